@@ -18,12 +18,10 @@
 #include <log_manager.h>
 #include <errno.h>
 
-/** Maximum byte size of an integer value */
-#define MAX_INTEGER_SIZE 10
-
 #define avro_decode(n) ((n >> 1) ^ -(n & 1))
-#define encode_long(n) ((n << 1) ^ (n >> 63))
-#define more_bytes(b) (b & 0x80)
+
+/** Number of unread bytes in the buffer of the file */
+#define buffer_left(f) ((size_t)((f)->buffer_end - (f)->buffer_ptr))
 
 /**
  * @brief Read an Avro integer
@@ -32,39 +30,53 @@
  * if more bytes belong to the integer value. The real value of the integer is
  * the concatenation of the lowest seven bits of each byte. This value is encoded
  * in a zigzag patten i.e. first value is -1, second 1, third -2 and so on.
- * @param file The source FILE handle
+ *
+ * The value is decoded from the buffer of the file. Most values fit into one
+ * byte and they are handled first.
+ * @param file The source file
  * @param dest Destination where the read value is written
- * @return True if value was read successfully
+ * @return True if value was read successfully, false if there was not enough
+ * data in the buffer or the value was too large
  */
 bool maxavro_read_integer(MAXAVRO_FILE* file, uint64_t *dest)
 {
-    uint64_t rval = 0;
-    uint8_t nread = 0;
-    uint8_t byte;
-    do
+    const uint8_t *ptr = file->buffer_ptr;
+    size_t left = buffer_left(file);
+    uint64_t rval;
+
+    if (left > 0 && !more_bytes(ptr[0]))
     {
-        if (nread >= MAX_INTEGER_SIZE)
-        {
-            file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
-            return false;
-        }
-        size_t rdsz = fread(&byte, sizeof(byte), 1, file->file);
-        if (rdsz != sizeof(byte))
+        rval = ptr[0];
+        file->buffer_ptr++;
+    }
+    else
+    {
+        size_t limit = left < MAX_INTEGER_SIZE ? left : MAX_INTEGER_SIZE;
+        size_t nread = 0;
+        uint8_t byte;
+        rval = 0;
+
+        do
         {
-            if (rdsz != 0)
-            {
-                MXS_ERROR("Failed to read %lu bytes from '%s'", sizeof(byte), file->filename);
-                file->last_error = MAXAVRO_ERR_IO;
-            }
-            else
+            if (nread == limit)
             {
-                MXS_DEBUG("Read 0 bytes from file '%s'", file->filename);
+                if (limit == MAX_INTEGER_SIZE)
+                {
+                    file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
+                }
+                else
+                {
+                    MXS_DEBUG("Not enough data for an integer in '%s'", file->filename);
+                }
+                return false;
             }
-            return false;
+            byte = ptr[nread];
+            rval |= (uint64_t)(byte & 0x7f) << (nread++ * 7);
         }
-        rval |= (uint64_t)(byte & 0x7f) << (nread++ * 7);
+        while (more_bytes(byte));
+
+        file->buffer_ptr += nread;
     }
-    while (more_bytes(byte));
 
     if (dest)
     {
@@ -73,26 +85,6 @@ bool maxavro_read_integer(MAXAVRO_FILE* file, uint64_t *dest)
     return true;
 }
 
-/**
- * @brief Calculate the length of an Avro integer
- *
- * @param val Vale to calculate
- * @return Length of the value in bytes
- */
-uint64_t avro_length_integer(uint64_t val)
-{
-    uint64_t encval = encode_long(val);
-    uint8_t nbytes = 0;
-
-    while (more_bytes(encval))
-    {
-        nbytes++;
-        encval >>= 7;
-    }
-
-    return nbytes;
-}
-
 /**
  * @brief Read an Avro string
  *
@@ -110,23 +102,15 @@ char* maxavro_read_string(MAXAVRO_FILE* file)
 
     if (maxavro_read_integer(file, &len))
     {
-        key = malloc(len + 1);
-        if (key)
+        if (len > buffer_left(file))
         {
-            size_t nread = fread(key, 1, len, file->file);
-            if (nread == len)
-            {
-                key[len] = '\0';
-            }
-            else
-            {
-                if (nread != 0)
-                {
-                    file->last_error = MAXAVRO_ERR_IO;
-                }
-                free(key);
-                key = NULL;
-            }
+            MXS_DEBUG("Not enough data for a string of %lu bytes in '%s'", len, file->filename);
+        }
+        else if ((key = malloc(len + 1)))
+        {
+            memcpy(key, file->buffer_ptr, len);
+            key[len] = '\0';
+            file->buffer_ptr += len;
         }
         else
         {
@@ -149,12 +133,13 @@ bool maxavro_skip_string(MAXAVRO_FILE* file)
 
     if (maxavro_read_integer(file, &len))
     {
-        if (fseek(file->file, len, SEEK_CUR) != 0)
+        if (len > buffer_left(file))
         {
             file->last_error = MAXAVRO_ERR_IO;
         }
         else
         {
+            file->buffer_ptr += len;
             return true;
         }
     }
@@ -162,18 +147,6 @@ bool maxavro_skip_string(MAXAVRO_FILE* file)
     return false;
 }
 
-/**
- * @brief Calculate the length of an Avro string
- * @param val Vale to calculate
- * @return Length of the string in bytes
- */
-uint64_t avro_length_string(const char* str)
-{
-    uint64_t slen = strlen(str);
-    uint64_t ilen = avro_length_integer(slen);
-    return slen + ilen;
-}
-
 /**
  * @brief Read an Avro float
  *
@@ -186,23 +159,13 @@ uint64_t avro_length_string(const char* str)
  */
 bool maxavro_read_float(MAXAVRO_FILE* file, float *dest)
 {
-    size_t nread = fread(dest, 1, sizeof(*dest), file->file);
-    if (nread != sizeof(*dest) && nread != 0)
+    if (buffer_left(file) < sizeof(*dest))
     {
-        file->last_error = MAXAVRO_ERR_IO;
         return false;
     }
-    return nread == sizeof(*dest);
-}
-
-/**
- * @brief Calculate the length of a float value
- * @param val Vale to calculate
- * @return Length of the value in bytes
- */
-uint64_t avro_length_float(float val)
-{
-    return sizeof(val);
+    memcpy(dest, file->buffer_ptr, sizeof(*dest));
+    file->buffer_ptr += sizeof(*dest);
+    return true;
 }
 
 /**
@@ -217,23 +180,13 @@ uint64_t avro_length_float(float val)
  */
 bool maxavro_read_double(MAXAVRO_FILE* file, double *dest)
 {
-    size_t nread = fread(dest, 1, sizeof(*dest), file->file);
-    if (nread != sizeof(*dest) && nread != 0)
+    if (buffer_left(file) < sizeof(*dest))
     {
-        file->last_error = MAXAVRO_ERR_IO;
         return false;
     }
-    return nread == sizeof(*dest);
-}
-
-/**
- * @brief Calculate the length of a double value
- * @param val Vale to calculate
- * @return Length of the value in bytes
- */
-uint64_t avro_length_double(double val)
-{
-    return sizeof(val);
+    memcpy(dest, file->buffer_ptr, sizeof(*dest));
+    file->buffer_ptr += sizeof(*dest);
+    return true;
 }
 
 /**
@@ -305,22 +258,3 @@ void maxavro_map_free(MAXAVRO_MAP *value)
     }
 }
 
-/**
- * @brief Calculate the length of an Avro map
- * @param map Map to measure
- * @return Length of the map in bytes
- */
-uint64_t avro_map_length(MAXAVRO_MAP* map)
-{
-    uint64_t len = avro_length_integer(map->blocks);
-
-    while (map)
-    {
-        len += avro_length_string(map->key);
-        len += avro_length_string(map->value);
-        map = map->next;
-    }
-
-    len += avro_length_integer(0);
-    return len;
-}
@@ -27,6 +27,13 @@
 /** The file magic */
 static const char avro_magic[] = {0x4f, 0x62, 0x6a, 0x01};
 
+/** Maximum byte size of an integer value */
+#define MAX_INTEGER_SIZE 10
+
+/** Zigzag encoding of a signed integer */
+#define encode_long(n) (((n) << 1) ^ (uint64_t)((int64_t)(n) >> 63))
+#define more_bytes(b) (b & 0x80)
+
 enum maxavro_value_type
 {
     MAXAVRO_TYPE_UNKNOWN = 0,
@@ -39,6 +46,7 @@ enum maxavro_value_type
     MAXAVRO_TYPE_BYTES,
     MAXAVRO_TYPE_ENUM,
     MAXAVRO_TYPE_NULL,
+    MAXAVRO_TYPE_UNION,
     MAXAVRO_TYPE_MAX
 };
 
@@ -55,6 +63,13 @@ typedef struct
     size_t num_fields;
 } MAXAVRO_SCHEMA;
 
+/** Compression codec of the data blocks */
+enum maxavro_codec
+{
+    MAXAVRO_CODEC_NULL,
+    MAXAVRO_CODEC_DEFLATE
+};
+
 enum maxavro_error
 {
     MAXAVRO_ERR_NONE,
@@ -76,16 +91,30 @@ typedef struct
     uint64_t bytes_read_from_block;
     uint64_t block_size; /*< Size of the block in bytes */
 
-    /** The position @c ftell returns before the first record is read  */
+    /** The file offset of the first data block */
     long header_end_pos;
-    long data_start_pos;
-    long block_start_pos;
+    long data_start_pos; /*< File offset of the data of the current block */
+    long block_start_pos; /*< File offset of the current block */
     bool metadata_read; /*< If datablock metadata has been read. This is kept
                          * in memory if EOF is reached but an attempt to read
                          * is made later when new data is available. We need
                          * to know when to read it and when not to.  */
     enum maxavro_error last_error; /*< Last error */
     uint8_t sync[SYNC_MARKER_SIZE];
+    enum maxavro_codec codec; /*< Compression codec of the data blocks */
+
+    /** The current data block and its sync marker. The values are decoded
+     * from memory instead of reading the file one value at a time. */
+    uint8_t *buffer;
+    uint8_t *buffer_ptr; /*< The next unread byte */
+    uint8_t *buffer_end; /*< End of the block data, the sync marker follows */
+    size_t buffer_size; /*< Allocated size of the buffer */
+
+    /** The decompressed data of the current block if the file uses a codec.
+     * The values are then decoded from here and @c buffer holds the
+     * compressed block. */
+    uint8_t *inflated;
+    size_t inflated_size; /*< Allocated size of the decompressed data */
 } MAXAVRO_FILE;
 
 /** A record field value */
@@ -106,14 +135,42 @@ typedef struct
     size_t size;
 } MAXAVRO_RECORD;
 
+/**
+ * An Avro file being written
+ *
+ * The records are encoded straight into the block buffer which is grown only
+ * when a record does not fit into it. The types of the fields are resolved
+ * into the field plan when the writer is opened so that encoding a record
+ * does not need to look at the schema.
+ */
+typedef struct
+{
+    int fd; /*< The file descriptor */
+    char *filename; /*< The filename */
+    MAXAVRO_SCHEMA *schema; /*< Schema of the records */
+    enum maxavro_codec codec; /*< Compression codec of the data blocks */
+    uint8_t sync[SYNC_MARKER_SIZE]; /*< The sync marker of the file */
+    enum maxavro_value_type *plan; /*< Field types in schema order */
+    size_t fixed_size; /*< Largest encoded size of a record without strings */
+    uint8_t *buffer; /*< The data of the current block */
+    size_t buffer_size; /*< Allocated size of the buffer */
+    size_t datasize; /*< Size of the encoded data in the buffer */
+    uint8_t *deflated; /*< Compressed data of the current block */
+    size_t deflated_size; /*< Allocated size of the compressed data */
+    size_t block_size; /*< Blocks are written once they reach this size */
+    uint64_t records; /*< Number of records in the current block */
+    uint64_t blocks_written; /*< Total number of blocks written */
+    uint64_t records_written; /*< Total number of records written */
+    enum maxavro_error last_error; /*< Last error */
+} MAXAVRO_WRITER;
+
+/** JSON text of records */
 typedef struct
 {
-    uint8_t *buffer; /*< Buffer memory */
-    size_t buffersize; /*< Size of the buffer */
-    size_t datasize; /*< size of written data */
-    uint64_t records; /*< Number of successfully written records */
-    MAXAVRO_FILE *avrofile; /*< The current open file */
-} MAXAVRO_DATABLOCK;
+    char *data; /*< The text, not null-terminated */
+    size_t len; /*< Length of the text */
+    size_t size; /*< Allocated size of the data */
+} MAXAVRO_TEXT;
 
 typedef struct avro_map_value
 {
@@ -124,18 +181,23 @@ typedef struct avro_map_value
     int blocks; /*< Number of added key-value blocks */
 } MAXAVRO_MAP;
 
-/** Data block generation */
-MAXAVRO_DATABLOCK* maxavro_datablock_allocate(MAXAVRO_FILE *file, size_t buffersize);
-void maxavro_datablock_free(MAXAVRO_DATABLOCK* block);
-bool maxavro_datablock_finalize(MAXAVRO_DATABLOCK* block);
-
-/** Adding values to a datablock. The caller must ensure that the inserted
- * values conform to the file schema and that the required amount of fields
- * is added before finalizing the block. */
-bool maxavro_datablock_add_integer(MAXAVRO_DATABLOCK *file, uint64_t val);
-bool maxavro_datablock_add_string(MAXAVRO_DATABLOCK *file, const char* str);
-bool maxavro_datablock_add_float(MAXAVRO_DATABLOCK *file, float val);
-bool maxavro_datablock_add_double(MAXAVRO_DATABLOCK *file, double val);
+/** Writing files. The values of a record are given in schema order. The
+ * @c lengths array holds the lengths of string and bytes values, if it is
+ * NULL the strings are expected to be null-terminated. The @c branches array
+ * holds the branch of each union field and the value of the field is that of
+ * the branch, if it is NULL the first branch is used. */
+MAXAVRO_WRITER* maxavro_writer_open(const char *filename, const char *json_schema,
+                                    enum maxavro_codec codec, size_t block_size);
+bool maxavro_writer_append(MAXAVRO_WRITER *writer, const MAXAVRO_RECORD_VALUE *values,
+                           const size_t *lengths, const int *branches);
+bool maxavro_writer_flush(MAXAVRO_WRITER *writer);
+bool maxavro_writer_close(MAXAVRO_WRITER *writer);
+
+/** Encoding values in-memory */
+uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val);
+uint64_t maxavro_encode_string(uint8_t* dest, const char* str, size_t len);
+uint64_t maxavro_encode_float(uint8_t* dest, float val);
+uint64_t maxavro_encode_double(uint8_t* dest, double val);
 
 /** Reading primitives */
 bool maxavro_read_integer(MAXAVRO_FILE *file, uint64_t *val);
@@ -150,10 +212,12 @@ void maxavro_map_free(MAXAVRO_MAP *value);
 
 /** Reading and seeking records */
 json_t* maxavro_record_read_json(MAXAVRO_FILE *file);
+bool maxavro_record_read_text(MAXAVRO_FILE *file, MAXAVRO_TEXT *text, uint64_t *integers);
 GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file);
 bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset);
 bool maxavro_record_set_pos(MAXAVRO_FILE *file, long pos);
 bool maxavro_next_block(MAXAVRO_FILE *file);
+long maxavro_skip_blocks(MAXAVRO_FILE *file, long max_bytes);
 
 /** File operations */
 MAXAVRO_FILE* maxavro_file_open(const char* filename);
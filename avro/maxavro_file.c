@@ -15,67 +15,241 @@
 #include <errno.h>
 #include <string.h>
 #include <log_manager.h>
+#include <unistd.h>
+#include <zlib.h>
 
 
-static bool maxavro_read_sync(FILE *file, uint8_t* sync)
+/** Maximum byte size of the record count and byte size of a data block */
+#define BLOCK_HEADER_SIZE 20
+
+/** The size of the first read of the file header */
+#define HEADER_READ_SIZE 4096
+
+/**
+ * @brief Make sure the buffer of the file can hold a number of bytes
+ *
+ * @param file File whose buffer is grown
+ * @param size Number of bytes needed
+ * @return True if the buffer is large enough
+ */
+static bool maxavro_reserve_buffer(MAXAVRO_FILE *file, size_t size)
 {
-    return fread(sync, 1, SYNC_MARKER_SIZE, file) == SYNC_MARKER_SIZE;
+    if (size > file->buffer_size)
+    {
+        uint8_t *buffer = realloc(file->buffer, size);
+
+        if (buffer == NULL)
+        {
+            MXS_ERROR("Failed to allocate %lu bytes for reading '%s'.", size, file->filename);
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        file->buffer = buffer;
+        file->buffer_size = size;
+    }
+
+    return true;
 }
 
+/**
+ * @brief Check the sync marker at the end of the current block
+ *
+ * The sync marker was read into the buffer after the data of the block.
+ *
+ * @param file File to check
+ * @return True if the block ends with the sync marker of the file
+ */
 bool maxavro_verify_block(MAXAVRO_FILE *file)
 {
-    char sync[SYNC_MARKER_SIZE];
-    int rc = fread(sync, 1, SYNC_MARKER_SIZE, file->file);
-    if (rc != SYNC_MARKER_SIZE)
+    if (memcmp(file->sync, file->buffer + file->block_size, SYNC_MARKER_SIZE))
     {
-        if (rc == -1)
+        MXS_ERROR("Sync marker mismatch at the end of the block at offset %ld in '%s'.",
+                  file->block_start_pos, file->filename);
+        return false;
+    }
+
+    /** Increment block count */
+    file->blocks_read++;
+    file->bytes_read += file->block_size;
+    return true;
+}
+
+/**
+ * @brief Decode the record count and the size of a data block
+ *
+ * @param file File the block is from
+ * @param header Start of the block
+ * @param len Number of bytes available at @c header
+ * @param records Where the record count is stored
+ * @param bytes Where the size of the block data is stored
+ * @return Number of bytes taken by the two values or 0 if they were not
+ * complete or could not be decoded
+ */
+static size_t decode_block_header(MAXAVRO_FILE *file, uint8_t *header, size_t len,
+                                  uint64_t *records, uint64_t *bytes)
+{
+    uint8_t *ptr = file->buffer_ptr;
+    uint8_t *end = file->buffer_end;
+    size_t rval = 0;
+
+    file->buffer_ptr = header;
+    file->buffer_end = header + len;
+
+    if (maxavro_read_integer(file, records) && maxavro_read_integer(file, bytes))
+    {
+        rval = file->buffer_ptr - header;
+    }
+
+    file->buffer_ptr = ptr;
+    file->buffer_end = end;
+    return rval;
+}
+
+/**
+ * @brief Decompress a deflate compressed data block
+ *
+ * The data is decompressed from the buffer of the file into the buffer for
+ * the decompressed data which is grown until the whole block fits into it.
+ *
+ * @param file File whose current block is decompressed
+ * @param bytes Size of the compressed data
+ * @return Size of the decompressed data or -1 on error
+ */
+static long inflate_block(MAXAVRO_FILE *file, uint64_t bytes)
+{
+    size_t size = file->inflated_size ? file->inflated_size : bytes * 4 + 64;
+
+    while (true)
+    {
+        if (size > file->inflated_size)
         {
-            MXS_ERROR("Failed to read file: %d %s", errno, strerror(errno));
+            uint8_t *inflated = realloc(file->inflated, size);
+
+            if (inflated == NULL)
+            {
+                MXS_ERROR("Failed to allocate %lu bytes for reading '%s'.", size, file->filename);
+                file->last_error = MAXAVRO_ERR_MEMORY;
+                return -1;
+            }
+
+            file->inflated = inflated;
+            file->inflated_size = size;
         }
-        else
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.next_in = file->buffer;
+        stream.avail_in = bytes;
+        stream.next_out = file->inflated;
+        stream.avail_out = file->inflated_size;
+
+        /** Avro uses raw deflate data without the zlib header */
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
         {
-            MXS_ERROR("Short read when reading sync marker. Read %d bytes instead of %d",
-                      rc, SYNC_MARKER_SIZE);
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return -1;
         }
-        return false;
-    }
 
-    if (memcmp(file->sync, sync, SYNC_MARKER_SIZE))
-    {
-        long pos = ftell(file->file);
-        long expected = file->data_start_pos + file->block_size + SYNC_MARKER_SIZE;
-        if (pos != expected)
+        int rc = inflate(&stream, Z_FINISH);
+        long len = stream.total_out;
+        inflateEnd(&stream);
+
+        if (rc == Z_STREAM_END)
         {
-            MXS_ERROR("Sync marker mismatch due to wrong file offset. file is at %ld "
-                      "when it should be at %ld.", pos, expected);
+            return len;
         }
-        else
+        else if (rc != Z_BUF_ERROR || stream.avail_out > 0)
         {
-            MXS_ERROR("Sync marker mismatch.");
+            MXS_ERROR("Failed to decompress the block at offset %ld in '%s'.",
+                      file->block_start_pos, file->filename);
+            file->last_error = MAXAVRO_ERR_IO;
+            return -1;
         }
-        return false;
-    }
 
-    /** Increment block count */
-    file->blocks_read++;
-    file->bytes_read += file->block_size;
-    return true;
+        size *= 2;
+    }
 }
 
+/**
+ * @brief Read the next data block into memory
+ *
+ * The record count and the size of the block are read first and then the
+ * data of the block and its sync marker with one read. If the whole block
+ * is not yet in the file, the file is left at the start of the block so that
+ * it can be read again once the rest of the block has been written.
+ *
+ * @param file File to read from
+ * @return True if a complete block was read
+ */
 bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
 {
     /** The actual start of the binary block */
     file->block_start_pos = ftell(file->file);
     file->metadata_read = false;
+
+    uint8_t header[BLOCK_HEADER_SIZE];
+    size_t header_len = fread(header, 1, sizeof(header), file->file);
     uint64_t records, bytes;
-    bool rval = maxavro_read_integer(file, &records) && maxavro_read_integer(file, &bytes);
+    size_t used = decode_block_header(file, header, header_len, &records, &bytes);
+    bool rval = used > 0;
+    file->buffer_ptr = file->buffer_end = file->buffer;
+
+    if (rval)
+    {
+        /** Part of the data was read with the record count and the size */
+        size_t block_len = bytes + SYNC_MARKER_SIZE;
+        size_t have = header_len - used;
+
+        if (!maxavro_reserve_buffer(file, block_len))
+        {
+            return false;
+        }
+
+        if (have >= block_len)
+        {
+            memcpy(file->buffer, header + used, block_len);
+            fseek(file->file, file->block_start_pos + used + block_len, SEEK_SET);
+        }
+        else
+        {
+            memcpy(file->buffer, header + used, have);
+
+            if (fread(file->buffer + have, 1, block_len - have, file->file) != block_len - have)
+            {
+                if (ferror(file->file))
+                {
+                    MXS_ERROR("Failed to read data block from '%s': %d, %s",
+                              file->filename, errno, strerror(errno));
+                    file->last_error = MAXAVRO_ERR_IO;
+                }
+                rval = false;
+            }
+        }
+    }
 
     if (rval)
     {
         file->block_size = bytes;
         file->records_in_block = records;
         file->records_read_from_block = 0;
-        file->data_start_pos = ftell(file->file);
+        file->data_start_pos = file->block_start_pos + used;
+        file->buffer_ptr = file->buffer;
+        file->buffer_end = file->buffer + bytes;
+
+        if (file->codec == MAXAVRO_CODEC_DEFLATE)
+        {
+            long len = inflate_block(file, bytes);
+
+            if (len < 0)
+            {
+                return false;
+            }
+
+            file->buffer_ptr = file->inflated;
+            file->buffer_end = file->inflated + len;
+        }
+
         ss_dassert(file->data_start_pos > file->block_start_pos);
         file->metadata_read = true;
     }
@@ -83,42 +257,161 @@ bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
     {
         MXS_ERROR("Failed to read data block start.");
     }
-    else if (feof(file->file))
+    else
     {
+        /** Not all of the block has been written, try again later */
         clearerr(file->file);
+        fseek(file->file, file->block_start_pos, SEEK_SET);
     }
     return rval;
 }
 
+/**
+ * @brief Skip data blocks without reading their data
+ *
+ * The current block and the complete blocks after it are skipped until at
+ * least @c max_bytes have been skipped. Only the start and the sync marker
+ * of the skipped blocks are read. The block after them is then read into
+ * memory like with maxavro_next_block().
+ *
+ * The skipped blocks start at the offset where the current block started.
+ *
+ * @param file File to skip in
+ * @param max_bytes Number of bytes after which no more blocks are skipped
+ * @return Number of bytes skipped
+ */
+long maxavro_skip_blocks(MAXAVRO_FILE *file, long max_bytes)
+{
+    if (file->last_error != MAXAVRO_ERR_NONE || !file->metadata_read ||
+        !maxavro_verify_block(file))
+    {
+        return 0;
+    }
+
+    int fd = fileno(file->file);
+    long start = file->block_start_pos;
+    long pos = file->data_start_pos + file->block_size + SYNC_MARKER_SIZE;
+    file->records_read += file->records_in_block - file->records_read_from_block;
+
+    while (pos - start < max_bytes)
+    {
+        uint8_t header[BLOCK_HEADER_SIZE];
+        uint8_t sync[SYNC_MARKER_SIZE];
+        uint64_t records, bytes;
+        ssize_t len = pread(fd, header, sizeof(header), pos);
+        size_t used = len > 0 ? decode_block_header(file, header, len, &records, &bytes) : 0;
+
+        /** A block that is not complete or is corrupted is read normally */
+        if (used == 0 ||
+            pread(fd, sync, SYNC_MARKER_SIZE, pos + used + bytes) != SYNC_MARKER_SIZE ||
+            memcmp(sync, file->sync, SYNC_MARKER_SIZE))
+        {
+            file->last_error = MAXAVRO_ERR_NONE;
+            break;
+        }
+
+        pos += used + bytes + SYNC_MARKER_SIZE;
+        file->blocks_read++;
+        file->bytes_read += bytes;
+        file->records_read += records;
+    }
+
+    file->records_read_from_block = file->records_in_block;
+    fseek(file->file, pos, SEEK_SET);
+    maxavro_read_datablock_start(file);
+    return pos - start;
+}
+
 /** The header metadata is encoded as an Avro map with @c bytes encoded
  * key-value pairs. A @c bytes value is written as a length encoded string
  * where the length of the value is stored as a @c long followed by the
- * actual data. */
+ * actual data. The codec of the data blocks is stored in the same map. */
 static char* read_schema(MAXAVRO_FILE* file)
 {
     char *rval = NULL;
+    bool codec_ok = true;
     MAXAVRO_MAP* head = maxavro_map_read(file);
     MAXAVRO_MAP* map = head;
 
+    file->codec = MAXAVRO_CODEC_NULL;
+
     while (map)
     {
         if (strcmp(map->key, "avro.schema") == 0)
         {
+            free(rval);
             rval = strdup(map->value);
-            break;
+        }
+        else if (strcmp(map->key, "avro.codec") == 0)
+        {
+            if (strcmp(map->value, "deflate") == 0)
+            {
+                file->codec = MAXAVRO_CODEC_DEFLATE;
+            }
+            else if (strcmp(map->value, "null") != 0)
+            {
+                MXS_ERROR("Unsupported codec '%s' in '%s'.", map->value, file->filename);
+                file->last_error = MAXAVRO_ERR_IO;
+                codec_ok = false;
+            }
         }
         map = map->next;
     }
 
-    if (rval == NULL)
+    maxavro_map_free(head);
+
+    if (!codec_ok)
     {
-        MXS_ERROR("No schema found from Avro header.");
+        free(rval);
+        rval = NULL;
     }
 
-    maxavro_map_free(head);
     return rval;
 }
 
+/**
+ * @brief Read the file header
+ *
+ * The header is read into the buffer of the file and decoded from there.
+ * The buffer is grown until the whole header fits into it. The file is left
+ * at the start of the first data block.
+ *
+ * @param file File to read from, positioned after the magic marker
+ * @return The schema of the file or NULL if an error occurred
+ */
+static char* read_header(MAXAVRO_FILE* file)
+{
+    for (size_t size = HEADER_READ_SIZE; maxavro_reserve_buffer(file, size); size *= 2)
+    {
+        fseek(file->file, AVRO_MAGIC_SIZE, SEEK_SET);
+        size_t len = fread(file->buffer, 1, size, file->file);
+        file->buffer_ptr = file->buffer;
+        file->buffer_end = file->buffer + len;
+
+        char *rval = read_schema(file);
+
+        if (rval && file->buffer_end - file->buffer_ptr >= SYNC_MARKER_SIZE)
+        {
+            memcpy(file->sync, file->buffer_ptr, SYNC_MARKER_SIZE);
+            file->buffer_ptr += SYNC_MARKER_SIZE;
+            file->header_end_pos = AVRO_MAGIC_SIZE + (file->buffer_ptr - file->buffer);
+            fseek(file->file, file->header_end_pos, SEEK_SET);
+            return rval;
+        }
+
+        free(rval);
+
+        if (len < size || file->last_error != MAXAVRO_ERR_NONE)
+        {
+            /** The whole file was read or the header is corrupted */
+            MXS_ERROR("No schema found from Avro header.");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Open an avro file
  *
@@ -159,20 +452,20 @@ MAXAVRO_FILE* maxavro_file_open(const char* filename)
     {
         avrofile->file = file;
         avrofile->filename = strdup(filename);
-        char *schema = read_schema(avrofile);
-        avrofile->schema = schema ? maxavro_schema_alloc(schema) : NULL;
         avrofile->last_error = MAXAVRO_ERR_NONE;
+        char *schema = read_header(avrofile);
+        avrofile->schema = schema ? maxavro_schema_alloc(schema) : NULL;
 
+        /** A file with only the header is opened and its first block is
+         * read once it has been written */
         if (!schema || !avrofile->schema ||
-            !maxavro_read_sync(file, avrofile->sync) ||
-            !maxavro_read_datablock_start(avrofile))
+            (!maxavro_read_datablock_start(avrofile) &&
+             maxavro_get_error(avrofile) != MAXAVRO_ERR_NONE))
         {
             MXS_ERROR("Failed to initialize avrofile.");
-            free(avrofile->schema);
-            free(avrofile);
+            maxavro_file_close(avrofile);
             avrofile = NULL;
         }
-        avrofile->header_end_pos = avrofile->block_start_pos;
         free(schema);
     }
     else
@@ -231,6 +524,8 @@ void maxavro_file_close(MAXAVRO_FILE *file)
     {
         fclose(file->file);
         free(file->filename);
+        free(file->buffer);
+        free(file->inflated);
         maxavro_schema_free(file->schema);
         free(file);
     }
@@ -17,11 +17,32 @@
 #include <skygw_debug.h>
 #include <log_manager.h>
 #include <errno.h>
+#include <math.h>
 
 bool maxavro_read_datablock_start(MAXAVRO_FILE *file);
 bool maxavro_verify_block(MAXAVRO_FILE *file);
 const char* type_to_string(enum maxavro_value_type type);
 
+/**
+ * @brief Read the branch index of a union value
+ *
+ * @param file File to read from
+ * @param field The union field
+ * @return The branch of the value or NULL if the index is not valid
+ */
+static MAXAVRO_SCHEMA_FIELD* read_union_branch(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *field)
+{
+    MAXAVRO_SCHEMA *branches = field->extra;
+    uint64_t index = 0;
+
+    if (maxavro_read_integer(file, &index) && index < branches->num_fields)
+    {
+        return &branches->fields[index];
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Read a single value from a file
  * @param file File to read from
@@ -37,9 +58,9 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
     {
         case MAXAVRO_TYPE_BOOL:
         {
-            int i = 0;
-            if (fread(&i, 1, 1, file->file) == 1)
+            if (file->buffer_ptr < file->buffer_end)
             {
+                int i = *file->buffer_ptr++;
                 value = json_pack("b", i);
             }
         }
@@ -94,6 +115,20 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
         }
         break;
 
+        case MAXAVRO_TYPE_NULL:
+            value = json_null();
+            break;
+
+        case MAXAVRO_TYPE_UNION:
+        {
+            MAXAVRO_SCHEMA_FIELD *branch = read_union_branch(file, field);
+            if (branch)
+            {
+                value = read_and_pack_value(file, branch);
+            }
+        }
+        break;
+
         default:
             MXS_ERROR("Unimplemented type: %d", field->type);
             break;
@@ -101,10 +136,32 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
     return value;
 }
 
-static void skip_value(MAXAVRO_FILE *file, enum maxavro_value_type type)
+static void skip_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *field)
 {
+    enum maxavro_value_type type = field->type;
+
     switch (type)
     {
+        case MAXAVRO_TYPE_BOOL:
+            if (file->buffer_ptr < file->buffer_end)
+            {
+                file->buffer_ptr++;
+            }
+            break;
+
+        case MAXAVRO_TYPE_NULL:
+            break;
+
+        case MAXAVRO_TYPE_UNION:
+        {
+            MAXAVRO_SCHEMA_FIELD *branch = read_union_branch(file, field);
+            if (branch)
+            {
+                skip_value(file, branch);
+            }
+        }
+        break;
+
         case MAXAVRO_TYPE_INT:
         case MAXAVRO_TYPE_LONG:
         case MAXAVRO_TYPE_ENUM:
@@ -166,7 +223,7 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
                 }
                 else
                 {
-                    long pos = ftell(file->file);
+                    long pos = file->data_start_pos + (file->buffer_ptr - file->buffer);
                     MXS_ERROR("Failed to read field value '%s', type '%s' at "
                               "file offset %ld, record numer %lu.",
                               file->schema->fields[i].name,
@@ -185,11 +242,345 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
     return object;
 }
 
+/**
+ * @brief Make room for more text
+ *
+ * @param file File being read
+ * @param text Text buffer
+ * @param len Number of bytes that will be appended
+ * @return True if there is room for @c len bytes
+ */
+static bool text_reserve(MAXAVRO_FILE *file, MAXAVRO_TEXT *text, size_t len)
+{
+    if (text->len + len > text->size)
+    {
+        size_t size = text->size ? text->size : 1024;
+
+        while (text->len + len > size)
+        {
+            size *= 2;
+        }
+
+        char *data = realloc(text->data, size);
+
+        if (data == NULL)
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        text->data = data;
+        text->size = size;
+    }
+
+    return true;
+}
+
+static bool text_append(MAXAVRO_FILE *file, MAXAVRO_TEXT *text, const char *str, size_t len)
+{
+    if (!text_reserve(file, text, len))
+    {
+        return false;
+    }
+
+    memcpy(text->data + text->len, str, len);
+    text->len += len;
+    return true;
+}
+
+/**
+ * @brief Append a quoted JSON string
+ *
+ * The characters are escaped like jansson does it by default.
+ *
+ * @param file File being read
+ * @param text Text buffer
+ * @param str The string, not null-terminated
+ * @param len Length of the string
+ * @return True if the string was appended
+ */
+static bool text_append_string(MAXAVRO_FILE *file, MAXAVRO_TEXT *text, const uint8_t *str, size_t len)
+{
+    /** In the worst case every character is escaped as \u00XX */
+    if (!text_reserve(file, text, len * 6 + 2))
+    {
+        return false;
+    }
+
+    char *ptr = text->data + text->len;
+    *ptr++ = '"';
+
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t c = str[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            *ptr++ = c;
+            continue;
+        }
+
+        *ptr++ = '\\';
+
+        switch (c)
+        {
+            case '"':
+            case '\\':
+                *ptr++ = c;
+                break;
+
+            case '\b':
+                *ptr++ = 'b';
+                break;
+
+            case '\f':
+                *ptr++ = 'f';
+                break;
+
+            case '\n':
+                *ptr++ = 'n';
+                break;
+
+            case '\r':
+                *ptr++ = 'r';
+                break;
+
+            case '\t':
+                *ptr++ = 't';
+                break;
+
+            default:
+                ptr += sprintf(ptr, "u%04x", c);
+                break;
+        }
+    }
+
+    *ptr++ = '"';
+    text->len = ptr - text->data;
+    return true;
+}
+
+/**
+ * @brief Append a double in the format jansson uses
+ *
+ * @param file File being read
+ * @param text Text buffer
+ * @param d The value
+ * @return True if the value was appended, false for values JSON cannot represent
+ */
+static bool text_append_double(MAXAVRO_FILE *file, MAXAVRO_TEXT *text, double d)
+{
+    char buf[64];
+
+    if (isnan(d) || isinf(d))
+    {
+        return false;
+    }
+
+    int len = snprintf(buf, sizeof(buf) - 2, "%.17g", d);
+
+    if (strspn(buf, "0123456789-") == len)
+    {
+        strcpy(buf + len, ".0");
+        len += 2;
+    }
+
+    char *exp = strchr(buf, 'e');
+
+    if (exp)
+    {
+        /** Remove the plus sign and the leading zeros of the exponent */
+        char *start = exp + 1;
+
+        if (*start == '-')
+        {
+            start++;
+        }
+
+        char *end = start;
+
+        while (*end == '+' || *end == '0')
+        {
+            end++;
+        }
+
+        memmove(start, end, strlen(end) + 1);
+        len = strlen(buf);
+    }
+
+    return text_append(file, text, buf, len);
+}
+
+/**
+ * @brief Read a single value and write it as JSON text
+ *
+ * @param file File to read from
+ * @param field The field of the value
+ * @param text Text buffer
+ * @param integer Where the value of an integer field is stored
+ * @return True if the value was read and written
+ */
+static bool read_and_write_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *field,
+                                 MAXAVRO_TEXT *text, uint64_t *integer)
+{
+    char buf[32];
+
+    switch (field->type)
+    {
+        case MAXAVRO_TYPE_BOOL:
+            if (file->buffer_ptr < file->buffer_end)
+            {
+                return *file->buffer_ptr++ ? text_append(file, text, "true", 4) :
+                       text_append(file, text, "false", 5);
+            }
+            break;
+
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+            if (maxavro_read_integer(file, integer))
+            {
+                int len = snprintf(buf, sizeof(buf), "%lld", (long long)*integer);
+                return text_append(file, text, buf, len);
+            }
+            break;
+
+        case MAXAVRO_TYPE_ENUM:
+        {
+            json_t *arr = field->extra;
+            ss_dassert(arr);
+            ss_dassert(json_is_array(arr));
+
+            if (maxavro_read_integer(file, integer) && *integer < json_array_size(arr))
+            {
+                const char *symbol = json_string_value(json_array_get(arr, *integer));
+
+                if (symbol)
+                {
+                    return text_append_string(file, text, (const uint8_t*)symbol, strlen(symbol));
+                }
+            }
+        }
+        break;
+
+        case MAXAVRO_TYPE_FLOAT:
+        case MAXAVRO_TYPE_DOUBLE:
+        {
+            double d = 0;
+            return maxavro_read_double(file, &d) && text_append_double(file, text, d);
+        }
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+        {
+            uint64_t len;
+
+            if (maxavro_read_integer(file, &len) &&
+                len <= (uint64_t)(file->buffer_end - file->buffer_ptr))
+            {
+                const uint8_t *str = file->buffer_ptr;
+                file->buffer_ptr += len;
+                return text_append_string(file, text, str, len);
+            }
+        }
+        break;
+
+        case MAXAVRO_TYPE_NULL:
+            return text_append(file, text, "null", 4);
+
+        case MAXAVRO_TYPE_UNION:
+        {
+            MAXAVRO_SCHEMA_FIELD *branch = read_union_branch(file, field);
+            return branch && read_and_write_value(file, branch, text, integer);
+        }
+
+        default:
+            MXS_ERROR("Unimplemented type: %d", field->type);
+            break;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Read a record as JSON text
+ *
+ * The text is the same that json_dumps() with JSON_PRESERVE_ORDER produces
+ * for the value returned by maxavro_record_read_json(). It is written
+ * straight from the data block without building the JSON objects.
+ *
+ * @param file File to read from
+ * @param text Buffer where the record is appended. The caller must free the
+ * data of the buffer.
+ * @param integers If not NULL, the values of the integer and enum fields are
+ * stored here at the indexes of the fields in the schema
+ * @return True if a record was read, false if there are no more records in
+ * the current block or an error occurred
+ */
+bool maxavro_record_read_text(MAXAVRO_FILE *file, MAXAVRO_TEXT *text, uint64_t *integers)
+{
+    if (!file->metadata_read && !maxavro_read_datablock_start(file))
+    {
+        return false;
+    }
+
+    if (file->records_read_from_block >= file->records_in_block)
+    {
+        return false;
+    }
+
+    size_t start = text->len;
+
+    if (!text_append(file, text, "{", 1))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < file->schema->num_fields; i++)
+    {
+        MAXAVRO_SCHEMA_FIELD *field = &file->schema->fields[i];
+        uint64_t integer = 0;
+
+        if ((i > 0 && !text_append(file, text, ", ", 2)) ||
+            !text_append_string(file, text, (const uint8_t*)field->name, strlen(field->name)) ||
+            !text_append(file, text, ": ", 2))
+        {
+            text->len = start;
+            return false;
+        }
+
+        if (!read_and_write_value(file, field, text, &integer))
+        {
+            long pos = file->data_start_pos + (file->buffer_ptr - file->buffer);
+            MXS_ERROR("Failed to read field value '%s', type '%s' at "
+                      "file offset %ld, record numer %lu.",
+                      field->name, type_to_string(field->type),
+                      pos, file->records_read);
+            text->len = start;
+            return false;
+        }
+
+        if (integers)
+        {
+            integers[i] = integer;
+        }
+    }
+
+    if (!text_append(file, text, "}", 1))
+    {
+        text->len = start;
+        return false;
+    }
+
+    file->records_read_from_block++;
+    file->records_read++;
+    return true;
+}
+
 static void skip_record(MAXAVRO_FILE *file)
 {
     for (size_t i = 0; i < file->schema->num_fields; i++)
     {
-        skip_value(file, file->schema->fields[i].type);
+        skip_value(file, &file->schema->fields[i]);
     }
     file->records_read_from_block++;
     file->records_read++;
@@ -198,7 +589,8 @@ static void skip_record(MAXAVRO_FILE *file)
 /**
  * @brief Read next data block
  *
- * This seeks past any unread data from the current block
+ * This skips any unread data from the current block. If the previous attempt
+ * to read the next block found only a part of it, it is read again.
  * @param file File to read from
  * @return True if reading the next block was successfully read
  */
@@ -206,18 +598,17 @@ bool maxavro_next_block(MAXAVRO_FILE *file)
 {
     if (file->last_error == MAXAVRO_ERR_NONE)
     {
+        if (!file->metadata_read)
+        {
+            return maxavro_read_datablock_start(file);
+        }
+
         if (file->records_read_from_block < file->records_in_block)
         {
             file->records_read += file->records_in_block - file->records_read_from_block;
-            long curr_pos = ftell(file->file);
-            long offset = (long) file->block_size - (curr_pos - file->data_start_pos);
-
-            if (offset > 0)
-            {
-                fseek(file->file, offset, SEEK_CUR);
-            }
         }
 
+        /** The whole block is in memory and the file is at the next block */
         return maxavro_verify_block(file) && maxavro_read_datablock_start(file);
     }
     return false;
@@ -254,7 +645,6 @@ bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset)
         {
             /** Skip full blocks that don't have the position we want */
             offset -= file->records_in_block;
-            fseek(file->file, file->block_size, SEEK_CUR);
             maxavro_next_block(file);
         }
 
@@ -282,8 +672,18 @@ bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset)
  */
 bool maxavro_record_set_pos(MAXAVRO_FILE *file, long pos)
 {
-    fseek(file->file, pos - SYNC_MARKER_SIZE, SEEK_SET);
-    return maxavro_verify_block(file) && maxavro_read_datablock_start(file);
+    uint8_t sync[SYNC_MARKER_SIZE];
+
+    if (fseek(file->file, pos - SYNC_MARKER_SIZE, SEEK_SET) != 0 ||
+        fread(sync, 1, SYNC_MARKER_SIZE, file->file) != SYNC_MARKER_SIZE ||
+        memcmp(sync, file->sync, SYNC_MARKER_SIZE))
+    {
+        MXS_ERROR("No sync marker before offset %ld in '%s'.", pos, file->filename);
+        clearerr(file->file);
+        return false;
+    }
+
+    return maxavro_read_datablock_start(file);
 }
 
 /**
@@ -307,17 +707,24 @@ GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file)
             return NULL;
         }
 
-        long data_size = (file->data_start_pos - file->block_start_pos) + file->block_size;
+        long header_size = file->data_start_pos - file->block_start_pos;
+        long data_size = header_size + file->block_size;
         ss_dassert(data_size > 0);
         rval = gwbuf_alloc(data_size + SYNC_MARKER_SIZE);
 
         if (rval)
         {
+            /** The data of the block is in memory, only the record count and
+             * the size of the block are read again */
+            long next_pos = ftell(file->file);
             fseek(file->file, file->block_start_pos, SEEK_SET);
 
-            if (fread(GWBUF_DATA(rval), 1, data_size, file->file) == data_size)
+            if (fread(GWBUF_DATA(rval), 1, header_size, file->file) == header_size &&
+                fseek(file->file, next_pos, SEEK_SET) == 0)
             {
-                memcpy(((uint8_t*) GWBUF_DATA(rval)) + data_size, file->sync, sizeof(file->sync));
+                uint8_t *data = (uint8_t*) GWBUF_DATA(rval);
+                memcpy(data + header_size, file->buffer, file->block_size);
+                memcpy(data + data_size, file->sync, sizeof(file->sync));
                 maxavro_next_block(file);
             }
             else
@@ -325,7 +732,7 @@ GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file)
                 if (ferror(file->file))
                 {
                     char err[STRERROR_BUFLEN];
-                    MXS_ERROR("Failed to read %ld bytes: %d, %s", data_size, errno,
+                    MXS_ERROR("Failed to read %ld bytes: %d, %s", header_size, errno,
                               strerror_r(errno, err, sizeof(err)));
                     file->last_error = MAXAVRO_ERR_IO;
                 }
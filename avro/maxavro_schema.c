@@ -56,6 +56,11 @@ enum maxavro_value_type string_to_type(const char *str)
  */
 const char* type_to_string(enum maxavro_value_type type)
 {
+    if (type == MAXAVRO_TYPE_UNION)
+    {
+        return "union";
+    }
+
     for (int i = 0; types[i].name; i++)
     {
         if (types[i].type == type)
@@ -66,6 +71,50 @@ const char* type_to_string(enum maxavro_value_type type)
     return "unknown type";
 }
 
+static enum maxavro_value_type unpack_to_type(json_t *object,
+                                              MAXAVRO_SCHEMA_FIELD* field);
+
+/**
+ * @brief Extract the branches of a union
+ *
+ * The branches are stored in the @c extra member of the field as a schema
+ * whose fields are the branches in the order they are declared in.
+ *
+ * @param object JSON array of the branch types
+ * @param field The associated field
+ * @return MAXAVRO_TYPE_UNION or MAXAVRO_TYPE_UNKNOWN if a branch is not supported
+ */
+static enum maxavro_value_type unpack_union(json_t *object, MAXAVRO_SCHEMA_FIELD* field)
+{
+    size_t n_branches = json_array_size(object);
+    MAXAVRO_SCHEMA *branches = malloc(sizeof(MAXAVRO_SCHEMA));
+
+    if (branches == NULL ||
+        (branches->fields = calloc(n_branches, sizeof(MAXAVRO_SCHEMA_FIELD))) == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        free(branches);
+        return MAXAVRO_TYPE_UNKNOWN;
+    }
+
+    branches->num_fields = n_branches;
+    field->extra = branches;
+
+    for (size_t i = 0; i < n_branches; i++)
+    {
+        MAXAVRO_SCHEMA_FIELD *branch = &branches->fields[i];
+        branch->type = unpack_to_type(json_array_get(object, i), branch);
+
+        /** Unions can't directly contain other unions */
+        if (branch->type == MAXAVRO_TYPE_UNKNOWN || branch->type == MAXAVRO_TYPE_UNION)
+        {
+            return MAXAVRO_TYPE_UNKNOWN;
+        }
+    }
+
+    return MAXAVRO_TYPE_UNION;
+}
+
 /**
  * @brief extract the type definition from a JSON schema
  * @param object JSON object containing the schema
@@ -87,8 +136,12 @@ static enum maxavro_value_type unpack_to_type(json_t *object,
 
     if (json_is_array(object))
     {
-        json_t *tmp = json_array_get(object, 0);
-        type = tmp;
+        return unpack_union(object, field);
+    }
+
+    if (json_is_string(object))
+    {
+        type = object;
     }
 
     if (type && json_is_string(type))
@@ -139,6 +192,7 @@ MAXAVRO_SCHEMA* maxavro_schema_alloc(const char* json)
 
                 json_unpack(object, "{s:s s:o}", "name", &key, "type", &value_obj);
                 rval->fields[i].name = strdup(key);
+                rval->fields[i].extra = NULL;
                 rval->fields[i].type = unpack_to_type(value_obj, &rval->fields[i]);
             }
 
@@ -165,6 +219,11 @@ static void maxavro_schema_field_free(MAXAVRO_SCHEMA_FIELD *field)
         {
             json_decref((json_t*)field->extra);
         }
+        else if (field->type == MAXAVRO_TYPE_UNION || field->type == MAXAVRO_TYPE_UNKNOWN)
+        {
+            /** An unsupported union is left with the branches it had */
+            maxavro_schema_free((MAXAVRO_SCHEMA*)field->extra);
+        }
     }
 }
 
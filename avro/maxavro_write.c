@@ -17,13 +17,28 @@
 #include "maxavro.h"
 #include <log_manager.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
 
 /**
- * @file maxavro_write.c - Avro value writing
+ * @file maxavro_write.c - Avro file writing
  *
- * Currently these functions aren't in use
+ * The records are encoded into an in-memory data block. Before a record is
+ * encoded, the largest possible size of it is reserved from the block buffer
+ * so that the values themselves are stored without any further checks. Once
+ * the block is large enough it is compressed and written to the file with
+ * one system call that also writes the block header and the sync marker.
  */
 
+/** Maximum byte size of the record count and byte size of a data block */
+#define BLOCK_HEADER_SIZE (MAX_INTEGER_SIZE * 2)
+
+/** Default size of a data block */
+#define DEFAULT_BLOCK_SIZE (64 * 1024)
+
 /**
  * @brief Encode an integer value in Avro format
  * @param buffer Buffer where the encoded value is stored
@@ -35,7 +50,7 @@ uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val)
     uint64_t encval = encode_long(val);
     uint8_t nbytes = 0;
 
-    while (more_bytes(encval))
+    while (encval > 0x7f)
     {
         buffer[nbytes++] = 0x80 | (0x7f & encval);
         encval >>= 7;
@@ -45,33 +60,19 @@ uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val)
     return nbytes;
 }
 
-bool maxavro_write_integer(FILE *file, uint64_t val)
-{
-    uint8_t buffer[MAX_INTEGER_SIZE];
-    uint8_t nbytes = maxavro_encode_integer(buffer, val);
-    return fwrite(buffer, 1, nbytes, file) == nbytes;
-}
-
-
 /**
  * @brief Encode a string in Avro format
  *
  * @param dest Destination buffer where the string is stored
- * @param str Null-terminated string to store
+ * @param str String to store
+ * @param len Length of the string
  * @return number of bytes stored
  */
-uint64_t maxavro_encode_string(uint8_t* dest, const char* str)
-{
-    uint64_t slen = strlen(str);
-    uint64_t ilen = maxavro_encode_integer(dest, slen);
-    memcpy(dest, str, slen);
-    return slen + ilen;
-}
-
-bool maxavro_write_string(FILE *file, const char* str)
+uint64_t maxavro_encode_string(uint8_t* dest, const char* str, size_t len)
 {
-    uint64_t len = strlen(str);
-    return maxavro_write_integer(file, len) && fwrite(str, 1, len, file) == len;
+    uint64_t ilen = maxavro_encode_integer(dest, len);
+    memcpy(dest + ilen, str, len);
+    return len + ilen;
 }
 
 /**
@@ -86,11 +87,6 @@ uint64_t maxavro_encode_float(uint8_t* dest, float val)
     return sizeof(val);
 }
 
-bool maxavro_write_float(FILE *file, float val)
-{
-    return fwrite(&val, 1, sizeof(val), file) == sizeof(val);
-}
-
 /**
  * @brief Encode a double value in Avro format
  * @param buffer Buffer where the encoded value is stored
@@ -103,28 +99,588 @@ uint64_t maxavro_encode_double(uint8_t* dest, double val)
     return sizeof(val);
 }
 
-bool maxavro_write_double(FILE *file, double val)
+/**
+ * @brief Largest encoded size of a field, not counting the string data
+ *
+ * @param type Type of the field
+ * @return Size in bytes
+ */
+static size_t field_fixed_size(enum maxavro_value_type type)
 {
-    return fwrite(&val, 1, sizeof(val), file) == sizeof(val);
+    switch (type)
+    {
+        case MAXAVRO_TYPE_FLOAT:
+            return sizeof(float);
+
+        case MAXAVRO_TYPE_DOUBLE:
+            return sizeof(double);
+
+        case MAXAVRO_TYPE_BOOL:
+            return 1;
+
+        case MAXAVRO_TYPE_NULL:
+            return 0;
+
+        default:
+            return MAX_INTEGER_SIZE;
+    }
 }
 
-MAXAVRO_MAP* avro_map_start()
+/**
+ * @brief Largest encoded size of a union, not counting the string data
+ *
+ * @param field The union field
+ * @return Size in bytes of the branch index and the largest branch value
+ */
+static size_t union_fixed_size(MAXAVRO_SCHEMA_FIELD *field)
 {
-    return (MAXAVRO_MAP*)calloc(1, sizeof(MAXAVRO_MAP));
+    MAXAVRO_SCHEMA *branches = field->extra;
+    size_t size = 0;
+
+    for (size_t i = 0; i < branches->num_fields; i++)
+    {
+        size_t branch_size = field_fixed_size(branches->fields[i].type);
+
+        if (branch_size > size)
+        {
+            size = branch_size;
+        }
+    }
+
+    return MAX_INTEGER_SIZE + size;
+}
+
+/**
+ * @brief Create the field plan of the writer from its schema
+ *
+ * @param writer Writer whose schema is used
+ * @return True if all field types are supported
+ */
+static bool create_plan(MAXAVRO_WRITER *writer)
+{
+    MAXAVRO_SCHEMA *schema = writer->schema;
+
+    if ((writer->plan = malloc(sizeof(*writer->plan) * (schema->num_fields + 1))) == NULL)
+    {
+        return false;
+    }
+
+    writer->fixed_size = 0;
+
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        if (schema->fields[i].type == MAXAVRO_TYPE_UNKNOWN)
+        {
+            MXS_ERROR("Unsupported type for field '%s' in '%s'.",
+                      schema->fields[i].name, writer->filename);
+            return false;
+        }
+
+        writer->plan[i] = schema->fields[i].type;
+        writer->fixed_size += schema->fields[i].type == MAXAVRO_TYPE_UNION ?
+                              union_fixed_size(&schema->fields[i]) :
+                              field_fixed_size(schema->fields[i].type);
+    }
+
+    writer->plan[schema->num_fields] = MAXAVRO_TYPE_UNKNOWN;
+    return true;
+}
+
+/**
+ * @brief Make sure the block buffer can hold a number of bytes more
+ *
+ * @param writer Writer whose buffer is grown
+ * @param size Number of bytes needed after the current data
+ * @return True if the buffer is large enough
+ */
+static bool reserve_block(MAXAVRO_WRITER *writer, size_t size)
+{
+    size_t needed = writer->datasize + size;
+
+    if (needed > writer->buffer_size)
+    {
+        size_t newsize = writer->buffer_size ? writer->buffer_size : writer->block_size;
+
+        while (newsize < needed)
+        {
+            newsize *= 2;
+        }
+
+        uint8_t *buffer = realloc(writer->buffer, newsize);
+
+        if (buffer == NULL)
+        {
+            writer->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        writer->buffer = buffer;
+        writer->buffer_size = newsize;
+    }
+
+    return true;
 }
 
-uint64_t avro_map_encode(uint8_t *dest, MAXAVRO_MAP* map)
+/**
+ * @brief Compress the current block with raw deflate
+ *
+ * @param writer Writer whose block is compressed
+ * @return Size of the compressed data or -1 on error
+ */
+static long deflate_block(MAXAVRO_WRITER *writer)
 {
-    uint64_t len = maxavro_encode_integer(dest, map->blocks);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    /** Avro uses raw deflate data without the zlib header */
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        writer->last_error = MAXAVRO_ERR_MEMORY;
+        return -1;
+    }
+
+    size_t bound = deflateBound(&stream, writer->datasize);
+
+    if (bound > writer->deflated_size)
+    {
+        uint8_t *deflated = realloc(writer->deflated, bound);
+
+        if (deflated == NULL)
+        {
+            deflateEnd(&stream);
+            writer->last_error = MAXAVRO_ERR_MEMORY;
+            return -1;
+        }
+
+        writer->deflated = deflated;
+        writer->deflated_size = bound;
+    }
+
+    stream.next_in = writer->buffer;
+    stream.avail_in = writer->datasize;
+    stream.next_out = writer->deflated;
+    stream.avail_out = writer->deflated_size;
 
-    while (map)
+    int rc = deflate(&stream, Z_FINISH);
+    long len = stream.total_out;
+    deflateEnd(&stream);
+
+    if (rc != Z_STREAM_END)
     {
-        len += maxavro_encode_string(dest, map->key);
-        len += maxavro_encode_string(dest, map->value);
-        map = map->next;
+        MXS_ERROR("Failed to compress a block of %lu bytes for '%s'.",
+                  writer->datasize, writer->filename);
+        writer->last_error = MAXAVRO_ERR_IO;
+        return -1;
     }
 
-    /** Maps end with an empty block i.e. a zero integer value */
-    len += maxavro_encode_integer(dest, 0);
     return len;
 }
+
+/**
+ * @brief Write the contents of an I/O vector to the file
+ *
+ * If the write fails, the file is truncated to its original size so that no
+ * partial blocks are left in it.
+ *
+ * @param writer Writer to use
+ * @param iov The data
+ * @param n_iov Number of elements in @c iov
+ * @return True if all of the data was written
+ */
+static bool write_vector(MAXAVRO_WRITER *writer, struct iovec *iov, int n_iov)
+{
+    off_t pos = lseek(writer->fd, 0, SEEK_END);
+    ssize_t total = 0;
+
+    for (int i = 0; i < n_iov; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    ssize_t rc = writev(writer->fd, iov, n_iov);
+
+    if (rc != total)
+    {
+        MXS_ERROR("Failed to write %ld bytes to '%s': %d, %s", total,
+                  writer->filename, errno, strerror(errno));
+
+        if (pos >= 0 && ftruncate(writer->fd, pos) != 0)
+        {
+            MXS_ERROR("Failed to truncate '%s' after a failed write: %d, %s",
+                      writer->filename, errno, strerror(errno));
+        }
+
+        writer->last_error = MAXAVRO_ERR_IO;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Create a random sync marker
+ *
+ * @param writer Writer of a new file
+ * @return True if the marker was created
+ */
+static bool create_sync_marker(MAXAVRO_WRITER *writer)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, writer->sync, SYNC_MARKER_SIZE) != SYNC_MARKER_SIZE)
+    {
+        MXS_ERROR("Failed to read a sync marker for '%s' from /dev/urandom: %d, %s",
+                  writer->filename, errno, strerror(errno));
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+/**
+ * @brief Write the file header
+ *
+ * The header is the magic marker, the metadata map with the schema and the
+ * codec and the sync marker of the file.
+ *
+ * @param writer Writer of a new, empty file
+ * @param json_schema The schema in JSON
+ * @return True if the header was written
+ */
+static bool write_header(MAXAVRO_WRITER *writer, const char *json_schema)
+{
+    const char *codec = writer->codec == MAXAVRO_CODEC_DEFLATE ? "deflate" : "null";
+    size_t schema_len = strlen(json_schema);
+    size_t size = AVRO_MAGIC_SIZE + MAX_INTEGER_SIZE * 6 + schema_len + 64;
+
+    if (!reserve_block(writer, size))
+    {
+        return false;
+    }
+
+    uint8_t *ptr = writer->buffer;
+    memcpy(ptr, avro_magic, AVRO_MAGIC_SIZE);
+    ptr += AVRO_MAGIC_SIZE;
+
+    /** One map block with two key-value pairs followed by an empty block */
+    ptr += maxavro_encode_integer(ptr, 2);
+    ptr += maxavro_encode_string(ptr, "avro.schema", strlen("avro.schema"));
+    ptr += maxavro_encode_string(ptr, json_schema, schema_len);
+    ptr += maxavro_encode_string(ptr, "avro.codec", strlen("avro.codec"));
+    ptr += maxavro_encode_string(ptr, codec, strlen(codec));
+    ptr += maxavro_encode_integer(ptr, 0);
+
+    struct iovec iov[2];
+    iov[0].iov_base = writer->buffer;
+    iov[0].iov_len = ptr - writer->buffer;
+    iov[1].iov_base = writer->sync;
+    iov[1].iov_len = SYNC_MARKER_SIZE;
+
+    return write_vector(writer, iov, 2);
+}
+
+/**
+ * @brief Free a writer without flushing it
+ *
+ * @param writer Writer to free
+ */
+static void writer_free(MAXAVRO_WRITER *writer)
+{
+    if (writer)
+    {
+        if (writer->fd >= 0)
+        {
+            close(writer->fd);
+        }
+        maxavro_schema_free(writer->schema);
+        free(writer->filename);
+        free(writer->plan);
+        free(writer->buffer);
+        free(writer->deflated);
+        free(writer);
+    }
+}
+
+/**
+ * @brief Open an Avro file for writing
+ *
+ * If the file exists and has a header, the records are appended to it and
+ * the schema and the codec of the file are used instead of the given ones.
+ * Otherwise the file is created with the given schema and codec.
+ *
+ * @param filename File to open
+ * @param json_schema Schema of the records in JSON
+ * @param codec Compression codec of the data blocks of a new file
+ * @param block_size Size of the data blocks, 0 for the default size
+ * @return The writer or NULL if an error occurred
+ */
+MAXAVRO_WRITER* maxavro_writer_open(const char *filename, const char *json_schema,
+                                    enum maxavro_codec codec, size_t block_size)
+{
+    MAXAVRO_WRITER *writer = calloc(1, sizeof(MAXAVRO_WRITER));
+
+    if (writer == NULL || (writer->filename = strdup(filename)) == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        free(writer);
+        return NULL;
+    }
+
+    writer->fd = -1;
+    writer->codec = codec;
+    writer->block_size = block_size ? block_size : DEFAULT_BLOCK_SIZE;
+    writer->last_error = MAXAVRO_ERR_NONE;
+
+    struct stat st;
+    bool exists = stat(filename, &st) == 0 && st.st_size > 0;
+
+    if (exists)
+    {
+        MAXAVRO_FILE *file = maxavro_file_open(filename);
+
+        if (file == NULL)
+        {
+            writer_free(writer);
+            return NULL;
+        }
+
+        /** Take the schema, the codec and the sync marker from the file */
+        writer->schema = file->schema;
+        writer->codec = file->codec;
+        memcpy(writer->sync, file->sync, SYNC_MARKER_SIZE);
+        file->schema = NULL;
+        maxavro_file_close(file);
+    }
+    else
+    {
+        writer->schema = maxavro_schema_alloc(json_schema);
+
+        if (!create_sync_marker(writer))
+        {
+            writer_free(writer);
+            return NULL;
+        }
+    }
+
+    if (writer->schema == NULL || !create_plan(writer))
+    {
+        writer_free(writer);
+        return NULL;
+    }
+
+    if ((writer->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0660)) < 0)
+    {
+        MXS_ERROR("Failed to open file '%s': %d, %s", filename, errno, strerror(errno));
+        writer_free(writer);
+        return NULL;
+    }
+
+    if (!exists && !write_header(writer, json_schema))
+    {
+        writer_free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+/**
+ * @brief Encode one value
+ *
+ * @param ptr Where the value is stored, there must be room for it
+ * @param type Type of the value
+ * @param value The value
+ * @param len Length of a string or bytes value
+ * @return Pointer to the byte after the encoded value
+ */
+static uint8_t* encode_value(uint8_t *ptr, enum maxavro_value_type type,
+                             const MAXAVRO_RECORD_VALUE *value, size_t len)
+{
+    switch (type)
+    {
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+        case MAXAVRO_TYPE_ENUM:
+            ptr += maxavro_encode_integer(ptr, value->integer);
+            break;
+
+        case MAXAVRO_TYPE_FLOAT:
+            ptr += maxavro_encode_float(ptr, value->floating);
+            break;
+
+        case MAXAVRO_TYPE_DOUBLE:
+            ptr += maxavro_encode_double(ptr, value->floating);
+            break;
+
+        case MAXAVRO_TYPE_BOOL:
+            *ptr++ = value->boolean ? 1 : 0;
+            break;
+
+        case MAXAVRO_TYPE_STRING:
+            ptr += maxavro_encode_string(ptr, value->string, len);
+            break;
+
+        case MAXAVRO_TYPE_BYTES:
+            ptr += maxavro_encode_string(ptr, value->bytes, len);
+            break;
+
+        default:
+            /** Null values have no data */
+            break;
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Append a record to the current data block
+ *
+ * The record is encoded with the field plan of the writer. A union is
+ * encoded as the index of its branch followed by the value of the branch.
+ * The block is written to the file once it reaches the block size of the
+ * writer.
+ *
+ * @param writer Writer to use
+ * @param values Values of the record in schema order
+ * @param lengths Lengths of string and bytes values or NULL if all string
+ * values are null-terminated
+ * @param branches Branches of the union values or NULL if the first branch
+ * of each union is used
+ * @return True if the record was added, false if a branch was not valid or
+ * an error occurred
+ */
+bool maxavro_writer_append(MAXAVRO_WRITER *writer, const MAXAVRO_RECORD_VALUE *values,
+                           const size_t *lengths, const int *branches)
+{
+    size_t size = writer->fixed_size;
+    size_t nfields = writer->schema->num_fields;
+    enum maxavro_value_type types[nfields + 1];
+    size_t len[nfields + 1];
+
+    for (size_t i = 0; i < nfields; i++)
+    {
+        types[i] = writer->plan[i];
+        len[i] = 0;
+
+        if (types[i] == MAXAVRO_TYPE_UNION)
+        {
+            MAXAVRO_SCHEMA *schema = writer->schema->fields[i].extra;
+            int branch = branches ? branches[i] : 0;
+
+            if (branch < 0 || (size_t)branch >= schema->num_fields)
+            {
+                MXS_ERROR("Invalid branch %d for union field '%s' in '%s'.", branch,
+                          writer->schema->fields[i].name, writer->filename);
+                return false;
+            }
+
+            types[i] = schema->fields[branch].type;
+        }
+
+        if (types[i] == MAXAVRO_TYPE_STRING || types[i] == MAXAVRO_TYPE_BYTES)
+        {
+            len[i] = lengths ? lengths[i] : strlen(values[i].string);
+            size += len[i];
+        }
+    }
+
+    if (!reserve_block(writer, size))
+    {
+        return false;
+    }
+
+    uint8_t *ptr = writer->buffer + writer->datasize;
+
+    for (size_t i = 0; i < nfields; i++)
+    {
+        if (writer->plan[i] == MAXAVRO_TYPE_UNION)
+        {
+            ptr += maxavro_encode_integer(ptr, branches ? branches[i] : 0);
+        }
+
+        ptr = encode_value(ptr, types[i], &values[i], len[i]);
+    }
+
+    writer->datasize = ptr - writer->buffer;
+    writer->records++;
+
+    return writer->datasize < writer->block_size || maxavro_writer_flush(writer);
+}
+
+/**
+ * @brief Write the current data block to the file
+ *
+ * The record count, the size of the data, the data and the sync marker are
+ * written with a single system call.
+ *
+ * @param writer Writer to flush
+ * @return True if the block was written or there was nothing to write
+ */
+bool maxavro_writer_flush(MAXAVRO_WRITER *writer)
+{
+    if (writer->records == 0)
+    {
+        return true;
+    }
+
+    uint8_t *data = writer->buffer;
+    long datasize = writer->datasize;
+
+    if (writer->codec == MAXAVRO_CODEC_DEFLATE)
+    {
+        if ((datasize = deflate_block(writer)) < 0)
+        {
+            return false;
+        }
+        data = writer->deflated;
+    }
+
+    uint8_t header[BLOCK_HEADER_SIZE];
+    size_t header_len = maxavro_encode_integer(header, writer->records);
+    header_len += maxavro_encode_integer(header + header_len, datasize);
+
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = data;
+    iov[1].iov_len = datasize;
+    iov[2].iov_base = writer->sync;
+    iov[2].iov_len = SYNC_MARKER_SIZE;
+
+    if (!write_vector(writer, iov, 3))
+    {
+        return false;
+    }
+
+    writer->blocks_written++;
+    writer->records_written += writer->records;
+    writer->records = 0;
+    writer->datasize = 0;
+    return true;
+}
+
+/**
+ * @brief Flush and close a writer
+ *
+ * @param writer Writer to close
+ * @return True if the last block was written
+ */
+bool maxavro_writer_close(MAXAVRO_WRITER *writer)
+{
+    bool rval = true;
+
+    if (writer)
+    {
+        rval = maxavro_writer_flush(writer);
+        writer_free(writer);
+    }
+
+    return rval;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+#include <maxavro.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+const char *testfile = "test_writer.avro";
+const char *testschema = "{\"namespace\": \"MaxScaleChangeDataSchema.avro\", "
+                         "\"type\": \"record\", \"name\": \"ChangeRecord\", \"fields\": ["
+                         "{\"name\": \"id\", \"type\": \"long\"}, "
+                         "{\"name\": \"name\", \"type\": \"string\"}, "
+                         "{\"name\": \"price\", \"type\": \"double\"}, "
+                         "{\"name\": \"note\", \"type\": [\"null\", \"string\"]}, "
+                         "{\"name\": \"kind\", \"type\": {\"type\": \"enum\", \"name\": \"kind\", "
+                         "\"symbols\": [\"a\", \"b\", \"c\"]}}, "
+                         "{\"name\": \"data\", \"type\": \"bytes\"}, "
+                         "{\"name\": \"empty\", \"type\": \"null\"}]}";
+
+#define NUM_RECORDS 10000
+#define NUM_FIELDS 7
+
+static const char *kinds[] = {"a", "b", "c"};
+
+/** Every other record has a null note */
+static void make_note(char *dest, int i)
+{
+    sprintf(dest, "note-%d", i);
+}
+
+/**
+ * Check that a record read from the file has the values it was written with
+ */
+static int check_record(json_t *row, int i)
+{
+    char name[64];
+    char note[64];
+    sprintf(name, "row-%d", i);
+    make_note(note, i);
+
+    json_int_t id = json_integer_value(json_object_get(row, "id"));
+    const char *str = json_string_value(json_object_get(row, "name"));
+    double price = json_real_value(json_object_get(row, "price"));
+    json_t *note_value = json_object_get(row, "note");
+    const char *kind = json_string_value(json_object_get(row, "kind"));
+    const char *data = json_string_value(json_object_get(row, "data"));
+
+    if (id != i - NUM_RECORDS / 2 || str == NULL || strcmp(str, name) != 0 || price != i / 4.0)
+    {
+        printf("Record %d is wrong: %ld, %s, %f\n", i, (long)id, str ? str : "(null)", price);
+        return 1;
+    }
+
+    if (i % 2 == 0 ? !json_is_null(note_value) :
+        !json_is_string(note_value) || strcmp(json_string_value(note_value), note) != 0)
+    {
+        printf("Record %d has a wrong union value\n", i);
+        return 1;
+    }
+
+    if (kind == NULL || strcmp(kind, kinds[i % 3]) != 0 || data == NULL ||
+        strncmp(data, name, 3) != 0 || strlen(data) != 3 || !json_is_null(json_object_get(row, "empty")))
+    {
+        printf("Record %d has a wrong enum, bytes or null value\n", i);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write the test records with two writers, the second one appending to the
+ * file created by the first one, and read them back.
+ */
+int test_write(enum maxavro_codec codec)
+{
+    char name[64];
+    unlink(testfile);
+
+    for (int half = 0; half < 2; half++)
+    {
+        MAXAVRO_WRITER *writer = maxavro_writer_open(testfile, testschema, codec, 4096);
+
+        if (writer == NULL)
+        {
+            printf("Failed to open '%s' for writing\n", testfile);
+            return 1;
+        }
+
+        for (int i = half * NUM_RECORDS / 2; i < (half + 1) * NUM_RECORDS / 2; i++)
+        {
+            MAXAVRO_RECORD_VALUE values[NUM_FIELDS];
+            size_t lengths[NUM_FIELDS] = {0};
+            int branches[NUM_FIELDS] = {0};
+            char note[64];
+            sprintf(name, "row-%d", i);
+            make_note(note, i);
+            values[0].integer = i - NUM_RECORDS / 2;
+            values[1].string = name;
+            lengths[1] = strlen(name);
+            values[2].floating = i / 4.0;
+            branches[3] = i % 2;
+            values[3].string = note;
+            lengths[3] = strlen(note);
+            values[4].integer = i % 3;
+            values[5].bytes = name;
+            lengths[5] = 3;
+
+            if (!maxavro_writer_append(writer, values, lengths, branches))
+            {
+                printf("Failed to append record %d\n", i);
+                return 1;
+            }
+        }
+
+        MAXAVRO_RECORD_VALUE values[NUM_FIELDS] = {{0}};
+        int branches[NUM_FIELDS] = {0};
+        branches[3] = 2;
+        values[1].string = "";
+        values[5].bytes = "";
+
+        if (maxavro_writer_append(writer, values, NULL, branches))
+        {
+            printf("A value for a union branch that does not exist was appended\n");
+            return 1;
+        }
+
+        if (!maxavro_writer_close(writer))
+        {
+            printf("Failed to close writer\n");
+            return 1;
+        }
+    }
+
+    MAXAVRO_FILE *file = maxavro_file_open(testfile);
+
+    if (file == NULL)
+    {
+        printf("Failed to open '%s' for reading\n", testfile);
+        return 1;
+    }
+
+    int rval = 0;
+    int i = 0;
+    json_t *row;
+
+    do
+    {
+        while ((row = maxavro_record_read_json(file)))
+        {
+            rval |= check_record(row, i);
+            json_decref(row);
+            i++;
+        }
+    }
+    while (maxavro_next_block(file));
+
+    if (i != NUM_RECORDS)
+    {
+        printf("Expected %d records, read %d\n", NUM_RECORDS, i);
+        rval = 1;
+    }
+
+    maxavro_file_close(file);
+
+    /** Skipping records must skip the union values by their branches */
+    if ((file = maxavro_file_open(testfile)) == NULL ||
+        !maxavro_record_seek(file, 5) || (row = maxavro_record_read_json(file)) == NULL)
+    {
+        printf("Failed to seek in '%s'\n", testfile);
+        rval = 1;
+    }
+    else
+    {
+        rval |= check_record(row, 5);
+        json_decref(row);
+    }
+
+    maxavro_file_close(file);
+    unlink(testfile);
+    return rval;
+}
+
+int main(int argc, char** argv)
+{
+    int rval = 0;
+    rval += test_write(MAXAVRO_CODEC_NULL);
+    rval += test_write(MAXAVRO_CODEC_DEFLATE);
+    return rval;
+}
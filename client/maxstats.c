@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxstats.c  - Print the statistics that MaxScale publishes in shared memory
+ *
+ * The statistics are read from the segment without connecting to MaxScale,
+ * see statshm.h. With an interval, they are printed repeatedly.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <version.h>
+#include <statshm.h>
+
+static struct option long_options[] =
+{
+    {"name", required_argument, 0, 'n'},
+    {"interval", required_argument, 0, 'i'},
+    {"version", no_argument, 0, 'v'},
+    {"help", no_argument, 0, '?'},
+    {0, 0, 0, 0}
+};
+
+/**
+ * How many times in a row a busy segment is read again before it is reported
+ * as stale, and how long to wait before reading it again, about one second in
+ * all. The writer holds the sequence lock only while it copies the data.
+ */
+#define BUSY_RETRIES  50
+#define BUSY_SLEEP_US 20000
+
+/** A mapping of the statistics segment */
+typedef struct
+{
+    int    fd;
+    void  *addr;
+    size_t size;
+} SEGMENT;
+
+static void DoUsage(const char *progname)
+{
+    printf("maxstats: The MaxScale statistics client\n\n");
+    printf("Usage: %s [-n <name>] [-i <ms>]\n\n", progname);
+    printf("  -n|--name=...      The name of the statistics segment. The default\n"
+           "                     is %s\n", STATSHM_DEFAULT_NAME);
+    printf("  -i|--interval=...  Print the statistics every this many milliseconds\n");
+    printf("  -v|--version       Print version information and exit\n");
+    printf("  -?|--help          Print this help\n");
+}
+
+/**
+ * Map the segment, or map it again with its current size
+ *
+ * @param seg  The mapping
+ * @param name Name of the segment
+ * @return 0 on success, -1 on error
+ */
+static int map_segment(SEGMENT *seg, const char *name)
+{
+    struct stat st;
+
+    if (seg->addr)
+    {
+        munmap(seg->addr, seg->size);
+        seg->addr = NULL;
+    }
+
+    if (seg->fd == -1 && (seg->fd = shm_open(name, O_RDONLY, 0)) == -1)
+    {
+        fprintf(stderr, "Unable to open the statistics segment '%s': %s\n"
+                "Is stats_shm_interval set in the configuration of MaxScale?\n",
+                name, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(seg->fd, &st) == -1 ||
+        (seg->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, seg->fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map the statistics segment '%s': %s\n", name, strerror(errno));
+        seg->addr = NULL;
+        return -1;
+    }
+
+    seg->size = st.st_size;
+    return 0;
+}
+
+/**
+ * Print the statistics once
+ *
+ * @param seg  The mapping
+ * @param name Name of the segment
+ * @param buf  The buffer of the copy, grown when needed
+ * @param size Size of the buffer
+ * @return 0 on success, -1 on error
+ */
+static int print_stats(SEGMENT *seg, const char *name, char **buf, size_t *size)
+{
+    int busy = 0;
+
+    while (1)
+    {
+        const STATSHM_HEADER *hdr = (const STATSHM_HEADER*)seg->addr;
+        size_t length = 0;
+
+        switch (statshm_read(hdr, seg->size, *buf, *size, &length))
+        {
+        case STATSHM_OK:
+            fwrite(*buf, 1, length, stdout);
+            fflush(stdout);
+            return 0;
+
+        case STATSHM_RETRY:
+            if (length > *size)
+            {
+                char *newbuf = realloc(*buf, length);
+
+                if (newbuf == NULL)
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+                *buf = newbuf;
+                *size = length;
+            }
+            if (hdr->size > seg->size && map_segment(seg, name) == -1)
+            {
+                return -1;
+            }
+            break;
+
+        case STATSHM_BUSY:
+            if (++busy >= BUSY_RETRIES)
+            {
+                pid_t pid = (pid_t)hdr->pid;
+                bool running = pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+
+                fprintf(stderr, "The statistics segment '%s' appears to be stale: it has been "
+                        "in the middle of a write for over a second. The process %ld that "
+                        "writes it is %s.\n", name, (long)pid,
+                        running ? "running" : "no longer running");
+                return -1;
+            }
+            usleep(BUSY_SLEEP_US);
+            break;
+
+        default:
+            fprintf(stderr, "'%s' is not a statistics segment of this version of MaxScale.\n", name);
+            return -1;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = STATSHM_DEFAULT_NAME;
+    long interval = 0;
+    int option_index = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "n:i:v?", long_options, &option_index)) >= 0)
+    {
+        switch (c)
+        {
+        case 'n':
+            name = optarg;
+            break;
+
+        case 'i':
+            interval = strtol(optarg, NULL, 10);
+            if (interval <= 0)
+            {
+                fprintf(stderr, "Invalid interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'v':
+            printf("maxstats %s\n", MAXSCALE_VERSION);
+            exit(EXIT_SUCCESS);
+
+        default:
+            DoUsage(argv[0]);
+            exit(optopt ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+
+    SEGMENT seg = {-1, NULL, 0};
+    size_t size = 0;
+    char *buf = NULL;
+
+    if (map_segment(&seg, name) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    do
+    {
+        if (print_stats(&seg, name, &buf, &size) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (interval)
+        {
+            usleep(interval * 1000);
+        }
+    }
+    while (interval);
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
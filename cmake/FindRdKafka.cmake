@@ -0,0 +1,17 @@
+# This CMake file locates the librdkafka C library and headers
+#
+# The following variables are set:
+# RDKAFKA_FOUND - If the librdkafka library was found
+# RDKAFKA_LIBRARIES - Path to the library
+# RDKAFKA_INCLUDE_DIR - Path to librdkafka headers
+
+find_path(RDKAFKA_INCLUDE_DIR librdkafka/rdkafka.h)
+find_library(RDKAFKA_LIBRARIES NAMES rdkafka)
+
+if (RDKAFKA_INCLUDE_DIR AND RDKAFKA_LIBRARIES)
+  message(STATUS "Found librdkafka: ${RDKAFKA_LIBRARIES}")
+  set(RDKAFKA_FOUND TRUE)
+else()
+  message(STATUS "librdkafka not found, the avrorouter will not publish rows to Kafka.")
+  unset(RDKAFKA_LIBRARIES)
+endif()
@@ -39,6 +39,9 @@ set(WITH_SCRIPTS TRUE CACHE BOOL "Install init.d scripts and ldconf configuratio
 # Build tests
 set(BUILD_TESTS FALSE CACHE BOOL "Build tests")
 
+# Build the microbenchmarks of the core, requires BUILD_TESTS
+set(BUILD_BENCHMARKS FALSE CACHE BOOL "Build microbenchmarks")
+
 # Build packages
 set(PACKAGE FALSE CACHE BOOL "Enable package building (this disables local installation of system files)")
 
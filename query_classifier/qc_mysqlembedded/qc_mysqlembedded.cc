@@ -250,10 +250,15 @@ static bool parse_query(GWBUF* querybuf)
      */
     create_parse_tree(thd);
     /** Add complete parsing info struct to the query buffer */
-    gwbuf_add_buffer_object(querybuf,
-                            GWBUF_PARSING_INFO,
-                            (void *) pi,
-                            parsing_info_done);
+    if (!gwbuf_add_buffer_object(querybuf,
+                                 GWBUF_PARSING_INFO,
+                                 (void *) pi,
+                                 parsing_info_done))
+    {
+        parsing_info_done(pi);
+        succp = false;
+        goto retblock;
+    }
 
     succp = true;
 retblock:
@@ -1008,9 +1013,8 @@ char* qc_get_stmtname(GWBUF* buf)
     MYSQL* mysql;
 
     if (buf == NULL ||
-        buf->gwbuf_bufobj == NULL ||
-        buf->gwbuf_bufobj->bo_data == NULL ||
-        (mysql = (MYSQL *) ((parsing_info_t *) buf->gwbuf_bufobj->bo_data)->pi_handle) == NULL ||
+        buf->sbuf->bufobj[GWBUF_PARSING_INFO].bo_data == NULL ||
+        (mysql = (MYSQL *) ((parsing_info_t *) buf->sbuf->bufobj[GWBUF_PARSING_INFO].bo_data)->pi_handle) == NULL ||
         mysql->thd == NULL ||
         (THD *) (mysql->thd))->lex == NULL ||
         (THD *) (mysql->thd))->lex->prepared_stmt_name == NULL)
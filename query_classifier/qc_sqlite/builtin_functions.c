@@ -3,19 +3,34 @@
  */
 
 #include "builtin_functions.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <skygw_debug.h>
+#include <log_manager.h>
+
+// The functions are looked up using a perfect hash that is built when the
+// module is initialized. The first hash of a name selects a bucket, whose
+// displacement tells the slot of the name. A negative displacement gives the
+// slot directly, a positive one is the seed of the second hash and zero means
+// that no function falls into the bucket. A lookup is thus two hashes of the
+// name and one string comparison. After the initialization the table is only
+// read, so it is shared by all threads.
+
+#define BUILTIN_HASH_SIZE 512 // Must be a power of two and larger than N_BUILTIN_FUNCTIONS.
+#define BUILTIN_HASH_MASK (BUILTIN_HASH_SIZE - 1)
 
 static struct
 {
     bool inited;
+    int16_t displacements[BUILTIN_HASH_SIZE]; // Of the buckets, see above.
+    const char* slots[BUILTIN_HASH_SIZE];     // The functions, NULL if the slot is unused.
 } unit = { false };
 
 // The functions have been taken from:
 // https://mariadb.com/kb/en/mariadb/functions-and-operators/
 
-static const char* BUILTIN_FUNCTIONS[] =
+static const char* const BUILTIN_FUNCTIONS[] =
 {
     /*
      * Bit Functions and Operators
@@ -367,29 +382,167 @@ static const char* BUILTIN_FUNCTIONS[] =
 
 const size_t N_BUILTIN_FUNCTIONS = sizeof(BUILTIN_FUNCTIONS) / sizeof(BUILTIN_FUNCTIONS[0]);
 
-// NOTE: sort_compare and search_compare are not identical, so don't
-// NOTE: optimize either of them away.
-static int sort_compare(const void* key, const void* value)
+/**
+ * Hash a function name, ignoring the case of the letters.
+ *
+ * @param seed  The seed, 0 for the bucket and the displacement for the slot.
+ * @param zName The name.
+ *
+ * @return The hash of the name.
+ */
+static inline uint32_t builtin_hash(uint32_t seed, const char* zName)
 {
-    return strcasecmp(*(const char**) key, *(const char**) value);
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    uint8_t c;
+
+    while ((c = *zName++))
+    {
+        h ^= (c | 0x20); // Lower case for letters, the exact match is checked later.
+        h *= 16777619u;
+    }
+
+    return h ^ (h >> 15);
 }
 
-static int search_compare(const void* key, const void* value)
+/**
+ * Find a displacement with which all names of a bucket hash to unused slots,
+ * and place the names.
+ *
+ * @param first   The index of the first name of the bucket.
+ * @param next    The index of the next name of the same bucket, -1 ends the bucket.
+ * @param n_names The number of names in the bucket.
+ *
+ * @return The displacement or 0 if none was found.
+ */
+static int place_bucket(int first, const int* next, int n_names)
 {
-    return strcasecmp((const char*) key, *(const char**) value);
+    int slots[n_names];
+
+    for (int d = 1; d <= INT16_MAX; ++d)
+    {
+        int n = 0;
+        int i;
+
+        for (i = first; i != -1; i = next[i])
+        {
+            int slot = builtin_hash(d, BUILTIN_FUNCTIONS[i]) & BUILTIN_HASH_MASK;
+            int j = 0;
+
+            while ((j < n) && (slots[j] != slot))
+            {
+                ++j;
+            }
+
+            if (unit.slots[slot] || (j < n))
+            {
+                break;
+            }
+
+            slots[n++] = slot;
+        }
+
+        if (i == -1)
+        {
+            n = 0;
+
+            for (i = first; i != -1; i = next[i])
+            {
+                unit.slots[slots[n++]] = BUILTIN_FUNCTIONS[i];
+            }
+
+            return d;
+        }
+    }
+
+    return 0;
 }
 
 //
 // API
 //
 
-void init_builtin_functions()
+/**
+ * Build the perfect hash of the builtin functions.
+ *
+ * @return True if all names could be placed, false otherwise.
+ */
+bool init_builtin_functions()
 {
     ss_dassert(!unit.inited);
-
-    qsort(BUILTIN_FUNCTIONS, N_BUILTIN_FUNCTIONS, sizeof(char*), sort_compare);
+    ss_dassert(N_BUILTIN_FUNCTIONS < BUILTIN_HASH_SIZE);
+
+    int first[BUILTIN_HASH_SIZE]; // The first name of each bucket, -1 if none.
+    int next[N_BUILTIN_FUNCTIONS];
+    int sizes[BUILTIN_HASH_SIZE];
+    int max_size = 0;
+
+    memset(first, -1, sizeof(first));
+    memset(sizes, 0, sizeof(sizes));
+    memset(unit.displacements, 0, sizeof(unit.displacements));
+    memset(unit.slots, 0, sizeof(unit.slots));
+
+    for (int i = 0; i < (int)N_BUILTIN_FUNCTIONS; ++i)
+    {
+        int b = builtin_hash(0, BUILTIN_FUNCTIONS[i]) & BUILTIN_HASH_MASK;
+        int j = first[b];
+
+        // The same function may be listed in more than one category.
+        while ((j != -1) && (strcasecmp(BUILTIN_FUNCTIONS[j], BUILTIN_FUNCTIONS[i]) != 0))
+        {
+            j = next[j];
+        }
+
+        if (j == -1)
+        {
+            next[i] = first[b];
+            first[b] = i;
+
+            if (++sizes[b] > max_size)
+            {
+                max_size = sizes[b];
+            }
+        }
+    }
+
+    // The largest buckets are placed first, while most slots are unused.
+    for (int size = max_size; size > 1; --size)
+    {
+        for (int b = 0; b < BUILTIN_HASH_SIZE; ++b)
+        {
+            if (sizes[b] == size)
+            {
+                unit.displacements[b] = place_bucket(first[b], next, size);
+
+                if (unit.displacements[b] == 0)
+                {
+                    MXS_ERROR("qc_sqlite: Could not place the %d builtin functions of hash "
+                              "bucket %d, the table of builtin functions is too full.",
+                              size, b);
+                    return false;
+                }
+            }
+        }
+    }
+
+    int slot = 0;
+
+    for (int b = 0; b < BUILTIN_HASH_SIZE; ++b)
+    {
+        if (sizes[b] == 1)
+        {
+            while (unit.slots[slot])
+            {
+                ++slot;
+            }
+
+            unit.slots[slot] = BUILTIN_FUNCTIONS[first[b]];
+            unit.displacements[b] = -(slot + 1);
+        }
+    }
 
     unit.inited = true;
+
+    return true;
 }
 
 void finish_builtin_functions()
@@ -402,7 +555,14 @@ bool is_builtin_readonly_function(const char* key)
 {
     ss_dassert(unit.inited);
 
-    char* value = bsearch(key, BUILTIN_FUNCTIONS, N_BUILTIN_FUNCTIONS, sizeof(char*), search_compare);
+    int d = unit.displacements[builtin_hash(0, key) & BUILTIN_HASH_MASK];
+
+    if (d == 0)
+    {
+        return false;
+    }
+
+    const char* zName = unit.slots[d < 0 ? -d - 1 : builtin_hash(d, key) & BUILTIN_HASH_MASK];
 
-    return value ? true : false;
+    return zName && (strcasecmp(key, zName) == 0);
 }
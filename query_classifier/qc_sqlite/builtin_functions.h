@@ -11,7 +11,7 @@
 extern "C" {
 #endif
 
-void init_builtin_functions();
+bool init_builtin_functions();
 void finish_builtin_functions();
 
 bool is_builtin_readonly_function(const char* zToken);
@@ -13,14 +13,20 @@
 
 #include <sqliteInt.h>
 
+#include <ctype.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <string.h>
 #include <log_manager.h>
 #include <modinfo.h>
+#include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <platform.h>
 #include <query_classifier.h>
 #include <skygw_utils.h>
+#include <statistics.h>
+#include <strhash.h>
 #include "builtin_functions.h"
 
 //#define QC_TRACE_ENABLED
@@ -53,6 +59,7 @@ static inline bool qc_info_was_parsed(qc_parse_result_t status)
 typedef struct qc_sqlite_info
 {
     qc_parse_result_t status;        // The validity of the information in this structure.
+    uint32_t collect;                // What information should be or was collected, qc_collect_info_t.
     const char* query;               // The query passed to sqlite.
     size_t query_len;                // The length of the query.
 
@@ -74,8 +81,12 @@ typedef struct qc_sqlite_info
     char** database_names;           // Array of database names used in the query.
     size_t database_names_len;       // The used entries in database_names.
     size_t database_names_capacity;  // The capacity of database_names.
+    char** function_names;           // Array of the lower case names of the called functions.
+    size_t function_names_len;       // The used entries in function_names.
+    size_t function_names_capacity;  // The capacity of function_names.
     int keyword_1;                   // The first encountered keyword.
     int keyword_2;                   // The second encountered keyword.
+    char* block;                     // The memory of the names and fields above, NULL if none.
 } QC_SQLITE_INFO;
 
 typedef enum qc_log_level
@@ -86,6 +97,54 @@ typedef enum qc_log_level
     QC_LOG_NON_TOKENIZED,
 } qc_log_level_t;
 
+/**
+ * An entry in the classification cache of a thread. The entries are kept in
+ * a list ordered by the time of the last use, so that the least recently used
+ * one can be evicted when the cache is full.
+ */
+typedef struct qc_cache_entry
+{
+    char* key;                    // The canonical form of the statement.
+    QC_SQLITE_INFO* info;         // The classification of the statement.
+    struct qc_cache_entry* prev;  // The more recently used entry.
+    struct qc_cache_entry* next;  // The less recently used entry.
+} QC_CACHE_ENTRY;
+
+#define QC_CACHE_DEFAULT_SIZE 2048 // Default number of entries per thread.
+#define QC_CACHE_MAX_KEY_LEN  2048 // Longer statements are not cached.
+
+/**
+ * A chunk of the parsing arena of a thread. While a statement is parsed, the
+ * memory sqlite asks for and the names and fields being collected are bumped
+ * off the current chunk. A chunk counts its live allocations and is rewound,
+ * or returned to the spare chunks, when the last of them is freed; in practice
+ * after the statement has been finalized and its classification moved to the
+ * heap. The chunks are aligned to their size, so the chunk of an allocation is
+ * found from its address. The memory allocated while parsing must be freed by
+ * the same thread, which is the case as the sqlite handles are per thread.
+ */
+typedef struct qc_arena_chunk
+{
+    struct qc_arena_chunk* next;  // The next spare chunk.
+    size_t used;                  // The bytes used, including this header.
+    size_t live;                  // The allocations not yet freed.
+} QC_ARENA_CHUNK;
+
+/**
+ * The header of every allocation made with arena_malloc(), also the ones that
+ * do not fit in a chunk and are made from the heap.
+ */
+typedef struct qc_arena_header
+{
+    uint32_t size;      // The usable size of the allocation.
+    uint32_t in_arena;  // Whether the allocation is in a chunk.
+} QC_ARENA_HEADER;
+
+#define QC_ARENA_CHUNK_SIZE (64 * 1024)              // The size and alignment of a chunk.
+#define QC_ARENA_MAX_ALLOC  (QC_ARENA_CHUNK_SIZE / 4) // Larger allocations are made from the heap.
+#define QC_ARENA_MAX_SPARE  4                         // Spare chunks kept per thread.
+#define QC_ARENA_ROUND(n)   (((size_t)(n) + 7) & ~(size_t)7)
+#define QC_ARENA_START      QC_ARENA_ROUND(sizeof(QC_ARENA_CHUNK))
 
 /**
  * The state of qc_sqlite.
@@ -94,6 +153,11 @@ static struct
 {
     bool initialized;
     qc_log_level_t log_level;
+    int cache_size;              // The maximum number of entries per thread, 0 if disabled.
+    ts_stats_t cache_hits;       // Statements classified from the cache.
+    ts_stats_t cache_misses;     // Cacheable statements that were parsed.
+    ts_stats_t cache_evictions;  // Entries evicted to make room for new ones.
+    ts_gauge_t cache_entries;    // Entries in the caches of all threads.
 } this_unit;
 
 /**
@@ -104,6 +168,14 @@ static thread_local struct
     bool initialized;
     sqlite3* db;      // Thread specific database handle.
     QC_SQLITE_INFO* info;
+    STRHASH* cache;              // The cache entries by canonical form, NULL if disabled.
+    QC_CACHE_ENTRY* cache_head;  // The most recently used entry.
+    QC_CACHE_ENTRY* cache_tail;  // The least recently used entry.
+    int cache_n_entries;         // The number of entries in the cache.
+    bool arena_active;           // Whether a statement is being parsed.
+    QC_ARENA_CHUNK* arena;       // The chunk allocations are made from.
+    QC_ARENA_CHUNK* arena_spare; // Chunks not in use.
+    int arena_n_spare;           // The number of spare chunks.
 } this_thread;
 
 
@@ -165,6 +237,318 @@ static char* mxs_strdup(const char* s1)
 }
 
 
+/**
+ * ARENA
+ *
+ * The allocation functions of sqlite and of the information collected while
+ * parsing. Outside parsing the allocations are made from the heap.
+ */
+
+static inline QC_ARENA_CHUNK* arena_chunk_of(const void* p)
+{
+    return (QC_ARENA_CHUNK*) ((uintptr_t) p & ~((uintptr_t) QC_ARENA_CHUNK_SIZE - 1));
+}
+
+static QC_ARENA_CHUNK* arena_chunk_alloc(void)
+{
+    QC_ARENA_CHUNK* chunk = this_thread.arena_spare;
+
+    if (chunk)
+    {
+        this_thread.arena_spare = chunk->next;
+        --this_thread.arena_n_spare;
+    }
+    else
+    {
+        void* p;
+
+        if (posix_memalign(&p, QC_ARENA_CHUNK_SIZE, QC_ARENA_CHUNK_SIZE) != 0)
+        {
+            return NULL;
+        }
+
+        chunk = (QC_ARENA_CHUNK*) p;
+    }
+
+    chunk->next = NULL;
+    chunk->used = QC_ARENA_START;
+    chunk->live = 0;
+
+    return chunk;
+}
+
+static void arena_chunk_release(QC_ARENA_CHUNK* chunk)
+{
+    if (this_thread.arena_n_spare < QC_ARENA_MAX_SPARE)
+    {
+        chunk->next = this_thread.arena_spare;
+        this_thread.arena_spare = chunk;
+        ++this_thread.arena_n_spare;
+    }
+    else
+    {
+        free(chunk);
+    }
+}
+
+/**
+ * Free the chunks of the thread that are no longer in use.
+ */
+static void arena_free_chunks(void)
+{
+    QC_ARENA_CHUNK* chunk = this_thread.arena_spare;
+
+    while (chunk)
+    {
+        QC_ARENA_CHUNK* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    this_thread.arena_spare = NULL;
+    this_thread.arena_n_spare = 0;
+
+    // A chunk still having live allocations is left to sqlite.
+    if (this_thread.arena && (this_thread.arena->live == 0))
+    {
+        free(this_thread.arena);
+    }
+
+    this_thread.arena = NULL;
+}
+
+/**
+ * Allocate memory. While a statement is being parsed, the memory is allocated
+ * from the arena of the thread, otherwise from the heap.
+ *
+ * @param size  The size of the allocation.
+ *
+ * @return The memory, or NULL if it could not be allocated.
+ */
+static void* arena_malloc(size_t size)
+{
+    size_t required = sizeof(QC_ARENA_HEADER) + QC_ARENA_ROUND(size);
+    QC_ARENA_HEADER* header = NULL;
+
+    if (this_thread.arena_active && (required <= QC_ARENA_MAX_ALLOC))
+    {
+        QC_ARENA_CHUNK* chunk = this_thread.arena;
+
+        if (!chunk || (chunk->used + required > QC_ARENA_CHUNK_SIZE))
+        {
+            // A full chunk is released when its last allocation is freed.
+            if ((chunk = arena_chunk_alloc()))
+            {
+                this_thread.arena = chunk;
+            }
+        }
+
+        if (chunk)
+        {
+            header = (QC_ARENA_HEADER*) ((char*) chunk + chunk->used);
+            header->in_arena = 1;
+
+            chunk->used += required;
+            ++chunk->live;
+        }
+    }
+
+    if (!header)
+    {
+        if (!(header = (QC_ARENA_HEADER*) malloc(required)))
+        {
+            return NULL;
+        }
+
+        header->in_arena = 0;
+    }
+
+    header->size = required - sizeof(QC_ARENA_HEADER);
+
+    return header + 1;
+}
+
+/**
+ * Free memory allocated with arena_malloc() or arena_realloc().
+ *
+ * @param p  The memory, may be NULL.
+ */
+static void arena_free(void* p)
+{
+    if (p)
+    {
+        QC_ARENA_HEADER* header = (QC_ARENA_HEADER*) p - 1;
+
+        if (header->in_arena)
+        {
+            QC_ARENA_CHUNK* chunk = arena_chunk_of(header);
+            ss_dassert(chunk->live > 0);
+
+            if (--chunk->live == 0)
+            {
+                if (chunk == this_thread.arena)
+                {
+                    chunk->used = QC_ARENA_START;
+                }
+                else
+                {
+                    arena_chunk_release(chunk);
+                }
+            }
+        }
+        else
+        {
+            free(header);
+        }
+    }
+}
+
+/**
+ * Change the size of memory allocated with arena_malloc(). The last allocation
+ * of the current chunk grows in place, if there is room for it.
+ *
+ * @param p     The memory, may be NULL.
+ * @param size  The new size.
+ *
+ * @return The memory, or NULL if it could not be allocated.
+ */
+static void* arena_realloc(void* p, size_t size)
+{
+    if (!p)
+    {
+        return arena_malloc(size);
+    }
+
+    QC_ARENA_HEADER* header = (QC_ARENA_HEADER*) p - 1;
+
+    if (size <= header->size)
+    {
+        return p;
+    }
+
+    size = QC_ARENA_ROUND(size);
+
+    if (header->in_arena)
+    {
+        QC_ARENA_CHUNK* chunk = arena_chunk_of(header);
+        char* end = (char*) p + header->size;
+
+        if ((chunk == this_thread.arena) &&
+            (end == (char*) chunk + chunk->used) &&
+            (chunk->used + size - header->size <= QC_ARENA_CHUNK_SIZE) &&
+            (sizeof(QC_ARENA_HEADER) + size <= QC_ARENA_MAX_ALLOC))
+        {
+            chunk->used += size - header->size;
+            header->size = size;
+            return p;
+        }
+
+        void* q = arena_malloc(size);
+
+        if (q)
+        {
+            memcpy(q, p, header->size);
+            arena_free(p);
+        }
+
+        return q;
+    }
+    else
+    {
+        if (!(header = (QC_ARENA_HEADER*) realloc(header, sizeof(QC_ARENA_HEADER) + size)))
+        {
+            return NULL;
+        }
+
+        header->size = size;
+
+        return header + 1;
+    }
+}
+
+static void* arena_sqlite3_malloc(int n)
+{
+    return arena_malloc(n);
+}
+
+static void arena_sqlite3_free(void* p)
+{
+    arena_free(p);
+}
+
+static void* arena_sqlite3_realloc(void* p, int n)
+{
+    return arena_realloc(p, n);
+}
+
+static int arena_sqlite3_size(void* p)
+{
+    return p ? ((QC_ARENA_HEADER*) p - 1)->size : 0;
+}
+
+static int arena_sqlite3_roundup(int n)
+{
+    return QC_ARENA_ROUND(n);
+}
+
+static int arena_sqlite3_init(void* data)
+{
+    return SQLITE_OK;
+}
+
+static void arena_sqlite3_shutdown(void* data)
+{
+}
+
+static const sqlite3_mem_methods arena_sqlite3_mem_methods =
+{
+    arena_sqlite3_malloc,
+    arena_sqlite3_free,
+    arena_sqlite3_realloc,
+    arena_sqlite3_size,
+    arena_sqlite3_roundup,
+    arena_sqlite3_init,
+    arena_sqlite3_shutdown,
+    NULL
+};
+
+/**
+ * The allocation functions for the information collected while parsing. Like
+ * the mxs_ functions above, they never return NULL.
+ */
+static void* scratch_malloc(size_t size)
+{
+    void* p = arena_malloc(size);
+    if (!p)
+    {
+        raise(SIGABRT);
+    }
+
+    return p;
+}
+
+static void* scratch_realloc(void* p, size_t size)
+{
+    p = arena_realloc(p, size);
+    if (!p)
+    {
+        raise(SIGABRT);
+    }
+
+    return p;
+}
+
+static char* scratch_strdup(const char* s1)
+{
+    size_t len = strlen(s1) + 1;
+    char* s2 = scratch_malloc(len);
+
+    memcpy(s2, s1, len);
+
+    return s2;
+}
+
+
 /**
  * HELPERS
  */
@@ -178,19 +562,26 @@ typedef enum qc_token_position
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s);
 static void buffer_object_free(void* data);
+static void cache_add(const char* key, const QC_SQLITE_INFO* info);
+static void cache_free(void);
+static QC_SQLITE_INFO* cache_get(const char* key, uint32_t collect);
+static bool cache_key(const char* query, size_t len, char* key);
 static char** copy_string_array(char** strings, int* pn);
 static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity);
-static bool ensure_query_is_parsed(GWBUF* query);
-static void free_string_array(char** sa);
-static QC_SQLITE_INFO* get_query_info(GWBUF* query);
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect);
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect);
 static QC_SQLITE_INFO* info_alloc(void);
+static QC_SQLITE_INFO* info_dup(const QC_SQLITE_INFO* info);
 static void info_finish(QC_SQLITE_INFO* info);
+static void info_free_scratch(QC_SQLITE_INFO* info);
 static void info_free(QC_SQLITE_INFO* info);
 static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info);
+static void info_pack(QC_SQLITE_INFO* info, const QC_SQLITE_INFO* source);
 static bool is_submitted_query(const QC_SQLITE_INFO* info, const Parse* pParse);
-static bool parse_query(GWBUF* query);
+static bool parse_query(GWBUF* query, uint32_t collect);
+static QC_SQLITE_INFO* parse_query_fast(const char* query, size_t len);
 static void parse_query_string(const char* query, size_t len);
-static bool query_is_parsed(GWBUF* query);
+static bool query_is_parsed(GWBUF* query, uint32_t collect);
 static bool should_exclude(const char* zName, const ExprList* pExclude);
 static void update_affected_fields(QC_SQLITE_INFO* info,
                                    int prev_token,
@@ -204,6 +595,7 @@ static void update_affected_fields_from_idlist(QC_SQLITE_INFO* info,
 static void update_affected_fields_from_select(QC_SQLITE_INFO* info,
                                                const Select* pSelect, const ExprList* pExclude);
 static void update_database_names(QC_SQLITE_INFO* info, const char* name);
+static void update_function_names(QC_SQLITE_INFO* info, const char* name);
 static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable);
 static void update_names_from_srclist(QC_SQLITE_INFO* info, const SrcList* pSrc);
 
@@ -240,64 +632,785 @@ extern void exposed_sqlite3StartTable(Parse *pParse,   /* Parser context */
 extern void maxscaleCollectInfoFromSelect(Parse*, Select*);
 
 /**
- * Used for freeing a QC_SQLITE_INFO object added to a GWBUF.
+ * Used for freeing a QC_SQLITE_INFO object added to a GWBUF.
+ *
+ * @param object A pointer to a QC_SQLITE_INFO object.
+ */
+static void buffer_object_free(void* data)
+{
+    info_free((QC_SQLITE_INFO*) data);
+}
+
+static inline bool is_identifier_char(char c)
+{
+    return isalnum((unsigned char)c) || (c == '_') || (c == '$') || ((unsigned char)c >= 0x80);
+}
+
+/**
+ * Create the key of a statement in the classification cache. The key is the
+ * canonical form of the statement: string and numeric literals are replaced
+ * with question marks and runs of whitespace with a single space. Quoted
+ * identifiers are kept as they are, as sqlite takes double quoted strings for
+ * identifiers.
+ *
+ * Statements with comments are not cached, as a comment may be an executable
+ * one that changes the meaning of the statement.
+ *
+ * @param query  The statement.
+ * @param len    The length of the statement.
+ * @param key    Buffer of at least len + 1 bytes for the key.
+ *
+ * @return True if the statement can be cached.
+ */
+static bool cache_key(const char* query, size_t len, char* key)
+{
+    const char* p = query;
+    const char* end = query + len;
+    char* k = key;
+    bool space = false;
+
+    while (p < end)
+    {
+        char c = *p;
+
+        if (isspace((unsigned char)c))
+        {
+            space = true;
+            ++p;
+            continue;
+        }
+
+        if (space && (k != key))
+        {
+            *k++ = ' ';
+        }
+        space = false;
+
+        if ((c == '#') ||
+            ((c == '/') && (p + 1 < end) && (p[1] == '*')) ||
+            ((c == '-') && (p + 1 < end) && (p[1] == '-') &&
+             ((p + 2 == end) || isspace((unsigned char)p[2]))))
+        {
+            return false;
+        }
+        else if (c == '\'')
+        {
+            // A string literal, the quote is escaped by a backslash or by doubling it.
+            bool closed = false;
+            ++p;
+
+            while (!closed && (p < end))
+            {
+                if ((*p == '\\') && (p + 1 < end))
+                {
+                    p += 2;
+                }
+                else if ((*p == '\'') && (p + 1 < end) && (p[1] == '\''))
+                {
+                    p += 2;
+                }
+                else
+                {
+                    closed = (*p == '\'');
+                    ++p;
+                }
+            }
+
+            if (!closed)
+            {
+                return false;
+            }
+
+            *k++ = '?';
+        }
+        else if ((c == '`') || (c == '"'))
+        {
+            // A quoted identifier, the quote is escaped by doubling it.
+            bool closed = false;
+            *k++ = *p++;
+
+            while (!closed && (p < end))
+            {
+                if ((*p == c) && (p + 1 < end) && (p[1] == c))
+                {
+                    *k++ = *p++;
+                }
+                else
+                {
+                    closed = (*p == c);
+                }
+                *k++ = *p++;
+            }
+
+            if (!closed)
+            {
+                return false;
+            }
+        }
+        else if (isdigit((unsigned char)c))
+        {
+            // A number, unless it turns out to be the start of an identifier like 1abc.
+            const char* start = p;
+
+            if ((c == '0') && (p + 1 < end) && ((p[1] == 'x') || (p[1] == 'X')))
+            {
+                p += 2;
+
+                while ((p < end) && isxdigit((unsigned char)*p))
+                {
+                    ++p;
+                }
+            }
+            else
+            {
+                while ((p < end) && (isdigit((unsigned char)*p) || (*p == '.')))
+                {
+                    ++p;
+                }
+
+                if ((p + 1 < end) && ((*p == 'e') || (*p == 'E')) &&
+                    (isdigit((unsigned char)p[1]) ||
+                     (((p[1] == '+') || (p[1] == '-')) && (p + 2 < end) && isdigit((unsigned char)p[2]))))
+                {
+                    p += 2;
+
+                    while ((p < end) && isdigit((unsigned char)*p))
+                    {
+                        ++p;
+                    }
+                }
+            }
+
+            if ((p < end) && is_identifier_char(*p))
+            {
+                p = start;
+
+                while ((p < end) && is_identifier_char(*p))
+                {
+                    *k++ = *p++;
+                }
+            }
+            else
+            {
+                *k++ = '?';
+            }
+        }
+        else if (is_identifier_char(c))
+        {
+            // Identifiers and keywords are copied whole, so that digits in them are kept.
+            while ((p < end) && is_identifier_char(*p))
+            {
+                *k++ = *p++;
+            }
+        }
+        else
+        {
+            *k++ = *p++;
+        }
+    }
+
+    *k = 0;
+
+    return true;
+}
+
+/**
+ * Skip whitespace.
+ *
+ * @param p    The current position.
+ * @param end  The end of the statement.
+ *
+ * @return The first position that is not whitespace.
+ */
+static inline const char* fast_skip_space(const char* p, const char* end)
+{
+    while ((p < end) && isspace((unsigned char)*p))
+    {
+        ++p;
+    }
+
+    return p;
+}
+
+/**
+ * Match a keyword. The keyword must not be followed by an identifier character.
+ *
+ * @param pp       The current position, moved past the keyword and the following
+ *                 whitespace if it matches.
+ * @param end      The end of the statement.
+ * @param keyword  The keyword in upper case.
+ *
+ * @return True if the keyword is at the current position.
+ */
+static bool fast_match(const char** pp, const char* end, const char* keyword)
+{
+    const char* p = *pp;
+
+    while (*keyword && (p < end) && (toupper((unsigned char)*p) == *keyword))
+    {
+        ++p;
+        ++keyword;
+    }
+
+    bool match = (*keyword == 0) && ((p == end) || !is_identifier_char(*p));
+
+    if (match)
+    {
+        *pp = fast_skip_space(p, end);
+    }
+
+    return match;
+}
+
+/**
+ * Match the end of a statement, an optional semicolon followed by whitespace.
+ */
+static bool fast_match_end(const char* p, const char* end)
+{
+    if ((p < end) && (*p == ';'))
+    {
+        p = fast_skip_space(p + 1, end);
+    }
+
+    return p == end;
+}
+
+/**
+ * Match a plain or a backtick quoted identifier.
+ *
+ * @param pp   The current position, moved past the identifier and the following
+ *             whitespace if it matches.
+ * @param end  The end of the statement.
+ *
+ * @return True if an identifier is at the current position.
+ */
+static bool fast_match_identifier(const char** pp, const char* end)
+{
+    const char* p = *pp;
+    bool match = false;
+
+    if ((p < end) && (*p == '`'))
+    {
+        ++p;
+
+        while ((p < end) && (*p != '`'))
+        {
+            ++p;
+        }
+
+        match = (p < end) && (p > *pp + 1);
+        ++p;
+    }
+    else
+    {
+        while ((p < end) && is_identifier_char(*p))
+        {
+            ++p;
+        }
+
+        match = (p > *pp);
+    }
+
+    if (match)
+    {
+        *pp = fast_skip_space(p, end);
+    }
+
+    return match;
+}
+
+/**
+ * Classify a statement that is trivial enough to be recognized without the
+ * sqlite parser: BEGIN, START TRANSACTION, COMMIT, ROLLBACK, SET autocommit,
+ * USE and SELECT of a single unqualified system variable. The classification
+ * is the same as the parser would produce. Anything else, including statements
+ * with comments, is left to the parser.
+ *
+ * @param query  The statement.
+ * @param len    The length of the statement.
+ *
+ * @return The classification, or NULL if the statement must be parsed.
+ */
+static QC_SQLITE_INFO* parse_query_fast(const char* query, size_t len)
+{
+    const char* end = query + len;
+    const char* p = fast_skip_space(query, end);
+    uint32_t types = QUERY_TYPE_UNKNOWN;
+    qc_query_op_t operation = QUERY_OP_UNDEFINED;
+    bool recognized = false;
+
+    if (p == end)
+    {
+        return NULL;
+    }
+
+    switch (toupper((unsigned char)*p))
+    {
+    case 'B':
+        recognized = fast_match(&p, end, "BEGIN") && fast_match_end(p, end);
+        types = QUERY_TYPE_BEGIN_TRX;
+        break;
+
+    case 'C':
+        recognized = fast_match(&p, end, "COMMIT") && fast_match_end(p, end);
+        types = QUERY_TYPE_COMMIT;
+        break;
+
+    case 'R':
+        recognized = fast_match(&p, end, "ROLLBACK") && fast_match_end(p, end);
+        types = QUERY_TYPE_ROLLBACK;
+        break;
+
+    case 'S':
+        if (fast_match(&p, end, "START"))
+        {
+            recognized = fast_match(&p, end, "TRANSACTION") && fast_match_end(p, end);
+            types = QUERY_TYPE_BEGIN_TRX;
+        }
+        else if (fast_match(&p, end, "SET"))
+        {
+            if (!fast_match(&p, end, "SESSION"))
+            {
+                fast_match(&p, end, "GLOBAL");
+            }
+
+            if ((p + 1 < end) && (p[0] == '@') && (p[1] == '@'))
+            {
+                p += 2;
+
+                if (!fast_match(&p, end, "SESSION") && !fast_match(&p, end, "GLOBAL"))
+                {
+                    // Neither was followed by a dot.
+                }
+                else if ((p < end) && (*p == '.'))
+                {
+                    ++p;
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            if (fast_match(&p, end, "AUTOCOMMIT") && (p < end) && (*p == '='))
+            {
+                p = fast_skip_space(p + 1, end);
+
+                int enable = -1;
+
+                if (fast_match(&p, end, "1") || fast_match(&p, end, "ON") || fast_match(&p, end, "TRUE"))
+                {
+                    enable = 1;
+                }
+                else if (fast_match(&p, end, "0") || fast_match(&p, end, "OFF") || fast_match(&p, end, "FALSE"))
+                {
+                    enable = 0;
+                }
+
+                if ((enable != -1) && fast_match_end(p, end))
+                {
+                    recognized = true;
+                    types = QUERY_TYPE_GSYSVAR_WRITE;
+                    types |= enable ?
+                        (QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_COMMIT) :
+                        (QUERY_TYPE_BEGIN_TRX | QUERY_TYPE_DISABLE_AUTOCOMMIT);
+                }
+            }
+        }
+        else if (fast_match(&p, end, "SELECT"))
+        {
+            if ((p + 2 < end) && (p[0] == '@') && (p[1] == '@') && is_identifier_char(p[2]))
+            {
+                p += 2;
+
+                recognized = fast_match_identifier(&p, end) && fast_match_end(p, end);
+                types = QUERY_TYPE_READ | QUERY_TYPE_SYSVAR_READ;
+                operation = QUERY_OP_SELECT;
+            }
+        }
+        break;
+
+    case 'U':
+        recognized = fast_match(&p, end, "USE") && fast_match_identifier(&p, end) && fast_match_end(p, end);
+        types = QUERY_TYPE_SESSION_WRITE;
+        operation = QUERY_OP_CHANGE_DB;
+        break;
+
+    default:
+        break;
+    }
+
+    QC_SQLITE_INFO* info = NULL;
+
+    if (recognized && (info = info_alloc()))
+    {
+        info->status = QC_QUERY_PARSED;
+        info->collect = QC_COLLECT_ALL; // There is nothing else to collect.
+        info->types = types;
+        info->operation = operation;
+    }
+
+    return info;
+}
+
+/**
+ * Move a cache entry to the head of the list of the thread.
+ *
+ * @param entry  The entry, not in the list.
+ */
+static void cache_push(QC_CACHE_ENTRY* entry)
+{
+    entry->prev = NULL;
+    entry->next = this_thread.cache_head;
+
+    if (this_thread.cache_head)
+    {
+        this_thread.cache_head->prev = entry;
+    }
+    else
+    {
+        this_thread.cache_tail = entry;
+    }
+
+    this_thread.cache_head = entry;
+}
+
+/**
+ * Remove a cache entry from the list of the thread.
+ *
+ * @param entry  The entry.
+ */
+static void cache_unlink(QC_CACHE_ENTRY* entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        this_thread.cache_head = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        this_thread.cache_tail = entry->prev;
+    }
+}
+
+/**
+ * Get the classification of a statement from the cache of the thread.
+ *
+ * @param key      The canonical form of the statement.
+ * @param collect  The information that is needed.
+ *
+ * @return A copy of the cached classification, or NULL if the statement
+ *         is not in the cache or the cached classification lacks some of
+ *         the needed information.
+ */
+static QC_SQLITE_INFO* cache_get(const char* key, uint32_t collect)
+{
+    QC_CACHE_ENTRY* entry = (QC_CACHE_ENTRY*) strhash_fetch(this_thread.cache, key);
+    QC_SQLITE_INFO* info = NULL;
+
+    if (entry && ((entry->info->collect & collect) == collect))
+    {
+        if (entry != this_thread.cache_head)
+        {
+            cache_unlink(entry);
+            cache_push(entry);
+        }
+
+        info = info_dup(entry->info);
+        ts_stats_add(this_unit.cache_hits, 1);
+    }
+    else
+    {
+        ts_stats_add(this_unit.cache_misses, 1);
+    }
+
+    return info;
+}
+
+/**
+ * Free a cache entry that is no longer in the list or the table.
+ *
+ * @param entry  The entry.
+ */
+static void cache_entry_free(QC_CACHE_ENTRY* entry)
+{
+    info_free(entry->info);
+    free(entry->key);
+    free(entry);
+}
+
+/**
+ * Add the classification of a statement to the cache of the thread. If the
+ * cache is full, the least recently used entry is evicted.
+ *
+ * @param key   The canonical form of the statement.
+ * @param info  The classification, a copy of it is stored. An earlier
+ *              classification of the same statement is replaced.
+ */
+static void cache_add(const char* key, const QC_SQLITE_INFO* info)
+{
+    QC_CACHE_ENTRY* old = (QC_CACHE_ENTRY*) strhash_fetch(this_thread.cache, key);
+
+    if (old)
+    {
+        // The statement was classified again with more information.
+        cache_unlink(old);
+        strhash_delete(this_thread.cache, old->key);
+        cache_entry_free(old);
+
+        --this_thread.cache_n_entries;
+        ts_gauge_add(this_unit.cache_entries, -1);
+    }
+
+    if (this_thread.cache_n_entries >= this_unit.cache_size)
+    {
+        QC_CACHE_ENTRY* lru = this_thread.cache_tail;
+
+        ss_dassert(lru);
+        cache_unlink(lru);
+        strhash_delete(this_thread.cache, lru->key);
+        cache_entry_free(lru);
+
+        --this_thread.cache_n_entries;
+        ts_gauge_add(this_unit.cache_entries, -1);
+        ts_stats_add(this_unit.cache_evictions, 1);
+    }
+
+    QC_CACHE_ENTRY* entry = (QC_CACHE_ENTRY*) mxs_malloc(sizeof(*entry));
+
+    entry->key = mxs_strdup(key);
+    entry->info = info_dup(info);
+
+    if (strhash_add(this_thread.cache, key, entry))
+    {
+        cache_push(entry);
+
+        ++this_thread.cache_n_entries;
+        ts_gauge_add(this_unit.cache_entries, 1);
+    }
+    else
+    {
+        cache_entry_free(entry);
+    }
+}
+
+/**
+ * Free the cache of the thread.
+ */
+static void cache_free(void)
+{
+    QC_CACHE_ENTRY* entry = this_thread.cache_head;
+
+    while (entry)
+    {
+        QC_CACHE_ENTRY* next = entry->next;
+        cache_entry_free(entry);
+        entry = next;
+    }
+
+    ts_gauge_add(this_unit.cache_entries, -this_thread.cache_n_entries);
+
+    strhash_free(this_thread.cache);
+    this_thread.cache = NULL;
+    this_thread.cache_head = NULL;
+    this_thread.cache_tail = NULL;
+    this_thread.cache_n_entries = 0;
+}
+
+static char** copy_string_array(char** strings, int* pn)
+{
+    size_t n = 0;
+
+    char** ss = strings;
+    *pn = 0;
+
+    while (*ss)
+    {
+        ++ss;
+        ++(*pn);
+    }
+
+    ss = (char**) mxs_malloc((*pn + 1) * sizeof(char*));
+
+    ss[*pn] = 0;
+
+    for (int i = 0; i < *pn; ++i)
+    {
+        ss[i] = mxs_strdup(strings[i]);
+    }
+
+    return ss;
+}
+
+static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity)
+{
+    if (len + n >= *pCapacity)
+    {
+        int capacity = *pCapacity ? *pCapacity * 2 : 4;
+
+        *ppzStrings = (char**) scratch_realloc(*ppzStrings, capacity * sizeof(char**));
+        *pCapacity = capacity;
+    }
+}
+
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect)
+{
+    bool parsed = query_is_parsed(query, collect);
+
+    if (!parsed)
+    {
+        parsed = parse_query(query, collect);
+    }
+
+    return parsed;
+}
+
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect)
+{
+    QC_SQLITE_INFO* info = NULL;
+
+    if (ensure_query_is_parsed(query, collect))
+    {
+        info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(info);
+    }
+
+    return info;
+}
+
+static QC_SQLITE_INFO* info_alloc(void)
+{
+    QC_SQLITE_INFO* info = mxs_malloc(sizeof(*info));
+
+    info_init(info);
+
+    return info;
+}
+
+/**
+ * Calculate the memory needed for a copy of a string array.
  *
- * @param object A pointer to a QC_SQLITE_INFO object.
+ * @param strings        The array, may be NULL.
+ * @param len            The used entries of the array.
+ * @param pStringsSize   The size of the strings is added here.
+ *
+ * @return The size of the pointers.
  */
-static void buffer_object_free(void* data)
-{
-    info_free((QC_SQLITE_INFO*) data);
-}
-
-static char** copy_string_array(char** strings, int* pn)
+static size_t string_array_size(char** strings, size_t len, size_t* pStringsSize)
 {
-    size_t n = 0;
-
-    char** ss = strings;
-    *pn = 0;
+    size_t size = 0;
 
-    while (*ss)
+    if (strings)
     {
-        ++ss;
-        ++(*pn);
+        size = (len + 1) * sizeof(char*);
+
+        for (size_t i = 0; i < len; ++i)
+        {
+            *pStringsSize += strlen(strings[i]) + 1;
+        }
     }
 
-    ss = (char**) mxs_malloc((*pn + 1) * sizeof(char*));
+    return size;
+}
 
-    ss[*pn] = 0;
+static char* pack_string(const char* s, char** ppStrings)
+{
+    char* copy = NULL;
 
-    for (int i = 0; i < *pn; ++i)
+    if (s)
     {
-        ss[i] = mxs_strdup(strings[i]);
+        size_t len = strlen(s) + 1;
+
+        copy = *ppStrings;
+        memcpy(copy, s, len);
+        *ppStrings += len;
     }
 
-    return ss;
+    return copy;
 }
 
-static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity)
+static char** pack_string_array(char** strings, size_t len, char*** ppArrays, char** ppStrings)
 {
-    if (len + n >= *pCapacity)
+    char** copy = NULL;
+
+    if (strings)
     {
-        int capacity = *pCapacity ? *pCapacity * 2 : 4;
+        copy = *ppArrays;
+        *ppArrays += len + 1;
 
-        *ppzStrings = (char**) mxs_realloc(*ppzStrings, capacity * sizeof(char**));
-        *pCapacity = capacity;
+        for (size_t i = 0; i < len; ++i)
+        {
+            copy[i] = pack_string(strings[i], ppStrings);
+        }
+
+        copy[len] = NULL;
     }
+
+    return copy;
 }
 
-static bool ensure_query_is_parsed(GWBUF* query)
+/**
+ * Copy the names and fields of a classification to a single block of heap
+ * memory, so that they outlive the statement and the arena.
+ *
+ * @param info    The classification the copies are stored in.
+ * @param source  The classification whose names and fields are copied.
+ */
+static void info_pack(QC_SQLITE_INFO* info, const QC_SQLITE_INFO* source)
 {
-    bool parsed = query_is_parsed(query);
+    size_t strings_size = 0;
+    size_t arrays_size =
+        string_array_size(source->table_names, source->table_names_len, &strings_size) +
+        string_array_size(source->table_fullnames, source->table_fullnames_len, &strings_size) +
+        string_array_size(source->database_names, source->database_names_len, &strings_size) +
+        string_array_size(source->function_names, source->function_names_len, &strings_size);
+
+    if (source->affected_fields)
+    {
+        strings_size += strlen(source->affected_fields) + 1;
+    }
 
-    if (!parsed)
+    if (source->created_table_name)
     {
-        parsed = parse_query(query);
+        strings_size += strlen(source->created_table_name) + 1;
     }
 
-    return parsed;
+    size_t size = arrays_size + strings_size;
+
+    // The pointer arrays are placed first, as a string may have any length.
+    char* block = size ? (char*) mxs_malloc(size) : NULL;
+    char** arrays = (char**) block;
+    char* strings = block + arrays_size;
+
+    info->block = block;
+    info->affected_fields = pack_string(source->affected_fields, &strings);
+    info->affected_fields_capacity = info->affected_fields ? source->affected_fields_len + 1 : 0;
+    info->table_names = pack_string_array(source->table_names, source->table_names_len,
+                                          &arrays, &strings);
+    info->table_names_capacity = info->table_names ? source->table_names_len + 1 : 0;
+    info->table_fullnames = pack_string_array(source->table_fullnames, source->table_fullnames_len,
+                                              &arrays, &strings);
+    info->table_fullnames_capacity = info->table_fullnames ? source->table_fullnames_len + 1 : 0;
+    info->database_names = pack_string_array(source->database_names, source->database_names_len,
+                                             &arrays, &strings);
+    info->database_names_capacity = info->database_names ? source->database_names_len + 1 : 0;
+    info->function_names = pack_string_array(source->function_names, source->function_names_len,
+                                             &arrays, &strings);
+    info->function_names_capacity = info->function_names ? source->function_names_len + 1 : 0;
+    info->created_table_name = pack_string(source->created_table_name, &strings);
+
+    ss_dassert(strings == block + size);
 }
 
-static void free_string_array(char** sa)
+static void scratch_free_string_array(char** sa)
 {
     if (sa)
     {
@@ -305,43 +1418,45 @@ static void free_string_array(char** sa)
 
         while (*s)
         {
-            free(*s);
+            arena_free(*s);
             ++s;
         }
 
-        free(sa);
+        arena_free(sa);
     }
 }
 
-static QC_SQLITE_INFO* get_query_info(GWBUF* query)
+/**
+ * Free the names and fields collected into the arena while parsing.
+ *
+ * @param info  The classification, before it was packed.
+ */
+static void info_free_scratch(QC_SQLITE_INFO* info)
 {
-    QC_SQLITE_INFO* info = NULL;
-
-    if (ensure_query_is_parsed(query))
-    {
-        info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
-        ss_dassert(info);
-    }
-
-    return info;
+    arena_free(info->affected_fields);
+    scratch_free_string_array(info->table_names);
+    scratch_free_string_array(info->table_fullnames);
+    arena_free(info->created_table_name);
+    scratch_free_string_array(info->database_names);
+    scratch_free_string_array(info->function_names);
 }
 
-static QC_SQLITE_INFO* info_alloc(void)
+static QC_SQLITE_INFO* info_dup(const QC_SQLITE_INFO* info)
 {
-    QC_SQLITE_INFO* info = mxs_malloc(sizeof(*info));
+    QC_SQLITE_INFO* copy = mxs_malloc(sizeof(*copy));
 
-    info_init(info);
+    *copy = *info;
+    copy->query = NULL;
+    copy->query_len = 0;
 
-    return info;
+    info_pack(copy, info);
+
+    return copy;
 }
 
 static void info_finish(QC_SQLITE_INFO* info)
 {
-    free(info->affected_fields);
-    free_string_array(info->table_names);
-    free_string_array(info->table_fullnames);
-    free(info->created_table_name);
-    free_string_array(info->database_names);
+    free(info->block);
 }
 
 static void info_free(QC_SQLITE_INFO* info)
@@ -358,6 +1473,7 @@ static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
     memset(info, 0, sizeof(*info));
 
     info->status = QC_QUERY_INVALID;
+    info->collect = QC_COLLECT_ESSENTIALS;
 
     info->types = QUERY_TYPE_UNKNOWN;
     info->operation = QUERY_OP_UNDEFINED;
@@ -377,6 +1493,9 @@ static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
     info->database_names = NULL;
     info->database_names_len = 0;
     info->database_names_capacity = 0;
+    info->function_names = NULL;
+    info->function_names_len = 0;
+    info->function_names_capacity = 0;
     info->keyword_1 = 0; // Sqlite3 starts numbering tokens from 1, so 0 means
     info->keyword_2 = 0; // that we have not seen a keyword.
 
@@ -481,38 +1600,104 @@ static void parse_query_string(const char* query, size_t len)
     }
 }
 
-static bool parse_query(GWBUF* query)
+/**
+ * Parse a statement and attach the classification to the buffer. If the
+ * buffer already has a classification that lacks some of the information
+ * asked for now, the statement is parsed again and the classification is
+ * replaced.
+ *
+ * @param query    The buffer containing the statement.
+ * @param collect  The information to collect, in addition to the essentials.
+ *
+ * @return True if the classification was attached.
+ */
+static bool parse_query(GWBUF* query, uint32_t collect)
 {
     bool parsed = false;
-    ss_dassert(!query_is_parsed(query));
+    ss_dassert(!query_is_parsed(query, collect));
 
-    QC_SQLITE_INFO* info = info_alloc();
+    QC_SQLITE_INFO* existing = NULL;
 
-    if (info)
+    if (GWBUF_IS_PARSED(query))
     {
-        this_thread.info = info;
+        existing = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(existing);
+        collect |= existing->collect;
+    }
+
+    // The SQL is read in place, unless the packet is split over several buffers
+    // in which case the copy is shared with the filters that look at the SQL.
+    const char* s;
+    int n;
+
+    if (!modutil_get_SQL_view(query, &s, &n))
+    {
+        return false;
+    }
+
+    size_t len = n;
+
+    char key[len <= QC_CACHE_MAX_KEY_LEN ? len + 1 : 1];
+    bool cacheable = false;
+
+    QC_SQLITE_INFO* info = parse_query_fast(s, len);
 
-        // TODO: Somewhere it needs to be ensured that this buffer is contiguous.
-        // TODO: Where is it checked that the GWBUF really contains a query?
-        uint8_t* data = (uint8_t*) GWBUF_DATA(query);
-        size_t len = MYSQL_GET_PACKET_LEN(data) - 1; // Subtract 1 for packet type byte.
+    if (!info)
+    {
+        cacheable = this_thread.cache && (len <= QC_CACHE_MAX_KEY_LEN) && cache_key(s, len, key);
+        info = cacheable ? cache_get(key, collect) : NULL;
+    }
+
+    if (!info && (info = info_alloc()))
+    {
+        this_thread.info = info;
 
-        const char* s = (const char*) &data[5]; // TODO: Are there symbolic constants somewhere?
+        info->collect = collect;
 
         this_thread.info->query = s;
         this_thread.info->query_len = len;
+        this_thread.arena_active = true;
         parse_query_string(s, len);
+        this_thread.arena_active = false;
         this_thread.info->query = NULL;
         this_thread.info->query_len = 0;
 
-        // TODO: Add return value to gwbuf_add_buffer_object.
-        // Always added; also when it was not recognized. If it was not recognized now,
-        // it won't be if we try a second time.
-        gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
-        parsed = true;
+        // Moving the collected information to the heap releases the arena.
+        QC_SQLITE_INFO scratch = *info;
+        info_pack(info, &scratch);
+        info_free_scratch(&scratch);
+
+        // The outcome of SET depends on the assigned values, e.g. autocommit=0,
+        // so it cannot be shared by statements of the same canonical form.
+        if (cacheable && (info->keyword_1 != TK_SET))
+        {
+            cache_add(key, info);
+        }
 
         this_thread.info = NULL;
     }
+
+    if (info && existing)
+    {
+        // The buffer object keeps pointing to the existing structure.
+        info_finish(existing);
+        *existing = *info;
+        free(info);
+        parsed = true;
+    }
+    else if (info)
+    {
+        // Always added; also when it was not recognized. If it was not recognized now,
+        // it won't be if we try a second time.
+        if (gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free))
+        {
+            parsed = true;
+        }
+        else
+        {
+            info_free(info);
+        }
+    }
     else
     {
         MXS_ERROR("qc_sqlite: Could not allocate structure for containing parse data.");
@@ -521,9 +1706,19 @@ static bool parse_query(GWBUF* query)
     return parsed;
 }
 
-static bool query_is_parsed(GWBUF* query)
+static bool query_is_parsed(GWBUF* query, uint32_t collect)
 {
-    return query && GWBUF_IS_PARSED(query);
+    bool parsed = query && GWBUF_IS_PARSED(query);
+
+    if (parsed && (collect != QC_COLLECT_ESSENTIALS))
+    {
+        QC_SQLITE_INFO* info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(info);
+
+        parsed = (info->collect & collect) == collect;
+    }
+
+    return parsed;
 }
 
 /*
@@ -598,6 +1793,11 @@ static bool is_submitted_query(const QC_SQLITE_INFO* info, const Parse* pParse)
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
 {
+    if (!(info->collect & QC_COLLECT_FIELDS))
+    {
+        return;
+    }
+
     size_t len = strlen(s);
     size_t required_len = info->affected_fields_len + len + 1; // 1 for NULL
 
@@ -618,7 +1818,7 @@ static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
             info->affected_fields_capacity *= 2;
         }
 
-        info->affected_fields = mxs_realloc(info->affected_fields, info->affected_fields_capacity);
+        info->affected_fields = scratch_realloc(info->affected_fields, info->affected_fields_capacity);
     }
 
     if (info->affected_fields_len != 0)
@@ -744,6 +1944,8 @@ static void update_affected_fields(QC_SQLITE_INFO* info,
     case TK_SELECT:
         if ((pExpr->op == TK_FUNCTION) && zToken)
         {
+            update_function_names(info, zToken);
+
             if (strcasecmp(zToken, "last_insert_id") == 0)
             {
                 info->types |= (QUERY_TYPE_READ | QUERY_TYPE_MASTER_READ);
@@ -874,11 +2076,31 @@ static void update_affected_fields_from_select(QC_SQLITE_INFO* info,
         info->has_clause = true;
         update_affected_fields(info, 0, pSelect->pHaving, QC_TOKEN_MIDDLE, pSelect->pEList);
     }
+
+    if (pSelect->pOrderBy && (info->collect & QC_COLLECT_FUNCTIONS))
+    {
+        // Only the functions are collected from ORDER BY, its fields and the
+        // type of the statement are reported as qc_mysqlembedded reports them.
+        uint32_t collect = info->collect;
+        uint32_t types = info->types;
+        bool has_clause = info->has_clause;
+
+        info->collect = QC_COLLECT_FUNCTIONS;
+        update_affected_fields_from_exprlist(info, pSelect->pOrderBy, pSelect->pEList);
+        info->collect = collect;
+        info->types = types;
+        info->has_clause = has_clause;
+    }
 }
 
 static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
 {
-    char* zCopy = mxs_strdup(zDatabase);
+    if (!(info->collect & QC_COLLECT_DATABASES))
+    {
+        return;
+    }
+
+    char* zCopy = scratch_strdup(zDatabase);
     exposed_sqlite3Dequote(zCopy);
 
     enlarge_string_array(1, info->database_names_len,
@@ -887,9 +2109,47 @@ static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
     info->database_names[info->database_names_len] = NULL;
 }
 
+static void update_function_names(QC_SQLITE_INFO* info, const char* zName)
+{
+    if (!(info->collect & QC_COLLECT_FUNCTIONS))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < info->function_names_len; ++i)
+    {
+        if (strcasecmp(info->function_names[i], zName) == 0)
+        {
+            return;
+        }
+    }
+
+    char* zCopy = scratch_strdup(zName);
+
+    for (char* p = zCopy; *p; ++p)
+    {
+        *p = tolower((unsigned char)*p);
+    }
+
+    enlarge_string_array(1, info->function_names_len,
+                         &info->function_names, &info->function_names_capacity);
+    info->function_names[info->function_names_len++] = zCopy;
+    info->function_names[info->function_names_len] = NULL;
+}
+
 static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable)
 {
-    char* zCopy = mxs_strdup(zTable);
+    if (zDatabase)
+    {
+        update_database_names(info, zDatabase);
+    }
+
+    if (!(info->collect & QC_COLLECT_TABLES))
+    {
+        return;
+    }
+
+    char* zCopy = scratch_strdup(zTable);
     exposed_sqlite3Dequote(zCopy);
 
     enlarge_string_array(1, info->table_names_len, &info->table_names, &info->table_names_capacity);
@@ -898,18 +2158,16 @@ static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char
 
     if (zDatabase)
     {
-        zCopy = mxs_malloc(strlen(zDatabase) + 1 + strlen(zTable) + 1);
+        zCopy = scratch_malloc(strlen(zDatabase) + 1 + strlen(zTable) + 1);
 
         strcpy(zCopy, zDatabase);
         strcat(zCopy, ".");
         strcat(zCopy, zTable);
         exposed_sqlite3Dequote(zCopy);
-
-        update_database_names(info, zDatabase);
     }
     else
     {
-        zCopy = mxs_strdup(zCopy);
+        zCopy = scratch_strdup(zCopy);
     }
 
     enlarge_string_array(1, info->table_fullnames_len,
@@ -1399,7 +2657,8 @@ void mxs_sqlite3StartTable(Parse *pParse,   /* Parser context */
             update_names(info, NULL, name);
         }
 
-        info->created_table_name = mxs_strdup(info->table_names[0]);
+        info->created_table_name = scratch_strdup(name);
+        exposed_sqlite3Dequote(info->created_table_name);
     }
     else
     {
@@ -2347,16 +3606,22 @@ static void qc_sqlite_end(void);
 static bool qc_sqlite_thread_init(void);
 static void qc_sqlite_thread_end(void);
 static qc_parse_result_t qc_sqlite_parse(GWBUF* query);
+static qc_parse_result_t qc_sqlite_parse_collect(GWBUF* query, uint32_t collect);
 static uint32_t qc_sqlite_get_type(GWBUF* query);
 static qc_query_op_t qc_sqlite_get_operation(GWBUF* query);
 static char* qc_sqlite_get_created_table_name(GWBUF* query);
 static bool qc_sqlite_is_drop_table_query(GWBUF* query);
 static bool qc_sqlite_is_real_query(GWBUF* query);
 static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnames);
+static bool qc_sqlite_peek_table_names(GWBUF* query, bool fullnames,
+                                       const char* const** names, int* tblsize);
 static char* qc_sqlite_get_canonical(GWBUF* query);
 static bool qc_sqlite_query_has_clause(GWBUF* query);
 static char* qc_sqlite_get_affected_fields(GWBUF* query);
 static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep);
+static bool qc_sqlite_get_cache_stats(QC_CACHE_STATS* stats);
+static bool qc_sqlite_get_function_names(GWBUF* query, char*** names, int* sizep);
+static void qc_sqlite_cache_stats_free(void);
 
 static bool get_key_and_value(char* arg, const char** pkey, const char** pvalue)
 {
@@ -2374,6 +3639,7 @@ static bool get_key_and_value(char* arg, const char** pkey, const char** pvalue)
 }
 
 static char ARG_LOG_UNRECOGNIZED_STATEMENTS[] = "log_unrecognized_statements";
+static char ARG_CACHE_SIZE[] = "cache_size";
 
 static bool qc_sqlite_init(const char* args)
 {
@@ -2381,52 +3647,97 @@ static bool qc_sqlite_init(const char* args)
     assert(!this_unit.initialized);
 
     qc_log_level_t log_level = QC_LOG_NOTHING;
+    int cache_size = QC_CACHE_DEFAULT_SIZE;
 
     if (args)
     {
         char arg[strlen(args) + 1];
         strcpy(arg, args);
 
-        const char* key;
-        const char* value;
+        char* saveptr;
 
-        if (get_key_and_value(arg, &key, &value))
+        // The arguments are given as "key1=value1,key2=value2".
+        for (char* token = strtok_r(arg, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr))
         {
-            if (strcmp(key, ARG_LOG_UNRECOGNIZED_STATEMENTS) == 0)
+            const char* key;
+            const char* value;
+
+            if (get_key_and_value(token, &key, &value))
             {
                 char *end;
 
                 long l = strtol(value, &end, 0);
 
-                if ((*end == 0) && (l >= QC_LOG_NOTHING) && (l <= QC_LOG_NON_TOKENIZED))
+                if (strcmp(key, ARG_LOG_UNRECOGNIZED_STATEMENTS) == 0)
                 {
-                    log_level = l;
+                    if ((*end == 0) && (l >= QC_LOG_NOTHING) && (l <= QC_LOG_NON_TOKENIZED))
+                    {
+                        log_level = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a number between %d and %d.",
+                                    value, QC_LOG_NOTHING, QC_LOG_NON_TOKENIZED);
+                    }
+                }
+                else if (strcmp(key, ARG_CACHE_SIZE) == 0)
+                {
+                    if ((*end == 0) && (l >= 0) && (l <= INT_MAX))
+                    {
+                        cache_size = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a valid cache size.", value);
+                    }
                 }
                 else
                 {
-                    MXS_WARNING("qc_sqlite: '%s' is not a number between %d and %d.",
-                                value, QC_LOG_NOTHING, QC_LOG_NON_TOKENIZED);
+                    MXS_WARNING("qc_sqlite: '%s' is not a recognized argument.", key);
                 }
             }
             else
             {
-                MXS_WARNING("qc_sqlite: '%s' is not a recognized argument.", key);
+                MXS_WARNING("qc_sqlite: '%s' is not a recognized argument string.", token);
             }
         }
-        else
+    }
+
+    this_unit.cache_size = cache_size;
+
+    if (cache_size > 0)
+    {
+        this_unit.cache_hits = ts_stats_alloc();
+        this_unit.cache_misses = ts_stats_alloc();
+        this_unit.cache_evictions = ts_stats_alloc();
+        this_unit.cache_entries = ts_gauge_alloc();
+
+        if (!this_unit.cache_hits || !this_unit.cache_misses ||
+            !this_unit.cache_evictions || !this_unit.cache_entries)
         {
-            MXS_WARNING("qc_sqlite: '%s' is not a recognized argument string.", args);
+            MXS_ERROR("qc_sqlite: Could not allocate the statistics of the classification "
+                      "cache, the cache is disabled.");
+            qc_sqlite_cache_stats_free();
+            this_unit.cache_size = 0;
         }
     }
 
+    // The parser allocates from the arena of the thread. Without it, sqlite
+    // keeps on using the heap. The memory statistics of sqlite are not used.
+    if ((sqlite3_config(SQLITE_CONFIG_MALLOC, &arena_sqlite3_mem_methods) != SQLITE_OK) ||
+        (sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0) != SQLITE_OK))
+    {
+        MXS_WARNING("qc_sqlite: Could not configure the memory allocation of sqlite.");
+    }
+
     if (sqlite3_initialize() == 0)
     {
         this_unit.initialized = true;
 
-        if (qc_sqlite_thread_init())
-        {
-            init_builtin_functions();
+        bool thread_inited = qc_sqlite_thread_init();
 
+        if (thread_inited && init_builtin_functions())
+        {
             this_unit.log_level = log_level;
 
             if (log_level != QC_LOG_NOTHING)
@@ -2456,6 +3767,11 @@ static bool qc_sqlite_init(const char* args)
         }
         else
         {
+            if (thread_inited)
+            {
+                qc_sqlite_thread_end();
+            }
+
             this_unit.initialized = false;
 
             sqlite3_shutdown();
@@ -2477,6 +3793,7 @@ static void qc_sqlite_end(void)
     finish_builtin_functions();
 
     qc_sqlite_thread_end();
+    qc_sqlite_cache_stats_free();
 
     sqlite3_shutdown();
     this_unit.initialized = false;
@@ -2494,6 +3811,13 @@ static bool qc_sqlite_thread_init(void)
     {
         this_thread.initialized = true;
 
+        if ((this_unit.cache_size > 0) &&
+            !(this_thread.cache = strhash_alloc(this_unit.cache_size, NULL)))
+        {
+            MXS_ERROR("qc_sqlite: Could not allocate the classification cache for thread %lu, "
+                      "statements are always parsed.", (unsigned long) pthread_self());
+        }
+
         MXS_INFO("qc_sqlite: In-memory sqlite database successfully opened for thread %lu.",
                  (unsigned long) pthread_self());
     }
@@ -2522,6 +3846,14 @@ static void qc_sqlite_thread_end(void)
     }
 
     this_thread.db = NULL;
+
+    if (this_thread.cache)
+    {
+        cache_free();
+    }
+
+    arena_free_chunks();
+
     this_thread.initialized = false;
 }
 
@@ -2531,7 +3863,18 @@ static qc_parse_result_t qc_sqlite_parse(GWBUF* query)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ALL);
+
+    return info ? info->status : QC_QUERY_INVALID;
+}
+
+static qc_parse_result_t qc_sqlite_parse_collect(GWBUF* query, uint32_t collect)
+{
+    QC_TRACE();
+    ss_dassert(this_unit.initialized);
+    ss_dassert(this_thread.initialized);
+
+    QC_SQLITE_INFO* info = get_query_info(query, collect);
 
     return info ? info->status : QC_QUERY_INVALID;
 }
@@ -2543,7 +3886,7 @@ static uint32_t qc_sqlite_get_type(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     uint32_t types = QUERY_TYPE_UNKNOWN;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2571,7 +3914,7 @@ static qc_query_op_t qc_sqlite_get_operation(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     qc_query_op_t op = QUERY_OP_UNDEFINED;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2599,7 +3942,7 @@ static char* qc_sqlite_get_created_table_name(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     char* created_table_name = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2630,7 +3973,7 @@ static bool qc_sqlite_is_drop_table_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_drop_table = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2658,7 +4001,7 @@ static bool qc_sqlite_is_real_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_real_query = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2686,7 +4029,7 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
     ss_dassert(this_thread.initialized);
 
     char** table_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_TABLES);
 
     if (info)
     {
@@ -2723,6 +4066,50 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
     return table_names;
 }
 
+static bool qc_sqlite_peek_table_names(GWBUF* query, bool fullnames,
+                                       const char* const** names, int* tblsize)
+{
+    QC_TRACE();
+    ss_dassert(this_unit.initialized);
+    ss_dassert(this_thread.initialized);
+
+    static const char* const no_names[] = { NULL };
+
+    *names = no_names;
+    *tblsize = 0;
+
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_TABLES);
+
+    if (info)
+    {
+        if (qc_info_is_valid(info->status))
+        {
+            // The names live in the info of the buffer, also when the info
+            // was copied from the classification cache.
+            if (fullnames && info->table_fullnames)
+            {
+                *names = (const char* const*)info->table_fullnames;
+                *tblsize = info->table_fullnames_len;
+            }
+            else if (!fullnames && info->table_names)
+            {
+                *names = (const char* const*)info->table_names;
+                *tblsize = info->table_names_len;
+            }
+        }
+        else
+        {
+            MXS_ERROR("qc_sqlite: The query operation was not resolved. Response not valid.");
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
+
+    return true;
+}
+
 static char* qc_sqlite_get_canonical(GWBUF* query)
 {
     QC_TRACE();
@@ -2741,7 +4128,7 @@ static bool qc_sqlite_query_has_clause(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool has_clause = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2769,7 +4156,7 @@ static char* qc_sqlite_get_affected_fields(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     char* affected_fields = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_FIELDS);
 
     if (info)
     {
@@ -2802,7 +4189,7 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     ss_dassert(this_thread.initialized);
 
     char** database_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_DATABASES);
 
     if (info)
     {
@@ -2826,6 +4213,74 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     return database_names;
 }
 
+static bool qc_sqlite_get_function_names(GWBUF* query, char*** names, int* sizep)
+{
+    QC_TRACE();
+    ss_dassert(this_unit.initialized);
+    ss_dassert(this_thread.initialized);
+
+    bool valid = false;
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_FUNCTIONS);
+
+    *names = NULL;
+    *sizep = 0;
+
+    if (info)
+    {
+        if (qc_info_is_valid(info->status))
+        {
+            if (info->function_names)
+            {
+                *names = copy_string_array(info->function_names, sizep);
+            }
+
+            valid = true;
+        }
+        else
+        {
+            MXS_ERROR("qc_sqlite: The query operation was not resolved. Response not valid.");
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
+
+    return valid;
+}
+
+static bool qc_sqlite_get_cache_stats(QC_CACHE_STATS* stats)
+{
+    QC_TRACE();
+    ss_dassert(this_unit.initialized);
+
+    bool enabled = this_unit.cache_size > 0;
+
+    if (enabled)
+    {
+        stats->size = this_unit.cache_size;
+        stats->entries = ts_gauge_get(this_unit.cache_entries);
+        stats->hits = ts_stats_sum(this_unit.cache_hits);
+        stats->misses = ts_stats_sum(this_unit.cache_misses);
+        stats->evictions = ts_stats_sum(this_unit.cache_evictions);
+    }
+
+    return enabled;
+}
+
+static void qc_sqlite_cache_stats_free(void)
+{
+    ts_stats_free(this_unit.cache_hits);
+    ts_stats_free(this_unit.cache_misses);
+    ts_stats_free(this_unit.cache_evictions);
+    ts_gauge_free(this_unit.cache_entries);
+
+    this_unit.cache_hits = NULL;
+    this_unit.cache_misses = NULL;
+    this_unit.cache_evictions = NULL;
+    this_unit.cache_entries = NULL;
+}
+
 /**
  * EXPORTS
  */
@@ -2849,6 +4304,10 @@ static QUERY_CLASSIFIER qc =
     qc_sqlite_query_has_clause,
     qc_sqlite_get_affected_fields,
     qc_sqlite_get_database_names,
+    qc_sqlite_get_cache_stats,
+    qc_sqlite_parse_collect,
+    qc_sqlite_peek_table_names,
+    qc_sqlite_get_function_names,
 };
 
 
@@ -58,3 +58,5 @@ select @v, coercibility(@v);
 select @@version, @@version_comment, @@version_compile_machine,       @@version_compile_os;
 SELECT @x_str_1, @x_int_1, @x_int_2, @x_int_3;
 SELECT user,host,password,insert_priv FROM user WHERE user=@u AND host=@h;
+SELECT @@GLOBAL.max_connections, @@session.autocommit;
+SELECT v2 FROM t1 WHERE v1 IN ("a", "b") OR v1 IN ('c', 3);
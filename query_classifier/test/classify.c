@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <gwdirs.h>
 #include <log_manager.h>
+#include <statistics.h>
 
 char* append(char* types, const char* type_name, size_t* lenp)
 {
@@ -309,6 +310,7 @@ int main(int argc, char** argv)
         set_datadir(strdup("/tmp"));
         set_langdir(strdup("."));
         set_process_datadir(strdup("/tmp"));
+        ts_stats_init();
 
         if (mxs_log_init(NULL, ".", MXS_LOG_TARGET_DEFAULT))
         {
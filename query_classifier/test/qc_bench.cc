@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qc_bench.cc  Throughput benchmark of the query classifiers
+ *
+ * The statements of the given files are classified by each classifier using
+ * 1 to N threads. For every thread count a JSON object is printed on a line
+ * of its own, containing the throughput, the latency percentiles and the
+ * number of allocations per statement, so that the results of different
+ * releases can be compared mechanically.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gwdirs.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+#include <query_classifier.h>
+#include <statistics.h>
+#include "testreader.hh"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+#if defined(__GLIBC__)
+/**
+ * The allocations are counted by interposing the allocation functions of
+ * glibc. As the executable comes first in the symbol lookup, the calls made
+ * by the classifier plugins end up here as well.
+ */
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t n, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+}
+
+static __thread size_t n_allocs;
+
+extern "C" void* malloc(size_t size)
+{
+    ++n_allocs;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size)
+{
+    ++n_allocs;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t size)
+{
+    ++n_allocs;
+    return __libc_realloc(p, size);
+}
+
+extern "C" int posix_memalign(void** pp, size_t alignment, size_t size)
+{
+    ++n_allocs;
+    *pp = __libc_memalign(alignment, size);
+    return *pp ? 0 : ENOMEM;
+}
+
+#define ALLOCS_COUNTED true
+#else
+static size_t n_allocs;
+#define ALLOCS_COUNTED false
+#endif
+
+namespace
+{
+
+char USAGE[] =
+    "usage: qc_bench [-c classifier]... [-A args] [-m type|all] [-r rounds] [-w rounds] "
+    "[-t threads] [-l] file...\n\n"
+    "-c    a classifier to benchmark, may be given several times, default qc_sqlite\n"
+    "-A    arguments for the classifiers\n"
+    "-m    type, only the type of each statement is asked for, as the routers do\n"
+    "      all, the statement is parsed and all information is asked for\n"
+    "      default is type\n"
+    "-r    the number of measured rounds over the statements, default 1\n"
+    "-w    the number of rounds to run before measuring, default 0\n"
+    "-t    the benchmark is run with 1 to this many threads, default 1\n"
+    "-l    the files have one statement per line, as in a query log, instead of\n"
+    "      being in the format of the mysqltest files\n\n"
+    "A JSON object is printed for every classifier and thread count.\n";
+
+enum mode_t
+{
+    MODE_TYPE,
+    MODE_ALL
+};
+
+struct Settings
+{
+    const char* args;
+    mode_t mode;
+    size_t rounds;
+    size_t warmup;
+    size_t threads;
+    bool per_line;
+} settings = { NULL,      // args
+               MODE_TYPE, // mode
+               1,         // rounds
+               0,         // warmup
+               1,         // threads
+               false };   // per_line
+
+/**
+ * The state of a benchmark thread.
+ */
+struct Thread
+{
+    pthread_t tid;
+    QUERY_CLASSIFIER* pClassifier;
+    const vector<string>* pStatements;
+    pthread_barrier_t* pBarrier;
+    vector<long> latencies; // The nanoseconds of every measured statement.
+    size_t allocs;          // The allocations made by the classifier.
+    bool failed;
+};
+
+GWBUF* create_gwbuf(const string& s)
+{
+    size_t len = s.length() + 1;
+    size_t gwbuf_len = len + MYSQL_HEADER_LEN + 1;
+
+    GWBUF* gwbuf = gwbuf_alloc(gwbuf_len);
+
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf))) = len;
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 1)) = (len >> 8);
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 2)) = (len >> 16);
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 3)) = 0x00;
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 4)) = 0x03;
+    memcpy((char*)GWBUF_DATA(gwbuf) + 5, s.c_str(), s.length() + 1);
+
+    return gwbuf;
+}
+
+QUERY_CLASSIFIER* get_classifier(const char* zName, const char* zArgs)
+{
+    size_t len = strlen(zName);
+    char libdir[len + 4];
+
+    sprintf(libdir, "../%s", zName);
+
+    set_libdir(strdup(libdir));
+
+    QUERY_CLASSIFIER* pClassifier = qc_load(zName);
+
+    if (pClassifier)
+    {
+        if (!pClassifier->qc_init(zArgs))
+        {
+            cerr << "error: Could not init classifier " << zName << "." << endl;
+            qc_unload(pClassifier);
+            pClassifier = 0;
+        }
+    }
+    else
+    {
+        cerr << "error: Could not load classifier " << zName << "." << endl;
+    }
+
+    return pClassifier;
+}
+
+void put_classifier(QUERY_CLASSIFIER* pClassifier)
+{
+    pClassifier->qc_end();
+    qc_unload(pClassifier);
+}
+
+void free_strings(char** strings, int n)
+{
+    if (strings)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            free(strings[i]);
+        }
+
+        free(strings);
+    }
+}
+
+/**
+ * Classify a statement the way the mode calls for.
+ */
+void classify(QUERY_CLASSIFIER* pClassifier, GWBUF* pBuf)
+{
+    pClassifier->qc_get_type(pBuf);
+
+    if (settings.mode == MODE_ALL)
+    {
+        int n = 0;
+        char** strings;
+
+        pClassifier->qc_parse(pBuf);
+        pClassifier->qc_get_operation(pBuf);
+        free(pClassifier->qc_get_created_table_name(pBuf));
+        pClassifier->qc_is_drop_table_query(pBuf);
+        pClassifier->qc_is_real_query(pBuf);
+        strings = pClassifier->qc_get_table_names(pBuf, &n, false);
+        free_strings(strings, n);
+        strings = pClassifier->qc_get_table_names(pBuf, &n, true);
+        free_strings(strings, n);
+        pClassifier->qc_query_has_clause(pBuf);
+        free(pClassifier->qc_get_affected_fields(pBuf));
+        strings = pClassifier->qc_get_database_names(pBuf, &n);
+        free_strings(strings, n);
+    }
+}
+
+long nanoseconds_between(const timespec& start, const timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+void run_round(Thread* pThread, bool measured)
+{
+    const vector<string>& statements = *pThread->pStatements;
+
+    for (vector<string>::const_iterator i = statements.begin(); i != statements.end(); ++i)
+    {
+        GWBUF* pBuf = create_gwbuf(*i);
+        timespec start;
+        timespec end;
+
+        size_t allocs = n_allocs;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        classify(pThread->pClassifier, pBuf);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        allocs = n_allocs - allocs;
+
+        gwbuf_free(pBuf);
+
+        if (measured)
+        {
+            pThread->latencies.push_back(nanoseconds_between(start, end));
+            pThread->allocs += allocs;
+        }
+    }
+}
+
+void* run_thread(void* data)
+{
+    Thread* pThread = static_cast<Thread*>(data);
+    QUERY_CLASSIFIER* pClassifier = pThread->pClassifier;
+    const vector<string>& statements = *pThread->pStatements;
+
+    pThread->failed = !pClassifier->qc_thread_init();
+
+    pThread->latencies.reserve(statements.size() * settings.rounds);
+    pThread->allocs = 0;
+
+    // All threads start the warmup together, and the measurement after all
+    // of them have finished the warmup.
+    pthread_barrier_wait(pThread->pBarrier);
+
+    for (size_t round = 0; !pThread->failed && (round < settings.warmup); ++round)
+    {
+        run_round(pThread, false);
+    }
+
+    pthread_barrier_wait(pThread->pBarrier);
+
+    if (!pThread->failed)
+    {
+        for (size_t round = 0; round < settings.rounds; ++round)
+        {
+            run_round(pThread, true);
+        }
+
+        pClassifier->qc_thread_end();
+    }
+
+    return NULL;
+}
+
+long percentile(const vector<long>& sorted, double p)
+{
+    long rv = 0;
+
+    if (!sorted.empty())
+    {
+        size_t i = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        rv = sorted[i];
+    }
+
+    return rv;
+}
+
+string json_string(const char* z)
+{
+    stringstream ss;
+
+    ss << '"';
+
+    for (; z && *z; ++z)
+    {
+        switch (*z)
+        {
+        case '"':
+        case '\\':
+            ss << '\\' << *z;
+            break;
+
+        default:
+            if (static_cast<unsigned char>(*z) < 0x20)
+            {
+                char buf[8];
+                sprintf(buf, "\\u%04x", *z);
+                ss << buf;
+            }
+            else
+            {
+                ss << *z;
+            }
+        }
+    }
+
+    ss << '"';
+
+    return ss.str();
+}
+
+/**
+ * Run the benchmark with a particular number of threads and print the result.
+ *
+ * @return True if all threads could be run.
+ */
+bool run(const char* zName, QUERY_CLASSIFIER* pClassifier,
+         const vector<string>& statements, size_t n_threads)
+{
+    vector<Thread> threads(n_threads);
+    pthread_barrier_t barrier;
+    bool success = true;
+
+    pthread_barrier_init(&barrier, NULL, n_threads + 1);
+
+    for (size_t i = 0; i < n_threads; ++i)
+    {
+        threads[i].pClassifier = pClassifier;
+        threads[i].pStatements = &statements;
+        threads[i].pBarrier = &barrier;
+        threads[i].failed = false;
+
+        if (pthread_create(&threads[i].tid, NULL, run_thread, &threads[i]) != 0)
+        {
+            cerr << "error: Could not create thread." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    timespec start;
+    timespec end;
+
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    QC_CACHE_STATS before = {};
+    bool have_stats = pClassifier->qc_get_cache_stats && pClassifier->qc_get_cache_stats(&before);
+
+    vector<long> latencies;
+    size_t allocs = 0;
+
+    for (size_t i = 0; i < n_threads; ++i)
+    {
+        pthread_join(threads[i].tid, NULL);
+
+        if (threads[i].failed)
+        {
+            success = false;
+        }
+
+        latencies.insert(latencies.end(), threads[i].latencies.begin(), threads[i].latencies.end());
+        allocs += threads[i].allocs;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&barrier);
+
+    if (!success)
+    {
+        cerr << "error: Could not initialize " << zName << " for a thread." << endl;
+        return false;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    long busy = 0;
+
+    for (vector<long>::const_iterator i = latencies.begin(); i != latencies.end(); ++i)
+    {
+        busy += *i;
+    }
+
+    size_t n = latencies.size();
+    double seconds = nanoseconds_between(start, end) / 1e9;
+    // The throughput of a thread is based on the time it spends classifying,
+    // so that the creation of the buffers does not distort it.
+    double per_thread = busy ? n / (busy / 1e9) : 0;
+
+    cout << "{\"classifier\": " << json_string(zName)
+         << ", \"args\": " << json_string(settings.args)
+         << ", \"mode\": \"" << (settings.mode == MODE_ALL ? "all" : "type") << "\""
+         << ", \"threads\": " << n_threads
+         << ", \"statements\": " << n
+         << ", \"seconds\": " << seconds
+         << ", \"statements_per_second\": " << (seconds > 0 ? n / seconds : 0)
+         << ", \"statements_per_second_per_thread\": " << per_thread
+         << ", \"latency_ns\": {"
+         << "\"min\": " << percentile(latencies, 0)
+         << ", \"p50\": " << percentile(latencies, 50)
+         << ", \"p90\": " << percentile(latencies, 90)
+         << ", \"p99\": " << percentile(latencies, 99)
+         << ", \"p999\": " << percentile(latencies, 99.9)
+         << ", \"max\": " << percentile(latencies, 100)
+         << "}";
+
+    if (ALLOCS_COUNTED)
+    {
+        cout << ", \"allocations_per_statement\": " << (n ? static_cast<double>(allocs) / n : 0);
+    }
+
+    QC_CACHE_STATS after;
+
+    // Without a configuration the statistics have a single slot that the
+    // threads would update concurrently, so they are only reported for one.
+    if (have_stats && (n_threads == 1) && pClassifier->qc_get_cache_stats(&after))
+    {
+        cout << ", \"cache\": {"
+             << "\"hits\": " << after.hits - before.hits
+             << ", \"misses\": " << after.misses - before.misses
+             << ", \"evictions\": " << after.evictions - before.evictions
+             << "}";
+    }
+
+    cout << "}" << endl;
+
+    return true;
+}
+
+bool read_statements(istream& in, vector<string>& statements)
+{
+    bool success = true;
+
+    if (settings.per_line)
+    {
+        string line;
+
+        while (std::getline(in, line))
+        {
+            if (!line.empty())
+            {
+                statements.push_back(line);
+            }
+        }
+    }
+    else
+    {
+        TestReader reader(in);
+        TestReader::result_t result;
+        string stmt;
+
+        while ((result = reader.get_statement(stmt)) == TestReader::RESULT_STMT)
+        {
+            statements.push_back(stmt);
+        }
+
+        if (result == TestReader::RESULT_ERROR)
+        {
+            cerr << "error: Cannot handle line " << reader.line() << ": " << stmt << endl;
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int rc = EXIT_SUCCESS;
+    vector<const char*> classifiers;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:A:m:r:w:t:l")) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            classifiers.push_back(optarg);
+            break;
+
+        case 'A':
+            settings.args = optarg;
+            break;
+
+        case 'm':
+            if (strcmp(optarg, "type") == 0)
+            {
+                settings.mode = MODE_TYPE;
+            }
+            else if (strcmp(optarg, "all") == 0)
+            {
+                settings.mode = MODE_ALL;
+            }
+            else
+            {
+                rc = EXIT_FAILURE;
+            }
+            break;
+
+        case 'r':
+            settings.rounds = atoi(optarg);
+            break;
+
+        case 'w':
+            settings.warmup = atoi(optarg);
+            break;
+
+        case 't':
+            settings.threads = atoi(optarg);
+            break;
+
+        case 'l':
+            settings.per_line = true;
+            break;
+
+        default:
+            rc = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if ((rc != EXIT_SUCCESS) || (optind == argc) || (settings.rounds == 0) || (settings.threads == 0))
+    {
+        cout << USAGE << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (classifiers.empty())
+    {
+        classifiers.push_back("qc_sqlite");
+    }
+
+    vector<string> statements;
+
+    for (int i = optind; (rc == EXIT_SUCCESS) && (i < argc); ++i)
+    {
+        ifstream in(argv[i]);
+
+        if (!in || !read_statements(in, statements))
+        {
+            cerr << "error: Could not read " << argv[i] << "." << endl;
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    if (rc == EXIT_SUCCESS)
+    {
+        set_datadir(strdup("/tmp"));
+        set_langdir(strdup("."));
+        set_process_datadir(strdup("/tmp"));
+        ts_stats_init();
+
+        if (mxs_log_init(NULL, ".", MXS_LOG_TARGET_DEFAULT))
+        {
+            for (size_t i = 0; (rc == EXIT_SUCCESS) && (i < classifiers.size()); ++i)
+            {
+                QUERY_CLASSIFIER* pClassifier = get_classifier(classifiers[i], settings.args);
+
+                if (pClassifier)
+                {
+                    for (size_t n = 1; (rc == EXIT_SUCCESS) && (n <= settings.threads); ++n)
+                    {
+                        if (!run(classifiers[i], pClassifier, statements, n))
+                        {
+                            rc = EXIT_FAILURE;
+                        }
+                    }
+
+                    put_classifier(pClassifier);
+                }
+                else
+                {
+                    rc = EXIT_FAILURE;
+                }
+            }
+
+            mxs_log_finish();
+        }
+        else
+        {
+            cerr << "error: Could not initialize log." << endl;
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    return rc;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testclone.c - Classification of clones of a part of a buffer
+ *
+ * A buffer read from a client can hold several statements that are routed
+ * as clones of their own part of the data. The test is run in the build
+ * directory of the query classifier tests and loads qc_sqlite from there.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+#include <gwdirs.h>
+#include <modutil.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+
+static bool
+has_table(GWBUF *buf, const char *table)
+{
+    int n = 0;
+    char **names = qc_get_table_names(buf, &n, false);
+    bool found = n == 1 && strcmp(names[0], table) == 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+
+    return found;
+}
+
+/**
+ * test1    The clones of the statements of a buffer are classified by their
+ *          own statement, also after the whole buffer has been classified
+ *
+ */
+static int
+test1()
+{
+    GWBUF *buffer = gwbuf_append(modutil_create_query("SELECT a FROM t1"),
+                                 modutil_create_query("UPDATE t2 SET b = 1"));
+    size_t first_len;
+
+    ss_dfprintf(stderr, "testclone : Classify the statements of a buffer one by one");
+    buffer = gwbuf_make_contiguous(buffer);
+    ss_info_dassert(buffer && buffer->next == NULL, "The statements should be in one buffer");
+    first_len = MYSQL_GET_PACKET_LEN((uint8_t*)GWBUF_DATA(buffer)) + MYSQL_HEADER_LEN;
+
+    /** The whole buffer is classified by its first statement */
+    ss_info_dassert(qc_get_operation(buffer) == QUERY_OP_SELECT,
+                    "The buffer should be classified as a SELECT");
+
+    GWBUF *first = gwbuf_clone_portion(buffer, 0, first_len);
+    GWBUF *second = gwbuf_clone_portion(buffer, first_len, GWBUF_LENGTH(buffer) - first_len);
+
+    ss_info_dassert(first && second, "The statements should be cloned");
+    ss_info_dassert(qc_get_operation(second) == QUERY_OP_UPDATE,
+                    "The second statement should be classified as an UPDATE");
+    ss_info_dassert(qc_get_type(second) & QUERY_TYPE_WRITE,
+                    "The second statement should be a write");
+    ss_info_dassert(has_table(second, "t2"), "The second statement should update t2");
+    ss_info_dassert(qc_get_operation(first) == QUERY_OP_SELECT,
+                    "The first statement should be classified as a SELECT");
+    ss_info_dassert(qc_get_type(first) & QUERY_TYPE_READ,
+                    "The first statement should be a read");
+    ss_info_dassert(has_table(first, "t1"), "The first statement should read t1");
+    ss_info_dassert(qc_get_operation(second) == QUERY_OP_UPDATE,
+                    "Classifying the first statement should not change the second");
+
+    gwbuf_free(buffer);
+    gwbuf_free(first);
+    gwbuf_free(second);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+
+    set_libdir(strdup("../qc_sqlite/"));
+    ss_info_dassert(qc_init("qc_sqlite", NULL) && qc_thread_init(),
+                    "The query classifier should be initialized");
+
+    result += test1();
+
+    qc_thread_end();
+    qc_end();
+    mxs_log_finish();
+
+    exit(result);
+}
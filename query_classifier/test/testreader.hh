@@ -0,0 +1,70 @@
+#ifndef _TESTREADER_HH
+#define _TESTREADER_HH
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+#include <iostream>
+#include <string>
+
+/**
+ * Reads the statements of a file in the format of the mysqltest files. The
+ * mysqltest commands and the statements that are expected to fail are
+ * skipped. A file with one statement per line is read as such.
+ */
+class TestReader
+{
+public:
+    enum result_t
+    {
+        RESULT_STMT,  // A statement was returned.
+        RESULT_EOF,   // There are no more statements.
+        RESULT_ERROR  // The file contains something that cannot be handled.
+    };
+
+    /**
+     * Create a reader.
+     *
+     * @param in  The stream to read from.
+     */
+    TestReader(std::istream& in);
+
+    /**
+     * Get the next statement.
+     *
+     * @param stmt  The statement, without the delimiter if it is not ';'.
+     *
+     * @return RESULT_STMT if a statement was returned.
+     */
+    result_t get_statement(std::string& stmt);
+
+    /**
+     * @return The number of the line that was read last.
+     */
+    size_t line() const
+    {
+        return m_line;
+    }
+
+private:
+    void skip_block();
+
+private:
+    TestReader(const TestReader&);
+    TestReader& operator = (const TestReader&);
+
+    std::istream& m_in;        // The stream being read.
+    size_t        m_line;      // The line that was read last.
+    char          m_delimiter; // The current statement delimiter.
+};
+
+#endif
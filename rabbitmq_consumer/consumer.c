@@ -25,18 +25,42 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/time.h>
 
+#define DEFAULT_BATCH_SIZE 100
+#define DEFAULT_BATCH_TIMEOUT 1000
+
+/**
+ * A consumed message that is not yet committed to the database
+ */
 typedef struct delivery_t
 {
     uint64_t dtag;
-    amqp_message_t* message;
+    int reply;                  /*< 1 for a reply, 0 for a query */
+    char *tag, *body, *date;
     struct delivery_t *next, *prev;
 } DELIVERY;
 
+/**
+ * A row that is inserted when the batch is committed
+ */
+typedef struct row_t
+{
+    DELIVERY *query;            /*< The query that created the row */
+    DELIVERY *reply;            /*< The latest reply to it, NULL if none */
+    char *date_out;
+    int counter;
+    struct row_t *next;
+} ROW;
+
 typedef struct consumer_t
 {
     char *hostname, *vhost, *user, *passwd, *queue, *dbserver, *dbname, *dbuser, *dbpasswd;
-    DELIVERY* query_stack;
+    DELIVERY *query_stack, *query_tail;   /*< The batch, oldest message first */
+    int n_queued;
+    struct timeval batch_start;
+    int batch_size, batch_timeout;
+    MYSQL_STMT *increment, *update;
     int port, dbport;
 } CONSUMER;
 
@@ -46,10 +70,10 @@ static CONSUMER* c_inst;
 static char* DB_DATABASE = "CREATE DATABASE IF NOT EXISTS %s;";
 static char* DB_TABLE =
     "CREATE TABLE IF NOT EXISTS pairs (tag VARCHAR(64) PRIMARY KEY NOT NULL, query VARCHAR(2048), reply VARCHAR(2048), date_in DATETIME NOT NULL, date_out DATETIME DEFAULT NULL, counter INT DEFAULT 1)";
-static char* DB_INSERT = "INSERT INTO pairs(tag, query, date_in) VALUES ('%s','%s',FROM_UNIXTIME(%s))";
-static char* DB_UPDATE = "UPDATE pairs SET reply='%s', date_out=FROM_UNIXTIME(%s) WHERE tag='%s'";
+static char* DB_INSERT_ROWS = "INSERT INTO pairs(tag, query, reply, date_in, date_out, counter) VALUES ";
+static char* DB_UPDATE = "UPDATE pairs SET reply=?, date_out=FROM_UNIXTIME(?) WHERE tag=?";
 static char* DB_INCREMENT =
-    "UPDATE pairs SET counter = counter+1, date_out=FROM_UNIXTIME(%s) WHERE query='%s'";
+    "UPDATE pairs SET counter = counter+1, date_out=FROM_UNIXTIME(?) WHERE query=?";
 
 void sighndl(int signum)
 {
@@ -114,6 +138,14 @@ int handler(void* user, const char* section, const char* name,
         {
             out_fd = fopen(value, "ab");
         }
+        else if (strcmp(name, "batch_size") == 0)
+        {
+            c_inst->batch_size = atoi(value);
+        }
+        else if (strcmp(name, "batch_timeout") == 0)
+        {
+            c_inst->batch_timeout = atoi(value);
+        }
 
     }
 
@@ -197,87 +229,349 @@ int connectToServer(MYSQL* server)
     return 1;
 }
 
-int sendMessage(MYSQL* server, amqp_message_t* msg)
+/**
+ * Parse a consumed message into a delivery that is committed with the next
+ * batch. The message is of the form "<timestamp>|<query or reply>".
+ *
+ * @param msg The message
+ * @param dtag The delivery tag of the message
+ * @return The delivery or NULL if the message is not valid
+ */
+DELIVERY* parseMessage(amqp_message_t* msg, uint64_t dtag)
 {
-    int buffsz = (int)((msg->body.len + 1) * 2 + 1) +
-                 (int)((msg->properties.correlation_id.len + 1) * 2 + 1) +
-                 strlen(DB_INSERT),
-                 rval = 0;
-    char* saved;
-    char *qstr = calloc(buffsz, sizeof(char)),
-          *rawmsg = calloc((msg->body.len + 1), sizeof(char)),
-           *clnmsg = calloc(((msg->body.len + 1) * 2 + 1), sizeof(char)),
-            *rawdate = calloc((msg->body.len + 1), sizeof(char)),
-             *clndate = calloc(((msg->body.len + 1) * 2 + 1), sizeof(char)),
-              *rawtag = calloc((msg->properties.correlation_id.len + 1), sizeof(char)),
-               *clntag = calloc(((msg->properties.correlation_id.len + 1) * 2 + 1), sizeof(char));
-
+    char *saved, *ptr;
+    char *qstr = calloc(msg->body.len + 1, sizeof(char));
+    DELIVERY* d = calloc(1, sizeof(DELIVERY));
 
+    if (!qstr || !d)
+    {
+        fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+        free(qstr);
+        free(d);
+        return NULL;
+    }
 
     sprintf(qstr, "%.*s", (int)msg->body.len, (char *)msg->body.bytes);
     fprintf(out_fd, "Received: %s\n", qstr);
-    char *ptr = strtok_r(qstr, "|", &saved);
-    sprintf(rawdate, "%s", ptr);
+
+    if (strncmp(msg->properties.message_id.bytes,
+                "query", msg->properties.message_id.len) == 0)
+    {
+        d->reply = 0;
+    }
+    else if (strncmp(msg->properties.message_id.bytes,
+                     "reply", msg->properties.message_id.len) == 0)
+    {
+        d->reply = 1;
+    }
+    else
+    {
+        free(qstr);
+        free(d);
+        return NULL;
+    }
+
+    ptr = strtok_r(qstr, "|", &saved);
+    d->date = strdup(ptr ? ptr : "");
     ptr = strtok_r(NULL, "\n\0", &saved);
     if (ptr == NULL)
     {
         fprintf(out_fd, "Message content not valid.\n");
-        rval = 1;
-        goto cleanup;
+        free(qstr);
+        free(d->date);
+        free(d);
+        return NULL;
     }
-    sprintf(rawmsg, "%s", ptr);
-    sprintf(rawtag, "%.*s", (int)msg->properties.correlation_id.len,
+    d->body = strdup(ptr);
+    d->tag = calloc(msg->properties.correlation_id.len + 1, sizeof(char));
+    sprintf(d->tag, "%.*s", (int)msg->properties.correlation_id.len,
             (char *)msg->properties.correlation_id.bytes);
-    memset(qstr, 0, buffsz);
+    d->dtag = dtag;
+    free(qstr);
 
-    mysql_real_escape_string(server, clnmsg, rawmsg, strnlen(rawmsg, msg->body.len + 1));
-    mysql_real_escape_string(server, clndate, rawdate, strnlen(rawdate, msg->body.len + 1));
-    mysql_real_escape_string(server, clntag, rawtag, strnlen(rawtag, msg->properties.correlation_id.len + 1));
+    return d;
+}
 
-    if (strncmp(msg->properties.message_id.bytes,
-                "query", msg->properties.message_id.len) == 0)
+void freeDelivery(DELIVERY* d)
+{
+    free(d->tag);
+    free(d->body);
+    free(d->date);
+    free(d);
+}
+
+/**
+ * Add a delivery to the batch
+ */
+void queueDelivery(DELIVERY* d)
+{
+    if (c_inst->query_tail)
     {
+        c_inst->query_tail->next = d;
+        d->prev = c_inst->query_tail;
+    }
+    else
+    {
+        c_inst->query_stack = d;
+        gettimeofday(&c_inst->batch_start, NULL);
+    }
+    c_inst->query_tail = d;
+    c_inst->n_queued++;
+}
 
-        sprintf(qstr, DB_INCREMENT, clndate, clnmsg);
-        rval = mysql_query(server, qstr);
+/**
+ * Milliseconds left until the batch must be committed
+ */
+long batchTimeLeft()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long elapsed = (now.tv_sec - c_inst->batch_start.tv_sec) * 1000 +
+                   (now.tv_usec - c_inst->batch_start.tv_usec) / 1000;
+    return elapsed < c_inst->batch_timeout ? c_inst->batch_timeout - elapsed : 0;
+}
 
-        if (mysql_affected_rows(server) == 0)
-        {
-            memset(qstr, 0, buffsz);
-            sprintf(qstr, DB_INSERT, clntag, clnmsg, clndate);
-            rval = mysql_query(server, qstr);
-        }
+void closeStatements()
+{
+    if (c_inst->increment)
+    {
+        mysql_stmt_close(c_inst->increment);
+        c_inst->increment = NULL;
+    }
+    if (c_inst->update)
+    {
+        mysql_stmt_close(c_inst->update);
+        c_inst->update = NULL;
+    }
+}
 
+int prepareStatements(MYSQL* server)
+{
+    if ((c_inst->increment = mysql_stmt_init(server)) == NULL ||
+        (c_inst->update = mysql_stmt_init(server)) == NULL ||
+        mysql_stmt_prepare(c_inst->increment, DB_INCREMENT, strlen(DB_INCREMENT)) ||
+        mysql_stmt_prepare(c_inst->update, DB_UPDATE, strlen(DB_UPDATE)))
+    {
+        fprintf(stderr, "Could not prepare statements:%s\n", mysql_error(server));
+        closeStatements();
+        return 0;
     }
-    else if (strncmp(msg->properties.message_id.bytes,
-                     "reply", msg->properties.message_id.len) == 0)
+    return 1;
+}
+
+/**
+ * Execute a prepared statement with string parameters
+ *
+ * @return 0 on success
+ */
+int executeStatement(MYSQL_STMT* stmt, char** params, int n_params)
+{
+    MYSQL_BIND bind[n_params];
+    unsigned long len[n_params];
+
+    memset(bind, 0, sizeof(bind));
+    for (int i = 0; i < n_params; i++)
     {
+        len[i] = strlen(params[i]);
+        bind[i].buffer_type = MYSQL_TYPE_STRING;
+        bind[i].buffer = params[i];
+        bind[i].buffer_length = len[i];
+        bind[i].length = &len[i];
+    }
 
-        sprintf(qstr, DB_UPDATE, clnmsg, clndate, clntag);
-        rval = mysql_query(server, qstr);
+    if (mysql_stmt_bind_param(stmt, bind) || mysql_stmt_execute(stmt))
+    {
+        fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_stmt_error(stmt));
+        return 1;
+    }
+    return 0;
+}
 
+char* appendValue(MYSQL* server, char* ptr, const char* value, int date)
+{
+    if (value == NULL)
+    {
+        return ptr + sprintf(ptr, "NULL");
     }
-    else
+    ptr += sprintf(ptr, date ? "FROM_UNIXTIME('" : "'");
+    ptr += mysql_real_escape_string(server, ptr, value, strlen(value));
+    return ptr + sprintf(ptr, date ? "')" : "'");
+}
+
+/**
+ * Insert the new rows of a batch with one multi-row INSERT
+ *
+ * @return 0 on success
+ */
+int insertRows(MYSQL* server, ROW* rows)
+{
+    size_t buffsz = strlen(DB_INSERT_ROWS) + 1;
+    int rval;
+
+    for (ROW* r = rows; r; r = r->next)
     {
-        rval = 1;
-        goto cleanup;
+        buffsz += (strlen(r->query->tag) + strlen(r->query->body) + strlen(r->query->date)) * 2 +
+                  (r->reply ? strlen(r->reply->body) * 2 : 0) +
+                  (r->date_out ? strlen(r->date_out) * 2 : 0) + 128;
     }
 
+    char *qstr = malloc(buffsz);
 
-    if (rval)
+    if (!qstr)
+    {
+        fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+        return 1;
+    }
+
+    char *ptr = qstr + sprintf(qstr, "%s", DB_INSERT_ROWS);
+
+    for (ROW* r = rows; r; r = r->next)
+    {
+        ptr += sprintf(ptr, r == rows ? "(" : ",(");
+        ptr = appendValue(server, ptr, r->query->tag, 0);
+        *ptr++ = ',';
+        ptr = appendValue(server, ptr, r->query->body, 0);
+        *ptr++ = ',';
+        ptr = appendValue(server, ptr, r->reply ? r->reply->body : NULL, 0);
+        *ptr++ = ',';
+        ptr = appendValue(server, ptr, r->query->date, 1);
+        *ptr++ = ',';
+        ptr = appendValue(server, ptr, r->date_out, 1);
+        ptr += sprintf(ptr, ",%d)", r->counter);
+    }
+
+    if ((rval = mysql_real_query(server, qstr, ptr - qstr)))
     {
         fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_error(server));
-        goto cleanup;
     }
 
-cleanup:
     free(qstr);
-    free(rawmsg);
-    free(clnmsg);
-    free(rawdate);
-    free(clndate);
-    free(rawtag);
-    free(clntag);
+    return rval;
+}
+
+/**
+ * Commit the batch of consumed messages to the database in one transaction
+ * and acknowledge them to the broker. A query that is not yet in the pairs
+ * table becomes a row that is inserted at the end of the batch, later
+ * messages in the same batch update that row in memory. If the transaction
+ * fails, the messages are returned to the queue.
+ *
+ * @return 0 on success
+ */
+int flushBatch(MYSQL* server, amqp_connection_state_t conn, int channel)
+{
+    ROW *rows = NULL, *last_row = NULL;
+    DELIVERY* d;
+    int rval = 0;
+
+    if (c_inst->query_stack == NULL)
+    {
+        return 0;
+    }
+
+    if (c_inst->increment == NULL && !prepareStatements(server))
+    {
+        rval = 1;
+    }
+    else if (mysql_query(server, "START TRANSACTION"))
+    {
+        fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_error(server));
+        rval = 1;
+    }
+
+    for (d = c_inst->query_stack; d && rval == 0; d = d->next)
+    {
+        ROW* r = rows;
+
+        while (r && strcmp(d->reply ? r->query->tag : r->query->body,
+                           d->reply ? d->tag : d->body) != 0)
+        {
+            r = r->next;
+        }
+
+        if (r)
+        {
+            if (d->reply)
+            {
+                r->reply = d;
+            }
+            else
+            {
+                r->counter++;
+            }
+            r->date_out = d->date;
+        }
+        else if (d->reply)
+        {
+            char* params[] = {d->body, d->date, d->tag};
+            rval = executeStatement(c_inst->update, params, 3);
+        }
+        else
+        {
+            char* params[] = {d->date, d->body};
+
+            if ((rval = executeStatement(c_inst->increment, params, 2)) == 0 &&
+                mysql_stmt_affected_rows(c_inst->increment) == 0)
+            {
+                if ((r = calloc(1, sizeof(ROW))) == NULL)
+                {
+                    fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+                    rval = 1;
+                    break;
+                }
+                r->query = d;
+                r->counter = 1;
+
+                if (last_row)
+                {
+                    last_row->next = r;
+                }
+                else
+                {
+                    rows = r;
+                }
+                last_row = r;
+            }
+        }
+    }
+
+    if (rval == 0 && rows)
+    {
+        rval = insertRows(server, rows);
+    }
+
+    if (rval == 0 && (rval = mysql_commit(server)))
+    {
+        fprintf(stderr, "Could not commit to SQL server:%s\n", mysql_error(server));
+    }
+
+    if (rval == 0)
+    {
+        amqp_basic_ack(conn, channel, c_inst->query_tail->dtag, 1);
+    }
+    else
+    {
+        /** The statements are prepared again in case the connection was lost */
+        mysql_rollback(server);
+        closeStatements();
+        amqp_basic_nack(conn, channel, c_inst->query_tail->dtag, 1, 1);
+    }
+
+    while (rows)
+    {
+        ROW* r = rows->next;
+        free(rows);
+        rows = r;
+    }
+
+    while (c_inst->query_stack)
+    {
+        d = c_inst->query_stack->next;
+        freeDelivery(c_inst->query_stack);
+        c_inst->query_stack = d;
+    }
+    c_inst->query_tail = NULL;
+    c_inst->n_queued = 0;
 
     return rval;
 }
@@ -412,6 +706,9 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    c_inst->batch_size = DEFAULT_BATCH_SIZE;
+    c_inst->batch_timeout = DEFAULT_BATCH_TIMEOUT;
+
     if (signal(SIGINT, sighndl) == SIG_IGN)
     {
         signal(SIGINT, SIG_IGN);
@@ -532,13 +829,31 @@ int main(int argc, char** argv)
 
     while (all_ok)
     {
+        if (c_inst->query_stack)
+        {
+            long left = batchTimeLeft();
+            timeout.tv_sec = left / 1000;
+            timeout.tv_usec = (left % 1000) * 1000;
+        }
+        else
+        {
+            timeout.tv_sec = 1;
+            timeout.tv_usec = 0;
+        }
 
         status = amqp_simple_wait_frame_noblock(conn, &frame, &timeout);
 
         /**No frames to read from server, possibly out of messages*/
         if (status == AMQP_STATUS_TIMEOUT)
         {
-            sleep(timeout.tv_sec);
+            if (c_inst->query_stack)
+            {
+                flushBatch(&db_inst, conn, channel);
+            }
+            else
+            {
+                sleep(timeout.tv_sec);
+            }
             continue;
         }
 
@@ -547,21 +862,29 @@ int main(int argc, char** argv)
 
             amqp_basic_deliver_t* decoded = (amqp_basic_deliver_t*)frame.payload.method.decoded;
 
+            uint64_t dtag = decoded->delivery_tag;
+
             amqp_read_message(conn, channel, reply, 0);
 
-            if (sendMessage(&db_inst, reply))
+            DELIVERY* d = parseMessage(reply, dtag);
+            amqp_destroy_message(reply);
+
+            if (d == NULL)
             {
 
                 fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received malformed message.\n");
-                amqp_basic_reject(conn, channel, decoded->delivery_tag, 0);
-                amqp_destroy_message(reply);
+                amqp_basic_reject(conn, channel, dtag, 0);
 
             }
             else
             {
 
-                amqp_basic_ack(conn, channel, decoded->delivery_tag, 0);
-                amqp_destroy_message(reply);
+                queueDelivery(d);
+
+                if (c_inst->n_queued >= c_inst->batch_size || batchTimeLeft() == 0)
+                {
+                    flushBatch(&db_inst, conn, channel);
+                }
 
             }
 
@@ -576,9 +899,11 @@ int main(int argc, char** argv)
 
     }
 
+    flushBatch(&db_inst, conn, channel);
     fprintf(out_fd, "Shutting down...\n");
 error:
 
+    closeStatements();
     mysql_close(&db_inst);
     mysql_library_end();
     if (c_inst && c_inst->query_stack)
@@ -587,8 +912,7 @@ error:
         while (c_inst->query_stack)
         {
             DELIVERY* d = c_inst->query_stack->next;
-            amqp_destroy_message(c_inst->query_stack->message);
-            free(c_inst->query_stack);
+            freeDelivery(c_inst->query_stack);
             c_inst->query_stack = d;
         }
 
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file affinity.c - Pinning of the polling threads to CPUs
+ *
+ * The value of the thread_affinity parameter is either a list of CPUs, e.g.
+ * 0-7,16-23, or auto. With a list, the polling threads are pinned to the
+ * CPUs in the order of the list. With auto, the threads are spread over the
+ * NUMA nodes found in /sys/devices/system/node, so that consecutive threads
+ * are on different nodes.
+ *
+ * A thread is pinned before it allocates anything, so the pages of its
+ * buffer pool and of its malloc arena are placed on its own node by the
+ * kernel when they are first touched.
+ */
+
+#include <affinity.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <glob.h>
+#include <log_manager.h>
+
+#define NODE_PATH "/sys/devices/system/node"
+
+/** The CPU of each polling thread, -1 if the thread is not pinned */
+static int *thread_cpus = NULL;
+static int n_thread_cpus = 0;
+
+/**
+ * Parse a list of CPUs
+ *
+ * @param value List of CPUs and ranges of CPUs separated by commas
+ * @param cpus  Array of AFFINITY_MAX_CPUS where the CPUs are stored, or NULL
+ * @return Number of CPUs in the list, -1 if the list is not valid
+ */
+static int parse_cpu_list(const char *value, int *cpus)
+{
+    const char *p = value;
+    int n = 0;
+
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0)
+        {
+            return -1;
+        }
+
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+
+            if (end == p || last < first)
+            {
+                return -1;
+            }
+        }
+
+        if (last >= AFFINITY_MAX_CPUS || n + (last - first) >= AFFINITY_MAX_CPUS)
+        {
+            return -1;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (cpus)
+            {
+                cpus[n] = cpu;
+            }
+            n++;
+        }
+
+        p = end;
+
+        while (isspace((unsigned char)*p))
+        {
+            p++;
+        }
+
+        if (*p == ',' && p[1])
+        {
+            p++;
+        }
+        else if (*p)
+        {
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Read the CPUs of a NUMA node
+ *
+ * @param node The node
+ * @param cpus Array of AFFINITY_MAX_CPUS where the CPUs are stored
+ * @return Number of CPUs of the node, 0 if they could not be read
+ */
+static int read_node_cpus(int node, int *cpus)
+{
+    char path[64];
+    char line[4096];
+    int n = 0;
+
+    snprintf(path, sizeof(path), NODE_PATH "/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+
+    if (file)
+    {
+        if (fgets(line, sizeof(line), file))
+        {
+            line[strcspn(line, "\n")] = '\0';
+            n = parse_cpu_list(line, cpus);
+        }
+        fclose(file);
+    }
+
+    return n > 0 ? n : 0;
+}
+
+/**
+ * Find the CPUs that the threads are spread over with the auto setting
+ *
+ * The CPUs of the nodes are interleaved so that the first CPU of each node
+ * comes first, then the second CPU of each node and so on. Without NUMA
+ * information the CPUs that the process may use are used in order.
+ *
+ * @param cpus Array of AFFINITY_MAX_CPUS where the CPUs are stored
+ * @return Number of CPUs
+ */
+static int auto_cpus(int *cpus)
+{
+    glob_t nodes;
+    int n = 0;
+
+    if (glob(NODE_PATH "/node[0-9]*", 0, NULL, &nodes) == 0)
+    {
+        int n_nodes = nodes.gl_pathc;
+        int (*node_cpus)[AFFINITY_MAX_CPUS] = malloc(n_nodes * sizeof(*node_cpus));
+        int *counts = calloc(n_nodes, sizeof(int));
+
+        if (node_cpus && counts)
+        {
+            for (int i = 0; i < n_nodes; i++)
+            {
+                int node = atoi(nodes.gl_pathv[i] + strlen(NODE_PATH "/node"));
+                counts[i] = read_node_cpus(node, node_cpus[i]);
+            }
+
+            for (int k = 0; n < AFFINITY_MAX_CPUS; k++)
+            {
+                int added = 0;
+
+                for (int i = 0; i < n_nodes && n < AFFINITY_MAX_CPUS; i++)
+                {
+                    if (k < counts[i])
+                    {
+                        cpus[n++] = node_cpus[i][k];
+                        added++;
+                    }
+                }
+
+                if (added == 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        free(node_cpus);
+        free(counts);
+        globfree(&nodes);
+    }
+
+    if (n == 0)
+    {
+        cpu_set_t set;
+
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE && cpu < AFFINITY_MAX_CPUS; cpu++)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus[n++] = cpu;
+                }
+            }
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Check whether a value of the thread_affinity parameter is valid
+ *
+ * @param value The value
+ * @return True if the value is none, auto or a list of CPUs
+ */
+bool affinity_valid(const char *value)
+{
+    return strcmp(value, "none") == 0 || strcmp(value, "auto") == 0 ||
+           parse_cpu_list(value, NULL) > 0;
+}
+
+/**
+ * Assign the CPUs to the polling threads
+ *
+ * This must be called before the polling threads are started.
+ *
+ * @param value     The value of the thread_affinity parameter, NULL for none
+ * @param n_threads Number of polling threads
+ * @return True on success
+ */
+bool affinity_init(const char *value, int n_threads)
+{
+    int cpus[AFFINITY_MAX_CPUS];
+    int n_cpus;
+
+    if (value == NULL || strcmp(value, "none") == 0)
+    {
+        return true;
+    }
+
+    n_cpus = strcmp(value, "auto") == 0 ? auto_cpus(cpus) : parse_cpu_list(value, cpus);
+
+    if (n_cpus <= 0 || (thread_cpus = malloc(n_threads * sizeof(int))) == NULL)
+    {
+        MXS_ERROR("Could not assign CPUs to the threads with thread_affinity=%s.", value);
+        return false;
+    }
+
+    if (n_cpus < n_threads)
+    {
+        MXS_WARNING("There are %d threads but thread_affinity=%s has only %d CPUs, "
+                    "some threads share a CPU.", n_threads, value, n_cpus);
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        thread_cpus[i] = cpus[i % n_cpus];
+    }
+
+    n_thread_cpus = n_threads;
+    return true;
+}
+
+/**
+ * Get the CPU of a polling thread
+ *
+ * @param thread_id The polling thread
+ * @return The CPU or -1 if the thread is not pinned
+ */
+int affinity_thread_cpu(int thread_id)
+{
+    return thread_id >= 0 && thread_id < n_thread_cpus ? thread_cpus[thread_id] : -1;
+}
+
+/**
+ * Get the NUMA node of a CPU
+ *
+ * @param cpu The CPU
+ * @return The node or -1 if it is not known
+ */
+int affinity_cpu_node(int cpu)
+{
+    glob_t nodes;
+    char pattern[64];
+    int node = -1;
+
+    snprintf(pattern, sizeof(pattern), NODE_PATH "/node[0-9]*/cpu%d", cpu);
+
+    if (glob(pattern, 0, NULL, &nodes) == 0)
+    {
+        node = atoi(nodes.gl_pathv[0] + strlen(NODE_PATH "/node"));
+        globfree(&nodes);
+    }
+
+    return node;
+}
+
+/**
+ * Pin the calling thread to the CPU of a polling thread
+ *
+ * @param thread_id The polling thread
+ */
+void affinity_pin_thread(int thread_id)
+{
+    int cpu = affinity_thread_cpu(thread_id);
+
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        int err;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) == 0)
+        {
+            MXS_INFO("Thread %d is pinned to CPU %d on NUMA node %d.",
+                     thread_id, cpu, affinity_cpu_node(cpu));
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_WARNING("Failed to pin thread %d to CPU %d: %s",
+                        thread_id, cpu, strerror_r(err, errbuf, sizeof(errbuf)));
+        }
+    }
+}
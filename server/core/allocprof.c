@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file allocprof.c  Sampling profiler of the buffer, DCB and session allocations
+ *
+ * Each thread counts down the allocations it makes and samples one when the
+ * count reaches zero. The count is reset to a random value averaging the
+ * rate so that allocations that repeat with the same period as the rate are
+ * not always or never sampled.
+ *
+ * The allocation sites of a thread are kept in an open addressing table of
+ * its own that only the thread adds to. A site is published by writing its
+ * hash last, the readers skip the slots whose hash is zero. The counters of
+ * a site are updated with atomic additions, as the objects sampled by one
+ * thread may be freed by any thread. The tables are never freed, the samples
+ * that are still outstanding refer to their sites.
+ *
+ * The counts and bytes are estimates of all the allocations, each sample is
+ * weighted with the rate at the time it was taken.
+ */
+
+#include <allocprof.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <execinfo.h>
+#include <dcb.h>
+#include <spinlock.h>
+#include <platform.h>
+#include <random_jkiss.h>
+#include <log_manager.h>
+
+/** Frames recorded per allocation site */
+#define ALLOCPROF_DEPTH 12
+/** Allocation sites per thread, a power of two */
+#define ALLOCPROF_SITES 1024
+/** Sites shown by allocprof_print */
+#define ALLOCPROF_TOP   20
+
+typedef struct alloc_site
+{
+    volatile uint64_t hash;     /*< Hash of the stack and kind, 0 if the slot is free */
+    allocprof_kind_t kind;      /*< The kind of the objects */
+    int             depth;      /*< Frames in stack */
+    void            *stack[ALLOCPROF_DEPTH]; /*< The stack of the allocation */
+    int64_t         n_samples;  /*< Samples taken */
+    int64_t         n_alloc;    /*< Estimated allocations */
+    int64_t         n_free;     /*< Estimated releases */
+    int64_t         bytes_alloc; /*< Estimated bytes allocated */
+    int64_t         bytes_free; /*< Estimated bytes released */
+    int64_t         n_lifetimes; /*< Released samples */
+    int64_t         lifetime_ms; /*< Total lifetime of the released samples */
+} ALLOC_SITE;
+
+struct alloc_sample
+{
+    ALLOC_SITE      *site;      /*< The allocation site */
+    int64_t         size;       /*< The size of the object */
+    int64_t         weight;     /*< The rate when the sample was taken */
+    uint64_t        born_ms;    /*< When the object was allocated */
+};
+
+typedef struct alloc_table
+{
+    ALLOC_SITE          sites[ALLOCPROF_SITES];
+    int                 n_sites;    /*< Used slots */
+    int                 n_dropped;  /*< Samples dropped as the table was full */
+    struct alloc_table  *next;      /*< Next table in all_tables */
+} ALLOC_TABLE;
+
+volatile int allocprof_rate = 0;
+
+static thread_local ALLOC_TABLE *thread_table = NULL;
+static thread_local int countdown = 0;
+static ALLOC_TABLE *all_tables = NULL;
+static SPINLOCK all_tables_lock = SPINLOCK_INIT;
+
+static const char *allocprof_kind_names[ALLOCPROF_N_KINDS] =
+{
+    "buffer",
+    "DCB",
+    "session"
+};
+
+static inline uint64_t
+allocprof_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Set the sampling rate. The samples taken before are kept.
+ *
+ * @param rate One in this many allocations is sampled, 0 disables the profiler
+ */
+void
+allocprof_set_rate(int rate)
+{
+    allocprof_rate = rate > 0 ? rate : 0;
+    if (rate > 0)
+    {
+        MXS_NOTICE("Allocation profiler samples one in %d allocations.", rate);
+    }
+    else
+    {
+        MXS_NOTICE("Allocation profiler disabled.");
+    }
+}
+
+/**
+ * Return the site table of the calling thread, allocating it on first use
+ *
+ * @return The table or NULL if memory allocation failed
+ */
+static ALLOC_TABLE *
+allocprof_table()
+{
+    if (thread_table == NULL &&
+        (thread_table = (ALLOC_TABLE *)calloc(1, sizeof(ALLOC_TABLE))) != NULL)
+    {
+        spinlock_acquire(&all_tables_lock);
+        thread_table->next = all_tables;
+        all_tables = thread_table;
+        spinlock_release(&all_tables_lock);
+    }
+    return thread_table;
+}
+
+/**
+ * Find or add the site of a stack in the table of the calling thread
+ *
+ * @param table The table of the calling thread
+ * @param kind  The kind of the object
+ * @param stack The frames of the stack
+ * @param depth Number of frames
+ * @return The site or NULL if the table is full
+ */
+static ALLOC_SITE *
+allocprof_site(ALLOC_TABLE *table, allocprof_kind_t kind, void **stack, int depth)
+{
+    uint64_t hash = 14695981039346656037ULL ^ kind;
+
+    for (int i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (uintptr_t)stack[i]) * 1099511628211ULL;
+    }
+    hash |= 1;
+
+    for (unsigned int i = hash, n = 0; n < ALLOCPROF_SITES; i++, n++)
+    {
+        ALLOC_SITE *site = &table->sites[i & (ALLOCPROF_SITES - 1)];
+
+        if (site->hash == hash && site->kind == kind && site->depth == depth &&
+            memcmp(site->stack, stack, depth * sizeof(void *)) == 0)
+        {
+            return site;
+        }
+
+        if (site->hash == 0)
+        {
+            /** The table is kept at most three quarters full */
+            if (table->n_sites >= ALLOCPROF_SITES / 4 * 3)
+            {
+                break;
+            }
+            site->kind = kind;
+            site->depth = depth;
+            memcpy(site->stack, stack, depth * sizeof(void *));
+            __atomic_store_n(&site->hash, hash, __ATOMIC_RELEASE);
+            table->n_sites++;
+            return site;
+        }
+    }
+
+    table->n_dropped++;
+    return NULL;
+}
+
+/**
+ * Sample an allocation if the countdown of the calling thread has reached
+ * zero. Called through allocprof_alloc only when the profiler is enabled.
+ *
+ * @param sample The sample pointer of the object
+ * @param kind   The kind of the object
+ * @param size   The size of the object in bytes
+ */
+void
+allocprof_sample(struct alloc_sample **sample, allocprof_kind_t kind, size_t size)
+{
+    int rate = allocprof_rate;
+
+    if (--countdown > 0 || rate <= 0)
+    {
+        return;
+    }
+    countdown = 1 + random_jkiss() % (2 * rate);
+
+    ALLOC_TABLE *table = allocprof_table();
+    void *stack[ALLOCPROF_DEPTH + 1];
+    int depth;
+
+    /** The first frame is this function */
+    if (table == NULL || (depth = backtrace(stack, ALLOCPROF_DEPTH + 1) - 1) <= 0)
+    {
+        return;
+    }
+
+    ALLOC_SITE *site = allocprof_site(table, kind, stack + 1, depth);
+    struct alloc_sample *s;
+
+    if (site == NULL || (s = (struct alloc_sample *)malloc(sizeof(*s))) == NULL)
+    {
+        return;
+    }
+
+    s->site = site;
+    s->size = size;
+    s->weight = rate;
+    s->born_ms = allocprof_now();
+    __atomic_add_fetch(&site->n_samples, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->n_alloc, rate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->bytes_alloc, s->size * rate, __ATOMIC_RELAXED);
+    *sample = s;
+}
+
+/**
+ * Release the sample of an object that is freed
+ *
+ * @param sample The sample pointer of the object, set to NULL
+ */
+void
+allocprof_release(struct alloc_sample **sample)
+{
+    struct alloc_sample *s = *sample;
+    ALLOC_SITE *site = s->site;
+
+    *sample = NULL;
+    __atomic_add_fetch(&site->n_free, s->weight, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->bytes_free, s->size * s->weight, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->lifetime_ms, allocprof_now() - s->born_ms, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->n_lifetimes, 1, __ATOMIC_RELAXED);
+    free(s);
+}
+
+/** The sites of all threads with the same stack, combined for printing */
+typedef struct
+{
+    ALLOC_SITE  total;
+    int64_t     outstanding;
+} ALLOC_SUMMARY;
+
+static bool
+allocprof_same_site(const ALLOC_SITE *a, const ALLOC_SITE *b)
+{
+    return a->hash == b->hash && a->kind == b->kind && a->depth == b->depth &&
+           memcmp(a->stack, b->stack, a->depth * sizeof(void *)) == 0;
+}
+
+static int
+allocprof_compare_hash(const void *a, const void *b)
+{
+    const ALLOC_SUMMARY *sa = (const ALLOC_SUMMARY *)a;
+    const ALLOC_SUMMARY *sb = (const ALLOC_SUMMARY *)b;
+
+    return sa->total.hash < sb->total.hash ? -1 : sa->total.hash > sb->total.hash ? 1 : 0;
+}
+
+static int
+allocprof_compare(const void *a, const void *b)
+{
+    const ALLOC_SUMMARY *sa = (const ALLOC_SUMMARY *)a;
+    const ALLOC_SUMMARY *sb = (const ALLOC_SUMMARY *)b;
+
+    return sa->outstanding < sb->outstanding ? 1 : sa->outstanding > sb->outstanding ? -1 : 0;
+}
+
+/**
+ * Print the allocation sites with the most outstanding bytes
+ *
+ * @param dcb DCB to print to
+ */
+void
+allocprof_print(DCB *dcb)
+{
+    ALLOC_TABLE *tables;
+    int n_tables = 0;
+    int n_dropped = 0;
+
+    spinlock_acquire(&all_tables_lock);
+    tables = all_tables;
+    spinlock_release(&all_tables_lock);
+
+    for (ALLOC_TABLE *t = tables; t; t = t->next)
+    {
+        n_tables++;
+    }
+
+    if (allocprof_rate > 0)
+    {
+        dcb_printf(dcb, "Allocation profiler samples one in %d allocations.\n", allocprof_rate);
+    }
+    else
+    {
+        dcb_printf(dcb, "Allocation profiler is disabled, use 'set allocprofile <rate>' to enable it.\n");
+    }
+
+    ALLOC_SUMMARY *summary;
+
+    if (n_tables == 0 ||
+        (summary = (ALLOC_SUMMARY *)calloc(n_tables * ALLOCPROF_SITES, sizeof(*summary))) == NULL)
+    {
+        return;
+    }
+
+    int n_sites = 0;
+    int n_summary = 0;
+    int64_t kind_bytes[ALLOCPROF_N_KINDS] = {0};
+    int64_t kind_count[ALLOCPROF_N_KINDS] = {0};
+
+    /** The counters are copied without locking, they may be slightly inconsistent */
+    for (ALLOC_TABLE *t = tables; t; t = t->next)
+    {
+        n_dropped += t->n_dropped;
+
+        for (int i = 0; i < ALLOCPROF_SITES; i++)
+        {
+            ALLOC_SITE *site = &t->sites[i];
+
+            if (__atomic_load_n(&site->hash, __ATOMIC_ACQUIRE) != 0)
+            {
+                summary[n_sites++].total = *site;
+            }
+        }
+    }
+
+    /** The sites of the same stack in different threads are combined */
+    qsort(summary, n_sites, sizeof(*summary), allocprof_compare_hash);
+
+    for (int i = 0; i < n_sites; i++)
+    {
+        if (n_summary > 0 && allocprof_same_site(&summary[n_summary - 1].total, &summary[i].total))
+        {
+            ALLOC_SITE *to = &summary[n_summary - 1].total;
+            ALLOC_SITE *from = &summary[i].total;
+
+            to->n_samples += from->n_samples;
+            to->n_alloc += from->n_alloc;
+            to->n_free += from->n_free;
+            to->bytes_alloc += from->bytes_alloc;
+            to->bytes_free += from->bytes_free;
+            to->n_lifetimes += from->n_lifetimes;
+            to->lifetime_ms += from->lifetime_ms;
+        }
+        else
+        {
+            summary[n_summary++] = summary[i];
+        }
+    }
+
+    for (int i = 0; i < n_summary; i++)
+    {
+        ALLOC_SITE *site = &summary[i].total;
+        summary[i].outstanding = site->bytes_alloc - site->bytes_free;
+        kind_bytes[site->kind] += summary[i].outstanding;
+        kind_count[site->kind] += site->n_alloc - site->n_free;
+    }
+
+    qsort(summary, n_summary, sizeof(*summary), allocprof_compare);
+
+    dcb_printf(dcb, "Estimated outstanding objects:\n");
+    for (int i = 0; i < ALLOCPROF_N_KINDS; i++)
+    {
+        dcb_printf(dcb, "\t%-10s %10" PRId64 " objects %14" PRId64 " bytes\n",
+                   allocprof_kind_names[i], kind_count[i], kind_bytes[i]);
+    }
+    dcb_printf(dcb, "Allocation sites: %d, samples dropped as the site tables were full: %d\n\n",
+               n_summary, n_dropped);
+
+    for (int i = 0; i < n_summary && i < ALLOCPROF_TOP; i++)
+    {
+        ALLOC_SITE *site = &summary[i].total;
+
+        dcb_printf(dcb, "Site %d: %s, %" PRId64 " samples\n", i + 1,
+                   allocprof_kind_names[site->kind], site->n_samples);
+        dcb_printf(dcb, "\tOutstanding:   %" PRId64 " objects, %" PRId64 " bytes\n",
+                   site->n_alloc - site->n_free, summary[i].outstanding);
+        dcb_printf(dcb, "\tAllocated:     %" PRId64 " objects, %" PRId64 " bytes\n",
+                   site->n_alloc, site->bytes_alloc);
+        if (site->n_lifetimes > 0)
+        {
+            dcb_printf(dcb, "\tAvg lifetime:  %" PRId64 " ms\n",
+                       site->lifetime_ms / site->n_lifetimes);
+        }
+
+        char **symbols = backtrace_symbols(site->stack, site->depth);
+
+        for (int j = 0; j < site->depth; j++)
+        {
+            if (symbols)
+            {
+                dcb_printf(dcb, "\t\t%s\n", symbols[j]);
+            }
+            else
+            {
+                dcb_printf(dcb, "\t\t%p\n", site->stack[j]);
+            }
+        }
+        free(symbols);
+        dcb_printf(dcb, "\n");
+    }
+
+    free(summary);
+}
@@ -38,6 +38,8 @@
  * @endverbatim
  */
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <buffer.h>
 #include <atomic.h>
 #include <skygw_debug.h>
@@ -46,66 +48,290 @@
 #include <hint.h>
 #include <log_manager.h>
 #include <errno.h>
+#include <platform.h>
+#include <dcb.h>
+
+/** The data size of the smallest size class of the buffer pool */
+#define GWBUF_POOL_MIN_SIZE 128
+/** Number of size classes, each class is twice the size of the previous one */
+#define GWBUF_POOL_CLASSES 8
+/** The largest data size that is served from the buffer pool */
+#define GWBUF_POOL_MAX_SIZE (GWBUF_POOL_MIN_SIZE << (GWBUF_POOL_CLASSES - 1))
+/** Maximum number of free blocks a thread keeps in one size class */
+#define GWBUF_POOL_MAX_FREE 64
 
-#if defined(BUFFER_TRACE)
-#include <hashtable.h>
-#include <execinfo.h>
+/**
+ * A buffer allocated with a single allocation. The buffer header, the
+ * shared buffer and the data follow each other in the same memory block.
+ * The block is released when the last reference to the shared buffer is
+ * gone, clones of the buffer have headers of their own.
+ */
+typedef struct
+{
+    GWBUF         buf;    /*< The header of the original buffer */
+    SHARED_BUF    sbuf;   /*< The shared buffer */
+    unsigned char data[]; /*< The data */
+} GWBUF_BLOCK;
 
-static HASHTABLE *buffer_hashtable = NULL;
-#endif
+/** The block that contains a shared buffer */
+#define GWBUF_BLOCK_OF(sb) ((GWBUF_BLOCK *)((char *)(sb) - offsetof(GWBUF_BLOCK, sbuf)))
 
+/**
+ * The buffer pool of a thread. Each thread keeps a list of free blocks for
+ * each size class, blocks freed by a thread go to its own pool no matter
+ * which thread allocated them. The pools are never freed so that their
+ * statistics can be shown even after the thread has exited.
+ */
+typedef struct gwbuf_pool
+{
+    GWBUF_BLOCK       *free[GWBUF_POOL_CLASSES];   /*< Free blocks of each size class */
+    int               n_free[GWBUF_POOL_CLASSES]; /*< Number of free blocks in each class */
+    unsigned long     hits;                       /*< Allocations served from a free list */
+    unsigned long     misses;                     /*< Allocations that used malloc */
+    unsigned long     oversized;                  /*< Allocations too large for the pool */
+    unsigned long     releases;                   /*< Blocks freed because the list was full */
+    struct gwbuf_pool *next;                      /*< Next pool in the list of all pools */
+} GWBUF_POOL;
+
+static thread_local GWBUF_POOL *thread_pool = NULL;
+static GWBUF_POOL *all_pools = NULL;
+static SPINLOCK all_pools_lock = SPINLOCK_INIT;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static GWBUF_BLOCK *gwbuf_block_alloc(unsigned int size);
+static void gwbuf_block_free(SHARED_BUF *sbuf);
 static void gwbuf_free_one(GWBUF *buf);
-static buffer_object_t* gwbuf_remove_buffer_object(GWBUF*           buf,
-                                                   buffer_object_t* bufobj);
 
-#if defined(BUFFER_TRACE)
-static void gwbuf_add_to_hashtable(GWBUF *buf);
-static int bhashfn (void *key);
-static int bcmpfn (void *key1, void *key2);
-static void gwbuf_remove_from_hashtable(GWBUF *buf);
-#endif
+/**
+ * Release the free blocks of a thread when it exits.
+ *
+ * @param data The pool of the thread
+ */
+static void
+gwbuf_pool_flush(void *data)
+{
+    GWBUF_POOL *pool = (GWBUF_POOL *)data;
+
+    for (int i = 0; i < GWBUF_POOL_CLASSES; i++)
+    {
+        while (pool->free[i])
+        {
+            GWBUF_BLOCK *block = pool->free[i];
+            pool->free[i] = (GWBUF_BLOCK *)block->buf.next;
+            free(block);
+        }
+        pool->n_free[i] = 0;
+    }
+}
 
 /**
- * Allocate a new gateway buffer structure of size bytes.
+ * Create the key used to release the pools of exiting threads.
+ */
+static void
+gwbuf_pool_key_init()
+{
+    pthread_key_create(&pool_key, gwbuf_pool_flush);
+}
+
+/**
+ * Get the buffer pool of the calling thread, creating it on first use.
  *
- * For now we allocate memory directly from malloc for buffer the management
- * structure and the actual data buffer itself. We may swap at a future date
- * to a more efficient mechanism.
+ * @return The pool or NULL if memory could not be allocated
+ */
+static inline GWBUF_POOL *
+gwbuf_pool_get()
+{
+    if (thread_pool == NULL && (thread_pool = calloc(1, sizeof(GWBUF_POOL))) != NULL)
+    {
+        pthread_once(&pool_key_once, gwbuf_pool_key_init);
+        pthread_setspecific(pool_key, thread_pool);
+
+        spinlock_acquire(&all_pools_lock);
+        thread_pool->next = all_pools;
+        all_pools = thread_pool;
+        spinlock_release(&all_pools_lock);
+    }
+    return thread_pool;
+}
+
+/**
+ * Find the smallest size class of the buffer pool that fits a buffer.
  *
- * @param       size The size in bytes of the data area required
- * @return      Pointer to the buffer structure or NULL if memory could not
- *              be allocated.
+ * @param size The data size of the buffer
+ * @return The size class or -1 if the buffer is too large for the pool
  */
-GWBUF *
-gwbuf_alloc(unsigned int size)
+static inline int
+gwbuf_size_class(unsigned int size)
 {
-    GWBUF      *rval;
-    SHARED_BUF *sbuf;
+    int size_class = 0;
 
-    /* Allocate the buffer header */
-    if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if (size > GWBUF_POOL_MAX_SIZE)
     {
-        goto retblock;
+        return -1;
     }
+    while ((GWBUF_POOL_MIN_SIZE << size_class) < size)
+    {
+        size_class++;
+    }
+    return size_class;
+}
+
+/**
+ * Allocate the memory block of a buffer. The blocks of the common sizes
+ * are taken from the pool of the calling thread, larger ones are allocated
+ * directly with malloc.
+ *
+ * @param size The data size of the buffer
+ * @return The block or NULL if memory could not be allocated
+ */
+static GWBUF_BLOCK *
+gwbuf_block_alloc(unsigned int size)
+{
+    GWBUF_BLOCK *block;
+    GWBUF_POOL  *pool = gwbuf_pool_get();
+    int         size_class = gwbuf_size_class(size);
 
-    /* Allocate the shared data buffer */
-    if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
+    if (pool == NULL)
     {
-        free(rval);
-        rval = NULL;
-        goto retblock;
+        size_class = -1;
+    }
+    else if (size_class < 0)
+    {
+        pool->oversized++;
+    }
+    else if ((block = pool->free[size_class]) != NULL)
+    {
+        pool->free[size_class] = (GWBUF_BLOCK *)block->buf.next;
+        pool->n_free[size_class]--;
+        pool->hits++;
+        return block;
+    }
+    else
+    {
+        pool->misses++;
+        size = GWBUF_POOL_MIN_SIZE << size_class;
     }
 
-    /* Allocate the space for the actual data */
-    if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
+    if ((block = (GWBUF_BLOCK *)malloc(sizeof(GWBUF_BLOCK) + size)) != NULL)
+    {
+        block->sbuf.size_class = size_class;
+    }
+    return block;
+}
+
+/**
+ * Release the memory block of a shared buffer once it has no references.
+ * The block goes back to the pool of the calling thread unless the pool
+ * already has enough free blocks of that size.
+ *
+ * @param sbuf The shared buffer
+ */
+static void
+gwbuf_block_free(SHARED_BUF *sbuf)
+{
+    GWBUF_BLOCK *block = GWBUF_BLOCK_OF(sbuf);
+    int         size_class = sbuf->size_class;
+    GWBUF_POOL  *pool;
+
+    if (size_class >= 0 && (pool = gwbuf_pool_get()) != NULL)
+    {
+        if (pool->n_free[size_class] < GWBUF_POOL_MAX_FREE)
+        {
+            block->buf.next = (GWBUF *)pool->free[size_class];
+            pool->free[size_class] = block;
+            pool->n_free[size_class]++;
+            return;
+        }
+        pool->releases++;
+    }
+    free(block);
+}
+
+/**
+ * Take a new reference to a shared buffer. The caller already holds a
+ * reference, so the count can not drop to zero meanwhile and no ordering
+ * is needed.
+ *
+ * @param sbuf The shared buffer
+ */
+static inline void
+gwbuf_sbuf_ref(SHARED_BUF *sbuf)
+{
+    __atomic_fetch_add(&sbuf->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release a reference to a shared buffer. The last reference of a buffer
+ * that was never cloned is released without an atomic read-modify-write,
+ * as no other thread can refer to the buffer.
+ *
+ * @param sbuf The shared buffer
+ * @return True if this was the last reference
+ */
+static inline bool
+gwbuf_sbuf_unref(SHARED_BUF *sbuf)
+{
+    return __atomic_load_n(&sbuf->refcount, __ATOMIC_ACQUIRE) == 1 ||
+           __atomic_sub_fetch(&sbuf->refcount, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/**
+ * Lock the buffer objects of a shared buffer if other references to it exist.
+ * A reference count of one can not grow behind the caller's back, as a clone
+ * can only be made through a reference.
+ *
+ * @param sbuf The shared buffer
+ * @return True if the lock was acquired and must be released with
+ * gwbuf_sbuf_unlock
+ */
+static inline bool
+gwbuf_sbuf_lock(SHARED_BUF *sbuf)
+{
+    if (__atomic_load_n(&sbuf->refcount, __ATOMIC_ACQUIRE) > 1)
+    {
+        spinlock_acquire(&sbuf->lock);
+        return true;
+    }
+    return false;
+}
+
+static inline void
+gwbuf_sbuf_unlock(SHARED_BUF *sbuf, bool locked)
+{
+    if (locked)
+    {
+        spinlock_release(&sbuf->lock);
+    }
+}
+
+/**
+ * Allocate a new gateway buffer structure of size bytes.
+ *
+ * The buffer header, the shared buffer and the data are allocated as one
+ * block. Blocks with at most GWBUF_POOL_MAX_SIZE bytes of data are recycled
+ * through the buffer pool of the calling thread.
+ *
+ * @param       size The size in bytes of the data area required
+ * @return      Pointer to the buffer structure or NULL if memory could not
+ *              be allocated.
+ */
+GWBUF *
+gwbuf_alloc(unsigned int size)
+{
+    GWBUF       *rval = NULL;
+    GWBUF_BLOCK *block;
+    SHARED_BUF  *sbuf;
+
+    if ((block = gwbuf_block_alloc(size)) == NULL)
     {
-        ss_dassert(sbuf->data != NULL);
-        free(rval);
-        free(sbuf);
-        rval = NULL;
         goto retblock;
     }
-    spinlock_init(&rval->gwbuf_lock);
+    rval = &block->buf;
+    sbuf = &block->sbuf;
+    sbuf->data = block->data;
+    memset(sbuf->bufobj, 0, sizeof(sbuf->bufobj));
+    spinlock_init(&sbuf->lock);
     rval->start = sbuf->data;
     rval->end = (void *)((char *)rval->start + size);
     sbuf->refcount = 1;
@@ -114,9 +340,8 @@ gwbuf_alloc(unsigned int size)
     rval->tail = rval;
     rval->hint = NULL;
     rval->properties = NULL;
+    rval->sample = NULL;
     rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
-    rval->gwbuf_info = GWBUF_INFO_NONE;
-    rval->gwbuf_bufobj = NULL;
     CHK_GWBUF(rval);
 retblock:
     if (rval == NULL)
@@ -125,12 +350,10 @@ retblock:
         MXS_ERROR("Memory allocation failed due to %s.",
                   strerror_r(errno, errbuf, sizeof(errbuf)));
     }
-#if defined(BUFFER_TRACE)
     else
     {
-        gwbuf_add_to_hashtable(rval);
+        allocprof_alloc(&rval->sample, ALLOCPROF_GWBUF, size);
     }
-#endif
     return rval;
 }
 
@@ -153,101 +376,50 @@ gwbuf_alloc_and_load(unsigned int size, void *data)
     return rval;
 }
 
-#if defined(BUFFER_TRACE)
 /**
- * Store a trace of buffer creation
+ * Print the statistics of the buffer pools via a given print DCB
  *
- * @param buf The buffer to record
+ * The counters of the threads are read without locking, the totals are
+ * therefore only approximate while buffers are being allocated.
+ *
+ * @param pdcb  Print DCB for output
  */
-static void
-gwbuf_add_to_hashtable(GWBUF *buf)
+void
+dprintBufferPool(void *pdcb)
 {
-    void *array[16];
-    size_t size, i, total;
-    char **strings;
-    char *tracetext;
+    DCB *dcb = (DCB *)pdcb;
+    unsigned long hits = 0, misses = 0, oversized = 0, releases = 0;
+    int n_free[GWBUF_POOL_CLASSES] = {0};
+    int n_pools = 0;
 
-    size = backtrace(array, 16);
-    strings = backtrace_symbols(array, size);
-    total = (2 * size) + 1;
-    for (i = 0; i < size; i++)
-    {
-        total += strlen(strings[i]);
-    }
-    tracetext = (char *)malloc(total);
-    if (tracetext)
+    spinlock_acquire(&all_pools_lock);
+    for (GWBUF_POOL *pool = all_pools; pool; pool = pool->next)
     {
-        char *ptr = tracetext;
-        for (i = 0; i < size; i++)
-        {
-            sprintf(ptr, "\t%s\n", strings[i]);
-            ptr += (strlen(strings[i]) + 2);
-        }
-        free (strings);
-
-        if (NULL == buffer_hashtable)
+        hits += pool->hits;
+        misses += pool->misses;
+        oversized += pool->oversized;
+        releases += pool->releases;
+        for (int i = 0; i < GWBUF_POOL_CLASSES; i++)
         {
-            buffer_hashtable = hashtable_alloc(10000, bhashfn, bcmpfn);
-            hashtable_memory_fns(buffer_hashtable, NULL, NULL, NULL, (HASHMEMORYFN)free);
+            n_free[i] += pool->n_free[i];
         }
-        hashtable_add(buffer_hashtable, buf, (void *)tracetext);
+        n_pools++;
     }
-}
-
-/**
- * Hash a buffer (address) to an integer
- *
- * @param key The pointer to the buffer
- */
-static int
-bhashfn(void *key)
-{
-    return (int)((uintptr_t) key % INT_MAX);
-}
-
-/**
- * Compare two buffer keys (pointers)
- *
- * @param key1 The pointer to the first buffer
- * @param key2 The pointer to the second buffer
- */
-static int
-bcmpfn(void *key1, void *key2)
-{
-    return key1 == key2 ? 0 : 1;
-}
-
-/**
- * Remove a buffer from the store of buffer traces
- *
- * @param buf The buffer to be removed
- */
-static void
-gwbuf_remove_from_hashtable(GWBUF *buf)
-{
-    hashtable_delete(buffer_hashtable, buf);
-}
-
-/**
- * Print all buffer traces via a given print DCB
- *
- * @param pdcb  Print DCB for output
- */
-void
-dprintAllBuffers(void *pdcb)
-{
-    void *buf;
-    char *backtrace;
-    HASHITERATOR *buffers = hashtable_iterator(buffer_hashtable);
-    while (NULL != (buf = hashtable_next(buffers)))
+    spinlock_release(&all_pools_lock);
+
+    dcb_printf(dcb, "Buffer Pool Statistics\n\n");
+    dcb_printf(dcb, "No. of thread pools:                     %d\n", n_pools);
+    dcb_printf(dcb, "No. of allocations from the pool:        %lu\n", hits);
+    dcb_printf(dcb, "No. of pooled allocations using malloc:  %lu\n", misses);
+    dcb_printf(dcb, "No. of allocations too large for pool:   %lu\n", oversized);
+    dcb_printf(dcb, "No. of blocks freed when pool full:      %lu\n", releases);
+    dcb_printf(dcb, "\nSize class      Free blocks\n");
+    dcb_printf(dcb, "----------------------------\n");
+    for (int i = 0; i < GWBUF_POOL_CLASSES; i++)
     {
-        dcb_printf((DCB *)pdcb, "Buffer: %p\n", (void *)buf);
-        backtrace = hashtable_fetch(buffer_hashtable, buf);
-        dcb_printf((DCB *)pdcb, "%s", backtrace);
+        dcb_printf(dcb, "%-15d %d\n", GWBUF_POOL_MIN_SIZE << i, n_free[i]);
     }
-    hashtable_iterator_free(buffers);
 }
-#endif
 
 /**
  * Free a list of gateway buffers
@@ -258,8 +430,6 @@ void
 gwbuf_free(GWBUF *buf)
 {
     GWBUF *nextbuf;
-    BUF_PROPERTY    *prop;
-    buffer_object_t *bo;
 
     while (buf)
     {
@@ -273,26 +443,20 @@ gwbuf_free(GWBUF *buf)
 /**
  * Free a single gateway buffer
  *
+ * The header of the original buffer is a part of the block of the shared
+ * buffer, so the reference is released only after the header is no longer
+ * used. Otherwise the freeing of the last clone in another thread could
+ * release the block while this thread is still using it.
+ *
  * @param buf The buffer to free
  */
 static void
 gwbuf_free_one(GWBUF *buf)
 {
     BUF_PROPERTY    *prop;
-    buffer_object_t *bo;
-
-    if (atomic_add(&buf->sbuf->refcount, -1) == 1)
-    {
-        free(buf->sbuf->data);
-        free(buf->sbuf);
-        bo = buf->gwbuf_bufobj;
-
-        while (bo != NULL)
-        {
-            bo = gwbuf_remove_buffer_object(buf, bo);
-        }
+    SHARED_BUF      *sbuf = buf->sbuf;
+    bool            embedded = buf == &GWBUF_BLOCK_OF(sbuf)->buf;
 
-    }
     while (buf->properties)
     {
         prop = buf->properties;
@@ -308,10 +472,34 @@ gwbuf_free_one(GWBUF *buf)
         buf->hint = buf->hint->next;
         hint_free(h);
     }
-#if defined(BUFFER_TRACE)
-    gwbuf_remove_from_hashtable(buf);
-#endif
-    free(buf);
+    allocprof_free(&buf->sample);
+    if (gwbuf_sbuf_unref(sbuf))
+    {
+        for (int i = 0; i < GWBUF_N_BUFOBJ; i++)
+        {
+            buffer_object_t* bo = &sbuf->bufobj[i];
+
+            while (bo)
+            {
+                buffer_object_t* next = bo->bo_next;
+
+                if (bo->bo_data)
+                {
+                    bo->bo_donefun_fp(bo->bo_data);
+                }
+                if (bo != &sbuf->bufobj[i])
+                {
+                    free(bo);
+                }
+                bo = next;
+            }
+        }
+        gwbuf_block_free(sbuf);
+    }
+    if (!embedded)
+    {
+        free(buf);
+    }
 }
 
 /**
@@ -338,19 +526,15 @@ gwbuf_clone(GWBUF *buf)
         return NULL;
     }
 
-    atomic_add(&buf->sbuf->refcount, 1);
+    gwbuf_sbuf_ref(buf->sbuf);
     rval->sbuf = buf->sbuf;
     rval->start = buf->start;
     rval->end = buf->end;
     rval->gwbuf_type = buf->gwbuf_type;
-    rval->gwbuf_info = buf->gwbuf_info;
-    rval->gwbuf_bufobj = buf->gwbuf_bufobj;
     rval->tail = rval;
     rval->next = NULL;
     CHK_GWBUF(rval);
-#if defined(BUFFER_TRACE)
-    gwbuf_add_to_hashtable(rval);
-#endif
+    allocprof_alloc(&rval->sample, ALLOCPROF_GWBUF, sizeof(GWBUF));
     return rval;
 }
 
@@ -401,7 +585,7 @@ GWBUF *gwbuf_clone_portion(GWBUF *buf,
                   strerror_r(errno, errbuf, sizeof(errbuf)));
         return NULL;
     }
-    atomic_add(&buf->sbuf->refcount, 1);
+    gwbuf_sbuf_ref(buf->sbuf);
     clonebuf->sbuf = buf->sbuf;
     clonebuf->gwbuf_type = buf->gwbuf_type; /*< clone info bits too */
     clonebuf->start = (void *)((char*)buf->start + start_offset);
@@ -409,14 +593,11 @@ GWBUF *gwbuf_clone_portion(GWBUF *buf,
     clonebuf->gwbuf_type = buf->gwbuf_type; /*< clone the type for now */
     clonebuf->properties = NULL;
     clonebuf->hint = NULL;
-    clonebuf->gwbuf_info = buf->gwbuf_info;
-    clonebuf->gwbuf_bufobj = buf->gwbuf_bufobj;
     clonebuf->next = NULL;
     clonebuf->tail = clonebuf;
+    clonebuf->sample = NULL;
     CHK_GWBUF(clonebuf);
-#if defined(BUFFER_TRACE)
-    gwbuf_add_to_hashtable(clonebuf);
-#endif
+    allocprof_alloc(&clonebuf->sample, ALLOCPROF_GWBUF, sizeof(GWBUF));
     return clonebuf;
 }
 
@@ -713,98 +894,146 @@ void gwbuf_set_type(
 }
 
 /**
- * Add a buffer object to GWBUF buffer.
+ * Find the object of a type that was derived from the data the buffer
+ * refers to. Clones of different portions of the same data each have their
+ * own object, the objects are kept in a list that only grows while the data
+ * is shared, which is why it can be walked without the lock.
+ *
+ * @param buf   GWBUF to be searched
+ * @param id    Identifier for the object
+ * @return The object or NULL if the data of the buffer has no such object
+ */
+static buffer_object_t* gwbuf_find_buffer_object(GWBUF* buf, bufobj_id_t id)
+{
+    size_t offset = (unsigned char*)buf->start - (unsigned char*)buf->sbuf->data;
+    size_t length = GWBUF_LENGTH(buf);
+    buffer_object_t* bo = &buf->sbuf->bufobj[id];
+
+    while (bo)
+    {
+        if (__atomic_load_n(&bo->bo_data, __ATOMIC_ACQUIRE) &&
+            bo->bo_offset == offset && bo->bo_length == length)
+        {
+            break;
+        }
+        bo = __atomic_load_n(&bo->bo_next, __ATOMIC_ACQUIRE);
+    }
+
+    return bo;
+}
+
+/**
+ * Attach an object to the data of a buffer. The object belongs to the part
+ * of the data that the buffer refers to and is only visible to the buffers
+ * that refer to exactly the same part. It is freed with the given function
+ * when the last reference to the data is freed.
  *
  * @param buf           GWBUF where object is added
  * @param id            Type identifier for object
  * @param data          Object data
- * @param donefun_fp    Clean-up function to be executed before buffer is freed.
+ * @param donefun_fp    Clean-up function to be executed before buffer is freed
+ * @return True if the object was added, false if the data the buffer refers
+ * to already has an object of the same type or the memory ran out
  */
-void gwbuf_add_buffer_object(GWBUF* buf,
+bool gwbuf_add_buffer_object(GWBUF* buf,
                              bufobj_id_t id,
                              void*  data,
                              void (*donefun_fp)(void *))
 {
-    buffer_object_t** p_b;
-    buffer_object_t*  newb;
+    buffer_object_t* head = &buf->sbuf->bufobj[id];
+    buffer_object_t* bo;
+    bool             locked;
+    bool             added = false;
 
     CHK_GWBUF(buf);
-    newb = (buffer_object_t *)malloc(sizeof(buffer_object_t));
-    ss_dassert(newb != NULL);
+    ss_dassert(id < GWBUF_N_BUFOBJ && data != NULL);
+    locked = gwbuf_sbuf_lock(buf->sbuf);
 
-    if (newb == NULL)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Memory allocation failed due to %s.",
-                  strerror_r(errno, errbuf, sizeof(errbuf)));
-        return;
-    }
-    newb->bo_id = id;
-    newb->bo_data = data;
-    newb->bo_donefun_fp = donefun_fp;
-    newb->bo_next = NULL;
-    /** Lock */
-    spinlock_acquire(&buf->gwbuf_lock);
-    p_b = &buf->gwbuf_bufobj;
-    /** Search the end of the list and add there */
-    while (*p_b != NULL)
+    if (gwbuf_find_buffer_object(buf, id) == NULL)
     {
-        p_b = &(*p_b)->bo_next;
+        /** Reuse a freed object before growing the list */
+        for (bo = head; bo && bo->bo_data; bo = bo->bo_next)
+        {
+            ;
+        }
+
+        if (bo == NULL && (bo = calloc(1, sizeof(*bo))) != NULL)
+        {
+            bo->bo_next = head->bo_next;
+            __atomic_store_n(&head->bo_next, bo, __ATOMIC_RELEASE);
+        }
+
+        if (bo)
+        {
+            bo->bo_offset = (unsigned char*)buf->start - (unsigned char*)buf->sbuf->data;
+            bo->bo_length = GWBUF_LENGTH(buf);
+            bo->bo_donefun_fp = donefun_fp;
+            __atomic_store_n(&bo->bo_data, data, __ATOMIC_RELEASE);
+            added = true;
+        }
     }
-    *p_b = newb;
-    /** Set flag */
-    buf->gwbuf_info |= GWBUF_INFO_PARSED;
-    /** Unlock */
-    spinlock_release(&buf->gwbuf_lock);
+
+    gwbuf_sbuf_unlock(buf->sbuf, locked);
+    return added;
 }
 
 /**
- * Search buffer object which matches with the id.
+ * Get the object of a type attached to the part of the data that the buffer
+ * refers to.
  *
  * @param buf   GWBUF to be searched
  * @param id    Identifier for the object
  *
- * @return Searched buffer object or NULL if not found
+ * @return The object data or NULL if the buffer has no such object
  */
 void* gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id)
 {
     buffer_object_t* bo;
 
     CHK_GWBUF(buf);
-    /** Lock */
-    spinlock_acquire(&buf->gwbuf_lock);
-    bo = buf->gwbuf_bufobj;
-
-    while (bo != NULL && bo->bo_id != id)
-    {
-        bo = bo->bo_next;
-    }
-    /** Unlock */
-    spinlock_release(&buf->gwbuf_lock);
-    if (bo)
-    {
-        return bo->bo_data;
-    }
-    return NULL;
+    ss_dassert(id < GWBUF_N_BUFOBJ);
+    bo = gwbuf_find_buffer_object(buf, id);
+    return bo ? __atomic_load_n(&bo->bo_data, __ATOMIC_ACQUIRE) : NULL;
 }
 
 /**
- * @return pointer to next buffer object or NULL
+ * Free the buffer object that matches with the id, for example when the data
+ * that the object was derived from has been modified. Nothing is done if the
+ * buffer has no such object.
+ *
+ * @param buf   GWBUF to be searched
+ * @param id    Identifier for the object
  */
-static buffer_object_t* gwbuf_remove_buffer_object(GWBUF* buf, buffer_object_t* bufobj)
+void gwbuf_free_buffer_object(GWBUF* buf, bufobj_id_t id)
 {
-    buffer_object_t* next;
+    buffer_object_t* bo;
+    buffer_object_t  removed = {NULL};
+    bool             locked;
 
-    next = bufobj->bo_next;
-    /** Call corresponding clean-up function to clean buffer object's data */
-    bufobj->bo_donefun_fp(bufobj->bo_data);
-    free(bufobj);
-    return next;
+    CHK_GWBUF(buf);
+    ss_dassert(id < GWBUF_N_BUFOBJ);
+    locked = gwbuf_sbuf_lock(buf->sbuf);
+
+    if ((bo = gwbuf_find_buffer_object(buf, id)))
+    {
+        removed = *bo;
+        __atomic_store_n(&bo->bo_data, NULL, __ATOMIC_RELEASE);
+    }
+
+    gwbuf_sbuf_unlock(buf->sbuf, locked);
+
+    if (removed.bo_data)
+    {
+        removed.bo_donefun_fp(removed.bo_data);
+    }
 }
 
 /**
  * Add a property to a buffer.
  *
+ * The properties are free form strings, the metadata that is looked up for
+ * every query is stored as a buffer object instead.
+ *
  * @param buf   The buffer to add the property to
  * @param name  The property name
  * @param value The property value
@@ -825,10 +1054,8 @@ gwbuf_add_property(GWBUF *buf, char *name, char *value)
     }
     prop->name = strdup(name);
     prop->value = strdup(value);
-    spinlock_acquire(&buf->gwbuf_lock);
     prop->next = buf->properties;
     buf->properties = prop;
-    spinlock_release(&buf->gwbuf_lock);
     return 1;
 }
 
@@ -843,13 +1070,11 @@ gwbuf_get_property(GWBUF *buf, char *name)
 {
     BUF_PROPERTY *prop;
 
-    spinlock_acquire(&buf->gwbuf_lock);
     prop = buf->properties;
     while (prop && strcmp(prop->name, name) != 0)
     {
         prop = prop->next;
     }
-    spinlock_release(&buf->gwbuf_lock);
     if (prop)
     {
         return prop->value;
@@ -897,6 +1122,29 @@ gwbuf_make_contiguous(GWBUF *orig)
     return newbuf;
 }
 
+/**
+ * The number of bytes that the data of a buffer can be extended by in place,
+ * by moving the end of the buffer. Only a buffer that is the sole owner of
+ * its data and that came from the buffer pool, whose size classes leave room
+ * after the requested size, can be extended.
+ *
+ * @param buf   The buffer
+ * @return      The bytes available after the end of the buffer
+ */
+unsigned int
+gwbuf_tailroom(GWBUF *buf)
+{
+    SHARED_BUF *sbuf = buf->sbuf;
+
+    if (GWBUF_IS_SHARED(buf) || sbuf->size_class < 0)
+    {
+        return 0;
+    }
+
+    char *limit = (char *)sbuf->data + (GWBUF_POOL_MIN_SIZE << sbuf->size_class);
+    return limit > (char *)buf->end ? limit - (char *)buf->end : 0;
+}
+
 /**
  * Add hint to a buffer.
  *
@@ -909,7 +1157,6 @@ gwbuf_add_hint(GWBUF *buf, HINT *hint)
 {
     HINT *ptr;
 
-    spinlock_acquire(&buf->gwbuf_lock);
     if (buf->hint)
     {
         ptr = buf->hint;
@@ -923,7 +1170,6 @@ gwbuf_add_hint(GWBUF *buf, HINT *hint)
     {
         buf->hint = hint;
     }
-    spinlock_release(&buf->gwbuf_lock);
     return 1;
 }
 
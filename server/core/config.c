@@ -72,6 +72,8 @@
 #include <sys/utsname.h>
 #include <dbusers.h>
 #include <gw.h>
+#include <affinity.h>
+#include <statshm.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
@@ -118,8 +120,8 @@ static char *service_params[] =
     "passwd",
     "enable_root_user",
     "max_connections",
-    /* "max_queued_connections", */
-    /* "queued_connection_timeout", */
+    "max_queued_connections",
+    "queued_connection_timeout",
     "connection_timeout",
     "auth_all_servers",
     "strip_db_esc",
@@ -134,6 +136,11 @@ static char *service_params[] =
     "ignore_databases",
     "ignore_databases_regex",
     "log_auth_warnings",
+    "slow_query_threshold",
+    "scheduling_weight",
+    "client_compression",
+    "client_compression_level",
+    "client_compression_min_length",
     "source", /**< Avrorouter only */
     NULL
 };
@@ -153,6 +160,10 @@ static char *listener_params[] =
     "ssl_key",
     "ssl_version",
     "ssl_cert_verify_depth",
+    "ssl_ktls",
+    "connection_rate",
+    "subnet_connection_rate",
+    "max_handshakes",
     NULL
 };
 
@@ -167,6 +178,7 @@ static char *monitor_params[] =
     "events",
     "mysql51_replication",
     "monitor_interval",
+    "max_monitor_interval",
     "detect_replication_lag",
     "detect_stale_master",
     "disable_master_failback",
@@ -185,16 +197,23 @@ static char *server_params[] =
     "protocol",
     "port",
     "address",
+    "socket",
     "monitoruser",
     "monitorpw",
     "persistpoolmax",
     "persistmaxtime",
+    "persistwarm",
+    "persiststandby",
+    "compression",
+    "compression_level",
+    "warmup_time",
     "ssl_cert",
     "ssl_ca_cert",
     "ssl",
     "ssl_key",
     "ssl_version",
     "ssl_cert_verify_depth",
+    "ssl_ktls",
     NULL
 };
 
@@ -812,6 +831,21 @@ config_threadcount()
     return gateway.n_threads;
 }
 
+/**
+ * Return the most polling threads that can run. The structures that have
+ * an entry for each polling thread are sized with this. The admin thread, if
+ * enabled, has the last entry.
+ *
+ * @return The larger of max_threads and threads, plus the admin thread
+ */
+int
+config_max_threadcount()
+{
+    int n = gateway.max_threads > gateway.n_threads ? gateway.max_threads : gateway.n_threads;
+
+    return gateway.admin_thread ? n + 1 : n;
+}
+
 /**
  * Return the number of non-blocking polls to be done before a blocking poll
  * is issued.
@@ -836,6 +870,137 @@ config_pollsleep()
     return gateway.pollsleep;
 }
 
+/**
+ * Return whether each polling thread has a private epoll set and event queue
+ * and DCBs are bound to the thread that owns their session.
+ *
+ * @return True if poll affinity is enabled
+ */
+bool
+config_poll_affinity()
+{
+    return gateway.poll_affinity;
+}
+
+/**
+ * Return whether idle polling threads may process the events of the DCBs
+ * owned by other threads when poll affinity is enabled.
+ *
+ * @return True if work stealing is enabled
+ */
+bool
+config_poll_work_stealing()
+{
+    return gateway.poll_work_stealing;
+}
+
+/**
+ * Return whether the administrative services are served by a polling
+ * thread of their own.
+ *
+ * @return True if the admin thread is enabled
+ */
+bool
+config_admin_thread()
+{
+    return gateway.admin_thread;
+}
+
+/**
+ * Return the maximum number of events a polling thread receives with one
+ * epoll_wait call.
+ *
+ * @return The maximum number of events
+ */
+int
+config_poll_max_events()
+{
+    return gateway.poll_max_events;
+}
+
+/**
+ * Return whether the polling threads adapt the number of non-blocking polls
+ * and the timeout of the blocking poll to the rate of the events.
+ *
+ * @return True if adaptive polling is enabled
+ */
+bool
+config_poll_adaptive()
+{
+    return gateway.poll_adaptive;
+}
+
+/**
+ * Return how long an event may be processed before the stack of the polling
+ * thread processing it is logged.
+ *
+ * @return The threshold in milliseconds, 0 if the events are not watched
+ */
+int
+config_event_watchdog_threshold()
+{
+    return gateway.event_watchdog_threshold;
+}
+
+/**
+ * Return whether TCP listeners get a separate SO_REUSEPORT socket for each
+ * polling thread when poll affinity is enabled.
+ *
+ * @return True if listeners are sharded over the polling threads
+ */
+bool
+config_reuseport_listeners()
+{
+    return gateway.reuseport_listeners;
+}
+
+/**
+ * Return the length of the TCP Fast Open queue of the listeners. Backend
+ * connections are opened with TCP Fast Open when this is not zero.
+ *
+ * @return The queue length or 0 if TCP Fast Open is disabled
+ */
+int
+config_tcp_fastopen()
+{
+    return gateway.tcp_fastopen;
+}
+
+/**
+ * Return whether the writes made while the polling threads process events
+ * are deferred and submitted with io_uring.
+ *
+ * @return True if io_uring is used for the writes
+ */
+bool
+config_io_uring_writes()
+{
+    return gateway.io_uring_writes;
+}
+
+/**
+ * Return the number of threads that start the services at startup
+ *
+ * @return The number of service start threads
+ */
+int
+config_start_threads()
+{
+    return gateway.start_threads;
+}
+
+/**
+ * Return whether the listeners of a service are opened with the users
+ * cached on disk while the users are loaded from the backends
+ *
+ * @return True if the cached users are used at startup
+ */
+bool
+config_cached_users_at_startup()
+{
+    return gateway.cached_users_at_startup;
+}
+
 /**
  * Return the feedback config data pointer
  *
@@ -905,6 +1070,20 @@ handle_global_item(const char *name, const char *value)
             }
         }
     }
+    else if (strcmp(name, "max_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.max_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'max_threads': %s", value);
+            return 0;
+        }
+    }
     else if (strcmp(name, "non_blocking_polls") == 0)
     {
         gateway.n_nbpoll = atoi(value);
@@ -913,10 +1092,145 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.pollsleep = atoi(value);
     }
+    else if (strcmp(name, "poll_affinity") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.poll_affinity = truth;
+    }
+    else if (strcmp(name, "poll_work_stealing") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.poll_work_stealing = truth;
+    }
+    else if (strcmp(name, "admin_thread") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.admin_thread = truth;
+    }
+    else if (strcmp(name, "poll_max_events") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.poll_max_events = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'poll_max_events': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "poll_adaptive") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.poll_adaptive = truth;
+    }
+    else if (strcmp(name, "reuseport_listeners") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.reuseport_listeners = truth;
+    }
+    else if (strcmp(name, "tcp_fastopen") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.tcp_fastopen = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'tcp_fastopen': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "start_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.start_threads = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'start_threads': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "cached_users_at_startup") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.cached_users_at_startup = truth;
+    }
     else if (strcmp(name, "ms_timestamp") == 0)
     {
         mxs_log_set_highprecision_enabled(config_truth_value((char*)value));
     }
+    else if (strcmp(name, "log_throttling") == 0)
+    {
+        char* endptr;
+        long count = strtol(value, &endptr, 0);
+        long window_ms = -1;
+        long suppress_ms = -1;
+
+        if (*endptr == ',')
+        {
+            window_ms = strtol(endptr + 1, &endptr, 0);
+            if (*endptr == ',')
+            {
+                suppress_ms = strtol(endptr + 1, &endptr, 0);
+            }
+        }
+
+        while (isspace(*endptr))
+        {
+            endptr++;
+        }
+
+        if (*endptr == '\0' && count >= 0 && window_ms > 0 && suppress_ms > 0)
+        {
+            mxs_log_set_throttling(count, window_ms, suppress_ms);
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'log_throttling': %s. Expected the count, the window "
+                      "and the suppression time in milliseconds, e.g. 'log_throttling=10, 1000, 10000'.",
+                      value);
+            return 0;
+        }
+    }
     else if (strcmp(name, "auth_connect_timeout") == 0)
     {
         char* endptr;
@@ -976,6 +1290,176 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.qc_args = strdup(value);
     }
+    else if (strcmp(name, "query_classifier_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.qc_threads = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'query_classifier_threads': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "query_trace_sample_rate") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.qtrace_sample_rate = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'query_trace_sample_rate': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "profile_filters") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.profile_filters = truth;
+    }
+    else if (strcmp(name, "event_watchdog_threshold") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.event_watchdog_threshold = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'event_watchdog_threshold': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "flight_recorder_size") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.flight_recorder_size = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'flight_recorder_size': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "thread_affinity") == 0)
+    {
+        if (affinity_valid(value))
+        {
+            free(gateway.thread_affinity);
+            gateway.thread_affinity = strdup(value);
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'thread_affinity': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "writeq_high_water") == 0 || strcmp(name, "writeq_low_water") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= INT_MAX)
+        {
+            if (strcmp(name, "writeq_high_water") == 0)
+            {
+                gateway.writeq_high_water = intval;
+            }
+            else
+            {
+                gateway.writeq_low_water = intval;
+            }
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for '%s': %s", name, value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "writeq_budget") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.writeq_budget = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'writeq_budget': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "io_uring_writes") == 0)
+    {
+        int truth = config_truth_value((char*)value);
+
+        if (truth == -1)
+        {
+            return 0;
+        }
+        gateway.io_uring_writes = truth;
+    }
+    else if (strcmp(name, "query_classifier_offload_size") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.qc_offload_size = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'query_classifier_offload_size': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "stats_shm_interval") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0 && intval <= INT_MAX)
+        {
+            gateway.stats_shm_interval = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'stats_shm_interval': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "stats_shm_name") == 0)
+    {
+        const char* base = *value == '/' ? value + 1 : value;
+        char* shm_name;
+
+        if (*base == '\0' || strchr(base, '/'))
+        {
+            MXS_ERROR("Invalid value for 'stats_shm_name': %s", value);
+            return 0;
+        }
+        if ((shm_name = malloc(strlen(base) + 2)) == NULL)
+        {
+            return 0;
+        }
+        sprintf(shm_name, "/%s", base);
+        free(gateway.stats_shm_name);
+        gateway.stats_shm_name = shm_name;
+    }
     else
     {
         for (i = 0; lognames[i].name; i++)
@@ -1025,7 +1509,7 @@ free_ssl_structure(SSL_LISTENER *ssl)
 static SSL_LISTENER *
 make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
 {
-    char *ssl, *ssl_version, *ssl_cert, *ssl_key, *ssl_ca_cert, *ssl_cert_verify_depth;
+    char *ssl, *ssl_version, *ssl_cert, *ssl_key, *ssl_ca_cert, *ssl_cert_verify_depth, *ssl_ktls;
     int local_errors = 0;
     SSL_LISTENER *new_ssl;
 
@@ -1045,7 +1529,9 @@ make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
             ssl_ca_cert = config_get_value(obj->parameters, "ssl_ca_cert");
             ssl_version = config_get_value(obj->parameters, "ssl_version");
             ssl_cert_verify_depth = config_get_value(obj->parameters, "ssl_cert_verify_depth");
+            ssl_ktls = config_get_value(obj->parameters, "ssl_ktls");
             new_ssl->ssl_init_done = false;
+            new_ssl->ktls = ssl_ktls && config_truth_value(ssl_ktls);
 
             if (ssl_version)
             {
@@ -1190,11 +1676,33 @@ global_defaults()
     uint8_t mac_addr[6] = "";
     struct utsname uname_data;
     gateway.n_threads = DEFAULT_NTHREADS;
+    gateway.max_threads = 0;
     gateway.n_nbpoll = DEFAULT_NBPOLLS;
     gateway.pollsleep = DEFAULT_POLLSLEEP;
+    gateway.poll_affinity = 0;
+    gateway.poll_work_stealing = 1;
+    gateway.admin_thread = 0;
+    gateway.poll_max_events = DEFAULT_POLL_MAX_EVENTS;
+    gateway.poll_adaptive = 0;
+    gateway.reuseport_listeners = 0;
+    gateway.tcp_fastopen = 0;
+    gateway.start_threads = DEFAULT_START_THREADS;
+    gateway.cached_users_at_startup = 0;
     gateway.auth_conn_timeout = DEFAULT_AUTH_CONNECT_TIMEOUT;
     gateway.auth_read_timeout = DEFAULT_AUTH_READ_TIMEOUT;
     gateway.auth_write_timeout = DEFAULT_AUTH_WRITE_TIMEOUT;
+    gateway.qc_threads = 0;
+    gateway.qc_offload_size = DEFAULT_QC_OFFLOAD_SIZE;
+    gateway.qtrace_sample_rate = 0;
+    gateway.event_watchdog_threshold = 0;
+    gateway.profile_filters = 0;
+    gateway.flight_recorder_size = 0;
+    gateway.io_uring_writes = 0;
+    gateway.writeq_high_water = 0;
+    gateway.writeq_low_water = 0;
+    gateway.writeq_budget = 0;
+    gateway.stats_shm_interval = 0;
+    gateway.stats_shm_name = strdup(STATSHM_DEFAULT_NAME);
     if (version_string != NULL)
     {
         gateway.version_string = strdup(version_string);
@@ -1324,6 +1832,22 @@ process_config_update(CONFIG_CONTEXT *context)
                         service->log_auth_warnings = (bool)truthval;
                     }
 
+                    char *slow_query_threshold = config_get_value(obj->parameters, "slow_query_threshold");
+                    if (slow_query_threshold &&
+                        !serviceSetSlowQueryThreshold(service, atoi(slow_query_threshold)))
+                    {
+                        MXS_ERROR("Invalid value for 'slow_query_threshold' of service '%s': %s",
+                                  obj->object, slow_query_threshold);
+                    }
+
+                    char *scheduling_weight = config_get_value(obj->parameters, "scheduling_weight");
+                    if (scheduling_weight &&
+                        !serviceSetSchedulingWeight(service, atoi(scheduling_weight)))
+                    {
+                        MXS_ERROR("Invalid value for 'scheduling_weight' of service '%s': %s",
+                                  obj->object, scheduling_weight);
+                    }
+
                     CONFIG_PARAMETER* param;
 
                     if ((param = config_get_param(obj->parameters, "ignore_databases")))
@@ -1484,14 +2008,22 @@ process_config_update(CONFIG_CONTEXT *context)
         {
             char *address = config_get_value(obj->parameters, "address");
             char *port = config_get_value(obj->parameters, "port");
+            char *socket = config_get_value(obj->parameters, "socket");
 
-            if (address && port &&
-                (server = server_find(address, atoi(port))) != NULL)
+            /** A server behind a socket is named after the socket unless it has an address */
+            if (socket && address == NULL)
+            {
+                address = socket;
+            }
+
+            if (address && (port || socket) &&
+                (server = server_find(address, port ? atoi(port) : 0)) != NULL)
             {
                 char *protocol = config_get_value(obj->parameters, "protocol");
                 char *monuser = config_get_value(obj->parameters, "monuser");
                 char *monpw = config_get_value(obj->parameters, "monpw");
                 server_update(server, protocol, monuser, monpw);
+                server_set_socket(server, socket);
                 obj->element = server;
             }
             else
@@ -2205,6 +2737,41 @@ int create_new_service(CONFIG_CONTEXT *obj)
         serviceSetTimeout(obj->element, atoi(connection_timeout));
     }
 
+    char *slow_query_threshold = config_get_value(obj->parameters, "slow_query_threshold");
+    if (slow_query_threshold &&
+        !serviceSetSlowQueryThreshold(obj->element, atoi(slow_query_threshold)))
+    {
+        MXS_ERROR("Invalid value for 'slow_query_threshold' of service '%s': %s",
+                  obj->object, slow_query_threshold);
+        error_count++;
+    }
+
+    char *scheduling_weight = config_get_value(obj->parameters, "scheduling_weight");
+    if (scheduling_weight &&
+        !serviceSetSchedulingWeight(obj->element, atoi(scheduling_weight)))
+    {
+        MXS_ERROR("Invalid value for 'scheduling_weight' of service '%s': %s",
+                  obj->object, scheduling_weight);
+        error_count++;
+    }
+
+    char *client_compression = config_get_value(obj->parameters, "client_compression");
+    char *client_compression_level = config_get_value(obj->parameters, "client_compression_level");
+    char *client_compression_min = config_get_value(obj->parameters, "client_compression_min_length");
+    if ((client_compression || client_compression_level || client_compression_min) &&
+        !serviceSetClientCompression(obj->element,
+                                     client_compression && config_truth_value(client_compression),
+                                     client_compression_level ? atoi(client_compression_level) :
+                                     SERVER_COMPRESSION_LEVEL_DEFAULT,
+                                     client_compression_min ? atoi(client_compression_min) :
+                                     SERVICE_COMPRESSION_MIN_LEN_DEFAULT))
+    {
+        MXS_ERROR("Invalid client compression parameters for service '%s', the level "
+                  "must be from 1 to 9 and the minimum length must not be negative.",
+                  obj->object);
+        error_count++;
+    }
+
     const char *max_connections = config_get_value_string(obj->parameters, "max_connections");
     const char *max_queued_connections = config_get_value_string(obj->parameters, "max_queued_connections");
     const char *queued_connection_timeout = config_get_value_string(obj->parameters, "queued_connection_timeout");
@@ -2388,15 +2955,25 @@ int create_new_server(CONFIG_CONTEXT *obj)
     int error_count = 0;
     char *address = config_get_value(obj->parameters, "address");
     char *port = config_get_value(obj->parameters, "port");
+    char *socket = config_get_value(obj->parameters, "socket");
     char *protocol = config_get_value(obj->parameters, "protocol");
     char *monuser = config_get_value(obj->parameters, "monitoruser");
     char *monpw = config_get_value(obj->parameters, "monitorpw");
 
-    if (address && port && protocol)
+    if (socket && address == NULL)
+    {
+        address = socket;
+    }
+
+    if (address && (port || socket) && protocol)
     {
-        if ((obj->element = server_alloc(address, protocol, atoi(port))))
+        if ((obj->element = server_alloc(address, protocol, port ? atoi(port) : 0)))
         {
             server_set_unique_name(obj->element, obj->object);
+            if (socket)
+            {
+                server_set_socket(obj->element, socket);
+            }
         }
         else
         {
@@ -2408,7 +2985,8 @@ int create_new_server(CONFIG_CONTEXT *obj)
     {
         obj->element = NULL;
         MXS_ERROR("Server '%s' is missing a required configuration parameter. A "
-                  "server must have address, port and protocol defined.", obj->object);
+                  "server must have protocol and either socket or address and port "
+                  "defined.", obj->object);
         error_count++;
     }
 
@@ -2450,6 +3028,87 @@ int create_new_server(CONFIG_CONTEXT *obj)
             }
         }
 
+        const char *persistwarm = config_get_value_string(obj->parameters, "persistwarm");
+        if (persistwarm)
+        {
+            server->persistwarm = strtol(persistwarm, &endptr, 0);
+            if (*endptr != '\0')
+            {
+                MXS_ERROR("Invalid value for 'persistwarm' for server %s: %s",
+                          server->unique_name, persistwarm);
+            }
+        }
+
+        const char *persiststandby = config_get_value_string(obj->parameters, "persiststandby");
+        if (persiststandby)
+        {
+            server->persiststandby = strtol(persiststandby, &endptr, 0);
+            if (*endptr != '\0')
+            {
+                MXS_ERROR("Invalid value for 'persiststandby' for server %s: %s",
+                          server->unique_name, persiststandby);
+            }
+            else if (server->persiststandby > 0)
+            {
+                if (server->persistpoolmax <= 0)
+                {
+                    MXS_WARNING("Server %s has 'persiststandby' but no 'persistpoolmax', "
+                                "no standby connections are kept.", server->unique_name);
+                }
+                server_pool_standby_start(server);
+            }
+        }
+
+        if (server->persistwarm > 0 || server->persiststandby > 0)
+        {
+            server_pool_warmup_start(server);
+        }
+
+        const char *compression = config_get_value_string(obj->parameters, "compression");
+        if (compression)
+        {
+            if (strcmp(compression, "zlib") == 0)
+            {
+                server->compression = SERVER_COMPRESSION_ZLIB;
+            }
+            else if (strcmp(compression, "none") != 0)
+            {
+                MXS_ERROR("Invalid value for 'compression' for server %s: %s",
+                          server->unique_name, compression);
+            }
+        }
+
+        const char *compression_level = config_get_value_string(obj->parameters,
+                                                                "compression_level");
+        if (compression_level)
+        {
+            long level = strtol(compression_level, &endptr, 0);
+            if (*endptr != '\0' || level < 1 || level > 9)
+            {
+                MXS_ERROR("Invalid value for 'compression_level' for server %s: %s",
+                          server->unique_name, compression_level);
+            }
+            else
+            {
+                server->compression_level = level;
+            }
+        }
+
+        const char *warmup = config_get_value_string(obj->parameters, "warmup_time");
+        if (warmup)
+        {
+            long seconds = strtol(warmup, &endptr, 0);
+            if (*endptr != '\0' || seconds < 0)
+            {
+                MXS_ERROR("Invalid value for 'warmup_time' for server %s: %s",
+                          server->unique_name, warmup);
+            }
+            else
+            {
+                server->warmup_time = seconds;
+            }
+        }
+
         CONFIG_PARAMETER *params = obj->parameters;
 
         server->server_ssl = make_ssl_structure(obj, false, &error_count);
@@ -2596,6 +3255,12 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
                        "using default value of 10000 milliseconds.", obj->object);
         }
 
+        char *max_interval = config_get_value(obj->parameters, "max_monitor_interval");
+        if (max_interval)
+        {
+            monitorSetMaxInterval(obj->element, atoi(max_interval));
+        }
+
         char *connect_timeout = config_get_value(obj->parameters, "backend_connect_timeout");
         if (connect_timeout)
         {
@@ -2675,6 +3340,51 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
     return error_count;
 }
 
+/**
+ * Set the admission limits of a listener from its configuration
+ * @param obj Listener configuration context
+ * @param listener The listener that was created from the configuration
+ * @return Number of errors
+ */
+static int configure_listener_admission(CONFIG_CONTEXT *obj, SERV_LISTENER *listener)
+{
+    const char *names[] = {"connection_rate", "subnet_connection_rate", "max_handshakes"};
+    int values[3] = {0, 0, 0};
+    int error_count = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        char *value = config_get_value(obj->parameters, (char*)names[i]);
+
+        if (value)
+        {
+            char *endptr;
+            long n = strtol(value, &endptr, 10);
+
+            if (*value == '\0' || *endptr != '\0' || n < 0 || n > INT_MAX)
+            {
+                MXS_ERROR("Invalid value for '%s' in listener '%s': %s",
+                          names[i], obj->object, value);
+                error_count++;
+            }
+            else
+            {
+                values[i] = n;
+            }
+        }
+    }
+
+    if (error_count == 0 && (values[0] || values[1] || values[2]) &&
+        !listener_set_admission(listener, values[0], values[1], values[2]))
+    {
+        MXS_ERROR("Failed to allocate the connection rate limits of listener '%s'.",
+                  obj->object);
+        error_count++;
+    }
+
+    return error_count;
+}
+
 /**
  * Create a new listener for a service
  * @param obj Listener configuration context
@@ -2707,7 +3417,11 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info);
+                    /** The listener that was added is the first one of the service */
+                    if (serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info))
+                    {
+                        error_count += configure_listener_admission(obj, service->ports);
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, 0);
@@ -2727,7 +3441,10 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info))
+                    {
+                        error_count += configure_listener_admission(obj, service->ports);
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, atoi(port));
@@ -37,6 +37,11 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mysql.h>
 
 #include <dcb.h>
@@ -50,6 +55,7 @@
 #include <mysqld_error.h>
 #include <regex.h>
 #include <mysql_utils.h>
+#include <thread.h>
 
 /** Don't include the root user */
 #define USERS_QUERY_NO_ROOT " AND user.user NOT IN ('root')"
@@ -111,6 +117,16 @@
 #define MAX_QUERY_STR_LEN strlen(MYSQL_USERS_COUNT_TEMPLATE_START MYSQL_USERS_COUNT_TEMPLATE_END \
     MYSQL_USERS_DB_QUERY_TEMPLATE) + strlen(USERS_QUERY_NO_ROOT) * 2 + strlen(MYSQL57_PASSWORD) * 4 + 1
 
+/** Digest of the users query result for each first character of the user
+ * names. The users query is inserted between the START and END portions. */
+#define MYSQL_USERS_DIGEST_TEMPLATE_START "SELECT BINARY LEFT(user, 1) AS prefix, \
+    COUNT(1), SUM(CRC32(COALESCE(userdata, user))) FROM ("
+#define MYSQL_USERS_DIGEST_TEMPLATE_END ") AS tbl_digest GROUP BY prefix"
+
+/** The rows of the users query for a list of first characters of the user names */
+#define MYSQL_USERS_PREFIX_TEMPLATE_START "SELECT * FROM ("
+#define MYSQL_USERS_PREFIX_TEMPLATE_END ") AS tbl_users WHERE BINARY LEFT(user, 1) IN ("
+
 #define LOAD_MYSQL_DATABASE_NAMES "SELECT * \
     FROM ( (SELECT COUNT(1) AS ndbs \
     FROM INFORMATION_SCHEMA.SCHEMATA) AS tbl1, \
@@ -125,12 +141,14 @@ static int add_databases(SERVICE *service, MYSQL *con);
 static int add_wildcard_users(USERS *users, char* name, char* host,
                               char* password, char* anydb, char* db, HASHTABLE* hash);
 static void *dbusers_keyread(int fd);
-static int dbusers_keywrite(int fd, void *key);
 static void *dbusers_valueread(int fd);
-static int dbusers_valuewrite(int fd, void *value);
 static int get_all_users(SERVICE *service, USERS *users);
 static int get_databases(SERVICE *, MYSQL *);
 static int get_users(SERVICE *service, USERS *users);
+static HASHTABLE *get_users_digests(SERVICE *service, MYSQL *con, const char *server_version);
+static MYSQL *dbusers_connect(SERVICE *service, SERVER_REF **dbref);
+static int add_user_row(SERVICE *service, USERS *users, MYSQL_RES *result, MYSQL_ROW row,
+                        bool db_grants, bool *anon_user);
 static MYSQL *gw_mysql_init(void);
 static int gw_mysql_set_timeouts(MYSQL* handle);
 static bool host_has_singlechar_wildcard(const char *host);
@@ -148,6 +166,61 @@ static int uh_hfun(void* key);
 static void *uh_keydup(void* key);
 static void uh_keyfree(void* key);
 static int wildcard_db_grant(char* str);
+static bool grant_matches_db(const char *db, const char *grant);
+static bool mysql_users_index_add(USERS *users, MYSQL_USER_HOST *key, char *auth);
+static int mysql_users_delete(USERS *users, MYSQL_USER_HOST *key);
+static void mysql_users_index_delete(USERS *users, MYSQL_USER_HOST *key);
+static int mysql_users_replace(USERS *users, MYSQL_USER_HOST *key, char *auth);
+static bool mysql_users_index_replace(USERS *users, MYSQL_USER_HOST *key, char *auth);
+
+/** A host and database grant of a user in the users index */
+typedef struct mysql_user_grant
+{
+    uint32_t addr;      /**< IPv4 network address in network byte order */
+    int netmask;        /**< Number of network bits in the address */
+    char *hostname;     /**< Address pattern with '_' wildcards or NULL */
+    char *resource;     /**< Database grant, "" for any database and NULL for none */
+    char *auth;         /**< The authentication data */
+} MYSQL_USER_GRANT;
+
+/** The grants of one user, from the most specific host to the least specific
+ * one. The strings are stored in the same allocation as the grants. */
+typedef struct mysql_user_grants
+{
+    int n_grants;
+    MYSQL_USER_GRANT grants[];
+} MYSQL_USER_GRANTS;
+
+/** A connection attempt to one backend server of a service */
+typedef struct dbusers_attempt
+{
+    SERVER_REF *dbref;      /**< The server being connected to */
+    MYSQL *con;             /**< The connection or NULL if the attempt failed */
+    bool done;              /**< Whether the attempt has completed */
+    struct dbusers_connector *connector;
+} DBUSERS_ATTEMPT;
+
+/**
+ * Concurrent connection attempts to all the backend servers of a service. The
+ * state is shared by the connecting threads and the thread loading the users
+ * and is freed by whichever of them releases it last.
+ */
+typedef struct dbusers_connector
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refcount;           /**< Running attempts plus the waiting thread */
+    bool abandoned;         /**< Late connections are closed by their threads */
+    char *service;          /**< Name of the service, for logging */
+    char *user;             /**< The service user */
+    char *password;         /**< The decrypted service password */
+    int n_attempts;
+    int n_done;
+    DBUSERS_ATTEMPT attempts[];
+} DBUSERS_CONNECTOR;
+
+static DBUSERS_CONNECTOR *dbusers_connector_start(SERVICE *service);
+static void dbusers_connector_release(DBUSERS_CONNECTOR *connector, DBUSERS_ATTEMPT *keep);
 
 /**
  * Get the user data query with databases
@@ -356,6 +429,390 @@ replace_mysql_users(SERVICE *service)
     return i;
 }
 
+/**
+ * Add a copy of a string to a list of strings
+ *
+ * @param list      The list, reallocated as needed
+ * @param n         The number of strings in the list
+ * @param str       The string to add
+ * @return          True on success, false if memory allocation failed
+ */
+static bool
+strlist_add(char ***list, int n, const char *str)
+{
+    char **newlist = realloc(*list, (n + 1) * sizeof(char*));
+
+    if (newlist == NULL)
+    {
+        return false;
+    }
+
+    *list = newlist;
+    return (newlist[n] = strdup(str)) != NULL;
+}
+
+/**
+ * Free a list of strings
+ *
+ * @param list      The list
+ * @param n         The number of strings in the list
+ */
+static void
+strlist_free(char **list, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        free(list[i]);
+    }
+    free(list);
+}
+
+/**
+ * Check whether a user name starts with one of the prefixes
+ *
+ * @param user      The user name
+ * @param prefixes  The list of prefixes
+ * @param n         The number of prefixes in the list
+ * @return          True if the user name has one of the prefixes
+ */
+static bool
+prefix_list_match(const char *user, char **prefixes, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (strncmp(user, prefixes[i], strlen(prefixes[i])) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Find the user name prefixes whose digest has changed
+ *
+ * @param old       The digests the users table was loaded with
+ * @param new       The current digests
+ * @param prefixes  Set to the list of changed prefixes
+ * @return          The number of changed prefixes or -1 on memory allocation failure
+ */
+static int
+get_changed_prefixes(HASHTABLE *old, HASHTABLE *new, char ***prefixes)
+{
+    HASHITERATOR *iter;
+    char *prefix;
+    int n = 0;
+
+    *prefixes = NULL;
+
+    if ((iter = hashtable_iterator(new)) == NULL)
+    {
+        return -1;
+    }
+
+    while ((prefix = hashtable_next(iter)) != NULL)
+    {
+        char *digest = hashtable_fetch(old, prefix);
+
+        if (digest == NULL || strcmp(digest, hashtable_fetch(new, prefix)) != 0)
+        {
+            if (!strlist_add(prefixes, n, prefix))
+            {
+                hashtable_iterator_free(iter);
+                strlist_free(*prefixes, n);
+                return -1;
+            }
+            n++;
+        }
+    }
+
+    hashtable_iterator_free(iter);
+
+    if ((iter = hashtable_iterator(old)) == NULL)
+    {
+        strlist_free(*prefixes, n);
+        return -1;
+    }
+
+    /** Prefixes that have no users left */
+    while ((prefix = hashtable_next(iter)) != NULL)
+    {
+        if (hashtable_fetch(new, prefix) == NULL)
+        {
+            if (!strlist_add(prefixes, n, prefix))
+            {
+                hashtable_iterator_free(iter);
+                strlist_free(*prefixes, n);
+                return -1;
+            }
+            n++;
+        }
+    }
+
+    hashtable_iterator_free(iter);
+    return n;
+}
+
+/**
+ * Merge the freshly loaded users into the live users table. New entries are
+ * added and changed entries are replaced in place first, and the entries that
+ * no longer exist are removed last. A reader of the table sees either the old
+ * or the new data of a user but never finds an existing user missing.
+ *
+ * @param users     The live users table
+ * @param fresh     The users loaded for the changed prefixes
+ * @param prefixes  The changed prefixes
+ * @param n         The number of changed prefixes
+ * @return          The number of added, changed and removed entries
+ */
+int
+mysql_users_merge(USERS *users, USERS *fresh, char **prefixes, int n)
+{
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+    MYSQL_USER_HOST **stale = NULL;
+    int nstale = 0;
+    int changes = 0;
+
+    if ((iter = hashtable_iterator(fresh->data)) != NULL)
+    {
+        while ((key = hashtable_next(iter)) != NULL)
+        {
+            char *auth = hashtable_fetch(fresh->data, key);
+            char *current = hashtable_fetch(users->data, key);
+
+            if (current == NULL)
+            {
+                changes += mysql_users_add(users, key, auth);
+            }
+            else if (strcmp(current, auth) != 0)
+            {
+                changes += mysql_users_replace(users, key, auth);
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
+    if ((iter = hashtable_iterator(users->data)) != NULL)
+    {
+        while ((key = hashtable_next(iter)) != NULL)
+        {
+            if (prefix_list_match(key->user, prefixes, n) &&
+                hashtable_fetch(fresh->data, key) == NULL)
+            {
+                MYSQL_USER_HOST **list = realloc(stale, (nstale + 1) * sizeof(*stale));
+
+                if (list == NULL || (list[nstale] = uh_keydup(key)) == NULL)
+                {
+                    stale = list ? list : stale;
+                    break;
+                }
+                stale = list;
+                nstale++;
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
+    for (int i = 0; i < nstale; i++)
+    {
+        changes += mysql_users_delete(users, stale[i]);
+        uh_keyfree(stale[i]);
+    }
+    free(stale);
+
+    return changes;
+}
+
+/**
+ * Remove all cached client lookups of a users table. The generation of the
+ * table is incremented first so that lookups which started before the update
+ * are not stored.
+ *
+ * @param users     The users table
+ */
+static void
+flush_mysql_users_lookups(USERS *users)
+{
+    HASHITERATOR *iter;
+    char *key;
+    char **keys = NULL;
+    int n = 0;
+
+    atomic_add(&users->generation, 1);
+
+    if (users->lookups == NULL || (iter = hashtable_iterator(users->lookups)) == NULL)
+    {
+        return;
+    }
+
+    while ((key = hashtable_next(iter)) != NULL)
+    {
+        if (!strlist_add(&keys, n, key))
+        {
+            break;
+        }
+        n++;
+    }
+    hashtable_iterator_free(iter);
+
+    for (int i = 0; i < n; i++)
+    {
+        hashtable_delete(users->lookups, keys[i]);
+    }
+    strlist_free(keys, n);
+}
+
+/**
+ * Update the users of the service in place with the users that have changed
+ * since the table was loaded.
+ *
+ * The backend computes a digest of the users for each first character of the
+ * user names. Only the users whose digest differs from the one taken when the
+ * table was loaded are fetched, and they are merged into the live table. The
+ * readers of the table are not blocked while it is updated. If the table has
+ * no digests or most of them have changed, the table is replaced in full with
+ * replace_mysql_users().
+ *
+ * @param service   The current service
+ * @return      -1 on any error or the number of changed entries
+ */
+int
+update_mysql_users(SERVICE *service)
+{
+    USERS *users = service->users;
+    SERVER_REF *server;
+    HASHTABLE *digests;
+    HASHTABLE *oldresources;
+    MYSQL *con;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    USERS *fresh;
+    char **prefixes;
+    int nprefixes;
+    bool anon_user = false;
+    int rval;
+
+    if (users == NULL || users->digests == NULL || service->users_from_all)
+    {
+        return replace_mysql_users(service);
+    }
+
+    if ((con = dbusers_connect(service, &server)) == NULL)
+    {
+        return -1;
+    }
+
+    digests = get_users_digests(service, con, server->server->server_string);
+
+    if (digests == NULL ||
+        (nprefixes = get_changed_prefixes(users->digests, digests, &prefixes)) == -1)
+    {
+        hashtable_free(digests);
+        mysql_close(con);
+        return replace_mysql_users(service);
+    }
+
+    if (nprefixes == 0)
+    {
+        MXS_DEBUG("%lu [update_mysql_users] users' table not updated, digests are the same",
+                  pthread_self());
+        hashtable_free(digests);
+        mysql_close(con);
+        return 0;
+    }
+
+    if (nprefixes > hashtable_size(digests) / 2)
+    {
+        /** Fetching most of the users one prefix at a time is not worth it */
+        strlist_free(prefixes, nprefixes);
+        hashtable_free(digests);
+        mysql_close(con);
+        return replace_mysql_users(service);
+    }
+
+    /** Each prefix is a single character of at most four bytes */
+    char userquery[MAX_QUERY_STR_LEN];
+    get_users_db_query(server->server->server_string, service->enable_root, userquery);
+    size_t len = sizeof(MYSQL_USERS_PREFIX_TEMPLATE_START) + strlen(userquery) +
+                 sizeof(MYSQL_USERS_PREFIX_TEMPLATE_END) + nprefixes * 12 + 1;
+    char *query = malloc(len);
+
+    if (query == NULL || (fresh = mysql_users_alloc()) == NULL)
+    {
+        free(query);
+        strlist_free(prefixes, nprefixes);
+        hashtable_free(digests);
+        mysql_close(con);
+        return -1;
+    }
+
+    char *ptr = query + sprintf(query, "%s%s%s", MYSQL_USERS_PREFIX_TEMPLATE_START,
+                                userquery, MYSQL_USERS_PREFIX_TEMPLATE_END);
+
+    for (int i = 0; i < nprefixes; i++)
+    {
+        *ptr++ = i ? ',' : ' ';
+        *ptr++ = '\'';
+        ptr += mysql_real_escape_string(con, ptr, prefixes[i], strlen(prefixes[i]));
+        *ptr++ = '\'';
+    }
+    strcpy(ptr, ")");
+
+    if (mysql_query(con, query) || (result = mysql_store_result(con)) == NULL)
+    {
+        MXS_ERROR("Updating users for service [%s] encountered error: [%s].",
+                  service->name, mysql_error(con));
+        free(query);
+        users_free(fresh);
+        strlist_free(prefixes, nprefixes);
+        hashtable_free(digests);
+        mysql_close(con);
+        return -1;
+    }
+
+    free(query);
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        add_user_row(service, fresh, result, row, true, &anon_user);
+    }
+
+    mysql_free_result(result);
+
+    /** The database names are reloaded just like with a full reload */
+    oldresources = service->resources;
+    get_databases(service, con);
+    mysql_close(con);
+
+    rval = mysql_users_merge(users, fresh, prefixes, nprefixes);
+    flush_mysql_users_lookups(users);
+
+    /** Set the parameter if it is not configured by the user */
+    if (service->localhost_match_wildcard_host == SERVICE_PARAM_UNINIT)
+    {
+        service->localhost_match_wildcard_host = anon_user ? 0 : 1;
+    }
+
+    hashtable_free(users->digests);
+    users->digests = digests;
+
+    spinlock_acquire(&service->spin);
+    if (service->resources != oldresources)
+    {
+        resource_free(oldresources);
+    }
+    spinlock_release(&service->spin);
+
+    MXS_INFO("%s: Updated %d entries of the users' table from %d changed user name "
+             "prefixes.", service->name, rval, nprefixes);
+
+    users_free(fresh);
+    strlist_free(prefixes, nprefixes);
+
+    return rval;
+}
+
 /**
  * Check if the IP address is a valid MySQL IP address. The IP address can contain
  * single or multi-character wildcards as used by MySQL.
@@ -738,6 +1195,58 @@ get_databases(SERVICE *service, MYSQL *con)
     return ndbs;
 }
 
+/**
+ * Load the digests of the users for each first character of the user names
+ *
+ * @param service           The service
+ * @param con               Connection to the backend server
+ * @param server_version    Version string of the backend server
+ * @return                  The digests by prefix or NULL if they could not be loaded
+ */
+static HASHTABLE *
+get_users_digests(SERVICE *service, MYSQL *con, const char *server_version)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    HASHTABLE *digests;
+    char userquery[MAX_QUERY_STR_LEN];
+
+    get_users_db_query(server_version, service->enable_root, userquery);
+
+    size_t len = sizeof(MYSQL_USERS_DIGEST_TEMPLATE_START) + strlen(userquery) +
+                 sizeof(MYSQL_USERS_DIGEST_TEMPLATE_END);
+    char query[len];
+    snprintf(query, len, "%s%s%s", MYSQL_USERS_DIGEST_TEMPLATE_START,
+             userquery, MYSQL_USERS_DIGEST_TEMPLATE_END);
+
+    if (mysql_query(con, query) || (result = mysql_store_result(con)) == NULL)
+    {
+        MXS_INFO("%s: Failed to load the digests of the users, the users will "
+                 "be reloaded in full: %s", service->name, mysql_error(con));
+        return NULL;
+    }
+
+    if ((digests = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, simple_str_hash,
+                                   strcmp)) != NULL)
+    {
+        hashtable_memory_fns(digests, (HASHMEMORYFN) strdup, (HASHMEMORYFN) strdup,
+                             (HASHMEMORYFN) free, (HASHMEMORYFN) free);
+
+        while ((row = mysql_fetch_row(result)))
+        {
+            if (row[0])
+            {
+                char digest[64];
+                snprintf(digest, sizeof(digest), "%s:%s", row[1], row[2] ? row[2] : "0");
+                hashtable_add(digests, row[0], digest);
+            }
+        }
+    }
+
+    mysql_free_result(result);
+    return digests;
+}
+
 /**
  * Load the user/passwd from mysql.user table into the service users' hashtable
  * environment from all the backend servers.
@@ -754,7 +1263,6 @@ get_all_users(SERVICE *service, USERS *users)
     MYSQL_RES *result = NULL;
     char *service_user = NULL;
     char *service_passwd = NULL;
-    char *dpwd = NULL;
     int total_users = 0;
     SERVER_REF *server;
     const char *userquery;
@@ -769,6 +1277,8 @@ get_all_users(SERVICE *service, USERS *users)
     int dbnames = 0;
     int db_grants = 0;
     bool anon_user = false;
+    DBUSERS_CONNECTOR *connector = NULL;
+    int nconnected = 0;
 
     if (serviceGetUser(service, &service_user, &service_passwd) == 0)
     {
@@ -781,15 +1291,10 @@ get_all_users(SERVICE *service, USERS *users)
         return -1;
     }
 
-    dpwd = decryptPassword(service_passwd);
     final_data = (char*) malloc(sizeof(char));
     *final_data = '\0';
 
-    /**
-     * Attempt to connect to one of the databases database or until we run
-     * out of databases
-     * to try
-     */
+    /** Connect to all the servers concurrently and load from each one that responds */
     server = service->dbref;
 
     if (server == NULL)
@@ -799,89 +1304,53 @@ get_all_users(SERVICE *service, USERS *users)
 
     service->resources = resource_alloc();
 
-    while (server != NULL)
+    if ((connector = dbusers_connector_start(service)) == NULL)
     {
-        while (!service->svc_do_shutdown && server != NULL)
-        {
-            con = gw_mysql_init();
-            if (con)
-            {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
-            }
-            else
-            {
-                server = NULL;
-                break;
-            }
+        goto cleanup;
+    }
 
-            server = server->next;
-        }
+    /** The users are loaded from all the servers so every attempt is waited for */
+    pthread_mutex_lock(&connector->lock);
 
-        if (server == NULL)
-        {
-            MXS_ERROR("Unable to get user data from backend database "
-                      "for service [%s]. Missing server information.",
-                      service->name);
-            goto cleanup;
-        }
-
-        add_databases(service, con);
-        mysql_close(con);
-        server = server->next;
+    while (connector->n_done < connector->n_attempts)
+    {
+        pthread_cond_wait(&connector->cond, &connector->lock);
     }
 
-    server = service->dbref;
+    pthread_mutex_unlock(&connector->lock);
 
-    while (server != NULL)
+    for (int i = 0; i < connector->n_attempts; i++)
     {
-        while (!service->svc_do_shutdown && server != NULL)
+        if (connector->attempts[i].con)
         {
-            con = gw_mysql_init();
-            if (con)
-            {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
-            }
-            else
-            {
-                server = NULL;
-                break;
-            }
-
-            server = server->next;
+            add_databases(service, connector->attempts[i].con);
+            nconnected++;
         }
+    }
+
+    if (nconnected == 0 || service->svc_do_shutdown)
+    {
+        MXS_ERROR("Unable to get user data from backend database for service [%s]."
+                  " Failed to connect to any of the backend databases.", service->name);
+        goto cleanup;
+    }
 
-        if (server == NULL)
+    for (int i = 0; i < connector->n_attempts; i++)
+    {
+        /** The connection is closed when the users have been loaded from it */
+        server = connector->attempts[i].dbref;
+        con = connector->attempts[i].con;
+        connector->attempts[i].con = NULL;
+
+        if (con == NULL)
         {
-            MXS_ERROR("Unable to get user data from backend database "
-                      "for service [%s]. Missing server information.",
-                      service->name);
-            goto cleanup;
+            continue;
         }
 
+        int server_users = total_users;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
         if (server->server->server_string == NULL)
         {
             const char *server_string = mysql_get_server_info(con);
@@ -1195,14 +1664,11 @@ get_all_users(SERVICE *service, USERS *users)
         strcat(final_data, users_data);
         free(users_data);
 
-        if (service->users_from_all)
-        {
-            server = server->next;
-        }
-        else
-        {
-            server = NULL;
-        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        MXS_INFO("[%s] Loaded %d users from [%s:%i] in %ld ms.", service->name,
+                 total_users - server_users, server->server->name, server->server->port,
+                 (long)(end.tv_sec - start.tv_sec) * 1000 +
+                 (end.tv_nsec - start.tv_nsec) / 1000000);
     }
 
     /* compute SHA1 digest for users' data */
@@ -1217,241 +1683,622 @@ get_all_users(SERVICE *service, USERS *users)
     }
 cleanup:
 
-    free(dpwd);
+    if (connector)
+    {
+        dbusers_connector_release(connector, NULL);
+    }
+
     free(final_data);
 
     return total_users;
 }
 
 /**
- * Load the user/passwd form mysql.user table into the service users' hashtable
- * environment.
+ * Free the connection attempts once the last reference is released
  *
- * @param service   The current service
- * @param users     The users table into which to load the users
- * @return          -1 on any error or the number of users inserted
+ * @param connector The connection attempts
  */
-static int
-get_users(SERVICE *service, USERS *users)
+static void
+dbusers_connector_free(DBUSERS_CONNECTOR *connector)
+{
+    pthread_mutex_destroy(&connector->lock);
+    pthread_cond_destroy(&connector->cond);
+    free(connector->service);
+    free(connector->user);
+    free(connector->password);
+    free(connector);
+}
+
+/**
+ * Thread that connects to one backend server
+ *
+ * @param data  The DBUSERS_ATTEMPT to perform
+ */
+static void
+dbusers_attempt_thread(void *data)
 {
+    DBUSERS_ATTEMPT *attempt = (DBUSERS_ATTEMPT*)data;
+    DBUSERS_CONNECTOR *connector = attempt->connector;
+    SERVER *server = attempt->dbref->server;
     MYSQL *con = NULL;
-    MYSQL_ROW row;
-    MYSQL_RES *result = NULL;
-    char *service_user = NULL;
-    char *service_passwd = NULL;
-    char *dpwd;
-    int total_users = 0;
-    SERVER_REF *server;
-    const char *userquery;
-    unsigned char hash[SHA_DIGEST_LENGTH] = "";
-    char *users_data = NULL;
-    int nusers = 0;
-    int users_data_row_len = MYSQL_USER_MAXLEN +
-                             MYSQL_HOST_MAXLEN +
-                             MYSQL_PASSWORD_LEN +
-                             sizeof(char) +
-                             MYSQL_DATABASE_MAXLEN;
-    int dbnames = 0;
-    int db_grants = 0;
-    char dbnm[MYSQL_DATABASE_MAXLEN + 1];
-    bool anon_user = false;
+    struct timespec start, end;
 
-    if (serviceGetUser(service, &service_user, &service_passwd) == 0)
+    if (mysql_thread_init() == 0)
     {
-        ss_dassert(service_passwd == NULL || service_user == NULL);
-        return -1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if ((con = gw_mysql_init()) &&
+            mxs_mysql_real_connect(con, server, connector->user, connector->password) == NULL)
+        {
+            MXS_ERROR("Failure loading users data from backend "
+                      "[%s:%i] for service [%s]. MySQL error %i, %s",
+                      server->name, server->port, connector->service,
+                      mysql_errno(con), mysql_error(con));
+            mysql_close(con);
+            con = NULL;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        MXS_INFO("[%s] Connecting to [%s:%i] for loading users %s in %ld ms.",
+                 connector->service, server->name, server->port,
+                 con ? "succeeded" : "failed",
+                 (long)(end.tv_sec - start.tv_sec) * 1000 +
+                 (end.tv_nsec - start.tv_nsec) / 1000000);
+    }
+    else
+    {
+        MXS_ERROR("Could not perform thread initialization for MySQL.");
     }
 
-    if (service->users_from_all)
+    pthread_mutex_lock(&connector->lock);
+
+    if (connector->abandoned && con)
     {
-        return get_all_users(service, users);
+        mysql_close(con);
+        con = NULL;
     }
 
-    con = gw_mysql_init();
+    attempt->con = con;
+    attempt->done = true;
+    connector->n_done++;
+    bool last = --connector->refcount == 0;
+    pthread_cond_broadcast(&connector->cond);
+    pthread_mutex_unlock(&connector->lock);
 
-    if (!con)
+    if (last)
     {
-        return -1;
+        dbusers_connector_free(connector);
     }
 
-    /**
-     * Attempt to connect to one of the databases database or until we run
-     * out of databases
-     * to try
-     */
-    server = service->dbref;
-    dpwd = decryptPassword(service_passwd);
+    mysql_thread_end();
+}
+
+/**
+ * Start connecting concurrently to all the backend servers of a service
+ *
+ * @param service   The service
+ * @return          The connection attempts or NULL on error
+ */
+static DBUSERS_CONNECTOR *
+dbusers_connector_start(SERVICE *service)
+{
+    char *service_user = NULL;
+    char *service_passwd = NULL;
+    int n = 0;
 
-    /* Select a server with Master bit, if available */
-    while (server != NULL && !(server->server->status & SERVER_MASTER))
+    if (service->svc_do_shutdown ||
+        serviceGetUser(service, &service_user, &service_passwd) == 0)
     {
-        server = server->next;
+        return NULL;
     }
 
-    if (service->svc_do_shutdown)
+    for (SERVER_REF *ref = service->dbref; ref; ref = ref->next)
     {
-        free(dpwd);
-        mysql_close(con);
-        return -1;
+        n++;
     }
 
-    /* Try loading data from master server */
-    if (server != NULL &&
-        (mxs_mysql_real_connect(con, server->server, service_user, dpwd) != NULL))
+    DBUSERS_CONNECTOR *connector = calloc(1, sizeof(DBUSERS_CONNECTOR) +
+                                          n * sizeof(DBUSERS_ATTEMPT));
+
+    if (connector == NULL)
     {
-        MXS_DEBUG("Dbusers : Loading data from backend database with "
-                  "Master role [%s:%i] for service [%s]",
-                  server->server->name,
-                  server->server->port,
-                  service->name);
+        return NULL;
     }
-    else
+
+    pthread_mutex_init(&connector->lock, NULL);
+    pthread_cond_init(&connector->cond, NULL);
+    connector->refcount = 1;
+    connector->service = strdup(service->name);
+    connector->user = strdup(service_user);
+    connector->password = decryptPassword(service_passwd);
+
+    if (connector->service == NULL || connector->user == NULL ||
+        connector->password == NULL)
     {
-        mysql_close(con);
-        /* load data from other servers via loop */
-        server = service->dbref;
+        dbusers_connector_free(connector);
+        return NULL;
+    }
+
+    SERVER_REF *ref = service->dbref;
+
+    for (int i = 0; i < n; i++, ref = ref->next)
+    {
+        DBUSERS_ATTEMPT *attempt = &connector->attempts[i];
+        THREAD thd;
+
+        attempt->dbref = ref;
+        attempt->connector = connector;
+        connector->n_attempts++;
+
+        pthread_mutex_lock(&connector->lock);
+        connector->refcount++;
+        pthread_mutex_unlock(&connector->lock);
+
+        if (thread_start(&thd, dbusers_attempt_thread, attempt) == NULL)
+        {
+            MXS_ERROR("[%s] Failed to start a thread for connecting to [%s:%i].",
+                      service->name, ref->server->name, ref->server->port);
+            pthread_mutex_lock(&connector->lock);
+            connector->refcount--;
+            attempt->done = true;
+            connector->n_done++;
+            pthread_mutex_unlock(&connector->lock);
+        }
+        else
+        {
+            thread_detach(thd);
+        }
+    }
+
+    return connector;
+}
+
+/**
+ * Pick the connection to load the users from. A connection to a server with
+ * the Master role is used if one can be made, otherwise the first connection
+ * made to any other server. Must be called with the lock held.
+ *
+ * @param connector The connection attempts
+ * @return          The chosen attempt, NULL if none is usable yet
+ */
+static DBUSERS_ATTEMPT *
+dbusers_connector_pick(DBUSERS_CONNECTOR *connector)
+{
+    DBUSERS_ATTEMPT *master = NULL;
+    bool master_pending = false;
 
-        while (!service->svc_do_shutdown && server != NULL)
+    for (int i = 0; i < connector->n_attempts; i++)
+    {
+        DBUSERS_ATTEMPT *attempt = &connector->attempts[i];
+
+        if (attempt->dbref->server->status & SERVER_MASTER)
         {
-            con = gw_mysql_init();
-            if (con)
+            if (!attempt->done)
             {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
+                master_pending = true;
             }
-            else
+            else if (attempt->con && master == NULL)
             {
-                server = NULL;
-                break;
+                master = attempt;
             }
-
-            server = server->next;
         }
+    }
 
-        if (service->svc_do_shutdown)
+    if (master || master_pending)
+    {
+        return master;
+    }
+
+    for (int i = 0; i < connector->n_attempts; i++)
+    {
+        if (connector->attempts[i].con)
         {
-            free(dpwd);
-            mysql_close(con);
-            return -1;
+            return &connector->attempts[i];
         }
+    }
+
+    return NULL;
+}
+
+/**
+ * Release the connection attempts. Connections that were made but not kept
+ * are closed and connections completing later are closed by their threads.
+ *
+ * @param connector The connection attempts
+ * @param keep      The attempt whose connection the caller keeps or NULL
+ */
+static void
+dbusers_connector_release(DBUSERS_CONNECTOR *connector, DBUSERS_ATTEMPT *keep)
+{
+    MYSQL *unused[connector->n_attempts + 1];
+    int n_unused = 0;
+
+    pthread_mutex_lock(&connector->lock);
+    connector->abandoned = true;
 
-        if (server != NULL)
+    for (int i = 0; i < connector->n_attempts; i++)
+    {
+        DBUSERS_ATTEMPT *attempt = &connector->attempts[i];
+
+        if (attempt != keep && attempt->con)
         {
-            MXS_DEBUG("Loading data from backend database [%s:%i] for service [%s]",
-                      server->server->name, server->server->port, service->name);
+            unused[n_unused++] = attempt->con;
+            attempt->con = NULL;
         }
     }
 
-    free(dpwd);
+    bool last = --connector->refcount == 0;
+    pthread_mutex_unlock(&connector->lock);
 
-    if (server == NULL)
+    for (int i = 0; i < n_unused; i++)
     {
-        MXS_ERROR("Unable to get user data from backend database for service [%s]."
-                  " Failed to connect to any of the backend databases.", service->name);
-        return -1;
+        mysql_close(unused[i]);
     }
 
-    if (server->server->server_string == NULL)
+    if (last)
     {
-        const char *server_string = mysql_get_server_info(con);
-        if (!server_set_version_string(server->server, server_string))
-        {
-            mysql_close(con);
-            return -1;
-        }
+        dbusers_connector_free(connector);
     }
+}
 
-    char querybuffer[MAX_QUERY_STR_LEN];
-    const char *usercount = get_usercount_query(server->server->server_string,
-                                                service->enable_root, querybuffer);
-    /** Count users. Start with users and db grants for users */
-    if (mysql_query(con, usercount))
+/**
+ * Connect to a backend server of the service for loading the users. All the
+ * servers are connected to concurrently so that an unresponsive server only
+ * delays the loading if it is the master. A server with the Master role is
+ * preferred.
+ *
+ * @param service   The service
+ * @param dbref     Set to the server the connection was made to
+ * @return          The connection or NULL if no server could be connected to
+ */
+static MYSQL *
+dbusers_connect(SERVICE *service, SERVER_REF **dbref)
+{
+    DBUSERS_CONNECTOR *connector = dbusers_connector_start(service);
+    DBUSERS_ATTEMPT *attempt = NULL;
+    SERVER_REF *server = NULL;
+    MYSQL *con = NULL;
+
+    if (connector == NULL)
     {
-        if (mysql_errno(con) != ER_TABLEACCESS_DENIED_ERROR)
-        {
-            /* This is an error we cannot handle, return */
-            MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
-                      service->name, mysql_error(con));
-            mysql_close(con);
-            return -1;
-        }
-        else
-        {
-            /*
-             * We have got ER_TABLEACCESS_DENIED_ERROR
-             * try counting users from mysql.user without DB names.
-             */
-            if (mysql_query(con, MYSQL_USERS_COUNT))
-            {
-                MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
-                          service->name, mysql_error(con));
-                mysql_close(con);
-                return -1;
-            }
-        }
+        return NULL;
     }
 
-    result = mysql_store_result(con);
+    pthread_mutex_lock(&connector->lock);
 
-    if (result == NULL)
+    while ((attempt = dbusers_connector_pick(connector)) == NULL &&
+           connector->n_done < connector->n_attempts)
     {
-        MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
-                  service->name, mysql_error(con));
-        mysql_close(con);
-        return -1;
+        pthread_cond_wait(&connector->cond, &connector->lock);
     }
 
-    row = mysql_fetch_row(result);
-
-    nusers = atoi(row[0]);
+    if (attempt)
+    {
+        server = attempt->dbref;
+        con = attempt->con;
+    }
 
-    mysql_free_result(result);
+    pthread_mutex_unlock(&connector->lock);
+    dbusers_connector_release(connector, attempt);
 
-    if (!nusers)
+    if (con && service->svc_do_shutdown)
     {
-        MXS_ERROR("Counting users for service %s returned 0.", service->name);
         mysql_close(con);
-        return -1;
+        return NULL;
     }
 
-    userquery = get_users_db_query(server->server->server_string,
-                                   service->enable_root, querybuffer);
-    /* send first the query that fetches users and db grants */
-    if (mysql_query(con, userquery))
+    if (con == NULL)
     {
-        /*
-         * An error occurred executing the query
-         *
-         * Check mysql_errno() against ER_TABLEACCESS_DENIED_ERROR)
-         */
-
-        if (1142 != mysql_errno(con))
-        {
-            /* This is an error we cannot handle, return */
+        MXS_ERROR("Unable to get user data from backend database for service [%s]."
+                  " Failed to connect to any of the backend databases.", service->name);
+        return NULL;
+    }
 
-            MXS_ERROR("Loading users with dbnames for service [%s] encountered "
-                      "error: [%s], MySQL errno %i", service->name,
-                      mysql_error(con), mysql_errno(con));
+    MXS_DEBUG("Loading data from backend database [%s:%i] for service [%s]",
+              server->server->name, server->server->port, service->name);
 
+    if (server->server->server_string == NULL)
+    {
+        const char *server_string = mysql_get_server_info(con);
+        if (!server_set_version_string(server->server, server_string))
+        {
             mysql_close(con);
-            return -1;
+            return NULL;
         }
-        else
-        {
-            /*
-             * We have got ER_TABLEACCESS_DENIED_ERROR
-             * try loading users from mysql.user without DB names.
+    }
+
+    *dbref = server;
+    return con;
+}
+
+/**
+ * Add one row of the users query result to a users table
+ *
+ * @param service   The service the users are loaded for
+ * @param users     The users table
+ * @param result    The result the row belongs to
+ * @param row       The row: user, host, password, userdata, anydb and db
+ * @param db_grants Whether the row contains the database grants
+ * @param anon_user Set to true if the row is an anonymous user
+ * @return          1 if the user was added, 0 on failure and -1 if the row
+ *                  was skipped or the user is a duplicate
+ */
+static int
+add_user_row(SERVICE *service, USERS *users, MYSQL_RES *result, MYSQL_ROW row,
+             bool db_grants, bool *anon_user)
+{
+    /**
+     * Up to six fields could be returned.
+     * user,host,passwd,concat(),anydb,db
+     * passwd+1 (escaping the first byte that is '*')
+     */
+
+    int rc = 0;
+    char *password = NULL;
+    char dbnm[MYSQL_DATABASE_MAXLEN + 1];
+
+    /** If the username is empty, the backend server still has anonymous
+     * user in it. This will mean that localhost addresses do not match
+     * the wildcard host '%' */
+    if (strlen(row[0]) == 0)
+    {
+        *anon_user = true;
+        return -1;
+    }
+
+    if (row[2] != NULL)
+    {
+        /* detect mysql_old_password (pre 4.1 protocol) */
+        if (strlen(row[2]) == 16)
+        {
+            MXS_ERROR("%s: The user %s@%s has on old password in the "
+                      "backend database. MaxScale does not support these "
+                      "old passwords. This user will not be able to connect "
+                      "via MaxScale. Update the users password to correct "
+                      "this.", service->name, row[0], row[1]);
+        return -1;
+        }
+
+        if (strlen(row[2]) > 1)
+        {
+            password = row[2] + 1;
+        }
+        else
+        {
+            password = row[2];
+        }
+    }
+
+    /*
+     * add user@host and DB global priv and specificsa grant (if possible)
+     */
+    if (db_grants)
+    {
+        bool havedb = false;
+        /* we have dbgrants, store them */
+        if (row[5])
+        {
+            unsigned long *rowlen = mysql_fetch_lengths(result);
+            memcpy(dbnm, row[5], rowlen[5]);
+            memset(dbnm + rowlen[5], 0, 1);
+            havedb = true;
+            if (service->strip_db_esc)
+            {
+                strip_escape_chars(dbnm);
+                MXS_DEBUG("[%s]: %s -> %s", service->name, row[5], dbnm);
+            }
+        }
+
+        if (havedb && wildcard_db_grant(row[5]))
+        {
+            /** Use ANYDB for wildcard grants */
+            rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
+                                                password, "Y", NULL);
+        }
+        else
+        {
+            rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
+                                                password, row[4],
+                                                havedb ? dbnm : NULL);
+        }
+
+    }
+    else
+    {
+        /* we don't have dbgrants, simply set ANY DB for the user */
+        rc = add_mysql_users_with_host_ipv4(users, row[0], row[1], password,
+                                            "Y", NULL);
+    }
+
+    if (rc == 1)
+    {
+        if (db_grants)
+        {
+            char dbgrant[MYSQL_DATABASE_MAXLEN + 1] = "";
+            if (row[4] != NULL)
+            {
+                if (strcmp(row[4], "Y") == 0)
+                {
+                    strcpy(dbgrant, "ANY");
+                }
+                else if (row[5])
+                {
+                    strncpy(dbgrant, row[5], MYSQL_DATABASE_MAXLEN);
+                }
+            }
+
+            if (!strlen(dbgrant))
+            {
+                strcpy(dbgrant, "no db");
+            }
+
+            /* Log the user being added with its db grants */
+            MXS_INFO("%s: User %s@%s for database %s added to "
+                     "service user table.",
+                     service->name,
+                     row[0],
+                     row[1],
+                     dbgrant);
+        }
+        else
+        {
+            /* Log the user being added (without db grants) */
+            MXS_INFO("%s: User %s@%s added to service user table.",
+                     service->name,
+                     row[0],
+                     row[1]);
+        }
+
+    }
+    else
+    {
+        /** Log errors and not the duplicate user */
+        if (service->log_auth_warnings && rc != -1)
+        {
+            MXS_WARNING("Failed to add user %s@%s for"
+                        " service [%s]. This user will be unavailable"
+                        " via MaxScale.", row[0], row[1], service->name);
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Load the user/passwd form mysql.user table into the service users' hashtable
+ * environment.
+ *
+ * @param service   The current service
+ * @param users     The users table into which to load the users
+ * @return          -1 on any error or the number of users inserted
+ */
+static int
+get_users(SERVICE *service, USERS *users)
+{
+    MYSQL *con = NULL;
+    MYSQL_ROW row;
+    MYSQL_RES *result = NULL;
+    char *service_user = NULL;
+    char *service_passwd = NULL;
+    int total_users = 0;
+    SERVER_REF *server;
+    const char *userquery;
+    unsigned char hash[SHA_DIGEST_LENGTH] = "";
+    char *users_data = NULL;
+    int nusers = 0;
+    int users_data_row_len = MYSQL_USER_MAXLEN +
+                             MYSQL_HOST_MAXLEN +
+                             MYSQL_PASSWORD_LEN +
+                             sizeof(char) +
+                             MYSQL_DATABASE_MAXLEN;
+    int dbnames = 0;
+    int db_grants = 0;
+    bool anon_user = false;
+
+    if (serviceGetUser(service, &service_user, &service_passwd) == 0)
+    {
+        ss_dassert(service_passwd == NULL || service_user == NULL);
+        return -1;
+    }
+
+    if (service->users_from_all)
+    {
+        return get_all_users(service, users);
+    }
+
+    con = dbusers_connect(service, &server);
+
+    if (con == NULL)
+    {
+        return -1;
+    }
+
+    char querybuffer[MAX_QUERY_STR_LEN];
+    const char *usercount = get_usercount_query(server->server->server_string,
+                                                service->enable_root, querybuffer);
+    /** Count users. Start with users and db grants for users */
+    if (mysql_query(con, usercount))
+    {
+        if (mysql_errno(con) != ER_TABLEACCESS_DENIED_ERROR)
+        {
+            /* This is an error we cannot handle, return */
+            MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
+                      service->name, mysql_error(con));
+            mysql_close(con);
+            return -1;
+        }
+        else
+        {
+            /*
+             * We have got ER_TABLEACCESS_DENIED_ERROR
+             * try counting users from mysql.user without DB names.
+             */
+            if (mysql_query(con, MYSQL_USERS_COUNT))
+            {
+                MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
+                          service->name, mysql_error(con));
+                mysql_close(con);
+                return -1;
+            }
+        }
+    }
+
+    result = mysql_store_result(con);
+
+    if (result == NULL)
+    {
+        MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
+                  service->name, mysql_error(con));
+        mysql_close(con);
+        return -1;
+    }
+
+    row = mysql_fetch_row(result);
+
+    nusers = atoi(row[0]);
+
+    mysql_free_result(result);
+
+    if (!nusers)
+    {
+        MXS_ERROR("Counting users for service %s returned 0.", service->name);
+        mysql_close(con);
+        return -1;
+    }
+
+    /** The digests are taken before the users so that the next update sees
+     * the changes made while the users are being loaded */
+    HASHTABLE *digests = get_users_digests(service, con, server->server->server_string);
+
+    userquery = get_users_db_query(server->server->server_string,
+                                   service->enable_root, querybuffer);
+    /* send first the query that fetches users and db grants */
+    if (mysql_query(con, userquery))
+    {
+        /*
+         * An error occurred executing the query
+         *
+         * Check mysql_errno() against ER_TABLEACCESS_DENIED_ERROR)
+         */
+
+        if (1142 != mysql_errno(con))
+        {
+            /* This is an error we cannot handle, return */
+
+            MXS_ERROR("Loading users with dbnames for service [%s] encountered "
+                      "error: [%s], MySQL errno %i", service->name,
+                      mysql_error(con), mysql_errno(con));
+
+            hashtable_free(digests);
+            mysql_close(con);
+            return -1;
+        }
+        else
+        {
+            /*
+             * We have got ER_TABLEACCESS_DENIED_ERROR
+             * try loading users from mysql.user without DB names.
             */
             MXS_ERROR("Failed to retrieve users: %s", mysql_error(con));
             MXS_ERROR(ERROR_NO_SHOW_DATABASES, service->name, service_user);
@@ -1465,6 +2312,7 @@ get_users(SERVICE *service, USERS *users)
                           "[%s], code %i", service->name, mysql_error(con),
                           mysql_errno(con));
 
+                hashtable_free(digests);
                 mysql_close(con);
                 return -1;
             }
@@ -1489,6 +2337,7 @@ get_users(SERVICE *service, USERS *users)
         MXS_ERROR("Loading users for service %s encountered error: %s.",
                   service->name, mysql_error(con));
 
+        hashtable_free(digests);
         mysql_free_result(result);
         mysql_close(con);
         return -1;
@@ -1501,6 +2350,7 @@ get_users(SERVICE *service, USERS *users)
         char errbuf[STRERROR_BUFLEN];
         MXS_ERROR("Memory allocation for user data failed due to %d, %s.",
                   errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        hashtable_free(digests);
         mysql_free_result(result);
         mysql_close(con);
         return -1;
@@ -1520,142 +2370,12 @@ get_users(SERVICE *service, USERS *users)
 
     while ((row = mysql_fetch_row(result)))
     {
-
-        /**
-         * Up to six fields could be returned.
-         * user,host,passwd,concat(),anydb,db
-         * passwd+1 (escaping the first byte that is '*')
-         */
-
-        int rc = 0;
-        char *password = NULL;
-
-        /** If the username is empty, the backend server still has anonymous
-         * user in it. This will mean that localhost addresses do not match
-         * the wildcard host '%' */
-        if (strlen(row[0]) == 0)
-        {
-            anon_user = true;
-            continue;
-        }
-
-        if (row[2] != NULL)
+        if (add_user_row(service, users, result, row, db_grants, &anon_user) == 1)
         {
-            /* detect mysql_old_password (pre 4.1 protocol) */
-            if (strlen(row[2]) == 16)
-            {
-                MXS_ERROR("%s: The user %s@%s has on old password in the "
-                          "backend database. MaxScale does not support these "
-                          "old passwords. This user will not be able to connect "
-                          "via MaxScale. Update the users password to correct "
-                          "this.", service->name, row[0], row[1]);
-                continue;
-            }
-
-            if (strlen(row[2]) > 1)
-            {
-                password = row[2] + 1;
-            }
-            else
-            {
-                password = row[2];
-            }
-        }
-
-        /*
-         * add user@host and DB global priv and specificsa grant (if possible)
-         */
-        if (db_grants)
-        {
-            bool havedb = false;
-            /* we have dbgrants, store them */
-            if (row[5])
-            {
-                unsigned long *rowlen = mysql_fetch_lengths(result);
-                memcpy(dbnm, row[5], rowlen[5]);
-                memset(dbnm + rowlen[5], 0, 1);
-                havedb = true;
-                if (service->strip_db_esc)
-                {
-                    strip_escape_chars(dbnm);
-                    MXS_DEBUG("[%s]: %s -> %s", service->name, row[5], dbnm);
-                }
-            }
-
-            if (havedb && wildcard_db_grant(row[5]))
-            {
-                /** Use ANYDB for wildcard grants */
-                rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
-                                                    password, "Y", NULL);
-            }
-            else
-            {
-                rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
-                                                    password, row[4],
-                                                    havedb ? dbnm : NULL);
-            }
-
-        }
-        else
-        {
-            /* we don't have dbgrants, simply set ANY DB for the user */
-            rc = add_mysql_users_with_host_ipv4(users, row[0], row[1], password,
-                                                "Y", NULL);
-        }
-
-        if (rc == 1)
-        {
-            if (db_grants)
-            {
-                char dbgrant[MYSQL_DATABASE_MAXLEN + 1] = "";
-                if (row[4] != NULL)
-                {
-                    if (strcmp(row[4], "Y") == 0)
-                    {
-                        strcpy(dbgrant, "ANY");
-                    }
-                    else if (row[5])
-                    {
-                        strncpy(dbgrant, row[5], MYSQL_DATABASE_MAXLEN);
-                    }
-                }
-
-                if (!strlen(dbgrant))
-                {
-                    strcpy(dbgrant, "no db");
-                }
-
-                /* Log the user being added with its db grants */
-                MXS_INFO("%s: User %s@%s for database %s added to "
-                         "service user table.",
-                         service->name,
-                         row[0],
-                         row[1],
-                         dbgrant);
-            }
-            else
-            {
-                /* Log the user being added (without db grants) */
-                MXS_INFO("%s: User %s@%s added to service user table.",
-                         service->name,
-                         row[0],
-                         row[1]);
-            }
-
             /* Append data in the memory area for SHA1 digest */
             strncat(users_data, row[3], users_data_row_len);
             total_users++;
         }
-        else
-        {
-            /** Log errors and not the duplicate user */
-            if (service->log_auth_warnings && rc != -1)
-            {
-                MXS_WARNING("Failed to add user %s@%s for"
-                            " service [%s]. This user will be unavailable"
-                            " via MaxScale.", row[0], row[1], service->name);
-            }
-        }
     }
 
     /* compute SHA1 digest for users' data */
@@ -1663,6 +2383,9 @@ get_users(SERVICE *service, USERS *users)
 
     memcpy(users->cksum, hash, SHA_DIGEST_LENGTH);
 
+    hashtable_free(users->digests);
+    users->digests = digests;
+
     /** Set the parameter if it is not configured by the user */
     if (service->localhost_match_wildcard_host == SERVICE_PARAM_UNINIT)
     {
@@ -1698,6 +2421,32 @@ mysql_users_alloc()
         return NULL;
     }
 
+    /** Services with many users grow the table instead of the chains */
+    hashtable_enable_resize(rval->data);
+
+    /** The grants of each user for mysql_users_find() */
+    if ((rval->index = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, simple_str_hash,
+                                       strcmp)) == NULL)
+    {
+        hashtable_free(rval->data);
+        free(rval);
+        return NULL;
+    }
+
+    hashtable_enable_resize(rval->index);
+    hashtable_memory_fns(rval->index, (HASHMEMORYFN) strdup, NULL,
+                         (HASHMEMORYFN) free, (HASHMEMORYFN) free);
+
+    /** The lookup cache lives and dies with this table so a reload of the
+     * users empties it. Failing to allocate it only disables the cache. */
+    if ((rval->lookups = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, simple_str_hash,
+                                         strcmp)) != NULL)
+    {
+        hashtable_enable_resize(rval->lookups);
+        hashtable_memory_fns(rval->lookups, (HASHMEMORYFN) strdup, (HASHMEMORYFN) strdup,
+                             (HASHMEMORYFN) free, (HASHMEMORYFN) free);
+    }
+
     /* set the MySQL user@host print routine for the debug interface */
     rval->usersCustomUserFormat = mysql_format_user_entry;
 
@@ -1722,35 +2471,441 @@ mysql_users_alloc()
 int
 mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth)
 {
-    int add;
+    int add;
+
+    if (key == NULL || key->user == NULL)
+    {
+        return 0;
+    }
+
+    atomic_add(&users->stats.n_adds, 1);
+    add = hashtable_add(users->data, key, auth);
+    atomic_add(&users->stats.n_entries, add);
+
+    if (add && !mysql_users_index_add(users, key, auth))
+    {
+        MXS_ERROR("Failed to add user %s to the users index, the user will not "
+                  "be able to connect.", key->user);
+    }
+
+    return add;
+}
+
+/**
+ * Replace the authentication data of a MySQL user in the user table. The
+ * entry is replaced in place, a concurrent lookup finds either the old or
+ * the new data.
+ *
+ * @param users     The users table
+ * @param key       The user@host to replace
+ * @param auth      The new authentication data
+ * @return          1 if the user was replaced, 0 on failure
+ */
+static int
+mysql_users_replace(USERS *users, MYSQL_USER_HOST *key, char *auth)
+{
+    if (key == NULL || key->user == NULL || !hashtable_replace(users->data, key, auth))
+    {
+        return 0;
+    }
+
+    if (!mysql_users_index_replace(users, key, auth))
+    {
+        MXS_ERROR("Failed to update user %s in the users index, the user will "
+                  "authenticate with the old password.", key->user);
+    }
+
+    return 1;
+}
+
+/**
+ * Delete a MySQL user from the user table
+ *
+ * @param users     The users table
+ * @param key       The user@host to delete
+ * @return          The number of users deleted from the table
+ */
+static int
+mysql_users_delete(USERS *users, MYSQL_USER_HOST *key)
+{
+    mysql_users_index_delete(users, key);
+
+    if (hashtable_delete(users->data, key) == 0)
+    {
+        return 0;
+    }
+
+    atomic_add(&users->stats.n_deletes, 1);
+    atomic_add(&users->stats.n_entries, -1);
+    return 1;
+}
+
+/**
+ * Order of the grants: the exact addresses first, then the networks from the
+ * longest netmask to the shortest, the address patterns and the '%' host last.
+ *
+ * @param grant The grant
+ * @return      The specificity of the grant host, larger is more specific
+ */
+static int
+grant_specificity(const MYSQL_USER_GRANT *grant)
+{
+    return grant->hostname ? 1 : grant->netmask * 2;
+}
+
+/**
+ * Copy grants into a new grants list of a user
+ *
+ * @param list  The grants, in order
+ * @param n     The number of grants
+ * @return      The grants list or NULL on memory allocation failure
+ */
+static MYSQL_USER_GRANTS *
+mysql_user_grants_alloc(const MYSQL_USER_GRANT *list, int n)
+{
+    size_t size = sizeof(MYSQL_USER_GRANTS) + n * sizeof(MYSQL_USER_GRANT);
+
+    for (int i = 0; i < n; i++)
+    {
+        size += strlen(list[i].auth) + 1;
+        size += list[i].hostname ? strlen(list[i].hostname) + 1 : 0;
+        size += list[i].resource ? strlen(list[i].resource) + 1 : 0;
+    }
+
+    MYSQL_USER_GRANTS *rval = malloc(size);
+
+    if (rval)
+    {
+        char *ptr = (char*)&rval->grants[n];
+        rval->n_grants = n;
+
+        for (int i = 0; i < n; i++)
+        {
+            MYSQL_USER_GRANT *grant = &rval->grants[i];
+            *grant = list[i];
+            grant->auth = strcpy(ptr, list[i].auth);
+            ptr += strlen(ptr) + 1;
+
+            if (list[i].hostname)
+            {
+                grant->hostname = strcpy(ptr, list[i].hostname);
+                ptr += strlen(ptr) + 1;
+            }
+
+            if (list[i].resource)
+            {
+                grant->resource = strcpy(ptr, list[i].resource);
+                ptr += strlen(ptr) + 1;
+            }
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * Convert a users table key to a grant
+ *
+ * @param key   The user@host key
+ * @param auth  The authentication data
+ * @param grant The grant to fill
+ */
+static void
+mysql_user_grant_from_key(MYSQL_USER_HOST *key, char *auth, MYSQL_USER_GRANT *grant)
+{
+    grant->addr = key->ipv4.sin_addr.s_addr;
+    grant->netmask = key->netmask;
+    grant->hostname = *key->hostname ? key->hostname : NULL;
+    grant->resource = key->resource;
+    grant->auth = auth;
+}
+
+/**
+ * Compare two optional strings
+ *
+ * @return True if both are NULL or both are equal strings
+ */
+static bool
+optional_str_eq(const char *a, const char *b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/**
+ * Add a grant to the index of the users table. The grants of the user are
+ * copied into a new list that replaces the old one, the readers of the index
+ * see either of the lists.
+ *
+ * @param users The users table
+ * @param key   The user@host that was added to the table
+ * @param auth  The authentication data
+ * @return      True on success, false on memory allocation failure
+ */
+static bool
+mysql_users_index_add(USERS *users, MYSQL_USER_HOST *key, char *auth)
+{
+    MYSQL_USER_GRANTS *old = hashtable_fetch(users->index, key->user);
+    int n = old ? old->n_grants : 0;
+    MYSQL_USER_GRANT list[n + 1];
+    MYSQL_USER_GRANT grant;
+    int i = 0;
+
+    mysql_user_grant_from_key(key, auth, &grant);
+
+    /** Grants of the same specificity keep the order they were added in */
+    while (i < n && grant_specificity(&old->grants[i]) >= grant_specificity(&grant))
+    {
+        list[i] = old->grants[i];
+        i++;
+    }
+
+    list[i] = grant;
+
+    for (; i < n; i++)
+    {
+        list[i + 1] = old->grants[i];
+    }
+
+    MYSQL_USER_GRANTS *grants = mysql_user_grants_alloc(list, n + 1);
+
+    if (grants == NULL || !hashtable_replace(users->index, key->user, grants))
+    {
+        free(grants);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Replace the authentication data of a grant in the index of the users table.
+ * The grant keeps its place in the list of the user.
+ *
+ * @param users The users table
+ * @param key   The user@host that was replaced in the table
+ * @param auth  The new authentication data
+ * @return      True on success, false on memory allocation failure
+ */
+static bool
+mysql_users_index_replace(USERS *users, MYSQL_USER_HOST *key, char *auth)
+{
+    MYSQL_USER_GRANTS *old = hashtable_fetch(users->index, key->user);
+
+    if (old == NULL)
+    {
+        return mysql_users_index_add(users, key, auth);
+    }
+
+    MYSQL_USER_GRANT list[old->n_grants];
+    MYSQL_USER_GRANT grant;
+
+    mysql_user_grant_from_key(key, auth, &grant);
+
+    for (int i = 0; i < old->n_grants; i++)
+    {
+        MYSQL_USER_GRANT *g = &old->grants[i];
+
+        list[i] = *g;
+
+        if (g->addr == grant.addr && g->netmask == grant.netmask &&
+            optional_str_eq(g->hostname, grant.hostname) &&
+            optional_str_eq(g->resource, grant.resource))
+        {
+            list[i].auth = auth;
+        }
+    }
+
+    MYSQL_USER_GRANTS *grants = mysql_user_grants_alloc(list, old->n_grants);
+
+    if (grants == NULL || !hashtable_replace(users->index, key->user, grants))
+    {
+        free(grants);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Remove a grant from the index of the users table
+ *
+ * @param users The users table
+ * @param key   The user@host that is removed from the table
+ */
+static void
+mysql_users_index_delete(USERS *users, MYSQL_USER_HOST *key)
+{
+    MYSQL_USER_GRANTS *old = hashtable_fetch(users->index, key->user);
+
+    if (old == NULL)
+    {
+        return;
+    }
+
+    MYSQL_USER_GRANT list[old->n_grants];
+    MYSQL_USER_GRANT grant;
+    int n = 0;
+
+    mysql_user_grant_from_key(key, NULL, &grant);
+
+    for (int i = 0; i < old->n_grants; i++)
+    {
+        MYSQL_USER_GRANT *g = &old->grants[i];
+
+        if (g->addr != grant.addr || g->netmask != grant.netmask ||
+            !optional_str_eq(g->hostname, grant.hostname) ||
+            !optional_str_eq(g->resource, grant.resource))
+        {
+            list[n++] = *g;
+        }
+    }
+
+    if (n == 0)
+    {
+        hashtable_delete(users->index, key->user);
+    }
+    else if (n < old->n_grants)
+    {
+        MYSQL_USER_GRANTS *grants = mysql_user_grants_alloc(list, n);
+
+        if (grants == NULL || !hashtable_replace(users->index, key->user, grants))
+        {
+            MXS_ERROR("Failed to remove a grant of user %s from the users index.", key->user);
+            free(grants);
+        }
+    }
+}
+
+/**
+ * Find the most specific grant of a user that matches the client address and
+ * the requested database.
+ *
+ * The grants of the user are walked once in order of specificity: exact
+ * addresses, then networks from the longest netmask to the shortest, then
+ * address patterns with '_' wildcards and finally the '%' host.
+ *
+ * @param users     The MySQL users table
+ * @param key       The user, client address and hostname and requested database
+ * @param wildcard  Whether networks, patterns and '%' may match the client
+ * @return          The authentication data or NULL if no grant matches
+ */
+char *mysql_users_find(USERS *users, MYSQL_USER_HOST *key, bool wildcard)
+{
+    MYSQL_USER_GRANTS *grants;
+
+    if (key == NULL || key->user == NULL)
+    {
+        return NULL;
+    }
+
+    atomic_add(&users->stats.n_fetches, 1);
+
+    if ((grants = hashtable_fetch(users->index, key->user)) == NULL)
+    {
+        return NULL;
+    }
+
+    uint32_t addr = key->ipv4.sin_addr.s_addr;
+
+    for (int i = 0; i < grants->n_grants; i++)
+    {
+        MYSQL_USER_GRANT *grant = &grants->grants[i];
+        bool host;
+
+        if (grant->hostname)
+        {
+            host = wildcard && *key->hostname &&
+                   host_matches_singlechar_wildcard(key->hostname, grant->hostname);
+        }
+        else if (!wildcard)
+        {
+            host = addr == grant->addr;
+        }
+        else
+        {
+            uint32_t mask = grant->netmask > 0 ? htonl(0xFFFFFFFFU << (32 - grant->netmask)) : 0;
+            host = (addr & mask) == grant->addr;
+        }
+
+        if (host && grant_matches_db(key->resource, grant->resource))
+        {
+            return grant->auth;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Fetch the authentication data for a particular user from the users table
+ *
+ * @param users The MySQL users table
+ * @param key   The key with user@host
+ * @return  The authentication data or NULL on error
+ */
+char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key)
+{
+    if (key == NULL)
+    {
+        return NULL;
+    }
+    atomic_add(&users->stats.n_fetches, 1);
+    return hashtable_fetch(users->data, key);
+}
+
+/**
+ * Fetch the cached result of matching a client against the users table.
+ *
+ * The cache stores the outcome of the exact, class C/B/A and wildcard host
+ * lookups so that repeated connections from the same client skip them.
+ *
+ * @param users The users table
+ * @param key   The lookup key, built from the user, client address and database
+ * @param auth  Set to the authentication data or NULL if the user was not found
+ * @param generation Set to the generation of the table, passed to mysql_users_lookup_add()
+ * @return True if the lookup was found in the cache
+ */
+bool mysql_users_lookup_fetch(USERS *users, char *key, char **auth, int *generation)
+{
+    char *value;
 
-    if (key == NULL || key->user == NULL)
+    *generation = *(volatile int*)&users->generation;
+
+    if (users->lookups == NULL || (value = hashtable_fetch(users->lookups, key)) == NULL)
     {
-        return 0;
+        return false;
     }
 
-    atomic_add(&users->stats.n_adds, 1);
-    add = hashtable_add(users->data, key, auth);
-    atomic_add(&users->stats.n_entries, add);
-
-    return add;
+    *auth = *value == '+' ? value + 1 : NULL;
+    return true;
 }
 
 /**
- * Fetch the authentication data for a particular user from the users table
+ * Store the result of matching a client against the users table. Once the
+ * cache holds USERS_LOOKUP_CACHE_MAX entries, new results are not stored.
  *
- * @param users The MySQL users table
- * @param key   The key with user@host
- * @return  The authentication data or NULL on error
+ * @param users The users table
+ * @param key   The lookup key, built from the user, client address and database
+ * @param auth  The authentication data or NULL if the user was not found
+ * @param generation The generation returned by mysql_users_lookup_fetch(), the
+ *                   result is not stored if the table was updated since then
  */
-char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key)
+void mysql_users_lookup_add(USERS *users, char *key, char *auth, int generation)
 {
-    if (key == NULL)
+    if (users->lookups == NULL || generation != users->generation ||
+        hashtable_size(users->lookups) >= USERS_LOOKUP_CACHE_MAX)
     {
-        return NULL;
+        return;
     }
-    atomic_add(&users->stats.n_fetches, 1);
-    return hashtable_fetch(users->data, key);
+
+    /** Found entries are prefixed with '+' so that a user with an empty
+     * password can be told apart from a user that does not exist */
+    size_t len = auth ? strlen(auth) : 0;
+    char value[len + 2];
+    value[0] = auth ? '+' : '-';
+    memcpy(value + 1, auth ? auth : "", len + 1);
+
+    hashtable_add(users->lookups, key, value);
 }
 
 /**
@@ -1776,6 +2931,71 @@ static int uh_hfun(void* key)
     }
 }
 
+/**
+ * Check whether a database grant allows access to the requested database
+ *
+ * @param db    The requested database, NULL or empty if none was requested
+ * @param grant The database grant, "" for any database and NULL for none
+ * @return      True if access is allowed
+ */
+static bool grant_matches_db(const char *db, const char *grant)
+{
+    /* if no database name was passed, auth is ok */
+    if (db == NULL || !strlen(db))
+    {
+        return true;
+    }
+
+    /* (1) check for no database grants at all and deny auth */
+    if (grant == NULL)
+    {
+        return false;
+    }
+    /* (2) check for ANY database grant and allow auth */
+    if (!strlen(grant))
+    {
+        return true;
+    }
+    /* (3) check for database name specific grant and allow auth */
+    if (strcmp(db, grant) == 0)
+    {
+        return true;
+    }
+
+    if (strchr(grant, '%') != NULL)
+    {
+        regex_t re;
+        char pattern[MYSQL_DATABASE_MAXLEN * 2 + 1];
+        strcpy(pattern, grant);
+        int len = strlen(pattern);
+        char* ptr = strrchr(pattern, '%');
+
+        while (ptr)
+        {
+            memmove(ptr + 1, ptr, (len - (ptr - pattern)) + 1);
+            *ptr = '.';
+            *(ptr + 1) = '*';
+            len = strlen(pattern);
+            ptr = strrchr(pattern, '%');
+        }
+
+        if ((regcomp(&re, pattern, REG_ICASE | REG_NOSUB)))
+        {
+            return false;
+        }
+
+        if (regexec(&re, db, 0, NULL, 0) == 0)
+        {
+            regfree(&re);
+            return true;
+        }
+        regfree(&re);
+    }
+
+    /* no matches, deny auth */
+    return false;
+}
+
 /**
  * The compare function we use for compare MySQL users as: users@hosts.
  * Currently only IPv4 addresses are supported
@@ -1813,68 +3033,7 @@ static int uh_cmpfun(void* v1, void* v2)
          (!wildcard_host && (hu1->ipv4.sin_addr.s_addr == hu2->ipv4.sin_addr.s_addr) &&
           (hu1->netmask >= hu2->netmask))))
     {
-        /* if no database name was passed, auth is ok */
-        if (hu1->resource == NULL || (hu1->resource && !strlen(hu1->resource)))
-        {
-            return 0;
-        }
-        else
-        {
-            /* (1) check for no database grants at all and deny auth */
-            if (hu2->resource == NULL)
-            {
-                return 1;
-            }
-            /* (2) check for ANY database grant and allow auth */
-            if (!strlen(hu2->resource))
-            {
-                return 0;
-            }
-            /* (3) check for database name specific grant and allow auth */
-            if (hu1->resource && hu2->resource && strcmp(hu1->resource,
-                                                         hu2->resource) == 0)
-            {
-                return 0;
-            }
-
-            if (hu2->resource && strlen(hu2->resource) && strchr(hu2->resource, '%') != NULL)
-            {
-                regex_t re;
-                char db[MYSQL_DATABASE_MAXLEN * 2 + 1];
-                strcpy(db, hu2->resource);
-                int len = strlen(db);
-                char* ptr = strrchr(db, '%');
-
-                if (ptr == NULL)
-                {
-                    return 1;
-                }
-
-                while (ptr)
-                {
-                    memmove(ptr + 1, ptr, (len - (ptr - db)) + 1);
-                    *ptr = '.';
-                    *(ptr + 1) = '*';
-                    len = strlen(db);
-                    ptr = strrchr(db, '%');
-                }
-
-                if ((regcomp(&re, db, REG_ICASE | REG_NOSUB)))
-                {
-                    return 1;
-                }
-
-                if (regexec(&re, hu1->resource, 0, NULL, 0) == 0)
-                {
-                    regfree(&re);
-                    return 0;
-                }
-                regfree(&re);
-            }
-
-            /* no matches, deny auth */
-            return 1;
-        }
+        return grant_matches_db(hu1->resource, hu2->resource) ? 0 : 1;
     }
     else
     {
@@ -2264,85 +3423,9 @@ retblock:
     return rc;
 }
 
-/*
- * Serialise a key for the dbusers hashtable to a file
- *
- * @param fd    File descriptor to write to
- * @param key   The key to write
- * @return      0 on error, 1 if the key was written
- */
-static int
-dbusers_keywrite(int fd, void *key)
-{
-    MYSQL_USER_HOST *dbkey = (MYSQL_USER_HOST *) key;
-    int tmp;
-
-    tmp = strlen(dbkey->user);
-    if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-    {
-        return 0;
-    }
-    if (write(fd, dbkey->user, tmp) != tmp)
-    {
-        return 0;
-    }
-    if (write(fd, &dbkey->ipv4, sizeof(dbkey->ipv4)) != sizeof(dbkey->ipv4))
-    {
-        return 0;
-    }
-    if (write(fd, &dbkey->netmask, sizeof(dbkey->netmask)) != sizeof(dbkey->netmask))
-    {
-        return 0;
-    }
-    if (dbkey->resource)
-    {
-        tmp = strlen(dbkey->resource);
-        if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-        {
-            return 0;
-        }
-        if (write(fd, dbkey->resource, tmp) != tmp)
-        {
-            return 0;
-        }
-    }
-    else // NULL is valid, so represent with a length of -1
-    {
-        tmp = -1;
-        if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-        {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-/**
- * Serialise a value for the dbusers hashtable to a file
- *
- * @param fd    File descriptor to write to
- * @param value The value to write
- * @return      0 on error, 1 if the value was written
- */
-static int
-dbusers_valuewrite(int fd, void *value)
-{
-    int tmp;
-
-    tmp = strlen(value);
-    if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-    {
-        return 0;
-    }
-    if (write(fd, value, tmp) != tmp)
-    {
-        return 0;
-    }
-    return 1;
-}
-
 /**
- * Unserialise a key for the dbusers hashtable from a file
+ * Unserialise a key for the dbusers hashtable from a file in the format
+ * written by hashtable_save, used by older versions
  *
  * @param fd    File descriptor to read from
  * @return      Pointer to the new key or NULL on error
@@ -2451,29 +3534,299 @@ dbusers_valueread(int fd)
 }
 
 /**
- * Save the dbusers data to a hashtable file
+ * The binary format of the users cache. The file consists of a header, an
+ * array of fixed size entries and an area of null terminated strings that the
+ * entries refer to with offsets. The whole file is written with one write
+ * and read by mapping it to memory.
+ */
+#define DBUSERS_CACHE_MAGIC     "MXSUSERS"
+#define DBUSERS_CACHE_VERSION   1
+#define DBUSERS_CACHE_NULL      UINT32_MAX      /*< Offset of a NULL string */
+
+typedef struct
+{
+    char     magic[8];      /*< DBUSERS_CACHE_MAGIC without the terminating null */
+    uint32_t version;       /*< DBUSERS_CACHE_VERSION */
+    uint32_t n_entries;     /*< The number of entries */
+    uint32_t strings;       /*< The size of the string area */
+    uint32_t checksum;      /*< FNV-1a hash of the entries and the strings */
+} DBUSERS_CACHE_HEADER;
+
+typedef struct
+{
+    uint32_t user;          /*< Offset of the user name */
+    uint32_t hostname;      /*< Offset of the hostname with wildcards */
+    uint32_t resource;      /*< Offset of the database or DBUSERS_CACHE_NULL */
+    uint32_t auth;          /*< Offset of the password hash */
+    uint32_t ipv4;          /*< The address in network byte order */
+    int32_t  netmask;       /*< The netmask of the address */
+} DBUSERS_CACHE_ENTRY;
+
+/**
+ * FNV-1a hash used as the checksum of the users cache
+ */
+static uint32_t dbusers_cache_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Copy a string to the string area of the users cache.
+ *
+ * @param strings   The string area
+ * @param offset    The current size of the string area, updated
+ * @param str       The string, may be NULL
+ * @return          The offset of the string
+ */
+static uint32_t dbusers_cache_string(char *strings, uint32_t *offset, const char *str)
+{
+    if (str == NULL)
+    {
+        return DBUSERS_CACHE_NULL;
+    }
+
+    uint32_t rval = *offset;
+    size_t len = strlen(str) + 1;
+
+    memcpy(strings + rval, str, len);
+    *offset += len;
+    return rval;
+}
+
+/**
+ * Save the dbusers data to a cache file. The file is written under a
+ * temporary name and renamed, so a reader never sees a partial file.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to save the data in
- * @return      The number of entries saved
+ * @return      The number of entries saved or -1 on error
  */
 int
 dbusers_save(USERS *users, const char *filename)
 {
-    return hashtable_save(users->data, filename, dbusers_keywrite, dbusers_valuewrite);
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+    uint32_t n_entries = 0;
+    size_t strings = 0;
+
+    /** The first pass calculates the size of the file */
+    if ((iter = hashtable_iterator(users->data)) == NULL)
+    {
+        return -1;
+    }
+    while ((key = hashtable_next(iter)) != NULL)
+    {
+        char *auth = hashtable_fetch(users->data, key);
+        strings += strlen(key->user) + strlen(key->hostname) + 2;
+        strings += key->resource ? strlen(key->resource) + 1 : 0;
+        strings += auth ? strlen(auth) + 1 : 1;
+        n_entries++;
+    }
+    hashtable_iterator_free(iter);
+
+    /** Entries added between the passes are left out */
+    size_t size = sizeof(DBUSERS_CACHE_HEADER) + n_entries * sizeof(DBUSERS_CACHE_ENTRY) + strings;
+    char *buf = calloc(1, size);
+
+    if (buf == NULL || (iter = hashtable_iterator(users->data)) == NULL)
+    {
+        free(buf);
+        return -1;
+    }
+
+    DBUSERS_CACHE_HEADER *header = (DBUSERS_CACHE_HEADER*)buf;
+    DBUSERS_CACHE_ENTRY *entries = (DBUSERS_CACHE_ENTRY*)(buf + sizeof(*header));
+    char *area = (char*)(entries + n_entries);
+    uint32_t offset = 0;
+    uint32_t n = 0;
+
+    while (n < n_entries && (key = hashtable_next(iter)) != NULL)
+    {
+        char *auth = hashtable_fetch(users->data, key);
+        size_t len = strlen(key->user) + strlen(key->hostname) + 2 +
+            (key->resource ? strlen(key->resource) + 1 : 0) + (auth ? strlen(auth) + 1 : 1);
+
+        if (offset + len > strings)
+        {
+            /** The entry was replaced with a longer one between the passes */
+            break;
+        }
+
+        entries[n].user = dbusers_cache_string(area, &offset, key->user);
+        entries[n].hostname = dbusers_cache_string(area, &offset, key->hostname);
+        entries[n].resource = dbusers_cache_string(area, &offset, key->resource);
+        entries[n].auth = dbusers_cache_string(area, &offset, auth ? auth : "");
+        entries[n].ipv4 = key->ipv4.sin_addr.s_addr;
+        entries[n].netmask = key->netmask;
+        n++;
+    }
+    hashtable_iterator_free(iter);
+
+    /** Move the strings next to the entries that were written */
+    memmove(entries + n, area, offset);
+    size = sizeof(*header) + n * sizeof(DBUSERS_CACHE_ENTRY) + offset;
+
+    memcpy(header->magic, DBUSERS_CACHE_MAGIC, sizeof(header->magic));
+    header->version = DBUSERS_CACHE_VERSION;
+    header->n_entries = n;
+    header->strings = offset;
+    header->checksum = dbusers_cache_checksum((uint8_t*)entries, size - sizeof(*header));
+
+    char tmpname[strlen(filename) + sizeof(".tmp")];
+    int fd, rval = -1;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1)
+    {
+        if (write(fd, buf, size) == size && close(fd) == 0 && rename(tmpname, filename) == 0)
+        {
+            rval = n;
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to write the users cache '%s': %d, %s", filename,
+                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            unlink(tmpname);
+        }
+    }
+    else
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open the users cache '%s': %d, %s", tmpname,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+
+    free(buf);
+    return rval;
+}
+
+/**
+ * Check that an offset points to a string in the string area of the users
+ * cache. The area ends with a null, so every string in it is terminated.
+ */
+static bool dbusers_cache_valid_offset(uint32_t offset, uint32_t strings, bool nullable)
+{
+    return offset < strings || (nullable && offset == DBUSERS_CACHE_NULL);
+}
+
+/**
+ * Load the users from a cache file mapped to memory.
+ *
+ * @param users     The users table
+ * @param map       The file
+ * @param size      The size of the file
+ * @return          The number of entries loaded or -1 if the file is invalid
+ */
+static int dbusers_load_cache(USERS *users, const char *map, size_t size)
+{
+    const DBUSERS_CACHE_HEADER *header = (const DBUSERS_CACHE_HEADER*)map;
+
+    if (size < sizeof(*header) || header->version != DBUSERS_CACHE_VERSION ||
+        (size - sizeof(*header)) / sizeof(DBUSERS_CACHE_ENTRY) < header->n_entries ||
+        size != sizeof(*header) + header->n_entries * sizeof(DBUSERS_CACHE_ENTRY) + header->strings ||
+        (header->strings > 0 && map[size - 1] != '\0') ||
+        header->checksum != dbusers_cache_checksum((const uint8_t*)(header + 1), size - sizeof(*header)))
+    {
+        return -1;
+    }
+
+    const DBUSERS_CACHE_ENTRY *entries = (const DBUSERS_CACHE_ENTRY*)(header + 1);
+    const char *strings = (const char*)(entries + header->n_entries);
+    int rval = 0;
+
+    for (uint32_t i = 0; i < header->n_entries; i++)
+    {
+        const DBUSERS_CACHE_ENTRY *entry = &entries[i];
+        MYSQL_USER_HOST key;
+
+        if (!dbusers_cache_valid_offset(entry->user, header->strings, false) ||
+            !dbusers_cache_valid_offset(entry->hostname, header->strings, false) ||
+            !dbusers_cache_valid_offset(entry->resource, header->strings, true) ||
+            !dbusers_cache_valid_offset(entry->auth, header->strings, false))
+        {
+            return -1;
+        }
+
+        memset(&key, 0, sizeof(key));
+        key.user = (char*)strings + entry->user;
+        strncpy(key.hostname, strings + entry->hostname, MYSQL_HOST_MAXLEN);
+        key.resource = entry->resource == DBUSERS_CACHE_NULL ? NULL : (char*)strings + entry->resource;
+        key.ipv4.sin_family = AF_INET;
+        key.ipv4.sin_addr.s_addr = entry->ipv4;
+        key.netmask = entry->netmask;
+
+        rval += mysql_users_add(users, &key, (char*)strings + entry->auth);
+    }
+
+    return rval;
 }
 
 /**
- * Load the dbusers data from a saved hashtable file
+ * Load the dbusers data from a cache file. Files in the format written by
+ * hashtable_save are also read.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to laod the data from
- * @return      The number of entries loaded
+ * @return      The number of entries loaded or -1 on error
  */
 int
 dbusers_load(USERS *users, const char *filename)
 {
-    return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    struct stat st;
+    int fd, rval = -1;
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(DBUSERS_CACHE_HEADER))
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED)
+        {
+            if (memcmp(map, DBUSERS_CACHE_MAGIC, strlen(DBUSERS_CACHE_MAGIC)) == 0)
+            {
+                if ((rval = dbusers_load_cache(users, map, st.st_size)) == -1)
+                {
+                    MXS_ERROR("The users cache '%s' is corrupted or of an unknown version.",
+                              filename);
+                }
+            }
+            else
+            {
+                rval = -2;
+            }
+            munmap(map, st.st_size);
+        }
+    }
+    else
+    {
+        rval = -2;
+    }
+    close(fd);
+
+    if (rval == -2)
+    {
+        /** A file written by an older version */
+        rval = hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+        if (rval > 0)
+        {
+            atomic_add(&users->stats.n_entries, rval);
+        }
+    }
+
+    return rval;
 }
 
 /**
@@ -65,10 +65,12 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
 #include <dcb.h>
+#include <memlog.h>
 #include <spinlock.h>
 #include <server.h>
 #include <session.h>
@@ -84,23 +86,106 @@
 #include <hashtable.h>
 #include <listener.h>
 #include <hk_heartbeat.h>
+#include <maxconfig.h>
+#include <platform.h>
+#include <rcu.h>
+#include <monitor.h>
 #include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <affinity.h>
+#include <uring.h>
+#include <statistics.h>
 
 static  DCB             *allDCBs = NULL;        /* Diagnostics need a list of DCBs */
 static  DCB             *lastDCB = NULL;
-static  DCB             *wasfreeDCB = NULL;
+static  DCB             *freeDCBs = NULL;       /* Free DCBs not cached by any thread */
+static  int             nfreeDCBs = 0;          /* Number of DCBs in freeDCBs */
 static  int             freeDCBcount = 0;
 static  int             nDCBs = 0;
 static  int             maxDCBs = 0;
-static  DCB             *zombies = NULL;
+static  thread_local DCB *zombies = NULL;      /* The zombies of the calling thread */
+static  DCB             *orphan_zombies = NULL; /* Zombies of threads that do not poll */
 static  int             nzombies = 0;
 static  int             maxzombies = 0;
 static  SPINLOCK        dcbspin = SPINLOCK_INIT;
 static  SPINLOCK        zombiespin = SPINLOCK_INIT;
 
+/** Maximum number of free DCBs a thread keeps for itself */
+#define DCB_CACHE_MAX 64
+/** Number of free DCBs moved at a time between a thread and the global list */
+#define DCB_CACHE_BATCH (DCB_CACHE_MAX / 2)
+
+/**
+ * The free DCBs of a thread. A DCB that is freed goes to the cache of the
+ * freeing thread, only a full or an empty cache needs the DCB list lock.
+ */
+typedef struct
+{
+    DCB *dcbs;  /*< The free DCBs linked by the nextfree pointer */
+    int count;  /*< The number of DCBs in the cache */
+} DCB_CACHE;
+
+static thread_local DCB_CACHE dcb_cache = { NULL, 0 };
+static pthread_key_t dcb_cache_key;
+static pthread_once_t dcb_cache_key_once = PTHREAD_ONCE_INIT;
+
+/** Size of the pooled buffer that dcb_read reads into */
+#define DCB_READ_BUFFER_SIZE 16384
+/** Size of the overflow area for data that does not fit into the read buffer */
+#define DCB_READ_OVERFLOW_SIZE MAX_BUFFER_SIZE
+/** Reads of at most this many bytes are copied into a buffer of the right size */
+#define DCB_READ_COPY_SIZE 1024
+/** Maximum number of buffers written with one writev call */
+#define DCB_WRITEV_MAX_BUFFERS IOV_MAX
+/** Maximum number of bytes of small buffers combined into one SSL_write, the size of a TLS record */
+#define DCB_SSL_WRITE_BATCH 16384
+/** Maximum number of DCBs whose writes a polling thread defers in one cycle */
+#define DCB_DEFERRED_MAX 128
+/** Maximum number of buffers in a deferred write */
+#define DCB_DEFERRED_MAX_BUFFERS 64
+/** Failed io_uring submissions in a row after which a polling thread stops using io_uring */
+#define DCB_URING_MAX_FAILURES 100
+
+/** A write submitted with io_uring */
+typedef struct
+{
+    DCB          *dcb;          /*< The DCB written to */
+    GWBUF        *writeq;       /*< The buffers taken from the write queue */
+    bool         above_water;   /*< Whether the queue was above the low water mark */
+    struct iovec iov[DCB_DEFERRED_MAX_BUFFERS];
+} DEFERRED_WRITE;
+
+/**
+ * The DCBs a polling thread has written to while processing events. Their
+ * write queues are drained at the end of the poll cycle with one io_uring
+ * submission instead of one writev call for each write.
+ */
+typedef struct
+{
+    bool            initialized; /*< Whether the ring has been set up */
+    bool            active;      /*< Whether writes are currently deferred */
+    int             thread_id;   /*< The polling thread */
+    URING           *ring;       /*< The ring, NULL if io_uring is not used */
+    int             n_writes;    /*< Number of DCBs in writes */
+    DEFERRED_WRITE  *writes;
+} DEFERRED_WRITES;
+
+static thread_local DEFERRED_WRITES deferred = { false, false, 0, NULL, 0, NULL };
+
+/** The water marks of the client DCBs, 0 if not set */
+static int writeq_high_water = 0;
+static int writeq_low_water = 0;
+/** The bytes all write queues may hold before the backends are throttled, 0 if unlimited */
+static long writeq_budget = 0;
+/** The bytes in all write queues, only counted if there is a budget */
+static ts_gauge_t writeq_total = NULL;
+
 static void dcb_final_free(DCB *dcb);
 static void dcb_call_callback(DCB *dcb, DCB_REASON reason);
 static int  dcb_null_write(DCB *dcb, GWBUF *buf);
@@ -110,28 +195,46 @@ static inline DCB * dcb_find_in_list(DCB *dcb);
 static inline void dcb_process_victim_queue(DCB *listofdcb);
 static void dcb_stop_polling_and_shutdown (DCB *dcb);
 static bool dcb_maybe_add_persistent(DCB *);
+static void dcb_uncharge(DCB *dcb);
+static void dcb_persistent_expire(WHEEL_TIMER *timer);
+static int dcb_persistent_clean(SERVER *server, bool cleanall, bool probe);
 static inline bool dcb_write_parameter_check(DCB *dcb, GWBUF *queue);
-static int dcb_bytes_readable(DCB *dcb);
 static int dcb_read_no_bytes_available(DCB *dcb, int nreadtotal);
+static int dcb_accept_admitted(DCB *listener, struct sockaddr_storage *client_conn);
+static DCB *dcb_accept_queued(DCB *listener, GWPROTOCOL *protocol_funcs);
+static void dcb_wake_queued(SERVICE *service);
 static int dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl);
+static void dcb_check_ktls(DCB *dcb);
 static int dcb_read_SSL(DCB *dcb, GWBUF **head);
-static GWBUF *dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread);
+static GWBUF *dcb_basic_read(DCB *dcb, int bufsize, int *nsingleread);
 static GWBUF *dcb_basic_read_SSL(DCB *dcb, int *nsingleread);
 #if defined(FAKE_CODE)
 static inline void dcb_write_fake_code(DCB *dcb);
 #endif
 static void dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno);
 static inline void dcb_write_tidy_up(DCB *dcb, bool below_water);
+static GWBUF *dcb_read_file(DCB *dcb, int fd, off_t offset, size_t len);
 static int gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret);
 static int dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn);
-static int dcb_listen_create_socket_inet(const char *config_bind);
+static int dcb_listen_create_socket_inet(const char *config_bind, bool reuseport);
+static int dcb_listen_start(int listener_socket, const char *config, const char *protocol_name);
+static void dcb_listen_set_cpu(int fd, int thread_id);
+static int dcb_assign_owner(SERVICE *service);
+static bool dcb_defer_drain(DCB *dcb);
+static void dcb_drain_written(DCB *dcb, int total_written, bool above_water);
+static void dcb_drain_done(DCB *dcb);
+static void dcb_resume_reads(DCB *dcb);
+static void dcb_abandon_uring(int threadid, int n_writes, int err);
+static int dcb_listen_add_shard(DCB *listener, const char *config, const char *protocol_name,
+                                int thread_id);
 static int dcb_listen_create_socket_unix(const char *config_bind);
 static int dcb_set_socket_option(int sockfd, int level, int optname, void *optval, socklen_t optlen);
 static void dcb_add_to_all_list(DCB *dcb);
 static DCB *dcb_find_free();
 static GWBUF *dcb_grab_writeq(DCB *dcb, bool first_time);
+static void dcb_splice_detach(DCB *dcb);
 
 size_t dcb_get_session_id(
     DCB *dcb)
@@ -166,14 +269,76 @@ bool dcb_get_ses_log_info(
 }
 
 /**
- * Return the pointer to the list of zombie DCB's
+ * Return the pointer to the list of zombie DCB's of the calling thread, or
+ * the shared list for threads that do not poll
  *
  * @return Zombies DCB list
  */
 DCB *
 dcb_get_zombies(void)
 {
-    return zombies;
+    return rcu_is_online() ? zombies : orphan_zombies;
+}
+
+/**
+ * Hand the zombies of a polling thread that is stopping over to the threads
+ * that are still running. Must be called before the thread goes offline.
+ *
+ * @param threadid      The thread ID of the caller
+ */
+void
+dcb_thread_stop(int threadid)
+{
+    uring_free(deferred.ring);
+    free(deferred.writes);
+    deferred.ring = NULL;
+    deferred.writes = NULL;
+    deferred.active = false;
+
+    if (rcu_is_online())
+    {
+        while (zombies)
+        {
+            DCB *dcb = zombies;
+            zombies = dcb->memdata.next;
+            spinlock_acquire(&zombiespin);
+            dcb->memdata.next = orphan_zombies;
+            orphan_zombies = dcb;
+            spinlock_release(&zombiespin);
+        }
+    }
+}
+
+/**
+ * Add a DCB to the zombie list of the calling thread. The DCB is retired
+ * after it was marked as a zombie, any thread that passes a quiescent point
+ * after that can no longer find it.
+ *
+ * @param dcb   The DCB that is closed
+ */
+static void
+dcb_add_to_zombies(DCB *dcb)
+{
+    int n = atomic_add(&nzombies, 1) + 1;
+
+    if (n > maxzombies)
+    {
+        maxzombies = n;
+    }
+
+    if (rcu_is_online())
+    {
+        dcb->memdata.epoch = rcu_retire();
+        dcb->memdata.next = zombies;
+        zombies = dcb;
+    }
+    else
+    {
+        spinlock_acquire(&zombiespin);
+        dcb->memdata.next = orphan_zombies;
+        orphan_zombies = dcb;
+        spinlock_release(&zombiespin);
+    }
 }
 
 /**
@@ -189,19 +354,17 @@ DCB *
 dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
 {
     DCB *newdcb;
+    int n;
 
-    spinlock_acquire(&dcbspin);
     if ((newdcb = dcb_find_free()) == NULL)
     {
-        spinlock_release(&dcbspin);
         return NULL;
     }
-    nDCBs++;
-    if (nDCBs > maxDCBs)
+    n = atomic_add(&nDCBs, 1) + 1;
+    if (n > maxDCBs)
     {
-        maxDCBs = nDCBs;
+        maxDCBs = n;
     }
-    spinlock_release(&dcbspin);
 
     newdcb->dcb_chk_top = CHK_NUM_DCB;
     newdcb->dcb_chk_tail = CHK_NUM_DCB;
@@ -212,7 +375,6 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     spinlock_init(&newdcb->writeqlock);
     spinlock_init(&newdcb->delayqlock);
     spinlock_init(&newdcb->authlock);
-    spinlock_init(&newdcb->cb_lock);
     spinlock_init(&newdcb->pollinlock);
     spinlock_init(&newdcb->polloutlock);
     newdcb->pollinbusy = 0;
@@ -226,11 +388,14 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->evq.pending_events = 0;
     newdcb->evq.processing = 0;
     spinlock_init(&newdcb->evq.eventqlock);
+    newdcb->owner = poll_current_thread();
 
     memset(&newdcb->stats, 0, sizeof(DCBSTATS));        // Zero the statistics
+    memset(&newdcb->timer, 0, sizeof(WHEEL_TIMER));     // Not scheduled
     newdcb->state = DCB_STATE_ALLOC;
-    bitmask_init(&newdcb->memdata.bitmask);
     newdcb->writeqlen = 0;
+    newdcb->writeq_charged = 0;
+    newdcb->readq_charged = 0;
     newdcb->high_water = 0;
     newdcb->low_water = 0;
     newdcb->session = NULL;
@@ -238,7 +403,8 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->service = NULL;
     newdcb->nextpersistent = NULL;
     newdcb->persistentstart = 0;
-    newdcb->callbacks = NULL;
+    newdcb->connectstart = 0;
+    memset(newdcb->n_callbacks, 0, sizeof(newdcb->n_callbacks));
     newdcb->data = NULL;
 
     newdcb->listener = listener;
@@ -247,6 +413,12 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->remote = NULL;
     newdcb->user = NULL;
     newdcb->flags = 0;
+    newdcb->reuseport = false;
+    newdcb->shard = NULL;
+    newdcb->splice = NULL;
+    newdcb->splice_src = NULL;
+    newdcb->handshaking = false;
+    allocprof_alloc(&newdcb->sample, ALLOCPROF_DCB, sizeof(DCB));
     return newdcb;
 }
 
@@ -256,10 +428,8 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
  * Must be called with the general DCB lock held.
  *
  * A pointer, lastDCB, is held to find the end of the list, and the new DCB
- * is linked to the end of the list.  The pointer, wasfreeDCB, that is used to
- * search for a free DCB is initialised if not already set. There cannot be
- * any free DCBs until this routine has been called at least once, so
- * wasfreeDCB will not be referred to before it is initialised.
+ * is linked to the end of the list. The list is only used for diagnostics,
+ * free DCBs are found through the free lists.
  *
  * @param dcb    The DCB to be added to the list
  */
@@ -275,71 +445,149 @@ dcb_add_to_all_list(DCB *dcb)
         lastDCB->next = dcb;
     }
     lastDCB = dcb;
-    if (NULL == wasfreeDCB)
+}
+
+/**
+ * Return the free DCBs of an exiting thread to the global free list.
+ *
+ * @param data The cache of the thread
+ */
+static void
+dcb_cache_flush(void *data)
+{
+    DCB_CACHE *cache = (DCB_CACHE *)data;
+
+    spinlock_acquire(&dcbspin);
+    while (cache->dcbs)
     {
-        wasfreeDCB = dcb;
+        DCB *dcb = cache->dcbs;
+        cache->dcbs = dcb->nextfree;
+        dcb->nextfree = freeDCBs;
+        freeDCBs = dcb;
+        nfreeDCBs++;
     }
+    cache->count = 0;
+    spinlock_release(&dcbspin);
 }
 
 /**
- * Find a free DCB or allocate memory for a new one.
+ * Create the key used to flush the caches of exiting threads.
+ */
+static void
+dcb_cache_key_init()
+{
+    pthread_key_create(&dcb_cache_key, dcb_cache_flush);
+}
+
+/**
+ * Move a batch of DCBs from the global free list to the cache of the
+ * calling thread.
+ */
+static void
+dcb_cache_refill()
+{
+    if (nfreeDCBs == 0)
+    {
+        /** Dirty read, a DCB freed just now will be found the next time */
+        return;
+    }
+
+    spinlock_acquire(&dcbspin);
+    while (freeDCBs && dcb_cache.count < DCB_CACHE_BATCH)
+    {
+        DCB *dcb = freeDCBs;
+        freeDCBs = dcb->nextfree;
+        nfreeDCBs--;
+        dcb->nextfree = dcb_cache.dcbs;
+        dcb_cache.dcbs = dcb;
+        dcb_cache.count++;
+    }
+    spinlock_release(&dcbspin);
+}
+
+/**
+ * Put a free DCB into the cache of the calling thread. If the cache is
+ * full, a batch of DCBs is moved to the global free list.
  *
- * This routine looks to see whether there are free DCB memory areas.
- * If not, new memory is allocated, if possible, and the new DCB is added to
- * the list of all DCBs.
+ * @param dcb The DCB that is no longer in use
+ */
+static void
+dcb_cache_put(DCB *dcb)
+{
+    if (dcb_cache.dcbs == NULL)
+    {
+        pthread_once(&dcb_cache_key_once, dcb_cache_key_init);
+        pthread_setspecific(dcb_cache_key, &dcb_cache);
+    }
+
+    dcb->nextfree = dcb_cache.dcbs;
+    dcb_cache.dcbs = dcb;
+
+    if (++dcb_cache.count > DCB_CACHE_MAX)
+    {
+        spinlock_acquire(&dcbspin);
+        while (dcb_cache.count > DCB_CACHE_MAX - DCB_CACHE_BATCH)
+        {
+            DCB *moved = dcb_cache.dcbs;
+            dcb_cache.dcbs = moved->nextfree;
+            dcb_cache.count--;
+            moved->nextfree = freeDCBs;
+            freeDCBs = moved;
+            nfreeDCBs++;
+        }
+        spinlock_release(&dcbspin);
+    }
+}
+
+/**
+ * Find a free DCB or allocate memory for a new one.
  *
- * Must be called with the general DCB lock held.
+ * A free DCB is taken from the cache of the calling thread, which is refilled
+ * from the global free list when it is empty. If there are no free DCBs, new
+ * memory is allocated, if possible, and the new DCB is added to the list of
+ * all DCBs.
  *
  * @return An available DCB or NULL if none could be allocated.
  */
 static DCB *
 dcb_find_free()
 {
-    DCB *nextdcb;
-    int loopcount = 0;
+    DCB *dcb;
 
-    if (freeDCBcount <= 0)
+    if (dcb_cache.dcbs == NULL)
     {
-        DCB *newdcb;
-        if ((newdcb = calloc(1, sizeof(DCB))) == NULL)
-        {
-            return NULL;
-        }
-        newdcb->next = NULL;
-        dcb_add_to_all_list(newdcb);
-        newdcb->dcb_is_in_use = true;
-        return newdcb;
+        dcb_cache_refill();
+    }
+
+    if ((dcb = dcb_cache.dcbs) != NULL)
+    {
+        dcb_cache.dcbs = dcb->nextfree;
+        dcb_cache.count--;
+        atomic_add(&freeDCBcount, -1);
+        ss_dassert(freeDCBcount >= 0);
+        /*
+         * Clear the old data. The list forward link is left alone as the
+         * diagnostic routines may be following it at the same time.
+         */
+        memset(dcb, 0, offsetof(DCB, next));
+        memset((char *)dcb + offsetof(DCB, next) + sizeof(dcb->next), 0,
+               sizeof(DCB) - offsetof(DCB, next) - sizeof(dcb->next));
     }
-    /* Starting at the last place a free DCB was found, loop through the */
-    /* list of DCBs searching for one that is not in use. */
-    while (wasfreeDCB->dcb_is_in_use)
+    else
     {
-        wasfreeDCB = wasfreeDCB->next;
-        if (NULL == wasfreeDCB)
+        if ((dcb = calloc(1, sizeof(DCB))) == NULL)
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free DCB failed to find a free DCB even"
-                          " though the free count was positive");
-                return NULL;
-            }
-            wasfreeDCB = allDCBs;
+            return NULL;
         }
+        dcb->next = NULL;
+        spinlock_acquire(&dcbspin);
+        dcb_add_to_all_list(dcb);
+        spinlock_release(&dcbspin);
     }
-    /* Dropping out of the loop means we have found a DCB that is not in use */
-    freeDCBcount--;
-    ss_dassert(freeDCBcount >= 0);
-    /* Clear the old data, then reset the list forward link */
-    nextdcb = wasfreeDCB->next;
-    memset(wasfreeDCB, 0, sizeof(DCB));
-    wasfreeDCB->next = nextdcb;
-    wasfreeDCB->dcb_is_in_use = true;
-    return wasfreeDCB;
+    dcb->dcb_is_in_use = true;
+    return dcb;
 }
 
-
 /**
  * Provided only for consistency, simply calls dcb_close to guarantee
  * safe disposal of a DCB
@@ -368,6 +616,7 @@ dcb_clone(DCB *orig)
     {
         clonedcb->fd = DCBFD_CLOSED;
         clonedcb->flags |= DCBF_CLONE;
+        clonedcb->owner = orig->owner;
         clonedcb->state = orig->state;
         clonedcb->data = orig->data;
         clonedcb->ssl_state = orig->ssl_state;
@@ -413,6 +662,9 @@ dcb_final_free(DCB *dcb)
         MXS_ERROR("dcb_final_free: DCB %p has outstanding events.", dcb);
     }
 
+    dcb_handshake_done(dcb);
+    dcb_uncharge(dcb);
+
     if (dcb->session)
     {
         /*<
@@ -452,9 +704,10 @@ dcb_final_free(DCB *dcb)
 void
 dcb_free_all_memory(DCB *dcb)
 {
-    DCB_CALLBACK *cb_dcb;
     ss_dassert(dcb->dcb_is_in_use);
 
+    timerwheel_remove(&dcb->timer);
+
     if (dcb->protocol && (!DCB_IS_CLONE(dcb)))
     {
         free(dcb->protocol);
@@ -488,45 +741,51 @@ dcb_free_all_memory(DCB *dcb)
         gwbuf_free(dcb->writeq);
         dcb->writeq = NULL;
     }
+    if (dcb->writeqlen && writeq_total)
+    {
+        ts_gauge_add(writeq_total, -dcb->writeqlen);
+    }
     if (dcb->dcb_readqueue)
     {
         gwbuf_free(dcb->dcb_readqueue);
         dcb->dcb_readqueue = NULL;
     }
 
-    spinlock_acquire(&dcb->cb_lock);
-    while ((cb_dcb = dcb->callbacks) != NULL)
-    {
-        dcb->callbacks = cb_dcb->next;
-        free(cb_dcb);
-    }
-    spinlock_release(&dcb->cb_lock);
+    memset(dcb->n_callbacks, 0, sizeof(dcb->n_callbacks));
     if (dcb->ssl)
     {
         SSL_free(dcb->ssl);
     }
-    bitmask_free(&dcb->memdata.bitmask);
+    if (dcb->splice)
+    {
+        close(dcb->splice->pipefd[0]);
+        close(dcb->splice->pipefd[1]);
+        free(dcb->splice);
+        dcb->splice = NULL;
+    }
+    dcb->splice_src = NULL;
+
+    allocprof_free(&dcb->sample);
 
     /* We never free the actual DCB, it is available for reuse*/
-    spinlock_acquire(&dcbspin);
     dcb->dcb_is_in_use = false;
-    freeDCBcount++;
-    nDCBs--;
-    spinlock_release(&dcbspin);
+    dcb_cache_put(dcb);
+    atomic_add(&freeDCBcount, 1);
+    atomic_add(&nDCBs, -1);
 
 }
 
 /**
  * Process the DCB zombie queue
  *
- * This routine is called by each of the polling threads with
- * the thread id of the polling thread. It must clear the bit in
- * the memdata bitmask for the polling thread that calls it. If the
- * operation of clearing this bit means that no bits are set in
- * the memdata.bitmask then the DCB is no longer able to be
- * referenced and it can be finally removed.
+ * This routine is called by each of the polling threads with the thread id
+ * of the polling thread at the end of each iteration of the polling loop,
+ * after it has published its quiescent point. It frees the DCBs on its own
+ * zombie list that every polling thread has passed. No locks are needed,
+ * unless a thread that does not poll has closed DCBs that must be taken over.
  *
  * @param       threadid        The thread ID of the caller
+ * @return      The remaining zombies of the caller
  */
 DCB *
 dcb_process_zombies(int threadid)
@@ -536,27 +795,40 @@ dcb_process_zombies(int threadid)
     DCB *listofdcb = NULL;
 
     /**
-     * Perform a dirty read to see if there is anything in the queue.
-     * This avoids threads hitting the queue spinlock when the queue
-     * is empty. This will really help when the only entry is being
-     * freed, since the queue is updated before the expensive call to
-     * dcb_final_free.
+     * Perform a dirty read to see if there are zombies of threads that do
+     * not poll. They are retired again as they may still be referred to
+     * by the threads that have not passed the current epoch. A thread that
+     * does not poll only takes them over when there are no polling threads.
      */
+    if (orphan_zombies && (rcu_is_online() || !rcu_enabled()))
+    {
+        DCB *orphans;
+        int epoch = rcu_retire();
+
+        spinlock_acquire(&zombiespin);
+        orphans = orphan_zombies;
+        orphan_zombies = NULL;
+        spinlock_release(&zombiespin);
+
+        while (orphans)
+        {
+            zombiedcb = orphans;
+            orphans = zombiedcb->memdata.next;
+            zombiedcb->memdata.epoch = epoch;
+            zombiedcb->memdata.next = zombies;
+            zombies = zombiedcb;
+        }
+    }
+
     if (!zombies)
     {
         return NULL;
     }
 
     /*
-     * Process the zombie queue and create a list of DCB's that can be
-     * finally freed. This processing is down under a spinlock that
-     * will prevent new entries being added to the zombie queue. Therefore
-     * we do not want to do any expensive operations under this spinlock
-     * as it will block other threads. The expensive operations will be
-     * performed on the victim queue within holding the zombie queue
-     * spinlock.
+     * Process the zombie list and create a list of DCB's that can be
+     * finally freed. The list belongs to this thread only.
      */
-    spinlock_acquire(&zombiespin);
     zombiedcb = zombies;
     while (zombiedcb)
     {
@@ -566,64 +838,49 @@ dcb_process_zombies(int threadid)
          * Skip processing of DCB's that are
          * in the event queue waiting to be processed.
          */
-        if (zombiedcb->evq.next || zombiedcb->evq.prev)
+        if (zombiedcb->evq.next || zombiedcb->evq.prev ||
+            !rcu_passed(zombiedcb->memdata.epoch))
         {
             previousdcb = zombiedcb;
         }
         else
         {
-
-            if (bitmask_clear_without_spinlock(&zombiedcb->memdata.bitmask, threadid))
+            /**
+             * Remove the DCB from the zombie queue
+             * and call the final free routine for the
+             * DCB
+             *
+             * zombiedcb is the DCB we are processing
+             * previousdcb is the previous DCB on the zombie
+             * queue or NULL if the DCB is at the head of the
+             * queue.  Remove zombiedcb from the zombies list.
+             */
+            if (NULL == previousdcb)
             {
-                /**
-                 * Remove the DCB from the zombie queue
-                 * and call the final free routine for the
-                 * DCB
-                 *
-                 * zombiedcb is the DCB we are processing
-                 * previousdcb is the previous DCB on the zombie
-                 * queue or NULL if the DCB is at the head of the
-                 * queue.  Remove zombiedcb from the zombies list.
-                 */
-                if (NULL == previousdcb)
-                {
-                    zombies = zombiedcb->memdata.next;
-                }
-                else
-                {
-                    previousdcb->memdata.next = zombiedcb->memdata.next;
-                }
-
-                MXS_DEBUG("%lu [%s] Remove dcb "
-                          "%p fd %d in state %s from the "
-                          "list of zombies.",
-                          pthread_self(),
-                          __func__,
-                          zombiedcb,
-                          zombiedcb->fd,
-                          STRDCBSTATE(zombiedcb->state));
-                /*<
-                 * Move zombie dcb to linked list of victim dcbs.
-                 * The variable dcb is used to hold the last DCB
-                 * to have been added to the linked list, or NULL
-                 * if none has yet been added.  If the list
-                 * (listofdcb) is not NULL, then it follows that
-                 * dcb will also not be null.
-                 */
-                nzombies--;
-                zombiedcb->memdata.next = listofdcb;
-                listofdcb = zombiedcb;
+                zombies = zombiedcb->memdata.next;
             }
             else
             {
-                /* Since we didn't remove this dcb from the zombies
-                   list, we need to advance the previous pointer */
-                previousdcb = zombiedcb;
+                previousdcb->memdata.next = zombiedcb->memdata.next;
             }
+
+            MXS_DEBUG("%lu [%s] Remove dcb "
+                      "%p fd %d in state %s from the "
+                      "list of zombies.",
+                      pthread_self(),
+                      __func__,
+                      zombiedcb,
+                      zombiedcb->fd,
+                      STRDCBSTATE(zombiedcb->state));
+            /*<
+             * Move zombie dcb to linked list of victim dcbs.
+             */
+            atomic_add(&nzombies, -1);
+            zombiedcb->memdata.next = listofdcb;
+            listofdcb = zombiedcb;
         }
         zombiedcb = nextdcb;
     }
-    spinlock_release(&zombiespin);
 
     if (listofdcb)
     {
@@ -680,17 +937,13 @@ dcb_process_victim_queue(DCB *listofdcb)
                 {
                     DCB *next2dcb;
                     dcb_stop_polling_and_shutdown(dcb);
-                    spinlock_acquire(&zombiespin);
-                    bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
+                    /*
+                     * A thread may have fetched an event for the DCB before it
+                     * was removed from the poll set, so it becomes a zombie again
+                     * in a new epoch.
+                     */
                     next2dcb = dcb->memdata.next;
-                    dcb->memdata.next = zombies;
-                    zombies = dcb;
-                    nzombies++;
-                    if (nzombies > maxzombies)
-                    {
-                        maxzombies = nzombies;
-                    }
-                    spinlock_release(&zombiespin);
+                    dcb_add_to_zombies(dcb);
                     dcb = next2dcb;
                     continue;
                 }
@@ -707,6 +960,7 @@ dcb_process_victim_queue(DCB *listofdcb)
                 if (dcb->protocol)
                 {
                     atomic_add(&dcb->service->client_count, -1);
+                    dcb_wake_queued(dcb->service);
                 }
             }
             else
@@ -716,7 +970,7 @@ dcb_process_victim_queue(DCB *listofdcb)
         }
         if (dcb->server && 0 == dcb->persistentstart)
         {
-            atomic_add(&dcb->server->stats.n_current, -1);
+            server_add_current(dcb->server, -1);
         }
 
         if (dcb->fd > 0)
@@ -756,6 +1010,7 @@ dcb_process_victim_queue(DCB *listofdcb)
                              &mxs_log_tls.li_sesid,
                              &mxs_log_tls.li_enabled_priorities);
 
+        memlog_ring_log(MLR_DCB_STATE, dcb, dcb->state, DCB_STATE_DISCONNECTED);
         dcb->state = DCB_STATE_DISCONNECTED;
         nextdcb = dcb->memdata.next;
         spinlock_release(&dcb->dcb_initlock);
@@ -806,13 +1061,20 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     char        *user;
 
     user = session_getUser(session);
-    if (user && strlen(user))
+    /** A pool warm-up connection must be a new one */
+    if (user && strlen(user) && !DCB_IS_POOL_WARMUP(session->client_dcb))
     {
         MXS_DEBUG("%lu [dcb_connect] Looking for persistent connection DCB "
                   "user %s protocol %s\n", pthread_self(), user, protocol);
-        dcb = server_get_persistent(server, user, protocol);
+        dcb = server_get_persistent(server, user, protocol, session->client_dcb->owner);
         if (dcb)
         {
+            bool switch_user = strcmp(dcb->user, user) != 0;
+
+            free(dcb->user);
+            dcb->user = NULL;
+            /** Cancel the expiry of the pooled connection */
+            timerwheel_remove(&dcb->timer);
             /**
              * Link dcb to session. Unlink is called in dcb_final_free
              */
@@ -824,16 +1086,46 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
                 dcb_close(dcb);
                 return NULL;
             }
-            MXS_DEBUG("%lu [dcb_connect] Reusing a persistent connection, dcb %p\n",
-                      pthread_self(), dcb);
+            MXS_DEBUG("%lu [dcb_connect] Reusing a persistent connection, dcb %p%s\n",
+                      pthread_self(), dcb, switch_user ? " of another user" : "");
             dcb->persistentstart = 0;
-            return dcb;
+
+            if (dcb->func.reusable && !dcb->func.reusable(dcb, session))
+            {
+                /** Negotiated differently than the client, open a new one */
+                MXS_DEBUG("%lu [dcb_connect] Persistent dcb %p does not fit the "
+                          "session.\n", pthread_self(), dcb);
+                dcb->dcb_errhandle_called = true;
+                dcb_close(dcb);
+            }
+            else if (!switch_user)
+            {
+                atomic_add(&server->stats.n_persist_hits, 1);
+                return dcb;
+            }
+            else if (dcb->func.reuse(dcb, session))
+            {
+                atomic_add(&server->stats.n_persist_hits, 1);
+                atomic_add(&server->stats.n_persist_switches, 1);
+                return dcb;
+            }
+
+            /** The connection could not be switched, open a new one */
+            MXS_DEBUG("%lu [dcb_connect] Failed to switch dcb %p to user %s.\n",
+                      pthread_self(), dcb, user);
+            dcb->dcb_errhandle_called = true;
+            dcb_close(dcb);
         }
         else
         {
             MXS_DEBUG("%lu [dcb_connect] Failed to find a reusable persistent connection.\n",
                       pthread_self());
         }
+
+        if (server->persistpoolmax)
+        {
+            atomic_add(&server->stats.n_persist_misses, 1);
+        }
     }
 
     if ((dcb = dcb_alloc(DCB_ROLE_BACKEND_HANDLER, NULL)) == NULL)
@@ -841,9 +1133,13 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
         return NULL;
     }
 
+    /** The backend DCB is handled by the thread that handles the client */
+    dcb->owner = session->client_dcb->owner;
+
     if ((funcs = (GWPROTOCOL *)load_module(protocol,
                                            MODULE_PROTOCOL)) == NULL)
     {
+        memlog_ring_log(MLR_DCB_STATE, dcb, dcb->state, DCB_STATE_DISCONNECTED);
         dcb->state = DCB_STATE_DISCONNECTED;
         dcb_final_free(dcb);
         MXS_ERROR("Failed to load protocol module for %s, free dcb %p\n",
@@ -877,6 +1173,8 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
                   dcb,
                   session->client_dcb,
                   session->client_dcb->fd);
+        monitor_report_server_error(server);
+        memlog_ring_log(MLR_DCB_STATE, dcb, dcb->state, DCB_STATE_DISCONNECTED);
         dcb->state = DCB_STATE_DISCONNECTED;
         dcb_final_free(dcb);
         return NULL;
@@ -896,6 +1194,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
      * Successfully connected to backend. Assign file descriptor to dcb
      */
     dcb->fd = fd;
+    server_connection_started(dcb);
 
     /**
      * Add server pointer to dcb
@@ -920,6 +1219,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
 
     if (rc)
     {
+        memlog_ring_log(MLR_DCB_STATE, dcb, dcb->state, DCB_STATE_DISCONNECTED);
         dcb->state = DCB_STATE_DISCONNECTED;
         dcb_final_free(dcb);
         return NULL;
@@ -927,8 +1227,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     /**
      * The dcb will be addded into poll set by dcb->func.connect
      */
-    atomic_add(&server->stats.n_connections, 1);
-    atomic_add(&server->stats.n_current, 1);
+    server_add_connection(server);
 
     return dcb;
 }
@@ -978,78 +1277,50 @@ int dcb_read(DCB   *dcb,
         return 0;
     }
 
+    /*
+     * Read until the socket has no more data. A read that returns less than
+     * was asked for has emptied the socket buffer, so there is no need for
+     * another read that would only fail with EAGAIN.
+     */
     while (0 == maxbytes || nreadtotal < maxbytes)
     {
-        int bytes_available;
+        GWBUF *buffer;
+        int bufsize = DCB_READ_BUFFER_SIZE + DCB_READ_OVERFLOW_SIZE;
 
-        bytes_available = dcb_bytes_readable(dcb);
-        if (bytes_available <= 0)
+        if (maxbytes)
         {
-            return bytes_available < 0 ? -1 :
-                   /** Handle closed client socket */
-                   dcb_read_no_bytes_available(dcb, nreadtotal);
+            bufsize = MIN(bufsize, maxbytes - nreadtotal);
         }
-        else
-        {
-            GWBUF *buffer;
-            dcb->last_read = hkheartbeat;
 
-            buffer = dcb_basic_read(dcb, bytes_available, maxbytes, nreadtotal, &nsingleread);
-            if (buffer)
-            {
-                nreadtotal += nsingleread;
-                /* <editor-fold defaultstate="collapsed" desc=" Debug Logging "> */
-                MXS_DEBUG("%lu [dcb_read] Read %d bytes from dcb %p in state %s "
-                          "fd %d.",
-                          pthread_self(),
-                          nsingleread,
-                          dcb,
-                          STRDCBSTATE(dcb->state),
-                          dcb->fd);
-                /* </editor-fold> */
-                /*< Append read data to the gwbuf */
-                *head = gwbuf_append(*head, buffer);
-            }
-            else
-            {
-                break;
-            }
+        buffer = dcb_basic_read(dcb, bufsize, &nsingleread);
+        if (buffer == NULL)
+        {
+            return nsingleread < 0 ? -1 :
+                   /** Handle closed client socket */
+                   dcb_read_no_bytes_available(dcb, nreadtotal);
         }
-    } /*< while (0 == maxbytes || nreadtotal < maxbytes) */
-
-    return nreadtotal;
-}
 
-/**
- * Find the number of bytes available for the DCB's socket
- *
- * @param dcb       The DCB to read from
- * @return          -1 on error, otherwise the total number of bytes available
- */
-static int
-dcb_bytes_readable(DCB *dcb)
-{
-    int bytesavailable;
-
-    if (-1 == ioctl(dcb->fd, FIONREAD, &bytesavailable))
-    {
-        char errbuf[STRERROR_BUFLEN];
-        /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-        MXS_ERROR("%lu [dcb_read] Error : ioctl FIONREAD for dcb %p in "
-                  "state %s fd %d failed due error %d, %s.",
+        dcb->last_read = hkheartbeat;
+        nreadtotal += nsingleread;
+        /* <editor-fold defaultstate="collapsed" desc=" Debug Logging "> */
+        MXS_DEBUG("%lu [dcb_read] Read %d bytes from dcb %p in state %s "
+                  "fd %d.",
                   pthread_self(),
+                  nsingleread,
                   dcb,
                   STRDCBSTATE(dcb->state),
-                  dcb->fd,
-                  errno,
-                  strerror_r(errno, errbuf, sizeof(errbuf)));
+                  dcb->fd);
         /* </editor-fold> */
-        return -1;
-    }
-    else
-    {
-        return bytesavailable;
-    }
+        /*< Append read data to the gwbuf */
+        *head = gwbuf_append(*head, buffer);
+
+        if (nsingleread < bufsize)
+        {
+            break;
+        }
+    } /*< while (0 == maxbytes || nreadtotal < maxbytes) */
+
+    return nreadtotal;
 }
 
 /**
@@ -1087,25 +1358,27 @@ dcb_read_no_bytes_available(DCB *dcb, int nreadtotal)
 /**
  * Basic read function to carry out a single read operation on the DCB socket.
  *
+ * The data is read with readv into a pooled buffer of DCB_READ_BUFFER_SIZE
+ * bytes and an overflow area on the stack, which is only copied into a
+ * buffer of its own if the read did not fit into the first one. Small reads
+ * are copied into a buffer of the right size so that a queued packet does
+ * not hold a large block.
+ *
  * @param dcb               The DCB to read from
- * @param bytesavailable    Pointer to linked list to append data to
- * @param maxbytes          Maximum bytes to read (0 = no limit)
- * @param nreadtotal        Total number of bytes already read
- * @param nsingleread       To be set as the number of bytes read this time
+ * @param bufsize           Maximum number of bytes to read
+ * @param nsingleread       Set to the number of bytes read, 0 if nothing could
+ *                          be read and -1 if memory allocation failed
  * @return                  GWBUF* buffer containing new data, or null.
  */
 static GWBUF *
-dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread)
+dcb_basic_read(DCB *dcb, int bufsize, int *nsingleread)
 {
     GWBUF *buffer;
+    uint8_t overflow[DCB_READ_OVERFLOW_SIZE];
+    struct iovec iov[2];
+    int primary = MIN(bufsize, DCB_READ_BUFFER_SIZE);
 
-    int bufsize = MIN(bytesavailable, MAX_BUFFER_SIZE);
-    if (maxbytes)
-    {
-        bufsize = MIN(bufsize, maxbytes - nreadtotal);
-    }
-
-    if ((buffer = gwbuf_alloc(bufsize)) == NULL)
+    if ((buffer = gwbuf_alloc(primary)) == NULL)
     {
         /*<
          * This is a fatal error which should cause shutdown.
@@ -1122,37 +1395,80 @@ dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *
                   strerror_r(errno, errbuf, sizeof(errbuf)));
         /* </editor-fold> */
         *nsingleread = -1;
+        return NULL;
     }
-    else
-    {
-        *nsingleread = read(dcb->fd, GWBUF_DATA(buffer), bufsize);
-        dcb->stats.n_reads++;
 
-        if (*nsingleread <= 0)
+    iov[0].iov_base = GWBUF_DATA(buffer);
+    iov[0].iov_len = primary;
+    iov[1].iov_base = overflow;
+    iov[1].iov_len = bufsize - primary;
+
+    errno = 0;
+    *nsingleread = readv(dcb->fd, iov, bufsize > primary ? 2 : 1);
+    dcb->stats.n_reads++;
+
+    if (*nsingleread <= 0)
+    {
+        if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
         {
-            if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-            {
-                char errbuf[STRERROR_BUFLEN];
-                /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-                MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
-                          "%s fd %d, due %d, %s.",
-                          pthread_self(),
-                          dcb,
-                          STRDCBSTATE(dcb->state),
-                          dcb->fd,
-                          errno,
-                          strerror_r(errno, errbuf, sizeof(errbuf)));
-                /* </editor-fold> */
-            }
-            gwbuf_free(buffer);
-            buffer = NULL;
+            char errbuf[STRERROR_BUFLEN];
+            /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
+            MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
+                      "%s fd %d, due %d, %s.",
+                      pthread_self(),
+                      dcb,
+                      STRDCBSTATE(dcb->state),
+                      dcb->fd,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            /* </editor-fold> */
         }
+        gwbuf_free(buffer);
+        *nsingleread = 0;
+        buffer = NULL;
     }
-    return buffer;
-}
+    else if (*nsingleread > primary)
+    {
+        GWBUF *extra = gwbuf_alloc_and_load(*nsingleread - primary, overflow);
 
-/**
- * General purpose read routine to read data from a socket through the SSL
+        if (extra == NULL)
+        {
+            /** The data has been consumed from the socket, the stream cannot continue */
+            MXS_ERROR("%lu [dcb_read] Error : Failed to allocate read buffer "
+                      "for dcb %p fd %d, %d bytes of data lost.",
+                      pthread_self(),
+                      dcb,
+                      dcb->fd,
+                      *nsingleread);
+            gwbuf_free(buffer);
+            *nsingleread = -1;
+            buffer = NULL;
+        }
+        else
+        {
+            buffer = gwbuf_append(buffer, extra);
+        }
+    }
+    else
+    {
+        GWBUF *copy;
+
+        if (*nsingleread <= DCB_READ_COPY_SIZE &&
+            (copy = gwbuf_alloc_and_load(*nsingleread, GWBUF_DATA(buffer))) != NULL)
+        {
+            gwbuf_free(buffer);
+            buffer = copy;
+        }
+        else
+        {
+            GWBUF_RTRIM(buffer, primary - *nsingleread);
+        }
+    }
+    return buffer;
+}
+
+/**
+ * General purpose read routine to read data from a socket through the SSL
  * structure lined with this DCB and append it to a linked list of buffers.
  * The list may be empty, in which case *head == NULL. The SSL structure should
  * be initialized and the SSL handshake should be done.
@@ -1365,6 +1681,94 @@ dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret)
     return -1;
 }
 
+/**
+ * Change the number of bytes in the write queue of a DCB
+ *
+ * @param dcb   The DCB
+ * @param delta Bytes added to the queue, negative if bytes were removed
+ */
+static inline void
+dcb_writeqlen_add(DCB *dcb, int delta)
+{
+    atomic_add(&dcb->writeqlen, delta);
+
+    if (writeq_total)
+    {
+        ts_gauge_add(writeq_total, delta);
+    }
+
+    SESSION *session = dcb->session;
+
+    /**
+     * The session is charged for the length of the queue rather than the
+     * delta, the bytes queued while the DCB had no session of its own are
+     * then charged once it has one.
+     */
+    if (session && session->state != SESSION_STATE_DUMMY)
+    {
+        int64_t len = dcb->writeqlen;
+        int64_t charged = __atomic_exchange_n(&dcb->writeq_charged, len, __ATOMIC_RELAXED);
+        session_mem_add(session, len - charged);
+    }
+}
+
+/**
+ * Charge the session of a DCB for the buffers in the read queue and the
+ * delay queue of the DCB. The queues are manipulated directly by the
+ * protocol modules, so the polling thread calls this after it has
+ * processed the events of the DCB.
+ *
+ * @param dcb   The DCB
+ */
+void
+dcb_charge_readq(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+
+    if (session && session->state != SESSION_STATE_DUMMY)
+    {
+        int64_t len = 0;
+
+        if (dcb->dcb_readqueue)
+        {
+            spinlock_acquire(&dcb->authlock);
+            len += gwbuf_length(dcb->dcb_readqueue);
+            spinlock_release(&dcb->authlock);
+        }
+        if (dcb->delayq)
+        {
+            spinlock_acquire(&dcb->delayqlock);
+            len += gwbuf_length(dcb->delayq);
+            spinlock_release(&dcb->delayqlock);
+        }
+
+        if (len != dcb->readq_charged)
+        {
+            session_mem_add(session, len - dcb->readq_charged);
+            dcb->readq_charged = len;
+        }
+    }
+}
+
+/**
+ * Give back what a DCB has charged its session for. Called before the DCB
+ * is detached from the session.
+ *
+ * @param dcb   The DCB
+ */
+static void
+dcb_uncharge(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+
+    if (session && session->state != SESSION_STATE_DUMMY)
+    {
+        int64_t charged = __atomic_exchange_n(&dcb->writeq_charged, 0, __ATOMIC_RELAXED);
+        session_mem_add(session, -(charged + dcb->readq_charged));
+        dcb->readq_charged = 0;
+    }
+}
+
 /**
  * General purpose routine to write to a DCB
  *
@@ -1393,7 +1797,7 @@ dcb_write(DCB *dcb, GWBUF *queue)
      * If it did not already have data, we call the drain write queue
      * function immediately to attempt to write the data.
      */
-    atomic_add(&dcb->writeqlen, gwbuf_length(queue));
+    dcb_writeqlen_add(dcb, gwbuf_length(queue));
     dcb->writeq = gwbuf_append(dcb->writeq, queue);
     spinlock_release(&dcb->writeqlock);
     dcb->stats.n_buffered++;
@@ -1404,7 +1808,7 @@ dcb_write(DCB *dcb, GWBUF *queue)
               dcb,
               STRDCBSTATE(dcb->state),
               dcb->fd);
-    if (empty_queue)
+    if (empty_queue && !dcb_defer_drain(dcb))
     {
         dcb_drain_writeq(dcb);
     }
@@ -1413,6 +1817,144 @@ dcb_write(DCB *dcb, GWBUF *queue)
     return 1;
 }
 
+/**
+ * Read a range of a file into a buffer
+ *
+ * @param dcb       The DCB the data is written to
+ * @param fd        File descriptor of the file
+ * @param offset    Offset of the data in the file
+ * @param len       Number of bytes to read
+ * @return The data or NULL if it could not be read
+ */
+static GWBUF *
+dcb_read_file(DCB *dcb, int fd, off_t offset, size_t len)
+{
+    GWBUF *buf = gwbuf_alloc(len);
+    ssize_t n = -1;
+
+    if (buf == NULL || (n = pread(fd, GWBUF_DATA(buf), len, offset)) != (ssize_t)len)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to read %lu bytes at offset %ld of the data written to "
+                  "dcb %p fd %d: %s", len, (long)offset, dcb, dcb->fd,
+                  n < 0 ? strerror_r(errno, errbuf, sizeof(errbuf)) : "unexpected end of file");
+        gwbuf_free(buf);
+        buf = NULL;
+    }
+
+    return buf;
+}
+
+/**
+ * Write a buffer followed by a range of a file to a DCB
+ *
+ * If nothing is queued for the DCB and its data is not encrypted by SSL, the
+ * data of the file is copied to the socket by the kernel with sendfile() and
+ * it never enters the user space. What the socket cannot take is read from
+ * the file and queued like with dcb_write, which is also done for the whole
+ * range when sendfile() cannot be used. The data bypasses the protocol of
+ * the DCB.
+ *
+ * @param dcb       The DCB to write to
+ * @param head      Buffer written before the data of the file
+ * @param fd        File descriptor of the file
+ * @param offset    Offset of the data in the file
+ * @param len       Number of bytes of the file to write
+ * @return 0 on failure, 1 on success
+ */
+int
+dcb_sendfile(DCB *dcb, GWBUF *head, int fd, off_t offset, size_t len)
+{
+    bool below_water = (dcb->high_water && dcb->writeqlen < dcb->high_water);
+    bool stop_writing = false;
+    bool direct;
+    bool drain;
+    GWBUF *rest = NULL;
+    ssize_t n;
+
+    if (!dcb_write_parameter_check(dcb, head))
+    {
+        return 0;
+    }
+
+    spinlock_acquire(&dcb->writeqlock);
+    direct = dcb->writeq == NULL && !dcb->draining_flag &&
+             (dcb->ssl == NULL || DCB_IS_KTLS_SEND(dcb)) && !(dcb->flags & DCBF_COMPRESSED);
+    if (direct)
+    {
+        /** The writes of other threads are queued until this one is done */
+        dcb->draining_flag = true;
+    }
+    spinlock_release(&dcb->writeqlock);
+
+    if (!direct)
+    {
+        if (len > 0 && (rest = dcb_read_file(dcb, fd, offset, len)) == NULL)
+        {
+            gwbuf_free(head);
+            return 0;
+        }
+        return dcb_write(dcb, gwbuf_append(head, rest));
+    }
+
+    while (head && !stop_writing)
+    {
+        head = gwbuf_consume(head, gw_write(dcb, head, &stop_writing));
+    }
+
+    while (len > 0 && !stop_writing)
+    {
+        if ((n = sendfile(dcb->fd, fd, &offset, len)) > 0)
+        {
+            len -= n;
+            dcb->stats.n_writes++;
+        }
+        else
+        {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EPIPE)
+            {
+                char errbuf[STRERROR_BUFLEN];
+                MXS_ERROR("Sending file data to dcb %p in state %s fd %d failed "
+                          "due errno %d, %s", dcb, STRDCBSTATE(dcb->state), dcb->fd,
+                          errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            }
+            stop_writing = true;
+        }
+    }
+
+    if (len > 0 && (rest = dcb_read_file(dcb, fd, offset, len)) == NULL)
+    {
+        gwbuf_free(head);
+        head = NULL;
+    }
+    head = gwbuf_append(head, rest);
+
+    /**
+     * The rest is put in front of what the other threads queued. If a drain
+     * was attempted meanwhile, the write event it handled may have been the
+     * one that would have drained the rest.
+     */
+    spinlock_acquire(&dcb->writeqlock);
+    if (head)
+    {
+        dcb_writeqlen_add(dcb, gwbuf_length(head));
+        dcb->writeq = gwbuf_append(head, dcb->writeq);
+        dcb->stats.n_buffered++;
+    }
+    drain = dcb->writeq && (!stop_writing || dcb->drain_called_while_busy);
+    dcb->draining_flag = false;
+    dcb->drain_called_while_busy = false;
+    spinlock_release(&dcb->writeqlock);
+
+    if (drain)
+    {
+        dcb_drain_writeq(dcb);
+    }
+    dcb_write_tidy_up(dcb, below_water);
+
+    return len > 0 && rest == NULL ? 0 : 1;
+}
+
 #if defined(FAKE_CODE)
 /**
  * Fake code for dcb_write
@@ -1580,10 +2122,137 @@ dcb_write_tidy_up(DCB *dcb, bool below_water)
     if (dcb->high_water && dcb->writeqlen > dcb->high_water && below_water)
     {
         atomic_add(&dcb->stats.n_high_water, 1);
+
+        if (dcb->low_water && dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER)
+        {
+            /** The backends stop reading, see dcb_throttle_read */
+            dcb->writeq_throttling = true;
+        }
         dcb_call_callback(dcb, DCB_REASON_HIGH_WATER);
     }
 }
 
+/**
+ * Set the water marks of the client DCBs and the budget of all write queues
+ *
+ * @param high_water Write queue length above which the backends of a session
+ *                   stop reading, 0 to never stop them
+ * @param low_water  Write queue length below which they resume
+ * @param budget     Bytes all write queues may hold before the backends of
+ *                   the sessions with more than low_water bytes queued stop
+ *                   reading, 0 for no limit
+ * @return True on success
+ */
+bool
+dcb_writeq_init(int high_water, int low_water, long budget)
+{
+    if ((high_water || low_water || budget) && (low_water == 0 || low_water >= high_water))
+    {
+        MXS_ERROR("Both 'writeq_high_water' and 'writeq_low_water' must be set, "
+                  "the low water mark below the high water mark.");
+        return false;
+    }
+
+    writeq_high_water = high_water;
+    writeq_low_water = low_water;
+    writeq_budget = budget;
+
+    if (budget > 0 && (writeq_total = ts_gauge_alloc()) == NULL)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Check whether a backend DCB must wait before reading
+ *
+ * A backend does not read while the write queue of the client of its session
+ * is above the high water mark, or above the low water mark while the write
+ * queues of all DCBs together exceed their budget. The data is left in the
+ * socket so that the server stops sending it. The backend is added to the
+ * throttled DCBs of the session and gets a read event once the client queue
+ * has drained below the low water mark.
+ *
+ * @param dcb A backend DCB with a read event
+ * @return True if the read must wait
+ */
+bool
+dcb_throttle_read(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+    DCB *client;
+
+    if (session == NULL || (client = session->client_dcb) == NULL || client->low_water == 0)
+    {
+        return false;
+    }
+
+    if (!client->writeq_throttling && writeq_total &&
+        client->writeqlen > client->low_water &&
+        ts_gauge_get(writeq_total) > writeq_budget)
+    {
+        client->writeq_throttling = true;
+    }
+
+    if (!client->writeq_throttling)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&session->ses_lock);
+
+    /** What is queued for the client may have been written meanwhile */
+    bool throttle = client->writeq_throttling && client->writeqlen >= client->low_water;
+
+    if (!throttle)
+    {
+        client->writeq_throttling = false;
+    }
+    else if (!dcb->read_throttled)
+    {
+        dcb->read_throttled = true;
+        dcb->next_throttled = session->throttled;
+        session->throttled = dcb;
+    }
+
+    spinlock_release(&session->ses_lock);
+
+    return throttle;
+}
+
+/**
+ * Let the backends of the session of a client read again
+ *
+ * @param dcb The client DCB whose write queue has drained
+ */
+static void
+dcb_resume_reads(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+
+    if (session == NULL)
+    {
+        dcb->writeq_throttling = false;
+        return;
+    }
+
+    spinlock_acquire(&session->ses_lock);
+    dcb->writeq_throttling = false;
+
+    while (session->throttled)
+    {
+        DCB *backend = session->throttled;
+        session->throttled = backend->next_throttled;
+        backend->next_throttled = NULL;
+        backend->read_throttled = false;
+        poll_fake_read_event(backend);
+    }
+
+    spinlock_release(&session->ses_lock);
+}
+
 /**
  * Drain the write queue of a DCB. This is called as part of the EPOLLOUT handling
  * of a socket and will try to send any buffered data from the write queue
@@ -1634,7 +2303,7 @@ dcb_drain_writeq(DCB *dcb)
             bool stop_writing = false;
             int written;
             /* The value put into written will be >= 0 */
-            if (dcb->ssl)
+            if (dcb->ssl && !DCB_IS_KTLS_SEND(dcb))
             {
                 written = gw_write_SSL(dcb, local_writeq, &stop_writing);
             }
@@ -1681,18 +2350,48 @@ dcb_drain_writeq(DCB *dcb)
         }
     }
     while ((local_writeq = dcb_grab_writeq(dcb, false)) != NULL);
-    /* The write queue has drained, potentially need to call a callback function */
-    dcb_call_callback(dcb, DCB_REASON_DRAINED);
+
+    dcb_drain_done(dcb);
 
 wrap_up:
+    dcb_drain_written(dcb, total_written, above_water);
+    return total_written;
+}
+
+/**
+ * Note that the write queue of a DCB has been drained
+ *
+ * @param dcb The DCB
+ */
+static void
+dcb_drain_done(DCB *dcb)
+{
+    if (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER && dcb->session)
+    {
+        qtrace_written(&dcb->session->trace);
+    }
+
+    /* The write queue has drained, potentially need to call a callback function */
+    dcb_call_callback(dcb, DCB_REASON_DRAINED);
+}
 
+/**
+ * Adjust the length of the write queue after data has been written
+ *
+ * @param dcb           The DCB
+ * @param total_written Number of bytes written
+ * @param above_water   Whether the queue was above the low water mark before
+ */
+static void
+dcb_drain_written(DCB *dcb, int total_written, bool above_water)
+{
     /*
      * If nothing has been written, the callback events cannot have occurred
      * and there is no need to adjust the length of the write queue.
      */
     if (total_written)
     {
-        atomic_add(&dcb->writeqlen, -total_written);
+        dcb_writeqlen_add(dcb, -total_written);
 
         /* Check if the draining has taken us from above water to below water */
         if (above_water && dcb->writeqlen < dcb->low_water)
@@ -1700,9 +2399,12 @@ wrap_up:
             atomic_add(&dcb->stats.n_low_water, 1);
             dcb_call_callback(dcb, DCB_REASON_LOW_WATER);
         }
+    }
 
+    if (dcb->writeq_throttling && dcb->writeqlen < dcb->low_water)
+    {
+        dcb_resume_reads(dcb);
     }
-    return total_written;
 }
 
 /**
@@ -1748,51 +2450,374 @@ dcb_grab_writeq(DCB *dcb, bool first_time)
 }
 
 /**
- * Removes dcb from poll set, and adds it to zombies list. As a consequence,
- * dcb first moves to DCB_STATE_NOPOLLING, and then to DCB_STATE_ZOMBIE state.
- * At the end of the function state may not be DCB_STATE_ZOMBIE because once
- * dcb_initlock is released parallel threads may change the state.
- *
- * Parameters:
- * @param dcb The DCB to close
+ * Start deferring the writes of the calling polling thread
  *
+ * While writes are deferred, a DCB owned by the thread that is written to
+ * with an empty write queue is remembered instead of being written to at
+ * once. The writes are submitted together by dcb_flush_writes. Nothing is
+ * deferred unless io_uring_writes is enabled and the kernel supports io_uring.
  *
+ * @param threadid The thread ID of the caller
  */
 void
-dcb_close(DCB *dcb)
+dcb_defer_writes(int threadid)
 {
-    CHK_DCB(dcb);
-
-    if (DCB_STATE_UNDEFINED == dcb->state
-        || DCB_STATE_DISCONNECTED == dcb->state)
+    if (!deferred.initialized)
     {
-        MXS_ERROR("%lu [dcb_close] Error : Removing DCB %p but was in state %s "
-                  "which is not legal for a call to dcb_close. ",
-                  pthread_self(),
-                  dcb,
-                  STRDCBSTATE(dcb->state));
-        raise(SIGABRT);
-    }
+        deferred.initialized = true;
+        deferred.thread_id = threadid;
 
-    /**
-     * dcb_close may be called for freshly created dcb, in which case
-     * it only needs to be freed.
-     */
-    if (dcb->state == DCB_STATE_ALLOC && dcb->fd == DCBFD_CLOSED)
-    {
-        dcb_final_free(dcb);
-        return;
-    }
+        if (config_io_uring_writes())
+        {
+            deferred.writes = (DEFERRED_WRITE *)malloc(DCB_DEFERRED_MAX * sizeof(DEFERRED_WRITE));
 
-    /*
-     * If DCB is in persistent pool, mark it as an error and exit
-     */
+            if (deferred.writes == NULL || (deferred.ring = uring_create(DCB_DEFERRED_MAX)) == NULL)
+            {
+                char errbuf[STRERROR_BUFLEN];
+                MXS_WARNING("Polling thread %d cannot use io_uring, writing directly: %s",
+                            threadid, strerror_r(errno, errbuf, sizeof(errbuf)));
+                free(deferred.writes);
+                deferred.writes = NULL;
+            }
+        }
+    }
+
+    deferred.active = deferred.ring != NULL;
+}
+
+/**
+ * Defer the draining of the write queue of a DCB to the end of the poll cycle
+ *
+ * @param dcb The DCB that was written to
+ * @return True if the draining was deferred, false if it must be done now
+ */
+static bool
+dcb_defer_drain(DCB *dcb)
+{
+    if (!deferred.active || dcb->owner != deferred.thread_id ||
+        (dcb->ssl && !DCB_IS_KTLS_SEND(dcb)))
+    {
+        return false;
+    }
+
+    if (!dcb->write_deferred)
+    {
+        if (deferred.n_writes == DCB_DEFERRED_MAX)
+        {
+            return false;
+        }
+        dcb->write_deferred = true;
+        deferred.writes[deferred.n_writes++].dcb = dcb;
+    }
+
+    return true;
+}
+
+/**
+ * Handle the result of a deferred write
+ *
+ * What was not written is put back at the front of the write queue. If the
+ * socket took everything, the queue is drained again in case more was
+ * queued meanwhile.
+ *
+ * @param write The write
+ * @param res   Number of bytes written, a negative errno on failure or
+ *              -ECANCELED if the write was never submitted
+ */
+static void
+dcb_deferred_complete(DEFERRED_WRITE *write, int res)
+{
+    DCB *dcb = write->dcb;
+    GWBUF *writeq = write->writeq;
+    bool retry, drained;
+
+    write->writeq = NULL;
+
+    if (res != -ECANCELED)
+    {
+        dcb->stats.n_writes++;
+    }
+
+    if (res > 0)
+    {
+        writeq = gwbuf_consume(writeq, res);
+    }
+    else if (res < 0 && res != -EAGAIN && res != -EPIPE && res != -ECANCELED)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Write to dcb %p "
+                  "in state %s fd %d failed due errno %d, %s",
+                  dcb,
+                  STRDCBSTATE(dcb->state),
+                  dcb->fd,
+                  -res,
+                  strerror_r(-res, errbuf, sizeof(errbuf)));
+    }
+
+    spinlock_acquire(&dcb->writeqlock);
+    dcb->writeq = gwbuf_append(writeq, dcb->writeq);
+    drained = dcb->writeq == NULL;
+    retry = !drained && (res > 0 || res == -ECANCELED || dcb->drain_called_while_busy);
+    dcb->drain_called_while_busy = false;
+    dcb->draining_flag = false;
+    spinlock_release(&dcb->writeqlock);
+
+    if (res > 0)
+    {
+        dcb_drain_written(dcb, res, write->above_water);
+    }
+
+    if (retry)
+    {
+        dcb_drain_writeq(dcb);
+    }
+    else if (drained)
+    {
+        dcb_drain_done(dcb);
+    }
+}
+
+/**
+ * Write the data queued for the DCBs whose writes were deferred
+ *
+ * The write queue of each DCB is written with one writev and all of them
+ * are submitted to the kernel with a single io_uring_enter call. The writes
+ * are not deferred after this until dcb_defer_writes is called again.
+ *
+ * @param threadid The thread ID of the caller
+ */
+void
+dcb_flush_writes(int threadid)
+{
+    int n_writes = deferred.n_writes;
+    int n_outstanding = 0;
+    int n_failures = 0;
+
+    deferred.active = false;
+    deferred.n_writes = 0;
+
+    for (int i = 0; i < n_writes; i++)
+    {
+        DEFERRED_WRITE *write = &deferred.writes[i];
+        DCB *dcb = write->dcb;
+
+        write->writeq = NULL;
+
+        /** The DCB was drained when it was closed */
+        if (!dcb->write_deferred)
+        {
+            continue;
+        }
+        dcb->write_deferred = false;
+
+        if (dcb->state != DCB_STATE_POLLING || dcb->fd <= 0)
+        {
+            dcb_drain_writeq(dcb);
+            continue;
+        }
+
+        if ((write->writeq = dcb_grab_writeq(dcb, true)) == NULL)
+        {
+            dcb_call_callback(dcb, DCB_REASON_DRAINED);
+            continue;
+        }
+
+        int n_iov = 0;
+
+        for (GWBUF *b = write->writeq; b && n_iov < DCB_DEFERRED_MAX_BUFFERS; b = b->next)
+        {
+            write->iov[n_iov].iov_base = GWBUF_DATA(b);
+            write->iov[n_iov].iov_len = GWBUF_LENGTH(b);
+            n_iov++;
+        }
+        write->above_water = (dcb->low_water && gwbuf_length(write->writeq) > dcb->low_water);
+
+        if (uring_writev(deferred.ring, dcb->fd, write->iov, n_iov, i))
+        {
+            n_outstanding++;
+        }
+        else
+        {
+            dcb_deferred_complete(write, -ECANCELED);
+        }
+    }
+
+    while (n_outstanding > 0)
+    {
+        uint64_t index;
+        int res;
+        int n_done = 0;
+        int rc = uring_submit(deferred.ring, 1);
+
+        if (rc < 0 && rc != -EINTR)
+        {
+            /** Do the writes the kernel did not take the usual way */
+            uint64_t discarded[DCB_DEFERRED_MAX];
+            unsigned n = uring_discard(deferred.ring, discarded, DCB_DEFERRED_MAX);
+            char errbuf[STRERROR_BUFLEN];
+
+            MXS_ERROR("Polling thread %d failed to submit %u writes with io_uring: %s",
+                      threadid, n, strerror_r(-rc, errbuf, sizeof(errbuf)));
+
+            for (unsigned j = 0; j < n; j++)
+            {
+                dcb_deferred_complete(&deferred.writes[discarded[j]], -ECANCELED);
+            }
+            n_outstanding -= n;
+            n_done += n;
+        }
+
+        while (uring_reap(deferred.ring, &index, &res))
+        {
+            dcb_deferred_complete(&deferred.writes[index], res);
+            n_outstanding--;
+            n_done++;
+        }
+
+        if (rc >= 0 || rc == -EINTR || n_done > 0)
+        {
+            n_failures = 0;
+        }
+        else if (n_outstanding > 0 && ++n_failures < DCB_URING_MAX_FAILURES)
+        {
+            /** The kernel has taken the writes, give it time to complete them */
+            struct timespec ts = {0, 1000000};
+            nanosleep(&ts, NULL);
+        }
+        else if (n_outstanding > 0)
+        {
+            dcb_abandon_uring(threadid, n_writes, -rc);
+            n_outstanding = 0;
+        }
+    }
+}
+
+/**
+ * Stop using io_uring after the submissions have failed repeatedly. The
+ * ring is freed, which cancels the writes the kernel still has, and the
+ * write queues of those writes are drained the usual way. The writes of
+ * the thread are not deferred after this.
+ *
+ * @param threadid The thread ID of the caller
+ * @param n_writes Number of writes in the last submission
+ * @param err      The error of the last submission
+ */
+static void
+dcb_abandon_uring(int threadid, int n_writes, int err)
+{
+    char errbuf[STRERROR_BUFLEN];
+
+    MXS_ERROR("Polling thread %d failed to submit writes with io_uring %d times in a row, "
+              "writing directly from now on: %s", threadid, DCB_URING_MAX_FAILURES,
+              strerror_r(err, errbuf, sizeof(errbuf)));
+
+    uring_free(deferred.ring);
+    deferred.ring = NULL;
+
+    for (int i = 0; i < n_writes; i++)
+    {
+        if (deferred.writes[i].writeq)
+        {
+            dcb_deferred_complete(&deferred.writes[i], -ECANCELED);
+        }
+    }
+}
+
+/**
+ * Removes dcb from poll set, and adds it to zombies list. As a consequence,
+ * dcb first moves to DCB_STATE_NOPOLLING, and then to DCB_STATE_ZOMBIE state.
+ * At the end of the function state may not be DCB_STATE_ZOMBIE because once
+ * dcb_initlock is released parallel threads may change the state.
+ *
+ * Parameters:
+ * @param dcb The DCB to close
+ *
+ *
+ */
+void
+dcb_close(DCB *dcb)
+{
+    CHK_DCB(dcb);
+
+    if (DCB_STATE_UNDEFINED == dcb->state
+        || DCB_STATE_DISCONNECTED == dcb->state)
+    {
+        MXS_ERROR("%lu [dcb_close] Error : Removing DCB %p but was in state %s "
+                  "which is not legal for a call to dcb_close. ",
+                  pthread_self(),
+                  dcb,
+                  STRDCBSTATE(dcb->state));
+        raise(SIGABRT);
+    }
+
+    /** A closed backend no longer waits for the client */
+    if (dcb->read_throttled && dcb->session)
+    {
+        SESSION *session = dcb->session;
+        spinlock_acquire(&session->ses_lock);
+
+        if (dcb->read_throttled)
+        {
+            DCB **prev = &session->throttled;
+
+            while (*prev != dcb)
+            {
+                prev = &(*prev)->next_throttled;
+            }
+            *prev = dcb->next_throttled;
+            dcb->next_throttled = NULL;
+            dcb->read_throttled = false;
+        }
+
+        spinlock_release(&session->ses_lock);
+    }
+
+    /** What was written before the DCB was closed is written first */
+    if (dcb->write_deferred)
+    {
+        dcb->write_deferred = false;
+        dcb_drain_writeq(dcb);
+    }
+
+    /**
+     * dcb_close may be called for freshly created dcb, in which case
+     * it only needs to be freed.
+     */
+    if (dcb->state == DCB_STATE_ALLOC && dcb->fd == DCBFD_CLOSED)
+    {
+        dcb_final_free(dcb);
+        return;
+    }
+
+    /*
+     * If DCB is in persistent pool, mark it as an error and exit
+     */
     if (dcb->persistentstart > 0)
     {
         dcb->dcb_errhandle_called = true;
         return;
     }
 
+    /** The idle timeout of the DCB no longer applies */
+    timerwheel_remove(&dcb->timer);
+
+    /*
+     * The other sockets of an SO_REUSEPORT listener share the session of
+     * the first one, which frees it.
+     */
+    while (dcb->shard)
+    {
+        DCB *shard = dcb->shard;
+        dcb->shard = shard->shard;
+        shard->shard = NULL;
+        shard->session = NULL;
+        dcb_close(shard);
+    }
+
+    dcb_splice_detach(dcb);
+
+    bool retire = false;
+
     spinlock_acquire(&zombiespin);
     if (!dcb->dcb_is_zombie)
     {
@@ -1808,25 +2833,44 @@ dcb_close(DCB *dcb)
             }
         }
         /*<
-         * Add closing dcb to the top of the list, setting zombie marker
+         * Set the zombie marker, the lock only protects against closing
+         * the DCB twice
          */
         dcb->dcb_is_zombie = true;
-        dcb->memdata.next = zombies;
-        zombies = dcb;
-        nzombies++;
-        if (nzombies > maxzombies)
-        {
-            maxzombies = nzombies;
-        }
-        /*< Set bit for each maxscale thread. This should be done before
-         * the state is changed, so as to protect the DCB from premature
-         * destruction. */
-        if (dcb->server)
+        retire = true;
+    }
+    spinlock_release(&zombiespin);
+
+    if (retire)
+    {
+        /*< Add closing dcb to the top of the zombie list of this thread */
+        dcb_add_to_zombies(dcb);
+    }
+}
+
+/**
+ * Called when a DCB has been in the persistent pool for longer than the
+ * persistmaxtime of the server. The pool is cleaned, which closes the DCB
+ * unless it has been taken into use again. The timer is added again if the
+ * clock has not yet passed the limit, as the heartbeat and the clock that
+ * the pool uses drift apart.
+ *
+ * @param timer The timer of the DCB
+ */
+static void
+dcb_persistent_expire(WHEEL_TIMER *timer)
+{
+    DCB *dcb = (DCB *)((char *)timer - offsetof(DCB, timer));
+
+    if (dcb->persistentstart > 0 && dcb->server)
+    {
+        dcb_persistent_clean_count(dcb->server, false);
+
+        if (dcb->persistentstart > 0)
         {
-            bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
+            timerwheel_add(&dcb->timer, dcb->owner, hkheartbeat + 10, dcb_persistent_expire);
         }
     }
-    spinlock_release(&zombiespin);
 }
 
 /**
@@ -1839,6 +2883,7 @@ dcb_close(DCB *dcb)
 static bool
 dcb_maybe_add_persistent(DCB *dcb)
 {
+    SERVER_POOL_USER *pooluser = NULL;
     int  poolcount = -1;
     if (dcb->user != NULL
         && strlen(dcb->user)
@@ -1847,9 +2892,10 @@ dcb_maybe_add_persistent(DCB *dcb)
         && (dcb->server->status & SERVER_RUNNING)
         && !dcb->dcb_errhandle_called
         && !(dcb->flags & DCBF_HUNG)
-        && (poolcount = dcb_persistent_clean_count(dcb, false)) < dcb->server->persistpoolmax)
+        && !(dcb->flags & DCBF_SPLICED)
+        && (poolcount = dcb_persistent_clean_count(dcb->server, false)) < dcb->server->persistpoolmax
+        && (pooluser = server_pool_user(dcb->server, dcb->user)) != NULL)
     {
-        DCB_CALLBACK *loopcallback;
         MXS_DEBUG("%lu [dcb_maybe_add_persistent] Adding DCB to persistent pool, user %s.\n",
                   pthread_self(),
                   dcb->user);
@@ -1861,6 +2907,8 @@ dcb_maybe_add_persistent(DCB *dcb)
              */
         {
             SESSION *local_session = dcb->session;
+            server_pool_save_auth(dcb->server, pooluser, dcb);
+            dcb_uncharge(dcb);
             session_set_dummy(dcb);
             CHK_SESSION(local_session);
             if (SESSION_STATE_DUMMY != local_session->state)
@@ -1868,19 +2916,15 @@ dcb_maybe_add_persistent(DCB *dcb)
                 session_free(local_session);
             }
         }
-        spinlock_acquire(&dcb->cb_lock);
-        while ((loopcallback = dcb->callbacks) != NULL)
+        memset(dcb->n_callbacks, 0, sizeof(dcb->n_callbacks));
+        if (dcb->server->persistmaxtime > 0)
         {
-            dcb->callbacks = loopcallback->next;
-            free(loopcallback);
+            timerwheel_add(&dcb->timer, dcb->owner,
+                           hkheartbeat + (dcb->server->persistmaxtime + 1) * 10,
+                           dcb_persistent_expire);
         }
-        spinlock_release(&dcb->cb_lock);
-        spinlock_acquire(&dcb->server->persistlock);
-        dcb->nextpersistent = dcb->server->persistent;
-        dcb->server->persistent = dcb;
-        spinlock_release(&dcb->server->persistlock);
-        atomic_add(&dcb->server->stats.n_persistent, 1);
-        atomic_add(&dcb->server->stats.n_current, -1);
+        server_add_persistent(dcb->server, pooluser, dcb);
+        server_add_current(dcb->server, -1);
         return true;
     }
     else
@@ -1990,90 +3034,87 @@ void printAllDCBs()
 }
 
 /**
- * Diagnostic to print one DCB in the system
+ * Format the details of one DCB into a print batch
  *
- * @param       pdcb    DCB to print results to
- * @param       dcb     DCB to be printed
+ * @param batch The batch to format into
+ * @param dcb   DCB to be printed
  */
-void
-dprintOneDCB(DCB *pdcb, DCB *dcb)
+static void
+dcb_batch_print_one(DCB_PRINT_BATCH *batch, DCB *dcb)
 {
     if (false == dcb->dcb_is_in_use)
     {
         return;
     }
-    dcb_printf(pdcb, "DCB: %p\n", (void *)dcb);
-    dcb_printf(pdcb, "\tDCB state:          %s\n",
-               gw_dcb_state2string(dcb->state));
+    dcb_batch_printf(batch, "DCB: %p\n", (void *)dcb);
+    dcb_batch_printf(batch, "\tDCB state:          %s\n",
+                     gw_dcb_state2string(dcb->state));
+    dcb_batch_printf(batch, "\tOwning thread:      %d\n", dcb->owner);
     if (dcb->session && dcb->session->service)
     {
-        dcb_printf(pdcb, "\tService:            %s\n",
-                   dcb->session->service->name);
+        dcb_batch_printf(batch, "\tService:            %s\n",
+                         dcb->session->service->name);
     }
     if (dcb->remote)
     {
-        dcb_printf(pdcb, "\tConnected to:       %s\n",
-                   dcb->remote);
+        dcb_batch_printf(batch, "\tConnected to:       %s\n",
+                         dcb->remote);
     }
     if (dcb->server)
     {
         if (dcb->server->name)
         {
-            dcb_printf(pdcb, "\tServer name/IP:     %s\n",
-                       dcb->server->name);
+            dcb_batch_printf(batch, "\tServer name/IP:     %s\n",
+                             dcb->server->name);
         }
         if (dcb->server->port)
         {
-            dcb_printf(pdcb, "\tPort number:        %d\n",
-                       dcb->server->port);
+            dcb_batch_printf(batch, "\tPort number:        %d\n",
+                             dcb->server->port);
         }
     }
     if (dcb->user)
     {
-        dcb_printf(pdcb, "\tUsername:           %s\n",
-                   dcb->user);
+        dcb_batch_printf(batch, "\tUsername:           %s\n",
+                         dcb->user);
     }
     if (dcb->protoname)
     {
-        dcb_printf(pdcb, "\tProtocol:           %s\n",
-                   dcb->protoname);
+        dcb_batch_printf(batch, "\tProtocol:           %s\n",
+                         dcb->protoname);
     }
     if (dcb->writeq)
     {
-        dcb_printf(pdcb, "\tQueued write data:  %d\n",
-                   gwbuf_length(dcb->writeq));
+        dcb_batch_printf(batch, "\tQueued write data:  %d\n",
+                         gwbuf_length(dcb->writeq));
     }
     char *statusname = server_status(dcb->server);
     if (statusname)
     {
-        dcb_printf(pdcb, "\tServer status:            %s\n", statusname);
+        dcb_batch_printf(batch, "\tServer status:            %s\n", statusname);
         free(statusname);
     }
     char *rolename = dcb_role_name(dcb);
     if (rolename)
     {
-        dcb_printf(pdcb, "\tRole:                     %s\n", rolename);
+        dcb_batch_printf(batch, "\tRole:                     %s\n", rolename);
         free(rolename);
     }
-    if (!bitmask_isallclear(&dcb->memdata.bitmask))
+    if (dcb->dcb_is_zombie)
     {
-        char *bitmasktext = bitmask_render_readable(&dcb->memdata.bitmask);
-        if (bitmasktext)
-        {
-            dcb_printf(pdcb, "\tBitMask:                %s\n", bitmasktext);
-            free(bitmasktext);
-        }
+        dcb_batch_printf(batch, "\tZombie epoch:           %d (current %d)\n",
+                         dcb->memdata.epoch, rcu_current());
     }
-    dcb_printf(pdcb, "\tStatistics:\n");
-    dcb_printf(pdcb, "\t\tNo. of Reads:             %d\n", dcb->stats.n_reads);
-    dcb_printf(pdcb, "\t\tNo. of Writes:            %d\n", dcb->stats.n_writes);
-    dcb_printf(pdcb, "\t\tNo. of Buffered Writes:   %d\n", dcb->stats.n_buffered);
-    dcb_printf(pdcb, "\t\tNo. of Accepts:           %d\n", dcb->stats.n_accepts);
-    dcb_printf(pdcb, "\t\tNo. of High Water Events: %d\n", dcb->stats.n_high_water);
-    dcb_printf(pdcb, "\t\tNo. of Low Water Events:  %d\n", dcb->stats.n_low_water);
+    dcb_batch_printf(batch, "\tStatistics:\n");
+    dcb_batch_printf(batch, "\t\tNo. of Reads:             %d\n", dcb->stats.n_reads);
+    dcb_batch_printf(batch, "\t\tNo. of Writes:            %d\n", dcb->stats.n_writes);
+    dcb_batch_printf(batch, "\t\tNo. of Buffered Writes:   %d\n", dcb->stats.n_buffered);
+    dcb_batch_printf(batch, "\t\tNo. of Accepts:           %d\n", dcb->stats.n_accepts);
+    dcb_batch_printf(batch, "\t\tNo. of High Water Events: %d\n", dcb->stats.n_high_water);
+    dcb_batch_printf(batch, "\t\tNo. of Low Water Events:  %d\n", dcb->stats.n_low_water);
     if (dcb->flags & DCBF_CLONE)
     {
-        dcb_printf(pdcb, "\t\tDCB is a clone.\n");
+        dcb_batch_printf(batch, "\t\tDCB is a clone.\n");
     }
     if (dcb->persistentstart)
     {
@@ -2081,33 +3122,56 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
         struct tm timeinfo;
         localtime_r(&dcb->persistentstart, &timeinfo);
         strftime(buff, sizeof(buff), "%b %d %H:%M:%S", &timeinfo);
-        dcb_printf(pdcb, "\t\tAdded to persistent pool:       %s\n", buff);
+        dcb_batch_printf(batch, "\t\tAdded to persistent pool:       %s\n", buff);
     }
 }
+
+/**
+ * Diagnostic to print one DCB in the system
+ *
+ * @param       pdcb    DCB to print results to
+ * @param       dcb     DCB to be printed
+ */
+void
+dprintOneDCB(DCB *pdcb, DCB *dcb)
+{
+    DCB_PRINT_BATCH batch;
+
+    dcb_batch_init(&batch, pdcb);
+    dcb_batch_print_one(&batch, dcb);
+    dcb_batch_flush(&batch);
+}
+
 /**
  * Diagnostic to print all DCB allocated in the system
  *
+ * The list is formatted into a print batch while the DCB list is locked
+ * and written to the DCB after the lock has been released.
+ *
  * @param       pdcb    DCB to print results to
  */
 void
 dprintAllDCBs(DCB *pdcb)
 {
+    DCB_PRINT_BATCH batch;
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
+    dcb_batch_init(&batch, pdcb);
 #if SPINLOCK_PROFILE
     dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
     spinlock_stats(&dcbspin, spin_reporter, pdcb);
     dcb_printf(pdcb, "Zombie Queue Lock Statistics:\n");
     spinlock_stats(&zombiespin, spin_reporter, pdcb);
 #endif
+    spinlock_acquire(&dcbspin);
     dcb = allDCBs;
     while (dcb)
     {
-        dprintOneDCB(pdcb, dcb);
+        dcb_batch_print_one(&batch, dcb);
         dcb = dcb->next;
     }
     spinlock_release(&dcbspin);
+    dcb_batch_flush(&batch);
 }
 
 /**
@@ -2118,28 +3182,31 @@ dprintAllDCBs(DCB *pdcb)
 void
 dListDCBs(DCB *pdcb)
 {
+    DCB_PRINT_BATCH batch;
     DCB *dcb;
 
+    dcb_batch_init(&batch, pdcb);
+    dcb_batch_printf(&batch, "Descriptor Control Blocks\n");
+    dcb_batch_printf(&batch, "------------------+----------------------------+--------------------+----------\n");
+    dcb_batch_printf(&batch, " %-16s | %-26s | %-18s | %s\n",
+                     "DCB", "State", "Service", "Remote");
+    dcb_batch_printf(&batch, "------------------+----------------------------+--------------------+----------\n");
     spinlock_acquire(&dcbspin);
     dcb = allDCBs;
-    dcb_printf(pdcb, "Descriptor Control Blocks\n");
-    dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
-    dcb_printf(pdcb, " %-16s | %-26s | %-18s | %s\n",
-               "DCB", "State", "Service", "Remote");
-    dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
     while (dcb)
     {
         if (dcb->dcb_is_in_use)
         {
-            dcb_printf(pdcb, " %-16p | %-26s | %-18s | %s\n",
-                       dcb, gw_dcb_state2string(dcb->state),
-                       ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
-                       (dcb->remote ? dcb->remote : ""));
+            dcb_batch_printf(&batch, " %-16p | %-26s | %-18s | %s\n",
+                             dcb, gw_dcb_state2string(dcb->state),
+                             ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
+                             (dcb->remote ? dcb->remote : ""));
         }
         dcb = dcb->next;
     }
-    dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n\n");
     spinlock_release(&dcbspin);
+    dcb_batch_printf(&batch, "------------------+----------------------------+--------------------+----------\n\n");
+    dcb_batch_flush(&batch);
 }
 
 /**
@@ -2150,29 +3217,32 @@ dListDCBs(DCB *pdcb)
 void
 dListClients(DCB *pdcb)
 {
+    DCB_PRINT_BATCH batch;
     DCB *dcb;
 
+    dcb_batch_init(&batch, pdcb);
+    dcb_batch_printf(&batch, "Client Connections\n");
+    dcb_batch_printf(&batch, "-----------------+------------------+----------------------+------------\n");
+    dcb_batch_printf(&batch, " %-15s | %-16s | %-20s | %s\n",
+                     "Client", "DCB", "Service", "Session");
+    dcb_batch_printf(&batch, "-----------------+------------------+----------------------+------------\n");
     spinlock_acquire(&dcbspin);
     dcb = allDCBs;
-    dcb_printf(pdcb, "Client Connections\n");
-    dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
-    dcb_printf(pdcb, " %-15s | %-16s | %-20s | %s\n",
-               "Client", "DCB", "Service", "Session");
-    dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
     while (dcb)
     {
         if (dcb->dcb_is_in_use && dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER)
         {
-            dcb_printf(pdcb, " %-15s | %16p | %-20s | %10p\n",
-                       (dcb->remote ? dcb->remote : ""),
-                       dcb, (dcb->session->service ?
-                             dcb->session->service->name : ""),
-                       dcb->session);
+            dcb_batch_printf(&batch, " %-15s | %16p | %-20s | %10p\n",
+                             (dcb->remote ? dcb->remote : ""),
+                             dcb, (dcb->session->service ?
+                                   dcb->session->service->name : ""),
+                             dcb->session);
         }
         dcb = dcb->next;
     }
-    dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n\n");
     spinlock_release(&dcbspin);
+    dcb_batch_printf(&batch, "-----------------+------------------+----------------------+------------\n\n");
+    dcb_batch_flush(&batch);
 }
 
 
@@ -2264,8 +3334,6 @@ dprintDCB(DCB *pdcb, DCB *dcb)
     spinlock_stats(&dcb->pollinlock, spin_reporter, pdcb);
     dcb_printf(pdcb, "\tPollout Lock Statistics:\n");
     spinlock_stats(&dcb->polloutlock, spin_reporter, pdcb);
-    dcb_printf(pdcb, "\tCallback Lock Statistics:\n");
-    spinlock_stats(&dcb->cb_lock, spin_reporter, pdcb);
 #endif
     if (dcb->persistentstart)
     {
@@ -2335,17 +3403,130 @@ dcb_printf(DCB *dcb, const char *fmt, ...)
 }
 
 /**
- * Print hash table statistics to a DCB
+ * Start a print batch
  *
- * @param dcb           The DCB to send the information to
- * @param table         The hash table
+ * @param batch The batch
+ * @param dcb   The DCB the output is written to
  */
-void dcb_hashtable_stats(
-    DCB     *dcb,
-    void    *table)
+void
+dcb_batch_init(DCB_PRINT_BATCH *batch, DCB *dcb)
 {
-    int total;
-    int longest;
+    batch->dcb = dcb;
+    batch->head = NULL;
+    batch->current = NULL;
+    batch->space = 0;
+}
+
+/**
+ * Reserve space at the end of a print batch
+ *
+ * The space is contiguous. A new buffer is started if the current one
+ * does not have enough room left.
+ *
+ * @param batch The batch
+ * @param len   Number of bytes to reserve
+ * @return Pointer to the reserved space or NULL on memory allocation failure
+ */
+uint8_t *
+dcb_batch_reserve(DCB_PRINT_BATCH *batch, size_t len)
+{
+    if (batch->current == NULL || batch->space < len)
+    {
+        size_t size = len > DCB_BATCH_SIZE ? len : DCB_BATCH_SIZE;
+        GWBUF *buf = gwbuf_alloc(size);
+
+        if (buf == NULL)
+        {
+            return NULL;
+        }
+        buf->end = buf->start;
+        batch->head = gwbuf_append(batch->head, buf);
+        batch->current = buf;
+        batch->space = size;
+    }
+
+    uint8_t *ptr = (uint8_t *)batch->current->end;
+    batch->current->end = ptr + len;
+    batch->space -= len;
+    return ptr;
+}
+
+/**
+ * A print batch version of printf
+ *
+ * @param batch The batch to format into
+ * @param fmt   A printf format string
+ * @param ...   Variable arguments for the print format
+ */
+void
+dcb_batch_printf(DCB_PRINT_BATCH *batch, const char *fmt, ...)
+{
+    char *ptr = batch->current ? (char *)batch->current->end : NULL;
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(ptr, batch->space, fmt, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        return;
+    }
+
+    if ((size_t)len < batch->space)
+    {
+        batch->current->end = ptr + len;
+        batch->space -= len;
+    }
+    else if ((ptr = (char *)dcb_batch_reserve(batch, len + 1)) != NULL)
+    {
+        va_start(args, fmt);
+        vsnprintf(ptr, len + 1, fmt, args);
+        va_end(args);
+
+        /** The terminating null is not part of the output */
+        batch->current->end = ptr + len;
+        batch->space++;
+    }
+}
+
+/**
+ * Write the contents of a print batch to its DCB
+ *
+ * The batch can be used again after it has been flushed.
+ *
+ * @param batch The batch
+ * @return The return value of the write or 1 if there was nothing to write
+ */
+int
+dcb_batch_flush(DCB_PRINT_BATCH *batch)
+{
+    int rval = 1;
+
+    if (batch->head)
+    {
+        rval = batch->dcb->func.write(batch->dcb, batch->head);
+    }
+
+    batch->head = NULL;
+    batch->current = NULL;
+    batch->space = 0;
+    return rval;
+}
+
+/**
+ * Print hash table statistics to a DCB
+ *
+ * @param dcb           The DCB to send the information to
+ * @param table         The hash table
+ */
+void dcb_hashtable_stats(
+    DCB     *dcb,
+    void    *table)
+{
+    int total;
+    int longest;
     int hashsize;
 
     total = 0;
@@ -2370,6 +3551,12 @@ void dcb_hashtable_stats(
  * linked from the DCB. All communication is encrypted and done via the SSL
  * structure. Data is written from the DCB write queue.
  *
+ * If the first buffer is small and followed by others, up to
+ * DCB_SSL_WRITE_BATCH bytes of the list are copied into one record so that
+ * a result set of many small buffers does not need an SSL_write for every
+ * buffer. A write that must be retried is retried with the same data, which
+ * is still at the start of the write queue, but possibly with more of it.
+ *
  * @param dcb           The DCB having an SSL connection
  * @param writeq        A buffer list containing the data to be written
  * @param stop_writing  Set to true if the caller should stop writing, false otherwise
@@ -2380,7 +3567,18 @@ gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
 {
     int written;
 
-    written = SSL_write(dcb->ssl, GWBUF_DATA(writeq), GWBUF_LENGTH(writeq));
+    if (writeq->next && GWBUF_LENGTH(writeq) < DCB_SSL_WRITE_BATCH)
+    {
+        uint8_t batch[DCB_SSL_WRITE_BATCH];
+        size_t nbytes = gwbuf_copy_data(writeq, 0, sizeof(batch), batch);
+
+        written = SSL_write(dcb->ssl, batch, nbytes);
+    }
+    else
+    {
+        written = SSL_write(dcb->ssl, GWBUF_DATA(writeq), GWBUF_LENGTH(writeq));
+    }
+    dcb->stats.n_writes++;
 
     *stop_writing = false;
     switch ((SSL_get_error(dcb->ssl, written)))
@@ -2435,6 +3633,10 @@ gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
 /**
  * Write data to a DCB. The data is taken from the DCB's write queue.
  *
+ * Up to DCB_WRITEV_MAX_BUFFERS buffers of the list are written with a single
+ * writev call. The caller consumes the written bytes from the list, which
+ * also takes care of a partial write that ends in the middle of a buffer.
+ *
  * @param dcb           The DCB to write buffer
  * @param writeq        A buffer list containing the data to be written
  * @param stop_writing  Set to true if the caller should stop writing, false otherwise
@@ -2447,8 +3649,17 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     int fd = dcb->fd;
     size_t nbytes = GWBUF_LENGTH(writeq);
     void *buf = GWBUF_DATA(writeq);
+    struct iovec iov[DCB_WRITEV_MAX_BUFFERS];
+    int n_iov = 0;
     int saved_errno;
 
+    for (GWBUF *b = writeq; b && n_iov < DCB_WRITEV_MAX_BUFFERS; b = b->next)
+    {
+        iov[n_iov].iov_base = GWBUF_DATA(b);
+        iov[n_iov].iov_len = GWBUF_LENGTH(b);
+        n_iov++;
+    }
+
     errno = 0;
 
 #if defined(FAKE_CODE)
@@ -2465,12 +3676,14 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     }
     else if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, n_iov);
+        dcb->stats.n_writes++;
     }
 #else
     if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, n_iov);
+        dcb->stats.n_writes++;
     }
 #endif /* FAKE_CODE */
 
@@ -2561,8 +3774,12 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
  * Duplicate registrations are not allowed, therefore an error will be
  * returned if the specific function, reason and userdata triple
  * are already registered.
- * An error will also be returned if the is insufficient memeory available to
- * create the registration.
+ * An error will also be returned if DCB_MAX_CALLBACKS callbacks are already
+ * registered for the reason.
+ *
+ * The callbacks of a DCB are only added and removed by the thread that owns
+ * the DCB, so no locking is needed. The count is stored last so that the
+ * callbacks can be called from other threads.
  *
  * @param dcb           The DCB to add the callback to
  * @param reason        The callback reason
@@ -2576,48 +3793,35 @@ dcb_add_callback(DCB *dcb,
                  int (*callback)(struct dcb *, DCB_REASON, void *),
                  void *userdata)
 {
-    DCB_CALLBACK *cb, *ptr, *lastcb = NULL;
+    DCB_CALLBACK *cbs = dcb->callbacks[reason];
+    int n = dcb->n_callbacks[reason];
 
-    if ((ptr = (DCB_CALLBACK *)malloc(sizeof(DCB_CALLBACK))) == NULL)
-    {
-        return 0;
-    }
-    ptr->reason = reason;
-    ptr->cb = callback;
-    ptr->userdata = userdata;
-    ptr->next = NULL;
-    spinlock_acquire(&dcb->cb_lock);
-    cb = dcb->callbacks;
-    while (cb)
+    for (int i = 0; i < n; i++)
     {
-        if (cb->reason == reason && cb->cb == callback &&
-            cb->userdata == userdata)
+        if (cbs[i].cb == callback && cbs[i].userdata == userdata)
         {
             /* Callback is a duplicate, abandon it */
-            free(ptr);
-            spinlock_release(&dcb->cb_lock);
             return 0;
         }
-        lastcb = cb;
-        cb = cb->next;
     }
-    if (NULL == lastcb)
-    {
-        dcb->callbacks = ptr;
-    }
-    else
+
+    if (n == DCB_MAX_CALLBACKS)
     {
-        lastcb->next = ptr;
+        MXS_ERROR("Too many callbacks registered for '%s' on a DCB.", STRDCBREASON(reason));
+        return 0;
     }
-    spinlock_release(&dcb->cb_lock);
+
+    cbs[n].cb = callback;
+    cbs[n].userdata = userdata;
+    __atomic_store_n(&dcb->n_callbacks[reason], n + 1, __ATOMIC_RELEASE);
     return 1;
 }
 
 /**
- * Remove a callback from the callback list for the DCB
+ * Remove a callback from the callbacks of the DCB
  *
- * Searches down the linked list to find the callback with a matching reason, function
- * and userdata.
+ * Finds the callback with a matching reason, function and userdata. The last
+ * callback of the reason takes its place.
  *
  * @param dcb           The DCB to add the callback to
  * @param reason        The callback reason
@@ -2631,81 +3835,51 @@ dcb_remove_callback(DCB *dcb,
                     int (*callback)(struct dcb *, DCB_REASON, void *),
                     void *userdata)
 {
-    DCB_CALLBACK *cb, *pcb = NULL;
-    int          rval = 0;
+    DCB_CALLBACK *cbs = dcb->callbacks[reason];
+    int n = dcb->n_callbacks[reason];
 
-    spinlock_acquire(&dcb->cb_lock);
-    cb = dcb->callbacks;
-    if (cb == NULL)
+    for (int i = 0; i < n; i++)
     {
-        rval = 0;
-    }
-    else
-    {
-        while (cb)
+        if (cbs[i].cb == callback && cbs[i].userdata == userdata)
         {
-            if (cb->reason == reason &&
-                cb->cb == callback &&
-                cb->userdata == userdata)
-            {
-                if (pcb != NULL)
-                {
-                    pcb->next = cb->next;
-                }
-                else
-                {
-                    dcb->callbacks = cb->next;
-                }
-                spinlock_release(&dcb->cb_lock);
-                free(cb);
-                rval = 1;
-                break;
-            }
-            pcb = cb;
-            cb = cb->next;
+            cbs[i] = cbs[n - 1];
+            __atomic_store_n(&dcb->n_callbacks[reason], n - 1, __ATOMIC_RELEASE);
+            return 1;
         }
     }
-    if (!rval)
-    {
-        spinlock_release(&dcb->cb_lock);
-    }
-    return rval;
+
+    return 0;
 }
 
 /**
  * Call the set of callbacks registered for a particular reason.
  *
+ * The callbacks are copied before they are called, as a callback may remove
+ * itself or add others.
+ *
  * @param dcb           The DCB to call the callbacks regarding
  * @param reason        The reason that has triggered the call
  */
 static void
 dcb_call_callback(DCB *dcb, DCB_REASON reason)
 {
-    DCB_CALLBACK *cb, *nextcb;
+    int n = __atomic_load_n(&dcb->n_callbacks[reason], __ATOMIC_ACQUIRE);
 
-    spinlock_acquire(&dcb->cb_lock);
-    cb = dcb->callbacks;
-    while (cb)
+    if (n > 0)
     {
-        if (cb->reason == reason)
-        {
-            nextcb = cb->next;
-            spinlock_release(&dcb->cb_lock);
+        DCB_CALLBACK cbs[DCB_MAX_CALLBACKS];
 
+        memcpy(cbs, dcb->callbacks[reason], n * sizeof(DCB_CALLBACK));
+
+        for (int i = 0; i < n; i++)
+        {
             MXS_DEBUG("%lu [dcb_call_callback] %s",
                       pthread_self(),
                       STRDCBREASON(reason));
 
-            cb->cb(dcb, reason, cb->userdata);
-            spinlock_acquire(&dcb->cb_lock);
-            cb = nextcb;
-        }
-        else
-        {
-            cb = cb->next;
+            cbs[i].cb(dcb, reason, cbs[i].userdata);
         }
     }
-    spinlock_release(&dcb->cb_lock);
 }
 
 /**
@@ -2880,59 +4054,125 @@ dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf)
     return 0;
 }
 
+/**
+ * Check without blocking that the backend has not closed a pooled connection
+ *
+ * An idle connection in the pool should have nothing to read. End of file
+ * means that the backend closed it and pending data is usually the error
+ * packet that the server sends before closing an idle connection, for
+ * example when its wait_timeout is exceeded. Either way the connection can
+ * not be used for a new session. The data is peeked so that nothing is read
+ * from the socket of a connection that is alive.
+ *
+ * @param dcb   The pooled DCB
+ * @return True if the connection is still usable
+ */
+bool
+dcb_persistent_alive(DCB *dcb)
+{
+    char c;
+    ssize_t n;
+
+    if (dcb->fd < 0)
+    {
+        return false;
+    }
+
+    while ((n = recv(dcb->fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT)) < 0 && errno == EINTR)
+    {
+        ;
+    }
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
 /**
  * Check persistent pool for expiry or excess size and count
  *
- * @param dcb           The DCB being closed.
+ * @param server        The server whose pool is checked
  * @param cleanall      Boolean, if true the whole pool is cleared for the
- *                      server related to the given DCB
+ *                      server
  * @return              A count of the DCBs remaining in the pool
  */
 int
-dcb_persistent_clean_count(DCB *dcb, bool cleanall)
+dcb_persistent_clean_count(SERVER *server, bool cleanall)
+{
+    return dcb_persistent_clean(server, cleanall, false);
+}
+
+/**
+ * Remove the connections that the backend has closed from the persistent
+ * pool of a server, along with the expired ones
+ *
+ * @param server        The server whose pool is checked
+ * @return              A count of the DCBs remaining in the pool
+ */
+int
+dcb_persistent_prune(SERVER *server)
+{
+    return dcb_persistent_clean(server, false, true);
+}
+
+/**
+ * Clean the persistent pool of a server
+ *
+ * @param server        The server whose pool is checked
+ * @param cleanall      If true the whole pool is cleared
+ * @param probe         If true the connections are checked with
+ *                      dcb_persistent_alive()
+ * @return              A count of the DCBs remaining in the pool
+ */
+static int
+dcb_persistent_clean(SERVER *server, bool cleanall, bool probe)
 {
     int count = 0;
-    if (dcb && dcb->server)
+    if (server)
     {
-        SERVER *server = dcb->server;
-        DCB *previousdcb = NULL;
+        SERVER_POOL_USER *pooluser;
+        DCB *previousdcb;
         DCB *persistentdcb, *nextdcb;
         DCB *disposals = NULL;
 
         CHK_SERVER(server);
         spinlock_acquire(&server->persistlock);
-        persistentdcb = server->persistent;
-        while (persistentdcb)
-        {
-            CHK_DCB(persistentdcb);
-            nextdcb = persistentdcb->nextpersistent;
-            if (cleanall
-                || persistentdcb-> dcb_errhandle_called
-                || count >= server->persistpoolmax
-                || persistentdcb->server == NULL
-                || !(persistentdcb->server->status & SERVER_RUNNING)
-                || (time(NULL) - persistentdcb->persistentstart) > server->persistmaxtime)
+        for (pooluser = server->persistent; pooluser; pooluser = pooluser->next)
+        {
+            previousdcb = NULL;
+            persistentdcb = pooluser->stack;
+            while (persistentdcb)
             {
-                /* Remove from persistent pool */
-                if (previousdcb)
+                CHK_DCB(persistentdcb);
+                nextdcb = persistentdcb->nextpersistent;
+                if (cleanall
+                    || persistentdcb-> dcb_errhandle_called
+                    || count >= server->persistpoolmax
+                    || persistentdcb->server == NULL
+                    || !(persistentdcb->server->status & SERVER_RUNNING)
+                    || (time(NULL) - persistentdcb->persistentstart) > server->persistmaxtime
+                    || (probe && !dcb_persistent_alive(persistentdcb)))
                 {
-                    previousdcb->nextpersistent = nextdcb;
+                    /* Remove from persistent pool */
+                    if (previousdcb)
+                    {
+                        previousdcb->nextpersistent = nextdcb;
+                    }
+                    else
+                    {
+                        pooluser->stack = nextdcb;
+                    }
+                    pooluser->count--;
+                    /* Add removed DCBs to disposal list for processing outside spinlock */
+                    persistentdcb->nextpersistent = disposals;
+                    disposals = persistentdcb;
+                    atomic_add(&server->stats.n_persistent, -1);
                 }
                 else
                 {
-                    server->persistent = nextdcb;
+                    count++;
+                    previousdcb = persistentdcb;
                 }
-                /* Add removed DCBs to disposal list for processing outside spinlock */
-                persistentdcb->nextpersistent = disposals;
-                disposals = persistentdcb;
-                atomic_add(&server->stats.n_persistent, -1);
+                persistentdcb = nextdcb;
             }
-            else
-            {
-                count++;
-                previousdcb = persistentdcb;
-            }
-            persistentdcb = nextdcb;
         }
         server->persistmax = MAX(server->persistmax, count);
         spinlock_release(&server->persistlock);
@@ -3036,9 +4276,34 @@ dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl)
         return -1;
     }
 
+    /** gw_write_SSL may retry a write from a different batching buffer */
+    SSL_set_mode(dcb->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     return 0;
 }
 
+/**
+ * Check whether OpenSSL handed the encryption of the written data over to
+ * the kernel after the handshake. If it did, the data is written with the
+ * same system calls as on a plain socket, which allows batching with writev
+ * and splicing into the socket. The data that is read still goes through
+ * SSL_read, so that the TLS records that are not application data are
+ * handled, but OpenSSL only receives it from the kernel.
+ *
+ * @param dcb   The DCB whose SSL handshake was completed
+ */
+static void
+dcb_check_ktls(DCB *dcb)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(dcb->ssl)))
+    {
+        dcb->flags |= DCBF_KTLS_SEND;
+        MXS_DEBUG("Kernel TLS is used for writes to %s.", dcb->remote ? dcb->remote : "a DCB");
+    }
+#endif
+}
+
 /**
  * Accept a SSL connection and do the SSL authentication handshake.
  * This function accepts a client connection to a DCB. It assumes that the SSL
@@ -3071,6 +4336,8 @@ int dcb_accept_SSL(DCB* dcb)
     {
         case SSL_ERROR_NONE:
             MXS_DEBUG("SSL_accept done for %s@%s", user, remote);
+            ssl_handshake_done(dcb->listener->ssl, dcb->ssl, false);
+            dcb_check_ktls(dcb);
             dcb->ssl_state = SSL_ESTABLISHED;
             dcb->ssl_read_want_write = false;
             return 1;
@@ -3133,18 +4400,27 @@ int dcb_connect_SSL(DCB* dcb)
     int ssl_rval;
     int return_code;
 
-    if ((NULL == dcb->server || NULL == dcb->server->server_ssl) ||
-        (NULL == dcb->ssl && dcb_create_SSL(dcb, dcb->server->server_ssl) != 0))
+    if (NULL == dcb->server || NULL == dcb->server->server_ssl)
     {
         ss_dassert((NULL != dcb->server) && (NULL != dcb->server->server_ssl));
         return -1;
     }
+    if (NULL == dcb->ssl)
+    {
+        if (dcb_create_SSL(dcb, dcb->server->server_ssl) != 0)
+        {
+            return -1;
+        }
+        ssl_resume_session(dcb->server->server_ssl, dcb->ssl);
+    }
     dcb->ssl_state = SSL_HANDSHAKE_REQUIRED;
     ssl_rval = SSL_connect(dcb->ssl);
     switch (SSL_get_error(dcb->ssl, ssl_rval))
     {
         case SSL_ERROR_NONE:
             MXS_DEBUG("SSL_connect done for %s", dcb->remote);
+            ssl_handshake_done(dcb->server->server_ssl, dcb->ssl, true);
+            dcb_check_ktls(dcb);
             dcb->ssl_state = SSL_ESTABLISHED;
             dcb->ssl_read_want_write = false;
             return_code = 1;
@@ -3210,6 +4486,9 @@ int dcb_connect_SSL(DCB* dcb)
  * are set before returning the new DCB to the caller, or returning NULL if
  * no new connection could be achieved.
  *
+ * Connections that were queued because the service had max_connections
+ * clients are returned before new ones, once there is room for them.
+ *
  * @param dcb Listener DCB that has detected new connection request
  * @return DCB - The new client DCB for the new connection, or NULL if failed
  */
@@ -3223,7 +4502,12 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
     socklen_t optlen = sizeof(sendbuf);
     char errbuf[STRERROR_BUFLEN];
 
-    if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)&client_conn)) >= 0)
+    if ((client_dcb = dcb_accept_queued(listener, protocol_funcs)) != NULL)
+    {
+        return client_dcb;
+    }
+
+    if ((c_sock = dcb_accept_admitted(listener, &client_conn)) >= 0)
     {
         listener->stats.n_accepts++;
 #if defined(SS_DEBUG)
@@ -3250,13 +4534,12 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
             MXS_ERROR("Failed to set socket options. Error %d: %s",
                       errno, strerror_r(errno, errbuf, sizeof(errbuf)));
         }
-        setnonblocking(c_sock);
-
         client_dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, listener->listener);
 
         if (client_dcb == NULL)
         {
             MXS_ERROR("Failed to create DCB object for client connection.");
+            listener_handshake_done(listener->listener);
             close(c_sock);
         }
         else
@@ -3264,9 +4547,19 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
             const char *authenticator_name = "NullAuth";
             GWAUTHENTICATOR *authfuncs;
 
+            client_dcb->handshaking = true;
+
             client_dcb->service = listener->session->service;
             client_dcb->session = session_set_dummy(client_dcb);
             client_dcb->fd = c_sock;
+            /*
+             * The kernel has already spread the connections over the sockets
+             * of an SO_REUSEPORT listener, keep them with the accepting thread.
+             */
+            client_dcb->owner = listener->reuseport ? listener->owner :
+                                dcb_assign_owner(client_dcb->service);
+            client_dcb->high_water = writeq_high_water;
+            client_dcb->low_water = writeq_low_water;
 
             // get client address
             if (((struct sockaddr *)&client_conn)->sa_family == AF_UNIX)
@@ -3316,14 +4609,27 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
                 }
             }
             memcpy(&(client_dcb->authfunc), authfuncs, sizeof(GWAUTHENTICATOR));
-            if (client_dcb->service->max_connections &&
-                client_dcb->service->client_count >= client_dcb->service->max_connections)
+            SERVICE *service = client_dcb->service;
+
+            /** A new connection does not overtake the queued ones */
+            if (service->max_connections &&
+                (service->client_count >= service->max_connections ||
+                 (service->queued_connections &&
+                  mxs_queue_count(service->queued_connections) > 0)))
             {
-                if (!mxs_enqueue(client_dcb->service->queued_connections, client_dcb))
+                if (mxs_enqueue(service->queued_connections, client_dcb))
+                {
+                    /** The handshake starts when the connection is admitted */
+                    MXS_INFO("Service '%s' has %d clients, queuing the connection from %s.",
+                             service->name, service->client_count, client_dcb->remote);
+                    dcb_handshake_done(client_dcb);
+                    dcb_wake_queued(service);
+                }
+                else
                 {
                     if (client_dcb->func.connlimit)
                     {
-                        client_dcb->func.connlimit(client_dcb, client_dcb->service->max_connections);
+                        client_dcb->func.connlimit(client_dcb, service->max_connections);
                     }
                     dcb_close(client_dcb);
                 }
@@ -3334,12 +4640,168 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
     return client_dcb;
 }
 
+/**
+ * Take the oldest queued connection of the service of a listener if there is
+ * room for it. A connection that was accepted by a listener of another
+ * protocol is left for that listener, which is woken up.
+ *
+ * @param listener          The listener DCB
+ * @param protocol_funcs    The protocol of the listener
+ * @return The client DCB of the connection or NULL if none can be admitted
+ */
+static DCB *
+dcb_accept_queued(DCB *listener, GWPROTOCOL *protocol_funcs)
+{
+    SERVICE *service = listener->service;
+    QUEUE_CONFIG *queue = service ? service->queued_connections : NULL;
+    QUEUE_ENTRY entry;
+
+    if (queue == NULL ||
+        (service->max_connections && service->client_count >= service->max_connections) ||
+        !mxs_queue_peek(queue, &entry))
+    {
+        return NULL;
+    }
+
+    DCB *client_dcb = (DCB *)entry.queued_object;
+
+    if (client_dcb->func.read != protocol_funcs->read)
+    {
+        dcb_wake_queued(service);
+        return NULL;
+    }
+
+    if (!mxs_dequeue(queue, &entry))
+    {
+        return NULL;
+    }
+
+    client_dcb = (DCB *)entry.queued_object;
+
+    if (client_dcb->func.read != protocol_funcs->read)
+    {
+        /** Taken by another listener in the meantime */
+        if (!mxs_enqueue(queue, client_dcb))
+        {
+            dcb_close(client_dcb);
+        }
+        dcb_wake_queued(service);
+        return NULL;
+    }
+
+    MXS_INFO("Admitting the queued connection from %s to service '%s' after %ld ms.",
+             client_dcb->remote, service->name, (hkheartbeat - entry.heartbeat) * 100);
+    client_dcb->owner = poll_current_thread();
+    return client_dcb;
+}
+
+/**
+ * Wake up the listener of the oldest queued connection of a service so that
+ * it admits the connection if there is room for it.
+ *
+ * @param service The service
+ */
+static void
+dcb_wake_queued(SERVICE *service)
+{
+    QUEUE_ENTRY entry;
+
+    if (service->queued_connections &&
+        (service->max_connections == 0 || service->client_count < service->max_connections) &&
+        mxs_queue_peek(service->queued_connections, &entry))
+    {
+        DCB *client_dcb = (DCB *)entry.queued_object;
+
+        if (client_dcb->listener && client_dcb->listener->listener)
+        {
+            poll_fake_read_event(client_dcb->listener->listener);
+        }
+    }
+}
+
+/**
+ * Make the listener try accepting again on the next heartbeat
+ *
+ * @param timer The timer of the listener DCB
+ */
+static void
+dcb_accept_resume(WHEEL_TIMER *timer)
+{
+    DCB *listener = (DCB *)((char *)timer - offsetof(DCB, timer));
+
+    if (listener->state == DCB_STATE_LISTENING)
+    {
+        poll_fake_read_event(listener);
+    }
+}
+
+/**
+ * Accept a connection the admission limits of the listener allow. When a limit
+ * is reached, the remaining connections stay in the backlog of the socket and
+ * accepting is retried on the next heartbeat. Connections from a subnet that
+ * exceeds its rate are closed.
+ *
+ * @param listener      The listener DCB
+ * @param client_conn   The address of the client
+ * @return The socket of the connection or -1 if none was accepted
+ */
+static int
+dcb_accept_admitted(DCB *listener, struct sockaddr_storage *client_conn)
+{
+    int c_sock = -1;
+
+    while (true)
+    {
+        if (listener->listener && !listener_can_accept(listener->listener))
+        {
+            timerwheel_add(&listener->timer, listener->owner, hkheartbeat + 1, dcb_accept_resume);
+            return -1;
+        }
+
+        if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)client_conn)) < 0 ||
+            listener->listener == NULL)
+        {
+            break;
+        }
+
+        uint32_t addr = client_conn->ss_family == AF_INET ?
+                        ((struct sockaddr_in *)client_conn)->sin_addr.s_addr : 0;
+
+        if (listener_admit(listener->listener, addr))
+        {
+            break;
+        }
+
+        MXS_INFO("Closing connection from a subnet that exceeds the connection rate "
+                 "of the listener on port %d.", listener->listener->port);
+        close(c_sock);
+    }
+
+    return c_sock;
+}
+
+/**
+ * Mark the authentication of a client as done in the listener that accepted it
+ *
+ * @param dcb   The client DCB
+ */
+void
+dcb_handshake_done(DCB *dcb)
+{
+    if (dcb->handshaking)
+    {
+        dcb->handshaking = false;
+        listener_handshake_done(dcb->listener);
+    }
+}
+
 /**
  * @brief Accept a new client connection, given listener, return file descriptor
  *
  * Up to 10 retries will be attempted in case of non-permanent errors.  Calls
- * the accept function and analyses the return, logging any errors and making
- * an appropriate return.
+ * the accept4 function and analyses the return, logging any errors and making
+ * an appropriate return. The new socket is already in non-blocking mode and
+ * is closed on exec.
  *
  * @param dcb Listener DCB that has detected new connection request
  * @return -1 for failure, or a file descriptor for the new connection
@@ -3368,9 +4830,10 @@ dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn)
 #endif /* FAKE_CODE */
 
             /* new connection from client */
-            c_sock = accept(listener->fd,
-                            client_conn,
-                            &client_len);
+            c_sock = accept4(listener->fd,
+                             client_conn,
+                             &client_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
             eno = errno;
             errno = 0;
 #if defined(FAKE_CODE)
@@ -3445,6 +4908,14 @@ dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn)
  * list.  The protocol name does not affect the logic, but is used in
  * log messages.
  *
+ * If reuseport_listeners and poll_affinity are enabled, a TCP listener gets
+ * an SO_REUSEPORT socket for each polling thread. The kernel spreads the new
+ * connections over the sockets and each thread only accepts connections from
+ * its own socket. The extra sockets are kept in a list of DCBs that starts
+ * from listener->shard. If the polling threads are pinned to CPUs, each
+ * socket prefers the connections whose packets arrive on the CPU of its
+ * thread.
+ *
  * @param listener Listener DCB that is being created
  * @param config Configuration for port to listen on
  * @param protocol_name Name of protocol that is listening
@@ -3454,6 +4925,7 @@ int
 dcb_listen(DCB *listener, const char *config, const char *protocol_name)
 {
     int listener_socket;
+    int n_shards = 1;
 
     listener->fd = -1;
     if (strchr(config, '/'))
@@ -3462,13 +4934,78 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
     }
     else
     {
-        listener_socket = dcb_listen_create_socket_inet(config);
+        if (config_reuseport_listeners() && config_poll_affinity() &&
+            !(listener->service && service_is_admin(listener->service) &&
+              poll_admin_thread() >= 0))
+        {
+            n_shards = config_threadcount();
+        }
+        listener_socket = dcb_listen_create_socket_inet(config, n_shards > 1);
     }
     if (listener_socket < 0)
     {
         return -1;
     }
 
+    if (dcb_listen_start(listener_socket, config, protocol_name) != 0)
+    {
+        return -1;
+    }
+
+    if (n_shards > 1)
+    {
+        MXS_NOTICE("Listening connections at %s with protocol %s on %d sockets",
+                   config, protocol_name, n_shards);
+    }
+    else
+    {
+        MXS_NOTICE("Listening connections at %s with protocol %s", config, protocol_name);
+    }
+
+    // assign listener_socket to dcb
+    listener->fd = listener_socket;
+    listener->reuseport = n_shards > 1;
+    listener->owner = listener->reuseport ? 0 : dcb_assign_owner(listener->service);
+
+    if (listener->reuseport)
+    {
+        dcb_listen_set_cpu(listener_socket, listener->owner);
+    }
+
+    // add listening socket to poll structure
+    if (poll_add_dcb(listener) != 0)
+    {
+        MXS_ERROR("MaxScale encountered system limit while "
+                  "attempting to register on an epoll instance.");
+        return -1;
+    }
+#if defined(FAKE_CODE)
+    conn_open[listener_socket] = true;
+#endif /* FAKE_CODE */
+
+    for (int i = 1; i < n_shards; i++)
+    {
+        if (dcb_listen_add_shard(listener, config, protocol_name, i) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Start listening on a bound socket
+ *
+ * The socket is closed if listening fails.
+ *
+ * @param listener_socket The bound socket
+ * @param config Configuration for port to listen on
+ * @param protocol_name Name of protocol that is listening
+ * @return 0 on success, -1 on error
+ */
+static int
+dcb_listen_start(int listener_socket, const char *config, const char *protocol_name)
+{
     if (listen(listener_socket, 10 * SOMAXCONN) != 0)
     {
         char errbuf[STRERROR_BUFLEN];
@@ -3480,14 +5017,53 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
         close(listener_socket);
         return -1;
     }
+    return 0;
+}
 
-    MXS_NOTICE("Listening connections at %s with protocol %s", config, protocol_name);
+/**
+ * @brief Add an SO_REUSEPORT socket for a polling thread to a listener
+ *
+ * The new DCB is linked to the listener before it is added to the poll set
+ * of the thread, so that it is closed together with the listener even if
+ * adding it fails.
+ *
+ * @param listener The first DCB of the listener
+ * @param config Configuration for port to listen on
+ * @param protocol_name Name of protocol that is listening
+ * @param thread_id The polling thread that accepts the connections of the socket
+ * @return 0 on success, -1 on error
+ */
+static int
+dcb_listen_add_shard(DCB *listener, const char *config, const char *protocol_name,
+                     int thread_id)
+{
+    DCB *shard;
+    int listener_socket = dcb_listen_create_socket_inet(config, true);
 
-    // assign listener_socket to dcb
-    listener->fd = listener_socket;
+    if (listener_socket < 0 ||
+        dcb_listen_start(listener_socket, config, protocol_name) != 0)
+    {
+        return -1;
+    }
 
-    // add listening socket to poll structure
-    if (poll_add_dcb(listener) != 0)
+    if ((shard = dcb_alloc(DCB_ROLE_SERVICE_LISTENER, listener->listener)) == NULL)
+    {
+        MXS_ERROR("Failed to create DCB object for listener socket.");
+        close(listener_socket);
+        return -1;
+    }
+
+    dcb_listen_set_cpu(listener_socket, thread_id);
+    memcpy(&shard->func, &listener->func, sizeof(GWPROTOCOL));
+    shard->fd = listener_socket;
+    shard->reuseport = true;
+    shard->owner = thread_id;
+    shard->session = listener->session;
+    shard->service = listener->service;
+    shard->shard = listener->shard;
+    listener->shard = shard;
+
+    if (poll_add_dcb(shard) != 0)
     {
         MXS_ERROR("MaxScale encountered system limit while "
                   "attempting to register on an epoll instance.");
@@ -3499,6 +5075,49 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
     return 0;
 }
 
+/**
+ * Choose the polling thread that owns a new listener or client connection.
+ * The administrative services are served by the admin thread if there is one.
+ *
+ * @param service The service of the listener, may be NULL
+ * @return The id of the polling thread
+ */
+static int
+dcb_assign_owner(SERVICE *service)
+{
+    int admin = poll_admin_thread();
+
+    if (admin >= 0 && service && service_is_admin(service))
+    {
+        return admin;
+    }
+    return poll_assign_thread();
+}
+
+/**
+ * Make an SO_REUSEPORT socket prefer the connections that arrive on the CPU
+ * of the polling thread that accepts them. With the interrupts of the network
+ * card bound to the CPUs of its NUMA node, the connections then stay on that
+ * node. Nothing is done if the thread is not pinned to a CPU.
+ *
+ * @param fd        The listening socket
+ * @param thread_id The polling thread that accepts the connections of the socket
+ */
+static void
+dcb_listen_set_cpu(int fd, int thread_id)
+{
+#if defined(SO_INCOMING_CPU)
+    int cpu = affinity_thread_cpu(thread_id);
+
+    if (cpu >= 0 && setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_WARNING("Failed to set the CPU of listening socket %d: %s",
+                    fd, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+#endif
+}
+
 /**
  * @brief Create a listening socket, TCP
  *
@@ -3506,10 +5125,11 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
  * Set options, set non-blocking and bind to the socket.
  *
  * @param config_bind The configuration information
+ * @param reuseport   Allow other sockets to bind to the same address
  * @return socket if successful, -1 otherwise
  */
 static int
-dcb_listen_create_socket_inet(const char *config_bind)
+dcb_listen_create_socket_inet(const char *config_bind, bool reuseport)
 {
     int listener_socket;
     struct sockaddr_in server_address;
@@ -3534,11 +5154,26 @@ dcb_listen_create_socket_inet(const char *config_bind)
 
     // socket options
     if (dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one)) != 0 ||
-        dcb_set_socket_option(listener_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one)) != 0)
+        dcb_set_socket_option(listener_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one)) != 0 ||
+        (reuseport &&
+         dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_REUSEPORT, (char *) &one, sizeof(one)) != 0))
     {
+        close(listener_socket);
         return -1;
     }
 
+    /** Without TCP Fast Open the listener still works, only slower to connect to */
+    int fastopen = config_tcp_fastopen();
+    if (fastopen > 0 &&
+        setsockopt(listener_socket, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_WARNING("Failed to enable TCP Fast Open on '%s': %d, %s",
+                    config_bind,
+                    errno,
+                    strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+
     // set NONBLOCKING mode
     if (setnonblocking(listener_socket) != 0)
     {
@@ -3722,3 +5357,203 @@ void dcb_append_readqueue(DCB *dcb, GWBUF *buffer)
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buffer);
     spinlock_release(&dcb->authlock);
 }
+
+/**
+ * Start splicing the data read from a DCB to another DCB. The protocol of the
+ * DCB keeps reading the data until it has no partially read data left and
+ * the queues of the peer are empty, which is checked after each read. From
+ * then on, the data is moved from socket to socket through a pipe and neither
+ * protocol sees it. The DCBs are not put into the persistent pool afterwards,
+ * as the state of their protocols is unknown.
+ *
+ * @param dcb   The DCB whose input is spliced
+ * @param peer  The DCB the input is written to
+ * @return True if the splicing was set up, false if either DCB uses SSL,
+ * the DCBs are already spliced or the pipe could not be created
+ */
+bool
+dcb_splice(DCB *dcb, DCB *peer)
+{
+    DCB_SPLICE *sp;
+
+    /**
+     * Spliced data would bypass the decompression of the protocol. Data can
+     * be spliced into an SSL socket only if the kernel encrypts it.
+     */
+    if (dcb->ssl || (peer->ssl && !DCB_IS_KTLS_SEND(peer)) || dcb->splice || peer->splice_src ||
+        (dcb->flags & DCBF_COMPRESSED) || (peer->flags & DCBF_COMPRESSED) ||
+        dcb->state != DCB_STATE_POLLING || peer->state != DCB_STATE_POLLING)
+    {
+        return false;
+    }
+
+    if ((sp = (DCB_SPLICE *)malloc(sizeof(DCB_SPLICE))) == NULL)
+    {
+        return false;
+    }
+
+    if (pipe2(sp->pipefd, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to create a pipe for splicing the data of %s: %d, %s",
+                  dcb->remote ? dcb->remote : "a DCB", errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        free(sp);
+        return false;
+    }
+
+    spinlock_init(&sp->lock);
+    sp->pending = 0;
+    sp->active = false;
+    sp->peer = peer;
+    sp->n_bytes = 0;
+
+    dcb->flags |= DCBF_SPLICED;
+    peer->flags |= DCBF_SPLICED;
+
+    /** The lock makes the splicing visible to the other threads only once it is set up */
+    spinlock_acquire(&sp->lock);
+    peer->splice_src = dcb;
+    dcb->splice = sp;
+    spinlock_release(&sp->lock);
+
+    return true;
+}
+
+/**
+ * Switch to splicing once the protocol of the DCB has read all it has been
+ * given and nothing is waiting to be written to the peer. Called by the
+ * polling thread after the protocol has read the DCB.
+ *
+ * @param dcb   A DCB that has been set up for splicing
+ */
+void
+dcb_splice_activate(DCB *dcb)
+{
+    DCB_SPLICE *sp = dcb->splice;
+    bool activated = false;
+
+    if (sp == NULL || sp->active)
+    {
+        return;
+    }
+
+    spinlock_acquire(&sp->lock);
+    if (sp->peer && dcb->state == DCB_STATE_POLLING && dcb->dcb_readqueue == NULL &&
+        sp->peer->writeq == NULL && sp->peer->delayq == NULL)
+    {
+        sp->active = true;
+        activated = true;
+    }
+    spinlock_release(&sp->lock);
+
+    if (activated)
+    {
+        MXS_INFO("Splicing the data of %s %s to %s.", dcb_role_name(dcb),
+                 dcb->remote ? dcb->remote : "", dcb_role_name(sp->peer));
+        /** The data that arrived during the last read is not signalled again */
+        dcb_splice_pump(dcb);
+    }
+}
+
+/**
+ * Move the data of a spliced DCB to its peer until either socket would block.
+ * If the peer cannot take more data, the rest waits in the pipe and the DCB
+ * is not read until the write event of the peer resumes the splicing. The end
+ * of the data and the errors are handled as the hangup and error events of
+ * the DCBs.
+ *
+ * @param dcb   A DCB whose data is being spliced
+ */
+void
+dcb_splice_pump(DCB *dcb)
+{
+    DCB_SPLICE *sp = dcb->splice;
+    DCB *peer;
+    ssize_t n;
+
+    spinlock_acquire(&sp->lock);
+    while ((peer = sp->peer) && sp->active)
+    {
+        if (sp->pending > 0)
+        {
+            if (peer->writeq)
+            {
+                /** Drained by the write event of the peer, which then resumes this */
+                break;
+            }
+
+            if ((n = splice(sp->pipefd[0], NULL, peer->fd, NULL, sp->pending,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0)
+            {
+                break;
+            }
+            sp->pending -= n;
+            sp->n_bytes += n;
+            peer->stats.n_writes++;
+        }
+        else
+        {
+            if ((n = splice(dcb->fd, NULL, sp->pipefd[1], NULL, MAX_BUFFER_SIZE,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0)
+            {
+                break;
+            }
+            sp->pending += n;
+            dcb->stats.n_reads++;
+            dcb->last_read = hkheartbeat;
+        }
+    }
+    spinlock_release(&sp->lock);
+}
+
+/**
+ * Resume the splicing of the data that is written to a DCB. Called by the
+ * polling thread when the DCB can be written to again.
+ *
+ * @param dcb   The peer of a spliced DCB
+ */
+void
+dcb_splice_resume(DCB *dcb)
+{
+    /** A closed source is freed only after this event has been processed */
+    DCB *src = dcb->splice_src;
+
+    if (src && src->splice)
+    {
+        dcb_splice_pump(src);
+    }
+}
+
+/**
+ * Stop the splicing to and from a DCB that is being closed.
+ *
+ * @param dcb   The DCB being closed
+ */
+static void
+dcb_splice_detach(DCB *dcb)
+{
+    DCB *src;
+
+    if (dcb->splice)
+    {
+        spinlock_acquire(&dcb->splice->lock);
+        if (dcb->splice->peer)
+        {
+            dcb->splice->peer->splice_src = NULL;
+            dcb->splice->peer = NULL;
+        }
+        spinlock_release(&dcb->splice->lock);
+    }
+
+    if ((src = dcb->splice_src) && src->splice)
+    {
+        spinlock_acquire(&src->splice->lock);
+        if (src->splice->peer == dcb)
+        {
+            src->splice->peer = NULL;
+        }
+        dcb->splice_src = NULL;
+        spinlock_release(&src->splice->lock);
+    }
+}
@@ -12,6 +12,14 @@
  */
 
 #include <externcmd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <atomic.h>
+
+extern char **environ;
+
+/** Commands that have been started but not reaped */
+static int n_running = 0;
 
 /**
  * Tokenize a string into arguments suitable for a execvp call.
@@ -158,7 +166,10 @@ void externcmd_free(EXTERNCMD* cmd)
 }
 
 /**
- *Execute a command in a separate process.
+ *Execute a command in a separate process. The process is spawned without
+ *copying the address space of MaxScale and the call does not wait for it to
+ *exit, externcmd_reap() collects it. At most MAXSCALE_EXTCMD_MAX_RUNNING
+ *commands run at the same time.
  *@param cmd Command to execute
  *@return 0 on success, -1 on error.
  */
@@ -166,32 +177,75 @@ int externcmd_execute(EXTERNCMD* cmd)
 {
     int rval = 0;
     pid_t pid;
+    int err;
 
-    pid = fork();
-
-    if (pid < 0)
+    if (atomic_add(&n_running, 1) >= MAXSCALE_EXTCMD_MAX_RUNNING)
     {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to execute command '%s', fork failed: [%d] %s",
-                  cmd->argv[0], errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        atomic_add(&n_running, -1);
+        MXS_ERROR("Failed to execute command '%s', %d commands are already running.",
+                  cmd->argv[0], MAXSCALE_EXTCMD_MAX_RUNNING);
         rval = -1;
     }
-    else if (pid == 0)
+    else if ((err = posix_spawnp(&pid, cmd->argv[0], NULL, NULL, cmd->argv, environ)) != 0)
     {
-        /** Child process, execute command */
-        execvp(cmd->argv[0], cmd->argv);
-        _exit(1);
+        char errbuf[STRERROR_BUFLEN];
+        atomic_add(&n_running, -1);
+        MXS_ERROR("Failed to execute command '%s', spawn failed: [%d] %s",
+                  cmd->argv[0], err, strerror_r(err, errbuf, sizeof(errbuf)));
+        rval = -1;
     }
     else
     {
         cmd->child = pid;
         cmd->n_exec++;
-        MXS_DEBUG("[monitor_exec_cmd] Forked child process %d : %s.", pid, cmd->argv[0]);
+        MXS_DEBUG("[monitor_exec_cmd] Spawned child process %d : %s.", pid, cmd->argv[0]);
     }
 
     return rval;
 }
 
+/**
+ * Reap all child processes that have exited and log how they exited. Called
+ * from the SIGCHLD handler; one signal may stand for several children.
+ */
+void externcmd_reap(void)
+{
+    int saved_errno = errno;
+    int exit_status = 0;
+    pid_t child;
+
+    while ((child = waitpid(-1, &exit_status, WNOHANG)) > 0)
+    {
+        atomic_add(&n_running, -1);
+
+        if (WIFEXITED(exit_status))
+        {
+            if (WEXITSTATUS(exit_status) != 0)
+            {
+                MXS_ERROR("Child process %d exited with status %d",
+                          child, WEXITSTATUS(exit_status));
+            }
+            else
+            {
+                MXS_INFO("Child process %d exited with status %d",
+                         child, WEXITSTATUS(exit_status));
+            }
+        }
+        else if (WIFSIGNALED(exit_status))
+        {
+            MXS_ERROR("Child process %d was stopped by signal %d.",
+                      child, WTERMSIG(exit_status));
+        }
+        else
+        {
+            MXS_ERROR("Child process %d did not exit normally. Exit status: %d",
+                      child, exit_status);
+        }
+    }
+
+    errno = saved_errno;
+}
+
 /**
  * Substitute all occurrences of @c match with @c replace in the arguments for @c cmd.
  * @param cmd External command
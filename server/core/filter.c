@@ -24,6 +24,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <filter.h>
@@ -32,11 +33,20 @@
 #include <spinlock.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <atomic.h>
+#include <hashtable.h>
+#include <metrics.h>
 
 static SPINLOCK filter_spin = SPINLOCK_INIT;    /**< Protects the list of all filters */
 static FILTER_DEF *allFilters = NULL;           /**< The list of all filters */
+static HASHTABLE *filter_names = NULL;          /**< The filters by name */
+
+/** The initial number of chains in the index of the filters, it grows as needed */
+#define FILTER_INDEX_SIZE 32
 
 static void filter_free_parameters(FILTER_DEF *filter);
+static bool filter_index(FILTER_DEF *filter);
+static void filter_unindex(FILTER_DEF *filter);
 
 /**
  * Allocate a new filter within MaxScale
@@ -62,10 +72,24 @@ filter_alloc(char *name, char *module)
     filter->options = NULL;
     filter->obj = NULL;
     filter->parameters = NULL;
+    filter->n_sessions = 0;
+    filter->n_current = 0;
+    filter->commands = FILTER_ALL_COMMANDS;
+    memset(&filter->route_profile, 0, sizeof(filter->route_profile));
+    memset(&filter->reply_profile, 0, sizeof(filter->reply_profile));
 
     spinlock_init(&filter->spin);
 
     spinlock_acquire(&filter_spin);
+    if (!filter_index(filter))
+    {
+        spinlock_release(&filter_spin);
+        MXS_ERROR("Failed to index filter '%s' by its name.", name);
+        free(filter->name);
+        free(filter->module);
+        free(filter);
+        return NULL;
+    }
     filter->next = allFilters;
     allFilters = filter;
     spinlock_release(&filter_spin);
@@ -73,6 +97,56 @@ filter_alloc(char *name, char *module)
     return filter;
 }
 
+/**
+ * Index a filter by its name, allocating the index on first use. If
+ * several filters have the same name, the one indexed last is found.
+ * Called with filter_spin held.
+ *
+ * @param filter        The filter
+ * @return True if the filter was indexed
+ */
+static bool
+filter_index(FILTER_DEF *filter)
+{
+    if (filter_names == NULL)
+    {
+        HASHTABLE *names = hashtable_alloc(FILTER_INDEX_SIZE, simple_str_hash, strcmp);
+
+        if (names == NULL)
+        {
+            return false;
+        }
+        hashtable_memory_fns(names, (HASHMEMORYFN) strdup, NULL, (HASHMEMORYFN) free, NULL);
+        hashtable_enable_resize(names);
+        filter_names = names;
+    }
+    return hashtable_replace(filter_names, filter->name, filter);
+}
+
+/**
+ * Remove a filter from the index of the names. Another filter with the
+ * same name takes its place. Called with filter_spin held.
+ *
+ * @param filter        The filter
+ */
+static void
+filter_unindex(FILTER_DEF *filter)
+{
+    if (hashtable_fetch(filter_names, filter->name) == filter)
+    {
+        hashtable_delete(filter_names, filter->name);
+
+        for (FILTER_DEF *ptr = allFilters; ptr; ptr = ptr->next)
+        {
+            if (ptr != filter && strcmp(ptr->name, filter->name) == 0)
+            {
+                hashtable_add(filter_names, ptr->name, ptr);
+                break;
+            }
+        }
+    }
+}
+
 
 /**
  * Deallocate the specified filter
@@ -105,6 +179,7 @@ filter_free(FILTER_DEF *filter)
                 ptr->next = filter->next;
             }
         }
+        filter_unindex(filter);
         spinlock_release(&filter_spin);
 
         /* Clean up session and free the memory */
@@ -121,6 +196,8 @@ filter_free(FILTER_DEF *filter)
         }
 
         filter_free_parameters(filter);
+        profile_free(&filter->route_profile);
+        profile_free(&filter->reply_profile);
 
         free(filter);
     }
@@ -136,20 +213,7 @@ filter_free(FILTER_DEF *filter)
 FILTER_DEF *
 filter_find(char *name)
 {
-    FILTER_DEF *filter;
-
-    spinlock_acquire(&filter_spin);
-    filter = allFilters;
-    while (filter)
-    {
-        if (strcmp(filter->name, name) == 0)
-        {
-            break;
-        }
-        filter = filter->next;
-    }
-    spinlock_release(&filter_spin);
-    return filter;
+    return hashtable_fetch(filter_names, name);
 }
 
 /**
@@ -194,6 +258,8 @@ dprintAllFilters(DCB *dcb)
             }
             dcb_printf(dcb, "\n");
         }
+        profile_print(dcb, "routeQuery:  ", &ptr->route_profile);
+        profile_print(dcb, "clientReply: ", &ptr->reply_profile);
         if (ptr->obj && ptr->filter)
         {
             ptr->obj->diagnostics(ptr->filter, NULL, dcb);
@@ -229,12 +295,36 @@ dprintFilter(DCB *dcb, FILTER_DEF *filter)
         }
         dcb_printf(dcb, "\n");
     }
+    profile_print(dcb, "routeQuery:  ", &filter->route_profile);
+    profile_print(dcb, "clientReply: ", &filter->reply_profile);
     if (filter->obj && filter->filter)
     {
         filter->obj->diagnostics(filter->filter, NULL, dcb);
     }
 }
 
+/**
+ * Carry out an administrative command on a filter
+ *
+ * @param filter  The filter
+ * @param dcb     The DCB of the administrator, for the output of the command
+ * @param command The command
+ * @param arg1    The first argument, or NULL
+ * @param arg2    The second argument, or NULL
+ * @return True if the filter knows the command, false if it does not or if
+ * the filter has no instance
+ */
+bool
+filter_command(FILTER_DEF *filter, DCB *dcb, const char *command, const char *arg1, const char *arg2)
+{
+    if (filter->obj == NULL || filter->filter == NULL || filter->obj->command == NULL)
+    {
+        return false;
+    }
+
+    return filter->obj->command(filter->filter, dcb, command, arg1, arg2);
+}
+
 /**
  * List all filters in a tabular form to a DCB
  *
@@ -274,6 +364,117 @@ dListFilters(DCB *dcb)
     spinlock_release(&filter_spin);
 }
 
+/** The entry points of the filters whose cost is written in the metrics */
+static struct
+{
+    const char *name;   /*< Description of the call counter */
+    const char *help;   /*< Description of the cycle counter */
+    const char *calls;  /*< Name of the call counter */
+    const char *cycles; /*< Name of the cycle counter */
+    size_t offset;      /*< Offset of the profile in FILTER_DEF */
+} filter_profiles[] =
+{
+    {
+        "Queries routed by the filter", "CPU cycles spent in routeQuery of the filter",
+        "maxscale_filter_route_calls", "maxscale_filter_route_cycles",
+        offsetof(FILTER_DEF, route_profile)
+    },
+    {
+        "Replies passed by the filter", "CPU cycles spent in clientReply of the filter",
+        "maxscale_filter_reply_calls", "maxscale_filter_reply_cycles",
+        offsetof(FILTER_DEF, reply_profile)
+    },
+    { NULL }
+};
+
+/**
+ * Write the metrics of all filters
+ *
+ * @param metrics The metrics being generated
+ */
+void
+filterWriteMetrics(METRICS *metrics)
+{
+    FILTER_DEF *ptr;
+
+    spinlock_acquire(&filter_spin);
+
+    metrics_family(metrics, "maxscale_filter_sessions", "counter", "Filter sessions created");
+    for (ptr = allFilters; ptr; ptr = ptr->next)
+    {
+        metrics_sample(metrics, "maxscale_filter_sessions", "_total");
+        metrics_label(metrics, "filter", ptr->name);
+        metrics_label(metrics, "module", ptr->module);
+        metrics_value(metrics, ptr->n_sessions);
+    }
+
+    metrics_family(metrics, "maxscale_filter_current_sessions", "gauge", "Current filter sessions");
+    for (ptr = allFilters; ptr; ptr = ptr->next)
+    {
+        metrics_sample(metrics, "maxscale_filter_current_sessions", NULL);
+        metrics_label(metrics, "filter", ptr->name);
+        metrics_label(metrics, "module", ptr->module);
+        metrics_value(metrics, ptr->n_current);
+    }
+
+    if (profile_enabled)
+    {
+        for (int i = 0; filter_profiles[i].name; i++)
+        {
+            metrics_family(metrics, filter_profiles[i].cycles, "counter", filter_profiles[i].help);
+            for (ptr = allFilters; ptr; ptr = ptr->next)
+            {
+                PROFILE *profile = (PROFILE *)((char *)ptr + filter_profiles[i].offset);
+                metrics_sample(metrics, filter_profiles[i].cycles, "_total");
+                metrics_label(metrics, "filter", ptr->name);
+                metrics_label(metrics, "module", ptr->module);
+                metrics_value(metrics, profile->cycles ? ts_stats_sum(profile->cycles) : 0);
+            }
+
+            metrics_family(metrics, filter_profiles[i].calls, "counter", filter_profiles[i].name);
+            for (ptr = allFilters; ptr; ptr = ptr->next)
+            {
+                PROFILE *profile = (PROFILE *)((char *)ptr + filter_profiles[i].offset);
+                metrics_sample(metrics, filter_profiles[i].calls, "_total");
+                metrics_label(metrics, "filter", ptr->name);
+                metrics_label(metrics, "module", ptr->module);
+                metrics_value(metrics, profile_calls(profile));
+            }
+        }
+    }
+
+    spinlock_release(&filter_spin);
+}
+
+/**
+ * Allocate the profiles of a filter, if not already allocated
+ *
+ * @param filter The filter
+ * @return True if the filter has profiles
+ */
+bool
+filter_alloc_profiles(FILTER_DEF *filter)
+{
+    bool rval = true;
+
+    spinlock_acquire(&filter->spin);
+    if (filter->route_profile.cycles == NULL)
+    {
+        if (!profile_alloc(&filter->route_profile))
+        {
+            rval = false;
+        }
+        else if (!profile_alloc(&filter->reply_profile))
+        {
+            profile_free(&filter->route_profile);
+            rval = false;
+        }
+    }
+    spinlock_release(&filter->spin);
+
+    return rval;
+}
+
 /**
  * Add a router option to a service
  *
@@ -376,6 +577,9 @@ bool filter_load(FILTER_DEF* filter)
             }
         }
 
+        filter->commands = filter->obj->getCapabilities ?
+                           filter->obj->getCapabilities() : FILTER_ALL_COMMANDS;
+
         if ((filter->filter = (filter->obj->createInstance)(filter->options,
                                                             filter->parameters)))
         {
@@ -399,15 +603,16 @@ bool filter_load(FILTER_DEF* filter)
  * @param filter        The filter to add into the chain
  * @param session       The client session
  * @param downstream    The filter downstream of this filter
- * @return              The downstream component for the next filter or NULL
- *                      if the filter could not be created
+ * @return              The downstream component for the next filter, allocated
+ *                      from the session, or NULL if the filter could not be
+ *                      created
  */
 DOWNSTREAM *
 filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream)
 {
     DOWNSTREAM *me;
 
-    if ((me = (DOWNSTREAM *)calloc(1, sizeof(DOWNSTREAM))) == NULL)
+    if ((me = (DOWNSTREAM *)session_arena_alloc(session, sizeof(DOWNSTREAM))) == NULL)
     {
         char errbuf[STRERROR_BUFLEN];
         MXS_ERROR("Memory allocation for filter session failed "
@@ -422,10 +627,11 @@ filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream)
 
     if ((me->session = filter->obj->newSession(me->instance, session)) == NULL)
     {
-        free(me);
         return NULL;
     }
     filter->obj->setDownstream(me->instance, me->session, downstream);
+    atomic_add(&filter->n_sessions, 1);
+    atomic_add(&filter->n_current, 1);
 
     return me;
 }
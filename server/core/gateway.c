@@ -76,6 +76,7 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <query_classifier.h>
+#include <qc_pool.h>
 
 #include <execinfo.h>
 
@@ -84,6 +85,10 @@
 #include <sys/prctl.h>
 #include <sys/file.h>
 #include <statistics.h>
+#include <query_trace.h>
+#include <profile.h>
+#include <affinity.h>
+#include <statshm.h>
 
 #define STRING_BUFFER_SIZE 1024
 #define PIDFD_CLOSED -1
@@ -308,47 +313,19 @@ sigint_handler(int i)
 static void
 sigchld_handler (int i)
 {
-    int exit_status = 0;
-    pid_t child = -1;
-
-    if ((child = wait(&exit_status)) == -1)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to wait child process: %d %s",
-                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-    }
-    else
-    {
-        if (WIFEXITED(exit_status))
-        {
-            if (WEXITSTATUS(exit_status) != 0)
-            {
-                MXS_ERROR("Child process %d exited with status %d",
-                          child, WEXITSTATUS(exit_status));
-            }
-            else
-            {
-                MXS_INFO("Child process %d exited with status %d",
-                         child, WEXITSTATUS(exit_status));
-            }
-        }
-        else if (WIFSIGNALED(exit_status))
-        {
-            MXS_ERROR("Child process %d was stopped by signal %d.",
-                      child, WTERMSIG(exit_status));
-        }
-        else
-        {
-            MXS_ERROR("Child process %d did not exit normally. Exit status: %d",
-                      child, exit_status);
-        }
-    }
+    externcmd_reap();
 }
 
 int fatal_handling = 0;
 
 static int signal_set(int sig, void (*handler)(int));
 
+static void
+log_ring_line(void *data, const char *line)
+{
+    MXS_ERROR("  %s", line);
+}
+
 static void
 sigfatal_handler(int i)
 {
@@ -387,6 +364,12 @@ sigfatal_handler(int i)
         }
     }
 
+    if (memlog_ring_size)
+    {
+        MXS_ERROR("Flight recorder, seconds before the signal:");
+        memlog_ring_dump(log_ring_line, NULL);
+    }
+
     mxs_log_flush_sync();
 
     /* re-raise signal to enforce core dump */
@@ -913,6 +896,10 @@ static void usage(void)
  */
 void worker_thread_main(void* arg)
 {
+    /** Pinned before anything is allocated so that the memory of the thread
+     * comes from the NUMA node of its CPU */
+    affinity_pin_thread((int)(intptr_t)arg);
+
     if (qc_thread_init())
     {
         /** Init mysql thread context for use with a mysql handle and a parser */
@@ -1156,15 +1143,12 @@ int main(int argc, char **argv)
     int      i;
     int      n;
     int      ini_rval;
-    intptr_t thread_id;
-    int      n_threads; /*< number of epoll listener threads */
     int      n_services;
     int      eno = 0;   /*< local variable for errno */
     int      opt;
     int      daemon_pipe[2] = { -1, -1};
     bool     parent_process;
     int      child_status;
-    THREAD*   threads = NULL;   /*< thread list */
     char     mysql_home[PATH_MAX + 1];
     char*    cnf_file_path = NULL;        /*< conf file, to be freed */
     char*    cnf_file_arg = NULL;         /*< conf filename from cmd-line arg */
@@ -1750,6 +1734,29 @@ int main(int argc, char **argv)
     GATEWAY_CONF* cnf = config_get_global_options();
     ss_dassert(cnf);
 
+    /** Initialize statistics, the query classifier allocates its own */
+    ts_stats_init();
+    server_stats_init();
+    qtrace_init(cnf->qtrace_sample_rate);
+    profile_init(cnf->profile_filters);
+    memlog_ring_init(cnf->flight_recorder_size);
+
+    if (!dcb_writeq_init(cnf->writeq_high_water, cnf->writeq_low_water, cnf->writeq_budget))
+    {
+        char* logerr = "Failed to set the limits of the write queues.";
+        print_log_n_stderr(true, true, logerr, logerr, 0);
+        rc = MAXSCALE_BADCONFIG;
+        goto return_main;
+    }
+
+    if (!affinity_init(cnf->thread_affinity, config_max_threadcount()))
+    {
+        char* logerr = "Failed to assign CPUs to the polling threads.";
+        print_log_n_stderr(true, true, logerr, logerr, 0);
+        rc = MAXSCALE_BADCONFIG;
+        goto return_main;
+    }
+
     if (!qc_init(cnf->qc_name, cnf->qc_args))
     {
         char* logerr = "Failed to initialise query classifier library.";
@@ -1829,9 +1836,6 @@ int main(int argc, char **argv)
         goto return_main;
     }
 
-    /** Initialize statistics */
-    ts_stats_init();
-
     /* Init MaxScale poll system */
     poll_init();
 
@@ -1872,25 +1876,39 @@ int main(int argc, char **argv)
      */
     hkinit();
 
-    /*<
-     * Start the polling threads, note this is one less than is
-     * configured as the main thread will also poll.
+    /*
+     * Start the threads that classify long queries
+     */
+    if (!qc_pool_init(cnf->qc_threads, cnf->qc_offload_size))
+    {
+        char* logerr = "Failed to start the query classifier threads.";
+        print_log_n_stderr(true, true, logerr, logerr, 0);
+        rc = MAXSCALE_INTERNALERROR;
+        goto return_main;
+    }
+
+    /*
+     * Start publishing the statistics in shared memory
      */
-    n_threads = config_threadcount();
-    threads = calloc(n_threads, sizeof(THREAD));
+    if (!statshm_init(cnf->stats_shm_name, cnf->stats_shm_interval))
+    {
+        char* logerr = "Failed to create the statistics segment.";
+        print_log_n_stderr(true, true, logerr, logerr, 0);
+        rc = MAXSCALE_INTERNALERROR;
+        goto return_main;
+    }
+
     /*<
-     * Start server threads.
+     * Start the polling threads, note this is one less than is
+     * configured as the main thread will also poll. The threads
+     * started at runtime use the same entry point.
      */
-    for (thread_id = 0; thread_id < n_threads - 1; thread_id++)
+    if (!poll_start_threads(worker_thread_main))
     {
-        if (thread_start(&threads[thread_id], worker_thread_main,
-                         (void *)(thread_id + 1)) == NULL)
-        {
-            char* logerr = "Failed to start worker thread.";
-            print_log_n_stderr(true, true, logerr, logerr, 0);
-            rc = MAXSCALE_INTERNALERROR;
-            goto return_main;
-        }
+        char* logerr = "Failed to start worker thread.";
+        print_log_n_stderr(true, true, logerr, logerr, 0);
+        rc = MAXSCALE_INTERNALERROR;
+        goto return_main;
     }
 
     MXS_NOTICE("MaxScale started with %d server threads.", config_threadcount());
@@ -1906,15 +1924,13 @@ int main(int argc, char **argv)
     /*<
      * Serve clients.
      */
+    affinity_pin_thread(0);
     poll_waitevents((void *)0);
 
     /*<
      * Wait server threads' completion.
      */
-    for (thread_id = 0; thread_id < n_threads - 1; thread_id++)
-    {
-        thread_wait(threads[thread_id]);
-    }
+    poll_wait_threads();
     /*<
      * Wait the flush thread.
      */
@@ -1928,6 +1944,8 @@ int main(int argc, char **argv)
     /** Release mysql thread context*/
     mysql_thread_end();
 
+    statshm_close();
+    qc_pool_end();
     qc_end();
 
     utils_end();
@@ -1949,10 +1967,6 @@ return_main:
         write_child_exit_code(daemon_pipe[1], rc);
     }
 
-    if (threads)
-    {
-        free(threads);
-    }
     if (cnf_file_path)
     {
         free(cnf_file_path);
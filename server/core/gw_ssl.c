@@ -33,6 +33,7 @@
 #include <service.h>
 #include <log_manager.h>
 #include <sys/ioctl.h>
+#include <atomic.h>
 
 /**
  * @brief Check client's SSL capability and start SSL if appropriate.
@@ -214,3 +215,53 @@ const char* ssl_method_type_to_string(ssl_method_type_t method_type)
         return "Unknown";
     }
 }
+
+/**
+ * Offer the last session negotiated with a server for resumption by a new
+ * connection to the server. Resuming it skips the full handshake.
+ *
+ * @param ssl_listener  The SSL configuration of the server
+ * @param ssl           The SSL of the new connection, before SSL_connect
+ */
+void ssl_resume_session(SSL_LISTENER *ssl_listener, SSL *ssl)
+{
+    spinlock_acquire(&ssl_listener->session_lock);
+    if (ssl_listener->session)
+    {
+        SSL_set_session(ssl, ssl_listener->session);
+    }
+    spinlock_release(&ssl_listener->session_lock);
+}
+
+/**
+ * Count a completed handshake. On a connection to a server, a session that
+ * was not resumed replaces the one that new connections try to resume.
+ *
+ * @param ssl_listener  The SSL configuration of the listener or the server
+ * @param ssl           The SSL of the connection
+ * @param is_client     True if MaxScale is the client of the connection
+ */
+void ssl_handshake_done(SSL_LISTENER *ssl_listener, SSL *ssl, bool is_client)
+{
+    atomic_add(&ssl_listener->n_handshakes, 1);
+
+    if (SSL_session_reused(ssl))
+    {
+        atomic_add(&ssl_listener->n_resumed, 1);
+    }
+    else if (is_client)
+    {
+        SSL_SESSION *session = SSL_get1_session(ssl);
+        SSL_SESSION *old;
+
+        spinlock_acquire(&ssl_listener->session_lock);
+        old = ssl_listener->session;
+        ssl_listener->session = session;
+        spinlock_release(&ssl_listener->session_lock);
+
+        if (old)
+        {
+            SSL_SESSION_free(old);
+        }
+    }
+}
@@ -18,6 +18,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <hashtable.h>
+#include <rcu.h>
+#include <log_manager.h>
 
 /**
  * @file hashtable.c General purpose hashtable routines
@@ -40,10 +42,12 @@
  * the key and the value, if the actions required are different the called functions
  * must understand how to differenate the key and value.
  *
- * The hash table implements a single write, multiple reader locking policy by
- * using a pair of counters and a spinlock. The spinlock is used to protect the
- * number of readers and writers counters when taking out locks. Releasing of
- * locks uses pure atomic actions and thus does not require spinlock protection.
+ * The writers are serialised by a spinlock. The polling threads read the
+ * table without locks and without writing to it, the entries that are
+ * removed are freed only after every polling thread has passed a quiescent
+ * point, see rcu.h. Other threads count themselves as readers, which defers
+ * the freeing until none of them is reading. A table that is allowed to
+ * resize doubles its chains online as it fills up.
  *
  * @verbatim
  * Revision History
@@ -59,6 +63,18 @@
  * @endverbatim
  */
 
+/**
+ * An entry or a set of chains that has been removed from the table but may
+ * still be read by a polling thread.
+ */
+typedef struct hashretired
+{
+    struct hashretired *next;   /**< The next retired item */
+    int epoch;                  /**< The epoch of the removal */
+    HASHENTRIES *entry;         /**< A deleted entry, freed with its key and value */
+    HASHBUCKETS *buckets;       /**< Chains replaced by a resize, the keys and values live on */
+} HASHRETIRED;
+
 static  void hashtable_read_lock(HASHTABLE *table);
 static  void hashtable_read_unlock(HASHTABLE *table);
 static  void hashtable_write_lock(HASHTABLE *table);
@@ -67,6 +83,9 @@ static HASHTABLE *hashtable_alloc_real(HASHTABLE* target,
                                        int size,
                                        int (*hashfn)(),
                                        int (*cmpfn)());
+static void hashtable_retire(HASHTABLE *table, HASHENTRIES *entry, HASHBUCKETS *buckets);
+static void hashtable_reclaim(HASHTABLE *table, bool all);
+static void hashtable_grow(HASHTABLE *table);
 
 /**
  * Special null function used as default memory allfunctions in the hashtable
@@ -82,6 +101,39 @@ nullfn(void *data)
     return data;
 }
 
+/**
+ * Allocate a new set of empty chains
+ *
+ * @param size  The number of chains
+ * @return The chains or NULL on memory allocation failure
+ */
+static HASHBUCKETS *
+hashtable_alloc_buckets(int size)
+{
+    HASHBUCKETS *buckets = calloc(1, sizeof(HASHBUCKETS) + size * sizeof(HASHENTRIES *));
+
+    if (buckets)
+    {
+        buckets->size = size;
+    }
+    return buckets;
+}
+
+/**
+ * Calculate the chain of a key
+ *
+ * @param table         The hash table
+ * @param buckets       The chains of the table
+ * @param key           The key
+ * @return The index of the chain
+ */
+static inline unsigned int
+hashtable_chain(HASHTABLE *table, HASHBUCKETS *buckets, void *key)
+{
+    unsigned int hashkey = table->hashfn(key) % buckets->size;
+    return hashkey % buckets->size;
+}
+
 /**
  * Allocate a new hash table.
  *
@@ -134,7 +186,6 @@ hashtable_alloc_real(HASHTABLE* target,
     rval->ht_chk_top = CHK_NUM_HASHTABLE;
     rval->ht_chk_tail = CHK_NUM_HASHTABLE;
 #endif
-    rval->hashsize = size > 0 ? size : 1;
     rval->hashfn = hashfn;
     rval->cmpfn = cmpfn;
     rval->kcopyfn = nullfn;
@@ -144,17 +195,35 @@ hashtable_alloc_real(HASHTABLE* target,
     rval->n_readers = 0;
     rval->writelock = 0;
     rval->n_elements = 0;
+    rval->ht_resize = false;
+    rval->retired = NULL;
     spinlock_init(&rval->spin);
-    if ((rval->entries = (HASHENTRIES **)calloc(rval->hashsize, sizeof(HASHENTRIES *))) == NULL)
+    if ((rval->buckets = hashtable_alloc_buckets(size > 0 ? size : 1)) == NULL)
     {
-        free(rval);
+        if (!rval->ht_isflat)
+        {
+            free(rval);
+        }
         return NULL;
     }
-    memset(rval->entries, 0, rval->hashsize * sizeof(HASHENTRIES *));
 
     return rval;
 }
 
+/**
+ * Let the hash table grow as elements are added to it. The chains are
+ * doubled when the table holds more than two elements per chain.
+ *
+ * @param table         The hash table
+ */
+void
+hashtable_enable_resize(HASHTABLE *table)
+{
+    hashtable_write_lock(table);
+    table->ht_resize = true;
+    hashtable_write_unlock(table);
+}
+
 /**
  * Delete an entire hash table
  *
@@ -172,9 +241,10 @@ hashtable_free(HASHTABLE *table)
     }
 
     hashtable_write_lock(table);
-    for (i = 0; i < table->hashsize; i++)
+    hashtable_reclaim(table, true);
+    for (i = 0; i < table->buckets->size; i++)
     {
-        entry = table->entries[i];
+        entry = table->buckets->chains[i];
         while (entry)
         {
             ptr = entry->next;
@@ -184,7 +254,7 @@ hashtable_free(HASHTABLE *table)
             entry = ptr;
         }
     }
-    free(table->entries);
+    free(table->buckets);
 
     hashtable_write_unlock(table);
     if (!table->ht_isflat)
@@ -232,6 +302,9 @@ hashtable_memory_fns(HASHTABLE   *table,
 /**
  * Add an item to the hash table.
  *
+ * The new entry is fully initialised before it is linked to its chain, so
+ * that the readers that do not take a lock never see a partial entry.
+ *
  * @param table         The hash table to which to add the item
  * @param key           The key of the item
  * @param value         The value for the item
@@ -240,29 +313,25 @@ hashtable_memory_fns(HASHTABLE   *table,
 int
 hashtable_add(HASHTABLE *table, void *key, void *value)
 {
-    unsigned int            hashkey;
+    unsigned int    hashkey;
     HASHENTRIES     *entry;
+    HASHBUCKETS     *buckets;
 
     if (table == NULL || key == NULL || value == NULL)
     {
         return 0;
     }
 
-    if (table->hashsize <= 0)
-    {
-        return 0;
-    }
-    else
-    {
-        hashkey = table->hashfn(key) % table->hashsize;
-    }
     hashtable_write_lock(table);
-    entry = table->entries[hashkey % table->hashsize];
+    hashtable_reclaim(table, false);
+    buckets = table->buckets;
+    hashkey = hashtable_chain(table, buckets, key);
+    entry = buckets->chains[hashkey];
     while (entry && table->cmpfn(key, entry->key) != 0)
     {
         entry = entry->next;
     }
-    if (entry && table->cmpfn(key, entry->key) == 0)
+    if (entry)
     {
         /* Duplicate key value */
         hashtable_write_unlock(table);
@@ -305,10 +374,83 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
             return 0;
         }
 
-        ptr->next = table->entries[hashkey % table->hashsize];
-        table->entries[hashkey % table->hashsize] = ptr;
+        ptr->next = buckets->chains[hashkey];
+        /** Publish the entry only after it has been filled in */
+        __sync_synchronize();
+        buckets->chains[hashkey] = ptr;
     }
     table->n_elements++;
+
+    if (table->ht_resize && table->n_elements > 2 * buckets->size)
+    {
+        hashtable_grow(table);
+    }
+    hashtable_write_unlock(table);
+
+    return 1;
+}
+
+/**
+ * Add an item to the hash table or replace the value of an existing item.
+ *
+ * An existing entry is replaced with a new one that takes its place in the
+ * chain with a single store. Readers see either the old or the new value and
+ * the old entry is freed once no reader can refer to it.
+ *
+ * @param table         The hash table
+ * @param key           The key of the item
+ * @param value         The new value for the item
+ * @return      Return 1 if the item was added or replaced, 0 on failure
+ */
+int
+hashtable_replace(HASHTABLE *table, void *key, void *value)
+{
+    HASHENTRIES *entry, *ptr, **link;
+
+    if (table == NULL || key == NULL || value == NULL)
+    {
+        return 0;
+    }
+
+    hashtable_write_lock(table);
+    hashtable_reclaim(table, false);
+    link = &table->buckets->chains[hashtable_chain(table, table->buckets, key)];
+    while ((entry = *link) && table->cmpfn(key, entry->key) != 0)
+    {
+        link = &entry->next;
+    }
+    if (entry == NULL)
+    {
+        hashtable_write_unlock(table);
+        return hashtable_add(table, key, value);
+    }
+
+    if ((ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES))) == NULL)
+    {
+        hashtable_write_unlock(table);
+        return 0;
+    }
+
+    if ((ptr->key = table->kcopyfn(key)) == NULL)
+    {
+        free(ptr);
+        hashtable_write_unlock(table);
+        return 0;
+    }
+
+    if ((ptr->value = table->vcopyfn(value)) == NULL)
+    {
+        table->kfreefn(ptr->key);
+        free(ptr);
+        hashtable_write_unlock(table);
+        return 0;
+    }
+
+    ptr->next = entry->next;
+    /** Publish the entry only after it has been filled in */
+    __sync_synchronize();
+    *link = ptr;
+    hashtable_retire(table, entry, NULL);
     hashtable_write_unlock(table);
 
     return 1;
@@ -317,6 +459,10 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
 /**
  * Delete an item from the hash table that has a given key
  *
+ * The entry is unlinked from its chain with a single store and left intact,
+ * readers that have already reached it can still follow its next pointer.
+ * It is freed once no reader can refer to it.
+ *
  * @param table         The hash table to delete from
  * @param key           The key value of the item to remove
  * @return Return the number of items deleted
@@ -324,20 +470,19 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
 int
 hashtable_delete(HASHTABLE *table, void *key)
 {
-    unsigned int hashkey;
-    HASHENTRIES *entry, *ptr;
+    HASHENTRIES *entry, **link;
 
     if (table == NULL || key == NULL)
     {
         return 0;
     }
 
-    hashkey = table->hashfn(key) % table->hashsize;
     hashtable_write_lock(table);
-    entry = table->entries[hashkey % table->hashsize];
-    while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+    hashtable_reclaim(table, false);
+    link = &table->buckets->chains[hashtable_chain(table, table->buckets, key)];
+    while ((entry = *link) && table->cmpfn(key, entry->key) != 0)
     {
-        entry = entry->next;
+        link = &entry->next;
     }
     if (entry == NULL)
     {
@@ -346,42 +491,8 @@ hashtable_delete(HASHTABLE *table, void *key)
         return 0;
     }
 
-    if (entry == table->entries[hashkey % table->hashsize])
-    {
-        /* We are removing from the first entry */
-        table->entries[hashkey % table->hashsize] = entry->next;
-        table->kfreefn(entry->key);
-        table->vfreefn(entry->value);
-
-        if (entry->next != NULL)
-        {
-            entry->key = entry->next->key;
-            entry->value = entry->next->value;
-        }
-        else
-        {
-            entry->key = NULL;
-            entry->value = NULL;
-        }
-        free(entry);
-    }
-    else
-    {
-        ptr = table->entries[hashkey % table->hashsize];
-        while (ptr && ptr->next != entry)
-        {
-            ptr = ptr->next;
-        }
-        if (ptr == NULL)
-        {
-            hashtable_write_unlock(table);
-            return 0;       /* This should never happen */
-        }
-        ptr->next = entry->next;
-        table->kfreefn(entry->key);
-        table->vfreefn(entry->value);
-        free(entry);
-    }
+    *link = entry->next;
+    hashtable_retire(table, entry, NULL);
     table->n_elements--;
     assert(table->n_elements >= 0);
     hashtable_write_unlock(table);
@@ -391,6 +502,10 @@ hashtable_delete(HASHTABLE *table, void *key)
 /**
  * Fetch an item with a given key value from the hash table
  *
+ * The polling threads read the chains without writing to the table. Other
+ * threads are counted as readers so that the removed entries they might see
+ * are not freed under them.
+ *
  * @param table         The hash table
  * @param key           The key value
  * @return The item or NULL if the item was not found
@@ -398,30 +513,162 @@ hashtable_delete(HASHTABLE *table, void *key)
 void *
 hashtable_fetch(HASHTABLE *table, void *key)
 {
-    unsigned int hashkey;
     HASHENTRIES *entry;
+    HASHBUCKETS *buckets;
+    void *value = NULL;
 
-    if (table == NULL || key == NULL || 0 == table->hashsize)
+    if (table == NULL || key == NULL)
     {
         return NULL;
     }
 
-    hashkey = table->hashfn(key) % table->hashsize;
     hashtable_read_lock(table);
-    entry = table->entries[hashkey % table->hashsize];
-    while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+    buckets = *(HASHBUCKETS * volatile *)&table->buckets;
+    entry = *(HASHENTRIES * volatile *)&buckets->chains[hashtable_chain(table, buckets, key)];
+    while (entry && table->cmpfn(key, entry->key) != 0)
     {
-        entry = entry->next;
+        entry = *(HASHENTRIES * volatile *)&entry->next;
     }
-    if (entry == NULL)
+    if (entry)
     {
-        hashtable_read_unlock(table);
-        return NULL;
+        value = entry->value;
     }
-    else
+    hashtable_read_unlock(table);
+    return value;
+}
+
+/**
+ * Double the number of chains of the table. The entries are copied to new
+ * chains which replace the old ones at once, and the old chains are freed
+ * once no reader can refer to them. If memory runs out the table keeps its
+ * old size. The caller must hold the write lock.
+ *
+ * @param table         The hash table
+ */
+static void
+hashtable_grow(HASHTABLE *table)
+{
+    HASHBUCKETS *old = table->buckets;
+    HASHBUCKETS *new = hashtable_alloc_buckets(old->size * 2);
+
+    if (new == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < old->size; i++)
+    {
+        for (HASHENTRIES *entry = old->chains[i]; entry; entry = entry->next)
+        {
+            HASHENTRIES *copy = malloc(sizeof(HASHENTRIES));
+
+            if (copy == NULL)
+            {
+                hashtable_retire(table, NULL, new);
+                return;
+            }
+
+            unsigned int hashkey = hashtable_chain(table, new, entry->key);
+            copy->key = entry->key;
+            copy->value = entry->value;
+            copy->next = new->chains[hashkey];
+            new->chains[hashkey] = copy;
+        }
+    }
+
+    /** Publish the new chains only after they have been filled in */
+    __sync_synchronize();
+    table->buckets = new;
+    hashtable_retire(table, NULL, old);
+}
+
+/**
+ * Retire an entry or a set of chains that have been removed from the table.
+ * The caller must hold the write lock.
+ *
+ * @param table         The hash table
+ * @param entry         The deleted entry or NULL
+ * @param buckets       The replaced chains or NULL
+ */
+static void
+hashtable_retire(HASHTABLE *table, HASHENTRIES *entry, HASHBUCKETS *buckets)
+{
+    HASHRETIRED *retired = malloc(sizeof(HASHRETIRED));
+
+    if (retired == NULL)
+    {
+        /**
+         * Without memory to track it the removed item is leaked rather than
+         * freed under a reader.
+         */
+        MXS_ERROR("Failed to allocate memory for a removed hashtable entry.");
+        return;
+    }
+
+    retired->epoch = rcu_retire();
+    retired->entry = entry;
+    retired->buckets = buckets;
+    retired->next = table->retired;
+    table->retired = retired;
+}
+
+/**
+ * Free the retired items that no reader can refer to any more. The caller
+ * must hold the write lock.
+ *
+ * @param table         The hash table
+ * @param all           Free everything, the table itself is being freed
+ */
+static void
+hashtable_reclaim(HASHTABLE *table, bool all)
+{
+    HASHRETIRED **link = &table->retired;
+    HASHRETIRED *retired;
+
+    if (*link == NULL)
+    {
+        return;
+    }
+
+    /** The removals must be visible before the readers are checked */
+    __sync_synchronize();
+    if (!all && table->n_readers)
     {
-        hashtable_read_unlock(table);
-        return entry->value;
+        return;
+    }
+
+    while ((retired = *link) != NULL)
+    {
+        if (all || rcu_passed(retired->epoch))
+        {
+            *link = retired->next;
+
+            if (retired->entry)
+            {
+                table->kfreefn(retired->entry->key);
+                table->vfreefn(retired->entry->value);
+                free(retired->entry);
+            }
+            if (retired->buckets)
+            {
+                for (int i = 0; i < retired->buckets->size; i++)
+                {
+                    HASHENTRIES *entry = retired->buckets->chains[i];
+                    while (entry)
+                    {
+                        HASHENTRIES *next = entry->next;
+                        free(entry);
+                        entry = next;
+                    }
+                }
+                free(retired->buckets);
+            }
+            free(retired);
+        }
+        else
+        {
+            link = &retired->next;
+        }
     }
 }
 
@@ -435,20 +682,22 @@ hashtable_stats(HASHTABLE *table)
 {
     int total, longest, i, j;
     HASHENTRIES *entries;
+    HASHBUCKETS *buckets;
 
     if (table == NULL)
     {
         return;
     }
 
-    printf("Hashtable: %p, size %d\n", table, table->hashsize);
+    hashtable_read_lock(table);
+    buckets = table->buckets;
+    printf("Hashtable: %p, size %d\n", table, buckets->size);
     total = 0;
     longest = 0;
-    hashtable_read_lock(table);
-    for (i = 0; i < table->hashsize; i++)
+    for (i = 0; i < buckets->size; i++)
     {
         j = 0;
-        entries = table->entries[i];
+        entries = buckets->chains[i];
         while (entries)
         {
             j++;
@@ -462,7 +711,7 @@ hashtable_stats(HASHTABLE *table)
     }
     hashtable_read_unlock(table);
     printf("\tNo. of entries:       %d\n", total);
-    printf("\tAverage chain length: %.1f\n", (float)total / table->hashsize);
+    printf("\tAverage chain length: %.1f\n", (float)total / buckets->size);
     printf("\tLongest chain length: %d\n", longest);
 }
 
@@ -492,6 +741,7 @@ void hashtable_get_stats(void* table,
                          int*  longest)
 {
     HASHTABLE* ht;
+    HASHBUCKETS* buckets;
     HASHENTRIES* entries;
     int i;
     int j;
@@ -505,11 +755,12 @@ void hashtable_get_stats(void* table,
         ht = (HASHTABLE *)table;
         CHK_HASHTABLE(ht);
         hashtable_read_lock(ht);
+        buckets = ht->buckets;
 
-        for (i = 0; i < ht->hashsize; i++)
+        for (i = 0; i < buckets->size; i++)
         {
             j = 0;
-            entries = ht->entries[i];
+            entries = buckets->chains[i];
             while (entries)
             {
                 j++;
@@ -521,7 +772,7 @@ void hashtable_get_stats(void* table,
                 *longest = j;
             }
         }
-        *hashsize = ht->hashsize;
+        *hashsize = buckets->size;
         hashtable_read_unlock(ht);
     }
 }
@@ -530,36 +781,20 @@ void hashtable_get_stats(void* table,
 /**
  * Take a read lock on the hashtable.
  *
- * The hashtable support multiple readers and a single writer,
- * we have a spinlock to protect the two counts, n_readers and
- * writelock.
- *
- * We take the hashtable spinlock and then check that writelock
- * is set to zero. If not we release the spinlock and do dirty
- * reads of writelock until it goes to 0. Once it is zero we
- * acquire the spinlock again and test that writelock is still
- * 0.
- *
- * With writelock set to zero we increment n_readers with the
- * spinlock still held.
+ * The polling threads take no lock at all, the entries they may see are
+ * only freed once they have passed a quiescent point. Other threads
+ * increment n_readers, which keeps the writers from freeing any removed
+ * entries until the count drops back to zero. Neither blocks the writers.
  *
  * @param table         The hashtable to lock.
  */
 static void
 hashtable_read_lock(HASHTABLE *table)
 {
-    spinlock_acquire(&table->spin);
-    while (table->writelock)
+    if (!rcu_is_online())
     {
-        spinlock_release(&table->spin);
-        while (table->writelock)
-        {
-            ;
-        }
-        spinlock_acquire(&table->spin);
+        atomic_add(&table->n_readers, 1);
     }
-    atomic_add(&table->n_readers, 1);
-    spinlock_release(&table->spin);
 }
 
 /**
@@ -572,45 +807,25 @@ hashtable_read_lock(HASHTABLE *table)
 static void
 hashtable_read_unlock(HASHTABLE *table)
 {
-    atomic_add(&table->n_readers, -1);
+    if (!rcu_is_online())
+    {
+        atomic_add(&table->n_readers, -1);
+    }
 }
 
 /**
  * Obtain an exclusive write lock for the hash table.
  *
- * We acquire the hashtable spinlock, check for the number of
- * readers beign zero. If it is not we hold the spinlock and
- * loop waiting for the n_readers to reach zero. This will prevent
- * any new readers beign granted access but will not prevent current
- * readers releasing the read lock.
- *
- * Once we have no readers we increment writelock and test if we are
- * the only writelock holder, if not we repeat the process. We hold
- * the spinlock throughout the process since both read and write
- * locks do not require the spinlock to be acquired.
+ * The writers are serialised by the hashtable spinlock. They do not wait for
+ * the readers, instead the entries they remove are freed later.
  *
  * @param table The table to lock for updates
  */
 static void
 hashtable_write_lock(HASHTABLE *table)
 {
-    int available;
-
     spinlock_acquire(&table->spin);
-    do
-    {
-        while (table->n_readers)
-        {
-            ;
-        }
-        available = atomic_add(&table->writelock, 1);
-        if (available != 0)
-        {
-            atomic_add(&table->writelock, -1);
-        }
-    }
-    while (available != 0);
-    spinlock_release(&table->spin);
+    table->writelock = 1;
 }
 
 /**
@@ -621,7 +836,8 @@ hashtable_write_lock(HASHTABLE *table)
 static void
 hashtable_write_unlock(HASHTABLE *table)
 {
-    atomic_add(&table->writelock, -1);
+    table->writelock = 0;
+    spinlock_release(&table->spin);
 }
 
 /**
@@ -655,6 +871,7 @@ hashtable_next(HASHITERATOR *iter)
 {
     int i;
     HASHENTRIES *entries;
+    HASHBUCKETS *buckets;
 
     if (iter == NULL)
     {
@@ -662,10 +879,11 @@ hashtable_next(HASHITERATOR *iter)
     }
 
     iter->depth++;
-    while (iter->chain < iter->table->hashsize)
+    hashtable_read_lock(iter->table);
+    buckets = *(HASHBUCKETS * volatile *)&iter->table->buckets;
+    while (iter->chain < buckets->size)
     {
-        hashtable_read_lock(iter->table);
-        if ((entries = iter->table->entries[iter->chain]) != NULL)
+        if ((entries = buckets->chains[iter->chain]) != NULL)
         {
             i = 0;
             while (entries && i < iter->depth)
@@ -673,19 +891,16 @@ hashtable_next(HASHITERATOR *iter)
                 entries = entries->next;
                 i++;
             }
-            hashtable_read_unlock(iter->table);
             if (entries)
             {
+                hashtable_read_unlock(iter->table);
                 return entries->key;
             }
         }
-        else
-        {
-            hashtable_read_unlock(iter->table);
-        }
         iter->depth = 0;
         iter->chain++;
     }
+    hashtable_read_unlock(iter->table);
     return NULL;
 }
 
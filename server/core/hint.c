@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <hint.h>
+#include <server.h>
 
 /**
  * @file hint.c generic support routines for hints.
@@ -49,6 +50,7 @@ hint_dup(HINT *hint)
             return nlhead;
         }
         ptr2->type = ptr1->type;
+        ptr2->server = ptr1->server;
         if (ptr1->data)
         {
             ptr2->data = strdup(ptr1->data);
@@ -84,6 +86,9 @@ hint_dup(HINT *hint)
 /**
  * Create a ROUTE TO type hint
  *
+ * The server of a HINT_ROUTE_TO_NAMED_SERVER hint is looked up here so that
+ * the routers can compare the server instead of its name.
+ *
  * @param head  The current hint list
  * @param type  The HINT_TYPE
  * @param data  Data may be NULL or the name of a server to route to
@@ -109,6 +114,39 @@ hint_create_route(HINT *head, HINT_TYPE type, char *data)
         hint->data = NULL;
     }
     hint->value = NULL;
+    hint->server = NULL;
+    if (type == HINT_ROUTE_TO_NAMED_SERVER && data)
+    {
+        hint->server = server_find_by_unique_name(data);
+    }
+    return hint;
+}
+
+/**
+ * Create a route to named server hint for a server that is already known
+ *
+ * @param head      The current hint list
+ * @param server    The server to route to
+ * @return The result hint list
+ */
+HINT *
+hint_create_server_route(HINT *head, SERVER *server)
+{
+    HINT *hint;
+
+    if ((hint = (HINT *)malloc(sizeof(HINT))) == NULL)
+    {
+        return head;
+    }
+    if ((hint->data = strdup(server->unique_name)) == NULL)
+    {
+        free(hint);
+        return head;
+    }
+    hint->next = head;
+    hint->type = HINT_ROUTE_TO_NAMED_SERVER;
+    hint->value = NULL;
+    hint->server = server;
     return hint;
 }
 
@@ -131,6 +169,7 @@ hint_create_parameter(HINT *head, char *pname, char *value)
     }
     hint->next = head;
     hint->type = HINT_PARAMETER;
+    hint->server = NULL;
     hint->data = strdup(pname);
     hint->value = strdup(value);
     return hint;
@@ -12,9 +12,12 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
 #include <housekeeper.h>
 #include <thread.h>
-#include <spinlock.h>
+#include <timerwheel.h>
 #include <log_manager.h>
 
 /**
@@ -22,12 +25,14 @@
  *
  * The housekeeper provides a mechanism to allow for tasks, function
  * calls basically, to be run on a tiem basis. A task may be run
- * repeatedly, with a given frequency (in seconds), or may be a one
- * shot task that will only be run once after a specified number of
- * seconds.
+ * repeatedly, with a given frequency, or may be a one shot task that
+ * will only be run once after a specified number of seconds.
  *
  * The housekeeper also maintains a global variable, hkheartbeat, that
- * is incremented every 100ms.
+ * is incremented every 100ms. The heartbeat thread does nothing else
+ * than turn a timer wheel that holds the tasks, the due tasks are run
+ * by a small pool of executor threads. A slow task therefore delays
+ * neither the heartbeat nor the other tasks.
  *
  * @verbatim
  * Revision History
@@ -39,23 +44,43 @@
  * @endverbatim
  */
 
+/** The number of threads that run the tasks */
+#define HK_N_EXECUTORS  2
+
+/** The length of a heartbeat in milliseconds */
+#define HK_HEARTBEAT_MS 100
+
 /**
  * List of all tasks that need to be run
  */
 static HKTASK *tasks = NULL;
 /**
- * Spinlock to protect the tasks list
+ * The due tasks in the order they became due
+ */
+static HKTASK *ready_head = NULL;
+static HKTASK *ready_tail = NULL;
+/**
+ * Protects the task list, the queue of due tasks and the timer wheel. The
+ * executors wait on the condition for tasks to become due, which is why
+ * this is a mutex and not a spinlock.
  */
-static SPINLOCK tasklock = SPINLOCK_INIT;
+static pthread_mutex_t tasklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taskcond = PTHREAD_COND_INITIALIZER;
+/**
+ * The wheel the tasks wait in, allocated by the first task
+ */
+static TIMER_WHEEL *task_wheel = NULL;
 
-static int do_shutdown = 0;
+static volatile int do_shutdown = 0;
 long hkheartbeat = 0; /*< One heartbeat is 100 milliseconds */
 static THREAD hk_thr_handle;
+static THREAD hk_executors[HK_N_EXECUTORS];
 
 static void hkthread(void *);
+static void hkexecutor(void *);
 
 /**
- * Initialise the housekeeper thread
+ * Initialise the housekeeper threads
  */
 void
 hkinit()
@@ -64,6 +89,135 @@ hkinit()
     {
         MXS_ERROR("Failed to start housekeeper thread.");
     }
+
+    for (int i = 0; i < HK_N_EXECUTORS; i++)
+    {
+        if (thread_start(&hk_executors[i], hkexecutor, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start housekeeper executor thread.");
+        }
+    }
+}
+
+/**
+ * Convert milliseconds to heartbeats, rounding up. A task waits at least
+ * one heartbeat.
+ *
+ * @param ms    The time in milliseconds
+ * @return The time in heartbeats
+ */
+static long
+hk_ms_to_heartbeats(int ms)
+{
+    long beats = (ms + HK_HEARTBEAT_MS - 1) / HK_HEARTBEAT_MS;
+
+    return beats > 0 ? beats : 1;
+}
+
+/**
+ * Called by the heartbeat thread when the timer of a task expires. The
+ * task is appended to the queue of due tasks. The caller holds the tasklock.
+ *
+ * @param timer The timer of the task
+ */
+static void
+hktask_due(WHEEL_TIMER *timer)
+{
+    HKTASK *task = (HKTASK *)((char *)timer - offsetof(HKTASK, timer));
+
+    task->state = HK_QUEUED;
+    task->next_ready = NULL;
+    if (ready_tail)
+    {
+        ready_tail->next_ready = task;
+    }
+    else
+    {
+        ready_head = task;
+    }
+    ready_tail = task;
+}
+
+/**
+ * Place a task in the timer wheel. The caller holds the tasklock.
+ *
+ * @param task      The task
+ * @param expires   The heartbeat when the task is due
+ */
+static void
+hktask_schedule(HKTASK *task, long expires)
+{
+    task->state = HK_IDLE;
+    task->nextdue = time(0) + (expires - hkheartbeat) * HK_HEARTBEAT_MS / 1000;
+    timerwheel_schedule(task_wheel, &task->timer, expires, hktask_due);
+}
+
+/**
+ * Allocate a task.
+ *
+ * @param name          The name of the task
+ * @param taskfn        The function to call for the task
+ * @param data          Data to pass to the task function
+ * @param type          The task type
+ * @param interval      The interval of the task in milliseconds
+ * @return The new task or NULL if memory allocation failed
+ */
+static HKTASK *
+hktask_alloc(const char *name, void (*taskfn)(void *), void *data, HKTASK_TYPE type, int interval)
+{
+    HKTASK *task;
+
+    if ((task = (HKTASK *)calloc(1, sizeof(HKTASK))) == NULL)
+    {
+        return NULL;
+    }
+    if ((task->name = strdup(name)) == NULL)
+    {
+        free(task);
+        return NULL;
+    }
+    task->task = taskfn;
+    task->data = data;
+    task->interval = interval;
+    task->type = type;
+    return task;
+}
+
+/**
+ * Append a task to the task list and schedule its first run. The caller
+ * holds the tasklock.
+ *
+ * @param task  The task
+ * @param delay The delay of the first run in milliseconds
+ * @return True if the task was added, false if the timer wheel could not be
+ *         allocated
+ */
+static bool
+hktask_insert(HKTASK *task, int delay)
+{
+    HKTASK *ptr;
+
+    if (task_wheel == NULL && (task_wheel = timerwheel_alloc()) == NULL)
+    {
+        return false;
+    }
+
+    ptr = tasks;
+    while (ptr && ptr->next)
+    {
+        ptr = ptr->next;
+    }
+    if (ptr)
+    {
+        ptr->next = task;
+    }
+    else
+    {
+        tasks = task;
+    }
+
+    hktask_schedule(task, hkheartbeat + hk_ms_to_heartbeats(delay));
+    return true;
 }
 
 /**
@@ -85,55 +239,55 @@ hkinit()
  */
 int
 hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
+{
+    return hktask_add_ms(name, taskfn, data, frequency * 1000);
+}
+
+/**
+ * Add a new task that is run repeatedly with an interval given in
+ * milliseconds. The resolution of the interval is one heartbeat, 100
+ * milliseconds.
+ *
+ * Task names must be unique.
+ *
+ * @param name          The unique name for this housekeeper task
+ * @param taskfn        The function to call for the task
+ * @param data          Data to pass to the task function
+ * @param interval      How often to run the task, expressed in milliseconds
+ * @return              Return the time in seconds when the task will be first run
+ *                      if the task was added, otherwise 0
+ */
+int
+hktask_add_ms(const char *name, void (*taskfn)(void *), void *data, int interval)
 {
     HKTASK *task, *ptr;
+    time_t nextdue = 0;
 
-    if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
+    if ((task = hktask_alloc(name, taskfn, data, HK_REPEATED, interval)) == NULL)
     {
         return 0;
     }
-    if ((task->name = strdup(name)) == NULL)
-    {
-        free(task);
-        return 0;
-    }
-    task->task = taskfn;
-    task->data = data;
-    task->frequency = frequency;
-    task->type = HK_REPEATED;
-    task->nextdue = time(0) + frequency;
-    task->next = NULL;
-    spinlock_acquire(&tasklock);
+
+    pthread_mutex_lock(&tasklock);
     ptr = tasks;
-    while (ptr && ptr->next)
+    while (ptr && strcmp(ptr->name, name) != 0)
     {
-        if (strcmp(ptr->name, name) == 0)
-        {
-            spinlock_release(&tasklock);
-            free(task->name);
-            free(task);
-            return 0;
-        }
         ptr = ptr->next;
     }
-    if (ptr)
+    if (ptr == NULL && hktask_insert(task, interval))
     {
-        if (strcmp(ptr->name, name) == 0)
-        {
-            spinlock_release(&tasklock);
-            free(task->name);
-            free(task);
-            return 0;
-        }
-        ptr->next = task;
+        nextdue = task->nextdue;
+        task = NULL;
     }
-    else
+    pthread_mutex_unlock(&tasklock);
+
+    if (task)
     {
-        tasks = task;
+        free(task->name);
+        free(task);
     }
-    spinlock_release(&tasklock);
 
-    return task->nextdue;
+    return nextdue;
 }
 
 /**
@@ -152,45 +306,87 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
 int
 hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
 {
-    HKTASK *task, *ptr;
+    HKTASK *task;
+    time_t nextdue = 0;
 
-    if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
+    if ((task = hktask_alloc(name, taskfn, data, HK_ONESHOT, 0)) == NULL)
     {
         return 0;
     }
-    if ((task->name = strdup(name)) == NULL)
+
+    pthread_mutex_lock(&tasklock);
+    if (hktask_insert(task, when * 1000))
     {
-        free(task);
-        return 0;
+        nextdue = task->nextdue;
+        task = NULL;
     }
-    task->task = taskfn;
-    task->data = data;
-    task->frequency = 0;
-    task->type = HK_ONESHOT;
-    task->nextdue = time(0) + when;
-    task->next = NULL;
-    spinlock_acquire(&tasklock);
-    ptr = tasks;
-    while (ptr && ptr->next)
+    pthread_mutex_unlock(&tasklock);
+
+    if (task)
     {
-        ptr = ptr->next;
+        free(task->name);
+        free(task);
     }
-    if (ptr)
+
+    return nextdue;
+}
+
+/**
+ * Unlink a task from the task list. The caller holds the tasklock.
+ *
+ * @param task The task
+ */
+static void
+hktask_unlink(HKTASK *task)
+{
+    HKTASK **pptr = &tasks;
+
+    while (*pptr && *pptr != task)
     {
-        ptr->next = task;
+        pptr = &(*pptr)->next;
     }
-    else
+    if (*pptr)
     {
-        tasks = task;
+        *pptr = task->next;
     }
-    spinlock_release(&tasklock);
-
-    return task->nextdue;
 }
 
+/**
+ * Remove a task from the queue of due tasks. The caller holds the tasklock.
+ *
+ * @param task The task
+ */
+static void
+hktask_dequeue(HKTASK *task)
+{
+    HKTASK *prev = NULL;
+    HKTASK *ptr = ready_head;
+
+    while (ptr && ptr != task)
+    {
+        prev = ptr;
+        ptr = ptr->next_ready;
+    }
+    if (ptr)
+    {
+        if (prev)
+        {
+            prev->next_ready = ptr->next_ready;
+        }
+        else
+        {
+            ready_head = ptr->next_ready;
+        }
+        if (ready_tail == ptr)
+        {
+            ready_tail = prev;
+        }
+    }
+}
 
 /**
- * Remove a named task from the housekeepers task list
+ * Remove a named task from the housekeepers task list. A task that is
+ * running when it is removed is freed when it returns.
  *
  * @param name          The task name to remove
  * @return              Returns 0 if the task could not be removed
@@ -198,99 +394,174 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
 int
 hktask_remove(const char *name)
 {
-    HKTASK *ptr, *lptr = NULL;
+    HKTASK *ptr;
+    HKTASK_STATE state = HK_IDLE;
 
-    spinlock_acquire(&tasklock);
+    pthread_mutex_lock(&tasklock);
     ptr = tasks;
     while (ptr && strcmp(ptr->name, name) != 0)
     {
-        lptr = ptr;
         ptr = ptr->next;
     }
-    if (ptr && lptr)
-    {
-        lptr->next = ptr->next;
-    }
-    else if (ptr)
+    if (ptr)
     {
-        tasks = ptr->next;
+        hktask_unlink(ptr);
+        state = ptr->state;
+        switch (state)
+        {
+        case HK_IDLE:
+            timerwheel_remove(&ptr->timer);
+            break;
+
+        case HK_QUEUED:
+            hktask_dequeue(ptr);
+            break;
+
+        case HK_RUNNING:
+            ptr->removed = true;
+            break;
+        }
     }
-    spinlock_release(&tasklock);
+    pthread_mutex_unlock(&tasklock);
 
-    if (ptr)
+    /** A running task may already have been freed by its executor */
+    if (ptr && state != HK_RUNNING)
     {
         free(ptr->name);
         free(ptr);
-        return 1;
     }
-    else
+
+    return ptr != NULL;
+}
+
+/**
+ * The heartbeat thread of the housekeeper.
+ *
+ * The heartbeat is incremented every 100 milliseconds against an absolute
+ * deadline, so it does not drift with the time spent on each tick. On each
+ * tick the wheel of the tasks is turned and the executors are woken up if
+ * tasks became due. The tasks are never run by this thread.
+ *
+ * @param       data            Unused, here to satisfy the thread system
+ */
+static void
+hkthread(void *data)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (!do_shutdown)
     {
-        return 0;
+        deadline.tv_nsec += HK_HEARTBEAT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        {
+        }
+
+        hkheartbeat++;
+        mxs_log_update_clock();
+        if (hkheartbeat % 10 == 0)
+        {
+            mxs_log_report_suppressed();
+        }
+
+        pthread_mutex_lock(&tasklock);
+        if (task_wheel)
+        {
+            timerwheel_turn(task_wheel);
+        }
+        if (ready_head)
+        {
+            pthread_cond_broadcast(&taskcond);
+        }
+        pthread_mutex_unlock(&tasklock);
     }
 }
 
+/**
+ * Elapsed time in microseconds between two points of the monotonic clock.
+ */
+static unsigned long
+hk_elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000UL + (end->tv_nsec - start->tv_nsec) / 1000;
+}
 
 /**
- * The housekeeper thread implementation.
- *
- * This function is responsible for executing the housekeeper tasks.
+ * An executor thread of the housekeeper.
  *
- * The implementation of the callng of the task functions is such that
- * the tasks are called without the tasklock spinlock being held. This
- * allows manipulation of the housekeeper task list during execution of
- * one of the tasks. The resutl is that upon completion of a task the
- * search for tasks to run must restart from the start of the queue.
- * It is vital that the task->nextdue tiem is updated before the task
- * is run.
+ * The executor takes the due tasks from the queue and runs them without the
+ * tasklock being held, so the tasks may add and remove tasks. A repeated
+ * task is put back in the wheel only when it returns, so the same task is
+ * never run by two executors at the same time. If a task overruns its
+ * interval, the next run is due one interval after the overrun run.
  *
  * @param       data            Unused, here to satisfy the thread system
  */
-void
-hkthread(void *data)
+static void
+hkexecutor(void *data)
 {
-    HKTASK *ptr;
-    time_t now;
-    void (*taskfn)(void *);
-    void *taskdata;
-    int i;
-
-    for (;;)
+    pthread_mutex_lock(&tasklock);
+    while (!do_shutdown)
     {
-        for (i = 0; i < 10; i++)
+        HKTASK *task = ready_head;
+
+        if (task == NULL)
         {
-            if (do_shutdown)
-            {
-                return;
-            }
-            thread_millisleep(100);
-            hkheartbeat++;
+            pthread_cond_wait(&taskcond, &tasklock);
+            continue;
         }
-        now = time(0);
-        spinlock_acquire(&tasklock);
-        ptr = tasks;
-        while (ptr)
+
+        ready_head = task->next_ready;
+        if (ready_head == NULL)
         {
-            if (ptr->nextdue <= now)
+            ready_tail = NULL;
+        }
+        task->state = HK_RUNNING;
+        pthread_mutex_unlock(&tasklock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        task->task(task->data);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        unsigned long us = hk_elapsed_us(&start, &end);
+
+        pthread_mutex_lock(&tasklock);
+        task->runs++;
+        task->total_us += us;
+        if (us > task->max_us)
+        {
+            task->max_us = us;
+        }
+
+        if (task->removed || task->type == HK_ONESHOT)
+        {
+            if (!task->removed)
             {
-                ptr->nextdue = now + ptr->frequency;
-                taskfn = ptr->task;
-                taskdata = ptr->data;
-                spinlock_release(&tasklock);
-                (*taskfn)(taskdata);
-                if (ptr->type == HK_ONESHOT)
-                {
-                    hktask_remove(ptr->name);
-                }
-                spinlock_acquire(&tasklock);
-                ptr = tasks;
+                hktask_unlink(task);
             }
-            else
+            pthread_mutex_unlock(&tasklock);
+            free(task->name);
+            free(task);
+            pthread_mutex_lock(&tasklock);
+        }
+        else
+        {
+            long expires = task->timer.expires + hk_ms_to_heartbeats(task->interval);
+
+            if (expires <= hkheartbeat)
             {
-                ptr = ptr->next;
+                expires = hkheartbeat + hk_ms_to_heartbeats(task->interval);
             }
+            hktask_schedule(task, expires);
         }
-        spinlock_release(&tasklock);
     }
+    pthread_mutex_unlock(&tasklock);
 }
 
 /**
@@ -300,7 +571,10 @@ hkthread(void *data)
 void
 hkshutdown()
 {
+    pthread_mutex_lock(&tasklock);
     do_shutdown = 1;
+    pthread_cond_broadcast(&taskcond);
+    pthread_mutex_unlock(&tasklock);
 }
 
 /**
@@ -315,20 +589,26 @@ hkshow_tasks(DCB *pdcb)
     struct tm tm;
     char buf[40];
 
-    dcb_printf(pdcb, "%-25s | Type     | Frequency | Next Due\n", "Name");
-    dcb_printf(pdcb, "--------------------------+----------+-----------+-------------------------\n");
-    spinlock_acquire(&tasklock);
+    dcb_printf(pdcb, "%-25s | Type     | Interval (ms) | Next Due            | State   "
+               "|    Runs | Avg (ms) | Max (ms)\n", "Name");
+    dcb_printf(pdcb, "--------------------------+----------+---------------+---------------------+---------"
+               "+---------+----------+---------\n");
+    pthread_mutex_lock(&tasklock);
     ptr = tasks;
     while (ptr)
     {
         localtime_r(&ptr->nextdue, &tm);
-        asctime_r(&tm, buf);
-        dcb_printf(pdcb, "%-25s | %-8s | %-9d | %s",
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+        dcb_printf(pdcb, "%-25s | %-8s | %-13d | %-19s | %-7s | %7lu | %8.1f | %8.1f\n",
                    ptr->name,
                    ptr->type == HK_REPEATED ? "Repeated" : "One-Shot",
-                   ptr->frequency,
-                   buf);
+                   ptr->interval,
+                   ptr->state == HK_IDLE ? buf : "-",
+                   ptr->state == HK_IDLE ? "Waiting" : ptr->state == HK_QUEUED ? "Queued" : "Running",
+                   ptr->runs,
+                   ptr->runs ? ptr->total_us / 1000.0 / ptr->runs : 0.0,
+                   ptr->max_us / 1000.0);
         ptr = ptr->next;
     }
-    spinlock_release(&tasklock);
+    pthread_mutex_unlock(&tasklock);
 }
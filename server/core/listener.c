@@ -34,11 +34,50 @@
 #include <gw_ssl.h>
 #include <gw_protocol.h>
 #include <log_manager.h>
+#include <housekeeper.h>
+#include <atomic.h>
+#include <arpa/inet.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+
+/** The number of sessions kept in the session cache of a listener */
+#define SSL_SESSION_CACHE_SIZE 10000
+
+/** How long a session can be resumed, in seconds */
+#define SSL_SESSION_TIMEOUT 300
+
+/** How often the key of the session tickets is replaced, in seconds */
+#define SSL_TICKET_KEY_ROTATE_FREQ 3600
+
+/** The length of each part of a session ticket key */
+#define SSL_TICKET_KEY_LEN 16
+
+/**
+ * A key that session tickets are encrypted with
+ */
+typedef struct ssl_ticket_key
+{
+    unsigned char name[SSL_TICKET_KEY_LEN];     /*< Identifies the key in a ticket */
+    unsigned char aes_key[SSL_TICKET_KEY_LEN];  /*< The encryption key */
+    unsigned char hmac_key[SSL_TICKET_KEY_LEN]; /*< The authentication key */
+} SSL_TICKET_KEY;
+
+/**
+ * The current ticket key and the one before it. Tickets encrypted with the
+ * previous key are still accepted, and are replaced with new ones.
+ */
+static SSL_TICKET_KEY ticket_keys[2];
+static SPINLOCK ticket_lock = SPINLOCK_INIT;
+static bool ticket_keys_done = false;
 
 static RSA *rsa_512 = NULL;
 static RSA *rsa_1024 = NULL;
 
 static RSA *tmp_rsa_callback(SSL *s, int is_export, int keylength);
+static bool ssl_ticket_keys_init();
+static void ssl_ticket_key_rotate(void *data);
+static int ssl_ticket_key_cb(SSL *s, unsigned char *key_name, unsigned char *iv,
+                             EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc);
 
 /**
  * Create a new listener structure
@@ -62,10 +101,174 @@ listener_alloc(char *protocol, char *address, unsigned short port, char *authent
         proto->port = port;
         proto->authenticator = authenticator ? strdup(authenticator) : NULL;
         proto->ssl = ssl;
+        memset(&proto->admission, 0, sizeof(proto->admission));
+        spinlock_init(&proto->admission.lock);
     }
     return proto;
 }
 
+/**
+ * Set the limits on the connections a listener accepts
+ *
+ * @param listener                  The listener
+ * @param connection_rate           Connections per second, 0 for no limit
+ * @param subnet_connection_rate    Connections per second from one subnet, 0 for no limit
+ * @param max_handshakes            Clients authenticating at once, 0 for no limit
+ * @return True on success, false if memory allocation failed
+ */
+bool
+listener_set_admission(SERV_LISTENER *listener, int connection_rate,
+                       int subnet_connection_rate, int max_handshakes)
+{
+    LISTENER_ADMISSION *adm = &listener->admission;
+
+    if (subnet_connection_rate > 0 && adm->subnets == NULL &&
+        (adm->subnets = calloc(LISTENER_SUBNET_BUCKETS, sizeof(LISTENER_BUCKET))) == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&adm->lock);
+    adm->connection_rate = connection_rate;
+    adm->subnet_connection_rate = subnet_connection_rate;
+    adm->max_handshakes = max_handshakes;
+    adm->bucket.tokens = connection_rate;
+    adm->bucket.stamp = hkheartbeat;
+    spinlock_release(&adm->lock);
+
+    return true;
+}
+
+/**
+ * Add the tokens for the time passed since the bucket was last filled
+ *
+ * @param bucket    The bucket
+ * @param rate      Tokens per second
+ */
+static void
+listener_bucket_fill(LISTENER_BUCKET *bucket, int rate)
+{
+    long now = hkheartbeat;
+
+    /** The heartbeat is incremented ten times a second */
+    bucket->tokens += (now - bucket->stamp) * rate / 10.0;
+    bucket->stamp = now;
+
+    if (bucket->tokens > rate)
+    {
+        bucket->tokens = rate;
+    }
+}
+
+/**
+ * Check whether the listener can accept a connection now. If not, the
+ * connections are left in the backlog of the listening socket until the
+ * rate or the number of authenticating clients allows accepting them.
+ *
+ * @param listener  The listener
+ * @return True if a connection can be accepted
+ */
+bool
+listener_can_accept(SERV_LISTENER *listener)
+{
+    LISTENER_ADMISSION *adm = &listener->admission;
+    bool rval = true;
+
+    if (adm->max_handshakes > 0 && adm->handshakes >= adm->max_handshakes)
+    {
+        rval = false;
+    }
+    else if (adm->connection_rate > 0)
+    {
+        spinlock_acquire(&adm->lock);
+        listener_bucket_fill(&adm->bucket, adm->connection_rate);
+        rval = adm->bucket.tokens >= 1;
+        spinlock_release(&adm->lock);
+    }
+
+    if (!rval)
+    {
+        atomic_add(&adm->n_throttled, 1);
+    }
+
+    return rval;
+}
+
+/**
+ * Account for a connection the listener accepted. The connection counts as
+ * authenticating until listener_handshake_done() is called for it.
+ *
+ * @param listener  The listener
+ * @param addr      The IPv4 source address in network byte order, 0 if not known
+ * @return True if the connection is admitted, false if its subnet has exceeded
+ * its rate and the connection should be closed
+ */
+bool
+listener_admit(SERV_LISTENER *listener, uint32_t addr)
+{
+    LISTENER_ADMISSION *adm = &listener->admission;
+    bool rval = true;
+
+    if (adm->connection_rate > 0 || adm->subnet_connection_rate > 0)
+    {
+        spinlock_acquire(&adm->lock);
+
+        if (adm->connection_rate > 0)
+        {
+            listener_bucket_fill(&adm->bucket, adm->connection_rate);
+            adm->bucket.tokens -= 1;
+        }
+
+        if (adm->subnet_connection_rate > 0 && addr != 0)
+        {
+            uint32_t key = ntohl(addr) >> (32 - LISTENER_SUBNET_BITS);
+            LISTENER_BUCKET *bucket = &adm->subnets[(key * 2654435761U) % LISTENER_SUBNET_BUCKETS];
+
+            listener_bucket_fill(bucket, adm->subnet_connection_rate);
+
+            /** A full bucket has no state worth keeping and can be taken over
+             * by another subnet, otherwise the subnets share the bucket */
+            if (bucket->key != key && bucket->tokens >= adm->subnet_connection_rate)
+            {
+                bucket->key = key;
+            }
+
+            if (bucket->tokens >= 1)
+            {
+                bucket->tokens -= 1;
+            }
+            else
+            {
+                rval = false;
+            }
+        }
+
+        spinlock_release(&adm->lock);
+    }
+
+    if (rval)
+    {
+        atomic_add(&adm->handshakes, 1);
+    }
+    else
+    {
+        atomic_add(&adm->n_rejected, 1);
+    }
+
+    return rval;
+}
+
+/**
+ * Mark the authentication of a client of the listener as done
+ *
+ * @param listener  The listener
+ */
+void
+listener_handshake_done(SERV_LISTENER *listener)
+{
+    atomic_add(&listener->admission.handshakes, -1);
+}
+
 /**
  * Set the maximum SSL/TLS version the listener will support
  * @param ssl_listener Listener data to configure
@@ -178,6 +381,39 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
         /** Disable SSLv3 */
         SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_NO_SSLv3);
 
+        /**
+         * Let clients that reconnect resume their sessions, either from the
+         * session cache or with a session ticket, instead of doing a full
+         * handshake. Connections to servers resume sessions with
+         * ssl_resume_session().
+         */
+        spinlock_init(&ssl_listener->session_lock);
+        ssl_listener->session = NULL;
+        SSL_CTX_set_session_cache_mode(ssl_listener->ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_set_session_id_context(ssl_listener->ctx, (unsigned char *)"MaxScale",
+                                       strlen("MaxScale"));
+        SSL_CTX_sess_set_cache_size(ssl_listener->ctx, SSL_SESSION_CACHE_SIZE);
+        SSL_CTX_set_timeout(ssl_listener->ctx, SSL_SESSION_TIMEOUT);
+
+        if (ssl_listener->ktls)
+        {
+#ifdef SSL_OP_ENABLE_KTLS
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_ENABLE_KTLS);
+#else
+            MXS_WARNING("Kernel TLS was requested but the OpenSSL library that "
+                        "MaxScale was built with does not support it.");
+#endif
+        }
+
+        if (ssl_ticket_keys_init())
+        {
+            SSL_CTX_set_tlsext_ticket_key_cb(ssl_listener->ctx, ssl_ticket_key_cb);
+        }
+        else
+        {
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_NO_TICKET);
+        }
+
         /** Generate the 512-bit and 1024-bit RSA keys */
         if (rsa_512 == NULL)
         {
@@ -291,3 +527,141 @@ tmp_rsa_callback(SSL *s, int is_export, int keylength)
     }
     return(rsa_tmp);
 }
+
+/**
+ * Generate a new session ticket key
+ *
+ * @param key   The key to fill
+ * @return True if the key was generated
+ */
+static bool
+ssl_ticket_key_generate(SSL_TICKET_KEY *key)
+{
+    return RAND_bytes(key->name, sizeof(key->name)) == 1 &&
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) == 1 &&
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) == 1;
+}
+
+/**
+ * Generate the first session ticket key, shared by all listeners, and start
+ * replacing it periodically.
+ *
+ * @return True if the session ticket key is available
+ */
+static bool
+ssl_ticket_keys_init()
+{
+    bool start = false;
+
+    spinlock_acquire(&ticket_lock);
+    if (!ticket_keys_done && ssl_ticket_key_generate(&ticket_keys[0]))
+    {
+        ticket_keys[1] = ticket_keys[0];
+        ticket_keys_done = true;
+        start = true;
+    }
+    bool rval = ticket_keys_done;
+    spinlock_release(&ticket_lock);
+
+    if (start)
+    {
+        hktask_add("SSL ticket key rotation", ssl_ticket_key_rotate, NULL,
+                   SSL_TICKET_KEY_ROTATE_FREQ);
+    }
+    else if (!rval)
+    {
+        MXS_ERROR("Failed to generate the SSL session ticket key, session "
+                  "tickets are disabled.");
+    }
+
+    return rval;
+}
+
+/**
+ * Housekeeper task that replaces the session ticket key. The replaced key
+ * is still accepted until the next rotation.
+ *
+ * @param data  Unused
+ */
+static void
+ssl_ticket_key_rotate(void *data)
+{
+    SSL_TICKET_KEY key;
+
+    if (ssl_ticket_key_generate(&key))
+    {
+        spinlock_acquire(&ticket_lock);
+        ticket_keys[1] = ticket_keys[0];
+        ticket_keys[0] = key;
+        spinlock_release(&ticket_lock);
+    }
+    else
+    {
+        MXS_ERROR("Failed to generate a new SSL session ticket key.");
+    }
+}
+
+/**
+ * The OpenSSL callback that sets up the encryption of a session ticket, or
+ * the decryption of a ticket that a client presents.
+ *
+ * @param s         The SSL of the connection
+ * @param key_name  The name of the key in the ticket
+ * @param iv        The initialization vector of the ticket
+ * @param ectx      The cipher context to initialize
+ * @param hctx      The HMAC context to initialize
+ * @param enc       1 when a ticket is created, 0 when one is decrypted
+ * @return 1 if the key was found, 2 if the ticket should be renewed, 0 if
+ * the key is unknown and -1 on error
+ */
+static int
+ssl_ticket_key_cb(SSL *s, unsigned char *key_name, unsigned char *iv,
+                  EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    SSL_TICKET_KEY key;
+    int rval = 1;
+
+    if (enc)
+    {
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1)
+        {
+            return -1;
+        }
+
+        spinlock_acquire(&ticket_lock);
+        key = ticket_keys[0];
+        spinlock_release(&ticket_lock);
+
+        memcpy(key_name, key.name, sizeof(key.name));
+        EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key.aes_key, iv);
+    }
+    else
+    {
+        spinlock_acquire(&ticket_lock);
+        if (memcmp(key_name, ticket_keys[0].name, sizeof(key.name)) == 0)
+        {
+            key = ticket_keys[0];
+        }
+        else if (memcmp(key_name, ticket_keys[1].name, sizeof(key.name)) == 0)
+        {
+            key = ticket_keys[1];
+            rval = 2;
+        }
+        else
+        {
+            rval = 0;
+        }
+        spinlock_release(&ticket_lock);
+
+        if (rval == 0)
+        {
+            return 0;
+        }
+
+        EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key.aes_key, iv);
+    }
+
+    HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL);
+
+    return rval;
+}
@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <modules.h>
 #include <modinfo.h>
 #include <skygw_utils.h>
@@ -47,6 +48,12 @@
 #include <gwdirs.h>
 
 static MODULES *registered = NULL;
+/**
+ * Serialises the loading of modules, which happens from the polling threads
+ * and from the threads that start the services. It is recursive because
+ * the initialisation of a module may load other modules.
+ */
+static pthread_mutex_t load_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 static MODULES *find_module(const char *module);
 static void register_module(const char *module,
@@ -56,6 +63,7 @@ static void register_module(const char *module,
                             void        *modobj,
                             MODULE_INFO *info);
 static void unregister_module(const char *module);
+static void *load_module_locked(const char *module, const char *type);
 int module_create_feedback_report(GWBUF **buffer, MODULES *modules, FEEDBACK_CONF *cfg);
 int do_http_post(GWBUF *buffer, void *cfg);
 
@@ -114,6 +122,25 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
  */
 void *
 load_module(const char *module, const char *type)
+{
+    void *modobj;
+
+    pthread_mutex_lock(&load_lock);
+    modobj = load_module_locked(module, type);
+    pthread_mutex_unlock(&load_lock);
+
+    return modobj;
+}
+
+/**
+ * Load a module, called with the load_lock held.
+ *
+ * @param module        Name of the module to load
+ * @param type          Type of module, used purely for registration
+ * @return              The module specific entry point structure or NULL
+ */
+static void *
+load_module_locked(const char *module, const char *type)
 {
     char *home, *version;
     char fname[MAXPATHLEN + 1];
@@ -265,15 +292,18 @@ load_module(const char *module, const char *type)
 void
 unload_module(const char *module)
 {
-    MODULES *mod = find_module(module);
+    MODULES *mod;
     void *handle;
 
-    if (!mod)
+    pthread_mutex_lock(&load_lock);
+    if ((mod = find_module(module)) == NULL)
     {
+        pthread_mutex_unlock(&load_lock);
         return;
     }
     handle = mod->handle;
     unregister_module(module);
+    pthread_mutex_unlock(&load_lock);
     dlclose(handle);
 }
 
@@ -24,6 +24,11 @@
 #include <syslog.h>
 #include <atomic.h>
 
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
 #include <mlist.h>
 #include <skygw_debug.h>
 #include <skygw_types.h>
@@ -286,6 +291,89 @@ typedef struct strpart
     struct strpart* sp_next;
 } strpart_t;
 
+/**
+ * The size of the staging ring of a logging thread, a power of two. A ring
+ * holds several full length messages.
+ */
+#define LOGRING_SIZE (64 * 1024)
+
+/** The maximum number of buffers the file writer passes to one writev */
+#define LOGRING_IOV_MAX 64
+
+/**
+ * A single producer ring where a logging thread stages its messages. Only
+ * the owning thread advances the head and only the file writer advances
+ * the tail, so neither needs a lock. The file writer frees the ring once
+ * the thread has exited and the ring is empty.
+ */
+typedef struct logring
+{
+    char*             lr_buf;   /**< LOGRING_SIZE bytes of message data */
+    volatile uint64_t lr_head;  /**< Bytes written, updated by the owner */
+    char              lr_pad[64 - sizeof(uint64_t)]; /**< Head and tail on separate lines */
+    volatile uint64_t lr_tail;  /**< Bytes written to the file, updated by the file writer */
+    volatile bool     lr_dead;  /**< The owner has exited */
+    struct logring*   lr_next;  /**< The next ring */
+} logring_t;
+
+/** All staging rings, new rings are added to the head */
+static logring_t* logrings = NULL;
+
+/** The ring of the calling thread */
+static __thread logring_t* logring_self = NULL;
+
+/** Set for the file writer thread, which must not wait for its own ring */
+static __thread bool logring_is_filewriter = false;
+
+/** Marks the ring of an exiting thread dead */
+static pthread_key_t logring_key;
+static pthread_once_t logring_key_once = PTHREAD_ONCE_INIT;
+
+/** A message is formatted here before it is copied to the ring */
+static __thread char logring_scratch[MAX_LOGSTRLEN];
+
+/**
+ * The timestamp that the housekeeper refreshes on every heartbeat. The
+ * sequence number is odd while the timestamp is being updated.
+ */
+static struct
+{
+    volatile int  lc_seqno;
+    volatile time_t lc_time;        /**< The second of the timestamp */
+    size_t        lc_len;           /**< Length of the timestamp without the NUL */
+    char          lc_text[64];      /**< The formatted timestamp */
+} log_clock;
+
+/** The number of call sites that can be throttled, a power of two */
+#define LOG_THROTTLE_SLOTS 1024
+
+/**
+ * The throttling state of a call site. A slot is claimed by the first site
+ * that hashes to it, other sites that hash to the same slot are not
+ * throttled. All fields are updated without locks, a race can only let a
+ * message too many through or miscount the suppressed ones by one.
+ */
+typedef struct log_throttle
+{
+    const char* volatile lt_file;           /**< The file of the site */
+    volatile int         lt_line;           /**< The line of the site */
+    volatile int         lt_priority;       /**< The priority of the last message */
+    volatile int         lt_count;          /**< Messages logged in the window */
+    volatile int         lt_suppressed;     /**< Messages suppressed and not reported */
+    volatile int64_t     lt_window_start;   /**< When the window started, in ms */
+    volatile int64_t     lt_suppress_until; /**< When the suppression ends, in ms */
+} log_throttle_t;
+
+static log_throttle_t log_throttles[LOG_THROTTLE_SLOTS];
+
+/** By default ten messages a second are let through, then a site is suppressed for ten seconds */
+static struct
+{
+    volatile int     count;         /**< Messages per window, 0 disables throttling */
+    volatile int64_t window_ms;     /**< The length of the window */
+    volatile int64_t suppress_ms;   /**< How long a site is suppressed */
+} log_throttling = { 10, 1000, 10000 };
+
 
 /** Static function declarations */
 static bool logfiles_init(logmanager_t* lmgr);
@@ -329,6 +417,10 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
 
 static void blockbuf_register(blockbuf_t* bb);
 static void blockbuf_unregister(blockbuf_t* bb);
+static logring_t* logring_get(void);
+static void logring_write(logring_t* ring, const char* data, size_t len, bool flush);
+static bool logrings_write(filewriter_t* fwr, bool flush);
+static size_t log_clock_copy(char* p_ts, size_t tslen);
 static char* add_slash(char* str);
 
 static bool check_file_and_path(char* filename,
@@ -603,6 +695,7 @@ static int logmanager_write_log(int            priority,
     char*        wp;
     int          err = 0;
     blockbuf_t*  bb;
+    logring_t*   ring = NULL;
     blockbuf_t*  bb_c;
     size_t       timestamp_len;
     int          i;
@@ -693,8 +786,16 @@ static int logmanager_write_log(int            priority,
     /** Book space for log string from buffer */
     if (do_maxlog)
     {
-        // All messages are now logged to the error log file.
-        wp = blockbuf_get_writepos(&bb, safe_str_len, flush);
+        if ((ring = logring_get()) != NULL)
+        {
+            /** The message is copied to the ring of the thread once it is complete */
+            wp = logring_scratch;
+        }
+        else
+        {
+            // All messages are now logged to the error log file.
+            wp = blockbuf_get_writepos(&bb, safe_str_len, flush);
+        }
     }
     else
     {
@@ -724,7 +825,8 @@ static int logmanager_write_log(int            priority,
     }
     else
     {
-        timestamp_len = snprint_timestamp(wp, timestamp_len);
+        size_t len = log_clock_copy(wp, timestamp_len);
+        timestamp_len = len ? len : snprint_timestamp(wp, timestamp_len);
     }
     if (sesid_str_len != 0)
     {
@@ -779,7 +881,14 @@ static int logmanager_write_log(int            priority,
 
     if (do_maxlog)
     {
-        blockbuf_unregister(bb);
+        if (ring)
+        {
+            logring_write(ring, wp, safe_str_len, flush);
+        }
+        else
+        {
+            blockbuf_unregister(bb);
+        }
     }
     else
     {
@@ -789,6 +898,245 @@ static int logmanager_write_log(int            priority,
     return err;
 }
 
+/**
+ * Mark the ring of an exiting thread dead so that the file writer frees it.
+ *
+ * @param data  The ring
+ */
+static void logring_release(void* data)
+{
+    logring_t* ring = (logring_t*)data;
+    ring->lr_dead = true;
+}
+
+static void logring_key_init(void)
+{
+    pthread_key_create(&logring_key, logring_release);
+}
+
+/**
+ * Get the staging ring of the calling thread, creating it on the first call.
+ *
+ * @return The ring or NULL if the thread should use the block buffers
+ */
+static logring_t* logring_get(void)
+{
+    if (logring_self == NULL && !logring_is_filewriter)
+    {
+        logring_t* ring = (logring_t*)calloc(1, sizeof(logring_t));
+
+        if (ring && (ring->lr_buf = (char*)malloc(LOGRING_SIZE)))
+        {
+            pthread_once(&logring_key_once, logring_key_init);
+            pthread_setspecific(logring_key, ring);
+
+            do
+            {
+                ring->lr_next = logrings;
+            }
+            while (!__sync_bool_compare_and_swap(&logrings, ring->lr_next, ring));
+
+            logring_self = ring;
+        }
+        else
+        {
+            free(ring);
+        }
+    }
+    return logring_self;
+}
+
+/**
+ * Copy a complete message to the ring of the calling thread. If the ring is
+ * full, the thread waits for the file writer to make room. The file writer
+ * is woken up for messages that must be flushed and when the ring gets half
+ * full, otherwise the messages are written on the next flush.
+ *
+ * @param ring  The ring of the calling thread
+ * @param data  The message
+ * @param len   The length of the message
+ * @param flush Whether the message should be written at once
+ */
+static void logring_write(logring_t* ring, const char* data, size_t len, bool flush)
+{
+    logfile_t* lf = &lm->lm_logfile;
+    uint64_t head = ring->lr_head;
+
+    ss_dassert(len <= LOGRING_SIZE);
+
+    while (LOGRING_SIZE - (head - ring->lr_tail) < len)
+    {
+        skygw_message_send(lf->lf_logmes);
+        pthread_yield();
+    }
+
+    size_t pos = head & (LOGRING_SIZE - 1);
+    size_t first = MIN(len, LOGRING_SIZE - pos);
+
+    memcpy(ring->lr_buf + pos, data, first);
+    memcpy(ring->lr_buf, data + first, len - first);
+
+    /** The message must be in place before the file writer can see it */
+    __sync_synchronize();
+    ring->lr_head = head + len;
+
+    uint64_t used = head - ring->lr_tail;
+
+    if (flush || (used <= LOGRING_SIZE / 2 && used + len > LOGRING_SIZE / 2))
+    {
+        skygw_message_send(lf->lf_logmes);
+    }
+}
+
+/**
+ * Write the pending messages of all staging rings to the log file. The
+ * rings are written in batches of at most LOGRING_IOV_MAX buffers with one
+ * writev each. The rings of exited threads are freed once they are empty.
+ *
+ * @param fwr   The file writer
+ * @param flush Whether the file should be synced to disk
+ * @return True if the writes succeeded
+ */
+static bool logrings_write(filewriter_t* fwr, bool flush)
+{
+    struct iovec iov[LOGRING_IOV_MAX];
+    logring_t*   rings[LOGRING_IOV_MAX];
+    uint64_t     heads[LOGRING_IOV_MAX];
+    int          n_iov = 0;
+    int          n_rings = 0;
+    int          err = 0;
+    logring_t*   ring = logrings;
+
+    while (ring || n_rings)
+    {
+        if (ring)
+        {
+            uint64_t head = ring->lr_head;
+            uint64_t tail = ring->lr_tail;
+
+            /** The messages must be read only after the head */
+            __sync_synchronize();
+
+            if (head != tail)
+            {
+                size_t pos = tail & (LOGRING_SIZE - 1);
+                size_t len = head - tail;
+                size_t first = MIN(len, LOGRING_SIZE - pos);
+
+                iov[n_iov].iov_base = ring->lr_buf + pos;
+                iov[n_iov++].iov_len = first;
+
+                if (len > first)
+                {
+                    iov[n_iov].iov_base = ring->lr_buf;
+                    iov[n_iov++].iov_len = len - first;
+                }
+                rings[n_rings] = ring;
+                heads[n_rings++] = head;
+            }
+            ring = ring->lr_next;
+        }
+
+        if (n_rings && (ring == NULL || n_iov > LOGRING_IOV_MAX - 2))
+        {
+            if (err == 0 && (err = skygw_file_writev(fwr->fwr_file, iov, n_iov, flush)))
+            {
+                char errbuf[STRERROR_BUFLEN];
+                fprintf(stderr,
+                        "Error : Writing to the log-file %s failed due to (%d, %s). "
+                        "Disabling writing to the log.",
+                        lm->lm_logfile.lf_full_file_name,
+                        err,
+                        strerror_r(err, errbuf, sizeof(errbuf)));
+
+                mxs_log_set_maxlog_enabled(false);
+            }
+
+            /** The messages are released even if they could not be written */
+            for (int i = 0; i < n_rings; i++)
+            {
+                rings[i]->lr_tail = heads[i];
+            }
+            n_iov = 0;
+            n_rings = 0;
+        }
+    }
+
+    /**
+     * Free the empty rings of exited threads. The first ring is never
+     * unlinked as the logging threads may be adding rings in front of it.
+     */
+    logring_t* prev = logrings;
+
+    while (prev && (ring = prev->lr_next))
+    {
+        if (ring->lr_dead && ring->lr_head == ring->lr_tail)
+        {
+            prev->lr_next = ring->lr_next;
+            free(ring->lr_buf);
+            free(ring);
+        }
+        else
+        {
+            prev = ring;
+        }
+    }
+
+    return err == 0;
+}
+
+/**
+ * Refresh the cached timestamp of the log messages. This is called by the
+ * housekeeper on every heartbeat and only formats the time once a second.
+ */
+void mxs_log_update_clock(void)
+{
+    time_t t = time(NULL);
+
+    if (t != log_clock.lc_time)
+    {
+        log_clock.lc_seqno++;
+        __sync_synchronize();
+        log_clock.lc_len = snprint_timestamp(log_clock.lc_text, sizeof(log_clock.lc_text));
+        log_clock.lc_time = t;
+        __sync_synchronize();
+        log_clock.lc_seqno++;
+    }
+}
+
+/**
+ * Copy the cached timestamp. The cache is only used if it is for the
+ * current second, which is cheap to check compared to formatting the
+ * local time. If the housekeeper is not running or falls behind, the
+ * callers format the time themselves.
+ *
+ * @param p_ts  Where to write the timestamp
+ * @param tslen The size of p_ts
+ * @return The length of the timestamp or 0 if there is no valid cached one
+ */
+static size_t log_clock_copy(char* p_ts, size_t tslen)
+{
+    time_t now = time(NULL);
+    size_t len;
+    int seqno;
+
+    do
+    {
+        seqno = log_clock.lc_seqno;
+        __sync_synchronize();
+
+        if (log_clock.lc_time != now || (len = log_clock.lc_len) >= tslen)
+        {
+            return 0;
+        }
+        memcpy(p_ts, log_clock.lc_text, len + 1);
+        __sync_synchronize();
+    }
+    while (seqno % 2 != 0 || seqno != log_clock.lc_seqno);
+
+    return len;
+}
+
 /**
  * Register writer to a block buffer. When reference counter is non-zero the
  * flusher thread doesn't write the block to disk.
@@ -2212,6 +2560,8 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
 
     } /* while (node != NULL) */
 
+    logrings_write(fwr, flush_logfile || do_flushall);
+
     /**
      * Writer's exit flag was set after checking it.
      * Loop is restarted to ensure that all logfiles are
@@ -2278,6 +2628,7 @@ static void* thr_filewriter_fun(void* data)
     skygw_thread_t* thr = (skygw_thread_t *)data;
     filewriter_t*   fwr = (filewriter_t *)skygw_thread_get_data(thr);
 
+    logring_is_filewriter = true;
     flushall_logfiles(false);
 
     CHK_FILEWRITER(fwr);
@@ -2743,11 +3094,11 @@ static enum log_flush priority_to_flush(int priority)
  * @param line     The line where the message was logged.
  * @param function The function where the message was logged.
  * @param format   The printf format of the following arguments.
- * @param ...      Optional arguments according to the format.
+ * @param valist_in The arguments according to the format.
  */
-int mxs_log_message(int priority,
-                    const char* file, int line, const char* function,
-                    const char* format, ...)
+static int log_message(int priority,
+                       const char* file, int line, const char* function,
+                       const char* format, va_list valist_in)
 {
     int err = 0;
 
@@ -2762,7 +3113,7 @@ int mxs_log_message(int priority,
             /**
              * Find out the length of log string (to be formatted str).
              */
-            va_start(valist, format);
+            va_copy(valist, valist_in);
             int message_len = vsnprintf(NULL, 0, format, valist);
             va_end(valist);
 
@@ -2823,7 +3174,7 @@ int mxs_log_message(int priority,
                     assert(len == augmentation_len);
                 }
 
-                va_start(valist, format);
+                va_copy(valist, valist_in);
                 vsnprintf(message_text, message_len + 1, format, valist);
                 va_end(valist);
 
@@ -2840,3 +3191,208 @@ int mxs_log_message(int priority,
 
     return err;
 }
+
+/**
+ * Log a message without throttling it.
+ *
+ * @param priority One of the syslog constants
+ * @param format   The printf format of the following arguments.
+ * @param ...      Optional arguments according to the format.
+ */
+static void log_message_unthrottled(int priority, const char* format, ...)
+{
+    va_list valist;
+
+    va_start(valist, format);
+    log_message(priority, __FILE__, __LINE__, __func__, format, valist);
+    va_end(valist);
+}
+
+/**
+ * Current time of the monotonic clock in milliseconds. The coarse clock is
+ * read without a system call.
+ */
+static int64_t log_throttle_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Find the throttling slot of a call site.
+ *
+ * @param file The file of the site
+ * @param line The line of the site
+ * @return The slot or NULL if the slot belongs to another site
+ */
+static log_throttle_t* log_throttle_slot(const char* file, int line)
+{
+    uintptr_t hash = ((uintptr_t)file >> 3) ^ ((uintptr_t)line * 2654435761u);
+    log_throttle_t* slot = &log_throttles[hash & (LOG_THROTTLE_SLOTS - 1)];
+
+    if (slot->lt_file == NULL &&
+        __sync_bool_compare_and_swap(&slot->lt_file, (const char*)NULL, file))
+    {
+        slot->lt_line = line;
+    }
+
+    /** The line is stored after the file, a site that just lost the race is not throttled */
+    return slot->lt_file == file && slot->lt_line == line ? slot : NULL;
+}
+
+/**
+ * Report how many messages of a site were suppressed.
+ *
+ * @param slot The throttling slot of the site
+ */
+static void log_throttle_report(log_throttle_t* slot)
+{
+    int suppressed = __sync_lock_test_and_set(&slot->lt_suppressed, 0);
+
+    if (suppressed > 0)
+    {
+        const char* file = strrchr(slot->lt_file, '/');
+
+        log_message_unthrottled(slot->lt_priority,
+                                "The message logged at %s:%d was repeated %d times.",
+                                file ? file + 1 : slot->lt_file, slot->lt_line, suppressed);
+    }
+}
+
+/**
+ * Check whether a message should be suppressed. Errors and warnings that a
+ * call site logs more than log_throttling.count times within the window are
+ * suppressed for log_throttling.suppress_ms milliseconds.
+ *
+ * @param priority The priority of the message
+ * @param file     The file of the call site
+ * @param line     The line of the call site
+ * @return True if the message should not be logged
+ */
+static bool log_throttle(int priority, const char* file, int line)
+{
+    int count = log_throttling.count;
+
+    if (count == 0 || (priority != LOG_ERR && priority != LOG_WARNING) || file == NULL)
+    {
+        return false;
+    }
+
+    log_throttle_t* slot = log_throttle_slot(file, line);
+
+    if (slot == NULL)
+    {
+        return false;
+    }
+
+    int64_t now = log_throttle_now();
+
+    if (now < slot->lt_suppress_until)
+    {
+        atomic_add((int*)&slot->lt_suppressed, 1);
+        return true;
+    }
+
+    if (slot->lt_suppressed)
+    {
+        log_throttle_report(slot);
+    }
+
+    if (now - slot->lt_window_start >= log_throttling.window_ms)
+    {
+        slot->lt_window_start = now;
+        slot->lt_count = 0;
+    }
+
+    if (atomic_add((int*)&slot->lt_count, 1) + 1 == count)
+    {
+        slot->lt_priority = priority;
+        slot->lt_suppress_until = now + log_throttling.suppress_ms;
+        slot->lt_count = 0;
+
+        const char* name = strrchr(file, '/');
+        log_message_unthrottled(LOG_WARNING,
+                                "The message logged at %s:%d was logged %d times in %ld milliseconds, "
+                                "suppressing it for %ld milliseconds.",
+                                name ? name + 1 : file, line, count,
+                                (long)log_throttling.window_ms, (long)log_throttling.suppress_ms);
+    }
+
+    return false;
+}
+
+/**
+ * Report the messages of the sites whose suppression has ended. This is
+ * called periodically by the housekeeper, so a site that stops logging
+ * still gets its summary.
+ */
+void mxs_log_report_suppressed(void)
+{
+    int64_t now = log_throttle_now();
+
+    for (int i = 0; i < LOG_THROTTLE_SLOTS; i++)
+    {
+        log_throttle_t* slot = &log_throttles[i];
+
+        if (slot->lt_suppressed && now >= slot->lt_suppress_until)
+        {
+            log_throttle_report(slot);
+        }
+    }
+}
+
+/**
+ * Set the log throttling parameters.
+ *
+ * @param count       How many messages a site may log within the window, 0 disables throttling
+ * @param window_ms   The length of the window in milliseconds
+ * @param suppress_ms How long a site that exceeds the count is suppressed
+ */
+void mxs_log_set_throttling(int count, long window_ms, long suppress_ms)
+{
+    log_throttling.count = count;
+    log_throttling.window_ms = window_ms;
+    log_throttling.suppress_ms = suppress_ms;
+
+    if (count == 0)
+    {
+        MXS_NOTICE("Log throttling has been disabled.");
+    }
+    else
+    {
+        MXS_NOTICE("A message that is logged %d times in %ld milliseconds will be suppressed "
+                   "for %ld milliseconds.", count, window_ms, suppress_ms);
+    }
+}
+
+/**
+ * Log a message of a particular priority.
+ *
+ * Errors and warnings are throttled per call site. A suppressed message is
+ * not formatted at all.
+ *
+ * @param priority One of the syslog constants: LOG_ERR, LOG_WARNING, ...
+ * @param file     The name of the file where the message was logged.
+ * @param line     The line where the message was logged.
+ * @param function The function where the message was logged.
+ * @param format   The printf format of the following arguments.
+ * @param ...      Optional arguments according to the format.
+ */
+int mxs_log_message(int priority,
+                    const char* file, int line, const char* function,
+                    const char* format, ...)
+{
+    int err = 0;
+
+    if (!log_throttle(priority, file, line))
+    {
+        va_list valist;
+
+        va_start(valist, format);
+        err = log_message(priority, file, line, function, format, valist);
+        va_end(valist);
+    }
+
+    return err;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxscale_crc32.c  CRC-32 with the instructions of the processor
+ *
+ * The implementation is selected on the first call. On x86-64 the data is
+ * folded with carry-less multiplications 64 bytes at a time as described in
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+ * by Gopal et al, Intel 2009. On ARMv8 the CRC32 instructions process eight
+ * bytes at a time. Otherwise, and for what is left over, zlib is used.
+ */
+
+#include <maxscale_crc32.h>
+#include <limits.h>
+#include <string.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CRC32_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && !defined(__AARCH64EB__) && (defined(__clang__) || __GNUC__ >= 8)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+typedef uint32_t (*crc32_func_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t crc32_select(uint32_t crc, const uint8_t *buf, size_t len);
+
+/** The implementation for this processor, selected on the first call */
+static crc32_func_t crc32_func = crc32_select;
+
+/**
+ * CRC-32 with zlib, which takes at most UINT_MAX bytes at a time
+ */
+static uint32_t
+crc32_zlib(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        uInt n = len > UINT_MAX ? UINT_MAX : len;
+
+        crc = crc32(crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+
+    return crc;
+}
+
+#ifdef CRC32_PCLMUL
+
+/** The shortest data that is folded, four blocks of 16 bytes */
+#define CRC32_FOLD_MIN 64
+
+/**
+ * Fold the data into the CRC without the initial and final inversion.
+ * The constants are those of the bit-reflected IEEE polynomial in the paper.
+ *
+ * @param buf   The data
+ * @param len   Length of the data, a multiple of 16 and at least CRC32_FOLD_MIN
+ * @param crc   The inverted CRC of the preceding data
+ * @return The inverted CRC
+ */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t
+crc32_fold(const uint8_t *buf, size_t len, uint32_t crc)
+{
+    static const uint64_t k1k2[] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /** Fold four blocks in parallel */
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    /** Fold the four blocks into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /** Fold the remaining blocks one at a time */
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    /** Fold 128 bits to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /** Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+/**
+ * CRC-32 with carry-less multiplication
+ */
+static uint32_t
+crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len >= CRC32_FOLD_MIN)
+    {
+        size_t n = len & ~(size_t)15;
+
+        crc = ~crc32_fold(buf, n, ~crc);
+        buf += n;
+        len -= n;
+    }
+
+    return crc32_zlib(crc, buf, len);
+}
+
+#endif /* CRC32_PCLMUL */
+
+#ifdef CRC32_ARMV8
+
+/**
+ * CRC-32 with the CRC32 instructions of ARMv8
+ */
+__attribute__((target("+crc")))
+static uint32_t
+crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+
+    while (len > 0 && ((uintptr_t)buf & 7))
+    {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+    while (len >= 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0)
+    {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+    return ~crc;
+}
+
+#endif /* CRC32_ARMV8 */
+
+/**
+ * Select the implementation for the processor and compute the CRC with it.
+ * Threads that call this at the same time select the same implementation.
+ */
+static uint32_t
+crc32_select(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc32_func_t func = crc32_zlib;
+
+#if defined(CRC32_PCLMUL)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1))
+    {
+        func = crc32_pclmul;
+    }
+#elif defined(CRC32_ARMV8)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        func = crc32_armv8;
+    }
+#endif
+
+    crc32_func = func;
+
+    return func(crc, buf, len);
+}
+
+uint32_t
+mxs_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    return buf ? crc32_func(crc, (const uint8_t *)buf, len) : 0;
+}
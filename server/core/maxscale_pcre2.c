@@ -24,7 +24,189 @@
  * @endverbatim
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <platform.h>
 #include <maxscale_pcre2.h>
+#include <log_manager.h>
+
+/** The initial and the largest size of the JIT stack of a thread */
+#define MXS_PCRE2_JIT_STACK_START   (32 * 1024)
+#define MXS_PCRE2_JIT_STACK_MAX     (512 * 1024)
+
+/**
+ * The matching resources of a thread. The match data is shared by all the
+ * patterns the thread matches and it is grown for patterns with more
+ * capturing groups than any before.
+ */
+typedef struct
+{
+    pcre2_match_data    *match_data;    /*< The match data of the thread */
+    uint32_t            n_pairs;        /*< The number of ovector pairs in the match data */
+    pcre2_match_context *context;       /*< Match context with the JIT stack assigned */
+    pcre2_jit_stack     *jit_stack;     /*< The JIT stack of the thread */
+} MXS_PCRE2_THREAD;
+
+static thread_local MXS_PCRE2_THREAD *pcre2_thread = NULL;
+static pthread_key_t pcre2_thread_key;
+static pthread_once_t pcre2_thread_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Free the matching resources of a thread when it exits.
+ */
+static void pcre2_thread_free(void *data)
+{
+    MXS_PCRE2_THREAD *pt = (MXS_PCRE2_THREAD*)data;
+
+    pcre2_match_data_free(pt->match_data);
+    pcre2_match_context_free(pt->context);
+    pcre2_jit_stack_free(pt->jit_stack);
+    free(pt);
+}
+
+static void pcre2_thread_key_create(void)
+{
+    pthread_key_create(&pcre2_thread_key, pcre2_thread_free);
+}
+
+/**
+ * Get the matching resources of the calling thread, allocating them on the
+ * first call of the thread.
+ *
+ * @return The resources of the thread or NULL if memory allocation failed
+ */
+static MXS_PCRE2_THREAD *pcre2_thread_get(void)
+{
+    if (pcre2_thread == NULL)
+    {
+        MXS_PCRE2_THREAD *pt = calloc(1, sizeof(MXS_PCRE2_THREAD));
+
+        if (pt == NULL || (pt->context = pcre2_match_context_create(NULL)) == NULL)
+        {
+            free(pt);
+            return NULL;
+        }
+
+        /** Without a JIT stack of its own the thread uses the 32kB default on the machine stack */
+        if ((pt->jit_stack = pcre2_jit_stack_create(MXS_PCRE2_JIT_STACK_START,
+                                                    MXS_PCRE2_JIT_STACK_MAX, NULL)))
+        {
+            pcre2_jit_stack_assign(pt->context, NULL, pt->jit_stack);
+        }
+
+        pthread_once(&pcre2_thread_once, pcre2_thread_key_create);
+        pthread_setspecific(pcre2_thread_key, pt);
+        pcre2_thread = pt;
+    }
+
+    return pcre2_thread;
+}
+
+/**
+ * Compile a pattern and, if the library supports it, compile it further
+ * with the just-in-time compiler. A pattern that can not be JIT compiled is
+ * matched with the interpreter.
+ *
+ * @param pattern   The pattern to compile
+ * @param options   PCRE2 compilation options
+ * @param error     The PCRE2 error code is stored here if the compilation fails
+ * @param erroffset The offset of the error is stored here if the compilation fails
+ * @return The compiled pattern or NULL if the compilation failed
+ */
+pcre2_code *mxs_pcre2_compile(const char *pattern, int options, int *error, size_t *erroffset)
+{
+    pcre2_code *re = pcre2_compile((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+                                   options, error, erroffset, NULL);
+
+    if (re)
+    {
+        int rc = pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+
+        if (rc < 0)
+        {
+            MXS_DEBUG("Pattern '%s' could not be JIT compiled (%d), using the interpreter.",
+                      pattern, rc);
+        }
+    }
+
+    return re;
+}
+
+/**
+ * Get the match data of the calling thread for a pattern. The match data has
+ * room for all the capturing groups of the pattern. It stays valid until the
+ * next call to this function or to mxs_pcre2_substitute() by the same thread,
+ * so it must not be kept over calls that may match other patterns.
+ *
+ * @param re The compiled pattern
+ * @return The match data or NULL if memory allocation failed
+ */
+pcre2_match_data *mxs_pcre2_match_data(const pcre2_code *re)
+{
+    MXS_PCRE2_THREAD *pt = pcre2_thread_get();
+    uint32_t n_captures = 0;
+
+    if (pt == NULL)
+    {
+        return NULL;
+    }
+
+    pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &n_captures);
+
+    if (pt->match_data == NULL || pt->n_pairs < n_captures + 1)
+    {
+        pcre2_match_data *mdata = pcre2_match_data_create(n_captures + 1, NULL);
+
+        if (mdata == NULL)
+        {
+            return NULL;
+        }
+
+        pcre2_match_data_free(pt->match_data);
+        pt->match_data = mdata;
+        pt->n_pairs = n_captures + 1;
+    }
+
+    return pt->match_data;
+}
+
+/**
+ * Get the match context of the calling thread. The context uses the JIT
+ * stack of the thread, so patterns that need more than the default 32kB of
+ * JIT stack can be matched.
+ *
+ * @return The match context or NULL if memory allocation failed, in which
+ * case the default context is used by PCRE2
+ */
+pcre2_match_context *mxs_pcre2_match_context(void)
+{
+    MXS_PCRE2_THREAD *pt = pcre2_thread_get();
+    return pt ? pt->context : NULL;
+}
+
+/**
+ * Match a subject against a pattern with the match data and the JIT stack of
+ * the calling thread.
+ *
+ * @param re      The compiled pattern
+ * @param subject The subject string
+ * @param length  The length of the subject or PCRE2_ZERO_TERMINATED
+ * @return The return value of pcre2_match, PCRE2_ERROR_NOMEMORY if the
+ * match data could not be allocated
+ */
+int mxs_pcre2_match(const pcre2_code *re, const char *subject, size_t length)
+{
+    pcre2_match_data *mdata = mxs_pcre2_match_data(re);
+
+    if (mdata == NULL)
+    {
+        return PCRE2_ERROR_NOMEMORY;
+    }
+
+    return pcre2_match(re, (PCRE2_SPTR) subject, length, 0, 0, mdata, mxs_pcre2_match_context());
+}
 
 /**
  * Utility wrapper for PCRE2 library function call pcre2_substitute.
@@ -47,12 +229,12 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject, con
 {
     int rc;
     mxs_pcre2_result_t rval = MXS_PCRE2_ERROR;
-    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(re, NULL);
+    pcre2_match_data *mdata = mxs_pcre2_match_data(re);
 
     if (mdata)
     {
         while ((rc = pcre2_substitute(re, (PCRE2_SPTR) subject, PCRE2_ZERO_TERMINATED, 0,
-                                      PCRE2_SUBSTITUTE_GLOBAL, mdata, NULL,
+                                      PCRE2_SUBSTITUTE_GLOBAL, mdata, mxs_pcre2_match_context(),
                                       (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
                                       (PCRE2_UCHAR*) *dest, size)) == PCRE2_ERROR_NOMEMORY)
         {
@@ -73,7 +255,6 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject, con
         {
             rval = MXS_PCRE2_NOMATCH;
         }
-        pcre2_match_data_free(mdata);
     }
 
     return rval;
@@ -103,7 +284,7 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
                                    options, &err, &erroff, NULL);
     if (re)
     {
-        pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(re, NULL);
+        pcre2_match_data *mdata = mxs_pcre2_match_data(re);
         if (mdata)
         {
             int rc = pcre2_match(re, (PCRE2_SPTR) subject, PCRE2_ZERO_TERMINATED,
@@ -118,7 +299,6 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
                  * pcre2_match will never return 0 */
                 rval = MXS_PCRE2_MATCH;
             }
-            pcre2_match_data_free(mdata);
         }
         else
         {
@@ -132,3 +312,272 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
     }
     return rval;
 }
+
+/**
+ * Skip a bracket expression
+ *
+ * @param ptr    The opening bracket
+ * @param pcre   Whether a backslash escapes a character inside the brackets
+ * @return The character after the closing bracket or NULL if there is none
+ */
+static const char *skip_bracket(const char *ptr, bool pcre)
+{
+    ptr++;
+
+    if (*ptr == '^')
+    {
+        ptr++;
+    }
+    if (*ptr == ']')
+    {
+        ptr++;
+    }
+
+    while (*ptr && *ptr != ']')
+    {
+        if (*ptr == '[' && (ptr[1] == ':' || ptr[1] == '.' || ptr[1] == '='))
+        {
+            /** A character class like [:alpha:] */
+            const char *end = strchr(ptr + 2, ptr[1]);
+            while (end && end[1] != ']')
+            {
+                end = strchr(end + 1, ptr[1]);
+            }
+            if (end == NULL)
+            {
+                return NULL;
+            }
+            ptr = end + 2;
+        }
+        else if (pcre && *ptr == '\\' && ptr[1])
+        {
+            ptr += 2;
+        }
+        else
+        {
+            ptr++;
+        }
+    }
+
+    return *ptr ? ptr + 1 : NULL;
+}
+
+/**
+ * Skip a group
+ *
+ * @param ptr The opening parenthesis
+ * @param pcre Whether the pattern is a PCRE2 pattern
+ * @return The character after the closing parenthesis or NULL if there is none
+ */
+static const char *skip_group(const char *ptr, bool pcre)
+{
+    int depth = 0;
+
+    while (*ptr)
+    {
+        if (*ptr == '\\' && ptr[1])
+        {
+            ptr += 2;
+        }
+        else if (*ptr == '[')
+        {
+            if ((ptr = skip_bracket(ptr, pcre)) == NULL)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            if (*ptr == '(')
+            {
+                depth++;
+            }
+            else if (*ptr == ')' && --depth == 0)
+            {
+                return ptr + 1;
+            }
+            ptr++;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Find a literal string that every match of a pattern contains
+ *
+ * The pattern is only analysed as far as it is plainly a sequence of
+ * characters, groups, bracket expressions and quantifiers. Anything else,
+ * like an alternative at the top level or an inline option, means that no
+ * literal is returned. A subject that does not contain the literal cannot
+ * match the pattern, so it does not need to be matched.
+ *
+ * The literal is made of ASCII characters only. If the pattern is caseless,
+ * the literal must be looked for without regard to case.
+ *
+ * @param pattern  The pattern
+ * @param syntax   The syntax of the pattern
+ * @param extended Whether the pattern is compiled with PCRE2_EXTENDED
+ * @return The longest such literal or NULL if there is none that has at least
+ * MXS_REGEX_LITERAL_MIN characters. The caller must free the literal.
+ */
+char *mxs_pcre2_required_literal(const char *pattern, mxs_regex_syntax_t syntax, bool extended)
+{
+    bool pcre = syntax == MXS_REGEX_PCRE2;
+    bool basic = syntax == MXS_REGEX_POSIX_BASIC;
+    const char *escaped = basic ? ".[]*^$\\/" : ".[](){}*+?|^$\\/-";
+    const char *ptr = pattern;
+    size_t len = strlen(pattern);
+    char run[len + 1], best[len + 1];
+    size_t n_run = 0, n_best = 0;
+    bool end_run = false;
+
+    if (pcre && extended)
+    {
+        /** Whitespace and comments are ignored */
+        return NULL;
+    }
+
+    while (*ptr)
+    {
+        unsigned char c = *ptr;
+
+        if (c == '\\')
+        {
+            c = ptr[1];
+            if (c && strchr(escaped, c))
+            {
+                run[n_run++] = c;
+            }
+            else if (c && !basic && strchr("dDsSwWbBAzZGhHvVnrtfe", c))
+            {
+                end_run = true;
+            }
+            else
+            {
+                return NULL;
+            }
+            ptr += 2;
+        }
+        else if (c == '[')
+        {
+            if ((ptr = skip_bracket(ptr, pcre)) == NULL)
+            {
+                return NULL;
+            }
+            end_run = true;
+        }
+        else if (c == '.' || c == '^' || c == '$' || c >= 0x80)
+        {
+            end_run = true;
+            ptr++;
+        }
+        else if (c == '*' || (!basic && (c == '?' || c == '+' || c == '{')))
+        {
+            if (c == '{')
+            {
+                /** Only a complete {n}, {n,} or {n,m} is a quantifier */
+                const char *end = ptr + 1;
+                while (isdigit(*end) || *end == ',')
+                {
+                    end++;
+                }
+                if (*end != '}' || !isdigit(ptr[1]))
+                {
+                    return NULL;
+                }
+                ptr = end;
+            }
+
+            /** The preceding character is not required, except with + */
+            if (c != '+' && n_run > 0)
+            {
+                n_run--;
+            }
+            ptr++;
+
+            /** Lazy and possessive quantifiers */
+            if (pcre && (*ptr == '?' || *ptr == '+'))
+            {
+                ptr++;
+            }
+            end_run = true;
+        }
+        else if (!basic && c == '(')
+        {
+            if (pcre && (ptr[1] == '*' || (ptr[1] == '?' && ptr[2] != 'P' &&
+                                           (isalpha(ptr[2]) || ptr[2] == '-' || ptr[2] == '^'))))
+            {
+                /** Inline options and verbs can change how the rest is matched */
+                return NULL;
+            }
+            if ((ptr = skip_group(ptr, pcre)) == NULL)
+            {
+                return NULL;
+            }
+            end_run = true;
+        }
+        else if (!basic && (c == '|' || c == ')' || c == '}'))
+        {
+            return NULL;
+        }
+        else
+        {
+            run[n_run++] = c;
+            ptr++;
+        }
+
+        if (end_run || *ptr == '\0')
+        {
+            if (n_run > n_best)
+            {
+                memcpy(best, run, n_run);
+                n_best = n_run;
+            }
+            n_run = 0;
+            end_run = false;
+        }
+    }
+
+    char *rval = NULL;
+
+    if (n_best >= MXS_REGEX_LITERAL_MIN && (rval = malloc(n_best + 1)))
+    {
+        memcpy(rval, best, n_best);
+        rval[n_best] = '\0';
+    }
+
+    return rval;
+}
+
+/**
+ * Check whether a subject contains a literal found with
+ * mxs_pcre2_required_literal()
+ *
+ * @param literal  The literal
+ * @param subject  The subject, need not be null-terminated
+ * @param length   The length of the subject
+ * @param caseless Whether the case is ignored
+ * @return True if the subject contains the literal
+ */
+bool mxs_pcre2_literal_found(const char *literal, const char *subject, size_t length, bool caseless)
+{
+    size_t n = strlen(literal);
+
+    if (!caseless)
+    {
+        return memmem(subject, length, literal, n) != NULL;
+    }
+
+    int first = tolower((unsigned char)*literal);
+
+    for (const char *ptr = subject, *end = subject + length; (size_t)(end - ptr) >= n; ptr++)
+    {
+        if (tolower((unsigned char)*ptr) == first && strncasecmp(ptr, literal, n) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -27,6 +27,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <atomic.h>
+#include <platform.h>
+#include <dcb.h>
+#include <session.h>
 
 static MEMLOG *memlogs = NULL;
 static SPINLOCK memlock = SPINLOCK_INIT;
@@ -264,3 +269,282 @@ memlog_flush(MEMLOG *log)
     log->offset = 0;
     fclose(fp);
 }
+
+/**
+ * The ring of a thread. The head is the number of records written, the
+ * writer updates it only after the record is complete.
+ */
+typedef struct memlog_ring
+{
+    uint64_t        head;
+    MEMLOG_RECORD   records[];
+} MEMLOG_RING;
+
+int memlog_ring_size = 0;
+
+static MEMLOG_RING *rings[MEMLOG_MAX_RINGS];
+static int n_rings = 0;
+
+/** The ring of the calling thread, NULL if the thread has none yet */
+static thread_local MEMLOG_RING *thread_ring = NULL;
+
+/** The thread could not get a ring and does not log */
+static thread_local bool thread_no_ring = false;
+
+/**
+ * Enable the ring logs
+ *
+ * This must be called once before the poll threads are started. The rings
+ * are allocated when the threads log their first records.
+ *
+ * @param size  The number of records in each ring, rounded up to a power
+ *              of two, 0 to disable the rings
+ */
+void
+memlog_ring_init(int size)
+{
+    int n = 1;
+
+    while (size > 0 && n < size)
+    {
+        n <<= 1;
+    }
+
+    memlog_ring_size = size > 0 ? n : 0;
+}
+
+/**
+ * Allocate the ring of the calling thread
+ *
+ * @return The ring or NULL if there are too many threads or no memory
+ */
+static MEMLOG_RING *
+ring_alloc()
+{
+    int index = atomic_add(&n_rings, 1);
+    MEMLOG_RING *ring;
+
+    if (index >= MEMLOG_MAX_RINGS ||
+        (ring = calloc(1, sizeof(MEMLOG_RING) +
+                       memlog_ring_size * sizeof(MEMLOG_RECORD))) == NULL)
+    {
+        thread_no_ring = true;
+        return NULL;
+    }
+
+    __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/**
+ * Log a record to the ring of the calling thread
+ *
+ * Use memlog_ring_log, which does nothing if the rings are disabled.
+ *
+ * @param type      The type of the record
+ * @param object    The DCB or session the record is about
+ * @param arg1      The first argument
+ * @param arg2      The second argument
+ */
+void
+memlog_ring_record(MEMLOG_RECORD_TYPE type, const void *object, intptr_t arg1, intptr_t arg2)
+{
+    MEMLOG_RING *ring = thread_ring;
+
+    if (ring == NULL)
+    {
+        if (thread_no_ring || (ring = thread_ring = ring_alloc()) == NULL)
+        {
+            return;
+        }
+    }
+
+    struct timespec ts;
+    uint64_t head = ring->head;
+    MEMLOG_RECORD *record = &ring->records[head & (memlog_ring_size - 1)];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->object = object;
+    record->args[0] = arg1;
+    record->args[1] = arg2;
+    record->type = type;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read the oldest record of a ring that has not been overwritten
+ *
+ * The writer may overwrite the record while it is being copied. The copy is
+ * valid only if the writer had not yet started on the slot after the copy.
+ *
+ * @param ring      The ring
+ * @param pos       The position of the next record to read, updated
+ * @param end       The head of the ring when the dump started
+ * @param record    The record is copied here
+ * @return True if a record was read, false if the ring has been read
+ */
+static bool
+ring_peek(MEMLOG_RING *ring, uint64_t *pos, uint64_t end, MEMLOG_RECORD *record)
+{
+    while (*pos < end)
+    {
+        *record = ring->records[*pos & (memlog_ring_size - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) < *pos + memlog_ring_size)
+        {
+            return true;
+        }
+
+        (*pos)++;
+    }
+
+    return false;
+}
+
+/**
+ * Format a record
+ *
+ * @param record    The record
+ * @param ring      The number of the ring it was read from
+ * @param now       The time of the dump
+ * @param buf       The buffer for the line
+ * @param len       Length of the buffer
+ */
+static void
+record_format(MEMLOG_RECORD *record, int ring, uint64_t now, char *buf, size_t len)
+{
+    int64_t ago = now > record->timestamp ? now - record->timestamp : 0;
+    int n = snprintf(buf, len, "-%ld.%09ld  %3d  %-14p ", (long)(ago / 1000000000),
+                     (long)(ago % 1000000000), ring, record->object);
+
+    if (n < 0 || (size_t)n >= len)
+    {
+        return;
+    }
+
+    buf += n;
+    len -= n;
+
+    switch (record->type)
+    {
+    case MLR_EVENT:
+        snprintf(buf, len, "event 0x%lx on fd %ld",
+                 (long)record->args[0], (long)record->args[1]);
+        break;
+    case MLR_DCB_STATE:
+        snprintf(buf, len, "dcb %s -> %s",
+                 gw_dcb_state2string(record->args[0]),
+                 gw_dcb_state2string(record->args[1]));
+        break;
+    case MLR_SESSION_STATE:
+        snprintf(buf, len, "session %s -> %s",
+                 session_state(record->args[0]),
+                 session_state(record->args[1]));
+        break;
+    case MLR_PROTOCOL_STATE:
+        snprintf(buf, len, "protocol %s -> %s",
+                 (const char *)record->args[0], (const char *)record->args[1]);
+        break;
+    default:
+        snprintf(buf, len, "unknown record type %d", record->type);
+        break;
+    }
+}
+
+/**
+ * Dump the records of all rings, merged by time
+ *
+ * The records that are written during the dump are not included. The dump
+ * does not allocate memory, so it can be called from a fatal signal handler.
+ *
+ * @param print     Called with each formatted line
+ * @param data      Passed to the print function
+ * @return The number of records dumped
+ */
+int
+memlog_ring_dump(void (*print)(void *, const char *), void *data)
+{
+    uint64_t pos[MEMLOG_MAX_RINGS];
+    uint64_t end[MEMLOG_MAX_RINGS];
+    int n = __atomic_load_n(&n_rings, __ATOMIC_ACQUIRE);
+    int count = 0;
+    struct timespec ts;
+    char line[256];
+
+    if (memlog_ring_size == 0)
+    {
+        return 0;
+    }
+
+    n = n < MEMLOG_MAX_RINGS ? n : MEMLOG_MAX_RINGS;
+
+    for (int i = 0; i < n; i++)
+    {
+        MEMLOG_RING *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+        end[i] = ring ? __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) : 0;
+        /** The oldest slot of a full ring may be in the middle of being
+         * overwritten by the next record */
+        pos[i] = end[i] >= memlog_ring_size ? end[i] - memlog_ring_size + 1 : 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    while (true)
+    {
+        MEMLOG_RECORD record, oldest;
+        int oldest_ring = -1;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (ring_peek(rings[i], &pos[i], end[i], &record) &&
+                (oldest_ring == -1 || record.timestamp < oldest.timestamp))
+            {
+                oldest = record;
+                oldest_ring = i;
+            }
+        }
+
+        if (oldest_ring == -1)
+        {
+            break;
+        }
+
+        pos[oldest_ring]++;
+        record_format(&oldest, oldest_ring, now, line, sizeof(line));
+        print(data, line);
+        count++;
+    }
+
+    return count;
+}
+
+static void
+dcb_print_line(void *data, const char *line)
+{
+    dcb_printf((DCB *)data, "%s\n", line);
+}
+
+/**
+ * Print the ring logs to a DCB
+ *
+ * @param dcb   The DCB to print to
+ */
+void
+dShowMemlogRings(DCB *dcb)
+{
+    if (memlog_ring_size == 0)
+    {
+        dcb_printf(dcb, "The flight recorder is disabled, set flight_recorder_size to enable it.\n");
+        return;
+    }
+
+    dcb_printf(dcb, "Seconds ago   Thread  Object          Record\n");
+    dcb_printf(dcb, "------------+-------+---------------+---------------------------------------\n");
+    int n = memlog_ring_dump(dcb_print_line, dcb);
+    dcb_printf(dcb, "%d records\n", n);
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.c - The statistics in the OpenMetrics text format
+ *
+ * The metrics are written into one buffer in a single pass over the servers,
+ * the services, the filters and the polling threads. The counters are read
+ * from the per-thread statistics and the objects without locking them, so
+ * generating the metrics does not stall the threads that update them. Only
+ * the spinlocks of the lists of objects are held while the lists are walked
+ * and those are taken by nothing but configuration changes.
+ *
+ * The text format is described at https://openmetrics.io/.
+ */
+
+#include <metrics.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <server.h>
+#include <service.h>
+#include <filter.h>
+#include <maxscale/poll.h>
+
+/** Initial size of the text */
+#define METRICS_INITIAL_SIZE 16384
+
+/**
+ * Append text to the metrics
+ *
+ * @param metrics The metrics
+ * @param str The text
+ * @param len Length of the text
+ */
+static void
+metrics_append(METRICS *metrics, const char *str, size_t len)
+{
+    if (metrics->failed)
+    {
+        return;
+    }
+
+    if (metrics->length + len > metrics->size)
+    {
+        size_t size = metrics->size ? metrics->size : METRICS_INITIAL_SIZE;
+
+        while (size < metrics->length + len)
+        {
+            size *= 2;
+        }
+
+        char *data = realloc(metrics->data, size);
+
+        if (data == NULL)
+        {
+            metrics->failed = true;
+            return;
+        }
+
+        metrics->data = data;
+        metrics->size = size;
+    }
+
+    memcpy(metrics->data + metrics->length, str, len);
+    metrics->length += len;
+}
+
+static inline void
+metrics_append_str(METRICS *metrics, const char *str)
+{
+    metrics_append(metrics, str, strlen(str));
+}
+
+/**
+ * Start a metric family
+ *
+ * @param metrics The metrics
+ * @param name Name of the family
+ * @param type Type of the family, e.g. counter or gauge
+ * @param help Description of the family
+ */
+void
+metrics_family(METRICS *metrics, const char *name, const char *type, const char *help)
+{
+    metrics_append_str(metrics, "# TYPE ");
+    metrics_append_str(metrics, name);
+    metrics_append_str(metrics, " ");
+    metrics_append_str(metrics, type);
+    metrics_append_str(metrics, "\n# HELP ");
+    metrics_append_str(metrics, name);
+    metrics_append_str(metrics, " ");
+    metrics_append_str(metrics, help);
+    metrics_append_str(metrics, "\n");
+}
+
+/**
+ * Start a sample of the current family. The labels follow and the value
+ * ends the sample.
+ *
+ * @param metrics The metrics
+ * @param name Name of the family
+ * @param suffix Suffix of the sample, e.g. _total for counters, or NULL
+ */
+void
+metrics_sample(METRICS *metrics, const char *name, const char *suffix)
+{
+    metrics_append_str(metrics, name);
+
+    if (suffix)
+    {
+        metrics_append_str(metrics, suffix);
+    }
+
+    metrics->n_labels = 0;
+}
+
+/**
+ * Add a label to the current sample
+ *
+ * @param metrics The metrics
+ * @param name Name of the label
+ * @param value Value of the label, NULL for an empty value
+ */
+void
+metrics_label(METRICS *metrics, const char *name, const char *value)
+{
+    if (value == NULL)
+    {
+        value = "";
+    }
+
+    metrics_append_str(metrics, metrics->n_labels++ ? "," : "{");
+    metrics_append_str(metrics, name);
+    metrics_append_str(metrics, "=\"");
+
+    for (const char *ptr = value; *ptr; ptr++)
+    {
+        switch (*ptr)
+        {
+        case '\\':
+            metrics_append(metrics, "\\\\", 2);
+            break;
+
+        case '"':
+            metrics_append(metrics, "\\\"", 2);
+            break;
+
+        case '\n':
+            metrics_append(metrics, "\\n", 2);
+            break;
+
+        default:
+            metrics_append(metrics, ptr, 1);
+            break;
+        }
+    }
+
+    metrics_append_str(metrics, "\"");
+}
+
+/**
+ * Add a numeric label to the current sample
+ *
+ * @param metrics The metrics
+ * @param name Name of the label
+ * @param value Value of the label
+ */
+void
+metrics_label_int(METRICS *metrics, const char *name, int value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", value);
+    metrics_label(metrics, name, buf);
+}
+
+/**
+ * End the current sample with an integer value
+ *
+ * @param metrics The metrics
+ * @param value The value
+ */
+void
+metrics_value(METRICS *metrics, int64_t value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s %lld\n", metrics->n_labels ? "}" : "", (long long)value);
+    metrics_append_str(metrics, buf);
+}
+
+/**
+ * End the current sample with a floating point value
+ *
+ * @param metrics The metrics
+ * @param value The value
+ */
+void
+metrics_value_double(METRICS *metrics, double value)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s %g\n", metrics->n_labels ? "}" : "", value);
+    metrics_append_str(metrics, buf);
+}
+
+/**
+ * Generate the metrics of all servers, services, filters and polling threads
+ *
+ * @return The metrics in the OpenMetrics text format or NULL if memory
+ * allocation failed
+ */
+GWBUF *
+metrics_generate()
+{
+    METRICS metrics;
+    GWBUF *rval = NULL;
+
+    memset(&metrics, 0, sizeof(metrics));
+
+    serverWriteMetrics(&metrics);
+    serviceWriteMetrics(&metrics);
+    filterWriteMetrics(&metrics);
+    pollWriteMetrics(&metrics);
+    metrics_append_str(&metrics, "# EOF\n");
+
+    if (!metrics.failed)
+    {
+        rval = gwbuf_alloc_and_load(metrics.length, metrics.data);
+    }
+
+    free(metrics.data);
+    return rval;
+}
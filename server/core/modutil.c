@@ -29,6 +29,8 @@
 #include <mysql_client_server_protocol.h>
 #include <maxscale/poll.h>
 #include <modutil.h>
+#include <mysql_utils.h>
+#include <mysql_wire.h>
 #include <strings.h>
 
 /** These are used when converting MySQL wildcards to regular expressions */
@@ -91,39 +93,162 @@ modutil_is_SQL_prepare(GWBUF *buf)
 }
 
 /**
- * Extract the SQL portion of a COM_QUERY packet
+ * The copy of the SQL of a packet that is cached in the buffer
+ */
+typedef struct
+{
+    int  length;        /*< The length of the SQL */
+    char sql[];         /*< The SQL, null terminated */
+} SQL_TEXT;
+
+/**
+ * Check if a GWBUF structure is a MySQL packet whose payload is SQL text;
+ * COM_QUERY, COM_STMT_PREPARE or COM_INIT_DB
  *
- * NB This sets *sql to point into the packet and does not
- * allocate any new storage. The string pointed to by *sql is
- * not NULL terminated.
+ * @param       buf     Buffer to check
+ * @return      True if the packet contains SQL text
+ */
+static bool
+modutil_has_SQL_text(GWBUF *buf)
+{
+    return modutil_is_SQL(buf) || modutil_is_SQL_prepare(buf) ||
+           (GWBUF_LENGTH(buf) >= 5 && MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(buf)));
+}
+
+/**
+ * Return the copy of the SQL of a packet that is cached in the buffer,
+ * copying it first if there is none.
  *
- * This routine is very simplistic and does not deal with SQL text
- * that spans multiple buffers.
+ * @param       buf     A packet for which modutil_has_SQL_text() is true
+ * @return      The copy or NULL if memory allocation failed
+ */
+static SQL_TEXT *
+modutil_cached_SQL(GWBUF *buf)
+{
+    SQL_TEXT *text = (SQL_TEXT *)gwbuf_get_buffer_object_data(buf, GWBUF_SQL_TEXT);
+
+    if (text == NULL)
+    {
+        int length = MYSQL_GET_PACKET_LEN((uint8_t*)GWBUF_DATA(buf)) - 1;
+
+        if (length < 0)
+        {
+            length = 0;
+        }
+
+        if ((text = (SQL_TEXT *)malloc(sizeof(SQL_TEXT) + length + 1)) == NULL)
+        {
+            return NULL;
+        }
+
+        /** The buffer may hold only a part of the packet */
+        text->length = gwbuf_copy_data(buf, MYSQL_HEADER_LEN + 1, length, (uint8_t*)text->sql);
+        text->sql[text->length] = '\0';
+
+        if (!gwbuf_add_buffer_object(buf, GWBUF_SQL_TEXT, text, free))
+        {
+            free(text);
+            text = NULL;
+        }
+    }
+
+    return text;
+}
+
+/**
+ * Get a view of the SQL of a COM_QUERY, COM_STMT_PREPARE or COM_INIT_DB
+ * packet without copying it.
  *
- * The length returned is the complete length of the SQL, which may
- * be larger than the amount of data in this packet.
+ * If the SQL is in the first buffer of the chain, *sql points into the
+ * packet. Otherwise the SQL is copied once and the copy is kept in the
+ * buffer, so the other callers that look at the same buffer get the same
+ * copy. The string is not null terminated. It is valid until the buffer is
+ * freed or the SQL is replaced with modutil_replace_SQL().
+ *
+ * @param       buf     The packet buffer
+ * @param       sql     Pointer that is set to point at the SQL
+ * @param       length  Set to the length of the SQL
+ * @return      True if the packet contains SQL
+ */
+bool
+modutil_get_SQL_view(GWBUF *buf, const char **sql, int *length)
+{
+    if (!modutil_has_SQL_text(buf))
+    {
+        return false;
+    }
+
+    int len = MYSQL_GET_PACKET_LEN((uint8_t*)GWBUF_DATA(buf)) - 1;
+
+    if (len >= 0 && (int)GWBUF_LENGTH(buf) >= MYSQL_HEADER_LEN + 1 + len)
+    {
+        *sql = (char*)GWBUF_DATA(buf) + MYSQL_HEADER_LEN + 1;
+        *length = len;
+        return true;
+    }
+
+    SQL_TEXT *text = modutil_cached_SQL(buf);
+
+    if (text == NULL)
+    {
+        return false;
+    }
+
+    *sql = text->sql;
+    *length = text->length;
+    return true;
+}
+
+/**
+ * Get the SQL of a COM_QUERY, COM_STMT_PREPARE or COM_INIT_DB packet as a
+ * null terminated string.
+ *
+ * The SQL is copied once and the copy is kept in the buffer, so the other
+ * callers that look at the same buffer, including modutil_get_SQL_view(),
+ * get the same copy. The string must not be modified or freed by the caller
+ * and it is valid until the buffer is freed or the SQL is replaced with
+ * modutil_replace_SQL(). Callers that can deal with a length should use
+ * modutil_get_SQL_view(), which avoids the copy for contiguous buffers.
+ *
+ * @param       buf     The packet buffer
+ * @return      The SQL or NULL if the packet does not contain SQL
+ */
+const char *
+modutil_get_SQL_string(GWBUF *buf)
+{
+    SQL_TEXT *text = NULL;
+
+    if (modutil_has_SQL_text(buf))
+    {
+        text = modutil_cached_SQL(buf);
+    }
+
+    return text ? text->sql : NULL;
+}
+
+/**
+ * Extract the SQL portion of a COM_QUERY packet
+ *
+ * NB This sets *sql to point into the packet or into the copy of the SQL
+ * that is kept in the buffer, see modutil_get_SQL_view(). It does not
+ * allocate any storage for the caller. The string pointed to by *sql is
+ * not NULL terminated.
  *
  * @param       buf     The packet buffer
  * @param       sql     Pointer that is set to point at the SQL data
- * @param       length  Length of the SQL query data
+ * @param       length  Length of the SQL data
  * @return      True if the packet is a COM_QUERY packet
  */
 int
 modutil_extract_SQL(GWBUF *buf, char **sql, int *length)
 {
-    unsigned char *ptr;
+    const char *view;
 
-    if (!modutil_is_SQL(buf))
+    if (!modutil_is_SQL(buf) || !modutil_get_SQL_view(buf, &view, length))
     {
         return 0;
     }
-    ptr = GWBUF_DATA(buf);
-    *length = *ptr++;
-    *length += (*ptr++ << 8);
-    *length += (*ptr++ << 16);
-    ptr += 2;  // Skip sequence id  and COM_QUERY byte
-    *length = *length - 1;
-    *sql = (char *)ptr;
+    *sql = (char *)view;
     return 1;
 }
 
@@ -200,62 +325,181 @@ retblock:
 }
 
 
+/** Unchanged parts of the SQL shorter than this are copied rather than shared */
+#define MODUTIL_SQL_SHARE_MIN 128
+
+/**
+ * Build a new chain for a packet whose SQL is replaced. The header and the
+ * changed part of the SQL are in new buffers and the long enough unchanged
+ * prefix and suffix of the SQL and the data after the packet are shared
+ * with the packet.
+ *
+ * @param packet    Buffer that holds the whole packet
+ * @param length    Length of the old SQL
+ * @param sql       The new SQL
+ * @param newlength Length of the new SQL
+ * @return The new chain or NULL if out of memory
+ */
+static GWBUF *
+modutil_build_SQL(GWBUF *packet, int length, const char *sql, int newlength)
+{
+    uint8_t *ptr = GWBUF_DATA(packet);
+    const char *old = (char *)ptr + MYSQL_HEADER_LEN + 1;
+    int after = GWBUF_LENGTH(packet) - (MYSQL_HEADER_LEN + 1 + length);
+    int common = length < newlength ? length : newlength;
+    int prefix = 0;
+    int suffix = 0;
+
+    while (prefix < common && old[prefix] == sql[prefix])
+    {
+        prefix++;
+    }
+    while (suffix < common - prefix && old[length - 1 - suffix] == sql[newlength - 1 - suffix])
+    {
+        suffix++;
+    }
+    if (prefix < MODUTIL_SQL_SHARE_MIN)
+    {
+        prefix = 0;
+    }
+    if (suffix < MODUTIL_SQL_SHARE_MIN)
+    {
+        suffix = 0;
+    }
+
+    /**
+     * The head is always a new buffer, the objects derived from the old SQL
+     * stay with the old data
+     */
+    int middle = newlength - prefix - suffix;
+    GWBUF *head = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + (prefix ? 0 : middle));
+    GWBUF *parts[4] = {NULL, NULL, NULL, NULL};
+    bool ok = head != NULL;
+
+    if (ok)
+    {
+        memcpy(GWBUF_DATA(head), ptr, MYSQL_HEADER_LEN + 1);
+        gw_mysql_set_byte3((uint8_t *)GWBUF_DATA(head), newlength + 1);
+
+        if (prefix)
+        {
+            ok = (parts[0] = gwbuf_clone_portion(packet, MYSQL_HEADER_LEN + 1, prefix)) != NULL &&
+                 (middle == 0 || (parts[1] = gwbuf_alloc_and_load(middle, (void *)(sql + prefix))));
+        }
+        else
+        {
+            memcpy((char *)GWBUF_DATA(head) + MYSQL_HEADER_LEN + 1, sql, middle);
+        }
+    }
+    if (ok && suffix)
+    {
+        ok = (parts[2] = gwbuf_clone_portion(packet, MYSQL_HEADER_LEN + 1 + length - suffix,
+                                             suffix)) != NULL;
+    }
+    if (ok && after)
+    {
+        ok = (parts[3] = gwbuf_clone_portion(packet, MYSQL_HEADER_LEN + 1 + length, after)) != NULL;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        head = gwbuf_append(head, parts[i]);
+    }
+
+    if (!ok)
+    {
+        gwbuf_free(head);
+        head = NULL;
+    }
+
+    return head;
+}
+
 /**
  * Replace the contents of a GWBUF with the new SQL statement passed as a text string.
  * The routine takes care of the modification needed to the MySQL packet,
  * returning a GWBUF chain that can be used to send the data to a MySQL server
  *
+ * If no clone shares the data of the buffer and the new SQL fits in the
+ * memory of the buffer, the SQL is overwritten in place. Otherwise the data
+ * is left for the clones and a new chain is built that shares the unchanged
+ * parts of the SQL with the original buffer, which is freed.
+ *
  * @param orig  The original request in a GWBUF
  * @param sql   The SQL text to replace in the packet
- * @return A newly formed GWBUF containing the MySQL packet.
+ * @return The buffer with the new SQL, NULL if the packet is not a COM_QUERY
+ *         or if memory ran out, in which case orig is not modified or freed
  */
 GWBUF *
 modutil_replace_SQL(GWBUF *orig, char *sql)
 {
-    unsigned char   *ptr;
-    int     length, newlength;
-    GWBUF   *addition;
-
     if (!modutil_is_SQL(orig))
     {
         return NULL;
     }
-    ptr = GWBUF_DATA(orig);
-    length = *ptr++;
-    length += (*ptr++ << 8);
-    length += (*ptr++ << 16);
-    ptr += 2;  // Skip sequence id  and COM_QUERY byte
 
-    newlength = strlen(sql);
-    if (length - 1 == newlength)
+    int length = MYSQL_GET_PACKET_LEN((uint8_t *)GWBUF_DATA(orig)) - 1;
+    int newlength = strlen(sql);
+    GWBUF *packet = orig;
+    GWBUF *rval;
+
+    /** A packet that is split over several buffers is first copied into one */
+    if ((int)GWBUF_LENGTH(orig) < MYSQL_HEADER_LEN + 1 + length)
     {
-        /* New SQL is the same length as old */
-        memcpy(ptr, sql, newlength);
+        if ((packet = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + length)) == NULL)
+        {
+            return NULL;
+        }
+        gwbuf_copy_data(orig, 0, GWBUF_LENGTH(packet), GWBUF_DATA(packet));
     }
-    else if (length - 1 > newlength)
+
+    uint8_t *ptr = GWBUF_DATA(packet);
+
+    if (GWBUF_LENGTH(packet) == MYSQL_HEADER_LEN + 1 + length && !GWBUF_IS_SHARED(packet) &&
+        (newlength <= length || newlength - length <= (int)gwbuf_tailroom(packet)))
     {
-        /* New SQL is shorter */
-        memcpy(ptr, sql, newlength);
-        GWBUF_RTRIM(orig, (length - 1) - newlength);
-        ptr = GWBUF_DATA(orig);
-        *ptr++ = (newlength + 1) & 0xff;
-        *ptr++ = ((newlength + 1) >> 8) & 0xff;
-        *ptr++ = ((newlength + 1) >> 16) & 0xff;
+        /** The objects derived from the old SQL are no longer valid */
+        gwbuf_free_buffer_object(packet, GWBUF_SQL_TEXT);
+        gwbuf_free_buffer_object(packet, GWBUF_PARSING_INFO);
+        memcpy(ptr + MYSQL_HEADER_LEN + 1, sql, newlength);
+        gw_mysql_set_byte3(ptr, newlength + 1);
+        packet->end = ptr + MYSQL_HEADER_LEN + 1 + newlength;
+        rval = packet;
     }
-    else
+    else if ((rval = modutil_build_SQL(packet, length, sql, newlength)) == NULL)
+    {
+        if (packet != orig)
+        {
+            gwbuf_free(packet);
+        }
+        return NULL;
+    }
+
+    if (rval == orig)
     {
-        memcpy(ptr, sql, length - 1);
-        addition = gwbuf_alloc(newlength - (length - 1));
-        memcpy(GWBUF_DATA(addition), &sql[length - 1], newlength - (length - 1));
-        ptr = GWBUF_DATA(orig);
-        *ptr++ = (newlength + 1) & 0xff;
-        *ptr++ = ((newlength + 1) >> 8) & 0xff;
-        *ptr++ = ((newlength + 1) >> 16) & 0xff;
-        addition->gwbuf_type = orig->gwbuf_type;
-        orig->next = addition;
+        return rval;
     }
 
-    return orig;
+    for (GWBUF *buf = rval; buf; buf = buf->next)
+    {
+        buf->gwbuf_type = orig->gwbuf_type;
+    }
+    rval->hint = orig->hint;
+    rval->properties = orig->properties;
+    orig->hint = NULL;
+    orig->properties = NULL;
+
+    if (packet != orig && rval != packet)
+    {
+        /** The new chain keeps references to the data of the copy */
+        gwbuf_free(packet);
+    }
+
+    /** The rest of the original chain follows the new packet */
+    GWBUF *rest = gwbuf_consume(orig, packet == orig ? GWBUF_LENGTH(orig) :
+                                MYSQL_HEADER_LEN + 1 + length);
+
+    return gwbuf_append(rval, rest);
 }
 
 
@@ -271,40 +515,15 @@ modutil_replace_SQL(GWBUF *orig, char *sql)
 char *
 modutil_get_SQL(GWBUF *buf)
 {
-    unsigned int len, length;
-    unsigned char *ptr;
-    char *dptr, *rval = NULL;
+    const char *sql;
+    int length;
+    char *rval = NULL;
 
-    if (modutil_is_SQL(buf) || modutil_is_SQL_prepare(buf) ||
-        MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(buf)))
+    if (modutil_get_SQL_view(buf, &sql, &length) &&
+        (rval = (char *) malloc(length + 1)))
     {
-        ptr = GWBUF_DATA(buf);
-        length = *ptr++;
-        length += (*ptr++ << 8);
-        length += (*ptr++ << 16);
-
-        if ((rval = (char *) malloc(length + 1)))
-        {
-            dptr = rval;
-            ptr += 2; // Skip sequence id  and COM_QUERY byte
-            len = GWBUF_LENGTH(buf) - 5;
-
-            while (buf && length > 0)
-            {
-                int clen = length > len ? len : length;
-                memcpy(dptr, ptr, clen);
-                dptr += clen;
-                length -= clen;
-                buf = buf->next;
-
-                if (buf)
-                {
-                    ptr = GWBUF_DATA(buf);
-                    len = GWBUF_LENGTH(buf);
-                }
-            }
-            *dptr = 0;
-        }
+        memcpy(rval, sql, length);
+        rval[length] = 0;
     }
     return rval;
 }
@@ -721,6 +940,412 @@ modutil_count_signal_packets(GWBUF *reply, int use_ok,  int n_found, int* more)
     return (eof + err);
 }
 
+/**
+ * Initialize the state of an incremental packet scan
+ *
+ * @param scan  The scan state
+ */
+void
+modutil_scan_init(MODUTIL_PACKET_SCAN *scan)
+{
+    memset(scan, 0, sizeof(*scan));
+}
+
+/**
+ * Initialize the state of an incremental packet scan of the replies to a
+ * client that may have negotiated CLIENT_DEPRECATE_EOF. Without the EOF
+ * packets the scan counts the end of the column definitions and the OK
+ * packet that ends the rows in their place, so a complete result set still
+ * counts as two signal packets.
+ *
+ * @param scan          The scan state
+ * @param deprecate_eof Whether the result sets end in an OK packet
+ */
+void
+modutil_scan_init_eof(MODUTIL_PACKET_SCAN *scan, bool deprecate_eof)
+{
+    memset(scan, 0, sizeof(*scan));
+    scan->deprecate_eof = deprecate_eof;
+}
+
+/**
+ * Check whether the client of a session negotiated CLIENT_DEPRECATE_EOF, in
+ * which case the result sets it receives end in an OK packet and there is no
+ * EOF packet after the column definitions.
+ *
+ * @param session   The session
+ * @return True if the session uses OK packets in place of EOF packets
+ */
+bool
+modutil_deprecate_eof(SESSION *session)
+{
+    DCB *client = session ? session->client_dcb : NULL;
+
+    return client && client->protocol &&
+           (((MySQLProtocol *)client->protocol)->client_capabilities &
+            GW_MYSQL_CAPABILITIES_DEPRECATE_EOF);
+}
+
+/** The position of a scan in a reply whose result sets end in an OK packet */
+enum
+{
+    SCAN_REPLY,     /**< The first packet of a reply or of the next result */
+    SCAN_COLUMNS,   /**< The column definitions */
+    SCAN_ROWS       /**< The rows */
+};
+
+/**
+ * Check the SERVER_MORE_RESULTS_EXIST flag of an OK packet. The status
+ * follows the affected rows and the insert ID, which are short in the OK
+ * packet that ends a result set. If they are not, the flag cannot be seen
+ * in the packet prefix and no more results are assumed.
+ *
+ * @param ptr   The packet prefix
+ * @param len   The payload length of the packet
+ * @return True if more results follow
+ */
+static inline bool
+scan_ok_more_results(const uint8_t *ptr, size_t len)
+{
+    size_t end = MIN(len + MYSQL_HEADER_LEN, MODUTIL_SCAN_PREFIX_LEN);
+    size_t off = MYSQL_HEADER_LEN + 1;
+
+    if (off < end)
+    {
+        off += mxs_wire_lenenc_bytes(ptr[off]);
+
+        if (off < end)
+        {
+            off += mxs_wire_lenenc_bytes(ptr[off]);
+            return off < end && (ptr[off] & 0x08);
+        }
+    }
+    return false;
+}
+
+/**
+ * Classify a packet of a reply whose result sets end in an OK packet. The
+ * scan follows the structure of the reply: the column count of a result set
+ * tells how many column definitions to skip before the rows.
+ *
+ * @param scan      The scan state
+ * @param ptr       The packet prefix
+ * @param len       The payload length of the packet
+ * @return          1 if the packet ends the column definitions, the rows or
+ *                  the reply, 0 otherwise
+ */
+static inline int
+scan_classify_ok_terminated(MODUTIL_PACKET_SCAN *scan, const uint8_t *ptr, size_t len)
+{
+    uint8_t cmd = ptr[MYSQL_HEADER_LEN];
+    int rval = 0;
+
+    switch (scan->state)
+    {
+    case SCAN_COLUMNS:
+        if (--scan->columns == 0)
+        {
+            scan->state = SCAN_ROWS;
+            rval = 1;
+        }
+        break;
+
+    case SCAN_ROWS:
+        /** A row can start with 0xfe only if it is at least 16MB long */
+        if (cmd == 0xff || (cmd == 0xfe && len < 0xffffff))
+        {
+            scan->more = cmd == 0xfe && scan_ok_more_results(ptr, len);
+            scan->state = SCAN_REPLY;
+            rval = 1;
+        }
+        break;
+
+    default:
+        if (cmd == 0xff)
+        {
+            scan->more = false;
+            rval = 1;
+        }
+        else if (cmd != 0x00 && cmd != 0xfb && cmd != 0xfe)
+        {
+            /** A result set, the column count is at most 4096 */
+            if (cmd < 0xfb)
+            {
+                scan->columns = cmd;
+            }
+            else if (cmd == 0xfc && len >= 3)
+            {
+                scan->columns = ptr[MYSQL_HEADER_LEN + 1] | (ptr[MYSQL_HEADER_LEN + 2] << 8);
+            }
+            else
+            {
+                scan->columns = 0;
+            }
+            scan->state = scan->columns ? SCAN_COLUMNS : SCAN_ROWS;
+        }
+        break;
+    }
+
+    return rval;
+}
+
+/**
+ * Check whether a packet is an EOF or an ERR packet
+ *
+ * @param scan      The scan state
+ * @param ptr       The start of the packet, at least the header, the command
+ *                  byte and the EOF status flags if the packet is that long
+ * @param len       The payload length of the packet
+ * @return          1 if the packet is an EOF or an ERR packet, 0 otherwise
+ */
+static inline int
+scan_classify_packet(MODUTIL_PACKET_SCAN *scan, const uint8_t *ptr, size_t len)
+{
+    int rval = 0;
+
+    /** The continuation of a 16MB packet is payload, not a new packet */
+    if (!scan->continued && len > 0)
+    {
+        if (scan->deprecate_eof)
+        {
+            rval = scan_classify_ok_terminated(scan, ptr, len);
+        }
+        else if (ptr[MYSQL_HEADER_LEN] == 0xff)
+        {
+            scan->more = false;
+            rval = 1;
+        }
+        else if (len == 5 && ptr[MYSQL_HEADER_LEN] == 0xfe)
+        {
+            scan->more = (ptr[7] & 0x08) != 0;
+            rval = 1;
+        }
+
+        if (rval)
+        {
+            scan->err = ptr[MYSQL_HEADER_LEN] == 0xff;
+        }
+    }
+
+    scan->continued = len == 0xffffff;
+
+    return rval;
+}
+
+/**
+ * Count the EOF and ERR packets in a buffer. This is the incremental version of
+ * modutil_count_signal_packets: the buffer can contain partial packets and
+ * the scan continues from where the previous call stopped. Only the packet
+ * headers are read; the payload of each packet is skipped over in one step.
+ *
+ * @param scan      The scan state, initialized with modutil_scan_init
+ * @param buffer    The next part of the reply, may be a chain of buffers
+ * @return          Number of EOF and ERR packets that were completed by this buffer
+ */
+int
+modutil_scan_signal_packets(MODUTIL_PACKET_SCAN *scan, GWBUF *buffer)
+{
+    int found = 0;
+
+    for (GWBUF *buf = buffer; buf; buf = buf->next)
+    {
+        const uint8_t *ptr = GWBUF_DATA(buf);
+        const uint8_t *end = ptr + GWBUF_LENGTH(buf);
+
+        while (ptr < end)
+        {
+            if (scan->skip > 0)
+            {
+                size_t n = MIN(scan->skip, (size_t)(end - ptr));
+                scan->skip -= n;
+                ptr += n;
+            }
+            else if (scan->prefix_len == 0 && end - ptr >= MODUTIL_SCAN_PREFIX_LEN)
+            {
+                /** The packet prefix is contiguous, hop over whole packets
+                 * without copying anything */
+                while (end - ptr >= MODUTIL_SCAN_PREFIX_LEN)
+                {
+                    size_t len = gw_mysql_get_byte3(ptr);
+                    size_t total = len + MYSQL_HEADER_LEN;
+                    found += scan_classify_packet(scan, ptr, len);
+
+                    if (total > (size_t)(end - ptr))
+                    {
+                        scan->skip = total - (end - ptr);
+                        ptr = end;
+                    }
+                    else
+                    {
+                        ptr += total;
+                    }
+                }
+            }
+            else
+            {
+                /** The prefix is split between buffers, collect it */
+                scan->prefix[scan->prefix_len++] = *ptr++;
+
+                if (scan->prefix_len >= MYSQL_HEADER_LEN)
+                {
+                    size_t len = gw_mysql_get_byte3(scan->prefix);
+                    size_t needed = MIN(len + MYSQL_HEADER_LEN, MODUTIL_SCAN_PREFIX_LEN);
+
+                    if ((size_t)scan->prefix_len == needed)
+                    {
+                        found += scan_classify_packet(scan, scan->prefix, len);
+                        scan->skip = len + MYSQL_HEADER_LEN - needed;
+                        scan->prefix_len = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Check whether a connection to a backend negotiated CLIENT_SESSION_TRACK, in
+ * which case its OK packets can report the changes to the session state.
+ *
+ * @param dcb   A backend DCB
+ * @return True if the OK packets of the connection report state changes
+ */
+bool
+modutil_tracks_session_state(DCB *dcb)
+{
+    return dcb && dcb->protocol &&
+           (((MySQLProtocol *)dcb->protocol)->client_capabilities &
+            GW_MYSQL_CAPABILITIES_SESSION_TRACK);
+}
+
+/**
+ * Read the session state changes of an OK packet of a connection that has
+ * negotiated CLIENT_SESSION_TRACK. The names and values point into the packet.
+ *
+ * @param packet    The OK packet with its header
+ * @param len       Length of the packet
+ * @param changes   Array where the changes are stored
+ * @param max       Size of the array, the changes after these are ignored
+ * @return Number of changes stored, 0 if the state did not change and -1 if
+ *         the packet is not a valid OK packet
+ */
+int
+modutil_get_state_changes(const uint8_t *packet, size_t len,
+                          MODUTIL_STATE_CHANGE *changes, int max)
+{
+    const uint8_t *end = packet + len;
+    const uint8_t *ptr = packet + MYSQL_HEADER_LEN + 1;
+    uint64_t value;
+    uint16_t status;
+    const char *str;
+    size_t slen;
+    int n = 0;
+
+    if (len < MYSQL_HEADER_LEN + 7 || packet[MYSQL_HEADER_LEN] != 0x00 ||
+        gw_mysql_get_byte3(packet) + MYSQL_HEADER_LEN != len ||
+        !mxs_wire_get_lenenc(&ptr, end, &value) ||   /** Affected rows */
+        !mxs_wire_get_lenenc(&ptr, end, &value) ||   /** Insert ID */
+        end - ptr < 4)
+    {
+        return -1;
+    }
+
+    status = gw_mysql_get_byte2(ptr);
+    ptr += 4;
+
+    if (ptr == end)
+    {
+        /** The info and the state are left out when both are empty */
+        return 0;
+    }
+
+    if (!mxs_wire_get_lenenc_str(&ptr, end, &str, &slen))
+    {
+        return -1;
+    }
+
+    if ((status & MODUTIL_SESSION_STATE_CHANGED) == 0)
+    {
+        return 0;
+    }
+
+    const uint8_t *state_end;
+
+    if (!mxs_wire_get_lenenc(&ptr, end, &value) || value > (uint64_t)(end - ptr))
+    {
+        return -1;
+    }
+
+    state_end = ptr + value;
+
+    while (ptr < state_end)
+    {
+        uint8_t type = *ptr++;
+        const uint8_t *data;
+        const uint8_t *data_end;
+
+        if (!mxs_wire_get_lenenc(&ptr, state_end, &value) ||
+            value > (uint64_t)(state_end - ptr))
+        {
+            return -1;
+        }
+
+        data = ptr;
+        data_end = ptr + value;
+        ptr = data_end;
+
+        if (n == max)
+        {
+            continue;
+        }
+
+        MODUTIL_STATE_CHANGE *change = &changes[n];
+        change->type = type;
+        change->name = NULL;
+        change->name_len = 0;
+
+        switch (type)
+        {
+        case MODUTIL_TRACK_SYSTEM_VARIABLES:
+            if (!mxs_wire_get_lenenc_str(&data, data_end, &change->name, &change->name_len))
+            {
+                return -1;
+            }
+            /** Fallthrough */
+        case MODUTIL_TRACK_SCHEMA:
+        case MODUTIL_TRACK_STATE_CHANGE:
+        case MODUTIL_TRACK_TRANSACTION_CHARACTERISTICS:
+        case MODUTIL_TRACK_TRANSACTION_STATE:
+            if (!mxs_wire_get_lenenc_str(&data, data_end, &change->value, &change->value_len))
+            {
+                return -1;
+            }
+            break;
+
+        case MODUTIL_TRACK_GTIDS:
+            /** The encoding specification precedes the GTIDs */
+            data++;
+            if (!mxs_wire_get_lenenc_str(&data, data_end, &change->value, &change->value_len))
+            {
+                return -1;
+            }
+            break;
+
+        default:
+            /** A type this version does not know, the data is passed as is */
+            change->value = (const char *)data;
+            change->value_len = data_end - data;
+            break;
+        }
+
+        n++;
+    }
+
+    return n;
+}
+
 /**
  * Create parse error and EPOLLIN event to event queue of the backend DCB.
  * When event is notified the error message is processed as error reply and routed
@@ -1120,11 +1745,7 @@ mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char*
     char* matchstr = (char*) malloc(matchsize);
     char* tempstr = (char*) malloc(tempsize);
 
-    pcre2_match_data *mdata_percent = pcre2_match_data_create_from_pattern(re_percent, NULL);
-    pcre2_match_data *mdata_single = pcre2_match_data_create_from_pattern(re_single, NULL);
-    pcre2_match_data *mdata_escape = pcre2_match_data_create_from_pattern(re_escape, NULL);
-
-    if (matchstr && tempstr && mdata_percent && mdata_single && mdata_escape)
+    if (matchstr && tempstr && pattern_init)
     {
         if (mxs_pcre2_substitute(re_escape, pattern, sub_escape,
                                  &matchstr, &matchsize) == MXS_PCRE2_ERROR ||
@@ -1162,9 +1783,6 @@ mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char*
         MXS_ERROR("Fatal error when matching wildcard patterns.");
     }
 
-    pcre2_match_data_free(mdata_percent);
-    pcre2_match_data_free(mdata_single);
-    pcre2_match_data_free(mdata_escape);
     free(matchstr);
     free(tempstr);
     return rval;
@@ -1173,8 +1791,6 @@ mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char*
 /*
  * Replace user-provided literals with question marks.
  *
- * TODO: Make the canonicalization allocate only one buffer of memory
- *
  * @param querybuf GWBUF with a COM_QUERY statement
  * @return A copy of the query in its canonical form or NULL if an error occurred.
  */
@@ -1186,37 +1802,10 @@ char* modutil_get_canonical(GWBUF* querybuf)
     {
         size_t srcsize = GWBUF_LENGTH(querybuf) - MYSQL_HEADER_LEN - 1;
         char *src = (char*)GWBUF_DATA(querybuf) + MYSQL_HEADER_LEN + 1;
-        size_t destsize = 0;
-        char *dest = NULL;
 
-        if (replace_quoted((const char**)&src, &srcsize, &dest, &destsize))
+        if ((querystr = malloc(CANONICAL_SQL_SIZE(srcsize))))
         {
-            /** Reset the buffers so that the old result is reused and a new
-             * result is created.*/
-            src = dest;
-            srcsize = destsize;
-            dest = NULL;
-            destsize = 0;
-
-            if (remove_mysql_comments((const char**)&src, &srcsize, &dest, &destsize))
-            {
-                /** Both buffers now contain allocated memory so all we need
-                 * to do is to swap them */
-                if (replace_values((const char**)&dest, &destsize, &src, &srcsize))
-                {
-                    querystr = squeeze_whitespace(src);
-                    free(dest);
-                }
-                else
-                {
-                    free(src);
-                    free(dest);
-                }
-            }
-            else
-            {
-                free(src);
-            }
+            canonicalize_sql(src, srcsize, querystr, NULL);
         }
     }
 
@@ -40,6 +40,11 @@
 #include <externcmd.h>
 #include <mysqld_error.h>
 #include <mysql_utils.h>
+#include <thread.h>
+#include <atomic.h>
+#include <time.h>
+#include <hk_heartbeat.h>
+#include <hashtable.h>
 
 /*
  *  Create declarations of the enum for monitor events and also the array of
@@ -57,8 +62,14 @@ const monitor_def_t monitor_event_definitions[MAX_MONITOR_EVENT] =
 
 static MONITOR  *allMonitors = NULL;
 static SPINLOCK monLock = SPINLOCK_INIT;
+static HASHTABLE *monitor_names = NULL;   /**< The monitors by name */
+
+/** The initial number of chains in the index of the monitors, it grows as needed */
+#define MONITOR_INDEX_SIZE 16
 
 static void monitor_servers_free(MONITOR_SERVERS *servers);
+static bool monitor_index(MONITOR *mon);
+static void monitor_unindex(MONITOR *mon);
 
 /**
  * Allocate a new monitor, load the associated module for the monitor
@@ -95,9 +106,21 @@ monitor_alloc(char *name, char *module)
     mon->write_timeout = DEFAULT_WRITE_TIMEOUT;
     mon->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
     mon->interval = MONITOR_INTERVAL;
+    mon->max_interval = 0;
+    mon->cur_interval = MONITOR_INTERVAL;
+    mon->next_round = 0;
+    mon->probe_requested = 0;
     mon->parameters = NULL;
     spinlock_init(&mon->lock);
     spinlock_acquire(&monLock);
+    if (!monitor_index(mon))
+    {
+        spinlock_release(&monLock);
+        MXS_ERROR("Failed to index monitor '%s' by its name.", name);
+        free(mon->name);
+        free(mon);
+        return NULL;
+    }
     mon->next = allMonitors;
     allMonitors = mon;
     spinlock_release(&monLock);
@@ -105,6 +128,56 @@ monitor_alloc(char *name, char *module)
     return mon;
 }
 
+/**
+ * Index a monitor by its name, allocating the index on first use. If
+ * several monitors have the same name, the one indexed last is found.
+ * Called with monLock held.
+ *
+ * @param mon   The monitor
+ * @return True if the monitor was indexed
+ */
+static bool
+monitor_index(MONITOR *mon)
+{
+    if (monitor_names == NULL)
+    {
+        HASHTABLE *names = hashtable_alloc(MONITOR_INDEX_SIZE, simple_str_hash, strcmp);
+
+        if (names == NULL)
+        {
+            return false;
+        }
+        hashtable_memory_fns(names, (HASHMEMORYFN) strdup, NULL, (HASHMEMORYFN) free, NULL);
+        hashtable_enable_resize(names);
+        monitor_names = names;
+    }
+    return hashtable_replace(monitor_names, mon->name, mon);
+}
+
+/**
+ * Remove a monitor from the index of the names. Another monitor with the
+ * same name takes its place. Called with monLock held.
+ *
+ * @param mon   The monitor
+ */
+static void
+monitor_unindex(MONITOR *mon)
+{
+    if (hashtable_fetch(monitor_names, mon->name) == mon)
+    {
+        hashtable_delete(monitor_names, mon->name);
+
+        for (MONITOR *ptr = allMonitors; ptr; ptr = ptr->next)
+        {
+            if (ptr != mon && strcmp(ptr->name, mon->name) == 0)
+            {
+                hashtable_add(monitor_names, ptr->name, ptr);
+                break;
+            }
+        }
+    }
+}
+
 /**
  * Free a monitor, first stop the monitor and then remove the monitor from
  * the chain of monitors and free the memory.
@@ -135,6 +208,7 @@ monitor_free(MONITOR *mon)
             ptr->next = mon->next;
         }
     }
+    monitor_unindex(mon);
     spinlock_release(&monLock);
     free_config_parameter(mon->parameters);
     monitor_servers_free(mon->databases);
@@ -255,9 +329,16 @@ monitorAddServer(MONITOR *mon, SERVER *server)
     db->mon_prev_status = -1;
     /* pending status is updated by get_replication_tree */
     db->pending_status = 0;
+    db->slave_pos = 0;
+    db->probe_time = 0;
+    db->n_errors = 0;
+    db->fc_paused_ns = 0;
+    db->fc_sample_time = 0;
 
     spinlock_acquire(&mon->lock);
 
+    db->added_running = mon->state == MONITOR_STATE_RUNNING;
+
     if (mon->databases == NULL)
     {
         mon->databases = db;
@@ -348,6 +429,14 @@ monitorShow(DCB *dcb, MONITOR *monitor)
         {
             dcb_printf(dcb, "\t(no diagnostics)\n");
         }
+
+        dcb_printf(dcb, "\tProbe latency:\n");
+
+        for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+        {
+            dcb_printf(dcb, "\t\t%s:%d\t%.3f ms\n", db->server->name, db->server->port,
+                       db->probe_time / 1000.0);
+        }
     }
     else
     {
@@ -390,20 +479,7 @@ monitorList(DCB *dcb)
 MONITOR *
 monitor_find(char *name)
 {
-    MONITOR *ptr;
-
-    spinlock_acquire(&monLock);
-    ptr = allMonitors;
-    while (ptr)
-    {
-        if (!strcmp(ptr->name, name))
-        {
-            break;
-        }
-        ptr = ptr->next;
-    }
-    spinlock_release(&monLock);
-    return ptr;
+    return hashtable_fetch(monitor_names, name);
 }
 
 /**
@@ -416,6 +492,22 @@ void
 monitorSetInterval(MONITOR *mon, unsigned long interval)
 {
     mon->interval = interval;
+    mon->cur_interval = interval;
+}
+
+/**
+ * Set the longest monitor interval. While no server changes its state, the
+ * interval is doubled after each cycle until it reaches this value. Any
+ * state change or reported connection error returns it to the monitor
+ * interval.
+ *
+ * @param mon           The monitor instance
+ * @param interval      The longest interval in milliseconds, 0 to disable
+ */
+void
+monitorSetMaxInterval(MONITOR *mon, unsigned long interval)
+{
+    mon->max_interval = interval;
 }
 
 /**
@@ -1047,3 +1139,215 @@ void mon_log_state_change(MONITOR_SERVERS *ptr)
     free(prev);
     free(next);
 }
+
+/** The servers that the threads of mon_probe_servers() share */
+typedef struct
+{
+    MONITOR *mon;
+    void (*probe)(MONITOR *, MONITOR_SERVERS *);
+    SPINLOCK lock;
+    MONITOR_SERVERS *next;  /**< The next server to probe */
+} MONITOR_PROBE;
+
+/**
+ * Probe servers until every server of the monitor has been taken
+ *
+ * @param probe The shared state of the probe
+ */
+static void mon_probe_worker(MONITOR_PROBE *probe)
+{
+    while (true)
+    {
+        spinlock_acquire(&probe->lock);
+        MONITOR_SERVERS *db = probe->next;
+
+        if (db)
+        {
+            probe->next = db->next;
+        }
+        spinlock_release(&probe->lock);
+
+        if (db == NULL)
+        {
+            break;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        db->n_errors = 0;
+        probe->probe(probe->mon, db);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        db->probe_time = (end.tv_sec - start.tv_sec) * 1000000 +
+            (end.tv_nsec - start.tv_nsec) / 1000;
+    }
+}
+
+/** Entry point of the threads started by mon_probe_servers() */
+static void mon_probe_thread(void *data)
+{
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in monitor probe thread.");
+        return;
+    }
+
+    mon_probe_worker((MONITOR_PROBE*)data);
+    mysql_thread_end();
+}
+
+/**
+ * Probe all servers of a monitor concurrently. Up to MONITOR_MAX_PROBE_THREADS
+ * servers are probed at the same time, so one slow server does not delay the
+ * others. The calling thread probes servers too and the function returns when
+ * all servers have been probed. The time each probe took is stored in the
+ * probe_time of the server.
+ *
+ * The probe function may only modify the server it is given.
+ *
+ * @param mon   The monitor
+ * @param probe Function that probes one server
+ */
+void mon_probe_servers(MONITOR *mon, void (*probe)(MONITOR *, MONITOR_SERVERS *))
+{
+    MONITOR_PROBE data;
+    THREAD threads[MONITOR_MAX_PROBE_THREADS - 1];
+    int n_servers = 0;
+    int n_threads = 0;
+
+    data.mon = mon;
+    data.probe = probe;
+    data.next = mon->databases;
+    spinlock_init(&data.lock);
+
+    for (MONITOR_SERVERS *db = mon->databases; db; db = db->next)
+    {
+        n_servers++;
+    }
+
+    /** A thread that fails to start leaves its servers to the others */
+    while (n_threads < n_servers - 1 && n_threads < MONITOR_MAX_PROBE_THREADS - 1 &&
+           thread_start(&threads[n_threads], mon_probe_thread, &data))
+    {
+        n_threads++;
+    }
+
+    mon_probe_worker(&data);
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        thread_wait(threads[i]);
+    }
+}
+
+/**
+ * Report a failed connection to a server or the loss of one. When a running
+ * server has had MONITOR_FAST_PROBE_ERRORS errors since it was last probed,
+ * the monitors of the server probe it at their next base interval instead of
+ * waiting for the monitor interval.
+ *
+ * @param server The server
+ */
+void monitor_report_server_error(SERVER *server)
+{
+    if (!SERVER_IS_RUNNING(server))
+    {
+        return;
+    }
+
+    spinlock_acquire(&monLock);
+
+    for (MONITOR *mon = allMonitors; mon; mon = mon->next)
+    {
+        if (mon->state != MONITOR_STATE_RUNNING)
+        {
+            continue;
+        }
+
+        for (MONITOR_SERVERS *db = mon->databases; db; db = db->next)
+        {
+            if (db->server == server &&
+                atomic_add(&db->n_errors, 1) + 1 == MONITOR_FAST_PROBE_ERRORS)
+            {
+                MXS_INFO("Server %s:%d had %d connection errors, monitor '%s' "
+                         "probes it without waiting for the monitor interval.",
+                         server->name, server->port, MONITOR_FAST_PROBE_ERRORS,
+                         mon->name);
+                mon->probe_requested = 1;
+            }
+        }
+    }
+
+    spinlock_release(&monLock);
+}
+
+/**
+ * Check whether the servers should be probed at this base interval. They
+ * are probed at the first round, whenever the current interval has passed and
+ * whenever monitor_report_server_error() has requested it.
+ *
+ * @param mon     The monitor
+ * @param nrounds Number of base intervals the monitor has waited
+ * @return True if the servers should be probed
+ */
+bool mon_probe_is_due(MONITOR *mon, size_t nrounds)
+{
+    bool requested = __sync_lock_test_and_set(&mon->probe_requested, 0) != 0;
+
+    if (requested)
+    {
+        mon->cur_interval = mon->interval;
+    }
+
+    if (nrounds == 0 || nrounds >= mon->next_round || requested)
+    {
+        size_t rounds = mon->cur_interval / MON_BASE_INTERVAL_MS;
+        mon->next_round = nrounds + (rounds > 0 ? rounds : 1);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Publish the states of all servers of a monitor to the routers and adapt
+ * the monitor interval. Called at the end of each monitoring cycle.
+ *
+ * @param mon The monitor
+ */
+void mon_publish_states(MONITOR *mon)
+{
+    bool changed = false;
+
+    for (MONITOR_SERVERS *db = mon->databases; db; db = db->next)
+    {
+        /**
+         * A server that came back or was added at runtime starts to warm up.
+         * The slaves found by the first cycle after startup do not.
+         */
+        if (SRV_SLAVE_STATUS(db->server->status) &&
+            (db->added_running || (db->mon_prev_status != (unsigned int)-1 &&
+                                   !SRV_SLAVE_STATUS(db->mon_prev_status))))
+        {
+            db->server->slave_since = hkheartbeat;
+        }
+        db->added_running = false;
+
+        server_publish_state(db->server);
+        changed = changed || mon_status_changed(db);
+    }
+
+    /** The interval backs off while nothing changes */
+    if (changed || mon->max_interval <= mon->interval)
+    {
+        mon->cur_interval = mon->interval;
+    }
+    else if (mon->cur_interval * 2 < mon->max_interval)
+    {
+        mon->cur_interval *= 2;
+    }
+    else
+    {
+        mon->cur_interval = mon->max_interval;
+    }
+}
@@ -504,19 +504,11 @@ void format_temporal_value(char *str, size_t size, uint8_t type, struct tm *tm)
 }
 
 /**
- * @brief Extract a value from a row event
- *
- * This function extracts a single value from a row event and stores it for
- * further processing. Integer values are usable immediately but temporal
- * values need to be unpacked from the compact format they are stored in.
- * @param ptr Pointer to the start of the field value
+ * @brief Get the size of a numeric value
  * @param type Column type of the field
- * @param metadata Pointer to the field metadata
- * @param val Destination where the extracted value is stored
- * @return Number of bytes copied
- * @see extract_temporal_value
+ * @return Size of the value in bytes
  */
-size_t unpack_numeric_field(uint8_t *src, uint8_t type, uint8_t *metadata, uint8_t *dest)
+static size_t numeric_field_size(uint8_t type)
 {
     size_t size = 0;
     switch (type)
@@ -548,6 +540,181 @@ size_t unpack_numeric_field(uint8_t *src, uint8_t type, uint8_t *metadata, uint8
             break;
     }
 
+    return size;
+}
+
+/**
+ * @brief Extract a value from a row event
+ *
+ * This function extracts a single value from a row event and stores it for
+ * further processing. Integer values are usable immediately but temporal
+ * values need to be unpacked from the compact format they are stored in.
+ * @param ptr Pointer to the start of the field value
+ * @param type Column type of the field
+ * @param metadata Pointer to the field metadata
+ * @param val Destination where the extracted value is stored
+ * @return Number of bytes copied
+ * @see extract_temporal_value
+ */
+size_t unpack_numeric_field(uint8_t *src, uint8_t type, uint8_t *metadata, uint8_t *dest)
+{
+    size_t size = numeric_field_size(type);
     memcpy(dest, src, size);
     return size;
 }
+
+/**
+ * @brief Get the length of the metadata for a particular field
+ *
+ * @param type Type of the field
+ * @return Length of the metadata for this field
+ */
+int column_metadata_len(uint8_t type)
+{
+    switch (type)
+    {
+        case TABLE_COL_TYPE_STRING:
+        case TABLE_COL_TYPE_VAR_STRING:
+        case TABLE_COL_TYPE_VARCHAR:
+        case TABLE_COL_TYPE_DECIMAL:
+        case TABLE_COL_TYPE_NEWDECIMAL:
+        case TABLE_COL_TYPE_ENUM:
+        case TABLE_COL_TYPE_SET:
+        case TABLE_COL_TYPE_BIT:
+            return 2;
+
+        case TABLE_COL_TYPE_BLOB:
+        case TABLE_COL_TYPE_FLOAT:
+        case TABLE_COL_TYPE_DOUBLE:
+        case TABLE_COL_TYPE_DATETIME2:
+        case TABLE_COL_TYPE_TIMESTAMP2:
+        case TABLE_COL_TYPE_TIME2:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Get the size of a binary DECIMAL value
+ *
+ * @param metadata Precision and the number of decimals
+ * @return Size of the value in bytes
+ */
+static int decimal_size(uint8_t *metadata)
+{
+    const int dec_dig = 9;
+    const int dig_bytes[] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+    int precision = metadata[0];
+    int decimals = metadata[1];
+    int ipart = precision - decimals;
+    int ipart1 = ipart / dec_dig;
+    int fpart1 = decimals / dec_dig;
+    int ipart2 = ipart - ipart1 * dec_dig;
+    int fpart2 = decimals - fpart1 * dec_dig;
+
+    return ipart1 * 4 + dig_bytes[ipart2] + fpart1 * 4 + dig_bytes[fpart2];
+}
+
+/**
+ * @brief Create a plan for decoding the row images of a table
+ *
+ * The type of each column is resolved once so that the rows can be decoded
+ * without checking the type and metadata of each value. The plan points to
+ * @c metadata which must stay valid as long as the plan is used.
+ *
+ * @param types Column types from the table map event
+ * @param columns Number of columns
+ * @param metadata Column metadata from the table map event
+ * @param metadata_size Size of the metadata
+ * @return New plan with one entry per column or NULL if memory allocation failed
+ */
+COLUMN_PLAN* column_plan_alloc(uint8_t *types, uint64_t columns, uint8_t *metadata,
+                               size_t metadata_size)
+{
+    COLUMN_PLAN *plan = malloc(sizeof(COLUMN_PLAN) * (columns ? columns : 1));
+
+    if (plan == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the row decoding plan.");
+        return NULL;
+    }
+
+    size_t offset = 0;
+
+    for (uint64_t i = 0; i < columns; i++)
+    {
+        COLUMN_PLAN *col = &plan[i];
+        uint8_t *meta = &metadata[offset];
+
+        col->type = types[i];
+        col->metadata = meta;
+        col->size = 0;
+
+        if (column_is_fixed_string(types[i]))
+        {
+            if (fixed_string_is_enum(meta[0]))
+            {
+                col->kind = COLUMN_KIND_ENUM;
+                col->size = meta[1];
+            }
+            else
+            {
+                col->kind = COLUMN_KIND_STRING;
+            }
+        }
+        else if (column_is_bit(types[i]))
+        {
+            col->kind = COLUMN_KIND_BIT;
+        }
+        else if (column_is_decimal(types[i]))
+        {
+            col->kind = COLUMN_KIND_DECIMAL;
+            col->size = decimal_size(meta);
+        }
+        else if (column_is_variable_string(types[i]))
+        {
+            col->kind = COLUMN_KIND_VARSTRING;
+        }
+        else if (column_is_blob(types[i]))
+        {
+            col->kind = COLUMN_KIND_BLOB;
+            col->size = meta[0];
+        }
+        else if (column_is_temporal(types[i]))
+        {
+            col->kind = COLUMN_KIND_TEMPORAL;
+        }
+        else
+        {
+            switch (types[i])
+            {
+                case TABLE_COL_TYPE_LONGLONG:
+                    col->kind = COLUMN_KIND_LONG;
+                    col->size = 8;
+                    break;
+
+                case TABLE_COL_TYPE_FLOAT:
+                    col->kind = COLUMN_KIND_FLOAT;
+                    col->size = 4;
+                    break;
+
+                case TABLE_COL_TYPE_DOUBLE:
+                    col->kind = COLUMN_KIND_DOUBLE;
+                    col->size = 8;
+                    break;
+
+                default:
+                    col->kind = COLUMN_KIND_INT;
+                    col->size = numeric_field_size(types[i]);
+                    break;
+            }
+        }
+
+        offset += column_metadata_len(types[i]);
+        ss_dassert(offset <= metadata_size);
+    }
+
+    return plan;
+}
@@ -149,6 +149,7 @@ char* lestr_consume(uint8_t** c, size_t *size)
 
 /**
  * Creates a connection to a MySQL database engine. If necessary, initializes SSL.
+ * A server with a Unix domain socket is connected to through the socket.
  *
  * @param con    A valid MYSQL structure.
  * @param server The server on which the MySQL engine is running.
@@ -172,5 +173,16 @@ MYSQL *mxs_mysql_real_connect(MYSQL *con, SERVER *server, const char *user, cons
 #endif
     }
 
-    return mysql_real_connect(con, server->name, user, passwd, NULL, server->port, NULL, 0);
+    /** With no host, the connector uses the socket instead of TCP */
+    MYSQL *mysql = server->socket ?
+                   mysql_real_connect(con, NULL, user, passwd, NULL, 0, server->socket, 0) :
+                   mysql_real_connect(con, server->name, user, passwd, NULL, server->port, NULL, 0);
+
+    if (mysql)
+    {
+        /** Recorded for the handshake that MaxScale sends to the clients */
+        server->capabilities = mysql->server_capabilities;
+    }
+
+    return mysql;
 }
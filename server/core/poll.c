@@ -17,7 +17,16 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <maxscale/poll.h>
 #include <dcb.h>
 #include <atomic.h>
@@ -33,12 +42,19 @@
 #include <session.h>
 #include <statistics.h>
 #include <query_classifier.h>
+#include <platform.h>
+#include <rcu.h>
+#include <monitor.h>
+#include <metrics.h>
+#include <service.h>
+#include <memlog.h>
+#include <thread.h>
+#include <timerwheel.h>
 
 #define         PROFILE_POLL    0
 
 #if PROFILE_POLL
 #include <rdtsc.h>
-#include <memlog.h>
 
 extern unsigned long hkheartbeat;
 MEMLOG  *plog;
@@ -46,6 +62,8 @@ MEMLOG  *plog;
 
 int number_poll_spins;
 int max_poll_sleep;
+static int poll_max_events = MAX_EVENTS; /*< Events received by one epoll_wait call */
+static bool poll_adaptive = false; /*< Tune the spinning and the timeout to the load */
 
 /**
  * @file poll.c  - Abstraction of the epoll functionality
@@ -80,28 +98,277 @@ int max_poll_sleep;
  */
 #define MUTEX_EPOLL     0
 
-static int epoll_fd = -1;    /*< The epoll file descriptor */
+/**
+ * The DCBs with pending events of one scheduling class
+ */
+typedef struct
+{
+    DCB      *eventq;     /*< The queue of DCBs in the order their events arrived */
+    int      deficit;     /*< Events the class may still process in this round */
+} POLL_CLASS;
+
+/**
+ * A poll set is an epoll instance together with the queue of DCBs that have
+ * pending events reported by it. By default there is a single poll set that
+ * is shared by all the polling threads. When poll affinity is enabled, each
+ * polling thread has a poll set of its own and only processes the events of
+ * the DCBs it owns. The DCBs of a session are owned by the same thread.
+ *
+ * The queue is divided into the scheduling classes of the services, so that
+ * a service with a flood of events cannot delay the events of the others by
+ * more than the weights of the classes allow. @see poll_evq_next
+ */
+typedef struct
+{
+    int      epoll_fd;    /*< The epoll file descriptor */
+    int      wakeup_fd;   /*< Event descriptor that wakes up the owning thread, or -1 */
+    POLL_CLASS classes[POLL_SCHED_CLASSES]; /*< The event queues of the classes */
+    uint64_t active;      /*< Bitmap of the classes that have DCBs in their queue */
+    int      current;     /*< The class being served in the current round */
+    SPINLOCK lock;        /*< Protects the event queue */
+    int      evq_length;  /*< Event queue length */
+    int      evq_pending; /*< Number of pending descriptors in event queue */
+    int      evq_max;     /*< Maximum event queue length */
+} POLL_SET;
+
+static POLL_SET *poll_sets = NULL; /*< The poll sets */
+static int n_poll_sets = 0;  /*< Number of poll sets, 1 or one per thread */
+static bool work_stealing = false; /*< Idle threads process events of other threads */
+static int next_thread = 0;  /*< Used for the round-robin assignment of owners */
+static thread_local int poll_thread_id = -1; /*< Id of the calling polling thread */
 static int do_shutdown = 0;  /*< Flag the shutdown of the poll subsystem */
 static GWBITMASK poll_mask;
 #if MUTEX_EPOLL
 static simple_mutex_t epoll_wait_mutex; /*< serializes calls to epoll_wait */
 #endif
 static int n_waiting = 0;    /*< No. of threads in epoll_wait */
+static int sched_weights[POLL_SCHED_CLASSES]; /*< Weights of the classes, 0 for the default */
+
+/**
+ * The admin thread serves the administrative services, such as maxadmin and
+ * maxinfo, from a poll set of its own so that they stay responsive when the
+ * other threads are overloaded. It has the last thread slot and runs at a
+ * lower priority than the other threads.
+ */
+static int admin_thread = -1;        /*< The id of the admin thread, -1 if disabled */
+static POLL_SET *admin_set = NULL;   /*< The poll set of the admin thread */
+
+/** The nice value of the admin thread */
+#define POLL_ADMIN_NICE 10
+static int next_sched_class = 1; /*< The next scheduling class given to a service */
 
-static int process_pollq(int thread_id);
+static int process_pollq(int thread_id, POLL_SET *set, bool steal);
+static int poll_steal_work(int thread_id);
 static void poll_add_event_to_dcb(DCB* dcb, GWBUF* buf, __uint32_t ev);
 static bool poll_dcb_session_check(DCB *dcb, const char *);
+static void poll_wakeup(POLL_SET *set);
+static int poll_set_stat(size_t offset, bool maximum);
+
+/**
+ * Return the poll set of a polling thread
+ *
+ * @param thread_id The polling thread
+ * @return The poll set the thread waits on
+ */
+static inline POLL_SET *
+poll_set_of_thread(int thread_id)
+{
+    if (thread_id == admin_thread)
+    {
+        return admin_set;
+    }
+    return n_poll_sets > 1 ? &poll_sets[thread_id] : poll_sets;
+}
+
+/**
+ * Return the poll set a DCB belongs to
+ *
+ * @param dcb The DCB
+ * @return The poll set of the polling thread owning the DCB
+ */
+static inline POLL_SET *
+poll_set_of(DCB *dcb)
+{
+    return poll_set_of_thread(dcb->owner);
+}
+
+/**
+ * Return the scheduling class of a DCB, that of the service of its session
+ *
+ * @param dcb The DCB
+ * @return The scheduling class
+ */
+static inline int
+poll_class_of(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+    SERVICE *service = session ? session->service : NULL;
+
+    return service ? service->sched_class : 0;
+}
+
+/**
+ * Append a DCB to the event queue of its scheduling class. The caller must
+ * hold the lock of the poll set and the DCB must not be in the queue.
+ *
+ * @param set The poll set of the DCB
+ * @param dcb The DCB
+ */
+static void
+poll_evq_append(POLL_SET *set, DCB *dcb)
+{
+    int c = poll_class_of(dcb);
+    POLL_CLASS *cls = &set->classes[c];
+
+    dcb->evq.sched_class = c;
+    if (cls->eventq)
+    {
+        dcb->evq.prev = cls->eventq->evq.prev;
+        cls->eventq->evq.prev->evq.next = dcb;
+        cls->eventq->evq.prev = dcb;
+        dcb->evq.next = cls->eventq;
+    }
+    else
+    {
+        cls->eventq = dcb;
+        dcb->evq.prev = dcb;
+        dcb->evq.next = dcb;
+        set->active |= (uint64_t)1 << c;
+    }
+    set->evq_length++;
+    if (set->evq_length > set->evq_max)
+    {
+        set->evq_max = set->evq_length;
+    }
+}
+
+/**
+ * Remove a DCB from the event queue. The caller must hold the lock of the
+ * poll set.
+ *
+ * @param set The poll set of the DCB
+ * @param dcb The DCB
+ */
+static void
+poll_evq_remove(POLL_SET *set, DCB *dcb)
+{
+    int c = dcb->evq.sched_class;
+    POLL_CLASS *cls = &set->classes[c];
+
+    if (dcb->evq.prev != dcb)
+    {
+        dcb->evq.prev->evq.next = dcb->evq.next;
+        dcb->evq.next->evq.prev = dcb->evq.prev;
+        if (cls->eventq == dcb)
+        {
+            cls->eventq = dcb->evq.next;
+        }
+    }
+    else
+    {
+        cls->eventq = NULL;
+        set->active &= ~((uint64_t)1 << c);
+    }
+    dcb->evq.next = NULL;
+    dcb->evq.prev = NULL;
+    set->evq_length--;
+}
+
+/**
+ * Move a DCB that has more pending events to the end of the queue of its
+ * class. The caller must hold the lock of the poll set.
+ *
+ * @param set The poll set of the DCB
+ * @param dcb The DCB
+ */
+static void
+poll_evq_requeue(POLL_SET *set, DCB *dcb)
+{
+    POLL_CLASS *cls = &set->classes[dcb->evq.sched_class];
+
+    /**
+     * If we are the first item on the queue this is easy, we just bump the
+     * eventq pointer.
+     */
+    if (dcb->evq.prev != dcb)
+    {
+        if (cls->eventq == dcb)
+        {
+            cls->eventq = dcb->evq.next;
+        }
+        else
+        {
+            dcb->evq.prev->evq.next = dcb->evq.next;
+            dcb->evq.next->evq.prev = dcb->evq.prev;
+            dcb->evq.prev = cls->eventq->evq.prev;
+            dcb->evq.next = cls->eventq;
+            cls->eventq->evq.prev = dcb;
+            dcb->evq.prev->evq.next = dcb;
+        }
+    }
+}
+
+/**
+ * Choose the next DCB to process by deficit round-robin over the scheduling
+ * classes. A class may process as many events in its turn as its weight, then
+ * the next class with queued DCBs is served. A class whose DCBs are all being
+ * processed by other threads loses the rest of its turn. Within a class, the
+ * DCBs are processed in the order their events arrived. The caller must hold
+ * the lock of the poll set.
+ *
+ * @param set The poll set
+ * @return A queued DCB that is not being processed, NULL if there is none
+ */
+static DCB *
+poll_evq_next(POLL_SET *set)
+{
+    int n_active = __builtin_popcountll(set->active);
+
+    /** Without queued DCBs there is no class to give the turn to */
+    if (n_active == 0)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i <= n_active; i++)
+    {
+        POLL_CLASS *cls = &set->classes[set->current];
+
+        if (cls->eventq && cls->deficit > 0)
+        {
+            DCB *dcb = cls->eventq;
+
+            do
+            {
+                if (dcb->evq.processing == 0)
+                {
+                    cls->deficit--;
+                    return dcb;
+                }
+                dcb = dcb->evq.next;
+            }
+            while (dcb != cls->eventq);
+        }
+
+        /** Give the turn to the next class that has queued DCBs */
+        cls->deficit = 0;
+        uint64_t after = set->current + 1 < POLL_SCHED_CLASSES ?
+                         set->active & (~(uint64_t)0 << (set->current + 1)) : 0;
+        set->current = after ? __builtin_ctzll(after) : __builtin_ctzll(set->active);
 
-DCB *eventq = NULL;
-SPINLOCK pollqlock = SPINLOCK_INIT;
+        int weight = sched_weights[set->current];
+        set->classes[set->current].deficit = weight > 0 ? weight : POLL_SCHED_WEIGHT_DEFAULT;
+    }
+
+    return NULL;
+}
 
 /**
  * Thread load average, this is the average number of descriptors in each
  * poll completion, a value of 1 or less is the ideal.
  */
-static double load_average = 0.0;
-static int load_samples = 0;
-static int load_nfds = 0;
+static ts_stats_t load_samples;
+static ts_stats_t load_nfds;
 static double current_avg = 0.0;
 static double *avg_samples = NULL;
 static int *evqp_samples = NULL;
@@ -109,7 +376,29 @@ static int next_sample = 0;
 static int n_avg_samples;
 
 /* Thread statistics data */
-static int n_threads;      /*< No. of threads */
+static int n_threads;      /*< No. of thread slots, the most threads that can poll */
+
+/**
+ * Return the most polling threads that can process the events of the
+ * services other than the administrative ones
+ *
+ * @return The number of thread slots without the admin thread
+ */
+static inline int
+poll_max_workers()
+{
+    return admin_thread >= 0 ? n_threads - 1 : n_threads;
+}
+
+/**
+ * The polling threads with an id below this poll, the others stop at the end
+ * of their current iteration of the polling loop. Thread 0 is the main thread.
+ */
+static volatile int n_active_threads = 0;
+static THREAD *poll_threads = NULL;         /*< Handles of the started threads */
+static bool *poll_thread_started = NULL;    /*< Whether the thread of a slot is yet to be joined */
+static void (*poll_thread_main)(void *) = NULL; /*< Entry point of the polling threads */
+static pthread_mutex_t poll_thread_lock = PTHREAD_MUTEX_INITIALIZER; /*< Serializes starting and joining */
 
 /**
  * Internal MaxScale thread states
@@ -123,9 +412,62 @@ typedef enum
     THREAD_ZPROCESSING
 } THREAD_STATE;
 
+/** Bytes of the routed statement kept for the watchdog */
+#define POLL_QUERY_PREVIEW 256
+
+/** Stack frames captured by the watchdog */
+#define POLL_STACK_DEPTH 64
+
+/** The signal used to capture the stack of a polling thread */
+#define POLL_STACK_SIGNAL SIGUSR2
+
+/**
+ * The event handlers whose execution time is measured
+ */
+typedef enum
+{
+    POLL_HANDLER_READ,
+    POLL_HANDLER_WRITE,
+    POLL_HANDLER_ERROR,
+    POLL_HANDLER_HANGUP,
+    POLL_N_HANDLERS
+} POLL_HANDLER;
+
+static const char *poll_handler_names[POLL_N_HANDLERS] =
+{
+    "read",
+    "write",
+    "error",
+    "hangup"
+};
+
+/** Threads whose events arrive further apart than this do not spin */
+#define POLL_SPIN_MAX_GAP_NS 200000
+/** Upper limit of the adaptive number of non-blocking polls */
+#define POLL_SPIN_MAX 10000
+/** Number of events a thread receives if the configured batch cannot be allocated */
+#define POLL_FALLBACK_EVENTS 64
+
+/**
+ * The state of the adaptive polling of a thread. The number of non-blocking
+ * polls done before blocking and the timeout of the blocking poll follow the
+ * time between the polls that return events.
+ */
+typedef struct
+{
+    uint64_t last_event_ns; /*< When a poll last returned events */
+    int64_t avg_gap_ns;     /*< Moving average of the time between polls with events */
+    int64_t spin_ns;        /*< Moving average of the cost of a non-blocking poll */
+    int spins;              /*< Non-blocking polls done before blocking */
+    int timeout;            /*< Timeout of the blocking poll in milliseconds */
+} POLL_TUNING;
+
 /**
  * Thread data used to report the current state and activity related to
  * a thread
+ *
+ * The counters and times are only written by the thread itself and are read
+ * without locking by the threads that report them.
  */
 typedef struct
 {
@@ -133,10 +475,112 @@ typedef struct
     int n_fds;          /*< No. of descriptors thread is processing */
     DCB *cur_dcb;       /*< Current DCB being processed */
     uint32_t event;     /*< Current event being processed */
+    int n_dcbs;         /*< No. of DCBs owned by the thread in the poll set */
+    uint64_t n_events;  /*< No. of events processed */
+    uint64_t handler_ns[POLL_N_HANDLERS]; /*< Time spent in each event handler */
+    uint64_t wait_ns;   /*< Time spent in epoll_wait */
+    bool has_cpu_clock; /*< Whether cpu_clock is valid */
+    clockid_t cpu_clock; /*< Clock measuring the CPU time of the thread */
+    uint64_t last_busy_ns; /*< Handler time at the previous load sample */
+    double load;        /*< Moving average of the share of time spent in handlers */
+    pthread_t thread;   /*< The thread, for signalling it */
+    unsigned long event_started; /*< Heartbeat when the current event was started */
+    uint64_t reported_event; /*< The last event reported by the watchdog */
+    char query[POLL_QUERY_PREVIEW]; /*< Start of the statement being routed */
+    int query_len;      /*< Length of query, 0 if no statement is routed */
+    void *stack[POLL_STACK_DEPTH]; /*< Stack captured for the watchdog */
+    int stack_depth;    /*< No. of frames in stack */
+    uint64_t stack_event; /*< The event during which the stack was captured */
+    POLL_TUNING tuning; /*< Adaptive polling state */
 } THREAD_DATA;
 
 static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
 
+/**
+ * The weight of the newest sample in the moving average of the thread load,
+ * with a sample every POLL_LOAD_FREQ seconds the older samples fade out in
+ * about a minute.
+ */
+#define POLL_LOAD_WEIGHT 0.3
+
+/** Heartbeats an event may run before the watchdog reports it, 0 if never */
+static unsigned long watchdog_threshold = 0;
+
+static void poll_watchdog(void *);
+static void poll_stack_handler(int sig);
+
+/**
+ * Return the current time of the monotonic clock
+ *
+ * @return The time in nanoseconds
+ */
+static inline uint64_t
+poll_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Add the time since the start of an event handler to the handler time of
+ * a thread
+ *
+ * @param thread_id The thread that ran the handler
+ * @param handler   The handler
+ * @param start     When the handler was started
+ * @return The current time, the start of the next handler
+ */
+static inline uint64_t
+poll_handler_done(int thread_id, POLL_HANDLER handler, uint64_t start)
+{
+    uint64_t now = poll_clock();
+
+    if (thread_data)
+    {
+        thread_data[thread_id].handler_ns[handler] += now - start;
+    }
+    return now;
+}
+
+/**
+ * Return the total time a thread has spent in the event handlers
+ *
+ * @param thread_id The thread
+ * @return The time in nanoseconds
+ */
+static uint64_t
+poll_busy_time(int thread_id)
+{
+    uint64_t busy = 0;
+
+    for (int i = 0; i < POLL_N_HANDLERS; i++)
+    {
+        busy += thread_data[thread_id].handler_ns[i];
+    }
+    return busy;
+}
+
+/**
+ * Return the CPU time a polling thread has used
+ *
+ * @param thread_id The thread
+ * @return The time in seconds, 0 if the thread is not running
+ */
+static double
+poll_cpu_time(int thread_id)
+{
+    struct timespec ts;
+
+    if (thread_data[thread_id].state == THREAD_STOPPED ||
+        !thread_data[thread_id].has_cpu_clock ||
+        clock_gettime(thread_data[thread_id].cpu_clock, &ts) != 0)
+    {
+        return 0.0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /**
  * The number of buckets used to gather statistics about how many
  * descriptors where processed on each epoll completion.
@@ -158,16 +602,15 @@ static struct
     ts_stats_t *n_error;        /*< Number of error events  */
     ts_stats_t *n_hup;          /*< Number of hangup events */
     ts_stats_t *n_accept;       /*< Number of accept events */
+    ts_stats_t *n_throttled;    /*< Number of reads delayed for a slow client */
     ts_stats_t *n_polls;        /*< Number of poll cycles   */
     ts_stats_t *n_pollev;       /*< Number of polls returning events */
     ts_stats_t *n_nbpollev;     /*< Number of polls returning events */
     ts_stats_t *n_nothreads;    /*< Number of times no threads are polling */
-    int n_fds[MAXNFDS];         /*< Number of wakeups with particular n_fds value */
-    int evq_length;             /*< Event queue length */
-    int evq_pending;            /*< Number of pending descriptors in event queue */
-    int evq_max;                /*< Maximum event queue length */
-    int wake_evqpending;        /*< Woken from epoll_wait with pending events in queue */
+    ts_histogram_t n_fds;       /*< Number of wakeups with particular n_fds value */
+    ts_stats_t *wake_evqpending; /*< Woken from epoll_wait with pending events in queue */
     ts_stats_t *blockingpolls;  /*< Number of epoll_waits with a timeout specified */
+    ts_stats_t *n_steals;       /*< Number of events taken from the queue of another thread */
 } pollStats;
 
 #define N_QUEUE_TIMES   30
@@ -176,12 +619,19 @@ static struct
  */
 static struct
 {
-    unsigned int qtimes[N_QUEUE_TIMES + 1];
-    unsigned int exectimes[N_QUEUE_TIMES + 1];
-    unsigned long maxqtime;
-    unsigned long maxexectime;
+    ts_histogram_t qtimes;      /*< Queue times in heartbeats, N_QUEUE_TIMES + 1 buckets */
+    ts_histogram_t exectimes;   /*< Execution times in heartbeats */
+    ts_stats_t *maxqtime;       /*< Longest queue time of each thread */
+    ts_stats_t *maxexectime;    /*< Longest execution time of each thread */
 } queueStats;
 
+/**
+ * The minimum number of DCBs with pending events a poll set must have before
+ * an idle thread takes work from it. The owner is usually busy with the first
+ * one, so it is only worth stealing if there is at least one more waiting.
+ */
+#define POLL_STEAL_MIN_PENDING 2
+
 /**
  * How frequently to call the poll_loadav function used to monitor the load
  * average of the poll subsystem.
@@ -197,6 +647,42 @@ static void poll_loadav(void *);
  */
 static int poll_resolve_error(DCB *, int, bool);
 
+/**
+ * Create the epoll instance of a poll set
+ *
+ * @param set    The poll set
+ * @param wakeup Whether other threads can wake up the owner of the set
+ */
+static void
+poll_set_init(POLL_SET *set, bool wakeup)
+{
+    spinlock_init(&set->lock);
+    set->wakeup_fd = -1;
+    if ((set->epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+    {
+        perror("epoll_create");
+        exit(-1);
+    }
+    if (wakeup)
+    {
+        /**
+         * Events can be added to the queue of a thread by other threads,
+         * the event descriptor is used to wake up the owner if it is
+         * blocked in epoll_wait. It is recognized by the NULL pointer.
+         */
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if ((set->wakeup_fd = eventfd(0, EFD_NONBLOCK)) == -1 ||
+            epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, set->wakeup_fd, &ev) == -1)
+        {
+            perror("eventfd");
+            exit(-1);
+        }
+    }
+}
+
 /**
  * Initialise the polling system we are using for the gateway.
  *
@@ -207,21 +693,57 @@ poll_init()
 {
     int i;
 
-    if (epoll_fd != -1)
+    if (poll_sets != NULL)
     {
         return;
     }
-    if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+    n_threads = config_max_threadcount();
+    n_active_threads = config_threadcount();
+    if (config_admin_thread())
     {
-        perror("epoll_create");
+        admin_thread = n_threads - 1;
+    }
+    n_poll_sets = config_poll_affinity() ? n_active_threads : 1;
+    if (n_poll_sets > 1 && poll_max_workers() > n_active_threads)
+    {
+        MXS_WARNING("The number of threads cannot be changed at runtime when "
+                    "poll_affinity is enabled, max_threads is ignored.");
+    }
+    if ((poll_threads = (THREAD *)calloc(n_threads, sizeof(THREAD))) == NULL ||
+        (poll_thread_started = (bool *)calloc(n_threads, sizeof(bool))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    work_stealing = n_poll_sets > 1 && config_poll_work_stealing();
+    if ((poll_sets = (POLL_SET *)calloc(n_poll_sets, sizeof(POLL_SET))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
         exit(-1);
     }
+    for (i = 0; i < n_poll_sets; i++)
+    {
+        poll_set_init(&poll_sets[i], n_poll_sets > 1);
+    }
+    if (admin_thread >= 0)
+    {
+        if ((admin_set = (POLL_SET *)calloc(1, sizeof(POLL_SET))) == NULL)
+        {
+            perror("Fatal error: Memory allocation failed.");
+            exit(-1);
+        }
+        poll_set_init(admin_set, true);
+    }
     memset(&pollStats, 0, sizeof(pollStats));
     memset(&queueStats, 0, sizeof(queueStats));
     bitmask_init(&poll_mask);
-    n_threads = config_threadcount();
+    rcu_init(n_threads);
+    timerwheel_init(n_threads);
+    timerwheel_set_active(n_active_threads);
+    timerwheel_set_dedicated(admin_thread);
     if ((thread_data = (THREAD_DATA *)malloc(n_threads * sizeof(THREAD_DATA))) != NULL)
     {
+        memset(thread_data, 0, n_threads * sizeof(THREAD_DATA));
         for (i = 0; i < n_threads; i++)
         {
             thread_data[i].state = THREAD_STOPPED;
@@ -233,11 +755,21 @@ poll_init()
         (pollStats.n_error = ts_stats_alloc()) == NULL ||
         (pollStats.n_hup = ts_stats_alloc()) == NULL ||
         (pollStats.n_accept = ts_stats_alloc()) == NULL ||
+        (pollStats.n_throttled = ts_stats_alloc()) == NULL ||
         (pollStats.n_polls = ts_stats_alloc()) == NULL ||
         (pollStats.n_pollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nbpollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nothreads = ts_stats_alloc()) == NULL ||
-        (pollStats.blockingpolls = ts_stats_alloc()) == NULL)
+        (pollStats.blockingpolls = ts_stats_alloc()) == NULL ||
+        (pollStats.n_steals = ts_stats_alloc()) == NULL ||
+        (pollStats.wake_evqpending = ts_stats_alloc()) == NULL ||
+        (pollStats.n_fds = ts_histogram_alloc(MAXNFDS)) == NULL ||
+        (queueStats.qtimes = ts_histogram_alloc(N_QUEUE_TIMES + 1)) == NULL ||
+        (queueStats.exectimes = ts_histogram_alloc(N_QUEUE_TIMES + 1)) == NULL ||
+        (queueStats.maxqtime = ts_stats_alloc()) == NULL ||
+        (queueStats.maxexectime = ts_stats_alloc()) == NULL ||
+        (load_samples = ts_stats_alloc()) == NULL ||
+        (load_nfds = ts_stats_alloc()) == NULL)
     {
         perror("Fatal error: Memory allocation failed.");
         exit(-1);
@@ -262,6 +794,36 @@ poll_init()
 
     number_poll_spins = config_nbpolls();
     max_poll_sleep = config_pollsleep();
+    poll_max_events = config_poll_max_events();
+    poll_adaptive = config_poll_adaptive();
+
+    int threshold = config_event_watchdog_threshold();
+
+    if (threshold > 0 && thread_data)
+    {
+        struct sigaction sigact;
+        void *frame;
+
+        memset(&sigact, 0, sizeof(sigact));
+        sigact.sa_handler = poll_stack_handler;
+        sigact.sa_flags = SA_RESTART;
+        /** The first call of backtrace loads libgcc, which is not safe to do
+         * in a signal handler */
+        backtrace(&frame, 1);
+
+        if (sigaction(POLL_STACK_SIGNAL, &sigact, NULL) == 0)
+        {
+            watchdog_threshold = threshold < 100 ? 1 : threshold / 100;
+            session_watch_queries = true;
+            hktask_add("Event Watchdog", poll_watchdog, NULL, 1);
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to install the signal handler of the event watchdog: %s",
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+    }
 
 #if PROFILE_POLL
     plog = memlog_create("EventQueueWaitTime", ML_LONG, 10000);
@@ -328,13 +890,14 @@ poll_add_dcb(DCB *dcb)
                   dcb,
                   STRDCBSTATE(dcb->state));
     }
+    memlog_ring_log(MLR_DCB_STATE, dcb, dcb->state, new_state);
     dcb->state = new_state;
     spinlock_release(&dcb->dcb_initlock);
     /*
      * The only possible failure that will not cause a crash is
      * running out of system resources.
      */
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
+    rc = epoll_ctl(poll_set_of(dcb)->epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
     if (rc)
     {
         /* Some errors are actually considered acceptable */
@@ -342,6 +905,10 @@ poll_add_dcb(DCB *dcb)
     }
     if (0 == rc)
     {
+        if (thread_data && dcb->owner >= 0 && dcb->owner < n_threads)
+        {
+            atomic_add(&thread_data[dcb->owner].n_dcbs, 1);
+        }
         MXS_DEBUG("%lu [poll_add_dcb] Added dcb %p in state %s to poll set.",
                   pthread_self(),
                   dcb,
@@ -388,6 +955,7 @@ poll_remove_dcb(DCB *dcb)
     /*<
      * Set state to NOPOLLING and remove dcb from poll set.
      */
+    memlog_ring_log(MLR_DCB_STATE, dcb, dcb->state, DCB_STATE_NOPOLLING);
     dcb->state = DCB_STATE_NOPOLLING;
 
     /**
@@ -401,7 +969,7 @@ poll_remove_dcb(DCB *dcb)
     spinlock_release(&dcb->dcb_initlock);
     if (dcbfd > 0)
     {
-        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
+        rc = epoll_ctl(poll_set_of(dcb)->epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
         /**
          * The poll_resolve_error function will always
          * return 0 or crash.  So if it returns non-zero result,
@@ -415,6 +983,10 @@ poll_remove_dcb(DCB *dcb)
         {
             raise(SIGABRT);
         }
+        if (thread_data && dcb->owner >= 0 && dcb->owner < n_threads)
+        {
+            atomic_add(&thread_data[dcb->owner].n_dcbs, -1);
+        }
     }
     return rc;
 }
@@ -497,6 +1069,65 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
                          *  debugging easier.
                          */
 
+/**
+ * Note the cost of a non-blocking poll that returned no events
+ *
+ * @param tuning The adaptive polling state of the thread
+ * @param start  When the poll was started
+ */
+static inline void
+poll_note_spin(POLL_TUNING *tuning, uint64_t start)
+{
+    if (poll_adaptive)
+    {
+        tuning->spin_ns += ((int64_t)(poll_clock() - start) - tuning->spin_ns) / 8;
+    }
+}
+
+/**
+ * Adjust the adaptive polling of a thread after a poll
+ *
+ * A thread whose events arrive close to each other spins with non-blocking
+ * polls for about twice the average time between the events, as the next
+ * event is likely to arrive before it could go to sleep and be woken up. A
+ * thread whose events are further apart blocks at once. The timeout of the
+ * blocking poll grows with the time between the events and with the time
+ * the thread has been idle, up to poll_sleep.
+ *
+ * @param tuning The state of the thread
+ * @param now    The current time
+ * @param nfds   Number of events the poll returned
+ */
+static void
+poll_tune(POLL_TUNING *tuning, uint64_t now, int nfds)
+{
+    if (nfds > 0)
+    {
+        if (tuning->last_event_ns)
+        {
+            int64_t gap = now - tuning->last_event_ns;
+            tuning->avg_gap_ns += (gap - tuning->avg_gap_ns) / 8;
+        }
+        tuning->last_event_ns = now;
+    }
+
+    if (tuning->avg_gap_ns < POLL_SPIN_MAX_GAP_NS && tuning->spin_ns > 0)
+    {
+        int64_t spins = 2 * tuning->avg_gap_ns / tuning->spin_ns;
+        tuning->spins = spins < POLL_SPIN_MAX ? spins : POLL_SPIN_MAX;
+    }
+    else
+    {
+        tuning->spins = 0;
+    }
+
+    int64_t idle = now - tuning->last_event_ns;
+    int64_t gap = tuning->avg_gap_ns > idle ? tuning->avg_gap_ns : idle;
+    int64_t timeout = gap / 1000000;
+
+    tuning->timeout = timeout < 1 ? 1 : timeout > max_poll_sleep ? max_poll_sleep : timeout;
+}
+
 /**
  * The main polling loop
  *
@@ -546,35 +1177,80 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
  * point there is an event to be processed then the value will be reduced to 10% again
  * for the next blocking call.
  *
+ * With poll_adaptive, the number of non-blocking polls and the timeout are
+ * instead derived from the recent arrival rate of the events, see poll_tune.
+ *
  * @param arg   The thread ID passed as a void * to satisfy the threading package
  */
 void
 poll_waitevents(void *arg)
 {
-    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event fallback_events[POLL_FALLBACK_EVENTS];
+    struct epoll_event *events;
+    int max_events = poll_max_events;
     int i, nfds, timeout_bias = 1;
     intptr_t thread_id = (intptr_t)arg;
     int poll_spins = 0;
+    POLL_SET *set = poll_set_of_thread(thread_id);
+    POLL_TUNING local_tuning;
+    POLL_TUNING *tuning = thread_data ? &thread_data[thread_id].tuning : &local_tuning;
+
+    if ((events = (struct epoll_event *)malloc(max_events * sizeof(*events))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate room for %d events, polling thread %d "
+                  "receives at most %d events at a time.",
+                  max_events, (int)thread_id, POLL_FALLBACK_EVENTS);
+        events = fallback_events;
+        max_events = POLL_FALLBACK_EVENTS;
+    }
+
+    memset(tuning, 0, sizeof(*tuning));
+    tuning->spins = number_poll_spins;
+    tuning->timeout = max_poll_sleep;
 
     ts_stats_set_thread_id(thread_id);
+    poll_thread_id = thread_id;
 
     /** Add this thread to the bitmask of running polling threads */
     bitmask_set(&poll_mask, thread_id);
+    rcu_thread_start(thread_id);
+    if (thread_id == admin_thread &&
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), POLL_ADMIN_NICE) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_WARNING("Failed to lower the priority of the admin thread: %s",
+                    strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
     if (thread_data)
     {
         thread_data[thread_id].state = THREAD_IDLE;
+        thread_data[thread_id].has_cpu_clock =
+            pthread_getcpuclockid(pthread_self(), &thread_data[thread_id].cpu_clock) == 0;
+        thread_data[thread_id].thread = pthread_self();
+    }
+
+    if (watchdog_threshold)
+    {
+        /** All signals are blocked, let the watchdog capture the stack */
+        sigset_t sigset;
+        sigemptyset(&sigset);
+        sigaddset(&sigset, POLL_STACK_SIGNAL);
+        pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
     }
 
     while (1)
     {
-        if (pollStats.evq_pending == 0 && timeout_bias < 10)
+        if (set->evq_pending == 0 && timeout_bias < 10)
         {
             timeout_bias++;
         }
 
+        int spin_limit = poll_adaptive ? tuning->spins : number_poll_spins;
+        int timeout = poll_adaptive ? tuning->timeout : (max_poll_sleep * timeout_bias) / 10;
+        uint64_t wait_start = poll_clock();
         atomic_add(&n_waiting, 1);
 #if BLOCKINGPOLL
-        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        nfds = epoll_wait(set->epoll_fd, events, max_events, -1);
         atomic_add(&n_waiting, -1);
 #else /* BLOCKINGPOLL */
 #if MUTEX_EPOLL
@@ -586,7 +1262,7 @@ poll_waitevents(void *arg)
         }
 
         ts_stats_add(pollStats.n_polls, 1);
-        if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0)) == -1)
+        if ((nfds = epoll_wait(set->epoll_fd, events, max_events, 0)) == -1)
         {
             atomic_add(&n_waiting, -1);
             int eno = errno;
@@ -606,22 +1282,25 @@ poll_waitevents(void *arg)
          * We calculate a timeout bias to alter the length of the blocking
          * call based on the time since we last received an event to process
          */
-        else if (nfds == 0 && pollStats.evq_pending == 0 && poll_spins++ > number_poll_spins)
+        else if (nfds == 0 && set->evq_pending == 0 && poll_spins++ > spin_limit)
         {
+            poll_note_spin(tuning, wait_start);
             ts_stats_add(pollStats.blockingpolls, 1);
-            nfds = epoll_wait(epoll_fd,
-                              events,
-                              MAX_EVENTS,
-                              (max_poll_sleep * timeout_bias) / 10);
-            if (nfds == 0 && pollStats.evq_pending)
+            nfds = epoll_wait(set->epoll_fd, events, max_events, timeout);
+            if (nfds == 0 && set->evq_pending)
             {
-                atomic_add(&pollStats.wake_evqpending, 1);
+                ts_stats_add(pollStats.wake_evqpending, 1);
                 poll_spins = 0;
             }
         }
         else
         {
             atomic_add(&n_waiting, -1);
+
+            if (nfds == 0)
+            {
+                poll_note_spin(tuning, wait_start);
+            }
         }
 
         if (n_waiting == 0)
@@ -632,10 +1311,22 @@ poll_waitevents(void *arg)
         simple_mutex_unlock(&epoll_wait_mutex);
 #endif
 #endif /* BLOCKINGPOLL */
+        uint64_t wait_end = poll_clock();
+
+        if (thread_data)
+        {
+            thread_data[thread_id].wait_ns += wait_end - wait_start;
+        }
+
+        if (poll_adaptive)
+        {
+            poll_tune(tuning, wait_end, nfds);
+        }
+
         if (nfds > 0)
         {
             timeout_bias = 1;
-            if (poll_spins <= number_poll_spins + 1)
+            if (poll_spins <= spin_limit + 1)
             {
                 ts_stats_add(pollStats.n_nbpollev, 1);
             }
@@ -652,11 +1343,10 @@ poll_waitevents(void *arg)
                 thread_data[thread_id].state = THREAD_PROCESSING;
             }
 
-            pollStats.n_fds[(nfds < MAXNFDS ? (nfds - 1) : MAXNFDS - 1)]++;
+            ts_histogram_add(pollStats.n_fds, nfds - 1);
 
-            load_average = (load_average * load_samples + nfds) / (load_samples + 1);
-            atomic_add(&load_samples, 1);
-            atomic_add(&load_nfds, nfds);
+            ts_stats_add(load_samples, 1);
+            ts_stats_add(load_nfds, nfds);
 
             /*
              * Process every DCB that has a new event and add
@@ -668,76 +1358,85 @@ poll_waitevents(void *arg)
              * idle and is added to the queue to process after
              * setting the event bits.
              */
+            uint64_t queued_ns = qtrace_enabled() ? qtrace_now() : 0;
+
             for (i = 0; i < nfds; i++)
             {
                 DCB *dcb = (DCB *)events[i].data.ptr;
                 __uint32_t ev = events[i].events;
 
-                spinlock_acquire(&pollqlock);
+                if (dcb == NULL)
+                {
+                    /** Woken up by another thread, the events are already queued */
+                    uint64_t count;
+                    if (read(set->wakeup_fd, &count, sizeof(count)) == -1)
+                    {
+                        errno = 0;
+                    }
+                    continue;
+                }
+
+                spinlock_acquire(&set->lock);
                 if (DCB_POLL_BUSY(dcb))
                 {
                     if (dcb->evq.pending_events == 0)
                     {
-                        pollStats.evq_pending++;
+                        set->evq_pending++;
                         dcb->evq.inserted = hkheartbeat;
+                        dcb->evq.queued_ns = queued_ns;
                     }
                     dcb->evq.pending_events |= ev;
                 }
                 else
                 {
                     dcb->evq.pending_events = ev;
-                    if (eventq)
-                    {
-                        dcb->evq.prev = eventq->evq.prev;
-                        eventq->evq.prev->evq.next = dcb;
-                        eventq->evq.prev = dcb;
-                        dcb->evq.next = eventq;
-                    }
-                    else
-                    {
-                        eventq = dcb;
-                        dcb->evq.prev = dcb;
-                        dcb->evq.next = dcb;
-                    }
-                    pollStats.evq_length++;
-                    pollStats.evq_pending++;
+                    poll_evq_append(set, dcb);
+                    set->evq_pending++;
                     dcb->evq.inserted = hkheartbeat;
-                    if (pollStats.evq_length > pollStats.evq_max)
-                    {
-                        pollStats.evq_max = pollStats.evq_length;
-                    }
+                    dcb->evq.queued_ns = queued_ns;
                 }
-                spinlock_release(&pollqlock);
+                spinlock_release(&set->lock);
             }
         }
 
+        /** The writes made while processing the events are submitted together */
+        dcb_defer_writes(thread_id);
+
         /*
          * Process of the queue of waiting requests
          * This is done without checking the evq_pending count as a
          * precautionary measure to avoid issues if the house keeping
          * of the count goes wrong.
          */
-        if (process_pollq(thread_id))
+        if (process_pollq(thread_id, set, false))
         {
             timeout_bias = 1;
         }
-
-        if (check_timeouts && hkheartbeat >= next_timeout_check)
+        else if (work_stealing && thread_id != admin_thread && poll_steal_work(thread_id))
         {
-            process_idle_sessions();
+            timeout_bias = 1;
+            poll_spins = 0;
         }
 
+        /** Expire the idle sessions and pooled connections of this thread */
+        timerwheel_process(thread_id);
+        dcb_flush_writes(thread_id);
+
         if (thread_data)
         {
             thread_data[thread_id].state = THREAD_ZPROCESSING;
         }
+        /** The thread no longer refers to anything it has read before */
+        rcu_quiescent(thread_id);
         dcb_process_zombies(thread_id);
         if (thread_data)
         {
             thread_data[thread_id].state = THREAD_IDLE;
         }
 
-        if (do_shutdown)
+        int n_active = n_active_threads;
+
+        if (do_shutdown || (thread_id >= n_active && thread_id != admin_thread))
         {
             /*<
              * Remove the thread from the bitmask of running
@@ -748,6 +1447,18 @@ poll_waitevents(void *arg)
                 thread_data[thread_id].state = THREAD_STOPPED;
             }
             bitmask_clear(&poll_mask, thread_id);
+            if (!do_shutdown)
+            {
+                /** The timers of the thread would never expire if they stayed in its wheel */
+                timerwheel_move(thread_id, thread_id % n_active);
+                MXS_NOTICE("Polling thread %d stopped.", (int)thread_id);
+            }
+            dcb_thread_stop(thread_id);
+            rcu_thread_stop(thread_id);
+            if (events != fallback_events)
+            {
+                free(events);
+            }
             return;
         }
         if (thread_data)
@@ -804,60 +1515,58 @@ poll_set_maxwait(unsigned int maxwait)
  * Thread local storage (tls_log_info_t) follows thread and is accessed every
  * time log is written to particular log.
  *
+ * When an idle thread steals work from the queue of another thread, the DCB
+ * stays in the queue it was taken from and is marked as being processed in
+ * the same way as when the owner processes it. The processing flag therefore
+ * still guarantees that only one thread at a time handles the events of a DCB.
+ * A thief never waits for the lock of the queue, that would only slow down
+ * the owner.
+ *
  * @param thread_id     The thread ID of the calling thread
+ * @param set           The poll set whose queue is processed
+ * @param steal         True if the queue belongs to another thread
  * @return              0 if no DCB's have been processed
  */
 static int
-process_pollq(int thread_id)
+process_pollq(int thread_id, POLL_SET *set, bool steal)
 {
     DCB *dcb;
     int found = 0;
     uint32_t ev;
     unsigned long qtime;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    if (steal)
     {
-        /* Nothing to process */
-        spinlock_release(&pollqlock);
-        return 0;
+        if (!spinlock_acquire_nowait(&set->lock))
+        {
+            return 0;
+        }
     }
-    dcb = eventq;
-    if (dcb->evq.next == dcb->evq.prev && dcb->evq.processing == 0)
+    else
     {
-        found = 1;
-        dcb->evq.processing = 1;
+        spinlock_acquire(&set->lock);
     }
-    else if (dcb->evq.next == dcb->evq.prev)
+    if (set->active == 0)
     {
-        /* Only item in queue is being processed */
-        spinlock_release(&pollqlock);
+        /* Nothing to process */
+        spinlock_release(&set->lock);
         return 0;
     }
-    else
+    if ((dcb = poll_evq_next(set)) != NULL)
     {
-        do
-        {
-            dcb = dcb->evq.next;
-        }
-        while (dcb != eventq && dcb->evq.processing == 1);
-
-        if (dcb->evq.processing == 0)
-        {
-            /* Found DCB to process */
-            dcb->evq.processing = 1;
-            found = 1;
-        }
+        /* Found DCB to process */
+        dcb->evq.processing = 1;
+        found = 1;
     }
     if (found)
     {
         ev = dcb->evq.pending_events;
         dcb->evq.processing_events = ev;
         dcb->evq.pending_events = 0;
-        pollStats.evq_pending--;
-        ss_dassert(pollStats.evq_pending >= 0);
+        set->evq_pending--;
+        ss_dassert(set->evq_pending >= 0);
     }
-    spinlock_release(&pollqlock);
+    spinlock_release(&set->lock);
 
     if (found == 0)
     {
@@ -870,23 +1579,22 @@ process_pollq(int thread_id)
     qtime = hkheartbeat - dcb->evq.inserted;
     dcb->evq.started = hkheartbeat;
 
-    if (qtime > N_QUEUE_TIMES)
-    {
-        queueStats.qtimes[N_QUEUE_TIMES]++;
-    }
-    else
-    {
-        queueStats.qtimes[qtime]++;
-    }
-    if (qtime > queueStats.maxqtime)
+    ts_histogram_add(queueStats.qtimes, qtime);
+    ts_stats_set_max(queueStats.maxqtime, qtime);
+
+    if (qtrace_enabled())
     {
-        queueStats.maxqtime = qtime;
+        qtrace_event_begin(dcb->evq.queued_ns);
     }
 
 
     CHK_DCB(dcb);
+    memlog_ring_log(MLR_EVENT, dcb, ev, dcb->fd);
+
     if (thread_data)
     {
+        thread_data[thread_id].n_events++;
+        thread_data[thread_id].event_started = dcb->evq.started;
         thread_data[thread_id].state = THREAD_PROCESSING;
         thread_data[thread_id].cur_dcb = dcb;
         thread_data[thread_id].event = ev;
@@ -921,6 +1629,8 @@ process_pollq(int thread_id)
               dcb,
               STRDCBROLE(dcb->dcb_role));
 
+    uint64_t handler_start = poll_clock();
+
     if (ev & EPOLLOUT)
     {
         int eno = 0;
@@ -937,6 +1647,11 @@ process_pollq(int thread_id)
             if (poll_dcb_session_check(dcb, "write_ready"))
             {
                 dcb->func.write_ready(dcb);
+
+                if (dcb->splice_src)
+                {
+                    dcb_splice_resume(dcb);
+                }
             }
         }
         else
@@ -951,6 +1666,7 @@ process_pollq(int thread_id)
                       dcb,
                       dcb->fd);
         }
+        handler_start = poll_handler_done(thread_id, POLL_HANDLER_WRITE, handler_start);
     }
     if (ev & EPOLLIN)
     {
@@ -970,6 +1686,11 @@ process_pollq(int thread_id)
                 dcb->func.accept(dcb);
             }
         }
+        else if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER && dcb_throttle_read(dcb))
+        {
+            /** The client is too far behind, the read is done once it catches up */
+            ts_stats_add(pollStats.n_throttled, 1);
+        }
         else
         {
             MXS_DEBUG("%lu [poll_waitevents] "
@@ -996,11 +1717,31 @@ process_pollq(int thread_id)
                 }
                 if (1 == return_code)
                 {
-                    dcb->func.read(dcb);
+                    if (DCB_IS_SPLICED(dcb))
+                    {
+                        dcb_splice_pump(dcb);
+                    }
+                    else
+                    {
+                        dcb->func.read(dcb);
+
+                        if (dcb->splice)
+                        {
+                            dcb_splice_activate(dcb);
+                        }
+                    }
                 }
             }
         }
+        handler_start = poll_handler_done(thread_id, POLL_HANDLER_READ, handler_start);
+    }
+    if ((ev & (EPOLLERR | EPOLLHUP)) && dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER &&
+        dcb->server)
+    {
+        /** Let the monitors check the server without waiting for their interval */
+        monitor_report_server_error(dcb->server);
     }
+
     if (ev & EPOLLERR)
     {
         int eno = gw_getsockerrno(dcb->fd);
@@ -1037,6 +1778,7 @@ process_pollq(int thread_id)
         {
             dcb->func.error(dcb);
         }
+        handler_start = poll_handler_done(thread_id, POLL_HANDLER_ERROR, handler_start);
     }
 
     if (ev & EPOLLHUP)
@@ -1072,6 +1814,7 @@ process_pollq(int thread_id)
         {
             spinlock_release(&dcb->dcb_initlock);
         }
+        handler_start = poll_handler_done(thread_id, POLL_HANDLER_HANGUP, handler_start);
     }
 
 #ifdef EPOLLRDHUP
@@ -1108,126 +1851,432 @@ process_pollq(int thread_id)
         {
             spinlock_release(&dcb->dcb_initlock);
         }
+        poll_handler_done(thread_id, POLL_HANDLER_HANGUP, handler_start);
     }
 #endif
+    dcb_charge_readq(dcb);
     qtime = hkheartbeat - dcb->evq.started;
 
-    if (qtime > N_QUEUE_TIMES)
-    {
-        queueStats.exectimes[N_QUEUE_TIMES]++;
-    }
-    else
+    if (thread_data)
     {
-        queueStats.exectimes[qtime % N_QUEUE_TIMES]++;
+        thread_data[thread_id].cur_dcb = NULL;
     }
-    if (qtime > queueStats.maxexectime)
+
+    if (qtrace_enabled())
     {
-        queueStats.maxexectime = qtime;
+        qtrace_event_end();
     }
 
-    spinlock_acquire(&pollqlock);
+    ts_histogram_add(queueStats.exectimes, qtime);
+    ts_stats_set_max(queueStats.maxexectime, qtime);
+
+    spinlock_acquire(&set->lock);
     dcb->evq.processing_events = 0;
 
     if (dcb->evq.pending_events == 0)
     {
         /* No pending events so remove from the queue */
-        if (dcb->evq.prev != dcb)
-        {
-            dcb->evq.prev->evq.next = dcb->evq.next;
-            dcb->evq.next->evq.prev = dcb->evq.prev;
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-        }
-        else
-        {
-            eventq = NULL;
-        }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
+        poll_evq_remove(set, dcb);
     }
     else
     {
         /*
          * We have a pending event, move to the end of the queue
          * if there are any other DCB's in the queue.
-         *
-         * If we are the first item on the queue this is easy, we
-         * just bump the eventq pointer.
          */
-        if (dcb->evq.prev != dcb)
+        poll_evq_requeue(set, dcb);
+    }
+    dcb->evq.processing = 0;
+    /** Reset session id from thread's local storage */
+    mxs_log_tls.li_sesid = 0;
+    spinlock_release(&set->lock);
+
+    return 1;
+}
+
+/**
+ *
+ * Check that the DCB has a session link before processing.
+ * If not, log an error.  Processing will be bypassed
+ *
+ * @param   dcb         The DCB to check
+ * @param   function    The name of the function about to be called
+ * @return  bool        Does the DCB have a non-null session link
+ */
+static bool
+poll_dcb_session_check(DCB *dcb, const char *function)
+{
+    if (dcb->session)
+    {
+        return true;
+    }
+    else
+    {
+        MXS_ERROR("%lu [%s] The dcb %p that was about to be processed by %s does not "
+                  "have a non-null session pointer ",
+                  pthread_self(),
+                  __func__,
+                  dcb,
+                  function);
+        return false;
+    }
+}
+
+/**
+ * Start a polling thread in a slot. The caller must hold poll_thread_lock
+ * unless the threads are started for the first time.
+ *
+ * @param thread_id The slot of the thread
+ * @return True if the thread was started
+ */
+static bool
+poll_start_thread(int thread_id)
+{
+    if (thread_start(&poll_threads[thread_id], poll_thread_main,
+                     (void *)(intptr_t)thread_id) == NULL)
+    {
+        MXS_ERROR("Failed to start polling thread %d.", thread_id);
+        return false;
+    }
+    poll_thread_started[thread_id] = true;
+    return true;
+}
+
+/**
+ * Join the thread of a slot if it was started. The thread must have been
+ * told to stop.
+ *
+ * @param thread_id The slot of the thread
+ */
+static void
+poll_join_thread(int thread_id)
+{
+    if (poll_thread_started[thread_id])
+    {
+        thread_wait(poll_threads[thread_id]);
+        poll_thread_started[thread_id] = false;
+    }
+}
+
+/**
+ * Start the polling threads other than the main thread, which polls when it
+ * calls poll_waitevents itself. The same entry point is used for the threads
+ * started at runtime.
+ *
+ * @param entry The entry point of the threads, it must call poll_waitevents
+ * @return True if all threads were started
+ */
+bool
+poll_start_threads(void (*entry)(void *))
+{
+    poll_thread_main = entry;
+
+    for (int i = 1; i < n_active_threads; i++)
+    {
+        if (!poll_start_thread(i))
         {
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-            else
+            return false;
+        }
+    }
+    if (admin_thread >= 0)
+    {
+        if (!poll_start_thread(admin_thread))
+        {
+            return false;
+        }
+        MXS_NOTICE("Started the admin thread.");
+    }
+    return true;
+}
+
+/**
+ * Wait for the polling threads started with poll_start_threads to stop,
+ * called after poll_shutdown.
+ */
+void
+poll_wait_threads()
+{
+    pthread_mutex_lock(&poll_thread_lock);
+    for (int i = 1; i < n_threads; i++)
+    {
+        poll_join_thread(i);
+    }
+    pthread_mutex_unlock(&poll_thread_lock);
+}
+
+/**
+ * Change the number of polling threads. The threads with the highest ids
+ * stop at the end of their current iteration of the polling loop, the events
+ * of their DCBs are processed by the remaining threads from the shared poll
+ * set. The structures of the threads are sized for max_threads at startup,
+ * so nothing needs to be reallocated.
+ *
+ * This is not possible when each thread has a poll set of its own, as the
+ * DCBs of a stopping thread would have to be moved to another poll set while
+ * events for them may be processed.
+ *
+ * @param count The new number of polling threads
+ * @return True if the number of threads was changed
+ */
+bool
+poll_set_threadcount(int count)
+{
+    if (n_poll_sets > 1)
+    {
+        MXS_ERROR("The number of threads cannot be changed when poll_affinity is enabled.");
+        return false;
+    }
+
+    if (count < 1 || count > poll_max_workers())
+    {
+        MXS_ERROR("Invalid number of threads %d, the value must be between 1 and %d. "
+                  "The upper limit is set with max_threads.", count, poll_max_workers());
+        return false;
+    }
+
+    if (poll_thread_main == NULL || do_shutdown)
+    {
+        MXS_ERROR("The number of threads cannot be changed, the polling "
+                  "threads are not running.");
+        return false;
+    }
+
+    pthread_mutex_lock(&poll_thread_lock);
+    int old_count = n_active_threads;
+    bool rval = true;
+
+    if (count < old_count)
+    {
+        /** The timers added from here on go to the wheels of the remaining threads */
+        timerwheel_set_active(count);
+        n_active_threads = count;
+        MXS_NOTICE("Stopping %d polling threads, %d remain.", old_count - count, count);
+    }
+    else if (count > old_count)
+    {
+        /**
+         * A thread that was told to stop must have done so before its slot
+         * is reused. It notices it at the latest when its blocking poll
+         * times out.
+         */
+        for (int i = old_count; i < count; i++)
+        {
+            poll_join_thread(i);
+        }
+
+        n_active_threads = count;
+        for (int i = old_count; i < count; i++)
+        {
+            if (!poll_start_thread(i))
             {
-                dcb->evq.prev->evq.next = dcb->evq.next;
-                dcb->evq.next->evq.prev = dcb->evq.prev;
-                dcb->evq.prev = eventq->evq.prev;
-                dcb->evq.next = eventq;
-                eventq->evq.prev = dcb;
-                dcb->evq.prev->evq.next = dcb;
+                n_active_threads = i;
+                rval = false;
+                break;
             }
         }
+        timerwheel_set_active(n_active_threads);
+        MXS_NOTICE("Started %d polling threads, %d are running.",
+                   n_active_threads - old_count, n_active_threads);
     }
-    dcb->evq.processing = 0;
-    /** Reset session id from thread's local storage */
-    mxs_log_tls.li_sesid = 0;
-    spinlock_release(&pollqlock);
+    pthread_mutex_unlock(&poll_thread_lock);
+
+    return rval;
+}
+
+/**
+ * Return the number of polling threads that are running
+ *
+ * @return The number of polling threads
+ */
+int
+poll_thread_count()
+{
+    return n_active_threads;
+}
+
+/**
+ * Shutdown the polling loop
+ */
+void
+poll_shutdown()
+{
+    do_shutdown = 1;
+}
+
+/**
+ * Return the bitmask of polling threads
+ *
+ * @return The bitmask of the running polling threads
+ */
+GWBITMASK *
+poll_bitmask()
+{
+    return &poll_mask;
+}
+
+/**
+ * Choose the polling thread that will own a new client connection or
+ * listener. With poll affinity the threads are assigned in a round-robin
+ * fashion, otherwise all DCBs belong to the one shared poll set.
+ *
+ * @return The id of the polling thread
+ */
+int
+poll_assign_thread()
+{
+    if (n_poll_sets > 1)
+    {
+        return (atomic_add(&next_thread, 1) & INT_MAX) % n_poll_sets;
+    }
+    return 0;
+}
+
+/**
+ * Return the id of the calling polling thread. Threads that are not polling
+ * threads, and the main thread before it starts polling, are reported as
+ * thread 0.
+ *
+ * @return The id of the polling thread
+ */
+int
+poll_current_thread()
+{
+    return poll_thread_id < 0 ? 0 : poll_thread_id;
+}
 
-    return 1;
+/**
+ * Return the id of the admin thread that owns the listeners and sessions of
+ * the administrative services
+ *
+ * @return The id of the admin thread, -1 if it is not enabled
+ */
+int
+poll_admin_thread()
+{
+    return admin_thread;
 }
 
 /**
+ * Give a scheduling class to a new service. When all classes are taken, the
+ * service shares class 0 with the DCBs that have no service.
  *
- * Check that the DCB has a session link before processing.
- * If not, log an error.  Processing will be bypassed
+ * @return The scheduling class
+ */
+int
+poll_sched_class_alloc()
+{
+    int c = atomic_add(&next_sched_class, 1);
+
+    if (c >= POLL_SCHED_CLASSES)
+    {
+        MXS_WARNING("More than %d services, the events of the services created from now on "
+                    "are scheduled in a shared class with the default weight.",
+                    POLL_SCHED_CLASSES - 1);
+        return 0;
+    }
+    return c;
+}
+
+/**
+ * Set the number of events a scheduling class may process in its turn
  *
- * @param   dcb         The DCB to check
- * @param   function    The name of the function about to be called
- * @return  bool        Does the DCB have a non-null session link
+ * @param sched_class The scheduling class
+ * @param weight      The weight, between 1 and POLL_SCHED_WEIGHT_MAX
  */
-static bool
-poll_dcb_session_check(DCB *dcb, const char *function)
+void
+poll_set_sched_weight(int sched_class, int weight)
 {
-    if (dcb->session)
+    if (sched_class > 0 && sched_class < POLL_SCHED_CLASSES)
     {
-        return true;
+        sched_weights[sched_class] = weight;
     }
-    else
+}
+
+/**
+ * Wake up the thread owning a poll set after events have been added to its
+ * queue. Nothing needs to be done when the calling thread is the owner, as
+ * it processes the queue before it polls again.
+ *
+ * @param set The poll set that was modified
+ */
+static void
+poll_wakeup(POLL_SET *set)
+{
+    if (set->wakeup_fd != -1 && (poll_thread_id < 0 || set != poll_set_of_thread(poll_thread_id)))
     {
-        MXS_ERROR("%lu [%s] The dcb %p that was about to be processed by %s does not "
-                  "have a non-null session pointer ",
-                  pthread_self(),
-                  __func__,
-                  dcb,
-                  function);
-        return false;
+        uint64_t one = 1;
+
+        if (write(set->wakeup_fd, &one, sizeof(one)) == -1)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to wake up polling thread %d: %d, %s",
+                      (int)(set - poll_sets),
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
     }
 }
 
 /**
- * Shutdown the polling loop
+ * Process an event of another polling thread. The idle thread picks the poll
+ * set with the most DCBs that have pending events, as long as there are
+ * enough of them to keep both the owner and the thief busy.
+ *
+ * The pending counts are read without holding the locks, a stale value only
+ * means that a wrong victim is chosen or that nothing is found.
+ *
+ * @param thread_id The id of the idle thread
+ * @return 1 if an event was processed, 0 otherwise
  */
-void
-poll_shutdown()
+static int
+poll_steal_work(int thread_id)
 {
-    do_shutdown = 1;
+    POLL_SET *victim = NULL;
+    int most = POLL_STEAL_MIN_PENDING - 1;
+
+    for (int i = 0; i < n_poll_sets; i++)
+    {
+        if (i != thread_id && poll_sets[i].evq_pending > most)
+        {
+            victim = &poll_sets[i];
+            most = victim->evq_pending;
+        }
+    }
+
+    if (victim && process_pollq(thread_id, victim, true))
+    {
+        ts_stats_add(pollStats.n_steals, 1);
+        return 1;
+    }
+    return 0;
 }
 
 /**
- * Return the bitmask of polling threads
+ * Combine an event queue statistic of all the poll sets
  *
- * @return The bitmask of the running polling threads
+ * @param offset  Offset of the statistic in the POLL_SET structure
+ * @param maximum Return the largest value instead of the sum
+ * @return The combined value
  */
-GWBITMASK *
-poll_bitmask()
+static int
+poll_set_stat(size_t offset, bool maximum)
 {
-    return &poll_mask;
+    int rval = 0;
+
+    for (int i = 0; i < n_poll_sets; i++)
+    {
+        int value = *(int *)((char *)&poll_sets[i] + offset);
+
+        if (!maximum)
+        {
+            rval += value;
+        }
+        else if (value > rval)
+        {
+            rval = value;
+        }
+    }
+    return rval;
 }
 
 /**
@@ -1254,47 +2303,72 @@ dprintPollStats(DCB *dcb)
     int i;
 
     dcb_printf(dcb, "\nPoll Statistics.\n\n");
-    dcb_printf(dcb, "No. of epoll cycles:                           %d\n",
+    dcb_printf(dcb, "No. of epoll cycles:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_polls));
-    dcb_printf(dcb, "No. of epoll cycles with wait:                         %d\n",
+    dcb_printf(dcb, "No. of epoll cycles with wait:                         %" PRId64 "\n",
                ts_stats_sum(pollStats.blockingpolls));
-    dcb_printf(dcb, "No. of epoll calls returning events:           %d\n",
+    dcb_printf(dcb, "No. of epoll calls returning events:           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_pollev));
-    dcb_printf(dcb, "No. of non-blocking calls returning events:    %d\n",
+    dcb_printf(dcb, "No. of non-blocking calls returning events:    %" PRId64 "\n",
                ts_stats_sum(pollStats.n_nbpollev));
-    dcb_printf(dcb, "No. of read events:                            %d\n",
+    dcb_printf(dcb, "No. of read events:                            %" PRId64 "\n",
                ts_stats_sum(pollStats.n_read));
-    dcb_printf(dcb, "No. of write events:                           %d\n",
+    dcb_printf(dcb, "No. of write events:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_write));
-    dcb_printf(dcb, "No. of error events:                           %d\n",
+    dcb_printf(dcb, "No. of error events:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_error));
-    dcb_printf(dcb, "No. of hangup events:                          %d\n",
+    dcb_printf(dcb, "No. of hangup events:                          %" PRId64 "\n",
                ts_stats_sum(pollStats.n_hup));
-    dcb_printf(dcb, "No. of accept events:                          %d\n",
+    dcb_printf(dcb, "No. of accept events:                          %" PRId64 "\n",
                ts_stats_sum(pollStats.n_accept));
-    dcb_printf(dcb, "No. of times no threads polling:               %d\n",
+    dcb_printf(dcb, "No. of reads delayed for slow clients:         %" PRId64 "\n",
+               ts_stats_sum(pollStats.n_throttled));
+    dcb_printf(dcb, "No. of times no threads polling:               %" PRId64 "\n",
                ts_stats_sum(pollStats.n_nothreads));
+    dcb_printf(dcb, "No. of events stolen from other threads:       %" PRId64 "\n",
+               ts_stats_sum(pollStats.n_steals));
+    dcb_printf(dcb, "No. of poll sets:                              %d\n",
+               n_poll_sets);
     dcb_printf(dcb, "Current event queue length:                    %d\n",
-               pollStats.evq_length);
+               poll_set_stat(offsetof(POLL_SET, evq_length), false));
     dcb_printf(dcb, "Maximum event queue length:                    %d\n",
-               pollStats.evq_max);
+               poll_set_stat(offsetof(POLL_SET, evq_max), true));
     dcb_printf(dcb, "No. of DCBs with pending events:               %d\n",
-               pollStats.evq_pending);
-    dcb_printf(dcb, "No. of wakeups with pending queue:             %d\n",
-               pollStats.wake_evqpending);
+               poll_set_stat(offsetof(POLL_SET, evq_pending), false));
+    dcb_printf(dcb, "No. of wakeups with pending queue:             %" PRId64 "\n",
+               ts_stats_sum(pollStats.wake_evqpending));
 
     dcb_printf(dcb, "No of poll completions with descriptors\n");
     dcb_printf(dcb, "\tNo. of descriptors\tNo. of poll completions.\n");
     for (i = 0; i < MAXNFDS - 1; i++)
     {
-        dcb_printf(dcb, "\t%2d\t\t\t%d\n", i + 1, pollStats.n_fds[i]);
+        dcb_printf(dcb, "\t%2d\t\t\t%" PRId64 "\n", i + 1,
+                   ts_histogram_bucket(pollStats.n_fds, i));
+    }
+    dcb_printf(dcb, "\t>= %d\t\t\t%" PRId64 "\n", MAXNFDS,
+               ts_histogram_bucket(pollStats.n_fds, MAXNFDS - 1));
+    dcb_printf(dcb, "Maximum events per epoll call:                 %d\n",
+               poll_max_events);
+
+    if (poll_adaptive && thread_data)
+    {
+        dcb_printf(dcb, "Adaptive polling\n");
+        dcb_printf(dcb, "\tThread\tEvent gap (us)\tPoll cost (ns)\tSpins\tTimeout (ms)\n");
+        for (i = 0; i < n_threads; i++)
+        {
+            POLL_TUNING *tuning = &thread_data[i].tuning;
+            dcb_printf(dcb, "\t%d\t%" PRId64 "\t\t%" PRId64 "\t\t%d\t%d\n", i,
+                       tuning->avg_gap_ns / 1000, tuning->spin_ns,
+                       tuning->spins, tuning->timeout);
+        }
     }
-    dcb_printf(dcb, "\t>= %d\t\t\t%d\n", MAXNFDS,
-               pollStats.n_fds[MAXNFDS - 1]);
 
 #if SPINLOCK_PROFILE
-    dcb_printf(dcb, "Event queue lock statistics:\n");
-    spinlock_stats(&pollqlock, spin_reporter, dcb);
+    for (i = 0; i < n_poll_sets; i++)
+    {
+        dcb_printf(dcb, "Event queue %d lock statistics:\n", i);
+        spinlock_stats(&poll_sets[i].lock, spin_reporter, dcb);
+    }
 #endif
 }
 
@@ -1371,7 +2445,10 @@ dShowThreads(DCB *dcb)
     double qavg1 = 0.0, qavg5 = 0.0, qavg15 = 0.0;
 
     dcb_printf(dcb, "Polling Threads.\n\n");
-    dcb_printf(dcb, "Historic Thread Load Average: %.2f.\n", load_average);
+    int64_t samples = ts_stats_sum(load_samples);
+
+    dcb_printf(dcb, "Historic Thread Load Average: %.2f.\n",
+               samples ? (double)ts_stats_sum(load_nfds) / samples : 0.0);
     dcb_printf(dcb, "Current Thread Load Average: %.2f.\n", current_avg);
 
     /* Average all the samples to get the 15 minute average */
@@ -1423,6 +2500,12 @@ dShowThreads(DCB *dcb)
     {
         return;
     }
+    dcb_printf(dcb, "Polling threads: %d, at most %d\n", n_active_threads, poll_max_workers());
+    if (admin_thread >= 0)
+    {
+        dcb_printf(dcb, "Admin thread: %d\n", admin_thread);
+    }
+    dcb_printf(dcb, "\n");
     dcb_printf(dcb, " ID | State      | # fds  | Descriptor       | Running  | Event\n");
     dcb_printf(dcb, "----+------------+--------+------------------+----------+---------------\n");
     for (i = 0; i < n_threads; i++)
@@ -1474,7 +2557,7 @@ dShowThreads(DCB *dcb)
             dcb_printf(dcb,
                        " %2d | %-10s | %6d | %-16p | <%3lu00ms | %s\n",
                        i, state, thread_data[i].n_fds,
-                       thread_data[i].cur_dcb, 1 + hkheartbeat - dcb->evq.started,
+                       thread_data[i].cur_dcb, 1 + hkheartbeat - thread_data[i].cur_dcb->evq.started,
                        event_string);
 
             if (from_heap)
@@ -1483,6 +2566,163 @@ dShowThreads(DCB *dcb)
             }
         }
     }
+
+    dcb_printf(dcb, "\nThread activity, times in seconds:\n\n");
+    dcb_printf(dcb, " ID |     Events |     Read |    Write |    Error |   Hangup |"
+               "     Wait |   Stolen |   DCBs |      CPU | Load\n");
+    dcb_printf(dcb, "----+------------+----------+----------+----------+----------+"
+               "----------+----------+--------+----------+------\n");
+    for (i = 0; i < n_threads; i++)
+    {
+        THREAD_DATA *data = &thread_data[i];
+
+        dcb_printf(dcb, " %2d | %10" PRIu64 " | %8.2f | %8.2f | %8.2f | %8.2f |"
+                   " %8.2f | %8" PRId64 " | %6d | %8.2f | %3.0f%%\n",
+                   i, data->n_events,
+                   data->handler_ns[POLL_HANDLER_READ] / 1e9,
+                   data->handler_ns[POLL_HANDLER_WRITE] / 1e9,
+                   data->handler_ns[POLL_HANDLER_ERROR] / 1e9,
+                   data->handler_ns[POLL_HANDLER_HANGUP] / 1e9,
+                   data->wait_ns / 1e9,
+                   ts_stats_get(pollStats.n_steals, i),
+                   data->n_dcbs, poll_cpu_time(i), 100 * data->load);
+    }
+}
+
+/**
+ * Note the statement the calling polling thread is about to route, so that
+ * the watchdog can report it if the thread gets stuck. This is called only
+ * when the watchdog is enabled.
+ *
+ * @param query The statement, NULL when the routing is done
+ */
+void
+poll_watch_query(GWBUF *query)
+{
+    if (thread_data == NULL || poll_thread_id < 0)
+    {
+        return;
+    }
+
+    THREAD_DATA *data = &thread_data[poll_thread_id];
+    int len = query ? GWBUF_LENGTH(query) - 5 : 0;
+
+    if (len > 0 && ((uint8_t*)GWBUF_DATA(query))[4] == MYSQL_COM_QUERY)
+    {
+        if (len > POLL_QUERY_PREVIEW)
+        {
+            len = POLL_QUERY_PREVIEW;
+        }
+        memcpy(data->query, (uint8_t*)GWBUF_DATA(query) + 5, len);
+        data->query_len = len;
+    }
+    else
+    {
+        data->query_len = 0;
+    }
+}
+
+/**
+ * Capture the stack of the polling thread the watchdog signalled
+ *
+ * @param sig The signal
+ */
+static void
+poll_stack_handler(int sig)
+{
+    if (thread_data && poll_thread_id >= 0)
+    {
+        THREAD_DATA *data = &thread_data[poll_thread_id];
+
+        data->stack_depth = backtrace(data->stack, POLL_STACK_DEPTH);
+        __sync_synchronize();
+        data->stack_event = data->n_events;
+    }
+}
+
+/**
+ * Log the stack and the event of a polling thread that has been processing
+ * the same event for too long
+ *
+ * The thread is signalled to capture its own stack. The DCB and the session
+ * are only looked at if the thread is still processing the same event after
+ * the stack was captured, the event keeps them alive.
+ *
+ * @param thread_id The thread
+ * @param event     The number of the event the thread is stuck in
+ */
+static void
+poll_report_stuck_thread(int thread_id, uint64_t event)
+{
+    THREAD_DATA *data = &thread_data[thread_id];
+
+    if (pthread_kill(data->thread, POLL_STACK_SIGNAL) != 0)
+    {
+        return;
+    }
+
+    /** Wait at most 100ms for the thread to capture its stack */
+    for (int i = 0; i < 100 && data->stack_event != event; i++)
+    {
+        usleep(1000);
+    }
+    __sync_synchronize();
+
+    DCB *dcb = data->cur_dcb;
+
+    if (data->stack_event != event || data->n_events != event || dcb == NULL)
+    {
+        return;
+    }
+
+    SESSION *session = dcb->session;
+    const char *service = session && session->service ? session->service->name : "none";
+    char *events = event_to_string(data->event);
+
+    MXS_WARNING("Thread %d has been processing the %s events of DCB %p for %lu00ms. "
+                "Session %lu of service '%s', %s %s, statement: %.*s",
+                thread_id, events ? events : "??", dcb,
+                hkheartbeat - data->event_started,
+                session ? session->ses_id : 0, service,
+                STRDCBROLE(dcb->dcb_role), dcb->remote ? dcb->remote : "",
+                data->query_len ? data->query_len : 4,
+                data->query_len ? data->query : "none");
+    free(events);
+
+    char **symbols = backtrace_symbols(data->stack, data->stack_depth);
+
+    if (symbols)
+    {
+        for (int i = 0; i < data->stack_depth; i++)
+        {
+            MXS_WARNING("  %s", symbols[i]);
+        }
+        free(symbols);
+    }
+}
+
+/**
+ * The housekeeper task that looks for polling threads that have been
+ * processing the same event for longer than the watchdog threshold
+ *
+ * @param data Not used
+ */
+static void
+poll_watchdog(void *data)
+{
+    for (int i = 0; i < n_threads; i++)
+    {
+        uint64_t event = thread_data[i].n_events;
+
+        if (thread_data[i].state == THREAD_PROCESSING &&
+            thread_data[i].cur_dcb &&
+            event != thread_data[i].reported_event &&
+            hkheartbeat - thread_data[i].event_started >= watchdog_threshold)
+        {
+            thread_data[i].reported_event = event;
+            poll_report_stuck_thread(i, event);
+        }
+    }
 }
 
 /**
@@ -1494,13 +2734,14 @@ dShowThreads(DCB *dcb)
 static void
 poll_loadav(void *data)
 {
-    static  int last_samples = 0, last_nfds = 0;
-    int new_samples, new_nfds;
+    static  int64_t last_samples = 0, last_nfds = 0;
+    int64_t samples = ts_stats_sum(load_samples), nfds = ts_stats_sum(load_nfds);
+    int64_t new_samples, new_nfds;
 
-    new_samples = load_samples - last_samples;
-    new_nfds = load_nfds - last_nfds;
-    last_samples = load_samples;
-    last_nfds = load_nfds;
+    new_samples = samples - last_samples;
+    new_nfds = nfds - last_nfds;
+    last_samples = samples;
+    last_nfds = nfds;
 
     /* POLL_LOAD_FREQ average is... */
     if (new_samples)
@@ -1512,12 +2753,32 @@ poll_loadav(void *data)
         current_avg = 0.0;
     }
     avg_samples[next_sample] = current_avg;
-    evqp_samples[next_sample] = pollStats.evq_pending;
+    evqp_samples[next_sample] = poll_set_stat(offsetof(POLL_SET, evq_pending), false);
     next_sample++;
     if (next_sample >= n_avg_samples)
     {
         next_sample = 0;
     }
+
+    /* The share of the time each thread spent in the event handlers */
+    static uint64_t last_sample_ns = 0;
+    uint64_t now = poll_clock();
+
+    if (thread_data && last_sample_ns)
+    {
+        double interval = now - last_sample_ns;
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            uint64_t busy = poll_busy_time(i);
+            double load = (busy - thread_data[i].last_busy_ns) / interval;
+
+            thread_data[i].load = POLL_LOAD_WEIGHT * (load > 1.0 ? 1.0 : load) +
+                                  (1.0 - POLL_LOAD_WEIGHT) * thread_data[i].load;
+            thread_data[i].last_busy_ns = busy;
+        }
+    }
+    last_sample_ns = now;
 }
 
 /**
@@ -1549,14 +2810,15 @@ static void poll_add_event_to_dcb(DCB*       dcb,
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buf);
     spinlock_release(&dcb->authlock);
 
-    spinlock_acquire(&pollqlock);
+    POLL_SET *set = poll_set_of(dcb);
+    spinlock_acquire(&set->lock);
 
     /** Set event to DCB */
     if (DCB_POLL_BUSY(dcb))
     {
         if (dcb->evq.pending_events == 0)
         {
-            pollStats.evq_pending++;
+            set->evq_pending++;
         }
         dcb->evq.pending_events |= ev;
     }
@@ -1564,28 +2826,11 @@ static void poll_add_event_to_dcb(DCB*       dcb,
     {
         dcb->evq.pending_events = ev;
         /** Add DCB to eventqueue if it isn't already there */
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
+        poll_evq_append(set, dcb);
+        set->evq_pending++;
     }
-    spinlock_release(&pollqlock);
+    spinlock_release(&set->lock);
+    poll_wakeup(set);
 }
 
 /*
@@ -1642,8 +2887,9 @@ poll_fake_read_event(DCB *dcb)
 void
 poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
 {
+    POLL_SET *set = poll_set_of(dcb);
 
-    spinlock_acquire(&pollqlock);
+    spinlock_acquire(&set->lock);
     /*
      * If the DCB is already on the queue, there are no pending events and
      * there are other events on the queue, then
@@ -1651,22 +2897,14 @@ poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
      */
     if (DCB_POLL_BUSY(dcb) && dcb->evq.pending_events == 0 && dcb->evq.prev != dcb)
     {
-        dcb->evq.prev->evq.next = dcb->evq.next;
-        dcb->evq.next->evq.prev = dcb->evq.prev;
-        if (eventq == dcb)
-        {
-            eventq = dcb->evq.next;
-        }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
+        poll_evq_remove(set, dcb);
     }
 
     if (DCB_POLL_BUSY(dcb))
     {
         if (dcb->evq.pending_events == 0)
         {
-            pollStats.evq_pending++;
+            set->evq_pending++;
         }
         dcb->evq.pending_events |= ev;
     }
@@ -1674,28 +2912,12 @@ poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
     {
         dcb->evq.pending_events = ev;
         dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
+        dcb->evq.queued_ns = 0;
+        poll_evq_append(set, dcb);
+        set->evq_pending++;
     }
-    spinlock_release(&pollqlock);
+    spinlock_release(&set->lock);
+    poll_wakeup(set);
 }
 
 /*
@@ -1713,13 +2935,14 @@ poll_fake_hangup_event(DCB *dcb)
 #else
     uint32_t ev = EPOLLHUP;
 #endif
+    POLL_SET *set = poll_set_of(dcb);
 
-    spinlock_acquire(&pollqlock);
+    spinlock_acquire(&set->lock);
     if (DCB_POLL_BUSY(dcb))
     {
         if (dcb->evq.pending_events == 0)
         {
-            pollStats.evq_pending++;
+            set->evq_pending++;
         }
         dcb->evq.pending_events |= ev;
     }
@@ -1727,28 +2950,12 @@ poll_fake_hangup_event(DCB *dcb)
     {
         dcb->evq.pending_events = ev;
         dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
+        dcb->evq.queued_ns = 0;
+        poll_evq_append(set, dcb);
+        set->evq_pending++;
     }
-    spinlock_release(&pollqlock);
+    spinlock_release(&set->lock);
+    poll_wakeup(set);
 }
 
 /**
@@ -1761,31 +2968,50 @@ dShowEventQ(DCB *pdcb)
 {
     DCB *dcb;
     char *tmp1, *tmp2;
+    bool header = false;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    for (int i = 0; i < n_poll_sets + (admin_set ? 1 : 0); i++)
     {
-        /* Nothing to process */
-        spinlock_release(&pollqlock);
-        return;
+        POLL_SET *set = i < n_poll_sets ? &poll_sets[i] : admin_set;
+
+        spinlock_acquire(&set->lock);
+        if (set->active == 0)
+        {
+            /* Nothing to process */
+            spinlock_release(&set->lock);
+            continue;
+        }
+        if (!header)
+        {
+            dcb_printf(pdcb, "\nEvent Queue.\n");
+            dcb_printf(pdcb, "%-16s | %-5s | %-10s | %-18s | %s\n", "DCB", "Class", "Status",
+                       "Processing Events", "Pending Events");
+            dcb_printf(pdcb, "-----------------+-------+------------+--------------------+"
+                       "-------------------\n");
+            header = true;
+        }
+        for (int c = 0; c < POLL_SCHED_CLASSES; c++)
+        {
+            DCB *eventq = set->classes[c].eventq;
+
+            if ((dcb = eventq) == NULL)
+            {
+                continue;
+            }
+            do
+            {
+                dcb_printf(pdcb, "%-16p | %-5d | %-10s | %-18s | %-18s\n", dcb, c,
+                           dcb->evq.processing ? "Processing" : "Pending",
+                           (tmp1 = event_to_string(dcb->evq.processing_events)),
+                           (tmp2 = event_to_string(dcb->evq.pending_events)));
+                free(tmp1);
+                free(tmp2);
+                dcb = dcb->evq.next;
+            }
+            while (dcb != eventq);
+        }
+        spinlock_release(&set->lock);
     }
-    dcb = eventq;
-    dcb_printf(pdcb, "\nEvent Queue.\n");
-    dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
-               "Pending Events");
-    dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
-    do
-    {
-        dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
-                   dcb->evq.processing ? "Processing" : "Pending",
-                   (tmp1 = event_to_string(dcb->evq.processing_events)),
-                   (tmp2 = event_to_string(dcb->evq.pending_events)));
-        free(tmp1);
-        free(tmp2);
-        dcb = dcb->evq.next;
-    }
-    while (dcb != eventq);
-    spinlock_release(&pollqlock);
 }
 
 
@@ -1800,23 +3026,30 @@ dShowEventStats(DCB *pdcb)
     int i;
 
     dcb_printf(pdcb, "\nEvent statistics.\n");
-    dcb_printf(pdcb, "Maximum queue time:           %3lu00ms\n", queueStats.maxqtime);
-    dcb_printf(pdcb, "Maximum execution time:       %3lu00ms\n", queueStats.maxexectime);
-    dcb_printf(pdcb, "Maximum event queue length:   %3d\n", pollStats.evq_max);
-    dcb_printf(pdcb, "Current event queue length:   %3d\n", pollStats.evq_length);
+    dcb_printf(pdcb, "Maximum queue time:           %3" PRId64 "00ms\n",
+               ts_stats_max(queueStats.maxqtime));
+    dcb_printf(pdcb, "Maximum execution time:       %3" PRId64 "00ms\n",
+               ts_stats_max(queueStats.maxexectime));
+    dcb_printf(pdcb, "Maximum event queue length:   %3d\n",
+               poll_set_stat(offsetof(POLL_SET, evq_max), true));
+    dcb_printf(pdcb, "Current event queue length:   %3d\n",
+               poll_set_stat(offsetof(POLL_SET, evq_length), false));
     dcb_printf(pdcb, "\n");
     dcb_printf(pdcb, "               |    Number of events\n");
     dcb_printf(pdcb, "Duration       | Queued     | Executed\n");
     dcb_printf(pdcb, "---------------+------------+-----------\n");
-    dcb_printf(pdcb, " < 100ms       | %-10d | %-10d\n",
-               queueStats.qtimes[0], queueStats.exectimes[0]);
+    dcb_printf(pdcb, " < 100ms       | %-10" PRId64 " | %-10" PRId64 "\n",
+               ts_histogram_bucket(queueStats.qtimes, 0),
+               ts_histogram_bucket(queueStats.exectimes, 0));
     for (i = 1; i < N_QUEUE_TIMES; i++)
     {
-        dcb_printf(pdcb, " %2d00 - %2d00ms | %-10d | %-10d\n", i, i + 1,
-                   queueStats.qtimes[i], queueStats.exectimes[i]);
+        dcb_printf(pdcb, " %2d00 - %2d00ms | %-10" PRId64 " | %-10" PRId64 "\n", i, i + 1,
+                   ts_histogram_bucket(queueStats.qtimes, i),
+                   ts_histogram_bucket(queueStats.exectimes, i));
     }
-    dcb_printf(pdcb, " > %2d00ms      | %-10d | %-10d\n", N_QUEUE_TIMES,
-               queueStats.qtimes[N_QUEUE_TIMES], queueStats.exectimes[N_QUEUE_TIMES]);
+    dcb_printf(pdcb, " > %2d00ms      | %-10" PRId64 " | %-10" PRId64 "\n", N_QUEUE_TIMES,
+               ts_histogram_bucket(queueStats.qtimes, N_QUEUE_TIMES),
+               ts_histogram_bucket(queueStats.exectimes, N_QUEUE_TIMES));
 }
 
 /**
@@ -1841,15 +3074,15 @@ poll_get_stat(POLL_STAT stat)
     case POLL_STAT_ACCEPT:
         return ts_stats_sum(pollStats.n_accept);
     case POLL_STAT_EVQ_LEN:
-        return pollStats.evq_length;
+        return poll_set_stat(offsetof(POLL_SET, evq_length), false);
     case POLL_STAT_EVQ_PENDING:
-        return pollStats.evq_pending;
+        return poll_set_stat(offsetof(POLL_SET, evq_pending), false);
     case POLL_STAT_EVQ_MAX:
-        return pollStats.evq_max;
+        return poll_set_stat(offsetof(POLL_SET, evq_max), true);
     case POLL_STAT_MAX_QTIME:
-        return (int)queueStats.maxqtime;
+        return (int)ts_stats_max(queueStats.maxqtime);
     case POLL_STAT_MAX_EXECTIME:
-        return (int)queueStats.maxexectime;
+        return (int)ts_stats_max(queueStats.maxexectime);
     }
     return 0;
 }
@@ -1890,10 +3123,10 @@ eventTimesRowCallback(RESULTSET *set, void *data)
         buf[39] = '\0';
         resultset_row_set(row, 0, buf);
     }
-    snprintf(buf, 39, "%u", queueStats.qtimes[*rowno]);
+    snprintf(buf, 39, "%" PRId64, ts_histogram_bucket(queueStats.qtimes, *rowno));
     buf[39] = '\0';
     resultset_row_set(row, 1, buf);
-    snprintf(buf, 39, "%u", queueStats.exectimes[*rowno]);
+    snprintf(buf, 39, "%" PRId64, ts_histogram_bucket(queueStats.exectimes, *rowno));
     buf[39] = '\0';
     resultset_row_set(row, 2, buf);
     (*rowno)++;
@@ -1927,3 +3160,121 @@ eventTimesGetList()
 
     return set;
 }
+
+/** The per-thread event counters exported as metrics */
+static const struct
+{
+    const char *name;
+    const char *help;
+    ts_stats_t  **stats;
+} poll_metrics[] =
+{
+    {"maxscale_thread_read_events", "Read events processed by the thread",
+     &pollStats.n_read},
+    {"maxscale_thread_write_events", "Write events processed by the thread",
+     &pollStats.n_write},
+    {"maxscale_thread_error_events", "Error events processed by the thread",
+     &pollStats.n_error},
+    {"maxscale_thread_hangup_events", "Hangup events processed by the thread",
+     &pollStats.n_hup},
+    {"maxscale_thread_accept_events", "Accept events processed by the thread",
+     &pollStats.n_accept},
+    {NULL}
+};
+
+/**
+ * Write an event time histogram, the buckets are in heartbeats of 100ms
+ *
+ * @param metrics The metrics being generated
+ * @param name Name of the histogram
+ * @param help Description of the histogram
+ * @param histogram The histogram of N_QUEUE_TIMES + 1 buckets
+ */
+static void
+poll_write_times(METRICS *metrics, const char *name, const char *help, ts_histogram_t histogram)
+{
+    int64_t total = 0;
+    char le[32];
+
+    metrics_family(metrics, name, "histogram", help);
+    for (int i = 0; i < N_QUEUE_TIMES; i++)
+    {
+        total += ts_histogram_bucket(histogram, i);
+        snprintf(le, sizeof(le), "%d.%d", (i + 1) / 10, (i + 1) % 10);
+        metrics_sample(metrics, name, "_bucket");
+        metrics_label(metrics, "le", le);
+        metrics_value(metrics, total);
+    }
+
+    total += ts_histogram_bucket(histogram, N_QUEUE_TIMES);
+    metrics_sample(metrics, name, "_bucket");
+    metrics_label(metrics, "le", "+Inf");
+    metrics_value(metrics, total);
+    metrics_sample(metrics, name, "_count");
+    metrics_value(metrics, total);
+}
+
+/**
+ * Write the metrics of the polling threads
+ *
+ * @param metrics The metrics being generated
+ */
+void
+pollWriteMetrics(METRICS *metrics)
+{
+    for (int i = 0; poll_metrics[i].name; i++)
+    {
+        metrics_family(metrics, poll_metrics[i].name, "counter", poll_metrics[i].help);
+        for (int thread = 0; thread < n_threads; thread++)
+        {
+            metrics_sample(metrics, poll_metrics[i].name, "_total");
+            metrics_label_int(metrics, "thread", thread);
+            metrics_value(metrics, ts_stats_get(*poll_metrics[i].stats, thread));
+        }
+    }
+
+    metrics_family(metrics, "maxscale_event_queue_length", "gauge", "Current event queue length");
+    metrics_sample(metrics, "maxscale_event_queue_length", NULL);
+    metrics_value(metrics, poll_set_stat(offsetof(POLL_SET, evq_length), false));
+
+    poll_write_times(metrics, "maxscale_event_queue_seconds",
+                     "Time the events waited in the event queue", queueStats.qtimes);
+    poll_write_times(metrics, "maxscale_event_execution_seconds",
+                     "Time it took to process the events", queueStats.exectimes);
+
+    if (thread_data == NULL)
+    {
+        return;
+    }
+
+    metrics_family(metrics, "maxscale_thread_handler_seconds", "counter",
+                   "Time spent in the event handlers");
+    for (int thread = 0; thread < n_threads; thread++)
+    {
+        for (int i = 0; i < POLL_N_HANDLERS; i++)
+        {
+            metrics_sample(metrics, "maxscale_thread_handler_seconds", "_total");
+            metrics_label_int(metrics, "thread", thread);
+            metrics_label(metrics, "handler", poll_handler_names[i]);
+            metrics_value_double(metrics, thread_data[thread].handler_ns[i] / 1e9);
+        }
+    }
+
+    metrics_family(metrics, "maxscale_thread_wait_seconds", "counter",
+                   "Time spent waiting for events");
+    for (int thread = 0; thread < n_threads; thread++)
+    {
+        metrics_sample(metrics, "maxscale_thread_wait_seconds", "_total");
+        metrics_label_int(metrics, "thread", thread);
+        metrics_value_double(metrics, thread_data[thread].wait_ns / 1e9);
+    }
+
+    metrics_family(metrics, "maxscale_thread_dcbs", "gauge",
+                   "Number of DCBs owned by the thread");
+    for (int thread = 0; thread < n_threads; thread++)
+    {
+        metrics_sample(metrics, "maxscale_thread_dcbs", NULL);
+        metrics_label_int(metrics, "thread", thread);
+        metrics_value(metrics, thread_data[thread].n_dcbs);
+    }
+}
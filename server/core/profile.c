@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file profile.c - CPU cost of the filters and routers
+ *
+ * When profiling is enabled, the session inserts a timing element in front
+ * of each filter and the router. An element notes the time-stamp counter
+ * before and after the call. The nested calls of the elements further down
+ * the chain add their time to a per-thread counter, which is subtracted
+ * from the time of the call. The remainder is the cost of the filter or the
+ * router and is counted in per-thread counters of the filter definition or
+ * the service.
+ *
+ * The counts are in CPU cycles. The counter is read without serializing the
+ * processor, so a single short call may be inaccurate, but the totals are
+ * not affected.
+ */
+
+#include <profile.h>
+#include <string.h>
+#include <inttypes.h>
+#include <dcb.h>
+
+bool profile_enabled = false;
+
+/** Time of the calls made by the element currently being timed */
+thread_local CYCLES profile_nested = 0;
+
+/**
+ * Enable or disable the profiling
+ *
+ * This must be called once before the services are started.
+ *
+ * @param enabled Whether the filters and routers are profiled
+ */
+void profile_init(bool enabled)
+{
+    profile_enabled = enabled;
+}
+
+/**
+ * Allocate the counters of an entry point
+ *
+ * @param profile The profile to allocate
+ * @return True on success
+ */
+bool profile_alloc(PROFILE *profile)
+{
+    if ((profile->cycles = ts_stats_alloc()) == NULL ||
+        (profile->histogram = ts_histogram_alloc_log()) == NULL)
+    {
+        profile_free(profile);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Free the counters of an entry point
+ *
+ * @param profile The profile to free, it need not have any counters
+ */
+void profile_free(PROFILE *profile)
+{
+    if (profile->cycles)
+    {
+        ts_stats_free(profile->cycles);
+    }
+    ts_histogram_free(profile->histogram);
+    profile->cycles = NULL;
+    profile->histogram = NULL;
+}
+
+/**
+ * Get the number of calls of an entry point
+ *
+ * @param profile The profile
+ * @return The number of calls
+ */
+int64_t profile_calls(PROFILE *profile)
+{
+    return profile->cycles ? ts_histogram_count(profile->histogram) : 0;
+}
+
+/**
+ * Get the average cost of a call
+ *
+ * @param profile The profile
+ * @return Average cycles per call
+ */
+int64_t profile_average(PROFILE *profile)
+{
+    int64_t calls = profile_calls(profile);
+    return calls ? ts_stats_sum(profile->cycles) / calls : 0;
+}
+
+/**
+ * Get a percentile of the cost of a call
+ *
+ * @param profile    The profile
+ * @param percentile The percentile
+ * @return The upper limit of cycles of the percentile
+ */
+int64_t profile_percentile(PROFILE *profile, double percentile)
+{
+    return profile->cycles ? ts_histogram_percentile(profile->histogram, percentile) : 0;
+}
+
+/**
+ * Print the cost of an entry point
+ *
+ * @param dcb     DCB to print to
+ * @param label   Label of the line, including the padding
+ * @param profile The profile
+ */
+void profile_print(DCB *dcb, const char *label, PROFILE *profile)
+{
+    if (profile->cycles)
+    {
+        dcb_printf(dcb, "\t%s%" PRId64 " calls, %" PRId64 " cycles on average, "
+                   "%" PRId64 " at the 99th percentile\n", label, profile_calls(profile),
+                   profile_average(profile), profile_percentile(profile, 99));
+    }
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qc_pool.c  A pool of threads that classify long queries
+ *
+ * The queries wait in a single queue. A thread of the pool takes several
+ * queries from the queue at a time, its share of the queue up to a limit,
+ * so that the lock is not taken for every query when the pool is busy and
+ * the queries are still spread over the idle threads.
+ *
+ * Each queued query holds a reference to the session of its client DCB,
+ * which keeps the DCB from being freed until the query has been handed back.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <qc_pool.h>
+#include <query_classifier.h>
+#include <session.h>
+#include <thread.h>
+#include <atomic.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+
+/** The most queries a thread takes from the queue at a time */
+#define QC_POOL_BATCH   8
+
+/**
+ * A query waiting to be parsed
+ */
+typedef struct qc_job
+{
+    struct qc_job   *next;      /*< The next query in the queue */
+    DCB             *dcb;       /*< The client DCB of the query */
+    SESSION         *session;   /*< The session the reference is held to */
+    GWBUF           *query;     /*< The query */
+    qc_pool_done_t  done;       /*< Called when the query has been parsed */
+} QC_JOB;
+
+static QC_JOB *job_head = NULL;
+static QC_JOB *job_tail = NULL;
+static int n_jobs = 0;
+/**
+ * Protects the queue. The threads wait on the condition for queries to
+ * arrive, which is why this is a mutex and not a spinlock.
+ */
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+
+static volatile int do_shutdown = 0;
+static THREAD *pool_threads = NULL;
+static int n_pool_threads = 0;
+/** The length of the shortest query that is parsed by the pool, 0 if disabled */
+static unsigned int pool_min_size = 0;
+
+static void qc_pool_thread(void *data);
+
+/**
+ * Start the threads of the pool. Must be called after the query classifier
+ * has been initialised.
+ *
+ * @param n_threads     The number of threads, 0 disables the pool
+ * @param min_size      The length of the shortest query given to the pool
+ * @return False if the threads could not be started
+ */
+bool
+qc_pool_init(int n_threads, unsigned int min_size)
+{
+    if (n_threads <= 0)
+    {
+        return true;
+    }
+
+    if ((pool_threads = (THREAD *)calloc(n_threads, sizeof(THREAD))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate the query classifier threads.");
+        return false;
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        if (thread_start(&pool_threads[i], qc_pool_thread, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start query classifier thread.");
+            break;
+        }
+        n_pool_threads++;
+    }
+
+    if (n_pool_threads > 0)
+    {
+        pool_min_size = min_size;
+        MXS_NOTICE("Queries of at least %u bytes are classified by %d threads.",
+                   pool_min_size, n_pool_threads);
+    }
+
+    return n_pool_threads == n_threads;
+}
+
+/**
+ * Stop the threads of the pool. The queries that have not been parsed yet
+ * are freed without calling their callbacks. Called once the polling
+ * threads have stopped.
+ */
+void
+qc_pool_end(void)
+{
+    QC_JOB *job;
+
+    pool_min_size = 0;
+
+    pthread_mutex_lock(&joblock);
+    do_shutdown = 1;
+    pthread_cond_broadcast(&jobcond);
+    pthread_mutex_unlock(&joblock);
+
+    for (int i = 0; i < n_pool_threads; i++)
+    {
+        thread_wait(pool_threads[i]);
+    }
+    free(pool_threads);
+    pool_threads = NULL;
+    n_pool_threads = 0;
+
+    while ((job = job_head) != NULL)
+    {
+        job_head = job->next;
+        gwbuf_free(job->query);
+        session_free(job->session);
+        free(job);
+    }
+    job_tail = NULL;
+    n_jobs = 0;
+}
+
+/**
+ * Check whether a query should be parsed by the pool. Only the text protocol
+ * queries that are long enough and have not been parsed yet are.
+ *
+ * @param query A buffer containing one MySQL packet
+ * @return True if the query should be given to qc_pool_classify()
+ */
+bool
+qc_pool_wants(GWBUF *query)
+{
+    uint8_t cmd;
+
+    return pool_min_size > 0 &&
+           gwbuf_length(query) >= pool_min_size &&
+           gwbuf_copy_data(query, MYSQL_HEADER_LEN, 1, &cmd) == 1 &&
+           cmd == MYSQL_COM_QUERY &&
+           gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO) == NULL;
+}
+
+/**
+ * Queue a query to be parsed by the pool. The callback is called by a thread
+ * of the pool and it must pass the query back to the polling thread of the
+ * DCB. Nothing of the query or the DCB may be touched by the caller until then.
+ *
+ * @param dcb   The client DCB of the query
+ * @param query The query, owned by the pool until it is passed to the callback
+ * @param done  The function called when the query has been parsed
+ * @return False if the query could not be queued and the caller still owns it
+ */
+bool
+qc_pool_classify(DCB *dcb, GWBUF *query, qc_pool_done_t done)
+{
+    QC_JOB *job;
+
+    if (pool_min_size == 0 || (job = (QC_JOB *)malloc(sizeof(QC_JOB))) == NULL)
+    {
+        return false;
+    }
+
+    job->next = NULL;
+    job->dcb = dcb;
+    job->session = dcb->session;
+    job->query = query;
+    job->done = done;
+    atomic_add(&job->session->refcount, 1);
+
+    pthread_mutex_lock(&joblock);
+    if (job_tail)
+    {
+        job_tail->next = job;
+    }
+    else
+    {
+        job_head = job;
+    }
+    job_tail = job;
+    n_jobs++;
+    pthread_cond_signal(&jobcond);
+    pthread_mutex_unlock(&joblock);
+
+    return true;
+}
+
+/**
+ * Take the share of the calling thread of the queued queries. The caller
+ * holds the joblock and the queue is not empty.
+ *
+ * @return The list of the queries to parse
+ */
+static QC_JOB *
+qc_pool_take_batch(void)
+{
+    int n = (n_jobs + n_pool_threads - 1) / n_pool_threads;
+    QC_JOB *batch = job_head;
+    QC_JOB *last = batch;
+
+    if (n > QC_POOL_BATCH)
+    {
+        n = QC_POOL_BATCH;
+    }
+
+    for (int i = 1; i < n && last->next; i++)
+    {
+        last = last->next;
+        n_jobs--;
+    }
+    n_jobs--;
+
+    job_head = last->next;
+    if (job_head == NULL)
+    {
+        job_tail = NULL;
+    }
+    last->next = NULL;
+
+    return batch;
+}
+
+/**
+ * A thread of the pool. The queries are parsed and handed back without the
+ * joblock being held.
+ *
+ * @param data  Unused, here to satisfy the thread system
+ */
+static void
+qc_pool_thread(void *data)
+{
+    if (!qc_thread_init())
+    {
+        MXS_ERROR("Could not perform thread initialization for query classifier. Exiting thread.");
+        return;
+    }
+
+    pthread_mutex_lock(&joblock);
+    while (!do_shutdown)
+    {
+        if (job_head == NULL)
+        {
+            pthread_cond_wait(&jobcond, &joblock);
+            continue;
+        }
+
+        QC_JOB *job = qc_pool_take_batch();
+
+        if (job_head)
+        {
+            /** Let an idle thread take the rest */
+            pthread_cond_signal(&jobcond);
+        }
+        pthread_mutex_unlock(&joblock);
+
+        while (job)
+        {
+            QC_JOB *next = job->next;
+
+            qc_parse(job->query);
+            job->done(job->dcb, job->query);
+            session_free(job->session);
+            free(job);
+            job = next;
+        }
+
+        pthread_mutex_lock(&joblock);
+    }
+    pthread_mutex_unlock(&joblock);
+
+    qc_thread_end();
+}
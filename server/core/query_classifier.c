@@ -12,9 +12,13 @@
  */
 
 #include <query_classifier.h>
+#include <inttypes.h>
+#include <dcb.h>
 #include <log_manager.h>
 #include <modules.h>
 #include <modutil.h>
+#include <mysql_client_server_protocol.h>
+#include <query_trace.h>
 
 //#define QC_TRACE_ENABLED
 #undef QC_TRACE_ENABLED
@@ -118,7 +122,46 @@ qc_parse_result_t qc_parse(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_parse(query);
+    uint64_t start = qtrace_classify_begin();
+    qc_parse_result_t rval = classifier->qc_parse(query);
+    qtrace_classify_end(start);
+
+    return rval;
+}
+
+/**
+ * Parses the query in the provided buffer, collecting only the information
+ * that is asked for in addition to the essentials. The getters of the other
+ * information parse the query again if it was not collected.
+ *
+ * Callers that know they will only need the type of the query can use this
+ * to spare the classifier from collecting table names and fields. If the
+ * classifier does not support this, the query is parsed completely.
+ *
+ * @param query   A GWBUF containing an SQL statement.
+ * @param collect A bitmask of qc_collect_info_t values.
+ * @result To what extent the query could be parsed.
+ */
+qc_parse_result_t qc_parse_collect(GWBUF* query, uint32_t collect)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    uint64_t start = qtrace_classify_begin();
+    qc_parse_result_t rval;
+
+    if (classifier->qc_parse_collect)
+    {
+        rval = classifier->qc_parse_collect(query, collect);
+    }
+    else
+    {
+        rval = classifier->qc_parse(query);
+    }
+
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 /**
@@ -135,7 +178,117 @@ uint32_t qc_get_type(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_type(query);
+    uint64_t start = qtrace_classify_begin();
+    uint32_t rval = classifier->qc_get_type(query);
+    qtrace_classify_end(start);
+
+    return rval;
+}
+
+/**
+ * Create a COM_QUERY packet of a part of a multi-statement query.
+ *
+ * @param sql The statement
+ * @param len The length of the statement
+ * @return The packet, or NULL if memory allocation failed
+ */
+static GWBUF* qc_create_stmt(const char* sql, size_t len)
+{
+    GWBUF* stmt = gwbuf_alloc(len + MYSQL_HEADER_LEN + 1);
+
+    if (stmt)
+    {
+        uint8_t* data = (uint8_t*)GWBUF_DATA(stmt);
+
+        gw_mysql_set_byte3(data, len + 1);
+        data[3] = 0;
+        data[4] = MYSQL_COM_QUERY;
+        memcpy(data + MYSQL_HEADER_LEN + 1, sql, len);
+        gwbuf_set_type(stmt, GWBUF_TYPE_MYSQL);
+    }
+
+    return stmt;
+}
+
+/**
+ * Split a multi-statement query into its statements in one pass and
+ * classify each of them, so that a query consisting of reads only can be
+ * treated as a read. The statements are classified like any other query,
+ * so a classifier with a cache benefits from statements it has seen before.
+ *
+ * A query is not split if it contains a compound statement, that is, a
+ * BEGIN ... END block, or if any of its statements cannot be parsed
+ * completely.
+ *
+ * @param query A buffer containing a COM_QUERY packet.
+ * @param type  The types of all the statements or'ed together are stored here.
+ * @return The number of statements, or 0 if the query could not be split
+ *         and classified reliably, in which case @c type is not set.
+ */
+int qc_get_multi_stmt_type(GWBUF* query, uint32_t* type)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    const char* sql;
+    int len;
+
+    if (!modutil_get_SQL_view(query, &sql, &len))
+    {
+        return 0;
+    }
+
+    char* data = (char*)sql;
+    char* end = data + len;
+    char* start = data;
+    uint32_t types = 0;
+    int n_stmts = 0;
+    bool ok = true;
+    uint64_t trace_start = qtrace_classify_begin();
+
+    while (ok && start < end && !is_mysql_statement_end(start, end - start))
+    {
+        char* semicolon = strnchr_esc_mysql(start, ';', end - start);
+        /** Without a semicolon, the rest is the last statement */
+        char* stmt_end = semicolon ? semicolon : end;
+
+        if (semicolon && is_mysql_sp_end(semicolon, end - semicolon))
+        {
+            /** Inside a BEGIN ... END block, the semicolons do not separate statements */
+            ok = false;
+        }
+        else
+        {
+            GWBUF* stmt = qc_create_stmt(start, stmt_end - start);
+
+            if (stmt && classifier->qc_parse(stmt) == QC_QUERY_PARSED)
+            {
+                types |= classifier->qc_get_type(stmt);
+                n_stmts++;
+            }
+            else
+            {
+                ok = false;
+            }
+
+            gwbuf_free(stmt);
+        }
+
+        start = stmt_end + 1;
+    }
+
+    qtrace_classify_end(trace_start);
+
+    if (ok && n_stmts > 0)
+    {
+        *type = types;
+    }
+    else
+    {
+        n_stmts = 0;
+    }
+
+    return n_stmts;
 }
 
 qc_query_op_t qc_get_operation(GWBUF* query)
@@ -143,7 +296,11 @@ qc_query_op_t qc_get_operation(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_operation(query);
+    uint64_t start = qtrace_classify_begin();
+    qc_query_op_t rval = classifier->qc_get_operation(query);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 char* qc_get_created_table_name(GWBUF* query)
@@ -151,7 +308,11 @@ char* qc_get_created_table_name(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_created_table_name(query);
+    uint64_t start = qtrace_classify_begin();
+    char* rval = classifier->qc_get_created_table_name(query);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 bool qc_is_drop_table_query(GWBUF* query)
@@ -159,7 +320,11 @@ bool qc_is_drop_table_query(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_is_drop_table_query(query);
+    uint64_t start = qtrace_classify_begin();
+    bool rval = classifier->qc_is_drop_table_query(query);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 bool qc_is_real_query(GWBUF* query)
@@ -167,7 +332,11 @@ bool qc_is_real_query(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_is_real_query(query);
+    uint64_t start = qtrace_classify_begin();
+    bool rval = classifier->qc_is_real_query(query);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 char** qc_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
@@ -175,21 +344,59 @@ char** qc_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_table_names(query, tblsize, fullnames);
+    uint64_t start = qtrace_classify_begin();
+    char** rval = classifier->qc_get_table_names(query, tblsize, fullnames);
+    qtrace_classify_end(start);
+
+    return rval;
+}
+
+/**
+ * Get the table names of a query without copying them. The names are owned
+ * by the classification of the query and are valid for as long as the buffer.
+ * A caller that only looks the names up, e.g. for every query of a session,
+ * avoids the allocations of qc_get_table_names() with this.
+ *
+ * @param query     A GWBUF containing an SQL statement
+ * @param fullnames If true, the names are qualified with the database names
+ * @param names     The NULL terminated array of the names is stored here
+ * @param tblsize   The number of names is stored here
+ * @return False if the classifier does not support this, in which case
+ *         qc_get_table_names() must be used
+ */
+bool qc_peek_table_names(GWBUF* query, bool fullnames, const char* const** names, int* tblsize)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    uint64_t start = qtrace_classify_begin();
+    bool rval = classifier->qc_peek_table_names &&
+                classifier->qc_peek_table_names(query, fullnames, names, tblsize);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 char* qc_get_canonical(GWBUF* query)
 {
     QC_TRACE();
     ss_dassert(classifier);
+
+    uint64_t start = qtrace_classify_begin();
+    char* rval;
+
     if (classifier->qc_get_canonical)
     {
-        return classifier->qc_get_canonical(query);
+        rval = classifier->qc_get_canonical(query);
     }
     else
     {
-        return modutil_get_canonical(query);
+        rval = modutil_get_canonical(query);
     }
+
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 bool qc_query_has_clause(GWBUF* query)
@@ -197,7 +404,11 @@ bool qc_query_has_clause(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_query_has_clause(query);
+    uint64_t start = qtrace_classify_begin();
+    bool rval = classifier->qc_query_has_clause(query);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 /**
@@ -254,7 +465,11 @@ char* qc_get_affected_fields(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_affected_fields(query);
+    uint64_t start = qtrace_classify_begin();
+    char* rval = classifier->qc_get_affected_fields(query);
+    qtrace_classify_end(start);
+
+    return rval;
 }
 
 char** qc_get_database_names(GWBUF* query, int* sizep)
@@ -262,7 +477,80 @@ char** qc_get_database_names(GWBUF* query, int* sizep)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_database_names(query, sizep);
+    uint64_t start = qtrace_classify_begin();
+    char** rval = classifier->qc_get_database_names(query, sizep);
+    qtrace_classify_end(start);
+
+    return rval;
+}
+
+/**
+ * Get the names of the functions that a statement calls.
+ *
+ * @param query The statement
+ * @param names Set to the lower case names, NULL if there are none. The
+ *              caller frees the names and the array.
+ * @param size  Set to the number of names
+ * @return True if the classifier reported the functions, false if it cannot
+ *         report them or the statement could not be parsed
+ */
+bool qc_get_function_names(GWBUF* query, char*** names, int* size)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    *names = NULL;
+    *size = 0;
+
+    uint64_t start = qtrace_classify_begin();
+    bool rval = classifier->qc_get_function_names &&
+                classifier->qc_get_function_names(query, names, size);
+    qtrace_classify_end(start);
+
+    return rval;
+}
+
+/**
+ * Get the statistics of the classification cache of the query classifier.
+ *
+ * @param stats The statistics are written here
+ * @return True if the classifier has a cache and it is enabled
+ */
+bool qc_get_cache_stats(QC_CACHE_STATS* stats)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    return classifier->qc_get_cache_stats && classifier->qc_get_cache_stats(stats);
+}
+
+/**
+ * Print the statistics of the classification cache to a DCB
+ *
+ * @param pdcb The DCB to print to
+ */
+void dprintQcCacheStats(void* pdcb)
+{
+    DCB* dcb = (DCB*) pdcb;
+    QC_CACHE_STATS stats;
+
+    if (classifier && qc_get_cache_stats(&stats))
+    {
+        int64_t lookups = stats.hits + stats.misses;
+
+        dcb_printf(dcb, "Query Classification Cache\n\n");
+        dcb_printf(dcb, "Maximum entries per thread:   %" PRId64 "\n", stats.size);
+        dcb_printf(dcb, "Entries:                      %" PRId64 "\n", stats.entries);
+        dcb_printf(dcb, "Hits:                         %" PRId64 "\n", stats.hits);
+        dcb_printf(dcb, "Misses:                       %" PRId64 "\n", stats.misses);
+        dcb_printf(dcb, "Evictions:                    %" PRId64 "\n", stats.evictions);
+        dcb_printf(dcb, "Hit ratio:                    %.1f%%\n",
+                   lookups ? 100.0 * stats.hits / lookups : 0.0);
+    }
+    else
+    {
+        dcb_printf(dcb, "The query classifier does not cache classifications.\n");
+    }
 }
 
 /**
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file query_trace.c - Sampled per-query latency breakdown
+ *
+ * The poll threads note when the event of a DCB was queued and when its
+ * processing started. When a sampled query enters the filter chain of its
+ * session, the times are copied to the trace of the session and the query is
+ * timed as it passes through the filters, the query classifier and the
+ * router. The protocol notes when the reply is written to the client.
+ *
+ * The trace is complete when the next query of the session arrives or when
+ * the session is closed, as only then it is known that the whole reply has
+ * been written. The durations of the stages are then added to the latency
+ * histograms of the service.
+ *
+ * The timestamps are written by the threads that process the events of the
+ * client and the backends without locking. A trace is a sample and an
+ * occasional inaccurate sample does not affect the percentiles.
+ */
+
+#include <query_trace.h>
+#include <string.h>
+
+int qtrace_rate = 0;
+
+thread_local QUERY_TRACE *qtrace_current = NULL;
+
+/** Queries left until the next sampled one */
+static thread_local int countdown = 0;
+
+/** When the event being processed was queued and when it was dispatched */
+static thread_local uint64_t event_queued = 0;
+static thread_local uint64_t event_dispatched = 0;
+
+static const char *stage_names[QTRACE_N_STAGES] =
+{
+    "queue",
+    "classify",
+    "filter",
+    "router",
+    "backend",
+    "reply",
+    "total"
+};
+
+/**
+ * Initialize the query tracing
+ *
+ * This must be called once before the poll threads are started.
+ *
+ * @param sample_rate One in this many queries is traced, 0 to disable tracing
+ */
+void qtrace_init(int sample_rate)
+{
+    qtrace_rate = sample_rate > 0 ? sample_rate : 0;
+}
+
+/**
+ * Decide whether the next query is traced
+ *
+ * @return True if the query should be traced
+ */
+bool qtrace_sample()
+{
+    if (--countdown > 0)
+    {
+        return false;
+    }
+
+    countdown = qtrace_rate;
+    return true;
+}
+
+/**
+ * Note the start of the processing of an event
+ *
+ * @param queued When the event was queued, 0 if not known
+ */
+void qtrace_event_begin(uint64_t queued)
+{
+    event_queued = queued;
+    event_dispatched = qtrace_now();
+}
+
+/**
+ * Note the end of the processing of an event
+ */
+void qtrace_event_end()
+{
+    event_queued = 0;
+    event_dispatched = 0;
+}
+
+/**
+ * Start tracing a query that is about to enter the filter chain
+ *
+ * @param trace The trace of the session
+ */
+void qtrace_start(QUERY_TRACE *trace)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->routed = qtrace_now();
+
+    if (event_dispatched && event_dispatched <= trace->routed)
+    {
+        trace->queued = event_queued;
+        trace->dispatched = event_dispatched;
+    }
+
+    trace->active = true;
+}
+
+static inline uint64_t elapsed(uint64_t start, uint64_t end)
+{
+    return start && end > start ? end - start : 0;
+}
+
+/**
+ * Count the durations of a complete trace in the histograms of a service
+ *
+ * A query whose reply was never seen is discarded.
+ *
+ * @param trace The trace of the session
+ * @param latency The histograms of the service, in microseconds
+ */
+void qtrace_finish(QUERY_TRACE *trace, ts_histogram_t *latency)
+{
+    trace->active = false;
+
+    if (latency[0] == NULL || trace->first_reply == 0 || trace->router_done == 0)
+    {
+        return;
+    }
+
+    uint64_t stages[QTRACE_N_STAGES];
+    uint64_t router_start = trace->router ? trace->router : trace->routed;
+    uint64_t router_classify = trace->classify - trace->classify_filter;
+    uint64_t filter = elapsed(trace->routed, trace->router);
+    uint64_t router = elapsed(router_start, trace->router_done);
+
+    stages[QTRACE_QUEUE] = elapsed(trace->queued, trace->dispatched);
+    stages[QTRACE_CLASSIFY] = trace->classify;
+    stages[QTRACE_FILTER] = filter > trace->classify_filter ? filter - trace->classify_filter : 0;
+    stages[QTRACE_ROUTER] = router > router_classify ? router - router_classify : 0;
+    stages[QTRACE_BACKEND] = elapsed(trace->router_done, trace->first_reply);
+    stages[QTRACE_REPLY] = elapsed(trace->first_reply, trace->last_write);
+    stages[QTRACE_TOTAL] = elapsed(trace->queued ? trace->queued : trace->routed,
+                                   trace->last_write);
+
+    for (int i = 0; i < QTRACE_N_STAGES; i++)
+    {
+        /** Without filters the router is the first element of the chain and
+         * the queueing time of the events inserted by MaxScale is not known */
+        if ((i != QTRACE_FILTER || trace->router) && (i != QTRACE_QUEUE || trace->queued))
+        {
+            ts_histogram_add(latency[i], stages[i] / 1000);
+        }
+    }
+}
+
+/**
+ * Allocate the latency histograms of a service
+ *
+ * @param latency Array of QTRACE_N_STAGES histograms
+ * @return True on success
+ */
+bool qtrace_alloc_stats(ts_histogram_t *latency)
+{
+    for (int i = 0; i < QTRACE_N_STAGES; i++)
+    {
+        if ((latency[i] = ts_histogram_alloc_log()) == NULL)
+        {
+            qtrace_free_stats(latency);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Free the latency histograms of a service
+ *
+ * @param latency Array of QTRACE_N_STAGES histograms
+ */
+void qtrace_free_stats(ts_histogram_t *latency)
+{
+    for (int i = 0; i < QTRACE_N_STAGES; i++)
+    {
+        ts_histogram_free(latency[i]);
+        latency[i] = NULL;
+    }
+}
+
+/**
+ * Get the name of a stage
+ *
+ * @param stage The stage
+ * @return The name of the stage
+ */
+const char* qtrace_stage_name(qtrace_stage_t stage)
+{
+    return stage < QTRACE_N_STAGES ? stage_names[stage] : "unknown";
+}
@@ -17,6 +17,14 @@
  * MaxScale contains a number of FIFO queues. This code attempts to provide
  * standard functions for handling them.
  *
+ * The queues are bounded rings of slots in the manner of Dmitry Vyukov's
+ * MPMC queue. A slot whose sequence number equals a position is free for
+ * the producer that claims the position, and once the entry has been stored
+ * the sequence is set to the position plus one for the consumer. The
+ * consumer then sets it to the position of the next round. The producers
+ * claim positions by advancing the end and the consumers by advancing the
+ * start with a compare-and-swap, so neither waits for the other.
+ *
  * @verbatim
  * Revision History
  *
@@ -26,11 +34,68 @@
  * @endverbatim
  */
 #include <stdlib.h>
+#include <time.h>
 #include <queuemanager.h>
-#include <spinlock.h>
 #include <log_manager.h>
 #include <hk_heartbeat.h>
 
+/**
+ * The current time in nanoseconds
+ */
+static inline uint64_t
+queue_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Create a new queue
+ *
+ * The queue holds at most limit entries. The flags are QUEUE_SINGLE_CONSUMER
+ * if only one thread removes entries and QUEUE_TIMESTAMPS if the time the
+ * entries spend in the queue is collected.
+ *
+ * @param limit         The maximum number of entries
+ * @param flags         Bitmask of the QUEUE_ flags
+ * @return QUEUE_CONFIG The queue or NULL if out of memory
+ */
+QUEUE_CONFIG *
+mxs_queue_create(int limit, int flags)
+{
+    QUEUE_CONFIG *new_queue;
+    int size = 2;
+
+    if (limit < 1)
+    {
+        limit = 1;
+    }
+    while (size < limit)
+    {
+        size *= 2;
+    }
+
+    if ((new_queue = (QUEUE_CONFIG *)calloc(1, sizeof(QUEUE_CONFIG))) == NULL ||
+        (new_queue->queue_array = (QUEUE_SLOT *)calloc(size, sizeof(QUEUE_SLOT))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for new queue in mxs_queue_create");
+        free(new_queue);
+        return NULL;
+    }
+
+    new_queue->queue_size = size;
+    new_queue->queue_limit = limit;
+    new_queue->flags = flags;
+
+    for (int i = 0; i < size; i++)
+    {
+        new_queue->queue_array[i].sequence = i;
+    }
+
+    return new_queue;
+}
+
 /**
  * @brief Allocate a new queue
  *
@@ -50,17 +115,9 @@ QUEUE_CONFIG
         MXS_ERROR("Limit configured for connection queue exceeds system maximum");
         limit = CONNECTION_QUEUE_LIMIT;
     }
-    new_queue = (QUEUE_CONFIG *)calloc(1, sizeof(QUEUE_CONFIG));
-    if (new_queue)
+    if ((new_queue = mxs_queue_create(limit, 0)))
     {
-        new_queue->queue_size = CONNECTION_QUEUE_LIMIT;
-        new_queue->queue_limit = limit;
         new_queue->timeout = timeout;
-        spinlock_init(&new_queue->queue_lock);
-    }
-    else
-    {
-        MXS_ERROR("Failed to allocate memory for new queue in mxs_queue_alloc");
     }
     return new_queue;
 }
@@ -75,7 +132,196 @@ QUEUE_CONFIG
  */
 void mxs_queue_free(QUEUE_CONFIG *queue_config)
 {
-    free(queue_config);
+    if (queue_config)
+    {
+        free(queue_config->queue_array);
+        free(queue_config);
+    }
+}
+
+/**
+ * Claim positions for new entries. At most n consecutive positions are
+ * claimed, as many as there are free slots for within the limit.
+ *
+ * @param queue_config  The queue
+ * @param n             The number of entries to add
+ * @param claimed       The number of claimed positions is stored here
+ * @return The first claimed position
+ */
+static uint64_t
+queue_claim_end(QUEUE_CONFIG *queue_config, int n, int *claimed)
+{
+    uint64_t mask = queue_config->queue_size - 1;
+    uint64_t pos = __atomic_load_n(&queue_config->end, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        uint64_t start = __atomic_load_n(&queue_config->start, __ATOMIC_ACQUIRE);
+        int room = queue_config->queue_limit - (int)(pos > start ? pos - start : 0);
+        int count = 0;
+
+        if (room > n)
+        {
+            room = n;
+        }
+
+        /** A slot stays free for its position until that position is claimed */
+        while (count < room &&
+               __atomic_load_n(&queue_config->queue_array[(pos + count) & mask].sequence,
+                               __ATOMIC_ACQUIRE) == pos + count)
+        {
+            count++;
+        }
+
+        if (count == 0)
+        {
+            uint64_t now = __atomic_load_n(&queue_config->end, __ATOMIC_RELAXED);
+
+            if (now == pos)
+            {
+                /** The queue is full */
+                *claimed = 0;
+                return pos;
+            }
+            pos = now;
+        }
+        else if (__atomic_compare_exchange_n(&queue_config->end, &pos, pos + count, false,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *claimed = count;
+            return pos;
+        }
+    }
+}
+
+/**
+ * Claim positions of entries to remove. At most n consecutive positions are
+ * claimed, as many as there are stored entries for.
+ *
+ * @param queue_config  The queue
+ * @param n             The number of entries to remove
+ * @param claimed       The number of claimed positions is stored here
+ * @return The first claimed position
+ */
+static uint64_t
+queue_claim_start(QUEUE_CONFIG *queue_config, int n, int *claimed)
+{
+    uint64_t mask = queue_config->queue_size - 1;
+    uint64_t pos = __atomic_load_n(&queue_config->start, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        int count = 0;
+
+        while (count < n &&
+               __atomic_load_n(&queue_config->queue_array[(pos + count) & mask].sequence,
+                               __ATOMIC_ACQUIRE) == pos + count + 1)
+        {
+            count++;
+        }
+
+        if (count == 0)
+        {
+            uint64_t now = __atomic_load_n(&queue_config->start, __ATOMIC_RELAXED);
+
+            if (now == pos)
+            {
+                /** The queue is empty */
+                *claimed = 0;
+                return pos;
+            }
+            pos = now;
+        }
+        else if (queue_config->flags & QUEUE_SINGLE_CONSUMER)
+        {
+            __atomic_store_n(&queue_config->start, pos + count, __ATOMIC_RELAXED);
+            *claimed = count;
+            return pos;
+        }
+        else if (__atomic_compare_exchange_n(&queue_config->start, &pos, pos + count, false,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *claimed = count;
+            return pos;
+        }
+    }
+}
+
+/**
+ * Copy out the entry of a claimed position and free its slot for the next round
+ *
+ * @param queue_config  The queue
+ * @param pos           The claimed position
+ * @param result        The entry is copied here
+ * @param now           The current time in nanoseconds if the queue has timestamps
+ */
+static inline void
+queue_take(QUEUE_CONFIG *queue_config, uint64_t pos, QUEUE_ENTRY *result, uint64_t now)
+{
+    QUEUE_SLOT *slot = &queue_config->queue_array[pos & (queue_config->queue_size - 1)];
+
+    *result = slot->entry;
+    __atomic_store_n(&slot->sequence, pos + queue_config->queue_size, __ATOMIC_RELEASE);
+
+    if (queue_config->flags & QUEUE_TIMESTAMPS)
+    {
+        QUEUE_STATS *stats = &queue_config->stats;
+        uint64_t wait = now > result->queued_at ? now - result->queued_at : 0;
+        uint64_t max = __atomic_load_n(&stats->max_wait, __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&stats->n_dequeued, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->total_wait, wait, __ATOMIC_RELAXED);
+        while (wait > max &&
+               !__atomic_compare_exchange_n(&stats->max_wait, &max, wait, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+}
+
+/**
+ * @brief Add items to a queue
+ *
+ * Add new items to a FIFO queue in one operation. The items are added in
+ * order and they are consecutive in the queue. If the queue does not have
+ * room for all of them, as many of the first ones as fit are added.
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param new_entries   The new entries, to be added
+ * @param n             The number of entries
+ * @return int          The number of entries added
+ */
+int mxs_enqueue_batch(QUEUE_CONFIG *queue_config, void **new_entries, int n)
+{
+    if (queue_config == NULL || n <= 0)
+    {
+        return 0;
+    }
+
+    int claimed;
+    uint64_t pos = queue_claim_end(queue_config, n, &claimed);
+    uint64_t mask = queue_config->queue_size - 1;
+    uint64_t now = queue_config->flags & QUEUE_TIMESTAMPS ? queue_clock() : 0;
+
+    for (int i = 0; i < claimed; i++)
+    {
+        QUEUE_SLOT *slot = &queue_config->queue_array[(pos + i) & mask];
+        slot->entry.queued_object = new_entries[i];
+        slot->entry.heartbeat = hkheartbeat;
+        slot->entry.queued_at = now;
+        __atomic_store_n(&slot->sequence, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    if (queue_config->flags & QUEUE_TIMESTAMPS)
+    {
+        __atomic_add_fetch(&queue_config->stats.n_enqueued, claimed, __ATOMIC_RELAXED);
+        if (claimed < n)
+        {
+            __atomic_add_fetch(&queue_config->stats.n_full, n - claimed, __ATOMIC_RELAXED);
+        }
+    }
+
+    return claimed;
 }
 
 /**
@@ -89,54 +335,153 @@ void mxs_queue_free(QUEUE_CONFIG *queue_config)
  */
 bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry)
 {
-    bool result = false;
+    return mxs_enqueue_batch(queue_config, &new_entry, 1) == 1;
+}
 
-    if (queue_config)
+/**
+ * @brief Remove items from a queue
+ *
+ * Remove the oldest items from a FIFO queue in one operation.
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param results       The removed entries are copied here
+ * @param n             The most entries to remove
+ * @return int          The number of entries removed
+ */
+int mxs_dequeue_batch(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *results, int n)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    int claimed;
+    uint64_t pos = queue_claim_start(queue_config, n, &claimed);
+    uint64_t now = claimed && queue_config->flags & QUEUE_TIMESTAMPS ? queue_clock() : 0;
+
+    for (int i = 0; i < claimed; i++)
+    {
+        queue_take(queue_config, pos + i, &results[i], now);
+    }
+
+    return claimed;
+}
+
+/**
+ * @brief Remove an item from a queue
+ *
+ * Remove the oldest item from a FIFO queue
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param result        The removed entry is copied here
+ * @return bool         Whether an entry was removed
+ */
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result)
+{
+    return mxs_dequeue_batch(queue_config, result, 1) == 1;
+}
+
+/**
+ * @brief Remove an expired item from a queue
+ *
+ * Remove the oldest item from a FIFO queue if it has been in the queue for
+ * longer than the timeout of the queue, in seconds. As the items are queued
+ * in order, calling this until it fails removes all expired items.
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param result        The removed entry is copied here
+ * @return bool         Whether an entry was removed
+ */
+bool mxs_dequeue_expired(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result)
+{
+    uint64_t mask = queue_config->queue_size - 1;
+    uint64_t pos = __atomic_load_n(&queue_config->start, __ATOMIC_RELAXED);
+
+    while (true)
     {
-        spinlock_acquire(&queue_config->queue_lock);
-        if (queue_config->queue_limit < queue_config->queue_size
-            && mxs_queue_count(queue_config) < queue_config->queue_size)
+        QUEUE_SLOT *slot = &queue_config->queue_array[pos & mask];
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1)
         {
-            queue_config->queue_array[queue_config->end].queued_object = new_entry;
-            queue_config->queue_array[queue_config->end].heartbeat = hkheartbeat;
-            queue_config->end++;
-            if (queue_config->end >= queue_config->queue_size)
+            /** One heartbeat is 100 milliseconds */
+            if (hkheartbeat - slot->entry.heartbeat <= queue_config->timeout * 10)
             {
-                queue_config->end = 0;
+                return false;
+            }
+            if (__atomic_compare_exchange_n(&queue_config->start, &pos, pos + 1, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                queue_take(queue_config, pos, result,
+                           queue_config->flags & QUEUE_TIMESTAMPS ? queue_clock() : 0);
+                return true;
             }
-            result = true;
         }
         else
         {
-            result = false;
+            uint64_t now = __atomic_load_n(&queue_config->start, __ATOMIC_RELAXED);
+
+            if (now == pos)
+            {
+                return false;
+            }
+            pos = now;
         }
-        spinlock_release(&queue_config->queue_lock);
     }
-    return result;
 }
 
 /**
- * @brief Remove an item from a queue
+ * @brief Look at the oldest item of a queue
  *
- * Remove an item from a FIFO queue
+ * The item stays in the queue. With concurrent consumers the item may
+ * have been removed by the time this returns.
  *
  * @param queue_config  The configuration and anchor structure for the queue
- * @return QUEUE_ENTRY  A structure defining the removed entry
+ * @param result        The oldest entry is copied here
+ * @return bool         Whether the queue had an entry
  */
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config)
+bool mxs_queue_peek(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result)
 {
-    int count;
-    QUEUE_ENTRY *result = NULL;
+    uint64_t mask = queue_config->queue_size - 1;
 
-    spinlock_acquire(&queue_config->queue_lock);
-    if (NULL == result && (count = mxs_queue_count(queue_config)) > 0)
+    while (true)
     {
-        result = &(queue_config->queue_array[queue_config->start++]);
-        if (queue_config->start >= queue_config->queue_size)
+        uint64_t pos = __atomic_load_n(&queue_config->start, __ATOMIC_ACQUIRE);
+        QUEUE_SLOT *slot = &queue_config->queue_array[pos & mask];
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+        {
+            if (__atomic_load_n(&queue_config->start, __ATOMIC_ACQUIRE) == pos)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        *result = slot->entry;
+
+        /** The entry is valid if the slot was not taken while it was copied */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == pos + 1)
         {
-            queue_config->start = 0;
+            return true;
         }
     }
-    spinlock_release(&queue_config->queue_lock);
-    return result;
+}
+
+/**
+ * @brief Get the statistics of a queue
+ *
+ * The numbers of queued entries and the queue times are only collected if
+ * the queue was created with QUEUE_TIMESTAMPS.
+ *
+ * @param queue_config  The queue
+ * @param stats         The statistics are copied here
+ */
+void mxs_queue_get_stats(QUEUE_CONFIG *queue_config, QUEUE_STATS *stats)
+{
+    stats->n_enqueued = __atomic_load_n(&queue_config->stats.n_enqueued, __ATOMIC_RELAXED);
+    stats->n_dequeued = __atomic_load_n(&queue_config->stats.n_dequeued, __ATOMIC_RELAXED);
+    stats->n_full = __atomic_load_n(&queue_config->stats.n_full, __ATOMIC_RELAXED);
+    stats->total_wait = __atomic_load_n(&queue_config->stats.total_wait, __ATOMIC_RELAXED);
+    stats->max_wait = __atomic_load_n(&queue_config->stats.max_wait, __ATOMIC_RELAXED);
 }
@@ -31,54 +31,106 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <platform.h>
 #include <spinlock.h>
 #include <random_jkiss.h>
 
 /* Public domain code for JKISS RNG - Comment header added */
 
+/**
+ * The state of a JKISS generator
+ */
+typedef struct
+{
+    unsigned int x; /*< The state of the congruential generator */
+    unsigned int y; /*< The state of the xorshift generator, never zero */
+    unsigned int z; /*< The state of the multiply-with-carry generator */
+    unsigned int c; /*< The carry, less than 698769069 */
+} JKISS;
+
 /* If possible, the seed variables will be set from /dev/urandom but
  * should that fail, these arbitrary numbers will be used as a last resort.
+ * The global generator only seeds the generators of the threads.
  */
-static unsigned int x = 123456789, y = 987654321, z = 43219876, c = 6543217; /* Seed variables */
+static JKISS global = { 123456789, 987654321, 43219876, 6543217 }; /* Seed variables */
 static bool init = false;
 
 static SPINLOCK random_jkiss_spinlock = SPINLOCK_INIT;
 
+/* The generator of the calling thread, seeded on the first call */
+static thread_local JKISS local;
+static thread_local bool local_init = false;
+
 static unsigned int random_jkiss_devrand(void);
 static void random_init_jkiss(void);
 
-/***
- *
- * Return a pseudo-random number that satisfies major tests for random sequences
- *
- * @return  uint    Random number
+/**
+ * Advance a generator.
  *
+ * @param g The generator
+ * @return The next random number of the generator
  */
-unsigned int
-random_jkiss(void)
+static inline unsigned int
+jkiss_next(JKISS *g)
 {
     unsigned long long t;
-    unsigned int result;
 
+    g->x = 314527869 * g->x + 1234567;
+    g->y ^= g->y << 5;
+    g->y ^= g->y >> 7;
+    g->y ^= g->y << 22;
+    t = 4294584393ULL * g->z + g->c;
+    g->c = t >> 32;
+    g->z = t;
+    return g->x + g->y + g->z;
+}
+
+/**
+ * Seed the generator of the calling thread from the global generator. The
+ * global generator is advanced under the lock, so no two threads get the
+ * same seed.
+ */
+static void
+random_init_local(void)
+{
     spinlock_acquire(&random_jkiss_spinlock);
     if (!init)
     {
-        /* Must set init first because initialisation calls this function */
         init = true;
-        spinlock_release(&random_jkiss_spinlock);
         random_init_jkiss();
-        spinlock_acquire(&random_jkiss_spinlock);
     }
-    x = 314527869 * x + 1234567;
-    y ^= y << 5;
-    y ^= y >> 7;
-    y ^= y << 22;
-    t = 4294584393ULL * z + c;
-    c = t >> 32;
-    z = t;
-    result = x + y + z;
+    local.x = jkiss_next(&global);
+    local.y = jkiss_next(&global);
+    local.z = jkiss_next(&global);
+    local.c = jkiss_next(&global) % 698769068 + 1;
     spinlock_release(&random_jkiss_spinlock);
-    return result;
+
+    if (local.y == 0)
+    {
+        local.y = 987654321;
+    }
+    local_init = true;
+}
+
+/***
+ *
+ * Return a pseudo-random number that satisfies major tests for random sequences
+ *
+ * Each thread has a generator of its own, so no lock is taken except on the
+ * first call of a thread.
+ *
+ * @return  uint    Random number
+ *
+ */
+unsigned int
+random_jkiss(void)
+{
+    if (!local_init)
+    {
+        random_init_local();
+    }
+
+    return jkiss_next(&local);
 }
 
 /* Own code adapted from http://www0.cs.ucl.ac.uk/staff/d.jones/GoodPracticeRNG.pdf */
@@ -111,8 +163,8 @@ random_jkiss_devrand(void)
 
 /***
  *
- * Initialise the generator using /dev/urandom if available, and warm up
- * with 1000 iterations
+ * Initialise the global generator using /dev/urandom if available, and warm
+ * up with 100 iterations. The caller holds the spinlock.
  *
  */
 static void
@@ -120,31 +172,29 @@ random_init_jkiss(void)
 {
     int newrand, i;
 
-    spinlock_acquire(&random_jkiss_spinlock);
     if ((newrand = random_jkiss_devrand()) != 0)
     {
-        x = newrand;
+        global.x = newrand;
     }
 
     if ((newrand = random_jkiss_devrand()) != 0)
     {
-        y = newrand;
+        global.y = newrand;
     }
 
     if ((newrand = random_jkiss_devrand()) != 0)
     {
-        z = newrand;
+        global.z = newrand;
     }
 
     if ((newrand = random_jkiss_devrand()) != 0)
     {
-        c = newrand % 698769068 + 1; /* Should be less than 698769069 */
+        global.c = newrand % 698769068 + 1; /* Should be less than 698769069 */
     }
-    spinlock_release(&random_jkiss_spinlock);
 
     /* "Warm up" our random number generator */
     for (i = 0; i < 100; i++)
     {
-        random_jkiss();
+        jkiss_next(&global);
     }
 }
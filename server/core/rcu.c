@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file rcu.c  Quiescent state based reclamation for the polling threads
+ *
+ * Each polling thread publishes the global epoch it has seen at the end of
+ * every iteration of the polling loop, a point where it holds no references
+ * to shared objects. Retiring an object advances the global epoch. Once every
+ * polling thread has published a later epoch than the one the object was
+ * tagged with, no thread can refer to it any more.
+ */
+
+#include <stdlib.h>
+#include <rcu.h>
+#include <atomic.h>
+#include <log_manager.h>
+#include <platform.h>
+
+/**
+ * The epoch published by a polling thread. Each one is on a cache line of
+ * its own as the owning thread updates it on every iteration of the polling
+ * loop.
+ */
+typedef struct
+{
+    volatile int    epoch;  /*< The global epoch at the last quiescent point */
+    volatile bool   online; /*< Whether the thread is polling */
+    char            pad[64 - sizeof(int) - sizeof(bool)];
+} RCU_EPOCH;
+
+static  int             rcu_epoch = 0;          /* The global epoch */
+static  RCU_EPOCH       *rcu_epochs = NULL;     /* The epochs of the polling threads */
+static  int             rcu_n_epochs = 0;
+static  thread_local int rcu_thread_id = -1;    /* The polling thread id of the caller */
+
+/**
+ * Allocate the epochs of the polling threads. Must be called before any of
+ * the polling threads are started.
+ *
+ * @param n_threads     The number of polling threads
+ */
+void
+rcu_init(int n_threads)
+{
+    if ((rcu_epochs = (RCU_EPOCH *)calloc(n_threads, sizeof(RCU_EPOCH))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate the epochs of %d polling threads.", n_threads);
+        return;
+    }
+    rcu_n_epochs = n_threads;
+}
+
+/**
+ * Mark the calling thread as a polling thread. From here on the objects it
+ * may refer to are not freed before it has passed a quiescent point.
+ *
+ * @param thread_id     The thread ID of the caller
+ */
+void
+rcu_thread_start(int thread_id)
+{
+    if (thread_id < rcu_n_epochs)
+    {
+        rcu_epochs[thread_id].epoch = atomic_add(&rcu_epoch, 0);
+        rcu_epochs[thread_id].online = true;
+        rcu_thread_id = thread_id;
+    }
+}
+
+/**
+ * Mark the calling thread as no longer polling
+ *
+ * @param thread_id     The thread ID of the caller
+ */
+void
+rcu_thread_stop(int thread_id)
+{
+    if (rcu_thread_id >= 0)
+    {
+        rcu_epochs[thread_id].online = false;
+        rcu_thread_id = -1;
+    }
+}
+
+/**
+ * Publish a quiescent point of the calling polling thread. The thread must
+ * not refer to any retired object after this. Only the cache line of the
+ * thread itself is written.
+ *
+ * @param thread_id     The thread ID of the caller
+ */
+void
+rcu_quiescent(int thread_id)
+{
+    if (rcu_thread_id >= 0)
+    {
+        /** The reads of the shared objects must be done before the epoch is published */
+        __sync_synchronize();
+        rcu_epochs[thread_id].epoch = *(volatile int *)&rcu_epoch;
+    }
+}
+
+/**
+ * Check whether the calling thread is a polling thread that publishes its
+ * quiescent points
+ *
+ * @return True if the thread is a polling thread
+ */
+bool
+rcu_is_online(void)
+{
+    return rcu_thread_id >= 0;
+}
+
+/**
+ * Check whether the polling threads have been set up. Before that all
+ * retired objects can be freed at once.
+ *
+ * @return True if the epochs of the polling threads exist
+ */
+bool
+rcu_enabled(void)
+{
+    return rcu_n_epochs > 0;
+}
+
+/**
+ * Retire an object that has been unlinked from a shared structure. The
+ * global epoch is advanced so that the polling threads can publish a later
+ * one at their next quiescent point.
+ *
+ * @return The epoch to tag the object with
+ */
+int
+rcu_retire(void)
+{
+    return atomic_add(&rcu_epoch, 1);
+}
+
+/**
+ * Check whether all polling threads have passed a quiescent point after the
+ * given epoch.
+ *
+ * @param epoch The epoch of a retired object
+ * @return True if no polling thread can refer to an object of that epoch
+ */
+bool
+rcu_passed(int epoch)
+{
+    for (int i = 0; i < rcu_n_epochs; i++)
+    {
+        /** The difference works even when the epoch wraps around */
+        if (rcu_epochs[i].online && (int)((unsigned)rcu_epochs[i].epoch - (unsigned)epoch) <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Return the current global epoch, used in diagnostics
+ *
+ * @return The global epoch
+ */
+int
+rcu_current(void)
+{
+    return rcu_epoch;
+}
@@ -28,12 +28,14 @@
 #include <resultset.h>
 #include <buffer.h>
 #include <dcb.h>
+#include <mysql_wire.h>
 
 
-static int mysql_send_fieldcount(DCB *, int);
-static int mysql_send_columndef(DCB *, char *, int, int, uint8_t);
-static int mysql_send_eof(DCB *, int);
-static int mysql_send_row(DCB *, RESULT_ROW *, int);
+static int mysql_send_fieldcount(DCB_PRINT_BATCH *, int);
+static int mysql_send_columndef(DCB_PRINT_BATCH *, char *, int, int, uint8_t);
+static int mysql_send_eof(DCB_PRINT_BATCH *, int);
+static int mysql_send_row(DCB_PRINT_BATCH *, RESULT_ROW *, int);
+static RESULT_ROW *resultset_next_row(RESULTSET *, long *);
 
 
 /**
@@ -54,6 +56,8 @@ resultset_create(RESULT_ROW_CB func, void *data)
         rval->column = NULL;
         rval->userdata = data;
         rval->fetchrow = func;
+        rval->limit = -1;
+        rval->offset = 0;
     }
     return rval;
 }
@@ -228,69 +232,119 @@ resultset_row_set(RESULT_ROW *row, int col, char *value)
     return 1;
 }
 
+/**
+ * Limit the rows of a result set that are streamed
+ *
+ * @param set    The result set
+ * @param limit  Maximum number of rows to stream, -1 for no limit
+ * @param offset Number of rows to skip before the first streamed row
+ */
+void
+resultset_set_limit(RESULTSET *set, long limit, long offset)
+{
+    set->limit = limit;
+    set->offset = offset > 0 ? offset : 0;
+}
+
+/**
+ * Fetch the next row of a result set that is to be streamed
+ *
+ * The rows before the offset are skipped. Once the limit has been reached
+ * the remaining rows are still fetched and discarded as the row callbacks
+ * release their data only after they have returned the last row.
+ *
+ * @param set   The result set
+ * @param rowno Number of rows returned so far, updated by the call
+ * @return The next row or NULL if there are no more rows to stream
+ */
+static RESULT_ROW *
+resultset_next_row(RESULTSET *set, long *rowno)
+{
+    RESULT_ROW *row;
+
+    while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+    {
+        long n = (*rowno)++;
+
+        if (n >= set->offset && (set->limit < 0 || n < set->offset + set->limit))
+        {
+            return row;
+        }
+        resultset_free_row(row);
+    }
+    return NULL;
+}
+
 /**
  * Stream a result set using the MySQL protocol for encodign the result
  * set. Each row is retrieved by calling the function passed in the
  * argument list.
  *
+ * The packets are collected into large buffers that are written to the
+ * DCB whenever one fills up instead of writing each packet separately.
+ *
  * @param set   The result set to stream
  * @param dcb   The connection to stream the result set to
  */
 void
 resultset_stream_mysql(RESULTSET *set, DCB *dcb)
 {
+    DCB_PRINT_BATCH batch;
     RESULT_COLUMN *col;
     RESULT_ROW *row;
     uint8_t seqno = 2;
+    long rowno = 0;
 
-    mysql_send_fieldcount(dcb, set->n_cols);
+    dcb_batch_init(&batch, dcb);
+    mysql_send_fieldcount(&batch, set->n_cols);
 
     col = set->column;
     while (col)
     {
-        mysql_send_columndef(dcb, col->name, col->type, col->len, seqno++);
+        mysql_send_columndef(&batch, col->name, col->type, col->len, seqno++);
         col = col->next;
     }
-    mysql_send_eof(dcb, seqno++);
-    while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+    mysql_send_eof(&batch, seqno++);
+    while ((row = resultset_next_row(set, &rowno)) != NULL)
     {
-        mysql_send_row(dcb, row, seqno++);
+        mysql_send_row(&batch, row, seqno++);
         resultset_free_row(row);
+
+        if (DCB_BATCH_FULL(&batch))
+        {
+            dcb_batch_flush(&batch);
+        }
     }
-    mysql_send_eof(dcb, seqno);
+    mysql_send_eof(&batch, seqno);
+    dcb_batch_flush(&batch);
 }
 
 /**
  * Send the field count packet in a response packet sequence.
  *
- * @param dcb           DCB of connection to send result set to
+ * @param batch         The batch the packet is added to
  * @param count         Number of columns in the result set
  * @return              Non-zero on success
  */
 static int
-mysql_send_fieldcount(DCB *dcb, int count)
+mysql_send_fieldcount(DCB_PRINT_BATCH *batch, int count)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(5)) == NULL)
+    if ((ptr = dcb_batch_reserve(batch, MXS_WIRE_HEADER_LEN + mxs_wire_lenenc_size(count))) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
-    *ptr++ = 0x01;                  // Payload length
-    *ptr++ = 0x00;
-    *ptr++ = 0x00;
-    *ptr++ = 0x01;                  // Sequence number in response
-    *ptr++ = count;                 // Length of result string
-    return dcb->func.write(dcb, pkt);
+    ptr = mxs_wire_put_header(ptr, mxs_wire_lenenc_size(count), 1);
+    mxs_wire_put_lenenc(ptr, count);
+    return 1;
 }
 
 
 /**
  * Send the column definition packet in a response packet sequence.
  *
- * @param dcb           The DCB of the connection
+ * @param batch         The batch the packet is added to
  * @param name          Name of the column
  * @param type          Column type
  * @param len           Column length
@@ -298,87 +352,39 @@ mysql_send_fieldcount(DCB *dcb, int count)
  * @return              Non-zero on success
  */
 static int
-mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
+mysql_send_columndef(DCB_PRINT_BATCH *batch, char *name, int type, int len, uint8_t seqno)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
-    int plen;
 
-    if ((pkt = gwbuf_alloc(26 + strlen(name))) == NULL)
+    if ((ptr = dcb_batch_reserve(batch, mxs_wire_coldef_len(0, 0, strlen(name)))) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
-    plen = 22 + strlen(name);
-    *ptr++ = plen & 0xff;
-    *ptr++ = (plen >> 8) & 0xff;
-    *ptr++ = (plen >> 16) & 0xff;
-    *ptr++ = seqno;                         // Sequence number in response
-    *ptr++ = 3;                             // Catalog is always def
-    *ptr++ = 'd';
-    *ptr++ = 'e';
-    *ptr++ = 'f';
-    *ptr++ = 0;                             // Schema name length
-    *ptr++ = 0;                             // virtual table name length
-    *ptr++ = 0;                             // Table name length
-    *ptr++ = strlen(name);                  // Column name length;
-    while (*name)
-    {
-        *ptr++ = *name++;                   // Copy the column name
-    }
-    *ptr++ = 0;                             // Orginal column name
-    *ptr++ = 0x0c;                          // Length of next fields always 12
-    *ptr++ = 0x3f;                          // Character set
-    *ptr++ = 0;
-    *ptr++ = len & 0xff;                    // Length of column
-    *ptr++ = (len >> 8) & 0xff;
-    *ptr++ = (len >> 16) & 0xff;
-    *ptr++ = (len >> 24) & 0xff;
-    *ptr++ = type;
-    *ptr++ = 0x81;                          // Two bytes of flags
-    if (type == 0xfd)
-    {
-        *ptr++ = 0x1f;
-    }
-    else
-    {
-        *ptr++ = 0x00;
-    }
-    *ptr++ = 0;
-    *ptr++ = 0;
-    *ptr++ = 0;
-    return dcb->func.write(dcb, pkt);
+    /** Binary collation for strings, the flags are NOT_NULL and UNSIGNED */
+    mxs_wire_put_coldef(ptr, seqno, "", "", name, 0x3f, len, type,
+                        type == 0xfd ? 0x1f81 : 0x0081, 0);
+    return 1;
 }
 
 
 /**
  * Send an EOF packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param batch         The batch the packet is added to
  * @param seqno         The sequence number of the EOF packet
  * @return              Non-zero on success
  */
 static int
-mysql_send_eof(DCB *dcb, int seqno)
+mysql_send_eof(DCB_PRINT_BATCH *batch, int seqno)
 {
-    GWBUF   *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(9)) == NULL)
+    if ((ptr = dcb_batch_reserve(batch, MXS_WIRE_EOF_LEN)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
-    *ptr++ = 0x05;
-    *ptr++ = 0x00;
-    *ptr++ = 0x00;
-    *ptr++ = seqno;                         // Sequence number in response
-    *ptr++ = 0xfe;                          // Length of result string
-    *ptr++ = 0x00;                          // No Errors
-    *ptr++ = 0x00;
-    *ptr++ = 0x02;                          // Autocommit enabled
-    *ptr++ = 0x00;
-    return dcb->func.write(dcb, pkt);
+    mxs_wire_put_eof(ptr, seqno, 0, MXS_WIRE_STATUS_AUTOCOMMIT);
+    return 1;
 }
 
 
@@ -386,53 +392,37 @@ mysql_send_eof(DCB *dcb, int seqno)
 /**
  * Send a row packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param batch         The batch the packet is added to
  * @param row           The row to send
  * @param seqno         The sequence number of the EOF packet
  * @return              Non-zero on success
  */
 static int
-mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
+mysql_send_row(DCB_PRINT_BATCH *batch, RESULT_ROW *row, int seqno)
 {
-    GWBUF *pkt;
-    int i, len = 4;
+    int i;
+    size_t len = 0;
     uint8_t *ptr;
 
     for (i = 0; i < row->n_cols; i++)
     {
-        if (row->cols[i])
-        {
-            len += strlen(row->cols[i]);
-        }
-        len++;
+        size_t collen = row->cols[i] ? strlen(row->cols[i]) : 0;
+        len += mxs_wire_lenenc_size(collen) + collen;
     }
 
-    if ((pkt = gwbuf_alloc(len)) == NULL)
+    if ((ptr = dcb_batch_reserve(batch, MXS_WIRE_HEADER_LEN + len)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
-    len -= 4;
-    *ptr++ = len & 0xff;
-    *ptr++ = (len >> 8) & 0xff;
-    *ptr++ = (len >> 16) & 0xff;
-    *ptr++ = seqno;
+    ptr = mxs_wire_put_header(ptr, len, seqno);
     for (i = 0; i < row->n_cols; i++)
     {
-        if (row->cols[i])
-        {
-            len = strlen(row->cols[i]);
-            *ptr++ = len;
-            strncpy((char *)ptr, row->cols[i], len);
-            ptr += len;
-        }
-        else
-        {
-            *ptr++ = 0;     // NULL column
-        }
+        /** A NULL column is sent as an empty string */
+        const char *col = row->cols[i] ? row->cols[i] : "";
+        ptr = mxs_wire_put_lenenc_str(ptr, col, strlen(col));
     }
 
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 /**
@@ -473,47 +463,56 @@ value_is_numeric(char *value)
 void
 resultset_stream_json(RESULTSET *set, DCB *dcb)
 {
+    DCB_PRINT_BATCH batch;
     RESULT_COLUMN *col;
     RESULT_ROW *row;
-    int rowno = 0;
+    long rowno = 0;
+    int sent = 0;
 
-    dcb_printf(dcb, "[ ");
-    while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+    dcb_batch_init(&batch, dcb);
+    dcb_batch_printf(&batch, "[ ");
+    while ((row = resultset_next_row(set, &rowno)) != NULL)
     {
         int i = 0;
-        if (rowno++ > 0)
+        if (sent++ > 0)
         {
-            dcb_printf(dcb, ",\n");
+            dcb_batch_printf(&batch, ",\n");
         }
-        dcb_printf(dcb, "{ ");
+        dcb_batch_printf(&batch, "{ ");
         col = set->column;
         while (col)
         {
-            dcb_printf(dcb, "\"%s\" : ", col->name);
+            dcb_batch_printf(&batch, "\"%s\" : ", col->name);
             if (row->cols[i])
             {
                 if (value_is_numeric(row->cols[i]))
                 {
-                    dcb_printf(dcb, "%s", row->cols[i]);
+                    dcb_batch_printf(&batch, "%s", row->cols[i]);
                 }
                 else
                 {
-                    dcb_printf(dcb, "\"%s\"", row->cols[i]);
+                    dcb_batch_printf(&batch, "\"%s\"", row->cols[i]);
                 }
             }
             else
             {
-                dcb_printf(dcb, "null");
+                dcb_batch_printf(&batch, "null");
             }
             i++;
             col = col->next;
             if (col)
             {
-                dcb_printf(dcb, ", ");
+                dcb_batch_printf(&batch, ", ");
             }
         }
         resultset_free_row(row);
-        dcb_printf(dcb, "}");
+        dcb_batch_printf(&batch, "}");
+
+        if (DCB_BATCH_FULL(&batch))
+        {
+            dcb_batch_flush(&batch);
+        }
     }
-    dcb_printf(dcb, "]\n");
+    dcb_batch_printf(&batch, "]\n");
+    dcb_batch_flush(&batch);
 }
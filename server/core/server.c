@@ -35,220 +35,1202 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <session.h>
 #include <server.h>
 #include <spinlock.h>
 #include <dcb.h>
 #include <maxscale/poll.h>
+#include <maxconfig.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <gw_ssl.h>
+#include <atomic.h>
+#include <housekeeper.h>
+#include <mysql_client_server_protocol.h>
+#include <arpa/inet.h>
+#include <gw.h>
+#include <rcu.h>
+#include <metrics.h>
+#include <stddef.h>
+
+/** The protocol whose client credentials warm-up connections can reuse */
+#define SERVER_POOL_WARMUP_PROTOCOL "MySQLBackend"
+
+/** How often the persistent pools are warmed, in seconds */
+#define SERVER_POOL_WARMUP_FREQ 1
+
+/** How often the addresses of the servers are resolved again, in seconds */
+#define SERVER_ADDRESS_REFRESH_FREQ 60
+
+/** How often the closed connections are removed from the persistent pools, in seconds */
+#define SERVER_POOL_PRUNE_FREQ 1
+
+/** How often the housekeeper publishes the sharded counters, in milliseconds */
+#define SERVER_STATS_PUBLISH_INTERVAL 100
+
+/** The initial number of chains in the indexes of the servers, they grow as needed */
+#define SERVER_INDEX_SIZE 64
+
+/**
+ * The credentials of a client session, without its default database, that
+ * a warm-up connection of the persistent pool authenticates with. The
+ * backend protocol reads them from the data of the internal client DCB.
+ */
+struct server_pool_auth
+{
+    SERVICE       *service; /**< The service of the session the credentials are from */
+    MYSQL_session session;  /**< The client credentials */
+};
 
 static SPINLOCK server_spin = SPINLOCK_INIT;
 static SERVER *allServers = NULL;
+static HASHTABLE *server_names = NULL;           /**< The servers by unique name */
+static HASHTABLE *server_addresses = NULL;       /**< The servers by address and port */
+static SERVER **standby_servers = NULL;          /**< The servers with persiststandby set */
+static int n_standby_servers = 0;                /**< Number of standby_servers */
+static SPINLOCK state_lock = SPINLOCK_INIT;      /**< Serializes the publishers of states */
+static SERVER_STATE *retired_states = NULL;      /**< Replaced states waiting to be freed */
+static int state_readers = 0;                    /**< Readers that are not polling threads */
+static bool stats_sharded = false;               /**< Whether the counters are sharded */
+
+static void spin_reporter(void *, char *, int);
+static void server_parameter_free(SERVER_PARAM *tofree);
+static void server_pool_warmup(void *data);
+static void server_address_refresh(void *data);
+static void server_pool_prune(void *data);
+static void server_address_resolve_task(void *data);
+static bool server_set_numeric_address(SERVER *server);
+static bool server_shards_alloc(SERVER *server);
+static void server_shards_free(SERVER *server);
+static void server_stats_publish_all(void *data);
+static bool server_index_init();
+static bool server_index_address(SERVER *server);
+static void server_unindex_address(SERVER *server);
+static void server_unindex_name(SERVER *server);
+static void server_pool_save_standby_auth(DCB *dcb);
+
+/**
+ * Allocate a new server withn the gateway
+ *
+ *
+ * @param servname      The server name
+ * @param protocol      The protocol to use to connect to the server
+ * @param port          The port to connect to
+ *
+ * @return              The newly created server or NULL if an error occured
+ */
+SERVER *
+server_alloc(char *servname, char *protocol, unsigned short port)
+{
+    SERVER *server;
+
+    if ((server = (SERVER *)calloc(1, sizeof(SERVER))) == NULL)
+    {
+        return NULL;
+    }
+#if defined(SS_DEBUG)
+    server->server_chk_top = CHK_NUM_SERVER;
+    server->server_chk_tail = CHK_NUM_SERVER;
+#endif
+    server->name = strndup(servname, MAX_SERVER_NAME_LEN);
+    server->protocol = strdup(protocol);
+    server->port = port;
+    server->status = SERVER_RUNNING;
+    server->node_id = -1;
+    server->rlag = -2;
+    server->master_id = -1;
+    server->depth = -1;
+    server->slaves = NULL;
+    server->parameters = NULL;
+    server->server_string = NULL;
+    spinlock_init(&server->lock);
+    server->persistent = NULL;
+    server->persistindex = NULL;
+    server->persistmax = 0;
+    server->persistmaxtime = 0;
+    server->persistpoolmax = 0;
+    server->persistwarm = 0;
+    server->persiststandby = 0;
+    server->compression = SERVER_COMPRESSION_NONE;
+    server->compression_level = SERVER_COMPRESSION_LEVEL_DEFAULT;
+    server->warmup_time = 0;
+    server->slave_since = -1;
+    spinlock_init(&server->persistlock);
+    server->addr_resolved = false;
+    server_publish_state(server);
+
+    spinlock_acquire(&server_spin);
+    if ((stats_sharded && !server_shards_alloc(server)) ||
+        !server_index_init() || !server_index_address(server))
+    {
+        spinlock_release(&server_spin);
+        server_shards_free(server);
+        free(server->state);
+        free(server->name);
+        free(server->protocol);
+        free(server);
+        return NULL;
+    }
+    bool first = allServers == NULL;
+    server->next = allServers;
+    allServers = server;
+    spinlock_release(&server_spin);
+
+    /**
+     * Host names are looked up by the housekeeper so that creating a
+     * backend connection never waits for the resolver. A server named
+     * after its Unix domain socket has no address to look up.
+     */
+    if (*servname != '/' && !server_set_numeric_address(server))
+    {
+        hktask_oneshot("Resolve server address", server_address_resolve_task, server, 0);
+    }
+    if (first)
+    {
+        hktask_add("Server address refresh", server_address_refresh, NULL,
+                   SERVER_ADDRESS_REFRESH_FREQ);
+        hktask_add("Persistent pool pruning", server_pool_prune, NULL,
+                   SERVER_POOL_PRUNE_FREQ);
+    }
+
+    return server;
+}
+
+
+/**
+ * Deallocate the specified server
+ *
+ * @param server        The service to deallocate
+ * @return Returns true if the server was freed
+ */
+int
+server_free(SERVER *tofreeserver)
+{
+    SERVER *server;
+
+    /* First of all remove from the linked list and the indexes */
+    spinlock_acquire(&server_spin);
+    if (allServers == tofreeserver)
+    {
+        allServers = tofreeserver->next;
+    }
+    else
+    {
+        server = allServers;
+        while (server && server->next != tofreeserver)
+        {
+            server = server->next;
+        }
+        if (server)
+        {
+            server->next = tofreeserver->next;
+        }
+    }
+    server_unindex_name(tofreeserver);
+    server_unindex_address(tofreeserver);
+    for (int i = 0; i < n_standby_servers; i++)
+    {
+        if (standby_servers[i] == tofreeserver)
+        {
+            standby_servers[i] = standby_servers[--n_standby_servers];
+            break;
+        }
+    }
+    spinlock_release(&server_spin);
+
+    /* Clean up session and free the memory */
+    free(tofreeserver->name);
+    free(tofreeserver->socket);
+    free(tofreeserver->protocol);
+    free(tofreeserver->unique_name);
+    free(tofreeserver->server_string);
+    free(tofreeserver->slaves);
+    server_parameter_free(tofreeserver->parameters);
+
+    dcb_persistent_clean_count(tofreeserver, true);
+
+    SERVER_POOL_USER *pooluser;
+    while ((pooluser = tofreeserver->persistent))
+    {
+        tofreeserver->persistent = pooluser->next;
+        free(pooluser->user);
+        free(pooluser->auth);
+        free(pooluser);
+    }
+    if (tofreeserver->persistindex)
+    {
+        hashtable_free(tofreeserver->persistindex);
+    }
+    server_shards_free(tofreeserver);
+    free(tofreeserver->state);
+    free(tofreeserver);
+    return 1;
+}
+
+/**
+ * Take a DCB from the stack of one user in the persistent pool. Must be
+ * called with the persistlock of the server held.
+ *
+ * @param server    The server
+ * @param pooluser  The pool entry of the user
+ * @param protocol  The name of the protocol needed for the connection
+ * @param owner     The polling thread that will own the connection
+ * @param reuse     Whether the protocol must be able to switch the user
+ * @param dead      Set to true if a connection closed by the backend was found
+ * @return The DCB or NULL if the stack has no suitable one
+ */
+static DCB *
+server_pool_pop(SERVER *server, SERVER_POOL_USER *pooluser, const char *protocol,
+                int owner, bool reuse, bool *dead)
+{
+    DCB *dcb, *previous = NULL;
+    time_t now = time(NULL);
+
+    for (dcb = pooluser->stack; dcb; previous = dcb, dcb = dcb->nextpersistent)
+    {
+        if (dcb->protoname
+            && !dcb-> dcb_errhandle_called
+            && !(dcb->flags & DCBF_HUNG)
+            && (!config_poll_affinity() || dcb->owner == owner)
+            && (!reuse || dcb->func.reuse)
+            && now - dcb->persistentstart <= server->persistmaxtime
+            && 0 == strcmp(dcb->protoname, protocol))
+        {
+            if (!dcb_persistent_alive(dcb))
+            {
+                MXS_DEBUG("%lu [server_get_persistent] Rejected dcb %p from pool "
+                          "of user %s, closed by the server.",
+                          pthread_self(), dcb, pooluser->user);
+                *dead = true;
+                continue;
+            }
+
+            if (NULL == previous)
+            {
+                pooluser->stack = dcb->nextpersistent;
+            }
+            else
+            {
+                previous->nextpersistent = dcb->nextpersistent;
+            }
+            pooluser->count--;
+            return dcb;
+        }
+        else
+        {
+            MXS_DEBUG("%lu [server_get_persistent] Rejected dcb "
+                      "%p from pool of user %s, protocol %s "
+                      "looking for %s, hung flag %s, error handle called %s.",
+                      pthread_self(),
+                      dcb,
+                      pooluser->user,
+                      dcb->protoname ? dcb->protoname : "NULL",
+                      protocol,
+                      (dcb->flags & DCBF_HUNG) ? "true" : "false",
+                      dcb-> dcb_errhandle_called ? "true" : "false");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get a DCB from the persistent connection pool, if possible
+ *
+ * A connection of the user is preferred. If there is none, an idle
+ * connection of the user with the most of them is taken, if the protocol
+ * can switch it to another user. The user name of the DCB is left for the
+ * caller to compare and free. The connections that are too old or broken
+ * are skipped here and left for dcb_persistent_clean_count() to remove.
+ * Before a connection is returned, its socket is peeked without blocking
+ * so that a connection the backend has closed is never handed out. Those
+ * are pruned from the pool right away.
+ *
+ * @param       server      The server to set the name on
+ * @param       user        The name of the user needing the connection
+ * @param       protocol    The name of the protocol needed for the connection
+ * @param       owner       The polling thread that will own the connection
+ */
+DCB *
+server_get_persistent(SERVER *server, char *user, const char *protocol, int owner)
+{
+    DCB *dcb = NULL;
+    bool dead = false;
+
+    if (server->stats.n_persistent > 0
+        && server->persistindex
+        && (server->status & SERVER_RUNNING))
+    {
+        SERVER_POOL_USER *pooluser;
+
+        spinlock_acquire(&server->persistlock);
+        if ((pooluser = hashtable_fetch(server->persistindex, user)) != NULL)
+        {
+            dcb = server_pool_pop(server, pooluser, protocol, owner, false, &dead);
+        }
+
+        if (dcb == NULL)
+        {
+            SERVER_POOL_USER *largest = NULL;
+
+            for (pooluser = server->persistent; pooluser; pooluser = pooluser->next)
+            {
+                if (pooluser->count > 0 && (largest == NULL || pooluser->count > largest->count))
+                {
+                    largest = pooluser;
+                }
+            }
+            if (largest && strcmp(largest->user, user) != 0)
+            {
+                dcb = server_pool_pop(server, largest, protocol, owner, true, &dead);
+            }
+        }
+        spinlock_release(&server->persistlock);
+
+        if (dcb)
+        {
+            atomic_add(&server->stats.n_persistent, -1);
+            server_add_current(server, 1);
+        }
+        if (dead)
+        {
+            dcb_persistent_prune(server);
+        }
+    }
+    return dcb;
+}
+
+/**
+ * Find the entry of a user in the persistent pool of a server, creating it
+ * if the user has no connections in the pool yet. The entries live as long
+ * as the server.
+ *
+ * @param server    The server
+ * @param user      The user the connections are authenticated as
+ * @return The entry of the user or NULL if memory allocation failed
+ */
+SERVER_POOL_USER *
+server_pool_user(SERVER *server, const char *user)
+{
+    SERVER_POOL_USER *pooluser = NULL;
+
+    spinlock_acquire(&server->persistlock);
+    if (server->persistindex == NULL
+        && (server->persistindex = hashtable_alloc(32, simple_str_hash, strcmp)) != NULL)
+    {
+        hashtable_enable_resize(server->persistindex);
+    }
+
+    if (server->persistindex
+        && (pooluser = hashtable_fetch(server->persistindex, (char *)user)) == NULL)
+    {
+        if ((pooluser = calloc(1, sizeof(SERVER_POOL_USER))) == NULL
+            || (pooluser->user = strdup(user)) == NULL
+            || !hashtable_add(server->persistindex, pooluser->user, pooluser))
+        {
+            if (pooluser)
+            {
+                free(pooluser->user);
+                free(pooluser);
+                pooluser = NULL;
+            }
+        }
+        else
+        {
+            pooluser->next = server->persistent;
+            server->persistent = pooluser;
+        }
+    }
+    spinlock_release(&server->persistlock);
+
+    if (pooluser == NULL)
+    {
+        MXS_ERROR("Failed to add user '%s' to the persistent pool of server %s, "
+                  "memory allocation failed.", user, server->unique_name);
+    }
+    return pooluser;
+}
+
+/**
+ * Copy the credentials of the client of the session of a backend DCB
+ *
+ * @param dcb       The backend DCB, linked to its session
+ * @return The credentials or NULL if the session has none that can be used
+ */
+static SERVER_POOL_AUTH *
+server_pool_auth_alloc(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+    SERVER_POOL_AUTH *auth;
+
+    if (dcb->protoname == NULL
+        || strcmp(dcb->protoname, SERVER_POOL_WARMUP_PROTOCOL) != 0
+        || session == NULL
+        || session->client_dcb == NULL
+        || session->client_dcb->data == NULL
+        || DCB_IS_POOL_WARMUP(session->client_dcb)
+        || (auth = malloc(sizeof(SERVER_POOL_AUTH))) == NULL)
+    {
+        return NULL;
+    }
+
+    auth->service = session->service;
+    memcpy(&auth->session, session->client_dcb->data, sizeof(MYSQL_session));
+    auth->session.db[0] = '\0';
+    auth->session.auth_token = NULL;
+    auth->session.auth_token_len = 0;
+    return auth;
+}
+
+/**
+ * Replace the credentials a user is warmed with
+ *
+ * @param server    The server
+ * @param pooluser  The pool entry of the user
+ * @param auth      The new credentials
+ */
+static void
+server_pool_set_auth(SERVER *server, SERVER_POOL_USER *pooluser, SERVER_POOL_AUTH *auth)
+{
+    spinlock_acquire(&server->persistlock);
+    SERVER_POOL_AUTH *old = pooluser->auth;
+    pooluser->auth = auth;
+    pooluser->warmfailed = false;
+    spinlock_release(&server->persistlock);
+    free(old);
+}
+
+/**
+ * Keep the credentials of the session of a DCB that goes to the persistent
+ * pool so that the pool of the user can be warmed with them. MaxScale only
+ * knows the password hash that the client sent, so only the users that have
+ * connected since startup can be warmed. Nothing is kept if warm-up is not
+ * configured for the server.
+ *
+ * @param server    The server of the DCB
+ * @param pooluser  The pool entry of the user of the DCB
+ * @param dcb       The backend DCB, still linked to its session
+ */
+void
+server_pool_save_auth(SERVER *server, SERVER_POOL_USER *pooluser, DCB *dcb)
+{
+    SERVER_POOL_AUTH *auth;
+
+    if ((server->persistwarm > 0 || server->persiststandby > 0)
+        && (auth = server_pool_auth_alloc(dcb)) != NULL)
+    {
+        server_pool_set_auth(server, pooluser, auth);
+    }
+}
+
+/**
+ * Make a server a standby for the master of its services. While the server
+ * is not the master, the pool of every user who has connected to any server
+ * of the services of the server is warmed up to persiststandby connections,
+ * so that the sessions that reconnect after the server has been promoted
+ * find authenticated connections waiting for them.
+ *
+ * @param server    The server
+ */
+void
+server_pool_standby_start(SERVER *server)
+{
+    spinlock_acquire(&server_spin);
+    SERVER **servers = realloc(standby_servers, (n_standby_servers + 1) * sizeof(SERVER *));
+
+    if (servers)
+    {
+        standby_servers = servers;
+        standby_servers[n_standby_servers++] = server;
+    }
+    spinlock_release(&server_spin);
+
+    if (servers == NULL)
+    {
+        MXS_ERROR("Failed to make server %s a standby, memory allocation failed.",
+                  server->unique_name);
+    }
+}
+
+/**
+ * Keep the credentials of the session of a new backend connection for the
+ * standby servers of the service of the session that have none for the user
+ * or whose last credentials were rejected.
+ *
+ * @param dcb       The backend DCB that has authenticated
+ */
+static void
+server_pool_save_standby_auth(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+
+    if (n_standby_servers == 0 || session == NULL || session->service == NULL ||
+        dcb->user == NULL || *dcb->user == '\0')
+    {
+        return;
+    }
+
+    spinlock_acquire(&server_spin);
+    for (int i = 0; i < n_standby_servers; i++)
+    {
+        SERVER *standby = standby_servers[i];
+        SERVER_POOL_USER *pooluser;
+        SERVER_POOL_AUTH *auth;
+
+        if (standby != dcb->server
+            && !SERVER_IS_MASTER(standby)
+            && serviceHasBackend(session->service, standby)
+            && (pooluser = server_pool_user(standby, dcb->user)) != NULL)
+        {
+            spinlock_acquire(&standby->persistlock);
+            bool needed = pooluser->auth == NULL || pooluser->warmfailed;
+            spinlock_release(&standby->persistlock);
+
+            if (needed && (auth = server_pool_auth_alloc(dcb)) != NULL)
+            {
+                server_pool_set_auth(standby, pooluser, auth);
+            }
+        }
+    }
+    spinlock_release(&server_spin);
+}
+
+/**
+ * Put a DCB on the persistent pool stack of its user
+ *
+ * @param server    The server of the DCB
+ * @param pooluser  The pool entry of the user of the DCB
+ * @param dcb       The DCB, detached from its session
+ */
+void
+server_add_persistent(SERVER *server, SERVER_POOL_USER *pooluser, DCB *dcb)
+{
+    spinlock_acquire(&server->persistlock);
+    dcb->nextpersistent = pooluser->stack;
+    pooluser->stack = dcb;
+    pooluser->count++;
+    spinlock_release(&server->persistlock);
+    atomic_add(&server->stats.n_persistent, 1);
+}
+
+/**
+ * Start warming the persistent pool of a server. Once a second, the pool of
+ * every user with saved credentials is topped up to persistwarm connections,
+ * or persiststandby while the server is not the master, as long as the pool
+ * as a whole stays within persistpoolmax.
+ *
+ * @param server    The server
+ */
+void
+server_pool_warmup_start(SERVER *server)
+{
+    char name[MAX_SERVER_NAME_LEN + 40];
+
+    snprintf(name, sizeof(name), "Pool warm-up %s", server->unique_name);
+    hktask_add(name, server_pool_warmup, server, SERVER_POOL_WARMUP_FREQ);
+}
+
+/**
+ * End the warm-up of one connection of a user
+ *
+ * @param server    The server
+ * @param user      The user the connection was for
+ */
+static void
+server_pool_warmup_end(SERVER *server, char *user)
+{
+    SERVER_POOL_USER *pooluser;
+
+    spinlock_acquire(&server->persistlock);
+    if ((pooluser = hashtable_fetch(server->persistindex, user)) != NULL)
+    {
+        pooluser->warming--;
+    }
+    spinlock_release(&server->persistlock);
+}
+
+/**
+ * The free function of the data of a warm-up client DCB, called when the
+ * warm-up session is freed however the warm-up ended.
+ *
+ * @param dcb   The internal client DCB
+ */
+static void
+server_pool_warmup_free(DCB *dcb)
+{
+    free(dcb->data);
+    server_pool_warmup_end(dcb->server, dcb->user);
+}
+
+/**
+ * Open a warm-up connection to a server. The connection has an internal
+ * client with the saved credentials of the user, like the connection of the
+ * binlog router to its master. The backend protocol calls
+ * server_pool_warmup_done() when the authentication has completed.
+ *
+ * @param server    The server
+ * @param user      The user to authenticate as
+ * @param auth      The credentials of the user
+ * @return True if the connection is being opened
+ */
+static bool
+server_pool_warmup_connect(SERVER *server, char *user, SERVER_POOL_AUTH *auth)
+{
+    static int next_owner = 0;
+    MYSQL_session *data = NULL;
+    SESSION *session;
+    DCB *client;
+
+    if ((client = dcb_alloc(DCB_ROLE_INTERNAL, NULL)) == NULL
+        || (data = malloc(sizeof(MYSQL_session))) == NULL
+        || (client->user = strdup(user)) == NULL)
+    {
+        MXS_ERROR("Failed to warm the persistent pool of server %s, "
+                  "memory allocation failed.", server->unique_name);
+        free(data);
+        if (client)
+        {
+            dcb_close(client);
+        }
+        server_pool_warmup_end(server, user);
+        return false;
+    }
+
+    memcpy(data, &auth->session, sizeof(MYSQL_session));
+    client->data = data;
+    client->server = server;
+    client->flags |= DCBF_POOL_WARMUP;
+    client->owner = (unsigned int)atomic_add(&next_owner, 1) % poll_thread_count();
+    client->authfunc.free = server_pool_warmup_free;
+    client->state = DCB_STATE_POLLING;  /* Fake the client is reading */
+
+    if ((session = session_alloc(auth->service, client)) == NULL
+        || dcb_connect(server, session, server->protocol) == NULL)
+    {
+        MXS_INFO("Failed to open a warm-up connection for user '%s' to server %s.",
+                 user, server->unique_name);
+        dcb_close(client);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Called by the backend protocol when a warm-up connection has authenticated
+ * with the server or failed. An authenticated connection goes to the pool as
+ * it is closed. After a failure, the user is not warmed again until a client
+ * session brings new credentials.
+ *
+ * @param dcb       The backend DCB of the warm-up session
+ * @param success   Whether the server accepted the credentials
+ */
+void
+server_pool_warmup_done(DCB *dcb, bool success)
+{
+    DCB *client = dcb->session->client_dcb;
+
+    if (dcb->dcb_is_zombie)
+    {
+        return;
+    }
+
+    if (!success)
+    {
+        SERVER_POOL_USER *pooluser;
+
+        dcb->dcb_errhandle_called = true;
+        spinlock_acquire(&dcb->server->persistlock);
+        if ((pooluser = hashtable_fetch(dcb->server->persistindex, client->user)) != NULL)
+        {
+            pooluser->warmfailed = true;
+        }
+        spinlock_release(&dcb->server->persistlock);
+    }
+    dcb_close(dcb);
+    dcb_close(client);
+}
+
+/**
+ * Housekeeper task that tops up the persistent pool of a server
+ *
+ * @param data  The server
+ */
+static void
+server_pool_warmup(void *data)
+{
+    SERVER *server = (SERVER *)data;
+    SERVER_POOL_USER *pooluser;
+    long warm = server->persistwarm;
+    int room;
+
+    if (!SERVER_IS_MASTER(server) && server->persiststandby > warm)
+    {
+        warm = server->persiststandby;
+    }
+
+    if ((server->status & (SERVER_RUNNING | SERVER_MAINT)) != SERVER_RUNNING
+        || server->persistpoolmax <= 0 || warm <= 0)
+    {
+        return;
+    }
+
+    /** Drop the expired and broken connections before counting */
+    room = server->persistpoolmax - dcb_persistent_clean_count(server, false);
+
+    spinlock_acquire(&server->persistlock);
+    for (pooluser = server->persistent; pooluser; pooluser = pooluser->next)
+    {
+        room -= pooluser->warming;
+    }
+    pooluser = server->persistent;
+    spinlock_release(&server->persistlock);
+
+    /** The entries are never removed and new ones go to the head */
+    for (; pooluser && room > 0; pooluser = pooluser->next)
+    {
+        SERVER_POOL_AUTH auth;
+        int n = 0;
+
+        spinlock_acquire(&server->persistlock);
+        if (pooluser->auth && !pooluser->warmfailed)
+        {
+            n = MIN(warm - pooluser->count - pooluser->warming, room);
+            if (n > 0)
+            {
+                pooluser->warming += n;
+                memcpy(&auth, pooluser->auth, sizeof(auth));
+            }
+        }
+        spinlock_release(&server->persistlock);
+
+        for (int i = 0; i < n; i++)
+        {
+            if (!server_pool_warmup_connect(server, pooluser->user, &auth))
+            {
+                /** Give up the connections not yet started, retry on the next run */
+                spinlock_acquire(&server->persistlock);
+                pooluser->warming -= n - i - 1;
+                spinlock_release(&server->persistlock);
+                return;
+            }
+        }
+        room -= MAX(n, 0);
+    }
+}
+
+/**
+ * Called when a new connection to a server has been opened, starts timing
+ * the handshake with the server
+ *
+ * @param dcb   The backend DCB
+ */
+void
+server_connection_started(DCB *dcb)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    dcb->connectstart = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Called by the backend protocol when a new connection has authenticated
+ * with the server. The time since server_connection_started() is added to
+ * the handshake statistics of the server, which estimate the time that the
+ * persistent pool saves.
+ *
+ * @param dcb   The backend DCB
+ */
+void
+server_connection_authenticated(DCB *dcb)
+{
+    SERVER *server = dcb->server;
+
+    if (server && dcb->connectstart)
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t elapsed = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - dcb->connectstart;
+        dcb->connectstart = 0;
+
+        spinlock_acquire(&server->lock);
+        server->stats.n_handshakes++;
+        server->stats.handshake_time += elapsed;
+        spinlock_release(&server->lock);
+    }
+
+    server_pool_save_standby_auth(dcb);
+}
+
+/**
+ * Allocate the per-thread counters of a server. The counters start from the
+ * current values of the statistics.
+ *
+ * @param server    The server
+ * @return True if the counters were allocated
+ */
+static bool
+server_shards_alloc(SERVER *server)
+{
+    SERVER_SHARDS *shards = &server->shards;
+
+    if ((shards->n_connections = ts_gauge_alloc()) == NULL ||
+        (shards->n_current = ts_gauge_alloc()) == NULL ||
+        (shards->n_current_ops = ts_gauge_alloc()) == NULL)
+    {
+        return false;
+    }
+
+    ts_gauge_add(shards->n_connections, server->stats.n_connections);
+    ts_gauge_add(shards->n_current, server->stats.n_current);
+    ts_gauge_add(shards->n_current_ops, server->stats.n_current_ops);
+    return true;
+}
+
+/**
+ * Free the per-thread counters of a server
+ *
+ * @param server    The server
+ */
+static void
+server_shards_free(SERVER *server)
+{
+    SERVER_SHARDS *shards = &server->shards;
+
+    if (shards->n_connections)
+    {
+        ts_gauge_free(shards->n_connections);
+    }
+    if (shards->n_current)
+    {
+        ts_gauge_free(shards->n_current);
+    }
+    if (shards->n_current_ops)
+    {
+        ts_gauge_free(shards->n_current_ops);
+    }
+    memset(&server->shards, 0, sizeof(server->shards));
+}
 
-static void spin_reporter(void *, char *, int);
-static void server_parameter_free(SERVER_PARAM *tofree);
+/**
+ * Start counting the connections and operations of the servers per thread.
+ * Until this is called, the counters in SERVER_STATS are updated directly
+ * with atomic operations. Must be called after ts_stats_init and before the
+ * polling threads are started.
+ */
+void
+server_stats_init()
+{
+    spinlock_acquire(&server_spin);
+    for (SERVER *server = allServers; server; server = server->next)
+    {
+        if (!server_shards_alloc(server))
+        {
+            MXS_ERROR("Failed to allocate the statistics of server '%s', its "
+                      "counters are shared by all threads.", server->unique_name);
+            server_shards_free(server);
+        }
+    }
+    stats_sharded = true;
+    spinlock_release(&server_spin);
+
+    hktask_add_ms("Server statistics", server_stats_publish_all, NULL,
+                  SERVER_STATS_PUBLISH_INTERVAL);
+}
 
 /**
- * Allocate a new server withn the gateway
+ * Publish the sums of the per-thread counters of a server if they have not
+ * been published in a while
  *
+ * @param server    The server
+ */
+static inline void
+server_stats_update(SERVER *server)
+{
+    if (ts_publish_due(&server->shards.published))
+    {
+        server_publish_stats(server);
+    }
+}
+
+/**
+ * Update the statistics of a server when a new connection has been opened
  *
- * @param servname      The server name
- * @param protocol      The protocol to use to connect to the server
- * @param port          The port to connect to
+ * @param server    The server
+ */
+void
+server_add_connection(SERVER *server)
+{
+    if (server->shards.n_current)
+    {
+        ts_gauge_add(server->shards.n_connections, 1);
+        ts_gauge_add(server->shards.n_current, 1);
+        server_stats_update(server);
+    }
+    else
+    {
+        atomic_add(&server->stats.n_connections, 1);
+        atomic_add(&server->stats.n_current, 1);
+    }
+}
+
+/**
+ * Change the number of current connections of a server
  *
- * @return              The newly created server or NULL if an error occured
+ * @param server    The server
+ * @param delta     The change, negative when connections are closed
  */
-SERVER *
-server_alloc(char *servname, char *protocol, unsigned short port)
+void
+server_add_current(SERVER *server, int delta)
 {
-    SERVER *server;
+    if (server->shards.n_current)
+    {
+        ts_gauge_add(server->shards.n_current, delta);
+        server_stats_update(server);
+    }
+    else
+    {
+        atomic_add(&server->stats.n_current, delta);
+    }
+}
 
-    if ((server = (SERVER *)calloc(1, sizeof(SERVER))) == NULL)
+/**
+ * Change the number of operations that are running on a server. The routers
+ * call this when a query is sent to the server and when its reply is done.
+ *
+ * @param server    The server
+ * @param delta     The change
+ */
+void
+server_add_current_ops(SERVER *server, int delta)
+{
+    if (server->shards.n_current_ops)
     {
-        return NULL;
+        ts_gauge_add(server->shards.n_current_ops, delta);
+        server_stats_update(server);
     }
-#if defined(SS_DEBUG)
-    server->server_chk_top = CHK_NUM_SERVER;
-    server->server_chk_tail = CHK_NUM_SERVER;
-#endif
-    server->name = strndup(servname, MAX_SERVER_NAME_LEN);
-    server->protocol = strdup(protocol);
-    server->port = port;
-    server->status = SERVER_RUNNING;
-    server->node_id = -1;
-    server->rlag = -2;
-    server->master_id = -1;
-    server->depth = -1;
-    server->slaves = NULL;
-    server->parameters = NULL;
-    server->server_string = NULL;
-    spinlock_init(&server->lock);
-    server->persistent = NULL;
-    server->persistmax = 0;
-    server->persistmaxtime = 0;
-    server->persistpoolmax = 0;
-    spinlock_init(&server->persistlock);
+    else
+    {
+        atomic_add(&server->stats.n_current_ops, delta);
+    }
+}
+
+/**
+ * Publish the sums of the per-thread counters of a server to its statistics.
+ * The routers use the published values, which can be a few milliseconds
+ * old, and the diagnostics call this to show exact values.
+ *
+ * @param server    The server
+ */
+void
+server_publish_stats(SERVER *server)
+{
+    SERVER_SHARDS *shards = &server->shards;
 
+    if (shards->n_current && shards->n_connections && shards->n_current_ops)
+    {
+        server->stats.n_connections = ts_gauge_get(shards->n_connections);
+        server->stats.n_current = ts_gauge_get(shards->n_current);
+        server->stats.n_current_ops = ts_gauge_get(shards->n_current_ops);
+    }
+}
+
+/**
+ * Housekeeper task that publishes the counters of all servers. This keeps
+ * the statistics current when the servers see no traffic.
+ *
+ * @param data  Unused
+ */
+static void
+server_stats_publish_all(void *data)
+{
     spinlock_acquire(&server_spin);
-    server->next = allServers;
-    allServers = server;
+    for (SERVER *server = allServers; server; server = server->next)
+    {
+        server_publish_stats(server);
+    }
     spinlock_release(&server_spin);
-
-    return server;
 }
 
+/**
+ * Add the result of compressing or decompressing data on a connection to
+ * the server to the compression statistics of the server.
+ *
+ * @param server        The server
+ * @param written       True if the data was compressed for writing to the
+ *                      server, false if it was read and decompressed
+ * @param compressed    The number of compressed bytes
+ * @param uncompressed  The number of uncompressed bytes
+ * @param usecs         The CPU time it took, in microseconds
+ */
+void
+server_add_compression_stats(SERVER *server, bool written, uint64_t compressed,
+                             uint64_t uncompressed, uint64_t usecs)
+{
+    spinlock_acquire(&server->lock);
+    if (written)
+    {
+        server->stats.compressed_out += compressed;
+        server->stats.uncompressed_out += uncompressed;
+    }
+    else
+    {
+        server->stats.compressed_in += compressed;
+        server->stats.uncompressed_in += uncompressed;
+    }
+    server->stats.compress_time += usecs;
+    spinlock_release(&server->lock);
+}
 
 /**
- * Deallocate the specified server
+ * Set a unique name for the server
  *
- * @param server        The service to deallocate
- * @return Returns true if the server was freed
+ * @param       server  The server to set the name on
+ * @param       name    The unique name for the server
  */
-int
-server_free(SERVER *tofreeserver)
+void
+server_set_unique_name(SERVER *server, char *name)
 {
-    SERVER *server;
+    char *unique_name = strdup(name);
 
-    /* First of all remove from the linked list */
     spinlock_acquire(&server_spin);
-    if (allServers == tofreeserver)
+    server_unindex_name(server);
+    free(server->unique_name);
+    server->unique_name = unique_name;
+    if (unique_name && !hashtable_replace(server_names, unique_name, server))
     {
-        allServers = tofreeserver->next;
+        MXS_ERROR("Failed to index server '%s' by its name, the server "
+                  "cannot be looked up by name.", unique_name);
     }
-    else
+    spinlock_release(&server_spin);
+}
+
+/**
+ * Allocate the indexes of the servers. Called with server_spin held.
+ *
+ * @return True if the indexes exist
+ */
+static bool
+server_index_init()
+{
+    if (server_names == NULL)
     {
-        server = allServers;
-        while (server && server->next != tofreeserver)
-        {
-            server = server->next;
-        }
-        if (server)
+        HASHTABLE *names = hashtable_alloc(SERVER_INDEX_SIZE, simple_str_hash, strcmp);
+        HASHTABLE *addresses = hashtable_alloc(SERVER_INDEX_SIZE, simple_str_hash, strcmp);
+
+        if (names == NULL || addresses == NULL)
         {
-            server->next = tofreeserver->next;
+            hashtable_free(names);
+            hashtable_free(addresses);
+            return false;
         }
+
+        hashtable_memory_fns(names, (HASHMEMORYFN) strdup, NULL, (HASHMEMORYFN) free, NULL);
+        hashtable_memory_fns(addresses, (HASHMEMORYFN) strdup, NULL, (HASHMEMORYFN) free, NULL);
+        hashtable_enable_resize(names);
+        hashtable_enable_resize(addresses);
+        server_addresses = addresses;
+        server_names = names;
     }
-    spinlock_release(&server_spin);
+    return true;
+}
 
-    /* Clean up session and free the memory */
-    free(tofreeserver->name);
-    free(tofreeserver->protocol);
-    free(tofreeserver->unique_name);
-    free(tofreeserver->server_string);
-    free(tofreeserver->slaves);
-    server_parameter_free(tofreeserver->parameters);
+/** The length of the index key of an address and a port */
+#define SERVER_ADDRESS_KEY_LEN(address) (strlen(address) + sizeof(":65535"))
 
-    if (tofreeserver->persistent)
-    {
-        dcb_persistent_clean_count(tofreeserver->persistent, true);
-    }
-    free(tofreeserver);
-    return 1;
+/**
+ * Write the index key of an address and a port
+ *
+ * @param key           Buffer of SERVER_ADDRESS_KEY_LEN(address) bytes
+ * @param address       The address of the server
+ * @param port          The port of the server
+ */
+static void
+server_address_key(char *key, const char *address, unsigned short port)
+{
+    sprintf(key, "%s:%u", address, (unsigned int)port);
 }
 
 /**
- * Get a DCB from the persistent connection pool, if possible
+ * Index a server by its address and port. If several servers have the same
+ * address and port, the one indexed last is found. Called with server_spin held.
  *
- * @param       server      The server to set the name on
- * @param       user        The name of the user needing the connection
- * @param       protocol    The name of the protocol needed for the connection
+ * @param server        The server
+ * @return True if the server was indexed
  */
-DCB *
-server_get_persistent(SERVER *server, char *user, const char *protocol)
+static bool
+server_index_address(SERVER *server)
 {
-    DCB *dcb, *previous = NULL;
+    char key[SERVER_ADDRESS_KEY_LEN(server->name)];
+    server_address_key(key, server->name, server->port);
+    return hashtable_replace(server_addresses, key, server);
+}
 
-    if (server->persistent
-        && dcb_persistent_clean_count(server->persistent, false)
-        && server->persistent
-        && (server->status & SERVER_RUNNING))
+/**
+ * Remove a server from the index of the addresses. Another server with the
+ * same address and port takes its place. Called with server_spin held.
+ *
+ * @param server        The server
+ */
+static void
+server_unindex_address(SERVER *server)
+{
+    char key[SERVER_ADDRESS_KEY_LEN(server->name)];
+    server_address_key(key, server->name, server->port);
+
+    if (hashtable_fetch(server_addresses, key) == server)
     {
-        spinlock_acquire(&server->persistlock);
-        dcb = server->persistent;
-        while (dcb)
+        hashtable_delete(server_addresses, key);
+
+        for (SERVER *ptr = allServers; ptr; ptr = ptr->next)
         {
-            if (dcb->user
-                && dcb->protoname
-                && !dcb-> dcb_errhandle_called
-                && !(dcb->flags & DCBF_HUNG)
-                && 0 == strcmp(dcb->user, user)
-                && 0 == strcmp(dcb->protoname, protocol))
-            {
-                if (NULL == previous)
-                {
-                    server->persistent = dcb->nextpersistent;
-                }
-                else
-                {
-                    previous->nextpersistent = dcb->nextpersistent;
-                }
-                free(dcb->user);
-                dcb->user = NULL;
-                spinlock_release(&server->persistlock);
-                atomic_add(&server->stats.n_persistent, -1);
-                atomic_add(&server->stats.n_current, 1);
-                return dcb;
-            }
-            else
+            if (ptr != server && ptr->port == server->port &&
+                strcmp(ptr->name, server->name) == 0)
             {
-                MXS_DEBUG("%lu [server_get_persistent] Rejected dcb "
-                          "%p from pool, user %s looking for %s, protocol %s "
-                          "looking for %s, hung flag %s, error handle called %s.",
-                          pthread_self(),
-                          dcb,
-                          dcb->user ? dcb->user : "NULL",
-                          user,
-                          dcb->protoname ? dcb->protoname : "NULL",
-                          protocol,
-                          (dcb->flags & DCBF_HUNG) ? "true" : "false",
-                          dcb-> dcb_errhandle_called ? "true" : "false");
+                hashtable_add(server_addresses, key, ptr);
+                break;
             }
-            previous = dcb;
-            dcb = dcb->nextpersistent;
         }
-        spinlock_release(&server->persistlock);
     }
-    return NULL;
 }
 
 /**
- * Set a unique name for the server
+ * Remove a server from the index of the unique names. Another server with
+ * the same name takes its place. Called with server_spin held.
  *
- * @param       server  The server to set the name on
- * @param       name    The unique name for the server
+ * @param server        The server
  */
-void
-server_set_unique_name(SERVER *server, char *name)
+static void
+server_unindex_name(SERVER *server)
 {
-    server->unique_name = strdup(name);
+    if (server->unique_name && hashtable_fetch(server_names, server->unique_name) == server)
+    {
+        hashtable_delete(server_names, server->unique_name);
+
+        for (SERVER *ptr = allServers; ptr; ptr = ptr->next)
+        {
+            if (ptr != server && ptr->unique_name &&
+                strcmp(ptr->unique_name, server->unique_name) == 0)
+            {
+                hashtable_add(server_names, ptr->unique_name, ptr);
+                break;
+            }
+        }
+    }
 }
 
 /**
  * Find an existing server using the unique section name in
  * configuration file
  *
- * @param       servname        The Server name or address
- * @param       port            The server port
+ * @param       name    The unique name of the server
  * @return      The server or NULL if not found
  */
 SERVER *
 server_find_by_unique_name(char *name)
 {
-    SERVER *server;
-
-    spinlock_acquire(&server_spin);
-    server = allServers;
-    while (server)
-    {
-        if (server->unique_name && strcmp(server->unique_name, name) == 0)
-        {
-            break;
-        }
-        server = server->next;
-    }
-    spinlock_release(&server_spin);
-    return server;
+    return hashtable_fetch(server_names, name);
 }
 
 /**
@@ -261,20 +1243,9 @@ server_find_by_unique_name(char *name)
 SERVER *
 server_find(char *servname, unsigned short port)
 {
-    SERVER  *server;
-
-    spinlock_acquire(&server_spin);
-    server = allServers;
-    while (server)
-    {
-        if (strcmp(server->name, servname) == 0 && server->port == port)
-        {
-            break;
-        }
-        server = server->next;
-    }
-    spinlock_release(&server_spin);
-    return server;
+    char key[SERVER_ADDRESS_KEY_LEN(servname)];
+    server_address_key(key, servname, port);
+    return hashtable_fetch(server_addresses, key);
 }
 
 /**
@@ -285,6 +1256,7 @@ server_find(char *servname, unsigned short port)
 void
 printServer(SERVER *server)
 {
+    server_publish_stats(server);
     printf("Server %p\n", server);
     printf("\tServer:                       %s\n", server->name);
     printf("\tProtocol:             %s\n", server->protocol);
@@ -362,6 +1334,7 @@ dprintAllServersJson(DCB *dcb)
     dcb_printf(dcb, "[\n");
     while (server)
     {
+        server_publish_stats(server);
         dcb_printf(dcb, "  {\n  \"server\": \"%s\",\n",
                    server->name);
         stat = server_status(server);
@@ -442,6 +1415,7 @@ dprintAllServersJson(DCB *dcb)
 void
 dprintServer(DCB *dcb, SERVER *server)
 {
+    server_publish_stats(server);
     dcb_printf(dcb, "Server %p (%s)\n", server, server->unique_name);
     dcb_printf(dcb, "\tServer:                              %s\n", server->name);
     char* stat = server_status(server);
@@ -449,6 +1423,21 @@ dprintServer(DCB *dcb, SERVER *server)
     free(stat);
     dcb_printf(dcb, "\tProtocol:                            %s\n", server->protocol);
     dcb_printf(dcb, "\tPort:                                %d\n", server->port);
+    if (server->socket)
+    {
+        dcb_printf(dcb, "\tSocket:                              %s\n", server->socket);
+    }
+    struct in_addr addr;
+    if (server_get_address(server, &addr))
+    {
+        char addrbuf[INET_ADDRSTRLEN];
+        dcb_printf(dcb, "\tResolved address:                    %s\n",
+                   inet_ntop(AF_INET, &addr, addrbuf, sizeof(addrbuf)));
+    }
+    else
+    {
+        dcb_printf(dcb, "\tResolved address:                    not resolved\n");
+    }
     if (server->server_string)
     {
         dcb_printf(dcb, "\tServer Version:                      %s\n", server->server_string);
@@ -480,6 +1469,10 @@ dprintServer(DCB *dcb, SERVER *server)
             dcb_printf(dcb, "\tSlave delay:                         %d\n", server->rlag);
         }
     }
+    if (server->load > 0)
+    {
+        dcb_printf(dcb, "\tLoad score:                          %d\n", server->load);
+    }
     if (server->node_ts > 0)
     {
         struct tm result;
@@ -499,15 +1492,77 @@ dprintServer(DCB *dcb, SERVER *server)
     }
     dcb_printf(dcb, "\tNumber of connections:               %d\n", server->stats.n_connections);
     dcb_printf(dcb, "\tCurrent no. of conns:                %d\n", server->stats.n_current);
+    if (config_tcp_fastopen())
+    {
+        dcb_printf(dcb, "\tTCP Fast Open connections:           %d\n", server->stats.n_fastopen);
+    }
     dcb_printf(dcb, "\tCurrent no. of operations:           %d\n", server->stats.n_current_ops);
     if (server->persistpoolmax)
     {
         dcb_printf(dcb, "\tPersistent pool size:                %d\n", server->stats.n_persistent);
         dcb_printf(dcb, "\tPersistent measured pool size:       %d\n",
-                   dcb_persistent_clean_count(server->persistent, false));
+                   dcb_persistent_clean_count(server, false));
         dcb_printf(dcb, "\tPersistent actual size max:          %d\n", server->persistmax);
         dcb_printf(dcb, "\tPersistent pool size limit:          %ld\n", server->persistpoolmax);
         dcb_printf(dcb, "\tPersistent max time (secs):          %ld\n", server->persistmaxtime);
+        if (server->persistwarm)
+        {
+            dcb_printf(dcb, "\tPersistent warm-up per user:         %ld\n", server->persistwarm);
+        }
+        if (server->persiststandby)
+        {
+            dcb_printf(dcb, "\tPersistent standby per user:         %ld\n", server->persiststandby);
+        }
+
+        int hits = server->stats.n_persist_hits;
+        int lookups = hits + server->stats.n_persist_misses;
+        double handshake = 0;
+
+        spinlock_acquire(&server->lock);
+        if (server->stats.n_handshakes)
+        {
+            handshake = (double)server->stats.handshake_time / server->stats.n_handshakes / 1000;
+        }
+        spinlock_release(&server->lock);
+
+        dcb_printf(dcb, "\tPersistent pool hits:                %d\n", hits);
+        dcb_printf(dcb, "\tPersistent pool misses:              %d\n", lookups - hits);
+        dcb_printf(dcb, "\tPersistent pool user switches:       %d\n",
+                   server->stats.n_persist_switches);
+        dcb_printf(dcb, "\tPersistent pool hit ratio:           %.1f%%\n",
+                   lookups ? 100.0 * hits / lookups : 0.0);
+        dcb_printf(dcb, "\tAverage handshake time (ms):         %.3f\n", handshake);
+        dcb_printf(dcb, "\tHandshake time saved (secs):         %.3f\n", hits * handshake / 1000);
+    }
+    if (server->warmup_time > 0)
+    {
+        dcb_printf(dcb, "\tSlave warm-up time (secs):           %ld\n", server->warmup_time);
+        int weight = server_warmup_weight(server, 1000);
+        if (weight < 1000)
+        {
+            dcb_printf(dcb, "\tWarming up, share of full weight:    %.1f%%\n", weight / 10.0);
+        }
+    }
+    if (server->compression != SERVER_COMPRESSION_NONE)
+    {
+        SERVER_STATS stats;
+
+        spinlock_acquire(&server->lock);
+        stats = server->stats;
+        spinlock_release(&server->lock);
+
+        dcb_printf(dcb, "\tCompression:                         zlib, level %d\n",
+                   server->compression_level);
+        dcb_printf(dcb, "\tCompressed bytes read:               %lu (%lu uncompressed)\n",
+                   stats.compressed_in, stats.uncompressed_in);
+        dcb_printf(dcb, "\tCompressed bytes written:            %lu (%lu uncompressed)\n",
+                   stats.compressed_out, stats.uncompressed_out);
+        dcb_printf(dcb, "\tCompression ratio:                   %.2f\n",
+                   stats.compressed_in + stats.compressed_out ?
+                   (double)(stats.uncompressed_in + stats.uncompressed_out) /
+                   (stats.compressed_in + stats.compressed_out) : 0.0);
+        dcb_printf(dcb, "\tCompression CPU time (secs):         %.3f\n",
+                   (double)stats.compress_time / 1000000);
     }
     if (server->server_ssl)
     {
@@ -523,6 +1578,8 @@ dprintServer(DCB *dcb, SERVER *server)
                    l->ssl_key ? l->ssl_key : "null");
         dcb_printf(dcb, "\tSSL CA certificate:                  %s\n",
                    l->ssl_ca_cert ? l->ssl_ca_cert : "null");
+        dcb_printf(dcb, "\tSSL handshakes:                      %d\n", l->n_handshakes);
+        dcb_printf(dcb, "\tSSL sessions resumed:                %d\n", l->n_resumed);
     }
 }
 
@@ -548,6 +1605,7 @@ spin_reporter(void *dcb, char *desc, int value)
 void
 dprintPersistentDCBs(DCB *pdcb, SERVER *server)
 {
+    SERVER_POOL_USER *pooluser;
     DCB *dcb;
 
     spinlock_acquire(&server->persistlock);
@@ -555,11 +1613,14 @@ dprintPersistentDCBs(DCB *pdcb, SERVER *server)
     dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
     spinlock_stats(&server->persistlock, spin_reporter, pdcb);
 #endif
-    dcb = server->persistent;
-    while (dcb)
+    for (pooluser = server->persistent; pooluser; pooluser = pooluser->next)
     {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->nextpersistent;
+        dcb = pooluser->stack;
+        while (dcb)
+        {
+            dprintOneDCB(pdcb, dcb);
+            dcb = dcb->nextpersistent;
+        }
     }
     spinlock_release(&server->persistlock);
 }
@@ -586,6 +1647,7 @@ dListServers(DCB *dcb)
     }
     while (server)
     {
+        server_publish_stats(server);
         stat = server_status(server);
         dcb_printf(dcb, "%-18s | %-15s | %5d | %11d | %s\n",
                    server->unique_name, server->name,
@@ -895,6 +1957,7 @@ serverRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 1, server->name);
     sprintf(buf, "%d", server->port);
     resultset_row_set(row, 2, buf);
+    server_publish_stats(server);
     sprintf(buf, "%d", server->stats.n_current);
     resultset_row_set(row, 3, buf);
     stat = server_status(server);
@@ -934,6 +1997,69 @@ serverGetList()
     return set;
 }
 
+/** The server statistics exported as metrics */
+static const struct
+{
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t      offset;
+} server_metrics[] =
+{
+    {"maxscale_server_connections", "counter", "Connections created to the server",
+     offsetof(SERVER_STATS, n_connections)},
+    {"maxscale_server_current_connections", "gauge", "Current connections to the server",
+     offsetof(SERVER_STATS, n_current)},
+    {"maxscale_server_current_operations", "gauge", "Current active operations on the server",
+     offsetof(SERVER_STATS, n_current_ops)},
+    {"maxscale_server_persistent_connections", "gauge", "Connections in the persistent pool",
+     offsetof(SERVER_STATS, n_persistent)},
+    {"maxscale_server_persistent_hits", "counter", "Connections taken from the persistent pool",
+     offsetof(SERVER_STATS, n_persist_hits)},
+    {"maxscale_server_persistent_misses", "counter", "Connections opened as the pool had none to give",
+     offsetof(SERVER_STATS, n_persist_misses)},
+    {"maxscale_server_fastopen_connections", "counter", "Connections opened with TCP Fast Open",
+     offsetof(SERVER_STATS, n_fastopen)},
+    {NULL}
+};
+
+/**
+ * Write the metrics of all servers
+ *
+ * @param metrics The metrics being generated
+ */
+void
+serverWriteMetrics(METRICS *metrics)
+{
+    SERVER *server;
+
+    spinlock_acquire(&server_spin);
+
+    metrics_family(metrics, "maxscale_server_up", "gauge", "Whether the server is running");
+    for (server = allServers; server; server = server->next)
+    {
+        metrics_sample(metrics, "maxscale_server_up", NULL);
+        metrics_label(metrics, "server", server->unique_name);
+        metrics_value(metrics, SERVER_IS_RUNNING(server) ? 1 : 0);
+    }
+
+    for (int i = 0; server_metrics[i].name; i++)
+    {
+        bool counter = strcmp(server_metrics[i].type, "counter") == 0;
+
+        metrics_family(metrics, server_metrics[i].name, server_metrics[i].type, server_metrics[i].help);
+        for (server = allServers; server; server = server->next)
+        {
+            int *value = (int*)((char*)&server->stats + server_metrics[i].offset);
+            metrics_sample(metrics, server_metrics[i].name, counter ? "_total" : NULL);
+            metrics_label(metrics, "server", server->unique_name);
+            metrics_value(metrics, *value);
+        }
+    }
+
+    spinlock_release(&server_spin);
+}
+
 /*
  * Update the address value of a specific server
  *
@@ -947,13 +2073,24 @@ server_update_address(SERVER *server, char *address)
     spinlock_acquire(&server_spin);
     if (server && address)
     {
+        server_unindex_address(server);
         if (server->name)
         {
             free(server->name);
         }
         server->name = strdup(address);
+        server_index_address(server);
     }
     spinlock_release(&server_spin);
+
+    if (server && address && !server_set_numeric_address(server))
+    {
+        /** Connections fail until the new name is resolved */
+        spinlock_acquire(&server->lock);
+        server->addr_resolved = false;
+        spinlock_release(&server->lock);
+        hktask_oneshot("Resolve server address", server_address_resolve_task, server, 0);
+    }
 }
 
 /*
@@ -969,9 +2106,204 @@ server_update_port(SERVER *server, unsigned short port)
     spinlock_acquire(&server_spin);
     if (server && port > 0)
     {
+        server_unindex_address(server);
         server->port = port;
+        server_index_address(server);
+    }
+    spinlock_release(&server_spin);
+}
+
+/**
+ * Set the Unix domain socket of a server. The backend connections, the
+ * monitors and the loading of the users connect to the socket instead of
+ * the address and port of the server.
+ *
+ * @param server        The server
+ * @param path          Path to the socket or NULL to use TCP
+ */
+void
+server_set_socket(SERVER *server, const char *path)
+{
+    char *socket = path ? strdup(path) : NULL;
+
+    spinlock_acquire(&server_spin);
+    free(server->socket);
+    server->socket = socket;
+    spinlock_release(&server_spin);
+}
+
+/**
+ * Set the address of a server whose name is a numeric IPv4 address. This
+ * needs no lookup and is done at once.
+ *
+ * @param server    The server
+ * @return True if the name was a numeric address
+ */
+static bool
+server_set_numeric_address(SERVER *server)
+{
+    struct in_addr addr;
+    bool rval = false;
+
+    spinlock_acquire(&server_spin);
+    if (server->name && inet_aton(server->name, &addr))
+    {
+        spinlock_acquire(&server->lock);
+        server->addr = addr;
+        server->addr_resolved = true;
+        spinlock_release(&server->lock);
+        rval = true;
+    }
+    spinlock_release(&server_spin);
+
+    return rval;
+}
+
+/**
+ * Check that a server has not been freed. The caller holds server_spin.
+ *
+ * @param server    The server
+ * @return True if the server is in the list of servers
+ */
+static bool
+server_in_list(SERVER *server)
+{
+    SERVER *ptr = allServers;
+
+    while (ptr && ptr != server)
+    {
+        ptr = ptr->next;
+    }
+
+    return ptr != NULL;
+}
+
+/**
+ * Look up the address of a server and store it for the backend connections.
+ * The lookup may block and must not be done in a polling thread. If it
+ * fails, the previously resolved address is kept.
+ *
+ * @param server    The server
+ * @return True if the address was resolved
+ */
+bool
+server_resolve_address(SERVER *server)
+{
+    struct in_addr addr;
+    char *name;
+    bool rval = false;
+
+    /** A queued lookup may outlive the server, a server behind a socket has no address */
+    spinlock_acquire(&server_spin);
+    name = server_in_list(server) && server->name && server->socket == NULL ?
+           strdup(server->name) : NULL;
+    spinlock_release(&server_spin);
+
+    if (name && setipaddress(&addr, name))
+    {
+        spinlock_acquire(&server_spin);
+        /** Ignore the result if the name changed during the lookup */
+        if (server_in_list(server) && server->name && strcmp(server->name, name) == 0)
+        {
+            spinlock_acquire(&server->lock);
+            server->addr = addr;
+            server->addr_resolved = true;
+            spinlock_release(&server->lock);
+            rval = true;
+        }
+        spinlock_release(&server_spin);
+    }
+    free(name);
+
+    return rval;
+}
+
+/**
+ * Get the resolved address of a server. This never does a lookup.
+ *
+ * @param server    The server
+ * @param addr      Where the address is written
+ * @return True if the address of the server has been resolved
+ */
+bool
+server_get_address(SERVER *server, struct in_addr *addr)
+{
+    bool rval;
+
+    spinlock_acquire(&server->lock);
+    if ((rval = server->addr_resolved))
+    {
+        *addr = server->addr;
+    }
+    spinlock_release(&server->lock);
+
+    return rval;
+}
+
+/**
+ * Housekeeper task that resolves the address of one server
+ *
+ * @param data  The server
+ */
+static void
+server_address_resolve_task(void *data)
+{
+    server_resolve_address((SERVER *)data);
+}
+
+/**
+ * Housekeeper task that resolves the addresses of all servers again, so
+ * that changes in DNS are picked up.
+ *
+ * @param data  Unused
+ */
+static void
+server_address_refresh(void *data)
+{
+    SERVER *server;
+
+    spinlock_acquire(&server_spin);
+    server = allServers;
+    spinlock_release(&server_spin);
+
+    while (server)
+    {
+        if (!server_set_numeric_address(server))
+        {
+            server_resolve_address(server);
+        }
+        spinlock_acquire(&server_spin);
+        server = server->next;
+        spinlock_release(&server_spin);
     }
+}
+
+/**
+ * Housekeeper task that removes the connections the backends have closed
+ * from the persistent pools, so that they do not take the place of usable
+ * connections while they wait to be checked out.
+ *
+ * @param data  Unused
+ */
+static void
+server_pool_prune(void *data)
+{
+    SERVER *server;
+
+    spinlock_acquire(&server_spin);
+    server = allServers;
     spinlock_release(&server_spin);
+
+    while (server)
+    {
+        if (server->persistpoolmax && server->stats.n_persistent > 0)
+        {
+            dcb_persistent_prune(server);
+        }
+        spinlock_acquire(&server_spin);
+        server = server->next;
+        spinlock_release(&server_spin);
+    }
 }
 
 static struct
@@ -1031,3 +2363,257 @@ bool server_set_version_string(SERVER* server, const char* string)
     spinlock_release(&server->lock);
     return rval;
 }
+
+/**
+ * The clock of the replication positions
+ *
+ * @return Milliseconds from an arbitrary point in the past
+ */
+static uint64_t
+repl_pos_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Publish the replication position of a server. Only the monitor of the
+ * server may call this. The rate at which the position advances is a moving
+ * average over the updates, it is not updated when the binary log rotates.
+ *
+ * @param server    The server
+ * @param pos       The binary log position, 0 if it is not known
+ */
+void
+server_set_repl_pos(SERVER *server, uint64_t pos)
+{
+    SERVER_REPL_POS *rp = &server->repl_pos;
+    uint64_t now = repl_pos_clock();
+    double rate = 0;
+
+    if (pos != 0 && rp->pos != 0 && pos >= rp->pos && now > rp->ts)
+    {
+        rate = rp->rate;
+
+        if (SERVER_REPL_POS_FILE(pos) == SERVER_REPL_POS_FILE(rp->pos))
+        {
+            double sample = (double)(pos - rp->pos) * 1000 / (now - rp->ts);
+            rate = rp->rate > 0 ? (rp->rate * 3 + sample) / 4 : sample;
+        }
+    }
+
+    atomic_add(&rp->version, 1);
+    rp->pos = pos;
+    rp->ts = now;
+    rp->rate = rate;
+    atomic_add(&rp->version, 1);
+}
+
+/**
+ * Read the replication position of a server. The position is copied without
+ * locking and the copy is retried if the monitor updated it at the same time.
+ *
+ * @param server    The server
+ * @param pos       Where the position is copied
+ * @return True if the position of the server is known
+ */
+bool
+server_get_repl_pos(SERVER *server, SERVER_REPL_POS *pos)
+{
+    SERVER_REPL_POS *rp = &server->repl_pos;
+    int version;
+
+    do
+    {
+        /** The atomic operations are full memory barriers */
+        version = atomic_add(&rp->version, 0);
+        pos->pos = rp->pos;
+        pos->ts = rp->ts;
+        pos->rate = rp->rate;
+    }
+    while ((version & 1) || atomic_add(&rp->version, 0) != version);
+
+    pos->version = version;
+    return pos->pos != 0;
+}
+
+/**
+ * Estimate the replication lag of a slave at the time of the call. Both the
+ * master and the slave positions are advanced by their rates from the moment
+ * they were read, so a slave that falls behind is noticed between the updates
+ * of the monitor. The lag measured by the monitor is used if the positions
+ * are not known, if the slave replicates from some other server or if the
+ * master and the slave are in different binary log files.
+ *
+ * @param slave     The slave
+ * @param master    The master of the slave or NULL if not known
+ * @return The larger of the estimated and the measured lag in seconds, or the
+ * measured lag if the lag cannot be estimated
+ */
+int
+server_estimate_rlag(SERVER *slave, SERVER *master)
+{
+    SERVER_REPL_POS spos;
+    SERVER_REPL_POS mpos;
+    int rlag = slave->rlag;
+
+    if (master == NULL || slave->master_id != master->node_id ||
+        !server_get_repl_pos(slave, &spos) || !server_get_repl_pos(master, &mpos) ||
+        SERVER_REPL_POS_FILE(spos.pos) != SERVER_REPL_POS_FILE(mpos.pos) ||
+        mpos.rate <= 0)
+    {
+        return rlag;
+    }
+
+    uint64_t now = repl_pos_clock();
+    double mnow = mpos.pos + mpos.rate * (now - mpos.ts) / 1000;
+    double snow = spos.pos + spos.rate * (now - spos.ts) / 1000;
+    int estimate = snow < mnow ? (int)((mnow - snow) / mpos.rate) : 0;
+
+    return estimate > rlag ? estimate : rlag;
+}
+
+/**
+ * Free the replaced states that no reader can refer to any more. The caller
+ * must hold state_lock.
+ */
+static void server_state_reclaim(void)
+{
+    SERVER_STATE **link = &retired_states;
+    SERVER_STATE *state;
+
+    /** The replacements must be visible before the readers are checked */
+    __sync_synchronize();
+    if (state_readers)
+    {
+        return;
+    }
+
+    while ((state = *link) != NULL)
+    {
+        if (rcu_passed(state->epoch))
+        {
+            *link = state->retired;
+            free(state);
+        }
+        else
+        {
+            link = &state->retired;
+        }
+    }
+}
+
+/**
+ * Publish a snapshot of the current state of a server. The monitors call
+ * this once the state of a monitoring cycle is complete, the routers then
+ * see all of it at once.
+ *
+ * @param server The server
+ */
+void
+server_publish_state(SERVER *server)
+{
+    SERVER_STATE *state = malloc(sizeof(SERVER_STATE));
+
+    if (state == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the state of server %s:%d.",
+                  server->name, server->port);
+        return;
+    }
+
+    state->status = server->status;
+    state->node_id = server->node_id;
+    state->master_id = server->master_id;
+    state->depth = server->depth;
+    state->rlag = server->rlag;
+    state->node_ts = server->node_ts;
+    state->load = server->load;
+    state->epoch = 0;
+    state->retired = NULL;
+
+    spinlock_acquire(&state_lock);
+    SERVER_STATE *old = server->state;
+    state->version = old ? old->version + 1 : 1;
+
+    /** The contents must be visible before the pointer */
+    __sync_synchronize();
+    server->state = state;
+
+    if (old)
+    {
+        old->epoch = rcu_retire();
+        old->retired = retired_states;
+        retired_states = old;
+    }
+
+    server_state_reclaim();
+    spinlock_release(&state_lock);
+}
+
+/**
+ * Scale the routing weight of a server that is warming up. A server that has
+ * just become a slave, for example after it was restarted, has cold caches and
+ * answers slowly until they fill up. For warmup_time seconds after the monitor
+ * saw the server become a slave, its weight grows linearly from
+ * SERVER_WARMUP_START thousandths of the full weight to the full weight.
+ *
+ * @param server The server
+ * @param weight The full routing weight of the server
+ * @return The weight to route with, at least 1 if weight is positive
+ */
+int
+server_warmup_weight(const SERVER *server, int weight)
+{
+    long since = server->slave_since;
+    long period = server->warmup_time * 10;
+    long elapsed = hkheartbeat - since;
+
+    if (weight <= 0 || period <= 0 || since < 0 || elapsed >= period ||
+        !SERVER_IS_SLAVE(server))
+    {
+        return weight;
+    }
+
+    long factor = SERVER_WARMUP_START + (1000 - SERVER_WARMUP_START) * elapsed / period;
+    long scaled = (long)weight * factor / 1000;
+
+    return scaled > 0 ? (int)scaled : 1;
+}
+
+/**
+ * Get the latest snapshot of the state of a server. The snapshot must be
+ * released with server_state_release() and not used after that. On a
+ * polling thread it stays valid until the next quiescent point, other
+ * threads keep every replaced snapshot from being freed until they release
+ * theirs, so they must not hold one for long.
+ *
+ * @param server The server
+ * @return The state of the server, NULL if none has been published
+ */
+const SERVER_STATE *
+server_state_acquire(SERVER *server)
+{
+    if (!rcu_is_online())
+    {
+        atomic_add(&state_readers, 1);
+    }
+
+    return *(SERVER_STATE * volatile *)&server->state;
+}
+
+/**
+ * Release a snapshot returned by server_state_acquire()
+ *
+ * @param state The snapshot, may be NULL
+ */
+void
+server_state_release(const SERVER_STATE *state)
+{
+    if (!rcu_is_online())
+    {
+        atomic_add(&state_readers, -1);
+    }
+}
@@ -42,6 +42,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <mysql.h>
 #include <session.h>
 #include <service.h>
 #include <gw_protocol.h>
@@ -66,6 +68,9 @@
 #include <math.h>
 #include <version.h>
 #include <queuemanager.h>
+#include <thread.h>
+#include <atomic.h>
+#include <metrics.h>
 
 /** To be used with configuration type checks */
 typedef struct typelib_st
@@ -90,12 +95,25 @@ typelib_t sqlvar_target_type =
 
 static SPINLOCK service_spin = SPINLOCK_INIT;
 static SERVICE  *allServices = NULL;
+static HASHTABLE *service_names = NULL;   /**< The services by name */
 
 static int find_type(typelib_t* tl, const char* needle, int maxlen);
 
 static void service_add_qualified_param(SERVICE*          svc,
                                         CONFIG_PARAMETER* param);
 static void service_internal_restart(void *data);
+static bool service_shards_alloc(SERVICE *service);
+static void service_shards_free(SERVICE *service);
+static void service_stats_publish_all(void *data);
+static void service_expire_queued(void *data);
+static bool service_index(SERVICE *service);
+static void service_unindex(SERVICE *service);
+
+/** How often the housekeeper publishes the sharded counters, in milliseconds */
+#define SERVICE_STATS_PUBLISH_INTERVAL 100
+
+/** The initial number of chains in the index of the services, it grows as needed */
+#define SERVICE_INDEX_SIZE 32
 
 /**
  * Allocate a new service for the gateway to support
@@ -151,6 +169,11 @@ service_alloc(const char *servname, const char *router)
     service->routerOptions = NULL;
     service->log_auth_warnings = true;
     service->strip_db_esc = true;
+    service->sched_class = poll_sched_class_alloc();
+    service->sched_weight = POLL_SCHED_WEIGHT_DEFAULT;
+    service->client_compression = false;
+    service->client_compression_level = SERVER_COMPRESSION_LEVEL_DEFAULT;
+    service->client_compression_min_len = SERVICE_COMPRESSION_MIN_LEN_DEFAULT;
     if (service->name == NULL || service->routerModule == NULL)
     {
         if (service->name)
@@ -167,6 +190,15 @@ service_alloc(const char *servname, const char *router)
     spinlock_init(&service->users_table_spin);
 
     spinlock_acquire(&service_spin);
+    if (!service_index(service))
+    {
+        spinlock_release(&service_spin);
+        MXS_ERROR("Failed to index service '%s' by its name.", service->name);
+        free(service->name);
+        free(service->routerModule);
+        free(service);
+        return NULL;
+    }
     service->next = allServices;
     allServices = service;
     spinlock_release(&service_spin);
@@ -174,6 +206,71 @@ service_alloc(const char *servname, const char *router)
     return service;
 }
 
+/**
+ * Index a service by its name, allocating the index on first use. If
+ * several services have the same name, the one indexed last is found.
+ * Called with service_spin held.
+ *
+ * @param service The service
+ * @return True if the service was indexed
+ */
+static bool
+service_index(SERVICE *service)
+{
+    if (service_names == NULL)
+    {
+        HASHTABLE *names = hashtable_alloc(SERVICE_INDEX_SIZE, simple_str_hash, strcmp);
+
+        if (names == NULL)
+        {
+            return false;
+        }
+        hashtable_memory_fns(names, (HASHMEMORYFN) strdup, NULL, (HASHMEMORYFN) free, NULL);
+        hashtable_enable_resize(names);
+        service_names = names;
+    }
+    return hashtable_replace(service_names, service->name, service);
+}
+
+/**
+ * Remove a service from the index of the names. Another service with the
+ * same name takes its place. Called with service_spin held.
+ *
+ * @param service The service
+ */
+static void
+service_unindex(SERVICE *service)
+{
+    if (hashtable_fetch(service_names, service->name) == service)
+    {
+        hashtable_delete(service_names, service->name);
+
+        for (SERVICE *ptr = allServices; ptr; ptr = ptr->next)
+        {
+            if (ptr != service && strcmp(ptr->name, service->name) == 0)
+            {
+                hashtable_add(service_names, ptr->name, ptr);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Check whether a service is an administrative one, used to inspect and
+ * control MaxScale rather than to route queries to the servers
+ *
+ * @param service The service
+ * @return True if the router of the service is cli, debugcli or maxinfo
+ */
+bool
+service_is_admin(SERVICE *service)
+{
+    return strcmp(service->routerModule, "cli") == 0 ||
+           strcmp(service->routerModule, "debugcli") == 0 ||
+           strcmp(service->routerModule, "maxinfo") == 0;
+}
+
 /**
  * Check to see if a service pointer is valid
  *
@@ -201,6 +298,99 @@ service_isvalid(SERVICE *service)
     return rval;
 }
 
+/**
+ * Build the path of the file where the users of a service are cached.
+ *
+ * @param service       The service
+ * @param path          Buffer of PATH_MAX + 1 bytes for the path
+ */
+static void
+service_users_cache_path(SERVICE *service, char *path)
+{
+    snprintf(path, PATH_MAX + 1, "%s/%s/.cache/dbusers", get_cachedir(), service->name);
+}
+
+/**
+ * Load the users of a service from the file cache.
+ *
+ * @param service       The service
+ * @return              The number of users loaded or -1 on error
+ */
+static int
+service_load_cached_users(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+
+    service_users_cache_path(service, path);
+    return dbusers_load(service->users, path);
+}
+
+/**
+ * Create a directory unless it already exists.
+ *
+ * @param path          The directory
+ */
+static void
+service_mkdir(const char *path)
+{
+    if (access(path, R_OK) == -1 && mkdir(path, 0777) && errno != EEXIST)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                  path,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * Save the users of a service to the file cache, creating the cache
+ * directory if needed.
+ *
+ * @param service       The service
+ */
+static void
+service_save_cached_users(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+
+    snprintf(path, sizeof(path), "%s/%s", get_cachedir(), service->name);
+    service_mkdir(path);
+    snprintf(path, sizeof(path), "%s/%s/.cache", get_cachedir(), service->name);
+    service_mkdir(path);
+
+    service_users_cache_path(service, path);
+    dbusers_save(service->users, path);
+}
+
+/**
+ * Housekeeper task that loads the users of a service that was started with
+ * the cached users. The task is retried until the users are loaded.
+ *
+ * @param data          The service
+ */
+static void
+service_load_users_task(void *data)
+{
+    SERVICE *service = (SERVICE*)data;
+
+    if (service_refresh_users(service) == 0)
+    {
+        service_save_cached_users(service);
+        MXS_NOTICE("Loaded %d MySQL Users for service [%s].",
+                   service->users->stats.n_entries, service->name);
+    }
+    else
+    {
+        char taskname[strlen(service->name) + sizeof("_load_users")];
+        snprintf(taskname, sizeof(taskname), "%s_load_users", service->name);
+        MXS_WARNING("Failed to load the users of service [%s] from the backends, "
+                    "using the cached users and retrying in %d seconds.",
+                    service->name, USERS_REFRESH_TIME);
+        hktask_oneshot(taskname, service_load_users_task, service, USERS_REFRESH_TIME);
+    }
+}
+
 /**
  * Start an individual port/protocol pair
  *
@@ -229,6 +419,7 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
         MXS_ERROR("Failed to create listener for service %s.", service->name);
         goto retblock;
     }
+    port->listener->service = service;
 
     if (port->ssl)
     {
@@ -239,7 +430,16 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
     {
         int loaded;
 
-        if (service->users == NULL)
+        if (service->users == NULL && port->authenticator &&
+            strcmp(port->authenticator, "NullAuth") == 0)
+        {
+            /** The clients are not authenticated, e.g. when benchmarking
+             * with mock servers that could not be queried for the users */
+            service->users = mysql_users_alloc();
+            MXS_NOTICE("Service [%s] does not authenticate its clients, "
+                       "the users are not loaded.", service->name);
+        }
+        else if (service->users == NULL)
         {
             /*
              * Allocate specific data for MySQL users
@@ -247,7 +447,18 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
              */
             service->users = mysql_users_alloc();
 
-            if ((loaded = load_mysql_users(service)) < 0)
+            if (config_cached_users_at_startup() &&
+                (loaded = service_load_cached_users(service)) > 0)
+            {
+                /** The listener is opened with the cached users, the housekeeper
+                 * loads the users from the backends right after the startup */
+                char taskname[strlen(service->name) + sizeof("_load_users")];
+                snprintf(taskname, sizeof(taskname), "%s_load_users", service->name);
+                hktask_oneshot(taskname, service_load_users_task, service, 0);
+                MXS_NOTICE("Service [%s] starts with cached users, the users are "
+                           "loaded from the backends in the background.", service->name);
+            }
+            else if ((loaded = load_mysql_users(service)) < 0)
             {
                 MXS_ERROR("Unable to load users for "
                           "service %s listening at %s:%d.",
@@ -255,20 +466,13 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
                           (port->address == NULL ? "0.0.0.0" : port->address),
                           port->port);
 
+                /* Try loading authentication data from file cache */
+                loaded = service_load_cached_users(service);
+                if (loaded != -1)
                 {
-                    /* Try loading authentication data from file cache */
-                    char *ptr, path[PATH_MAX + 1];
-                    strncpy(path, get_cachedir(), sizeof(path) - 1);
-                    strncat(path, "/", sizeof(path) - 1);
-                    strncat(path, service->name, sizeof(path) - 1);
-                    strncat(path, "/.cache/dbusers", sizeof(path) - 1);
-                    loaded = dbusers_load(service->users, path);
-                    if (loaded != -1)
-                    {
-                        MXS_ERROR("Using cached credential information.");
-                    }
+                    MXS_ERROR("Using cached credential information.");
                 }
-                if (loaded == -1)
+                else
                 {
                     users_free(service->users);
                     service->users = NULL;
@@ -280,50 +484,9 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
             else
             {
                 /* Save authentication data to file cache */
-                char *ptr, path[PATH_MAX + 1];
-                int mkdir_rval = 0;
-                strncpy(path, get_cachedir(), PATH_MAX);
-                strncat(path, "/", 4096);
-                strncat(path, service->name, PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-
-                strncat(path, "/.cache", PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-                strncat(path, "/dbusers", PATH_MAX);
-                dbusers_save(service->users, path);
+                service_save_cached_users(service);
             }
+
             if (loaded == 0)
             {
                 MXS_ERROR("Service %s: failed to load any user "
@@ -382,6 +545,10 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
         if (port->listener->session != NULL)
         {
             port->listener->session->state = SESSION_STATE_LISTENER;
+            for (DCB *shard = port->listener->shard; shard; shard = shard->shard)
+            {
+                shard->session = port->listener->session;
+            }
             listeners += 1;
         }
         else
@@ -520,6 +687,40 @@ serviceStart(SERVICE *service)
 {
     int listeners = 0;
 
+    if (qtrace_enabled() && service->latency[0] == NULL &&
+        !qtrace_alloc_stats(service->latency))
+    {
+        MXS_ERROR("%s: Failed to allocate the query latency statistics, "
+                  "the queries of the service are not traced.", service->name);
+    }
+
+    if (profile_enabled)
+    {
+        if (service->router_profile.cycles == NULL &&
+            !profile_alloc(&service->router_profile))
+        {
+            MXS_ERROR("%s: Failed to allocate the profile of the router, "
+                      "the router is not profiled.", service->name);
+        }
+
+        for (int i = 0; i < service->n_filters; i++)
+        {
+            if (service->filters[i] && !filter_alloc_profiles(service->filters[i]))
+            {
+                MXS_ERROR("%s: Failed to allocate the profile of filter '%s', "
+                          "the filter is not profiled.", service->name,
+                          service->filters[i]->name);
+            }
+        }
+    }
+
+    if (service->shards.n_current == NULL && !service_shards_alloc(service))
+    {
+        MXS_ERROR("%s: Failed to allocate the session counters, they are "
+                  "shared by all threads.", service->name);
+        service_shards_free(service);
+    }
+
     if (check_service_permissions(service))
     {
         char **router_options = copy_string_array(service->routerOptions);
@@ -569,34 +770,123 @@ serviceStartProtocol(SERVICE *service, char *protocol, int port)
 }
 
 
+/**
+ * The state shared by the threads that start the services
+ */
+typedef struct
+{
+    SPINLOCK lock;      /*< Protects next */
+    SERVICE *next;      /*< The next service to start */
+    int     listeners;  /*< The number of listeners started */
+    bool    error;      /*< Whether a service failed to start */
+} SERVICE_START;
+
+/**
+ * Start services until all of them have been started.
+ *
+ * @param start         The shared SERVICE_START state
+ */
+static void
+service_start_loop(SERVICE_START *start)
+{
+    SERVICE *service;
+
+    for (;;)
+    {
+        spinlock_acquire(&start->lock);
+        if ((service = start->next) && !service->svc_do_shutdown)
+        {
+            start->next = service->next;
+        }
+        else
+        {
+            service = NULL;
+        }
+        spinlock_release(&start->lock);
+
+        if (service == NULL)
+        {
+            break;
+        }
+
+        int listeners = serviceStart(service);
+
+        if (listeners == 0)
+        {
+            MXS_ERROR("Failed to start service '%s'.", service->name);
+            start->error = true;
+        }
+        atomic_add(&start->listeners, listeners);
+    }
+}
+
+/**
+ * Thread that starts services. The services connect to the backends when
+ * they are started, so starting them concurrently hides the latency of the
+ * backends.
+ *
+ * @param data          The shared SERVICE_START state
+ */
+static void
+service_start_thread(void *data)
+{
+    if (mysql_thread_init() == 0)
+    {
+        service_start_loop((SERVICE_START*)data);
+        mysql_thread_end();
+    }
+    else
+    {
+        MXS_ERROR("Could not perform thread initialization for MySQL. Exiting thread.");
+    }
+}
+
 /**
  * Start all the services
  *
+ * The services are started by a pool of start_threads threads. The calling
+ * thread is one of them.
+ *
  * @return Return the number of services started
  */
 int
 serviceStartAll()
 {
-    SERVICE *ptr;
-    int n = 0, i;
-    bool error = false;
+    SERVICE_START start;
+    int n_services = 0;
 
     config_enable_feedback_task();
+    hktask_add_ms("Service statistics", service_stats_publish_all, NULL,
+                  SERVICE_STATS_PUBLISH_INTERVAL);
 
-    ptr = allServices;
-    while (ptr && !ptr->svc_do_shutdown)
+    for (SERVICE *ptr = allServices; ptr; ptr = ptr->next)
     {
-        n += (i = serviceStart(ptr));
+        n_services++;
+    }
 
-        if (i == 0)
-        {
-            MXS_ERROR("Failed to start service '%s'.", ptr->name);
-            error = true;
-        }
+    spinlock_init(&start.lock);
+    start.next = allServices;
+    start.listeners = 0;
+    start.error = false;
 
-        ptr = ptr->next;
+    int n_threads = MIN(config_start_threads(), n_services) - 1;
+    THREAD threads[n_threads > 0 ? n_threads : 1];
+    int started = 0;
+
+    while (started < n_threads && thread_start(&threads[started], service_start_thread, &start))
+    {
+        started++;
+    }
+
+    /** The calling thread has been initialised for MySQL by the caller */
+    service_start_loop(&start);
+
+    for (int i = 0; i < started; i++)
+    {
+        thread_wait(threads[i]);
     }
-    return error ? 0 : n;
+
+    return start.error ? 0 : start.listeners;
 }
 
 /**
@@ -620,6 +910,10 @@ serviceStop(SERVICE *service)
         {
             if (poll_remove_dcb(port->listener) == 0)
             {
+                for (DCB *shard = port->listener->shard; shard; shard = shard->shard)
+                {
+                    poll_remove_dcb(shard);
+                }
                 port->listener->session->state = SESSION_STATE_LISTENER_STOPPED;
                 listeners++;
             }
@@ -652,6 +946,10 @@ serviceRestart(SERVICE *service)
         {
             if (poll_add_dcb(port->listener) == 0)
             {
+                for (DCB *shard = port->listener->shard; shard; shard = shard->shard)
+                {
+                    poll_add_dcb(shard);
+                }
                 port->listener->session->state = SESSION_STATE_LISTENER;
                 listeners++;
             }
@@ -674,6 +972,7 @@ service_free(SERVICE *service)
 {
     SERVICE *ptr;
     SERVER_REF *srv;
+    service_publish_stats(service);
     if (service->stats.n_current)
     {
         return 0;
@@ -696,6 +995,7 @@ service_free(SERVICE *service)
             ptr->next = service->next;
         }
     }
+    service_unindex(service);
     spinlock_release(&service_spin);
 
     /* Clean up session and free the memory */
@@ -717,6 +1017,9 @@ service_free(SERVICE *service)
     users_free(service->users);
     hashtable_free(service->resources);
     serviceClearRouterOptions(service);
+    qtrace_free_stats(service->latency);
+    profile_free(&service->router_profile);
+    service_shards_free(service);
 
     free(service);
     return 1;
@@ -1023,13 +1326,76 @@ serviceSetTimeout(SERVICE *service, int val)
         return 0;
     }
 
-    /** Enable the session timeout checks if and only if at least one service is
-     * configured with a idle timeout. */
-    if ((service->conn_idle_timeout = val))
+    /** The timeouts are added to the timer wheels as the sessions are created */
+    service->conn_idle_timeout = val;
+
+    return 1;
+}
+
+/**
+ * Sets the threshold of the slow queries of the service
+ *
+ * @param service Service to configure
+ * @param val Threshold in milliseconds, 0 to disable the sampling
+ * @return 1 on success, 0 when the value is invalid
+ */
+int
+serviceSetSlowQueryThreshold(SERVICE *service, int val)
+{
+    if (val < 0)
+    {
+        return 0;
+    }
+
+    service->slow_query_threshold = val;
+
+    return 1;
+}
+
+/**
+ * Sets the number of events of the service that the polling threads may
+ * process in a row before they serve the events of the other services
+ *
+ * @param service Service to configure
+ * @param val The weight, from 1 to POLL_SCHED_WEIGHT_MAX
+ * @return 1 on success, 0 when the value is invalid
+ */
+int
+serviceSetSchedulingWeight(SERVICE *service, int val)
+{
+    if (val < 1 || val > POLL_SCHED_WEIGHT_MAX)
+    {
+        return 0;
+    }
+
+    service->sched_weight = val;
+    poll_set_sched_weight(service->sched_class, val);
+
+    return 1;
+}
+
+/**
+ * Sets whether the compressed protocol is offered to the clients of the
+ * service and how the data sent to them is compressed
+ *
+ * @param service Service to configure
+ * @param enable Whether the compressed protocol is offered
+ * @param level The zlib compression level, from 1 to 9
+ * @param min_len The shortest payload that is compressed
+ * @return 1 on success, 0 when the values are invalid
+ */
+int
+serviceSetClientCompression(SERVICE *service, bool enable, int level, int min_len)
+{
+    if (level < 1 || level > 9 || min_len < 0)
     {
-        enable_session_timeouts();
+        return 0;
     }
 
+    service->client_compression = enable;
+    service->client_compression_level = level;
+    service->client_compression_min_len = min_len;
+
     return 1;
 }
 
@@ -1053,13 +1419,61 @@ serviceSetConnectionLimits(SERVICE *service, int max, int queued, int timeout)
     service->max_connections = max;
     if (queued && timeout)
     {
+        if (service->queued_connections)
+        {
+            service->queued_connections->queue_limit = queued;
+            service->queued_connections->timeout = timeout;
+        }
         /* If memory allocation fails, result will be null so no queue */
-        service->queued_connections = mxs_queue_alloc(queued, timeout);
+        else if ((service->queued_connections = mxs_queue_alloc(queued, timeout)))
+        {
+            hktask_add("Connection queue expiry", service_expire_queued, NULL, 1);
+        }
+    }
+    else if (service->queued_connections)
+    {
+        /** Stop queuing, the queued connections are still admitted or expired */
+        service->queued_connections->queue_limit = 0;
     }
 
     return 1;
 }
 
+/**
+ * Close the queued client connections that have waited longer than the
+ * queued_connection_timeout of their service
+ *
+ * @param data Unused
+ */
+static void
+service_expire_queued(void *data)
+{
+    spinlock_acquire(&service_spin);
+
+    for (SERVICE *service = allServices; service; service = service->next)
+    {
+        QUEUE_ENTRY entry;
+
+        while (service->queued_connections &&
+               mxs_dequeue_expired(service->queued_connections, &entry))
+        {
+            DCB *dcb = (DCB *)entry.queued_object;
+
+            MXS_INFO("The connection from %s to service '%s' was queued for longer "
+                     "than %d seconds, closing it.", dcb->remote, service->name,
+                     service->queued_connections->timeout);
+
+            if (dcb->func.connlimit)
+            {
+                dcb->func.connlimit(dcb, service->max_connections);
+            }
+            dcb_close(dcb);
+        }
+    }
+
+    spinlock_release(&service_spin);
+}
+
 /**
  * Enable or disable the restarting of the service on failure.
  * @param service Service to configure
@@ -1154,17 +1568,7 @@ serviceSetFilters(SERVICE *service, char *filters)
 SERVICE *
 service_find(char *servname)
 {
-    SERVICE *service;
-
-    spinlock_acquire(&service_spin);
-    service = allServices;
-    while (service && strcmp(service->name, servname) != 0)
-    {
-        service = service->next;
-    }
-    spinlock_release(&service_spin);
-
-    return service;
+    return hashtable_fetch(service_names, servname);
 }
 
 
@@ -1204,6 +1608,7 @@ printService(SERVICE *service)
         printf("\n");
     }
     printf("\tUsers data:           %p\n", (void *)service->users);
+    service_publish_stats(service);
     printf("\tTotal connections:    %d\n", service->stats.n_sessions);
     printf("\tCurrently connected:  %d\n", service->stats.n_current);
 }
@@ -1263,6 +1668,7 @@ void dprintService(DCB *dcb, SERVICE *service)
     char timebuf[30];
     int i;
 
+    service_publish_stats(service);
     dcb_printf(dcb, "Service %p\n", service);
     dcb_printf(dcb, "\tService:                             %s\n",
                service->name);
@@ -1319,6 +1725,197 @@ void dprintService(DCB *dcb, SERVICE *service)
                service->stats.n_sessions);
     dcb_printf(dcb, "\tCurrently connected:                 %d\n",
                service->stats.n_current);
+    dcb_printf(dcb, "\tMemory held by sessions:             %ld bytes\n",
+               service->stats.mem_used);
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
+    {
+        if (port->ssl)
+        {
+            dcb_printf(dcb, "\tSSL handshakes on port %-5d          %d (%d resumed)\n",
+                       port->port, port->ssl->n_handshakes, port->ssl->n_resumed);
+        }
+    }
+
+    profile_print(dcb, "Router routeQuery:                   ", &service->router_profile);
+
+    if (service->slow_query_threshold)
+    {
+        dcb_printf(dcb, "\tSlow query threshold:                %d ms\n",
+                   service->slow_query_threshold);
+    }
+
+    dcb_printf(dcb, "\tScheduling weight:                   %d%s\n", service->sched_weight,
+               service->sched_class ? "" : " (shared class)");
+    if (service->client_compression)
+    {
+        dcb_printf(dcb, "\tClient compression level:            %d\n",
+                   service->client_compression_level);
+    }
+
+    if (service->latency[0])
+    {
+        dcb_printf(dcb, "\tTraced queries:                      %" PRId64 "\n",
+                   ts_histogram_count(service->latency[QTRACE_TOTAL]));
+        dcb_printf(dcb, "\tQuery latency in microseconds:       p50 / p90 / p99 / p99.9\n");
+
+        for (int i = 0; i < QTRACE_N_STAGES; i++)
+        {
+            dcb_printf(dcb, "\t\t%-10s %" PRId64 " / %" PRId64 " / %" PRId64 " / %" PRId64 "\n",
+                       qtrace_stage_name(i),
+                       ts_histogram_percentile(service->latency[i], 50),
+                       ts_histogram_percentile(service->latency[i], 90),
+                       ts_histogram_percentile(service->latency[i], 99),
+                       ts_histogram_percentile(service->latency[i], 99.9));
+        }
+    }
+}
+
+/**
+ * List the query latency percentiles of the services in a tabular format.
+ *
+ * @param dcb           DCB to print the latencies to.
+ */
+void
+dListServiceLatency(DCB *dcb)
+{
+    SERVICE *service;
+
+    if (!qtrace_enabled())
+    {
+        dcb_printf(dcb, "Query tracing is disabled, set query_trace_sample_rate to enable it.\n");
+        return;
+    }
+
+    dcb_printf(dcb, "Query latency in microseconds, one in %d queries traced.\n", qtrace_rate);
+    dcb_printf(dcb, "--------------------------+----------+------------+----------+----------+----------+----------\n");
+    dcb_printf(dcb, "%-25s | %-8s | %-10s | %-8s | %-8s | %-8s | %-8s\n",
+               "Service Name", "Stage", "Count", "p50", "p90", "p99", "p99.9");
+    dcb_printf(dcb, "--------------------------+----------+------------+----------+----------+----------+----------\n");
+
+    spinlock_acquire(&service_spin);
+    for (service = allServices; service; service = service->next)
+    {
+        for (int i = 0; service->latency[0] && i < QTRACE_N_STAGES; i++)
+        {
+            dcb_printf(dcb, "%-25s | %-8s | %10" PRId64 " | %8" PRId64 " | %8" PRId64
+                       " | %8" PRId64 " | %8" PRId64 "\n",
+                       service->name, qtrace_stage_name(i),
+                       ts_histogram_count(service->latency[i]),
+                       ts_histogram_percentile(service->latency[i], 50),
+                       ts_histogram_percentile(service->latency[i], 90),
+                       ts_histogram_percentile(service->latency[i], 99),
+                       ts_histogram_percentile(service->latency[i], 99.9));
+        }
+    }
+    spinlock_release(&service_spin);
+
+    dcb_printf(dcb, "--------------------------+----------+------------+----------+----------+----------+----------\n\n");
+}
+
+/** The percentiles of the query latency exported as metrics */
+static const struct
+{
+    const char *label;
+    double      percentile;
+} latency_quantiles[] =
+{
+    {"0.5", 50},
+    {"0.9", 90},
+    {"0.99", 99},
+    {"0.999", 99.9}
+};
+
+/**
+ * Write the metrics of all services
+ *
+ * @param metrics The metrics being generated
+ */
+void
+serviceWriteMetrics(METRICS *metrics)
+{
+    SERVICE *service;
+
+    spinlock_acquire(&service_spin);
+
+    metrics_family(metrics, "maxscale_service_sessions", "counter",
+                   "Sessions created on the service");
+    for (service = allServices; service; service = service->next)
+    {
+        service_publish_stats(service);
+        metrics_sample(metrics, "maxscale_service_sessions", "_total");
+        metrics_label(metrics, "service", service->name);
+        metrics_value(metrics, service->stats.n_sessions);
+    }
+
+    metrics_family(metrics, "maxscale_service_current_sessions", "gauge",
+                   "Current sessions of the service");
+    for (service = allServices; service; service = service->next)
+    {
+        metrics_sample(metrics, "maxscale_service_current_sessions", NULL);
+        metrics_label(metrics, "service", service->name);
+        metrics_value(metrics, service->stats.n_current);
+    }
+
+    metrics_family(metrics, "maxscale_service_memory_bytes", "gauge",
+                   "Memory held by the sessions of the service");
+    for (service = allServices; service; service = service->next)
+    {
+        metrics_sample(metrics, "maxscale_service_memory_bytes", NULL);
+        metrics_label(metrics, "service", service->name);
+        metrics_value(metrics, service->stats.mem_used);
+    }
+
+    if (qtrace_enabled())
+    {
+        const char *name = "maxscale_service_query_latency_microseconds";
+        int n_quantiles = sizeof(latency_quantiles) / sizeof(latency_quantiles[0]);
+
+        metrics_family(metrics, name, "summary", "Latency of the traced queries at each stage");
+        for (service = allServices; service; service = service->next)
+        {
+            for (int i = 0; service->latency[0] && i < QTRACE_N_STAGES; i++)
+            {
+                for (int j = 0; j < n_quantiles; j++)
+                {
+                    metrics_sample(metrics, name, NULL);
+                    metrics_label(metrics, "service", service->name);
+                    metrics_label(metrics, "stage", qtrace_stage_name(i));
+                    metrics_label(metrics, "quantile", latency_quantiles[j].label);
+                    metrics_value(metrics, ts_histogram_percentile(service->latency[i],
+                                                                   latency_quantiles[j].percentile));
+                }
+
+                metrics_sample(metrics, name, "_count");
+                metrics_label(metrics, "service", service->name);
+                metrics_label(metrics, "stage", qtrace_stage_name(i));
+                metrics_value(metrics, ts_histogram_count(service->latency[i]));
+            }
+        }
+    }
+
+    if (profile_enabled)
+    {
+        metrics_family(metrics, "maxscale_service_router_cycles", "counter",
+                       "CPU cycles spent in routeQuery of the router");
+        for (service = allServices; service; service = service->next)
+        {
+            PROFILE *profile = &service->router_profile;
+            metrics_sample(metrics, "maxscale_service_router_cycles", "_total");
+            metrics_label(metrics, "service", service->name);
+            metrics_value(metrics, profile->cycles ? ts_stats_sum(profile->cycles) : 0);
+        }
+
+        metrics_family(metrics, "maxscale_service_router_calls", "counter",
+                       "Queries routed by the router");
+        for (service = allServices; service; service = service->next)
+        {
+            metrics_sample(metrics, "maxscale_service_router_calls", "_total");
+            metrics_label(metrics, "service", service->name);
+            metrics_value(metrics, profile_calls(&service->router_profile));
+        }
+    }
+
+    spinlock_release(&service_spin);
 }
 
 /**
@@ -1343,6 +1940,7 @@ dListServices(DCB *dcb)
     }
     while (service)
     {
+        service_publish_stats(service);
         ss_dassert(service->stats.n_current >= 0);
         dcb_printf(dcb, "%-25s | %-20s | %6d | %5d\n",
                    service->name, service->routerModule,
@@ -1445,7 +2043,7 @@ service_update(SERVICE *service, char *router, char *user, char *auth)
 
 /**
  * Refresh the database users for the service
- * This function replaces the MySQL users used by the service with the latest
+ * This function updates the MySQL users used by the service with the latest
  * version found on the backend servers. There is a limit on how often the users
  * can be reloaded and if this limit is exceeded, the reload will fail.
  * @param service Service to reload
@@ -1484,7 +2082,7 @@ int service_refresh_users(SERVICE *service)
         service->rate_limit.last = time(NULL);
     }
 
-    ret = replace_mysql_users(service);
+    ret = update_mysql_users(service);
 
     /* remove lock */
     spinlock_release(&service->users_table_spin);
@@ -1499,6 +2097,47 @@ int service_refresh_users(SERVICE *service)
     }
 }
 
+/**
+ * Housekeeper task that reloads the users of a service
+ * @param data The service
+ */
+static void service_refresh_users_task(void *data)
+{
+    SERVICE *service = (SERVICE*)data;
+
+    service_refresh_users(service);
+    atomic_add(&service->rate_limit.pending, -1);
+}
+
+/**
+ * Queue a reload of the database users for the service
+ *
+ * The reload is done by the housekeeper so the caller does not wait for the
+ * backend queries. Only one reload is queued at a time. If the rate limit of
+ * service_refresh_users() does not allow a reload now, it is done as soon as
+ * the limit allows it.
+ * @param service Service to reload
+ */
+void service_refresh_users_async(SERVICE *service)
+{
+    if (atomic_add(&service->rate_limit.pending, 1) != 0)
+    {
+        /** A reload is already queued */
+        atomic_add(&service->rate_limit.pending, -1);
+        return;
+    }
+
+    time_t now = time(NULL);
+    time_t allowed = service->rate_limit.last + USERS_REFRESH_TIME;
+    int delay = now < allowed ? allowed - now : 0;
+
+    if (hktask_oneshot("Reload users", service_refresh_users_task, service, delay) == 0)
+    {
+        MXS_ERROR("%s: Failed to queue a reload of the users' table.", service->name);
+        atomic_add(&service->rate_limit.pending, -1);
+    }
+}
+
 bool service_set_param_value(SERVICE*            service,
                              CONFIG_PARAMETER*   param,
                              char*               valstr,
@@ -1815,6 +2454,7 @@ serviceSessionCountAll()
     service = allServices;
     while (service)
     {
+        service_publish_stats(service);
         rval += service->stats.n_current;
         service = service->next;
     }
@@ -1822,6 +2462,161 @@ serviceSessionCountAll()
     return rval;
 }
 
+/**
+ * Allocate the per-thread session counters of a service. The counters start
+ * from the current values of the statistics.
+ *
+ * @param service   The service
+ * @return True if the counters were allocated
+ */
+static bool
+service_shards_alloc(SERVICE *service)
+{
+    SERVICE_SHARDS *shards = &service->shards;
+
+    if ((shards->n_sessions = ts_gauge_alloc()) == NULL ||
+        (shards->n_current = ts_gauge_alloc()) == NULL ||
+        (shards->mem_used = ts_gauge_alloc()) == NULL)
+    {
+        return false;
+    }
+
+    ts_gauge_add(shards->n_sessions, service->stats.n_sessions);
+    ts_gauge_add(shards->n_current, service->stats.n_current);
+    ts_gauge_add(shards->mem_used, service->stats.mem_used);
+    return true;
+}
+
+/**
+ * Free the per-thread session counters of a service
+ *
+ * @param service   The service
+ */
+static void
+service_shards_free(SERVICE *service)
+{
+    SERVICE_SHARDS *shards = &service->shards;
+
+    if (shards->n_sessions)
+    {
+        ts_gauge_free(shards->n_sessions);
+    }
+    if (shards->n_current)
+    {
+        ts_gauge_free(shards->n_current);
+    }
+    if (shards->mem_used)
+    {
+        ts_gauge_free(shards->mem_used);
+    }
+    memset(shards, 0, sizeof(*shards));
+}
+
+/**
+ * Update the statistics of a service when a new session is created. Until
+ * the service is started the counters are updated with atomic operations.
+ *
+ * @param service   The service
+ */
+void
+service_add_session(SERVICE *service)
+{
+    if (service->shards.n_current)
+    {
+        ts_gauge_add(service->shards.n_sessions, 1);
+        ts_gauge_add(service->shards.n_current, 1);
+
+        if (ts_publish_due(&service->shards.published))
+        {
+            service_publish_stats(service);
+        }
+    }
+    else
+    {
+        atomic_add(&service->stats.n_sessions, 1);
+        atomic_add(&service->stats.n_current, 1);
+    }
+}
+
+/**
+ * Update the statistics of a service when a session is closed
+ *
+ * @param service   The service
+ */
+void
+service_remove_session(SERVICE *service)
+{
+    if (service->shards.n_current)
+    {
+        ts_gauge_add(service->shards.n_current, -1);
+
+        if (ts_publish_due(&service->shards.published))
+        {
+            service_publish_stats(service);
+        }
+    }
+    else
+    {
+        atomic_add(&service->stats.n_current, -1);
+    }
+}
+
+/**
+ * Change the bytes of memory held by the sessions of a service. The sessions
+ * call this when the buffers, session command history or filter state they
+ * hold grow or shrink.
+ *
+ * @param service   The service
+ * @param delta     Bytes taken by a session, negative if bytes were released
+ */
+void
+service_mem_add(SERVICE *service, int64_t delta)
+{
+    if (service->shards.mem_used)
+    {
+        ts_gauge_add(service->shards.mem_used, delta);
+    }
+    else
+    {
+        __atomic_add_fetch(&service->stats.mem_used, delta, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Publish the sums of the per-thread session counters of a service to its
+ * statistics. The diagnostics call this to show exact values.
+ *
+ * @param service   The service
+ */
+void
+service_publish_stats(SERVICE *service)
+{
+    SERVICE_SHARDS *shards = &service->shards;
+
+    if (shards->n_sessions && shards->n_current && shards->mem_used)
+    {
+        service->stats.n_sessions = ts_gauge_get(shards->n_sessions);
+        service->stats.n_current = ts_gauge_get(shards->n_current);
+        service->stats.mem_used = ts_gauge_get(shards->mem_used);
+    }
+}
+
+/**
+ * Housekeeper task that publishes the session counters of all services
+ *
+ * @param data  Unused
+ */
+static void
+service_stats_publish_all(void *data)
+{
+    spinlock_acquire(&service_spin);
+    for (SERVICE *service = allServices; service; service = service->next)
+    {
+        service_publish_stats(service);
+    }
+    spinlock_release(&service_spin);
+}
+
 /**
  * Provide a row to the result set that defines the set of service
  * listeners
@@ -1949,6 +2744,7 @@ serviceRowCallback(RESULTSET *set, void *data)
     row = resultset_make_row(set);
     resultset_row_set(row, 0, service->name);
     resultset_row_set(row, 1, service->routerModule);
+    service_publish_stats(service);
     sprintf(buf, "%d", service->stats.n_current);
     resultset_row_set(row, 2, buf);
     sprintf(buf, "%d", service->stats.n_sessions);
@@ -1957,6 +2753,94 @@ serviceRowCallback(RESULTSET *set, void *data)
     return row;
 }
 
+/**
+ * Provide a row to the result set of the query latencies, one row for each
+ * stage of each service whose queries are traced
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+serviceLatencyRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int i = 0;
+    char buf[32];
+    RESULT_ROW *row;
+    SERVICE *service;
+
+    spinlock_acquire(&service_spin);
+    for (service = allServices; service; service = service->next)
+    {
+        if (service->latency[0])
+        {
+            if (*rowno < i + QTRACE_N_STAGES)
+            {
+                break;
+            }
+            i += QTRACE_N_STAGES;
+        }
+    }
+    if (service == NULL)
+    {
+        spinlock_release(&service_spin);
+        free(data);
+        return NULL;
+    }
+
+    int stage = *rowno - i;
+    double percentiles[] = {50, 90, 99, 99.9};
+    (*rowno)++;
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, service->name);
+    resultset_row_set(row, 1, (char*)qtrace_stage_name(stage));
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_histogram_count(service->latency[stage]));
+    resultset_row_set(row, 2, buf);
+
+    for (int j = 0; j < 4; j++)
+    {
+        snprintf(buf, sizeof(buf), "%" PRId64,
+                 ts_histogram_percentile(service->latency[stage], percentiles[j]));
+        resultset_row_set(row, 3 + j, buf);
+    }
+    spinlock_release(&service_spin);
+    return row;
+}
+
+/**
+ * Return a result set with the query latency percentiles of the services,
+ * in microseconds
+ *
+ * @return A Result set
+ */
+RESULTSET *
+serviceLatencyGetList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(serviceLatencyRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service Name", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Stage", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Count", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p50", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p90", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p99", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p99.9", 20, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
 /**
  * Return a result set that has the current set of services in it
  *
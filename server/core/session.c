@@ -28,6 +28,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -40,31 +41,88 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <housekeeper.h>
-
-/** Global session id; updated safely by holding session_spin */
+#include <maxscale/poll.h>
+#include <profile.h>
+#include <memlog.h>
+#include <rcu.h>
+#include <platform.h>
+#include <mysql_wire.h>
+#include <pthread.h>
+
+/** Global session id; updated atomically */
 static size_t session_id;
 
+/** Protects the end of the list of all sessions and the global free list */
 static SPINLOCK session_spin = SPINLOCK_INIT;
 static SESSION *allSessions = NULL;
 static SESSION *lastSession = NULL;
-static SESSION *wasfreeSession = NULL;
-static int freeSessionCount = 0;
 
-static struct session session_dummy_struct;
+/** Maximum number of free sessions a thread keeps for itself */
+#define SESSION_CACHE_MAX 64
+/** Number of free sessions moved at a time between a thread and the global list */
+#define SESSION_CACHE_BATCH (SESSION_CACHE_MAX / 2)
 
 /**
- * These two are declared in session.h
+ * A list of free sessions, oldest first. A free session is tagged with the
+ * RCU epoch of its release and it is reused only after the polling threads
+ * that may still be listing it have moved on.
  */
-bool check_timeouts = false;
-long next_timeout_check = 0;
+typedef struct
+{
+    SESSION *first;  /*< The session freed first, linked by nextfree */
+    SESSION *last;   /*< The session freed last */
+    int count;       /*< Number of sessions in the list */
+} SESSION_LIST;
+
+/** The free sessions of the calling thread */
+static thread_local SESSION_LIST session_cache = { NULL, NULL, 0 };
+/** Free sessions not cached by any thread, protected by session_spin */
+static SESSION_LIST freeSessions = { NULL, NULL, 0 };
+static pthread_key_t session_cache_key;
+static pthread_once_t session_cache_key_once = PTHREAD_ONCE_INIT;
+
+/** Size of the standard blocks of the session arenas */
+#define SESSION_ARENA_BLOCK_SIZE 4096
+/** Allocations larger than this get a block of their own */
+#define SESSION_ARENA_LARGE (SESSION_ARENA_BLOCK_SIZE / 4)
+/** Maximum number of free arena blocks a thread keeps */
+#define SESSION_ARENA_CACHE_MAX 64
+
+/** Free standard arena blocks of the calling thread, linked by next */
+static thread_local SESSION_ARENA_BLOCK *arena_cache = NULL;
+static thread_local int arena_cache_count = 0;
+static pthread_key_t arena_cache_key;
+
+bool session_watch_queries = false;
 
-static SPINLOCK timeout_lock = SPINLOCK_INIT;
+static struct session session_dummy_struct;
 
 static int session_setup_filters(SESSION *session);
 static void session_simple_free(SESSION *session, DCB *dcb);
 static void session_add_to_all_list(SESSION *session);
 static SESSION *session_find_free();
 static void session_final_free(SESSION *session);
+static void session_mem_flush(SESSION *session);
+static void session_cache_key_init();
+static void session_idle_timeout(WHEEL_TIMER *timer);
+static int session_route_to_router(void *instance, void *session, GWBUF *data);
+static int session_profile_route(void *instance, void *session, GWBUF *data);
+static int session_profile_reply(void *instance, void *session, GWBUF *data);
+static int session_create_filter(SESSION *session, int i);
+static int session_link_filters(SESSION *session);
+static int session_reply_select(void *instance, void *session, GWBUF *data);
+
+/**
+ * Change the state of a session and note the change in the flight recorder
+ *
+ * @param session   The session
+ * @param state     The new state
+ */
+static inline void session_set_state(SESSION *session, session_state_t state)
+{
+    memlog_ring_log(MLR_SESSION_STATE, session, session->state, state);
+    session->state = state;
+}
 
 /**
  * Allocate a new session for a new client of the specified service.
@@ -82,9 +140,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 {
     SESSION *session;
 
-    spinlock_acquire(&session_spin);
     session = session_find_free();
-    spinlock_release(&session_spin);
     ss_info_dassert(session != NULL, "Allocating memory for session failed.");
 
     if (session == NULL)
@@ -102,10 +158,14 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 #endif
     session->ses_is_child = (bool) DCB_IS_CLONE(client_dcb);
     spinlock_init(&session->ses_lock);
+    spinlock_init(&session->arena_lock);
     session->service = service;
     session->client_dcb = client_dcb;
     session->n_filters = 0;
+    /** The client is authenticated once it has a session */
+    dcb_handshake_done(client_dcb);
     memset(&session->stats, 0, sizeof(SESSION_STATS));
+    memset(&session->trace, 0, sizeof(QUERY_TRACE));
     session->stats.connect = time(0);
     session->state = SESSION_STATE_ALLOC;
     /*<
@@ -120,7 +180,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
      * This indicates that session is ready to be shared with backend
      * DCBs. Note that this doesn't mean that router is initialized yet!
      */
-    session->state = SESSION_STATE_READY;
+    session_set_state(session, SESSION_STATE_READY);
 
     /*
      * Only create a router session if we are not the listening
@@ -138,7 +198,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
         session->router_session = service->router->newSession(service->router_instance, session);
         if (session->router_session == NULL)
         {
-            session->state = SESSION_STATE_TO_BE_FREED;
+            session_set_state(session, SESSION_STATE_TO_BE_FREED);
             MXS_ERROR("Failed to create new router session for service '%s'. "
                       "See previous errors for more details.", service->name);
         }
@@ -156,6 +216,15 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 
         session->head.routeQuery = (void *)(service->router->routeQuery);
 
+        if ((qtrace_enabled() && service->n_filters > 0) || profile_enabled)
+        {
+            /** Notes when a traced query has passed the filters and
+             * times the router */
+            session->head.instance = (void *)session;
+            session->head.session = (void *)session;
+            session->head.routeQuery = session_route_to_router;
+        }
+
         session->tail.instance = session;
         session->tail.session = session;
         session->tail.clientReply = session_reply;
@@ -164,7 +233,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
             && service->n_filters > 0
             && !session_setup_filters(session))
         {
-            session->state = SESSION_STATE_TO_BE_FREED;
+            session_set_state(session, SESSION_STATE_TO_BE_FREED);
             MXS_ERROR("Setting up filters failed. "
                       "Terminating session %s.",
                       service->name);
@@ -173,7 +242,16 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 
     if (SESSION_STATE_TO_BE_FREED != session->state)
     {
-        session->state = SESSION_STATE_ROUTER_READY;
+        session_set_state(session, SESSION_STATE_ROUTER_READY);
+
+        if (service->conn_idle_timeout > 0 &&
+            client_dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER &&
+            client_dcb->state != DCB_STATE_LISTENING)
+        {
+            timerwheel_add(&client_dcb->timer, client_dcb->owner,
+                           hkheartbeat + service->conn_idle_timeout * 10 + 1,
+                           session_idle_timeout);
+        }
 
         if (session->client_dcb->user == NULL)
         {
@@ -199,12 +277,9 @@ session_alloc(SERVICE *service, DCB *client_dcb)
                  session->client_dcb->user,
                  session->client_dcb->remote);
     }
-    spinlock_acquire(&session_spin);
-    /** Assign a session id and increase, insert session into list */
-    session->ses_id = ++session_id;
-    spinlock_release(&session_spin);
-    atomic_add(&service->stats.n_sessions, 1);
-    atomic_add(&service->stats.n_current, 1);
+    /** Assign a session id and increase */
+    session->ses_id = __sync_add_and_fetch(&session_id, 1);
+    service_add_session(service);
     CHK_SESSION(session);
 
     client_dcb->session = session;
@@ -217,10 +292,8 @@ session_alloc(SERVICE *service, DCB *client_dcb)
  * Must be called with the general session lock held.
  *
  * A pointer, lastSession, is held to find the end of the list, and the new session
- * is linked to the end of the list.  The pointer, wasfreeSession, that is used to
- * search for a free session is initialised if not already set. There cannot be
- * any free sessions (or any at all) until this routine has been called at least
- * once. Hence it will not be referred to until after it is initialised.
+ * is linked to the end of the list. Sessions are never removed from the list, so
+ * it can be read without the lock.
  *
  * @param session       The session to be added to the list
  */
@@ -229,74 +302,236 @@ session_add_to_all_list(SESSION *session)
 {
     if (allSessions == NULL)
     {
-        allSessions = session;
+        __atomic_store_n(&allSessions, session, __ATOMIC_RELEASE);
     }
     else
     {
-        lastSession->next = session;
+        __atomic_store_n(&lastSession->next, session, __ATOMIC_RELEASE);
     }
     lastSession = session;
-    if (NULL == wasfreeSession)
+}
+
+/**
+ * Return the first session in the list of all sessions
+ *
+ * The list can be followed with the next pointers without locking. A session
+ * whose ses_is_in_use is false is free.
+ *
+ * @return The first session or NULL if there are none
+ */
+static inline SESSION *
+session_list_first()
+{
+    return __atomic_load_n(&allSessions, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Add a free session to the end of a list
+ *
+ * @param list    The list
+ * @param session The session
+ */
+static void
+session_list_put(SESSION_LIST *list, SESSION *session)
+{
+    session->nextfree = NULL;
+
+    if (list->last)
+    {
+        list->last->nextfree = session;
+    }
+    else
     {
-        wasfreeSession = session;
+        list->first = session;
     }
+    list->last = session;
+    list->count++;
 }
 
 /**
- * Find a free session or allocate memory for a new one.
+ * Take the oldest session from a list if it can be reused
  *
- * This routine looks to see whether there are free session memory areas.
- * If not, new memory is allocated, if possible, and the new session is added to
- * the list of all sessions.
+ * @param list The list
+ * @return A session or NULL if the list has no session that can be reused
+ */
+static SESSION *
+session_list_take(SESSION_LIST *list)
+{
+    SESSION *session = list->first;
+
+    if (session && rcu_passed(session->epoch))
+    {
+        if ((list->first = session->nextfree) == NULL)
+        {
+            list->last = NULL;
+        }
+        list->count--;
+        return session;
+    }
+
+    return NULL;
+}
+
+/**
+ * Return the free sessions of an exiting thread to the global free list.
  *
- * Must be called with the general session lock held.
+ * @param data The cache of the thread
+ */
+static void
+session_cache_flush(void *data)
+{
+    SESSION_LIST *cache = (SESSION_LIST *)data;
+
+    spinlock_acquire(&session_spin);
+    while (cache->first)
+    {
+        SESSION *session = cache->first;
+        cache->first = session->nextfree;
+        session_list_put(&freeSessions, session);
+    }
+    cache->last = NULL;
+    cache->count = 0;
+    spinlock_release(&session_spin);
+}
+
+/**
+ * Free the arena blocks cached by an exiting thread.
+ *
+ * @param data The first cached block
+ */
+static void
+session_arena_cache_flush(void *data)
+{
+    SESSION_ARENA_BLOCK *block = (SESSION_ARENA_BLOCK *)data;
+
+    while (block)
+    {
+        SESSION_ARENA_BLOCK *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_cache = NULL;
+    arena_cache_count = 0;
+}
+
+/**
+ * Take back the memory of a session that is reused. The first standard
+ * block stays with the session, the other standard blocks are cached by
+ * the calling thread and the large blocks are freed.
+ *
+ * @param session The session
+ */
+static void
+session_arena_reset(SESSION *session)
+{
+    SESSION_ARENA_BLOCK *block = session->arena;
+    SESSION_ARENA_BLOCK *kept = NULL;
+
+    while (block)
+    {
+        SESSION_ARENA_BLOCK *next = block->next;
+
+        if (block->size != SESSION_ARENA_BLOCK_SIZE)
+        {
+            free(block);
+        }
+        else if (kept == NULL)
+        {
+            kept = block;
+        }
+        else if (arena_cache_count < SESSION_ARENA_CACHE_MAX)
+        {
+            if (arena_cache == NULL)
+            {
+                pthread_once(&session_cache_key_once, session_cache_key_init);
+            }
+            block->next = arena_cache;
+            arena_cache = block;
+            arena_cache_count++;
+            pthread_setspecific(arena_cache_key, arena_cache);
+        }
+        else
+        {
+            free(block);
+        }
+        block = next;
+    }
+
+    if (kept)
+    {
+        kept->next = NULL;
+        kept->used = 0;
+    }
+    session->arena = kept;
+}
+
+/**
+ * Create the key used to flush the caches of exiting threads.
+ */
+static void
+session_cache_key_init()
+{
+    pthread_key_create(&session_cache_key, session_cache_flush);
+    pthread_key_create(&arena_cache_key, session_arena_cache_flush);
+}
+
+/**
+ * Find a free session or allocate memory for a new one.
+ *
+ * A free session is taken from the cache of the calling thread, which is
+ * refilled from the global free list when it has nothing to reuse. If there
+ * are no free sessions, new memory is allocated, if possible, and the new
+ * session is added to the list of all sessions.
  *
  * @return An available session or NULL if none could be allocated.
  */
 static SESSION *
 session_find_free()
 {
-    SESSION *nextsession;
+    SESSION *session = session_list_take(&session_cache);
 
-    if (freeSessionCount <= 0)
+    /** Dirty read, a session freed just now will be found the next time */
+    if (session == NULL && freeSessions.count > 0)
     {
-        SESSION *newsession;
-        if ((newsession = calloc(1, sizeof(SESSION))) == NULL)
+        spinlock_acquire(&session_spin);
+        session = session_list_take(&freeSessions);
+
+        SESSION *moved;
+        while (session_cache.count < SESSION_CACHE_BATCH &&
+               (moved = session_list_take(&freeSessions)) != NULL)
         {
-            return NULL;
+            session_list_put(&session_cache, moved);
         }
-        newsession->next = NULL;
-        session_add_to_all_list(newsession);
-        newsession->ses_is_in_use = true;
-        return newsession;
-    }
-    /* Starting at the last place a free session was found, loop through the */
-    /* list of sessions searching for one that is not in use. */
-    while (wasfreeSession->ses_is_in_use)
-    {
-        int loopcount = 0;
-        wasfreeSession = wasfreeSession->next;
-        if (NULL == wasfreeSession)
+        spinlock_release(&session_spin);
+    }
+
+    if (session)
+    {
+        session_arena_reset(session);
+        SESSION_ARENA_BLOCK *arena = session->arena;
+
+        /*
+         * Clear the old data. The list forward link is left alone as the
+         * diagnostic routines may be following it at the same time.
+         */
+        memset(session, 0, offsetof(SESSION, next));
+        memset((char *)session + offsetof(SESSION, next) + sizeof(session->next), 0,
+               sizeof(SESSION) - offsetof(SESSION, next) - sizeof(session->next));
+        session->arena = arena;
+    }
+    else
+    {
+        if ((session = calloc(1, sizeof(SESSION))) == NULL)
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free session failed to find a session even"
-                          " though free count was positive");
-                return NULL;
-            }
-            wasfreeSession = allSessions;
+            return NULL;
         }
+        spinlock_acquire(&session_spin);
+        session_add_to_all_list(session);
+        spinlock_release(&session_spin);
     }
-    /* Dropping out of the loop means we have found a session that is not in use */
-    freeSessionCount--;
-    /* Clear the old data, then reset the list forward link */
-    nextsession = wasfreeSession->next;
-    memset(wasfreeSession, 0, sizeof(SESSION));
-    wasfreeSession->next = nextsession;
-    wasfreeSession->ses_is_in_use = true;
-    return wasfreeSession;
+    session->ses_is_in_use = true;
+    allocprof_alloc(&session->sample, ALLOCPROF_SESSION, sizeof(SESSION));
+    return session;
 }
 
 /**
@@ -364,6 +599,144 @@ void session_disable_log_priority(SESSION* session, int priority)
     }
 }
 
+/**
+ * Allocate memory that lives as long as a session. The memory is zeroed and
+ * it must not be freed, it is taken back when the session is reused.
+ *
+ * @param session   The session
+ * @param size      Number of bytes
+ * @return          The memory or NULL if out of memory
+ */
+void *
+session_arena_alloc(SESSION *session, size_t size)
+{
+    SESSION_ARENA_BLOCK *block;
+    void *rval = NULL;
+
+    /** Keep the memory aligned for any type */
+    size = (size + 15) & ~(size_t)15;
+
+    spinlock_acquire(&session->arena_lock);
+
+    block = session->arena;
+
+    if (block && block->size - block->used >= size)
+    {
+        rval = block->data + block->used;
+        block->used += size;
+    }
+    else if (size > SESSION_ARENA_LARGE)
+    {
+        if ((block = malloc(sizeof(SESSION_ARENA_BLOCK) + size)))
+        {
+            block->size = size;
+            block->used = size;
+            rval = block->data;
+
+            /** The current block may still have room for small allocations */
+            if (session->arena)
+            {
+                block->next = session->arena->next;
+                session->arena->next = block;
+            }
+            else
+            {
+                block->next = NULL;
+                session->arena = block;
+            }
+        }
+    }
+    else
+    {
+        if ((block = arena_cache))
+        {
+            arena_cache = block->next;
+            arena_cache_count--;
+            pthread_setspecific(arena_cache_key, arena_cache);
+        }
+        else if ((block = malloc(sizeof(SESSION_ARENA_BLOCK) + SESSION_ARENA_BLOCK_SIZE)))
+        {
+            block->size = SESSION_ARENA_BLOCK_SIZE;
+        }
+
+        if (block)
+        {
+            block->used = size;
+            block->next = session->arena;
+            session->arena = block;
+            rval = block->data;
+        }
+    }
+
+    spinlock_release(&session->arena_lock);
+
+    if (rval)
+    {
+        memset(rval, 0, size);
+        session_mem_add(session, size);
+    }
+
+    return rval;
+}
+
+/**
+ * Copy a string into the memory of a session.
+ *
+ * @param session   The session
+ * @param str       The string
+ * @return          The copy or NULL if out of memory
+ */
+char *
+session_arena_strdup(SESSION *session, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *rval = session_arena_alloc(session, len);
+
+    if (rval)
+    {
+        memcpy(rval, str, len);
+    }
+
+    return rval;
+}
+
+/**
+ * Change the bytes of memory held by a session. The DCBs charge the session
+ * for their queued buffers and the routers and filters for the state they
+ * keep for it. The bytes are also added to the total of the service. What
+ * the session still holds when it is freed is taken off the service then,
+ * so the callers don't need to give back what is freed with the session.
+ *
+ * @param session   The session, may be NULL
+ * @param delta     Bytes taken, negative if bytes were released
+ */
+void
+session_mem_add(SESSION *session, int64_t delta)
+{
+    if (session && delta && session->state != SESSION_STATE_DUMMY && session->service)
+    {
+        __atomic_add_fetch(&session->mem_used, delta, __ATOMIC_RELAXED);
+        service_mem_add(session->service, delta);
+    }
+}
+
+/**
+ * Take the memory that a session still holds off the total of its service.
+ * Called when the session is freed.
+ *
+ * @param session   The session
+ */
+static void
+session_mem_flush(SESSION *session)
+{
+    int64_t held = __atomic_exchange_n(&session->mem_used, 0, __ATOMIC_RELAXED);
+
+    if (held)
+    {
+        service_mem_add(session->service, -held);
+    }
+}
+
 /**
  * Link a session to a DCB.
  *
@@ -419,7 +792,8 @@ session_simple_free(SESSION *session, DCB *dcb)
                 session->service->router_instance,
                 session->router_session);
         }
-        session->state = SESSION_STATE_STOPPING;
+        session_set_state(session, SESSION_STATE_STOPPING);
+        session_mem_flush(session);
     }
 
     session_final_free(session);
@@ -448,9 +822,14 @@ session_free(SESSION *session)
         /* Must be one or more references left */
         return false;
     }
-    session->state = SESSION_STATE_TO_BE_FREED;
+    session_set_state(session, SESSION_STATE_TO_BE_FREED);
 
-    atomic_add(&session->service->stats.n_current, -1);
+    service_remove_session(session->service);
+
+    if (session->trace.active)
+    {
+        qtrace_finish(&session->trace, session->service->latency);
+    }
 
     /***
      *
@@ -473,7 +852,7 @@ session_free(SESSION *session)
         int i;
         for (i = 0; i < session->n_filters; i++)
         {
-            if (session->filters[i].filter)
+            if (session->filters[i].filter && session->filters[i].session)
             {
                 session->filters[i].filter->obj->closeSession(session->filters[i].instance,
                                                               session->filters[i].session);
@@ -481,13 +860,13 @@ session_free(SESSION *session)
         }
         for (i = 0; i < session->n_filters; i++)
         {
-            if (session->filters[i].filter)
+            if (session->filters[i].filter && session->filters[i].session)
             {
                 session->filters[i].filter->obj->freeSession(session->filters[i].instance,
                                                              session->filters[i].session);
+                atomic_add(&session->filters[i].filter->n_current, -1);
             }
         }
-        free(session->filters);
     }
 
     MXS_INFO("Stopped %s client session [%lu]",
@@ -497,23 +876,51 @@ session_free(SESSION *session)
     /** Disable trace and decrease trace logger counter */
     session_disable_log_priority(session, LOG_INFO);
 
+    session_mem_flush(session);
+
     /** If session doesn't have parent referencing to it, it can be freed */
     if (!session->ses_is_child)
     {
-        session->state = SESSION_STATE_FREE;
+        session_set_state(session, SESSION_STATE_FREE);
         session_final_free(session);
     }
     return true;
 }
 
+/**
+ * Put a session that is no longer used into the cache of the calling thread.
+ * If the cache is full, a batch of sessions is moved to the global free list.
+ *
+ * @param session The session
+ */
 static void
 session_final_free(SESSION *session)
 {
-    /* We never free the actual session, it is available for reuse*/
-    spinlock_acquire(&session_spin);
-    session->ses_is_in_use = false;
-    freeSessionCount++;
-    spinlock_release(&session_spin);
+    allocprof_free(&session->sample);
+
+    /* We never free the actual session, it is available for reuse */
+    if (session_cache.first == NULL)
+    {
+        pthread_once(&session_cache_key_once, session_cache_key_init);
+        pthread_setspecific(session_cache_key, &session_cache);
+    }
+
+    session->epoch = rcu_retire();
+    __atomic_store_n(&session->ses_is_in_use, false, __ATOMIC_RELEASE);
+    session_list_put(&session_cache, session);
+
+    if (session_cache.count > SESSION_CACHE_MAX)
+    {
+        spinlock_acquire(&session_spin);
+        while (session_cache.count > SESSION_CACHE_MAX - SESSION_CACHE_BATCH)
+        {
+            SESSION *moved = session_cache.first;
+            session_cache.first = moved->nextfree;
+            session_cache.count--;
+            session_list_put(&freeSessions, moved);
+        }
+        spinlock_release(&session_spin);
+    }
 }
 
 /**
@@ -528,8 +935,7 @@ session_isvalid(SESSION *session)
     SESSION *list_session;
     int rval = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    list_session = session_list_first();
     while (list_session)
     {
         if (list_session->ses_is_in_use && list_session == session)
@@ -539,7 +945,6 @@ session_isvalid(SESSION *session)
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 
     return rval;
 }
@@ -574,8 +979,7 @@ printAllSessions()
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    list_session = session_list_first();
     while (list_session)
     {
         if (list_session->ses_is_in_use)
@@ -584,7 +988,6 @@ printAllSessions()
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 }
 
 
@@ -601,8 +1004,7 @@ CheckSessions()
     int noclients = 0;
     int norouter = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    list_session = session_list_first();
     while (list_session)
     {
         if (false == list_session->ses_is_in_use)
@@ -626,13 +1028,11 @@ CheckSessions()
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
     if (noclients)
     {
         printf("%d Sessions have no clients\n", noclients);
     }
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    list_session = session_list_first();
     while (list_session)
     {
         if (false == list_session->ses_is_in_use)
@@ -656,7 +1056,6 @@ CheckSessions()
         }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
     if (norouter)
     {
         printf("%d Sessions have no router session\n", norouter);
@@ -676,8 +1075,7 @@ dprintAllSessions(DCB *dcb)
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    list_session = session_list_first();
     while (list_session)
     {
         if (false == list_session->ses_is_in_use)
@@ -690,7 +1088,6 @@ dprintAllSessions(DCB *dcb)
 
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 }
 
 /**
@@ -723,6 +1120,7 @@ dprintSession(DCB *dcb, SESSION *print_session)
 
     dcb_printf(dcb, "\tConnected:           %s", // asctime inserts newline.
                asctime_r(localtime_r(&print_session->stats.connect, &result), buf));
+    dcb_printf(dcb, "\tMemory held:         %ld bytes\n", print_session->mem_used);
 
     if (print_session->client_dcb && print_session->client_dcb->state == DCB_STATE_POLLING)
     {
@@ -737,6 +1135,11 @@ dprintSession(DCB *dcb, SESSION *print_session)
         {
             dcb_printf(dcb, "\tFilter: %s\n",
                        print_session->filters[i].filter->name);
+            if (print_session->filters[i].session == NULL)
+            {
+                dcb_printf(dcb, "\t\tNot used by the session yet\n");
+                continue;
+            }
             print_session->filters[i].filter->obj->diagnostics(print_session->filters[i].instance,
                                                                print_session->filters[i].session,
                                                                dcb);
@@ -755,36 +1158,42 @@ dprintSession(DCB *dcb, SESSION *print_session)
 void
 dListSessions(DCB *dcb)
 {
+    DCB_PRINT_BATCH batch;
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    dcb_batch_init(&batch, dcb);
+    list_session = session_list_first();
     if (list_session)
     {
-        dcb_printf(dcb, "Sessions.\n");
-        dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
-        dcb_printf(dcb, "Session          | Client          | Service        | State\n");
-        dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
+        dcb_batch_printf(&batch, "Sessions.\n");
+        dcb_batch_printf(&batch, "-----------------+-----------------+----------------+--------------------------\n");
+        dcb_batch_printf(&batch, "Session          | Client          | Service        | State\n");
+        dcb_batch_printf(&batch, "-----------------+-----------------+----------------+--------------------------\n");
     }
     while (list_session)
     {
         if (list_session->ses_is_in_use)
         {
-            dcb_printf(dcb, "%-16p | %-15s | %-14s | %s\n", list_session,
-                       ((list_session->client_dcb && list_session->client_dcb->remote)
-                        ? list_session->client_dcb->remote : ""),
-                       (list_session->service && list_session->service->name ? list_session->service->name
-                        : ""),
-                       session_state(list_session->state));
+            dcb_batch_printf(&batch, "%-16p | %-15s | %-14s | %s\n", list_session,
+                             ((list_session->client_dcb && list_session->client_dcb->remote)
+                              ? list_session->client_dcb->remote : ""),
+                             (list_session->service && list_session->service->name ? list_session->service->name
+                              : ""),
+                             session_state(list_session->state));
+
+            if (DCB_BATCH_FULL(&batch))
+            {
+                dcb_batch_flush(&batch);
+            }
         }
         list_session = list_session->next;
     }
-    if (allSessions)
+    if (session_list_first())
     {
-        dcb_printf(dcb,
-                   "-----------------+-----------------+----------------+--------------------------\n\n");
+        dcb_batch_printf(&batch,
+                         "-----------------+-----------------+----------------+--------------------------\n\n");
     }
-    spinlock_release(&session_spin);
+    dcb_batch_flush(&batch);
 }
 
 /**
@@ -823,7 +1232,12 @@ session_state(session_state_t state)
 
 SESSION* get_session_by_router_ses(void* rses)
 {
-    SESSION* ses = allSessions;
+    SESSION* ses = session_list_first();
+
+    if (ses == NULL)
+    {
+        return NULL;
+    }
 
     while (((ses->ses_is_in_use == false) || (ses->router_session != rses)) && ses->next != NULL)
     {
@@ -841,11 +1255,9 @@ SESSION* get_session_by_router_ses(void* rses)
 /**
  * Create the filter chain for this session.
  *
- * Filters must be setup in reverse order, starting with the last
- * filter in the chain and working back towards the client connection
- * Each filter is passed the current session head of the filter chain
- * this head becomes the destination for the filter. The newly created
- * filter becomes the new head of the filter chain.
+ * The sessions of the filters that handle all commands are created here. A
+ * filter that declares the commands it handles gets its session when the
+ * first of these commands arrives, see session_filters_for.
  *
  * @param       session         The session that requires the chain
  * @return      0 if filter creation fails
@@ -854,50 +1266,136 @@ static int
 session_setup_filters(SESSION *session)
 {
     SERVICE *service = session->service;
-    DOWNSTREAM *head;
-    UPSTREAM *tail;
     int i;
 
-    if ((session->filters = calloc(service->n_filters,
-                                   sizeof(SESSION_FILTER))) == NULL)
+    if ((session->filters = session_arena_alloc(session, service->n_filters *
+                                                sizeof(SESSION_FILTER))) == NULL)
     {
         MXS_ERROR("Insufficient memory to allocate session filter "
                   "tracking.\n");
         return 0;
     }
     session->n_filters = service->n_filters;
+    session->router_head = session->head;
+    session->filter_commands = 0;
+    session->lazy_commands = 0;
+
     for (i = service->n_filters - 1; i >= 0; i--)
     {
-        if (service->filters[i] == NULL)
+        FILTER_DEF *filter = service->filters[i];
+
+        if (filter == NULL)
         {
             MXS_ERROR("Service '%s' contians an unresolved filter.", service->name);
             return 0;
         }
-        if ((head = filterApply(service->filters[i], session,
-                                &session->head)) == NULL)
+
+        session->filters[i].filter = filter;
+        session->filters[i].instance = filter->filter;
+        session->filter_commands |= filter->commands;
+
+        if (filter->commands != FILTER_ALL_COMMANDS)
+        {
+            session->lazy_commands |= filter->commands;
+        }
+        else if (session_create_filter(session, i) == 0)
         {
-            MXS_ERROR("Failed to create filter '%s' for "
-                      "service '%s'.\n",
-                      service->filters[i]->name,
-                      service->name);
             return 0;
         }
-        session->filters[i].filter = service->filters[i];
-        session->filters[i].session = head->session;
-        session->filters[i].instance = head->instance;
-        session->head = *head;
-        free(head);
     }
 
-    for (i = 0; i < service->n_filters; i++)
+    session->filter_bypass = session->filter_commands != FILTER_ALL_COMMANDS;
+
+    return session_link_filters(session);
+}
+
+/**
+ * Create the session of one filter. The filter is linked into the chain by
+ * session_link_filters.
+ *
+ * @param       session         The session
+ * @param       i               Index of the filter
+ * @return      0 if filter creation fails
+ */
+static int
+session_create_filter(SESSION *session, int i)
+{
+    DOWNSTREAM *head;
+
+    if ((head = filterApply(session->filters[i].filter, session, &session->router_head)) == NULL)
+    {
+        MXS_ERROR("Failed to create filter '%s' for "
+                  "service '%s'.\n",
+                  session->filters[i].filter->name,
+                  session->service->name);
+        return 0;
+    }
+    session->filters[i].session = head->session;
+    return 1;
+}
+
+/**
+ * Link the filters that have a session into the downstream and upstream
+ * chains of the session.
+ *
+ * Filters are linked in reverse order, starting with the last
+ * filter in the chain and working back towards the client connection.
+ * Each filter is passed the current head of the filter chain, this head
+ * becomes the destination for the filter and the filter becomes the new head.
+ *
+ * @param       session         The session
+ * @return      0 if linking fails
+ */
+static int
+session_link_filters(SESSION *session)
+{
+    DOWNSTREAM head = session->router_head;
+    UPSTREAM tail;
+    UPSTREAM *up;
+    int i;
+
+    for (i = session->n_filters - 1; i >= 0; i--)
+    {
+        SESSION_FILTER *filter = &session->filters[i];
+
+        if (filter->session == NULL)
+        {
+            continue;
+        }
+
+        filter->filter->obj->setDownstream(filter->instance, filter->session, &head);
+        head.instance = filter->instance;
+        head.session = filter->session;
+        head.routeQuery = (void *)(filter->filter->obj->routeQuery);
+
+        if (profile_enabled)
+        {
+            filter->down = head;
+            head.instance = filter;
+            head.session = filter;
+            head.routeQuery = session_profile_route;
+        }
+    }
+
+    memset(&tail, 0, sizeof(tail));
+    tail.instance = session;
+    tail.session = session;
+    tail.clientReply = session_reply;
+
+    for (i = 0; i < session->n_filters; i++)
     {
-        if ((tail = filterUpstream(service->filters[i],
-                                   session->filters[i].session,
-                                   &session->tail)) == NULL)
+        SESSION_FILTER *filter = &session->filters[i];
+
+        if (filter->session == NULL)
+        {
+            continue;
+        }
+
+        if ((up = filterUpstream(filter->filter, filter->session, &tail)) == NULL)
         {
             MXS_ERROR("Failed to create filter '%s' for service '%s'.",
-                      service->filters[i]->name,
-                      service->name);
+                      filter->filter->name,
+                      session->service->name);
             return 0;
         }
 
@@ -906,16 +1404,113 @@ session_setup_filters(SESSION *session)
          * the filter has no upstream entry point. So no need
          * to copy the contents or free tail in this case.
          */
-        if (tail != &session->tail)
+        if (up != &tail)
         {
-            session->tail = *tail;
-            free(tail);
+            tail = *up;
+            free(up);
+
+            if (profile_enabled)
+            {
+                filter->up = tail;
+                tail.instance = filter;
+                tail.session = filter;
+                tail.clientReply = session_profile_reply;
+                tail.error = NULL;
+            }
         }
     }
 
+    session->head = head;
+
+    if (session->filter_bypass)
+    {
+        /** The replies to the statements that skipped the filters skip them too */
+        session->filter_tail = tail;
+        session->tail.instance = session;
+        session->tail.session = session;
+        session->tail.clientReply = session_reply_select;
+        session->tail.error = NULL;
+    }
+    else
+    {
+        session->tail = tail;
+    }
+
     return 1;
 }
 
+/**
+ * Select the first element for a statement of a session whose filters do
+ * not all handle every command. The sessions of the filters that handle the
+ * command are created if they do not exist yet.
+ *
+ * @param       session         The session
+ * @param       data            The statement
+ * @return      The head of the filter chain or the router
+ */
+static DOWNSTREAM *
+session_filters_for(SESSION *session, GWBUF *data)
+{
+    uint8_t command;
+
+    if (gwbuf_copy_data(data, MXS_WIRE_HEADER_LEN, 1, &command) != 1)
+    {
+        session->bypassed = false;
+        return &session->head;
+    }
+
+    uint64_t bit = FILTER_COMMAND(command);
+
+    if ((session->filter_commands & bit) == 0)
+    {
+        session->bypassed = true;
+        return &session->router_head;
+    }
+
+    if (session->lazy_commands & bit)
+    {
+        for (int i = 0; i < session->n_filters; i++)
+        {
+            if (session->filters[i].session == NULL &&
+                (session->filters[i].filter->commands & bit) &&
+                session_create_filter(session, i) == 0)
+            {
+                /** The statement goes through the filters that do exist */
+                break;
+            }
+        }
+
+        session->lazy_commands &= ~bit;
+        session_link_filters(session);
+    }
+
+    session->bypassed = false;
+    return &session->head;
+}
+
+/**
+ * The first element of the upstream chain when statements may skip the
+ * filters. A reply skips the filters if the last statement did.
+ *
+ * @param       instance        The session
+ * @param       session         The session
+ * @param       data            The reply
+ * @return      The return value of the clientReply of the next element
+ */
+static int
+session_reply_select(void *instance, void *session, GWBUF *data)
+{
+    SESSION *the_session = (SESSION *)session;
+
+    if (the_session->bypassed)
+    {
+        return session_reply(instance, session, data);
+    }
+
+    return the_session->filter_tail.clientReply(the_session->filter_tail.instance,
+                                                the_session->filter_tail.session, data);
+}
+
 /**
  * Entry point for the final element int he upstream filter, i.e. the writing
  * of the data to the client.
@@ -928,8 +1523,159 @@ int
 session_reply(void *instance, void *session, GWBUF *data)
 {
     SESSION *the_session = (SESSION *)session;
+    PROFILE_CALL call;
+    int rc;
+
+    if (profile_enabled)
+    {
+        /** The write is not charged to the filters */
+        profile_begin(&call);
+    }
+
+    qtrace_reply(&the_session->trace);
+    rc = the_session->client_dcb->func.write(the_session->client_dcb, data);
+    qtrace_written(&the_session->trace);
+
+    if (profile_enabled)
+    {
+        profile_end(&call, NULL);
+    }
+
+    return rc;
+}
+
+/**
+ * Route a query to the head of the filter chain when query tracing or the
+ * event watchdog is enabled
+ *
+ * The trace of the previous query of the session is complete once the next
+ * query arrives. A sample of the queries is traced. The watchdog is told
+ * which statement the thread is routing.
+ *
+ * @param session       The session
+ * @param data          The query
+ * @return The return value of the routeQuery entry point of the head
+ */
+int
+session_route_traced(SESSION *session, GWBUF *data)
+{
+    QUERY_TRACE *trace = &session->trace;
+    DOWNSTREAM *head = session->filter_bypass ? session_filters_for(session, data) : &session->head;
+    int rc;
+
+    if (session_watch_queries)
+    {
+        poll_watch_query(data);
+    }
+
+    if (trace->active)
+    {
+        qtrace_finish(trace, session->service->latency);
+    }
+
+    if (!qtrace_enabled() || !qtrace_sample())
+    {
+        rc = head->routeQuery(head->instance, head->session, data);
+    }
+    else
+    {
+        qtrace_start(trace);
+        qtrace_current = trace;
+        rc = head->routeQuery(head->instance, head->session, data);
+        qtrace_current = NULL;
+        trace->router_done = qtrace_now();
+    }
+
+    if (session_watch_queries)
+    {
+        poll_watch_query(NULL);
+    }
+
+    return rc;
+}
+
+/**
+ * The last element of the filter chain when query tracing is enabled. It
+ * notes when a traced query reaches the router.
+ *
+ * @param instance      The session
+ * @param session       The session
+ * @param data          The query
+ * @return The return value of the routeQuery entry point of the router
+ */
+static int
+session_route_to_router(void *instance, void *session, GWBUF *data)
+{
+    SESSION *the_session = (SESSION *)session;
+
+    SERVICE *service = the_session->service;
+
+    if (qtrace_current == &the_session->trace)
+    {
+        the_session->trace.router = qtrace_now();
+        the_session->trace.classify_filter = the_session->trace.classify;
+    }
+
+    if (!profile_enabled)
+    {
+        return service->router->routeQuery(service->router_instance,
+                                           the_session->router_session, data);
+    }
+
+    PROFILE_CALL call;
+    int rc;
+
+    profile_begin(&call);
+    rc = service->router->routeQuery(service->router_instance, the_session->router_session, data);
+    profile_end(&call, &service->router_profile);
+
+    return rc;
+}
+
+/**
+ * The element in front of a filter when profiling is enabled. It times the
+ * routeQuery entry point of the filter.
+ *
+ * @param instance      The filter of the session
+ * @param session       The filter of the session
+ * @param data          The query
+ * @return The return value of the routeQuery entry point of the filter
+ */
+static int
+session_profile_route(void *instance, void *session, GWBUF *data)
+{
+    SESSION_FILTER *filter = (SESSION_FILTER *)instance;
+    PROFILE_CALL call;
+    int rc;
+
+    profile_begin(&call);
+    rc = filter->down.routeQuery(filter->down.instance, filter->down.session, data);
+    profile_end(&call, &filter->filter->route_profile);
 
-    return the_session->client_dcb->func.write(the_session->client_dcb, data);
+    return rc;
+}
+
+/**
+ * The element behind a filter when profiling is enabled. It times the
+ * clientReply entry point of the filter.
+ *
+ * @param instance      The filter of the session
+ * @param session       The filter of the session
+ * @param data          The reply
+ * @return The return value of the clientReply entry point of the filter
+ */
+static int
+session_profile_reply(void *instance, void *session, GWBUF *data)
+{
+    SESSION_FILTER *filter = (SESSION_FILTER *)instance;
+    PROFILE_CALL call;
+    int rc;
+
+    profile_begin(&call);
+    rc = filter->up.clientReply(filter->up.instance, filter->up.session, data);
+    profile_end(&call, &filter->filter->reply_profile);
+
+    return rc;
 }
 
 /**
@@ -990,52 +1736,40 @@ session_getUser(SESSION *session)
  */
 SESSION *get_all_sessions()
 {
-    return allSessions;
+    return session_list_first();
 }
 
 /**
- * Enable the timing out of idle connections.
+ * Close a session that has been idle for too long.
  *
- * This will prevent unnecessary acquisitions of the session spinlock if no
- * service is configured with a session idle timeout.
- */
-void enable_session_timeouts()
-{
-    check_timeouts = true;
-}
-
-/**
- * Close sessions that have been idle for too long.
+ * The timer of the client DCB is added when the session is created and it
+ * expires when the session would time out had it sent no data. Activity on
+ * the session only updates the time of the last read, so when the timer
+ * expires the real idle time is checked and the timer is added again for
+ * the remaining time. The connection timeout is disabled by default.
  *
- * If the time since a session last sent data is greater than the set value in the
- * service, it is disconnected. The connection timeout is disabled by default.
+ * @param timer The timer of the client DCB
  */
-void process_idle_sessions()
+static void
+session_idle_timeout(WHEEL_TIMER *timer)
 {
-    if (spinlock_acquire_nowait(&timeout_lock))
-    {
-        if (hkheartbeat >= next_timeout_check)
-        {
-            /** Because the resolution of the timeout is one second, we only need to
-             * check for it once per second. One heartbeat is 100 milliseconds. */
-            next_timeout_check = hkheartbeat + 10;
-            spinlock_acquire(&session_spin);
-            SESSION *all_session = allSessions;
+    DCB *dcb = (DCB *)((char *)timer - offsetof(DCB, timer));
+    SESSION *session = dcb->session;
 
-            while (all_session)
-            {
-                if (all_session->ses_is_in_use &&
-                    all_session->service && all_session->client_dcb && all_session->client_dcb->state == DCB_STATE_POLLING &&
-                    hkheartbeat - all_session->client_dcb->last_read > all_session->service->conn_idle_timeout * 10)
-                {
-                    dcb_close(all_session->client_dcb);
-                }
+    if (session && session->service && session->service->conn_idle_timeout > 0 &&
+        (dcb->state == DCB_STATE_POLLING || dcb->state == DCB_STATE_ALLOC))
+    {
+        long timeout = session->service->conn_idle_timeout * 10;
 
-                all_session = all_session->next;
-            }
-            spinlock_release(&session_spin);
+        if (dcb->state == DCB_STATE_POLLING && hkheartbeat - dcb->last_read > timeout)
+        {
+            dcb_close(dcb);
+        }
+        else
+        {
+            long expires = MAX(dcb->last_read, hkheartbeat - timeout) + timeout + 1;
+            timerwheel_add(timer, dcb->owner, expires, session_idle_timeout);
         }
-        spinlock_release(&timeout_lock);
     }
 }
 
@@ -1044,51 +1778,40 @@ void process_idle_sessions()
  */
 typedef struct
 {
-    int index;
+    SESSION *current;            /*< The session of the previous row */
+    bool started;                /*< Whether the first row has been sent */
     SESSIONLISTFILTER filter;
 } SESSIONFILTER;
 
 /**
  * Provide a row to the result set that defines the set of sessions
  *
+ * The position in the session list is kept between the calls so that
+ * the whole result set is produced with a single pass over the list.
+ * Sessions are never removed from the list, so the position stays valid.
+ *
  * @param set   The result set
- * @param data  The index of the row to send
+ * @param data  The position in the session list
  * @return The next row or NULL
  */
 static RESULT_ROW *
 sessionRowCallback(RESULTSET *set, void *data)
 {
     SESSIONFILTER *cbdata = (SESSIONFILTER *)data;
-    int i = 0;
     char buf[20];
     RESULT_ROW *row;
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    /* Skip to the first non-listener if not showing listeners */
-    while (false == list_session->ses_is_in_use ||
-           (list_session && cbdata->filter == SESSION_LIST_CONNECTION &&
-            list_session->state == SESSION_STATE_LISTENER))
+    if (cbdata->started)
     {
-        list_session = list_session->next;
+        list_session = cbdata->current ? cbdata->current->next : NULL;
     }
-    while (i < cbdata->index && list_session)
+    else
     {
-        if (list_session->ses_is_in_use)
-        {
-            if (cbdata->filter == SESSION_LIST_CONNECTION &&
-                list_session->state !=  SESSION_STATE_LISTENER)
-            {
-                i++;
-            }
-            else if (cbdata->filter == SESSION_LIST_ALL)
-            {
-                i++;
-            }
-        }
-        list_session = list_session->next;
+        list_session = session_list_first();
+        cbdata->started = true;
     }
+
     /* Skip to the next non-listener if not showing listeners */
     while (list_session && (false == list_session->ses_is_in_use ||
                             (cbdata->filter == SESSION_LIST_CONNECTION &&
@@ -1098,11 +1821,10 @@ sessionRowCallback(RESULTSET *set, void *data)
     }
     if (list_session == NULL)
     {
-        spinlock_release(&session_spin);
         free(data);
         return NULL;
     }
-    cbdata->index++;
+    cbdata->current = list_session;
     row = resultset_make_row(set);
     snprintf(buf,19, "%p", list_session);
     buf[19] = '\0';
@@ -1112,7 +1834,6 @@ sessionRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 2, (list_session->service && list_session->service->name
                                ? list_session->service->name : ""));
     resultset_row_set(row, 3, session_state(list_session->state));
-    spinlock_release(&session_spin);
     return row;
 }
 
@@ -1137,7 +1858,8 @@ sessionGetList(SESSIONLISTFILTER filter)
     {
         return NULL;
     }
-    data->index = 0;
+    data->current = NULL;
+    data->started = false;
     data->filter = filter;
     if ((set = resultset_create(sessionRowCallback, data)) == NULL)
     {
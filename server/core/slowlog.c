@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file slowlog.c - Sampling of slow queries
+ *
+ * When a service has a slow query threshold, its router copies the start of
+ * each query it routes to the router session and notes the time. When the
+ * first reply arrives, only the elapsed time is compared to the threshold.
+ * The canonical form of the query is computed only for the slow queries.
+ *
+ * The slow queries are written to a ring of SLOWLOG_SIZE entries without
+ * locking. A writer claims the next entry with an atomic increment and marks
+ * it as being written by making its sequence number odd. If another writer
+ * is still writing the entry after the ring has wrapped around, the query is
+ * dropped. A reader copies an entry and discards the copy if the sequence
+ * number changed while it was copied.
+ */
+
+#include <slowlog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <atomic.h>
+#include <dcb.h>
+#include <skygw_utils.h>
+
+static SLOWLOG_ENTRY slowlog[SLOWLOG_SIZE];
+
+/** The number of slow queries written to the ring */
+static int slowlog_next = 0;
+
+static inline uint64_t slowlog_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Note the start of a query
+ *
+ * @param query  The timed query of the router session
+ * @param buffer The query
+ */
+void slowlog_note(SLOWLOG_QUERY *query, GWBUF *buffer)
+{
+    uint8_t header[5];
+    size_t len = gwbuf_length(buffer);
+
+    query->start = 0;
+
+    if (len <= sizeof(header) ||
+        gwbuf_copy_data(buffer, 0, sizeof(header), header) != sizeof(header) ||
+        header[4] != 0x03) // COM_QUERY
+    {
+        return;
+    }
+
+    if (query->sql == NULL && (query->sql = (char *)malloc(SLOWLOG_SQL_LEN + 1)) == NULL)
+    {
+        return;
+    }
+
+    len -= sizeof(header);
+    if (len > SLOWLOG_SQL_LEN)
+    {
+        len = SLOWLOG_SQL_LEN;
+    }
+
+    query->len = gwbuf_copy_data(buffer, sizeof(header), len, (uint8_t *)query->sql);
+    query->start = slowlog_now();
+}
+
+/**
+ * Calculate the fingerprint of the canonical form of a query
+ *
+ * @param sql The query
+ * @param len Length of the query
+ * @return The fingerprint of the canonical form
+ */
+static uint64_t slowlog_hash(const char *sql, size_t len)
+{
+    char canonical[CANONICAL_SQL_SIZE(SLOWLOG_SQL_LEN)];
+    uint64_t hash;
+
+    canonicalize_sql(sql, len, canonical, &hash);
+    return hash;
+}
+
+/**
+ * Check whether a query was slow when its first reply arrives and add it to
+ * the ring if it was
+ *
+ * @param query     The timed query of the router session
+ * @param threshold The slow query threshold of the service in milliseconds
+ * @param service   Name of the service
+ * @param server    Name of the server that replied
+ */
+void slowlog_check(SLOWLOG_QUERY *query, int threshold, const char *service, const char *server)
+{
+    int64_t duration = slowlog_now() - query->start;
+
+    query->start = 0;
+
+    if (threshold <= 0 || duration < (int64_t)threshold * 1000)
+    {
+        return;
+    }
+
+    SLOWLOG_ENTRY *entry = &slowlog[(unsigned int)atomic_add(&slowlog_next, 1) % SLOWLOG_SIZE];
+    int seq = entry->seq;
+
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&entry->seq, seq, seq + 1))
+    {
+        /** Another thread is writing the entry */
+        return;
+    }
+
+    query->sql[query->len] = '\0';
+    entry->hash = slowlog_hash(query->sql, query->len);
+    entry->timestamp = time(NULL);
+    entry->duration = duration;
+    snprintf(entry->service, sizeof(entry->service), "%s", service);
+    snprintf(entry->server, sizeof(entry->server), "%s", server ? server : "");
+    memcpy(entry->sql, query->sql, query->len + 1);
+    entry->sql_len = query->len;
+
+    __sync_synchronize();
+    entry->seq = seq + 2;
+}
+
+/**
+ * Free the copy of the query of a router session
+ *
+ * @param query The timed query of the router session
+ */
+void slowlog_query_free(SLOWLOG_QUERY *query)
+{
+    free(query->sql);
+    query->sql = NULL;
+    query->start = 0;
+}
+
+/**
+ * Get the number of slow queries in the ring
+ *
+ * @return The number of entries that can be read
+ */
+int slowlog_count()
+{
+    unsigned int n = (unsigned int)slowlog_next;
+    return n < SLOWLOG_SIZE ? n : SLOWLOG_SIZE;
+}
+
+/**
+ * Copy a slow query from the ring
+ *
+ * @param index The index of the query, 0 is the most recent one
+ * @param entry Where the query is copied
+ * @return True if the copy is valid, false if the entry was being written
+ */
+bool slowlog_get(int index, SLOWLOG_ENTRY *entry)
+{
+    unsigned int next = (unsigned int)slowlog_next;
+    SLOWLOG_ENTRY *src = &slowlog[(next - 1 - index) % SLOWLOG_SIZE];
+    int seq = src->seq;
+
+    if (index >= slowlog_count() || seq == 0 || (seq & 1))
+    {
+        return false;
+    }
+
+    __sync_synchronize();
+    memcpy(entry, src, sizeof(*entry));
+    __sync_synchronize();
+
+    return src->seq == seq;
+}
+
+/**
+ * Print the slow queries, the most recent first
+ *
+ * @param dcb DCB to print to
+ */
+void dShowSlowQueries(DCB *dcb)
+{
+    SLOWLOG_ENTRY *entry = (SLOWLOG_ENTRY *)malloc(sizeof(SLOWLOG_ENTRY));
+    int n = slowlog_count();
+
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    dcb_printf(dcb, "Time                | Service              | Server               |"
+               "     Time (ms) | Hash             | Query\n");
+    dcb_printf(dcb, "--------------------+----------------------+----------------------+"
+               "---------------+------------------+------------------------------\n");
+
+    for (int i = 0; i < n; i++)
+    {
+        if (slowlog_get(i, entry))
+        {
+            char timebuf[32];
+            struct tm tm;
+
+            localtime_r(&entry->timestamp, &tm);
+            strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm);
+            dcb_printf(dcb, "%-19s | %-20s | %-20s | %13.1f | %016" PRIx64 " | %.*s\n",
+                       timebuf, entry->service, entry->server, entry->duration / 1000.0,
+                       entry->hash, entry->sql_len, entry->sql);
+        }
+    }
+
+    free(entry);
+}
+
+/**
+ * Provide a row to the result set of the slow queries
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+slowlogRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    SLOWLOG_ENTRY *entry = (SLOWLOG_ENTRY *)malloc(sizeof(SLOWLOG_ENTRY));
+    int n = slowlog_count();
+
+    while (entry && *rowno < n && !slowlog_get(*rowno, entry))
+    {
+        (*rowno)++;
+    }
+
+    if (entry == NULL || *rowno >= n)
+    {
+        free(entry);
+        free(data);
+        return NULL;
+    }
+
+    char buf[32];
+    RESULT_ROW *row = resultset_make_row(set);
+    struct tm tm;
+
+    (*rowno)++;
+    localtime_r(&entry->timestamp, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    resultset_row_set(row, 0, buf);
+    resultset_row_set(row, 1, entry->service);
+    resultset_row_set(row, 2, entry->server);
+    snprintf(buf, sizeof(buf), "%" PRId64, entry->duration);
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%016" PRIx64, entry->hash);
+    resultset_row_set(row, 4, buf);
+    resultset_row_set(row, 5, entry->sql);
+
+    free(entry);
+    return row;
+}
+
+/**
+ * Return a result set with the slow queries, the most recent first
+ *
+ * @return A Result set
+ */
+RESULTSET *
+slowlogGetList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(slowlogRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Time", 19, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Service", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Server", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Duration", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Hash", 8, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Query", 80, COL_TYPE_VARCHAR);
+
+    return set;
+}
@@ -26,7 +26,20 @@
 #include <spinlock.h>
 #include <atomic.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <skygw_debug.h>
+#include <rdtsc.h>
+
+/** Number of backoff rounds before a waiting thread sleeps on the lock */
+#define SPINLOCK_SPINS          10
+
+/** The maximum number of pauses in one backoff round */
+#define SPINLOCK_MAX_BACKOFF    256
+
+/** The sites that have acquired a lock */
+static SPINLOCK_SITE *spinlock_site_list = NULL;
 
 /**
  * Initialise a spinlock.
@@ -46,13 +59,73 @@ spinlock_init(SPINLOCK *lock)
 #endif
 }
 
+/**
+ * Sleep until the value of a lock is something else than expected or the
+ * lock is released.
+ *
+ * @param lock  The lock word
+ * @param value The value where to sleep
+ */
+static inline void
+spinlock_futex_wait(int *lock, int value)
+{
+    syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/**
+ * Wake up one thread that sleeps on a lock.
+ *
+ * @param lock  The lock word
+ */
+static inline void
+spinlock_futex_wake(int *lock)
+{
+    syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Tell the processor that the thread is spinning.
+ */
+static inline void
+spinlock_pause(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ volatile ("pause" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+/**
+ * Add a site to the list of sites when it first acquires a lock.
+ *
+ * @param site  The site
+ */
+static void
+spinlock_register(SPINLOCK_SITE *site)
+{
+    if (__sync_bool_compare_and_swap(&site->registered, 0, 1))
+    {
+        do
+        {
+            site->next = spinlock_site_list;
+        }
+        while (!__sync_bool_compare_and_swap(&spinlock_site_list, site->next, site));
+    }
+}
+
 /**
  * Acquire a spinlock.
  *
+ * The lock is first spun on with an exponential backoff. If it is still
+ * held after SPINLOCK_SPINS rounds, the thread marks the lock as having
+ * waiters and sleeps on it until it is released.
+ *
  * @param lock The spinlock to acquire
+ * @param site The counters of the calling site
  */
 void
-spinlock_acquire(SPINLOCK *lock)
+spinlock_acquire_at(SPINLOCK *lock, SPINLOCK_SITE *site)
 {
 #if SPINLOCK_PROFILE
     int spins = 0;
@@ -60,20 +133,52 @@ spinlock_acquire(SPINLOCK *lock)
     atomic_add(&(lock->waiting), 1);
 #endif
 
-#ifdef __GNUC__
-    while (__sync_lock_test_and_set(&(lock->lock), 1))
-        while (lock->lock)
-        {
-#else
-    while (atomic_add(&(lock->lock), 1) != 0)
+    if (!site->registered)
     {
-        atomic_add(&(lock->lock), -1);
-#endif
+        spinlock_register(site);
+    }
+
+    if (!__sync_bool_compare_and_swap(&lock->lock, 0, 1))
+    {
+        CYCLES start = rdtsc();
+        bool acquired = false;
+        int backoff = 1;
+
+        for (int round = 0; round < SPINLOCK_SPINS && !acquired; round++)
+        {
+            for (int i = 0; i < backoff; i++)
+            {
+                spinlock_pause();
+            }
 #if SPINLOCK_PROFILE
             atomic_add(&(lock->spins), 1);
             spins++;
 #endif
+            if (backoff < SPINLOCK_MAX_BACKOFF)
+            {
+                backoff *= 2;
+            }
+            acquired = lock->lock == 0 && __sync_bool_compare_and_swap(&lock->lock, 0, 1);
         }
+
+        if (!acquired)
+        {
+            /**
+             * A lock that is taken here is marked as having waiters even if
+             * there are none left, which only costs an extra wake up.
+             */
+            while (__sync_lock_test_and_set(&lock->lock, 2) != 0)
+            {
+                spinlock_futex_wait(&lock->lock, 2);
+            }
+            site->parked++;
+        }
+
+        site->contended++;
+        site->cycles += rdtsc() - start;
+    }
+    site->acquired++;
+
 #if SPINLOCK_PROFILE
     if (spins)
     {
@@ -98,18 +203,10 @@ spinlock_acquire(SPINLOCK *lock)
 int
 spinlock_acquire_nowait(SPINLOCK *lock)
 {
-#ifdef __GNUC__
-    if (__sync_lock_test_and_set(&(lock->lock), 1))
-    {
-        return FALSE;
-    }
-#else
-    if (atomic_add(&(lock->lock), 1) != 0)
+    if (!__sync_bool_compare_and_swap(&lock->lock, 0, 1))
     {
-        atomic_add(&(lock->lock), -1);
         return FALSE;
     }
-#endif
 #if SPINLOCK_PROFILE
     lock->acquired++;
     lock->owner = thread_self();
@@ -118,7 +215,8 @@ spinlock_acquire_nowait(SPINLOCK *lock)
 }
 
 /*
- * Release a spinlock.
+ * Release a spinlock. If there may be threads sleeping on the lock, one of
+ * them is woken up.
  *
  * @param lock The spinlock to release
  */
@@ -132,12 +230,11 @@ spinlock_release(SPINLOCK *lock)
         lock->max_waiting = lock->waiting;
     }
 #endif
-#ifdef __GNUC__
     __sync_synchronize(); /* Memory barrier. */
-    lock->lock = 0;
-#else
-    atomic_add(&(lock->lock), -1);
-#endif
+    if (__sync_lock_test_and_set(&lock->lock, 0) == 2)
+    {
+        spinlock_futex_wake(&lock->lock);
+    }
 }
 
 /**
@@ -177,3 +274,19 @@ spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
     }
 #endif
 }
+
+/**
+ * Report the counters of all lock sites that have acquired a lock. A
+ * callback is used for the same reason as in spinlock_stats.
+ *
+ * @param reporter      The callback function that is called for each site
+ * @param hdl           A handle that is passed to the reporter function
+ */
+void
+spinlock_sites(void (*reporter)(void *, SPINLOCK_SITE *), void *hdl)
+{
+    for (SPINLOCK_SITE *site = spinlock_site_list; site; site = site->next)
+    {
+        reporter(hdl, site);
+    }
+}
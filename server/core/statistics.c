@@ -13,8 +13,10 @@
 
 #include <statistics.h>
 #include <maxconfig.h>
+#include <stdlib.h>
 #include <string.h>
 #include <platform.h>
+#include <time.h>
 
 thread_local int current_thread_id = 0;
 
@@ -27,7 +29,14 @@ static bool initialized = false;
 void ts_stats_init()
 {
     ss_dassert(!initialized);
-    thread_count = config_threadcount();
+    thread_count = config_max_threadcount();
+
+    if (thread_count < 1)
+    {
+        // Programs that do not load a configuration, e.g. the tests.
+        thread_count = 1;
+    }
+
     initialized = true;
 }
 
@@ -39,6 +48,47 @@ void ts_stats_end()
     ss_dassert(initialized);
 }
 
+/**
+ * The value of one thread. The padding keeps the values of different threads
+ * on separate cache lines so that the threads do not invalidate each other's
+ * caches when they update them.
+ */
+typedef struct
+{
+    int64_t value;
+    char    pad[TS_STATS_CACHE_LINE - sizeof(int64_t)];
+} ts_stats_slot_t;
+
+/**
+ * A histogram. Each thread has a row of buckets that starts on a cache line of
+ * its own.
+ */
+typedef struct
+{
+    int     n_buckets;  /*< Number of buckets, the last one counts all the larger values */
+    bool    log;        /*< Values are counted in log-linear buckets */
+    int     stride;     /*< Number of values in a row, a multiple of a cache line */
+    int64_t *buckets;   /*< The rows of all threads */
+} ts_histogram_data_t;
+
+/**
+ * Allocate memory that starts at the beginning of a cache line
+ *
+ * @param size Size of the memory
+ * @return Zeroed memory or NULL if memory allocation failed
+ */
+static void* ts_stats_alloc_aligned(size_t size)
+{
+    void *rval;
+
+    if (posix_memalign(&rval, TS_STATS_CACHE_LINE, size) != 0)
+    {
+        return NULL;
+    }
+    memset(rval, 0, size);
+    return rval;
+}
+
 /**
  * Create a new statistics object
  *
@@ -47,7 +97,7 @@ void ts_stats_end()
 ts_stats_t ts_stats_alloc()
 {
     ss_dassert(initialized);
-    return calloc(thread_count, sizeof(int));
+    return ts_stats_alloc_aligned(thread_count * sizeof(ts_stats_slot_t));
 }
 
 /**
@@ -79,10 +129,10 @@ void ts_stats_set_thread_id(int id)
  * @param stats Statistics to add to
  * @param value Value to add
  */
-void ts_stats_add(ts_stats_t stats, int value)
+void ts_stats_add(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] += value;
+    ((ts_stats_slot_t*)stats)[current_thread_id].value += value;
 }
 
 /**
@@ -92,10 +142,27 @@ void ts_stats_add(ts_stats_t stats, int value)
  * @param stats Statistics to set
  * @param value Value to set to
  */
-void ts_stats_set(ts_stats_t stats, int value)
+void ts_stats_set(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] = value;
+    ((ts_stats_slot_t*)stats)[current_thread_id].value = value;
+}
+
+/**
+ * Raise the value of the current thread to @c value if it is larger
+ *
+ * @param stats Statistics to set
+ * @param value The new candidate for the maximum
+ */
+void ts_stats_set_max(ts_stats_t stats, int64_t value)
+{
+    ss_dassert(initialized);
+    ts_stats_slot_t *slot = &((ts_stats_slot_t*)stats)[current_thread_id];
+
+    if (value > slot->value)
+    {
+        slot->value = value;
+    }
 }
 
 /**
@@ -104,13 +171,344 @@ void ts_stats_set(ts_stats_t stats, int value)
  * @param stats Statistics to read
  * @return Value of statistics
  */
-int ts_stats_sum(ts_stats_t stats)
+int64_t ts_stats_sum(ts_stats_t stats)
 {
     ss_dassert(initialized);
-    int sum = 0;
+    int64_t sum = 0;
     for (int i = 0; i < thread_count; i++)
     {
-        sum += ((int*)stats)[i];
+        sum += ((ts_stats_slot_t*)stats)[i].value;
     }
     return sum;
 }
+
+/**
+ * Read the value of one thread
+ *
+ * @param stats Statistics to read
+ * @param thread The thread ID
+ * @return The value of the thread
+ */
+int64_t ts_stats_get(ts_stats_t stats, int thread)
+{
+    ss_dassert(initialized);
+    ss_dassert(thread >= 0 && thread < thread_count);
+    return ((ts_stats_slot_t*)stats)[thread].value;
+}
+
+/**
+ * Read the largest value of any thread
+ *
+ * @param stats Statistics to read
+ * @return The maximum value
+ */
+int64_t ts_stats_max(ts_stats_t stats)
+{
+    ss_dassert(initialized);
+    int64_t max = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (((ts_stats_slot_t*)stats)[i].value > max)
+        {
+            max = ((ts_stats_slot_t*)stats)[i].value;
+        }
+    }
+    return max;
+}
+
+/**
+ * Create a new gauge
+ *
+ * A gauge may be incremented by one thread and decremented by another, the
+ * value of a single thread has no meaning but the sum of them is the value
+ * of the gauge.
+ *
+ * @return New gauge or NULL if memory allocation failed
+ */
+ts_gauge_t ts_gauge_alloc()
+{
+    return ts_stats_alloc();
+}
+
+/**
+ * Free a gauge
+ *
+ * @param gauge Gauge to free
+ */
+void ts_gauge_free(ts_gauge_t gauge)
+{
+    ts_stats_free(gauge);
+}
+
+/**
+ * Change the value of a gauge
+ *
+ * The threads that are not polling threads share the first value, so it is
+ * changed with an atomic add. The cache line is normally owned by the
+ * calling thread and the add is cheap.
+ *
+ * @param gauge Gauge to change
+ * @param delta The amount to add, negative to decrease the gauge
+ */
+void ts_gauge_add(ts_gauge_t gauge, int64_t delta)
+{
+    ss_dassert(initialized);
+    __atomic_fetch_add(&((ts_stats_slot_t*)gauge)[current_thread_id].value, delta,
+                       __ATOMIC_RELAXED);
+}
+
+/**
+ * Read the current value of a gauge
+ *
+ * @param gauge Gauge to read
+ * @return The value of the gauge
+ */
+int64_t ts_gauge_get(ts_gauge_t gauge)
+{
+    return ts_stats_sum(gauge);
+}
+
+/**
+ * Create a new histogram
+ *
+ * A value is counted in the bucket with the same index, values that are
+ * larger than the last bucket are counted in the last one.
+ *
+ * @param n_buckets Number of buckets
+ * @return New histogram or NULL if memory allocation failed
+ */
+ts_histogram_t ts_histogram_alloc(int n_buckets)
+{
+    ss_dassert(initialized);
+    ts_histogram_data_t *histogram = malloc(sizeof(ts_histogram_data_t));
+    const int per_line = TS_STATS_CACHE_LINE / sizeof(int64_t);
+
+    if (histogram)
+    {
+        histogram->n_buckets = n_buckets;
+        histogram->log = false;
+        histogram->stride = (n_buckets + per_line - 1) / per_line * per_line;
+        histogram->buckets = ts_stats_alloc_aligned(thread_count * histogram->stride *
+                                                    sizeof(int64_t));
+        if (histogram->buckets == NULL)
+        {
+            free(histogram);
+            histogram = NULL;
+        }
+    }
+    return histogram;
+}
+
+/**
+ * Free a histogram
+ *
+ * @param histogram Histogram to free
+ */
+void ts_histogram_free(ts_histogram_t histogram)
+{
+    if (histogram)
+    {
+        free(((ts_histogram_data_t*)histogram)->buckets);
+        free(histogram);
+    }
+}
+
+/**
+ * Count a value in the histogram
+ *
+ * @param histogram Histogram to add to
+ * @param value The value, negative values are counted in the first bucket
+ */
+void ts_histogram_add(ts_histogram_t histogram, int64_t value)
+{
+    ss_dassert(initialized);
+    ts_histogram_data_t *h = (ts_histogram_data_t*)histogram;
+    int bucket;
+
+    if (h->log)
+    {
+        bucket = ts_log_bucket(value);
+        if (bucket >= h->n_buckets)
+        {
+            bucket = h->n_buckets - 1;
+        }
+    }
+    else
+    {
+        bucket = value < 0 ? 0 : value >= h->n_buckets ? h->n_buckets - 1 : (int)value;
+    }
+
+    h->buckets[current_thread_id * h->stride + bucket]++;
+}
+
+/**
+ * Read the count of one bucket of a histogram
+ *
+ * @param histogram Histogram to read
+ * @param bucket The bucket
+ * @return Number of values counted in the bucket by all threads
+ */
+int64_t ts_histogram_bucket(ts_histogram_t histogram, int bucket)
+{
+    ss_dassert(initialized);
+    ts_histogram_data_t *h = (ts_histogram_data_t*)histogram;
+    int64_t sum = 0;
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        sum += h->buckets[i * h->stride + bucket];
+    }
+    return sum;
+}
+
+/**
+ * Find the log-linear bucket of a value
+ *
+ * The values below TS_LOG_SUB_BUCKETS have a bucket of their own. Each larger
+ * power of two is split into TS_LOG_SUB_BUCKETS buckets of equal width, so the
+ * width of a bucket is at most one eighth of its values.
+ *
+ * @param value The value
+ * @return The bucket of the value
+ */
+int ts_log_bucket(int64_t value)
+{
+    if (value < TS_LOG_SUB_BUCKETS)
+    {
+        return value < 0 ? 0 : (int)value;
+    }
+
+    int msb = 63 - __builtin_clzll((uint64_t)value);
+    int sub = (value >> (msb - 3)) & (TS_LOG_SUB_BUCKETS - 1);
+
+    return (msb - 2) * TS_LOG_SUB_BUCKETS + sub;
+}
+
+/**
+ * Get the largest value counted in a log-linear bucket
+ *
+ * @param bucket The bucket
+ * @return The largest value of the bucket
+ */
+int64_t ts_log_bucket_limit(int bucket)
+{
+    if (bucket < TS_LOG_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / TS_LOG_SUB_BUCKETS - 1;
+    int64_t sub = bucket % TS_LOG_SUB_BUCKETS;
+
+    return ((TS_LOG_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/**
+ * Create a new log-linear histogram
+ *
+ * The values are counted in the buckets returned by ts_log_bucket, which
+ * keeps the relative error of the percentiles constant over a wide range of
+ * values. Values of 2^32 and above are counted in the last bucket.
+ *
+ * @return New histogram or NULL if memory allocation failed
+ */
+ts_histogram_t ts_histogram_alloc_log()
+{
+    ts_histogram_data_t *histogram = ts_histogram_alloc(TS_LOG_BUCKETS);
+
+    if (histogram)
+    {
+        histogram->log = true;
+    }
+    return histogram;
+}
+
+/**
+ * Read the number of values counted in a histogram
+ *
+ * @param histogram Histogram to read
+ * @return Number of values counted by all threads
+ */
+int64_t ts_histogram_count(ts_histogram_t histogram)
+{
+    ts_histogram_data_t *h = (ts_histogram_data_t*)histogram;
+    int64_t sum = 0;
+
+    for (int i = 0; i < h->n_buckets; i++)
+    {
+        sum += ts_histogram_bucket(histogram, i);
+    }
+    return sum;
+}
+
+/**
+ * Estimate a percentile of the values counted in a histogram
+ *
+ * The estimate is the largest value of the bucket that contains the
+ * percentile. The counts are read without locking so the result is
+ * approximate while the other threads add values.
+ *
+ * @param histogram Histogram to read
+ * @param percentile The percentile, between 0 and 100
+ * @return The estimate or 0 if the histogram is empty
+ */
+int64_t ts_histogram_percentile(ts_histogram_t histogram, double percentile)
+{
+    ts_histogram_data_t *h = (ts_histogram_data_t*)histogram;
+    int64_t counts[h->n_buckets];
+    int64_t total = 0;
+
+    for (int i = 0; i < h->n_buckets; i++)
+    {
+        counts[i] = ts_histogram_bucket(histogram, i);
+        total += counts[i];
+    }
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    int64_t target = (int64_t)(total * percentile / 100.0 + 0.5);
+    int64_t sum = 0;
+    int bucket = 0;
+
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    for (bucket = 0; bucket < h->n_buckets - 1; bucket++)
+    {
+        sum += counts[bucket];
+
+        if (sum >= target)
+        {
+            break;
+        }
+    }
+
+    return h->log ? ts_log_bucket_limit(bucket) : bucket;
+}
+
+/**
+ * Check whether the sums of sharded counters should be published again
+ *
+ * The check uses the coarse monotonic clock which is cheap enough for the
+ * paths that change the counters. Only one of the threads that make the
+ * check at the same time gets a true return value.
+ *
+ * @param published When the sums were last published, updated if they are due
+ * @return True if the caller should publish the sums
+ */
+bool ts_publish_due(uint64_t *published)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    uint64_t last = __atomic_load_n(published, __ATOMIC_RELAXED);
+
+    return now - last >= TS_PUBLISH_INTERVAL_NS &&
+           __atomic_compare_exchange_n(published, &last, now, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
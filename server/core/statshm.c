@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file statshm.c - The statistics published in a shared memory segment
+ *
+ * A housekeeper task generates the metrics and copies them into the segment.
+ * Generating the metrics does not lock the objects, see metrics.c, and the
+ * readers never take a lock that MaxScale could wait for, so an agent that
+ * reads the segment in a tight loop costs MaxScale nothing. Only the
+ * housekeeper writes the segment.
+ */
+
+#include <statshm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <housekeeper.h>
+#include <metrics.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Initial size of the segment, it doubles when the data does not fit */
+#define STATSHM_INITIAL_SIZE 65536
+
+static char *statshm_name = NULL;
+static int statshm_fd = -1;
+static STATSHM_HEADER *statshm_hdr = NULL;
+
+static void statshm_publish(void *data);
+
+/**
+ * Remove a segment of the same name that was left behind by a MaxScale that
+ * did not exit cleanly. A segment whose writer is still running belongs to
+ * another MaxScale and is left alone.
+ *
+ * @param name Name of the segment
+ * @return True if there is no segment of that name any more
+ */
+static bool statshm_remove_stale(const char *name)
+{
+    char errbuf[STRERROR_BUFLEN];
+    STATSHM_HEADER hdr;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return true;
+        }
+        MXS_ERROR("Failed to open the existing statistics segment '%s': %d, %s", name,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    bool valid = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == STATSHM_MAGIC;
+    close(fd);
+
+    if (valid)
+    {
+        pid_t pid = (pid_t)hdr.pid;
+
+        if (pid > 0 && pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM))
+        {
+            MXS_ERROR("The statistics segment '%s' is in use by the process %ld. Give each "
+                      "MaxScale on the same host a stats_shm_name of its own.", name, (long)pid);
+            return false;
+        }
+    }
+
+    if (shm_unlink(name) == -1 && errno != ENOENT)
+    {
+        MXS_ERROR("Failed to remove the stale statistics segment '%s': %d, %s", name,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Create the statistics segment and start publishing the statistics
+ *
+ * @param name     Name of the segment, starting with a slash
+ * @param interval How often the statistics are published, in milliseconds,
+ *                 0 if the segment is not used
+ * @return True if the segment was created or is not used
+ */
+bool statshm_init(const char *name, int interval)
+{
+    char errbuf[STRERROR_BUFLEN];
+
+    if (interval <= 0)
+    {
+        return true;
+    }
+
+    if ((statshm_name = strdup(name)) == NULL)
+    {
+        return false;
+    }
+
+    if (!statshm_remove_stale(statshm_name))
+    {
+        free(statshm_name);
+        statshm_name = NULL;
+        return false;
+    }
+
+    if ((statshm_fd = shm_open(statshm_name, O_CREAT | O_EXCL | O_RDWR, 0644)) == -1)
+    {
+        MXS_ERROR("Failed to create the statistics segment '%s': %d, %s", statshm_name,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        free(statshm_name);
+        statshm_name = NULL;
+        return false;
+    }
+
+    void *addr = MAP_FAILED;
+
+    if (ftruncate(statshm_fd, STATSHM_INITIAL_SIZE) == -1 ||
+        (addr = mmap(NULL, STATSHM_INITIAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     statshm_fd, 0)) == MAP_FAILED)
+    {
+        MXS_ERROR("Failed to map the statistics segment '%s': %d, %s", statshm_name,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(statshm_fd);
+        statshm_fd = -1;
+        statshm_close();
+        return false;
+    }
+
+    statshm_hdr = (STATSHM_HEADER*)addr;
+    statshm_hdr->seq = 0;
+    statshm_hdr->size = STATSHM_INITIAL_SIZE;
+    statshm_hdr->length = 0;
+    statshm_hdr->timestamp = 0;
+    statshm_hdr->pid = getpid();
+    statshm_hdr->version = STATSHM_VERSION;
+    __sync_synchronize();
+    statshm_hdr->magic = STATSHM_MAGIC;
+
+    if (hktask_add_ms("Statistics segment", statshm_publish, NULL, interval) == 0)
+    {
+        MXS_ERROR("Failed to add the housekeeper task of the statistics segment.");
+        munmap(statshm_hdr, STATSHM_INITIAL_SIZE);
+        statshm_hdr = NULL;
+        close(statshm_fd);
+        statshm_fd = -1;
+        statshm_close();
+        return false;
+    }
+
+    MXS_NOTICE("Publishing the statistics in the shared memory segment '%s' every %d milliseconds.",
+               statshm_name, interval);
+    return true;
+}
+
+/**
+ * Grow the segment so that the data fits in it. The readers notice the new
+ * size in the header and map the segment again.
+ *
+ * @param length Length of the data
+ * @return True if the data fits in the segment
+ */
+static bool statshm_grow(size_t length)
+{
+    size_t size = statshm_hdr->size;
+
+    while (size < sizeof(STATSHM_HEADER) + length)
+    {
+        size *= 2;
+    }
+
+    if (size == statshm_hdr->size)
+    {
+        return true;
+    }
+
+    char errbuf[STRERROR_BUFLEN];
+    void *addr;
+
+    if (ftruncate(statshm_fd, size) == -1 ||
+        (addr = mremap(statshm_hdr, statshm_hdr->size, size, MREMAP_MAYMOVE)) == MAP_FAILED)
+    {
+        MXS_ERROR("Failed to grow the statistics segment '%s' to %lu bytes: %d, %s",
+                  statshm_name, size, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    statshm_hdr = (STATSHM_HEADER*)addr;
+    statshm_hdr->size = size;
+    return true;
+}
+
+/**
+ * Write the data into the statistics segment
+ *
+ * @param data   The data
+ * @param length Length of the data
+ * @return True if the data was written
+ */
+bool statshm_write(const char *data, size_t length)
+{
+    if (statshm_hdr == NULL || !statshm_grow(length))
+    {
+        return false;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    statshm_hdr->seq++;
+    __sync_synchronize();
+    memcpy(STATSHM_DATA(statshm_hdr), data, length);
+    statshm_hdr->length = length;
+    statshm_hdr->timestamp = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    __sync_synchronize();
+    statshm_hdr->seq++;
+
+    return true;
+}
+
+/**
+ * The housekeeper task that publishes the statistics
+ */
+static void statshm_publish(void *data)
+{
+    GWBUF *buffer = metrics_generate();
+
+    if (buffer)
+    {
+        statshm_write((const char*)GWBUF_DATA(buffer), GWBUF_LENGTH(buffer));
+        gwbuf_free(buffer);
+    }
+}
+
+/**
+ * Remove the statistics segment. The housekeeper may still be writing it and
+ * cannot be waited for, so the mapping is left to the exit of the process and
+ * only the name is removed. A reader that has the segment mapped keeps the
+ * last statistics.
+ */
+void statshm_close()
+{
+    hktask_remove("Statistics segment");
+
+    if (statshm_name)
+    {
+        shm_unlink(statshm_name);
+        free(statshm_name);
+        statshm_name = NULL;
+    }
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file strhash.c  An open addressing hashtable for string keys
+ *
+ * Each key has a home slot given by its hash. An entry that is added walks
+ * forward from its home slot and takes the place of any entry that is closer
+ * to its own home slot, the displaced entry then continues the walk. This
+ * Robin Hood probing keeps the distances of all entries close to each other,
+ * so a lookup can stop as soon as it meets an entry that is closer to its
+ * home than the key would be.
+ *
+ * A slot is only considered a match if both the hash and the inline prefix
+ * of the key match. The copy of the key is only read for keys that are
+ * longer than the prefix.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strhash.h>
+
+/** The table is grown when more than seven eighths of the slots are in use */
+#define STRHASH_FULL(table, n) ((n) > ((table)->mask + 1) / 8 * 7)
+
+/** The smallest number of slots */
+#define STRHASH_MIN_SLOTS 8
+
+static void *
+nullfn(void *data)
+{
+    return data;
+}
+
+/**
+ * The 32-bit FNV-1a hash of a string.
+ *
+ * @param key   The string
+ * @return The hash of the string
+ */
+static uint32_t
+strhash_hash(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*key)
+    {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Check whether a slot holds a key.
+ *
+ * @param slot          The slot
+ * @param key           The key
+ * @param prefix        The prefix of the key
+ * @return True if the slot holds the key
+ */
+static inline bool
+strhash_match(const STRHASH_SLOT *slot, const char *key, const char *prefix)
+{
+    if (memcmp(slot->prefix, prefix, STRHASH_PREFIX_LEN) != 0)
+    {
+        return false;
+    }
+
+    /** A prefix that ends in a NUL holds the whole key */
+    return slot->prefix[STRHASH_PREFIX_LEN - 1] == '\0' ||
+           strcmp(slot->key + STRHASH_PREFIX_LEN, key + STRHASH_PREFIX_LEN) == 0;
+}
+
+/**
+ * Find the slot of a key.
+ *
+ * @param table         The table
+ * @param key           The key
+ * @return The index of the slot or -1 if the key is not in the table
+ */
+static long
+strhash_find(const STRHASH *table, const char *key)
+{
+    char prefix[STRHASH_PREFIX_LEN];
+    uint32_t hash = strhash_hash(key);
+    uint32_t idx = hash & table->mask;
+    uint32_t dist = 1;
+
+    strncpy(prefix, key, STRHASH_PREFIX_LEN);
+
+    /** Empty slots have a distance of zero which also ends the search */
+    while (table->slots[idx].dist >= dist)
+    {
+        STRHASH_SLOT *slot = &table->slots[idx];
+
+        if (slot->hash == hash && strhash_match(slot, key, prefix))
+        {
+            return idx;
+        }
+        idx = (idx + 1) & table->mask;
+        dist++;
+    }
+    return -1;
+}
+
+/**
+ * Place an entry in the slot array. The key must not be in the table and
+ * there must be at least one empty slot.
+ *
+ * @param slots         The slot array
+ * @param mask          The number of slots minus one
+ * @param entry         The entry to place, its distance is ignored
+ */
+static void
+strhash_place(STRHASH_SLOT *slots, uint32_t mask, STRHASH_SLOT entry)
+{
+    uint32_t idx = entry.hash & mask;
+
+    entry.dist = 1;
+
+    while (slots[idx].dist != 0)
+    {
+        if (slots[idx].dist < entry.dist)
+        {
+            /** Take the slot from an entry that is closer to its home */
+            STRHASH_SLOT displaced = slots[idx];
+            slots[idx] = entry;
+            entry = displaced;
+        }
+        idx = (idx + 1) & mask;
+        entry.dist++;
+    }
+    slots[idx] = entry;
+}
+
+/**
+ * Double the number of slots of a table.
+ *
+ * @param table         The table
+ * @return True if the table was grown, false on memory allocation failure
+ */
+static bool
+strhash_grow(STRHASH *table)
+{
+    uint32_t mask = table->mask * 2 + 1;
+    STRHASH_SLOT *slots = calloc((size_t)mask + 1, sizeof(STRHASH_SLOT));
+
+    if (slots == NULL)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i <= table->mask; i++)
+    {
+        if (table->slots[i].dist)
+        {
+            strhash_place(slots, mask, table->slots[i]);
+        }
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->mask = mask;
+    return true;
+}
+
+/**
+ * Allocate a new table.
+ *
+ * @param size          The number of entries the table is expected to hold,
+ *                      the table grows beyond it as needed
+ * @param vfreefn       Optional function that frees the values
+ * @return The table or NULL on memory allocation failure
+ */
+STRHASH *
+strhash_alloc(int size, HASHMEMORYFN vfreefn)
+{
+    STRHASH *table = malloc(sizeof(STRHASH));
+    uint32_t n_slots = STRHASH_MIN_SLOTS;
+
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    while (n_slots < (1u << 30) && n_slots / 8 * 7 < (uint32_t)(size > 0 ? size : 0))
+    {
+        n_slots *= 2;
+    }
+
+    if ((table->slots = calloc(n_slots, sizeof(STRHASH_SLOT))) == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    table->mask = n_slots - 1;
+    table->n_elements = 0;
+    table->vfreefn = vfreefn ? vfreefn : nullfn;
+    return table;
+}
+
+/**
+ * Free a table along with its keys and values.
+ *
+ * @param table         The table to free
+ */
+void
+strhash_free(STRHASH *table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i <= table->mask; i++)
+    {
+        if (table->slots[i].dist)
+        {
+            free(table->slots[i].key);
+            table->vfreefn(table->slots[i].value);
+        }
+    }
+    free(table->slots);
+    free(table);
+}
+
+/**
+ * Add an entry to the table. The key is copied, the value is stored as is.
+ *
+ * @param table         The table
+ * @param key           The key
+ * @param value         The value
+ * @return The number of entries added, 0 if the key already exists or memory
+ *         allocation fails
+ */
+int
+strhash_add(STRHASH *table, const char *key, void *value)
+{
+    STRHASH_SLOT entry;
+
+    if (table == NULL || key == NULL || value == NULL ||
+        strhash_find(table, key) != -1)
+    {
+        return 0;
+    }
+
+    if (STRHASH_FULL(table, table->n_elements + 1) && !strhash_grow(table))
+    {
+        return 0;
+    }
+
+    if ((entry.key = strdup(key)) == NULL)
+    {
+        return 0;
+    }
+
+    entry.hash = strhash_hash(key);
+    entry.value = value;
+    strncpy(entry.prefix, key, STRHASH_PREFIX_LEN);
+    strhash_place(table->slots, table->mask, entry);
+    table->n_elements++;
+    return 1;
+}
+
+/**
+ * Delete an entry from the table. The key and the value are freed.
+ *
+ * @param table         The table
+ * @param key           The key of the entry
+ * @return The number of entries deleted
+ */
+int
+strhash_delete(STRHASH *table, const char *key)
+{
+    long found;
+
+    if (table == NULL || key == NULL || (found = strhash_find(table, key)) == -1)
+    {
+        return 0;
+    }
+
+    uint32_t idx = found;
+    uint32_t next = (idx + 1) & table->mask;
+
+    free(table->slots[idx].key);
+    table->vfreefn(table->slots[idx].value);
+
+    /** Shift the following entries back until one is in its home slot */
+    while (table->slots[next].dist > 1)
+    {
+        table->slots[idx] = table->slots[next];
+        table->slots[idx].dist--;
+        idx = next;
+        next = (next + 1) & table->mask;
+    }
+
+    memset(&table->slots[idx], 0, sizeof(STRHASH_SLOT));
+    table->n_elements--;
+    return 1;
+}
+
+/**
+ * Fetch the value of a key.
+ *
+ * @param table         The table
+ * @param key           The key
+ * @return The value or NULL if the key is not in the table
+ */
+void *
+strhash_fetch(const STRHASH *table, const char *key)
+{
+    long idx;
+
+    if (table == NULL || key == NULL || (idx = strhash_find(table, key)) == -1)
+    {
+        return NULL;
+    }
+    return table->slots[idx].value;
+}
+
+/**
+ * Return the number of entries in a table.
+ *
+ * @param table         The table
+ * @return The number of entries
+ */
+int
+strhash_size(const STRHASH *table)
+{
+    return table ? table->n_elements : 0;
+}
@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file benchmarkcore.c - Microbenchmarks of the core primitives
+ *
+ * Each benchmark is run with an increasing number of iterations until it runs
+ * for at least the minimum time. The benchmarks that are marked as threaded
+ * are repeated with 1, 2, 4 ... threads up to the maximum number of threads,
+ * each thread running the same number of iterations at the same time.
+ *
+ * The results are written as JSON in the same layout as Google Benchmark
+ * uses, so that the results of two builds can be compared with its tools:
+ *
+ * benchmark_core [-o FILE] [-t MAX_THREADS] [-m MIN_TIME_MS] [NAME]
+ *
+ * Only the benchmarks whose name contains NAME are run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <atomic.h>
+#include <buffer.h>
+#include <hashtable.h>
+#include <spinlock.h>
+#include <statistics.h>
+#include <modutil.h>
+#include <log_manager.h>
+#include <thread.h>
+
+/** Upper limit of the number of threads */
+#define BENCH_MAX_THREADS 64
+
+/** Number of keys in the hashtable that is read */
+#define BENCH_HASH_KEYS 1024
+
+/** Number of rows in the synthetic result set */
+#define BENCH_RESULTSET_ROWS 100
+
+typedef struct
+{
+    const char *name;                      /*< Name of the benchmark */
+    bool       threaded;                   /*< Run with multiple threads */
+    void       (*setup)();                 /*< Called before each run, may be NULL */
+    void       (*run)(int thread, int64_t iterations);
+    void       (*teardown)();              /*< Called after each run, may be NULL */
+} BENCHMARK;
+
+/** Arguments of a benchmark thread */
+typedef struct
+{
+    const BENCHMARK *bench;
+    int             thread;
+    int64_t         iterations;
+} BENCH_THREAD;
+
+static int threads_ready;
+static volatile int threads_go;
+
+/** Result of a benchmark, kept so that the compiler does not remove the work */
+static volatile int64_t bench_sink;
+
+static uint64_t
+bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Buffers
+ */
+
+static GWBUF *clone_source;
+
+static void
+bench_gwbuf_alloc(int thread, int64_t iterations)
+{
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        GWBUF *buf = gwbuf_alloc(1024);
+        gwbuf_free(buf);
+    }
+}
+
+static void
+setup_gwbuf_clone()
+{
+    clone_source = gwbuf_alloc(1024);
+}
+
+static void
+teardown_gwbuf_clone()
+{
+    gwbuf_free(clone_source);
+}
+
+static void
+bench_gwbuf_clone(int thread, int64_t iterations)
+{
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        GWBUF *buf = gwbuf_clone(clone_source);
+        gwbuf_free(buf);
+    }
+}
+
+static void
+bench_gwbuf_split(int thread, int64_t iterations)
+{
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        GWBUF *buf = gwbuf_append(gwbuf_alloc(512), gwbuf_alloc(512));
+        GWBUF *head = gwbuf_split(&buf, 768);
+        gwbuf_free(head);
+        gwbuf_free(buf);
+    }
+}
+
+/*
+ * Hashtable
+ */
+
+static HASHTABLE *hash;
+
+static int
+int_hash(void *key)
+{
+    return (int)(intptr_t)key;
+}
+
+static int
+int_cmp(void *a, void *b)
+{
+    return (intptr_t)a != (intptr_t)b;
+}
+
+static void
+setup_hashtable()
+{
+    hash = hashtable_alloc(BENCH_HASH_KEYS, int_hash, int_cmp);
+
+    for (intptr_t i = 1; i <= BENCH_HASH_KEYS; i++)
+    {
+        hashtable_add(hash, (void*)i, (void*)i);
+    }
+}
+
+static void
+teardown_hashtable()
+{
+    hashtable_free(hash);
+}
+
+static void
+bench_hashtable_fetch(int thread, int64_t iterations)
+{
+    int64_t found = 0;
+
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        intptr_t key = (i + thread) % BENCH_HASH_KEYS + 1;
+        found += hashtable_fetch(hash, (void*)key) != NULL;
+    }
+
+    bench_sink = found;
+}
+
+static void
+bench_hashtable_add(int thread, int64_t iterations)
+{
+    /** The keys of each thread are above the prefilled ones and distinct */
+    intptr_t key = BENCH_HASH_KEYS + 1 + thread;
+
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        hashtable_add(hash, (void*)key, (void*)key);
+        hashtable_delete(hash, (void*)key);
+    }
+}
+
+/*
+ * Spinlock
+ */
+
+static SPINLOCK bench_lock = SPINLOCK_INIT;
+static int64_t locked_counter;
+
+static void
+bench_spinlock(int thread, int64_t iterations)
+{
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        spinlock_acquire(&bench_lock);
+        locked_counter++;
+        spinlock_release(&bench_lock);
+    }
+}
+
+/*
+ * Statistics
+ */
+
+static ts_stats_t stats;
+
+static void
+setup_ts_stats()
+{
+    stats = ts_stats_alloc();
+}
+
+static void
+teardown_ts_stats()
+{
+    bench_sink = ts_stats_sum(stats);
+    ts_stats_free(stats);
+}
+
+static void
+bench_ts_stats_add(int thread, int64_t iterations)
+{
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        ts_stats_add(stats, 1);
+    }
+}
+
+/*
+ * Signal packet counting
+ */
+
+static GWBUF *resultset;
+
+/**
+ * Append a packet to a buffer
+ *
+ * @param buf Buffer to append to
+ * @param seq Sequence number of the packet
+ * @param payload The payload
+ * @param len Length of the payload
+ * @return The buffer with the packet appended
+ */
+static GWBUF *
+append_packet(GWBUF *buf, uint8_t *seq, const uint8_t *payload, int len)
+{
+    GWBUF *pkt = gwbuf_alloc(len + 4);
+    uint8_t *ptr = GWBUF_DATA(pkt);
+
+    ptr[0] = len;
+    ptr[1] = len >> 8;
+    ptr[2] = len >> 16;
+    ptr[3] = (*seq)++;
+    memcpy(ptr + 4, payload, len);
+
+    return gwbuf_append(buf, pkt);
+}
+
+/**
+ * Create a result set of one column and BENCH_RESULTSET_ROWS rows
+ */
+static void
+setup_resultset()
+{
+    static const uint8_t column_count[] = {0x01};
+    static const uint8_t column[] = {3, 'd', 'e', 'f', 0, 0, 0, 1, 'a', 0, 0x0c, 0x3f, 0,
+                                     0x0b, 0, 0, 0, 0x03, 0, 0, 0, 0, 0};
+    static const uint8_t eof[] = {0xfe, 0, 0, 0x02, 0};
+    static const uint8_t row[] = {10, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0'};
+    uint8_t seq = 1;
+    GWBUF *buf = NULL;
+
+    buf = append_packet(buf, &seq, column_count, sizeof(column_count));
+    buf = append_packet(buf, &seq, column, sizeof(column));
+    buf = append_packet(buf, &seq, eof, sizeof(eof));
+
+    for (int i = 0; i < BENCH_RESULTSET_ROWS; i++)
+    {
+        buf = append_packet(buf, &seq, row, sizeof(row));
+    }
+
+    buf = append_packet(buf, &seq, eof, sizeof(eof));
+    resultset = gwbuf_make_contiguous(buf);
+}
+
+static void
+teardown_resultset()
+{
+    gwbuf_free(resultset);
+}
+
+static void
+bench_count_signal_packets(int thread, int64_t iterations)
+{
+    int64_t found = 0;
+
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        int more = 0;
+        found += modutil_count_signal_packets(resultset, 0, 0, &more);
+    }
+
+    bench_sink = found;
+}
+
+/*
+ * Logging
+ */
+
+static void
+bench_log_write(int thread, int64_t iterations)
+{
+    for (int64_t i = 0; i < iterations; i++)
+    {
+        MXS_NOTICE("Benchmark message %" PRId64 " from thread %d.", i, thread);
+    }
+}
+
+static const BENCHMARK benchmarks[] =
+{
+    {"gwbuf_alloc_free", true, NULL, bench_gwbuf_alloc, NULL},
+    {"gwbuf_clone", true, setup_gwbuf_clone, bench_gwbuf_clone, teardown_gwbuf_clone},
+    {"gwbuf_split", true, NULL, bench_gwbuf_split, NULL},
+    {"hashtable_fetch", true, setup_hashtable, bench_hashtable_fetch, teardown_hashtable},
+    {"hashtable_add_delete", true, setup_hashtable, bench_hashtable_add, teardown_hashtable},
+    {"spinlock_acquire", true, NULL, bench_spinlock, NULL},
+    {"ts_stats_add", false, setup_ts_stats, bench_ts_stats_add, teardown_ts_stats},
+    {"modutil_count_signal_packets", false, setup_resultset, bench_count_signal_packets,
+     teardown_resultset},
+    {"log_write", true, NULL, bench_log_write, NULL},
+    {NULL}
+};
+
+static void
+bench_thread(void *data)
+{
+    BENCH_THREAD *arg = (BENCH_THREAD*)data;
+
+    atomic_add(&threads_ready, 1);
+    while (!threads_go)
+    {
+        ;
+    }
+
+    arg->bench->run(arg->thread, arg->iterations);
+}
+
+/**
+ * Run a benchmark once
+ *
+ * @param bench The benchmark
+ * @param n_threads Number of threads
+ * @param iterations Iterations of each thread
+ * @return The wall clock time of the run in nanoseconds
+ */
+static uint64_t
+bench_run_once(const BENCHMARK *bench, int n_threads, int64_t iterations)
+{
+    THREAD handles[BENCH_MAX_THREADS];
+    BENCH_THREAD args[BENCH_MAX_THREADS];
+    uint64_t start, end;
+
+    if (bench->setup)
+    {
+        bench->setup();
+    }
+
+    if (n_threads == 1)
+    {
+        start = bench_now();
+        bench->run(0, iterations);
+        end = bench_now();
+    }
+    else
+    {
+        threads_ready = 0;
+        threads_go = 0;
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            args[i].bench = bench;
+            args[i].thread = i;
+            args[i].iterations = iterations;
+            thread_start(&handles[i], bench_thread, &args[i]);
+        }
+
+        while (threads_ready < n_threads)
+        {
+            ;
+        }
+
+        start = bench_now();
+        threads_go = 1;
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            thread_wait(handles[i]);
+        }
+
+        end = bench_now();
+    }
+
+    if (bench->teardown)
+    {
+        bench->teardown();
+    }
+
+    return end - start;
+}
+
+/**
+ * Run a benchmark for at least the minimum time and write the result
+ *
+ * @param out Where the result is written
+ * @param bench The benchmark
+ * @param n_threads Number of threads
+ * @param min_time Minimum duration of the run in nanoseconds
+ * @param first Whether this is the first result
+ */
+static void
+bench_run(FILE *out, const BENCHMARK *bench, int n_threads, uint64_t min_time, bool first)
+{
+    int64_t iterations = 1;
+    uint64_t elapsed;
+
+    while ((elapsed = bench_run_once(bench, n_threads, iterations)) < min_time)
+    {
+        /** Aim a bit above the minimum so that the next round is the last */
+        int64_t next = iterations * 100;
+
+        if (elapsed)
+        {
+            next = iterations * 1.4 * min_time / elapsed;
+        }
+
+        if (next < iterations * 2)
+        {
+            next = iterations * 2;
+        }
+        else if (next > iterations * 100)
+        {
+            next = iterations * 100;
+        }
+
+        iterations = next;
+    }
+
+    double ns = (double)elapsed / iterations;
+
+    fprintf(out, "%s    {\n", first ? "" : ",\n");
+    fprintf(out, "      \"name\": \"%s/threads:%d\",\n", bench->name, n_threads);
+    fprintf(out, "      \"iterations\": %" PRId64 ",\n", iterations);
+    fprintf(out, "      \"real_time\": %.2f,\n", ns);
+    fprintf(out, "      \"cpu_time\": %.2f,\n", ns);
+    fprintf(out, "      \"time_unit\": \"ns\",\n");
+    fprintf(out, "      \"threads\": %d,\n", n_threads);
+    fprintf(out, "      \"items_per_second\": %.0f\n", n_threads * 1e9 / ns);
+    fprintf(out, "    }");
+    fflush(out);
+
+    fprintf(stderr, "%-30s %3d threads %12.2f ns %12" PRId64 " iterations\n",
+            bench->name, n_threads, ns, iterations);
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *out = stdout;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t min_time = 500000000;
+    const char *filter = NULL;
+    char date[64];
+    int c;
+
+    while ((c = getopt(argc, argv, "o:t:m:")) != -1)
+    {
+        switch (c)
+        {
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+
+        case 'm':
+            min_time = (uint64_t)atoi(optarg) * 1000000;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-o FILE] [-t MAX_THREADS] [-m MIN_TIME_MS] [NAME]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc)
+    {
+        filter = argv[optind];
+    }
+
+    if (max_threads < 1)
+    {
+        max_threads = 1;
+    }
+    else if (max_threads > BENCH_MAX_THREADS)
+    {
+        max_threads = BENCH_MAX_THREADS;
+    }
+
+    ts_stats_init();
+    mxs_log_init(NULL, "/tmp", MXS_LOG_TARGET_FS);
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+    fprintf(out, "{\n  \"context\": {\n");
+    fprintf(out, "    \"date\": \"%s\",\n", date);
+    fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+#if defined(SS_DEBUG)
+    fprintf(out, "    \"library_build_type\": \"debug\"\n");
+#else
+    fprintf(out, "    \"library_build_type\": \"release\"\n");
+#endif
+    fprintf(out, "  },\n  \"benchmarks\": [\n");
+
+    bool first = true;
+
+    for (int i = 0; benchmarks[i].name; i++)
+    {
+        if (filter && strstr(benchmarks[i].name, filter) == NULL)
+        {
+            continue;
+        }
+
+        for (int n = 1; n <= (benchmarks[i].threaded ? max_threads : 1); n *= 2)
+        {
+            bench_run(out, &benchmarks[i], n, min_time, first);
+            first = false;
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    mxs_log_finish();
+    ts_stats_end();
+    return 0;
+}
@@ -0,0 +1,602 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file loadgen.c - Load generator for throughput regression testing
+ *
+ * Opens a number of client connections to a MaxScale service, each driven by
+ * a thread of its own, and executes a weighted mix of queries on them as fast
+ * as the replies arrive. After a warm-up period the queries are counted and
+ * timed for a fixed duration and the throughput, the latency percentiles and,
+ * if the process ID of MaxScale is given, the CPU time MaxScale used per
+ * query are reported.
+ *
+ * The queries use the table loadgen in the given database, which is created
+ * and filled with the -S option:
+ *
+ * point   SELECT of one row by the primary key
+ * range   SELECT of 100 consecutive rows
+ * update  UPDATE of one row by the primary key
+ * trivial SELECT 1, which only measures the round trip
+ *
+ * The random numbers are seeded from the client number, so two runs with the
+ * same arguments execute the same queries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <mysql.h>
+
+#include <atomic.h>
+#include <statistics.h>
+#include <thread.h>
+
+/** Number of rows in the table */
+#define LOADGEN_ROWS 10000
+
+/** Rows read by a range query */
+#define LOADGEN_RANGE 100
+
+/** Upper limit of the number of clients */
+#define LOADGEN_MAX_CLIENTS 1024
+
+typedef enum
+{
+    QUERY_POINT,
+    QUERY_RANGE,
+    QUERY_UPDATE,
+    QUERY_TRIVIAL,
+    QUERY_N_TYPES
+} query_type_t;
+
+static const char *query_names[QUERY_N_TYPES] = {"point", "range", "update", "trivial"};
+
+/** The connection parameters */
+static const char *host = "127.0.0.1";
+static int port = 4006;
+static const char *user = "maxuser";
+static const char *password = "maxpwd";
+static const char *database = "test";
+
+/** Weights of the query types */
+static int weights[QUERY_N_TYPES] = {80, 10, 10, 0};
+static int total_weight = 100;
+
+/** The phase of the run, changed by the main thread */
+static volatile int measuring = 0;
+static volatile int stopping = 0;
+static int clients_connected = 0;
+
+/**
+ * The state of one client
+ */
+typedef struct
+{
+    int          id;
+    unsigned int seed;                      /*< State of rand_r */
+    int64_t      queries;                   /*< Queries completed while measuring */
+    int64_t      errors;                    /*< Queries that failed while measuring */
+    int64_t      latency[TS_LOG_BUCKETS];   /*< Latencies in microseconds */
+    bool         failed;                    /*< The client could not connect */
+} CLIENT;
+
+static uint64_t
+loadgen_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Parse the query mix, e.g. point=70,range=10,update=20
+ *
+ * @param mix The query mix
+ * @return True if the mix is valid
+ */
+static bool
+parse_mix(char *mix)
+{
+    char *saveptr;
+    int new_weights[QUERY_N_TYPES] = {0};
+    int total = 0;
+
+    for (char *tok = strtok_r(mix, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(tok, '=');
+        int i;
+
+        if (value == NULL)
+        {
+            return false;
+        }
+
+        *value++ = '\0';
+
+        for (i = 0; i < QUERY_N_TYPES && strcmp(tok, query_names[i]) != 0; i++)
+        {
+            ;
+        }
+
+        if (i == QUERY_N_TYPES || atoi(value) < 0)
+        {
+            return false;
+        }
+
+        new_weights[i] = atoi(value);
+        total += new_weights[i];
+    }
+
+    if (total == 0)
+    {
+        return false;
+    }
+
+    memcpy(weights, new_weights, sizeof(weights));
+    total_weight = total;
+    return true;
+}
+
+static MYSQL *
+loadgen_connect()
+{
+    MYSQL *conn = mysql_init(NULL);
+
+    if (conn && mysql_real_connect(conn, host, user, password, database, port, NULL, 0) == NULL)
+    {
+        fprintf(stderr, "Failed to connect to %s:%d: %s\n", host, port, mysql_error(conn));
+        mysql_close(conn);
+        conn = NULL;
+    }
+
+    return conn;
+}
+
+/**
+ * Create and fill the table that the queries use
+ *
+ * @return True on success
+ */
+static bool
+prepare_table()
+{
+    MYSQL *conn = loadgen_connect();
+    char query[LOADGEN_RANGE * 32 + 64];
+    bool rval = conn != NULL;
+
+    if (rval && (mysql_query(conn, "DROP TABLE IF EXISTS loadgen") ||
+                 mysql_query(conn, "CREATE TABLE loadgen (id INT PRIMARY KEY, val INT, "
+                             "pad CHAR(60))")))
+    {
+        fprintf(stderr, "Failed to create the table: %s\n", mysql_error(conn));
+        rval = false;
+    }
+
+    for (int i = 0; rval && i < LOADGEN_ROWS; i += LOADGEN_RANGE)
+    {
+        int len = sprintf(query, "INSERT INTO loadgen VALUES ");
+
+        for (int j = i; j < i + LOADGEN_RANGE; j++)
+        {
+            len += sprintf(query + len, "%s(%d, %d, 'loadgen')", j > i ? "," : "", j, j);
+        }
+
+        if (mysql_query(conn, query))
+        {
+            fprintf(stderr, "Failed to fill the table: %s\n", mysql_error(conn));
+            rval = false;
+        }
+    }
+
+    if (conn)
+    {
+        mysql_close(conn);
+    }
+
+    return rval;
+}
+
+/**
+ * Pick the next query
+ *
+ * @param client The client
+ * @param query Buffer where the query is written
+ * @param size Size of the buffer
+ */
+static void
+next_query(CLIENT *client, char *query, size_t size)
+{
+    int pick = rand_r(&client->seed) % total_weight;
+    int id = rand_r(&client->seed) % LOADGEN_ROWS;
+    int type = 0;
+
+    while (pick >= weights[type])
+    {
+        pick -= weights[type++];
+    }
+
+    switch (type)
+    {
+    case QUERY_POINT:
+        snprintf(query, size, "SELECT id, val, pad FROM loadgen WHERE id = %d", id);
+        break;
+
+    case QUERY_RANGE:
+        snprintf(query, size, "SELECT id, val, pad FROM loadgen WHERE id BETWEEN %d AND %d",
+                 id, id + LOADGEN_RANGE - 1);
+        break;
+
+    case QUERY_UPDATE:
+        snprintf(query, size, "UPDATE loadgen SET val = val + 1 WHERE id = %d", id);
+        break;
+
+    default:
+        snprintf(query, size, "SELECT 1");
+        break;
+    }
+}
+
+static void
+client_thread(void *data)
+{
+    CLIENT *client = (CLIENT*)data;
+    char query[256];
+    MYSQL *conn;
+
+    mysql_thread_init();
+
+    if ((conn = loadgen_connect()) == NULL)
+    {
+        client->failed = true;
+        atomic_add(&clients_connected, 1);
+        mysql_thread_end();
+        return;
+    }
+
+    atomic_add(&clients_connected, 1);
+
+    while (!stopping)
+    {
+        next_query(client, query, sizeof(query));
+
+        uint64_t start = loadgen_now();
+        bool ok = mysql_query(conn, query) == 0;
+
+        if (ok)
+        {
+            MYSQL_RES *res = mysql_store_result(conn);
+
+            if (res)
+            {
+                mysql_free_result(res);
+            }
+            else
+            {
+                ok = mysql_field_count(conn) == 0;
+            }
+        }
+
+        int64_t usec = (loadgen_now() - start) / 1000;
+
+        if (measuring && !stopping)
+        {
+            int bucket = ts_log_bucket(usec);
+
+            client->latency[bucket < TS_LOG_BUCKETS ? bucket : TS_LOG_BUCKETS - 1]++;
+            client->queries++;
+
+            if (!ok)
+            {
+                client->errors++;
+            }
+        }
+
+        if (!ok && mysql_errno(conn) >= 2000)
+        {
+            /** A client error, e.g. a lost connection, ends the client */
+            fprintf(stderr, "Client %d: %s\n", client->id, mysql_error(conn));
+            break;
+        }
+    }
+
+    mysql_close(conn);
+    mysql_thread_end();
+}
+
+/**
+ * Read the CPU time of a process
+ *
+ * @param pid The process ID
+ * @return The user and system CPU time in microseconds or -1 on error
+ */
+static int64_t
+process_cpu_time(int pid)
+{
+    char path[64];
+    char buf[1024];
+    unsigned long utime, stime;
+    FILE *file;
+    int64_t rval = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    if ((file = fopen(path, "r")))
+    {
+        /** The command name may contain spaces, the fields start after it */
+        char *ptr = fgets(buf, sizeof(buf), file) ? strrchr(buf, ')') : NULL;
+
+        if (ptr && sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                          &utime, &stime) == 2)
+        {
+            rval = (int64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+        }
+
+        fclose(file);
+    }
+
+    return rval;
+}
+
+/**
+ * Get a percentile of the merged latencies
+ *
+ * @param latency The merged latency histogram
+ * @param total Number of values in the histogram
+ * @param percentile The percentile, e.g. 99.9
+ * @return The percentile in microseconds
+ */
+static int64_t
+latency_percentile(const int64_t *latency, int64_t total, double percentile)
+{
+    int64_t target = (int64_t)(total * percentile / 100.0 + 0.5);
+    int64_t sum = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < TS_LOG_BUCKETS - 1; bucket++)
+    {
+        sum += latency[bucket];
+
+        if (sum >= target && sum > 0)
+        {
+            break;
+        }
+    }
+
+    return ts_log_bucket_limit(bucket);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [OPTIONS]\n"
+            "  -h HOST      MaxScale host (127.0.0.1)\n"
+            "  -P PORT      Port of the service (4006)\n"
+            "  -u USER      User (maxuser)\n"
+            "  -p PASSWORD  Password (maxpwd)\n"
+            "  -D DATABASE  Database of the table (test)\n"
+            "  -c CLIENTS   Concurrent client connections (16)\n"
+            "  -d SECONDS   Duration of the measurement (30)\n"
+            "  -w SECONDS   Warm-up before the measurement (5)\n"
+            "  -m MIX       Query mix (point=80,range=10,update=10,trivial=0)\n"
+            "  -x PID       Process ID of MaxScale, to report the CPU time per query\n"
+            "  -o FILE      Append the result as a line of JSON to FILE\n"
+            "  -S           Create and fill the table and exit\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int n_clients = 16;
+    int duration = 30;
+    int warmup = 5;
+    int pid = 0;
+    const char *output = NULL;
+    bool setup = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "h:P:u:p:D:c:d:w:m:x:o:S")) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            host = optarg;
+            break;
+
+        case 'P':
+            port = atoi(optarg);
+            break;
+
+        case 'u':
+            user = optarg;
+            break;
+
+        case 'p':
+            password = optarg;
+            break;
+
+        case 'D':
+            database = optarg;
+            break;
+
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            break;
+
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+
+        case 'm':
+            if (!parse_mix(optarg))
+            {
+                fprintf(stderr, "Invalid query mix.\n");
+                return 1;
+            }
+            break;
+
+        case 'x':
+            pid = atoi(optarg);
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'S':
+            setup = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (n_clients < 1 || n_clients > LOADGEN_MAX_CLIENTS || duration < 1 || warmup < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mysql_library_init(0, NULL, NULL);
+
+    if (setup)
+    {
+        bool ok = prepare_table();
+        mysql_library_end();
+        return ok ? 0 : 1;
+    }
+
+    CLIENT *clients = calloc(n_clients, sizeof(CLIENT));
+    THREAD *threads = calloc(n_clients, sizeof(THREAD));
+
+    if (clients == NULL || threads == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < n_clients; i++)
+    {
+        clients[i].id = i;
+        clients[i].seed = i + 1;
+        thread_start(&threads[i], client_thread, &clients[i]);
+    }
+
+    while (clients_connected < n_clients)
+    {
+        usleep(10000);
+    }
+
+    sleep(warmup);
+
+    int64_t cpu_start = pid ? process_cpu_time(pid) : -1;
+    uint64_t start = loadgen_now();
+    measuring = 1;
+
+    sleep(duration);
+
+    stopping = 1;
+    uint64_t elapsed = loadgen_now() - start;
+    int64_t cpu_end = pid ? process_cpu_time(pid) : -1;
+
+    for (int i = 0; i < n_clients; i++)
+    {
+        thread_wait(threads[i]);
+    }
+
+    int64_t latency[TS_LOG_BUCKETS] = {0};
+    int64_t queries = 0;
+    int64_t errors = 0;
+    int failed = 0;
+
+    for (int i = 0; i < n_clients; i++)
+    {
+        for (int j = 0; j < TS_LOG_BUCKETS; j++)
+        {
+            latency[j] += clients[i].latency[j];
+        }
+
+        queries += clients[i].queries;
+        errors += clients[i].errors;
+        failed += clients[i].failed;
+    }
+
+    double qps = queries * 1e9 / elapsed;
+    int64_t p50 = latency_percentile(latency, queries, 50);
+    int64_t p99 = latency_percentile(latency, queries, 99);
+    int64_t p999 = latency_percentile(latency, queries, 99.9);
+    double cpu = cpu_start >= 0 && cpu_end >= 0 && queries ?
+                 (double)(cpu_end - cpu_start) / queries : -1;
+
+    printf("Clients:          %d (%d failed to connect)\n", n_clients, failed);
+    printf("Queries:          %" PRId64 " (%" PRId64 " errors)\n", queries, errors);
+    printf("Queries/second:   %.0f\n", qps);
+    printf("Latency p50:      %" PRId64 " us\n", p50);
+    printf("Latency p99:      %" PRId64 " us\n", p99);
+    printf("Latency p99.9:    %" PRId64 " us\n", p999);
+
+    if (cpu >= 0)
+    {
+        printf("CPU per query:    %.1f us\n", cpu);
+    }
+
+    if (output)
+    {
+        FILE *file = fopen(output, "a");
+
+        if (file == NULL)
+        {
+            perror(output);
+            return 1;
+        }
+
+        fprintf(file, "{\"clients\": %d, \"duration\": %d, \"mix\": {", n_clients, duration);
+
+        for (int i = 0; i < QUERY_N_TYPES; i++)
+        {
+            fprintf(file, "%s\"%s\": %d", i ? ", " : "", query_names[i], weights[i]);
+        }
+
+        fprintf(file, "}, \"queries\": %" PRId64 ", \"errors\": %" PRId64 ", \"qps\": %.0f, "
+                "\"p50_us\": %" PRId64 ", \"p99_us\": %" PRId64 ", \"p999_us\": %" PRId64,
+                queries, errors, qps, p50, p99, p999);
+
+        if (cpu >= 0)
+        {
+            fprintf(file, ", \"cpu_us_per_query\": %.1f", cpu);
+        }
+
+        fprintf(file, "}\n");
+        fclose(file);
+    }
+
+    free(clients);
+    free(threads);
+    mysql_library_end();
+
+    return failed || queries == 0 ? 1 : 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/bash
+#
+# Run the load generator against a MaxScale started with the given
+# configuration and append the result to a file of JSON lines.
+#
+# Usage: loadtest.sh <maxscale binary> <configuration> <result file> [loadgen options]
+#
+# The configuration must contain everything that MaxScale needs to run from a
+# scratch directory, loadtest.cnf is an example. The table of the load
+# generator is created before the run. Each run is labelled with the current
+# commit so that the throughput of consecutive commits can be compared.
+
+if [ $# -lt 3 ]
+then
+    echo "Usage: loadtest.sh <maxscale binary> <configuration> <result file> [loadgen options]"
+    exit 1
+fi
+
+MAXSCALE=$1
+CONFIG=$2
+RESULT=$3
+shift 3
+
+LOADGEN=$(dirname $0)/loadgen
+[ -x $LOADGEN ] || LOADGEN=$(dirname $MAXSCALE)/loadgen
+WORKDIR=$(mktemp -d)
+
+$MAXSCALE -d -f $CONFIG -L $WORKDIR -D $WORKDIR -A $WORKDIR -P $WORKDIR &> $WORKDIR/stdout &
+PID=$!
+
+# Wait until the service accepts connections
+for i in $(seq 1 50)
+do
+    $LOADGEN "$@" -S &> /dev/null && break
+    sleep 0.2
+done
+
+TMPRESULT=$WORKDIR/result.json
+$LOADGEN "$@" -x $PID -o $TMPRESULT
+RVAL=$?
+
+kill $PID
+wait $PID
+
+if [ $RVAL -eq 0 ]
+then
+    COMMIT=$(git -C $(dirname $0) rev-parse --short HEAD 2> /dev/null)
+    sed -e "s/^{/{\"commit\": \"$COMMIT\", /" $TMPRESULT >> $RESULT
+else
+    echo "The load test failed, the MaxScale log is in $WORKDIR"
+    exit $RVAL
+fi
+
+rm -rf $WORKDIR
@@ -39,6 +39,8 @@
 #include <mysql_auth.h>
 #include <listener.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
 
 extern int setipaddress();
 
@@ -308,6 +310,235 @@ int set_and_get_mysql_users_wildcards(char *username, char *hostname, char *pass
     return ret;
 }
 
+/**
+ * Save users to a cache file and load them into another table
+ *
+ * @return 0 on success, 1 on failure
+ */
+int save_and_load_mysql_users()
+{
+    const char *filename = "/tmp/test_mysql_users.cache";
+    const char *users[] = {"alpha", "beta", "gamma"};
+    char *resources[] = {NULL, "db1", ""};
+    USERS *saved = mysql_users_alloc();
+    USERS *loaded = mysql_users_alloc();
+    MYSQL_USER_HOST key;
+    int rval = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        memset(&key, 0, sizeof(key));
+        key.user = (char*)users[i];
+        key.resource = resources[i];
+        key.ipv4.sin_family = AF_INET;
+        key.ipv4.sin_addr.s_addr = htonl(0xC0A80000 + i);
+        key.netmask = 32;
+        snprintf(key.hostname, sizeof(key.hostname), "192.168.0.%d", i);
+        mysql_users_add(saved, &key, "password");
+    }
+
+    if (dbusers_save(saved, filename) != 3 || dbusers_load(loaded, filename) != 3 ||
+        loaded->stats.n_entries != 3)
+    {
+        fprintf(stderr, "Saving and loading the users cache failed\n");
+        rval = 1;
+    }
+
+    for (int i = 0; i < 3 && rval == 0; i++)
+    {
+        char *auth;
+
+        memset(&key, 0, sizeof(key));
+        key.user = (char*)users[i];
+        key.resource = resources[i];
+        key.ipv4.sin_family = AF_INET;
+        key.ipv4.sin_addr.s_addr = htonl(0xC0A80000 + i);
+        key.netmask = 32;
+
+        if ((auth = mysql_users_fetch(loaded, &key)) == NULL || strcmp(auth, "password") != 0)
+        {
+            fprintf(stderr, "User %s was not found in the loaded users\n", users[i]);
+            rval = 1;
+        }
+    }
+
+    unlink(filename);
+    users_free(saved);
+    users_free(loaded);
+    return rval;
+}
+
+/**
+ * Check that the most specific grant of a user is found
+ *
+ * @return 0 on success, 1 on failure
+ */
+int find_most_specific_grant()
+{
+    USERS *users = mysql_users_alloc();
+    MYSQL_USER_HOST key;
+    char *auth;
+    int rval = 0;
+
+    add_mysql_users_with_host_ipv4(users, "grant", "%", "any", "Y", NULL);
+    add_mysql_users_with_host_ipv4(users, "grant", "10.%", "net8", "Y", NULL);
+    add_mysql_users_with_host_ipv4(users, "grant", "10.1.1.%", "net24", "N", "db1");
+    add_mysql_users_with_host_ipv4(users, "grant", "10.1.1.1", "exact", "Y", NULL);
+
+    memset(&key, 0, sizeof(key));
+    key.user = "grant";
+    key.ipv4.sin_family = AF_INET;
+    key.resource = "";
+
+    const char *addrs[] = {"10.1.1.1", "10.1.1.2", "10.1.1.2", "10.2.2.2", "192.168.0.1"};
+    const char *dbs[] = {"", "db1", "db2", "", ""};
+    const char *expected[] = {"exact", "net24", "net8", "net8", "any"};
+
+    for (int i = 0; i < 5; i++)
+    {
+        inet_aton(addrs[i], &key.ipv4.sin_addr);
+        key.resource = (char*)dbs[i];
+
+        if ((auth = mysql_users_find(users, &key, true)) == NULL || strcmp(auth, expected[i]) != 0)
+        {
+            fprintf(stderr, "Expected grant %s for %s, got %s\n", expected[i], addrs[i],
+                    auth ? auth : "nothing");
+            rval = 1;
+        }
+    }
+
+    /** Without wildcards only the exact address matches */
+    inet_aton("10.1.1.2", &key.ipv4.sin_addr);
+    key.resource = "";
+
+    if (mysql_users_find(users, &key, false) != NULL)
+    {
+        fprintf(stderr, "A wildcard grant matched when wildcards are not allowed\n");
+        rval = 1;
+    }
+
+    users_free(users);
+    return rval;
+}
+
+/** The users table the merge test reads while it is merged into */
+static USERS *merge_users;
+static volatile bool merge_done;
+
+/**
+ * Find a user of the merge test by the address of its only grant
+ *
+ * @return The authentication data or NULL if the user was not found
+ */
+static char *find_merged_user(char *user, const char *addr)
+{
+    MYSQL_USER_HOST key;
+
+    memset(&key, 0, sizeof(key));
+    key.user = user;
+    key.resource = "";
+    key.ipv4.sin_family = AF_INET;
+    inet_aton(addr, &key.ipv4.sin_addr);
+    return mysql_users_find(merge_users, &key, true);
+}
+
+/**
+ * Look up an unchanged and a changed user until the merges are done
+ *
+ * @return The number of failed lookups
+ */
+static void *merge_reader(void *data)
+{
+    long failures = 0;
+
+    while (!merge_done)
+    {
+        if (find_merged_user("ann", "10.0.0.2") == NULL ||
+            find_merged_user("amy", "10.0.0.1") == NULL)
+        {
+            failures++;
+        }
+    }
+
+    return (void*)failures;
+}
+
+/**
+ * Check that a merge adds, changes and removes the users of the changed
+ * prefixes only and that the users that exist are found during the merge
+ *
+ * @return 0 on success, 1 on failure
+ */
+int merge_mysql_users()
+{
+    USERS *fresh[2] = {mysql_users_alloc(), mysql_users_alloc()};
+    char *prefixes[] = {"a"};
+    pthread_t reader;
+    void *failures;
+    char *auth;
+    int rval = 0;
+
+    merge_users = mysql_users_alloc();
+    add_mysql_users_with_host_ipv4(merge_users, "amy", "10.0.0.1", "old", "Y", NULL);
+    add_mysql_users_with_host_ipv4(merge_users, "ann", "10.0.0.2", "same", "Y", NULL);
+    add_mysql_users_with_host_ipv4(merge_users, "axel", "10.0.0.3", "gone", "Y", NULL);
+    add_mysql_users_with_host_ipv4(merge_users, "bob", "10.0.0.4", "other", "Y", NULL);
+
+    /** The users with the prefix 'a' as they are after the change and before it */
+    add_mysql_users_with_host_ipv4(fresh[0], "amy", "10.0.0.1", "new", "Y", NULL);
+    add_mysql_users_with_host_ipv4(fresh[0], "ann", "10.0.0.2", "same", "Y", NULL);
+    add_mysql_users_with_host_ipv4(fresh[0], "alf", "10.0.0.5", "added", "Y", NULL);
+    add_mysql_users_with_host_ipv4(fresh[1], "amy", "10.0.0.1", "old", "Y", NULL);
+    add_mysql_users_with_host_ipv4(fresh[1], "ann", "10.0.0.2", "same", "Y", NULL);
+    add_mysql_users_with_host_ipv4(fresh[1], "axel", "10.0.0.3", "gone", "Y", NULL);
+
+    if (mysql_users_merge(merge_users, fresh[0], prefixes, 1) != 3)
+    {
+        fprintf(stderr, "Merging one added, one changed and one removed user failed\n");
+        rval = 1;
+    }
+
+    if ((auth = find_merged_user("amy", "10.0.0.1")) == NULL || strcmp(auth, "new") != 0 ||
+        (auth = find_merged_user("ann", "10.0.0.2")) == NULL || strcmp(auth, "same") != 0 ||
+        (auth = find_merged_user("alf", "10.0.0.5")) == NULL || strcmp(auth, "added") != 0 ||
+        (auth = find_merged_user("bob", "10.0.0.4")) == NULL || strcmp(auth, "other") != 0 ||
+        find_merged_user("axel", "10.0.0.3") != NULL)
+    {
+        fprintf(stderr, "The merged users are not the users that were loaded\n");
+        rval = 1;
+    }
+
+    /** The changed and unchanged users must be found while they are merged */
+    merge_done = false;
+    pthread_create(&reader, NULL, merge_reader, NULL);
+
+    for (int i = 1; i <= 1000; i++)
+    {
+        mysql_users_merge(merge_users, fresh[i % 2], prefixes, 1);
+    }
+
+    merge_done = true;
+    pthread_join(reader, &failures);
+
+    if (failures != NULL)
+    {
+        fprintf(stderr, "Users were not found %ld times during the merges\n", (long)failures);
+        rval = 1;
+    }
+
+    if ((auth = find_merged_user("amy", "10.0.0.1")) == NULL || strcmp(auth, "new") != 0 ||
+        merge_users->stats.n_entries != 4)
+    {
+        fprintf(stderr, "The users are not the last ones that were merged\n");
+        rval = 1;
+    }
+
+    users_free(fresh[0]);
+    users_free(fresh[1]);
+    users_free(merge_users);
+    return rval;
+}
+
 int main()
 {
     int ret;
@@ -536,6 +767,15 @@ int main()
     }
     assert(ret == 0);
 
+    ret = save_and_load_mysql_users();
+    assert(ret == 0);
+
+    ret = find_most_specific_grant();
+    assert(ret == 0);
+
+    ret = merge_mysql_users();
+    assert(ret == 0);
+
     fprintf(stderr, "----------------\n");
     fprintf(stderr, "<<< Test completed\n");
 
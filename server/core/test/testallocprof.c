@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testallocprof.c - The counters of the allocation profiler and of the
+ * profiles of the filters and routers
+ *
+ * The counters of the allocation profiler are read from what allocprof_print
+ * prints into a DCB that keeps the output. The buffers of the output are
+ * sampled too, so the test samples sessions, which nothing else allocates.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+#include <statistics.h>
+#include <allocprof.h>
+#include <profile.h>
+#include <dcb.h>
+
+#define N_OBJECTS   400
+#define OBJECT_SIZE 100
+#define RATE        4
+
+static DCB dcb;
+static char output[65536];
+
+static int
+output_write(DCB *dcb, GWBUF *queue)
+{
+    size_t len = strlen(output);
+
+    snprintf(output + len, sizeof(output) - len, "%.*s",
+             (int)GWBUF_LENGTH(queue), (char*)GWBUF_DATA(queue));
+    gwbuf_free(queue);
+    return 1;
+}
+
+/** The counters of the allocation site of the sessions */
+typedef struct
+{
+    int64_t samples;
+    int64_t outstanding;
+    int64_t outstanding_bytes;
+    int64_t allocated;
+    int64_t allocated_bytes;
+} SITE_COUNTERS;
+
+static void
+read_site(SITE_COUNTERS *c)
+{
+    const char *site;
+
+    *output = '\0';
+    allocprof_print(&dcb);
+    site = strstr(output, ": session, ");
+    ss_info_dassert(site, "There should be a site of sessions");
+    ss_info_dassert(strstr(site + 1, ": session, ") == NULL,
+                    "The sessions should have one allocation site");
+    ss_info_dassert(sscanf(site, ": session, %" SCNd64 " samples\n"
+                           "\tOutstanding:   %" SCNd64 " objects, %" SCNd64 " bytes\n"
+                           "\tAllocated:     %" SCNd64 " objects, %" SCNd64 " bytes\n",
+                           &c->samples, &c->outstanding, &c->outstanding_bytes,
+                           &c->allocated, &c->allocated_bytes) == 5,
+                    "The counters of the site should be printed");
+}
+
+/**
+ * test1    A profile without counters is freed and reports no calls
+ *
+ */
+static int
+test1()
+{
+    PROFILE profile;
+
+    ss_dfprintf(stderr, "testallocprof : Free a profile without counters");
+    memset(&profile, 0, sizeof(profile));
+    /** This is done before the statistics are initialized */
+    profile_free(&profile);
+    ss_info_dassert(profile.cycles == NULL && profile.histogram == NULL,
+                    "The profile should have no counters");
+    ss_info_dassert(profile_calls(&profile) == 0 && profile_average(&profile) == 0 &&
+                    profile_percentile(&profile, 99) == 0,
+                    "A profile without counters should have no calls");
+
+    *output = '\0';
+    profile_print(&dcb, "", &profile);
+    ss_info_dassert(*output == '\0', "A profile without counters should not be printed");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    The calls timed in a profile are counted and its counters freed
+ *
+ */
+static int
+test2()
+{
+    PROFILE profile;
+    PROFILE_CALL call;
+
+    ss_dfprintf(stderr, "testallocprof : Count the calls of a profile");
+    memset(&profile, 0, sizeof(profile));
+    ss_info_dassert(profile_alloc(&profile), "The counters should be allocated");
+
+    for (int i = 0; i < 10; i++)
+    {
+        profile_begin(&call);
+        profile_end(&call, &profile);
+    }
+    ss_info_dassert(profile_calls(&profile) == 10, "The calls should be counted");
+
+    profile_free(&profile);
+    ss_info_dassert(profile.cycles == NULL && profile.histogram == NULL,
+                    "The counters should be freed");
+    ss_info_dassert(profile_calls(&profile) == 0, "A freed profile should have no calls");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    Each sample counts for as many allocations as the rate, and the
+ *          samples are released also after the profiler has been disabled
+ *
+ */
+static int
+test3()
+{
+    static struct alloc_sample *samples[N_OBJECTS];
+    SITE_COUNTERS c;
+    int64_t n_samples = 0;
+    int64_t n_released = 0;
+
+    ss_dfprintf(stderr, "testallocprof : Count the sampled allocations");
+    allocprof_set_rate(RATE);
+
+    for (int i = 0; i < N_OBJECTS; i++)
+    {
+        allocprof_alloc(&samples[i], ALLOCPROF_SESSION, OBJECT_SIZE);
+        n_samples += samples[i] != NULL;
+    }
+    ss_info_dassert(n_samples > 0 && n_samples < N_OBJECTS, "Some allocations should be sampled");
+
+    read_site(&c);
+    ss_info_dassert(c.samples == n_samples, "The samples should be counted");
+    ss_info_dassert(c.allocated == n_samples * RATE &&
+                    c.allocated_bytes == n_samples * RATE * OBJECT_SIZE,
+                    "Each sample should count for as many allocations as the rate");
+    ss_info_dassert(c.outstanding == c.allocated && c.outstanding_bytes == c.allocated_bytes,
+                    "All of the objects should be outstanding");
+
+    for (int i = 0; i < N_OBJECTS / 2; i++)
+    {
+        n_released += samples[i] != NULL;
+        allocprof_free(&samples[i]);
+        ss_info_dassert(samples[i] == NULL, "The sample should be released");
+    }
+
+    read_site(&c);
+    ss_info_dassert(c.outstanding == (n_samples - n_released) * RATE &&
+                    c.outstanding_bytes == (n_samples - n_released) * RATE * OBJECT_SIZE,
+                    "The released samples should no longer be outstanding");
+    ss_info_dassert(c.allocated == n_samples * RATE, "The allocations should not change");
+    ss_dfprintf(stderr, "\t..done\nRelease the samples after disabling the profiler.");
+
+    allocprof_set_rate(0);
+
+    for (int i = N_OBJECTS / 2; i < N_OBJECTS; i++)
+    {
+        allocprof_free(&samples[i]);
+    }
+
+    read_site(&c);
+    ss_info_dassert(c.outstanding == 0 && c.outstanding_bytes == 0,
+                    "No object should be outstanding");
+
+    for (int i = 0; i < N_OBJECTS; i++)
+    {
+        allocprof_alloc(&samples[i], ALLOCPROF_SESSION, OBJECT_SIZE);
+        ss_info_dassert(samples[i] == NULL, "A disabled profiler should not sample");
+    }
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+    dcb.func.write = output_write;
+
+    result += test1();
+    ts_stats_init();
+    result += test2();
+    result += test3();
+
+    ts_stats_end();
+    mxs_log_finish();
+
+    exit(result);
+}
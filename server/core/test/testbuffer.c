@@ -314,6 +314,124 @@ void test_consume()
     consume_buffer(n_buffers - 1, -1);
 }
 
+/** Test that pooled and oversized buffers outlive the buffer they were cloned from */
+void test_pool()
+{
+    size_t sizes[] = {1, 128, 129, 4000, 16384, 16385, 100000};
+    const int n_sizes = sizeof(sizes) / sizeof(size_t);
+    uint8_t* data = generate_data(100000);
+
+    for (int i = 0; i < n_sizes; i++)
+    {
+        GWBUF* buffer = gwbuf_alloc_and_load(sizes[i], data);
+        ss_info_dassert(buffer, "Buffer should be allocated");
+        ss_info_dassert(GWBUF_LENGTH(buffer) == sizes[i], "Buffer should have the requested size");
+
+        GWBUF* clone = gwbuf_clone(buffer);
+        ss_info_dassert(clone, "Buffer should be cloned");
+        gwbuf_free(buffer);
+        ss_info_dassert(memcmp(GWBUF_DATA(clone), data, sizes[i]) == 0,
+                        "Clone should have the original data after the original is freed");
+
+        /** The freed block is reused for the next buffer of the same size */
+        buffer = gwbuf_alloc(sizes[i]);
+        ss_info_dassert(buffer && GWBUF_DATA(buffer) != GWBUF_DATA(clone),
+                        "New buffer should not share the data of the clone");
+        memset(GWBUF_DATA(buffer), 0, sizes[i]);
+        ss_info_dassert(memcmp(GWBUF_DATA(clone), data, sizes[i]) == 0,
+                        "Clone should not be modified by writes to a new buffer");
+        gwbuf_free(buffer);
+        gwbuf_free(clone);
+    }
+
+    /** Buffers from the free list have the correct size and state */
+    for (int i = 0; i < 1000; i++)
+    {
+        size_t size = 1 + (i * 37) % 20000;
+        GWBUF* buffer = gwbuf_alloc_and_load(size, data);
+        ss_info_dassert(buffer && GWBUF_LENGTH(buffer) == size, "Buffer should have the requested size");
+        ss_info_dassert(buffer->next == NULL && buffer->tail == buffer, "Buffer should not be linked");
+        ss_info_dassert(buffer->sbuf->refcount == 1, "Buffer should have one reference");
+        gwbuf_free(buffer);
+    }
+
+    free(data);
+}
+
+static int bufobj_freed = 0;
+
+static void free_test_bufobj(void *data)
+{
+    bufobj_freed++;
+}
+
+/**
+ * Buffer objects belong to the shared data, they are visible through every
+ * clone and freed with the last reference
+ */
+void test_bufobj()
+{
+    GWBUF* buffer = gwbuf_alloc(100);
+    GWBUF* clone = gwbuf_clone(buffer);
+    int data;
+
+    ss_info_dassert(buffer->sbuf->refcount == 2, "Buffer should have two references");
+    ss_info_dassert(gwbuf_add_buffer_object(clone, GWBUF_SQL_TEXT, &data, free_test_bufobj),
+                    "Adding a buffer object should succeed");
+    ss_info_dassert(gwbuf_get_buffer_object_data(buffer, GWBUF_SQL_TEXT) == &data,
+                    "Buffer object added to the clone should be visible in the original");
+    ss_info_dassert(!gwbuf_add_buffer_object(buffer, GWBUF_SQL_TEXT, &data, free_test_bufobj),
+                    "A buffer should have only one object of each type");
+    ss_info_dassert(gwbuf_get_buffer_object_data(buffer, GWBUF_PARSING_INFO) == NULL,
+                    "Buffer should not have other objects");
+    gwbuf_free(buffer);
+    ss_info_dassert(bufobj_freed == 0, "Buffer object should not be freed while referenced");
+    ss_info_dassert(clone->sbuf->refcount == 1, "Clone should have the last reference");
+    ss_info_dassert(gwbuf_get_buffer_object_data(clone, GWBUF_SQL_TEXT) == &data,
+                    "Buffer object should be found through the clone");
+    gwbuf_free(clone);
+    ss_info_dassert(bufobj_freed == 1, "Buffer object should be freed once");
+}
+
+/**
+ * Buffer objects belong to the part of the data they were derived from, the
+ * clones of other parts do not see them
+ */
+void test_bufobj_portion()
+{
+    GWBUF* buffer = gwbuf_alloc(100);
+    GWBUF* first = gwbuf_clone_portion(buffer, 0, 50);
+    GWBUF* second = gwbuf_clone_portion(buffer, 50, 50);
+    int data[3];
+
+    bufobj_freed = 0;
+    ss_info_dassert(gwbuf_add_buffer_object(buffer, GWBUF_PARSING_INFO, &data[0], free_test_bufobj),
+                    "Adding a buffer object should succeed");
+    ss_info_dassert(gwbuf_get_buffer_object_data(first, GWBUF_PARSING_INFO) == NULL &&
+                    gwbuf_get_buffer_object_data(second, GWBUF_PARSING_INFO) == NULL,
+                    "Object of the whole data should not be visible in the portions");
+    ss_info_dassert(gwbuf_add_buffer_object(first, GWBUF_PARSING_INFO, &data[1], free_test_bufobj) &&
+                    gwbuf_add_buffer_object(second, GWBUF_PARSING_INFO, &data[2], free_test_bufobj),
+                    "Each portion should get an object of its own");
+    ss_info_dassert(gwbuf_get_buffer_object_data(buffer, GWBUF_PARSING_INFO) == &data[0] &&
+                    gwbuf_get_buffer_object_data(first, GWBUF_PARSING_INFO) == &data[1] &&
+                    gwbuf_get_buffer_object_data(second, GWBUF_PARSING_INFO) == &data[2],
+                    "Each buffer should find the object of its own data");
+    ss_info_dassert(!gwbuf_add_buffer_object(first, GWBUF_PARSING_INFO, &data[1], free_test_bufobj),
+                    "A portion should have only one object of each type");
+
+    gwbuf_free_buffer_object(first, GWBUF_PARSING_INFO);
+    ss_info_dassert(bufobj_freed == 1, "The object of the portion should be freed");
+    ss_info_dassert(gwbuf_get_buffer_object_data(first, GWBUF_PARSING_INFO) == NULL &&
+                    gwbuf_get_buffer_object_data(second, GWBUF_PARSING_INFO) == &data[2],
+                    "Only the object of the portion should be removed");
+
+    gwbuf_free(buffer);
+    gwbuf_free(first);
+    gwbuf_free(second);
+    ss_info_dassert(bufobj_freed == 3, "The remaining objects should be freed with the data");
+}
+
 /**
  * test1    Allocate a buffer and do lots of things
  *
@@ -450,6 +568,9 @@ test1()
     test_split();
     test_load_and_copy();
     test_consume();
+    test_pool();
+    test_bufobj();
+    test_bufobj_portion();
 
     return 0;
 }
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <skygw_debug.h>
+#include <maxscale_crc32.h>
+
+#define N_BYTES     (1024 * 1024)
+#define MAX_OFFSET  16
+#define MAX_LEN     600
+
+/**
+ * test1    The checksums must match zlib at every alignment and length,
+ * also when the checksum of the data is computed in two parts.
+ */
+static int
+test1()
+{
+    unsigned char *data = malloc(N_BYTES);
+
+    ss_dfprintf(stderr, "testcrc32 : comparing to zlib");
+    ss_info_dassert(data != NULL, "Memory must be allocated");
+
+    for (int i = 0; i < N_BYTES; i++)
+    {
+        data[i] = rand();
+    }
+
+    ss_info_dassert(mxs_crc32(0, NULL, 0) == crc32(0L, NULL, 0), "Initial value must match zlib");
+
+    for (int offset = 0; offset < MAX_OFFSET; offset++)
+    {
+        for (int len = 0; len < MAX_LEN; len++)
+        {
+            uint32_t crc = mxs_crc32(0, data + offset, len);
+
+            ss_info_dassert(crc == crc32(0L, data + offset, len), "Checksum must match zlib");
+            ss_info_dassert(mxs_crc32(crc, data + offset + len, 77) ==
+                            crc32(crc, data + offset + len, 77),
+                            "Continued checksum must match zlib");
+        }
+    }
+
+    ss_info_dassert(mxs_crc32(0, data, N_BYTES) == crc32(0L, data, N_BYTES),
+                    "Checksum of a large buffer must match zlib");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+
+    exit(result);
+}
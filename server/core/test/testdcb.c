@@ -32,6 +32,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <listener.h>
 #include <dcb.h>
 
@@ -77,11 +79,174 @@ test1()
     return 0;
 }
 
+/**
+ * test2    Write a buffer and a part of a file to a DCB
+ *
+  */
+static int
+test2()
+{
+    DCB     *dcb;
+    GWBUF   *head;
+    char    path[] = "/tmp/testdcb_XXXXXX";
+    char    data[] = "0123456789abcdefghij";
+    char    result[64];
+    int     fd, sock[2], n, total = 0;
+    SERV_LISTENER dummy;
+
+    ss_dfprintf(stderr, "testdcb : writing a buffer and a file range to a DCB");
+    fd = mkstemp(path);
+    ss_info_dassert(fd != -1, "Temporary file must be created");
+    unlink(path);
+    ss_info_dassert(write(fd, data, strlen(data)) == strlen(data), "File must be written");
+    ss_info_dassert(socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == 0, "Socket pair must be created");
+
+    dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, &dummy);
+    dcb->fd = sock[0];
+    head = gwbuf_alloc_and_load(3, "ABC");
+    ss_info_dassert(dcb_sendfile(dcb, head, fd, 5, 10) == 1, "Data must be written");
+    ss_info_dassert(dcb->writeq == NULL, "Nothing must be queued");
+
+    while (total < 13 && (n = read(sock[1], result + total, sizeof(result) - total)) > 0)
+    {
+        total += n;
+    }
+    ss_info_dassert(total == 13 && memcmp(result, "ABC56789abcde", 13) == 0,
+                    "The buffer must be followed by the file range");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    dcb->fd = DCBFD_CLOSED;
+    dcb_close(dcb);
+    close(sock[0]);
+    close(sock[1]);
+    close(fd);
+
+    return 0;
+}
+
+static int
+test_callback(DCB *dcb, DCB_REASON reason, void *userdata)
+{
+    return 1;
+}
+
+/**
+ * test3    Add and remove callbacks of a DCB
+ *
+  */
+static int
+test3()
+{
+    DCB     *dcb;
+    int     data[DCB_MAX_CALLBACKS + 1];
+    SERV_LISTENER dummy;
+
+    ss_dfprintf(stderr, "testdcb : adding and removing callbacks");
+    dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, &dummy);
+
+    for (int i = 0; i < DCB_MAX_CALLBACKS; i++)
+    {
+        ss_info_dassert(dcb_add_callback(dcb, DCB_REASON_DRAINED, test_callback, &data[i]),
+                        "Callback must be added");
+    }
+    ss_info_dassert(!dcb_add_callback(dcb, DCB_REASON_DRAINED, test_callback, &data[0]),
+                    "Duplicate callback must not be added");
+    ss_info_dassert(!dcb_add_callback(dcb, DCB_REASON_DRAINED, test_callback,
+                                      &data[DCB_MAX_CALLBACKS]),
+                    "Callbacks beyond the maximum must not be added");
+    ss_info_dassert(dcb->n_callbacks[DCB_REASON_DRAINED] == DCB_MAX_CALLBACKS &&
+                    dcb->n_callbacks[DCB_REASON_HIGH_WATER] == 0,
+                    "Callbacks must be counted by their reason");
+
+    ss_info_dassert(dcb_remove_callback(dcb, DCB_REASON_DRAINED, test_callback, &data[0]),
+                    "Callback must be removed");
+    ss_info_dassert(!dcb_remove_callback(dcb, DCB_REASON_DRAINED, test_callback, &data[0]),
+                    "Removed callback must not be found");
+    ss_info_dassert(!dcb_remove_callback(dcb, DCB_REASON_HIGH_WATER, test_callback, &data[1]),
+                    "Callback must not be found with another reason");
+    ss_info_dassert(dcb->n_callbacks[DCB_REASON_DRAINED] == DCB_MAX_CALLBACKS - 1 &&
+                    dcb->callbacks[DCB_REASON_DRAINED][0].userdata == &data[DCB_MAX_CALLBACKS - 1],
+                    "The last callback must take the place of the removed one");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    dcb_close(dcb);
+
+    return 0;
+}
+
+static GWBUF *test_written;
+static int test_writes;
+
+static int
+test_write(DCB *dcb, GWBUF *buf)
+{
+    test_written = gwbuf_append(test_written, buf);
+    test_writes++;
+    return 1;
+}
+
+/**
+ * test4    Format output into a print batch and write it in one go
+ *
+  */
+static int
+test4()
+{
+    DCB     *dcb;
+    DCB_PRINT_BATCH batch;
+    char    line[100];
+    char    *result;
+    int     i, len;
+    SERV_LISTENER dummy;
+
+    ss_dfprintf(stderr, "testdcb : formatting output into a print batch");
+    dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, &dummy);
+    dcb->func.write = test_write;
+
+    dcb_batch_init(&batch, dcb);
+    ss_info_dassert(dcb_batch_flush(&batch) == 1 && test_writes == 0,
+                    "An empty batch must not be written");
+
+    for (i = 0; i < 10000; i++)
+    {
+        dcb_batch_printf(&batch, "line %d\n", i);
+    }
+    ss_info_dassert(test_writes == 0, "Nothing must be written before the flush");
+    ss_info_dassert(DCB_BATCH_FULL(&batch), "More than one buffer must be used");
+    memset(dcb_batch_reserve(&batch, 3), 'x', 3);
+    dcb_batch_flush(&batch);
+    ss_info_dassert(test_writes == 1, "The batch must be written with one write");
+
+    len = gwbuf_length(test_written);
+    result = malloc(len + 1);
+    gwbuf_copy_data(test_written, 0, len, (uint8_t*)result);
+    result[len] = '\0';
+
+    char *ptr = result;
+    for (i = 0; i < 10000; i++)
+    {
+        sprintf(line, "line %d\n", i);
+        ss_info_dassert(strncmp(ptr, line, strlen(line)) == 0, "Lines must be in order");
+        ptr += strlen(line);
+    }
+    ss_info_dassert(strcmp(ptr, "xxx") == 0, "Reserved space must follow the lines");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    free(result);
+    gwbuf_free(test_written);
+    dcb_close(dcb);
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
 
     exit(result);
 }
@@ -36,6 +36,8 @@
 #include <time.h>
 
 #include <hashtable.h>
+#include <strhash.h>
+#include <skygw_utils.h>
 
 static void
 read_lock(HASHTABLE *table)
@@ -180,6 +182,130 @@ static bool do_hashtest(
     return succp;
 }
 
+/**
+ * Test the open addressing string hashtable and compare its lookups with
+ * those of the chained hashtable.
+ *
+ * @param argelems      The number of keys
+ * @param argsize       The initial size of the tables
+ * @return True if the test succeeded
+ */
+static bool do_strhashtest(
+    int argelems,
+    int argsize)
+{
+    STRHASH*   sh;
+    HASHTABLE* h;
+    char**     keys;
+    int        i;
+    int        round;
+    int        found;
+    clock_t    begin;
+    double     t_hashtable;
+    double     t_strhash;
+
+    ss_dfprintf(stderr,
+                "testhash : creating string hash tables of size %d, including %d "
+                "elements in total.",
+                argsize,
+                argelems);
+
+    keys = (char **)malloc(sizeof(char *) * argelems);
+    sh = strhash_alloc(argsize, NULL);
+    h = hashtable_alloc(argsize > 0 ? argsize : 1, simple_str_hash, strcmp);
+    ss_info_dassert(keys && sh && h, "Allocation should succeed");
+    hashtable_memory_fns(h, (HASHMEMORYFN)strdup, NULL, (HASHMEMORYFN)free, NULL);
+    hashtable_enable_resize(h);
+
+    for (i = 0; i < argelems; i++)
+    {
+        char key[64];
+        /** Both short keys and keys that share a long prefix */
+        snprintf(key, sizeof(key), i % 2 ? "%d" : "user%d@192.168.0.%%", i);
+        keys[i] = strdup(key);
+        ss_info_dassert(strhash_add(sh, keys[i], keys[i]) == 1, "Adding should succeed");
+        hashtable_add(h, keys[i], keys[i]);
+    }
+    ss_info_dassert(strhash_size(sh) == argelems, "Invalid element count");
+
+    ss_dfprintf(stderr, "\t..done\nValidate read values.");
+
+    for (i = 0; i < argelems; i++)
+    {
+        ss_info_dassert(strhash_fetch(sh, keys[i]) == keys[i], "Key should be found");
+        ss_info_dassert(strhash_add(sh, keys[i], keys[i]) == 0, "Duplicate key should not be added");
+    }
+    ss_info_dassert(strhash_fetch(sh, "no such key") == NULL, "Missing key should not be found");
+
+    ss_dfprintf(stderr, "\t..done\nCompare lookups.");
+
+    begin = clock();
+    for (round = 0, found = 0; round < 10; round++)
+    {
+        for (i = 0; i < argelems; i++)
+        {
+            found += hashtable_fetch(h, keys[i]) != NULL;
+        }
+    }
+    t_hashtable = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    ss_info_dassert(found == argelems * 10, "Hashtable should find all keys");
+
+    begin = clock();
+    for (round = 0, found = 0; round < 10; round++)
+    {
+        for (i = 0; i < argelems; i++)
+        {
+            found += strhash_fetch(sh, keys[i]) != NULL;
+        }
+    }
+    t_strhash = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    ss_info_dassert(found == argelems * 10, "String hashtable should find all keys");
+
+    ss_dfprintf(stderr, "\t..done\nLookups took %gs with hashtable and %gs with strhash.",
+                t_hashtable, t_strhash);
+
+    ss_dfprintf(stderr, "\t..done\nDelete every other key.");
+
+    for (i = 0; i < argelems; i += 2)
+    {
+        ss_info_dassert(strhash_delete(sh, keys[i]) == 1, "Deleting should succeed");
+    }
+    ss_info_dassert(strhash_delete(sh, "no such key") == 0, "Missing key should not be deleted");
+    ss_info_dassert(strhash_size(sh) == argelems / 2, "Invalid element count after delete");
+
+    for (i = 0; i < argelems; i++)
+    {
+        ss_info_dassert((strhash_fetch(sh, keys[i]) != NULL) == (i % 2 == 1),
+                        "Only the remaining keys should be found");
+    }
+
+    ss_dfprintf(stderr, "\t\t..done\nReplace the values.");
+
+    for (i = 0; i < argelems; i++)
+    {
+        ss_info_dassert(hashtable_replace(h, keys[i], keys[argelems - i - 1]) == 1,
+                        "Replacing should succeed");
+    }
+    ss_info_dassert(hashtable_size(h) == argelems, "Replacing should not add entries");
+
+    for (i = 0; i < argelems; i++)
+    {
+        ss_info_dassert(hashtable_fetch(h, keys[i]) == keys[argelems - i - 1],
+                        "The replaced value should be found");
+    }
+
+    ss_dfprintf(stderr, "\t..done\n\nTest completed successfully.\n\n");
+
+    strhash_free(sh);
+    hashtable_free(h);
+    for (i = 0; i < argelems; i++)
+    {
+        free(keys[i]);
+    }
+    free(keys);
+    return true;
+}
+
 /**
  * @node Simple test which creates hashtable and frees it. Size and number of entries
  * sre specified by user and passed as arguments.
@@ -236,6 +362,18 @@ int main(void)
     {
         goto return_rc;
     }
+    if (!do_strhashtest(10, 0))
+    {
+        goto return_rc;
+    }
+    if (!do_strhashtest(100000, 100))
+    {
+        goto return_rc;
+    }
+    if (!do_strhashtest(100000, 100000))
+    {
+        goto return_rc;
+    }
 
     rc = 0;
 return_rc:
@@ -34,6 +34,7 @@
 #include <string.h>
 
 #include <hint.h>
+#include <server.h>
 
 /**
  * test1    Allocate table of users and mess around with it
@@ -67,11 +68,48 @@ test1()
 
 }
 
+/**
+ * test2    Named server hints resolve their server
+ */
+static int
+test2()
+{
+    HINT    *hint, *dup;
+    SERVER  *server;
+
+    ss_dfprintf(stderr, "testhint : Resolve the server of a named server hint");
+    server = server_alloc("127.0.0.1", "MySQLBackend", 3306);
+    ss_info_dassert(NULL != server, "Allocating the server should succeed");
+    server_set_unique_name(server, "hintserver");
+    hint = hint_create_route(NULL, HINT_ROUTE_TO_NAMED_SERVER, "hintserver");
+    ss_info_dassert(hint->server == server, "Hint should have the server");
+    dup = hint_dup(hint);
+    ss_info_dassert(dup->server == server, "Duplicate should have the server");
+    hint_free(dup);
+    hint_free(hint);
+    ss_dfprintf(stderr, "\t..done\nCreate a hint for a known server.");
+
+    hint = hint_create_server_route(NULL, server);
+    ss_info_dassert(hint->server == server, "Hint should have the server");
+    ss_info_dassert(0 == strcmp(hint->data, "hintserver"), "Hint should have the server name");
+    hint_free(hint);
+    ss_dfprintf(stderr, "\t..done\nUnknown server name.");
+
+    hint = hint_create_route(NULL, HINT_ROUTE_TO_NAMED_SERVER, "nosuchserver");
+    ss_info_dassert(hint->server == NULL, "Hint should have no server");
+    hint_free(hint);
+    server_free(server);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
 
     exit(result);
 }
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <skygw_debug.h>
+#include <atomic.h>
+#include <housekeeper.h>
+
+static int n_fast;
+static int n_slow;
+static int n_oneshot;
+static int n_self_remove;
+
+static void
+fast_task(void *data)
+{
+    atomic_add(&n_fast, 1);
+}
+
+static void
+slow_task(void *data)
+{
+    atomic_add(&n_slow, 1);
+    sleep(2);
+}
+
+static void
+oneshot_task(void *data)
+{
+    atomic_add(&n_oneshot, 1);
+}
+
+static void
+self_remove_task(void *data)
+{
+    atomic_add(&n_self_remove, 1);
+    hktask_remove("self_remove");
+}
+
+/**
+ * test1    A slow task delays neither the heartbeat nor the other tasks
+ *
+ */
+static int
+test1()
+{
+    ss_dfprintf(stderr, "testhousekeeper : Run a slow and a fast task");
+    ss_info_dassert(hktask_add("slow", slow_task, NULL, 1) != 0, "Adding a task should succeed");
+    ss_info_dassert(hktask_add("slow", slow_task, NULL, 1) == 0, "Task names should be unique");
+    ss_info_dassert(hktask_add_ms("fast", fast_task, NULL, 200) != 0, "Adding a task should succeed");
+
+    long start = hkheartbeat;
+    sleep(3);
+
+    ss_info_dassert(hkheartbeat - start >= 25, "Heartbeat should not wait for the tasks");
+    ss_info_dassert(n_slow == 1, "Slow task should not be run again before it returns");
+    ss_info_dassert(n_fast >= 10, "Fast task should run while the slow task runs");
+
+    ss_info_dassert(hktask_remove("fast"), "Removing a task should succeed");
+    ss_info_dassert(hktask_remove("slow"), "Removing a running task should succeed");
+    ss_info_dassert(!hktask_remove("fast"), "A task should be removed only once");
+
+    int fast = n_fast;
+    sleep(1);
+    ss_info_dassert(n_fast == fast, "Removed task should not run");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    One-shot tasks and tasks that remove themselves
+ *
+ */
+static int
+test2()
+{
+    ss_dfprintf(stderr, "testhousekeeper : Run a one-shot task");
+    ss_info_dassert(hktask_oneshot("oneshot", oneshot_task, NULL, 1) != 0,
+                    "Adding a one-shot task should succeed");
+    ss_info_dassert(hktask_add_ms("self_remove", self_remove_task, NULL, 100) != 0,
+                    "Adding a task should succeed");
+    sleep(2);
+    ss_info_dassert(n_oneshot == 1, "One-shot task should run once");
+    ss_info_dassert(!hktask_remove("oneshot"), "One-shot task should be removed after it runs");
+    ss_info_dassert(n_self_remove == 1, "Task that removes itself should run once");
+    ss_info_dassert(!hktask_remove("self_remove"), "Task should have removed itself");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    hkinit();
+    result += test1();
+    result += test2();
+    hkshutdown();
+
+    exit(result);
+}
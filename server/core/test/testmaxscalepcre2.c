@@ -95,12 +95,100 @@ static int test2()
     return 0;
 }
 
+/**
+ * Test matching with the match data of the thread
+ */
+static int test3()
+{
+    int err;
+    size_t erroff;
+    const char* subject = "The quick brown fox jumps over the lazy dog";
+
+    pcre2_code *re = mxs_pcre2_compile("brown", 0, &err, &erroff);
+    pcre2_code *re2 = mxs_pcre2_compile("(\\w+) (\\w+) (\\w+) (\\w+)$", 0, &err, &erroff);
+    test_assert(re && re2, "Patterns should compile");
+    test_assert(mxs_pcre2_compile("black.*[dog", 0, &err, &erroff) == NULL, "Bad pattern should not compile");
+
+    test_assert(mxs_pcre2_match(re, subject, PCRE2_ZERO_TERMINATED) == 1, "Pattern should match");
+
+    /** The match data of the thread must grow for the pattern with more groups */
+    test_assert(mxs_pcre2_match(re2, subject, PCRE2_ZERO_TERMINATED) == 5,
+                "All groups should be captured");
+    test_assert(pcre2_get_ovector_count(mxs_pcre2_match_data(re2)) >= 5,
+                "Match data should have room for all groups");
+    test_assert(mxs_pcre2_match(re, subject, 9) == PCRE2_ERROR_NOMATCH,
+                "Pattern should not match a partial subject");
+
+    pcre2_code_free(re);
+    pcre2_code_free(re2);
+    return 0;
+}
+
+/**
+ * Test finding the literal every match of a pattern contains
+ */
+static int test4()
+{
+    struct
+    {
+        const char *pattern;
+        mxs_regex_syntax_t syntax;
+        const char *literal;
+    } tests[] =
+    {
+        {"select.*from t1", MXS_REGEX_PCRE2, "from t1"},
+        {"from\\s+orders_history", MXS_REGEX_PCRE2, "orders_history"},
+        {"ab(cd|ef)ghijk*", MXS_REGEX_PCRE2, "ghij"},
+        {"colour?s_table", MXS_REGEX_PCRE2, "s_table"},
+        {"x+yz{2}[abc]qrst", MXS_REGEX_PCRE2, "qrst"},
+        {"a\\.b\\(cd", MXS_REGEX_PCRE2, "a.b(cd"},
+        {"insert|update", MXS_REGEX_PCRE2, NULL},
+        {"(?i)select", MXS_REGEX_PCRE2, NULL},
+        {"\\Qselect\\E", MXS_REGEX_PCRE2, NULL},
+        {"ab", MXS_REGEX_PCRE2, NULL},
+        {"delete (from)? users", MXS_REGEX_POSIX_EXTENDED, "delete "},
+        {"count(*) from", MXS_REGEX_POSIX_BASIC, ") from"},
+        {"a\\(bcd\\)", MXS_REGEX_POSIX_BASIC, NULL},
+        {NULL}
+    };
+
+    for (int i = 0; tests[i].pattern; i++)
+    {
+        char *literal = mxs_pcre2_required_literal(tests[i].pattern, tests[i].syntax, false);
+
+        if (tests[i].literal == NULL ? literal != NULL :
+            literal == NULL || strcmp(literal, tests[i].literal) != 0)
+        {
+            fprintf(stderr, "Pattern '%s' should have literal '%s', got '%s'\n", tests[i].pattern,
+                    tests[i].literal ? tests[i].literal : "(none)", literal ? literal : "(none)");
+            free(literal);
+            return 1;
+        }
+        free(literal);
+    }
+
+    test_assert(mxs_pcre2_required_literal("select", MXS_REGEX_PCRE2, true) == NULL,
+                "Extended patterns should have no literal");
+
+    const char *sql = "SELECT * FROM orders_history";
+    test_assert(mxs_pcre2_literal_found("orders", sql, strlen(sql), false), "Literal should be found");
+    test_assert(!mxs_pcre2_literal_found("select", sql, strlen(sql), false),
+                "Literal of a different case should not be found");
+    test_assert(mxs_pcre2_literal_found("select", sql, strlen(sql), true),
+                "Caseless literal should be found");
+    test_assert(!mxs_pcre2_literal_found("history", sql, strlen(sql) - 1, true),
+                "Literal past the length should not be found");
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
     result += test2();
+    result += test3();
+    result += test4();
 
     return result;
 }
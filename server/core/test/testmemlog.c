@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <memlog.h>
 
 /**
@@ -60,6 +61,36 @@ linecount(char *file)
     return i;
 }
 
+/** The number of dumped ring records and whether they were in order */
+static int ring_lines = 0;
+static double ring_last = -1;
+static int ring_unordered = 0;
+
+static void
+ring_line(void *data, const char *line)
+{
+    double ago = -atof(line);
+
+    if (ring_last >= 0 && ago > ring_last)
+    {
+        ring_unordered++;
+    }
+    ring_last = ago;
+    ring_lines++;
+}
+
+static void *
+ring_thread(void *data)
+{
+    long i;
+
+    for (i = 0; i < 10; i++)
+    {
+        memlog_ring_log(MLR_EVENT, data, i, i);
+    }
+    return NULL;
+}
+
 /* Some strings to log */
 char    *strings[] =
 {
@@ -499,5 +530,48 @@ main()
             printf("Flush on destroy:		Passed\n");
         }
     }
+
+    memlog_ring_init(100);
+    if (memlog_ring_size != 128)
+    {
+        printf("Ring size rounding:		Failed\n");
+        failures++;
+    }
+    else
+    {
+        printf("Ring size rounding:		Passed\n");
+    }
+    {
+        pthread_t thr;
+
+        for (i = 0; i < 100; i++)
+        {
+            memlog_ring_log(MLR_PROTOCOL_STATE, NULL, (intptr_t)"old", (intptr_t)"new");
+        }
+        pthread_create(&thr, NULL, ring_thread, NULL);
+        pthread_join(thr, NULL);
+        for (i = 0; i < 100; i++)
+        {
+            memlog_ring_log(MLR_EVENT, NULL, i, i);
+        }
+        if (memlog_ring_dump(ring_line, NULL) != 137 || ring_lines != 137)
+        {
+            printf("Ring wrap around:		Failed\n");
+            failures++;
+        }
+        else
+        {
+            printf("Ring wrap around:		Passed\n");
+        }
+        if (ring_unordered)
+        {
+            printf("Ring merge order:		Failed\n");
+            failures++;
+        }
+        else
+        {
+            printf("Ring merge order:		Passed\n");
+        }
+    }
     exit(failures);
 }
@@ -81,7 +81,8 @@ test2()
 
     memset(query, ';', 128);
     memset(query + 128, '\0', 1);
-    *((unsigned char*)buffer->start) = len;
+    /** The payload length includes the command byte */
+    *((unsigned char*)buffer->start) = len + 1;
     *((unsigned char*)buffer->start + 1) = 0;
     *((unsigned char*)buffer->start + 2) = 0;
     *((unsigned char*)buffer->start + 3) = 1;
@@ -96,6 +97,62 @@ test2()
 
 }
 
+/**
+ * Create a COM_QUERY packet that is split into two buffers
+ */
+static GWBUF* create_split_query(const char* sql, int split)
+{
+    int len = strlen(sql);
+    uint8_t header[5] = {len + 1, 0, 0, 0, 0x03};
+    GWBUF* buffer = gwbuf_alloc(5 + split);
+
+    memcpy(GWBUF_DATA(buffer), header, 5);
+    memcpy((char*)GWBUF_DATA(buffer) + 5, sql, split);
+    return gwbuf_append(buffer, gwbuf_alloc_and_load(len - split, (void*)(sql + split)));
+}
+
+int
+test3()
+{
+    const char* query = "select * from some_table";
+    GWBUF* buffer = modutil_create_query((char*)query);
+    const char* sql;
+    const char* sql2;
+    int length;
+
+    ss_dfprintf(stderr, "testmodutil : SQL views.");
+    ss_info_dassert(modutil_get_SQL_view(buffer, &sql, &length), "COM_QUERY should have a view");
+    ss_info_dassert(sql == (char*)GWBUF_DATA(buffer) + 5, "View of contiguous buffer should point into it");
+    ss_info_dassert(length == strlen(query) && memcmp(sql, query, length) == 0, "View should be the query");
+    sql = modutil_get_SQL_string(buffer);
+    ss_info_dassert(sql && strcmp(sql, query) == 0, "String should be the query");
+    ss_info_dassert(sql == modutil_get_SQL_string(buffer), "String should be copied only once");
+
+    modutil_replace_SQL(buffer, "select 1");
+    sql = modutil_get_SQL_string(buffer);
+    ss_info_dassert(sql && strcmp(sql, "select 1") == 0, "Replacing the SQL should drop the copy");
+    gwbuf_free(buffer);
+
+    buffer = create_split_query(query, 6);
+    ss_info_dassert(modutil_get_SQL_view(buffer, &sql, &length), "Split COM_QUERY should have a view");
+    ss_info_dassert(length == strlen(query) && memcmp(sql, query, length) == 0, "View should be the query");
+    ss_info_dassert(modutil_get_SQL_view(buffer, &sql2, &length) && sql2 == sql,
+                    "Split query should be copied only once");
+    ss_info_dassert(sql == modutil_get_SQL_string(buffer), "View and string should share the copy");
+    char* copy = modutil_get_SQL(buffer);
+    ss_info_dassert(copy && strcmp(copy, query) == 0, "Copy of split query should be the query");
+    free(copy);
+    gwbuf_free(buffer);
+
+    buffer = gwbuf_alloc(100);
+    memset(GWBUF_DATA(buffer), 0, 100);
+    ss_info_dassert(!modutil_get_SQL_view(buffer, &sql, &length), "Non-SQL buffer should not have a view");
+    ss_info_dassert(modutil_get_SQL_string(buffer) == NULL, "Non-SQL buffer should not have a string");
+    gwbuf_free(buffer);
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
 /** This is a standard OK packet */
 static char ok[] =
 {
@@ -383,16 +440,212 @@ void test_large_packets()
     }
 }
 
+void test_scan_signal_packets()
+{
+    MODUTIL_PACKET_SCAN scan;
+
+    ss_dfprintf(stderr, "testmodutil : Incremental packet scan.");
+
+    /** Whole result set in one buffer */
+    modutil_scan_init(&scan);
+    GWBUF* buffer = gwbuf_alloc_and_load(sizeof(resultset), resultset);
+    ss_info_dassert(modutil_scan_signal_packets(&scan, buffer) == 2, "Result set should have two EOFs");
+    ss_info_dassert(!scan.more, "Result set should not have more results");
+    gwbuf_free(buffer);
+
+    /** Result set fed one byte at a time */
+    int found = 0;
+    modutil_scan_init(&scan);
+
+    for (size_t i = 0; i < sizeof(resultset); i++)
+    {
+        buffer = gwbuf_alloc_and_load(1, resultset + i);
+        found += modutil_scan_signal_packets(&scan, buffer);
+        gwbuf_free(buffer);
+    }
+
+    ss_info_dassert(found == 2, "Split result set should have two EOFs");
+
+    /** Result set split into a chain */
+    for (size_t split = 1; split < sizeof(resultset); split++)
+    {
+        modutil_scan_init(&scan);
+        buffer = gwbuf_alloc_and_load(split, resultset);
+        buffer = gwbuf_append(buffer, gwbuf_alloc_and_load(sizeof(resultset) - split,
+                                                           resultset + split));
+        ss_info_dassert(modutil_scan_signal_packets(&scan, buffer) == 2,
+                        "Chained result set should have two EOFs");
+        gwbuf_free(buffer);
+    }
+
+    /** An OK packet is not a signal packet */
+    modutil_scan_init(&scan);
+    buffer = gwbuf_alloc_and_load(sizeof(ok), ok);
+    ss_info_dassert(modutil_scan_signal_packets(&scan, buffer) == 0, "OK should not be counted");
+    gwbuf_free(buffer);
+
+    /** A result set that ends in an OK packet, CLIENT_DEPRECATE_EOF */
+    uint8_t ok_resultset[] =
+    {
+        0x01, 0x00, 0x00, 0x01, 0x01,
+        0x05, 0x00, 0x00, 0x02, 0x03, 'd', 'e', 'f', 0x00,
+        0x02, 0x00, 0x00, 0x03, 0x01, '1',
+        0x07, 0x00, 0x00, 0x04, 0xfe, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00
+    };
+
+    modutil_scan_init_eof(&scan, true);
+    buffer = gwbuf_alloc_and_load(sizeof(ok_resultset), ok_resultset);
+    ss_info_dassert(modutil_scan_signal_packets(&scan, buffer) == 2,
+                    "OK terminated result set should have two signals");
+    ss_info_dassert(!scan.more && !scan.err, "Result set should end without more results");
+    gwbuf_free(buffer);
+
+    found = 0;
+    modutil_scan_init_eof(&scan, true);
+
+    for (size_t i = 0; i < sizeof(ok_resultset); i++)
+    {
+        buffer = gwbuf_alloc_and_load(1, ok_resultset + i);
+        found += modutil_scan_signal_packets(&scan, buffer);
+        gwbuf_free(buffer);
+    }
+
+    ss_info_dassert(found == 2, "Split OK terminated result set should have two signals");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+void test_state_changes()
+{
+    MODUTIL_STATE_CHANGE changes[4];
+
+    ss_dfprintf(stderr, "testmodutil : Session state changes.");
+
+    /** OK with autocommit=OFF and the schema test */
+    uint8_t ok_track[] =
+    {
+        0x21, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x40, 0x00, 0x00,
+        0x00, 0x18,
+        0x00, 0x0f, 0x0a, 'a', 'u', 't', 'o', 'c', 'o', 'm', 'm', 'i', 't', 0x03, 'O', 'F', 'F',
+        0x01, 0x05, 0x04, 't', 'e', 's', 't'
+    };
+
+    ss_info_dassert(modutil_get_state_changes(ok_track, sizeof(ok_track), changes, 4) == 2,
+                    "OK packet should have two state changes");
+    ss_info_dassert(changes[0].type == MODUTIL_TRACK_SYSTEM_VARIABLES &&
+                    changes[0].name_len == 10 && memcmp(changes[0].name, "autocommit", 10) == 0 &&
+                    changes[0].value_len == 3 && memcmp(changes[0].value, "OFF", 3) == 0,
+                    "First change should set autocommit");
+    ss_info_dassert(changes[1].type == MODUTIL_TRACK_SCHEMA && changes[1].name == NULL &&
+                    changes[1].value_len == 4 && memcmp(changes[1].value, "test", 4) == 0,
+                    "Second change should be the schema");
+    ss_info_dassert(modutil_get_state_changes(ok_track, sizeof(ok_track), changes, 1) == 1,
+                    "Changes after the array should be ignored");
+    ss_info_dassert(modutil_get_state_changes(ok_track, sizeof(ok_track) - 1, changes, 4) == -1,
+                    "Truncated packet should be rejected");
+
+    /** A plain OK packet reports no changes */
+    ss_info_dassert(modutil_get_state_changes((uint8_t *)ok, sizeof(ok), changes, 4) == 0,
+                    "OK without state should have no changes");
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
+/**
+ * Read the SQL of a COM_QUERY chain into a null terminated string
+ */
+static char* replaced_sql(GWBUF* buffer)
+{
+    int len = gwbuf_length(buffer) - 5;
+    char* sql = malloc(len + 1);
+    gwbuf_copy_data(buffer, 5, len, (uint8_t*)sql);
+    sql[len] = '\0';
+    uint8_t* hdr = GWBUF_DATA(buffer);
+    ss_info_dassert((hdr[0] | (hdr[1] << 8) | (hdr[2] << 16)) == len + 1,
+                    "Header should have the length of the new SQL");
+    return sql;
+}
+
+void test_replace_sql()
+{
+    ss_dfprintf(stderr, "testmodutil : Replace SQL in place and copy on write");
+
+    /** An unshared buffer is rewritten in place, also when the SQL grows */
+    GWBUF* buffer = modutil_create_query("select 1");
+    GWBUF* result = modutil_replace_SQL(buffer, "select 12");
+    ss_info_dassert(result == buffer, "Unshared buffer should be rewritten in place");
+    char* sql = replaced_sql(result);
+    ss_info_dassert(strcmp(sql, "select 12") == 0, "SQL should be replaced");
+    free(sql);
+    gwbuf_free(result);
+
+    /** A clone keeps the old SQL */
+    buffer = modutil_create_query("select 1");
+    GWBUF* clone = gwbuf_clone(buffer);
+    result = modutil_replace_SQL(buffer, "select 2");
+    ss_info_dassert(result && result != buffer, "Shared buffer should not be modified");
+    sql = replaced_sql(result);
+    ss_info_dassert(strcmp(sql, "select 2") == 0, "SQL should be replaced");
+    free(sql);
+    sql = replaced_sql(clone);
+    ss_info_dassert(strcmp(sql, "select 1") == 0, "Clone should keep the old SQL");
+    free(sql);
+    gwbuf_free(result);
+    gwbuf_free(clone);
+
+    /** Long unchanged parts are shared with the original */
+    char old[1024];
+    char new[1024];
+    memset(old, 'a', 300);
+    strcpy(old + 300, " = 1 and ");
+    memset(old + 309, 'b', 300);
+    old[609] = '\0';
+    memcpy(new, old, 300);
+    strcpy(new + 300, " = 22 and ");
+    strcpy(new + 310, old + 309);
+
+    buffer = modutil_create_query(old);
+    clone = gwbuf_clone(buffer);
+    result = modutil_replace_SQL(buffer, new);
+    ss_info_dassert(result && gwbuf_count(result) == 4, "Result should have the header, the "
+                    "shared prefix, the changed part and the shared suffix");
+    ss_info_dassert(result->next->sbuf == clone->sbuf && result->next->next->next->sbuf == clone->sbuf,
+                    "Unchanged parts should be shared");
+    ss_info_dassert(result->sbuf != clone->sbuf, "Header should be new");
+    sql = replaced_sql(result);
+    ss_info_dassert(strcmp(sql, new) == 0, "SQL should be replaced");
+    free(sql);
+    gwbuf_free(result);
+    sql = replaced_sql(clone);
+    ss_info_dassert(strcmp(sql, old) == 0, "Clone should keep the old SQL");
+    free(sql);
+    gwbuf_free(clone);
+
+    /** A split packet is replaced */
+    buffer = create_split_query("select * from some_table", 6);
+    result = modutil_replace_SQL(buffer, "select 3");
+    sql = replaced_sql(result);
+    ss_info_dassert(strcmp(sql, "select 3") == 0, "Split packet should be replaced");
+    free(sql);
+    gwbuf_free(result);
+
+    ss_dfprintf(stderr, "\t..done\n");
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
     result += test2();
+    result += test3();
     test_single_sql_packet();
     test_multiple_sql_packets();
     test_strnchr_esc();
     test_strnchr_esc_mysql();
     test_large_packets();
+    test_scan_signal_packets();
+    test_state_changes();
+    test_replace_sql();
     exit(result);
 }
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testmultistmt.c - Splitting and classifying multi-statement queries
+ *
+ * The test loads qc_sqlite from the build directory of the query classifier.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+#include <gwdirs.h>
+#include <modutil.h>
+#include <query_classifier.h>
+
+/** A type that no query has, to see that the type is left alone */
+#define TYPE_NOT_SET 0xdeadbeef
+
+/**
+ * Split and classify a query
+ *
+ * @param sql  The query
+ * @param type Set to the combined type of the statements
+ * @return The number of statements
+ */
+static int
+multi_stmt_type(const char *sql, uint32_t *type)
+{
+    GWBUF *buf = modutil_create_query((char*)sql);
+    int n;
+
+    *type = TYPE_NOT_SET;
+    n = qc_get_multi_stmt_type(buf, type);
+    gwbuf_free(buf);
+
+    return n;
+}
+
+/**
+ * test1    The statements of a query are counted and their types combined
+ *
+ */
+static int
+test1()
+{
+    uint32_t type;
+
+    ss_dfprintf(stderr, "testmultistmt : Classify the statements of a query");
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1; SELECT b FROM t2", &type) == 2,
+                    "The query should have two statements");
+    ss_info_dassert((type & QUERY_TYPE_READ) && !(type & QUERY_TYPE_WRITE),
+                    "The query should only read");
+
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1; UPDATE t2 SET b = 1", &type) == 2,
+                    "The query should have two statements");
+    ss_info_dassert((type & QUERY_TYPE_READ) && (type & QUERY_TYPE_WRITE),
+                    "The query should read and write");
+
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1", &type) == 1,
+                    "A single statement should be classified");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    A semicolon or a comment at the end of the query is not a
+ *          statement and a semicolon in a string does not end one
+ *
+ */
+static int
+test2()
+{
+    uint32_t type;
+
+    ss_dfprintf(stderr, "testmultistmt : The ends of the statements");
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1; SELECT b FROM t2;", &type) == 2,
+                    "A semicolon at the end should not start a statement");
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1; SELECT b FROM t2; -- The end", &type) == 2,
+                    "A comment at the end should not be a statement");
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1 WHERE b = ';'; SELECT c FROM t2", &type) == 2,
+                    "A semicolon in a string should not end the statement");
+    ss_info_dassert(!(type & QUERY_TYPE_WRITE), "The query should only read");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    Queries that cannot be split reliably are not split and their type
+ *          is left alone
+ *
+ */
+static int
+test3()
+{
+    uint32_t type;
+
+    ss_dfprintf(stderr, "testmultistmt : Queries that are not split");
+    ss_info_dassert(multi_stmt_type("CREATE PROCEDURE p() BEGIN SELECT a FROM t1; END; "
+                                    "SELECT b FROM t2", &type) == 0,
+                    "A query with a BEGIN ... END block should not be split");
+    ss_info_dassert(type == TYPE_NOT_SET, "The type should not be set");
+
+    ss_info_dassert(multi_stmt_type("SELECT a FROM t1; SELECT FROM WHERE", &type) == 0,
+                    "A query with a statement that cannot be parsed should not be split");
+    ss_info_dassert(type == TYPE_NOT_SET, "The type should not be set");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+
+    set_libdir(strdup("../../../query_classifier/qc_sqlite/"));
+    ss_info_dassert(qc_init("qc_sqlite", NULL) && qc_thread_init(),
+                    "The query classifier should be initialized");
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    qc_thread_end();
+    qc_end();
+    mxs_log_finish();
+
+    exit(result);
+}
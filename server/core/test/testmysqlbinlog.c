@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <skygw_debug.h>
+#include <mysql_binlog.h>
+
+/**
+ * test1    The plan must resolve the kind, size and metadata of each column.
+ */
+static int
+test1()
+{
+    uint8_t types[] =
+    {
+        TABLE_COL_TYPE_LONG, TABLE_COL_TYPE_VARCHAR, TABLE_COL_TYPE_DOUBLE,
+        TABLE_COL_TYPE_LONGLONG, TABLE_COL_TYPE_STRING, TABLE_COL_TYPE_BLOB,
+        TABLE_COL_TYPE_NEWDECIMAL, TABLE_COL_TYPE_DATETIME2, TABLE_COL_TYPE_INT24
+    };
+    uint8_t metadata[] =
+    {
+        0xff, 0x00,                 /* VARCHAR(255) */
+        8,                          /* DOUBLE */
+        TABLE_COL_TYPE_ENUM, 1,     /* ENUM */
+        2,                          /* BLOB */
+        10, 2,                      /* DECIMAL(10,2) */
+        0                           /* DATETIME */
+    };
+
+    ss_dfprintf(stderr, "testmysqlbinlog : column plan");
+    COLUMN_PLAN *plan = column_plan_alloc(types, sizeof(types), metadata, sizeof(metadata));
+    ss_info_dassert(plan != NULL, "Plan must be allocated");
+
+    ss_info_dassert(plan[0].kind == COLUMN_KIND_INT && plan[0].size == 4, "LONG is a 4 byte integer");
+    ss_info_dassert(plan[1].kind == COLUMN_KIND_VARSTRING && plan[1].metadata == &metadata[0],
+                    "VARCHAR is a variable string");
+    ss_info_dassert(plan[2].kind == COLUMN_KIND_DOUBLE && plan[2].metadata == &metadata[2],
+                    "DOUBLE is a double");
+    ss_info_dassert(plan[3].kind == COLUMN_KIND_LONG && plan[3].size == 8, "LONGLONG is a long");
+    ss_info_dassert(plan[4].kind == COLUMN_KIND_ENUM && plan[4].size == 1, "ENUM is stored as a STRING");
+    ss_info_dassert(plan[5].kind == COLUMN_KIND_BLOB && plan[5].size == 2, "BLOB has a 2 byte length");
+    ss_info_dassert(plan[6].kind == COLUMN_KIND_DECIMAL && plan[6].size == 5, "DECIMAL(10,2) is 5 bytes");
+    ss_info_dassert(plan[7].kind == COLUMN_KIND_TEMPORAL && plan[7].metadata == &metadata[8],
+                    "DATETIME2 is temporal");
+    ss_info_dassert(plan[8].kind == COLUMN_KIND_INT && plan[8].size == 3, "INT24 is a 3 byte integer");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    free(plan);
+    return 0;
+}
+
+/**
+ * test2    Bitmap words must contain the bits of the requested columns.
+ */
+static int
+test2()
+{
+    uint8_t bitmap[10] = {0x01, 0, 0, 0, 0, 0, 0, 0x80, 0x03, 0x01};
+
+    ss_dfprintf(stderr, "testmysqlbinlog : bitmap words");
+    ss_info_dassert(column_bitmap_word(bitmap, 80, 0) == 0x8000000000000001ULL,
+                    "First word must have columns 0 and 63 set");
+    ss_info_dassert(column_bitmap_word(bitmap, 80, 64) == 0x0103ULL,
+                    "Second word must have columns 64, 65 and 72 set");
+    ss_info_dassert(column_bitmap_word(bitmap, 66, 64) == 0x03ULL,
+                    "Bytes past the bitmap must not be read");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
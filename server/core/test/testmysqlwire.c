@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Test of the MySQL wire format encoding and decoding
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql_wire.h>
+
+static int
+test_lenenc()
+{
+    uint64_t values[] = {0, 250, 251, 0xffff, 0x10000, 0xffffff, 0x1000000, UINT64_MAX};
+    uint8_t buf[16];
+    int rval = 0;
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        uint8_t *end = mxs_wire_put_lenenc(buf, values[i]);
+        const uint8_t *ptr = buf;
+        uint64_t value;
+
+        if ((size_t)(end - buf) != mxs_wire_lenenc_size(values[i]) ||
+            mxs_wire_lenenc_bytes(buf[0]) != mxs_wire_lenenc_size(values[i]) ||
+            !mxs_wire_get_lenenc(&ptr, end, &value) || value != values[i] || ptr != end)
+        {
+            printf("Length-encoded integer %lu failed\n", (unsigned long)values[i]);
+            rval++;
+        }
+
+        ptr = buf;
+        if (end - buf > 1 && mxs_wire_get_lenenc(&ptr, end - 1, &value))
+        {
+            printf("Truncated integer %lu was read\n", (unsigned long)values[i]);
+            rval++;
+        }
+    }
+
+    return rval;
+}
+
+static int
+test_lenenc_str()
+{
+    char str[300];
+    uint8_t buf[320];
+    const char *out;
+    size_t len;
+    int rval = 0;
+
+    memset(str, 'a', sizeof(str));
+
+    uint8_t *end = mxs_wire_put_lenenc_str(buf, str, sizeof(str));
+    const uint8_t *ptr = buf;
+
+    if (end - buf != 3 + sizeof(str) ||
+        !mxs_wire_get_lenenc_str(&ptr, end, &out, &len) ||
+        len != sizeof(str) || memcmp(out, str, len) != 0 || ptr != end)
+    {
+        printf("Length-encoded string failed\n");
+        rval++;
+    }
+
+    ptr = buf;
+    if (mxs_wire_get_lenenc_str(&ptr, end - 1, &out, &len))
+    {
+        printf("Truncated string was read\n");
+        rval++;
+    }
+
+    buf[0] = MXS_WIRE_LENENC_NULL;
+    ptr = buf;
+    if (mxs_wire_get_lenenc_str(&ptr, end, &out, &len))
+    {
+        printf("NULL was read as a string\n");
+        rval++;
+    }
+
+    return rval;
+}
+
+static int
+test_packets()
+{
+    uint8_t ok[] = {7, 0, 0, 2, 0, 1, 0, 2, 0, 0, 0};
+    uint8_t err[] = {9, 0, 0, 1, 0xff, 0x10, 0x04, '#', '4', '2', '0', '0', '0'};
+    uint8_t eof[] = {5, 0, 0, 3, 0xfe, 0, 0, 2, 0};
+    uint8_t coldef[] = {23, 0, 0, 2, 3, 'd', 'e', 'f', 0, 0, 0, 1, 'a', 0, 0x0c,
+                        0x3f, 0, 4, 0, 0, 0, 3, 0x81, 0, 0, 0, 0};
+    uint8_t buf[64];
+    int rval = 0;
+
+    if (mxs_wire_ok_len(1, 0, 0) != sizeof(ok) ||
+        mxs_wire_put_ok(buf, 2, 1, 0, MXS_WIRE_STATUS_AUTOCOMMIT, 0, NULL, 0) != buf + sizeof(ok) ||
+        memcmp(buf, ok, sizeof(ok)) != 0)
+    {
+        printf("OK packet failed\n");
+        rval++;
+    }
+
+    if (mxs_wire_err_len("42000", 0) != sizeof(err) ||
+        mxs_wire_put_err(buf, 1, 1040, "42000", "", 0) != buf + sizeof(err) ||
+        memcmp(buf, err, sizeof(err)) != 0)
+    {
+        printf("ERR packet failed\n");
+        rval++;
+    }
+
+    if (mxs_wire_put_eof(buf, 3, 0, MXS_WIRE_STATUS_AUTOCOMMIT) != buf + MXS_WIRE_EOF_LEN ||
+        memcmp(buf, eof, sizeof(eof)) != 0)
+    {
+        printf("EOF packet failed\n");
+        rval++;
+    }
+
+    if (mxs_wire_coldef_len(0, 0, 1) != sizeof(coldef) ||
+        mxs_wire_put_coldef(buf, 2, "", "", "a", 0x3f, 4, 3, 0x81, 0) != buf + sizeof(coldef) ||
+        memcmp(buf, coldef, sizeof(coldef)) != 0)
+    {
+        printf("Column definition packet failed\n");
+        rval++;
+    }
+
+    GWBUF *pkt = mxs_wire_create_err(1, 1040, "42000", "");
+
+    if (pkt == NULL || GWBUF_LENGTH(pkt) != sizeof(err) ||
+        memcmp(GWBUF_DATA(pkt), err, sizeof(err)) != 0)
+    {
+        printf("Created ERR packet failed\n");
+        rval++;
+    }
+    gwbuf_free(pkt);
+
+    return rval;
+}
+
+int main(int argc, char **argv)
+{
+    int rval = 0;
+
+    rval += test_lenenc();
+    rval += test_lenenc_str();
+    rval += test_packets();
+
+    return rval;
+}
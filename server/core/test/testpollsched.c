@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testpollsched.c - The deficit round-robin over the scheduling classes
+ * of the event queue
+ *
+ * The event queue and its scheduler are internal to poll.c, which is included
+ * here. The test fills a poll set of its own with DCBs of two services and
+ * processes one event of the chosen DCB at a time, requeueing it as if it
+ * always had more events.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include "../poll.c"
+
+#define N_DCBS   4
+#define N_EVENTS 40
+
+#define CLASS_A  1
+#define CLASS_B  2
+#define WEIGHT_A 3
+
+static POLL_SET set;
+static SERVICE services[2];
+static SESSION sessions[2];
+static DCB dcbs[2][N_DCBS];
+
+/** Queue N_DCBS DCBs of both services, the class of service A has a weight of WEIGHT_A */
+static void
+init_set()
+{
+    memset(&set, 0, sizeof(set));
+    memset(dcbs, 0, sizeof(dcbs));
+    poll_set_sched_weight(CLASS_A, WEIGHT_A);
+
+    for (int s = 0; s < 2; s++)
+    {
+        services[s].sched_class = s == 0 ? CLASS_A : CLASS_B;
+        sessions[s].service = &services[s];
+
+        for (int i = 0; i < N_DCBS; i++)
+        {
+            dcbs[s][i].session = &sessions[s];
+            poll_evq_append(&set, &dcbs[s][i]);
+        }
+    }
+}
+
+/**
+ * Process one event of the next DCB and requeue it
+ *
+ * @return The index of the service of the DCB, -1 if there was none
+ */
+static int
+process_one(DCB **chosen)
+{
+    DCB *dcb = poll_evq_next(&set);
+
+    if (chosen)
+    {
+        *chosen = dcb;
+    }
+    if (dcb == NULL)
+    {
+        return -1;
+    }
+    poll_evq_requeue(&set, dcb);
+
+    return dcb->session == &sessions[0] ? 0 : 1;
+}
+
+/**
+ * test1    Each class processes as many events in its turn as its weight and
+ *          the busy classes share the events in proportion to their weights
+ *
+ */
+static int
+test1()
+{
+    int counts[2] = {0, 0};
+
+    ss_dfprintf(stderr, "testpollsched : Share the events by the weights of the classes");
+    init_set();
+
+    for (int i = 0; i < N_EVENTS; i++)
+    {
+        int s = process_one(NULL);
+
+        ss_info_dassert(s >= 0, "A DCB should be chosen");
+        /** Service A uses the first WEIGHT_A events of each round, B the last one */
+        ss_info_dassert(s == (i % (WEIGHT_A + 1) < WEIGHT_A ? 0 : 1),
+                        "A class should process as many events in its turn as its weight");
+        counts[s]++;
+    }
+
+    ss_info_dassert(counts[0] == N_EVENTS * WEIGHT_A / (WEIGHT_A + 1) &&
+                    counts[1] == N_EVENTS / (WEIGHT_A + 1),
+                    "The events should be shared by the weights of the classes");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    The DCBs of a class are served in the order their events arrived
+ *
+ */
+static int
+test2()
+{
+    int next[2] = {0, 0};
+
+    ss_dfprintf(stderr, "testpollsched : Serve the DCBs of a class in order");
+    init_set();
+
+    for (int i = 0; i < N_EVENTS; i++)
+    {
+        DCB *dcb;
+        int s = process_one(&dcb);
+
+        ss_info_dassert(dcb == &dcbs[s][next[s]], "The DCBs of a class should take turns");
+        next[s] = (next[s] + 1) % N_DCBS;
+    }
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    A class whose DCBs are all being processed by other threads gives
+ *          its turn away, and an empty class is skipped
+ *
+ */
+static int
+test3()
+{
+    ss_dfprintf(stderr, "testpollsched : Skip the classes that have nothing to process");
+    init_set();
+
+    for (int i = 0; i < N_DCBS; i++)
+    {
+        dcbs[0][i].evq.processing = 1;
+    }
+    for (int i = 0; i < N_EVENTS; i++)
+    {
+        ss_info_dassert(process_one(NULL) == 1,
+                        "Only the class that is not being processed should be served");
+    }
+    for (int i = 0; i < N_DCBS; i++)
+    {
+        dcbs[0][i].evq.processing = 0;
+        poll_evq_remove(&set, &dcbs[1][i]);
+    }
+    ss_info_dassert(set.active == ((uint64_t)1 << CLASS_A),
+                    "Only the class of service A should have queued DCBs");
+
+    for (int i = 0; i < N_EVENTS; i++)
+    {
+        ss_info_dassert(process_one(NULL) == 0, "Only the class with DCBs should be served");
+    }
+    for (int i = 0; i < N_DCBS; i++)
+    {
+        poll_evq_remove(&set, &dcbs[0][i]);
+    }
+    ss_info_dassert(set.active == 0 && set.evq_length == 0, "The queue should be empty");
+    ss_info_dassert(process_one(NULL) == -1, "Nothing should be chosen from an empty queue");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    exit(result);
+}
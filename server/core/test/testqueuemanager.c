@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <skygw_debug.h>
+
+#include <housekeeper.h>
+#include <queuemanager.h>
+
+static int objects[CONNECTION_QUEUE_LIMIT];
+
+/**
+ * Test the order and the limit of the queue
+ */
+static int
+test1()
+{
+    QUEUE_CONFIG *queue;
+    QUEUE_ENTRY entry;
+
+    ss_dfprintf(stderr, "testqueuemanager : Queue up to the limit");
+    queue = mxs_queue_alloc(3, 10);
+    ss_info_dassert(queue != NULL, "Allocating a queue should succeed");
+    ss_info_dassert(!mxs_queue_peek(queue, &entry), "New queue should be empty");
+    ss_info_dassert(mxs_enqueue(queue, &objects[0]), "Queuing should succeed");
+    ss_info_dassert(mxs_enqueue(queue, &objects[1]), "Queuing should succeed");
+    ss_info_dassert(mxs_enqueue(queue, &objects[2]), "Queuing should succeed");
+    ss_info_dassert(!mxs_enqueue(queue, &objects[3]), "Queuing past the limit should fail");
+    ss_info_dassert(mxs_queue_count(queue) == 3, "Queue should have three entries");
+    ss_dfprintf(stderr, "\t..done\nDequeue in order.");
+
+    ss_info_dassert(mxs_queue_peek(queue, &entry) && entry.queued_object == &objects[0],
+                    "Peek should return the oldest entry");
+    for (int i = 0; i < 3; i++)
+    {
+        ss_info_dassert(mxs_dequeue(queue, &entry), "Dequeuing should succeed");
+        ss_info_dassert(entry.queued_object == &objects[i], "Entries should come out in order");
+    }
+    ss_info_dassert(!mxs_dequeue(queue, &entry), "Empty queue should not return entries");
+    mxs_queue_free(queue);
+    ss_dfprintf(stderr, "\t..done\nWrap around the end of the array.");
+
+    queue = mxs_queue_alloc(CONNECTION_QUEUE_LIMIT, 10);
+    for (int round = 0; round < 3; round++)
+    {
+        int n = 0;
+        while (mxs_enqueue(queue, &objects[n]))
+        {
+            n++;
+        }
+        ss_info_dassert(n == CONNECTION_QUEUE_LIMIT, "Full queue should hold the limit");
+        for (int i = 0; i < n; i++)
+        {
+            ss_info_dassert(mxs_dequeue(queue, &entry) && entry.queued_object == &objects[i],
+                            "Entries should come out in order");
+        }
+        /** Move the start so that the next round wraps around */
+        mxs_enqueue(queue, &objects[0]);
+        mxs_dequeue(queue, &entry);
+    }
+    mxs_queue_free(queue);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * Test the expiry of queued entries
+ */
+static int
+test2()
+{
+    QUEUE_CONFIG *queue;
+    QUEUE_ENTRY entry;
+
+    ss_dfprintf(stderr, "testqueuemanager : Expire queued entries");
+    queue = mxs_queue_alloc(10, 2);
+    mxs_enqueue(queue, &objects[0]);
+    hkheartbeat += 10;
+    mxs_enqueue(queue, &objects[1]);
+    hkheartbeat += 10;
+    ss_info_dassert(!mxs_dequeue_expired(queue, &entry), "Nothing should expire after the timeout");
+    hkheartbeat++;
+    ss_info_dassert(mxs_dequeue_expired(queue, &entry) && entry.queued_object == &objects[0],
+                    "Oldest entry should expire");
+    ss_info_dassert(!mxs_dequeue_expired(queue, &entry), "Newer entry should not expire");
+    hkheartbeat += 10;
+    ss_info_dassert(mxs_dequeue_expired(queue, &entry) && entry.queued_object == &objects[1],
+                    "Newer entry should expire later");
+    ss_info_dassert(mxs_queue_count(queue) == 0, "Queue should be empty");
+    mxs_queue_free(queue);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * Test adding and removing entries in batches
+ */
+static int
+test3()
+{
+    QUEUE_CONFIG *queue;
+    QUEUE_ENTRY entries[10];
+    QUEUE_STATS stats;
+    void *batch[10];
+
+    ss_dfprintf(stderr, "testqueuemanager : Batches of entries");
+    for (int i = 0; i < 10; i++)
+    {
+        batch[i] = &objects[i];
+    }
+
+    queue = mxs_queue_create(8, QUEUE_TIMESTAMPS);
+    ss_info_dassert(mxs_enqueue_batch(queue, batch, 5) == 5, "Whole batch should be queued");
+    ss_info_dassert(mxs_enqueue_batch(queue, batch + 5, 5) == 3, "Batch should be cut at the limit");
+    ss_info_dassert(mxs_dequeue_batch(queue, entries, 6) == 6, "Six entries should be removed");
+    for (int i = 0; i < 6; i++)
+    {
+        ss_info_dassert(entries[i].queued_object == &objects[i], "Entries should come out in order");
+    }
+    ss_info_dassert(mxs_enqueue_batch(queue, batch, 10) == 6, "Freed slots should be reused");
+    ss_info_dassert(mxs_dequeue_batch(queue, entries, 10) == 8, "All entries should be removed");
+    ss_info_dassert(entries[0].queued_object == &objects[6] &&
+                    entries[2].queued_object == &objects[0], "Batches should wrap around the ring");
+    ss_info_dassert(mxs_dequeue_batch(queue, entries, 10) == 0, "Queue should be empty");
+
+    mxs_queue_get_stats(queue, &stats);
+    ss_info_dassert(stats.n_enqueued == 14 && stats.n_dequeued == 14 && stats.n_full == 6,
+                    "Statistics should count the entries");
+    mxs_queue_free(queue);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+#define TEST4_THREADS 4
+#define TEST4_ITEMS   100000
+
+static QUEUE_CONFIG *test4_queue;
+static long test4_sums[TEST4_THREADS];
+static int test4_received;
+
+static void *
+test4_producer(void *arg)
+{
+    long id = (long)arg;
+
+    for (long i = 1; i <= TEST4_ITEMS; i++)
+    {
+        while (!mxs_enqueue(test4_queue, (void *)(id * TEST4_ITEMS + i)))
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *
+test4_consumer(void *arg)
+{
+    long id = (long)arg;
+    QUEUE_ENTRY entries[16];
+
+    while (__atomic_load_n(&test4_received, __ATOMIC_RELAXED) < TEST4_THREADS * TEST4_ITEMS)
+    {
+        int n = mxs_dequeue_batch(test4_queue, entries, 16);
+
+        for (int i = 0; i < n; i++)
+        {
+            test4_sums[id] += (long)entries[i].queued_object;
+        }
+        __atomic_add_fetch(&test4_received, n, __ATOMIC_RELAXED);
+
+        if (n == 0)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test that concurrent producers and consumers pass every entry exactly once
+ */
+static int
+test4()
+{
+    pthread_t producers[TEST4_THREADS], consumers[TEST4_THREADS];
+    long expected = 0, sum = 0;
+
+    ss_dfprintf(stderr, "testqueuemanager : Concurrent producers and consumers");
+    test4_queue = mxs_queue_create(64, 0);
+
+    for (long i = 0; i < TEST4_THREADS; i++)
+    {
+        pthread_create(&consumers[i], NULL, test4_consumer, (void *)i);
+        pthread_create(&producers[i], NULL, test4_producer, (void *)i);
+    }
+    for (int i = 0; i < TEST4_THREADS; i++)
+    {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+
+    for (long id = 0; id < TEST4_THREADS; id++)
+    {
+        sum += test4_sums[id];
+        for (long i = 1; i <= TEST4_ITEMS; i++)
+        {
+            expected += id * TEST4_ITEMS + i;
+        }
+    }
+    ss_info_dassert(sum == expected, "Every entry should be received once");
+    ss_info_dassert(mxs_queue_count(test4_queue) == 0, "Queue should be empty");
+    mxs_queue_free(test4_queue);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    hkheartbeat = 1000;
+    result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+
+    exit(result);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <skygw_debug.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <random_jkiss.h>
+
+#define N_THREADS   8
+#define N_NUMBERS   1000000
+
+static unsigned int first[N_THREADS];   /*< The first number of each thread */
+static long bits[N_THREADS];            /*< The number of bits set in the numbers */
+static SPINLOCK lock = SPINLOCK_INIT;
+static int use_lock;
+
+static void
+generate(void *data)
+{
+    int id = (int)(long)data;
+    long n_bits = 0;
+
+    first[id] = random_jkiss();
+    for (int i = 0; i < N_NUMBERS; i++)
+    {
+        unsigned int r;
+
+        if (use_lock)
+        {
+            /** How random_jkiss behaved when all threads shared one generator */
+            spinlock_acquire(&lock);
+            r = random_jkiss();
+            spinlock_release(&lock);
+        }
+        else
+        {
+            r = random_jkiss();
+        }
+        n_bits += __builtin_popcount(r);
+    }
+    bits[id] = n_bits;
+}
+
+static double
+run_threads()
+{
+    THREAD threads[N_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < N_THREADS; i++)
+    {
+        thread_start(&threads[i], generate, (void *)i);
+    }
+    for (int i = 0; i < N_THREADS; i++)
+    {
+        thread_wait(threads[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * test1    Every thread has a generator of its own
+ *
+ */
+static int
+test1()
+{
+    ss_dfprintf(stderr, "testrandom : Generate numbers in %d threads", N_THREADS);
+    use_lock = 0;
+    run_threads();
+
+    for (int i = 0; i < N_THREADS; i++)
+    {
+        for (int j = i + 1; j < N_THREADS; j++)
+        {
+            ss_info_dassert(first[i] != first[j], "Threads should be seeded differently");
+        }
+
+        /** Half of the bits should be set, the deviation is about 2800 bits */
+        long expected = N_NUMBERS * 16L;
+        ss_info_dassert(labs(bits[i] - expected) < 50000, "Numbers should be evenly distributed");
+    }
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    Compare the generators of the threads with a shared one
+ *
+ */
+static int
+test2()
+{
+    use_lock = 1;
+    double locked = run_threads();
+    use_lock = 0;
+    double local = run_threads();
+
+    ss_dfprintf(stderr, "testrandom : %d threads, %d numbers each: "
+                "shared generator %.3fs, thread generators %.3fs\n",
+                N_THREADS, N_NUMBERS, locked, local);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
@@ -32,9 +32,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <time.h>
 
 #include <server.h>
+#include <dcb.h>
+#include <session.h>
 #include <log_manager.h>
+#include <hk_heartbeat.h>
 /**
  * test1    Allocate a server and do lots of other things
  *
@@ -100,11 +107,269 @@ test1()
 
 }
 
+/**
+ * Allocate a backend DCB that looks like one closed into the persistent pool.
+ * Its socket is one end of a socket pair, the server end is returned in peer.
+ */
+static DCB *
+pooled_dcb(SERVER *server, char *user, int *peer)
+{
+    DCB *dcb = dcb_alloc(DCB_ROLE_BACKEND_HANDLER, NULL);
+    int sv[2];
+
+    ss_info_dassert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "Socket pair must be created");
+    dcb->fd = sv[0];
+    *peer = sv[1];
+    dcb->server = server;
+    dcb->user = strdup(user);
+    dcb->protoname = strdup("MySQLBackend");
+    dcb->persistentstart = time(NULL);
+    return dcb;
+}
+
+/**
+ * Close the sockets of a DCB taken from the persistent pool and free it
+ */
+static void
+free_pooled_dcb(DCB *dcb, int peer)
+{
+    close(dcb->fd);
+    close(peer);
+    dcb->fd = DCBFD_CLOSED;
+    dcb_close(dcb);
+}
+
+/**
+ * A protocol that can switch the user of a pooled connection
+ */
+static int
+reuse_stub(DCB *dcb, SESSION *session)
+{
+    return 1;
+}
+
+/**
+ * test2    The persistent pool keeps a stack of connections per user
+ *
+ */
+static int
+test2()
+{
+    SERVER *server;
+    SERVER_POOL_USER *alice, *bob;
+    DCB *first, *second, *other;
+    int first_peer, second_peer, other_peer;
+
+    ss_dfprintf(stderr, "testserver : persistent pool by user");
+    server = server_alloc("PoolServer", "MySQLBackend", 3306);
+    server_set_unique_name(server, "poolserver");
+    server->persistpoolmax = 10;
+    server->persistmaxtime = 60;
+
+    alice = server_pool_user(server, "alice");
+    bob = server_pool_user(server, "bob");
+    ss_info_dassert(alice && bob && alice != bob, "Users must have their own entries");
+    ss_info_dassert(alice == server_pool_user(server, "alice"), "Entry of a user must be found again");
+
+    first = pooled_dcb(server, "alice", &first_peer);
+    second = pooled_dcb(server, "alice", &second_peer);
+    other = pooled_dcb(server, "bob", &other_peer);
+    server_add_persistent(server, alice, first);
+    server_add_persistent(server, alice, second);
+    server_add_persistent(server, bob, other);
+    ss_info_dassert(server->stats.n_persistent == 3, "Pool must hold three connections");
+    ss_info_dassert(alice->count == 2 && bob->count == 1, "Stacks must be counted per user");
+
+    ss_info_dassert(server_get_persistent(server, "carol", "MySQLBackend", 0) == NULL,
+                    "Unknown user must get no connection");
+    ss_info_dassert(server_get_persistent(server, "alice", "HTTPD", 0) == NULL,
+                    "Other protocol must get no connection");
+    ss_info_dassert(server_get_persistent(server, "alice", "MySQLBackend", 0) == second,
+                    "Newest connection of the user must be reused first");
+    ss_info_dassert(server_get_persistent(server, "alice", "MySQLBackend", 0) == first,
+                    "Older connection must be reused next");
+    ss_info_dassert(server_get_persistent(server, "alice", "MySQLBackend", 0) == NULL,
+                    "Stack of the user must be empty");
+    ss_info_dassert(server->stats.n_persistent == 1 && bob->count == 1,
+                    "Connection of the other user must stay in the pool");
+
+    other->func.reuse = reuse_stub;
+    ss_info_dassert(server_get_persistent(server, "carol", "MySQLBackend", 0) == other,
+                    "Connection of another user must be taken if it can be switched");
+    ss_info_dassert(0 == strcmp(other->user, "bob"), "Caller must see the user of the connection");
+    ss_info_dassert(server->stats.n_persistent == 0 && bob->count == 0, "Pool must be empty");
+
+    free_pooled_dcb(first, first_peer);
+    free_pooled_dcb(second, second_peer);
+    free_pooled_dcb(other, other_peer);
+    ss_info_dassert(0 != server_free(server), "Free should succeed");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test3    Published states are snapshots of the server
+ *
+ */
+static int
+test3()
+{
+    SERVER *server;
+    const SERVER_STATE *first, *second;
+
+    ss_dfprintf(stderr, "testserver : published server states");
+    server = server_alloc("StateServer", "MySQLBackend", 3306);
+    first = server_state_acquire(server);
+    ss_info_dassert(first && first->status == SERVER_RUNNING, "New server must have a state");
+
+    server_set_status(server, SERVER_MASTER);
+    server->rlag = 5;
+    ss_info_dassert(first->status == SERVER_RUNNING, "Snapshot must not change with the server");
+
+    server_publish_state(server);
+    second = server_state_acquire(server);
+    ss_info_dassert(second != first, "Publishing must replace the snapshot");
+    ss_info_dassert(second->status == (SERVER_RUNNING | SERVER_MASTER) && second->rlag == 5,
+                    "Snapshot must have the published state");
+    ss_info_dassert(second->version == first->version + 1, "Version must be incremented");
+    ss_info_dassert(first->status == SERVER_RUNNING, "Held snapshot must not be freed");
+
+    server_state_release(second);
+    server_state_release(first);
+    ss_info_dassert(0 != server_free(server), "Free should succeed");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test4    The weight of a slave ramps up while it warms up
+ */
+static int
+test4()
+{
+    SERVER *server;
+
+    ss_dfprintf(stderr, "testserver : slave warm-up weights");
+    server = server_alloc("WarmServer", "MySQLBackend", 3306);
+    server_set_status(server, SERVER_SLAVE);
+    ss_info_dassert(server_warmup_weight(server, 1000) == 1000,
+                    "Without warmup_time the full weight must be used");
+
+    hkheartbeat = 1000;
+    server->warmup_time = 10;
+    ss_info_dassert(server_warmup_weight(server, 1000) == 1000,
+                    "A slave from the first monitoring cycle must have the full weight");
+
+    server->slave_since = hkheartbeat;
+    ss_info_dassert(server_warmup_weight(server, 1000) == SERVER_WARMUP_START,
+                    "A new slave must start with a part of its weight");
+    ss_info_dassert(server_warmup_weight(server, 1) == 1, "A positive weight must stay positive");
+    ss_info_dassert(server_warmup_weight(server, 0) == 0, "A zero weight must stay zero");
+
+    server->slave_since = hkheartbeat - 50;
+    ss_info_dassert(server_warmup_weight(server, 1000) == (1000 + SERVER_WARMUP_START) / 2,
+                    "Half way through the weight must be half way to full");
+
+    server->slave_since = hkheartbeat - 100;
+    ss_info_dassert(server_warmup_weight(server, 1000) == 1000,
+                    "After warmup_time the full weight must be used");
+
+    server->slave_since = hkheartbeat;
+    server_set_status(server, SERVER_MAINT);
+    ss_info_dassert(server_warmup_weight(server, 1000) == 1000,
+                    "A server that is not a slave must not be scaled");
+
+    ss_info_dassert(0 != server_free(server), "Free should succeed");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test5    The servers are found by name and by address after they change
+ */
+static int
+test5()
+{
+    SERVER *first, *second;
+
+    ss_dfprintf(stderr, "testserver : lookups by name and address");
+    first = server_alloc("127.0.0.1", "MySQLBackend", 3306);
+    second = server_alloc("127.0.0.1", "MySQLBackend", 3306);
+    server_set_unique_name(first, "lookup1");
+    server_set_unique_name(second, "lookup2");
+    ss_info_dassert(first == server_find_by_unique_name("lookup1"), "Should find the first server by name.");
+    ss_info_dassert(second == server_find_by_unique_name("lookup2"), "Should find the second server by name.");
+    ss_info_dassert(second == server_find("127.0.0.1", 3306), "Should find the newest server by address.");
+
+    server_update_port(second, 3307);
+    ss_info_dassert(first == server_find("127.0.0.1", 3306), "Should find the other server by the old port.");
+    ss_info_dassert(second == server_find("127.0.0.1", 3307), "Should find the server by its new port.");
+
+    server_update_address(first, "127.0.0.2");
+    ss_info_dassert(NULL == server_find("127.0.0.1", 3306), "Should not find the server by the old address.");
+    ss_info_dassert(first == server_find("127.0.0.2", 3306), "Should find the server by its new address.");
+
+    server_set_unique_name(second, "lookup1");
+    ss_info_dassert(NULL == server_find_by_unique_name("lookup2"), "Should not find the server by the old name.");
+    ss_info_dassert(second == server_find_by_unique_name("lookup1"), "Should find the server by its new name.");
+
+    ss_info_dassert(0 != server_free(second), "Free should succeed");
+    ss_info_dassert(first == server_find_by_unique_name("lookup1"),
+                    "The remaining server with the name should be found.");
+    ss_info_dassert(NULL == server_find("127.0.0.1", 3307), "Should not find a freed server.");
+    ss_info_dassert(0 != server_free(first), "Free should succeed");
+    ss_info_dassert(NULL == server_find_by_unique_name("lookup1"), "Should not find a freed server.");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test6    A pooled connection that the server has closed is not reused
+ */
+static int
+test6()
+{
+    SERVER *server;
+    SERVER_POOL_USER *alice;
+    DCB *older, *newer;
+    int older_peer, newer_peer;
+
+    ss_dfprintf(stderr, "testserver : closed connections in the persistent pool");
+    server = server_alloc("DeadServer", "MySQLBackend", 3306);
+    server_set_unique_name(server, "deadserver");
+    server->persistpoolmax = 10;
+    server->persistmaxtime = 60;
+
+    alice = server_pool_user(server, "alice");
+    older = pooled_dcb(server, "alice", &older_peer);
+    newer = pooled_dcb(server, "alice", &newer_peer);
+    server_add_persistent(server, alice, older);
+    server_add_persistent(server, alice, newer);
+    ss_info_dassert(dcb_persistent_alive(newer), "Connection must be alive while the server keeps it");
+
+    close(newer_peer);
+    ss_info_dassert(!dcb_persistent_alive(newer), "Connection closed by the server must be dead");
+    ss_info_dassert(server_get_persistent(server, "alice", "MySQLBackend", 0) == older,
+                    "Connection closed by the server must be skipped");
+    ss_info_dassert(alice->count == 0 && server->stats.n_persistent == 0,
+                    "Connection closed by the server must be dropped from the pool");
+
+    free_pooled_dcb(older, older_peer);
+    ss_info_dassert(0 != server_free(server), "Free should succeed");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+    result += test5();
+    result += test6();
 
     exit(result);
 }
@@ -32,40 +32,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
-#include <maxscale/poll.h>
-#include <dcb.h>
+#include <spinlock.h>
+#include <session.h>
 
 /**
- * test1    Allocate a service and do lots of other things
+ * test1    Allocate memory from the arena of a session
  *
-  */
-
+ */
 static int
 test1()
 {
-    DCB     *dcb;
-    int     result;
+    SESSION *session = calloc(1, sizeof(SESSION));
+    char *small[100];
+    char *large;
+    char *str;
+    int i;
+
+    ss_dfprintf(stderr, "testsession : Allocate session memory.");
+    ss_info_dassert(session != NULL, "Session must be allocated");
+    spinlock_init(&session->arena_lock);
+
+    for (i = 0; i < 100; i++)
+    {
+        small[i] = session_arena_alloc(session, 1 + i * 7);
+        ss_info_dassert(small[i] != NULL, "Allocation must succeed");
+        ss_info_dassert(((uintptr_t)small[i] & 15) == 0, "Memory must be aligned");
+        ss_info_dassert(small[i][i * 7] == 0, "Memory must be zeroed");
+        memset(small[i], i, 1 + i * 7);
+    }
 
-    /* Poll tests */
-    ss_dfprintf(stderr,
-                "testpoll : Initialise the polling system.");
-    poll_init();
-    ss_dfprintf(stderr, "\t..done\nAdd a DCB");
-    dcb = dcb_alloc(DCB_ROLE_SERVICE_LISTENER);
-    dcb->fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    poll_add_dcb(dcb);
-    poll_remove_dcb(dcb);
-    poll_add_dcb(dcb);
-    ss_dfprintf(stderr, "\t..done\nStart wait for events.");
-    sleep(10);
-    poll_shutdown();
-    ss_dfprintf(stderr, "\t..done\nTidy up.");
-    dcb_close(dcb);
+    large = session_arena_alloc(session, 100000);
+    ss_info_dassert(large != NULL, "Large allocation must succeed");
+    memset(large, 0xff, 100000);
+
+    str = session_arena_strdup(session, "session string");
+    ss_info_dassert(str && strcmp(str, "session string") == 0, "String must be copied");
+
+    for (i = 0; i < 100; i++)
+    {
+        ss_info_dassert(small[i][0] == i && small[i][i * 7] == i,
+                        "Allocations must not overlap");
+    }
     ss_dfprintf(stderr, "\t..done\n");
 
     return 0;
-
 }
 
 int main(int argc, char **argv)
@@ -245,6 +245,63 @@ test3()
     return 0 == failures ? 0 : 1;
 }
 
+/**
+ * test4    lock site counters
+ *
+ * Check that a thread that waits for a long held lock is counted as
+ * contended at its site and that it sleeps instead of spinning.
+ */
+static SPINLOCK_SITE test4_site = SPINLOCK_SITE_INIT;
+static bool test4_found;
+
+static void
+test4_helper(void *data)
+{
+    SPINLOCK *lck = (SPINLOCK *)data;
+
+    spinlock_acquire_at(lck, &test4_site);
+    spinlock_release(lck);
+}
+
+static void
+test4_reporter(void *hdl, SPINLOCK_SITE *site)
+{
+    if (site == &test4_site)
+    {
+        test4_found = true;
+    }
+}
+
+static int
+test4()
+{
+    SPINLOCK    lck;
+    THREAD      handle;
+    struct timespec sleeptime;
+
+    sleeptime.tv_sec = 1;
+    sleeptime.tv_nsec = 0;
+
+    spinlock_init(&lck);
+    spinlock_acquire_at(&lck, &test4_site);
+    thread_start(&handle, test4_helper, (void *)&lck);
+    nanosleep(&sleeptime, NULL);
+    spinlock_release(&lck);
+    thread_wait(handle);
+
+    spinlock_sites(test4_reporter, NULL);
+
+    if (!test4_found || test4_site.acquired != 2 || test4_site.contended != 1 ||
+        test4_site.parked != 1 || test4_site.cycles == 0)
+    {
+        fprintf(stderr, "spinlock: test 4 failed, acquired %lu contended %lu slept %lu.\n",
+                (unsigned long)test4_site.acquired, (unsigned long)test4_site.contended,
+                (unsigned long)test4_site.parked);
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
@@ -252,6 +309,7 @@ int main(int argc, char **argv)
     result += test1();
     result += test2();
     result += test3();
+    result += test4();
 
     exit(result);
 }
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <statistics.h>
+#include <unistd.h>
+
+/**
+ * test1    Log-linear buckets
+ *
+ * Every value falls between the limits of its bucket and the width of a
+ * bucket is at most one eighth of its values.
+ */
+static int
+test1()
+{
+    int64_t prev_limit = -1;
+
+    for (int bucket = 0; bucket < TS_LOG_BUCKETS; bucket++)
+    {
+        int64_t limit = ts_log_bucket_limit(bucket);
+
+        if (limit <= prev_limit)
+        {
+            fprintf(stderr, "ts_log_bucket_limit: test 1.1 failed for bucket %d.\n", bucket);
+            return 1;
+        }
+
+        if (ts_log_bucket(limit) != bucket || ts_log_bucket(prev_limit + 1) != bucket)
+        {
+            fprintf(stderr, "ts_log_bucket: test 1.2 failed for bucket %d.\n", bucket);
+            return 1;
+        }
+
+        if (bucket >= TS_LOG_SUB_BUCKETS && (limit - prev_limit) * 8 > limit + 1)
+        {
+            fprintf(stderr, "ts_log_bucket: test 1.3 failed for bucket %d.\n", bucket);
+            return 1;
+        }
+
+        prev_limit = limit;
+    }
+
+    if (ts_log_bucket(-1) != 0 || ts_log_bucket((1LL << 32) - 1) != TS_LOG_BUCKETS - 1)
+    {
+        fprintf(stderr, "ts_log_bucket: test 1.4 failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * test2    Percentiles of a log-linear histogram
+ */
+static int
+test2()
+{
+    ts_histogram_t histogram = ts_histogram_alloc_log();
+
+    if (ts_histogram_percentile(histogram, 50) != 0)
+    {
+        fprintf(stderr, "ts_histogram_percentile: test 2.1 failed.\n");
+        return 1;
+    }
+
+    for (int i = 1; i <= 10000; i++)
+    {
+        ts_histogram_add(histogram, i);
+    }
+
+    int64_t p50 = ts_histogram_percentile(histogram, 50);
+    int64_t p99 = ts_histogram_percentile(histogram, 99);
+    int64_t p100 = ts_histogram_percentile(histogram, 100);
+
+    if (ts_histogram_count(histogram) != 10000)
+    {
+        fprintf(stderr, "ts_histogram_count: test 2.2 failed.\n");
+        return 1;
+    }
+
+    if (p50 < 5000 || p50 > 5000 + 5000 / 8 || p99 < 9900 || p99 > 9900 + 9900 / 8 ||
+        p100 < 10000 || p100 > 10000 + 10000 / 8)
+    {
+        fprintf(stderr, "ts_histogram_percentile: test 2.3 failed: %ld %ld %ld.\n",
+                (long)p50, (long)p99, (long)p100);
+        return 1;
+    }
+
+    ts_histogram_free(histogram);
+    return 0;
+}
+
+/**
+ * test3    Sharded gauges and publishing their sums
+ *
+ * A gauge can go below zero and back, and the sums are due to be published
+ * only once per interval.
+ */
+static int
+test3()
+{
+    ts_gauge_t gauge = ts_gauge_alloc();
+    uint64_t published = 0;
+
+    ts_gauge_add(gauge, 5);
+    ts_gauge_add(gauge, -7);
+    ts_gauge_add(gauge, 3);
+
+    if (ts_gauge_get(gauge) != 1)
+    {
+        fprintf(stderr, "ts_gauge_get: test 3.1 failed: %ld.\n", (long)ts_gauge_get(gauge));
+        return 1;
+    }
+
+    if (!ts_publish_due(&published) || ts_publish_due(&published))
+    {
+        fprintf(stderr, "ts_publish_due: test 3.2 failed.\n");
+        return 1;
+    }
+
+    usleep(20000);
+
+    if (!ts_publish_due(&published))
+    {
+        fprintf(stderr, "ts_publish_due: test 3.3 failed.\n");
+        return 1;
+    }
+
+    ts_gauge_free(gauge);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    ts_stats_init();
+    result += test1();
+    result += test2();
+    result += test3();
+
+    exit(result);
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <skygw_debug.h>
+
+#include <statshm.h>
+
+/** Longer than the initial size of the segment */
+#define LONG_DATA_LEN 200000
+
+static char name[64];
+
+/** Map the segment as a reader does */
+static void *
+map_segment(size_t *size)
+{
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    ss_info_dassert(fd != -1, "The segment should exist");
+    ss_info_dassert(fstat(fd, &st) == 0, "The segment should have a size");
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ss_info_dassert(addr != MAP_FAILED, "The segment should be mapped");
+    close(fd);
+    *size = st.st_size;
+    return addr;
+}
+
+/**
+ * test1    The data written is read back, also after the segment has grown
+ *
+ */
+static int
+test1()
+{
+    char buf[LONG_DATA_LEN];
+    char *data = malloc(LONG_DATA_LEN);
+    size_t mapped, length;
+
+    ss_dfprintf(stderr, "teststatshm : Write and read the statistics");
+    ss_info_dassert(data, "Memory should be allocated");
+    ss_info_dassert(statshm_init(name, 1000), "The segment should be created");
+
+    void *addr = map_segment(&mapped);
+    ss_info_dassert(statshm_read(addr, mapped, buf, sizeof(buf), &length) == STATSHM_OK,
+                    "An empty segment should be read");
+    ss_info_dassert(length == 0, "The segment should be empty");
+
+    ss_info_dassert(statshm_write("metric 1\n", 9), "The data should be written");
+    ss_info_dassert(statshm_read(addr, mapped, buf, sizeof(buf), &length) == STATSHM_OK,
+                    "The data should be read");
+    ss_info_dassert(length == 9 && memcmp(buf, "metric 1\n", 9) == 0,
+                    "The data read should be the data written");
+    ss_info_dassert(((STATSHM_HEADER*)addr)->seq == 2, "The sequence number should be even");
+
+    for (int i = 0; i < LONG_DATA_LEN; i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+    ss_info_dassert(statshm_write(data, LONG_DATA_LEN), "The long data should be written");
+    ss_info_dassert(statshm_read(addr, mapped, buf, sizeof(buf), &length) == STATSHM_RETRY,
+                    "The grown segment should be mapped again");
+    ss_info_dassert(((STATSHM_HEADER*)addr)->size > mapped, "The size should have grown");
+    munmap(addr, mapped);
+
+    addr = map_segment(&mapped);
+    ss_info_dassert(statshm_read(addr, mapped, buf, 100, &length) == STATSHM_RETRY,
+                    "A short buffer should not be filled");
+    ss_info_dassert(length == LONG_DATA_LEN, "The length needed should be returned");
+    ss_info_dassert(statshm_read(addr, mapped, buf, sizeof(buf), &length) == STATSHM_OK,
+                    "The long data should be read");
+    ss_info_dassert(length == LONG_DATA_LEN && memcmp(buf, data, length) == 0,
+                    "The long data read should be the data written");
+    munmap(addr, mapped);
+
+    statshm_close();
+    ss_info_dassert(shm_open(name, O_RDONLY, 0) == -1, "The segment should be removed");
+    free(data);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    Memory that is not a statistics segment is rejected
+ *
+ */
+static int
+test2()
+{
+    STATSHM_HEADER hdr;
+    char buf[16];
+    size_t length;
+
+    ss_dfprintf(stderr, "teststatshm : Reject memory that is not a segment");
+    memset(&hdr, 0, sizeof(hdr));
+    ss_info_dassert(statshm_read(&hdr, sizeof(hdr), buf, sizeof(buf), &length) == STATSHM_INVALID,
+                    "Memory without the magic should be rejected");
+    hdr.magic = STATSHM_MAGIC;
+    hdr.version = STATSHM_VERSION + 1;
+    ss_info_dassert(statshm_read(&hdr, sizeof(hdr), buf, sizeof(buf), &length) == STATSHM_INVALID,
+                    "Another version should be rejected");
+    hdr.version = STATSHM_VERSION;
+    hdr.seq = 1;
+    ss_info_dassert(statshm_read(&hdr, sizeof(hdr), buf, sizeof(buf), &length) == STATSHM_BUSY,
+                    "A segment being written should not be read");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    snprintf(name, sizeof(name), "/maxscale-teststatshm-%d", (int)getpid());
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
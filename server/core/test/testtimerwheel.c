@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <skygw_debug.h>
+
+#include <timerwheel.h>
+
+#define N_TIMERS 1000
+
+static WHEEL_TIMER timers[N_TIMERS];
+static long expired_at[N_TIMERS];
+static int n_expired;
+
+static void
+expire(WHEEL_TIMER *timer)
+{
+    expired_at[timer - timers] = hkheartbeat;
+    n_expired++;
+}
+
+/** Adds itself again once so that the re-added timer expires on the next heartbeat */
+static void
+expire_and_add(WHEEL_TIMER *timer)
+{
+    expire(timer);
+    if (n_expired == 1)
+    {
+        timerwheel_add(timer, 0, hkheartbeat, expire_and_add);
+    }
+}
+
+static void
+turn_wheel(long until)
+{
+    while (hkheartbeat < until)
+    {
+        hkheartbeat++;
+        timerwheel_process(0);
+    }
+}
+
+/**
+ * test1    Timers on all levels of the wheel expire on time
+ *
+ */
+static int
+test1()
+{
+    memset(timers, 0, sizeof(timers));
+    memset(expired_at, 0, sizeof(expired_at));
+    n_expired = 0;
+
+    ss_dfprintf(stderr, "testtimerwheel : Add timers on all levels");
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        /** Spread the expiry times up to three million heartbeats, about 83 hours */
+        long when = hkheartbeat + 1 + (long)i * i * 3;
+        timerwheel_add(&timers[i], 0, when, expire);
+        ss_info_dassert(TIMERWHEEL_PENDING(&timers[i]), "Timer should be pending");
+    }
+
+    /** Removed timers never expire */
+    for (int i = 0; i < N_TIMERS; i += 10)
+    {
+        timerwheel_remove(&timers[i]);
+        ss_info_dassert(!TIMERWHEEL_PENDING(&timers[i]), "Removed timer should not be pending");
+    }
+    ss_dfprintf(stderr, "\t..done\nTurn the wheel.");
+
+    long start = hkheartbeat;
+    turn_wheel(start + 1 + (long)N_TIMERS * N_TIMERS * 3);
+
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        if (i % 10 == 0)
+        {
+            ss_info_dassert(expired_at[i] == 0, "Removed timer should not expire");
+        }
+        else
+        {
+            ss_info_dassert(expired_at[i] == start + 1 + (long)i * i * 3,
+                            "Timer should expire on the heartbeat it was added for");
+            ss_info_dassert(!TIMERWHEEL_PENDING(&timers[i]), "Expired timer should not be pending");
+        }
+    }
+    ss_info_dassert(n_expired == N_TIMERS - N_TIMERS / 10, "All timers should expire once");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    Moving, expired and re-added timers
+ *
+ */
+static int
+test2()
+{
+    memset(timers, 0, sizeof(timers));
+    memset(expired_at, 0, sizeof(expired_at));
+    n_expired = 0;
+
+    ss_dfprintf(stderr, "testtimerwheel : Move a timer to a later time");
+    long start = hkheartbeat;
+    timerwheel_add(&timers[0], 0, start + 5, expire);
+    timerwheel_add(&timers[0], 0, start + 500, expire);
+    turn_wheel(start + 499);
+    ss_info_dassert(n_expired == 0, "Moved timer should not expire early");
+    turn_wheel(start + 500);
+    ss_info_dassert(expired_at[0] == start + 500, "Moved timer should expire at its new time");
+    ss_dfprintf(stderr, "\t..done\nAdd a timer in the past.");
+
+    n_expired = 0;
+    timerwheel_add(&timers[1], 0, hkheartbeat - 100, expire);
+    turn_wheel(hkheartbeat + 1);
+    ss_info_dassert(n_expired == 1, "Timer in the past should expire on the next heartbeat");
+    ss_dfprintf(stderr, "\t..done\nAdd a timer again in its expiry function.");
+
+    n_expired = 0;
+    start = hkheartbeat;
+    timerwheel_add(&timers[2], 0, start + 1, expire_and_add);
+    turn_wheel(start + 1);
+    ss_info_dassert(n_expired == 1, "Timer should expire only once per heartbeat");
+    turn_wheel(start + 2);
+    ss_info_dassert(n_expired == 2, "Re-added timer should expire on the next heartbeat");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    Timers of a wheel that is no longer turned
+ *
+ */
+static int
+test3()
+{
+    memset(timers, 0, sizeof(timers));
+    memset(expired_at, 0, sizeof(expired_at));
+    n_expired = 0;
+
+    ss_dfprintf(stderr, "testtimerwheel : Move the timers of a stopped wheel");
+    long start = hkheartbeat;
+    for (int i = 0; i < N_TIMERS / 2; i++)
+    {
+        timerwheel_add(&timers[i], 1, start + 1 + (long)i * i, expire);
+    }
+
+    /** The timers added for the stopped wheel go to the one that is turned */
+    timerwheel_set_active(1);
+    for (int i = N_TIMERS / 2; i < N_TIMERS; i++)
+    {
+        timerwheel_add(&timers[i], 1, start + 1 + (long)i * i, expire);
+    }
+    timerwheel_move(1, 0);
+
+    /** A moved timer can still be removed */
+    timerwheel_remove(&timers[10]);
+    ss_info_dassert(!TIMERWHEEL_PENDING(&timers[10]), "Removed timer should not be pending");
+
+    turn_wheel(start + 1 + (long)N_TIMERS * N_TIMERS);
+
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        if (i != 10)
+        {
+            ss_info_dassert(expired_at[i] == start + 1 + (long)i * i,
+                            "Timer should expire on the heartbeat it was added for");
+        }
+    }
+    ss_info_dassert(n_expired == N_TIMERS - 1, "All timers should expire once");
+    timerwheel_set_active(2);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+#define N_ROUNDS 100
+
+static volatile int n_added;
+
+/** Adds the timers to the wheel of a thread that is being stopped */
+static void *
+add_timers(void *data)
+{
+    long start = *(long*)data;
+
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        timerwheel_add(&timers[i], 1, start + 1 + i, expire);
+        n_added = i + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * test4    Timers added while the timers of a wheel are moved
+ *
+ */
+static int
+test4()
+{
+    ss_dfprintf(stderr, "testtimerwheel : Add timers while the wheel is moved");
+    for (int round = 0; round < N_ROUNDS; round++)
+    {
+        pthread_t thr;
+        long start = hkheartbeat;
+
+        memset(timers, 0, sizeof(timers));
+        n_expired = 0;
+        n_added = 0;
+        timerwheel_set_active(2);
+
+        ss_info_dassert(pthread_create(&thr, NULL, add_timers, &start) == 0,
+                        "Thread should be created");
+        /**
+         * Stop the thread of the wheel while timers are being added to it.
+         * The wheel is moved before the number of active wheels is lowered,
+         * the timers added in between are like those added by a thread that
+         * read the old number just before the wheel was moved.
+         */
+        while (n_added < round * N_TIMERS / N_ROUNDS)
+        {
+        }
+        timerwheel_move(1, 0);
+        for (int added = n_added; added == n_added && added < N_TIMERS;)
+        {
+        }
+        timerwheel_set_active(1);
+        pthread_join(thr, NULL);
+
+        turn_wheel(start + 1 + N_TIMERS);
+        ss_info_dassert(n_expired == N_TIMERS,
+                        "The timers added during the move should expire");
+    }
+    timerwheel_set_active(2);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    /** Start from a heartbeat that is not aligned with the slots */
+    hkheartbeat = 12345;
+    timerwheel_init(2);
+    result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+
+    exit(result);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testuring.c - The io_uring submission and completion ring
+ *
+ * The tests pass without doing anything if the kernel does not support
+ * io_uring.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <skygw_debug.h>
+
+#include <uring.h>
+
+#define N_ENTRIES 4
+
+/**
+ * test1    Writes are submitted together and their results reaped
+ *
+ */
+static int
+test1(URING *ring)
+{
+    int fds[2];
+    char data[16];
+    struct iovec iov[2][2] =
+    {
+        {{"ab", 2}, {"cd", 2}},
+        {{"efg", 3}, {NULL, 0}}
+    };
+    bool done[2] = {false, false};
+    uint64_t index;
+    int res;
+
+    ss_dfprintf(stderr, "testuring : Submit two writes");
+    ss_info_dassert(pipe(fds) == 0, "Pipe should be created");
+    ss_info_dassert(uring_writev(ring, fds[1], iov[0], 2, 0), "First write should be queued");
+    ss_info_dassert(uring_submit(ring, 1) == 1, "The first write should be submitted");
+    ss_info_dassert(uring_writev(ring, fds[1], iov[1], 1, 1), "Second write should be queued");
+    ss_info_dassert(uring_submit(ring, 2) == 1, "The second write should be submitted");
+
+    for (int i = 0; i < 2; i++)
+    {
+        ss_info_dassert(uring_reap(ring, &index, &res), "Both writes should have completed");
+        ss_info_dassert(index < 2 && !done[index], "A write should complete once");
+        ss_info_dassert(res == (index == 0 ? 4 : 3), "All of the data should be written");
+        done[index] = true;
+    }
+    ss_info_dassert(!uring_reap(ring, &index, &res), "Nothing else should complete");
+    ss_info_dassert(read(fds[0], data, sizeof(data)) == 7 && memcmp(data, "abcdefg", 7) == 0,
+                    "The data should be written in order");
+    close(fds[0]);
+    close(fds[1]);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    A write that fails returns the errno and a full queue is reported
+ *
+ */
+static int
+test2(URING *ring)
+{
+    int fds[2];
+    struct iovec iov = {"x", 1};
+    uint64_t index;
+    int res;
+
+    ss_dfprintf(stderr, "testuring : Write to a closed descriptor");
+    ss_info_dassert(pipe(fds) == 0, "Pipe should be created");
+    close(fds[0]);
+    close(fds[1]);
+    ss_info_dassert(uring_writev(ring, fds[1], &iov, 1, 7), "Write should be queued");
+    ss_info_dassert(uring_submit(ring, 1) == 1, "The write should be submitted");
+    ss_info_dassert(uring_reap(ring, &index, &res), "The write should have completed");
+    ss_info_dassert(index == 7 && res == -EBADF, "The write should fail with EBADF");
+    ss_dfprintf(stderr, "\t..done\nFill the submission queue.");
+
+    int n = 0;
+
+    while (uring_writev(ring, -1, &iov, 1, n))
+    {
+        n++;
+        ss_info_dassert(n <= N_ENTRIES, "The queue should become full");
+    }
+    ss_info_dassert(n == N_ENTRIES, "The queue should hold as many writes as it was created for");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    Writes that were not submitted can be taken back
+ *
+ */
+static int
+test3(URING *ring)
+{
+    uint64_t discarded[N_ENTRIES];
+    uint64_t index;
+    int res;
+
+    ss_dfprintf(stderr, "testuring : Discard the queued writes");
+    ss_info_dassert(uring_discard(ring, discarded, N_ENTRIES) == N_ENTRIES,
+                    "All queued writes should be taken back");
+
+    for (int i = 0; i < N_ENTRIES; i++)
+    {
+        ss_info_dassert(discarded[i] == N_ENTRIES - 1 - i,
+                        "The user data of the writes should be returned");
+    }
+    ss_info_dassert(uring_discard(ring, discarded, N_ENTRIES) == 0, "Nothing should be left");
+    ss_info_dassert(uring_submit(ring, 0) == 0, "Nothing should be submitted");
+    ss_info_dassert(!uring_reap(ring, &index, &res), "Nothing should complete");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+    URING *ring = uring_create(N_ENTRIES);
+
+    if (ring == NULL)
+    {
+        ss_dfprintf(stderr, "testuring : io_uring is not available, nothing to test: %s\n",
+                    strerror(errno));
+        exit(0);
+    }
+
+    result += test1(ring);
+    result += test2(ring);
+    result += test3(ring);
+    uring_free(ring);
+
+    exit(result);
+}
@@ -55,6 +55,18 @@ thread_wait(THREAD thd)
     pthread_join((pthread_t)thd, &rval);
 }
 
+/**
+ * Detach a running thread so that its resources are released when it exits.
+ * A detached thread can not be waited for.
+ *
+ * @param thd   The thread handle
+ */
+void
+thread_detach(THREAD thd)
+{
+    pthread_detach((pthread_t)thd);
+}
+
 /**
  * Put the thread to sleep for a number of milliseconds
  *
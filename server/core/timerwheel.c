@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timerwheel.c  Hierarchical timer wheels of the polling threads
+ *
+ * A wheel consists of a root level with one slot per heartbeat and of outer
+ * levels where each slot covers a whole turn of the level below it. A timer
+ * is placed in the level that its remaining time falls into. When the root
+ * level completes a turn, the next slot of the first outer level is cascaded
+ * into the levels below it, and so on. This way a timer is moved at most
+ * once per level before it expires.
+ *
+ * Timers that are further away than the range of the wheel are placed in the
+ * last slot of the range. The callers are expected to check the real expiry
+ * time in the callback, as is done for the idle timeouts.
+ */
+
+#include <stdlib.h>
+#include <timerwheel.h>
+#include <spinlock.h>
+#include <log_manager.h>
+
+#define TW_ROOT_BITS    8
+#define TW_ROOT_SIZE    (1 << TW_ROOT_BITS)
+#define TW_ROOT_MASK    (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_BITS   6
+#define TW_LEVEL_SIZE   (1 << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK   (TW_LEVEL_SIZE - 1)
+#define TW_N_LEVELS     3
+
+/** The furthest expiry time that fits in the wheel, about 77 days */
+#define TW_MAX_TICKS    ((1L << (TW_ROOT_BITS + TW_N_LEVELS * TW_LEVEL_BITS)) - 1)
+
+/** The slot of a timer on an outer level */
+#define TW_LEVEL_INDEX(expires, level) \
+    (((expires) >> (TW_ROOT_BITS + (level) * TW_LEVEL_BITS)) & TW_LEVEL_MASK)
+
+/**
+ * A timer wheel. The lock is only contended if a timer of the wheel is added
+ * or removed by a thread other than the one turning the wheel.
+ *
+ * Once the timers of a wheel have been moved to another wheel, the timers
+ * added to it are forwarded to that wheel until it is turned again. The
+ * number of active wheels is read without a lock, a timer can be added to
+ * a wheel whose thread is just stopping.
+ */
+struct timer_wheel
+{
+    SPINLOCK    lock;                                   /*< Protects the slots */
+    long        now;                                    /*< The next heartbeat to process */
+    TIMER_WHEEL *forward;                               /*< Where the timers go, NULL if turned */
+    WHEEL_TIMER *root[TW_ROOT_SIZE];                    /*< One slot per heartbeat */
+    WHEEL_TIMER *levels[TW_N_LEVELS][TW_LEVEL_SIZE];    /*< The outer levels */
+};
+
+static TIMER_WHEEL *wheels = NULL;
+static int n_timer_wheels = 0;
+static volatile int n_active_wheels = 0;  /*< The wheels turned by running polling threads */
+static int dedicated_wheel = -1;          /*< Wheel of a thread that always polls, or -1 */
+
+/**
+ * Initialise the timer wheels. Must be called before the polling threads
+ * are started.
+ *
+ * @param n_wheels      The number of wheels, one per polling thread
+ */
+void
+timerwheel_init(int n_wheels)
+{
+    if ((wheels = (TIMER_WHEEL *)calloc(n_wheels, sizeof(TIMER_WHEEL))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate %d timer wheels.", n_wheels);
+        return;
+    }
+
+    for (int i = 0; i < n_wheels; i++)
+    {
+        spinlock_init(&wheels[i].lock);
+        wheels[i].now = hkheartbeat;
+    }
+    n_timer_wheels = n_wheels;
+    n_active_wheels = n_wheels;
+}
+
+/**
+ * Allocate a timer wheel that is not owned by a polling thread.
+ *
+ * @return The new wheel or NULL if memory allocation failed
+ */
+TIMER_WHEEL *
+timerwheel_alloc(void)
+{
+    TIMER_WHEEL *wheel = (TIMER_WHEEL *)calloc(1, sizeof(TIMER_WHEEL));
+
+    if (wheel == NULL)
+    {
+        MXS_ERROR("Failed to allocate a timer wheel.");
+        return NULL;
+    }
+
+    spinlock_init(&wheel->lock);
+    wheel->now = hkheartbeat;
+    return wheel;
+}
+
+/**
+ * Free a wheel allocated with timerwheel_alloc(). The timers still in the
+ * wheel are not expired.
+ *
+ * @param wheel The wheel to free
+ */
+void
+timerwheel_free(TIMER_WHEEL *wheel)
+{
+    free(wheel);
+}
+
+/**
+ * Place a timer in the slot that its expiry time falls into. The caller
+ * must hold the lock of the wheel.
+ *
+ * @param wheel The wheel
+ * @param timer The timer to insert
+ */
+static void
+timerwheel_insert(TIMER_WHEEL *wheel, WHEEL_TIMER *timer)
+{
+    long expires = timer->expires;
+    long delta = expires - wheel->now;
+    WHEEL_TIMER **slot;
+
+    if (delta < 0)
+    {
+        /** Already expired, it is processed on the next heartbeat */
+        slot = &wheel->root[wheel->now & TW_ROOT_MASK];
+    }
+    else if (delta < TW_ROOT_SIZE)
+    {
+        slot = &wheel->root[expires & TW_ROOT_MASK];
+    }
+    else
+    {
+        int level = 0;
+
+        if (delta > TW_MAX_TICKS)
+        {
+            expires = wheel->now + TW_MAX_TICKS;
+            delta = TW_MAX_TICKS;
+        }
+
+        while (level < TW_N_LEVELS - 1 &&
+               delta >= 1L << (TW_ROOT_BITS + (level + 1) * TW_LEVEL_BITS))
+        {
+            level++;
+        }
+        slot = &wheel->levels[level][TW_LEVEL_INDEX(expires, level)];
+    }
+
+    timer->next = *slot;
+    if (timer->next)
+    {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/**
+ * Remove a timer from its slot. The caller must hold the lock of the wheel.
+ *
+ * @param timer The timer to remove
+ */
+static void
+timerwheel_unlink(WHEEL_TIMER *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * Add a timer to a wheel. A timer that is already scheduled is moved to its
+ * new expiry time, also if it was in another wheel.
+ *
+ * @param wheel         The wheel
+ * @param timer         The timer
+ * @param expires       The heartbeat when the timer expires
+ * @param expire        The function called when the timer expires
+ */
+void
+timerwheel_schedule(TIMER_WHEEL *wheel, WHEEL_TIMER *timer, long expires,
+                    void (*expire)(WHEEL_TIMER *))
+{
+    if (TIMERWHEEL_PENDING(timer))
+    {
+        timerwheel_remove(timer);
+    }
+
+    spinlock_acquire(&wheel->lock);
+    while (wheel->forward)
+    {
+        TIMER_WHEEL *next = wheel->forward;
+        spinlock_release(&wheel->lock);
+        wheel = next;
+        spinlock_acquire(&wheel->lock);
+    }
+    timer->expires = expires;
+    timer->expire = expire;
+    timer->wheel = wheel;
+    timerwheel_insert(wheel, timer);
+    spinlock_release(&wheel->lock);
+}
+
+/**
+ * Add a timer to the wheel of a polling thread. A timer that is already
+ * scheduled is moved to its new expiry time.
+ *
+ * @param timer         The timer
+ * @param wheel         The wheel, normally the owner of the DCB the timer is for.
+ *                      The wheel of a thread that is not polling is replaced
+ *                      by one that is, unless it is the dedicated wheel.
+ * @param expires       The heartbeat when the timer expires
+ * @param expire        The function called when the timer expires
+ */
+void
+timerwheel_add(WHEEL_TIMER *timer, int wheel, long expires,
+               void (*expire)(WHEEL_TIMER *))
+{
+    if (n_timer_wheels == 0)
+    {
+        return;
+    }
+
+    int active = n_active_wheels;
+
+    if (wheel >= active && wheel != dedicated_wheel)
+    {
+        wheel %= active;
+    }
+
+    timerwheel_schedule(&wheels[wheel], timer, expires, expire);
+}
+
+/**
+ * Remove a timer from its wheel. Removing a timer that is not scheduled
+ * has no effect.
+ *
+ * @param timer The timer
+ */
+void
+timerwheel_remove(WHEEL_TIMER *timer)
+{
+    while (TIMERWHEEL_PENDING(timer))
+    {
+        TIMER_WHEEL *tw = timer->wheel;
+
+        spinlock_acquire(&tw->lock);
+        /** The timer may have expired or moved before the lock was taken */
+        if (TIMERWHEEL_PENDING(timer) && timer->wheel == tw)
+        {
+            timerwheel_unlink(timer);
+        }
+        spinlock_release(&tw->lock);
+    }
+}
+
+/**
+ * Move the timers of a slot on an outer level to the levels below it. The
+ * caller must hold the lock of the wheel.
+ *
+ * @param wheel The wheel
+ * @param level The level to cascade
+ * @return The index of the slot that was cascaded
+ */
+static int
+timerwheel_cascade(TIMER_WHEEL *wheel, int level)
+{
+    int index = TW_LEVEL_INDEX(wheel->now, level);
+    WHEEL_TIMER *timer = wheel->levels[level][index];
+
+    wheel->levels[level][index] = NULL;
+
+    while (timer)
+    {
+        WHEEL_TIMER *next = timer->next;
+        timerwheel_insert(wheel, timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+/**
+ * Set the wheel of a thread that polls whatever the number of active polling
+ * threads is. Its timers are not moved to the other wheels.
+ *
+ * @param wheel         The wheel, -1 if there is none
+ */
+void
+timerwheel_set_dedicated(int wheel)
+{
+    dedicated_wheel = wheel < n_timer_wheels ? wheel : -1;
+}
+
+/**
+ * Set the number of wheels that are turned. The timers added to the wheels
+ * of the threads that no longer poll go to the wheels that are turned. The
+ * active wheels no longer forward their timers.
+ *
+ * @param n_wheels      The number of polling threads that are running
+ */
+void
+timerwheel_set_active(int n_wheels)
+{
+    if (n_wheels > 0 && n_wheels <= n_timer_wheels)
+    {
+        for (int i = 0; i < n_wheels; i++)
+        {
+            spinlock_acquire(&wheels[i].lock);
+            wheels[i].forward = NULL;
+            spinlock_release(&wheels[i].lock);
+        }
+        n_active_wheels = n_wheels;
+    }
+}
+
+/**
+ * Move the timers of a wheel to another one. Called by a polling thread that
+ * stops polling, the timers of its wheel would otherwise never expire. The
+ * timers added to the wheel after this are forwarded to the other wheel.
+ *
+ * @param from  The wheel of the calling thread
+ * @param to    The wheel of a thread that keeps on polling
+ */
+void
+timerwheel_move(int from, int to)
+{
+    if (from >= n_timer_wheels || to >= n_timer_wheels || from == to)
+    {
+        return;
+    }
+
+    TIMER_WHEEL *src = &wheels[from];
+    TIMER_WHEEL *dst = &wheels[to];
+    WHEEL_TIMER **slots[TW_ROOT_SIZE + TW_N_LEVELS * TW_LEVEL_SIZE];
+    int n_slots = 0;
+
+    for (int i = 0; i < TW_ROOT_SIZE; i++)
+    {
+        slots[n_slots++] = &src->root[i];
+    }
+    for (int level = 0; level < TW_N_LEVELS; level++)
+    {
+        for (int i = 0; i < TW_LEVEL_SIZE; i++)
+        {
+            slots[n_slots++] = &src->levels[level][i];
+        }
+    }
+
+    /** Only the threads that stop polling take the lock of another wheel */
+    spinlock_acquire(&src->lock);
+    spinlock_acquire(&dst->lock);
+    for (int i = 0; i < n_slots; i++)
+    {
+        WHEEL_TIMER *timer = *slots[i];
+
+        *slots[i] = NULL;
+        while (timer)
+        {
+            WHEEL_TIMER *next = timer->next;
+            timer->wheel = dst;
+            timerwheel_insert(dst, timer);
+            timer = next;
+        }
+    }
+    src->forward = dst;
+    spinlock_release(&dst->lock);
+    spinlock_release(&src->lock);
+}
+
+/**
+ * Turn the wheel of a polling thread up to the current heartbeat.
+ *
+ * @param wheel The wheel of the calling thread
+ */
+void
+timerwheel_process(int wheel)
+{
+    if (wheel < n_timer_wheels)
+    {
+        timerwheel_turn(&wheels[wheel]);
+    }
+}
+
+/**
+ * Turn a wheel up to the current heartbeat and call the expiry functions of
+ * the timers that have expired. The expiry functions are called without
+ * holding the lock of the wheel and they may add the timer again. Only one
+ * thread may turn a wheel.
+ *
+ * @param tw The wheel
+ */
+void
+timerwheel_turn(TIMER_WHEEL *tw)
+{
+    /** A dirty read to skip the lock on most iterations of the polling loop */
+    if (tw->now > hkheartbeat)
+    {
+        return;
+    }
+
+    spinlock_acquire(&tw->lock);
+    while (tw->now <= hkheartbeat)
+    {
+        int index = tw->now & TW_ROOT_MASK;
+
+        if (index == 0)
+        {
+            for (int level = 0; level < TW_N_LEVELS; level++)
+            {
+                if (timerwheel_cascade(tw, level) != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        /**
+         * The slot is moved to a local list and the heartbeat is advanced
+         * before the timers expire. A timer that is added again for the
+         * current heartbeat then goes to the next slot instead of the one
+         * being processed.
+         */
+        WHEEL_TIMER *expired = tw->root[index];
+        WHEEL_TIMER *timer;
+
+        tw->root[index] = NULL;
+        if (expired)
+        {
+            expired->pprev = &expired;
+        }
+        tw->now++;
+
+        while ((timer = expired) != NULL)
+        {
+            timerwheel_unlink(timer);
+            spinlock_release(&tw->lock);
+            timer->expire(timer);
+            spinlock_acquire(&tw->lock);
+        }
+    }
+    spinlock_release(&tw->lock);
+}
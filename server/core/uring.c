@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file uring.c - A minimal io_uring submission and completion ring
+ *
+ * The ring is set up with the io_uring_setup system call and the submission
+ * queue, the completion queue and the submission queue entries are mapped
+ * into the memory of the process. No library is needed and on a kernel
+ * without io_uring uring_create simply fails.
+ *
+ * The kernel reads the tail of the submission queue and writes the tail of
+ * the completion queue, so these are accessed with acquire and release
+ * semantics. The heads are only written by the owner of the ring.
+ */
+
+#include <uring.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+struct uring
+{
+    int                  fd;           /**< The ring */
+    unsigned             sq_entries;   /**< Size of the submission queue */
+    unsigned             *sq_head;     /**< Consumed by the kernel up to here */
+    unsigned             *sq_tail;     /**< Queued by us up to here */
+    unsigned             *sq_mask;
+    unsigned             *sq_array;
+    struct io_uring_sqe  *sqes;
+    unsigned             *cq_head;     /**< Reaped by us up to here */
+    unsigned             *cq_tail;     /**< Completed by the kernel up to here */
+    unsigned             *cq_mask;
+    struct io_uring_cqe  *cqes;
+    void                 *sq_ring;
+    size_t               sq_ring_size;
+    void                 *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    unsigned             n_queued;     /**< Queued but not yet submitted */
+};
+
+/**
+ * Create a ring
+ *
+ * @param entries Size of the submission queue, rounded up to a power of two
+ * @return The ring or NULL if io_uring is not available
+ */
+URING *uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    URING *ring = calloc(1, sizeof(URING));
+
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = ring->sq_ring;
+        }
+        if (ring->sqes == MAP_FAILED)
+        {
+            ring->sqes = NULL;
+        }
+        uring_free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return ring;
+}
+
+/**
+ * Free a ring
+ *
+ * The operations that are still in progress are cancelled by the kernel.
+ *
+ * @param ring The ring to free
+ */
+void uring_free(URING *ring)
+{
+    if (ring)
+    {
+        if (ring->sqes)
+        {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if (ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free(ring);
+    }
+}
+
+/**
+ * Queue a writev
+ *
+ * The iovecs and the memory they point to must stay valid until the
+ * completion of the write has been reaped.
+ *
+ * @param ring      The ring
+ * @param fd        The descriptor to write to
+ * @param iov       The data to write
+ * @param n_iov     Number of iovecs
+ * @param user_data Returned with the result of the write
+ * @return True if the write was queued, false if the queue is full
+ */
+bool uring_writev(URING *ring, int fd, const struct iovec *iov, int n_iov, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        return false;
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = n_iov;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->n_queued++;
+    return true;
+}
+
+/**
+ * Submit the queued operations and wait for completions
+ *
+ * @param ring    The ring
+ * @param wait_nr Return only after this many operations have completed
+ * @return Number of operations submitted or a negative errno
+ */
+int uring_submit(URING *ring, unsigned wait_nr)
+{
+    int rc = syscall(__NR_io_uring_enter, ring->fd, ring->n_queued, wait_nr,
+                     wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (rc < 0)
+    {
+        return -errno;
+    }
+
+    ring->n_queued -= rc;
+    return rc;
+}
+
+/**
+ * Take back the operations the kernel has not yet consumed
+ *
+ * This is used when uring_submit fails and the operations are done some
+ * other way.
+ *
+ * @param ring      The ring
+ * @param user_data Array where the user data of the operations is stored
+ * @param max       Size of the array
+ * @return Number of operations taken back
+ */
+unsigned uring_discard(URING *ring, uint64_t *user_data, unsigned max)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    unsigned n = 0;
+
+    while (tail != head && n < max)
+    {
+        tail--;
+        user_data[n++] = ring->sqes[tail & *ring->sq_mask].user_data;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->n_queued -= n < ring->n_queued ? n : ring->n_queued;
+    return n;
+}
+
+/**
+ * Read the result of a completed operation
+ *
+ * @param ring      The ring
+ * @param user_data The user data of the operation
+ * @param res       The result, a negative errno on failure
+ * @return True if an operation had completed
+ */
+bool uring_reap(URING *ring, uint64_t *user_data, int *res)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -82,6 +82,18 @@ users_free(USERS *users)
     {
         hashtable_free(users->data);
     }
+    if (users->index)
+    {
+        hashtable_free(users->index);
+    }
+    if (users->lookups)
+    {
+        hashtable_free(users->lookups);
+    }
+    if (users->digests)
+    {
+        hashtable_free(users->digests);
+    }
     free(users);
 }
 
@@ -0,0 +1,40 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file affinity.h - Pinning of the polling threads to CPUs
+ *
+ * Each polling thread can be pinned to a CPU of its own, either from a list
+ * of CPUs or spread over the NUMA nodes of the host. A pinned thread allocates
+ * its buffers, DCBs and sessions from the memory of its own node.
+ */
+
+#include <stdbool.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+/** The largest CPU number that can be used */
+#define AFFINITY_MAX_CPUS 1024
+
+bool affinity_valid(const char *value);
+bool affinity_init(const char *value, int n_threads);
+int affinity_thread_cpu(int thread_id);
+int affinity_cpu_node(int cpu);
+void affinity_pin_thread(int thread_id);
+
+EXTERN_C_BLOCK_END
+
+#endif
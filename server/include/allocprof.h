@@ -0,0 +1,81 @@
+#ifndef _ALLOCPROF_H
+#define _ALLOCPROF_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file allocprof.h  Sampling profiler of the buffer, DCB and session allocations
+ *
+ * When the profiler is enabled, one in every N allocations of each thread is
+ * sampled. The stack of a sampled allocation is recorded as its allocation
+ * site and the object points to its sample until it is freed, so that the
+ * outstanding bytes and the lifetime of the objects can be reported by site.
+ * The objects that are not sampled only cost a test of the rate.
+ */
+
+#include <stddef.h>
+
+struct dcb;
+
+/** The kinds of profiled objects */
+typedef enum
+{
+    ALLOCPROF_GWBUF,
+    ALLOCPROF_DCB,
+    ALLOCPROF_SESSION,
+    ALLOCPROF_N_KINDS
+} allocprof_kind_t;
+
+/** A sampled allocation, stored in the object until it is freed */
+struct alloc_sample;
+
+/** One in this many allocations is sampled, 0 if the profiler is disabled */
+extern volatile int allocprof_rate;
+
+extern void allocprof_set_rate(int rate);
+extern void allocprof_sample(struct alloc_sample **sample, allocprof_kind_t kind, size_t size);
+extern void allocprof_release(struct alloc_sample **sample);
+extern void allocprof_print(struct dcb *dcb);
+
+/**
+ * Note the allocation of an object
+ *
+ * @param sample The sample pointer of the object, must be NULL
+ * @param kind   The kind of the object
+ * @param size   The size of the object in bytes
+ */
+static inline void
+allocprof_alloc(struct alloc_sample **sample, allocprof_kind_t kind, size_t size)
+{
+    if (allocprof_rate > 0)
+    {
+        allocprof_sample(sample, kind, size);
+    }
+}
+
+/**
+ * Note the release of an object. The sample of the object is released even
+ * if the profiler has been disabled after it was taken.
+ *
+ * @param sample The sample pointer of the object
+ */
+static inline void
+allocprof_free(struct alloc_sample **sample)
+{
+    if (*sample)
+    {
+        allocprof_release(sample);
+    }
+}
+
+#endif
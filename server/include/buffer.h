@@ -47,6 +47,8 @@
 #include <hint.h>
 #include <spinlock.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <allocprof.h>
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -71,7 +73,8 @@ typedef enum
     GWBUF_TYPE_SESCMD_RESPONSE = 0x08,
     GWBUF_TYPE_RESPONSE_END    = 0x10,
     GWBUF_TYPE_SESCMD          = 0x20,
-    GWBUF_TYPE_HTTP            = 0x40
+    GWBUF_TYPE_HTTP            = 0x40,
+    GWBUF_TYPE_STREAM          = 0x80  /*< Continues the command routed before it */
 } gwbuf_type_t;
 
 #define GWBUF_IS_TYPE_UNDEFINED(b)       (b->gwbuf_type == 0)
@@ -81,47 +84,56 @@ typedef enum
 #define GWBUF_IS_TYPE_SESCMD_RESPONSE(b) (b->gwbuf_type & GWBUF_TYPE_SESCMD_RESPONSE)
 #define GWBUF_IS_TYPE_RESPONSE_END(b)    (b->gwbuf_type & GWBUF_TYPE_RESPONSE_END)
 #define GWBUF_IS_TYPE_SESCMD(b)          (b->gwbuf_type & GWBUF_TYPE_SESCMD)
+#define GWBUF_IS_TYPE_STREAM(b)          (b->gwbuf_type & GWBUF_TYPE_STREAM)
+
+/**
+ * The objects that can be attached to the data of a buffer, e.g. the result
+ * of parsing it. Each kind of object has a slot of its own in the shared
+ * buffer and the cleanup function of the object is called when the last
+ * reference to the data is freed.
+ */
+typedef enum
+{
+    GWBUF_PARSING_INFO, /*< The classification of the statement */
+    GWBUF_SQL_TEXT,     /*< A copy of the SQL of the packet, see modutil_get_SQL_view */
+    GWBUF_N_BUFOBJ
+} bufobj_id_t;
+
+typedef struct buffer_object
+{
+    void*            bo_data;
+    void            (*bo_donefun_fp)(void *);
+    size_t           bo_offset; /*< Start of the data the object was derived from */
+    size_t           bo_length; /*< Length of the data the object was derived from */
+    struct buffer_object *bo_next; /*< Object of the same type for other data */
+} buffer_object_t;
 
 /**
  * A structure to encapsulate the data in a form that the data itself can be
  * shared between multiple GWBUF's without the need to make multiple copies
  * but still maintain separate data pointers.
+ *
+ * The buffer objects are derived from the data and are thus shared by all
+ * the clones that refer to the same part of it. A clone of a portion of the
+ * data, such as one statement of several that were read at once, only sees
+ * the objects derived from that portion. The lock serializes adding and
+ * removing them only while there is more than one reference, a buffer with a
+ * single owner is modified without locking.
  */
 typedef struct
 {
     unsigned char   *data;                  /*< Physical memory that was allocated */
     int             refcount;               /*< Reference count on the buffer */
+    int             size_class;             /*< Size class in the buffer pool or -1 */
+    buffer_object_t bufobj[GWBUF_N_BUFOBJ]; /*< Objects derived from the data, by id */
+    SPINLOCK        lock;                   /*< Protects bufobj when the buffer is shared */
 } SHARED_BUF;
 
-typedef enum
-{
-    GWBUF_INFO_NONE         = 0x0,
-    GWBUF_INFO_PARSED       = 0x1
-} gwbuf_info_t;
-
-#define GWBUF_IS_PARSED(b)      (b->gwbuf_info & GWBUF_INFO_PARSED)
-
-/**
- * A structure for cleaning up memory allocations of structures which are
- * referred to by GWBUF and deallocated in gwbuf_free but GWBUF doesn't
- * know what they are.
- * All functions on the list are executed before freeing memory of GWBUF struct.
- */
-typedef enum
-{
-    GWBUF_PARSING_INFO
-} bufobj_id_t;
-
-typedef struct buffer_object_st buffer_object_t;
-
-struct buffer_object_st
-{
-    bufobj_id_t      bo_id;
-    void*            bo_data;
-    void            (*bo_donefun_fp)(void *);
-    buffer_object_t* bo_next;
-};
+/*< True if the data of the buffer is shared with clones and must not be modified */
+#define GWBUF_IS_SHARED(b)      (__atomic_load_n(&(b)->sbuf->refcount, __ATOMIC_ACQUIRE) > 1)
 
+/*< True if the classification of the statement is attached to the buffer */
+#define GWBUF_IS_PARSED(b)      (gwbuf_get_buffer_object_data((b), GWBUF_PARSING_INFO) != NULL)
 
 /**
  * The buffer structure used by the descriptor control blocks.
@@ -130,20 +142,21 @@ struct buffer_object_st
  * or written to a descriptor. The use of linked lists of buffers with
  * flexible data pointers is designed to minimise the need for data to
  * be copied within the gateway.
+ *
+ * A buffer header is owned by one thread at a time, its hints and properties
+ * are not locked.
  */
 typedef struct gwbuf
 {
-    SPINLOCK        gwbuf_lock;
     struct gwbuf    *next;  /*< Next buffer in a linked chain of buffers */
     struct gwbuf    *tail;  /*< Last buffer in a linked chain of buffers */
     void            *start; /*< Start of the valid data */
     void            *end;   /*< First byte after the valid data */
     SHARED_BUF      *sbuf;  /*< The shared buffer with the real data */
-    buffer_object_t *gwbuf_bufobj; /*< List of objects referred to by GWBUF */
-    gwbuf_info_t    gwbuf_info; /*< Info bits */
     gwbuf_type_t    gwbuf_type; /*< buffer's data type information */
     HINT            *hint;  /*< Hint data for this buffer */
     BUF_PROPERTY    *properties; /*< Buffer properties */
+    struct alloc_sample *sample; /*< Allocation profiler sample, NULL if not sampled */
 } GWBUF;
 
 /*<
@@ -202,16 +215,16 @@ extern void             gwbuf_set_type(GWBUF *head, gwbuf_type_t type);
 extern int              gwbuf_add_property(GWBUF *buf, char *name, char *value);
 extern char             *gwbuf_get_property(GWBUF *buf, char *name);
 extern GWBUF            *gwbuf_make_contiguous(GWBUF *);
+extern unsigned int     gwbuf_tailroom(GWBUF *buf);
 extern int              gwbuf_add_hint(GWBUF *, HINT *);
 
-void                    gwbuf_add_buffer_object(GWBUF* buf,
+bool                    gwbuf_add_buffer_object(GWBUF* buf,
                                                 bufobj_id_t id,
                                                 void*  data,
                                                 void (*donefun_fp)(void *));
 void*                   gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id);
-#if defined(BUFFER_TRACE)
-extern void             dprintAllBuffers(void *pdcb);
-#endif
+void                    gwbuf_free_buffer_object(GWBUF* buf, bufobj_id_t id);
+extern void             dprintBufferPool(void *pdcb);
 EXTERN_C_BLOCK_END
 
 
@@ -36,6 +36,7 @@
 /* Refresh rate limits for load users from database */
 #define USERS_REFRESH_TIME         30           /* Allowed time interval (in seconds) after last update*/
 #define USERS_REFRESH_MAX_PER_TIME 4    /* Max number of load calls within the time interval */
+#define USERS_LOOKUP_CACHE_MAX     10000 /* Max number of cached client lookups per users' table */
 
 /** Default timeout values used by the connections which fetch user authentication data */
 #define DEFAULT_AUTH_CONNECT_TIMEOUT 3
@@ -70,7 +71,12 @@ extern int load_mysql_users(SERVICE *service);
 extern int mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth);
 extern USERS *mysql_users_alloc();
 extern char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key);
+extern char *mysql_users_find(USERS *users, MYSQL_USER_HOST *key, bool wildcard);
+extern int mysql_users_merge(USERS *users, USERS *fresh, char **prefixes, int n);
+extern bool mysql_users_lookup_fetch(USERS *users, char *key, char **auth, int *generation);
+extern void mysql_users_lookup_add(USERS *users, char *key, char *auth, int generation);
 extern int reload_mysql_users(SERVICE *service);
 extern int replace_mysql_users(SERVICE *service);
+extern int update_mysql_users(SERVICE *service);
 
 #endif
@@ -19,6 +19,7 @@
 #include <gw_ssl.h>
 #include <modinfo.h>
 #include <gwbitmask.h>
+#include <timerwheel.h>
 #include <skygw_utils.h>
 #include <netinet/in.h>
 
@@ -75,6 +76,8 @@ struct dcb;
  *      eventqlock              Spinlock to protect this structure
  *      inserted                Insertion time for logging purposes
  *      started                 Time that the processign started
+ *      queued_ns               Insertion time in nanoseconds for query tracing
+ *      sched_class             The scheduling class whose queue the DCB is in
  */
 typedef struct
 {
@@ -86,10 +89,26 @@ typedef struct
     SPINLOCK        eventqlock;
     unsigned long   inserted;
     unsigned long   started;
+    uint64_t        queued_ns;
+    int             sched_class;
 } DCBEVENTQ;
 
 #define DCBFD_CLOSED -1
 
+/**
+ * The splicing of the data read from a DCB directly to the socket of another
+ * DCB. The data goes through a pipe and never leaves the kernel.
+ */
+typedef struct dcb_splice
+{
+    SPINLOCK        lock;       /*< Protects the pipe and the peer */
+    int             pipefd[2];  /*< Read data that is not yet written to the peer */
+    size_t          pending;    /*< Number of bytes in the pipe */
+    bool            active;     /*< The data is spliced instead of being read */
+    struct dcb      *peer;      /*< The DCB the data is written to, NULL if closed */
+    uint64_t        n_bytes;    /*< Number of bytes spliced to the peer */
+} DCB_SPLICE;
+
 /**
  * The statistics gathered on a descriptor control block
  */
@@ -115,15 +134,15 @@ typedef struct dcbstats
  * processing an event that will access the DCB.
  *
  * We solve this issue by making the dcb_free routine merely mark a DCB as a zombie and
- * place it on a special zombie list. Before placing the DCB on the zombie list we create
- * a bitmask with a bit set in it for each active polling thread. Each thread will call
- * a routine to process the zombie list at the end of the polling loop. This routine
- * will clear the bit value that corresponds to the calling thread. Once the bitmask
- * is completely cleared the DCB can finally be freed and removed from the zombie list.
+ * place it on the zombie list of the closing thread, tagged with the current global
+ * epoch. Each polling thread publishes the epoch it has seen at the end of every
+ * iteration of the polling loop, a point where it holds no references to DCBs. Once
+ * every polling thread has published a later epoch than the one the DCB was tagged
+ * with, the DCB can finally be freed and removed from the zombie list.
  */
 typedef struct
 {
-    GWBITMASK       bitmask;        /*< The bitmask of threads */
+    int             epoch;          /*< The epoch when the DCB became a zombie */
     struct dcb      *next;          /*< Next pointer for the zombie list */
 } DCBMM;
 
@@ -161,15 +180,19 @@ typedef enum
     DCB_REASON_NOT_RESPONDING       /*< Server connection was lost */
 } DCB_REASON;
 
+/** Number of callback reasons */
+#define DCB_N_REASONS (DCB_REASON_NOT_RESPONDING + 1)
+
+/** Number of callbacks that can be registered on a DCB for each reason */
+#define DCB_MAX_CALLBACKS 2
+
 /**
  * Callback structure - used to track callbacks registered on a DCB
  */
 typedef struct dcb_callback
 {
-    DCB_REASON           reason;         /*< The reason for the callback */
     int                 (*cb)(struct dcb *dcb, DCB_REASON reason, void *userdata);
     void                 *userdata;      /*< User data to be sent in the callback */
-    struct dcb_callback  *next;          /*< Next callback for this DCB */
 } DCB_CALLBACK;
 
 /**
@@ -197,66 +220,84 @@ typedef enum
  */
 typedef struct dcb
 {
+    /* The fields used by the poll loop and when data is read or written come
+     * first so that they share as few cache lines as possible */
     skygw_chk_t     dcb_chk_top;
-    bool            dcb_is_in_use;  /**< Whether DCB is in use or for later reuse */
-    bool            dcb_errhandle_called; /*< this can be called only once */
-    bool            dcb_is_zombie;  /**< Whether the DCB is in the zombie list */
-    bool            draining_flag;  /**< Set while write queue is drained */
-    bool            drain_called_while_busy; /**< Set as described */
-    dcb_role_t      dcb_role;
-    SPINLOCK        dcb_initlock;
-    DCBEVENTQ       evq;            /**< The event queue for this DCB */
     int             fd;             /**< The descriptor */
     dcb_state_t     state;          /**< Current descriptor state */
+    dcb_role_t      dcb_role;
     SSL_STATE       ssl_state;      /**< Current state of SSL if in use */
+    int             owner;          /**< The polling thread that owns this DCB */
     int             flags;          /**< DCB flags */
+    int             writeqlen;      /**< Current number of byes in the write queue */
+    int64_t         writeq_charged; /**< Bytes of the write queue charged to the session */
+    int64_t         readq_charged;  /**< Bytes of the read and delay queues charged to the session */
+    bool            draining_flag;  /**< Set while write queue is drained */
+    bool            drain_called_while_busy; /**< Set as described */
+    bool            write_deferred; /**< Drained at the end of the poll cycle */
+    bool            read_throttled; /**< Reading waits until the client has caught up */
+    bool            writeq_throttling; /**< Reads of the backends wait until below low water */
+    bool            dcb_is_zombie;  /**< Whether the DCB is in the zombie list */
+    bool            dcb_is_in_use;  /**< Whether DCB is in use or for later reuse */
+    DCBEVENTQ       evq;            /**< The event queue for this DCB */
+    GWBUF           *writeq;        /**< Write Data Queue */
+    SPINLOCK        writeqlock;     /**< Write Queue spinlock */
+    int             low_water;      /**< Low water mark */
+    int             high_water;     /**< High water mark */
+    struct session  *session;       /**< The owning session */
+    void            *protocol;      /**< The protocol specific state */
+    GWBUF           *dcb_readqueue; /**< read queue for storing incomplete reads */
+    size_t           protocol_packet_length; /**< How long the protocol specific packet is */
+    size_t           protocol_bytes_processed; /**< How many bytes of a packet have been read */
+    struct server   *server;        /**< The associated backend server */
+    SSL*            ssl;            /*< SSL struct for connection */
+    DCB_SPLICE      *splice;        /**< Splicing of the read data, NULL if not spliced */
+    struct dcb      *splice_src;    /**< The DCB whose data is spliced to this one */
+    long            last_read;      /*< Last time the DCB received data */
+    SPINLOCK        dcb_initlock;
+    SPINLOCK        authlock;       /**< Generic Authorization spinlock */
+    DCBSTATS        stats;          /**< DCB related statistics */
+    GWPROTOCOL      func;           /**< The protocol functions for this descriptor */
+
+    /* The fields used when the connection is created, closed or shown */
+    bool            dcb_errhandle_called; /*< this can be called only once */
     char            *remote;        /**< Address of remote end */
     char            *user;          /**< User name for connection */
     struct sockaddr_in ipv4;        /**< remote end IPv4 address */
     char            *protoname;     /**< Name of the protocol */
-    void            *protocol;      /**< The protocol specific state */
-    size_t           protocol_packet_length; /**< How long the protocol specific packet is */
-    size_t           protocol_bytes_processed; /**< How many bytes of a packet have been read */
-    struct session  *session;       /**< The owning session */
     struct servlistener *listener;  /**< For a client DCB, the listener data */
-    GWPROTOCOL      func;           /**< The protocol functions for this descriptor */
     GWAUTHENTICATOR authfunc;       /**< The authenticator functions for this descriptor */
-
-    int             writeqlen;      /**< Current number of byes in the write queue */
-    SPINLOCK        writeqlock;     /**< Write Queue spinlock */
-    GWBUF           *writeq;        /**< Write Data Queue */
     SPINLOCK        delayqlock;     /**< Delay Backend Write Queue spinlock */
     GWBUF           *delayq;        /**< Delay Backend Write Data Queue */
-    GWBUF           *dcb_readqueue; /**< read queue for storing incomplete reads */
-    SPINLOCK        authlock;       /**< Generic Authorization spinlock */
-
-    DCBSTATS        stats;          /**< DCB related statistics */
     unsigned int    dcb_server_status; /*< the server role indicator from SERVER */
     struct dcb      *next;          /**< Next DCB in the chain of allocated DCB's */
+    struct dcb      *nextfree;      /**< Next DCB in a list of free DCB's */
     struct dcb      *nextpersistent;   /**< Next DCB in the persistent pool for SERVER */
+    struct dcb      *next_throttled; /**< Next backend DCB waiting for the client of the session */
     time_t          persistentstart;   /**< Time when DCB placed in persistent pool */
+    uint64_t        connectstart;   /**< When the connection to the server was opened, in microseconds */
     struct service  *service;       /**< The related service */
     void            *data;          /**< Specific client data */
     DCBMM           memdata;        /**< The data related to DCB memory management */
-    SPINLOCK        cb_lock;        /**< The lock for the callbacks linked list */
-    DCB_CALLBACK    *callbacks;     /**< The list of callbacks for the DCB */
+    int             n_callbacks[DCB_N_REASONS]; /**< Number of callbacks for each reason */
+    DCB_CALLBACK    callbacks[DCB_N_REASONS][DCB_MAX_CALLBACKS]; /**< The callbacks of the DCB
+                                                                   * by their reason */
     SPINLOCK        pollinlock;
     int             pollinbusy;
     int             readcheck;
-
     SPINLOCK        polloutlock;
     int             polloutbusy;
     int             writecheck;
-    long            last_read;      /*< Last time the DCB received data */
-    int             high_water;     /**< High water mark */
-    int             low_water;      /**< Low water mark */
-    struct server   *server;        /**< The associated backend server */
-    SSL*            ssl;            /*< SSL struct for connection */
+    WHEEL_TIMER     timer;          /**< The idle or persistent pool timeout */
     bool            ssl_read_want_read;    /*< Flag */
     bool            ssl_read_want_write;    /*< Flag */
     bool            ssl_write_want_read;    /*< Flag */
     bool            ssl_write_want_write;    /*< Flag */
     int             dcb_port;       /**< port of target server */
+    bool            reuseport;      /**< Listener has an SO_REUSEPORT socket for each thread */
+    struct dcb      *shard;         /**< Next socket of an SO_REUSEPORT listener */
+    bool            handshaking;    /**< Counted as authenticating by the listener */
+    struct alloc_sample *sample;    /**< Allocation profiler sample, NULL if not sampled */
     skygw_chk_t     dcb_chk_tail;
 } DCB;
 
@@ -294,9 +335,30 @@ int           fail_accept_errno;
 
 #define DCB_POLL_BUSY(x)                ((x)->evq.next != NULL)
 
+/** Size of the buffers of a print batch */
+#define DCB_BATCH_SIZE (64 * 1024)
+
+/**
+ * Output that is formatted into large buffers and written to a DCB in one go.
+ * Formatting does not write anything, so it can be done while holding a lock
+ * that the write must not be done under.
+ */
+typedef struct dcb_print_batch
+{
+    DCB    *dcb;     /*< The DCB the output is written to */
+    GWBUF  *head;    /*< Output not yet written */
+    GWBUF  *current; /*< The buffer being filled */
+    size_t space;    /*< Free space in the current buffer */
+} DCB_PRINT_BATCH;
+
+/** True when at least one buffer of the batch is full */
+#define DCB_BATCH_FULL(b)               ((b)->head != (b)->current)
+
 DCB *dcb_get_zombies(void);
 int dcb_write(DCB *, GWBUF *);
+int dcb_sendfile(DCB *dcb, GWBUF *head, int fd, off_t offset, size_t len);
 DCB *dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs);
+void dcb_handshake_done(DCB *dcb);
 DCB *dcb_alloc(dcb_role_t, struct servlistener *);
 void dcb_free(DCB *);
 void dcb_free_all_memory(DCB *dcb);
@@ -306,6 +368,11 @@ int dcb_read(DCB *, GWBUF **, int);
 int dcb_drain_writeq(DCB *);
 void dcb_close(DCB *);
 DCB *dcb_process_zombies(int);              /* Process Zombies except the one behind the pointer */
+void dcb_thread_stop(int threadid);
+void dcb_defer_writes(int threadid);
+void dcb_flush_writes(int threadid);
+bool dcb_writeq_init(int high_water, int low_water, long budget);
+bool dcb_throttle_read(DCB *dcb);
 void printAllDCBs();                         /* Debug to print all DCB in the system */
 void printDCB(DCB *);                        /* Debug print routine */
 void dprintAllDCBs(DCB *);                   /* Debug to print all DCB in the system */
@@ -315,12 +382,18 @@ void dListDCBs(DCB *);                       /* List all DCBs in the system */
 void dListClients(DCB *);                    /* List al the client DCBs */
 const char *gw_dcb_state2string(dcb_state_t);              /* DCB state to string */
 void dcb_printf(DCB *, const char *, ...) __attribute__((format(printf, 2, 3))); /* DCB version of printf */
+void dcb_batch_init(DCB_PRINT_BATCH *batch, DCB *dcb);
+uint8_t *dcb_batch_reserve(DCB_PRINT_BATCH *batch, size_t len);
+void dcb_batch_printf(DCB_PRINT_BATCH *batch, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int dcb_batch_flush(DCB_PRINT_BATCH *batch);
 void dcb_hashtable_stats(DCB *, void *);     /**< Print statisitics */
 int dcb_add_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, void *), void *);
 int dcb_remove_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, void *), void *);
 int dcb_isvalid(DCB *);                     /* Check the DCB is in the linked list */
 int dcb_count_by_usage(DCB_USAGE);          /* Return counts of DCBs */
-int dcb_persistent_clean_count(DCB *, bool);      /* Clean persistent and return count */
+int dcb_persistent_clean_count(struct server *, bool); /* Clean persistent and return count */
+int dcb_persistent_prune(struct server *);             /* Remove closed connections from the pool */
+bool dcb_persistent_alive(DCB *);                      /* Check that a pooled connection is open */
 
 void dcb_call_foreach (struct server* server, DCB_REASON reason);
 void dcb_hangup_foreach (struct server* server);
@@ -331,6 +404,11 @@ int dcb_accept_SSL(DCB* dcb);
 int dcb_connect_SSL(DCB* dcb);
 int dcb_listen(DCB *listener, const char *config, const char *protocol_name);
 void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
+void dcb_charge_readq(DCB *dcb);
+bool dcb_splice(DCB *dcb, DCB *peer);
+void dcb_splice_activate(DCB *dcb);
+void dcb_splice_pump(DCB *dcb);
+void dcb_splice_resume(DCB *dcb);
 
 /**
  * DCB flags values
@@ -338,7 +416,14 @@ void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
 #define DCBF_CLONE              0x0001  /*< DCB is a clone */
 #define DCBF_HUNG               0x0002  /*< Hangup has been dispatched */
 #define DCBF_REPLIED    0x0004  /*< DCB was written to */
+#define DCBF_SPLICED    0x0008  /*< Data has bypassed the protocol */
+#define DCBF_POOL_WARMUP        0x0010  /*< Internal client of a persistent pool warm-up */
+#define DCBF_COMPRESSED         0x0020  /*< The protocol compresses the data on the socket */
+#define DCBF_KTLS_SEND          0x0040  /*< The kernel encrypts the data written to the SSL socket */
 
 #define DCB_IS_CLONE(d) ((d)->flags & DCBF_CLONE)
 #define DCB_REPLIED(d) ((d)->flags & DCBF_REPLIED)
+#define DCB_IS_POOL_WARMUP(d) ((d)->flags & DCBF_POOL_WARMUP)
+#define DCB_IS_KTLS_SEND(d) ((d)->flags & DCBF_KTLS_SEND)
+#define DCB_IS_SPLICED(d) ((d)->splice && (d)->splice->active)
 #endif /*  _DCB_H */
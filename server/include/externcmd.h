@@ -21,6 +21,7 @@
 #include <maxscale_pcre2.h>
 
 #define MAXSCALE_EXTCMD_ARG_MAX 256
+#define MAXSCALE_EXTCMD_MAX_RUNNING 8 /**< Most commands that may run at the same time */
 
 typedef struct extern_cmd_t
 {
@@ -37,5 +38,6 @@ int externcmd_execute(EXTERNCMD* cmd);
 bool externcmd_substitute_arg(EXTERNCMD* cmd, const char* re, const char* replace);
 bool externcmd_can_execute(const char* argstr);
 bool externcmd_matches(const EXTERNCMD* cmd, const char* match);
+void externcmd_reap(void);
 
 #endif
@@ -26,6 +26,7 @@
 #include <session.h>
 #include <buffer.h>
 #include <stdint.h>
+#include <profile.h>
 
 /**
  * The FILTER handle points to module specific data, so the best we can do
@@ -60,6 +61,16 @@ typedef struct
  *      clientReply             Called for each reply packet
  *      diagnostics             Called to force the filter to print
  *                              diagnostic output
+ *      getCapabilities         Optional, returns the MySQL commands the
+ *                              filter handles as a FILTER_COMMAND bitmask.
+ *                              The session of such a filter is created
+ *                              when the first of these commands arrives
+ *                              and statements that no filter of the
+ *                              service handles skip the filters.
+ *      command                 Optional, carries out an administrative
+ *                              command on the filter instance, such as
+ *                              changing a table of the filter at runtime.
+ *                              Returns false if the command is unknown.
  *
  * @endverbatim
  *
@@ -76,14 +87,23 @@ typedef struct filter_object
     int    (*routeQuery)(FILTER *instance, void *fsession, GWBUF *queue);
     int    (*clientReply)(FILTER *instance, void *fsession, GWBUF *queue);
     void   (*diagnostics)(FILTER *instance, void *fsession, DCB *dcb);
+    uint64_t (*getCapabilities)(void);
+    bool   (*command)(FILTER *instance, DCB *dcb, const char *command,
+                      const char *arg1, const char *arg2);
 } FILTER_OBJECT;
 
+/** The bit of a MySQL command in the capabilities of a filter */
+#define FILTER_COMMAND(cmd) ((uint64_t)1 << ((cmd) & 0x3f))
+
+/** The capabilities of a filter that handles all commands */
+#define FILTER_ALL_COMMANDS UINT64_MAX
+
 /**
  * The filter API version. If the FILTER_OBJECT structure or the filter API
  * is changed these values must be updated in line with the rules in the
  * file modinfo.h.
  */
-#define FILTER_VERSION  {1, 1, 0}
+#define FILTER_VERSION  {1, 3, 0}
 /**
  * The definition of a filter from the configuration file.
  * This is basically the link between a plugin to load and the
@@ -98,11 +118,19 @@ typedef struct filter_def
     FILTER filter;                 /**< The runtime filter */
     FILTER_OBJECT *obj;            /**< The "MODULE_OBJECT" for the filter */
     SPINLOCK spin;                 /**< Spinlock to protect the filter definition */
+    int n_sessions;                /**< Filter sessions created */
+    int n_current;                 /**< Current filter sessions */
+    uint64_t commands;             /**< The commands the filter handles, see FILTER_COMMAND */
+    PROFILE route_profile;         /**< Cost of the routeQuery entry point */
+    PROFILE reply_profile;         /**< Cost of the clientReply entry point */
     struct filter_def *next;       /**< Next filter in the chain of all filters */
 } FILTER_DEF;
 
+struct metrics;
+
 FILTER_DEF *filter_alloc(char *, char *);
 void filter_free(FILTER_DEF *);
+bool filter_command(FILTER_DEF *, DCB *, const char *, const char *, const char *);
 bool filter_load(FILTER_DEF* filter);
 FILTER_DEF *filter_find(char *);
 void filterAddOption(FILTER_DEF *, char *);
@@ -113,5 +141,7 @@ int filter_standard_parameter(char *);
 void dprintAllFilters(DCB *);
 void dprintFilter(DCB *, FILTER_DEF *);
 void dListFilters(DCB *);
+void filterWriteMetrics(struct metrics *);
+bool filter_alloc_profiles(FILTER_DEF *);
 
 #endif
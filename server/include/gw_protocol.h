@@ -51,6 +51,10 @@ struct session;
  *      listen          Create a listener for the protocol
  *      auth            Authentication entry point
  *  session         Session handling entry point
+ *      reuse           Switch a connection from the persistent pool
+ *                      to the user of a new session
+ *      reusable        Check that a connection from the persistent pool
+ *                      can be used by a new session, optional
  * @endverbatim
  *
  * This forms the "module object" for protocol modules within the gateway.
@@ -72,6 +76,8 @@ typedef struct gw_protocol
     int (*session)(struct dcb *, void *);
     char *(*auth_default)();
     int (*connlimit)(struct dcb *, int limit);
+    int (*reuse)(struct dcb *, struct session *);
+    int (*reusable)(struct dcb *, struct session *);
 } GWPROTOCOL;
 
 /**
@@ -79,7 +85,7 @@ typedef struct gw_protocol
  * the GWPROTOCOL structure is changed. See the rules defined in modinfo.h
  * that define how these numbers should change.
  */
-#define GWPROTOCOL_VERSION      {1, 1, 0}
+#define GWPROTOCOL_VERSION      {1, 3, 0}
 
 
 #endif /* GW_PROTOCOL_H */
@@ -28,6 +28,7 @@
  */
 
 #include <gw_protocol.h>
+#include <spinlock.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -69,6 +70,11 @@ typedef struct ssl_listener
     char *ssl_key;                      /*< SSL private key */
     char *ssl_ca_cert;                  /*< SSL CA certificate */
     bool ssl_init_done;                 /*< If SSL has already been initialized for this service */
+    bool ktls;                          /*< Whether the kernel encrypts the data after the handshake */
+    SSL_SESSION *session;               /*< Last session with the server, resumed by new connections */
+    SPINLOCK session_lock;              /*< Protects session */
+    int n_handshakes;                   /*< Completed SSL handshakes */
+    int n_resumed;                      /*< Handshakes that resumed an earlier session */
 } SSL_LISTENER;
 
 int ssl_authenticate_client(struct dcb *dcb, bool is_capable);
@@ -77,5 +83,7 @@ bool ssl_check_data_to_process(struct dcb *dcb);
 bool ssl_required_by_dcb(struct dcb *dcb);
 bool ssl_required_but_not_negotiated(struct dcb *dcb);
 const char* ssl_method_type_to_string(ssl_method_type_t method_type);
+void ssl_resume_session(SSL_LISTENER *ssl_listener, SSL *ssl);
+void ssl_handshake_done(SSL_LISTENER *ssl_listener, SSL *ssl, bool is_client);
 
 #endif /* _GW_SSL_H */
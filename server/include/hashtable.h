@@ -36,16 +36,25 @@
 /**
  * The entries within a hashtable.
  *
- * A NULL value for key indicates an empty entry.
  * The next pointer is the overflow chain for this hashentry.
  */
 typedef struct hashentry
 {
-    void *key;              /**< The value of the key or NULL if empty entry */
+    void *key;              /**< The value of the key */
     void *value;            /**< The value associated with key */
     struct hashentry *next; /**< The overflow chain */
 } HASHENTRIES;
 
+/**
+ * The chains of a hashtable. The readers see the size and the chains through
+ * a single pointer, so that a resize replaces both of them at once.
+ */
+typedef struct hashbuckets
+{
+    int size;               /**< The number of chains */
+    HASHENTRIES *chains[];  /**< The chains themselves */
+} HASHBUCKETS;
+
 /**
  * HASHTABLE iterator - used to walk the hashtable in a thread safe
  * way
@@ -70,8 +79,7 @@ typedef struct hashtable
 #if defined(SS_DEBUG)
     skygw_chk_t ht_chk_top;
 #endif
-    int hashsize;                 /**< The number of HASHENTRIES */
-    HASHENTRIES **entries;        /**< The entries themselves */
+    HASHBUCKETS *buckets;         /**< The chains, replaced as a whole on resize */
     int (*hashfn)(void *);        /**< The hash function */
     int (*cmpfn)(void *, void *); /**< The key comparison function */
     HASHMEMORYFN kcopyfn;         /**< Optional key copy function */
@@ -79,10 +87,12 @@ typedef struct hashtable
     HASHMEMORYFN kfreefn;         /**< Optional key free function */
     HASHMEMORYFN vfreefn;         /**< Optional value free function */
     SPINLOCK spin;                /**< Internal spinlock for the hashtable */
-    int n_readers;                /**< Number of clients reading the table */
+    int n_readers;                /**< Number of readers that are not polling threads */
     int writelock;                /**< The table is locked by a writer */
     bool ht_isflat;               /**< Indicates whether hashtable is in stack or heap */
+    bool ht_resize;               /**< Grow the table as elements are added */
     int n_elements;               /**< Number of added elements */
+    struct hashretired *retired;  /**< Removed entries waiting to be freed */
 #if defined(SS_DEBUG)
     skygw_chk_t ht_chk_tail;
 #endif
@@ -102,8 +112,12 @@ extern void hashtable_memory_fns(HASHTABLE   *table,
 /**< Provide an interface to control key/value memory
  * manipulation
  */
+extern void hashtable_enable_resize(HASHTABLE *table);
+/**< Grow the table online as it fills up */
 extern void hashtable_free(HASHTABLE *);                    /**< Free a hashtable */
 extern int hashtable_add(HASHTABLE *, void *, void *);     /**< Add an entry */
+extern int hashtable_replace(HASHTABLE *, void *, void *);
+/**< Add an entry or replace its value */
 extern int hashtable_delete(HASHTABLE *, void *);
 /**< Delete an entry table */
 extern void *hashtable_fetch(HASHTABLE *, void *);
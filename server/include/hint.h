@@ -27,6 +27,7 @@
 
 #include <skygw_debug.h>
 
+struct server;
 
 /**
  * The types of hint that are supported by the generic hinting mechanism.
@@ -37,7 +38,7 @@ typedef enum
     HINT_ROUTE_TO_SLAVE,
     HINT_ROUTE_TO_NAMED_SERVER,
     HINT_ROUTE_TO_UPTODATE_SERVER,
-    HINT_ROUTE_TO_ALL, /*< not implemented yet */
+    HINT_ROUTE_TO_ALL, /*< Only used by the schemarouter */
     HINT_PARAMETER
 } HINT_TYPE;
 
@@ -54,12 +55,14 @@ typedef struct hint
     void            *data;  /*< Type specific data */
     void            *value; /*< Parameter value for hint */
     unsigned int    dsize;  /*< Size of the hint data */
+    struct server   *server; /*< The server of a named server hint, NULL if unknown */
     struct hint     *next;  /*< Another hint for this buffer */
 } HINT;
 
 extern  HINT    *hint_alloc(HINT_TYPE, void *, unsigned int);
 extern  HINT    *hint_create_parameter(HINT *, char *, char *);
 extern  HINT    *hint_create_route(HINT *, HINT_TYPE, char *);
+extern  HINT    *hint_create_server_route(HINT *, struct server *);
 extern  void    hint_free(HINT *);
 extern  HINT    *hint_dup(HINT *);
 bool            hint_exists(HINT **, HINT_TYPE);
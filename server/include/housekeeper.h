@@ -15,6 +15,7 @@
 #include <time.h>
 #include <dcb.h>
 #include <hk_heartbeat.h>
+#include <timerwheel.h>
 /**
  * @file housekeeper.h A mechanism to have task run periodically
  *
@@ -33,6 +34,16 @@ typedef enum
     HK_ONESHOT
 } HKTASK_TYPE;
 
+/**
+ * The states of a task
+ */
+typedef enum
+{
+    HK_IDLE,        /*< Waiting in the timer wheel */
+    HK_QUEUED,      /*< Due and waiting for an executor */
+    HK_RUNNING      /*< Being run by an executor */
+} HKTASK_STATE;
+
 /**
  * The housekeeper task list
  */
@@ -41,14 +52,22 @@ typedef struct hktask
     char *name;               /*< A simple task name */
     void (*task)(void *data); /*< The task to call */
     void *data;               /*< Data to pass the task */
-    int frequency;            /*< How often to call the tasks (seconds) */
+    int interval;             /*< How often to call the tasks (milliseconds) */
     time_t nextdue;           /*< When the task should be next run */
     HKTASK_TYPE type;         /*< The task type */
+    HKTASK_STATE state;       /*< Whether the task is waiting, queued or running */
+    bool removed;             /*< Removed while running, freed by the executor */
+    WHEEL_TIMER timer;        /*< The timer of the next run */
+    unsigned long runs;       /*< How many times the task has been run */
+    unsigned long total_us;   /*< The total run time of the task (microseconds) */
+    unsigned long max_us;     /*< The longest run of the task (microseconds) */
     struct hktask *next;      /*< Next task in the list */
+    struct hktask *next_ready;/*< Next task in the queue of due tasks */
 } HKTASK;
 
 extern void hkinit();
 extern int  hktask_add(const char *name, void (*task)(void *), void *data, int frequency);
+extern int  hktask_add_ms(const char *name, void (*task)(void *), void *data, int interval);
 extern int  hktask_oneshot(const char *name, void (*task)(void *), void *data, int when);
 extern int  hktask_remove(const char *name);
 extern void hkshutdown();
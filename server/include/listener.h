@@ -29,9 +29,45 @@
 
 #include <gw_protocol.h>
 #include <gw_ssl.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 struct dcb;
 
+/** The number of token buckets for the source subnets of a listener */
+#define LISTENER_SUBNET_BUCKETS 1024
+
+/** The prefix length of the source subnets that are rate limited */
+#define LISTENER_SUBNET_BITS 24
+
+/**
+ * A token bucket that limits the rate of accepted connections. The bucket
+ * holds at most one second worth of tokens.
+ */
+typedef struct listener_bucket
+{
+    uint32_t key;               /**< The subnet that uses the bucket */
+    double tokens;              /**< Connections that can be accepted now */
+    long stamp;                 /**< Heartbeat when the bucket was last filled */
+} LISTENER_BUCKET;
+
+/**
+ * Limits on the connections a listener accepts. While a limit is reached, new
+ * connections are left in the backlog of the listening socket.
+ */
+typedef struct listener_admission
+{
+    int connection_rate;        /**< Connections per second, 0 for no limit */
+    int subnet_connection_rate; /**< Connections per second from one subnet, 0 for no limit */
+    int max_handshakes;         /**< Clients authenticating at once, 0 for no limit */
+    int handshakes;             /**< Clients that are authenticating */
+    int n_throttled;            /**< Times accepting was postponed */
+    int n_rejected;             /**< Connections closed for exceeding the subnet rate */
+    SPINLOCK lock;              /**< Protects the buckets */
+    LISTENER_BUCKET bucket;     /**< The bucket of the listener */
+    LISTENER_BUCKET *subnets;   /**< The buckets of the source subnets */
+} LISTENER_ADMISSION;
+
 /**
  * The servlistener structure is used to link a service to the protocols that
  * are used to support that service. It defines the name of the protocol module
@@ -46,6 +82,7 @@ typedef struct servlistener
     char *authenticator;        /**< Name of authenticator */
     SSL_LISTENER *ssl;          /**< Structure of SSL data or NULL */
     struct dcb *listener;       /**< The DCB for the listener */
+    LISTENER_ADMISSION admission; /**< Limits on accepting connections */
     struct  servlistener *next; /**< Next service protocol */
 } SERV_LISTENER;
 
@@ -54,5 +91,10 @@ SERV_LISTENER *listener_alloc(char *protocol, char *address, unsigned short port
 int listener_set_ssl_version(SSL_LISTENER *ssl_listener, char* version);
 void listener_set_certificates(SSL_LISTENER *ssl_listener, char* cert, char* key, char* ca_cert);
 int listener_init_SSL(SSL_LISTENER *ssl_listener);
+bool listener_set_admission(SERV_LISTENER *listener, int connection_rate,
+                            int subnet_connection_rate, int max_handshakes);
+bool listener_can_accept(SERV_LISTENER *listener);
+bool listener_admit(SERV_LISTENER *listener, uint32_t addr);
+void listener_handshake_done(SERV_LISTENER *listener);
 
 #endif
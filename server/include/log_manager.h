@@ -88,12 +88,15 @@ void mxs_log_finish(void);
 int mxs_log_flush();
 int mxs_log_flush_sync();
 int mxs_log_rotate();
+void mxs_log_update_clock(void);
+void mxs_log_report_suppressed(void);
 
 int  mxs_log_set_priority_enabled(int priority, bool enabled);
 void mxs_log_set_syslog_enabled(bool enabled);
 void mxs_log_set_maxlog_enabled(bool enabled);
 void mxs_log_set_highprecision_enabled(bool enabled);
 void mxs_log_set_augmentation(int bits);
+void mxs_log_set_throttling(int count, long window_ms, long suppress_ms);
 
 int mxs_log_message(int priority,
                     const char* file, int line, const char* function,
@@ -34,9 +34,12 @@
 
 #define DEFAULT_NBPOLLS         3       /**< Default number of non block polls before we block */
 #define DEFAULT_POLLSLEEP       1000    /**< Default poll wait time (milliseconds) */
+#define DEFAULT_POLL_MAX_EVENTS 1000    /**< Default number of events received by one epoll_wait call */
 #define _SYSNAME_STR_LENGTH     256     /**< sysname len */
 #define _RELEASE_STR_LENGTH     256     /**< release len */
 #define DEFAULT_NTHREADS        1 /**< Default number of polling threads */
+#define DEFAULT_START_THREADS   8 /**< Default number of threads starting the services */
+#define DEFAULT_QC_OFFLOAD_SIZE 16384 /**< Default length of the queries classified by the pool */
 /**
  * Maximum length for configuration parameter value.
  */
@@ -108,6 +111,7 @@ typedef struct config_context
 typedef struct
 {
     int           n_threads;                           /**< Number of polling threads */
+    int           max_threads;                         /**< Most polling threads at runtime, 0 for n_threads */
     char          *version_string;                     /**< The version string of embedded db library */
     char          release_string[_SYSNAME_STR_LENGTH]; /**< The release name string of the system */
     char          sysname[_SYSNAME_STR_LENGTH];        /**< The release name string of the system */
@@ -115,6 +119,15 @@ typedef struct
     unsigned long id;                                  /**< MaxScale ID */
     unsigned int  n_nbpoll;                            /**< Tune number of non-blocking polls */
     unsigned int  pollsleep;                           /**< Wait time in blocking polls */
+    int           poll_affinity;                       /**< Each thread has its own epoll set and event queue */
+    int           poll_work_stealing;                  /**< Idle threads process events of busy threads */
+    int           admin_thread;                        /**< A thread of its own serves the admin services */
+    int           poll_max_events;                     /**< Events received by one epoll_wait call */
+    int           poll_adaptive;                       /**< Tune the non-blocking polls to the load */
+    int           reuseport_listeners;                 /**< One SO_REUSEPORT socket per thread for listeners */
+    int           tcp_fastopen;                        /**< TCP Fast Open queue of listeners, 0 if disabled */
+    int           start_threads;                       /**< Number of threads that start the services */
+    int           cached_users_at_startup;             /**< Open listeners with the cached users */
     int           syslog;                              /**< Log to syslog */
     int           maxlog;                              /**< Log to MaxScale's own logs */
     int           log_to_shm;                          /**< Write log-file to shared memory */
@@ -123,6 +136,19 @@ typedef struct
     unsigned int  auth_write_timeout;                  /**< Write timeout for the user authentication */
     char          qc_name[PATH_MAX];                   /**< The name of the query classifier to load */
     char*         qc_args;                             /**< Arguments for the query classifier */
+    int           qc_threads;                          /**< Threads that classify long queries, 0 if none */
+    unsigned int  qc_offload_size;                     /**< Queries this long are classified by the threads */
+    int           qtrace_sample_rate;                  /**< One in this many queries is traced, 0 if none */
+    int           event_watchdog_threshold;            /**< Milliseconds before a running event is reported, 0 if never */
+    int           profile_filters;                     /**< Measure the CPU cost of the filters and routers */
+    int           flight_recorder_size;                /**< Records in the ring log of each thread, 0 if none */
+    char*         thread_affinity;                     /**< CPUs of the polling threads, NULL if not pinned */
+    int           io_uring_writes;                     /**< Submit the writes of a poll cycle with io_uring */
+    int           writeq_high_water;                   /**< Client write queue length that stops the backend reads */
+    int           writeq_low_water;                    /**< Client write queue length that resumes them */
+    long          writeq_budget;                       /**< Bytes all write queues may hold, 0 if unlimited */
+    int           stats_shm_interval;                  /**< Milliseconds between the statistics in shared memory, 0 if none */
+    char*         stats_shm_name;                      /**< Name of the shared memory segment of the statistics */
 } GATEWAY_CONF;
 
 
@@ -150,11 +176,23 @@ bool                config_load(char *);
 unsigned int        config_nbpolls();
 double              config_percentage_value(char *str);
 unsigned int        config_pollsleep();
+bool                config_poll_affinity();
+bool                config_poll_work_stealing();
+bool                config_admin_thread();
+int                 config_poll_max_events();
+bool                config_poll_adaptive();
+int                 config_event_watchdog_threshold();
+bool                config_reuseport_listeners();
+int                 config_tcp_fastopen();
+bool                config_io_uring_writes();
+int                 config_start_threads();
+bool                config_cached_users_at_startup();
 int                 config_reload();
 bool                config_set_qualified_param(CONFIG_PARAMETER* param,
                                                void* val,
                                                config_param_type_t type);
 int                 config_threadcount();
+int                 config_max_threadcount();
 int                 config_truth_value(char *);
 void                free_config_parameter(CONFIG_PARAMETER* p1);
 bool                is_internal_service(const char *router);
@@ -31,6 +31,19 @@
  */
 #define MAX_EVENTS 1000
 
+/**
+ * The event queue is divided into scheduling classes that are served by
+ * deficit round-robin. Each service has a class of its own, class 0 holds the
+ * DCBs of no service and of the services that did not get a class.
+ */
+#define POLL_SCHED_CLASSES 64
+
+/** The events a scheduling class may process in a round by default */
+#define POLL_SCHED_WEIGHT_DEFAULT 1
+
+/** The largest scheduling weight */
+#define POLL_SCHED_WEIGHT_MAX 1000
+
 /**
  * A statistic identifier that can be returned by poll_get_stat
  */
@@ -48,12 +61,21 @@ typedef enum
     POLL_STAT_MAX_EXECTIME
 } POLL_STAT;
 
+struct metrics;
+
 extern  void            poll_init();
 extern  int             poll_add_dcb(DCB *);
 extern  int             poll_remove_dcb(DCB *);
 extern  void            poll_waitevents(void *);
 extern  void            poll_shutdown();
+extern  bool            poll_start_threads(void (*entry)(void *));
+extern  void            poll_wait_threads();
+extern  bool            poll_set_threadcount(int count);
+extern  int             poll_thread_count();
 extern  GWBITMASK       *poll_bitmask();
+extern  int             poll_assign_thread();
+extern  int             poll_current_thread();
+extern  int             poll_admin_thread();
 extern  void            poll_set_maxwait(unsigned int);
 extern  void            poll_set_nonblocking_polls(unsigned int);
 extern  void            dprintPollStats(DCB *);
@@ -63,8 +85,12 @@ extern  void            dShowEventQ(DCB *dcb);
 extern  void            dShowEventStats(DCB *dcb);
 extern  int             poll_get_stat(POLL_STAT stat);
 extern  RESULTSET       *eventTimesGetList();
+extern  void            pollWriteMetrics(struct metrics *);
 extern  void            poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev);
 extern  void            poll_fake_hangup_event(DCB *dcb);
 extern  void            poll_fake_write_event(DCB *dcb);
 extern  void            poll_fake_read_event(DCB *dcb);
+extern  void            poll_watch_query(GWBUF *query);
+extern  int             poll_sched_class_alloc();
+extern  void            poll_set_sched_weight(int sched_class, int weight);
 #endif
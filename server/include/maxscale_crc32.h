@@ -0,0 +1,38 @@
+#ifndef _MAXSCALE_CRC32_H
+#define _MAXSCALE_CRC32_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxscale_crc32.h  CRC-32 checksums
+ *
+ * The checksum is the one of zlib's crc32() and of the binlog events, with
+ * the IEEE polynomial. It is computed with the carry-less multiplication of
+ * x86-64 or the CRC32 instructions of ARMv8 if the processor has them.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Update a running CRC-32 with a buffer. The initial value is 0, which is
+ * also returned for a NULL buffer, like with zlib's crc32().
+ *
+ * @param crc   The CRC-32 of the preceding data
+ * @param buf   The data, may be NULL
+ * @param len   Length of the data
+ * @return The CRC-32 of the preceding data and the buffer
+ */
+uint32_t mxs_crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -19,6 +19,7 @@
 #endif
 
 #include <pcre2.h>
+#include <stdbool.h>
 
 /**
  * @file maxscale_pcre2.h - Utility functions for regular expression matching
@@ -39,9 +40,26 @@ typedef enum
     MXS_PCRE2_ERROR
 } mxs_pcre2_result_t;
 
+/** The syntax of a pattern given to mxs_pcre2_required_literal() */
+typedef enum
+{
+    MXS_REGEX_PCRE2,            /*< PCRE2 pattern */
+    MXS_REGEX_POSIX_EXTENDED,   /*< POSIX pattern compiled with REG_EXTENDED */
+    MXS_REGEX_POSIX_BASIC       /*< POSIX pattern compiled without REG_EXTENDED */
+} mxs_regex_syntax_t;
+
+/** The shortest literal mxs_pcre2_required_literal() returns */
+#define MXS_REGEX_LITERAL_MIN 3
+
+pcre2_code *mxs_pcre2_compile(const char *pattern, int options, int *error, size_t *erroffset);
+pcre2_match_data *mxs_pcre2_match_data(const pcre2_code *re);
+pcre2_match_context *mxs_pcre2_match_context(void);
+int mxs_pcre2_match(const pcre2_code *re, const char *subject, size_t length);
 mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject,
                                         const char *replace, char** dest, size_t* size);
 mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subject,
                                           int options, int* error);
+char *mxs_pcre2_required_literal(const char *pattern, mxs_regex_syntax_t syntax, bool extended);
+bool mxs_pcre2_literal_found(const char *literal, const char *subject, size_t length, bool caseless);
 
 #endif
@@ -25,6 +25,7 @@
  * @endverbatim
  */
 #include <spinlock.h>
+#include <stdint.h>
 
 typedef enum { ML_INT, ML_LONG, ML_LONGLONG, ML_STRING } MEMLOGTYPE;
 
@@ -59,4 +60,62 @@ extern void    memlog_log(MEMLOG *, void *);
 extern void    memlog_flush_all();
 extern void    memlog_flush(MEMLOG *);
 
+/**
+ * The binary ring logs
+ *
+ * Each thread that logs a record gets a ring of its own. The records are
+ * written without locking and are only formatted when the rings are dumped,
+ * which makes the rings cheap enough for the hot paths. The rings act as a
+ * flight recorder of the recent state transitions of the DCBs, sessions and
+ * protocols.
+ */
+
+struct dcb;
+
+/** The largest number of threads that can have a ring */
+#define MEMLOG_MAX_RINGS        256
+
+/** The types of the records, the arguments depend on the type */
+typedef enum
+{
+    MLR_EVENT,          /*< A poll event is processed: events, file descriptor */
+    MLR_DCB_STATE,      /*< A DCB changes state: old state, new state */
+    MLR_SESSION_STATE,  /*< A session changes state: old state, new state */
+    MLR_PROTOCOL_STATE, /*< A protocol changes state: old name, new name */
+    MLR_N_TYPES
+} MEMLOG_RECORD_TYPE;
+
+typedef struct memlog_record
+{
+    uint64_t            timestamp;  /*< CLOCK_MONOTONIC in nanoseconds */
+    const void          *object;    /*< The DCB or session the record is about */
+    intptr_t            args[2];    /*< The arguments of the record */
+    MEMLOG_RECORD_TYPE  type;       /*< The type of the record */
+} MEMLOG_RECORD;
+
+/** Records in each ring, a power of two, 0 if the rings are disabled */
+extern int memlog_ring_size;
+
+extern void    memlog_ring_init(int);
+extern void    memlog_ring_record(MEMLOG_RECORD_TYPE, const void *, intptr_t, intptr_t);
+extern int     memlog_ring_dump(void (*)(void *, const char *), void *);
+extern void    dShowMemlogRings(struct dcb *);
+
+/**
+ * Log a record to the ring of the calling thread
+ *
+ * @param type      The type of the record
+ * @param object    The DCB or session the record is about
+ * @param arg1      The first argument
+ * @param arg2      The second argument
+ */
+static inline void memlog_ring_log(MEMLOG_RECORD_TYPE type, const void *object,
+                                   intptr_t arg1, intptr_t arg2)
+{
+    if (memlog_ring_size)
+    {
+        memlog_ring_record(type, object, arg1, arg2);
+    }
+}
+
 #endif
@@ -0,0 +1,48 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.h - The statistics in the OpenMetrics text format
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <buffer.h>
+
+/** The content type of the OpenMetrics text format */
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/**
+ * The text of the metrics being generated
+ */
+typedef struct metrics
+{
+    char   *data;     /*< The text */
+    size_t length;    /*< Length of the text */
+    size_t size;      /*< Size of the allocated memory */
+    bool   failed;    /*< Memory allocation failed */
+    int    n_labels;  /*< Labels of the current sample */
+} METRICS;
+
+extern GWBUF *metrics_generate();
+extern void metrics_family(METRICS *metrics, const char *name, const char *type, const char *help);
+extern void metrics_sample(METRICS *metrics, const char *name, const char *suffix);
+extern void metrics_label(METRICS *metrics, const char *name, const char *value);
+extern void metrics_label_int(METRICS *metrics, const char *name, int value);
+extern void metrics_value(METRICS *metrics, int64_t value);
+extern void metrics_value_double(METRICS *metrics, double value);
+
+#endif
@@ -39,12 +39,63 @@
 #define IS_FULL_RESPONSE(buf) (modutil_count_signal_packets(buf,0,0) == 2)
 #define PTR_EOF_MORE_RESULTS(b) ((PTR_IS_EOF(b) && ptr[7] & 0x08))
 
+/** Bytes of a packet needed to classify it: the header, the command byte and
+ * the status flags of an EOF packet */
+#define MODUTIL_SCAN_PREFIX_LEN 8
+
+/**
+ * State of an incremental scan of the packets of a reply. The state is kept
+ * between buffers so that each byte of the reply is inspected only once and
+ * packets can be split at arbitrary points between the buffers.
+ */
+typedef struct modutil_packet_scan
+{
+    size_t skip;        /**< Bytes of the current packet left to skip */
+    int prefix_len;     /**< Bytes collected of a split packet prefix */
+    uint8_t prefix[MODUTIL_SCAN_PREFIX_LEN];
+    bool continued;     /**< The next packet continues a 16MB packet */
+    bool more;          /**< Last EOF had SERVER_MORE_RESULTS_EXIST set */
+    bool err;           /**< Last signal packet was an ERR packet */
+    bool deprecate_eof; /**< Result sets end in an OK packet, CLIENT_DEPRECATE_EOF */
+    int state;          /**< Position in the reply, only with deprecate_eof */
+    uint32_t columns;   /**< Column definitions left to skip, only with deprecate_eof */
+} MODUTIL_PACKET_SCAN;
+
+/** The status flag of an OK packet that reports session state changes */
+#define MODUTIL_SESSION_STATE_CHANGED 0x4000
+
+/** Types of the session state changes reported with CLIENT_SESSION_TRACK */
+typedef enum
+{
+    MODUTIL_TRACK_SYSTEM_VARIABLES = 0,
+    MODUTIL_TRACK_SCHEMA = 1,
+    MODUTIL_TRACK_STATE_CHANGE = 2,
+    MODUTIL_TRACK_GTIDS = 3,
+    MODUTIL_TRACK_TRANSACTION_CHARACTERISTICS = 4,
+    MODUTIL_TRACK_TRANSACTION_STATE = 5
+} modutil_track_t;
+
+/**
+ * A session state change read from an OK packet. The strings point into the
+ * packet and are not terminated.
+ */
+typedef struct modutil_state_change
+{
+    int         type;      /**< One of modutil_track_t */
+    const char  *name;     /**< The system variable, NULL for other types */
+    size_t      name_len;
+    const char  *value;    /**< New value of the variable, the schema or other state */
+    size_t      value_len;
+} MODUTIL_STATE_CHANGE;
+
 
 extern int      modutil_is_SQL(GWBUF *);
 extern int      modutil_is_SQL_prepare(GWBUF *);
 extern int      modutil_extract_SQL(GWBUF *, char **, int *);
 extern int      modutil_MySQL_Query(GWBUF *, char **, int *, int *);
 extern char*    modutil_get_SQL(GWBUF *);
+extern bool     modutil_get_SQL_view(GWBUF *, const char **, int *);
+extern const char* modutil_get_SQL_string(GWBUF *);
 extern GWBUF*   modutil_replace_SQL(GWBUF *, char *);
 extern char*    modutil_get_query(GWBUF* buf);
 extern int      modutil_send_mysql_err_packet(DCB *, int, int, int, const char *, const char *);
@@ -61,6 +112,13 @@ GWBUF*          modutil_create_mysql_err_msg(int             packet_number,
                                              const char      *statemsg,
                                              const char      *msg);
 int modutil_count_signal_packets(GWBUF*, int, int, int*);
+void modutil_scan_init(MODUTIL_PACKET_SCAN *scan);
+void modutil_scan_init_eof(MODUTIL_PACKET_SCAN *scan, bool deprecate_eof);
+bool modutil_deprecate_eof(struct session *session);
+int modutil_scan_signal_packets(MODUTIL_PACKET_SCAN *scan, GWBUF *buffer);
+bool modutil_tracks_session_state(struct dcb *dcb);
+int modutil_get_state_changes(const uint8_t *packet, size_t len,
+                              MODUTIL_STATE_CHANGE *changes, int max);
 mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char* string);
 
 /** Character and token searching functions */
@@ -130,6 +130,9 @@ typedef enum
 #define MONITOR_INTERVAL 10000 // in milliseconds
 #define MONITOR_DEFAULT_ID 1UL // unsigned long value
 #define MONITOR_MAX_NUM_SLAVES 20 //number of MySQL slave servers associated to a MySQL master server
+#define MONITOR_MAX_PROBE_THREADS 16 /**< Most threads that probe the servers of a monitor at once */
+#define MONITOR_FAST_PROBE_ERRORS 2 /**< Connection errors after which a server is probed
+                                     *   without waiting for the monitor interval */
 
 /*
  * Create declarations of the enum for monitor events and also the array of
@@ -162,6 +165,14 @@ typedef struct monitor_servers
     int mon_err_count;
     unsigned int mon_prev_status;
     unsigned int pending_status;  /**< Pending Status flag bitmap */
+    uint64_t slave_pos;           /**< The position of its master the server has
+                                   *   executed, 0 if not known. @see SERVER_REPL_POS */
+    uint64_t probe_time;          /**< How long the last probe took, in microseconds */
+    int n_errors;                 /**< Connection errors reported since the last probe */
+    uint64_t fc_paused_ns;        /**< Galera flow control pause counter at the last probe */
+    uint64_t fc_sample_time;      /**< When fc_paused_ns was read, in nanoseconds */
+    bool added_running;           /**< Added while the monitor was running and not
+                                   *   yet published, a slave at once warms up */
     struct monitor_servers *next; /**< The next server in the list */
 } MONITOR_SERVERS;
 
@@ -189,6 +200,11 @@ typedef struct monitor
     MONITOR_OBJECT *module;       /**< The "monitor object" */
     void *handle;                 /**< Handle returned from startMonitor */
     size_t interval;              /**< The monitor interval */
+    size_t max_interval;          /**< Longest interval when the servers are stable,
+                                   *   0 if the interval does not adapt */
+    size_t cur_interval;          /**< The interval currently in use */
+    size_t next_round;            /**< Base interval round of the next probe */
+    int probe_requested;          /**< Servers should be probed at the next base interval */
     struct monitor *next;         /**< Next monitor in the linked list */
 } MONITOR;
 
@@ -206,6 +222,7 @@ extern void monitorShowAll(DCB *);
 extern void monitorShow(DCB *, MONITOR *);
 extern void monitorList(DCB *);
 extern void monitorSetInterval (MONITOR *, unsigned long);
+extern void monitorSetMaxInterval(MONITOR *, unsigned long);
 extern bool monitorSetNetworkTimeout(MONITOR *, int, int);
 extern RESULTSET *monitorGetList();
 extern bool check_monitor_permissions(MONITOR* monitor, const char* query);
@@ -222,5 +239,9 @@ int mon_parse_event_string(bool* events, size_t count, char* string);
 connect_result_t mon_connect_to_db(MONITOR* mon, MONITOR_SERVERS *database);
 void mon_log_connect_error(MONITOR_SERVERS* database, connect_result_t rval);
 void mon_log_state_change(MONITOR_SERVERS *ptr);
+void mon_probe_servers(MONITOR *mon, void (*probe)(MONITOR *, MONITOR_SERVERS *));
+void monitor_report_server_error(SERVER *server);
+bool mon_probe_is_due(MONITOR *mon, size_t nrounds);
+void mon_publish_states(MONITOR *mon);
 
 #endif
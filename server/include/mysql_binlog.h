@@ -68,6 +68,34 @@
 #define TABLE_DUMMY_ID 0x00ffffff
 
 
+/** How the value of a column is stored in a row image */
+typedef enum
+{
+    COLUMN_KIND_INT,        /*< Little-endian integer, @c size bytes */
+    COLUMN_KIND_LONG,       /*< 8 byte little-endian integer */
+    COLUMN_KIND_FLOAT,      /*< 4 byte float */
+    COLUMN_KIND_DOUBLE,     /*< 8 byte double */
+    COLUMN_KIND_STRING,     /*< CHAR with a one byte length */
+    COLUMN_KIND_ENUM,       /*< ENUM or SET stored as CHAR, @c size bytes */
+    COLUMN_KIND_VARSTRING,  /*< Length-encoded string */
+    COLUMN_KIND_BLOB,       /*< Length of @c size bytes followed by the data */
+    COLUMN_KIND_TEMPORAL,   /*< Temporal value, see unpack_temporal_value() */
+    COLUMN_KIND_BIT,        /*< BIT, partly stored in the NULL bitmap */
+    COLUMN_KIND_DECIMAL     /*< Binary DECIMAL, @c size bytes */
+} column_kind_t;
+
+/**
+ * How to decode a column of a row image. The plan of a table is created once
+ * from the table map event and used for all rows of the table.
+ */
+typedef struct column_plan
+{
+    column_kind_t kind;
+    uint8_t type; /*< Column type from the table map */
+    uint8_t size; /*< Size of the value or of its length, see column_kind_t */
+    uint8_t *metadata; /*< Metadata of the column */
+} COLUMN_PLAN;
+
 const char* column_type_to_string(uint8_t type);
 
 /** Column type checking functions */
@@ -91,4 +119,30 @@ uint64_t unpack_bit(uint8_t *ptr, uint8_t *null_mask, uint32_t col_count,
 
 void format_temporal_value(char *str, size_t size, uint8_t type, struct tm *tm);
 
+/** Row image decoding plans */
+int column_metadata_len(uint8_t type);
+COLUMN_PLAN* column_plan_alloc(uint8_t *types, uint64_t columns, uint8_t *metadata,
+                               size_t metadata_size);
+
+/**
+ * @brief Read 64 bits of a row event bitmap
+ *
+ * @param bitmap The NULL or present columns bitmap
+ * @param columns Number of columns in the bitmap
+ * @param first First column to read, a multiple of 64
+ * @return The bits of columns @c first to @c first + 63, bit 0 is column @c first
+ */
+static inline uint64_t column_bitmap_word(const uint8_t *bitmap, uint64_t columns, uint64_t first)
+{
+    uint64_t bytes = (columns + 7) / 8 - first / 8;
+    uint64_t word = 0;
+
+    for (uint64_t i = 0; i < bytes && i < 8; i++)
+    {
+        word |= (uint64_t)bitmap[first / 8 + i] << (i * 8);
+    }
+
+    return word;
+}
+
 #endif /* MYSQL_BINLOG_H */
@@ -0,0 +1,434 @@
+#ifndef _MYSQL_WIRE_H
+#define _MYSQL_WIRE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mysql_wire.h - Encoding and decoding of the MySQL wire format
+ *
+ * The writers put a value at a pointer and return the pointer past it, so
+ * that a packet is built in place in memory that was sized beforehand with
+ * the matching size functions, either a new GWBUF or a reserved part of an
+ * output batch. The readers never read past the end they are given. All
+ * the functions are inline so that the integer widths known at the call
+ * site are compiled into straight stores and loads.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <buffer.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+/** Length of the packet header, the payload length and the sequence number */
+#define MXS_WIRE_HEADER_LEN     4
+/** Length of an EOF packet with its header */
+#define MXS_WIRE_EOF_LEN        (MXS_WIRE_HEADER_LEN + 5)
+/** The length-encoded NULL */
+#define MXS_WIRE_LENENC_NULL    0xfb
+
+/** Server status of the packets created here, autocommit is on */
+#define MXS_WIRE_STATUS_AUTOCOMMIT 0x0002
+
+/**
+ * Write a little-endian integer
+ *
+ * @param ptr   Where to write
+ * @param value The value
+ * @param bytes Width of the integer, 1 to 8
+ * @return Pointer past the integer
+ */
+static inline uint8_t *mxs_wire_put_int(uint8_t *ptr, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        *ptr++ = value >> (8 * i);
+    }
+    return ptr;
+}
+
+/**
+ * Read a little-endian integer
+ *
+ * @param ptr   Where to read
+ * @param bytes Width of the integer, 1 to 8
+ * @return The value
+ */
+static inline uint64_t mxs_wire_get_int(const uint8_t *ptr, int bytes)
+{
+    uint64_t value = 0;
+
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)ptr[i] << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * Write a packet header
+ *
+ * @param ptr   Where to write
+ * @param len   Length of the payload
+ * @param seq   Sequence number of the packet
+ * @return Pointer to the payload
+ */
+static inline uint8_t *mxs_wire_put_header(uint8_t *ptr, uint32_t len, uint8_t seq)
+{
+    ptr = mxs_wire_put_int(ptr, len, 3);
+    *ptr++ = seq;
+    return ptr;
+}
+
+/**
+ * Size of a length-encoded integer
+ *
+ * @param value The value
+ * @return Number of bytes the encoded value takes
+ */
+static inline size_t mxs_wire_lenenc_size(uint64_t value)
+{
+    return value < 0xfb ? 1 : value <= 0xffff ? 3 : value <= 0xffffff ? 4 : 9;
+}
+
+/**
+ * Size of a length-encoded integer from its first byte
+ *
+ * @param first The first byte of the encoded value
+ * @return Number of bytes the encoded value takes
+ */
+static inline size_t mxs_wire_lenenc_bytes(uint8_t first)
+{
+    return first < 0xfb ? 1 : first == 0xfc ? 3 : first == 0xfd ? 4 : first == 0xfe ? 9 : 1;
+}
+
+/**
+ * Write a length-encoded integer
+ *
+ * @param ptr   Where to write
+ * @param value The value
+ * @return Pointer past the value
+ */
+static inline uint8_t *mxs_wire_put_lenenc(uint8_t *ptr, uint64_t value)
+{
+    if (value < 0xfb)
+    {
+        *ptr++ = value;
+    }
+    else if (value <= 0xffff)
+    {
+        *ptr++ = 0xfc;
+        ptr = mxs_wire_put_int(ptr, value, 2);
+    }
+    else if (value <= 0xffffff)
+    {
+        *ptr++ = 0xfd;
+        ptr = mxs_wire_put_int(ptr, value, 3);
+    }
+    else
+    {
+        *ptr++ = 0xfe;
+        ptr = mxs_wire_put_int(ptr, value, 8);
+    }
+    return ptr;
+}
+
+/**
+ * Write a length-encoded string
+ *
+ * @param ptr   Where to write
+ * @param str   The string
+ * @param len   Length of the string
+ * @return Pointer past the string
+ */
+static inline uint8_t *mxs_wire_put_lenenc_str(uint8_t *ptr, const char *str, size_t len)
+{
+    ptr = mxs_wire_put_lenenc(ptr, len);
+    memcpy(ptr, str, len);
+    return ptr + len;
+}
+
+/**
+ * Read a length-encoded integer
+ *
+ * @param ptr   Where to read, moved past the value
+ * @param end   End of the data
+ * @param value The value is stored here
+ * @return False if the value does not fit in the data or is NULL
+ */
+static inline bool mxs_wire_get_lenenc(const uint8_t **ptr, const uint8_t *end, uint64_t *value)
+{
+    const uint8_t *p = *ptr;
+
+    if (p >= end || *p == MXS_WIRE_LENENC_NULL || *p == 0xff)
+    {
+        return false;
+    }
+
+    size_t bytes = mxs_wire_lenenc_bytes(*p);
+
+    if ((size_t)(end - p) < bytes)
+    {
+        return false;
+    }
+
+    *value = bytes == 1 ? *p : mxs_wire_get_int(p + 1, bytes - 1);
+    *ptr = p + bytes;
+    return true;
+}
+
+/**
+ * Read a length-encoded string. The string is not copied.
+ *
+ * @param ptr   Where to read, moved past the string
+ * @param end   End of the data
+ * @param str   Start of the string is stored here
+ * @param len   Length of the string is stored here
+ * @return False if the string does not fit in the data or is NULL
+ */
+static inline bool mxs_wire_get_lenenc_str(const uint8_t **ptr, const uint8_t *end,
+                                           const char **str, size_t *len)
+{
+    const uint8_t *p = *ptr;
+    uint64_t n;
+
+    if (!mxs_wire_get_lenenc(&p, end, &n) || n > (uint64_t)(end - p))
+    {
+        return false;
+    }
+
+    *str = (const char *)p;
+    *len = n;
+    *ptr = p + n;
+    return true;
+}
+
+/**
+ * Length of an OK packet with its header
+ *
+ * @param affected_rows Number of affected rows
+ * @param insert_id     Last insert ID
+ * @param msglen        Length of the message
+ */
+static inline size_t mxs_wire_ok_len(uint64_t affected_rows, uint64_t insert_id, size_t msglen)
+{
+    return MXS_WIRE_HEADER_LEN + 1 + mxs_wire_lenenc_size(affected_rows) +
+           mxs_wire_lenenc_size(insert_id) + 4 + msglen;
+}
+
+/**
+ * Write an OK packet, sized with mxs_wire_ok_len
+ *
+ * @param ptr           Where to write
+ * @param seq           Sequence number
+ * @param affected_rows Number of affected rows
+ * @param insert_id     Last insert ID
+ * @param status        Server status
+ * @param warnings      Number of warnings
+ * @param msg           The message
+ * @param msglen        Length of the message
+ * @return Pointer past the packet
+ */
+static inline uint8_t *mxs_wire_put_ok(uint8_t *ptr, uint8_t seq, uint64_t affected_rows,
+                                       uint64_t insert_id, uint16_t status, uint16_t warnings,
+                                       const char *msg, size_t msglen)
+{
+    ptr = mxs_wire_put_header(ptr, mxs_wire_ok_len(affected_rows, insert_id, msglen) -
+                              MXS_WIRE_HEADER_LEN, seq);
+    *ptr++ = 0x00;
+    ptr = mxs_wire_put_lenenc(ptr, affected_rows);
+    ptr = mxs_wire_put_lenenc(ptr, insert_id);
+    ptr = mxs_wire_put_int(ptr, status, 2);
+    ptr = mxs_wire_put_int(ptr, warnings, 2);
+    if (msglen)
+    {
+        memcpy(ptr, msg, msglen);
+    }
+    return ptr + msglen;
+}
+
+/**
+ * Length of an ERR packet with its header
+ *
+ * @param sqlstate  The SQL state or NULL for none
+ * @param msglen    Length of the message
+ */
+static inline size_t mxs_wire_err_len(const char *sqlstate, size_t msglen)
+{
+    return MXS_WIRE_HEADER_LEN + 3 + (sqlstate ? 6 : 0) + msglen;
+}
+
+/**
+ * Write an ERR packet, sized with mxs_wire_err_len
+ *
+ * @param ptr       Where to write
+ * @param seq       Sequence number
+ * @param errnum    Error number
+ * @param sqlstate  The five characters of the SQL state or NULL for none
+ * @param msg       The message
+ * @param msglen    Length of the message
+ * @return Pointer past the packet
+ */
+static inline uint8_t *mxs_wire_put_err(uint8_t *ptr, uint8_t seq, uint16_t errnum,
+                                        const char *sqlstate, const char *msg, size_t msglen)
+{
+    ptr = mxs_wire_put_header(ptr, mxs_wire_err_len(sqlstate, msglen) - MXS_WIRE_HEADER_LEN, seq);
+    *ptr++ = 0xff;
+    ptr = mxs_wire_put_int(ptr, errnum, 2);
+    if (sqlstate)
+    {
+        *ptr++ = '#';
+        memcpy(ptr, sqlstate, 5);
+        ptr += 5;
+    }
+    memcpy(ptr, msg, msglen);
+    return ptr + msglen;
+}
+
+/**
+ * Write an EOF packet of MXS_WIRE_EOF_LEN bytes
+ *
+ * @param ptr       Where to write
+ * @param seq       Sequence number
+ * @param warnings  Number of warnings
+ * @param status    Server status
+ * @return Pointer past the packet
+ */
+static inline uint8_t *mxs_wire_put_eof(uint8_t *ptr, uint8_t seq, uint16_t warnings, uint16_t status)
+{
+    ptr = mxs_wire_put_header(ptr, MXS_WIRE_EOF_LEN - MXS_WIRE_HEADER_LEN, seq);
+    *ptr++ = 0xfe;
+    ptr = mxs_wire_put_int(ptr, warnings, 2);
+    return mxs_wire_put_int(ptr, status, 2);
+}
+
+/**
+ * Length of a column definition packet with its header. The catalog is
+ * always "def" and the original names are empty.
+ *
+ * @param db    Length of the database name
+ * @param table Length of the table name
+ * @param name  Length of the column name
+ */
+static inline size_t mxs_wire_coldef_len(size_t db, size_t table, size_t name)
+{
+    return MXS_WIRE_HEADER_LEN + 4 + mxs_wire_lenenc_size(db) + db +
+           mxs_wire_lenenc_size(table) + table + 1 + mxs_wire_lenenc_size(name) + name +
+           1 + 1 + 12;
+}
+
+/**
+ * Write a column definition packet, sized with mxs_wire_coldef_len
+ *
+ * @param ptr       Where to write
+ * @param seq       Sequence number
+ * @param db        The database name
+ * @param table     The table name
+ * @param name      The column name
+ * @param charset   Character set of the column
+ * @param length    Maximum length of the values
+ * @param type      Type of the column
+ * @param flags     Column flags
+ * @param decimals  Number of decimals
+ * @return Pointer past the packet
+ */
+static inline uint8_t *mxs_wire_put_coldef(uint8_t *ptr, uint8_t seq, const char *db,
+                                           const char *table, const char *name,
+                                           uint16_t charset, uint32_t length, uint8_t type,
+                                           uint16_t flags, uint8_t decimals)
+{
+    size_t dblen = strlen(db), tablelen = strlen(table), namelen = strlen(name);
+
+    ptr = mxs_wire_put_header(ptr, mxs_wire_coldef_len(dblen, tablelen, namelen) -
+                              MXS_WIRE_HEADER_LEN, seq);
+    ptr = mxs_wire_put_lenenc_str(ptr, "def", 3);
+    ptr = mxs_wire_put_lenenc_str(ptr, db, dblen);
+    ptr = mxs_wire_put_lenenc_str(ptr, table, tablelen);
+    *ptr++ = 0;                         // Original table name
+    ptr = mxs_wire_put_lenenc_str(ptr, name, namelen);
+    *ptr++ = 0;                         // Original column name
+    *ptr++ = 0x0c;                      // Length of the fixed fields
+    ptr = mxs_wire_put_int(ptr, charset, 2);
+    ptr = mxs_wire_put_int(ptr, length, 4);
+    *ptr++ = type;
+    ptr = mxs_wire_put_int(ptr, flags, 2);
+    *ptr++ = decimals;
+    return mxs_wire_put_int(ptr, 0, 2);
+}
+
+/**
+ * Create an OK packet
+ *
+ * @param seq           Sequence number
+ * @param affected_rows Number of affected rows
+ * @param insert_id     Last insert ID
+ * @param msg           The message or NULL for none
+ * @return The packet or NULL if out of memory
+ */
+static inline GWBUF *mxs_wire_create_ok(uint8_t seq, uint64_t affected_rows, uint64_t insert_id,
+                                        const char *msg)
+{
+    size_t msglen = msg ? strlen(msg) : 0;
+    GWBUF *buf = gwbuf_alloc(mxs_wire_ok_len(affected_rows, insert_id, msglen));
+
+    if (buf)
+    {
+        mxs_wire_put_ok(GWBUF_DATA(buf), seq, affected_rows, insert_id,
+                        MXS_WIRE_STATUS_AUTOCOMMIT, 0, msg, msglen);
+    }
+    return buf;
+}
+
+/**
+ * Create an ERR packet
+ *
+ * @param seq       Sequence number
+ * @param errnum    Error number
+ * @param sqlstate  The five characters of the SQL state or NULL for none
+ * @param msg       The message
+ * @return The packet or NULL if out of memory
+ */
+static inline GWBUF *mxs_wire_create_err(uint8_t seq, uint16_t errnum, const char *sqlstate,
+                                         const char *msg)
+{
+    size_t msglen = strlen(msg);
+    GWBUF *buf = gwbuf_alloc(mxs_wire_err_len(sqlstate, msglen));
+
+    if (buf)
+    {
+        mxs_wire_put_err(GWBUF_DATA(buf), seq, errnum, sqlstate, msg, msglen);
+    }
+    return buf;
+}
+
+/**
+ * Create an EOF packet
+ *
+ * @param seq   Sequence number
+ * @return The packet or NULL if out of memory
+ */
+static inline GWBUF *mxs_wire_create_eof(uint8_t seq)
+{
+    GWBUF *buf = gwbuf_alloc(MXS_WIRE_EOF_LEN);
+
+    if (buf)
+    {
+        mxs_wire_put_eof(GWBUF_DATA(buf), seq, 0, MXS_WIRE_STATUS_AUTOCOMMIT);
+    }
+    return buf;
+}
+
+EXTERN_C_BLOCK_END
+
+#endif
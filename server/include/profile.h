@@ -0,0 +1,95 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file profile.h - CPU cost of the filters and routers
+ *
+ * The calls of the routeQuery and clientReply entry points of the filters and
+ * the routeQuery entry point of the router are timed with the time-stamp
+ * counter. The time spent in the next element of the chain is subtracted, so
+ * that each element is only charged for its own work.
+ */
+
+#include <stdbool.h>
+#include <platform.h>
+#include <statistics.h>
+#include <rdtsc.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+/** The cost of one entry point of a filter or a router */
+typedef struct
+{
+    ts_stats_t     cycles;    /*< Cycles spent in the entry point */
+    ts_histogram_t histogram; /*< Cycles per call, log-linear buckets */
+} PROFILE;
+
+/** A call that is being timed */
+typedef struct
+{
+    CYCLES start;  /*< When the call was made */
+    CYCLES nested; /*< Time of the calls nested in the caller so far */
+} PROFILE_CALL;
+
+extern bool profile_enabled;
+extern thread_local CYCLES profile_nested;
+
+struct dcb;
+
+void profile_init(bool enabled);
+bool profile_alloc(PROFILE *profile);
+void profile_free(PROFILE *profile);
+int64_t profile_calls(PROFILE *profile);
+int64_t profile_average(PROFILE *profile);
+int64_t profile_percentile(PROFILE *profile, double percentile);
+void profile_print(struct dcb *dcb, const char *label, PROFILE *profile);
+
+/**
+ * Start timing a call
+ *
+ * @param call The call
+ */
+static inline void profile_begin(PROFILE_CALL *call)
+{
+    call->nested = profile_nested;
+    profile_nested = 0;
+    call->start = rdtsc();
+}
+
+/**
+ * Stop timing a call and charge the time not spent in the nested calls
+ *
+ * @param call    The call
+ * @param profile Where the time is counted, NULL if the call is only
+ *                subtracted from the time of the caller
+ */
+static inline void profile_end(PROFILE_CALL *call, PROFILE *profile)
+{
+    CYCLES elapsed = rdtsc() - call->start;
+
+    if (profile && profile->cycles)
+    {
+        CYCLES own = elapsed > profile_nested ? elapsed - profile_nested : 0;
+        ts_stats_add(profile->cycles, own);
+        ts_histogram_add(profile->histogram, own);
+    }
+
+    profile_nested = call->nested + elapsed;
+}
+
+EXTERN_C_BLOCK_END
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _QC_POOL_H
+#define _QC_POOL_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qc_pool.h  A pool of threads that classify long queries
+ *
+ * Parsing a long statement can take milliseconds, during which the polling
+ * thread cannot serve any other DCB it owns. When the pool is enabled, the
+ * client protocol hands the queries that are at least the configured size
+ * to the pool and the session continues on its own polling thread when the
+ * query has been parsed. The result of the parsing is kept in the buffer,
+ * so the query is not parsed again when it is routed.
+ */
+
+#include <stdbool.h>
+#include <buffer.h>
+#include <dcb.h>
+
+/**
+ * Called by a thread of the pool when a query has been parsed. The function
+ * takes the ownership of the query.
+ */
+typedef void (*qc_pool_done_t)(DCB *dcb, GWBUF *query);
+
+extern bool qc_pool_init(int n_threads, unsigned int min_size);
+extern void qc_pool_end(void);
+extern bool qc_pool_wants(GWBUF *query);
+extern bool qc_pool_classify(DCB *dcb, GWBUF *query, qc_pool_done_t done);
+
+#endif
@@ -73,8 +73,37 @@ typedef enum qc_parse_result
     QC_QUERY_PARSED           = 3  /*< The query was fully parsed; completely classified. */
 } qc_parse_result_t;
 
+/**
+ * The information a query classifier collects about a statement in addition
+ * to the essentials: the type, the operation, the created table and whether
+ * the statement has a clause or drops a table.
+ */
+typedef enum qc_collect_info
+{
+    QC_COLLECT_ESSENTIALS = 0x00, /*< Collect only the essentials */
+    QC_COLLECT_TABLES     = 0x01, /*< Collect the table names */
+    QC_COLLECT_DATABASES  = 0x02, /*< Collect the database names */
+    QC_COLLECT_FIELDS     = 0x04, /*< Collect the affected fields */
+    QC_COLLECT_FUNCTIONS  = 0x08, /*< Collect the names of the called functions */
+
+    QC_COLLECT_ALL = (QC_COLLECT_TABLES | QC_COLLECT_DATABASES | QC_COLLECT_FIELDS |
+                      QC_COLLECT_FUNCTIONS)
+} qc_collect_info_t;
+
 #define QUERY_IS_TYPE(mask,type) ((mask & type) == type)
 
+/**
+ * The statistics of the classification cache of a query classifier.
+ */
+typedef struct qc_cache_stats
+{
+    int64_t size;         /*< The maximum number of entries per thread */
+    int64_t entries;      /*< The number of entries in the caches of all threads */
+    int64_t hits;         /*< Statements classified from the cache */
+    int64_t misses;       /*< Cacheable statements that had to be parsed */
+    int64_t evictions;    /*< Entries evicted to make room for new ones */
+} QC_CACHE_STATS;
+
 bool qc_init(const char* plugin_name, const char* plugin_args);
 void qc_end(void);
 
@@ -87,19 +116,25 @@ bool qc_thread_init(void);
 void qc_thread_end(void);
 
 qc_parse_result_t qc_parse(GWBUF* querybuf);
+qc_parse_result_t qc_parse_collect(GWBUF* querybuf, uint32_t collect);
 
 uint32_t qc_get_type(GWBUF* querybuf);
+int qc_get_multi_stmt_type(GWBUF* querybuf, uint32_t* type);
 qc_query_op_t qc_get_operation(GWBUF* querybuf);
 
 char* qc_get_created_table_name(GWBUF* querybuf);
 bool qc_is_drop_table_query(GWBUF* querybuf);
 bool qc_is_real_query(GWBUF* querybuf);
 char** qc_get_table_names(GWBUF* querybuf, int* tblsize, bool fullnames);
+bool qc_peek_table_names(GWBUF* querybuf, bool fullnames, const char* const** names, int* tblsize);
 char* qc_get_canonical(GWBUF* querybuf);
 bool qc_query_has_clause(GWBUF* buf);
 char* qc_get_qtype_str(qc_query_type_t qtype);
 char* qc_get_affected_fields(GWBUF* buf);
 char** qc_get_database_names(GWBUF* querybuf, int* size);
+bool qc_get_function_names(GWBUF* querybuf, char*** names, int* size);
+bool qc_get_cache_stats(QC_CACHE_STATS* stats);
+void dprintQcCacheStats(void* pdcb);
 
 const char* qc_op_to_string(qc_query_op_t op);
 const char* qc_type_to_string(qc_query_type_t type);
@@ -126,6 +161,11 @@ struct query_classifier
     bool (*qc_query_has_clause)(GWBUF* buf);
     char* (*qc_get_affected_fields)(GWBUF* buf);
     char** (*qc_get_database_names)(GWBUF* querybuf, int* size);
+    bool (*qc_get_cache_stats)(QC_CACHE_STATS* stats); /*< Optional, may be NULL */
+    qc_parse_result_t (*qc_parse_collect)(GWBUF* querybuf, uint32_t collect); /*< Optional, may be NULL */
+    bool (*qc_peek_table_names)(GWBUF* querybuf, bool fullnames,
+                                const char* const** names, int* tblsize); /*< Optional, may be NULL */
+    bool (*qc_get_function_names)(GWBUF* querybuf, char*** names, int* size); /*< Optional, may be NULL */
 };
 
 #define QUERY_CLASSIFIER_VERSION {1, 0, 0}
@@ -0,0 +1,145 @@
+#ifndef _QUERY_TRACE_H
+#define _QUERY_TRACE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file query_trace.h - Sampled per-query latency breakdown
+ *
+ * A sample of the queries is timed at each stage of the session pipeline.
+ * The durations of the stages are counted in per-service log-linear
+ * histograms from which the percentiles are reported.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <platform.h>
+#include <statistics.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+/** The stages of a query */
+typedef enum
+{
+    QTRACE_QUEUE,    /*< Waiting in the event queue */
+    QTRACE_CLASSIFY, /*< Query classification */
+    QTRACE_FILTER,   /*< The filters of the service */
+    QTRACE_ROUTER,   /*< The router */
+    QTRACE_BACKEND,  /*< Waiting for the first reply */
+    QTRACE_REPLY,    /*< Sending the reply to the client */
+    QTRACE_TOTAL,    /*< From the event to the last write */
+    QTRACE_N_STAGES
+} qtrace_stage_t;
+
+/**
+ * The timestamps of the traced query of a session, in nanoseconds
+ */
+typedef struct query_trace
+{
+    bool     active;          /*< A query is being traced */
+    uint64_t queued;          /*< The event was queued, 0 if not known */
+    uint64_t dispatched;      /*< The event processing started */
+    uint64_t routed;          /*< The query entered the filter chain */
+    uint64_t router;          /*< The query reached the router, 0 if no filters */
+    uint64_t router_done;     /*< The routing of the query returned */
+    uint64_t first_reply;     /*< The first reply reached the client protocol */
+    uint64_t last_write;      /*< The reply was last written to the client */
+    uint64_t classify;        /*< Total classification time */
+    uint64_t classify_filter; /*< Classification time before the router */
+} QUERY_TRACE;
+
+/** One in this many queries is traced, 0 if tracing is disabled */
+extern int qtrace_rate;
+
+/** The trace of the query being routed by this thread */
+extern thread_local QUERY_TRACE *qtrace_current;
+
+void qtrace_init(int sample_rate);
+bool qtrace_sample();
+void qtrace_event_begin(uint64_t queued);
+void qtrace_event_end();
+void qtrace_start(QUERY_TRACE *trace);
+void qtrace_finish(QUERY_TRACE *trace, ts_histogram_t *latency);
+bool qtrace_alloc_stats(ts_histogram_t *latency);
+void qtrace_free_stats(ts_histogram_t *latency);
+const char* qtrace_stage_name(qtrace_stage_t stage);
+
+/**
+ * Check if queries are traced
+ */
+static inline bool qtrace_enabled()
+{
+    return qtrace_rate > 0;
+}
+
+/**
+ * The current time in nanoseconds
+ */
+static inline uint64_t qtrace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Start timing a call to the query classifier
+ *
+ * @return The start time or 0 if the current query is not traced
+ */
+static inline uint64_t qtrace_classify_begin()
+{
+    return qtrace_current ? qtrace_now() : 0;
+}
+
+/**
+ * Stop timing a call to the query classifier
+ *
+ * @param start Value returned by qtrace_classify_begin
+ */
+static inline void qtrace_classify_end(uint64_t start)
+{
+    if (start && qtrace_current)
+    {
+        qtrace_current->classify += qtrace_now() - start;
+    }
+}
+
+/**
+ * Note that a reply was given to the client protocol
+ */
+static inline void qtrace_reply(QUERY_TRACE *trace)
+{
+    if (trace->active && trace->first_reply == 0)
+    {
+        trace->first_reply = qtrace_now();
+    }
+}
+
+/**
+ * Note that the reply was written to the client or that the write queue of
+ * the client was drained
+ */
+static inline void qtrace_written(QUERY_TRACE *trace)
+{
+    if (trace->active && trace->first_reply)
+    {
+        trace->last_write = qtrace_now();
+    }
+}
+
+EXTERN_C_BLOCK_END
+
+#endif
@@ -16,6 +16,12 @@
 /**
  * @file queuemanager.h  The Queue Manager header file
  *
+ * The queues are bounded rings that any number of threads can add entries
+ * to and remove entries from without locks. Each slot of the ring has a
+ * sequence number that tells whether the slot is free for the producer of
+ * a given position or holds the entry for the consumer of that position, so
+ * that the producers and the consumers only contend on their own position
+ * counter.
  *
  * @verbatim
  * Revision History
@@ -26,38 +32,77 @@
  * @endverbatim
  */
 
-#include <spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <skygw_debug.h>
 
 #define CONNECTION_QUEUE_LIMIT 1000
 
+/** Only one thread removes entries, they are removed without atomic operations */
+#define QUEUE_SINGLE_CONSUMER 0x01
+/** Collect the time the entries spend in the queue */
+#define QUEUE_TIMESTAMPS      0x02
+
 typedef struct queue_entry
 {
     void            *queued_object;
-    long            heartbeat;
+    long            heartbeat;      /**< When the entry was queued, in heartbeats */
+    uint64_t        queued_at;      /**< When the entry was queued, in nanoseconds,
+                                     *   if the queue has QUEUE_TIMESTAMPS */
 } QUEUE_ENTRY;
 
+/** A slot of the ring */
+typedef struct queue_slot
+{
+    uint64_t        sequence;       /**< Position the slot is ready for */
+    QUEUE_ENTRY     entry;
+} QUEUE_SLOT;
+
+/** The statistics of a queue */
+typedef struct queue_stats
+{
+    uint64_t        n_enqueued;     /**< Entries added */
+    uint64_t        n_dequeued;     /**< Entries removed */
+    uint64_t        n_full;         /**< Entries rejected as the queue was full */
+    uint64_t        total_wait;     /**< Nanoseconds the removed entries were queued,
+                                     *   if the queue has QUEUE_TIMESTAMPS */
+    uint64_t        max_wait;       /**< Longest time an entry was queued */
+} QUEUE_STATS;
+
 typedef struct queue_config
 {
-    int             queue_size;
-    int             queue_limit;
-    int             start;
-    int             end;
-    int             timeout;
-    SPINLOCK        queue_lock;
-    QUEUE_ENTRY     queue_array[CONNECTION_QUEUE_LIMIT];
+    int             queue_size;     /**< Number of slots, a power of two */
+    int             queue_limit;    /**< Most entries the queue holds */
+    int             timeout;        /**< Seconds after which the entries expire */
+    int             flags;          /**< QUEUE_SINGLE_CONSUMER and QUEUE_TIMESTAMPS */
+    QUEUE_SLOT      *queue_array;
+    QUEUE_STATS     stats;
+    /** The positions are on cache lines of their own */
+    uint64_t        end __attribute__((aligned(64)));   /**< Next position to add to */
+    uint64_t        start __attribute__((aligned(64))); /**< Next position to remove from */
 } QUEUE_CONFIG;
 
 QUEUE_CONFIG *mxs_queue_alloc(int limit, int timeout);
+QUEUE_CONFIG *mxs_queue_create(int limit, int flags);
 void mxs_queue_free(QUEUE_CONFIG *queue_config);
 bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry);
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config);
+int mxs_enqueue_batch(QUEUE_CONFIG *queue_config, void **new_entries, int n);
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result);
+int mxs_dequeue_batch(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *results, int n);
+bool mxs_dequeue_expired(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result);
+bool mxs_queue_peek(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result);
+void mxs_queue_get_stats(QUEUE_CONFIG *queue_config, QUEUE_STATS *stats);
 
+/**
+ * The number of entries in a queue. With concurrent use the value may
+ * already be out of date when it is returned.
+ */
 static inline int
 mxs_queue_count(QUEUE_CONFIG *queue_config)
 {
-    int count = queue_config->end - queue_config->start;
-    return count < 0 ? (count + queue_config->queue_size) : count;
+    uint64_t start = __atomic_load_n(&queue_config->start, __ATOMIC_ACQUIRE);
+    uint64_t end = __atomic_load_n(&queue_config->end, __ATOMIC_ACQUIRE);
+    return end > start ? (int)(end - start) : 0;
 }
 
 #endif /* QUEUEMANAGER_H */
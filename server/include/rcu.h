@@ -0,0 +1,41 @@
+#ifndef _RCU_H
+#define _RCU_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file rcu.h  Deferred reclamation of shared objects
+ *
+ * The polling threads read shared structures without locks. An object that
+ * is removed from such a structure is retired and tagged with the global
+ * epoch, and it may be freed once every polling thread has passed a
+ * quiescent point, the end of an iteration of the polling loop, after it.
+ *
+ * Readers on the polling threads do not write to any shared memory. Threads
+ * that do not poll are not tracked, structures that they read must protect
+ * them by other means.
+ */
+
+#include <stdbool.h>
+
+extern void rcu_init(int n_threads);
+extern void rcu_thread_start(int thread_id);
+extern void rcu_thread_stop(int thread_id);
+extern void rcu_quiescent(int thread_id);
+extern bool rcu_is_online(void);
+extern bool rcu_enabled(void);
+extern int  rcu_retire(void);
+extern bool rcu_passed(int epoch);
+extern int  rcu_current(void);
+
+#endif
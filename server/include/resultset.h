@@ -73,6 +73,8 @@ typedef struct resultset
     RESULT_COLUMN *column;  /*< Linked list of column definitions */
     RESULT_ROW_CB fetchrow; /*< Fetch a row for the result set */
     void *userdata;         /*< User data for the fetch row call */
+    long limit;             /*< Maximum number of rows to send, -1 for all */
+    long offset;            /*< Number of rows to skip before sending */
 } RESULTSET;
 
 extern RESULTSET *resultset_create(RESULT_ROW_CB, void *);
@@ -82,6 +84,7 @@ extern void resultset_column_free(RESULT_COLUMN *);
 extern RESULT_ROW *resultset_make_row(RESULTSET *);
 extern void resultset_free_row(RESULT_ROW *);
 extern int resultset_row_set(RESULT_ROW *, int, char *);
+extern void resultset_set_limit(RESULTSET *, long, long);
 extern void resultset_stream_mysql(RESULTSET *, DCB *);
 extern void resultset_stream_json(RESULTSET *, DCB *);
 
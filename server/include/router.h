@@ -95,7 +95,11 @@ typedef enum router_capability_t
     RCAP_TYPE_UNDEFINED    = 0x00,
     RCAP_TYPE_STMT_INPUT   = 0x01,  /*< statement per buffer */
     RCAP_TYPE_PACKET_INPUT = 0x02,  /*< data as it was read from DCB */
-    RCAP_TYPE_NO_RSESSION  = 0x04   /*< router does not use router sessions */
+    RCAP_TYPE_NO_RSESSION  = 0x04,  /*< router does not use router sessions */
+    RCAP_TYPE_RESULT_STREAM = 0x08, /*< replies need not be split into complete packets */
+    RCAP_TYPE_DEPRECATE_EOF = 0x10, /*< result sets may end in an OK packet */
+    RCAP_TYPE_STREAM_INPUT = 0x20   /*< packets that continue a command may be
+                                     * routed in parts as they are read */
 } router_capability_t;
 
 
@@ -13,7 +13,10 @@
  * Public License.
  */
 #include <dcb.h>
+#include <hashtable.h>
+#include <netinet/in.h>
 #include <resultset.h>
+#include <statistics.h>
 
 /**
  * @file service.h
@@ -67,8 +70,110 @@ typedef struct
     int n_current;     /**< Current connections */
     int n_current_ops; /**< Current active operations */
     int n_persistent;  /**< Current persistent pool */
+    int n_persist_hits;   /**< Connections taken from the persistent pool */
+    int n_persist_misses; /**< Connections opened as the pool had none to give */
+    int n_persist_switches; /**< Pooled connections switched to another user */
+    int n_fastopen;       /**< Connections opened with TCP Fast Open */
+    int n_handshakes;     /**< Handshakes timed for handshake_time */
+    uint64_t handshake_time; /**< Total time of the timed handshakes, in microseconds */
+    uint64_t compressed_in;    /**< Compressed bytes read from the server */
+    uint64_t uncompressed_in;  /**< The bytes that compressed_in decompressed to */
+    uint64_t compressed_out;   /**< Compressed bytes written to the server */
+    uint64_t uncompressed_out; /**< The bytes that were compressed to compressed_out */
+    uint64_t compress_time;    /**< CPU time of compressing and decompressing, in microseconds */
 } SERVER_STATS;
 
+/**
+ * The counters of SERVER_STATS that change with every connection and query.
+ * Each thread changes its own copy of them and the sums are published to
+ * SERVER_STATS every few milliseconds.
+ */
+typedef struct
+{
+    ts_gauge_t n_connections; /**< Sharded n_connections */
+    ts_gauge_t n_current;     /**< Sharded n_current */
+    ts_gauge_t n_current_ops; /**< Sharded n_current_ops */
+    uint64_t   published;     /**< When the sums were last published */
+} SERVER_SHARDS;
+
+/**
+ * The compression of the protocol between MaxScale and a server
+ */
+typedef enum
+{
+    SERVER_COMPRESSION_NONE,
+    SERVER_COMPRESSION_ZLIB
+} server_compression_t;
+
+/** The default compression level of server_compression_t SERVER_COMPRESSION_ZLIB */
+#define SERVER_COMPRESSION_LEVEL_DEFAULT 6
+
+/**
+ * The share of its full routing weight that a server gets when it starts to
+ * warm up after becoming a slave, in units of 1/1000. @see server_warmup_weight
+ */
+#define SERVER_WARMUP_START 100
+
+/** The credentials a warm-up connection of the persistent pool is opened with */
+typedef struct server_pool_auth SERVER_POOL_AUTH;
+
+/**
+ * The unused persistent connections to a server that are authenticated as
+ * one user. The DCBs form a stack linked by nextpersistent so that the most
+ * recently pooled connection is reused first.
+ */
+typedef struct server_pool_user
+{
+    char             *user;      /**< The user the connections are authenticated as */
+    DCB              *stack;     /**< The pooled connections, newest first */
+    int              count;      /**< Number of connections in the stack */
+    int              warming;    /**< Warm-up connections being opened */
+    bool             warmfailed; /**< Warm-up failed, wait for new credentials */
+    SERVER_POOL_AUTH *auth;      /**< Credentials for warm-up connections, NULL if none */
+    struct server_pool_user *next; /**< Next user in the pool of the server */
+} SERVER_POOL_USER;
+
+/**
+ * An immutable snapshot of the state of a server that the monitor has
+ * determined. The monitor publishes a new snapshot at the end of each
+ * monitoring cycle by swapping the pointer in the server, so the routers read
+ * a consistent state without locks. A snapshot that has been replaced is
+ * freed once no polling thread can refer to it. @see server_state_acquire
+ */
+typedef struct server_state
+{
+    int           version;   /**< Incremented with each snapshot of the server */
+    unsigned int  status;    /**< Status flag bitmap of the server */
+    long          node_id;   /**< Node id, server_id for M/S or local_index for Galera */
+    long          master_id; /**< Master server id of this node */
+    int           depth;     /**< Replication level in the tree */
+    int           rlag;      /**< Replication lag for Master / Slave replication */
+    unsigned long node_ts;   /**< Last timestamp set from M/S monitor module */
+    int           load;      /**< Load score from the monitor, 0 if not measured */
+    int           epoch;     /**< Epoch at which the snapshot was replaced */
+    struct server_state *retired; /**< Next replaced snapshot waiting to be freed */
+} SERVER_STATE;
+
+/**
+ * The replication position of a server, published by the monitor without
+ * locks. The monitor makes the version odd while it updates the other fields,
+ * the readers use server_get_repl_pos() to read a consistent copy.
+ *
+ * The position is the binary log file number of the master in the upper 32 bits
+ * and the offset in the file in the lower ones. For a master it is the position
+ * it has written, for a slave the position of its master that it has executed.
+ */
+typedef struct
+{
+    int      version; /**< Incremented before and after an update */
+    uint64_t pos;     /**< The binary log position, 0 if not known */
+    uint64_t ts;      /**< When the position was read, in milliseconds */
+    double   rate;    /**< How many bytes per second the position advances */
+} SERVER_REPL_POS;
+
+/** The binary log file number of a replication position */
+#define SERVER_REPL_POS_FILE(pos) ((pos) >> 32)
+
 /**
  * The SERVER structure defines a backend server. Each server has a name
  * or IP address for the server, a port that the server listens on and
@@ -83,13 +188,17 @@ typedef struct server
     SPINLOCK       lock;           /**< Common access lock */
     char           *unique_name;   /**< Unique name for the server */
     char           *name;          /**< Server name/IP address*/
+    struct in_addr addr;           /**< The address name resolves to, refreshed by the housekeeper */
+    bool           addr_resolved;  /**< Whether addr holds an address for name */
     unsigned short port;           /**< Port to listen on */
+    char           *socket;        /**< Unix domain socket of the server, NULL for TCP */
     char           *protocol;      /**< Protocol module to use */
     SSL_LISTENER   *server_ssl;    /**< SSL data structure for server, if any */
     unsigned int   status;         /**< Status flag bitmap for the server */
     char           *monuser;       /**< User name to use to monitor the db */
     char           *monpw;         /**< Password to use to monitor the db */
     SERVER_STATS   stats;          /**< The server statistics */
+    SERVER_SHARDS  shards;         /**< The per-thread counters behind stats */
     struct  server *next;          /**< Next server */
     struct  server *nextdb;        /**< Next server in list attached to a service */
     char           *server_string; /**< Server version string, i.e. MySQL server version */
@@ -101,11 +210,23 @@ typedef struct server
     int            depth;          /**< Replication level in the tree */
     long           *slaves;        /**< Slaves of this node */
     bool           master_err_is_logged; /*< If node failed, this indicates whether it is logged */
-    DCB            *persistent;    /**< List of unused persistent connections to the server */
+    SERVER_POOL_USER *persistent;  /**< Unused persistent connections to the server by user */
+    HASHTABLE      *persistindex;  /**< The entries of persistent by user name */
     SPINLOCK       persistlock;    /**< Lock for adjusting the persistent connections list */
     long           persistpoolmax; /**< Maximum size of persistent connections pool */
     long           persistmaxtime; /**< Maximum number of seconds connection can live */
     int            persistmax;     /**< Maximum pool size actually achieved since startup */
+    long           persistwarm;    /**< Connections per user kept open in the pool */
+    long           persiststandby; /**< Connections per user kept open while not the master */
+    server_compression_t compression; /**< Compression of the connections to the server */
+    int            compression_level; /**< The zlib level of the compression */
+    SERVER_REPL_POS repl_pos;      /**< Replication position published by the monitor */
+    SERVER_STATE   *state;         /**< Latest snapshot of the state, NULL if none */
+    int            load;           /**< Load score from the monitor, 0 if not measured */
+    uint32_t       capabilities;   /**< Capabilities the server advertised, 0 if not known */
+    long           warmup_time;    /**< Seconds over which a new slave ramps up to full weight */
+    long           slave_since;    /**< The hkheartbeat when the monitor saw the server become
+                                    *   a slave, -1 if it was one when first monitored */
 #if defined(SS_DEBUG)
     skygw_chk_t    server_chk_tail;
 #endif
@@ -160,9 +281,11 @@ typedef struct server
  * Is the server a slave? The server must be both running and marked as a slave
  * in order for the macro to return true
  */
-#define SERVER_IS_SLAVE(server)                                         \
-    (((server)->status & (SERVER_RUNNING|SERVER_SLAVE|SERVER_MAINT)) == \
-     (SERVER_RUNNING|SERVER_SLAVE))
+#define SERVER_IS_SLAVE(server) SRV_SLAVE_STATUS((server)->status)
+
+#define SRV_SLAVE_STATUS(status) (((status) &                           \
+                                   (SERVER_RUNNING|SERVER_SLAVE|SERVER_MAINT)) == \
+                                  (SERVER_RUNNING|SERVER_SLAVE))
 
 /**
  * Is the server joined Galera node? The server must be running and joined.
@@ -192,6 +315,8 @@ typedef struct server
 
 extern SERVER *server_alloc(char *, char *, unsigned short);
 extern int server_free(SERVER *);
+struct metrics;
+
 extern SERVER *server_find_by_unique_name(char *);
 extern SERVER *server_find(char *, unsigned short);
 extern void printServer(SERVER *);
@@ -211,11 +336,36 @@ extern void serverAddParameter(SERVER *, char *, char *);
 extern char *serverGetParameter(SERVER *, char *);
 extern void server_update(SERVER *, char *, char *, char *);
 extern void server_set_unique_name(SERVER *, char *);
-extern DCB  *server_get_persistent(SERVER *, char *, const char *);
+extern DCB  *server_get_persistent(SERVER *, char *, const char *, int);
+extern SERVER_POOL_USER *server_pool_user(SERVER *, const char *);
+extern void server_pool_save_auth(SERVER *, SERVER_POOL_USER *, DCB *);
+extern void server_add_persistent(SERVER *, SERVER_POOL_USER *, DCB *);
+extern void server_pool_warmup_start(SERVER *);
+extern void server_pool_standby_start(SERVER *);
+extern void server_pool_warmup_done(DCB *, bool);
+extern void server_connection_started(DCB *);
+extern void server_connection_authenticated(DCB *);
+extern void server_stats_init();
+extern void server_add_connection(SERVER *);
+extern void server_add_current(SERVER *, int);
+extern void server_add_current_ops(SERVER *, int);
+extern void server_publish_stats(SERVER *);
+extern void server_add_compression_stats(SERVER *, bool, uint64_t, uint64_t, uint64_t);
 extern void server_update_address(SERVER *, char *);
 extern void server_update_port(SERVER *,  unsigned short);
+extern void server_set_socket(SERVER *, const char *);
+extern bool server_resolve_address(SERVER *);
+extern bool server_get_address(SERVER *, struct in_addr *);
 extern RESULTSET *serverGetList();
+extern void serverWriteMetrics(struct metrics *);
 extern unsigned int server_map_status(char *str);
 extern bool server_set_version_string(SERVER* server, const char* string);
+extern void server_set_repl_pos(SERVER *server, uint64_t pos);
+extern bool server_get_repl_pos(SERVER *server, SERVER_REPL_POS *pos);
+extern int server_estimate_rlag(SERVER *slave, SERVER *master);
+extern void server_publish_state(SERVER *server);
+extern int server_warmup_weight(const SERVER *server, int weight);
+extern const SERVER_STATE *server_state_acquire(SERVER *server);
+extern void server_state_release(const SERVER_STATE *state);
 
 #endif
@@ -24,6 +24,8 @@
 #include <resultset.h>
 #include <maxconfig.h>
 #include <queuemanager.h>
+#include <query_trace.h>
+#include <profile.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -57,6 +59,7 @@ struct server;
 struct router;
 struct router_object;
 struct users;
+struct metrics;
 
 /**
  * The service statistics structure
@@ -67,8 +70,22 @@ typedef struct
     int    n_failed_starts; /**< Number of times this service has failed to start */
     int    n_sessions;      /**< Number of sessions created on service since start */
     int    n_current;       /**< Current number of sessions */
+    int64_t mem_used;       /**< Bytes of memory held by the current sessions */
 } SERVICE_STATS;
 
+/**
+ * The counters of SERVICE_STATS that change with every session. Each thread
+ * changes its own copy of them and the sums are published to SERVICE_STATS
+ * every few milliseconds.
+ */
+typedef struct
+{
+    ts_gauge_t n_sessions; /**< Sharded n_sessions */
+    ts_gauge_t n_current;  /**< Sharded n_current */
+    ts_gauge_t mem_used;   /**< Sharded mem_used */
+    uint64_t   published;  /**< When the sums were last published */
+} SERVICE_SHARDS;
+
 /**
  * The service user structure holds the information that is needed
  for this service to allow the gateway to login to the backend
@@ -89,6 +106,7 @@ typedef struct
 {
     int nloads;
     time_t last;
+    int pending;  /**< A background reload has been queued */
 } SERVICE_REFRESH_RATE;
 
 typedef struct server_ref_t
@@ -108,6 +126,9 @@ typedef struct server_ref_t
  */
 #define SERVICE_PARAM_UNINIT -1
 
+/** Payloads shorter than this are sent to the clients without compressing them */
+#define SERVICE_COMPRESSION_MIN_LEN_DEFAULT 50
+
 /**
  * Defines a service within the gateway.
  *
@@ -134,6 +155,9 @@ typedef struct service
     SERVICE_USER credentials;          /**< The cedentials of the service user */
     SPINLOCK spin;                     /**< The service spinlock */
     SERVICE_STATS stats;               /**< The service statistics */
+    SERVICE_SHARDS shards;             /**< The per-thread counters behind stats */
+    ts_histogram_t latency[QTRACE_N_STAGES]; /**< Traced query latencies in microseconds */
+    PROFILE router_profile;            /**< Cost of the routeQuery entry point of the router */
     struct users *users;               /**< The user data for this service */
     int enable_root;                   /**< Allow root user  access */
     int localhost_match_wildcard_host; /**< Match localhost against wildcard */
@@ -150,6 +174,12 @@ typedef struct service
     FILTER_DEF **filters;              /**< Ordered list of filters */
     int n_filters;                     /**< Number of filters */
     long conn_idle_timeout;            /**< Session timeout in seconds */
+    int slow_query_threshold;          /**< Queries this slow in milliseconds are sampled, 0 if none */
+    int sched_class;                   /**< Scheduling class of the events of the service */
+    int sched_weight;                  /**< Events the service may process in its turn */
+    bool client_compression;           /**< Offer the compressed protocol to the clients */
+    int client_compression_level;      /**< The zlib level of the compression for the clients */
+    int client_compression_min_len;    /**< The shortest payload compressed for the clients */
     char *weightby;
     struct service *next;              /**< The next service in the linked list */
     bool retry_start;                  /*< If starting of the service should be retried later */
@@ -194,6 +224,10 @@ extern int serviceSetSSLVerifyDepth(SERVICE* service, int depth);
 extern void serviceSetCertificates(SERVICE *service, char* cert, char* key, char* ca_cert);
 extern int serviceEnableRootUser(SERVICE *, int );
 extern int serviceSetTimeout(SERVICE *, int );
+extern int serviceSetSlowQueryThreshold(SERVICE *, int);
+extern int serviceSetSchedulingWeight(SERVICE *, int);
+extern int serviceSetClientCompression(SERVICE *, bool, int, int);
+extern bool service_is_admin(SERVICE *service);
 extern int serviceSetConnectionLimits(SERVICE *, int, int, int);
 extern void serviceSetRetryOnFailure(SERVICE *service, char* value);
 extern void serviceWeightBy(SERVICE *, char *);
@@ -203,6 +237,7 @@ extern int serviceStripDbEsc(SERVICE* service, int action);
 extern int serviceAuthAllServers(SERVICE *service, int action);
 extern void service_update(SERVICE *, char *, char *, char *);
 extern int service_refresh_users(SERVICE *);
+extern void service_refresh_users_async(SERVICE *);
 extern void printService(SERVICE *);
 extern void printAllServices();
 extern void dprintAllServices(DCB *);
@@ -213,12 +248,19 @@ extern bool service_set_param_value(SERVICE*            service,
                                     config_param_type_t type);
 extern void dprintService(DCB *, SERVICE *);
 extern void dListServices(DCB *);
+extern void dListServiceLatency(DCB *);
 extern void dListListeners(DCB *);
 extern char* service_get_name(SERVICE* svc);
 extern void service_shutdown();
 extern int serviceSessionCountAll();
+extern void service_add_session(SERVICE *);
+extern void service_remove_session(SERVICE *);
+extern void service_mem_add(SERVICE *, int64_t);
+extern void service_publish_stats(SERVICE *);
 extern RESULTSET *serviceGetList();
 extern RESULTSET *serviceGetListenerList();
+extern RESULTSET *serviceLatencyGetList();
+extern void serviceWriteMetrics(struct metrics *);
 extern bool service_all_services_have_listeners();
 
 #endif
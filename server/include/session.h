@@ -39,6 +39,7 @@
 #include <resultset.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <query_trace.h>
 
 struct dcb;
 struct service;
@@ -90,15 +91,32 @@ typedef struct
 
 /**
  * Structure used to track the filter instances and sessions of the filters
- * that are in use within a session.
+ * that are in use within a session. The session of a filter that handles
+ * only some commands is NULL until the first of them arrives.
  */
 typedef struct
 {
     struct filter_def *filter;
     void *instance;
     void *session;
+    DOWNSTREAM down;  /*< The filter, called through the profiling element */
+    UPSTREAM up;      /*< The filter, called through the profiling element */
 } SESSION_FILTER;
 
+/**
+ * A block of the memory of a session. The memory returned by
+ * session_arena_alloc lives until the session is reused for a new client,
+ * when the blocks are taken back all at once: the first block stays with
+ * the session and the others go to a cache of the calling thread.
+ */
+typedef struct session_arena_block
+{
+    struct session_arena_block *next;
+    size_t          size;             /*< Size of the data */
+    size_t          used;             /*< Bytes of the data handed out */
+    char            data[] __attribute__((aligned(16)));
+} SESSION_ARENA_BLOCK;
+
 /**
  * Filter type for the sessionGetList call
  */
@@ -128,36 +146,49 @@ typedef struct session
     struct dcb      *client_dcb;      /*< The client connection */
     void            *router_session;  /*< The router instance data */
     SESSION_STATS   stats;            /*< Session statistics */
+    QUERY_TRACE     trace;            /*< The sampled query being traced */
     struct service  *service;         /*< The service this session is using */
     int             n_filters;        /*< Number of filter sessions */
     SESSION_FILTER  *filters;         /*< The filters in use within this session */
     DOWNSTREAM      head;             /*< Head of the filter chain */
     UPSTREAM        tail;             /*< The tail of the filter chain */
+    DOWNSTREAM      router_head;      /*< The element behind the filters */
+    UPSTREAM        filter_tail;      /*< Tail of the filters when statements may skip them */
+    uint64_t        filter_commands;  /*< Commands handled by a filter of the session */
+    uint64_t        lazy_commands;    /*< Commands whose filters have no session yet */
+    bool            filter_bypass;    /*< Some statements skip the filters */
+    bool            bypassed;         /*< The last statement skipped the filters */
     struct session  *next;            /*< Linked list of all sessions */
+    struct session  *nextfree;        /*< Free list of unused sessions */
+    int             epoch;            /*< RCU epoch when the session was freed */
+    struct dcb      *throttled;       /*< Backend DCBs waiting for the client to catch up */
     int             refcount;         /*< Reference count on the session */
+    SESSION_ARENA_BLOCK *arena;       /*< Memory that lives as long as the session */
+    SPINLOCK        arena_lock;       /*< Protects the arena */
+    int64_t         mem_used;         /*< Bytes of buffers, history and filter state held */
     bool            ses_is_child;     /*< this is a child session */
+    struct alloc_sample *sample;      /*< Allocation profiler sample, NULL if not sampled */
 #if defined(SS_DEBUG)
     skygw_chk_t     ses_chk_tail;
 #endif
 } SESSION;
 
-/** Whether to do session timeout checks */
-extern bool check_timeouts;
-
-/** When the next timeout check is done. This is compared to hkheartbeat in
- * hk_heartbeat.h */
-extern long next_timeout_check;
-
 #define SESSION_PROTOCOL(x, type)       DCB_PROTOCOL((x)->client_dcb, type)
 
+/** Whether the routed statements are noted for the event watchdog */
+extern bool session_watch_queries;
+
 /**
  * A convenience macro that can be used by the protocol modules to route
  * the incoming data to the first element in the pipeline of filters and
- * routers.
+ * routers. If query tracing is enabled, the query may be traced. Statements
+ * that no filter of the session handles are routed to the router.
  */
-#define SESSION_ROUTE_QUERY(sess, buf)                          \
-    ((sess)->head.routeQuery)((sess)->head.instance,            \
-                              (sess)->head.session, (buf))
+#define SESSION_ROUTE_QUERY(sess, buf)                                  \
+    (qtrace_enabled() || session_watch_queries || (sess)->filter_bypass ? \
+     session_route_traced((sess), (buf)) :                              \
+     ((sess)->head.routeQuery)((sess)->head.instance,                   \
+                               (sess)->head.session, (buf)))
 /**
  * A convenience macro that can be used by the router modules to route
  * the replies to the first element in the pipeline of filters and
@@ -173,6 +204,7 @@ SESSION *session_set_dummy(struct dcb *);
 bool session_free(SESSION *);
 int session_isvalid(SESSION *);
 int session_reply(void *inst, void *session, GWBUF *data);
+int session_route_traced(SESSION *session, GWBUF *data);
 char *session_get_remote(SESSION *);
 char *session_getUser(SESSION *);
 void printAllSessions();
@@ -185,7 +217,8 @@ bool session_link_dcb(SESSION *, struct dcb *);
 SESSION* get_session_by_router_ses(void* rses);
 void session_enable_log_priority(SESSION* ses, int priority);
 void session_disable_log_priority(SESSION* ses, int priority);
+void *session_arena_alloc(SESSION *session, size_t size);
+char *session_arena_strdup(SESSION *session, const char *str);
+void session_mem_add(SESSION *session, int64_t delta);
 RESULTSET *sessionGetList(SESSIONLISTFILTER);
-void process_idle_sessions();
-void enable_session_timeouts();
 #endif
@@ -0,0 +1,112 @@
+#ifndef _SLOWLOG_H
+#define _SLOWLOG_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file slowlog.h - Sampling of slow queries
+ *
+ * The routers note when they route a query and check the time when the first
+ * reply of the server arrives. Queries slower than the threshold of their
+ * service are copied to a fixed-size ring that is shared by all services.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <buffer.h>
+#include <resultset.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+/** Bytes of each query that are kept */
+#define SLOWLOG_SQL_LEN 1024
+
+/** Length of the service and server names that are kept */
+#define SLOWLOG_NAME_LEN 64
+
+/** Number of slow queries in the ring, a power of two */
+#define SLOWLOG_SIZE 256
+
+/** A slow query in the ring */
+typedef struct
+{
+    int      seq;                       /*< Odd while the entry is written, 0 if unused */
+    time_t   timestamp;                 /*< When the query was completed */
+    uint64_t hash;                      /*< Fingerprint of the canonical form of the query */
+    int64_t  duration;                  /*< Time to the first reply in microseconds */
+    char     service[SLOWLOG_NAME_LEN]; /*< The service of the query */
+    char     server[SLOWLOG_NAME_LEN];  /*< The server the query was routed to */
+    int      sql_len;                   /*< Length of sql */
+    char     sql[SLOWLOG_SQL_LEN + 1];  /*< The start of the query, null terminated */
+} SLOWLOG_ENTRY;
+
+/** The query of a router session that is being timed */
+typedef struct
+{
+    uint64_t start; /*< When the query was routed, 0 if no query is timed */
+    int      len;   /*< Length of sql */
+    char     *sql;  /*< The start of the query, allocated on first use */
+} SLOWLOG_QUERY;
+
+struct dcb;
+
+void slowlog_note(SLOWLOG_QUERY *query, GWBUF *buffer);
+void slowlog_check(SLOWLOG_QUERY *query, int threshold, const char *service, const char *server);
+void slowlog_query_free(SLOWLOG_QUERY *query);
+int slowlog_count();
+bool slowlog_get(int index, SLOWLOG_ENTRY *entry);
+void dShowSlowQueries(struct dcb *dcb);
+RESULTSET *slowlogGetList();
+
+/**
+ * Start timing a query routed by a router
+ *
+ * Only COM_QUERY packets are timed. Nothing is done if the service has no
+ * slow query threshold.
+ *
+ * @param query     The timed query of the router session
+ * @param threshold The slow query threshold of the service in milliseconds
+ * @param buffer    The query
+ */
+static inline void slowlog_start(SLOWLOG_QUERY *query, int threshold, GWBUF *buffer)
+{
+    if (threshold > 0)
+    {
+        slowlog_note(query, buffer);
+    }
+}
+
+/**
+ * Stop timing a query when the first reply arrives
+ *
+ * The query is added to the ring if it was slower than the threshold.
+ *
+ * @param query     The timed query of the router session
+ * @param threshold The slow query threshold of the service in milliseconds
+ * @param service   Name of the service
+ * @param server    Name of the server that replied
+ */
+static inline void slowlog_end(SLOWLOG_QUERY *query, int threshold,
+                               const char *service, const char *server)
+{
+    if (query->start)
+    {
+        slowlog_check(query, threshold, service, server);
+    }
+}
+
+EXTERN_C_BLOCK_END
+
+#endif
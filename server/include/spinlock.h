@@ -18,13 +18,18 @@
  *
  * Spinlock implementation for MaxScale.
  *
- * Spinlocks are cheap locks that can be used to protect short code blocks, they are
- * generally wasteful as any blocked threads will spin, consuming CPU cycles, waiting
- * for the lock to be released. However they are useful in that they do not involve
- * system calls and are light weight when the expected wait time for a lock is low.
+ * Spinlocks are cheap locks that can be used to protect short code blocks. They do
+ * not involve system calls and are light weight when the expected wait time for a
+ * lock is low. A thread that fails to get the lock spins for a while with an
+ * exponential backoff and then sleeps on a futex, so a lock holder that has been
+ * preempted does not make the waiting threads burn their timeslices.
+ *
+ * Every place that acquires a lock is a lock site with counters of its own. The
+ * counters are updated while the lock is held and are always enabled.
  */
 #include <thread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define SPINLOCK_PROFILE 0
 
@@ -40,7 +45,7 @@
  */
 typedef struct spinlock
 {
-    int lock;         /*< Is the lock held? */
+    int lock;         /*< 0 if free, 1 if held, 2 if held and there may be sleeping waiters */
 #if SPINLOCK_PROFILE
     int spins;        /*< Number of spins on this lock */
     int maxspins;     /*< Max no of spins to acquire lock */
@@ -67,10 +72,41 @@ typedef struct spinlock
 
 #define SPINLOCK_IS_LOCKED(l) ((l)->lock != 0 ? true : false)
 
+/**
+ * The counters of a place in the code that acquires a lock. The acquire and
+ * contended counts are updated while the lock is held, so they are exact for
+ * a site that always takes the same lock and may miss some updates if a site
+ * takes several locks at the same time.
+ */
+typedef struct spinlock_site
+{
+    const char              *file;      /*< The source file of the site */
+    int                     line;       /*< The line of the site */
+    int                     registered; /*< Whether the site is in the list of sites */
+    uint64_t                acquired;   /*< No. of times the lock was acquired */
+    uint64_t                contended;  /*< No. of acquires that had to wait */
+    uint64_t                parked;     /*< No. of acquires that slept on the lock */
+    uint64_t                cycles;     /*< Total CPU cycles spent waiting */
+    struct spinlock_site    *next;      /*< The next registered site */
+} SPINLOCK_SITE;
+
+#define SPINLOCK_SITE_INIT { __FILE__, __LINE__, 0, 0, 0, 0, 0, NULL }
+
+/**
+ * Acquire a spinlock, counting the acquire for the calling site.
+ */
+#define spinlock_acquire(l) \
+    do \
+    { \
+        static SPINLOCK_SITE spinlock_site__ = SPINLOCK_SITE_INIT; \
+        spinlock_acquire_at((l), &spinlock_site__); \
+    } while (0)
+
 extern void spinlock_init(SPINLOCK *lock);
-extern void spinlock_acquire(SPINLOCK *lock);
+extern void spinlock_acquire_at(SPINLOCK *lock, SPINLOCK_SITE *site);
 extern int spinlock_acquire_nowait(SPINLOCK *lock);
 extern void spinlock_release(SPINLOCK *lock);
 extern void spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl);
+extern void spinlock_sites(void (*reporter)(void *, SPINLOCK_SITE *), void *hdl);
 
 #endif
@@ -24,8 +24,36 @@
  * @endverbatim
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+/** The size of a cache line, each thread's value is on a line of its own */
+#define TS_STATS_CACHE_LINE 64
+
+/** A counter that each thread increments */
 typedef void* ts_stats_t;
 
+/** A value that goes up and down, e.g. the number of current connections */
+typedef void* ts_gauge_t;
+
+/** A histogram with a fixed number of buckets, e.g. for latencies */
+typedef void* ts_histogram_t;
+
+/** Sub-buckets per power of two in a log-linear histogram */
+#define TS_LOG_SUB_BUCKETS 8
+
+/** Number of buckets in a log-linear histogram of values below 2^32 */
+#define TS_LOG_BUCKETS ((32 - 2) * TS_LOG_SUB_BUCKETS)
+
+/**
+ * Counters that are read by the routers are sharded and their sums are
+ * published to a plain integer at most this often, in nanoseconds
+ */
+#define TS_PUBLISH_INTERVAL_NS 1000000
+
 /** stats_init should be called only once */
 void ts_stats_init();
 
@@ -37,8 +65,31 @@ void ts_stats_set_thread_id(int id);
 
 ts_stats_t ts_stats_alloc();
 void ts_stats_free(ts_stats_t stats);
-void ts_stats_add(ts_stats_t stats, int value);
-void ts_stats_set(ts_stats_t stats, int value);
-int ts_stats_sum(ts_stats_t stats);
+void ts_stats_add(ts_stats_t stats, int64_t value);
+void ts_stats_set(ts_stats_t stats, int64_t value);
+void ts_stats_set_max(ts_stats_t stats, int64_t value);
+int64_t ts_stats_sum(ts_stats_t stats);
+int64_t ts_stats_max(ts_stats_t stats);
+int64_t ts_stats_get(ts_stats_t stats, int thread);
+
+ts_gauge_t ts_gauge_alloc();
+void ts_gauge_free(ts_gauge_t gauge);
+void ts_gauge_add(ts_gauge_t gauge, int64_t delta);
+int64_t ts_gauge_get(ts_gauge_t gauge);
+
+ts_histogram_t ts_histogram_alloc(int n_buckets);
+void ts_histogram_free(ts_histogram_t histogram);
+void ts_histogram_add(ts_histogram_t histogram, int64_t value);
+int64_t ts_histogram_bucket(ts_histogram_t histogram, int bucket);
+
+ts_histogram_t ts_histogram_alloc_log();
+int64_t ts_histogram_count(ts_histogram_t histogram);
+int64_t ts_histogram_percentile(ts_histogram_t histogram, double percentile);
+int ts_log_bucket(int64_t value);
+int64_t ts_log_bucket_limit(int bucket);
+
+bool ts_publish_due(uint64_t *published);
+
+EXTERN_C_BLOCK_END
 
 #endif
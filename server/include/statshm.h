@@ -0,0 +1,131 @@
+#ifndef _STATSHM_H
+#define _STATSHM_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file statshm.h  The statistics published in a shared memory segment
+ *
+ * The housekeeper periodically writes the metrics of the servers, services,
+ * filters and polling threads into a POSIX shared memory segment, so that
+ * local agents can read them at any rate without connecting to MaxScale.
+ *
+ * The segment starts with a STATSHM_HEADER followed by the data. The header
+ * is protected by a sequence lock: the sequence number is odd while the data
+ * is being written, and a reader that sees the same even number before and
+ * after copying the data has a consistent copy. The segment grows when the
+ * data does not fit and the size in the header tells a reader to map it again.
+ *
+ * This header is also the reader library, it depends on nothing else.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+/** The first bytes of a statistics segment */
+#define STATSHM_MAGIC 0x4d585353
+
+/** The data is the metrics in the OpenMetrics text format */
+#define STATSHM_VERSION 1
+
+/** The name of the segment if none is configured, /dev/shm/maxscale-stats on Linux */
+#define STATSHM_DEFAULT_NAME "/maxscale-stats"
+
+/** The return values of statshm_read */
+#define STATSHM_OK      0   /*< The data was copied */
+#define STATSHM_RETRY   1   /*< The segment must be mapped again or the buffer is too small */
+#define STATSHM_BUSY    2   /*< The data kept changing while it was copied */
+#define STATSHM_INVALID 3   /*< The memory is not a statistics segment of this version */
+
+/** How many times a reader tries to copy the data before giving up */
+#define STATSHM_READ_ATTEMPTS 100
+
+/**
+ * The header of the statistics segment
+ */
+typedef struct statshm_header
+{
+    uint32_t magic;     /*< STATSHM_MAGIC */
+    uint32_t version;   /*< STATSHM_VERSION, the format of the data */
+    uint64_t seq;       /*< Odd while the data is being written */
+    uint64_t size;      /*< Size of the segment in bytes */
+    uint64_t length;    /*< Length of the data in bytes */
+    uint64_t timestamp; /*< When the data was written, in milliseconds since the epoch */
+    uint64_t pid;       /*< The process that writes the segment */
+} STATSHM_HEADER;
+
+/** The data that follows the header */
+#define STATSHM_DATA(hdr) ((char *)(hdr) + sizeof(STATSHM_HEADER))
+
+extern bool statshm_init(const char *name, int interval);
+extern bool statshm_write(const char *data, size_t length);
+extern void statshm_close();
+
+/**
+ * Copy the data of a mapped statistics segment
+ *
+ * @param hdr     The start of the mapping
+ * @param mapped  Number of bytes mapped
+ * @param buf     Where the data is copied
+ * @param size    Size of buf
+ * @param length  Set to the length of the data, and for STATSHM_RETRY to the
+ *                size of the buffer that is needed
+ * @return STATSHM_OK if buf holds a consistent copy of the data, STATSHM_RETRY
+ * if hdr->size is larger than mapped or the data is longer than size, or
+ * STATSHM_BUSY or STATSHM_INVALID
+ */
+static inline int
+statshm_read(const STATSHM_HEADER *hdr, size_t mapped, char *buf, size_t size, size_t *length)
+{
+    const volatile STATSHM_HEADER *vhdr = hdr;
+
+    if (mapped < sizeof(STATSHM_HEADER) ||
+        vhdr->magic != STATSHM_MAGIC || vhdr->version != STATSHM_VERSION)
+    {
+        return STATSHM_INVALID;
+    }
+
+    for (int i = 0; i < STATSHM_READ_ATTEMPTS; i++)
+    {
+        uint64_t seq = vhdr->seq;
+
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+
+        uint64_t len = vhdr->length;
+        bool fits = len <= size && sizeof(STATSHM_HEADER) + len <= mapped;
+
+        if (fits)
+        {
+            memcpy(buf, STATSHM_DATA(hdr), len);
+        }
+        __sync_synchronize();
+
+        if (vhdr->seq == seq)
+        {
+            *length = len;
+            return fits ? STATSHM_OK : STATSHM_RETRY;
+        }
+    }
+
+    return STATSHM_BUSY;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _STRHASH_H
+#define _STRHASH_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file strhash.h An open addressing hashtable for string keys
+ *
+ * The table keeps the hash and the first bytes of each key in its slot
+ * array, so a lookup usually touches a single cache line. Collisions are
+ * resolved with Robin Hood probing and deletions shift the following slots
+ * back, which keeps the probe sequences short without tombstones.
+ *
+ * The table does no locking of its own. It can be read concurrently as long
+ * as nobody modifies it, otherwise the caller must serialise the access.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <hashtable.h>
+
+/** The number of key bytes stored in a slot */
+#define STRHASH_PREFIX_LEN 8
+
+/**
+ * A slot of the table, two slots fit in a cache line.
+ */
+typedef struct strhash_slot
+{
+    uint32_t hash;                      /**< The hash of the key */
+    uint32_t dist;                      /**< Distance from the home slot plus one, 0 if empty */
+    char     prefix[STRHASH_PREFIX_LEN];/**< The start of the key, NUL padded */
+    char     *key;                      /**< The copy of the key */
+    void     *value;                    /**< The value */
+} STRHASH_SLOT;
+
+/**
+ * The open addressing hashtable.
+ */
+typedef struct strhash
+{
+    STRHASH_SLOT *slots;        /**< The slot array, the size is a power of two */
+    uint32_t     mask;          /**< The number of slots minus one */
+    int          n_elements;    /**< Number of added elements */
+    HASHMEMORYFN vfreefn;       /**< Optional value free function */
+} STRHASH;
+
+extern STRHASH *strhash_alloc(int size, HASHMEMORYFN vfreefn); /**< Allocate a table */
+extern void strhash_free(STRHASH *table);                      /**< Free a table */
+extern int strhash_add(STRHASH *table, const char *key, void *value); /**< Add an entry */
+extern int strhash_delete(STRHASH *table, const char *key);    /**< Delete an entry */
+extern void *strhash_fetch(const STRHASH *table, const char *key);
+/**< Fetch the data for a given key */
+extern int strhash_size(const STRHASH *table);                 /**< Number of elements */
+
+#endif
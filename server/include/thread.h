@@ -31,6 +31,7 @@
 
 extern THREAD *thread_start(THREAD *thd, void (*entry)(void *), void *arg);
 extern void thread_wait(THREAD thd);
+extern void thread_detach(THREAD thd);
 extern void thread_millisleep(int ms);
 
 #endif
@@ -0,0 +1,69 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timerwheel.h  Hierarchical timer wheels of the polling threads
+ *
+ * Each polling thread has a timer wheel of its own. The expiry times are
+ * given in the ticks of the housekeeper heartbeat, hkheartbeat, which is
+ * incremented every 100 milliseconds. Adding and removing a timer are
+ * constant time operations and only the timers that expire are touched
+ * when the wheel is turned.
+ *
+ * Wheels that are not owned by a polling thread, such as the one of the
+ * housekeeper, are allocated with timerwheel_alloc() and turned with
+ * timerwheel_turn().
+ */
+
+#include <stdbool.h>
+#include <hk_heartbeat.h>
+
+typedef struct timer_wheel TIMER_WHEEL;
+
+/**
+ * A timer in a timer wheel. The structure is embedded in the object that the
+ * timer is for, a zeroed timer is not scheduled.
+ */
+typedef struct wheel_timer
+{
+    struct wheel_timer  *next;      /*< Next timer in the same slot */
+    struct wheel_timer  **pprev;    /*< The link to this timer, NULL if not scheduled */
+    long                expires;    /*< The heartbeat when the timer expires */
+    TIMER_WHEEL         *wheel;     /*< The wheel the timer is in */
+    void                (*expire)(struct wheel_timer *); /*< Called when the timer expires */
+} WHEEL_TIMER;
+
+extern void timerwheel_init(int n_wheels);
+extern void timerwheel_add(WHEEL_TIMER *timer, int wheel, long expires,
+                           void (*expire)(WHEEL_TIMER *));
+extern void timerwheel_remove(WHEEL_TIMER *timer);
+extern void timerwheel_process(int wheel);
+extern void timerwheel_set_active(int n_wheels);
+extern void timerwheel_set_dedicated(int wheel);
+extern void timerwheel_move(int from, int to);
+
+extern TIMER_WHEEL *timerwheel_alloc(void);
+extern void timerwheel_free(TIMER_WHEEL *wheel);
+extern void timerwheel_schedule(TIMER_WHEEL *wheel, WHEEL_TIMER *timer, long expires,
+                                void (*expire)(WHEEL_TIMER *));
+extern void timerwheel_turn(TIMER_WHEEL *wheel);
+
+/**
+ * Check whether a timer is scheduled. This is a dirty read unless it is
+ * done by the thread that owns the wheel.
+ */
+#define TIMERWHEEL_PENDING(t)   ((t)->pprev != NULL)
+
+#endif
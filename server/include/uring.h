@@ -0,0 +1,42 @@
+#ifndef _URING_H
+#define _URING_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file uring.h - A minimal io_uring submission and completion ring
+ *
+ * The ring is used by one thread only. Operations are queued with
+ * uring_writev, handed to the kernel in one system call with uring_submit
+ * and their results are read with uring_reap.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+typedef struct uring URING;
+
+URING *uring_create(unsigned entries);
+void uring_free(URING *ring);
+bool uring_writev(URING *ring, int fd, const struct iovec *iov, int n_iov, uint64_t user_data);
+int uring_submit(URING *ring, unsigned wait_nr);
+unsigned uring_discard(URING *ring, uint64_t *user_data, unsigned max);
+bool uring_reap(URING *ring, uint64_t *user_data, int *res);
+
+EXTERN_C_BLOCK_END
+
+#endif
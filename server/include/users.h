@@ -52,6 +52,10 @@ typedef struct
 typedef struct users
 {
     HASHTABLE *data;                        /**< The hashtable containing the actual data */
+    HASHTABLE *index;                       /**< Optional index of the data by user name */
+    HASHTABLE *lookups;                     /**< Optional cache of resolved client lookups */
+    HASHTABLE *digests;                     /**< Optional row digests by user name prefix */
+    int generation;                         /**< Incremented when the data is updated in place */
     char *(*usersCustomUserFormat)(void *); /**< Optional username format routine */
     USERS_STATS stats;                      /**< The statistics for the users table */
     unsigned char cksum[SHA_DIGEST_LENGTH]; /**< The users' table ckecksum */
@@ -172,10 +172,21 @@ mysql_auth_authenticate(DCB *dcb)
 
         /* On failed authentication try to load user table from backend database */
         /* Success for service_refresh_users returns 0 */
-        if (MYSQL_AUTH_SUCCEEDED != auth_ret && 0 == service_refresh_users(dcb->service))
+        if (MYSQL_AUTH_SUCCEEDED != auth_ret)
         {
-            auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len, protocol,
-                                           client_data->user, client_data->client_sha1, client_data->db);
+            if (0 == service_refresh_users(dcb->service))
+            {
+                auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len,
+                                               protocol, client_data->user, client_data->client_sha1,
+                                               client_data->db);
+            }
+            else
+            {
+                /* Another thread is reloading the users or the rate limit was
+                 * hit by a storm of failing clients. Don't wait, reload the
+                 * users in the background once the limit allows it. */
+                service_refresh_users_async(dcb->service);
+            }
         }
 
         /* on successful authentication, set user into dcb field */
@@ -429,6 +440,7 @@ mysql_auth_is_client_ssl_capable(DCB *dcb)
 int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password, DCB *dcb)
 {
     SERVICE *service = NULL;
+    USERS *users = NULL;
     struct sockaddr_in *client;
     char *user_password = NULL;
     MYSQL_USER_HOST key;
@@ -437,6 +449,8 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
     client_data = (MYSQL_session *) dcb->data;
     service = (SERVICE *) dcb->service;
     client = (struct sockaddr_in *) &dcb->ipv4;
+    /* The same table is used for the whole lookup even if it is replaced */
+    users = service->users;
 
     key.user = username;
     memcpy(&key.ipv4, client, sizeof(struct sockaddr_in));
@@ -446,6 +460,10 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
     {
         strcpy(key.hostname, dcb->remote);
     }
+    else
+    {
+        key.hostname[0] = '\0';
+    }
 
     MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s]%s%s",
               pthread_self(),
@@ -454,101 +472,41 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
               key.resource != NULL ? " db: " : "",
               key.resource != NULL ? key.resource : "");
 
-    /* look for user@current_ipv4 now */
-    user_password = mysql_users_fetch(service->users, &key);
-
-    if (!user_password)
+    /* Localhost only matches the wildcard hosts if it is allowed */
+    bool wildcard = key.ipv4.sin_addr.s_addr != 0x0100007F ||
+                    service->localhost_match_wildcard_host;
+
+    /* Reconnecting clients reuse the result of the previous lookup */
+    size_t userlen = strlen(username);
+    char lookup[INET_ADDRSTRLEN + userlen + (key.resource ? strlen(key.resource) : 0) + 24];
+    char addr[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &client->sin_addr, addr, sizeof(addr));
+    sprintf(lookup, "%s %lu %s%s", addr, (unsigned long) userlen, username,
+            key.resource ? key.resource : "");
+    int generation;
+    bool cached = mysql_users_lookup_fetch(users, lookup, &user_password, &generation);
+
+    if (cached)
     {
-        /* The user is not authenticated @ current IPv4 */
-
-        while (1)
-        {
-            /*
-             * (1) Check for localhost first: 127.0.0.1 (IPv4 only)
-             */
-
-            if ((key.ipv4.sin_addr.s_addr == 0x0100007F) &&
-                !dcb->service->localhost_match_wildcard_host)
-            {
-                /* Skip the wildcard check and return 1 */
-                break;
-            }
-
-            /*
-             * (2) check for possible IPv4 class C,B,A networks
-             */
-
-            /* Class C check */
-            key.ipv4.sin_addr.s_addr &= 0x00FFFFFF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /* Class B check */
-            key.ipv4.sin_addr.s_addr &= 0x0000FFFF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /* Class A check */
-            key.ipv4.sin_addr.s_addr &= 0x000000FF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /*
-             * (3) Continue check for wildcard host, user@%
-             */
-
-            memset(&key.ipv4, 0, sizeof(struct sockaddr_in));
-            key.netmask = 0;
-
-            MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s] with "
-                      "wildcard host [%%]",
-                      pthread_self(),
-                      key.user,
-                      dcb->remote);
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            if (!user_password)
-            {
-                /*
-                 * user@% not found.
-                 */
-
-                MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
-                          pthread_self(),
-                          key.user,
-                          dcb->remote);
-
-                MXS_INFO("Authentication Failed: user [%s@%s] not found.",
-                         key.user,
-                         dcb->remote);
-                break;
-            }
+        MXS_DEBUG("%lu [MySQL Client Auth], using cached lookup for user [%s@%s]",
+                  pthread_self(), key.user, dcb->remote);
+    }
+    /* look for the most specific grant that matches user@current_ipv4 */
+    else if (!(user_password = mysql_users_find(users, &key, wildcard)))
+    {
+        MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
+                  pthread_self(),
+                  key.user,
+                  dcb->remote);
+
+        MXS_INFO("Authentication Failed: user [%s@%s] not found.",
+                 key.user,
+                 dcb->remote);
+    }
 
-        }
+    if (!cached)
+    {
+        mysql_users_lookup_add(users, lookup, user_password, generation);
     }
 
     /* If user@host has been found we get the the password in binary format*/
@@ -0,0 +1,1332 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file cachefilter.c - A result set cache
+ *
+ * The filter caches the result sets of SELECT statements and returns them to
+ * the client without sending the statement to the backend servers.
+ *
+ * The result sets are keyed by the SQL text, the current database and the
+ * user. Only statements that the query classifier considers pure reads and
+ * that do not call functions whose result changes between calls are cached.
+ * The called functions are reported by the query classifier, nothing is
+ * cached if it does not report them.
+ * Nothing is cached or returned from the cache inside a transaction.
+ *
+ * A cached result set is valid for a time-to-live. It is invalidated earlier
+ * if a statement that modifies one of its tables passes through the filter.
+ * Each table has a generation counter that such statements increment and the
+ * cached result sets remember the generations of their tables. Writes whose
+ * tables are not known, e.g. stored procedure calls, increment a global
+ * generation which invalidates all result sets. The prepared statements are
+ * classified when they are prepared and only executing a statement that
+ * modifies data invalidates its tables.
+ *
+ * The generations are kept in the filter instance. Changes made through other
+ * services, other MaxScale instances or directly on the servers are not seen
+ * by the filter and the result sets they make stale are returned until their
+ * time-to-live expires.
+ *
+ * The cache is split into shards, each with its own lock, hashtable and least
+ * recently used list. The memory used by the result sets is bounded and the
+ * least recently used result sets are evicted first. A cached result set is
+ * a single buffer that is shared, not copied, when it is returned to a client.
+ *
+ * @verbatim
+ * The parameters for this filter are:
+ *
+ *      ttl                 How long result sets are kept, in seconds
+ *      max_size            Total size of the cached result sets in bytes
+ *      max_resultset_size  Size of the largest result set that is cached
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <strhash.h>
+#include <log_manager.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_EXPERIMENTAL,
+    FILTER_VERSION,
+    "A result set cache"
+};
+
+static char *version_str = "V1.0.0";
+
+/** Number of shards in the cache */
+#define CACHE_SHARDS 16
+/** Default time-to-live of a result set in seconds */
+#define CACHE_DEFAULT_TTL 10
+/** Default total size of the cache in bytes */
+#define CACHE_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+/** Default size of the largest cached result set in bytes */
+#define CACHE_DEFAULT_MAX_RESULTSET_SIZE (1024 * 1024)
+/** Longest statement that is cached */
+#define CACHE_MAX_SQL_LEN 16384
+
+static FILTER *createInstance(char **options, FILTER_PARAMETER **params);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/**
+ * The generations of the tables that a result set was read from
+ */
+typedef struct cache_tables
+{
+    int n_tables;
+    int **counters; /*< The generation counters of the tables */
+    int *generations; /*< The values of the counters when the statement was routed */
+    int global; /*< The global generation when the statement was routed */
+} CACHE_TABLES;
+
+/**
+ * A cached result set
+ */
+typedef struct cache_entry
+{
+    char *key; /*< The user, the database and the SQL */
+    GWBUF *data; /*< The result set as one buffer */
+    size_t size; /*< Memory used by the entry */
+    time_t created; /*< When the result set was stored */
+    CACHE_TABLES tables;
+    struct cache_entry *prev; /*< More recently used entry */
+    struct cache_entry *next; /*< Less recently used entry */
+} CACHE_ENTRY;
+
+/**
+ * A shard of the cache
+ */
+typedef struct cache_shard
+{
+    SPINLOCK lock;
+    STRHASH *entries; /*< The entries by key */
+    CACHE_ENTRY *head; /*< Most recently used entry */
+    CACHE_ENTRY *tail; /*< Least recently used entry */
+    size_t size; /*< Memory used by the entries */
+} CACHE_SHARD;
+
+/**
+ * A prepared statement of a session
+ */
+typedef struct cache_stmt
+{
+    uint32_t id; /*< The statement id the client uses */
+    GWBUF *prepare; /*< The COM_STMT_PREPARE if the statement modifies data */
+    bool write; /*< The statement modifies data */
+    struct cache_stmt *next;
+} CACHE_STMT;
+
+/**
+ * The instance structure
+ */
+typedef struct
+{
+    int ttl; /*< Time-to-live in seconds */
+    size_t max_size; /*< Maximum size of a shard */
+    size_t max_resultset_size; /*< Largest cached result set */
+    CACHE_SHARD shards[CACHE_SHARDS];
+    SPINLOCK lock; /*< Protects the table generations */
+    STRHASH *tables; /*< Generation counters by table name */
+    int generation; /*< The global generation */
+    int n_hits; /*< Statements answered from the cache */
+    int n_misses; /*< Cacheable statements sent to the servers */
+    int n_stored; /*< Result sets added to the cache */
+    int n_evicted; /*< Result sets evicted because the cache was full */
+    int n_expired; /*< Result sets removed because they were too old or stale */
+    int n_invalidations; /*< Writes that invalidated result sets */
+} CACHE_INSTANCE;
+
+/**
+ * The session structure
+ */
+typedef struct
+{
+    DOWNSTREAM down;
+    UPSTREAM up;
+    SESSION *session;
+    char db[MYSQL_DATABASE_MAXLEN + 1]; /*< The current database */
+    char pending_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Database of a routed USE */
+    bool db_pending; /*< Waiting for the reply of a USE */
+    bool autocommit; /*< Autocommit is enabled */
+    bool in_trx; /*< An explicit transaction is open */
+    bool trx_write; /*< The transaction has modified data */
+    char *key; /*< Key of the result set being collected */
+    CACHE_TABLES tables; /*< Tables of the result set being collected */
+    GWBUF *reply; /*< The result set being collected */
+    size_t reply_size;
+    int n_signals; /*< EOF and ERR packets in the reply */
+    MODUTIL_PACKET_SCAN scan;
+    CACHE_STMT *stmts; /*< The prepared statements */
+    CACHE_STMT *pending_stmt; /*< A routed COM_STMT_PREPARE waiting for its id */
+} CACHE_SESSION;
+
+/**
+ * Functions whose results change between calls, the results of statements
+ * calling them are not cached. The query classifier reports the names in
+ * lower case.
+ */
+static const char *nondeterministic[] =
+{
+    "now", "rand", "uuid", "uuid_short", "sysdate", "current_timestamp", "current_date",
+    "current_time", "curdate", "curtime", "unix_timestamp", "utc_timestamp", "utc_date",
+    "utc_time", "localtime", "localtimestamp", "connection_id", "last_insert_id",
+    "found_rows", "row_count", "user", "current_user", "session_user", "system_user",
+    "current_role", "get_lock", "release_lock", "is_free_lock", "is_used_lock", "sleep",
+    "benchmark", "master_pos_wait", "master_gtid_wait", "nextval", "lastval", "setval",
+    "load_file", NULL
+};
+
+/**
+ * Clauses that make a SELECT lock rows or ask not to be cached
+ */
+static const char *uncacheable_clauses[] =
+{
+    "for update", "lock in share mode", "sql_no_cache", NULL
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+static void* free_value(void* value)
+{
+    free(value);
+    return NULL;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    CACHE_INSTANCE *my_instance = calloc(1, sizeof(CACHE_INSTANCE));
+    size_t max_size = CACHE_DEFAULT_MAX_SIZE;
+    bool error = false;
+
+    if (my_instance == NULL)
+    {
+        return NULL;
+    }
+
+    my_instance->ttl = CACHE_DEFAULT_TTL;
+    my_instance->max_resultset_size = CACHE_DEFAULT_MAX_RESULTSET_SIZE;
+    spinlock_init(&my_instance->lock);
+
+    for (int i = 0; params && params[i]; i++)
+    {
+        if (!strcmp(params[i]->name, "ttl"))
+        {
+            if ((my_instance->ttl = atoi(params[i]->value)) <= 0)
+            {
+                MXS_ERROR("cachefilter: Invalid value for 'ttl': %s", params[i]->value);
+                error = true;
+            }
+        }
+        else if (!strcmp(params[i]->name, "max_size"))
+        {
+            long long value = atoll(params[i]->value);
+
+            if (value < CACHE_SHARDS)
+            {
+                MXS_ERROR("cachefilter: Invalid value for 'max_size': %s", params[i]->value);
+                error = true;
+            }
+            max_size = value;
+        }
+        else if (!strcmp(params[i]->name, "max_resultset_size"))
+        {
+            long long value = atoll(params[i]->value);
+
+            if (value <= 0)
+            {
+                MXS_ERROR("cachefilter: Invalid value for 'max_resultset_size': %s",
+                          params[i]->value);
+                error = true;
+            }
+            my_instance->max_resultset_size = value;
+        }
+        else if (!filter_standard_parameter(params[i]->name))
+        {
+            MXS_ERROR("cachefilter: Unexpected parameter '%s'.", params[i]->name);
+            error = true;
+        }
+    }
+
+    my_instance->max_size = max_size / CACHE_SHARDS;
+
+    if (!error && (my_instance->tables = strhash_alloc(64, free_value)) == NULL)
+    {
+        error = true;
+    }
+
+    for (int i = 0; !error && i < CACHE_SHARDS; i++)
+    {
+        spinlock_init(&my_instance->shards[i].lock);
+        error = (my_instance->shards[i].entries = strhash_alloc(64, NULL)) == NULL;
+    }
+
+    if (error)
+    {
+        for (int i = 0; i < CACHE_SHARDS; i++)
+        {
+            if (my_instance->shards[i].entries)
+            {
+                strhash_free(my_instance->shards[i].entries);
+            }
+        }
+        if (my_instance->tables)
+        {
+            strhash_free(my_instance->tables);
+        }
+        free(my_instance);
+        my_instance = NULL;
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    CACHE_SESSION *my_session = calloc(1, sizeof(CACHE_SESSION));
+
+    if (my_session)
+    {
+        MYSQL_session *data = (MYSQL_session*) session->client_dcb->data;
+
+        my_session->session = session;
+        my_session->autocommit = true;
+
+        if (data)
+        {
+            strcpy(my_session->db, data->db);
+        }
+    }
+
+    return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+static void
+free_tables(CACHE_TABLES *tables)
+{
+    free(tables->counters);
+    free(tables->generations);
+    memset(tables, 0, sizeof(*tables));
+}
+
+/**
+ * Stop collecting the result set of the session
+ *
+ * @param my_session The session
+ */
+static void
+discard_reply(CACHE_SESSION *my_session)
+{
+    gwbuf_free(my_session->reply);
+    free(my_session->key);
+    free_tables(&my_session->tables);
+    my_session->reply = NULL;
+    my_session->key = NULL;
+    my_session->reply_size = 0;
+    my_session->n_signals = 0;
+}
+
+static void
+free_stmt(CACHE_STMT *stmt)
+{
+    if (stmt)
+    {
+        gwbuf_free(stmt->prepare);
+        free(stmt);
+    }
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    discard_reply(my_session);
+    free_stmt(my_session->pending_stmt);
+
+    while (my_session->stmts)
+    {
+        CACHE_STMT *next = my_session->stmts->next;
+        free_stmt(my_session->stmts);
+        my_session->stmts = next;
+    }
+
+    free(my_session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    my_session->up = *upstream;
+}
+
+static uint32_t
+hash_key(const char *key)
+{
+    /** FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    while (*key)
+    {
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Get the generation counter of a table, creating it if needed. The counters
+ * are never freed so they can be read and incremented without the lock.
+ *
+ * @param my_instance The filter instance
+ * @param table Name of the table
+ * @return The counter or NULL if memory allocation failed
+ */
+static int *
+table_counter(CACHE_INSTANCE *my_instance, const char *table)
+{
+    size_t len = strlen(table);
+    char name[len + 1];
+
+    for (size_t i = 0; i <= len; i++)
+    {
+        name[i] = tolower(table[i]);
+    }
+
+    spinlock_acquire(&my_instance->lock);
+    int *counter = strhash_fetch(my_instance->tables, name);
+
+    if (counter == NULL && (counter = calloc(1, sizeof(int))) &&
+        !strhash_add(my_instance->tables, name, counter))
+    {
+        free(counter);
+        counter = NULL;
+    }
+    spinlock_release(&my_instance->lock);
+
+    return counter;
+}
+
+/**
+ * Record the current generations of the tables of a statement
+ *
+ * @param my_instance The filter instance
+ * @param queue The statement
+ * @param tables Where the generations are stored
+ * @return True on success
+ */
+static bool
+read_generations(CACHE_INSTANCE *my_instance, GWBUF *queue, CACHE_TABLES *tables)
+{
+    int n_names = 0;
+    char **names = qc_get_table_names(queue, &n_names, false);
+    bool ok = true;
+
+    memset(tables, 0, sizeof(*tables));
+    /** The global generation is read first, a write that increments it after
+     * this invalidates the result set */
+    tables->global = my_instance->generation;
+    __sync_synchronize();
+
+    if (n_names > 0)
+    {
+        tables->counters = malloc(n_names * sizeof(int*));
+        tables->generations = malloc(n_names * sizeof(int));
+        ok = tables->counters && tables->generations;
+
+        for (int i = 0; ok && i < n_names; i++)
+        {
+            if ((tables->counters[i] = table_counter(my_instance, names[i])))
+            {
+                tables->generations[i] = *tables->counters[i];
+                tables->n_tables++;
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+    }
+
+    for (int i = 0; i < n_names; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+
+    if (!ok)
+    {
+        free_tables(tables);
+    }
+
+    return ok;
+}
+
+/**
+ * Invalidate the result sets that were read from the tables of a statement
+ *
+ * @param my_instance The filter instance
+ * @param queue The statement that modifies the tables
+ */
+static void
+invalidate_tables(CACHE_INSTANCE *my_instance, GWBUF *queue)
+{
+    int n_names = 0;
+    char **names = qc_get_table_names(queue, &n_names, false);
+    bool all = n_names == 0;
+
+    for (int i = 0; i < n_names; i++)
+    {
+        int *counter = table_counter(my_instance, names[i]);
+
+        if (counter)
+        {
+            atomic_add(counter, 1);
+        }
+        else
+        {
+            all = true;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    if (all)
+    {
+        atomic_add(&my_instance->generation, 1);
+    }
+
+    atomic_add(&my_instance->n_invalidations, 1);
+}
+
+static bool
+entry_is_valid(CACHE_INSTANCE *my_instance, CACHE_ENTRY *entry, time_t now)
+{
+    if (now - entry->created >= my_instance->ttl ||
+        entry->tables.global != my_instance->generation)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < entry->tables.n_tables; i++)
+    {
+        if (*entry->tables.counters[i] != entry->tables.generations[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+free_entry(CACHE_ENTRY *entry)
+{
+    gwbuf_free(entry->data);
+    free_tables(&entry->tables);
+    free(entry->key);
+    free(entry);
+}
+
+/**
+ * Remove an entry from a shard, the caller must hold the lock of the shard
+ */
+static void
+shard_remove(CACHE_SHARD *shard, CACHE_ENTRY *entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        shard->head = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        shard->tail = entry->prev;
+    }
+
+    strhash_delete(shard->entries, entry->key);
+    shard->size -= entry->size;
+    free_entry(entry);
+}
+
+/**
+ * Move an entry to the head of the LRU list, the caller must hold the lock
+ */
+static void
+shard_push_head(CACHE_SHARD *shard, CACHE_ENTRY *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+
+    if (shard->head)
+    {
+        shard->head->prev = entry;
+    }
+    else
+    {
+        shard->tail = entry;
+    }
+
+    shard->head = entry;
+}
+
+/**
+ * Find a valid result set from the cache
+ *
+ * @param my_instance The filter instance
+ * @param key The key of the result set
+ * @return A clone of the result set or NULL if it was not found
+ */
+static GWBUF *
+cache_get(CACHE_INSTANCE *my_instance, const char *key)
+{
+    CACHE_SHARD *shard = &my_instance->shards[hash_key(key) % CACHE_SHARDS];
+    GWBUF *rval = NULL;
+
+    spinlock_acquire(&shard->lock);
+    CACHE_ENTRY *entry = strhash_fetch(shard->entries, key);
+
+    if (entry)
+    {
+        if (entry_is_valid(my_instance, entry, time(NULL)))
+        {
+            if (entry != shard->head)
+            {
+                entry->prev->next = entry->next;
+
+                if (entry->next)
+                {
+                    entry->next->prev = entry->prev;
+                }
+                else
+                {
+                    shard->tail = entry->prev;
+                }
+
+                shard_push_head(shard, entry);
+            }
+
+            rval = gwbuf_clone(entry->data);
+        }
+        else
+        {
+            shard_remove(shard, entry);
+            atomic_add(&my_instance->n_expired, 1);
+        }
+    }
+    spinlock_release(&shard->lock);
+
+    return rval;
+}
+
+/**
+ * Add the result set collected by a session to the cache. The session gives
+ * up the ownership of the result set, the key and the tables.
+ *
+ * @param my_instance The filter instance
+ * @param my_session The session
+ */
+static void
+cache_put(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session)
+{
+    CACHE_ENTRY *entry = malloc(sizeof(CACHE_ENTRY));
+    GWBUF *data = gwbuf_make_contiguous(my_session->reply);
+    my_session->reply = NULL;
+
+    if (entry == NULL || data == NULL)
+    {
+        free(entry);
+        gwbuf_free(data);
+        discard_reply(my_session);
+        return;
+    }
+
+    entry->key = my_session->key;
+    entry->data = data;
+    entry->size = sizeof(CACHE_ENTRY) + strlen(entry->key) + GWBUF_LENGTH(data);
+    entry->created = time(NULL);
+    entry->tables = my_session->tables;
+    my_session->key = NULL;
+    memset(&my_session->tables, 0, sizeof(my_session->tables));
+    discard_reply(my_session);
+
+    CACHE_SHARD *shard = &my_instance->shards[hash_key(entry->key) % CACHE_SHARDS];
+
+    spinlock_acquire(&shard->lock);
+    CACHE_ENTRY *old = strhash_fetch(shard->entries, entry->key);
+
+    if (old)
+    {
+        shard_remove(shard, old);
+    }
+
+    if (entry->size <= my_instance->max_size && strhash_add(shard->entries, entry->key, entry))
+    {
+        shard_push_head(shard, entry);
+        shard->size += entry->size;
+        atomic_add(&my_instance->n_stored, 1);
+
+        while (shard->size > my_instance->max_size)
+        {
+            shard_remove(shard, shard->tail);
+            atomic_add(&my_instance->n_evicted, 1);
+        }
+    }
+    else
+    {
+        free_entry(entry);
+    }
+    spinlock_release(&shard->lock);
+}
+
+/**
+ * Check if the result set of a statement can be cached
+ *
+ * @param my_session The session
+ * @param queue The statement
+ * @param sql The SQL of the statement
+ * @param len Length of the SQL
+ * @return True if the statement is a deterministic read
+ */
+static bool
+is_cacheable(CACHE_SESSION *my_session, GWBUF *queue, const char *sql, int len)
+{
+    if (my_session->in_trx || len > CACHE_MAX_SQL_LEN)
+    {
+        return false;
+    }
+
+    uint32_t type = qc_get_type(queue);
+
+    if ((type & QUERY_TYPE_READ) == 0 ||
+        (type & ~(QUERY_TYPE_READ | QUERY_TYPE_LOCAL_READ)) != 0 ||
+        qc_get_operation(queue) != QUERY_OP_SELECT)
+    {
+        return false;
+    }
+
+    char lower[len + 1];
+
+    for (int i = 0; i < len; i++)
+    {
+        lower[i] = tolower(sql[i]);
+    }
+    lower[len] = '\0';
+
+    for (int i = 0; uncacheable_clauses[i]; i++)
+    {
+        if (strstr(lower, uncacheable_clauses[i]))
+        {
+            return false;
+        }
+    }
+
+    int n_names = 0;
+    char **names = NULL;
+    /** Without the names of the functions the statement cannot be trusted */
+    bool rval = qc_get_function_names(queue, &names, &n_names);
+
+    for (int i = 0; i < n_names; i++)
+    {
+        for (int j = 0; rval && nondeterministic[j]; j++)
+        {
+            if (strcmp(names[i], nondeterministic[j]) == 0)
+            {
+                rval = false;
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    return rval;
+}
+
+/**
+ * Check if a statement modifies data
+ *
+ * @param queue The statement
+ * @return True if the statement is a write
+ */
+static bool
+is_write(GWBUF *queue)
+{
+    uint32_t type = qc_get_type(queue);
+    qc_query_op_t op = qc_get_operation(queue);
+
+    return (type & (QUERY_TYPE_WRITE | QUERY_TYPE_CREATE_TMP_TABLE)) ||
+           (op != QUERY_OP_UNDEFINED && op != QUERY_OP_SELECT && op != QUERY_OP_CHANGE_DB);
+}
+
+/**
+ * Track the transaction state and the statements that modify data
+ *
+ * @param my_instance The filter instance
+ * @param my_session The session
+ * @param queue A statement
+ */
+static void
+track_statement(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, GWBUF *queue)
+{
+    uint32_t type = qc_get_type(queue);
+
+    if (type & QUERY_TYPE_DISABLE_AUTOCOMMIT)
+    {
+        my_session->autocommit = false;
+        my_session->in_trx = true;
+    }
+    else if (type & QUERY_TYPE_ENABLE_AUTOCOMMIT)
+    {
+        my_session->autocommit = true;
+    }
+
+    if (type & QUERY_TYPE_BEGIN_TRX)
+    {
+        my_session->in_trx = true;
+    }
+
+    if (is_write(queue))
+    {
+        invalidate_tables(my_instance, queue);
+
+        if (my_session->in_trx)
+        {
+            my_session->trx_write = true;
+        }
+    }
+
+    if (type & (QUERY_TYPE_COMMIT | QUERY_TYPE_ROLLBACK | QUERY_TYPE_ENABLE_AUTOCOMMIT))
+    {
+        /** Result sets read by other sessions during the transaction may
+         * have missed its changes */
+        if (my_session->trx_write)
+        {
+            atomic_add(&my_instance->generation, 1);
+        }
+
+        my_session->trx_write = false;
+        my_session->in_trx = !my_session->autocommit;
+    }
+}
+
+/**
+ * Classify a COM_STMT_PREPARE, the statement is added to the session once
+ * the server has returned its id
+ *
+ * @param my_session The session
+ * @param queue The COM_STMT_PREPARE
+ */
+static void
+track_prepare(CACHE_SESSION *my_session, GWBUF *queue)
+{
+    CACHE_STMT *stmt = calloc(1, sizeof(CACHE_STMT));
+
+    if (stmt)
+    {
+        /** A statement that cannot be stored is treated as an unknown one */
+        stmt->write = is_write(queue);
+
+        if (stmt->write && (stmt->prepare = gwbuf_clone(queue)) == NULL)
+        {
+            free(stmt);
+            stmt = NULL;
+        }
+    }
+
+    my_session->pending_stmt = stmt;
+}
+
+/**
+ * Find a prepared statement of the session
+ *
+ * @param my_session The session
+ * @param id The statement id
+ * @param remove Remove the statement from the session
+ * @return The statement or NULL if it is not known
+ */
+static CACHE_STMT *
+find_stmt(CACHE_SESSION *my_session, uint32_t id, bool remove)
+{
+    CACHE_STMT **prev = &my_session->stmts;
+
+    for (CACHE_STMT *stmt = my_session->stmts; stmt; stmt = stmt->next)
+    {
+        if (stmt->id == id)
+        {
+            if (remove)
+            {
+                *prev = stmt->next;
+            }
+            return stmt;
+        }
+        prev = &stmt->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * Invalidate the result sets that the execution of a prepared statement may
+ * make stale
+ *
+ * @param my_instance The filter instance
+ * @param my_session The session
+ * @param id The statement id
+ */
+static void
+track_execute(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, uint32_t id)
+{
+    CACHE_STMT *stmt = find_stmt(my_session, id, false);
+
+    if (stmt == NULL)
+    {
+        /** The statement is not known, assume that it modifies data */
+        atomic_add(&my_instance->generation, 1);
+        atomic_add(&my_instance->n_invalidations, 1);
+    }
+    else if (stmt->write)
+    {
+        invalidate_tables(my_instance, stmt->prepare);
+    }
+
+    if ((stmt == NULL || stmt->write) && my_session->in_trx)
+    {
+        my_session->trx_write = true;
+    }
+}
+
+/**
+ * Get the database of a USE statement
+ *
+ * @param sql The SQL
+ * @param len Length of the SQL
+ * @param dest Where the name of the database is stored
+ * @return True if this was a USE statement
+ */
+static bool
+parse_use(const char *sql, int len, char *dest)
+{
+    const char *start = sql;
+    const char *end = sql + len;
+
+    while (start < end && isspace(*start))
+    {
+        start++;
+    }
+
+    if (end - start < 4 || strncasecmp(start, "use", 3) || !isspace(start[3]))
+    {
+        return false;
+    }
+
+    start += 4;
+
+    while (start < end && isspace(*start))
+    {
+        start++;
+    }
+
+    while (end > start && (isspace(end[-1]) || end[-1] == ';'))
+    {
+        end--;
+    }
+
+    if (end - start > 1 && *start == '`' && end[-1] == '`')
+    {
+        start++;
+        end--;
+    }
+
+    if (end - start > MYSQL_DATABASE_MAXLEN)
+    {
+        return false;
+    }
+
+    memcpy(dest, start, end - start);
+    dest[end - start] = '\0';
+    return true;
+}
+
+/**
+ * The routeQuery entry point. This is passed the query buffer
+ * to which the filter should be applied. Once processed the
+ * query is passed to the downstream component
+ * (filter or router) in the filter chain.
+ *
+ * If the result set of the statement is in the cache, it is returned to the
+ * client and the statement is not routed.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    const char *sql;
+    int len;
+
+    /** A new statement before the previous reply was complete */
+    discard_reply(my_session);
+    free_stmt(my_session->pending_stmt);
+    my_session->pending_stmt = NULL;
+    my_session->db_pending = false;
+
+    if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN)
+    {
+        uint8_t command = ((uint8_t*) GWBUF_DATA(queue))[MYSQL_HEADER_LEN];
+
+        if (command == MYSQL_COM_INIT_DB)
+        {
+            size_t dblen = GWBUF_LENGTH(queue) - MYSQL_HEADER_LEN - 1;
+
+            if (dblen <= MYSQL_DATABASE_MAXLEN)
+            {
+                memcpy(my_session->pending_db, (char*) GWBUF_DATA(queue) + MYSQL_HEADER_LEN + 1, dblen);
+                my_session->pending_db[dblen] = '\0';
+                my_session->db_pending = true;
+            }
+        }
+        else if (command == MYSQL_COM_STMT_EXECUTE || command == MYSQL_COM_STMT_CLOSE)
+        {
+            uint8_t id[4];
+
+            if (gwbuf_copy_data(queue, MYSQL_HEADER_LEN + 1, sizeof(id), id) != sizeof(id))
+            {
+                /** A malformed packet, assume that it modifies data */
+                atomic_add(&my_instance->generation, 1);
+            }
+            else if (command == MYSQL_COM_STMT_EXECUTE)
+            {
+                track_execute(my_instance, my_session, gw_mysql_get_byte4(id));
+            }
+            else
+            {
+                free_stmt(find_stmt(my_session, gw_mysql_get_byte4(id), true));
+            }
+        }
+    }
+
+    if (modutil_is_SQL_prepare(queue))
+    {
+        track_prepare(my_session, queue);
+    }
+
+    if (modutil_is_SQL(queue) && modutil_get_SQL_view(queue, &sql, &len))
+    {
+        if (parse_use(sql, len, my_session->pending_db))
+        {
+            my_session->db_pending = true;
+        }
+
+        track_statement(my_instance, my_session, queue);
+
+        if (is_cacheable(my_session, queue, sql, len))
+        {
+            DCB *dcb = my_session->session->client_dcb;
+            bool deprecate_eof = modutil_deprecate_eof(my_session->session);
+            /** The result sets of clients with CLIENT_DEPRECATE_EOF have another format */
+            char key[strlen(dcb->user) + strlen(my_session->db) + len + 5];
+            sprintf(key, "%s\x1f%s\x1f%c\x1f%.*s", dcb->user, my_session->db,
+                    deprecate_eof ? 'O' : 'E', len, sql);
+
+            GWBUF *result = cache_get(my_instance, key);
+
+            if (result)
+            {
+                atomic_add(&my_instance->n_hits, 1);
+                gwbuf_free(queue);
+                return my_session->up.clientReply(my_session->up.instance,
+                                                  my_session->up.session, result);
+            }
+
+            atomic_add(&my_instance->n_misses, 1);
+
+            if (read_generations(my_instance, queue, &my_session->tables))
+            {
+                my_session->key = strdup(key);
+                modutil_scan_init_eof(&my_session->scan, deprecate_eof);
+            }
+        }
+    }
+
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * Check if a reply starts with a result set header
+ */
+static bool
+is_resultset(GWBUF *reply)
+{
+    uint8_t cmd;
+
+    return gwbuf_copy_data(reply, MYSQL_HEADER_LEN, 1, &cmd) != 1 ||
+           (cmd != 0x00 && cmd != 0xff && cmd != 0xfb);
+}
+
+/**
+ * The clientReply entry point. The result set of a cacheable statement is
+ * collected and added to the cache once it is complete.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The response data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    if (my_session->db_pending)
+    {
+        uint8_t cmd;
+
+        if (gwbuf_copy_data(reply, MYSQL_HEADER_LEN, 1, &cmd) == 1 && cmd == 0x00)
+        {
+            strcpy(my_session->db, my_session->pending_db);
+        }
+        my_session->db_pending = false;
+    }
+
+    if (my_session->pending_stmt)
+    {
+        uint8_t ok[5];
+
+        /** The reply starts with an OK packet that has the statement id */
+        if (gwbuf_copy_data(reply, MYSQL_HEADER_LEN, sizeof(ok), ok) == sizeof(ok) &&
+            ok[0] == 0x00)
+        {
+            my_session->pending_stmt->id = gw_mysql_get_byte4(ok + 1);
+            my_session->pending_stmt->next = my_session->stmts;
+            my_session->stmts = my_session->pending_stmt;
+        }
+        else
+        {
+            free_stmt(my_session->pending_stmt);
+        }
+        my_session->pending_stmt = NULL;
+    }
+
+    if (my_session->key)
+    {
+        GWBUF *clone = gwbuf_clone_all(reply);
+        my_session->reply_size += gwbuf_length(reply);
+
+        if (clone == NULL || my_session->reply_size > my_instance->max_resultset_size)
+        {
+            gwbuf_free(clone);
+            discard_reply(my_session);
+        }
+        else
+        {
+            my_session->n_signals += modutil_scan_signal_packets(&my_session->scan, clone);
+            my_session->reply = gwbuf_append(my_session->reply, clone);
+
+            if (!is_resultset(my_session->reply))
+            {
+                /** OK and ERR packets and LOAD DATA LOCAL requests */
+                discard_reply(my_session);
+            }
+            else if (my_session->n_signals >= 2 && my_session->scan.skip == 0 &&
+                     my_session->scan.prefix_len == 0)
+            {
+                /** The column definitions and the rows both end in an EOF or
+                 * an ERR packet, only complete single result sets are cached.
+                 * With CLIENT_DEPRECATE_EOF the scan counts the end of the
+                 * column definitions and the final OK packet instead. */
+                if (!my_session->scan.more && !my_session->scan.err)
+                {
+                    cache_put(my_instance, my_session);
+                }
+                else
+                {
+                    discard_reply(my_session);
+                }
+            }
+        }
+    }
+
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session, reply);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * Prints the statistics of the cache.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb         The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    size_t size = 0;
+    int entries = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        spinlock_acquire(&my_instance->shards[i].lock);
+        size += my_instance->shards[i].size;
+        entries += strhash_size(my_instance->shards[i].entries);
+        spinlock_release(&my_instance->shards[i].lock);
+    }
+
+    dcb_printf(dcb, "\t\tTime-to-live:                %d seconds\n", my_instance->ttl);
+    dcb_printf(dcb, "\t\tCached result sets:          %d\n", entries);
+    dcb_printf(dcb, "\t\tCache size:                  %lu of %lu bytes\n",
+               (unsigned long) size, (unsigned long) my_instance->max_size * CACHE_SHARDS);
+    dcb_printf(dcb, "\t\tCache hits:                  %d\n", my_instance->n_hits);
+    dcb_printf(dcb, "\t\tCache misses:                %d\n", my_instance->n_misses);
+    dcb_printf(dcb, "\t\tStored result sets:          %d\n", my_instance->n_stored);
+    dcb_printf(dcb, "\t\tEvicted result sets:         %d\n", my_instance->n_evicted);
+    dcb_printf(dcb, "\t\tExpired result sets:         %d\n", my_instance->n_expired);
+    dcb_printf(dcb, "\t\tInvalidating statements:     %d\n", my_instance->n_invalidations);
+}
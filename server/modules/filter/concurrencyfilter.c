@@ -0,0 +1,930 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file concurrencyfilter.c - An adaptive limit on the queries in progress
+ *
+ * The filter limits the number of queries of a service that have been sent to
+ * the backend servers and whose replies are not yet complete. A query that
+ * arrives when the limit has been reached waits in a bounded FIFO queue inside
+ * MaxScale until one of the queries in progress completes. When the queue is
+ * full, the query is answered with an error.
+ *
+ * The limit adapts to the latency of the queries with a gradient algorithm.
+ * The average latency of the queries that completed during an interval is
+ * compared to a long term average of the latency. When the queries become
+ * slower than the long term average by more than the tolerance, the servers
+ * are queueing work and the limit is decreased in proportion. Otherwise the
+ * limit grows by roughly its square root, but only if the queries in progress
+ * actually reached the limit during the interval.
+ *
+ * A queued query is sent again through the client DCB of its session once a
+ * slot is free, so that it is routed by the thread that owns the session.
+ * Filters before this one in the chain see such a query twice, which is why
+ * this filter should be the first one of the service.
+ *
+ * @verbatim
+ * The parameters for this filter are:
+ *
+ *      initial_limit       The limit when the service starts
+ *      min_limit           The lowest value of the limit
+ *      max_limit           The highest value of the limit
+ *      max_queue           The longest queue of waiting queries
+ *      tolerance           How much slower than the long term average the
+ *                          queries may become before the limit is decreased
+ *      interval            How often the limit is adjusted, in milliseconds
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <log_manager.h>
+#include <maxscale/poll.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_EXPERIMENTAL,
+    FILTER_VERSION,
+    "An adaptive limit on the queries in progress"
+};
+
+static char *version_str = "V1.0.0";
+
+#define CONCURRENCY_DEFAULT_INITIAL_LIMIT 20
+#define CONCURRENCY_DEFAULT_MIN_LIMIT 1
+#define CONCURRENCY_DEFAULT_MAX_LIMIT 1000
+#define CONCURRENCY_DEFAULT_MAX_QUEUE 1000
+#define CONCURRENCY_DEFAULT_TOLERANCE 1.5
+#define CONCURRENCY_DEFAULT_INTERVAL 1000
+/** Weight of the latest interval in the long term average latency */
+#define CONCURRENCY_LONG_WEIGHT 0.05
+/** Weight of the new limit when it is combined with the old one */
+#define CONCURRENCY_SMOOTHING 0.2
+
+static FILTER *createInstance(char **options, FILTER_PARAMETER **params);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/**
+ * Where the query of a session is
+ */
+typedef enum
+{
+    CONCURRENCY_IDLE,     /*< No query of the session holds a slot */
+    CONCURRENCY_QUEUED,   /*< The query waits in the queue */
+    CONCURRENCY_ADMITTED, /*< The query has a slot and is being sent again */
+    CONCURRENCY_ACTIVE    /*< The query has been routed and holds a slot */
+} concurrency_state_t;
+
+/**
+ * The session structure
+ */
+typedef struct concurrency_session
+{
+    DOWNSTREAM down;
+    UPSTREAM up;
+    SESSION *session;
+    concurrency_state_t state; /*< Protected by the instance lock */
+    GWBUF *held; /*< The queued query */
+    struct concurrency_session *next; /*< Next session in the queue */
+    uint64_t started; /*< When the active query was routed, in microseconds */
+    uint8_t command; /*< The command of the active query */
+    bool reply_started; /*< A part of the reply has been seen */
+    bool infile; /*< The reply is a LOAD DATA LOCAL INFILE request */
+    int n_signals; /*< EOF and ERR packets in the reply */
+    MODUTIL_PACKET_SCAN scan;
+    uint32_t packets_left; /*< Packets left of a COM_STMT_PREPARE reply */
+    size_t packet_skip; /*< Bytes left of the current packet */
+    uint8_t header[MYSQL_HEADER_LEN]; /*< The part of a split packet header */
+    int header_len; /*< Bytes in the header */
+} CONCURRENCY_SESSION;
+
+/**
+ * The instance structure
+ */
+typedef struct
+{
+    int min_limit;
+    int max_limit;
+    int max_queue;
+    double tolerance;
+    uint64_t interval; /*< In microseconds */
+    SPINLOCK lock; /*< Protects everything below */
+    double limit; /*< The current limit */
+    int in_flight; /*< Queries that hold a slot */
+    int queued; /*< Length of the queue */
+    CONCURRENCY_SESSION *head; /*< First session in the queue */
+    CONCURRENCY_SESSION *tail; /*< Last session in the queue */
+    uint64_t window_start; /*< When the current interval started */
+    uint64_t window_latency; /*< Total latency of the queries of the interval */
+    int window_samples; /*< Queries completed during the interval */
+    int window_peak; /*< Most queries in progress during the interval */
+    double long_latency; /*< Long term average latency, 0 if none yet */
+    double last_latency; /*< Average latency of the last interval */
+    int n_queued; /*< Queries that had to wait */
+    int n_rejected; /*< Queries rejected because the queue was full */
+} CONCURRENCY_INSTANCE;
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+static uint64_t
+now_usecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    CONCURRENCY_INSTANCE *my_instance = calloc(1, sizeof(CONCURRENCY_INSTANCE));
+    int initial_limit = CONCURRENCY_DEFAULT_INITIAL_LIMIT;
+    bool error = false;
+
+    if (my_instance == NULL)
+    {
+        return NULL;
+    }
+
+    my_instance->min_limit = CONCURRENCY_DEFAULT_MIN_LIMIT;
+    my_instance->max_limit = CONCURRENCY_DEFAULT_MAX_LIMIT;
+    my_instance->max_queue = CONCURRENCY_DEFAULT_MAX_QUEUE;
+    my_instance->tolerance = CONCURRENCY_DEFAULT_TOLERANCE;
+    my_instance->interval = CONCURRENCY_DEFAULT_INTERVAL * 1000;
+    spinlock_init(&my_instance->lock);
+
+    for (int i = 0; params && params[i]; i++)
+    {
+        if (!strcmp(params[i]->name, "initial_limit"))
+        {
+            if ((initial_limit = atoi(params[i]->value)) <= 0)
+            {
+                MXS_ERROR("concurrencyfilter: Invalid value for 'initial_limit': %s", params[i]->value);
+                error = true;
+            }
+        }
+        else if (!strcmp(params[i]->name, "min_limit"))
+        {
+            if ((my_instance->min_limit = atoi(params[i]->value)) <= 0)
+            {
+                MXS_ERROR("concurrencyfilter: Invalid value for 'min_limit': %s", params[i]->value);
+                error = true;
+            }
+        }
+        else if (!strcmp(params[i]->name, "max_limit"))
+        {
+            if ((my_instance->max_limit = atoi(params[i]->value)) <= 0)
+            {
+                MXS_ERROR("concurrencyfilter: Invalid value for 'max_limit': %s", params[i]->value);
+                error = true;
+            }
+        }
+        else if (!strcmp(params[i]->name, "max_queue"))
+        {
+            if ((my_instance->max_queue = atoi(params[i]->value)) < 0)
+            {
+                MXS_ERROR("concurrencyfilter: Invalid value for 'max_queue': %s", params[i]->value);
+                error = true;
+            }
+        }
+        else if (!strcmp(params[i]->name, "tolerance"))
+        {
+            if ((my_instance->tolerance = atof(params[i]->value)) < 1.0)
+            {
+                MXS_ERROR("concurrencyfilter: Invalid value for 'tolerance': %s, "
+                          "the value must be at least 1.0.", params[i]->value);
+                error = true;
+            }
+        }
+        else if (!strcmp(params[i]->name, "interval"))
+        {
+            int value = atoi(params[i]->value);
+
+            if (value <= 0)
+            {
+                MXS_ERROR("concurrencyfilter: Invalid value for 'interval': %s", params[i]->value);
+                error = true;
+            }
+            my_instance->interval = (uint64_t)value * 1000;
+        }
+        else if (!filter_standard_parameter(params[i]->name))
+        {
+            MXS_ERROR("concurrencyfilter: Unexpected parameter '%s'.", params[i]->name);
+            error = true;
+        }
+    }
+
+    if (!error && my_instance->min_limit > my_instance->max_limit)
+    {
+        MXS_ERROR("concurrencyfilter: 'min_limit' is greater than 'max_limit'.");
+        error = true;
+    }
+
+    if (error)
+    {
+        free(my_instance);
+        return NULL;
+    }
+
+    if (initial_limit < my_instance->min_limit)
+    {
+        initial_limit = my_instance->min_limit;
+    }
+    else if (initial_limit > my_instance->max_limit)
+    {
+        initial_limit = my_instance->max_limit;
+    }
+
+    my_instance->limit = initial_limit;
+    my_instance->window_start = now_usecs();
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    CONCURRENCY_SESSION *my_session = calloc(1, sizeof(CONCURRENCY_SESSION));
+
+    if (my_session)
+    {
+        my_session->session = session;
+        my_session->state = CONCURRENCY_IDLE;
+    }
+
+    return my_session;
+}
+
+/**
+ * Remove a session from the queue. The caller holds the instance lock.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The queued session
+ */
+static void
+queue_remove(CONCURRENCY_INSTANCE *my_instance, CONCURRENCY_SESSION *my_session)
+{
+    CONCURRENCY_SESSION *prev = NULL;
+    CONCURRENCY_SESSION *ptr = my_instance->head;
+
+    while (ptr && ptr != my_session)
+    {
+        prev = ptr;
+        ptr = ptr->next;
+    }
+
+    if (ptr)
+    {
+        if (prev)
+        {
+            prev->next = ptr->next;
+        }
+        else
+        {
+            my_instance->head = ptr->next;
+        }
+        if (my_instance->tail == ptr)
+        {
+            my_instance->tail = prev;
+        }
+        ptr->next = NULL;
+        my_instance->queued--;
+    }
+}
+
+/**
+ * Give the free slots to the sessions at the head of the queue. The queries
+ * are sent again through the client DCBs and routed by the threads that own
+ * the sessions. The caller holds the instance lock, which keeps a session
+ * from being closed while its query is handed back to it.
+ *
+ * @param my_instance The filter instance
+ */
+static void
+admit_waiting(CONCURRENCY_INSTANCE *my_instance)
+{
+    while (my_instance->head && my_instance->in_flight < (int)my_instance->limit)
+    {
+        CONCURRENCY_SESSION *waiter = my_instance->head;
+        my_instance->head = waiter->next;
+        if (my_instance->head == NULL)
+        {
+            my_instance->tail = NULL;
+        }
+        waiter->next = NULL;
+        my_instance->queued--;
+
+        GWBUF *query = waiter->held;
+        waiter->held = NULL;
+        waiter->state = CONCURRENCY_ADMITTED;
+        my_instance->in_flight++;
+
+        if (my_instance->in_flight > my_instance->window_peak)
+        {
+            my_instance->window_peak = my_instance->in_flight;
+        }
+
+        poll_add_epollin_event_to_dcb(waiter->session->client_dcb, query);
+    }
+}
+
+/**
+ * Adjust the limit with the latencies of the interval that has ended. The
+ * caller holds the instance lock.
+ *
+ * @param my_instance The filter instance
+ * @param now         The current time
+ */
+static void
+update_limit(CONCURRENCY_INSTANCE *my_instance, uint64_t now)
+{
+    double latency = (double)my_instance->window_latency / my_instance->window_samples;
+    double limit = my_instance->limit;
+
+    if (my_instance->long_latency == 0)
+    {
+        my_instance->long_latency = latency;
+    }
+    else
+    {
+        my_instance->long_latency = my_instance->long_latency * (1 - CONCURRENCY_LONG_WEIGHT) +
+                                    latency * CONCURRENCY_LONG_WEIGHT;
+    }
+
+    double gradient = latency > 0 ? my_instance->tolerance * my_instance->long_latency / latency : 1.0;
+
+    if (gradient > 1.0)
+    {
+        gradient = 1.0;
+    }
+    else if (gradient < 0.5)
+    {
+        gradient = 0.5;
+    }
+
+    /** Room for growth, the integer square root of the limit */
+    int headroom = 1;
+    while ((headroom + 1) * (headroom + 1) <= (int)limit)
+    {
+        headroom++;
+    }
+
+    double target = limit * gradient;
+
+    /** Only grow a limit that the queries actually reached */
+    if (my_instance->window_peak >= (int)limit)
+    {
+        target += headroom;
+    }
+
+    if (target < limit)
+    {
+        limit = limit * (1 - CONCURRENCY_SMOOTHING) + target * CONCURRENCY_SMOOTHING;
+    }
+    else
+    {
+        limit = target > limit + headroom ? limit + headroom : target;
+    }
+
+    if (limit < my_instance->min_limit)
+    {
+        limit = my_instance->min_limit;
+    }
+    else if (limit > my_instance->max_limit)
+    {
+        limit = my_instance->max_limit;
+    }
+
+    if ((int)limit != (int)my_instance->limit)
+    {
+        MXS_DEBUG("concurrencyfilter: Limit changed from %d to %d, latency %.0fus, "
+                  "long term latency %.0fus.", (int)my_instance->limit, (int)limit,
+                  latency, my_instance->long_latency);
+    }
+
+    my_instance->limit = limit;
+    my_instance->last_latency = latency;
+    my_instance->window_start = now;
+    my_instance->window_latency = 0;
+    my_instance->window_samples = 0;
+    my_instance->window_peak = my_instance->in_flight;
+}
+
+/**
+ * Release the slot of a session
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @param completed   The query completed and its latency is a valid sample
+ */
+static void
+release_slot(CONCURRENCY_INSTANCE *my_instance, CONCURRENCY_SESSION *my_session, bool completed)
+{
+    uint64_t now = completed ? now_usecs() : 0;
+
+    spinlock_acquire(&my_instance->lock);
+
+    if (my_session->state == CONCURRENCY_ACTIVE || my_session->state == CONCURRENCY_ADMITTED)
+    {
+        my_instance->in_flight--;
+
+        if (completed)
+        {
+            my_instance->window_latency += now - my_session->started;
+            my_instance->window_samples++;
+
+            if (now - my_instance->window_start >= my_instance->interval)
+            {
+                update_limit(my_instance, now);
+            }
+        }
+    }
+    else if (my_session->state == CONCURRENCY_QUEUED)
+    {
+        queue_remove(my_instance, my_session);
+    }
+
+    my_session->state = CONCURRENCY_IDLE;
+    admit_waiting(my_instance);
+
+    spinlock_release(&my_instance->lock);
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    CONCURRENCY_INSTANCE *my_instance = (CONCURRENCY_INSTANCE *) instance;
+    CONCURRENCY_SESSION *my_session = (CONCURRENCY_SESSION *) session;
+
+    release_slot(my_instance, my_session, false);
+    gwbuf_free(my_session->held);
+    my_session->held = NULL;
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    free(session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    CONCURRENCY_SESSION *my_session = (CONCURRENCY_SESSION *) session;
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    CONCURRENCY_SESSION *my_session = (CONCURRENCY_SESSION *) session;
+    my_session->up = *upstream;
+}
+
+/**
+ * Check whether the servers reply to a command
+ *
+ * @param queue The command
+ * @return True if the command has a reply
+ */
+static bool
+has_reply(GWBUF *queue)
+{
+    uint8_t command;
+
+    if (gwbuf_copy_data(queue, MYSQL_HEADER_LEN, 1, &command) != 1)
+    {
+        return false;
+    }
+
+    return command != MYSQL_COM_QUIT &&
+           command != MYSQL_COM_STMT_SEND_LONG_DATA &&
+           command != MYSQL_COM_STMT_CLOSE;
+}
+
+/**
+ * Route a query that holds a slot
+ *
+ * @param my_session The session
+ * @param queue      The query
+ * @return The return value of the downstream routeQuery
+ */
+static int
+route_active(CONCURRENCY_SESSION *my_session, GWBUF *queue)
+{
+    my_session->started = now_usecs();
+    my_session->command = 0;
+    gwbuf_copy_data(queue, MYSQL_HEADER_LEN, 1, &my_session->command);
+    my_session->reply_started = false;
+    my_session->infile = false;
+    my_session->n_signals = 0;
+    my_session->packets_left = 0;
+    modutil_scan_init_eof(&my_session->scan, modutil_deprecate_eof(my_session->session));
+
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * The routeQuery entry point. A query is routed at once if the limit allows
+ * it, otherwise it is queued.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    CONCURRENCY_INSTANCE *my_instance = (CONCURRENCY_INSTANCE *) instance;
+    CONCURRENCY_SESSION *my_session = (CONCURRENCY_SESSION *) session;
+
+    if (my_session->infile)
+    {
+        /** The contents of a LOAD DATA LOCAL INFILE */
+        return my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session, queue);
+    }
+
+    spinlock_acquire(&my_instance->lock);
+
+    if (!has_reply(queue))
+    {
+        /** Commands without a reply don't need a slot but they must not
+         * overtake the queued query of the session */
+        if (my_session->state == CONCURRENCY_QUEUED)
+        {
+            my_session->held = gwbuf_append(my_session->held, queue);
+            spinlock_release(&my_instance->lock);
+            return 1;
+        }
+
+        spinlock_release(&my_instance->lock);
+        return my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session, queue);
+    }
+
+    switch (my_session->state)
+    {
+    case CONCURRENCY_ADMITTED:
+        /** The query was queued and has been given a slot */
+        my_session->state = CONCURRENCY_ACTIVE;
+        spinlock_release(&my_instance->lock);
+        return route_active(my_session, queue);
+
+    case CONCURRENCY_QUEUED:
+        /** Keep the order of the queries of the session */
+        my_session->held = gwbuf_append(my_session->held, queue);
+        spinlock_release(&my_instance->lock);
+        return 1;
+
+    case CONCURRENCY_ACTIVE:
+        /** A new query before the reply to the previous one was complete */
+        my_instance->in_flight--;
+        my_session->state = CONCURRENCY_IDLE;
+        break;
+
+    default:
+        break;
+    }
+
+    if (my_instance->in_flight < (int)my_instance->limit && my_instance->head == NULL)
+    {
+        my_instance->in_flight++;
+        if (my_instance->in_flight > my_instance->window_peak)
+        {
+            my_instance->window_peak = my_instance->in_flight;
+        }
+        my_session->state = CONCURRENCY_ACTIVE;
+        spinlock_release(&my_instance->lock);
+        return route_active(my_session, queue);
+    }
+
+    if (my_instance->queued < my_instance->max_queue)
+    {
+        my_session->held = queue;
+        my_session->state = CONCURRENCY_QUEUED;
+        if (my_instance->tail)
+        {
+            my_instance->tail->next = my_session;
+        }
+        else
+        {
+            my_instance->head = my_session;
+        }
+        my_instance->tail = my_session;
+        my_instance->queued++;
+        my_instance->n_queued++;
+        /** The limit was exceeded, the queries did reach it */
+        my_instance->window_peak = my_instance->in_flight;
+        spinlock_release(&my_instance->lock);
+        return 1;
+    }
+
+    my_instance->n_rejected++;
+    spinlock_release(&my_instance->lock);
+
+    gwbuf_free(queue);
+    GWBUF *err = modutil_create_mysql_err_msg(1, 0, 1040, "08004",
+                                              "Too many queries are waiting for the servers");
+    return err ? my_session->up.clientReply(my_session->up.instance,
+                                            my_session->up.session, err) : 0;
+}
+
+/**
+ * Count the packets of a COM_STMT_PREPARE reply
+ *
+ * @param my_session The session
+ * @param reply      The next part of the reply
+ * @return True if all packets of the reply have been seen
+ */
+static bool
+prepare_reply_complete(CONCURRENCY_SESSION *my_session, GWBUF *reply)
+{
+    for (GWBUF *buf = reply; buf && my_session->packets_left > 0; buf = buf->next)
+    {
+        uint8_t *ptr = GWBUF_DATA(buf);
+        uint8_t *end = ptr + GWBUF_LENGTH(buf);
+
+        while (ptr < end && my_session->packets_left > 0)
+        {
+            if (my_session->packet_skip > 0)
+            {
+                size_t n = MIN(my_session->packet_skip, (size_t)(end - ptr));
+                my_session->packet_skip -= n;
+                ptr += n;
+
+                if (my_session->packet_skip == 0)
+                {
+                    my_session->packets_left--;
+                }
+            }
+            else
+            {
+                my_session->header[my_session->header_len++] = *ptr++;
+
+                if (my_session->header_len == MYSQL_HEADER_LEN)
+                {
+                    my_session->packet_skip = gw_mysql_get_byte3(my_session->header);
+                    my_session->header_len = 0;
+
+                    if (my_session->packet_skip == 0)
+                    {
+                        my_session->packets_left--;
+                    }
+                }
+            }
+        }
+    }
+
+    return my_session->packets_left == 0;
+}
+
+/**
+ * Start counting the packets of a COM_STMT_PREPARE reply. The OK packet is
+ * followed by the parameter and the column definitions, each group ending
+ * in an EOF packet unless the client uses CLIENT_DEPRECATE_EOF.
+ *
+ * @param my_session The session
+ * @param reply      The first part of the reply, starting with the OK packet
+ * @return True if the reply is complete
+ */
+static bool
+prepare_reply_start(CONCURRENCY_SESSION *my_session, GWBUF *reply)
+{
+    uint8_t counts[4];
+
+    /** The column and the parameter counts follow the statement ID */
+    if (gwbuf_copy_data(reply, MYSQL_HEADER_LEN + 5, sizeof(counts), counts) != sizeof(counts))
+    {
+        return true;
+    }
+
+    uint32_t columns = gw_mysql_get_byte2(counts);
+    uint32_t params = gw_mysql_get_byte2(counts + 2);
+    bool eof = !my_session->scan.deprecate_eof;
+
+    my_session->packets_left = 1 + columns + params +
+                               (eof && columns ? 1 : 0) + (eof && params ? 1 : 0);
+    my_session->packet_skip = 0;
+    my_session->header_len = 0;
+
+    return prepare_reply_complete(my_session, reply);
+}
+
+/**
+ * Check if the reply to the active query is complete
+ *
+ * @param my_session The session
+ * @param reply      The next part of the reply
+ * @return True if the reply is complete
+ */
+static bool
+reply_complete(CONCURRENCY_SESSION *my_session, GWBUF *reply)
+{
+    uint8_t cmd;
+
+    if (my_session->packets_left > 0)
+    {
+        return prepare_reply_complete(my_session, reply);
+    }
+
+    if (!my_session->reply_started || my_session->infile)
+    {
+        my_session->reply_started = true;
+
+        if (gwbuf_copy_data(reply, MYSQL_HEADER_LEN, 1, &cmd) == 1)
+        {
+            if (cmd == 0x00 && my_session->command == MYSQL_COM_STMT_PREPARE && !my_session->infile)
+            {
+                return prepare_reply_start(my_session, reply);
+            }
+            else if (cmd == 0x00 || cmd == 0xff)
+            {
+                /** OK and ERR packets, also the end of a LOAD DATA LOCAL INFILE */
+                return true;
+            }
+            else if (cmd == 0xfb)
+            {
+                my_session->infile = true;
+                return false;
+            }
+        }
+    }
+
+    my_session->n_signals += modutil_scan_signal_packets(&my_session->scan, reply);
+
+    return my_session->n_signals >= 2 && !my_session->scan.more &&
+           my_session->scan.skip == 0 && my_session->scan.prefix_len == 0;
+}
+
+/**
+ * The clientReply entry point. The slot of a query is released when its
+ * reply is complete.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The response data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    CONCURRENCY_INSTANCE *my_instance = (CONCURRENCY_INSTANCE *) instance;
+    CONCURRENCY_SESSION *my_session = (CONCURRENCY_SESSION *) session;
+
+    if (my_session->state == CONCURRENCY_ACTIVE && reply_complete(my_session, reply))
+    {
+        my_session->infile = false;
+        release_slot(my_instance, my_session, true);
+    }
+
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session, reply);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * Prints the limit and the statistics of the filter.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb         The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    CONCURRENCY_INSTANCE *my_instance = (CONCURRENCY_INSTANCE *) instance;
+
+    spinlock_acquire(&my_instance->lock);
+    int limit = my_instance->limit;
+    int in_flight = my_instance->in_flight;
+    int queued = my_instance->queued;
+    double latency = my_instance->last_latency;
+    double long_latency = my_instance->long_latency;
+    spinlock_release(&my_instance->lock);
+
+    dcb_printf(dcb, "\t\tLimit:                       %d (%d - %d)\n",
+               limit, my_instance->min_limit, my_instance->max_limit);
+    dcb_printf(dcb, "\t\tQueries in progress:         %d\n", in_flight);
+    dcb_printf(dcb, "\t\tQueries waiting:             %d of %d\n", queued, my_instance->max_queue);
+    dcb_printf(dcb, "\t\tLatency (ms):                %.3f\n", latency / 1000);
+    dcb_printf(dcb, "\t\tLong term latency (ms):      %.3f\n", long_latency / 1000);
+    dcb_printf(dcb, "\t\tQueued queries:              %d\n", my_instance->n_queued);
+    dcb_printf(dcb, "\t\tRejected queries:            %d\n", my_instance->n_rejected);
+}
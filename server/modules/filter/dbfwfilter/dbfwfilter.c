@@ -70,15 +70,20 @@
 #include <query_classifier.h>
 #include <mysql_client_server_protocol.h>
 #include <spinlock.h>
+#include <strhash.h>
 #include <skygw_types.h>
 #include <time.h>
 #include <assert.h>
 #include <regex.h>
 #include <maxscale_pcre2.h>
+#include <maxconfig.h>
+#include <housekeeper.h>
+#include <maxscale/poll.h>
 #include <dbfwfilter.h>
 #include <ruleparser.yy.h>
 #include <lex.yy.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 /** Older versions of Bison don't include the parsing function in the header */
 #ifndef dbfw_yyparse
@@ -130,7 +135,8 @@ typedef enum
     RT_PERMISSION, /*< Simple denying rule */
     RT_WILDCARD, /*< Wildcard denial rule */
     RT_REGEX, /*< Regex matching rule */
-    RT_CLAUSE /*< WHERE-clause requirement rule */
+    RT_CLAUSE, /*< WHERE-clause requirement rule */
+    RT_USER_THROTTLE /*< Query rate of a client user */
 } ruletype_t;
 
 const char* rule_names[] =
@@ -141,7 +147,8 @@ const char* rule_names[] =
     "PERMISSION",
     "WILDCARD",
     "REGEX",
-    "CLAUSE"
+    "CLAUSE",
+    "USER_THROTTLE"
 };
 
 /**
@@ -179,6 +186,41 @@ typedef struct queryspeed_t
     struct queryspeed_t* next; /*< Next node in the list */
 } QUERYSPEED;
 
+/**
+ * The tokens that a worker thread has taken from a user bucket
+ */
+typedef struct user_bucket_shard
+{
+    int tokens; /*< Tokens left */
+    long tick; /*< Heartbeat when the tokens were taken */
+} USER_BUCKET_SHARD;
+
+/**
+ * Token bucket of one client user@host. The bucket holds tenths of a token
+ * so that it can be refilled on every heartbeat tick without rounding. The
+ * heartbeat of the last refill is stored in the high 32 bits of the state and
+ * the tenths in the low 32 bits, which allows the state to be updated with a
+ * single compare-and-swap.
+ */
+typedef struct user_bucket
+{
+    uint64_t state; /*< Last refill and the tenths of tokens left */
+    USER_BUCKET_SHARD* shards; /*< Tokens held by each thread */
+} USER_BUCKET;
+
+/**
+ * Per-user query rate limit
+ */
+typedef struct user_limit
+{
+    int rate; /*< Queries per second */
+    int burst; /*< Size of the bucket */
+    int batch; /*< Tokens taken from the bucket at a time */
+    int n_threads; /*< Number of shards in each bucket */
+    SPINLOCK lock; /*< Protects the buckets */
+    STRHASH* buckets; /*< Buckets keyed by user@host */
+} USER_LIMIT;
+
 /**
  * A structure used to identify individual rules and to store their contents
  *
@@ -193,6 +235,7 @@ typedef struct rule_t
     qc_query_op_t on_queries; /*< Types of queries to inspect */
     int times_matched; /*< Number of times this rule has been matched */
     TIMERANGE* active; /*< List of times when this rule is active */
+    char* pattern; /*< Source of a regex rule */
     struct rule_t *next;
 } RULE;
 
@@ -205,6 +248,22 @@ typedef struct rulelist_t
     struct rulelist_t* next; /*< Next node in the list */
 } RULELIST;
 
+/**
+ * The rules of a match-any list that are checked together. The regex rules
+ * are combined into one pattern where each alternative sets a mark with the
+ * index of its rule and the column names are kept in a hashtable, so the
+ * cost of a query does not depend on the number of these rules. Only rules
+ * that are always active and apply to all query types are combined.
+ */
+typedef struct fw_matcher
+{
+    pcre2_code* regex; /*< The combined regex rules */
+    RULE** regex_rules; /*< The rule of each alternative of the pattern */
+    STRHASH* columns; /*< Lowercase column names mapped to their rules */
+    RULE* first; /*< The rule that a parse error is reported for */
+    RULELIST* rest; /*< The rules that are checked one by one */
+} FW_MATCHER;
+
 typedef struct user_template
 {
     char *name;
@@ -222,7 +281,7 @@ typedef struct user_t
     RULELIST* rules_and; /*< All of these rules must match for the action to trigger */
     RULELIST* rules_strict_and; /*< rules that skip the rest of the rules if one of them
                  * fails. This is only for rules paired with 'match strict_all'. */
-
+    FW_MATCHER* matcher; /*< Combined matcher for rules_or, NULL if not used */
 } USER;
 
 /**
@@ -260,7 +319,7 @@ enum fw_actions
  */
 typedef struct
 {
-    HASHTABLE* htable; /*< User hashtable */
+    STRHASH* htable; /*< User hashtable */
     RULE* rules; /*< List of all the rules */
     STRLINK* userstrings; /*< Temporary list of raw strings of users */
     enum fw_actions action; /*< Default operation mode, defaults to deny */
@@ -272,10 +331,18 @@ typedef struct
 /**
  * The session structure for Firewall filter.
  */
+typedef struct bucket_ref
+{
+    USER_LIMIT* limit; /*< The rule */
+    USER_BUCKET* bucket; /*< Bucket of the client */
+    struct bucket_ref* next;
+} BUCKET_REF;
+
 typedef struct
 {
     SESSION* session; /*< Client session structure */
     char* errmsg; /*< Rule specific error message */
+    BUCKET_REF* buckets; /*< Buckets of the limit_user_queries rules */
     DOWNSTREAM down; /*< Next object in the downstream chain */
     UPSTREAM up; /*< Next object in the upstream chain */
 } FW_SESSION;
@@ -407,10 +474,26 @@ static void* rulelist_free(void* fval)
     return NULL;
 }
 
+static void matcher_free(FW_MATCHER* matcher)
+{
+    if (matcher)
+    {
+        pcre2_code_free(matcher->regex);
+        free(matcher->regex_rules);
+        if (matcher->columns)
+        {
+            strhash_free(matcher->columns);
+        }
+        rulelist_free(matcher->rest);
+        free(matcher);
+    }
+}
+
 static void* huserfree(void* fval)
 {
     USER* value = (USER*) fval;
 
+    matcher_free(value->matcher);
     rulelist_free(value->rules_and);
     rulelist_free(value->rules_or);
     rulelist_free(value->rules_strict_and);
@@ -721,7 +804,7 @@ static bool apply_rule_to_user(FW_INSTANCE *instance, char *username,
 {
     USER* user;
     ss_dassert(type == FWTOK_MATCH_ANY || type == FWTOK_MATCH_STRICT_ALL || type == FWTOK_MATCH_ALL);
-    if ((user = (USER*) hashtable_fetch(instance->htable, username)) == NULL)
+    if ((user = (USER*) strhash_fetch(instance->htable, username)) == NULL)
     {
         /**New user*/
         if ((user = (USER*) calloc(1, sizeof(USER))) == NULL)
@@ -757,7 +840,7 @@ static bool apply_rule_to_user(FW_INSTANCE *instance, char *username,
             user->rules_and = tl;
             break;
     }
-    hashtable_add(instance->htable, (void *) username, (void *) user);
+    strhash_add(instance->htable, (void *) username, (void *) user);
     return true;
 }
 
@@ -886,6 +969,7 @@ bool create_rule(void* scanner, const char* name)
         ruledef->active = NULL;
         ruledef->times_matched = 0;
         ruledef->data = NULL;
+        ruledef->pattern = NULL;
         rstack->rule = ruledef;
     }
     else
@@ -924,6 +1008,11 @@ static void free_rules(RULE* rule)
                 free(rule->data);
                 break;
 
+            case RT_USER_THROTTLE:
+                strhash_free(((USER_LIMIT*) rule->data)->buckets);
+                free(rule->data);
+                break;
+
             case RT_REGEX:
                 pcre2_code_free((pcre2_code*) rule->data);
                 break;
@@ -932,6 +1021,7 @@ static void free_rules(RULE* rule)
                 break;
         }
 
+        free(rule->pattern);
         free(rule->name);
         rule = tmp;
     }
@@ -1161,6 +1251,63 @@ bool define_limit_queries_rule(void* scanner, int max, int timeperiod, int holdo
     return qs != NULL;
 }
 
+static void* user_bucket_free(void* fval)
+{
+    USER_BUCKET* bucket = (USER_BUCKET*) fval;
+
+    if (bucket)
+    {
+        free(bucket->shards);
+        free(bucket);
+    }
+
+    return NULL;
+}
+
+/**
+ * Define the topmost rule as a limit_user_queries rule
+ * @param scanner Current scanner
+ * @param rate Queries per second
+ * @param burst Number of queries that can be done at once
+ */
+bool define_limit_user_queries_rule(void* scanner, int rate, int burst)
+{
+    struct parser_stack* rstack = dbfw_yyget_extra((yyscan_t) scanner);
+    ss_dassert(rstack);
+
+    if (rate <= 0 || burst <= 0 || burst > INT32_MAX / 10)
+    {
+        MXS_ERROR("dbfwfilter: Invalid limit_user_queries rule, the rate and the "
+                  "burst must be positive and the burst less than %d.", INT32_MAX / 10);
+        return false;
+    }
+
+    USER_LIMIT* limit = calloc(1, sizeof(USER_LIMIT));
+
+    if (limit == NULL || (limit->buckets = strhash_alloc(64, user_bucket_free)) == NULL)
+    {
+        MXS_ERROR("dbfwfilter: Memory allocation failed when adding limit_user_queries rule.");
+        free(limit);
+        return false;
+    }
+
+    limit->rate = rate;
+    limit->burst = burst;
+    limit->n_threads = config_max_threadcount();
+
+    /** A thread takes at most its share of the tokens added in one heartbeat */
+    limit->batch = MIN(rate / 10, burst) / limit->n_threads;
+    if (limit->batch < 1)
+    {
+        limit->batch = 1;
+    }
+
+    spinlock_init(&limit->lock);
+    rstack->rule->type = RT_USER_THROTTLE;
+    rstack->rule->data = limit;
+    return true;
+}
+
 /**
  * Define the topmost rule as a regex rule
  * @param scanner Current scanner
@@ -1169,18 +1316,18 @@ bool define_limit_queries_rule(void* scanner, int max, int timeperiod, int holdo
 bool define_regex_rule(void* scanner, char* pattern)
 {
     /** This should never fail as long as the rule syntax is correct */
-    PCRE2_SPTR start = (PCRE2_SPTR) get_regex_string(&pattern);
+    const char *start = get_regex_string(&pattern);
     ss_dassert(start);
     pcre2_code *re;
     int err;
     size_t offset;
-    if ((re = pcre2_compile(start, PCRE2_ZERO_TERMINATED,
-                            0, &err, &offset, NULL)))
+    if ((re = mxs_pcre2_compile(start, 0, &err, &offset)))
     {
         struct parser_stack* rstack = dbfw_yyget_extra((yyscan_t) scanner);
         ss_dassert(rstack);
         rstack->rule->type = RT_REGEX;
         rstack->rule->data = (void*) re;
+        rstack->rule->pattern = strdup(start);
     }
     else
     {
@@ -1193,6 +1340,149 @@ bool define_regex_rule(void* scanner, char* pattern)
     return re != NULL;
 }
 
+/**
+ * Check if a rule can be checked by the combined matcher
+ * @param rule The rule
+ * @return True if the rule can be combined
+ */
+static bool rule_is_combinable(RULE* rule)
+{
+    uint32_t backrefs = 0;
+
+    if (rule->active || rule->on_queries != QUERY_OP_UNDEFINED)
+    {
+        return false;
+    }
+
+    switch (rule->type)
+    {
+        case RT_COLUMN:
+            return true;
+
+        case RT_REGEX:
+            /** The numbers of the groups change when the patterns are combined */
+            pcre2_pattern_info((pcre2_code*) rule->data, PCRE2_INFO_BACKREFMAX, &backrefs);
+            return rule->pattern && backrefs == 0;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * Create the combined matcher of a match-any rule list
+ *
+ * @param rules The rules of the user
+ * @return The matcher or NULL if it would not make the matching faster or
+ * could not be created, in which case the rules are checked one by one
+ */
+static FW_MATCHER* matcher_create(RULELIST* rules)
+{
+    FW_MATCHER* matcher;
+    RULELIST** rest;
+    size_t pattern_len = 1;
+    int n_regex = 0;
+    int n_combined = 0;
+
+    for (RULELIST* node = rules; node; node = node->next)
+    {
+        if (rule_is_combinable(node->rule))
+        {
+            n_combined++;
+
+            if (node->rule->type == RT_REGEX)
+            {
+                n_regex++;
+                pattern_len += strlen(node->rule->pattern) + 32;
+            }
+        }
+    }
+
+    if (n_combined < 2 || (matcher = calloc(1, sizeof(FW_MATCHER))) == NULL)
+    {
+        return NULL;
+    }
+
+    char pattern[pattern_len];
+    char* ptr = pattern;
+    *ptr = '\0';
+
+    if ((n_regex && (matcher->regex_rules = calloc(n_regex, sizeof(RULE*))) == NULL) ||
+        (n_combined > n_regex && (matcher->columns = strhash_alloc(16, NULL)) == NULL))
+    {
+        matcher_free(matcher);
+        return NULL;
+    }
+
+    n_regex = 0;
+    rest = &matcher->rest;
+
+    for (RULELIST* node = rules; node; node = node->next)
+    {
+        RULE* rule = node->rule;
+
+        if (!rule_is_combinable(rule))
+        {
+            if ((*rest = calloc(1, sizeof(RULELIST))) == NULL)
+            {
+                matcher_free(matcher);
+                return NULL;
+            }
+            (*rest)->rule = rule;
+            rest = &(*rest)->next;
+            continue;
+        }
+
+        if (matcher->first == NULL)
+        {
+            matcher->first = rule;
+        }
+
+        if (rule->type == RT_REGEX)
+        {
+            ptr += sprintf(ptr, "%s(?:%s)(*MARK:%d)", n_regex ? "|" : "",
+                           rule->pattern, n_regex);
+            matcher->regex_rules[n_regex++] = rule;
+        }
+        else
+        {
+            for (STRLINK* col = (STRLINK*) rule->data; col; col = col->next)
+            {
+                char name[strlen(col->value) + 1];
+
+                for (int i = 0; i <= strlen(col->value); i++)
+                {
+                    name[i] = tolower(col->value[i]);
+                }
+
+                /** The first rule in the list is reported like before */
+                if (strhash_fetch(matcher->columns, name) == NULL)
+                {
+                    strhash_add(matcher->columns, name, rule);
+                }
+            }
+        }
+    }
+
+    if (n_regex)
+    {
+        int err;
+        size_t offset;
+
+        if ((matcher->regex = mxs_pcre2_compile(pattern, 0, &err, &offset)) == NULL)
+        {
+            PCRE2_UCHAR errbuf[STRERROR_BUFLEN];
+            pcre2_get_error_message(err, errbuf, sizeof(errbuf));
+            MXS_INFO("dbfwfilter: The regex rules could not be combined, they are "
+                     "checked one by one: %s", errbuf);
+            matcher_free(matcher);
+            return NULL;
+        }
+    }
+
+    return matcher;
+}
+
 /**
  * @brief Find a rule by name
  *
@@ -1226,6 +1516,7 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
                                    RULE* rules)
 {
     bool rval = true;
+    user_template_t *head = templates;
 
     if (templates == NULL)
     {
@@ -1235,17 +1526,14 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
 
     while (templates)
     {
-        USER *user = hashtable_fetch(instance->htable, templates->name);
+        USER *user = strhash_fetch(instance->htable, templates->name);
 
         if (user == NULL)
         {
-            if ((user = malloc(sizeof(USER))) && (user->name = strdup(templates->name)))
+            if ((user = calloc(1, sizeof(USER))) && (user->name = strdup(templates->name)))
             {
-                user->rules_and = NULL;
-                user->rules_or = NULL;
-                user->rules_strict_and = NULL;
                 spinlock_init(&user->lock);
-                hashtable_add(instance->htable, user->name, user);
+                strhash_add(instance->htable, user->name, user);
             }
             else
             {
@@ -1303,6 +1591,16 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
         templates = templates->next;
     }
 
+    for (user_template_t *tmpl = head; rval && tmpl; tmpl = tmpl->next)
+    {
+        USER *user = strhash_fetch(instance->htable, tmpl->name);
+
+        if (user && user->matcher == NULL)
+        {
+            user->matcher = matcher_create(user->rules_or);
+        }
+    }
+
     return rval;
 }
 
@@ -1378,7 +1676,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 {
     FW_INSTANCE *my_instance;
     int i;
-    HASHTABLE* ht;
+    STRHASH* ht;
     char *filename = NULL;
     bool err = false;
 
@@ -1391,15 +1689,13 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
     spinlock_init(&my_instance->lock);
 
-    if ((ht = hashtable_alloc(100, simple_str_hash, strcmp)) == NULL)
+    if ((ht = strhash_alloc(100, huserfree)) == NULL)
     {
         MXS_ERROR("Unable to allocate hashtable.");
         free(my_instance);
         return NULL;
     }
 
-    hashtable_memory_fns(ht, (HASHMEMORYFN) strdup, NULL, (HASHMEMORYFN) free, huserfree);
-
     my_instance->htable = ht;
     my_instance->action = FW_ACTION_BLOCK;
     my_instance->log_match = FW_LOG_NONE;
@@ -1458,7 +1754,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
     if (err || !process_rule_file(filename, my_instance))
     {
-        hashtable_free(my_instance->htable);
+        strhash_free(my_instance->htable);
         free(my_instance);
         my_instance = NULL;
     }
@@ -1512,6 +1808,12 @@ freeSession(FILTER *instance, void *session)
     {
         free(my_session->errmsg);
     }
+    while (my_session->buckets)
+    {
+        BUCKET_REF *ref = my_session->buckets;
+        my_session->buckets = ref->next;
+        free(ref);
+    }
     free(my_session);
 }
 
@@ -1694,6 +1996,179 @@ static char* create_parse_error(FW_INSTANCE* my_instance,
     return msg;
 }
 
+/**
+ * Take tokens from a bucket
+ *
+ * The bucket is first refilled with the tokens accumulated since the last
+ * refill. This never blocks; if another thread updated the bucket at the same
+ * time, the update is retried with the new state.
+ *
+ * @param limit The rule
+ * @param bucket The bucket
+ * @param tokens Number of tokens wanted
+ * @return Number of tokens taken, less than @c tokens if the bucket ran out
+ */
+static int bucket_take(USER_LIMIT* limit, USER_BUCKET* bucket, int tokens)
+{
+    uint32_t now = (uint32_t) hkheartbeat;
+    uint64_t capacity = (uint64_t) limit->burst * 10;
+    uint64_t old_state, new_state;
+    int taken;
+
+    do
+    {
+        old_state = bucket->state;
+        uint32_t elapsed = now - (uint32_t)(old_state >> 32);
+        uint64_t tenths = (old_state & 0xffffffff) + (uint64_t) elapsed * limit->rate;
+
+        if (tenths > capacity)
+        {
+            tenths = capacity;
+        }
+
+        taken = MIN(tokens, tenths / 10);
+        new_state = ((uint64_t) now << 32) | (tenths - taken * 10);
+    }
+    while (!__sync_bool_compare_and_swap(&bucket->state, old_state, new_state));
+
+    return taken;
+}
+
+/**
+ * Return unused tokens to a bucket
+ * @param limit The rule
+ * @param bucket The bucket
+ * @param tokens Number of tokens to return
+ */
+static void bucket_return(USER_LIMIT* limit, USER_BUCKET* bucket, int tokens)
+{
+    uint64_t capacity = (uint64_t) limit->burst * 10;
+    uint64_t old_state, new_state;
+
+    do
+    {
+        old_state = bucket->state;
+        uint64_t tenths = (old_state & 0xffffffff) + (uint64_t) tokens * 10;
+
+        if (tenths > capacity)
+        {
+            tenths = capacity;
+        }
+
+        new_state = (old_state & 0xffffffff00000000) | tenths;
+    }
+    while (!__sync_bool_compare_and_swap(&bucket->state, old_state, new_state));
+}
+
+/**
+ * Find the bucket of the client of a session, creating it if needed
+ *
+ * The bucket is looked up from the rule only once per session.
+ *
+ * @param my_session Fwfilter session
+ * @param limit The rule
+ * @return The bucket or NULL if memory allocation failed
+ */
+static USER_BUCKET* session_bucket(FW_SESSION* my_session, USER_LIMIT* limit)
+{
+    for (BUCKET_REF* ref = my_session->buckets; ref; ref = ref->next)
+    {
+        if (ref->limit == limit)
+        {
+            return ref->bucket;
+        }
+    }
+
+    DCB* dcb = my_session->session->client_dcb;
+    char key[strlen(dcb->user) + strlen(dcb->remote) + 2];
+    sprintf(key, "%s@%s", dcb->user, dcb->remote);
+
+    BUCKET_REF* ref = malloc(sizeof(BUCKET_REF));
+
+    if (ref == NULL)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&limit->lock);
+    USER_BUCKET* bucket = strhash_fetch(limit->buckets, key);
+
+    if (bucket == NULL && (bucket = malloc(sizeof(USER_BUCKET))))
+    {
+        bucket->state = ((uint64_t)(uint32_t) hkheartbeat << 32) | ((uint64_t) limit->burst * 10);
+
+        if ((bucket->shards = calloc(limit->n_threads, sizeof(USER_BUCKET_SHARD))) == NULL ||
+            !strhash_add(limit->buckets, key, bucket))
+        {
+            user_bucket_free(bucket);
+            bucket = NULL;
+        }
+    }
+    spinlock_release(&limit->lock);
+
+    if (bucket == NULL)
+    {
+        free(ref);
+        return NULL;
+    }
+
+    ref->limit = limit;
+    ref->bucket = bucket;
+    ref->next = my_session->buckets;
+    my_session->buckets = ref;
+
+    return bucket;
+}
+
+/**
+ * Consume one token from the bucket of the client
+ *
+ * Each thread takes tokens from the shared bucket in batches and consumes
+ * them from its own shard, so most queries do not touch the shared state.
+ * Tokens left in a shard from an earlier heartbeat are returned to the
+ * bucket before new ones are taken, which keeps idle threads from holding
+ * on to them.
+ *
+ * @param my_session Fwfilter session
+ * @param limit The rule
+ * @return True if the client was within its rate
+ */
+static bool user_limit_consume(FW_SESSION* my_session, USER_LIMIT* limit)
+{
+    USER_BUCKET* bucket = session_bucket(my_session, limit);
+
+    if (bucket == NULL)
+    {
+        /** Don't block queries because of an internal error */
+        return true;
+    }
+
+    USER_BUCKET_SHARD* shard = &bucket->shards[poll_current_thread() % limit->n_threads];
+
+    if (shard->tick != hkheartbeat)
+    {
+        if (shard->tokens > 0)
+        {
+            bucket_return(limit, bucket, shard->tokens);
+        }
+        shard->tokens = 0;
+        shard->tick = hkheartbeat;
+    }
+
+    if (shard->tokens == 0)
+    {
+        shard->tokens = bucket_take(limit, bucket, limit->batch);
+    }
+
+    if (shard->tokens > 0)
+    {
+        shard->tokens--;
+        return true;
+    }
+
+    return false;
+}
+
 /**
  * Check if a query matches a single rule
  * @param my_instance Fwfilter instance
@@ -1708,7 +2183,7 @@ bool rule_matches(FW_INSTANCE* my_instance,
                   GWBUF *queue,
                   USER* user,
                   RULELIST *rulelist,
-                  char* query)
+                  const char* query)
 {
     char *ptr, *where, *msg = NULL;
     char emsg[512];
@@ -1785,26 +2260,17 @@ bool rule_matches(FW_INSTANCE* my_instance,
             case RT_REGEX:
                 if (query)
                 {
-                    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(
-                                                  rulelist->rule->data, NULL);
+                    int rc = mxs_pcre2_match((pcre2_code*) rulelist->rule->data,
+                                             query, PCRE2_ZERO_TERMINATED);
 
-                    if (mdata)
+                    if (rc > 0)
                     {
-                        if (pcre2_match((pcre2_code*) rulelist->rule->data,
-                                        (PCRE2_SPTR) query, PCRE2_ZERO_TERMINATED,
-                                        0, 0, mdata, NULL) > 0)
-                        {
-                            matches = true;
-                        }
-                        pcre2_match_data_free(mdata);
-                        if (matches)
-                        {
-                            msg = strdup("Permission denied, query matched regular expression.");
-                            MXS_INFO("dbfwfilter: rule '%s': regex matched on query", rulelist->rule->name);
-                            goto queryresolved;
-                        }
+                        matches = true;
+                        msg = strdup("Permission denied, query matched regular expression.");
+                        MXS_INFO("dbfwfilter: rule '%s': regex matched on query", rulelist->rule->name);
+                        goto queryresolved;
                     }
-                    else
+                    else if (rc == PCRE2_ERROR_NOMEMORY)
                     {
                         MXS_ERROR("Allocation of matching data for PCRE2 failed."
                                   " This is most likely caused by a lack of memory");
@@ -1967,6 +2433,18 @@ bool rule_matches(FW_INSTANCE* my_instance,
                 }
                 break;
 
+            case RT_USER_THROTTLE:
+                if (!user_limit_consume(my_session, (USER_LIMIT*) rulelist->rule->data))
+                {
+                    USER_LIMIT* limit = (USER_LIMIT*) rulelist->rule->data;
+                    matches = true;
+                    sprintf(emsg, "Query rate limit of %d queries per second exceeded.", limit->rate);
+                    MXS_INFO("dbfwfilter: rule '%s': query rate limit of user exceeded.",
+                             rulelist->rule->name);
+                    msg = strdup(emsg);
+                }
+                break;
+
             case RT_CLAUSE:
                 if (is_sql && is_real &&
                     !qc_query_has_clause(queue))
@@ -2003,6 +2481,132 @@ queryresolved:
     return matches;
 }
 
+/**
+ * Check if a query matches any of the rules of a combined matcher
+ * @param my_instance Fwfilter instance
+ * @param my_session Fwfilter session
+ * @param queue The GWBUF containing the query
+ * @param matcher The matcher to check
+ * @param query Pointer to the null-terminated query string
+ * @param matched The rule that matched is stored here
+ * @return true if the query matches one of the rules
+ */
+static bool matcher_matches(FW_INSTANCE* my_instance,
+                            FW_SESSION* my_session,
+                            GWBUF *queue,
+                            FW_MATCHER* matcher,
+                            const char* query,
+                            RULE** matched)
+{
+    char *msg = NULL;
+    char emsg[512];
+    bool is_sql, is_real = false, matches = false;
+    qc_parse_result_t parse_result = QC_QUERY_PARSED;
+    qc_query_op_t optype = QUERY_OP_UNDEFINED;
+
+    *matched = matcher->first;
+    is_sql = modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue);
+
+    if (is_sql)
+    {
+        parse_result = qc_parse(queue);
+
+        if (parse_result == QC_QUERY_INVALID)
+        {
+            msg = create_parse_error(my_instance, "tokenized", query, &matches);
+            goto queryresolved;
+        }
+
+        optype = qc_get_operation(queue);
+        is_real = qc_is_real_query(queue);
+    }
+
+    if (matcher->regex && query)
+    {
+        pcre2_match_data *mdata = mxs_pcre2_match_data(matcher->regex);
+        int rc = PCRE2_ERROR_NOMEMORY;
+
+        if (mdata)
+        {
+            rc = pcre2_match(matcher->regex, (PCRE2_SPTR) query, PCRE2_ZERO_TERMINATED,
+                             0, 0, mdata, mxs_pcre2_match_context());
+        }
+
+        if (rc >= 0)
+        {
+            *matched = matcher->regex_rules[atoi((const char*) pcre2_get_mark(mdata))];
+            matches = true;
+            msg = strdup("Permission denied, query matched regular expression.");
+            MXS_INFO("dbfwfilter: rule '%s': regex matched on query", (*matched)->name);
+            goto queryresolved;
+        }
+        else if (rc == PCRE2_ERROR_NOMEMORY)
+        {
+            MXS_ERROR("Allocation of matching data for PCRE2 failed."
+                      " This is most likely caused by a lack of memory");
+        }
+    }
+
+    if (matcher->columns && is_sql && is_real)
+    {
+        char *where;
+
+        if (parse_result != QC_QUERY_PARSED &&
+            (optype == QUERY_OP_SELECT || optype == QUERY_OP_UPDATE ||
+             optype == QUERY_OP_INSERT || optype == QUERY_OP_DELETE))
+        {
+            // The affected fields can't be trusted unless the query was parsed completely.
+            msg = create_parse_error(my_instance, "parsed completely", query, &matches);
+            goto queryresolved;
+        }
+
+        if ((where = qc_get_affected_fields(queue)) != NULL)
+        {
+            char* saveptr;
+            char* tok = strtok_r(where, " ,", &saveptr);
+
+            while (tok)
+            {
+                char name[strlen(tok) + 1];
+
+                for (int i = 0; i <= strlen(tok); i++)
+                {
+                    name[i] = tolower(tok[i]);
+                }
+
+                RULE* rule = (RULE*) strhash_fetch(matcher->columns, name);
+
+                if (rule)
+                {
+                    matches = true;
+                    *matched = rule;
+                    snprintf(emsg, sizeof(emsg), "Permission denied to column '%s'.", tok);
+                    MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
+                             rule->name, tok);
+                    msg = strdup(emsg);
+                    break;
+                }
+                tok = strtok_r(NULL, " ,", &saveptr);
+            }
+            free(where);
+        }
+    }
+
+queryresolved:
+    if (msg)
+    {
+        free(my_session->errmsg);
+        my_session->errmsg = msg;
+    }
+
+    if (matches)
+    {
+        (*matched)->times_matched++;
+    }
+
+    return matches;
+}
+
 /**
  * Check if the query matches any of the rules in the user's rulelist.
  * @param my_instance Fwfilter instance
@@ -2021,7 +2625,21 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
         (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue) ||
          MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue))))
     {
-        char *fullquery = modutil_get_SQL(queue);
+        const char *fullquery = modutil_get_SQL_string(queue);
+
+        if (user->matcher)
+        {
+            RULE* rule;
+
+            if (matcher_matches(my_instance, my_session, queue, user->matcher, fullquery, &rule))
+            {
+                *rulename = strdup(rule->name);
+                return true;
+            }
+
+            rulelist = user->matcher->rest;
+        }
+
         while (rulelist)
         {
             if (!rule_is_active(rulelist->rule))
@@ -2037,8 +2655,6 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             }
             rulelist = rulelist->next;
         }
-
-        free(fullquery);
     }
     return rval;
 }
@@ -2098,7 +2714,7 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
 
     if (rulelist && (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue)))
     {
-        char *fullquery = modutil_get_SQL(queue);
+        const char *fullquery = modutil_get_SQL_string(queue);
         rval = true;
         while (rulelist)
         {
@@ -2131,7 +2747,6 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             /** No active rules */
             rval = false;
         }
-        free(fullquery);
     }
 
     /** Set the list of matched rule names */
@@ -2148,17 +2763,17 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
  * @param remote Remove network address
  * @return The user data or NULL if it was not found
  */
-USER* find_user_data(HASHTABLE *hash, const char *name, const char *remote)
+USER* find_user_data(STRHASH *hash, const char *name, const char *remote)
 {
     char nameaddr[strlen(name) + strlen(remote) + 2];
     snprintf(nameaddr, sizeof(nameaddr), "%s@%s", name, remote);
-    USER* user = (USER*) hashtable_fetch(hash, nameaddr);
+    USER* user = (USER*) strhash_fetch(hash, nameaddr);
     if (user == NULL)
     {
         char *ip_start = strchr(nameaddr, '@') + 1;
         while (user == NULL && next_ip_class(ip_start))
         {
-            user = (USER*) hashtable_fetch(hash, nameaddr);
+            user = (USER*) strhash_fetch(hash, nameaddr);
         }
 
         if (user == NULL)
@@ -2167,7 +2782,7 @@ USER* find_user_data(HASHTABLE *hash, const char *name, const char *remote)
             ip_start = strchr(nameaddr, '@') + 1;
             while (user == NULL && next_ip_class(ip_start))
             {
-                user = (USER*) hashtable_fetch(hash, nameaddr);
+                user = (USER*) strhash_fetch(hash, nameaddr);
             }
         }
     }
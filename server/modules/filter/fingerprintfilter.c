@@ -0,0 +1,687 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file fingerprintfilter.c - Route statements to servers by their fingerprint
+ *
+ * The fingerprint of a statement is the 64-bit hash of its canonical form,
+ * the same hash that show slowqueries prints. The filter keeps a table of
+ * fingerprints and the servers the statements with them are routed to. Each
+ * statement is canonicalized in one pass into a buffer on the stack and the
+ * table is a hashtable that the polling threads read without locking, so the
+ * cost of a statement does not depend on the number of rules.
+ *
+ * The table is loaded from the rules file when the filter is created and can
+ * be changed at runtime with the add fingerprint and remove fingerprint
+ * commands of maxadmin. The changes made with maxadmin are not written to the
+ * rules file.
+ *
+ * @verbatim
+ * The parameters for this filter are:
+ *
+ *      rules       The file of the rules, one "<fingerprint> <server>" per line
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <hashtable.h>
+#include <hint.h>
+#include <server.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_EXPERIMENTAL,
+    FILTER_VERSION,
+    "A routing hint filter that directs statements by their fingerprint"
+};
+
+static char *version_str = "V1.0.0";
+
+/** Initial size of the table of rules, it grows as rules are added */
+#define FINGERPRINT_TABLE_SIZE 64
+
+/** Statements up to this long are canonicalized into a buffer on the stack */
+#define FINGERPRINT_STACK_LEN 4096
+
+/** Number of hexadecimal digits in a fingerprint */
+#define FINGERPRINT_DIGITS 16
+#define FINGERPRINT_XDIGITS "0123456789abcdefABCDEF"
+
+static FILTER *createInstance(char **options, FILTER_PARAMETER **params);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getCapabilities(void);
+static bool command(FILTER *instance, DCB *dcb, const char *cmd, const char *arg1, const char *arg2);
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    NULL, // No Upstream requirement
+    routeQuery,
+    NULL,
+    diagnostic,
+    getCapabilities,
+    command,
+};
+
+/**
+ * The target of a fingerprint, the value of the table of rules
+ */
+typedef struct
+{
+    SERVER *server; /* The server if it was found when the rule was added */
+    int hits; /* Statements routed by the rule */
+    char name[]; /* Name of the server */
+} FINGERPRINT_TARGET;
+
+/**
+ * Instance structure
+ */
+typedef struct
+{
+    char *rules; /* The rules file */
+    HASHTABLE *table; /* Fingerprint to FINGERPRINT_TARGET */
+    SPINLOCK lock; /* Serializes the changes of the table */
+    int n_rules; /* Number of rules in the table */
+} FINGERPRINT_INSTANCE;
+
+/**
+ * The session structure for this filter
+ */
+typedef struct
+{
+    DOWNSTREAM down; /* The downstream filter */
+    int n_diverted; /* No. of statements diverted */
+    int n_undiverted; /* No. of statements not diverted */
+} FINGERPRINT_SESSION;
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ * @see function load_module in load_utils.c for explanation of lint
+ */
+/*lint -e14 */
+void
+ModuleInit()
+{
+}
+/*lint +e14 */
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+static int
+fingerprint_hash(void *key)
+{
+    uint64_t fp = *(uint64_t *)key;
+    return (int)(fp ^ (fp >> 32)) & INT_MAX;
+}
+
+static int
+fingerprint_cmp(void *key1, void *key2)
+{
+    return *(uint64_t *)key1 != *(uint64_t *)key2;
+}
+
+static void *
+fingerprint_copy(void *key)
+{
+    uint64_t *fp = malloc(sizeof(uint64_t));
+
+    if (fp)
+    {
+        *fp = *(uint64_t *)key;
+    }
+    return fp;
+}
+
+/**
+ * Parse a fingerprint. A string of 16 hexadecimal digits is the fingerprint
+ * itself, anything else is taken to be an example statement whose fingerprint
+ * is computed. Any 64-bit value is a valid fingerprint, including 0.
+ *
+ * @param str The fingerprint or the statement
+ * @param fp  Set to the fingerprint
+ * @return True if the fingerprint was parsed, false if the statement is empty
+ * or there was not enough memory to canonicalize it
+ */
+static bool
+fingerprint_parse(const char *str, uint64_t *fp)
+{
+    size_t len = strlen(str);
+    bool rval = false;
+
+    if (len == FINGERPRINT_DIGITS && strspn(str, FINGERPRINT_XDIGITS) == FINGERPRINT_DIGITS)
+    {
+        *fp = strtoull(str, NULL, 16);
+        rval = true;
+    }
+    else
+    {
+        char *canonical = malloc(CANONICAL_SQL_SIZE(len));
+
+        if (canonical)
+        {
+            /** A statement of only whitespace and comments has no fingerprint */
+            rval = canonicalize_sql(str, len, canonical, fp) > 0;
+            free(canonical);
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * Add a rule or replace the server of an existing one
+ *
+ * @param my_instance The filter instance
+ * @param fp          The fingerprint
+ * @param name        The name of the server
+ * @return True if the rule was added
+ */
+static bool
+fingerprint_add(FINGERPRINT_INSTANCE *my_instance, uint64_t fp, const char *name)
+{
+    FINGERPRINT_TARGET *target = malloc(sizeof(FINGERPRINT_TARGET) + strlen(name) + 1);
+
+    if (target == NULL)
+    {
+        return false;
+    }
+
+    target->server = server_find_by_unique_name((char *)name);
+    target->hits = 0;
+    strcpy(target->name, name);
+
+    spinlock_acquire(&my_instance->lock);
+    bool exists = hashtable_fetch(my_instance->table, &fp) != NULL;
+    bool added = hashtable_replace(my_instance->table, &fp, target) != 0;
+
+    if (added && !exists)
+    {
+        my_instance->n_rules++;
+    }
+    spinlock_release(&my_instance->lock);
+
+    if (!added)
+    {
+        free(target);
+    }
+
+    return added;
+}
+
+/**
+ * Remove a rule
+ *
+ * @param my_instance The filter instance
+ * @param fp          The fingerprint
+ * @return True if there was a rule for the fingerprint
+ */
+static bool
+fingerprint_remove(FINGERPRINT_INSTANCE *my_instance, uint64_t fp)
+{
+    spinlock_acquire(&my_instance->lock);
+    bool removed = hashtable_delete(my_instance->table, &fp) != 0;
+
+    if (removed)
+    {
+        my_instance->n_rules--;
+    }
+    spinlock_release(&my_instance->lock);
+
+    return removed;
+}
+
+/**
+ * Load the rules file. Each line holds a fingerprint of 16 hexadecimal
+ * digits and the name of a server, separated by whitespace. Empty lines and
+ * lines starting with # are ignored.
+ *
+ * @param my_instance The filter instance
+ * @return True if the file was loaded
+ */
+static bool
+fingerprint_load(FINGERPRINT_INSTANCE *my_instance)
+{
+    FILE *file = fopen(my_instance->rules, "r");
+    char errbuf[STRERROR_BUFLEN];
+    char line[1024];
+    int lineno = 0;
+    bool rval = true;
+
+    if (file == NULL)
+    {
+        MXS_ERROR("fingerprintfilter: Failed to open the rules file '%s': %d, %s",
+                  my_instance->rules, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    while (rval && fgets(line, sizeof(line), file))
+    {
+        char fpstr[FINGERPRINT_DIGITS + 1];
+        char name[sizeof(line)];
+        char extra;
+        int n = sscanf(line, " %16s %1023s %c", fpstr, name, &extra);
+
+        lineno++;
+
+        if (n <= 0 || fpstr[0] == '#')
+        {
+            continue;
+        }
+
+        if (n != 2 || strlen(fpstr) != FINGERPRINT_DIGITS ||
+            strspn(fpstr, FINGERPRINT_XDIGITS) != FINGERPRINT_DIGITS)
+        {
+            MXS_ERROR("fingerprintfilter: Line %d of '%s' is not a fingerprint of %d "
+                      "hexadecimal digits followed by a server name.",
+                      lineno, my_instance->rules, FINGERPRINT_DIGITS);
+            rval = false;
+        }
+        else if (!fingerprint_add(my_instance, strtoull(fpstr, NULL, 16), name))
+        {
+            rval = false;
+        }
+        else if (server_find_by_unique_name(name) == NULL)
+        {
+            MXS_WARNING("fingerprintfilter: Server '%s' on line %d of '%s' was not found, "
+                        "it is looked up by name for each matching statement.",
+                        name, lineno, my_instance->rules);
+        }
+    }
+
+    fclose(file);
+    return rval;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    FINGERPRINT_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(FINGERPRINT_INSTANCE))) != NULL)
+    {
+        bool error = false;
+
+        spinlock_init(&my_instance->lock);
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "rules"))
+            {
+                free(my_instance->rules);
+                my_instance->rules = strdup(params[i]->value);
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("fingerprintfilter: Unexpected parameter '%s'.",
+                          params[i]->name);
+                error = true;
+            }
+        }
+
+        if (options && options[0])
+        {
+            MXS_ERROR("fingerprintfilter: Unsupported option '%s'.", options[0]);
+            error = true;
+        }
+
+        if (!error)
+        {
+            if ((my_instance->table = hashtable_alloc(FINGERPRINT_TABLE_SIZE, fingerprint_hash,
+                                                      fingerprint_cmp)) == NULL)
+            {
+                error = true;
+            }
+            else
+            {
+                hashtable_memory_fns(my_instance->table, fingerprint_copy, NULL,
+                                     (HASHMEMORYFN)free, (HASHMEMORYFN)free);
+                hashtable_enable_resize(my_instance->table);
+            }
+        }
+
+        if (!error && my_instance->rules && !fingerprint_load(my_instance))
+        {
+            error = true;
+        }
+
+        if (error)
+        {
+            if (my_instance->table)
+            {
+                hashtable_free(my_instance->table);
+            }
+            free(my_instance->rules);
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    FINGERPRINT_SESSION *my_session;
+
+    if ((my_session = session_arena_alloc(session, sizeof(FINGERPRINT_SESSION))) != NULL)
+    {
+        my_session->n_diverted = 0;
+        my_session->n_undiverted = 0;
+    }
+
+    return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+/**
+ * Free the memory associated with this filter session. The filter session
+ * lives in the memory of the client session and is taken back with it.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    return;
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ * @param downstream    The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    FINGERPRINT_SESSION *my_session = (FINGERPRINT_SESSION *) session;
+    my_session->down = *downstream;
+}
+
+/**
+ * The routeQuery entry point. This is passed the query buffer
+ * to which the filter should be applied. Once applied the
+ * query should normally be passed to the downstream component
+ * (filter or router) in the filter chain.
+ *
+ * If the table has a rule for the fingerprint of the statement, add the hint
+ * "Route to named server" with the server of the rule.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    FINGERPRINT_INSTANCE *my_instance = (FINGERPRINT_INSTANCE *) instance;
+    FINGERPRINT_SESSION *my_session = (FINGERPRINT_SESSION *) session;
+    char *sql;
+    int len;
+
+    /** Without rules, the statements are not canonicalized at all */
+    if (my_instance->n_rules > 0 && modutil_is_SQL(queue))
+    {
+        if (queue->next != NULL)
+        {
+            queue = gwbuf_make_contiguous(queue);
+        }
+        if (modutil_extract_SQL(queue, &sql, &len))
+        {
+            char stackbuf[CANONICAL_SQL_SIZE(FINGERPRINT_STACK_LEN)];
+            char *canonical = len <= FINGERPRINT_STACK_LEN ? stackbuf :
+                              malloc(CANONICAL_SQL_SIZE(len));
+            FINGERPRINT_TARGET *target = NULL;
+            uint64_t fp;
+
+            if (canonical)
+            {
+                canonicalize_sql(sql, len, canonical, &fp);
+                target = hashtable_fetch(my_instance->table, &fp);
+
+                if (canonical != stackbuf)
+                {
+                    free(canonical);
+                }
+            }
+
+            if (target)
+            {
+                queue->hint = target->server ?
+                    hint_create_server_route(queue->hint, target->server) :
+                    hint_create_route(queue->hint, HINT_ROUTE_TO_NAMED_SERVER, target->name);
+                atomic_add(&target->hits, 1);
+                my_session->n_diverted++;
+            }
+            else
+            {
+                my_session->n_undiverted++;
+            }
+        }
+    }
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    FINGERPRINT_INSTANCE *my_instance = (FINGERPRINT_INSTANCE *) instance;
+    FINGERPRINT_SESSION *my_session = (FINGERPRINT_SESSION *) fsession;
+
+    if (my_instance->rules)
+    {
+        dcb_printf(dcb, "\t\tRules file:                %s\n", my_instance->rules);
+    }
+    dcb_printf(dcb, "\t\tNumber of rules:           %d\n", my_instance->n_rules);
+
+    HASHITERATOR *iter = hashtable_iterator(my_instance->table);
+
+    if (iter)
+    {
+        uint64_t *fp;
+
+        dcb_printf(dcb, "\t\tFingerprint      | Server               |        Hits\n");
+        while ((fp = hashtable_next(iter)) != NULL)
+        {
+            FINGERPRINT_TARGET *target = hashtable_fetch(my_instance->table, fp);
+
+            if (target)
+            {
+                dcb_printf(dcb, "\t\t%016" PRIx64 " | %-20s | %11d\n",
+                           *fp, target->name, target->hits);
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
+    if (my_session)
+    {
+        dcb_printf(dcb, "\t\tNo. of queries diverted by filter: %d\n",
+                   my_session->n_diverted);
+        dcb_printf(dcb, "\t\tNo. of queries not diverted by filter:     %d\n",
+                   my_session->n_undiverted);
+    }
+}
+
+/**
+ * Capability routine.
+ *
+ * The filter only routes COM_QUERY statements, the other commands
+ * bypass it.
+ *
+ * @return The commands the filter handles
+ */
+static uint64_t getCapabilities(void)
+{
+    return FILTER_COMMAND(MYSQL_COM_QUERY);
+}
+
+/**
+ * The administrative commands of the filter
+ *
+ *      add <fingerprint> <server>      Route the statements with the
+ *                                      fingerprint to the server
+ *      remove <fingerprint>            Stop routing them
+ *
+ * The fingerprint is either 16 hexadecimal digits or an example statement.
+ * A fingerprint that cannot be parsed is reported and the rules are left as
+ * they were.
+ *
+ * @param instance  The filter instance
+ * @param dcb       The DCB for messages
+ * @param cmd       The command
+ * @param arg1      The fingerprint
+ * @param arg2      The server of the add command
+ * @return True if the command is known
+ */
+static bool
+command(FILTER *instance, DCB *dcb, const char *cmd, const char *arg1, const char *arg2)
+{
+    FINGERPRINT_INSTANCE *my_instance = (FINGERPRINT_INSTANCE *) instance;
+    uint64_t fp;
+
+    if ((strcmp(cmd, "add") == 0 && arg1 && arg2) || (strcmp(cmd, "remove") == 0 && arg1))
+    {
+        if (!fingerprint_parse(arg1, &fp))
+        {
+            dcb_printf(dcb, "Failed to parse '%s', the fingerprint must be %d hexadecimal "
+                       "digits or a statement.\n", arg1, FINGERPRINT_DIGITS);
+            return true;
+        }
+    }
+
+    if (strcmp(cmd, "add") == 0 && arg1 && arg2)
+    {
+        if (server_find_by_unique_name((char *)arg2) == NULL)
+        {
+            dcb_printf(dcb, "Server %s was not found.\n", arg2);
+        }
+        else if (fingerprint_add(my_instance, fp, arg2))
+        {
+            dcb_printf(dcb, "Statements with the fingerprint %016" PRIx64 " are routed to %s.\n",
+                       fp, arg2);
+            MXS_NOTICE("fingerprintfilter: Statements with the fingerprint %016" PRIx64
+                       " are routed to %s.", fp, arg2);
+        }
+        else
+        {
+            dcb_printf(dcb, "Failed to add the fingerprint %016" PRIx64 ".\n", fp);
+        }
+        return true;
+    }
+    else if (strcmp(cmd, "remove") == 0 && arg1)
+    {
+        if (fingerprint_remove(my_instance, fp))
+        {
+            dcb_printf(dcb, "Statements with the fingerprint %016" PRIx64 " are no longer "
+                       "routed by the filter.\n", fp);
+            MXS_NOTICE("fingerprintfilter: Statements with the fingerprint %016" PRIx64
+                       " are no longer routed by the filter.", fp);
+        }
+        else
+        {
+            dcb_printf(dcb, "There is no rule for the fingerprint %016" PRIx64 ".\n", fp);
+        }
+        return true;
+    }
+
+    return false;
+}
@@ -15,6 +15,7 @@
 #include <modinfo.h>
 #include <modutil.h>
 #include <mysqlhint.h>
+#include <maxconfig.h>
 
 /**
  * hintfilter.c - a filter to parse the MaxScale hint syntax and attach those
@@ -108,6 +109,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
     if ((my_instance = calloc(1, sizeof(HINT_INSTANCE))) != NULL)
     {
         my_instance->sessions = 0;
+        hint_cache_init(config_max_threadcount());
     }
     return (FILTER *)my_instance;
 }
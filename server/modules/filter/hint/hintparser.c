@@ -19,12 +19,38 @@
 #include <modinfo.h>
 #include <modutil.h>
 #include <mysqlhint.h>
+#include <spinlock.h>
+#include <maxscale/poll.h>
 
 /**
  * hintparser.c - Find any comment in the SQL packet and look for MAXSCALE
  * hints in that comment.
+ *
+ * Applications tend to send the same statements over and over again, so the
+ * results of parsing the comments are cached. Each thread has its own cache
+ * keyed by the bytes of the comment. Only comments that do not change the
+ * state of the session, i.e. one-off hints and comments that are not hints,
+ * are cached. The cached hints are never modified; each statement gets a
+ * copy of them.
  */
 
+/** Number of entries in the cache of each thread, must be a power of two */
+#define HINT_CACHE_SIZE 256
+/** Longest comment that is cached */
+#define HINT_CACHE_MAX_KEY 1024
+
+typedef struct hint_cache_entry
+{
+    uint32_t hash; /*< Hash of the key */
+    int len; /*< Length of the key, 0 if the entry is empty */
+    char *key; /*< The comment and the rest of the statement */
+    HINT *hints; /*< The parsed hints, NULL if the comment had no hints */
+} HINT_CACHE_ENTRY;
+
+static HINT_CACHE_ENTRY **hint_cache = NULL;
+static int hint_cache_threads = 0;
+static SPINLOCK hint_cache_lock = SPINLOCK_INIT;
+
 /**
  * The keywords in the hint syntax
  */
@@ -46,6 +72,7 @@ struct
     { "master", TOK_MASTER},
     { "slave", TOK_SLAVE},
     { "server", TOK_SERVER},
+    { "all", TOK_ALL},
     { NULL, 0}
 };
 /**
@@ -76,7 +103,7 @@ static void token_free(HINT_TOKEN* token);
 
 typedef enum
 {
-    HM_EXECUTE, HM_START, HM_PREPARE
+    HM_EXECUTE, HM_START, HM_PREPARE, HM_STOP
 } HINT_MODE;
 
 void token_free(HINT_TOKEN* token)
@@ -124,6 +151,147 @@ static const char* token_get_keyword(
     }
 }
 
+/**
+ * Allocate the per-thread hint caches. Safe to call more than once.
+ *
+ * @param n_threads Number of worker threads
+ */
+void
+hint_cache_init(int n_threads)
+{
+    spinlock_acquire(&hint_cache_lock);
+
+    if (hint_cache == NULL)
+    {
+        HINT_CACHE_ENTRY **caches = calloc(n_threads, sizeof(HINT_CACHE_ENTRY*));
+        bool ok = caches != NULL;
+
+        for (int i = 0; ok && i < n_threads; i++)
+        {
+            ok = (caches[i] = calloc(HINT_CACHE_SIZE, sizeof(HINT_CACHE_ENTRY))) != NULL;
+        }
+
+        if (ok)
+        {
+            hint_cache_threads = n_threads;
+            hint_cache = caches;
+        }
+        else
+        {
+            MXS_ERROR("Failed to allocate the hint cache, hints are parsed for every query.");
+            for (int i = 0; caches && i < n_threads; i++)
+            {
+                free(caches[i]);
+            }
+            free(caches);
+        }
+    }
+
+    spinlock_release(&hint_cache_lock);
+}
+
+static uint32_t
+hint_cache_hash(const char *key, int len)
+{
+    /** FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void
+hint_free_all(HINT *hint)
+{
+    while (hint)
+    {
+        HINT *next = hint->next;
+        hint_free(hint);
+        hint = next;
+    }
+}
+
+/**
+ * Find the cache entry of a comment in the cache of the current thread
+ *
+ * @param key The comment
+ * @param len Length of the comment
+ * @param hash The hash of the comment
+ * @return The entry where the comment is or should be stored, NULL if the
+ * cache is not in use
+ */
+static HINT_CACHE_ENTRY *
+hint_cache_entry(const char *key, int len, uint32_t hash)
+{
+    if (hint_cache == NULL || len > HINT_CACHE_MAX_KEY)
+    {
+        return NULL;
+    }
+
+    HINT_CACHE_ENTRY *cache = hint_cache[poll_current_thread() % hint_cache_threads];
+    return &cache[hash & (HINT_CACHE_SIZE - 1)];
+}
+
+static bool
+hint_cache_match(HINT_CACHE_ENTRY *entry, const char *key, int len, uint32_t hash)
+{
+    return entry->len == len && entry->hash == hash && memcmp(entry->key, key, len) == 0;
+}
+
+static void
+hint_cache_store(HINT_CACHE_ENTRY *entry, const char *key, int len, uint32_t hash, HINT *hints)
+{
+    char *copy = malloc(len);
+
+    if (copy)
+    {
+        memcpy(copy, key, len);
+        free(entry->key);
+        hint_free_all(entry->hints);
+        entry->key = copy;
+        entry->len = len;
+        entry->hash = hash;
+        entry->hints = hint_dup(hints);
+    }
+}
+
+/**
+ * Check if a statement mentions "maxscale" in any case. Statements that don't
+ * cannot have hints so the comments in them are not looked for.
+ *
+ * @param ptr Start of the statement
+ * @param len Length of the statement
+ * @return True if the statement contains the word
+ */
+static bool
+has_maxscale_keyword(const char *ptr, int len)
+{
+    static const char first[] = {'m', 'M'};
+    const int kwlen = sizeof("maxscale") - 1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        const char *start = ptr;
+        const char *end = ptr + len;
+        const char *found;
+
+        while (end - start >= kwlen && (found = memchr(start, first[i], end - start - kwlen + 1)))
+        {
+            if (strncasecmp(found, "maxscale", kwlen) == 0)
+            {
+                return true;
+            }
+            start = found + 1;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Parse the hint comments in the MySQL statement passed in request.
  * Add any hints to the buffer for later processing.
@@ -144,9 +312,21 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
     GWBUF *buf;
     HINT_TOKEN *tok;
     HINT_MODE mode = HM_EXECUTE;
+    HINT_CACHE_ENTRY *entry = NULL;
+    char *key = NULL;
+    int key_len = 0;
+    uint32_t hash = 0;
+    bool cacheable = false;
 
     /* First look for any comment in the SQL */
     modutil_MySQL_Query(request, &ptr, &len, &residual);
+
+    if (request->next == NULL &&
+        !has_maxscale_keyword(ptr, MIN(len, (char *)request->end - ptr)))
+    {
+        goto retblock;
+    }
+
     buf = request;
     found = 0;
     escape = 0;
@@ -230,6 +410,21 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
         goto retblock;
     }
 
+    if (buf->next == NULL)
+    {
+        key = ptr;
+        key_len = (char *)buf->end - ptr;
+        hash = hint_cache_hash(key, key_len);
+
+        if ((entry = hint_cache_entry(key, key_len, hash)) &&
+            hint_cache_match(entry, key, key_len, hash))
+        {
+            rval = hint_dup(entry->hints);
+            entry = NULL;
+            goto retblock;
+        }
+    }
+
     /*
      * If we have got here then we have a comment, ptr point to
      * the comment character if it is a '#' comment or the second
@@ -262,6 +457,7 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
     if (tok->token != TOK_MAXSCALE)
     {
         token_free(tok);
+        cacheable = true;
         goto retblock;
     }
     token_free(tok);
@@ -286,6 +482,7 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                     case TOK_STOP:
                         /* Action: pop active hint */
                         hint_pop(session);
+                        mode = HM_STOP;
                         state = HS_INIT;
                         break;
                     case TOK_START:
@@ -329,10 +526,14 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                     case TOK_SERVER:
                         state = HS_ROUTE_SERVER;
                         break;
+                    case TOK_ALL:
+                        rval = hint_create_route(rval,
+                                                 HINT_ROUTE_TO_ALL, NULL);
+                        break;
                     default:
-                        /* Error expected MASTER, SLAVE or SERVER */
+                        /* Error expected MASTER, SLAVE, SERVER or ALL */
                         MXS_ERROR("Syntax error in hint. Expected "
-                                  "'master', 'slave', or 'server' instead "
+                                  "'master', 'slave', 'server' or 'all' instead "
                                   "of '%s'. Hint ignored.",
                                   token_get_keyword(tok));
 
@@ -483,10 +684,19 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
              * We have a one-off hint for the statement we are
              * currently forwarding.
              */
+            cacheable = true;
+            break;
+
+        case HM_STOP:
             break;
     }
 
 retblock:
+    if (cacheable && entry)
+    {
+        hint_cache_store(entry, key, key_len, hash, rval);
+    }
+
     if (rval == NULL)
     {
         /* No new hint parsed in this statement, apply the current
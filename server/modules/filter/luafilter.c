@@ -34,6 +34,16 @@
  * is defined and valid, the matching entry point function in Lua will be called.
  * The same holds true for session script apart from no calls to createInstance
  * or diagnostic being made for the session script.
+ *
+ * By default the global script has a single state and its calls are serialized.
+ * With thread_states=true, each worker thread loads its own copy of the global
+ * script when it first needs it and calls its createInstance function. The
+ * copies don't see each other's global variables, so the global scripts can
+ * use the following functions for data shared by all threads:
+ *  * string shared_get(string) - value set with shared_set, nil if not set
+ *  * nil shared_set(string, string) - set a value, nil removes the value
+ *  * integer shared_add(string, integer) - atomically add to a counter and
+ *    return the new value. A counter that has not been added to is zero.
  */
 
 #include <skygw_types.h>
@@ -44,6 +54,10 @@
 #include <filter.h>
 #include <session.h>
 #include <modutil.h>
+#include <atomic.h>
+#include <strhash.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -123,6 +137,16 @@ static int id_gen(lua_State* state)
     return 1;
 }
 
+/**
+ * A copy of the global script owned by one worker thread
+ */
+typedef struct
+{
+    lua_State* state;
+    SPINLOCK lock; /*< Only contended if a non-worker thread calls the script */
+    bool failed; /*< Loading the script failed, it is not retried */
+} LUA_THREAD_STATE;
+
 /**
  * The Lua filter instance.
  */
@@ -132,6 +156,11 @@ typedef struct
     char* global_script;
     char* session_script;
     SPINLOCK lock;
+    LUA_THREAD_STATE* threads; /*< Per-thread global script states */
+    int n_threads;
+    SPINLOCK shared_lock; /*< Protects the shared values and counters */
+    STRHASH* shared_values; /*< Values set with shared_set */
+    STRHASH* shared_counters; /*< Counters updated with shared_add */
 } LUA_INSTANCE;
 
 /**
@@ -146,6 +175,192 @@ typedef struct
     UPSTREAM up;
 } LUA_SESSION;
 
+static void* free_value(void* value)
+{
+    free(value);
+    return NULL;
+}
+
+/**
+ * Get a shared value, the Lua signature is string shared_get(string)
+ * @param state Lua state
+ * @return Always 1
+ */
+static int shared_get(lua_State* state)
+{
+    LUA_INSTANCE* my_instance = (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+    const char* key = luaL_checkstring(state, 1);
+
+    /** Lua errors jump out of the function so the value is copied first */
+    spinlock_acquire(&my_instance->shared_lock);
+    char* value = strhash_fetch(my_instance->shared_values, key);
+    value = value ? strdup(value) : NULL;
+    spinlock_release(&my_instance->shared_lock);
+
+    if (value)
+    {
+        lua_pushstring(state, value);
+        free(value);
+    }
+    else
+    {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+/**
+ * Set a shared value, the Lua signature is nil shared_set(string, string)
+ * @param state Lua state
+ * @return Always 0
+ */
+static int shared_set(lua_State* state)
+{
+    LUA_INSTANCE* my_instance = (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+    const char* key = luaL_checkstring(state, 1);
+    char* value = NULL;
+
+    if (!lua_isnoneornil(state, 2) && (value = strdup(luaL_checkstring(state, 2))) == NULL)
+    {
+        return luaL_error(state, "Memory allocation failed");
+    }
+
+    spinlock_acquire(&my_instance->shared_lock);
+    strhash_delete(my_instance->shared_values, key);
+    if (value && !strhash_add(my_instance->shared_values, key, value))
+    {
+        free(value);
+    }
+    spinlock_release(&my_instance->shared_lock);
+
+    return 0;
+}
+
+/**
+ * Add to a shared counter, the Lua signature is integer shared_add(string, integer)
+ * @param state Lua state
+ * @return Always 1
+ */
+static int shared_add(lua_State* state)
+{
+    LUA_INSTANCE* my_instance = (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+    const char* key = luaL_checkstring(state, 1);
+    int value = luaL_optinteger(state, 2, 1);
+
+    spinlock_acquire(&my_instance->shared_lock);
+    int* counter = strhash_fetch(my_instance->shared_counters, key);
+
+    if (counter == NULL && (counter = calloc(1, sizeof(int))) &&
+        !strhash_add(my_instance->shared_counters, key, counter))
+    {
+        free(counter);
+        counter = NULL;
+    }
+    spinlock_release(&my_instance->shared_lock);
+
+    if (counter == NULL)
+    {
+        return luaL_error(state, "Memory allocation failed");
+    }
+
+    /** Counters are never removed so they can be updated outside the lock */
+    lua_pushinteger(state, atomic_add(counter, value) + value);
+    return 1;
+}
+
+/**
+ * Load the global script into a new Lua state
+ *
+ * The shared value functions are exported to the script, the script is
+ * executed once and its createInstance function is called.
+ *
+ * @param my_instance The filter instance
+ * @return The new Lua state or NULL if the script could not be loaded
+ */
+static lua_State* load_global_script(LUA_INSTANCE* my_instance)
+{
+    lua_State* state = luaL_newstate();
+
+    if (state == NULL)
+    {
+        MXS_ERROR("Unable to initialize new Lua state.");
+        return NULL;
+    }
+
+    luaL_openlibs(state);
+
+    lua_pushlightuserdata(state, my_instance);
+    lua_pushcclosure(state, shared_get, 1);
+    lua_setglobal(state, "shared_get");
+    lua_pushlightuserdata(state, my_instance);
+    lua_pushcclosure(state, shared_set, 1);
+    lua_setglobal(state, "shared_set");
+    lua_pushlightuserdata(state, my_instance);
+    lua_pushcclosure(state, shared_add, 1);
+    lua_setglobal(state, "shared_add");
+
+    if (luaL_dofile(state, my_instance->global_script))
+    {
+        MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
+                  my_instance->global_script, lua_tostring(state, -1));
+        lua_close(state);
+        return NULL;
+    }
+
+    lua_getglobal(state, "createInstance");
+    if (lua_pcall(state, 0, 0, 0))
+    {
+        MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
+                    " The createInstance entry point will not be called for the global script.",
+                    lua_tostring(state, -1));
+    }
+
+    return state;
+}
+
+/**
+ * Acquire the global script state of the calling thread
+ *
+ * With per-thread states, the state of the thread is loaded the first time it
+ * is needed.
+ *
+ * @param my_instance The filter instance
+ * @param lock The lock that must be released with spinlock_release() once the
+ * state is no longer used
+ * @return The locked state or NULL if there is no global script
+ */
+static lua_State* global_state_acquire(LUA_INSTANCE* my_instance, SPINLOCK** lock)
+{
+    if (my_instance->threads == NULL)
+    {
+        if (my_instance->global_lua_state == NULL)
+        {
+            return NULL;
+        }
+
+        *lock = &my_instance->lock;
+        spinlock_acquire(*lock);
+        return my_instance->global_lua_state;
+    }
+
+    LUA_THREAD_STATE* thread = &my_instance->threads[poll_current_thread() % my_instance->n_threads];
+    *lock = &thread->lock;
+    spinlock_acquire(*lock);
+
+    if (thread->state == NULL && !thread->failed)
+    {
+        thread->failed = (thread->state = load_global_script(my_instance)) == NULL;
+    }
+
+    if (thread->state == NULL)
+    {
+        spinlock_release(*lock);
+    }
+
+    return thread->state;
+}
+
 /**
  * The module initialisation routine, called when the module
  * is first loaded.
@@ -179,6 +394,8 @@ createInstance(char **options, FILTER_PARAMETER **params)
     }
 
     spinlock_init(&my_instance->lock);
+    spinlock_init(&my_instance->shared_lock);
+    bool thread_states = false;
 
     for (int i = 0; params[i] && !error; i++)
     {
@@ -190,6 +407,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
         {
             error = (my_instance->session_script = strdup(params[i]->value)) == NULL;
         }
+        else if (strcmp(params[i]->name, "thread_states") == 0)
+        {
+            thread_states = config_truth_value(params[i]->value);
+        }
         else if (!filter_standard_parameter(params[i]->name))
         {
             MXS_ERROR("Unexpected parameter '%s'", params[i]->name);
@@ -197,46 +418,51 @@ createInstance(char **options, FILTER_PARAMETER **params)
         }
     }
 
-    if (error)
+    if (!error && ((my_instance->shared_values = strhash_alloc(16, free_value)) == NULL ||
+                   (my_instance->shared_counters = strhash_alloc(16, free_value)) == NULL))
     {
-        free(my_instance->global_script);
-        free(my_instance->session_script);
-        free(my_instance);
-        return NULL;
+        error = true;
     }
 
-    if (my_instance->global_script)
+    if (!error && my_instance->global_script && thread_states)
     {
-        if ((my_instance->global_lua_state = luaL_newstate()))
-        {
-            luaL_openlibs(my_instance->global_lua_state);
+        my_instance->n_threads = config_max_threadcount();
 
-            if (luaL_dofile(my_instance->global_lua_state, my_instance->global_script))
-            {
-                MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
-                          my_instance->global_script, lua_tostring(my_instance->global_lua_state, -1));
-                free(my_instance->global_script);
-                free(my_instance->session_script);
-                free(my_instance);
-                my_instance = NULL;
-            }
-            else if (my_instance->global_lua_state)
+        if ((my_instance->threads = calloc(my_instance->n_threads, sizeof(LUA_THREAD_STATE))))
+        {
+            for (int i = 0; i < my_instance->n_threads; i++)
             {
-                lua_getglobal(my_instance->global_lua_state, "createInstance");
-                if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
-                {
-                    MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
-                                " The createInstance entry point will not be called for the global script.",
-                                lua_tostring(my_instance->global_lua_state, -1));
-                }
+                spinlock_init(&my_instance->threads[i].lock);
             }
+
+            /** Check that the script works, the first thread can use the state */
+            error = (my_instance->threads[0].state = load_global_script(my_instance)) == NULL;
         }
         else
         {
-            MXS_ERROR("Unable to initialize new Lua state.");
-            free(my_instance);
-            my_instance = NULL;
+            error = true;
+        }
+    }
+    else if (!error && my_instance->global_script)
+    {
+        error = (my_instance->global_lua_state = load_global_script(my_instance)) == NULL;
+    }
+
+    if (error)
+    {
+        if (my_instance->shared_values)
+        {
+            strhash_free(my_instance->shared_values);
         }
+        if (my_instance->shared_counters)
+        {
+            strhash_free(my_instance->shared_counters);
+        }
+        free(my_instance->threads);
+        free(my_instance->global_script);
+        free(my_instance->session_script);
+        free(my_instance);
+        return NULL;
     }
 
     return (FILTER *) my_instance;
@@ -300,17 +526,19 @@ static void * newSession(FILTER *instance, SESSION *session)
         }
     }
 
-    if (my_session && my_instance->global_lua_state)
+    SPINLOCK* lock;
+    lua_State* global;
+
+    if (my_session && (global = global_state_acquire(my_instance, &lock)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "newSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_getglobal(global, "newSession");
+        if (lua_pcall(global, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'newSession': '%s'."
                         " The newSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(global, -1));
         }
-        spinlock_release(&my_instance->lock);
+        spinlock_release(lock);
     }
 
     return my_session;
@@ -328,7 +556,8 @@ static void closeSession(FILTER *instance, void *session)
 {
     LUA_SESSION *my_session = (LUA_SESSION *) session;
     LUA_INSTANCE *my_instance = (LUA_INSTANCE*) instance;
-
+    SPINLOCK* lock;
+    lua_State* global;
 
     if (my_session->lua_state)
     {
@@ -343,17 +572,16 @@ static void closeSession(FILTER *instance, void *session)
         spinlock_release(&my_session->lock);
     }
 
-    if (my_instance->global_lua_state)
+    if ((global = global_state_acquire(my_instance, &lock)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "closeSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_getglobal(global, "closeSession");
+        if (lua_pcall(global, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'closeSession': '%s'."
                         " The closeSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(global, -1));
         }
-        spinlock_release(&my_instance->lock);
+        spinlock_release(lock);
     }
 }
 
@@ -409,6 +637,8 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
 {
     LUA_SESSION *my_session = (LUA_SESSION *) session;
     LUA_INSTANCE *my_instance = (LUA_INSTANCE *) instance;
+    SPINLOCK* lock;
+    lua_State* global;
 
     if (my_session->lua_state)
     {
@@ -421,16 +651,15 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
         }
         spinlock_release(&my_session->lock);
     }
-    if (my_instance->global_lua_state)
+    if ((global = global_state_acquire(my_instance, &lock)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "clientReply");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_getglobal(global, "clientReply");
+        if (lua_pcall(global, 0, 0, 0))
         {
             MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
-                      lua_tostring(my_session->lua_state, -1));
+                      lua_tostring(global, -1));
         }
-        spinlock_release(&my_instance->lock);
+        spinlock_release(lock);
     }
 
     return my_session->up.clientReply(my_session->up.instance,
@@ -464,6 +693,8 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
     bool route = true;
     GWBUF* forward = queue;
     int rc = 0;
+    SPINLOCK* lock;
+    lua_State* global;
 
     if (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue))
     {
@@ -497,33 +728,31 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
             spinlock_release(&my_session->lock);
         }
 
-        if (my_instance->global_lua_state)
+        if (fullquery && (global = global_state_acquire(my_instance, &lock)))
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "routeQuery");
-            lua_pushlstring(my_instance->global_lua_state, fullquery, strlen(fullquery));
-            if (lua_pcall(my_instance->global_lua_state, 1, 0, 0))
+            lua_getglobal(global, "routeQuery");
+            lua_pushlstring(global, fullquery, strlen(fullquery));
+            if (lua_pcall(global, 1, 0, 0))
             {
                 MXS_ERROR("luafilter: Global scope call to 'routeQuery' failed: '%s'.",
-                          lua_tostring(my_session->lua_state, -1));
+                          lua_tostring(global, -1));
             }
-            else if (lua_gettop(my_instance->global_lua_state))
+            else if (lua_gettop(global))
             {
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                if (lua_isstring(global, -1))
                 {
                     if (forward)
                     {
                         gwbuf_free(forward);
                     }
-                    forward = modutil_create_query((char*)
-                                                   lua_tostring(my_instance->global_lua_state, -1));
+                    forward = modutil_create_query((char*) lua_tostring(global, -1));
                 }
-                else if (lua_isboolean(my_instance->global_lua_state, -1))
+                else if (lua_isboolean(global, -1))
                 {
-                    route = lua_toboolean(my_instance->global_lua_state, -1);
+                    route = lua_toboolean(global, -1);
                 }
             }
-            spinlock_release(&my_instance->lock);
+            spinlock_release(lock);
         }
 
         free(fullquery);
@@ -556,28 +785,29 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 {
     LUA_INSTANCE *my_instance = (LUA_INSTANCE *) instance;
+    SPINLOCK* lock;
+    lua_State* global;
 
     if (my_instance)
     {
-        if (my_instance->global_lua_state)
+        if ((global = global_state_acquire(my_instance, &lock)))
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "diagnostic");
-            if (lua_pcall(my_instance->global_lua_state, 0, 1, 0) == 0)
+            lua_getglobal(global, "diagnostic");
+            if (lua_pcall(global, 0, 1, 0) == 0)
             {
-                lua_gettop(my_instance->global_lua_state);
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                lua_gettop(global);
+                if (lua_isstring(global, -1))
                 {
-                    dcb_printf(dcb, lua_tostring(my_instance->global_lua_state, -1));
+                    dcb_printf(dcb, lua_tostring(global, -1));
                     dcb_printf(dcb, "\n");
                 }
             }
             else
             {
                 dcb_printf(dcb, "Global scope call to 'diagnostic' failed: '%s'.\n",
-                           lua_tostring(my_instance->global_lua_state, -1));
+                           lua_tostring(global, -1));
             }
-            spinlock_release(&my_instance->lock);
+            spinlock_release(lock);
         }
         if (my_instance->global_script)
         {
@@ -587,5 +817,9 @@ static void diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         {
             dcb_printf(dcb, "Session script: %s\n", my_instance->session_script);
         }
+        if (my_instance->threads)
+        {
+            dcb_printf(dcb, "Global script states: One per thread\n");
+        }
     }
 }
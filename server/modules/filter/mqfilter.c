@@ -46,6 +46,8 @@
  *      ssl_CA_cert     Path to the CA certificate in PEM format
  *      ssl_client_cert Path to the client cerificate in PEM format
  *      ssl_client_key  Path to the client public key in PEM format
+ *      batch_size      Number of messages published before waiting for confirms
+ *      queue_size      Maximum number of queued messages
  *
  * The logging trigger levels are:
  *      all     Log everything
@@ -55,6 +57,13 @@
  *      object  Trigger on a particular database object (table or view)
  *@endverbatim
  * See the individual struct documentations for logging trigger parameters
+ *
+ * The routed queries only add the messages to a lock-free queue. A publisher
+ * thread owns the connection to the broker, publishes the messages in batches
+ * and waits for the broker to confirm each batch. Messages that the broker
+ * rejects or that were in flight when the connection was lost are published
+ * again. If the queue is full, new messages are dropped so that a slow broker
+ * never stalls the queries.
  */
 #include <my_config.h>
 #include <stdio.h>
@@ -76,6 +85,7 @@
 #include <spinlock.h>
 #include <session.h>
 #include <housekeeper.h>
+#include <thread.h>
 
 MODULE_INFO info =
 {
@@ -87,7 +97,15 @@ MODULE_INFO info =
 
 static char *version_str = "V1.0.2";
 static int uid_gen;
-static int hktask_id = 0;
+
+/** Default number of messages published before waiting for confirms */
+#define MQ_DEFAULT_BATCH_SIZE 64
+/** Default maximum number of queued messages */
+#define MQ_DEFAULT_QUEUE_SIZE 100000
+/** How long to wait for the broker to confirm a batch */
+#define MQ_CONFIRM_TIMEOUT 5
+/** How long the publisher sleeps when there are no messages */
+#define MQ_IDLE_SLEEP_MS 10
 /*
  * The filter entry points
  */
@@ -192,8 +210,22 @@ typedef struct mqstats_t
     int n_msg; /*< Total number of messages */
     int n_sent; /*< Number of sent messages */
     int n_queued; /*< Number of unsent messages */
+    int n_dropped; /*< Messages dropped because the queue was full */
+    int n_resent; /*< Messages published again */
 } MQSTATS;
 
+/**
+ * Multiple-producer, single-consumer message queue. The producers only
+ * exchange the tail pointer and the publisher thread is the only one that
+ * reads the head. The stub node keeps the queue from ever becoming empty.
+ */
+typedef struct mqqueue_t
+{
+    mqmessage *head; /*< Next message to consume, only used by the publisher */
+    mqmessage *tail; /*< Last added message */
+    mqmessage stub;
+} MQQUEUE;
+
 /**
  * A instance structure, containing the hostname, login credentials,
  * virtual host location and the names of the exchange and the key.
@@ -228,8 +260,12 @@ typedef struct
     int rconn_intv; /**delay for reconnects, in seconds*/
     time_t last_rconn; /**last reconnect attempt*/
     SPINLOCK rconn_lock;
-    SPINLOCK msg_lock;
-    mqmessage* messages;
+    MQQUEUE messages; /**Messages waiting to be published*/
+    mqmessage* retry; /**Messages to publish again, only used by the publisher*/
+    int batch_size; /**Messages published before waiting for confirms*/
+    int queue_size; /**Maximum number of queued messages*/
+    uint64_t next_tag; /**Delivery tag of the next published message*/
+    THREAD publisher;
     enum log_trigger_t trgtype;
     SRC_TRIG* src_trg;
     SHM_TRIG* shm_trg;
@@ -256,7 +292,7 @@ typedef struct
     bool was_query; /**True if the previous routeQuery call had valid content*/
 } MQ_SESSION;
 
-void sendMessage(void* data);
+static void publisher_main(void* data);
 
 /**
  * Implementation of the mandatory version entry point
@@ -367,6 +403,16 @@ init_conn(MQ_INSTANCE *my_instance)
         goto cleanup;
     }
 
+    /** The broker acknowledges each published message */
+    amqp_confirm_select(my_instance->conn, my_instance->channel);
+    reply = amqp_get_rpc_reply(my_instance->conn);
+    if (reply.reply_type != AMQP_RESPONSE_NORMAL)
+    {
+        MXS_ERROR("Failed to enable publisher confirms.");
+        goto cleanup;
+    }
+    my_instance->next_tag = 1;
+
     amqp_exchange_declare(my_instance->conn, my_instance->channel,
                           amqp_cstring_bytes(my_instance->exchange),
                           amqp_cstring_bytes(my_instance->exchange_type),
@@ -508,12 +554,14 @@ createInstance(char **options, FILTER_PARAMETER **params)
     int paramcount = 0, parammax = 64, i = 0, x = 0, arrsize = 0;
     FILTER_PARAMETER** paramlist;
     char** arr = NULL;
-    char taskname[512];
 
     if ((my_instance = calloc(1, sizeof(MQ_INSTANCE))))
     {
         spinlock_init(&my_instance->rconn_lock);
-        spinlock_init(&my_instance->msg_lock);
+        my_instance->messages.head = &my_instance->messages.stub;
+        my_instance->messages.tail = &my_instance->messages.stub;
+        my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+        my_instance->queue_size = MQ_DEFAULT_QUEUE_SIZE;
         uid_gen = 0;
         paramlist = malloc(sizeof(FILTER_PARAMETER*) * 64);
 
@@ -586,6 +634,24 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
                 my_instance->exchange_type = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "batch_size"))
+            {
+                if ((my_instance->batch_size = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_WARNING("mqfilter: Invalid batch_size '%s', using the default of %d.",
+                                params[i]->value, MQ_DEFAULT_BATCH_SIZE);
+                    my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "queue_size"))
+            {
+                if ((my_instance->queue_size = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_WARNING("mqfilter: Invalid queue_size '%s', using the default of %d.",
+                                params[i]->value, MQ_DEFAULT_QUEUE_SIZE);
+                    my_instance->queue_size = MQ_DEFAULT_QUEUE_SIZE;
+                }
+            }
             else if (!strcmp(params[i]->name, "logging_trigger"))
             {
 
@@ -786,10 +852,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
         }
 
         /**Connect to the server*/
-        init_conn(my_instance);
+        if (!init_conn(my_instance))
+        {
+            my_instance->conn_stat = AMQP_STATUS_SOCKET_ERROR;
+        }
 
-        snprintf(taskname, 511, "mqtask%d", atomic_add(&hktask_id, 1));
-        hktask_add(taskname, sendMessage, (void*) my_instance, 5);
+        if (thread_start(&my_instance->publisher, publisher_main, my_instance) == NULL)
+        {
+            MXS_ERROR("mqfilter: Failed to start the publisher thread.");
+        }
         if (arr)
         {
             for (int x = 0; x < arrsize; x++)
@@ -845,108 +916,339 @@ int declareQueue(MQ_INSTANCE *my_instance, MQ_SESSION* my_session, char* qname)
 }
 
 /**
- * Broadcasts a message on the message stack to the RabbitMQ server
- * and frees the allocated memory if successful. This function is only called by
- * the housekeeper thread.
- * @param data MQfilter instance
+ * Add a message to the queue. This can be called by any thread.
+ * @param queue The queue
+ * @param msg Message to add
  */
-void sendMessage(void* data)
+static void mqqueue_push(MQQUEUE *queue, mqmessage *msg)
 {
-    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
-    mqmessage *tmp;
-    int err_num = AMQP_STATUS_OK;
+    msg->next = NULL;
+    __sync_synchronize();
+    mqmessage *prev = __sync_lock_test_and_set(&queue->tail, msg);
+    prev->next = msg;
+}
 
-    spinlock_acquire(&instance->rconn_lock);
-    if (instance->conn_stat != AMQP_STATUS_OK)
+/**
+ * Take the oldest message from the queue. Only the publisher thread calls this.
+ * @param queue The queue
+ * @return The message or NULL if the queue is empty or the next message
+ * is still being added
+ */
+static mqmessage* mqqueue_pop(MQQUEUE *queue)
+{
+    mqmessage *head = queue->head;
+    mqmessage *next = head->next;
+
+    if (head == &queue->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        queue->head = next;
+        head = next;
+        next = next->next;
+    }
+
+    if (next == NULL)
+    {
+        if (head != queue->tail)
+        {
+            /** A producer has exchanged the tail but not yet linked the node */
+            return NULL;
+        }
+
+        mqqueue_push(queue, &queue->stub);
+        next = head->next;
+
+        if (next == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    queue->head = next;
+    return head;
+}
+
+static void free_message(mqmessage *msg)
+{
+    free(msg->prop);
+    free(msg->msg);
+    free(msg);
+}
+
+/** Confirmation states of the published messages */
+enum mq_confirm
+{
+    MQ_UNCONFIRMED,
+    MQ_ACKED,
+    MQ_NACKED
+};
+
+/**
+ * Wait until the broker has confirmed the published messages
+ *
+ * The broker acknowledges or rejects the messages by their delivery tag and
+ * it may confirm several messages at once. The acknowledged messages are
+ * freed and the rest are added to the front of the retry list in their
+ * original order.
+ *
+ * @param instance MQfilter instance
+ * @param batch The published messages in publishing order
+ * @param first_tag Delivery tag of the first message of the batch
+ * @param count Number of messages in the batch
+ * @return AMQP_STATUS_OK if all messages were acknowledged
+ */
+static int wait_confirms(MQ_INSTANCE *instance, mqmessage *batch, uint64_t first_tag, int count)
+{
+    char state[count];
+    int n_unconfirmed = count;
+    time_t deadline = time(NULL) + MQ_CONFIRM_TIMEOUT;
+    int rc = AMQP_STATUS_OK;
+
+    memset(state, MQ_UNCONFIRMED, count);
+
+    while (n_unconfirmed > 0 && rc == AMQP_STATUS_OK)
+    {
+        struct timeval tv = {deadline - time(NULL), 0};
+        amqp_frame_t frame;
+
+        if (tv.tv_sec < 0)
+        {
+            tv.tv_sec = 0;
+        }
+
+        rc = amqp_simple_wait_frame_noblock(instance->conn, &frame, &tv);
+
+        if (rc != AMQP_STATUS_OK || frame.frame_type != AMQP_FRAME_METHOD)
+        {
+            continue;
+        }
+
+        uint64_t tag;
+        bool multiple;
+        char result;
+
+        if (frame.payload.method.id == AMQP_BASIC_ACK_METHOD)
+        {
+            amqp_basic_ack_t *m = (amqp_basic_ack_t*) frame.payload.method.decoded;
+            tag = m->delivery_tag;
+            multiple = m->multiple;
+            result = MQ_ACKED;
+        }
+        else if (frame.payload.method.id == AMQP_BASIC_NACK_METHOD)
+        {
+            amqp_basic_nack_t *m = (amqp_basic_nack_t*) frame.payload.method.decoded;
+            tag = m->delivery_tag;
+            multiple = m->multiple;
+            result = MQ_NACKED;
+        }
+        else
+        {
+            continue;
+        }
+
+        if (tag >= first_tag && tag < first_tag + count)
+        {
+            for (int i = multiple ? 0 : tag - first_tag; i <= tag - first_tag; i++)
+            {
+                if (state[i] == MQ_UNCONFIRMED)
+                {
+                    state[i] = result;
+                    n_unconfirmed--;
+                }
+            }
+        }
+    }
+
+    amqp_maybe_release_buffers(instance->conn);
+
+    mqmessage *retry = NULL, *last = NULL;
+    int n_retry = 0;
+
+    for (int i = 0; i < count; i++)
     {
-        if (difftime(time(NULL), instance->last_rconn) > instance->rconn_intv)
+        mqmessage *msg = batch;
+        batch = batch->next;
+
+        if (state[i] == MQ_ACKED)
+        {
+            free_message(msg);
+            atomic_add(&instance->stats.n_sent, 1);
+            atomic_add(&instance->stats.n_queued, -1);
+        }
+        else
         {
-            instance->last_rconn = time(NULL);
+            msg->next = NULL;
 
-            if (init_conn(instance))
+            if (last)
             {
-                instance->rconn_intv = 1.0;
-                instance->conn_stat = AMQP_STATUS_OK;
+                last->next = msg;
             }
             else
             {
-                instance->rconn_intv += 5.0;
-                MXS_ERROR("Failed to reconnect to the MQRabbit server ");
+                retry = msg;
             }
+            last = msg;
+            n_retry++;
         }
-        err_num = instance->conn_stat;
     }
-    spinlock_release(&instance->rconn_lock);
 
-    if (err_num != AMQP_STATUS_OK)
+    if (retry)
     {
-        /** No connection to the broker */
-        return;
+        if (n_unconfirmed > 0)
+        {
+            MXS_ERROR("mqfilter: %d messages were not confirmed by the broker: %s",
+                      n_unconfirmed, amqp_error_string2(rc));
+            rc = rc == AMQP_STATUS_OK ? AMQP_STATUS_TIMEOUT : rc;
+        }
+
+        last->next = instance->retry;
+        instance->retry = retry;
+        atomic_add(&instance->stats.n_resent, n_retry);
     }
 
-    spinlock_acquire(&instance->msg_lock);
-    tmp = instance->messages;
+    return rc;
+}
 
-    if (tmp == NULL)
+/**
+ * Publish one batch of messages
+ *
+ * The messages to publish again are sent first, then the queued messages.
+ *
+ * @param instance MQfilter instance
+ * @return Number of messages published
+ */
+static int publish_batch(MQ_INSTANCE *instance)
+{
+    mqmessage *batch = NULL, *last = NULL;
+    uint64_t first_tag = instance->next_tag;
+    int count = 0;
+    int err_num = AMQP_STATUS_OK;
+
+    while (count < instance->batch_size)
     {
-        spinlock_release(&instance->msg_lock);
-        return;
-    }
+        mqmessage *msg = instance->retry;
 
-    instance->messages = instance->messages->next;
-    spinlock_release(&instance->msg_lock);
+        if (msg)
+        {
+            instance->retry = msg->next;
+        }
+        else if ((msg = mqqueue_pop(&instance->messages)) == NULL)
+        {
+            break;
+        }
 
-    while (tmp)
-    {
+        msg->next = NULL;
         err_num = amqp_basic_publish(instance->conn, instance->channel,
                                      amqp_cstring_bytes(instance->exchange),
                                      amqp_cstring_bytes(instance->key),
-                                     0, 0, tmp->prop, amqp_cstring_bytes(tmp->msg));
+                                     0, 0, msg->prop, amqp_cstring_bytes(msg->msg));
 
-        spinlock_acquire(&instance->rconn_lock);
-        instance->conn_stat = err_num;
-        spinlock_release(&instance->rconn_lock);
+        if (err_num != AMQP_STATUS_OK)
+        {
+            msg->next = instance->retry;
+            instance->retry = msg;
+            break;
+        }
+
+        if (last)
+        {
+            last->next = msg;
+        }
+        else
+        {
+            batch = msg;
+        }
+        last = msg;
+        instance->next_tag++;
+        count++;
+    }
+
+    if (batch)
+    {
+        int rc = wait_confirms(instance, batch, first_tag, count);
 
         if (err_num == AMQP_STATUS_OK)
         {
-            /**Message was sent successfully*/
-            free(tmp->prop);
-            free(tmp->msg);
-            free(tmp);
+            err_num = rc;
+        }
+    }
 
-            atomic_add(&instance->stats.n_sent, 1);
-            atomic_add(&instance->stats.n_queued, -1);
-            spinlock_acquire(&instance->msg_lock);
-            tmp = instance->messages;
+    spinlock_acquire(&instance->rconn_lock);
+    instance->conn_stat = err_num;
+    spinlock_release(&instance->rconn_lock);
+
+    return count;
+}
 
-            if (tmp == NULL)
+/**
+ * The publisher thread. It reconnects to the broker when needed and publishes
+ * the queued messages in batches.
+ * @param data MQfilter instance
+ */
+static void publisher_main(void* data)
+{
+    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
+
+    while (true)
+    {
+        int err_num;
+
+        spinlock_acquire(&instance->rconn_lock);
+        if (instance->conn_stat != AMQP_STATUS_OK)
+        {
+            if (difftime(time(NULL), instance->last_rconn) > instance->rconn_intv)
             {
-                spinlock_release(&instance->msg_lock);
-                return;
-            }
+                instance->last_rconn = time(NULL);
 
-            instance->messages = instance->messages->next;
-            spinlock_release(&instance->msg_lock);
+                if (init_conn(instance))
+                {
+                    instance->rconn_intv = 1.0;
+                    instance->conn_stat = AMQP_STATUS_OK;
+                }
+                else
+                {
+                    instance->rconn_intv += 5.0;
+                    MXS_ERROR("Failed to reconnect to the MQRabbit server ");
+                }
+            }
+            err_num = instance->conn_stat;
         }
         else
         {
-            spinlock_acquire(&instance->msg_lock);
-            tmp->next = instance->messages;
-            instance->messages = tmp;
-            spinlock_release(&instance->msg_lock);
-            return;
+            err_num = AMQP_STATUS_OK;
+        }
+        spinlock_release(&instance->rconn_lock);
+
+        /** Without a connection the messages stay queued */
+        if (err_num != AMQP_STATUS_OK || publish_batch(instance) == 0)
+        {
+            thread_millisleep(MQ_IDLE_SLEEP_MS);
         }
     }
 }
 
 /**
- * Push a new message on the stack to be broadcasted later.
+ * Queue a new message to be published by the publisher thread. If the queue
+ * is full, the message is dropped.
  * The message assumes ownership of the memory allocated to the message content and properties.
  * @param prop Message properties
  * @param msg Message content
  */
 void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg)
 {
+    atomic_add(&instance->stats.n_msg, 1);
+
+    if (atomic_add(&instance->stats.n_queued, 1) >= instance->queue_size)
+    {
+        atomic_add(&instance->stats.n_queued, -1);
+        atomic_add(&instance->stats.n_dropped, 1);
+        free(prop);
+        free(msg);
+        return;
+    }
 
     mqmessage* newmsg = calloc(1, sizeof(mqmessage));
     if (newmsg)
@@ -957,20 +1259,13 @@ void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg
     else
     {
         MXS_ERROR("Cannot allocate enough memory.");
+        atomic_add(&instance->stats.n_queued, -1);
         free(prop);
         free(msg);
         return;
     }
 
-    spinlock_acquire(&instance->msg_lock);
-
-    newmsg->next = instance->messages;
-    instance->messages = newmsg;
-
-    spinlock_release(&instance->msg_lock);
-
-    atomic_add(&instance->stats.n_msg, 1);
-    atomic_add(&instance->stats.n_queued, 1);
+    mqqueue_push(&instance->messages, newmsg);
 }
 
 /**
@@ -1685,11 +1980,13 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->vhost, my_instance->exchange,
                    my_instance->key, my_instance->queue
                   );
-        dcb_printf(dcb, "%-16s%-16s%-16s\n",
-                   "Messages", "Queued", "Sent");
-        dcb_printf(dcb, "%-16d%-16d%-16d\n",
+        dcb_printf(dcb, "%-16s%-16s%-16s%-16s%-16s\n",
+                   "Messages", "Queued", "Sent", "Dropped", "Resent");
+        dcb_printf(dcb, "%-16d%-16d%-16d%-16d%-16d\n",
                    my_instance->stats.n_msg,
                    my_instance->stats.n_queued,
-                   my_instance->stats.n_sent);
+                   my_instance->stats.n_sent,
+                   my_instance->stats.n_dropped,
+                   my_instance->stats.n_resent);
     }
 }
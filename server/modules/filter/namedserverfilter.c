@@ -15,11 +15,13 @@
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
+#include <mysql_client_server_protocol.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
 #include <regex.h>
 #include <hint.h>
+#include <server.h>
 
 /**
  * @file namedserverfilter.c - a very simple regular expression based filter
@@ -56,6 +58,7 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getCapabilities(void);
 
 
 static FILTER_OBJECT MyObject =
@@ -68,7 +71,7 @@ static FILTER_OBJECT MyObject =
     NULL, // No Upstream requirement
     routeQuery,
     NULL,
-    diagnostic,
+    diagnostic,    getCapabilities,
 };
 
 /**
@@ -80,7 +83,10 @@ typedef struct
     char *user; /* User name to restrict matches */
     char *match; /* Regular expression to match */
     char *server; /* Server to route to */
+    SERVER *target; /* The server if it was found when the filter was created */
     regex_t re; /* Compiled regex text */
+    char *literal; /* Text every match contains, NULL if not known */
+    bool caseless; /* Whether the regex ignores case */
 } REGEXHINT_INSTANCE;
 
 /**
@@ -152,6 +158,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->server = NULL;
         my_instance->source = NULL;
         my_instance->user = NULL;
+        my_instance->literal = NULL;
         bool error = false;
 
         for (int i = 0; params && params[i]; i++)
@@ -226,6 +233,21 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (!error)
+        {
+            my_instance->caseless = cflags & REG_ICASE;
+            my_instance->literal = mxs_pcre2_required_literal(my_instance->match,
+                                                              cflags & REG_EXTENDED ?
+                                                              MXS_REGEX_POSIX_EXTENDED :
+                                                              MXS_REGEX_POSIX_BASIC, false);
+        }
+
+        if (!error && (my_instance->target = server_find_by_unique_name(my_instance->server)) == NULL)
+        {
+            MXS_WARNING("namedserverfilter: Server '%s' was not found, it is looked up "
+                        "by name for each matching statement.", my_instance->server);
+        }
+
         if (error)
         {
             if (my_instance->match)
@@ -258,7 +280,7 @@ newSession(FILTER *instance, SESSION *session)
     REGEXHINT_SESSION *my_session;
     char *remote, *user;
 
-    if ((my_session = calloc(1, sizeof(REGEXHINT_SESSION))) != NULL)
+    if ((my_session = session_arena_alloc(session, sizeof(REGEXHINT_SESSION))) != NULL)
     {
         my_session->n_diverted = 0;
         my_session->n_undiverted = 0;
@@ -295,7 +317,8 @@ closeSession(FILTER *instance, void *session)
 }
 
 /**
- * Free the memory associated with this filter session.
+ * Free the memory associated with this filter session. The filter session
+ * lives in the memory of the client session and is taken back with it.
  *
  * @param instance  The filter instance data
  * @param session   The session being closed
@@ -303,7 +326,6 @@ closeSession(FILTER *instance, void *session)
 static void
 freeSession(FILTER *instance, void *session)
 {
-    free(session);
     return;
 }
 
@@ -341,6 +363,7 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     REGEXHINT_INSTANCE *my_instance = (REGEXHINT_INSTANCE *) instance;
     REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) session;
     char *sql;
+    int len;
 
     if (modutil_is_SQL(queue) && my_session->active)
     {
@@ -348,20 +371,26 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         {
             queue = gwbuf_make_contiguous(queue);
         }
-        if ((sql = modutil_get_SQL(queue)) != NULL)
+        /** The statement is matched in place, REG_STARTEND needs no terminator */
+        if (modutil_extract_SQL(queue, &sql, &len))
         {
-            if (regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+            regmatch_t range = {.rm_so = 0, .rm_eo = len};
+
+            /** Only a statement with the literal of the regex can match it */
+            if ((my_instance->literal == NULL ||
+                 mxs_pcre2_literal_found(my_instance->literal, sql, len, my_instance->caseless)) &&
+                regexec(&my_instance->re, sql, 1, &range, REG_STARTEND) == 0)
             {
-                queue->hint = hint_create_route(queue->hint,
-                                                HINT_ROUTE_TO_NAMED_SERVER,
-                                                my_instance->server);
+                queue->hint = my_instance->target ?
+                    hint_create_server_route(queue->hint, my_instance->target) :
+                    hint_create_route(queue->hint, HINT_ROUTE_TO_NAMED_SERVER,
+                                      my_instance->server);
                 my_session->n_diverted++;
             }
             else
             {
                 my_session->n_undiverted++;
             }
-            free(sql);
         }
     }
     return my_session->down.routeQuery(my_session->down.instance,
@@ -407,3 +436,16 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->user);
     }
 }
+
+/**
+ * Capability routine.
+ *
+ * The filter only routes COM_QUERY statements, the other commands
+ * bypass it.
+ *
+ * @return The commands the filter handles
+ */
+static uint64_t getCapabilities(void)
+{
+    return FILTER_COMMAND(MYSQL_COM_QUERY);
+}
@@ -26,6 +26,11 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * With log_type=unified the queries of all sessions are logged into one
+ * file. The routing threads copy the queries into per-thread rings and a
+ * background thread writes them to the file in large batches. If a ring
+ * is full, the query is not logged and the dropped queries are counted.
+ *
  * Date         Who             Description
  * 03/06/2014   Mark Riddoch    Initial implementation
  * 11/06/2014   Mark Riddoch    Addition of source and match parameters
@@ -40,13 +45,21 @@
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
+#include <mysql_client_server_protocol.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <time.h>
 #include <sys/time.h>
 #include <regex.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <atomic.h>
+#include <thread.h>
+#include <maxconfig.h>
+#include <hk_heartbeat.h>
+#include <maxscale/poll.h>
 
 MODULE_INFO info =
 {
@@ -61,6 +74,44 @@ static char *version_str = "V1.1.1";
 /** Formatting buffer size */
 #define QLA_STRING_BUFFER_SIZE 1024
 
+/** Default size of the per-thread rings of the unified log */
+#define QLA_DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+/** Records are aligned so that a wrap marker always fits at the end of a ring */
+#define QLA_RECORD_ALIGN 16
+
+/** Maximum number of records written with one writev */
+#define QLA_WRITE_BATCH 256
+
+/** How long the writer sleeps when there is nothing to write */
+#define QLA_WRITER_SLEEP_MS 100
+
+/** Marks the end of the data before the ring wraps around */
+#define QLA_RECORD_WRAP UINT32_MAX
+
+/**
+ * The header of a query in a ring. The text of the query, null terminated,
+ * follows the header.
+ */
+typedef struct
+{
+    uint32_t len; /* Length of the text, QLA_RECORD_WRAP for a wrap marker */
+    uint32_t prefix_len; /* Length of the user@host, prefix in the text */
+    time_t time; /* When the query was routed */
+} QLA_RECORD;
+
+/**
+ * A single producer, single consumer ring of queries. The routing thread
+ * only moves the head and the writer thread only moves the tail.
+ */
+typedef struct
+{
+    char *data;
+    size_t size;
+    volatile size_t head; /* Total bytes written */
+    volatile size_t tail; /* Total bytes consumed */
+} QLA_RING;
+
 /*
  * The filter entry points
  */
@@ -71,6 +122,7 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getCapabilities(void);
 
 
 static FILTER_OBJECT MyObject =
@@ -83,7 +135,7 @@ static FILTER_OBJECT MyObject =
     NULL, // No Upstream requirement
     routeQuery,
     NULL, // No client reply
-    diagnostic,
+    diagnostic,    getCapabilities,
 };
 
 /**
@@ -104,6 +156,15 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    bool unified; /* Log all sessions into one file */
+    size_t buffer_size; /* Size of each ring */
+    QLA_RING *rings; /* One ring per thread */
+    int n_rings;
+    int fd; /* The unified log file */
+    volatile time_t epoch; /* Wall clock time when hkheartbeat was zero */
+    int n_logged; /* Queries written to the unified log */
+    int n_dropped; /* Queries not logged because the ring was full */
+    THREAD writer;
 } QLA_INSTANCE;
 
 /**
@@ -122,8 +183,12 @@ typedef struct
     int active;
     char *user;
     char *remote;
+    char *prefix; /* user@remote, for the unified log */
+    int prefix_len;
 } QLA_SESSION;
 
+static void qla_writer(void *data);
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -176,8 +241,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
     QLA_INSTANCE *my_instance;
     int i;
 
-    if ((my_instance = malloc(sizeof(QLA_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(QLA_INSTANCE))) != NULL)
     {
+        my_instance->buffer_size = QLA_DEFAULT_BUFFER_SIZE;
+        my_instance->fd = -1;
         my_instance->source = NULL;
         my_instance->userName = NULL;
         my_instance->match = NULL;
@@ -209,6 +276,32 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->filebase = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "log_type"))
+                {
+                    if (!strcmp(params[i]->value, "unified"))
+                    {
+                        my_instance->unified = true;
+                    }
+                    else if (strcmp(params[i]->value, "session"))
+                    {
+                        MXS_ERROR("qlafilter: Unknown log_type '%s', expected "
+                                  "'session' or 'unified'.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "buffer_size"))
+                {
+                    long size = strtol(params[i]->value, NULL, 10);
+
+                    if (size < QLA_STRING_BUFFER_SIZE)
+                    {
+                        MXS_ERROR("qlafilter: Invalid buffer_size '%s', the "
+                                  "minimum is %d bytes.", params[i]->value,
+                                  QLA_STRING_BUFFER_SIZE);
+                        error = true;
+                    }
+                    my_instance->buffer_size = size;
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("qlafilter: Unexpected parameter '%s'.",
@@ -273,6 +366,61 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (!error && my_instance->unified)
+        {
+            char filename[strlen(my_instance->filebase) + sizeof(".unified")];
+            sprintf(filename, "%s.unified", my_instance->filebase);
+
+            /** Keep the records aligned */
+            my_instance->buffer_size -= my_instance->buffer_size % QLA_RECORD_ALIGN;
+            my_instance->n_rings = config_max_threadcount();
+            my_instance->epoch = time(NULL) - hkheartbeat / 10;
+
+            if ((my_instance->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+            {
+                char errbuf[STRERROR_BUFLEN];
+                MXS_ERROR("qlafilter: Opening output file '%s' failed due to %d, %s",
+                          filename, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+                error = true;
+            }
+            else if ((my_instance->rings = calloc(my_instance->n_rings,
+                                                  sizeof(QLA_RING))) == NULL)
+            {
+                error = true;
+            }
+
+            for (i = 0; !error && i < my_instance->n_rings; i++)
+            {
+                my_instance->rings[i].size = my_instance->buffer_size;
+                if ((my_instance->rings[i].data = malloc(my_instance->buffer_size)) == NULL)
+                {
+                    error = true;
+                }
+            }
+
+            if (!error && thread_start(&my_instance->writer, qla_writer, my_instance) == NULL)
+            {
+                MXS_ERROR("qlafilter: Failed to start the log writer thread.");
+                error = true;
+            }
+
+            if (error)
+            {
+                if (my_instance->rings)
+                {
+                    for (i = 0; i < my_instance->n_rings; i++)
+                    {
+                        free(my_instance->rings[i].data);
+                    }
+                    free(my_instance->rings);
+                }
+                if (my_instance->fd != -1)
+                {
+                    close(my_instance->fd);
+                }
+            }
+        }
+
         if (error)
         {
             if (my_instance->match)
@@ -312,16 +460,16 @@ newSession(FILTER *instance, SESSION *session)
     QLA_SESSION *my_session;
     char *remote, *userName;
 
-    if ((my_session = calloc(1, sizeof(QLA_SESSION))) != NULL)
+    /** The filter session and its strings live in the memory of the session */
+    if ((my_session = session_arena_alloc(session, sizeof(QLA_SESSION))) != NULL)
     {
-        if ((my_session->filename = (char *)malloc(strlen(my_instance->filebase) + 20)) == NULL)
+        if ((my_session->filename = session_arena_alloc(session, strlen(my_instance->filebase) + 20)) == NULL)
         {
             char errbuf[STRERROR_BUFLEN];
             MXS_ERROR("Memory allocation for qla filter "
                       "file name failed due to %d, %s.",
                       errno,
                       strerror_r(errno, errbuf, sizeof(errbuf)));
-            free(my_session);
             return NULL;
         }
         my_session->active = 1;
@@ -348,7 +496,17 @@ newSession(FILTER *instance, SESSION *session)
         // Multiple sessions can try to update my_instance->sessions simultaneously
         atomic_add(&(my_instance->sessions), 1);
 
-        if (my_session->active)
+        if (my_session->active && my_instance->unified)
+        {
+            my_session->prefix_len = strlen(userName) + strlen(remote) + 2;
+
+            if ((my_session->prefix = session_arena_alloc(session, my_session->prefix_len + 1)) == NULL)
+            {
+                return NULL;
+            }
+            sprintf(my_session->prefix, "%s@%s,", userName, remote);
+        }
+        else if (my_session->active)
         {
             my_session->fp = fopen(my_session->filename, "w");
 
@@ -359,8 +517,6 @@ newSession(FILTER *instance, SESSION *session)
                           "fileter failed due to %d, %s",
                           errno,
                           strerror_r(errno, errbuf, sizeof(errbuf)));
-                free(my_session->filename);
-                free(my_session);
                 my_session = NULL;
             }
         }
@@ -396,7 +552,8 @@ closeSession(FILTER *instance, void *session)
 }
 
 /**
- * Free the memory associated with the session
+ * Free the memory associated with the session. The filter session lives in
+ * the memory of the client session and is taken back with it.
  *
  * @param instance  The filter instance
  * @param session   The filter session
@@ -404,10 +561,6 @@ closeSession(FILTER *instance, void *session)
 static void
 freeSession(FILTER *instance, void *session)
 {
-    QLA_SESSION *my_session = (QLA_SESSION *) session;
-
-    free(my_session->filename);
-    free(session);
     return;
 }
 
@@ -427,6 +580,208 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
     my_session->down = *downstream;
 }
 
+/**
+ * Copy a query into the ring of the calling thread. The text is formatted
+ * by the writer thread. If the ring is full the query is dropped.
+ *
+ * @param my_instance   The filter instance
+ * @param ring          The ring of the calling thread
+ * @param my_session    The filter session
+ * @param sql           The SQL of the query
+ */
+static void
+log_to_ring(QLA_INSTANCE *my_instance, QLA_RING *ring, QLA_SESSION *my_session,
+            const char *sql)
+{
+    size_t sql_len = strlen(sql);
+    size_t len = my_session->prefix_len + sql_len;
+    size_t needed = sizeof(QLA_RECORD) + len + 1;
+    size_t head = ring->head;
+    size_t pos = head % ring->size;
+    size_t contiguous = ring->size - pos;
+    size_t padding = 0;
+
+    needed += (QLA_RECORD_ALIGN - needed % QLA_RECORD_ALIGN) % QLA_RECORD_ALIGN;
+
+    /** A record is never split, the rest of the ring is skipped */
+    if (needed > contiguous)
+    {
+        padding = contiguous;
+    }
+
+    if (needed + padding > ring->size - (head - ring->tail))
+    {
+        atomic_add(&my_instance->n_dropped, 1);
+        return;
+    }
+
+    if (padding)
+    {
+        ((QLA_RECORD*)(ring->data + pos))->len = QLA_RECORD_WRAP;
+        pos = 0;
+    }
+
+    QLA_RECORD *rec = (QLA_RECORD*)(ring->data + pos);
+    char *text = (char*)(rec + 1);
+    rec->len = len;
+    rec->prefix_len = my_session->prefix_len;
+    rec->time = my_instance->epoch + hkheartbeat / 10;
+    memcpy(text, my_session->prefix, my_session->prefix_len);
+    memcpy(text + my_session->prefix_len, sql, sql_len + 1);
+
+    /** The record must be complete before the writer can see it */
+    __sync_synchronize();
+    ring->head = head + padding + needed;
+}
+
+/**
+ * Write all of the buffers
+ *
+ * @param fd    File to write to
+ * @param iov   The buffers, modified when the write is partial
+ * @param n     Number of buffers
+ * @return True on success
+ */
+static bool
+write_iov(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+        ssize_t rc = writev(fd, iov, n);
+
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        while (n > 0 && (size_t)rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            iov++;
+            n--;
+        }
+
+        if (n > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Write the queries of a ring to the unified log
+ *
+ * @param my_instance   The filter instance
+ * @param ring          The ring to write
+ * @return Number of queries written
+ */
+static int
+write_ring(QLA_INSTANCE *my_instance, QLA_RING *ring)
+{
+    struct iovec iov[QLA_WRITE_BATCH * 3];
+    char stamps[QLA_WRITE_BATCH][24];
+    time_t stamp_time = 0;
+    char *stamp = NULL;
+    int n_records = 0;
+    int n_iov = 0;
+    size_t tail = ring->tail;
+    size_t head = ring->head;
+
+    /** Read the records only after the head */
+    __sync_synchronize();
+
+    while (tail < head && n_records < QLA_WRITE_BATCH)
+    {
+        QLA_RECORD *rec = (QLA_RECORD*)(ring->data + tail % ring->size);
+
+        if (rec->len == QLA_RECORD_WRAP)
+        {
+            tail += ring->size - tail % ring->size;
+            continue;
+        }
+
+        size_t size = sizeof(QLA_RECORD) + rec->len + 1;
+        size += (QLA_RECORD_ALIGN - size % QLA_RECORD_ALIGN) % QLA_RECORD_ALIGN;
+        char *text = (char*)(rec + 1);
+
+        if (stamp == NULL || rec->time != stamp_time)
+        {
+            struct tm t;
+            stamp = stamps[n_records];
+            stamp_time = rec->time;
+            localtime_r(&stamp_time, &t);
+            strftime(stamp, sizeof(stamps[0]), "%F %T,", &t);
+        }
+
+        /** The ring is not touched by the routing thread until the tail moves */
+        char *sql = trim(squeeze_whitespace(text + rec->prefix_len));
+
+        iov[n_iov].iov_base = stamp;
+        iov[n_iov++].iov_len = strlen(stamp);
+        iov[n_iov].iov_base = text;
+        iov[n_iov++].iov_len = rec->prefix_len;
+        iov[n_iov].iov_base = sql;
+        iov[n_iov].iov_len = strlen(sql) + 1;
+        /** The null terminator is replaced with the line separator */
+        sql[iov[n_iov++].iov_len - 1] = '\n';
+
+        tail += size;
+        n_records++;
+    }
+
+    if (n_iov > 0 && !write_iov(my_instance->fd, iov, n_iov))
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("qlafilter: Failed to write to the unified log: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+
+    __sync_synchronize();
+    ring->tail = tail;
+
+    return n_records;
+}
+
+/**
+ * The thread that writes the unified log. It also keeps the cached wall clock
+ * that the routing threads use for the timestamps up to date.
+ *
+ * @param data  The filter instance
+ */
+static void
+qla_writer(void *data)
+{
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) data;
+
+    while (true)
+    {
+        int written = 0;
+
+        my_instance->epoch = time(NULL) - hkheartbeat / 10;
+
+        for (int i = 0; i < my_instance->n_rings; i++)
+        {
+            written += write_ring(my_instance, &my_instance->rings[i]);
+        }
+
+        if (written == 0)
+        {
+            thread_millisleep(QLA_WRITER_SLEEP_MS);
+        }
+        else
+        {
+            atomic_add(&my_instance->n_logged, written);
+        }
+    }
+}
+
 /**
  * The routeQuery entry point. This is passed the query buffer
  * to which the filter should be applied. Once applied the
@@ -442,31 +797,40 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) session;
+    const char *sql;
     char *ptr;
     int length = 0;
     struct tm t;
     struct timeval tv;
 
-    if (my_session->active)
+    if (my_session->active && my_instance->unified)
     {
-        if (queue->next != NULL)
+        if ((sql = modutil_get_SQL_string(queue)) != NULL &&
+            (my_instance->match == NULL ||
+             regexec(&my_instance->re, sql, 0, NULL, 0) == 0) &&
+            (my_instance->nomatch == NULL ||
+             regexec(&my_instance->nore, sql, 0, NULL, 0) != 0))
         {
-            queue = gwbuf_make_contiguous(queue);
+            QLA_RING *ring = &my_instance->rings[poll_current_thread() % my_instance->n_rings];
+            log_to_ring(my_instance, ring, my_session, sql);
         }
-        if ((ptr = modutil_get_SQL(queue)) != NULL)
+    }
+    else if (my_session->active)
+    {
+        /** The SQL is shared with the other filters, it is copied only to be logged */
+        if ((sql = modutil_get_SQL_string(queue)) != NULL &&
+            (my_instance->match == NULL ||
+             regexec(&my_instance->re, sql, 0, NULL, 0) == 0) &&
+            (my_instance->nomatch == NULL ||
+             regexec(&my_instance->nore, sql, 0, NULL, 0) != 0) &&
+            (ptr = strdup(sql)) != NULL)
         {
-            if ((my_instance->match == NULL ||
-                 regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
-                (my_instance->nomatch == NULL ||
-                 regexec(&my_instance->nore, ptr, 0, NULL, 0) != 0))
-            {
-                char buffer[QLA_STRING_BUFFER_SIZE];
-                gettimeofday(&tv, NULL);
-                localtime_r(&tv.tv_sec, &t);
-                strftime(buffer, sizeof(buffer), "%F %T", &t);
-                fprintf(my_session->fp, "%s,%s@%s,%s\n", buffer, my_session->user,
-                        my_session->remote, trim(squeeze_whitespace(ptr)));
-            }
+            char buffer[QLA_STRING_BUFFER_SIZE];
+            gettimeofday(&tv, NULL);
+            localtime_r(&tv.tv_sec, &t);
+            strftime(buffer, sizeof(buffer), "%F %T", &t);
+            fprintf(my_session->fp, "%s,%s@%s,%s\n", buffer, my_session->user,
+                    my_session->remote, trim(squeeze_whitespace(ptr)));
             free(ptr);
         }
     }
@@ -492,7 +856,16 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) fsession;
 
-    if (my_session)
+    if (my_instance->unified)
+    {
+        dcb_printf(dcb, "\t\tLogging to file            %s.unified\n",
+                   my_instance->filebase);
+        dcb_printf(dcb, "\t\tQueries logged             %d\n",
+                   my_instance->n_logged);
+        dcb_printf(dcb, "\t\tQueries dropped            %d\n",
+                   my_instance->n_dropped);
+    }
+    else if (my_session)
     {
         dcb_printf(dcb, "\t\tLogging to file            %s.\n",
                    my_session->filename);
@@ -518,3 +891,18 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->nomatch);
     }
 }
+
+/**
+ * Capability routine.
+ *
+ * The filter only logs the statements that contain SQL, the other commands
+ * bypass it.
+ *
+ * @return The commands the filter handles
+ */
+static uint64_t getCapabilities(void)
+{
+    return FILTER_COMMAND(MYSQL_COM_QUERY) |
+           FILTER_COMMAND(MYSQL_COM_STMT_PREPARE) |
+           FILTER_COMMAND(MYSQL_COM_INIT_DB);
+}
@@ -16,6 +16,7 @@
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
+#include <mysql_client_server_protocol.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
@@ -57,9 +58,9 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getCapabilities(void);
 
-static char *regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *study,
-                           const char *replace);
+static char *regex_replace(const char *sql, pcre2_code *re, const char *replace);
 
 static FILTER_OBJECT MyObject =
 {
@@ -71,7 +72,7 @@ static FILTER_OBJECT MyObject =
     NULL, // No Upstream requirement
     routeQuery,
     NULL,
-    diagnostic,
+    diagnostic,    getCapabilities,
 };
 
 /**
@@ -84,7 +85,8 @@ typedef struct
     char *match; /*< Regular expression to match */
     char *replace; /*< Replacement text */
     pcre2_code *re; /*< Compiled regex text */
-    pcre2_match_data *match_data; /*< Matching data used by the compiled regex */
+    char *literal; /*< Text every match contains, NULL if not known */
+    bool caseless; /*< Whether the regex ignores case */
     FILE* logfile; /*< Log file */
     bool log_trace; /*< Whether messages should be printed to tracelog */
 } REGEX_INSTANCE;
@@ -95,14 +97,13 @@ typedef struct
 typedef struct
 {
     DOWNSTREAM down; /* The downstream filter */
-    SPINLOCK lock;
     int no_change; /* No. of unchanged requests */
     int replacements; /* No. of changed requests */
     int active; /* Is filter active */
 } REGEX_SESSION;
 
-void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new);
-void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old);
+void log_match(REGEX_INSTANCE* inst, char* re, const char* old, char* new);
+void log_nomatch(REGEX_INSTANCE* inst, char* re, const char* old);
 
 /**
  * Implementation of the mandatory version entry point
@@ -154,12 +155,8 @@ void free_instance(REGEX_INSTANCE *instance)
             pcre2_code_free(instance->re);
         }
 
-        if (instance->match_data)
-        {
-            pcre2_match_data_free(instance->match_data);
-        }
-
         free(instance->match);
+        free(instance->literal);
         free(instance->replace);
         free(instance->source);
         free(instance->user);
@@ -268,12 +265,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
-        if ((my_instance->re = pcre2_compile((PCRE2_SPTR) my_instance->match,
-                                             PCRE2_ZERO_TERMINATED,
-                                             cflags,
-                                             &errnumber,
-                                             &erroffset,
-                                             NULL)) == NULL)
+        if ((my_instance->re = mxs_pcre2_compile(my_instance->match,
+                                                 cflags,
+                                                 &errnumber,
+                                                 &erroffset)) == NULL)
         {
             char errbuffer[1024];
             pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) & errbuffer, sizeof(errbuffer));
@@ -283,14 +278,9 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
-        if ((my_instance->match_data =
-                 pcre2_match_data_create_from_pattern(my_instance->re, NULL)) == NULL)
-        {
-            MXS_ERROR("regexfilter: Failure to create PCRE2 matching data. "
-                      "This is most likely caused by a lack of available memory.");
-            free_instance(my_instance);
-            return NULL;
-        }
+        my_instance->caseless = cflags & PCRE2_CASELESS;
+        my_instance->literal = mxs_pcre2_required_literal(my_instance->match, MXS_REGEX_PCRE2,
+                                                          cflags & PCRE2_EXTENDED);
     }
     return (FILTER *) my_instance;
 }
@@ -309,7 +299,7 @@ newSession(FILTER *instance, SESSION *session)
     REGEX_SESSION *my_session;
     char *remote, *user;
 
-    if ((my_session = calloc(1, sizeof(REGEX_SESSION))) != NULL)
+    if ((my_session = session_arena_alloc(session, sizeof(REGEX_SESSION))) != NULL)
     {
         my_session->no_change = 0;
         my_session->replacements = 0;
@@ -346,7 +336,8 @@ closeSession(FILTER *instance, void *session)
 }
 
 /**
- * Free the memory associated with this filter session.
+ * Free the memory associated with this filter session. The filter session
+ * lives in the memory of the client session and is taken back with it.
  *
  * @param instance  The filter instance data
  * @param session   The session being closed
@@ -354,7 +345,6 @@ closeSession(FILTER *instance, void *session)
 static void
 freeSession(FILTER *instance, void *session)
 {
-    free(session);
     return;
 }
 
@@ -387,38 +377,51 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     REGEX_INSTANCE *my_instance = (REGEX_INSTANCE *) instance;
     REGEX_SESSION *my_session = (REGEX_SESSION *) session;
-    char *sql, *newsql;
+    const char *sql;
+    char *newsql;
 
     if (my_session->active && modutil_is_SQL(queue))
     {
-        if (queue->next != NULL)
+        /** The SQL is shared with the other filters and freed with the buffer */
+        if ((sql = modutil_get_SQL_string(queue)) != NULL)
         {
-            queue = gwbuf_make_contiguous(queue);
-        }
-        if ((sql = modutil_get_SQL(queue)) != NULL)
-        {
-            newsql = regex_replace(sql,
-                                   my_instance->re,
-                                   my_instance->match_data,
-                                   my_instance->replace);
+            /** Only a statement with the literal of the regex can match it */
+            if (my_instance->literal &&
+                !mxs_pcre2_literal_found(my_instance->literal, sql, strlen(sql),
+                                         my_instance->caseless))
+            {
+                newsql = NULL;
+            }
+            else
+            {
+                newsql = regex_replace(sql,
+                                       my_instance->re,
+                                       my_instance->replace);
+            }
+
             if (newsql)
             {
-                queue = modutil_replace_SQL(queue, newsql);
-                queue = gwbuf_make_contiguous(queue);
-                spinlock_acquire(&my_session->lock);
+                /** Logged first, replacing the SQL invalidates the old one */
                 log_match(my_instance, my_instance->match, sql, newsql);
-                spinlock_release(&my_session->lock);
+                GWBUF *replaced = modutil_replace_SQL(queue, newsql);
+
+                if (replaced)
+                {
+                    queue = gwbuf_make_contiguous(replaced);
+                    my_session->replacements++;
+                }
+                else
+                {
+                    MXS_ERROR("regexfilter: Failed to replace the SQL of a query, "
+                              "the query is routed as it was.");
+                }
                 free(newsql);
-                my_session->replacements++;
             }
             else
             {
-                spinlock_acquire(&my_session->lock);
                 log_nomatch(my_instance, my_instance->match, sql);
-                spinlock_release(&my_session->lock);
                 my_session->no_change++;
             }
-            free(sql);
         }
 
     }
@@ -471,25 +474,27 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
  *
  * @param   sql The original SQL text
  * @param   re  The compiled regular expression
- * @param   match_data The PCRE2 matching data buffer
  * @param   replace The replacement text
  * @return  The replaced text or NULL if no replacement was done.
  */
 static char *
-regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, const char *replace)
+regex_replace(const char *sql, pcre2_code *re, const char *replace)
 {
     char *result = NULL;
     size_t result_size;
+    pcre2_match_data *match_data = mxs_pcre2_match_data(re);
+    pcre2_match_context *match_context = mxs_pcre2_match_context();
 
-    /** This should never fail with rc == 0 because we used pcre2_match_data_create_from_pattern() */
-    if (pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL))
+    /** The match data of the thread has room for all the groups so this never returns 0 */
+    if (match_data &&
+        pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0, match_data, match_context) > 0)
     {
         result_size = strlen(sql) + strlen(replace);
         result = malloc(result_size);
 
         while (result &&
                pcre2_substitute(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0,
-                                PCRE2_SUBSTITUTE_GLOBAL, match_data, NULL,
+                                PCRE2_SUBSTITUTE_GLOBAL, match_data, match_context,
                                 (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
                                 (PCRE2_UCHAR*) result, (PCRE2_SIZE*) & result_size) == PCRE2_ERROR_NOMEMORY)
         {
@@ -513,7 +518,7 @@ regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, con
  * @param old Old SQL statement
  * @param new New SQL statement
  */
-void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new)
+void log_match(REGEX_INSTANCE* inst, char* re, const char* old, char* new)
 {
     if (inst->logfile)
     {
@@ -532,7 +537,7 @@ void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new)
  * @param re Regular expression
  * @param old SQL statement
  */
-void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old)
+void log_nomatch(REGEX_INSTANCE* inst, char* re, const char* old)
 {
     if (inst->logfile)
     {
@@ -544,3 +549,16 @@ void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old)
         MXS_INFO("No match %s: [%s]", re, old);
     }
 }
+
+/**
+ * Capability routine.
+ *
+ * The filter only rewrites COM_QUERY statements, the other commands
+ * bypass it.
+ *
+ * @return The commands the filter handles
+ */
+static uint64_t getCapabilities(void)
+{
+    return FILTER_COMMAND(MYSQL_COM_QUERY);
+}
@@ -29,6 +29,12 @@
  *          of the request (optional)
  * user     A user name to match against. If present only requests that
  *          originate from this user will be duplciated (optional)
+ * mode     Either sync or async. In async mode the client does not wait
+ *          for the branch and the duplicates are queued (optional)
+ * queue_size Number of duplicates queued for the branch in async mode
+ *          before duplicates are dropped (optional)
+ * pool_size Number of branch sessions shared by all client sessions,
+ *          implies async mode (optional)
  *
  * Revision History
  * ================
@@ -42,6 +48,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <filter.h>
 #include <modinfo.h>
@@ -57,7 +65,10 @@
 #include <sys/time.h>
 #include <maxscale/poll.h>
 #include <mysql_client_server_protocol.h>
+#include <mysql_wire.h>
 #include <housekeeper.h>
+#include <strhash.h>
+#include <atomic.h>
 
 #define MYSQL_COM_QUIT                  0x01
 #define MYSQL_COM_INITDB                0x02
@@ -75,6 +86,9 @@
 #define PARENT                          0
 #define CHILD                           1
 
+/** Default number of queued duplicates per session in async mode */
+#define TEE_DEFAULT_QUEUE_SIZE          16
+
 #ifdef SS_DEBUG
 static int debug_seq = 0;
 #endif
@@ -129,6 +143,8 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+struct tee_session;
+
 /**
  * The instance structure for the TEE filter - this holds the configuration
  * information for the filter.
@@ -142,6 +158,12 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    bool async; /* Don't wait for the branch replies */
+    int queue_size; /* Maximum number of queued duplicates in async mode */
+    int n_dropped; /* Duplicates dropped by all sessions */
+    int pool_size; /* Number of shared branch sessions, 0 for one per session */
+    struct tee_session* pool; /* The shared branch sessions */
+    int next_slot; /* The shared branch given to the next session */
 } TEE_INSTANCE;
 
 /**
@@ -151,8 +173,11 @@ typedef struct
  * in the chain.
  *
  * It also holds the file descriptor to which queries are written.
+ *
+ * The shared branch sessions of the pool use the same structure. They only
+ * use the branch session, the duplicate queue and the CHILD reply state.
  */
-typedef struct
+typedef struct tee_session
 {
     DOWNSTREAM down; /* The downstream filter */
     UPSTREAM up; /* The upstream filter */
@@ -161,9 +186,10 @@ typedef struct
     bool use_ok;
     int client_multistatement;
     bool multipacket[2];
-    unsigned char command;
+    unsigned char command[2]; /* The command each branch is executing */
     bool waiting[2]; /* if the client is waiting for a reply */
     int eof[2];
+    MODUTIL_PACKET_SCAN scan[2]; /* Reply packet scan state */
     int replies[2]; /* Number of queries received */
     int reply_packets[2]; /* Number of OK, ERR, LOCAL_INFILE_REQUEST or RESULT_SET packets received */
     DCB *branch_dcb; /* Client DCB for "branch" service */
@@ -171,6 +197,19 @@ typedef struct
     TEE_INSTANCE *instance;
     int n_duped; /* Number of duplicated queries */
     int n_rejected; /* Number of rejected queries */
+    int n_dropped; /* Duplicates dropped because the queue was full */
+    GWBUF** mirror; /* Duplicates waiting for the branch in async mode */
+    SESSION* session; /* The client session, charged for the queued duplicates.
+                       * NULL for the shared branches of the pool */
+    int mirror_head; /* Index of the oldest queued duplicate */
+    int mirror_count; /* Number of queued duplicates */
+    bool mirror_broken; /* A required duplicate was dropped, stop duplicating */
+    struct tee_session* pool_slot; /* The shared branch this session uses */
+    char db[MYSQL_DATABASE_MAXLEN + 1]; /* Current database of the client or,
+                                         * for a shared branch, the database it
+                                         * is in after the queued duplicates */
+    MYSQL_session* pool_data; /* Credentials of a shared branch */
+    MySQLProtocol* pool_protocol; /* Protocol data of a shared branch */
     int residual; /* Any outstanding SQL text */
     GWBUF* tee_replybuf; /* Buffer for reply */
     GWBUF* tee_partials[2];
@@ -199,7 +238,7 @@ static orphan_session_t* allOrphans = NULL;
 
 static SPINLOCK orphanLock;
 static int packet_is_required(GWBUF *queue);
-static int detect_loops(TEE_INSTANCE *instance, HASHTABLE* ht, SERVICE* session);
+static int detect_loops(TEE_INSTANCE *instance, STRHASH* ht, SERVICE* session);
 int internal_route(DCB* dcb);
 GWBUF* clone_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* buffer);
 int route_single_query(TEE_INSTANCE* my_instance,
@@ -207,6 +246,17 @@ int route_single_query(TEE_INSTANCE* my_instance,
                        GWBUF* buffer,
                        GWBUF* clone);
 int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer);
+static void reset_branch_state(TEE_SESSION* my_session, int branch, unsigned char command);
+static void scan_init_branch(TEE_SESSION* my_session, int branch);
+static void mirror_push(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* clone);
+static void mirror_route(TEE_SESSION* my_session);
+static int route_async_query(TEE_INSTANCE* my_instance,
+                             TEE_SESSION* my_session,
+                             GWBUF* buffer,
+                             GWBUF* clone);
+static bool pool_connect(TEE_INSTANCE* my_instance, TEE_SESSION* slot, SESSION* session);
+static void pool_push(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* clone);
+static void track_database(TEE_SESSION* my_session, GWBUF* buffer);
 void create_orphan(SESSION* ses);
 
 static void
@@ -370,6 +420,8 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->userName = NULL;
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
+        my_instance->async = false;
+        my_instance->queue_size = TEE_DEFAULT_QUEUE_SIZE;
         if (params)
         {
             for (i = 0; params[i]; i++)
@@ -398,6 +450,37 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->userName = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "mode"))
+                {
+                    if (!strcasecmp(params[i]->value, "async"))
+                    {
+                        my_instance->async = true;
+                    }
+                    else if (strcasecmp(params[i]->value, "sync"))
+                    {
+                        MXS_ERROR("tee: Unknown mode '%s', expected "
+                                  "'sync' or 'async'.", params[i]->value);
+                    }
+                }
+                else if (!strcmp(params[i]->name, "pool_size"))
+                {
+                    if ((my_instance->pool_size = atoi(params[i]->value)) < 0)
+                    {
+                        MXS_ERROR("tee: Invalid pool_size '%s', using one branch "
+                                  "session per client session.", params[i]->value);
+                        my_instance->pool_size = 0;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "queue_size"))
+                {
+                    if ((my_instance->queue_size = atoi(params[i]->value)) <= 0)
+                    {
+                        MXS_ERROR("tee: Invalid queue_size '%s', using the "
+                                  "default of %d.", params[i]->value,
+                                  TEE_DEFAULT_QUEUE_SIZE);
+                        my_instance->queue_size = TEE_DEFAULT_QUEUE_SIZE;
+                    }
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("tee: Unexpected parameter '%s'.",
@@ -440,6 +523,52 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
+        if (my_instance->pool_size > 0)
+        {
+            /** The shared branches can't make the clients wait */
+            my_instance->async = true;
+
+            if ((my_instance->pool = calloc(my_instance->pool_size,
+                                            sizeof(TEE_SESSION))) == NULL)
+            {
+                free(my_instance->match);
+                free(my_instance->nomatch);
+                free(my_instance->source);
+                free(my_instance);
+                return NULL;
+            }
+
+            for (i = 0; i < my_instance->pool_size; i++)
+            {
+                TEE_SESSION* slot = &my_instance->pool[i];
+                slot->active = 1;
+                slot->instance = my_instance;
+                spinlock_init(&slot->tee_lock);
+                slot->mirror = calloc(my_instance->queue_size, sizeof(GWBUF*));
+                slot->pool_data = calloc(1, sizeof(MYSQL_session));
+                slot->pool_protocol = calloc(1, sizeof(MySQLProtocol));
+
+                if (slot->mirror == NULL || slot->pool_data == NULL ||
+                    slot->pool_protocol == NULL)
+                {
+                    MXS_ERROR("tee: Allocating memory for the shared branch "
+                              "sessions failed.");
+                    for (int j = 0; j <= i; j++)
+                    {
+                        free(my_instance->pool[j].mirror);
+                        free(my_instance->pool[j].pool_data);
+                        free(my_instance->pool[j].pool_protocol);
+                    }
+                    free(my_instance->pool);
+                    free(my_instance->match);
+                    free(my_instance->nomatch);
+                    free(my_instance->source);
+                    free(my_instance);
+                    return NULL;
+                }
+            }
+        }
+
         if (my_instance->match &&
             regcomp(&my_instance->re, my_instance->match, cflags))
         {
@@ -496,9 +625,9 @@ newSession(FILTER *instance, SESSION *session)
         goto retblock;
     }
 
-    HASHTABLE* ht = hashtable_alloc(100, simple_str_hash, strcmp);
+    STRHASH* ht = strhash_alloc(16, NULL);
     bool is_loop = detect_loops(my_instance, ht, session->service);
-    hashtable_free(ht);
+    strhash_free(ht);
 
     if (is_loop)
     {
@@ -514,10 +643,22 @@ newSession(FILTER *instance, SESSION *session)
         my_session->residual = 0;
         my_session->tee_replybuf = NULL;
         my_session->client_dcb = session->client_dcb;
+        my_session->session = session;
         my_session->instance = my_instance;
         my_session->client_multistatement = false;
         my_session->queue = NULL;
         spinlock_init(&my_session->tee_lock);
+
+        if (my_instance->async && my_instance->pool_size == 0 &&
+            (my_session->mirror = calloc(my_instance->queue_size, sizeof(GWBUF*))) == NULL)
+        {
+            free(my_session);
+            my_session = NULL;
+            MXS_ERROR("tee: Allocating memory for the duplicate queue failed."
+                      " Terminating session.");
+            goto retblock;
+        }
+
         if (my_instance->source &&
             (remote = session_get_remote(session)) != NULL)
         {
@@ -539,7 +680,22 @@ newSession(FILTER *instance, SESSION *session)
             MXS_WARNING("Tee filter is not active.");
         }
 
-        if (my_session->active)
+        if (my_session->active && my_instance->pool_size > 0)
+        {
+            MYSQL_session* data = (MYSQL_session*) session->client_dcb->data;
+            int slot = atomic_add(&my_instance->next_slot, 1);
+            my_session->pool_slot = &my_instance->pool[abs(slot % my_instance->pool_size)];
+            strcpy(my_session->db, data->db);
+
+            spinlock_acquire(&my_session->pool_slot->tee_lock);
+            if (!pool_connect(my_instance, my_session->pool_slot, session))
+            {
+                MXS_WARNING("tee: Failed to create a shared branch session, "
+                            "statements are duplicated once it can be created.");
+            }
+            spinlock_release(&my_session->pool_slot->tee_lock);
+        }
+        else if (my_session->active)
         {
             DCB* dcb;
             SESSION* ses;
@@ -661,7 +817,7 @@ closeSession(FILTER *instance, void *session)
 
         if (my_session->waiting[PARENT])
         {
-            if (my_session->command != 0x01 &&
+            if (my_session->command[PARENT] != 0x01 &&
                 my_session->client_dcb &&
                 my_session->client_dcb->state == DCB_STATE_POLLING)
             {
@@ -724,6 +880,16 @@ freeSession(FILTER *instance, void *session)
     {
         gwbuf_free(my_session->tee_replybuf);
     }
+    if (my_session->mirror)
+    {
+        int size = my_session->instance->queue_size;
+
+        for (int i = 0; i < my_session->mirror_count; i++)
+        {
+            gwbuf_free(my_session->mirror[(my_session->mirror_head + i) % size]);
+        }
+        free(my_session->mirror);
+    }
     free(session);
 
     orphan_free(NULL);
@@ -826,6 +992,14 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     }
 
     clone = clone_query(my_instance, my_session, buffer);
+
+    if (my_instance->async)
+    {
+        rval = route_async_query(my_instance, my_session, buffer, clone);
+        spinlock_release(&my_session->tee_lock);
+        return rval;
+    }
+
     spinlock_release(&my_session->tee_lock);
 
     /* Reset session state */
@@ -878,27 +1052,6 @@ int count_replies(GWBUF* buffer)
     return replies;
 }
 
-int lenenc_length(uint8_t* ptr)
-{
-    uint8_t val = *ptr;
-    if (val < 251)
-    {
-        return 1;
-    }
-    else if (val == 0xfc)
-    {
-        return 3;
-    }
-    else if (val == 0xfd)
-    {
-        return 4;
-    }
-    else
-    {
-        return 9;
-    }
-}
-
 uint16_t get_response_flags(uint8_t* datastart, bool ok_packet)
 {
     uint8_t* ptr = datastart;
@@ -909,8 +1062,8 @@ uint16_t get_response_flags(uint8_t* datastart, bool ok_packet)
 
     if (ok_packet)
     {
-        ptr += lenenc_length(ptr);
-        ptr += lenenc_length(ptr);
+        ptr += mxs_wire_lenenc_bytes(*ptr);
+        ptr += mxs_wire_lenenc_bytes(*ptr);
         memcpy(&rval, ptr, sizeof(uint8_t) * 2);
     }
     else
@@ -945,7 +1098,6 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
     int more_results = 0;
 
     spinlock_acquire(&my_session->tee_lock);
-    int min_eof = my_session->command != 0x04 ? 2 : 1;
 
     if (!my_session->active)
     {
@@ -956,6 +1108,8 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
     }
 
     branch = instance == NULL ? CHILD : PARENT;
+    int min_eof = my_session->command[branch] != 0x04 ? 2 : 1;
+    bool async = my_session->instance->async;
 
     my_session->tee_partials[branch] = gwbuf_append(my_session->tee_partials[branch], reply);
     my_session->tee_partials[branch] = gwbuf_make_contiguous(my_session->tee_partials[branch]);
@@ -999,7 +1153,8 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
 
     if (my_session->waiting[branch])
     {
-        eof = modutil_count_signal_packets(complete, my_session->use_ok, my_session->eof[branch] > 0, &more_results);
+        eof = modutil_scan_signal_packets(&my_session->scan[branch], complete);
+        more_results = my_session->scan[branch].more;
         my_session->eof[branch] += eof;
 
         if (my_session->eof[branch] >= min_eof)
@@ -1008,6 +1163,7 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
             {
                 my_session->waiting[branch] = true;
                 my_session->eof[branch] = 0;
+                scan_init_branch(my_session, branch);
             }
             else
             {
@@ -1027,7 +1183,20 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
 
     my_session->replies[branch]++;
 
-    if (my_session->tee_replybuf == NULL ||
+    if (async)
+    {
+        /**
+         * The branch replies are discarded and the main replies are
+         * returned to the client as soon as they are complete.
+         */
+        if (branch == CHILD && !my_session->waiting[CHILD])
+        {
+            mirror_route(my_session);
+        }
+
+        route = my_session->tee_replybuf != NULL;
+    }
+    else if (my_session->tee_replybuf == NULL ||
         (!my_session->waiting[PARENT] && my_session->waiting[CHILD]) ||
         ((my_session->multipacket[PARENT] || my_session->multipacket[CHILD]) &&
          (my_session->eof[PARENT] < min_eof || my_session->eof[CHILD] < min_eof)))
@@ -1056,9 +1225,18 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
         my_session->tee_replybuf = NULL;
     }
 
-    if (my_session->queue &&
-        !my_session->waiting[PARENT] &&
-        !my_session->waiting[CHILD])
+    if (async && my_session->queue && !my_session->waiting[PARENT])
+    {
+        GWBUF* buffer = modutil_get_next_MySQL_packet(&my_session->queue);
+        GWBUF* clone = clone_query(my_session->instance, my_session, buffer);
+        MXS_INFO("tee: routing queued query");
+        rc = route_async_query(my_session->instance, my_session, buffer, clone);
+        spinlock_release(&my_session->tee_lock);
+        return rc;
+    }
+    else if (my_session->queue &&
+             !my_session->waiting[PARENT] &&
+             !my_session->waiting[CHILD])
     {
         GWBUF* buffer = modutil_get_next_MySQL_packet(&my_session->queue);
         GWBUF* clone = clone_query(my_session->instance, my_session, buffer);
@@ -1111,12 +1289,45 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
                    my_instance->nomatch);
     }
+    if (my_instance->async)
+    {
+        dcb_printf(dcb, "\t\tAsynchronous duplication, queue size	%d\n",
+                   my_instance->queue_size);
+        if (my_instance->pool_size)
+        {
+            int queued = 0, duped = 0;
+
+            for (int i = 0; i < my_instance->pool_size; i++)
+            {
+                queued += my_instance->pool[i].mirror_count;
+                duped += my_instance->pool[i].n_duped;
+            }
+            dcb_printf(dcb, "\t\tShared branch sessions		%d\n",
+                       my_instance->pool_size);
+            dcb_printf(dcb, "\t\tNo. of statements sent to branches:	%d.\n",
+                       duped);
+            dcb_printf(dcb, "\t\tNo. of statements queued:	%d.\n",
+                       queued);
+        }
+        dcb_printf(dcb, "\t\tNo. of statements dropped:	%d.\n",
+                   my_instance->n_dropped);
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of statements duplicated:	%d.\n",
                    my_session->n_duped);
         dcb_printf(dcb, "\t\tNo. of statements rejected:	%d.\n",
                    my_session->n_rejected);
+        if (my_instance->async)
+        {
+            dcb_printf(dcb, "\t\tNo. of statements dropped:	%d.\n",
+                       my_session->n_dropped);
+            if (!my_session->pool_slot)
+            {
+                dcb_printf(dcb, "\t\tNo. of statements queued:	%d.\n",
+                           my_session->mirror_count);
+            }
+        }
     }
 }
 
@@ -1151,7 +1362,7 @@ packet_is_required(GWBUF *queue)
 /**
  * Detects possible loops in the query cloning chain.
  */
-int detect_loops(TEE_INSTANCE *instance, HASHTABLE* ht, SERVICE* service)
+int detect_loops(TEE_INSTANCE *instance, STRHASH* ht, SERVICE* service)
 {
     SERVICE* svc = service;
     int i;
@@ -1161,7 +1372,7 @@ int detect_loops(TEE_INSTANCE *instance, HASHTABLE* ht, SERVICE* service)
         return -1;
     }
 
-    if (hashtable_add(ht, (void*) service->name, (void*) true) == 0)
+    if (strhash_add(ht, service->name, (void*) true) == 0)
     {
         return true;
     }
@@ -1220,8 +1431,9 @@ GWBUF* clone_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* bu
     int residual = 0;
     char* ptr;
 
-    if (my_session->branch_session &&
-        my_session->branch_session->state == SESSION_STATE_ROUTER_READY)
+    if (my_session->pool_slot ||
+        (my_session->branch_session &&
+         my_session->branch_session->state == SESSION_STATE_ROUTER_READY))
     {
         if (my_session->residual)
         {
@@ -1334,25 +1546,212 @@ int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer)
             my_session->client_multistatement = *((unsigned char*) buffer->start + 5);
             MXS_INFO("tee: client %s multistatements",
                      my_session->client_multistatement ? "enabled" : "disabled");
+        default:
+            break;
+    }
+
+    reset_branch_state(my_session, PARENT, command);
+    reset_branch_state(my_session, CHILD, command);
+
+    return 1;
+}
+
+/**
+ * Reset the reply tracking of one branch for a new command
+ * @param my_session Tee session
+ * @param branch PARENT or CHILD
+ * @param command The command that is sent to the branch
+ */
+static void reset_branch_state(TEE_SESSION* my_session, int branch, unsigned char command)
+{
+    switch (command)
+    {
+        case 0x1b:
         case 0x03:
         case 0x16:
         case 0x17:
         case 0x04:
         case 0x0a:
-            memset(my_session->multipacket, (char) true, 2 * sizeof(bool));
+            my_session->multipacket[branch] = true;
             break;
         default:
-            memset(my_session->multipacket, (char) false, 2 * sizeof(bool));
+            my_session->multipacket[branch] = false;
             break;
     }
 
-    memset(my_session->replies, 0, 2 * sizeof(int));
-    memset(my_session->reply_packets, 0, 2 * sizeof(int));
-    memset(my_session->eof, 0, 2 * sizeof(int));
-    memset(my_session->waiting, 1, 2 * sizeof(bool));
-    my_session->command = command;
+    my_session->replies[branch] = 0;
+    my_session->reply_packets[branch] = 0;
+    my_session->eof[branch] = 0;
+    scan_init_branch(my_session, branch);
+    my_session->waiting[branch] = true;
+    my_session->command[branch] = command;
+}
+
+/**
+ * Start the scan of the replies of one branch. The result sets of a branch
+ * end in an OK packet if its client negotiated CLIENT_DEPRECATE_EOF.
+ * @param my_session Tee session
+ * @param branch PARENT or CHILD
+ */
+static void scan_init_branch(TEE_SESSION* my_session, int branch)
+{
+    SESSION* ses = NULL;
+
+    if (branch == PARENT)
+    {
+        ses = my_session->client_dcb ? my_session->client_dcb->session : NULL;
+    }
+    else
+    {
+        ses = my_session->branch_session;
+    }
+
+    modutil_scan_init_eof(&my_session->scan[branch], modutil_deprecate_eof(ses));
+}
 
-    return 1;
+/**
+ * Queue a duplicate for the branch session in async mode. If the queue is
+ * full, the duplicate is dropped. Dropping a command that changes the session
+ * state would make the branch diverge from the client so in that case
+ * duplication stops for the rest of the session.
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param clone The duplicate
+ */
+static void mirror_push(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* clone)
+{
+    if (my_session->mirror_broken)
+    {
+        my_session->n_dropped++;
+        atomic_add(&my_instance->n_dropped, 1);
+        gwbuf_free(clone);
+    }
+    else if (my_session->mirror_count < my_instance->queue_size)
+    {
+        int tail = (my_session->mirror_head + my_session->mirror_count) % my_instance->queue_size;
+        my_session->mirror[tail] = clone;
+        my_session->mirror_count++;
+        session_mem_add(my_session->session, gwbuf_length(clone));
+    }
+    else
+    {
+        if (packet_is_required(clone))
+        {
+            MXS_WARNING("tee: Duplicate queue of the branch session is full and a "
+                        "session command was dropped. Duplicating is stopped for "
+                        "the rest of the session.");
+            my_session->mirror_broken = true;
+        }
+        my_session->n_dropped++;
+        atomic_add(&my_instance->n_dropped, 1);
+        gwbuf_free(clone);
+    }
+}
+
+/**
+ * Send queued duplicates to the branch session until a duplicate that is
+ * waiting for a reply is sent. Must be called with the session lock held.
+ * @param my_session Tee session
+ */
+static void mirror_route(TEE_SESSION* my_session)
+{
+    int size = my_session->instance->queue_size;
+
+    while (my_session->mirror_count > 0 && !my_session->waiting[CHILD])
+    {
+        GWBUF* clone = my_session->mirror[my_session->mirror_head];
+        my_session->mirror_head = (my_session->mirror_head + 1) % size;
+        my_session->mirror_count--;
+        session_mem_add(my_session->session, -(int64_t)gwbuf_length(clone));
+
+        if (my_session->branch_session == NULL ||
+            my_session->branch_session->state != SESSION_STATE_ROUTER_READY)
+        {
+            /** The branch is gone, the client session is not affected */
+            my_session->n_dropped++;
+            atomic_add(&my_session->instance->n_dropped, 1);
+            gwbuf_free(clone);
+            continue;
+        }
+
+        unsigned char command = ((uint8_t*) GWBUF_DATA(clone))[4];
+        reset_branch_state(my_session, CHILD, command);
+
+        /** These commands have no reply */
+        if (command == MYSQL_COM_STMT_SEND_LONG_DATA ||
+            command == MYSQL_COM_STMT_CLOSE ||
+            command == MYSQL_COM_QUIT)
+        {
+            my_session->waiting[CHILD] = false;
+        }
+
+        my_session->n_duped++;
+        SESSION_ROUTE_QUERY(my_session->branch_session, clone);
+    }
+}
+
+/**
+ * Route the main query downstream without waiting for the branch session.
+ * The clone, if any, is queued and sent to the branch once it has replied
+ * to the earlier duplicates. Must be called with the session lock held.
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param buffer Main buffer
+ * @param clone Cloned buffer or NULL
+ * @return 1 on success, 0 on failure.
+ */
+static int route_async_query(TEE_INSTANCE* my_instance,
+                             TEE_SESSION* my_session,
+                             GWBUF* buffer,
+                             GWBUF* clone)
+{
+    if (gwbuf_length(buffer) < 5)
+    {
+        gwbuf_free(buffer);
+        if (clone)
+        {
+            gwbuf_free(clone);
+        }
+        return 0;
+    }
+
+    reset_branch_state(my_session, PARENT, ((uint8_t*) GWBUF_DATA(buffer))[4]);
+
+    if (my_session->pool_slot)
+    {
+        track_database(my_session, buffer);
+
+        /**
+         * The shared branches are used by many clients so the commands that
+         * change the state of the connection are not duplicated. The current
+         * database is restored on the branch before each duplicate.
+         */
+        if (clone && packet_is_required(clone))
+        {
+            gwbuf_free(clone);
+        }
+        else if (clone)
+        {
+            pool_push(my_instance, my_session, clone);
+        }
+        else
+        {
+            my_session->n_rejected++;
+        }
+    }
+    else if (clone)
+    {
+        mirror_push(my_instance, my_session, clone);
+        mirror_route(my_session);
+    }
+    else
+    {
+        my_session->n_rejected++;
+    }
+
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session,
+                                       buffer);
 }
 
 void create_orphan(SESSION* ses)
@@ -1373,3 +1772,216 @@ void create_orphan(SESSION* ses)
         spinlock_release(&orphanLock);
     }
 }
+
+/**
+ * Create the branch session of a shared branch if it doesn't have a usable
+ * one. The branch is created with the credentials of the client session
+ * and it outlives it, so the client data is copied instead of shared.
+ * Must be called with the lock of the shared branch held.
+ * @param my_instance Tee instance
+ * @param slot The shared branch
+ * @param session The client session whose credentials are used
+ * @return True if the shared branch has a usable branch session
+ */
+static bool pool_connect(TEE_INSTANCE* my_instance, TEE_SESSION* slot, SESSION* session)
+{
+    MySQLProtocol* protocol = (MySQLProtocol*) session->client_dcb->protocol;
+    UPSTREAM* dummy_upstream;
+    SESSION* ses;
+    DCB* dcb;
+
+    if (slot->branch_session &&
+        slot->branch_session->state == SESSION_STATE_ROUTER_READY)
+    {
+        return true;
+    }
+
+    if (slot->branch_session && slot->branch_session->state == SESSION_STATE_STOPPING)
+    {
+        create_orphan(slot->branch_session);
+    }
+    slot->branch_session = NULL;
+
+    if ((dcb = dcb_clone(session->client_dcb)) == NULL)
+    {
+        return false;
+    }
+
+    memcpy(slot->pool_data, session->client_dcb->data, sizeof(MYSQL_session));
+    slot->pool_data->auth_token = NULL;
+    slot->pool_data->auth_token_len = 0;
+
+    memset(slot->pool_protocol, 0, sizeof(MySQLProtocol));
+#if defined(SS_DEBUG)
+    slot->pool_protocol->protocol_chk_top = CHK_NUM_PROTOCOL;
+    slot->pool_protocol->protocol_chk_tail = CHK_NUM_PROTOCOL;
+#endif
+    slot->pool_protocol->fd = DCBFD_CLOSED;
+    slot->pool_protocol->owner_dcb = dcb;
+    spinlock_init(&slot->pool_protocol->protocol_lock);
+    slot->pool_protocol->current_command = MYSQL_COM_UNDEFINED;
+    slot->pool_protocol->protocol_command.scom_cmd = MYSQL_COM_UNDEFINED;
+    slot->pool_protocol->protocol_auth_state = protocol->protocol_auth_state;
+    slot->pool_protocol->protocol_state = protocol->protocol_state;
+    memcpy(slot->pool_protocol->scramble, protocol->scramble, MYSQL_SCRAMBLE_LEN);
+    slot->pool_protocol->server_capabilities = protocol->server_capabilities;
+    slot->pool_protocol->client_capabilities = protocol->client_capabilities;
+    slot->pool_protocol->charset = protocol->charset;
+
+    dcb->data = slot->pool_data;
+    dcb->protocol = slot->pool_protocol;
+
+    if (slot->dummy_filterdef == NULL &&
+        (slot->dummy_filterdef = filter_alloc("tee_dummy", "tee_dummy")) == NULL)
+    {
+        dcb_close(dcb);
+        return false;
+    }
+
+    if ((ses = session_alloc(my_instance->service, dcb)) == NULL)
+    {
+        dcb_close(dcb);
+        return false;
+    }
+
+    slot->dummy_filterdef->obj = GetModuleObject();
+    slot->dummy_filterdef->filter = NULL;
+
+    if ((dummy_upstream = filterUpstream(slot->dummy_filterdef, slot, &ses->tail)) == NULL)
+    {
+        spinlock_acquire(&ses->ses_lock);
+        ses->state = SESSION_STATE_STOPPING;
+        spinlock_release(&ses->ses_lock);
+        ses->service->router->closeSession(ses->service->router_instance,
+                                           ses->router_session);
+        dcb_close(dcb);
+        return false;
+    }
+
+    ses->tail = *dummy_upstream;
+    free(dummy_upstream);
+
+    slot->branch_session = ses;
+    slot->branch_dcb = dcb;
+    slot->waiting[CHILD] = false;
+    strcpy(slot->db, slot->pool_data->db);
+
+    return true;
+}
+
+/**
+ * Queue a duplicate for the shared branch of the session. If the branch is
+ * in a different database than the client, a COM_INIT_DB is queued before
+ * the duplicate. Either both are queued or the duplicate is dropped.
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param clone The duplicate
+ */
+static void pool_push(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* clone)
+{
+    TEE_SESSION* slot = my_session->pool_slot;
+
+    spinlock_acquire(&slot->tee_lock);
+
+    bool change_db = *my_session->db && strcmp(slot->db, my_session->db);
+    int needed = change_db ? 2 : 1;
+
+    if (slot->mirror_count + needed > my_instance->queue_size)
+    {
+        my_session->n_dropped++;
+        atomic_add(&my_instance->n_dropped, 1);
+        gwbuf_free(clone);
+    }
+    else
+    {
+        if (change_db)
+        {
+            size_t len = strlen(my_session->db);
+            GWBUF* initdb = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+
+            if (initdb == NULL)
+            {
+                my_session->n_dropped++;
+                atomic_add(&my_instance->n_dropped, 1);
+                gwbuf_free(clone);
+                spinlock_release(&slot->tee_lock);
+                return;
+            }
+
+            uint8_t* ptr = GWBUF_DATA(initdb);
+            gw_mysql_set_byte3(ptr, len + 1);
+            ptr[3] = 0;
+            ptr[4] = MYSQL_COM_INITDB;
+            memcpy(ptr + 5, my_session->db, len);
+
+            mirror_push(my_instance, slot, initdb);
+            strcpy(slot->db, my_session->db);
+        }
+
+        mirror_push(my_instance, slot, clone);
+        my_session->n_duped++;
+        mirror_route(slot);
+    }
+
+    spinlock_release(&slot->tee_lock);
+}
+
+/**
+ * Track the current database of the client from COM_INIT_DB and USE
+ * statements so that it can be restored on the shared branch.
+ * @param my_session Tee session
+ * @param buffer Query sent by the client
+ */
+static void track_database(TEE_SESSION* my_session, GWBUF* buffer)
+{
+    uint8_t* ptr = GWBUF_DATA(buffer);
+    size_t len = gw_mysql_get_byte3(ptr);
+    char* start = (char*) ptr + 5;
+    char* end = start + len - 1;
+
+    if (len == 0 || GWBUF_LENGTH(buffer) < MYSQL_HEADER_LEN + len)
+    {
+        return;
+    }
+
+    if (ptr[4] == 0x03)
+    {
+        while (start < end && isspace(*start))
+        {
+            start++;
+        }
+
+        if (end - start < 4 || strncasecmp(start, "use", 3) || !isspace(start[3]))
+        {
+            return;
+        }
+
+        start += 4;
+
+        while (start < end && isspace(*start))
+        {
+            start++;
+        }
+
+        while (end > start && (isspace(end[-1]) || end[-1] == ';'))
+        {
+            end--;
+        }
+
+        if (end - start > 1 && *start == '`' && end[-1] == '`')
+        {
+            start++;
+            end--;
+        }
+    }
+    else if (ptr[4] != MYSQL_COM_INITDB)
+    {
+        return;
+    }
+
+    if (end > start && end - start <= MYSQL_DATABASE_MAXLEN)
+    {
+        memcpy(my_session->db, start, end - start);
+        my_session->db[end - start] = '\0';
+    }
+}
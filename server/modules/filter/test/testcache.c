@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testcache.c - The hits, the invalidation and the time-to-live of the
+ * result set cache
+ *
+ * The test is run in the build directory of the filters. The filter is loaded
+ * from there and placed between a router and a client that only count the
+ * statements and the replies.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+#include <gwdirs.h>
+#include <modules.h>
+#include <modutil.h>
+#include <filter.h>
+#include <session.h>
+#include <dcb.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+
+static FILTER_OBJECT *cache;
+static int n_routed; /*< Statements that reached the router */
+static int n_replies; /*< Replies that reached the client */
+
+static int
+route_query(void *instance, void *session, GWBUF *queue)
+{
+    n_routed++;
+    gwbuf_free(queue);
+    return 1;
+}
+
+static int
+client_reply(void *instance, void *session, GWBUF *queue)
+{
+    n_replies++;
+    gwbuf_free(queue);
+    return 1;
+}
+
+typedef struct
+{
+    FILTER *instance;
+    void *fsession;
+    SESSION session;
+    DCB dcb;
+    MYSQL_session data;
+} TEST_SESSION;
+
+static void
+test_session_init(TEST_SESSION *ts, const char *ttl)
+{
+    FILTER_PARAMETER param = {"ttl", (char*)ttl};
+    FILTER_PARAMETER *params[] = {&param, NULL};
+    DOWNSTREAM down = {NULL, NULL, route_query};
+    UPSTREAM up = {NULL, NULL, client_reply, NULL};
+
+    memset(ts, 0, sizeof(*ts));
+    strcpy(ts->data.db, "test");
+    ts->dcb.user = "maxuser";
+    ts->dcb.data = &ts->data;
+    ts->session.client_dcb = &ts->dcb;
+
+    ts->instance = cache->createInstance(NULL, params);
+    ss_info_dassert(ts->instance, "The filter instance should be created");
+    ts->fsession = cache->newSession(ts->instance, &ts->session);
+    ss_info_dassert(ts->fsession, "The filter session should be created");
+    cache->setDownstream(ts->instance, ts->fsession, &down);
+    cache->setUpstream(ts->instance, ts->fsession, &up);
+}
+
+static GWBUF *
+make_packet(GWBUF *head, uint8_t seq, const char *payload, size_t len)
+{
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + len);
+    uint8_t *ptr = (uint8_t*) GWBUF_DATA(buf);
+
+    gw_mysql_set_byte3(ptr, len);
+    ptr[3] = seq;
+    memcpy(ptr + MYSQL_HEADER_LEN, payload, len);
+
+    return gwbuf_append(head, buf);
+}
+
+/** A result set with one column and one row */
+static GWBUF *
+make_resultset()
+{
+    static const char coldef[] = "\x03" "def\x04test\x01t\x01t\x01" "a\x01" "a\x0c"
+                                 "\x3f\x00\x0b\x00\x00\x00\x03\x00\x00\x00\x00\x00";
+    GWBUF *reply = make_packet(NULL, 1, "\x01", 1);
+    reply = make_packet(reply, 2, coldef, sizeof(coldef) - 1);
+    reply = make_packet(reply, 3, "\xfe\x00\x00\x02\x00", 5);
+    reply = make_packet(reply, 4, "\x01" "1", 2);
+    return make_packet(reply, 5, "\xfe\x00\x00\x02\x00", 5);
+}
+
+static GWBUF *
+make_ok()
+{
+    return make_packet(NULL, 1, "\x00\x00\x00\x02\x00\x00\x00", 7);
+}
+
+/** Route a statement and return the reply the router would */
+static void
+execute(TEST_SESSION *ts, GWBUF *queue, GWBUF *reply)
+{
+    int routed = n_routed;
+
+    cache->routeQuery(ts->instance, ts->fsession, queue);
+
+    if (n_routed > routed)
+    {
+        cache->clientReply(ts->instance, ts->fsession, reply);
+    }
+    else
+    {
+        gwbuf_free(reply);
+    }
+}
+
+/**
+ * Execute a SELECT
+ *
+ * @return True if the result set came from the cache
+ */
+static bool
+select_from(TEST_SESSION *ts, char *sql)
+{
+    int routed = n_routed;
+    int replies = n_replies;
+
+    execute(ts, modutil_create_query(sql), make_resultset());
+    ss_info_dassert(n_replies == replies + 1, "The client should get one reply");
+
+    return n_routed == routed;
+}
+
+static void
+query(TEST_SESSION *ts, char *sql)
+{
+    execute(ts, modutil_create_query(sql), make_ok());
+}
+
+static void
+prepare(TEST_SESSION *ts, char *sql, uint32_t id)
+{
+    char ok[12] = {0};
+    GWBUF *queue = modutil_create_query(sql);
+
+    ((uint8_t*)GWBUF_DATA(queue))[MYSQL_HEADER_LEN] = MYSQL_COM_STMT_PREPARE;
+    gw_mysql_set_byte4((uint8_t*)ok + 1, id);
+    execute(ts, queue, make_packet(NULL, 1, ok, sizeof(ok)));
+}
+
+static void
+stmt_execute(TEST_SESSION *ts, uint32_t id)
+{
+    char payload[10] = {MYSQL_COM_STMT_EXECUTE};
+
+    gw_mysql_set_byte4((uint8_t*)payload + 1, id);
+    payload[6] = 1; /*< Iteration count */
+    execute(ts, make_packet(NULL, 0, payload, sizeof(payload)), make_ok());
+}
+
+static void
+test_session_free(TEST_SESSION *ts)
+{
+    cache->closeSession(ts->instance, ts->fsession);
+    cache->freeSession(ts->instance, ts->fsession);
+}
+
+/**
+ * test1    A result set is returned from the cache and only deterministic
+ *          reads are cached
+ *
+ */
+static int
+test1()
+{
+    TEST_SESSION ts;
+
+    ss_dfprintf(stderr, "testcache : Cache hits");
+    test_session_init(&ts, "60");
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1"), "The first SELECT should be routed");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "The second SELECT should hit the cache");
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1 WHERE a > 0"),
+                    "Another SELECT should be routed");
+    ss_info_dassert(!select_from(&ts, "SELECT NOW() FROM t1"), "A SELECT should be routed");
+    ss_info_dassert(!select_from(&ts, "SELECT NOW() FROM t1"),
+                    "A SELECT calling a nondeterministic function should not be cached");
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1 ORDER BY RAND()"), "A SELECT should be routed");
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1 ORDER BY RAND()"),
+                    "A SELECT ordered by a nondeterministic function should not be cached");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "The cached result set should remain");
+    test_session_free(&ts);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    A write only invalidates the result sets of the tables it modifies
+ *
+ */
+static int
+test2()
+{
+    TEST_SESSION ts;
+
+    ss_dfprintf(stderr, "testcache : Invalidation by table");
+    test_session_init(&ts, "60");
+    select_from(&ts, "SELECT a FROM t1");
+    select_from(&ts, "SELECT a FROM t2");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "t1 should be cached");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t2"), "t2 should be cached");
+
+    query(&ts, "UPDATE t1 SET a = 2");
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1"), "The UPDATE should invalidate t1");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t2"), "The UPDATE should not invalidate t2");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "t1 should be cached again");
+    test_session_free(&ts);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    Executing a prepared read invalidates nothing, a prepared write
+ *          only invalidates its tables and an unknown statement everything
+ *
+ */
+static int
+test3()
+{
+    TEST_SESSION ts;
+
+    ss_dfprintf(stderr, "testcache : Invalidation by prepared statements");
+    test_session_init(&ts, "60");
+    select_from(&ts, "SELECT a FROM t1");
+    select_from(&ts, "SELECT a FROM t2");
+
+    prepare(&ts, "SELECT a FROM t2 WHERE a = ?", 1);
+    prepare(&ts, "UPDATE t1 SET a = ?", 2);
+    stmt_execute(&ts, 1);
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "A prepared read should not invalidate t1");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t2"), "A prepared read should not invalidate t2");
+
+    stmt_execute(&ts, 2);
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1"), "The prepared UPDATE should invalidate t1");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t2"),
+                    "The prepared UPDATE should not invalidate t2");
+
+    stmt_execute(&ts, 3);
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t2"),
+                    "An unknown statement should invalidate everything");
+    test_session_free(&ts);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test4    A result set is not returned after its time-to-live
+ *
+ */
+static int
+test4()
+{
+    TEST_SESSION ts;
+
+    ss_dfprintf(stderr, "testcache : Time-to-live");
+    test_session_init(&ts, "1");
+    select_from(&ts, "SELECT a FROM t1");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "t1 should be cached");
+    sleep(2);
+    ss_info_dassert(!select_from(&ts, "SELECT a FROM t1"), "The result set should have expired");
+    ss_info_dassert(select_from(&ts, "SELECT a FROM t1"), "t1 should be cached again");
+    test_session_free(&ts);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+
+    set_libdir(strdup("../../../query_classifier/qc_sqlite/"));
+    ss_info_dassert(qc_init("qc_sqlite", NULL) && qc_thread_init(),
+                    "The query classifier should be initialized");
+
+    set_libdir(strdup("."));
+    cache = (FILTER_OBJECT*) load_module("cachefilter", MODULE_FILTER);
+    ss_info_dassert(cache, "The cache filter should be loaded");
+
+    result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+
+    qc_thread_end();
+    qc_end();
+    mxs_log_finish();
+
+    exit(result);
+}
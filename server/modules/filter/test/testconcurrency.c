@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testconcurrency.c - The queue and the reply tracking of the
+ * concurrency filter
+ *
+ * The test is run in the build directory of the filters. The filter is loaded
+ * from there with a limit of one query in progress and placed between a router
+ * and a client that only count the statements and the replies. A query that
+ * is given a slot is handed back to the read queue of the client DCB of its
+ * session, where the test picks it up.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+#include <gwdirs.h>
+#include <modules.h>
+#include <modutil.h>
+#include <filter.h>
+#include <session.h>
+#include <dcb.h>
+#include <maxscale/poll.h>
+#include <mysql_client_server_protocol.h>
+
+static FILTER_OBJECT *concurrency;
+static FILTER *instance;
+static int n_routed; /*< Statements that reached the router */
+static uint8_t last_routed; /*< Command of the last statement */
+
+static int
+route_query(void *instance, void *session, GWBUF *queue)
+{
+    n_routed++;
+    gwbuf_copy_data(queue, MYSQL_HEADER_LEN, 1, &last_routed);
+    gwbuf_free(queue);
+    return 1;
+}
+
+static int
+client_reply(void *instance, void *session, GWBUF *queue)
+{
+    gwbuf_free(queue);
+    return 1;
+}
+
+typedef struct
+{
+    void *fsession;
+    SESSION session;
+    DCB dcb;
+} TEST_SESSION;
+
+static void
+test_session_init(TEST_SESSION *ts)
+{
+    DOWNSTREAM down = {NULL, NULL, route_query};
+    UPSTREAM up = {NULL, NULL, client_reply, NULL};
+
+    memset(ts, 0, sizeof(*ts));
+    ts->session.client_dcb = &ts->dcb;
+
+    ts->fsession = concurrency->newSession(instance, &ts->session);
+    ss_info_dassert(ts->fsession, "The filter session should be created");
+    concurrency->setDownstream(instance, ts->fsession, &down);
+    concurrency->setUpstream(instance, ts->fsession, &up);
+}
+
+static void
+test_session_free(TEST_SESSION *ts)
+{
+    concurrency->closeSession(instance, ts->fsession);
+    concurrency->freeSession(instance, ts->fsession);
+}
+
+static GWBUF *
+make_packet(GWBUF *head, uint8_t seq, const char *payload, size_t len)
+{
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + len);
+    uint8_t *ptr = (uint8_t*) GWBUF_DATA(buf);
+
+    gw_mysql_set_byte3(ptr, len);
+    ptr[3] = seq;
+    memcpy(ptr + MYSQL_HEADER_LEN, payload, len);
+
+    return gwbuf_append(head, buf);
+}
+
+static GWBUF *
+make_command(uint8_t command, const char *sql)
+{
+    GWBUF *queue = modutil_create_query((char*)sql);
+    ((uint8_t*)GWBUF_DATA(queue))[MYSQL_HEADER_LEN] = command;
+    return queue;
+}
+
+static GWBUF *
+make_stmt_close(uint32_t id)
+{
+    char payload[5] = {MYSQL_COM_STMT_CLOSE};
+    gw_mysql_set_byte4((uint8_t*)payload + 1, id);
+    return make_packet(NULL, 0, payload, sizeof(payload));
+}
+
+static GWBUF *
+make_ok()
+{
+    return make_packet(NULL, 1, "\x00\x00\x00\x02\x00\x00\x00", 7);
+}
+
+/**
+ * Route the queries that were given a slot, the way the client protocol
+ * would read them from the client DCB
+ *
+ * @return Number of queries that were handed back
+ */
+static int
+route_admitted(TEST_SESSION *ts)
+{
+    GWBUF *readq = ts->dcb.dcb_readqueue;
+    GWBUF *packet;
+    int n = 0;
+
+    ts->dcb.dcb_readqueue = NULL;
+
+    while ((packet = modutil_get_next_MySQL_packet(&readq)))
+    {
+        concurrency->routeQuery(instance, ts->fsession, packet);
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * test1    A command without a reply that is sent while the query of the
+ *          session is queued is kept behind the query
+ *
+ */
+static int
+test1()
+{
+    /** The client DCBs stay in the event queue of the polling system */
+    static TEST_SESSION a;
+    static TEST_SESSION b;
+
+    ss_dfprintf(stderr, "testconcurrency : Commands without a reply wait behind a queued query");
+    test_session_init(&a);
+    test_session_init(&b);
+
+    concurrency->routeQuery(instance, a.fsession, make_command(MYSQL_COM_QUERY, "SELECT 1"));
+    ss_info_dassert(n_routed == 1, "The first query should be routed");
+    concurrency->routeQuery(instance, b.fsession, make_command(MYSQL_COM_QUERY, "SELECT 2"));
+    ss_info_dassert(n_routed == 1, "The second query should be queued");
+    concurrency->routeQuery(instance, b.fsession, make_stmt_close(1));
+    ss_info_dassert(n_routed == 1, "COM_STMT_CLOSE should not overtake the queued query");
+
+    concurrency->clientReply(instance, a.fsession, make_ok());
+    ss_info_dassert(route_admitted(&b) == 2,
+                    "The queued query and COM_STMT_CLOSE should be handed back");
+    ss_info_dassert(n_routed == 3 && last_routed == MYSQL_COM_STMT_CLOSE,
+                    "COM_STMT_CLOSE should be routed after the query");
+
+    concurrency->clientReply(instance, b.fsession, make_ok());
+    test_session_free(&a);
+    test_session_free(&b);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    The reply to COM_STMT_PREPARE is complete only after the parameter
+ *          and the column definitions
+ *
+ */
+static int
+test2()
+{
+    static const char coldef[] = "\x03" "def\x04test\x01t\x01t\x01" "a\x01" "a\x0c"
+                                 "\x3f\x00\x0b\x00\x00\x00\x03\x00\x00\x00\x00\x00";
+    /** Statement 1 with two columns and one parameter */
+    static const char prepare_ok[] = "\x00\x01\x00\x00\x00\x02\x00\x01\x00\x00\x00\x00";
+    /** The client DCBs stay in the event queue of the polling system */
+    static TEST_SESSION a;
+    static TEST_SESSION b;
+    int routed = n_routed;
+
+    ss_dfprintf(stderr, "testconcurrency : The reply to COM_STMT_PREPARE");
+    test_session_init(&a);
+    test_session_init(&b);
+
+    concurrency->routeQuery(instance, a.fsession,
+                            make_command(MYSQL_COM_STMT_PREPARE, "SELECT a, b FROM t1 WHERE c = ?"));
+    concurrency->routeQuery(instance, b.fsession, make_command(MYSQL_COM_QUERY, "SELECT 1"));
+    ss_info_dassert(n_routed == routed + 1, "The second query should be queued");
+
+    GWBUF *reply = make_packet(NULL, 1, prepare_ok, sizeof(prepare_ok) - 1);
+    reply = make_packet(reply, 2, coldef, sizeof(coldef) - 1);
+    concurrency->clientReply(instance, a.fsession, reply);
+    ss_info_dassert(b.dcb.dcb_readqueue == NULL,
+                    "The OK packet should not complete the reply");
+
+    /** The EOF packet is split between the buffers */
+    reply = make_packet(NULL, 3, "\xfe\x00\x00\x02\x00", 5);
+    GWBUF *head = gwbuf_split(&reply, 2);
+    concurrency->clientReply(instance, a.fsession, head);
+    concurrency->clientReply(instance, a.fsession, reply);
+    reply = make_packet(NULL, 4, coldef, sizeof(coldef) - 1);
+    reply = make_packet(reply, 5, coldef, sizeof(coldef) - 1);
+    concurrency->clientReply(instance, a.fsession, reply);
+    ss_info_dassert(b.dcb.dcb_readqueue == NULL,
+                    "The column definitions should not complete the reply");
+
+    concurrency->clientReply(instance, a.fsession, make_packet(NULL, 6, "\xfe\x00\x00\x02\x00", 5));
+    ss_info_dassert(route_admitted(&b) == 1,
+                    "The last EOF packet should complete the reply and admit the queued query");
+    ss_info_dassert(n_routed == routed + 2, "The queued query should be routed");
+
+    concurrency->clientReply(instance, b.fsession, make_ok());
+    test_session_free(&a);
+    test_session_free(&b);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+    FILTER_PARAMETER initial = {"initial_limit", "1"};
+    FILTER_PARAMETER max = {"max_limit", "1"};
+    FILTER_PARAMETER *params[] = {&initial, &max, NULL};
+
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+    poll_init();
+
+    set_libdir(strdup("."));
+    concurrency = (FILTER_OBJECT*) load_module("concurrencyfilter", MODULE_FILTER);
+    ss_info_dassert(concurrency, "The concurrency filter should be loaded");
+    instance = concurrency->createInstance(NULL, params);
+    ss_info_dassert(instance, "The filter instance should be created");
+
+    result += test1();
+    result += test2();
+
+    mxs_log_finish();
+
+    exit(result);
+}
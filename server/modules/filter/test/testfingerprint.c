@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testfingerprint.c - The maxadmin commands of the fingerprint filter
+ *
+ * The test is run in the build directory of the filters. The filter is loaded
+ * from there without a rules file, the rules are added with the commands and
+ * the statements are routed to a router that keeps the hint of the last one.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+#include <gwdirs.h>
+#include <modules.h>
+#include <modutil.h>
+#include <filter.h>
+#include <session.h>
+#include <server.h>
+#include <hint.h>
+#include <dcb.h>
+
+static FILTER_OBJECT *fingerprint;
+static FILTER *instance;
+static void *fsession;
+static SESSION session;
+static DCB admin; /*< The DCB of maxadmin */
+static char output[4096]; /*< What the commands have printed */
+static HINT *last_hint; /*< The hint of the last statement */
+
+static int
+admin_write(DCB *dcb, GWBUF *queue)
+{
+    size_t len = strlen(output);
+
+    snprintf(output + len, sizeof(output) - len, "%.*s",
+             (int)GWBUF_LENGTH(queue), (char*)GWBUF_DATA(queue));
+    gwbuf_free(queue);
+    return 1;
+}
+
+static void
+free_hints()
+{
+    while (last_hint)
+    {
+        HINT *next = last_hint->next;
+        hint_free(last_hint);
+        last_hint = next;
+    }
+}
+
+static int
+route_query(void *instance, void *session, GWBUF *queue)
+{
+    free_hints();
+    last_hint = queue->hint;
+    queue->hint = NULL;
+    gwbuf_free(queue);
+    return 1;
+}
+
+/**
+ * Run a command of the filter
+ *
+ * @return What the command printed
+ */
+static const char *
+command(const char *cmd, const char *arg1, const char *arg2)
+{
+    *output = '\0';
+    ss_info_dassert(fingerprint->command(instance, &admin, cmd, arg1, arg2),
+                    "The command should be known");
+    return output;
+}
+
+/**
+ * Route a statement through the filter
+ *
+ * @return The server the filter routed it to, NULL if it was not diverted
+ */
+static const char *
+route(const char *sql)
+{
+    fingerprint->routeQuery(instance, fsession, modutil_create_query((char*)sql));
+    return last_hint && last_hint->type == HINT_ROUTE_TO_NAMED_SERVER ? last_hint->data : NULL;
+}
+
+/**
+ * test1    Arguments that are not a fingerprint are rejected and no rule is
+ *          added or removed for them
+ *
+ */
+static int
+test1()
+{
+    static const char *invalid[] = {"", "   ", "-- a comment", "/* a comment */"};
+
+    ss_dfprintf(stderr, "testfingerprint : Reject what is not a fingerprint");
+
+    for (int i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        ss_info_dassert(strstr(command("add", invalid[i], "server1"), "Failed to parse"),
+                        "The add command should reject the argument");
+        ss_info_dassert(strstr(command("remove", invalid[i], NULL), "Failed to parse"),
+                        "The remove command should reject the argument");
+    }
+
+    *output = '\0';
+    fingerprint->diagnostics(instance, NULL, &admin);
+    ss_info_dassert(strstr(output, "Number of rules:           0\n"), "No rule should be added");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    The fingerprint 0 is a fingerprint like any other
+ *
+ */
+static int
+test2()
+{
+    ss_dfprintf(stderr, "testfingerprint : Add and remove the fingerprint 0");
+    ss_info_dassert(strstr(command("add", "0000000000000000", "server1"), "are routed to server1"),
+                    "The fingerprint 0 should be added");
+    ss_info_dassert(strstr(command("remove", "0000000000000000", NULL), "no longer routed"),
+                    "The fingerprint 0 should be removed");
+    ss_info_dassert(strstr(command("remove", "0000000000000000", NULL), "There is no rule"),
+                    "The fingerprint 0 should not be removed twice");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    A rule added with an example statement routes the statements that
+ *          differ from it only by their literals
+ *
+ */
+static int
+test3()
+{
+    ss_dfprintf(stderr, "testfingerprint : Add a rule with an example statement");
+    ss_info_dassert(strstr(command("add", "SELECT 1", "server1"), "are routed to server1"),
+                    "The statement should be added");
+    ss_info_dassert(route("SELECT 2") && strcmp(route("SELECT 2"), "server1") == 0,
+                    "The statement should be routed to server1");
+    ss_info_dassert(route("SELECT a FROM t1") == NULL,
+                    "Another statement should not be diverted");
+    ss_info_dassert(strstr(command("remove", "SELECT 3", NULL), "no longer routed"),
+                    "The rule should be removed by another example statement");
+    ss_info_dassert(route("SELECT 2") == NULL, "The statement should no longer be diverted");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+    DOWNSTREAM down = {NULL, NULL, route_query};
+    SERVER *server;
+
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+    admin.func.write = admin_write;
+
+    server = server_alloc("127.0.0.1", "MySQLBackend", 3306);
+    ss_info_dassert(server, "The server should be allocated");
+    server_set_unique_name(server, "server1");
+
+    set_libdir(strdup("."));
+    fingerprint = (FILTER_OBJECT*) load_module("fingerprintfilter", MODULE_FILTER);
+    ss_info_dassert(fingerprint, "The fingerprint filter should be loaded");
+    instance = fingerprint->createInstance(NULL, NULL);
+    ss_info_dassert(instance, "The filter instance should be created");
+    fsession = fingerprint->newSession(instance, &session);
+    ss_info_dassert(fsession, "The filter session should be created");
+    fingerprint->setDownstream(instance, fsession, &down);
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    free_hints();
+    mxs_log_finish();
+
+    exit(result);
+}
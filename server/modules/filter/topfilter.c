@@ -26,6 +26,14 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * The queries are kept in a bounded min-heap with the shortest of the top N
+ * queries at the root. A query that is not among the top N is rejected with
+ * a single comparison and the SQL is copied only when a query enters the heap.
+ *
+ * With the aggregate parameter the top N queries of all sessions are kept
+ * in one heap per thread. The heaps are merged into a single report that is
+ * written periodically to the file named by filebase.
+ *
  * Date         Who             Description
  * 18/06/2014   Mark Riddoch    Addition of source and user filters
  *
@@ -44,6 +52,13 @@
 #include <sys/time.h>
 #include <regex.h>
 #include <atomic.h>
+#include <spinlock.h>
+#include <housekeeper.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
+
+/** How often the aggregated report is written, in seconds */
+#define TOPN_REPORT_INTERVAL 10
 
 MODULE_INFO info =
 {
@@ -82,6 +97,29 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+/**
+ * Structure to hold the Top N queries
+ */
+typedef struct topnq
+{
+    struct timeval duration;
+    char *sql;
+    size_t size; /* Size of the allocation of sql */
+} TOPNQ;
+
+/**
+ * A bounded min-heap of the longest running queries. The root is the
+ * shortest of the stored queries.
+ */
+typedef struct
+{
+    SPINLOCK lock; /* Protects the per-thread heaps */
+    TOPNQ **top;
+    int count; /* Number of stored queries */
+    int size; /* Maximum number of stored queries */
+    size_t bytes; /* Bytes allocated for the SQL of the stored queries */
+} TOPN_HEAP;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -101,17 +139,11 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *exclude; /* Optional text to match against for exclusion */
     regex_t exre; /* Compiled regex nomatch text */
+    bool aggregate; /* Keep one report for all sessions */
+    TOPN_HEAP *threads; /* Per-thread heaps of the aggregated report */
+    int n_threads;
 } TOPN_INSTANCE;
 
-/**
- * Structure to hold the Top N queries
- */
-typedef struct topnq
-{
-    struct timeval duration;
-    char *sql;
-} TOPNQ;
-
 /**
  * The session structure for this TOPN filter.
  * This stores the downstream filter information, such that the
@@ -130,14 +162,29 @@ typedef struct
     char *filename;
     int fd;
     struct timeval start;
-    char *current;
-    TOPNQ **top;
+    char *current; /* SQL of the current query */
+    size_t current_size; /* Size of the allocation of current */
+    bool timing; /* A matching query is executing */
+    TOPN_HEAP heap;
+    SESSION *session; /* The client session, charged for the stored SQL */
+    size_t charged; /* Bytes charged to the session */
     int n_statements;
     struct timeval total;
     struct timeval connect;
     struct timeval disconnect;
 } TOPN_SESSION;
 
+static bool topn_heap_init(TOPN_HEAP *heap, int size);
+static void topn_heap_free(TOPN_HEAP *heap);
+static void topn_heap_insert(TOPN_HEAP *heap, const struct timeval *duration,
+                             const char *sql);
+static int topn_heap_sorted(TOPN_HEAP *heap, TOPNQ **dest);
+static bool merge_threads(TOPN_INSTANCE *my_instance, TOPN_HEAP *dest);
+static void print_queries(FILE *fp, TOPNQ **top, int n_top);
+static int cmp_topn(const void *va, const void *vb);
+static void write_report(void *data);
+static void topn_charge(TOPN_SESSION *my_session);
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -189,7 +236,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
     int i;
     TOPN_INSTANCE *my_instance;
 
-    if ((my_instance = malloc(sizeof(TOPN_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(TOPN_INSTANCE))) != NULL)
     {
         my_instance->topN = 10;
         my_instance->match = NULL;
@@ -225,6 +272,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->user = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "aggregate"))
+            {
+                my_instance->aggregate = config_truth_value(params[i]->value);
+            }
             else if (!filter_standard_parameter(params[i]->name))
             {
                 MXS_ERROR("topfilter: Unexpected parameter '%s'.",
@@ -266,6 +317,39 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (my_instance->topN <= 0)
+        {
+            MXS_ERROR("topfilter: Invalid 'count' parameter, the value must be "
+                      "greater than zero.");
+            error = true;
+        }
+
+        if (!error && my_instance->aggregate)
+        {
+            my_instance->n_threads = config_max_threadcount();
+
+            if ((my_instance->threads = calloc(my_instance->n_threads,
+                                               sizeof(TOPN_HEAP))) == NULL)
+            {
+                error = true;
+            }
+
+            for (i = 0; !error && i < my_instance->n_threads; i++)
+            {
+                if (!topn_heap_init(&my_instance->threads[i], my_instance->topN))
+                {
+                    error = true;
+                }
+            }
+
+            if (!error)
+            {
+                char task_name[strlen(my_instance->filebase) + sizeof("topfilter ")];
+                sprintf(task_name, "topfilter %s", my_instance->filebase);
+                hktask_add(task_name, write_report, my_instance, TOPN_REPORT_INTERVAL);
+            }
+        }
+
         my_instance->sessions = 0;
         if (my_instance->match &&
             regcomp(&my_instance->re, my_instance->match, cflags))
@@ -302,6 +386,14 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 regfree(&my_instance->re);
                 free(my_instance->match);
             }
+            if (my_instance->threads)
+            {
+                for (i = 0; i < my_instance->n_threads; i++)
+                {
+                    topn_heap_free(&my_instance->threads[i]);
+                }
+                free(my_instance->threads);
+            }
             free(my_instance->filebase);
             free(my_instance->source);
             free(my_instance->user);
@@ -326,7 +418,6 @@ newSession(FILTER *instance, SESSION *session)
 {
     TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
     TOPN_SESSION *my_session;
-    int i;
     char *remote, *user;
 
     if ((my_session = calloc(1, sizeof(TOPN_SESSION))) != NULL)
@@ -341,17 +432,18 @@ newSession(FILTER *instance, SESSION *session)
         sprintf(my_session->filename, "%s.%d", my_instance->filebase,
                 my_instance->sessions);
         atomic_add(&my_instance->sessions, 1);
-        my_session->top = (TOPNQ **) calloc(my_instance->topN + 1,
-                                            sizeof(TOPNQ *));
-        for (i = 0; i < my_instance->topN; i++)
+        if (!my_instance->aggregate &&
+            !topn_heap_init(&my_session->heap, my_instance->topN))
         {
-            my_session->top[i] = (TOPNQ *) calloc(1, sizeof(TOPNQ));
-            my_session->top[i]->sql = NULL;
+            free(my_session->filename);
+            free(my_session);
+            return NULL;
         }
         my_session->n_statements = 0;
         my_session->total.tv_sec = 0;
         my_session->total.tv_usec = 0;
         my_session->current = NULL;
+        my_session->session = session;
         if ((remote = session_get_remote(session)) != NULL)
         {
             my_session->clientHost = strdup(remote);
@@ -388,6 +480,30 @@ newSession(FILTER *instance, SESSION *session)
     return my_session;
 }
 
+/**
+ * Print a table of queries
+ *
+ * @param fp        The file to print to
+ * @param top       The queries, longest first
+ * @param n_top     Number of queries
+ */
+static void
+print_queries(FILE *fp, TOPNQ **top, int n_top)
+{
+    int i;
+
+    fprintf(fp, "Time (sec) | Query\n");
+    fprintf(fp, "-----------+-----------------------------------------------------------------\n");
+    for (i = 0; i < n_top; i++)
+    {
+        fprintf(fp, "%10.3f |  %s\n",
+                (double) ((top[i]->duration.tv_sec * 1000)
+                          + (top[i]->duration.tv_usec / 1000)) / 1000,
+                top[i]->sql);
+    }
+    fprintf(fp, "-----------+-----------------------------------------------------------------\n");
+}
+
 /**
  * Close a session with the filter, this is the mechanism
  * by which a filter may cleanup data structure etc.
@@ -402,32 +518,27 @@ closeSession(FILTER *instance, void *session)
     TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
     TOPN_SESSION *my_session = (TOPN_SESSION *) session;
     struct timeval diff;
-    int i;
     FILE *fp;
     int statements;
 
+    if (my_instance->aggregate)
+    {
+        /** The queries are reported for all sessions by write_report() */
+        return;
+    }
+
     gettimeofday(&my_session->disconnect, NULL);
     timersub((&my_session->disconnect), &(my_session->connect), &diff);
     if ((fp = fopen(my_session->filename, "w")) != NULL)
     {
+        TOPNQ *top[my_instance->topN];
+        int n_top = topn_heap_sorted(&my_session->heap, top);
         statements = my_session->n_statements != 0 ? my_session->n_statements : 1;
 
         fprintf(fp, "Top %d longest running queries in session.\n",
                 my_instance->topN);
         fprintf(fp, "==========================================\n\n");
-        fprintf(fp, "Time (sec) | Query\n");
-        fprintf(fp, "-----------+-----------------------------------------------------------------\n");
-        for (i = 0; i < my_instance->topN; i++)
-        {
-            if (my_session->top[i]->sql)
-            {
-                fprintf(fp, "%10.3f |  %s\n",
-                        (double) ((my_session->top[i]->duration.tv_sec * 1000)
-                                  + (my_session->top[i]->duration.tv_usec / 1000)) / 1000,
-                        my_session->top[i]->sql);
-            }
-        }
-        fprintf(fp, "-----------+-----------------------------------------------------------------\n");
+        print_queries(fp, top, n_top);
         struct tm tm;
         localtime_r(&my_session->connect.tv_sec, &tm);
         char buffer[32]; // asctime_r documentation requires 26
@@ -469,6 +580,11 @@ freeSession(FILTER *instance, void *session)
 {
     TOPN_SESSION *my_session = (TOPN_SESSION *) session;
 
+    if (my_session->heap.top)
+    {
+        topn_heap_free(&my_session->heap);
+    }
+    free(my_session->current);
     free(my_session->filename);
     free(session);
     return;
@@ -521,32 +637,55 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
     TOPN_SESSION *my_session = (TOPN_SESSION *) session;
-    char *ptr;
+    const char *sql = NULL;
+    int len = 0;
 
     if (my_session->active)
     {
-        if (queue->next != NULL)
+        if (my_instance->match || my_instance->exclude)
+        {
+            /** The regular expressions need a null terminated string which is shared with the other filters */
+            if ((sql = modutil_get_SQL_string(queue)) != NULL)
+            {
+                len = strlen(sql);
+            }
+        }
+        else if (!modutil_get_SQL_view(queue, &sql, &len))
         {
-            queue = gwbuf_make_contiguous(queue);
+            sql = NULL;
         }
-        if ((ptr = modutil_get_SQL(queue)) != NULL)
+
+        if (sql &&
+            (my_instance->match == NULL ||
+             regexec(&my_instance->re, sql, 0, NULL, 0) == 0) &&
+            (my_instance->exclude == NULL ||
+             regexec(&my_instance->exre, sql, 0, NULL, 0) != 0))
         {
-            if ((my_instance->match == NULL ||
-                 regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
-                (my_instance->exclude == NULL ||
-                 regexec(&my_instance->exre, ptr, 0, NULL, 0) != 0))
+            my_session->n_statements++;
+            my_session->timing = false;
+
+            /**
+             * The SQL is kept in a buffer that is reused for every query, it is
+             * copied into the heap only if the query makes it to the top N.
+             */
+            if (len + 1 > my_session->current_size)
             {
-                my_session->n_statements++;
-                if (my_session->current)
+                char *tmp = realloc(my_session->current, len + 1);
+
+                if (tmp)
                 {
-                    free(my_session->current);
+                    my_session->current = tmp;
+                    my_session->current_size = len + 1;
+                    topn_charge(my_session);
                 }
-                gettimeofday(&my_session->start, NULL);
-                my_session->current = ptr;
             }
-            else
+
+            if (len + 1 <= my_session->current_size)
             {
-                free(ptr);
+                memcpy(my_session->current, sql, len);
+                my_session->current[len] = '\0';
+                gettimeofday(&my_session->start, NULL);
+                my_session->timing = true;
             }
         }
     }
@@ -574,47 +713,27 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
     TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
     TOPN_SESSION *my_session = (TOPN_SESSION *) session;
     struct timeval tv, diff;
-    int i, inserted;
 
-    if (my_session->current)
+    if (my_session->timing)
     {
         gettimeofday(&tv, NULL);
         timersub(&tv, &(my_session->start), &diff);
 
         timeradd(&(my_session->total), &diff, &(my_session->total));
 
-        inserted = 0;
-        for (i = 0; i < my_instance->topN; i++)
-        {
-            if (my_session->top[i]->sql == NULL)
-            {
-                my_session->top[i]->sql = my_session->current;
-                my_session->top[i]->duration = diff;
-                inserted = 1;
-                break;
-            }
-        }
-
-        if (inserted == 0 && ((diff.tv_sec > my_session->top[my_instance->topN - 1]->duration.tv_sec) ||
-                              (diff.tv_sec == my_session->top[my_instance->topN - 1]->duration.tv_sec &&
-                               diff.tv_usec > my_session->top[my_instance->topN - 1]->duration.tv_usec)))
+        if (my_instance->aggregate)
         {
-            free(my_session->top[my_instance->topN - 1]->sql);
-            my_session->top[my_instance->topN - 1]->sql = my_session->current;
-            my_session->top[my_instance->topN - 1]->duration = diff;
-            inserted = 1;
-        }
-
-        if (inserted)
-        {
-            qsort(my_session->top, my_instance->topN,
-                  sizeof(TOPNQ *), cmp_topn);
+            TOPN_HEAP *heap = &my_instance->threads[poll_current_thread() % my_instance->n_threads];
+            spinlock_acquire(&heap->lock);
+            topn_heap_insert(heap, &diff, my_session->current);
+            spinlock_release(&heap->lock);
         }
         else
         {
-            free(my_session->current);
+            topn_heap_insert(&my_session->heap, &diff, my_session->current);
+            topn_charge(my_session);
         }
-        my_session->current = NULL;
+        my_session->timing = false;
     }
 
     /* Pass the result upstream */
@@ -638,10 +757,17 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 {
     TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
     TOPN_SESSION *my_session = (TOPN_SESSION *) fsession;
+    TOPN_HEAP merged;
+    TOPN_HEAP *heap = NULL;
     int i;
 
     dcb_printf(dcb, "\t\tReport size            %d\n",
                my_instance->topN);
+    if (my_instance->aggregate)
+    {
+        dcb_printf(dcb, "\t\tReport for all sessions in %s\n",
+                   my_instance->filebase);
+    }
     if (my_instance->source)
     {
         dcb_printf(dcb, "\t\tLimit logging to connections from  %s\n",
@@ -662,22 +788,287 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match     %s\n",
                    my_instance->exclude);
     }
-    if (my_session)
+    if (my_session && !my_instance->aggregate)
     {
         dcb_printf(dcb, "\t\tLogging to file %s.\n",
                    my_session->filename);
+        heap = &my_session->heap;
+    }
+    else if (my_session == NULL && my_instance->aggregate &&
+             merge_threads(my_instance, &merged))
+    {
+        heap = &merged;
+    }
+
+    if (heap)
+    {
+        TOPNQ *top[my_instance->topN];
+        int n_top = topn_heap_sorted(heap, top);
+
         dcb_printf(dcb, "\t\tCurrent Top %d:\n", my_instance->topN);
-        for (i = 0; i < my_instance->topN; i++)
+        for (i = 0; i < n_top; i++)
+        {
+            dcb_printf(dcb, "\t\t%d place:\n", i + 1);
+            dcb_printf(dcb, "\t\t\tExecution time: %.3f seconds\n",
+                       (double) ((top[i]->duration.tv_sec * 1000)
+                                 + (top[i]->duration.tv_usec / 1000)) / 1000);
+            dcb_printf(dcb, "\t\t\tSQL: %s\n",
+                       top[i]->sql);
+        }
+
+        if (heap == &merged)
+        {
+            topn_heap_free(&merged);
+        }
+    }
+}
+
+/**
+ * Initialise a heap
+ *
+ * @param heap  The heap to initialise
+ * @param size  Number of queries to store
+ * @return True if the memory for the queries was allocated
+ */
+static bool
+topn_heap_init(TOPN_HEAP *heap, int size)
+{
+    int i;
+
+    spinlock_init(&heap->lock);
+    heap->count = 0;
+    heap->size = size;
+    heap->bytes = 0;
+
+    if ((heap->top = (TOPNQ **) calloc(size, sizeof(TOPNQ *))) == NULL)
+    {
+        return false;
+    }
+
+    for (i = 0; i < size; i++)
+    {
+        if ((heap->top[i] = (TOPNQ *) calloc(1, sizeof(TOPNQ))) == NULL)
         {
-            if (my_session->top[i]->sql)
+            topn_heap_free(heap);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Charge the client session for the SQL that the filter session keeps. The
+ * heaps of an aggregated report are shared by the sessions and not charged.
+ *
+ * @param my_session    The filter session
+ */
+static void
+topn_charge(TOPN_SESSION *my_session)
+{
+    size_t bytes = my_session->current_size + my_session->heap.bytes;
+
+    if (bytes != my_session->charged)
+    {
+        session_mem_add(my_session->session, (int64_t)bytes - (int64_t)my_session->charged);
+        my_session->charged = bytes;
+    }
+}
+
+/**
+ * Free the queries of a heap
+ *
+ * @param heap  The heap to free
+ */
+static void
+topn_heap_free(TOPN_HEAP *heap)
+{
+    int i;
+
+    for (i = 0; i < heap->size && heap->top[i]; i++)
+    {
+        free(heap->top[i]->sql);
+        free(heap->top[i]);
+    }
+    free(heap->top);
+    heap->top = NULL;
+}
+
+/**
+ * Swap two queries in the heap
+ */
+static inline void
+topn_heap_swap(TOPN_HEAP *heap, int a, int b)
+{
+    TOPNQ *tmp = heap->top[a];
+    heap->top[a] = heap->top[b];
+    heap->top[b] = tmp;
+}
+
+/**
+ * Check if the query at a is shorter than the query at b
+ */
+static inline bool
+topn_heap_shorter(TOPN_HEAP *heap, int a, int b)
+{
+    return timercmp(&heap->top[a]->duration, &heap->top[b]->duration, <);
+}
+
+/**
+ * Add a query to the heap if it is among the top N. If the heap is full
+ * the query replaces the shortest query at the root of the heap.
+ *
+ * @param heap      The heap
+ * @param duration  Execution time of the query
+ * @param sql       The SQL of the query
+ */
+static void
+topn_heap_insert(TOPN_HEAP *heap, const struct timeval *duration, const char *sql)
+{
+    bool add = heap->count < heap->size;
+    int i = add ? heap->count : 0;
+
+    if (!add && !timercmp(duration, &heap->top[0]->duration, >))
+    {
+        return;
+    }
+
+    TOPNQ *entry = heap->top[i];
+    size_t len = strlen(sql) + 1;
+
+    /** The SQL buffer of the replaced query is reused */
+    if (len > entry->size)
+    {
+        char *tmp = realloc(entry->sql, len);
+
+        if (tmp == NULL)
+        {
+            return;
+        }
+        entry->sql = tmp;
+        heap->bytes += len - entry->size;
+        entry->size = len;
+    }
+
+    memcpy(entry->sql, sql, len);
+    entry->duration = *duration;
+
+    if (add)
+    {
+        heap->count++;
+
+        while (i > 0 && topn_heap_shorter(heap, i, (i - 1) / 2))
+        {
+            topn_heap_swap(heap, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+    else
+    {
+        while (true)
+        {
+            int smallest = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+
+            if (left < heap->count && topn_heap_shorter(heap, left, smallest))
             {
-                dcb_printf(dcb, "\t\t%d place:\n", i + 1);
-                dcb_printf(dcb, "\t\t\tExecution time: %.3f seconds\n",
-                           (double) ((my_session->top[i]->duration.tv_sec * 1000)
-                                     + (my_session->top[i]->duration.tv_usec / 1000)) / 1000);
-                dcb_printf(dcb, "\t\t\tSQL: %s\n",
-                           my_session->top[i]->sql);
+                smallest = left;
             }
+            if (right < heap->count && topn_heap_shorter(heap, right, smallest))
+            {
+                smallest = right;
+            }
+            if (smallest == i)
+            {
+                break;
+            }
+            topn_heap_swap(heap, i, smallest);
+            i = smallest;
+        }
+    }
+}
+
+/**
+ * Get the queries of the heap, longest first
+ *
+ * @param heap  The heap
+ * @param dest  Array of at least heap->size elements where the queries are stored
+ * @return Number of queries stored in @c dest
+ */
+static int
+topn_heap_sorted(TOPN_HEAP *heap, TOPNQ **dest)
+{
+    memcpy(dest, heap->top, heap->count * sizeof(TOPNQ *));
+    qsort(dest, heap->count, sizeof(TOPNQ *), cmp_topn);
+    return heap->count;
+}
+
+/**
+ * Merge the per-thread heaps of the aggregated report
+ *
+ * @param my_instance   The filter instance
+ * @param dest          Heap where the queries are merged, must be freed
+ *                      with topn_heap_free()
+ * @return True if the heaps were merged
+ */
+static bool
+merge_threads(TOPN_INSTANCE *my_instance, TOPN_HEAP *dest)
+{
+    int i, j;
+
+    if (!topn_heap_init(dest, my_instance->topN))
+    {
+        return false;
+    }
+
+    for (i = 0; i < my_instance->n_threads; i++)
+    {
+        TOPN_HEAP *heap = &my_instance->threads[i];
+        spinlock_acquire(&heap->lock);
+        for (j = 0; j < heap->count; j++)
+        {
+            topn_heap_insert(dest, &heap->top[j]->duration, heap->top[j]->sql);
         }
+        spinlock_release(&heap->lock);
     }
+
+    return true;
+}
+
+/**
+ * Write the aggregated report of all sessions, called by the housekeeper
+ *
+ * @param data  The filter instance
+ */
+static void
+write_report(void *data)
+{
+    TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) data;
+    TOPN_HEAP merged;
+    FILE *fp;
+
+    if (!merge_threads(my_instance, &merged))
+    {
+        return;
+    }
+
+    if ((fp = fopen(my_instance->filebase, "w")) != NULL)
+    {
+        TOPNQ *top[my_instance->topN];
+        int n_top = topn_heap_sorted(&merged, top);
+
+        fprintf(fp, "Top %d longest running queries in all sessions.\n",
+                my_instance->topN);
+        fprintf(fp, "===============================================\n\n");
+        print_queries(fp, top, n_top);
+        fprintf(fp, "\nTotal of %d sessions.\n", my_instance->sessions);
+        fclose(fp);
+    }
+    else
+    {
+        MXS_ERROR("topfilter: Failed to open '%s' for writing.", my_instance->filebase);
+    }
+
+    topn_heap_free(&merged);
 }
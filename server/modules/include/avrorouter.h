@@ -39,6 +39,22 @@
 #define AVRO_DEFAULT_BLOCK_TRX_COUNT 1
 #define AVRO_DEFAULT_BLOCK_ROW_COUNT 1000
 
+/** Avro data block defaults, the block size is in bytes and 0 uses the
+ * default of the Avro C library */
+#define AVRO_DEFAULT_CODEC "null"
+#define AVRO_DEFAULT_BLOCK_SIZE 0
+#define AVRO_DEFAULT_FLUSH_INTERVAL 0
+
+/** Threads that convert row events, 0 converts them in the reading thread */
+#define AVRO_DEFAULT_CONVERSION_THREADS 0
+
+/** Data blocks of each Avro file kept in memory as JSON for the clients */
+#define AVRO_DEFAULT_SHARED_BLOCKS 16
+
+/** Kafka producer defaults */
+#define AVRO_DEFAULT_KAFKA_COMPRESSION "snappy"
+#define AVRO_DEFAULT_KAFKA_BATCH_MS    100
+
 #define MAX_MAPPED_TABLES 1024
 
 #define GTID_TABLE_NAME        "gtid"
@@ -46,6 +62,7 @@
 #define MEMORY_DATABASE_NAME   "memory"
 #define MEMORY_TABLE_NAME      MEMORY_DATABASE_NAME".mem_used_tables"
 #define INDEX_TABLE_NAME       "indexing_progress"
+#define TIMESTAMP_TABLE_NAME   "block_timestamps"
 
 /** Name of the file where the binlog to Avro conversion progress is stored */
 #define AVRO_PROGRESS_FILE "avro-conversion.ini"
@@ -90,9 +107,27 @@ typedef enum avro_binlog_end
 /** Maximum column name length */
 #define TABLE_MAP_MAX_NAME_LEN 64
 
+/** Index of the first table column in a record, after the GTID and event fields */
+#define AVRO_FIRST_COLUMN_FIELD 6
+
 /** How many bytes each thread tries to send */
 #define AVRO_DATA_BURST_SIZE MAX_BUFFER_SIZE
 
+/**
+ * Length of the header of a CDC frame. The header has the length of the
+ * payload, the length of the payload before compression and the number of
+ * rows in the payload as 4 byte little-endian integers followed by one byte
+ * for the frame type and one byte for the frame flags.
+ */
+#define CDC_FRAME_HEADER_LEN 14
+
+/** CDC frame types */
+#define CDC_FRAME_ROWS   0x01 /*< Newline separated JSON rows */
+#define CDC_FRAME_SCHEMA 0x02 /*< The schema of the rows that follow */
+
+/** CDC frame flags */
+#define CDC_FRAME_DEFLATE 0x01 /*< The payload is compressed with zlib */
+
 /** A CREATE TABLE abstraction */
 typedef struct table_create
 {
@@ -118,6 +153,7 @@ typedef struct table_map
     uint8_t *column_metadata;
     size_t column_metadata_size;
     TABLE_CREATE *table_create; /*< The definition of the table */
+    COLUMN_PLAN *column_plan; /*< How to decode the columns of the rows */
     int version;
     char version_string[TABLE_MAP_VERSION_DIGITS + 1];
     char *table;
@@ -139,6 +175,8 @@ typedef struct
     uint64_t        lastsample;
     int             minno;
     int             minavgs[AVRO_NSTATS_MINUTES];
+    uint64_t        n_shared_hits; /*< Blocks sent from the shared blocks */
+    uint64_t        n_shared_misses; /*< Blocks converted by a client */
 } AVRO_ROUTER_STATS;
 
 /**
@@ -160,7 +198,7 @@ typedef struct avro_table_t
 {
     char* filename; /*< Absolute filename */
     char* json_schema; /*< JSON representation of the schema */
-    avro_file_writer_t avro_file; /*< Current Avro data file */
+    MAXAVRO_WRITER *writer; /*< Current Avro data file */
     avro_value_iface_t *avro_writer_iface; /*< Avro C API writer interface */
     avro_schema_t avro_schema; /*< Native Avro schema of the table */
 } AVRO_TABLE;
@@ -185,6 +223,61 @@ typedef struct gtid_pos
                          * rebuild GTID events in the correct order. */
 } gtid_pos_t;
 
+/** A row of a row event converted into an Avro record */
+typedef struct avro_row
+{
+    avro_value_t record;
+    int event_type;
+} AVRO_ROW;
+
+/** A row event given to a conversion worker */
+typedef struct avro_job
+{
+    REP_HEADER hdr; /*< Replication header of the event */
+    GWBUF *event; /*< The event without the header */
+    uint8_t *rows; /*< The first row in the event */
+    uint8_t *columns_present; /*< The bitfield of the columns present in the rows */
+    TABLE_MAP *map; /*< Table map of the table */
+    AVRO_TABLE *table; /*< Avro file of the table */
+    gtid_pos_t gtid; /*< GTID of the transaction */
+    uint64_t seqno; /*< Order of the event among the events given to the workers */
+    struct avro_job *next;
+} AVRO_JOB;
+
+/** A thread converting the row events of a set of tables */
+typedef struct avro_worker
+{
+    struct avro_instance *router;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /*< Signaled when a job is queued or all jobs are done */
+    AVRO_JOB *head;
+    AVRO_JOB *tail;
+    int pending; /*< Jobs queued or being converted */
+} AVRO_WORKER;
+
+/** A data block converted to JSON that the clients reading the file share */
+typedef struct
+{
+    long pos; /*< Offset of the block in the file */
+    long next_pos; /*< Offset of the next block */
+    uint64_t records; /*< Number of records in the block */
+    gtid_pos_t gtid; /*< GTID of the last record */
+    GWBUF *json; /*< The records as JSON, NULL if the slot is not used */
+} AVRO_SHARED_BLOCK;
+
+/** The most recently read data blocks of an Avro file */
+typedef struct avro_shared_file
+{
+    char name[AVRO_MAX_FILENAME_LEN + 1];
+    int refcount; /*< Number of clients reading the file */
+    int oldest; /*< The slot that is replaced next */
+    AVRO_SHARED_BLOCK *blocks;
+    struct avro_shared_file *next;
+} AVRO_SHARED_FILE;
+
+/** Kafka producer that publishes the converted rows, defined in avro_kafka.c */
+typedef struct avro_kafka AVRO_KAFKA;
+
 /**
  * The client structure used within this router.
  * This represents the clients that are requesting AVRO files from MaxScale.
@@ -208,11 +301,19 @@ typedef struct avro_client
     time_t          connect_time;   /*< Connect time of slave */
     MAXAVRO_FILE    avro_file;     /*< Avro file struct */
     char avro_binfile[AVRO_MAX_FILENAME_LEN + 1];
+    AVRO_SHARED_FILE *shared_file; /*< Shared blocks of the file, NULL if not shared */
     bool            requested_gtid; /*< If the client requested */
     gtid_pos_t      gtid; /*< Current/requested GTID */
     gtid_pos_t      gtid_start; /*< First sent GTID */
+    bool            requested_timestamp; /*< If the client requested a timestamp */
+    uint32_t        timestamp; /*< Requested timestamp */
     unsigned int    cstate;         /*< Catch up state */
     sqlite3       *sqlite_handle;
+    bool            framed;         /*< Data is sent in length-prefixed frames */
+    bool            compress;       /*< Frames are compressed */
+    uint32_t        window;         /*< Unacknowledged frames allowed, 0 for no limit */
+    uint64_t        frames_sent;    /*< Number of frames sent */
+    uint64_t        frames_acked;   /*< Number of frames acknowledged by the client */
 #if defined(SS_DEBUG)
     skygw_chk_t     rses_chk_tail;
 #endif
@@ -250,6 +351,13 @@ typedef struct avro_instance
     HASHTABLE     *open_tables;
     HASHTABLE     *created_tables;
     sqlite3       *sqlite_handle;
+    sqlite3_stmt  *index_insert_stmt; /*< Adds a GTID to the index */
+    sqlite3_stmt  *index_timestamp_stmt; /*< Adds the timestamp of a block to the index */
+    sqlite3_stmt  *index_position_stmt; /*< Reads how far a file is indexed */
+    sqlite3_stmt  *index_progress_stmt; /*< Stores how far a file is indexed */
+    sqlite3_stmt  *used_table_stmt; /*< Adds a table used by the current transaction */
+    sqlite3_stmt  *used_tables_flush_stmt; /*< Stores the used tables */
+    sqlite3_stmt  *used_tables_clear_stmt; /*< Clears the stored used tables */
     char              prevbinlog[BINLOG_FNAMELEN + 1];
     int               rotating;     /*< Rotation in progress flag */
     SPINLOCK          fileslock;    /*< Lock for the files queue above */
@@ -261,6 +369,22 @@ typedef struct avro_instance
     uint64_t        row_count; /*< Row events processed */
     uint64_t        row_target; /*< Minimum about of row events that will trigger
                                  * a flush of all tables */
+    int             flush_interval; /*< Seconds after which the tables are flushed
+                                     * even if the targets are not reached */
+    time_t          last_flush; /*< When the tables were last flushed */
+    char            *codec; /*< Codec of new Avro files */
+    size_t          block_size; /*< Maximum size of the data blocks of new Avro files */
+    int             n_workers; /*< Number of conversion threads */
+    AVRO_WORKER     *workers; /*< Conversion threads, NULL if there are none */
+    uint64_t        job_seqno; /*< Number of row events given to the workers */
+    pthread_mutex_t order_lock; /*< Lock for numbering the records in order */
+    pthread_cond_t  order_cond; /*< Signaled when a row event has been numbered */
+    uint64_t        order_next; /*< The next row event to number */
+    gtid_pos_t      order_gtid; /*< GTID and event number of the last numbered record */
+    int             shared_blocks; /*< Blocks of each file shared by the clients */
+    SPINLOCK        shared_lock; /*< Lock for the shared files */
+    AVRO_SHARED_FILE *shared_files; /*< Files that the clients are reading */
+    AVRO_KAFKA      *kafka; /*< Kafka producer, NULL if rows are not published */
     struct avro_instance  *next;
 } AVRO_INSTANCE;
 
@@ -278,13 +402,35 @@ extern void avro_client_rotate(AVRO_INSTANCE *router, AVRO_CLIENT *client, uint8
 extern bool avro_open_binlog(const char *binlogdir, const char *file, int *fd);
 extern void avro_close_binlog(int fd);
 extern avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router);
-extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema);
+extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                                    const char *codec, size_t block_size);
 extern void* avro_table_free(AVRO_TABLE *table);
+extern bool avro_table_append(AVRO_TABLE *table, avro_value_t *record);
 extern void avro_flush_all_tables(AVRO_INSTANCE *router);
 extern char* json_new_schema_from_table(TABLE_MAP *map);
 extern void save_avro_schema(const char *path, const char* schema, TABLE_MAP *map);
 extern bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
-extern bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
+extern bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, GWBUF *event);
+extern int avro_decode_rows(AVRO_JOB *job, AVRO_ROW **rows);
+extern void avro_write_rows(AVRO_INSTANCE *router, gtid_pos_t *gtid, REP_HEADER *hdr,
+                            AVRO_TABLE *table, AVRO_ROW *rows, int n);
+extern bool avro_workers_start(AVRO_INSTANCE *router);
+extern void avro_worker_dispatch(AVRO_INSTANCE *router, REP_HEADER *hdr, GWBUF *event,
+                                 char *ident, TABLE_MAP *map, AVRO_TABLE *table,
+                                 uint8_t *rows, uint8_t *columns_present);
+extern void avro_workers_wait(AVRO_INSTANCE *router);
+extern AVRO_SHARED_FILE* avro_shared_acquire(AVRO_INSTANCE *router, const char *name);
+extern void avro_shared_release(AVRO_INSTANCE *router, AVRO_SHARED_FILE *file);
+extern bool avro_shared_get(AVRO_INSTANCE *router, AVRO_SHARED_FILE *file, long pos,
+                            AVRO_SHARED_BLOCK *dest);
+extern void avro_shared_put(AVRO_INSTANCE *router, AVRO_SHARED_FILE *file,
+                            AVRO_SHARED_BLOCK *block);
+extern AVRO_KAFKA* avro_kafka_alloc(const char *brokers, const char *topic,
+                                    const char *compression, int batch_ms);
+extern void avro_kafka_free(AVRO_KAFKA *kafka);
+extern void avro_kafka_produce(AVRO_KAFKA *kafka, AVRO_TABLE *table, avro_value_t *record);
+extern bool avro_kafka_flush(AVRO_KAFKA *kafka);
+extern void avro_kafka_diagnostics(AVRO_KAFKA *kafka, DCB *dcb);
 extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
 
 #define AVRO_CLIENT_UNREGISTERED 0x0000
@@ -298,5 +444,6 @@ extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
  */
 #define AVRO_CS_BUSY             0x0001
 #define AVRO_WAIT_DATA           0x0002
+#define AVRO_WAIT_ACK            0x0004
 
 #endif
@@ -38,6 +38,7 @@
 #include <buffer.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include <memlog.h>
 #include <zlib.h>
 #include <mysql_client_server_protocol.h>
@@ -139,6 +140,147 @@
 #define DEF_LONG_BURST          500
 #define DEF_BURST_SIZE          1024000 /* 1 Mb */
 
+/**
+ * Slaves in catch-up read the binlog files in chunks of BLR_READAHEAD_SIZE
+ * bytes. The chunk after the one being sent is read ahead by a pool of I/O
+ * threads, DEF_CATCHUP_THREADS of them unless the router option
+ * catchup_threads says otherwise.
+ */
+#define BLR_READAHEAD_SIZE      (128 * 1024)
+#define DEF_CATCHUP_THREADS     2
+
+/**
+ * The latest DEF_EVENT_CACHE events are kept in memory for the slaves
+ * unless the router option event_cache says otherwise. Events larger than
+ * BLR_CACHE_MAX_EVENT are only read from the binlog files.
+ */
+#define DEF_EVENT_CACHE         1000
+#define BLR_CACHE_MAX_EVENT     (64 * 1024)
+
+/**
+ * The packets of events larger than one MySQL packet are written into the
+ * binlog from the buffers they were read into, at most BLR_FRAGMENT_IOV
+ * buffers with one system call.
+ */
+#define BLR_FRAGMENT_IOV        64
+
+/**
+ * Events of at least DEF_SENDFILE_SIZE bytes that slaves in catch-up read from
+ * the binlog files are sent from the file to the socket with sendfile(), unless
+ * the router option sendfile_size says otherwise.
+ */
+#define DEF_SENDFILE_SIZE       BLR_READAHEAD_SIZE
+
+/**
+ * The events from the master are collected in a write buffer of
+ * DEF_WRITE_BUFFER bytes, unless the router option write_buffer says
+ * otherwise, and written to the binlog file when the buffer is full and at
+ * the end of each batch of events read from the master. The binlog file is
+ * synced to disk at the end of each batch, unless the router option
+ * binlog_sync sets a minimum interval or BLR_SYNC_COMMIT syncs only the
+ * batches that contain a commit.
+ */
+#define DEF_WRITE_BUFFER        (64 * 1024)
+#define DEF_BINLOG_SYNC         0
+#define BLR_SYNC_COMMIT         -1
+
+/**
+ * Every binlog file has a sparse index in a file with the BLR_INDEX_SUFFIX.
+ * A record is added at the first transaction boundary after DEF_INDEX_INTERVAL
+ * events, unless the router option index_interval says otherwise. The check
+ * of the binlog file at startup starts from the last record of the index.
+ */
+#define DEF_INDEX_INTERVAL      1000
+#define BLR_INDEX_SUFFIX        ".idx"
+#define BLR_INDEX_MAGIC         "MXSBLX01"
+#define BLR_INDEX_MAGIC_SIZE    8
+
+#define BLR_INDEX_TRX           0x01    /*< The position is a transaction boundary */
+#define BLR_INDEX_CHECKSUM      0x02    /*< The events have checksums */
+
+/**
+ * A record of the index of a binlog file, written in host byte order
+ */
+typedef struct blr_index_record
+{
+    uint64_t pos;           /*< Position of an event in the binlog file */
+    uint32_t timestamp;     /*< Timestamp of the event */
+    uint32_t flags;         /*< BLR_INDEX_TRX and BLR_INDEX_CHECKSUM */
+    uint64_t gtid_seq;      /*< Sequence of the last MariaDB 10 GTID before the event */
+    uint32_t gtid_domain;   /*< Domain of the GTID */
+    uint32_t gtid_server;   /*< Server id of the GTID */
+} BLR_INDEX_RECORD;
+
+/**
+ * The position of every MariaDB 10 GTID written to the binlog files is kept
+ * in a GTID index, one file per replication domain in the binlog directory
+ * named after the fileroot and the domain with the BLR_GTID_INDEX_SUFFIX.
+ * The sequence numbers of a domain only grow, so a slave that registers
+ * with a GTID is positioned with a binary search of the index.
+ */
+#define BLR_GTID_INDEX_SUFFIX   ".gtid"
+#define BLR_GTID_INDEX_MAGIC    "MXSBLG01"
+#define BLR_GTID_INDEX_MAGIC_SIZE 8
+
+/**
+ * A record of the GTID index of a domain, written in host byte order
+ */
+typedef struct blr_gtid_record
+{
+    uint64_t seq;           /*< Sequence number of the GTID */
+    uint32_t server_id;     /*< Server id of the GTID */
+    uint32_t file;          /*< Number of the binlog file */
+    uint64_t pos;           /*< Position of the GTID event in the binlog file */
+} BLR_GTID_RECORD;
+
+/**
+ * The GTID index of a domain
+ */
+typedef struct blr_gtid_index
+{
+    uint32_t                domain;     /*< Replication domain */
+    int                     fd;         /*< The index file */
+    uint64_t                n_records;  /*< Number of records in the file */
+    BLR_GTID_RECORD         last;       /*< The last record, if any */
+    struct blr_gtid_index   *next;
+} BLR_GTID_INDEX;
+
+/**
+ * With the router option compress_binlogs, a binlog file is compressed once
+ * the router has rotated to the next file. The compressed file has the
+ * BLR_ZFILE_SUFFIX and holds the events in blocks of about BLR_ZBLOCK_SIZE
+ * bytes, each compressed separately with zlib and ending at an event
+ * boundary. The index of the blocks at the end of the file maps the binlog
+ * positions to the blocks, so an event is read by decompressing only the
+ * block that holds it.
+ */
+#define BLR_ZFILE_SUFFIX        ".z"
+#define BLR_ZFILE_MAGIC         "MXSBLZ01"
+#define BLR_ZFILE_MAGIC_SIZE    8
+#define BLR_ZBLOCK_SIZE         BLR_READAHEAD_SIZE
+
+/**
+ * The header of a compressed binlog file, written in host byte order
+ */
+typedef struct blr_zfile_header
+{
+    char     magic[BLR_ZFILE_MAGIC_SIZE];
+    uint64_t size;          /*< Size of the uncompressed binlog file */
+    uint64_t index_offset;  /*< File offset of the index of the blocks */
+    uint64_t n_blocks;      /*< Number of blocks */
+} BLR_ZFILE_HEADER;
+
+/**
+ * A record of the index of the blocks of a compressed binlog file
+ */
+typedef struct blr_zblock
+{
+    uint64_t pos;           /*< Binlog position of the start of the block */
+    uint64_t offset;        /*< File offset of the compressed data */
+    uint32_t len;           /*< Length of the uncompressed data */
+    uint32_t clen;          /*< Length of the compressed data */
+} BLR_ZBLOCK;
+
 /**
  * master reconnect backoff constants
  * BLR_MASTER_BACKOFF_TIME      The increments of the back off time (seconds)
@@ -251,26 +393,35 @@ typedef struct rep_header
 } REP_HEADER;
 
 /**
- * The binlog record structure. This contains the actual packet read from the binlog
- * file.
+ * The binlog record structure. This contains an event as it is in the binlog
+ * file. A record is not changed once it is in the cache.
  */
-typedef struct
+typedef struct blcache_record
 {
+    char            binlogname[BINLOG_FNAMELEN + 1]; /*< The binlog file of the event */
     unsigned long   position;       /*< binlog record position for this cache entry */
-    GWBUF           *pkt;           /*< The packet received from the master */
+    GWBUF           *pkt;           /*< The event, shared by the slaves it is sent to */
     REP_HEADER      hdr;            /*< The packet header */
+    uint64_t        seqno;          /*< Sequence number of the record in the cache */
+    int             epoch;          /*< Epoch at which the record was replaced */
+    struct blcache_record *retired; /*< Next replaced record waiting to be freed */
 } BLCACHE_RECORD;
 
 /**
- * The binlog cache. A cache exists for each file that hold cached bin log records.
- * Caches will be used for all files being read by more than 1 slave.
+ * The binlog cache. A ring of the latest events received from the master,
+ * in the order they are in the binlog files. The master thread inserts the
+ * events and the slaves read them without locks, each remembering where in
+ * the ring its next event is.
  */
 typedef struct
 {
-    BLCACHE_RECORD  **records;      /*< The actual binlog records */
-    int             current;        /*< The next record that will be inserted */
-    int             cnt;            /*< The number of records in the cache */
-    SPINLOCK        lock;           /*< The spinlock for the cache */
+    BLCACHE_RECORD  **records;      /*< The records, indexed by seqno modulo size */
+    int             size;           /*< Number of slots in the ring */
+    uint64_t        current;        /*< Sequence number of the next record inserted */
+    uint64_t        first;          /*< Sequence number of the oldest valid record */
+    SPINLOCK        lock;           /*< Protects retired */
+    BLCACHE_RECORD  *retired;       /*< Replaced records waiting to be freed */
+    int             readers;        /*< Threads that do not poll reading the cache */
 } BLCACHE;
 
 typedef struct blfile
@@ -280,9 +431,48 @@ typedef struct blfile
     int             refcnt;                         /*< Reference count for file */
     BLCACHE         *cache;                         /*< Record cache for this file */
     SPINLOCK        lock;                           /*< The file lock */
+    BLR_ZBLOCK      *zblocks;                       /*< Blocks of a compressed file, NULL if
+                                                     * the file is not compressed */
+    uint64_t        n_zblocks;                      /*< Number of blocks */
+    uint64_t        zsize;                          /*< Uncompressed size of the file */
+    uint8_t         *zdata;                         /*< The last block decompressed */
+    uint64_t        zblock;                         /*< Number of the block in zdata */
     struct blfile   *next;                          /*< Next file in list */
 } BLFILE;
 
+/**
+ * A chunk of a binlog file held in memory
+ */
+typedef struct
+{
+    char            binlogname[BINLOG_FNAMELEN + 1]; /*< The file the chunk is from */
+    unsigned long   start;                          /*< File offset of the first byte */
+    unsigned int    len;                            /*< Number of bytes in data */
+    uint8_t         *data;                          /*< BLR_READAHEAD_SIZE bytes */
+} BLR_CHUNK;
+
+/** The states of the chunk that is read ahead */
+#define BLR_RA_IDLE     0       /*< Not in use */
+#define BLR_RA_QUEUED   1       /*< Owned by the I/O threads */
+#define BLR_RA_READY    2       /*< Read and waiting to be used */
+
+/**
+ * The binlog read-ahead of a slave. The current chunk is only used by the
+ * thread running the catch-up of the slave, which the CS_BUSY state makes
+ * one thread at a time. The next chunk belongs to the I/O threads while
+ * it is queued.
+ */
+typedef struct blr_readahead
+{
+    BLR_CHUNK       cur;            /*< The chunk events are read from */
+    BLR_CHUNK       next;           /*< The chunk read ahead */
+    SPINLOCK        lock;           /*< Protects state and refcnt */
+    int             state;          /*< The state of the next chunk */
+    int             refcnt;         /*< The slave and a queued read */
+    struct router_instance *router; /*< The router of the slave */
+    struct blr_readahead *qnext;    /*< Next read in the I/O queue */
+} BLR_READAHEAD;
+
 /**
  * Slave statistics
  */
@@ -300,6 +490,8 @@ typedef struct
     int             n_dcb;
     int             n_above;
     int             n_failed_read;
+    int             n_sendfile;     /*< Number of events sent from the file */
+    int             n_handoff;      /*< Number of events sent by the slave's own thread */
     int             n_overrun;
     int             n_caughtup;
     int             n_actions[3];
@@ -335,6 +527,7 @@ typedef struct router_slave
     char            binlogfile[BINLOG_FNAMELEN + 1];
     /*< Current binlog file for this slave */
     char            *uuid;          /*< Slave UUID */
+    char            *gtid_state;    /*< GTID list of @slave_connect_state, if set */
 #ifdef BLFILE_IN_SLAVE
     BLFILE          *file;          /*< Currently open binlog file */
 #endif
@@ -367,6 +560,13 @@ typedef struct router_slave
     THREAD            lsi_sender_tid;  /*< Who sent */
     char              lsi_binlog_name[BINLOG_FNAMELEN + 1]; /*< Which binlog file */
     uint32_t          lsi_binlog_pos; /*< What position */
+    BLR_READAHEAD     *readahead;   /*< Binlog read-ahead, NULL until catch-up */
+    uint64_t          cache_seqno;  /*< Where the next event may be in the event cache */
+    // handoff: Event published by the master thread, sent by the thread owning the DCB
+    GWBUF             *handoff;     /*< Clone of the cached event, NULL if none */
+    REP_HEADER        handoff_hdr;  /*< Header of the event */
+    char              handoff_binlog_name[BINLOG_FNAMELEN + 1]; /*< Which binlog file */
+    uint32_t          handoff_binlog_pos; /*< What position */
 #if defined(SS_DEBUG)
     skygw_chk_t     rses_chk_tail;
 #endif
@@ -386,6 +586,10 @@ typedef struct
     uint64_t        n_rotates;      /*< Number of binlog rotate events */
     uint64_t        n_cachehits;    /*< Number of hits on the binlog cache */
     uint64_t        n_cachemisses;  /*< Number of misses on the binlog cache */
+    uint64_t        n_writes;       /*< Number of writes to the binlog files */
+    uint64_t        n_syncs;        /*< Number of syncs of the binlog files */
+    uint64_t        n_index;        /*< Number of records added to the binlog indexes */
+    int             n_compressed;   /*< Number of binlog files compressed */
     int             n_registered;   /*< Number of registered slaves */
     int             n_masterstarts; /*< Number of times connection restarted */
     int             n_delayedreconnects;
@@ -473,6 +677,28 @@ typedef struct router_instance
                                              *  file being written
                                              */
     uint64_t          last_written; /*< Position of the last write operation */
+    uint8_t           *wbuf;        /*< Events not yet written to the binlog file */
+    unsigned int      wbuf_size;    /*< Size of the write buffer, 0 for none */
+    unsigned int      wbuf_len;     /*< Number of bytes in the write buffer */
+    uint64_t          wbuf_pos;     /*< Binlog position of the write buffer */
+    SPINLOCK          wbuf_lock;    /*< Lock for the write buffer */
+    bool              wbuf_failed;  /*< Writing the buffer failed, the master must reconnect */
+    bool              wbuf_partial; /*< The start of an event was written past the buffer */
+    int               binlog_sync;  /*< Milliseconds between syncs or BLR_SYNC_COMMIT */
+    long              last_sync;    /*< The heartbeat of the last sync */
+    bool              unsynced;     /*< Data has been written since the last sync */
+    bool              unsynced_commit; /*< A commit has been written since the last sync */
+    int               index_fd;     /*< Index of the binlog file being written, -1 if none */
+    unsigned int      index_interval; /*< Events between the records of the index, 0 for none */
+    bool              compress_binlogs; /*< Compress the binlog files after rotation */
+    unsigned int      index_events; /*< Events written since the last record of the index */
+    uint64_t          index_pos;    /*< Position of the last record of the index */
+    bool              index_boundary; /*< The next event starts a transaction */
+    uint64_t          gtid_seq;     /*< Sequence of the last MariaDB 10 GTID written */
+    uint32_t          gtid_domain;  /*< Domain of the last MariaDB 10 GTID written */
+    uint32_t          gtid_server;  /*< Server id of the last MariaDB 10 GTID written */
+    BLR_GTID_INDEX    *gtid_index;  /*< The GTID indexes of the domains */
+    SPINLOCK          gtid_index_lock; /*< Lock for the GTID indexes */
     uint64_t          last_event_pos;       /*< Position of last event written */
     uint64_t          current_safe_event;
     /*< Position of the latest safe event being sent to slaves */
@@ -485,6 +711,10 @@ typedef struct router_instance
     unsigned int      short_burst;  /*< Short burst for slave catchup */
     unsigned int      long_burst;   /*< Long burst for slave catchup */
     unsigned long     burst_size;   /*< Maximum size of burst to send */
+    int               catchup_threads; /*< I/O threads reading ahead for slaves */
+    int               event_cache;  /*< Number of events kept in memory */
+    BLCACHE           *cache;       /*< The latest events, NULL if not kept */
+    unsigned int      sendfile_size; /*< Minimum size of the events sent with sendfile(), 0 for none */
     unsigned long     heartbeat;    /*< Configured heartbeat value */
     ROUTER_STATS      stats;        /*< Statistics for this router */
     int               active_logs;
@@ -608,19 +838,33 @@ extern int blr_slave_request(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern void blr_slave_rotate(ROUTER_INSTANCE *, ROUTER_SLAVE *, uint8_t *);
 extern int blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large);
 extern void blr_init_cache(ROUTER_INSTANCE *);
+extern GWBUF *blr_cache_add(ROUTER_INSTANCE *, REP_HEADER *, uint8_t *);
+extern GWBUF *blr_cache_read(ROUTER_INSTANCE *, ROUTER_SLAVE *, const char *, unsigned long,
+                             REP_HEADER *);
 
 extern int  blr_file_init(ROUTER_INSTANCE *);
 extern int  blr_write_binlog_record(ROUTER_INSTANCE *, REP_HEADER *, uint32_t pos, uint8_t *);
 extern int  blr_file_rotate(ROUTER_INSTANCE *, char *, uint64_t);
 extern void blr_file_flush(ROUTER_INSTANCE *);
+extern int  blr_file_write(ROUTER_INSTANCE *, uint8_t *, uint32_t, bool);
+extern int  blr_file_writev(ROUTER_INSTANCE *, const struct iovec *, int, uint32_t, bool);
+extern void blr_file_write_buffer(ROUTER_INSTANCE *);
+extern void blr_file_sync(ROUTER_INSTANCE *);
 extern BLFILE *blr_open_binlog(ROUTER_INSTANCE *, char *);
 extern GWBUF *blr_read_binlog(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *, char *);
+extern GWBUF *blr_read_binlog_ahead(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *,
+                                    char *, ROUTER_SLAVE *);
 extern void blr_close_binlog(ROUTER_INSTANCE *, BLFILE *);
+extern bool blr_readahead_init(int n_threads);
+extern BLR_READAHEAD *blr_readahead_alloc(ROUTER_INSTANCE *);
+extern void blr_readahead_free(BLR_READAHEAD *);
 extern unsigned long blr_file_size(BLFILE *);
 extern int blr_statistics(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern int blr_ping(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern int blr_send_custom_error(DCB *, int, int, char *, char *, unsigned int);
 extern int blr_file_next_exists(ROUTER_INSTANCE *, ROUTER_SLAVE *);
+extern bool blr_gtid_find(ROUTER_INSTANCE *, const char *, char *, uint32_t *, char *, size_t);
+extern void blr_gtid_index_free(ROUTER_INSTANCE *);
 uint32_t extract_field(uint8_t *src, int bits);
 void blr_cache_read_master_data(ROUTER_INSTANCE *router);
 int blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug);
@@ -636,5 +880,18 @@ extern bool blr_send_event(blr_thread_role_t role,
                            ROUTER_SLAVE *slave,
                            REP_HEADER *hdr,
                            uint8_t *buf);
+extern bool blr_send_event_buffer(blr_thread_role_t role,
+                                  const char* binlog_name,
+                                  uint32_t binlog_pos,
+                                  ROUTER_SLAVE *slave,
+                                  REP_HEADER *hdr,
+                                  GWBUF *event);
+extern bool blr_send_event_file(blr_thread_role_t role,
+                                const char* binlog_name,
+                                uint32_t binlog_pos,
+                                ROUTER_SLAVE *slave,
+                                REP_HEADER *hdr,
+                                BLFILE *file,
+                                GWBUF *evhdr);
 
 #endif
@@ -75,7 +75,8 @@ typedef enum
     MAXOP_SET,
     MAXOP_CLEAR,
     MAXOP_SHUTDOWN,
-    MAXOP_RESTART
+    MAXOP_RESTART,
+    MAXOP_LIMIT
 } MAXINFO_OPERATOR;
 
 /**
@@ -117,6 +118,8 @@ typedef struct maxinfo_tree
 #define LT_CLEAR        12
 #define LT_SHUTDOWN     13
 #define LT_RESTART      14
+#define LT_LIMIT        15
+#define LT_OFFSET       16
 
 
 /**
@@ -127,6 +130,7 @@ typedef enum
     PARSE_NOERROR,
     PARSE_MALFORMED_SHOW,
     PARSE_EXPECTED_LIKE,
+    PARSE_MALFORMED_LIMIT,
     PARSE_SYNTAX_ERROR
 } PARSE_ERROR;
 
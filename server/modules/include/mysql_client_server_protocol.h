@@ -68,6 +68,10 @@
 #define GW_MYSQL_WRITE 1
 #define MYSQL_HEADER_LEN 4L
 #define MYSQL_CHECKSUM_LEN 4L
+/** The header of a packet of the compressed protocol */
+#define MYSQL_COMPRESSED_HEADER_LEN 7L
+/** Payloads shorter than this are sent without compressing them */
+#define MYSQL_COMPRESS_MIN_LEN 50
 
 #define GW_MYSQL_PROTOCOL_VERSION 10 // version is 10
 #define GW_MYSQL_HANDSHAKE_FILLER 0x00
@@ -212,6 +216,8 @@ typedef enum
     GW_MYSQL_CAPABILITIES_MULTI_RESULTS =          (1 << 17),
     GW_MYSQL_CAPABILITIES_PS_MULTI_RESULTS =       (1 << 18),
     GW_MYSQL_CAPABILITIES_PLUGIN_AUTH =            (1 << 19),
+    GW_MYSQL_CAPABILITIES_SESSION_TRACK =          (1 << 23),
+    GW_MYSQL_CAPABILITIES_DEPRECATE_EOF =          (1 << 24),
     GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT = (1 << 30),
     GW_MYSQL_CAPABILITIES_REMEMBER_OPTIONS =       (1 << 31),
     GW_MYSQL_CAPABILITIES_CLIENT = (GW_MYSQL_CAPABILITIES_LONG_PASSWORD |
@@ -287,6 +293,16 @@ typedef struct
     unsigned        long tid;                         /*< MySQL Thread ID, in
         * handshake */
     unsigned int    charset;                          /*< MySQL character set at connect time */
+    bool            classifying;                      /*< A query is parsed by the classifier pool */
+    GWBUF*          classified_query;                 /*< A parsed query waiting to be routed */
+    bool            compressed;                       /*< The compressed protocol is in use */
+    uint8_t         compress_seq;                     /*< Sequence number of the next compressed packet */
+    GWBUF*          compress_readq;                   /*< Incomplete compressed packets that were read */
+    size_t          stream_left;                      /*< Bytes of a packet that was only partly
+        * forwarded to the router and are still to be read */
+    GWBUF*          stmt_readq;                       /*< Received part of an incomplete packet
+        * that is routed as a whole statement */
+    size_t          stmt_readq_len;                   /*< Length of stmt_readq */
 #if defined(SS_DEBUG)
     skygw_chk_t     protocol_chk_tail;
 #endif
@@ -317,10 +333,15 @@ typedef struct
 #define MYSQL_IS_CHANGE_USER(payload)       (MYSQL_GET_COMMAND(payload)==MYSQL_COM_CHANGE_USER)
 #define MYSQL_GET_NATTR(payload)                ((int)payload[4])
 
+/** The connection uses OK packets in place of EOF packets, CLIENT_DEPRECATE_EOF */
+#define MYSQL_DEPRECATE_EOF(proto) \
+    (((proto)->client_capabilities & GW_MYSQL_CAPABILITIES_DEPRECATE_EOF) != 0)
+
 
 MySQLProtocol* mysql_protocol_init(DCB* dcb, int fd);
 void           mysql_protocol_done (DCB* dcb);
 const char *gw_mysql_protocol_state2string(int state);
+void       mysql_protocol_set_state(MySQLProtocol *protocol, mysql_auth_state_t state);
 int        mysql_send_com_quit(DCB* dcb, int packet_number, GWBUF* buf);
 GWBUF*     mysql_create_com_quit(GWBUF* bufparam, int packet_number);
 
@@ -386,10 +407,13 @@ void protocol_set_response_status (MySQLProtocol* p, int  npackets, ssize_t  nby
 void protocol_archive_srv_command(MySQLProtocol* p);
 
 char* create_auth_fail_str(char *username, char *hostaddr, char *sha1, char *db, int);
+GWBUF* mysql_compress_packets(MySQLProtocol *proto, GWBUF *queue, int level, size_t min_len);
+GWBUF* mysql_decompress_packets(MySQLProtocol *proto, GWBUF *raw, uint64_t *nread, bool *error);
 
 void init_response_status (
     GWBUF* buf,
     mysql_server_cmd_t cmd,
+    bool deprecate_eof,
     int* npackets,
     ssize_t* nbytes);
 
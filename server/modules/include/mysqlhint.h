@@ -35,6 +35,7 @@ typedef enum
     TOK_MASTER,
     TOK_SLAVE,
     TOK_SERVER,
+    TOK_ALL,
     TOK_EOL
 } TOKEN_VALUE;
 
@@ -107,6 +108,7 @@ typedef struct
 
 
 extern HINT *hint_parser(HINT_SESSION *session, GWBUF *request);
+extern void hint_cache_init(int n_threads);
 NAMEDHINTS* free_named_hint(NAMEDHINTS* named_hint);
 HINTSTACK*  free_hint_stack(HINTSTACK* hint_stack);
 
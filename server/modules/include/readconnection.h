@@ -26,6 +26,8 @@
  * @endverbatim
  */
 #include <dcb.h>
+#include <statistics.h>
+#include <slowlog.h>
 
 /**
  * Internal structure used to define the set of backend servers we are routing
@@ -55,6 +57,8 @@ typedef struct router_client_session
     DCB *client_dcb; /**< Client DCB */
     struct router_client_session *next;
     int rses_capabilities; /*< input type, for example */
+    bool splice_tried; /*< Splicing has been tried for the session */
+    SLOWLOG_QUERY slow_query; /*< The query being timed for the slow query log */
 #if defined(SS_DEBUG)
     skygw_chk_t rses_chk_tail;
 #endif
@@ -66,7 +70,8 @@ typedef struct router_client_session
 typedef struct
 {
     int n_sessions; /*< Number sessions created     */
-    int n_queries; /*< Number of queries forwarded */
+    int n_spliced; /*< Number of sessions whose data was spliced */
+    ts_stats_t n_queries; /*< Number of queries forwarded */
 } ROUTER_STATS;
 
 /**
@@ -80,7 +85,14 @@ typedef struct router_instance
     BACKEND **servers; /*< List of backend servers                  */
     unsigned int bitmask; /*< Bitmask to apply to server->status       */
     unsigned int bitvalue; /*< Required value of server->status         */
+    bool splice; /*< Splice the data of the sessions between the sockets */
+    bool least_congested; /*< Prefer the servers with the lowest load score */
     ROUTER_STATS stats; /*< Statistics for this router               */
+    int n_servers; /*< Number of backend servers                */
+    int total_weight; /*< Sum of the weights of the servers         */
+    int *sample_alias; /*< Alias table for sampling servers by weight */
+    int *sample_prob; /*< Probability of a server to be sampled instead
+                       * of its alias, in units of 1/total_weight  */
     struct router_instance
         *next;
 } ROUTER_INSTANCE;
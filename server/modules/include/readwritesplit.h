@@ -26,27 +26,41 @@
 
 #include <dcb.h>
 #include <hashtable.h>
+#include <statistics.h>
+#include <slowlog.h>
+#include <query_classifier.h>
 #include <math.h>
 
-#undef PREP_STMT_CACHING
-
-#if defined(PREP_STMT_CACHING)
-
-typedef enum prep_stmt_type
-{
-    PREP_STMT_NAME,
-    PREP_STMT_ID
-} prep_stmt_type_t;
-
 typedef enum prep_stmt_state
 {
-    PREP_STMT_ALLOC,
-    PREP_STMT_SENT,
-    PREP_STMT_RECV,
-    PREP_STMT_DROPPED
+    PREP_STMT_ALLOC,    /*< Sent to the backends, no reply to the client yet */
+    PREP_STMT_RECV,     /*< The client knows the statement by its id */
+    PREP_STMT_DROPPED   /*< Closed by the client */
 } prep_stmt_state_t;
 
-#endif /*< PREP_STMT_CACHING */
+/**
+ * A read-only prepared statement that is prepared in all backends of the
+ * session. The client uses the id returned by the backend whose reply was
+ * sent to it and the id is replaced with the id of the statement in the
+ * backend that the statement is routed to.
+ */
+typedef struct prep_stmt_st
+{
+#if defined(SS_DEBUG)
+    skygw_chk_t       pstmt_chk_top;
+#endif
+    uint32_t          pstmt_id;          /*< The statement id known by the client, given
+                                          *  by the router */
+    prep_stmt_state_t pstmt_state;
+    qc_query_type_t   pstmt_qtype;       /*< The type of the prepared statement */
+    uint16_t          pstmt_nparams;     /*< Number of parameters */
+    bool              pstmt_master_only; /*< Long data was sent to the master only */
+    uint32_t*         pstmt_backend_ids; /*< The statement id in each backend of the
+                                          *  session, 0 if not prepared */
+#if defined(SS_DEBUG)
+    skygw_chk_t       pstmt_chk_tail;
+#endif
+} prep_stmt_t;
 
 typedef enum bref_state
 {
@@ -116,8 +130,10 @@ typedef enum select_criteria
     LEAST_ROUTER_CONNECTIONS,   /*< connections established by this router */
     LEAST_BEHIND_MASTER,
     LEAST_CURRENT_OPERATIONS,
-    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS,
-    LAST_CRITERIA               /*< not used except for an index */
+    LEAST_RESPONSE_TIME,        /*< weighted random choice by average response time */
+    LEAST_CONGESTED,            /*< lowest load score published by the monitor */
+    LAST_CRITERIA,              /*< not used except for an index */
+    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS
 } select_criteria_t;
 
 
@@ -126,6 +142,9 @@ typedef enum select_criteria
 #define CONFIG_MAX_SLAVE_RLAG -1 /*< not used */
 #define CONFIG_SQL_VARIABLES_IN TYPE_ALL
 
+/** How often a session looks for a better slave, in heartbeats (10 seconds) */
+#define RWSPLIT_REBALANCE_INTERVAL 100
+
 #define GET_SELECT_CRITERIA(s)                                                                  \
         (strncmp(s,"LEAST_GLOBAL_CONNECTIONS", strlen("LEAST_GLOBAL_CONNECTIONS")) == 0 ?       \
         LEAST_GLOBAL_CONNECTIONS : (                                                            \
@@ -134,7 +153,13 @@ typedef enum select_criteria
         strncmp(s,"LEAST_ROUTER_CONNECTIONS", strlen("LEAST_ROUTER_CONNECTIONS")) == 0 ?        \
         LEAST_ROUTER_CONNECTIONS : (                                                            \
         strncmp(s,"LEAST_CURRENT_OPERATIONS", strlen("LEAST_CURRENT_OPERATIONS")) == 0 ?        \
-        LEAST_CURRENT_OPERATIONS : UNDEFINED_CRITERIA))))
+        LEAST_CURRENT_OPERATIONS : (                                                            \
+        strncmp(s,"LEAST_RESPONSE_TIME", strlen("LEAST_RESPONSE_TIME")) == 0 ?                  \
+        LEAST_RESPONSE_TIME : (                                                                 \
+        strncmp(s,"ADAPTIVE_ROUTING", strlen("ADAPTIVE_ROUTING")) == 0 ?                        \
+        LEAST_RESPONSE_TIME : (                                                                 \
+        strncmp(s,"LEAST_CONGESTED", strlen("LEAST_CONGESTED")) == 0 ?                          \
+        LEAST_CONGESTED : UNDEFINED_CRITERIA)))))))
 
 /**
  * Session variable command
@@ -152,6 +177,10 @@ typedef struct mysql_sescmd_st
                                    *  LOCAL_INFILE. Slave servers are compared to this
                                    *  when they return session command replies.*/
     int      position; /*< Position of this command */
+    prep_stmt_t*       my_sescmd_pstmt; /*< The statement that a COM_STMT_PREPARE
+                                         *  prepares, NULL if not routed by its id */
+    char*              my_sescmd_key; /*< The session state the command sets, NULL
+                                       *  if it does more than set it to a constant */
 #if defined(SS_DEBUG)
     skygw_chk_t        my_sescmd_chk_tail;
 #endif
@@ -175,6 +204,7 @@ struct rses_property_st
         HASHTABLE*       temp_tables;
     } rses_prop_data;
     rses_property_t*     rses_prop_next; /*< next property of same type */
+    size_t               rses_prop_mem;  /*< Bytes charged to the client session */
 #if defined(SS_DEBUG)
     skygw_chk_t          rses_prop_chk_tail;
 #endif
@@ -190,6 +220,8 @@ typedef struct sescmd_cursor_st
     mysql_sescmd_t*    scmd_cur_cmd;          /*< pointer to current session command */
     bool               scmd_cur_active;       /*< true if command is being executed */
     int                position; /*< Position of this cursor */
+    int                scmd_cur_sent; /*< Position of the last command sent to the
+                                       *  backend, -1 if none has been sent */
 #if defined(SS_DEBUG)
     skygw_chk_t        scmd_cur_chk_tail;
 #endif
@@ -211,11 +243,40 @@ typedef struct backend_st
     int             backend_conn_count;  /*< Number of connections to the server */
     bool            be_valid; /*< Valid when belongs to the router's configuration */
     int             weight; /*< Desired weighting on the load. Expressed in .1% increments */
+    int             be_response_time; /*< Moving average of the response time in
+                                       *  microseconds, 0 until the first reply */
 #if defined(SS_DEBUG)
     skygw_chk_t     be_chk_tail;
 #endif
 } BACKEND;
 
+/**
+ * The internal query a backend is executing for the causal reads of a session
+ */
+typedef enum causal_op
+{
+    CAUSAL_OP_NONE,  /**< No internal query */
+    CAUSAL_OP_FETCH, /**< Reading the GTID of the last write from the master */
+    CAUSAL_OP_WAIT   /**< Waiting for a slave to replicate the last write */
+} causal_op_t;
+
+/**
+ * The state of the causal reads of a session
+ */
+typedef enum causal_state
+{
+    CAUSAL_SYNCED,   /**< Nothing was written after the last wait on the GTID */
+    CAUSAL_STALE,    /**< Written to the master, the GTID is not being read */
+    CAUSAL_FETCHING, /**< The GTID of the last write is being read */
+    CAUSAL_KNOWN     /**< The GTID of the last write is known */
+} causal_state_t;
+
+/** The longest GTID position that is waited for */
+#define CAUSAL_GTID_MAXLEN 251
+
+/** The first MariaDB version with MASTER_GTID_WAIT, as major * 10000 + minor * 100 + patch */
+#define CAUSAL_MIN_VERSION 100009
+
 /**
  * Reference to BACKEND.
  *
@@ -234,6 +295,10 @@ typedef struct backend_ref_st
     GWBUF*          bref_pending_cmd; /**< For stmt which can't be routed due active sescmd execution */
     unsigned char   reply_cmd;  /**< The reply the backend server sent to a session command.
                                  * Used to detect slaves that fail to execute session command. */
+    uint64_t        bref_query_start; /**< When the oldest unanswered query was sent,
+                                       * in microseconds */
+    causal_op_t     bref_causal_op; /**< The internal query being executed */
+    int             bref_causal_gen; /**< The GTID generation the slave has caught up with */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -263,32 +328,29 @@ typedef struct rwsplit_config_st
     bool              rw_master_reads; /**< Use master for reads */
     bool              rw_strict_multi_stmt; /**< Force non-multistatement queries to be routed
                                              * to the master after a multistatement query. */
+    bool              rw_route_prep_stmt; /**< Route executions of read-only prepared
+                                           * statements to slaves */
     enum failure_mode rw_master_failure_mode; /**< Master server failure handling mode.
                                                * @see enum failure_mode */
+    bool              rw_rebalance_slaves; /**< Replace the slaves of a session with
+                                            * better ones while the session is open */
+    bool              rw_lazy_connect; /**< Connect to the servers when the first
+                                        * query is routed to them */
+    bool              rw_causal_reads; /**< Wait on the slaves for the writes of the
+                                        * session before reading from them */
+    int               rw_causal_reads_timeout; /**< How long a slave is waited for, in seconds */
+    bool              rw_read_only_trx; /**< Execute read-only transactions in slaves */
+    bool              rw_skip_redundant_sescmd; /**< Answer session commands that would not
+                                                 * change the session state locally */
+    int               rw_idle_backend_timeout; /**< Seconds after which the servers of
+                                                * an idle session are released, 0 if never */
+    bool              rw_session_state_tracking; /**< Execute session commands in the slaves
+                                                  * when next used and replicate the state
+                                                  * changes the master reports */
+    bool              rw_lazy_prepare; /**< Prepare read-only statements in the slaves
+                                        * when next used */
 } rwsplit_config_t;
 
-#if defined(PREP_STMT_CACHING)
-
-typedef struct prep_stmt_st
-{
-#if defined(SS_DEBUG)
-    skygw_chk_t       pstmt_chk_top;
-#endif
-
-    union id
-    {
-        int   seq;
-        char* name;
-    } pstmt_id;
-    prep_stmt_state_t pstmt_state;
-    prep_stmt_type_t  pstmt_type;
-#if defined(SS_DEBUG)
-    skygw_chk_t       pstmt_chk_tail;
-#endif
-} prep_stmt_t;
-
-#endif /*< PREP_STMT_CACHING */
-
 /**
  * The client session structure used within this router.
  */
@@ -311,12 +373,31 @@ struct router_client_session
     bool             rses_load_active; /*< If LOAD DATA LOCAL INFILE is being currently executed */
     bool             have_tmp_tables;
     uint64_t         rses_load_data_sent; /*< How much data has been sent */
+    backend_ref_t    *rses_stream_target; /*< Where the data that continues the last
+                                           * command is routed to */
     DCB*             client_dcb;
+    SESSION*         rses_session;  /*< The client session, charged for the history */
     int              pos_generator;
     backend_ref_t    *forced_node; /*< Current server where all queries should be sent */
-#if defined(PREP_STMT_CACHING)
-    HASHTABLE*       rses_prep_stmt[2];
-#endif
+    HASHTABLE*       rses_prep_stmt; /*< Read-only prepared statements by their id */
+    uint32_t         rses_prep_stmt_next_id; /*< The id of the next read-only prepared statement */
+    long             rses_last_rebalance; /*< When the slaves were last rebalanced */
+    causal_state_t   rses_causal_state; /*< Whether the slaves may miss writes of the session */
+    char             rses_causal_gtid[CAUSAL_GTID_MAXLEN]; /*< GTID of the last write */
+    int              rses_causal_gen; /*< Incremented whenever the GTID changes */
+    bool             rses_causal_failed; /*< The GTID could not be read from the master */
+    GWBUF*           rses_causal_query; /*< A read waiting for the GTID to be read */
+    backend_ref_t*   rses_causal_target; /*< The slave chosen for rses_causal_query */
+    backend_ref_t*   rses_ro_trx_slave; /*< The slave executing the open read-only
+                                         *  transaction, NULL if there is none */
+    long             rses_last_activity; /*< When the client last sent a query */
+    bool             rses_state_pinned; /*< The session holds state that the session
+                                         *  command history can't restore */
+    int              rses_state_known_pos; /*< Session commands before this position may
+                                            *  have been overridden by other statements */
+    bool             rses_state_untracked; /*< The session state can change in ways the
+                                            *  history doesn't show */
+    SLOWLOG_QUERY    rses_slow_query; /*< The query being timed for the slow query log */
     struct router_instance *router;   /*< The router instance */
     struct router_client_session *next;
 #if defined(SS_DEBUG)
@@ -330,10 +411,10 @@ struct router_client_session
 typedef struct
 {
     int     n_sessions; /*< Number sessions created */
-    int     n_queries;  /*< Number of queries forwarded */
-    int     n_master;   /*< Number of stmts sent to master */
-    int     n_slave;    /*< Number of stmts sent to slave */
-    int     n_all;      /*< Number of stmts sent to all */
+    ts_stats_t n_queries;  /*< Number of queries forwarded */
+    ts_stats_t n_master;   /*< Number of stmts sent to master */
+    ts_stats_t n_slave;    /*< Number of stmts sent to slave */
+    ts_stats_t n_all;      /*< Number of stmts sent to all */
 } ROUTER_STATS;
 
 /**
@@ -351,6 +432,7 @@ typedef struct router_instance
     ROUTER_STATS            stats;       /*< Statistics for this router */
     struct router_instance* next;        /*< Next router on the list */
     bool                    available_slaves; /*< The router has some slaves avialable */
+    int                     causal_unsupported; /*< A server without causal reads was reported */
 } ROUTER_INSTANCE;
 
 #define BACKEND_TYPE(b) (SERVER_IS_MASTER((b)->backend_server) ? BE_MASTER :    \
@@ -31,6 +31,7 @@
 #include <hashtable.h>
 #include <mysql_client_server_protocol.h>
 #include <pcre2.h>
+#include <slowlog.h>
 /**
  * Bitmask values for the router session's initialization. These values are used
  * to prevent responses from internal commands being forwarded to the client.
@@ -60,7 +61,10 @@ enum shard_map_state
 };
 
 /**
- * A map of the shards tied to a single user.
+ * A map of the databases to the shards that have them. The map of the router
+ * instance is shared by the sessions and is never modified after it has been
+ * published; a refresh builds a new map. A session that maps the databases
+ * itself with the credentials of its client has a map of its own.
  */
 typedef struct shard_map
 {
@@ -69,6 +73,10 @@ typedef struct shard_map
     SPINLOCK lock;
     time_t last_updated;
     enum shard_map_state state; /*< State of the shard map */
+    HASHTABLE *tables; /*< The servers of the tables by their qualified names,
+                         * NULL if the tables are not mapped */
+    int refcount; /*< Number of the references to the map */
+    bool shared; /*< Built by the router and shared by all the sessions */
 } shard_map_t;
 
 /**
@@ -90,6 +98,18 @@ typedef enum bref_state
 #define BREF_IS_CLOSED(s)           ((s)->bref_state & BREF_CLOSED)
 #define BREF_IS_MAPPED(s)           ((s)->bref_mapped)
 
+/**
+ * The state of a backend in a query that is scattered to all the shards
+ */
+typedef enum sg_state
+{
+    SG_NONE = 0,  /*< The backend is not executing a scattered query */
+    SG_COLCOUNT,  /*< Waiting for the column count or the reply */
+    SG_COLUMNS,   /*< Reading the column definitions */
+    SG_ROWS,      /*< Reading the rows */
+    SG_DONE       /*< The whole reply has been read */
+} sg_state_t;
+
 #define SCHEMA_ERR_DUPLICATEDB 5000
 #define SCHEMA_ERRSTR_DUPLICATEDB "DUPDB"
 #define SCHEMA_ERR_DBNOTFOUND 1049
@@ -119,13 +139,15 @@ typedef enum
     TARGET_NAMED_SERVER = 0x04,
     TARGET_ALL          = 0x08,
     TARGET_RLAG_MAX     = 0x10,
-    TARGET_ANY          = 0x20
+    TARGET_ANY          = 0x20,
+    TARGET_SCATTER      = 0x40
 } route_target_t;
 
 #define TARGET_IS_UNDEFINED(t)    (t == TARGET_UNDEFINED)
 #define TARGET_IS_NAMED_SERVER(t) (t & TARGET_NAMED_SERVER)
 #define TARGET_IS_ALL(t)          (t & TARGET_ALL)
 #define TARGET_IS_ANY(t)          (t & TARGET_ANY)
+#define TARGET_IS_SCATTER(t)      (t & TARGET_SCATTER)
 
 typedef struct rses_property_st rses_property_t;
 typedef struct router_client_session ROUTER_CLIENT_SES;
@@ -267,6 +289,10 @@ typedef struct backend_ref_st
     int             bref_num_result_wait; /*< Number of not yet received results */
     sescmd_cursor_t bref_sescmd_cur; /*< Session command cursor */
     GWBUF*          bref_pending_cmd; /*< For stmt which can't be routed due active sescmd execution */
+    sg_state_t      sg_state; /*< State of the scattered query */
+    bool            sg_discard; /*< The rows of the scattered query are discarded */
+    GWBUF*          sg_readbuf; /*< Incomplete packets of the scattered query */
+    GWBUF*          sg_rows; /*< Rows read before the column definitions were sent */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -286,6 +312,8 @@ typedef struct schemarouter_config_st
     double refresh_min_interval; /*< Minimum required interval between refreshes of databases */
     bool refresh_databases; /*< Are databases refreshed when they are not found in the hashtable */
     bool debug; /*< Enable verbose debug messages to clients */
+    bool table_sharding; /*< Map the tables of the databases to the servers */
+    bool lazy_connect; /*< Connect to the shards when they are first needed */
 } schemarouter_config_t;
 
 /**
@@ -302,8 +330,10 @@ typedef struct
     double          ses_longest;      /*< Longest session */
     double          ses_shortest; /*< Shortest session */
     double          ses_average; /*< Average session length */
-    int             shmap_cache_hit; /*< Shard map was found from the cache */
-    int             shmap_cache_miss;/*< No shard map found from the cache */
+    int             shmap_cache_hit; /*< The session used the shared shard map */
+    int             shmap_cache_miss;/*< The session had to map the databases itself */
+    int             n_scattered;     /*< Queries routed to all the shards */
+    int             n_lazy_connects; /*< Shards connected after the start of a session */
 } ROUTER_STATS;
 
 /**
@@ -340,6 +370,14 @@ struct router_client_session
     ROUTER_STATS    stats;     /*< Statistics for this router         */
     int             n_sescmd;
     int             pos_generator;
+    int             sg_pending; /*< Backends the scattered query still waits for */
+    backend_ref_t*  sg_leader; /*< The backend whose column definitions are sent */
+    uint64_t        sg_ncolumns; /*< Number of columns in the scattered result */
+    bool            sg_header_sent; /*< The column definitions have been sent */
+    uint8_t         sg_seqno; /*< Sequence number of the next packet to the client */
+    GWBUF*          sg_reply; /*< The first error, or an OK if no result set was sent */
+    GWBUF*          sg_eof; /*< The last EOF that ended the rows of a backend */
+    SLOWLOG_QUERY   slow_query; /*< The query being timed for the slow query log */
 #if defined(SS_DEBUG)
     skygw_chk_t      rses_chk_tail;
 #endif
@@ -351,7 +389,9 @@ struct router_client_session
  */
 typedef struct router_instance
 {
-    HASHTABLE*              shard_maps;  /*< Shard maps hashed by user name */
+    shard_map_t*            shard_map;   /*< The shared shard map, NULL until the
+                                          * databases have been mapped */
+    bool                    shard_map_refreshing; /*< The shared map is being refreshed */
     SERVICE*                service;     /*< Pointer to service                 */
     ROUTER_CLIENT_SES*      connections; /*< List of client connections         */
     SPINLOCK                lock;        /*< Lock for the instance data         */
@@ -370,7 +410,6 @@ typedef struct router_instance
     pcre2_code*                   ignore_regex; /*< Databases matching this regex will
                                            * not cause the session to be terminated
                                            * if they are found on more than one server. */
-    pcre2_match_data*             ignore_match_data;
 
 } ROUTER_INSTANCE;
 
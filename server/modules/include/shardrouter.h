@@ -193,6 +193,7 @@ struct router_client_session
     DCB*             rses_client_dcb;
     DCB* replydcb; /* DCB used to send the client write messages from the router itself */
     DCB* routedcb; /* DCB used to send queued queries to the router */
+    DCB* startdcb; /* DCB used to start the subservice sessions after the handshake */
     MYSQL_session*   rses_mysql_session;
     /** Properties listed by their type */
     rses_property_t* rses_properties[RSES_PROP_TYPE_COUNT];
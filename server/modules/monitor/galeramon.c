@@ -36,6 +36,7 @@
 
 #include <galeramon.h>
 #include <dcb.h>
+#include <time.h>
 
 static void monitorMain(void *);
 
@@ -44,6 +45,9 @@ static char *version_str = "V2.0.0";
 /** Log a warning when a bad 'wsrep_local_index' is found */
 static bool warn_erange_on_local_index = true;
 
+/** The highest value of each part of the load score of a node */
+#define GALERA_LOAD_PART_MAX 1000
+
 /* @see function load_module in load_utils.c for explanation of the following
  * lint directives.
  */
@@ -290,6 +294,86 @@ diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
+/**
+ * Measure how congested a joined node is. The score is the time the node spent
+ * paused by flow control since the previous probe, in thousandths, plus the
+ * number of write sets waiting in its receive queue. Both parts are capped
+ * at GALERA_LOAD_PART_MAX.
+ *
+ * @param database      The database to probe
+ * @return The load score of the node, 0 if it could not be measured
+ */
+static int
+galera_load_score(MONITOR_SERVERS *database)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    uint64_t paused_ns = 0;
+    bool have_paused = false;
+    long recv_queue = 0;
+
+    if (mysql_query(database->con, "SHOW STATUS WHERE Variable_name IN "
+                    "('wsrep_flow_control_paused_ns', 'wsrep_local_recv_queue')") != 0
+        || (result = mysql_store_result(database->con)) == NULL)
+    {
+        database->fc_sample_time = 0;
+        return 0;
+    }
+
+    if (mysql_num_fields(result) < 2)
+    {
+        mysql_free_result(result);
+        MXS_ERROR("Unexpected result for the flow control status of server %s:%d. "
+                  "Expected 2 columns. MySQL Version: %s",
+                  database->server->name, database->server->port, version_str);
+        database->fc_sample_time = 0;
+        return 0;
+    }
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        if (row[0] == NULL || row[1] == NULL)
+        {
+            continue;
+        }
+
+        if (strcasecmp(row[0], "wsrep_flow_control_paused_ns") == 0)
+        {
+            paused_ns = strtoull(row[1], NULL, 10);
+            have_paused = true;
+        }
+        else if (strcasecmp(row[0], "wsrep_local_recv_queue") == 0)
+        {
+            recv_queue = strtol(row[1], NULL, 10);
+        }
+    }
+    mysql_free_result(result);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    int score = 0;
+
+    /** The counter is cumulative, so the pause rate needs two samples */
+    if (have_paused && database->fc_sample_time != 0 &&
+        now > database->fc_sample_time && paused_ns >= database->fc_paused_ns)
+    {
+        uint64_t paused = (paused_ns - database->fc_paused_ns) * GALERA_LOAD_PART_MAX /
+                          (now - database->fc_sample_time);
+        score += paused < GALERA_LOAD_PART_MAX ? (int)paused : GALERA_LOAD_PART_MAX;
+    }
+
+    database->fc_paused_ns = paused_ns;
+    database->fc_sample_time = have_paused ? now : 0;
+
+    if (recv_queue > 0)
+    {
+        score += recv_queue < GALERA_LOAD_PART_MAX ? (int)recv_queue : GALERA_LOAD_PART_MAX;
+    }
+
+    return score;
+}
+
 /**
  * Monitor an individual server. Does not deal with the setting of master or
  * slave bits, except for clearing them when a server is not joined to the
@@ -335,6 +419,8 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         }
 
         database->server->node_id = -1;
+        database->server->load = 0;
+        database->fc_sample_time = 0;
 
         if (mon_status_changed(database) && mon_print_fail_status(database))
         {
@@ -439,10 +525,13 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
             mysql_free_result(result);
         }
 
+        database->server->load = galera_load_score(database);
         server_set_status(&temp_server, SERVER_JOINED);
     }
     else
     {
+        database->server->load = 0;
+        database->fc_sample_time = 0;
         server_clear_status(&temp_server, SERVER_JOINED);
     }
 
@@ -508,9 +597,10 @@ monitorMain(void *arg)
          * Calculate how far away the monitor interval is from its full
          * cycle and if monitor interval time further than the base
          * interval, then skip monitoring checks. Excluding the first
-         * round.
+         * round and rounds where servers have reported connection
+         * errors.
          */
-        if (nrounds != 0 && ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >= MON_BASE_INTERVAL_MS)
+        if (!mon_probe_is_due(mon, nrounds))
         {
             nrounds += 1;
             continue;
@@ -521,14 +611,17 @@ monitorMain(void *arg)
         /* reset cluster members counter */
         is_cluster = 0;
 
-        ptr = mon->databases;
-
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             ptr->mon_prev_status = ptr->server->status;
+        }
 
-            monitorDatabase(mon, ptr);
+        mon_probe_servers(mon, monitorDatabase);
 
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             /* Log server status change */
             if (mon_status_changed(ptr))
             {
@@ -653,6 +746,8 @@ monitorMain(void *arg)
             }
             ptr = ptr->next;
         }
+
+        mon_publish_states(mon);
     }
 }
 
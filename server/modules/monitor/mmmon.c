@@ -577,28 +577,30 @@ monitorMain(void *arg)
          * Calculate how far away the monitor interval is from its full
          * cycle and if monitor interval time further than the base
          * interval, then skip monitoring checks. Excluding the first
-         * round.
+         * round and rounds where servers have reported connection
+         * errors.
          */
-        if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
+        if (!mon_probe_is_due(mon, nrounds))
         {
             nrounds += 1;
             continue;
         }
         nrounds += 1;
 
-        /* start from the first server in the list */
-        ptr = mon->databases;
-
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             /* copy server status into monitor pending_status */
             ptr->pending_status = ptr->server->status;
+        }
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+        /* monitor all nodes */
+        mon_probe_servers(mon, monitorDatabase);
 
+        /* start from the first server in the list */
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             if (mon_status_changed(ptr))
             {
                 if (!(SERVER_IS_RUNNING(ptr->server)) ||
@@ -679,6 +681,8 @@ monitorMain(void *arg)
             }
             ptr = ptr->next;
         }
+
+        mon_publish_states(mon);
     }
 }
 
@@ -71,11 +71,36 @@ MODULE_INFO info =
 static void *startMonitor(void *, void*);
 static void stopMonitor(void *);
 static void diagnostics(DCB *, void *);
-static MONITOR_SERVERS *getServerByNodeId(MONITOR_SERVERS *, long);
-static MONITOR_SERVERS *getSlaveOfNodeId(MONITOR_SERVERS *, long);
+
+/**
+ * An entry in the server_id index of the monitored servers. The index is built
+ * at the start of each replication tree computation so that masters and slaves
+ * can be resolved without walking the list of servers.
+ */
+typedef struct
+{
+    long            id;     /**< The server_id, 0 for an empty slot */
+    MONITOR_SERVERS *node;  /**< First server with this server_id */
+    MONITOR_SERVERS *slave; /**< First server replicating from this server_id */
+    MONITOR_SERVERS *master; /**< Last server listing this server_id as a slave */
+    int             walk;   /**< Last replication chain walk that visited this entry */
+} NODE_INDEX_ENTRY;
+
+typedef struct
+{
+    NODE_INDEX_ENTRY *entries;
+    size_t           size;  /**< Number of slots, a power of two */
+} NODE_INDEX;
+
+static bool node_index_build(NODE_INDEX *, MONITOR_SERVERS *);
+static NODE_INDEX_ENTRY *node_index_get(NODE_INDEX *, long);
+static MONITOR_SERVERS *getServerByNodeId(NODE_INDEX *, long);
+static MONITOR_SERVERS *getSlaveOfNodeId(NODE_INDEX *, long);
 static MONITOR_SERVERS *get_replication_tree(MONITOR *, int);
 static void set_master_heartbeat(MYSQL_MONITOR *, MONITOR_SERVERS *);
 static void set_slave_heartbeat(MONITOR *, MONITOR_SERVERS *);
+static void set_master_repl_pos(MONITOR_SERVERS *);
+static uint64_t binlog_coordinates_to_pos(const char *file, const char *offset);
 static int add_slave_to_master(long *, int, long);
 static bool isMySQLEvent(monitor_event_t event);
 void check_maxscale_schema_replication(MONITOR *monitor);
@@ -302,19 +327,18 @@ static void diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
-static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
+static inline void monitor_mysql100_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     int isslave = 0;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW ALL SLAVES STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result)
     {
         int i = 0;
         long master_id = -1;
+        uint64_t slave_pos = 0;
 
-        if (mysql_field_count(database->con) < 42)
+        if (mysql_num_fields(result) < 42)
         {
             mysql_free_result(result);
             MXS_ERROR("\"SHOW ALL SLAVES STATUS\" "
@@ -347,11 +371,16 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
                 }
             }
 
+            /* get Relay_Master_Log_File and Exec_Master_Log_Pos values */
+            slave_pos = binlog_coordinates_to_pos(row[11], row[23]);
             i++;
         }
         /* store master_id of current node */
         memcpy(&database->server->master_id, &master_id, sizeof(long));
 
+        /* The position is only comparable to the master's with a single master */
+        database->slave_pos = i == 1 ? slave_pos : 0;
+
         mysql_free_result(result);
 
         /* If all configured slaves are running set this node as slave */
@@ -388,17 +417,18 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
     }
 }
 
-static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
+static inline void monitor_mysql55_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     bool isslave = false;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result)
     {
         long master_id = -1;
-        if (mysql_field_count(database->con) < 40)
+
+        database->slave_pos = 0;
+
+        if (mysql_num_fields(result) < 40)
         {
             mysql_free_result(result);
             MXS_ERROR("\"SHOW SLAVE STATUS\" "
@@ -430,6 +460,9 @@ static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
                     master_id = -1;
                 }
             }
+
+            /* get Relay_Master_Log_File and Exec_Master_Log_Pos values */
+            database->slave_pos = binlog_coordinates_to_pos(row[9], row[21]);
         }
         /* store master_id of current node */
         memcpy(&database->server->master_id, &master_id, sizeof(long));
@@ -525,8 +558,8 @@ static inline void monitor_mysql51_db(MONITOR_SERVERS* database)
 static MONITOR_SERVERS *build_mysql51_replication_tree(MONITOR *mon)
 {
     MONITOR_SERVERS* database = mon->databases;
-    MONITOR_SERVERS *ptr, *rval = NULL;
-    int i;
+    MONITOR_SERVERS *rval = NULL;
+    NODE_INDEX index;
     while (database)
     {
         bool ismaster = false;
@@ -581,24 +614,21 @@ static MONITOR_SERVERS *build_mysql51_replication_tree(MONITOR *mon)
         database = database->next;
     }
 
+    if (!node_index_build(&index, mon->databases))
+    {
+        return NULL;
+    }
+
     database = mon->databases;
 
     /** Set master server IDs */
     while (database)
     {
-        ptr = mon->databases;
+        NODE_INDEX_ENTRY *entry = node_index_get(&index, database->server->node_id);
 
-        while (ptr)
+        if (entry && entry->master)
         {
-            for (i = 0; ptr->server->slaves[i]; i++)
-            {
-                if (ptr->server->slaves[i] == database->server->node_id)
-                {
-                    database->server->master_id = ptr->server->node_id;
-                    break;
-                }
-            }
-            ptr = ptr->next;
+            database->server->master_id = entry->master->server->node_id;
         }
         if (database->server->master_id <= 0 && SERVER_IS_SLAVE(database->server))
         {
@@ -606,9 +636,43 @@ static MONITOR_SERVERS *build_mysql51_replication_tree(MONITOR *mon)
         }
         database = database->next;
     }
+
+    free(index.entries);
     return rval;
 }
 
+/**
+ * Read the result of SELECT @@server_id into the server
+ *
+ * @param database  The database that was queried
+ * @param result    The result set
+ * @return False if the result is not what the query returns
+ */
+static bool monitor_read_server_id(MONITOR_SERVERS *database, MYSQL_RES *result)
+{
+    MYSQL_ROW row;
+
+    if (mysql_num_fields(result) != 1)
+    {
+        MXS_ERROR("Unexpected result for 'SELECT @@server_id'. Expected 1 column."
+                  " MySQL Version: %s", version_str);
+        return false;
+    }
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        long server_id = strtol(row[0], NULL, 10);
+        if ((errno == ERANGE && (server_id == LONG_MAX
+                                 || server_id == LONG_MIN)) || (errno != 0 && server_id == 0))
+        {
+            server_id = -1;
+        }
+        database->server->node_id = server_id;
+    }
+
+    return true;
+}
+
 /**
  * Monitor an individual server
  *
@@ -619,7 +683,6 @@ static void
 monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 {
     MYSQL_MONITOR* handle = mon->handle;
-    MYSQL_ROW row;
     MYSQL_RES *result;
     char *uname = mon->user;
     unsigned long int server_version = 0;
@@ -651,6 +714,14 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         {
             server_clear_status(database->server, SERVER_AUTH_ERROR);
             monitor_clear_pending_status(database, SERVER_AUTH_ERROR);
+
+            /** The status queries are sent as one multi-statement query */
+            if (mysql_set_server_option(database->con, MYSQL_OPTION_MULTI_STATEMENTS_ON) != 0)
+            {
+                MXS_ERROR("Failed to enable multi-statements for monitoring server %s:%d: %s",
+                          database->server->name, database->server->port,
+                          mysql_error(database->con));
+            }
         }
         else
         {
@@ -704,41 +775,63 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         server_set_version_string(database->server, server_string);
     }
 
-    /* get server_id form current node */
-    if (mysql_query(database->con, "SELECT @@server_id") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    /**
+     * The server id and the replication status are read with one
+     * multi-statement query so that a probe is a single round trip
+     */
+    const char *query = "SELECT @@server_id";
+    MYSQL_RES *repl_result = NULL;
+    bool id_ok = true;
+
+    if (server_version >= 100000)
     {
-        long server_id = -1;
+        query = "SELECT @@server_id; SHOW ALL SLAVES STATUS";
+    }
+    else if (server_version >= 5 * 10000 + 5 * 100)
+    {
+        query = "SELECT @@server_id; SHOW SLAVE STATUS";
+    }
 
-        if (mysql_field_count(database->con) != 1)
+    if (mysql_query(database->con, query) == 0)
+    {
+        if ((result = mysql_store_result(database->con)) != NULL)
         {
+            id_ok = monitor_read_server_id(database, result);
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for 'SELECT @@server_id'. Expected 1 column."
-                      " MySQL Version: %s", version_str);
-            return;
         }
 
-        while ((row = mysql_fetch_row(result)))
+        if (mysql_next_result(database->con) == 0)
+        {
+            repl_result = mysql_store_result(database->con);
+        }
+
+        /** Any further results must be read before the next query */
+        while (mysql_next_result(database->con) == 0)
         {
-            server_id = strtol(row[0], NULL, 10);
-            if ((errno == ERANGE && (server_id == LONG_MAX
-                                     || server_id == LONG_MIN)) || (errno != 0 && server_id == 0))
+            if ((result = mysql_store_result(database->con)))
             {
-                server_id = -1;
+                mysql_free_result(result);
             }
-            database->server->node_id = server_id;
         }
-        mysql_free_result(result);
+    }
+
+    if (!id_ok)
+    {
+        if (repl_result)
+        {
+            mysql_free_result(repl_result);
+        }
+        return;
     }
 
     /* Check first for MariaDB 10.x.x and get status for multi-master replication */
     if (server_version >= 100000)
     {
-        monitor_mysql100_db(database);
+        monitor_mysql100_db(database, repl_result);
     }
     else if (server_version >= 5 * 10000 + 5 * 100)
     {
-        monitor_mysql55_db(database);
+        monitor_mysql55_db(database, repl_result);
     }
     else
     {
@@ -811,11 +904,10 @@ monitorMain(void *arg)
          * Calculate how far away the monitor interval is from its full
          * cycle and if monitor interval time further than the base
          * interval, then skip monitoring checks. Excluding the first
-         * round.
+         * round and rounds where servers have reported connection
+         * errors.
          */
-        if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
+        if (!mon_probe_is_due(mon, nrounds))
         {
             nrounds += 1;
             continue;
@@ -824,19 +916,22 @@ monitorMain(void *arg)
         /* reset num_servers */
         num_servers = 0;
 
-        /* start from the first server in the list */
-        ptr = mon->databases;
-
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             ptr->mon_prev_status = ptr->server->status;
 
             /* copy server status into monitor pending_status */
             ptr->pending_status = ptr->server->status;
+        }
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+        /* monitor all nodes */
+        mon_probe_servers(mon, monitorDatabase);
 
+        /* start from the first server in the list */
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             /* reset the slave list of current node */
             if (ptr->server->slaves)
             {
@@ -1065,6 +1160,7 @@ monitorMain(void *arg)
              SERVER_IS_RELAY_SERVER(root_master->server)))
         {
             set_master_heartbeat(handle, root_master);
+            set_master_repl_pos(root_master);
             ptr = mon->databases;
 
             while (ptr)
@@ -1076,58 +1172,215 @@ monitorMain(void *arg)
                          SERVER_IS_RELAY_SERVER(ptr->server)))
                     {
                         set_slave_heartbeat(mon, ptr);
+                        server_set_repl_pos(ptr->server, ptr->slave_pos);
                     }
                 }
                 ptr = ptr->next;
             }
         }
+
+        mon_publish_states(mon);
     } /*< while (1) */
 }
 
 /**
- * Fetch a MySQL node by node_id
+ * Pack binary log coordinates into a replication position
  *
- * @param ptr           The list of servers to monitor
- * @param node_id   The MySQL server_id to fetch
- * @return      The server with the required server_id
+ * @param file      The binary log file name, e.g. mysql-bin.000012
+ * @param offset    The offset in the file
+ * @return The position, 0 if the coordinates could not be parsed
  */
-static MONITOR_SERVERS *
-getServerByNodeId(MONITOR_SERVERS *ptr, long node_id)
+static uint64_t binlog_coordinates_to_pos(const char *file, const char *offset)
 {
-    SERVER *current;
-    while (ptr)
+    const char *dot;
+    uint64_t filenum;
+    uint64_t off;
+
+    if (file == NULL || offset == NULL || (dot = strrchr(file, '.')) == NULL)
     {
-        current = ptr->server;
-        if (current->node_id == node_id)
+        return 0;
+    }
+
+    filenum = strtoull(dot + 1, NULL, 10);
+    off = strtoull(offset, NULL, 10);
+
+    return off <= UINT32_MAX ? (filenum << 32) | off : 0;
+}
+
+/**
+ * Publish the binary log position of the root master. The replication lag of
+ * the slaves is estimated by comparing their positions to it.
+ *
+ * @param database  The root master
+ */
+static void set_master_repl_pos(MONITOR_SERVERS *database)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    uint64_t pos = 0;
+
+    if (mysql_query(database->con, "SHOW MASTER STATUS") == 0
+        && (result = mysql_store_result(database->con)) != NULL)
+    {
+        /* get File and Position values */
+        if (mysql_num_fields(result) >= 2 && (row = mysql_fetch_row(result)))
         {
-            return ptr;
+            pos = binlog_coordinates_to_pos(row[0], row[1]);
         }
-        ptr = ptr->next;
+        mysql_free_result(result);
     }
-    return NULL;
+
+    server_set_repl_pos(database->server, pos);
 }
 
 /**
- * Fetch a MySQL slave node from a node_id
+ * Find the index slot of a server_id
  *
- * @param ptr           The list of servers to monitor
- * @param node_id   The MySQL server_id to fetch
- * @return      The slave server of this node_id
+ * @param index The server_id index
+ * @param id    The server_id, must be positive
+ * @return The slot holding the server_id or the empty slot where it belongs
  */
-static MONITOR_SERVERS *
-getSlaveOfNodeId(MONITOR_SERVERS *ptr, long node_id)
+static NODE_INDEX_ENTRY *node_index_slot(NODE_INDEX *index, long id)
 {
-    SERVER *current;
-    while (ptr)
+    size_t mask = index->size - 1;
+    size_t i = ((unsigned long)id * 0x9E3779B97F4A7C15UL) & mask;
+
+    while (index->entries[i].id && index->entries[i].id != id)
     {
-        current = ptr->server;
-        if (current->master_id == node_id)
+        i = (i + 1) & mask;
+    }
+
+    return &index->entries[i];
+}
+
+/**
+ * Add a server_id to the index
+ *
+ * @param index The server_id index
+ * @param id    The server_id
+ * @return The entry of the server_id or NULL if the server_id is not valid
+ */
+static NODE_INDEX_ENTRY *node_index_add(NODE_INDEX *index, long id)
+{
+    if (id < 1)
+    {
+        return NULL;
+    }
+
+    NODE_INDEX_ENTRY *entry = node_index_slot(index, id);
+    entry->id = id;
+    return entry;
+}
+
+/**
+ * Fetch the index entry of a server_id
+ *
+ * @param index The server_id index
+ * @param id    The server_id
+ * @return The entry or NULL if no server has or replicates from this server_id
+ */
+static NODE_INDEX_ENTRY *node_index_get(NODE_INDEX *index, long id)
+{
+    if (id < 1)
+    {
+        return NULL;
+    }
+
+    NODE_INDEX_ENTRY *entry = node_index_slot(index, id);
+    return entry->id ? entry : NULL;
+}
+
+/**
+ * Build the server_id index of the monitored servers
+ *
+ * Every server is indexed by its own server_id, the server_id of its master
+ * and the server_ids of the slaves found with SHOW SLAVE HOSTS. The list of
+ * servers is walked twice, once for sizing the index and once for filling it.
+ *
+ * @param index    The index to build, the caller frees index->entries
+ * @param database The list of servers to monitor
+ * @return True if the index was built
+ */
+static bool node_index_build(NODE_INDEX *index, MONITOR_SERVERS *database)
+{
+    MONITOR_SERVERS *ptr;
+    size_t n_ids = 0;
+
+    for (ptr = database; ptr; ptr = ptr->next)
+    {
+        n_ids += 2;
+        for (int i = 0; ptr->server->slaves && i < MONITOR_MAX_NUM_SLAVES && ptr->server->slaves[i]; i++)
         {
-            return ptr;
+            n_ids++;
         }
-        ptr = ptr->next;
     }
-    return NULL;
+
+    /** Keep the load factor at or below one half */
+    index->size = 16;
+    while (index->size < n_ids * 2)
+    {
+        index->size *= 2;
+    }
+
+    if ((index->entries = calloc(index->size, sizeof(NODE_INDEX_ENTRY))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the replication topology index.");
+        return false;
+    }
+
+    for (ptr = database; ptr; ptr = ptr->next)
+    {
+        SERVER *server = ptr->server;
+        NODE_INDEX_ENTRY *entry;
+
+        if ((entry = node_index_add(index, server->node_id)) && entry->node == NULL)
+        {
+            entry->node = ptr;
+        }
+
+        if ((entry = node_index_add(index, server->master_id)) && entry->slave == NULL)
+        {
+            entry->slave = ptr;
+        }
+
+        for (int i = 0; server->slaves && i < MONITOR_MAX_NUM_SLAVES && server->slaves[i]; i++)
+        {
+            if ((entry = node_index_add(index, server->slaves[i])))
+            {
+                entry->master = ptr;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Fetch a MySQL node by node_id
+ *
+ * @param index     The server_id index of the monitored servers
+ * @param node_id   The MySQL server_id to fetch
+ * @return      The server with the required server_id
+ */
+static MONITOR_SERVERS *
+getServerByNodeId(NODE_INDEX *index, long node_id)
+{
+    NODE_INDEX_ENTRY *entry = node_index_get(index, node_id);
+    return entry ? entry->node : NULL;
+}
+
+/**
+ * Fetch a MySQL slave node from a node_id
+ *
+ * @param index     The server_id index of the monitored servers
+ * @param node_id   The MySQL server_id to fetch
+ * @return      The slave server of this node_id
+ */
+static MONITOR_SERVERS *
+getSlaveOfNodeId(NODE_INDEX *index, long node_id)
+{
+    NODE_INDEX_ENTRY *entry = node_index_get(index, node_id);
+    return entry ? entry->slave : NULL;
 }
 
 /*******
@@ -1362,6 +1615,11 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
  * and returns the root server with SERVER_MASTER bit.
  * The tree is computed even for servers in 'maintenance' mode.
  *
+ * Masters and slaves are resolved through a server_id index built at the
+ * start of the computation. Each chain of masters is walked only until it
+ * reaches a server it has already visited, which means the chain ends in
+ * a replication ring.
+ *
  * @param handle    The monitor handle
  * @param num_servers   The number of servers monitored
  * @return      The server at root level with SERVER_MASTER bit
@@ -1373,10 +1631,17 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
     MONITOR_SERVERS *ptr;
     MONITOR_SERVERS *backend;
     SERVER *current;
+    NODE_INDEX index;
     int depth = 0;
+    int walk = 0;
     long node_id;
     int root_level;
 
+    if (!node_index_build(&index, mon->databases))
+    {
+        return NULL;
+    }
+
     ptr = mon->databases;
     root_level = num_servers;
 
@@ -1392,13 +1657,14 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
             continue;
         }
         depth = 0;
+        walk++;
         current = ptr->server;
 
         node_id = current->master_id;
         if (node_id < 1)
         {
             MONITOR_SERVERS *find_slave;
-            find_slave = getSlaveOfNodeId(mon->databases, current->node_id);
+            find_slave = getSlaveOfNodeId(&index, current->node_id);
 
             if (find_slave == NULL)
             {
@@ -1414,6 +1680,11 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
         }
         else
         {
+            NODE_INDEX_ENTRY *entry = node_index_get(&index, current->node_id);
+            if (entry)
+            {
+                entry->walk = walk;
+            }
             depth++;
         }
 
@@ -1425,7 +1696,29 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
                 root_level = current->depth;
                 handle->master = ptr;
             }
-            backend = getServerByNodeId(mon->databases, node_id);
+            NODE_INDEX_ENTRY *entry = node_index_get(&index, node_id);
+            backend = entry ? entry->node : NULL;
+
+            if (backend && entry->walk == walk)
+            {
+                /* The chain loops back to a server already on it. Walking the ring
+                 * until the depth limit would only keep increasing the depth, so
+                 * the result of the walk is set here. */
+                MXS_DEBUG("Server %s:%d replicates from a replication ring.",
+                          current->name, current->port);
+                if (depth + 1 <= num_servers && depth + 1 < root_level)
+                {
+                    root_level = depth + 1;
+                    handle->master = ptr;
+                }
+                current->depth = num_servers + 1;
+                break;
+            }
+
+            if (entry)
+            {
+                entry->walk = walk;
+            }
 
             if (backend)
             {
@@ -1447,7 +1740,7 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
                 MONITOR_SERVERS *master;
                 current->depth = depth;
 
-                master = getServerByNodeId(mon->databases, current->master_id);
+                master = getServerByNodeId(&index, current->master_id);
                 if (master && master->server && master->server->node_id > 0)
                 {
                     add_slave_to_master(master->server->slaves, MONITOR_MAX_NUM_SLAVES, current->node_id);
@@ -1474,6 +1767,8 @@ static MONITOR_SERVERS *get_replication_tree(MONITOR *mon, int num_servers)
         ptr = ptr->next;
     }
 
+    free(index.entries);
+
     /*
      * Return the root master
      */
@@ -250,10 +250,11 @@ diagnostics(DCB *dcb, void *arg)
 /**
  * Monitor an individual server
  *
+ * @param mon       The monitor
  * @param database  The database to probe
  */
 static void
-monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPasswd, MONITOR *mon)
+monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 {
     MYSQL_ROW row;
     MYSQL_RES *result;
@@ -398,23 +399,26 @@ monitorMain(void *arg)
          * Calculate how far away the monitor interval is from its full
          * cycle and if monitor interval time further than the base
          * interval, then skip monitoring checks. Excluding the first
-         * round.
+         * round and rounds where servers have reported connection
+         * errors.
          */
-        if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
+        if (!mon_probe_is_due(mon, nrounds))
         {
             nrounds += 1;
             continue;
         }
         nrounds += 1;
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
+        {
+            ptr->mon_prev_status = ptr->server->status;
+        }
+
+        mon_probe_servers(mon, monitorDatabase);
+
         ptr = mon->databases;
 
         while (ptr)
         {
-            ptr->mon_prev_status = ptr->server->status;
-            monitorDatabase(ptr, mon->user, mon->password, mon);
-
             if (ptr->server->status != ptr->mon_prev_status ||
                 SERVER_IS_DOWN(ptr->server))
             {
@@ -447,6 +451,8 @@ monitorMain(void *arg)
             }
             ptr = ptr->next;
         }
+
+        mon_publish_states(mon);
     }
 }
 
@@ -0,0 +1,795 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mockbackend.c - An in-process MySQL server for benchmarking
+ *
+ * A backend protocol that answers the queries itself instead of connecting
+ * to a server. It is used to measure the throughput of the routers, the
+ * filters and the polling loop without the noise of a real database.
+ *
+ * The connection is authenticated as soon as it is created. Queries that
+ * start with SELECT or SHOW are answered with a canned result set and all
+ * other commands with an OK packet. The size of the result set and the
+ * latency of the replies are set with the following parameters of the
+ * server:
+ *
+ * mock_rows                  Rows in a result set, default 1
+ * mock_columns               Columns in a result set, default 1
+ * mock_field_size            Bytes in each field, default 16
+ * mock_latency               Mean latency of a reply in microseconds, default 0
+ * mock_latency_distribution  fixed, uniform or exponential, default fixed
+ *
+ * Without latency, the reply is delivered as a fake read event on the backend
+ * DCB. With latency, the reply is held until a timerfd of the connection
+ * expires, so the delay is handled by the polling threads like the reply
+ * of a real server. The replies of one connection are delivered in order.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <modinfo.h>
+#include <dcb.h>
+#include <buffer.h>
+#include <gw_protocol.h>
+#include <session.h>
+#include <server.h>
+#include <router.h>
+#include <spinlock.h>
+#include <log_manager.h>
+#include <random_jkiss.h>
+#include <maxscale/poll.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_PROTOCOL,
+    MODULE_IN_DEVELOPMENT,
+    GWPROTOCOL_VERSION,
+    "In-process MySQL server for benchmarking"
+};
+
+static char *version_str = "V1.0.0";
+
+/** Largest field of the canned result set, keeps the rows below 16MB */
+#define MOCK_MAX_FIELD_SIZE 65535
+
+typedef enum
+{
+    MOCK_LATENCY_FIXED,
+    MOCK_LATENCY_UNIFORM,
+    MOCK_LATENCY_EXPONENTIAL
+} mock_latency_t;
+
+/** A reply that is waiting for its latency to pass */
+typedef struct mock_reply
+{
+    GWBUF             *reply;
+    uint64_t          due;     /*< When the reply is delivered, in nanoseconds */
+    struct mock_reply *next;
+} MOCK_REPLY;
+
+/**
+ * A mock connection. The MySQL protocol structure is the first member so
+ * that the routers can treat the connection as a MySQL backend connection.
+ */
+typedef struct
+{
+    MySQLProtocol  protocol;
+    uint8_t        *resultset;   /*< The canned result set */
+    size_t         resultset_len;
+    int            latency;      /*< Mean latency in microseconds */
+    mock_latency_t distribution; /*< Distribution of the latency */
+    SPINLOCK       lock;         /*< Protects the pending replies */
+    MOCK_REPLY     *pending;     /*< Replies waiting for their latency */
+    MOCK_REPLY     *last;        /*< The last pending reply */
+} MOCK_CONN;
+
+static int mock_read(DCB *dcb);
+static int mock_write(DCB *dcb, GWBUF *queue);
+static int mock_write_ready(DCB *dcb);
+static int mock_error(DCB *dcb);
+static int mock_hangup(DCB *dcb);
+static int mock_connect(DCB *dcb, SERVER *server, SESSION *session);
+static int mock_close(DCB *dcb);
+static char *mock_default_auth();
+
+/**
+ * The "module object" for the mock backend protocol module.
+ */
+static GWPROTOCOL MyObject =
+{
+    mock_read,        /**< Read - EPOLLIN handler        */
+    mock_write,       /**< Write - data from gateway     */
+    mock_write_ready, /**< WriteReady - EPOLLOUT handler */
+    mock_error,       /**< Error - EPOLLERR handler      */
+    mock_hangup,      /**< HangUp - EPOLLHUP handler     */
+    NULL,             /**< Accept                        */
+    mock_connect,     /**< Connect                       */
+    mock_close,       /**< Close                         */
+    NULL,             /**< Listen                        */
+    NULL,             /**< Authentication                */
+    NULL,             /**< Session                       */
+    mock_default_auth, /**< Default authenticator        */
+    NULL,             /**< Connection limit reached      */
+    NULL              /**< Reuse for another user        */
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char* version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+GWPROTOCOL* GetModuleObject()
+{
+    return &MyObject;
+}
+
+static char *mock_default_auth()
+{
+    return "NullBackendAuth";
+}
+
+static uint64_t mock_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Read an integer parameter of a server
+ *
+ * @param server The server
+ * @param name Name of the parameter
+ * @param def Default value
+ * @param max Largest allowed value
+ * @return The value of the parameter
+ */
+static int mock_parameter(SERVER *server, char *name, int def, int max)
+{
+    char *value = serverGetParameter(server, name);
+    int rval = def;
+
+    if (value)
+    {
+        char *end;
+        long l = strtol(value, &end, 10);
+
+        if (*end || l < 0 || l > max)
+        {
+            MXS_WARNING("Invalid value for '%s' in server '%s': %s, using %d.",
+                        name, server->unique_name, value, def);
+        }
+        else
+        {
+            rval = l;
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * Append a packet to a byte array
+ *
+ * @param ptr Where the packet is written
+ * @param seq Sequence number of the packet
+ * @param payload The payload, NULL if it was already written after the header
+ * @param len Length of the payload
+ * @return Pointer to the end of the packet
+ */
+static uint8_t *mock_packet(uint8_t *ptr, uint8_t seq, const uint8_t *payload, size_t len)
+{
+    gw_mysql_set_byte3(ptr, len);
+    ptr[3] = seq;
+
+    if (payload)
+    {
+        memcpy(ptr + MYSQL_HEADER_LEN, payload, len);
+    }
+
+    return ptr + MYSQL_HEADER_LEN + len;
+}
+
+/**
+ * Build the canned result set that a connection replies with
+ *
+ * @param conn The connection
+ * @param server The server of the connection
+ * @return True on success
+ */
+static bool mock_build_resultset(MOCK_CONN *conn, SERVER *server)
+{
+    static const uint8_t eof[] = {0xfe, 0x00, 0x00, 0x02, 0x00};
+    int rows = mock_parameter(server, "mock_rows", 1, INT32_MAX);
+    int columns = mock_parameter(server, "mock_columns", 1, 4096);
+    int field_size = mock_parameter(server, "mock_field_size", 16, MOCK_MAX_FIELD_SIZE);
+    int field_len = field_size + (field_size < 251 ? 1 : 3);
+    size_t coldef_len = 4 + 1 + 1 + 1 + 1 + 6 + 1 + 1 + 12;
+    size_t row_len;
+
+    if (columns == 0)
+    {
+        columns = 1;
+    }
+
+    row_len = (size_t)columns * field_len;
+
+    if (row_len > 0xffffff)
+    {
+        MXS_ERROR("The rows of server '%s' would not fit into a packet.", server->unique_name);
+        return false;
+    }
+
+    size_t len = (MYSQL_HEADER_LEN + (columns < 251 ? 1 : 3)) +
+        columns * (MYSQL_HEADER_LEN + coldef_len) +
+        (size_t)(rows + 2) * MYSQL_HEADER_LEN + 2 * sizeof(eof) +
+        (size_t)rows * row_len;
+
+    if ((conn->resultset = malloc(len)) == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = conn->resultset;
+    uint8_t column_count = columns < 251 ? columns : 0;
+    uint8_t seq = 1;
+
+    if (column_count)
+    {
+        ptr = mock_packet(ptr, seq++, &column_count, 1);
+    }
+    else
+    {
+        uint8_t lenenc[] = {0xfc, columns & 0xff, columns >> 8};
+        ptr = mock_packet(ptr, seq++, lenenc, sizeof(lenenc));
+    }
+
+    for (int i = 0; i < columns; i++)
+    {
+        uint8_t coldef[coldef_len];
+        uint8_t *c = coldef;
+        /** catalog "def", empty schema, table and original table */
+        *c++ = 3;
+        memcpy(c, "def", 3);
+        c += 3;
+        *c++ = 0;
+        *c++ = 0;
+        *c++ = 0;
+        /** Name cNNNN, padded with spaces so that all columns are equal in size */
+        *c++ = 6;
+        snprintf((char*)c, 7, "c%-5d", i % 100000);
+        c += 6;
+        /** Empty original name, then the fixed length fields */
+        *c++ = 0;
+        *c++ = 0x0c;
+        gw_mysql_set_byte2(c, 0x21);
+        gw_mysql_set_byte4(c + 2, field_size * 3);
+        c[6] = 0xfd;    /* VAR_STRING */
+        gw_mysql_set_byte2(c + 7, 0);
+        c[9] = 0;
+        c[10] = 0;
+        c[11] = 0;
+        ptr = mock_packet(ptr, seq++, coldef, sizeof(coldef));
+    }
+
+    ptr = mock_packet(ptr, seq++, eof, sizeof(eof));
+
+    for (int i = 0; i < rows; i++)
+    {
+        uint8_t *field = ptr + MYSQL_HEADER_LEN;
+
+        for (int j = 0; j < columns; j++)
+        {
+            if (field_size < 251)
+            {
+                *field++ = field_size;
+            }
+            else
+            {
+                *field++ = 0xfc;
+                gw_mysql_set_byte2(field, field_size);
+                field += 2;
+            }
+            memset(field, 'x', field_size);
+            field += field_size;
+        }
+
+        ptr = mock_packet(ptr, seq++, NULL, row_len);
+    }
+
+    ptr = mock_packet(ptr, seq++, eof, sizeof(eof));
+    conn->resultset_len = ptr - conn->resultset;
+    ss_dassert(conn->resultset_len == len);
+
+    return true;
+}
+
+/**
+ * Create a new mock connection
+ *
+ * The connection has a timerfd that wakes up the polling thread when a
+ * delayed reply is due, it never becomes readable otherwise.
+ *
+ * @param dcb The backend DCB
+ * @param server The server to connect to
+ * @param session The session
+ * @return The file descriptor or -1 on error
+ */
+static int mock_connect(DCB *dcb, SERVER *server, SESSION *session)
+{
+    MOCK_CONN *conn = calloc(1, sizeof(MOCK_CONN));
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (conn == NULL || fd == -1 || !mock_build_resultset(conn, server))
+    {
+        MXS_ERROR("Failed to create a mock connection to server '%s'.", server->unique_name);
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+
+        if (conn)
+        {
+            free(conn->resultset);
+            free(conn);
+        }
+
+        return -1;
+    }
+
+    /** Initialize the MySQL protocol part as the MySQLBackend module does */
+    MySQLProtocol *protocol = mysql_protocol_init(dcb, fd);
+
+    if (protocol == NULL)
+    {
+        close(fd);
+        free(conn->resultset);
+        free(conn);
+        return -1;
+    }
+
+    conn->protocol = *protocol;
+    free(protocol);
+
+    if (session->client_dcb->protocol)
+    {
+        conn->protocol.client_capabilities =
+            ((MySQLProtocol *)session->client_dcb->protocol)->client_capabilities;
+        conn->protocol.charset = ((MySQLProtocol *)session->client_dcb->protocol)->charset;
+    }
+
+    conn->protocol.protocol_auth_state = MYSQL_IDLE;
+
+    char *distribution = serverGetParameter(server, "mock_latency_distribution");
+
+    conn->latency = mock_parameter(server, "mock_latency", 0, 60000000);
+    conn->distribution = MOCK_LATENCY_FIXED;
+
+    if (distribution && strcasecmp(distribution, "uniform") == 0)
+    {
+        conn->distribution = MOCK_LATENCY_UNIFORM;
+    }
+    else if (distribution && strcasecmp(distribution, "exponential") == 0)
+    {
+        conn->distribution = MOCK_LATENCY_EXPONENTIAL;
+    }
+
+    spinlock_init(&conn->lock);
+    dcb->protocol = conn;
+
+    return fd;
+}
+
+/**
+ * Pick the latency of the next reply
+ *
+ * @param conn The connection
+ * @return The latency in nanoseconds
+ */
+static uint64_t mock_latency(MOCK_CONN *conn)
+{
+    double u = (random_jkiss() + 1.0) / (UINT32_MAX + 2.0);
+    double usec;
+
+    switch (conn->distribution)
+    {
+    case MOCK_LATENCY_UNIFORM:
+        usec = 2.0 * conn->latency * u;
+        break;
+
+    case MOCK_LATENCY_EXPONENTIAL:
+        usec = -conn->latency * log(u);
+        break;
+
+    default:
+        usec = conn->latency;
+        break;
+    }
+
+    return (uint64_t)(usec * 1000);
+}
+
+/**
+ * Arm the timer of a connection for the first pending reply
+ *
+ * @param dcb The backend DCB
+ * @param due When the reply is due, in nanoseconds
+ */
+static void mock_arm_timer(DCB *dcb, uint64_t due)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000000000;
+    its.it_value.tv_nsec = due % 1000000000;
+
+    if (timerfd_settime(dcb->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to arm the timer of a mock connection: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * Send a reply to the router, either at once or after the latency
+ *
+ * @param dcb The backend DCB
+ * @param reply The reply
+ */
+static void mock_reply(DCB *dcb, GWBUF *reply)
+{
+    MOCK_CONN *conn = (MOCK_CONN*)dcb->protocol;
+
+    if (conn->latency == 0)
+    {
+        poll_add_epollin_event_to_dcb(dcb, reply);
+        return;
+    }
+
+    MOCK_REPLY *pending = malloc(sizeof(MOCK_REPLY));
+
+    if (pending == NULL)
+    {
+        gwbuf_free(reply);
+        return;
+    }
+
+    pending->reply = reply;
+    pending->due = mock_now() + mock_latency(conn);
+    pending->next = NULL;
+
+    spinlock_acquire(&conn->lock);
+
+    /** A reply is never delivered before the one that was sent before it */
+    if (conn->last && conn->last->due > pending->due)
+    {
+        pending->due = conn->last->due;
+    }
+
+    if (conn->pending == NULL)
+    {
+        conn->pending = pending;
+        mock_arm_timer(dcb, pending->due);
+    }
+    else
+    {
+        conn->last->next = pending;
+    }
+
+    conn->last = pending;
+    spinlock_release(&conn->lock);
+}
+
+/**
+ * Create an OK packet
+ *
+ * @param seq Sequence number of the packet
+ * @return The OK packet
+ */
+static GWBUF *mock_ok(uint8_t seq)
+{
+    static const uint8_t ok[] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00};
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + sizeof(ok));
+
+    if (buf)
+    {
+        mock_packet(GWBUF_DATA(buf), seq, ok, sizeof(ok));
+    }
+
+    return buf;
+}
+
+/**
+ * Check if a query returns a result set
+ *
+ * @param sql The query
+ * @param len Length of the query
+ * @return True if the query starts with SELECT or SHOW
+ */
+static bool mock_is_read(const uint8_t *sql, size_t len)
+{
+    while (len && isspace(*sql))
+    {
+        sql++;
+        len--;
+    }
+
+    return (len >= 6 && strncasecmp((const char*)sql, "select", 6) == 0) ||
+        (len >= 4 && strncasecmp((const char*)sql, "show", 4) == 0);
+}
+
+/**
+ * Answer the commands that the router writes to the backend
+ *
+ * @param dcb The backend DCB
+ * @param queue The commands
+ * @return 1 on success
+ */
+static int mock_write(DCB *dcb, GWBUF *queue)
+{
+    MOCK_CONN *conn = (MOCK_CONN*)dcb->protocol;
+
+    queue = gwbuf_make_contiguous(queue);
+
+    if (queue == NULL)
+    {
+        return 0;
+    }
+
+    uint8_t *ptr = GWBUF_DATA(queue);
+    uint8_t *end = ptr + GWBUF_LENGTH(queue);
+
+    while (end - ptr >= MYSQL_HEADER_LEN + 1)
+    {
+        size_t len = MYSQL_GET_PACKET_LEN(ptr);
+        uint8_t seq = ptr[3] + 1;
+        GWBUF *reply = NULL;
+
+        if ((size_t)(end - ptr) < MYSQL_HEADER_LEN + len)
+        {
+            break;
+        }
+
+        switch (MYSQL_GET_COMMAND(ptr))
+        {
+        case MYSQL_COM_QUIT:
+        case MYSQL_COM_STMT_CLOSE:
+        case MYSQL_COM_STMT_SEND_LONG_DATA:
+            /** No reply */
+            break;
+
+        case MYSQL_COM_QUERY:
+            if (mock_is_read(ptr + MYSQL_HEADER_LEN + 1, len - 1))
+            {
+                reply = gwbuf_alloc_and_load(conn->resultset_len, conn->resultset);
+                break;
+            }
+            reply = mock_ok(seq);
+            break;
+
+        case MYSQL_COM_STMT_PREPARE:
+        case MYSQL_COM_STMT_EXECUTE:
+        case MYSQL_COM_STMT_FETCH:
+            reply = mysql_create_custom_error(seq, 0, "Prepared statements are not "
+                                              "supported by the mock backend");
+            break;
+
+        default:
+            reply = mock_ok(seq);
+            break;
+        }
+
+        if (reply)
+        {
+            mock_reply(dcb, reply);
+        }
+
+        ptr += MYSQL_HEADER_LEN + len;
+    }
+
+    gwbuf_free(queue);
+    return 1;
+}
+
+/**
+ * Route a reply to the router
+ *
+ * @param dcb The backend DCB
+ * @param reply The reply
+ */
+static void mock_route_reply(DCB *dcb, GWBUF *reply)
+{
+    SESSION *session = dcb->session;
+
+    if (session->state == SESSION_STATE_ROUTER_READY &&
+        session->client_dcb &&
+        session->client_dcb->state == DCB_STATE_POLLING &&
+        (session->router_session ||
+         session->service->router->getCapabilities() & (int)RCAP_TYPE_NO_RSESSION))
+    {
+        gwbuf_set_type(reply, GWBUF_TYPE_MYSQL);
+        session->service->router->clientReply(session->service->router_instance,
+                                              session->router_session,
+                                              reply, dcb);
+    }
+    else
+    {
+        gwbuf_free(reply);
+    }
+}
+
+/**
+ * Deliver the replies that are due
+ *
+ * The immediate replies are in the read queue of the DCB and the delayed
+ * ones in the pending list of the connection.
+ *
+ * @param dcb The backend DCB
+ * @return 1 always
+ */
+static int mock_read(DCB *dcb)
+{
+    MOCK_CONN *conn = (MOCK_CONN*)dcb->protocol;
+    uint64_t expirations;
+    GWBUF *reply;
+
+    /** Reset the timer, it may also have expired for a reply that was delivered */
+    while (read(dcb->fd, &expirations, sizeof(expirations)) > 0)
+    {
+        ;
+    }
+
+    spinlock_acquire(&dcb->authlock);
+    reply = dcb->dcb_readqueue;
+    dcb->dcb_readqueue = NULL;
+    spinlock_release(&dcb->authlock);
+
+    if (reply)
+    {
+        mock_route_reply(dcb, reply);
+    }
+
+    uint64_t now = mock_now();
+
+    while (true)
+    {
+        MOCK_REPLY *pending = NULL;
+
+        spinlock_acquire(&conn->lock);
+
+        if (conn->pending && conn->pending->due <= now)
+        {
+            pending = conn->pending;
+            conn->pending = pending->next;
+
+            if (conn->pending == NULL)
+            {
+                conn->last = NULL;
+            }
+        }
+        else if (conn->pending)
+        {
+            mock_arm_timer(dcb, conn->pending->due);
+        }
+
+        spinlock_release(&conn->lock);
+
+        if (pending == NULL)
+        {
+            break;
+        }
+
+        mock_route_reply(dcb, pending->reply);
+        free(pending);
+    }
+
+    return 1;
+}
+
+static int mock_write_ready(DCB *dcb)
+{
+    return 1;
+}
+
+static int mock_error(DCB *dcb)
+{
+    return 1;
+}
+
+static int mock_hangup(DCB *dcb)
+{
+    return 1;
+}
+
+/**
+ * Close a mock connection
+ *
+ * The pending replies are discarded. If the session is stopping, the client
+ * is closed as the MySQLBackend module does.
+ *
+ * @param dcb The backend DCB
+ * @return 1 always
+ */
+static int mock_close(DCB *dcb)
+{
+    MOCK_CONN *conn = (MOCK_CONN*)dcb->protocol;
+    SESSION *session = dcb->session;
+
+    spinlock_acquire(&conn->lock);
+
+    while (conn->pending)
+    {
+        MOCK_REPLY *pending = conn->pending;
+        conn->pending = pending->next;
+        gwbuf_free(pending->reply);
+        free(pending);
+    }
+
+    conn->last = NULL;
+    spinlock_release(&conn->lock);
+
+    free(conn->resultset);
+    conn->resultset = NULL;
+    mysql_protocol_done(dcb);
+
+    if (session)
+    {
+        spinlock_acquire(&session->ses_lock);
+
+        if (session->state == SESSION_STATE_STOPPING &&
+            session->client_dcb != NULL &&
+            session->client_dcb->state == DCB_STATE_POLLING)
+        {
+            spinlock_release(&session->ses_lock);
+            dcb_close(session->client_dcb);
+        }
+        else
+        {
+            spinlock_release(&session->ses_lock);
+        }
+    }
+
+    return 1;
+}
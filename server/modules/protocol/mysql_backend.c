@@ -18,7 +18,11 @@
 #include <modutil.h>
 #include <utils.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#include <maxconfig.h>
+#include <atomic.h>
 #include <gw.h>
+#include <time.h>
 
 /* The following can be compared using memcmp to detect a null password */
 uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN]="";
@@ -78,12 +82,17 @@ static int gw_backend_hangup(DCB *dcb);
 static int backend_write_delayqueue(DCB *dcb);
 static void backend_set_delayqueue(DCB *dcb, GWBUF *queue);
 static int gw_change_user(DCB *backend_dcb, SERVER *server, SESSION *in_session, GWBUF *queue);
+static int gw_reuse_backend(DCB *dcb, SESSION *session);
+static int gw_backend_reusable(DCB *dcb, SESSION *session);
 static char *gw_backend_default_auth();
 static GWBUF* process_response_data(DCB* dcb, GWBUF* readbuf, int nbytes_to_process);
 extern char* create_auth_failed_msg(GWBUF* readbuf, char* hostaddr, uint8_t* sha1);
 static bool sescmd_response_complete(DCB* dcb);
 static int gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session);
 static int gw_read_and_write(DCB *dcb, MYSQL_session local_session);
+static int gw_route_reply(DCB *dcb, GWBUF *read_buffer);
+static bool gw_reply_streamable(DCB *dcb, bool sescmd);
+static GWBUF *gw_take_stream(MySQLProtocol *proto, GWBUF **read_buffer, bool sescmd);
 static int gw_read_backend_handshake(MySQLProtocol *conn);
 static int gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload);
 static int gw_receive_backend_auth(MySQLProtocol *protocol);
@@ -94,7 +103,8 @@ static mysql_auth_state_t gw_send_authentication_to_backend(char *dbname,
 static uint32_t create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress);
 static int response_length(MySQLProtocol *conn, char *user, uint8_t *passwd, char *dbname);
 static uint8_t *load_hashed_password(MySQLProtocol *conn, uint8_t *payload, uint8_t *passwd);
-static int gw_do_connect_to_backend(char *host, int port, int *fd);
+static int gw_do_connect_to_backend(SERVER *server, int *fd);
+static int gw_do_connect_to_backend_unix(SERVER *server, int *fd);
 static void inline close_socket(int socket);
 static GWBUF *gw_create_change_user_packet(MYSQL_session*  mses,
                                     MySQLProtocol*  protocol);
@@ -107,6 +117,10 @@ static int gw_send_change_user_to_backend(char          *dbname,
 static int gw_session(DCB *backend_dcb, void *data);
 #endif
 static bool gw_get_shared_session_auth_info(DCB* dcb, MYSQL_session* session);
+static int gw_backend_read(DCB *dcb, GWBUF **head);
+static int gw_backend_write(DCB *dcb, GWBUF *queue);
+static GWBUF *gw_compress_packets(DCB *dcb, GWBUF *queue);
+static GWBUF *gw_decompress_packets(DCB *dcb, GWBUF *raw, bool *error);
 
 static GWPROTOCOL MyObject = {
                               gw_read_backend_event, /* Read - EPOLLIN handler        */
@@ -121,7 +135,9 @@ static GWPROTOCOL MyObject = {
                               gw_change_user, /* Authentication                */
                               NULL, /* Session                       */
                               gw_backend_default_auth, /* Default authenticator */
-                              NULL  /**< Connection limit reached      */
+                              NULL, /**< Connection limit reached      */
+                              gw_reuse_backend, /* Reuse for another user */
+                              gw_backend_reusable /* Pooled connection fits the session */
 };
 
 /*
@@ -237,7 +253,7 @@ static int gw_create_backend_connection(DCB *backend_dcb,
 
     /*< if succeed, fd > 0, -1 otherwise */
     /* TODO: Better if function returned a protocol auth state */
-    rv = gw_do_connect_to_backend(server->name, server->port, &fd);
+    rv = gw_do_connect_to_backend(server, &fd);
     /*< Assign protocol with backend_dcb */
     backend_dcb->protocol = protocol;
 
@@ -247,7 +263,7 @@ static int gw_create_backend_connection(DCB *backend_dcb,
         case 0:
             ss_dassert(fd > 0);
             protocol->fd = fd;
-            protocol->protocol_auth_state = MYSQL_CONNECTED;
+            mysql_protocol_set_state(protocol, MYSQL_CONNECTED);
             MXS_DEBUG("%lu [gw_create_backend_connection] Established "
                       "connection to %s:%i, protocol fd %d client "
                       "fd %d.",
@@ -263,7 +279,7 @@ static int gw_create_backend_connection(DCB *backend_dcb,
             /* as it means the calls have been successful but the connection  */
             /* has not yet completed and the calls are non-blocking.          */
             ss_dassert(fd > 0);
-            protocol->protocol_auth_state = MYSQL_PENDING_CONNECT;
+            mysql_protocol_set_state(protocol, MYSQL_PENDING_CONNECT);
             protocol->fd = fd;
             MXS_DEBUG("%lu [gw_create_backend_connection] Connection "
                       "pending to %s:%i, protocol fd %d client fd %d.",
@@ -297,9 +313,9 @@ return_fd:
  *
  * This routine creates socket and connects to a backend server.
  * Connect it non-blocking operation. If connect fails, socket is closed.
+ * The address of the server is the one last resolved by the housekeeper.
  *
- * @param host The host to connect to
- * @param port The host TCP/IP port
+ * @param server The server to connect to
  * @param *fd where connected fd is copied
  * @return 0/1 on success and -1 on failure
  * If successful, fd has file descriptor to socket which is connected to
@@ -307,15 +323,35 @@ return_fd:
  *
  */
 static int
-gw_do_connect_to_backend(char *host, int port, int *fd)
+gw_do_connect_to_backend(SERVER *server, int *fd)
 {
     struct sockaddr_in serv_addr;
+    char *host = server->name;
+    int port = server->port;
     int rv;
     int so = 0;
     int bufsize;
 
+    if (server->socket)
+    {
+        return gw_do_connect_to_backend_unix(server, fd);
+    }
+
     memset(&serv_addr, 0, sizeof serv_addr);
     serv_addr.sin_family = (int)AF_INET;
+
+    /** The address is resolved by the housekeeper, never here */
+    if (!server_get_address(server, &serv_addr.sin_addr))
+    {
+        MXS_ERROR("Establishing connection to backend server "
+                  "%s:%d failed, the address of the server has not "
+                  "been resolved.",
+                  host,
+                  port);
+        rv = -1;
+        goto return_rv;
+    }
+
     so = socket((int)AF_INET, (int)SOCK_STREAM, 0);
 
     if (so < 0)
@@ -332,7 +368,6 @@ gw_do_connect_to_backend(char *host, int port, int *fd)
         goto return_rv;
     }
     /* prepare for connect */
-    setipaddress(&serv_addr.sin_addr, host);
     serv_addr.sin_port = htons(port);
     bufsize = GW_BACKEND_SO_SNDBUF;
 
@@ -388,7 +423,32 @@ gw_do_connect_to_backend(char *host, int port, int *fd)
 
     /* set socket to as non-blocking here */
     setnonblocking(so);
-    rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+
+    /**
+     * The server speaks first, so there is no data to put in the SYN. An empty
+     * send with MSG_FASTOPEN still sends the Fast Open cookie, which lets the
+     * server accept the connection and send its handshake without waiting for
+     * the last packet of the TCP handshake. TCP_FASTOPEN_CONNECT is not used as
+     * it holds back the SYN until the first write.
+     */
+    if (config_tcp_fastopen() > 0)
+    {
+        rv = sendto(so, NULL, 0, MSG_FASTOPEN, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+
+        if (rv == 0 || errno == EINPROGRESS)
+        {
+            atomic_add(&server->stats.n_fastopen, 1);
+        }
+        else if (errno == EOPNOTSUPP || errno == EINVAL)
+        {
+            /** Fast Open is disabled in the kernel */
+            rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+        }
+    }
+    else
+    {
+        rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+    }
 
     if (rv != 0)
     {
@@ -423,6 +483,95 @@ return_rv:
 
 }
 
+/**
+ * Connect to a backend server through its Unix domain socket
+ *
+ * The socket is set up like the TCP one in gw_do_connect_to_backend, apart
+ * from the TCP options.
+ *
+ * @param server The server to connect to
+ * @param *fd where connected fd is copied
+ * @return 0/1 on success and -1 on failure
+ */
+static int
+gw_do_connect_to_backend_unix(SERVER *server, int *fd)
+{
+    struct sockaddr_un serv_addr;
+    int so;
+    int rv;
+
+    if (strlen(server->socket) >= sizeof(serv_addr.sun_path))
+    {
+        MXS_ERROR("Establishing connection to backend server "
+                  "%s failed, the socket path is too long.",
+                  server->socket);
+        return -1;
+    }
+
+    memset(&serv_addr, 0, sizeof serv_addr);
+    serv_addr.sun_family = AF_UNIX;
+    strcpy(serv_addr.sun_path, server->socket);
+
+    if ((so = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Establishing connection to backend server "
+                  "%s failed. Socket creation failed due %d, %s.",
+                  server->socket,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+
+    int sndbuf = GW_BACKEND_SO_SNDBUF;
+    int rcvbuf = GW_BACKEND_SO_RCVBUF;
+
+    if (setsockopt(so, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) != 0 ||
+        setsockopt(so, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to set socket options %s failed. Socket "
+                  "configuration failed due %d, %s.",
+                  server->socket,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        close_socket(so);
+        return -1;
+    }
+
+    setnonblocking(so);
+    rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+
+    if (rv != 0)
+    {
+        if (errno == EINPROGRESS)
+        {
+            rv = 1;
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to connect backend server %s, "
+                      "due %d, %s.",
+                      server->socket,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            close_socket(so);
+            return -1;
+        }
+    }
+
+    *fd = so;
+    MXS_DEBUG("%lu [gw_do_connect_to_backend] Connected to backend server "
+              "%s, fd %d.",
+              pthread_self(), server->socket, so);
+#if defined(FAKE_CODE)
+    conn_open[so] = true;
+#endif /* FAKE_CODE */
+
+    return rv;
+}
+
 /*******************************************************************************
  *******************************************************************************
  *
@@ -506,7 +655,7 @@ gw_read_backend_event(DCB *dcb)
             /** Read cached backend handshake */
             if (gw_read_backend_handshake(backend_protocol) != 0)
             {
-                backend_protocol->protocol_auth_state = MYSQL_HANDSHAKE_FAILED;
+                mysql_protocol_set_state(backend_protocol, MYSQL_HANDSHAKE_FAILED);
 
                 MXS_DEBUG("%lu [gw_read_backend_event] after "
                           "gw_read_backend_handshake, fd %d, "
@@ -598,7 +747,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
             if (h_len <= 4)
             {
                 /* log error this exit point */
-                conn->protocol_auth_state = MYSQL_HANDSHAKE_FAILED;
+                mysql_protocol_set_state(conn, MYSQL_HANDSHAKE_FAILED);
                 MXS_DEBUG("%lu [gw_read_backend_handshake] after "
                           "dcb_read, fd %d, "
                           "state = MYSQL_HANDSHAKE_FAILED.",
@@ -614,7 +763,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
                 uint16_t errcode = MYSQL_GET_ERRCODE(payload);
                 char* bufstr = strndup(&((char *)payload)[7], len - 3);
 
-                conn->protocol_auth_state = MYSQL_HANDSHAKE_FAILED;
+                mysql_protocol_set_state(conn, MYSQL_HANDSHAKE_FAILED);
 
                 MXS_DEBUG("%lu [gw_receive_backend_auth] Invalid "
                           "authentication message from backend dcb %p "
@@ -664,7 +813,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
                  * packet. Log error this exit point
                  */
 
-                conn->protocol_auth_state = MYSQL_HANDSHAKE_FAILED;
+                mysql_protocol_set_state(conn, MYSQL_HANDSHAKE_FAILED);
 
                 MXS_DEBUG("%lu [gw_read_backend_handshake] after "
                           "gw_mysql_get_byte3, fd %d, "
@@ -687,7 +836,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
                  * we cannot continue
                  * log error this exit point
                  */
-                conn->protocol_auth_state = MYSQL_HANDSHAKE_FAILED;
+                mysql_protocol_set_state(conn, MYSQL_HANDSHAKE_FAILED);
 
                 MXS_DEBUG("%lu [gw_read_backend_handshake] after "
                           "gw_decode_mysql_server_handshake, fd %d, "
@@ -698,7 +847,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
                 return 1;
             }
 
-            conn->protocol_auth_state = MYSQL_AUTH_SENT;
+            mysql_protocol_set_state(conn, MYSQL_AUTH_SENT);
 
             // consume all the data here
             gwbuf_free(head);
@@ -736,6 +885,8 @@ gw_send_authentication_to_backend(char *dbname,
     uint8_t client_capabilities[4] = {0,0,0,0};
     GWBUF *buffer;
     uint8_t *curr_passwd = memcmp(passwd, null_client_sha1, MYSQL_SCRAMBLE_LEN) ? passwd : NULL;
+    bool compress = conn->owner_dcb->server->compression != SERVER_COMPRESSION_NONE &&
+        (conn->server_capabilities & GW_MYSQL_CAPABILITIES_COMPRESS);
 
     /**
      * If session is stopping return with error.
@@ -747,7 +898,23 @@ gw_send_authentication_to_backend(char *dbname,
         return MYSQL_AUTH_FAILED;
     }
 
-    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), false);
+    if (MYSQL_DEPRECATE_EOF(conn) &&
+        !(conn->server_capabilities & GW_MYSQL_CAPABILITIES_DEPRECATE_EOF))
+    {
+        MXS_ERROR("Server %s:%d does not support CLIENT_DEPRECATE_EOF which the "
+                  "client of the session has negotiated.",
+                  conn->owner_dcb->server->name, conn->owner_dcb->server->port);
+        return MYSQL_AUTH_FAILED;
+    }
+
+    /** The state changes in the OK packets are optional for the client, the
+     * capabilities of the connection tell the routers whether they are reported */
+    if ((conn->server_capabilities & GW_MYSQL_CAPABILITIES_SESSION_TRACK) == 0)
+    {
+        conn->client_capabilities &= ~GW_MYSQL_CAPABILITIES_SESSION_TRACK;
+    }
+
+    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), compress);
     gw_mysql_set_byte4(client_capabilities, capabilities);
 
     bytes = response_length(conn, user, passwd, dbname);
@@ -827,7 +994,12 @@ gw_send_authentication_to_backend(char *dbname,
     /* Following needed if payload is used again */
     /* payload += strlen("mysql_native_password"); */
 
-    return dcb_write(conn->owner_dcb, buffer) ? MYSQL_AUTH_RECV : MYSQL_AUTH_FAILED;
+    if (!dcb_write(conn->owner_dcb, buffer))
+    {
+        return MYSQL_AUTH_FAILED;
+    }
+
+    return MYSQL_AUTH_RECV;
 }
 
 /**
@@ -893,14 +1065,14 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             switch (receive_rc)
             {
                 case -1:
-                    backend_protocol->protocol_auth_state = MYSQL_AUTH_FAILED;
+                    mysql_protocol_set_state(backend_protocol, MYSQL_AUTH_FAILED);
                     MXS_ERROR("Backend server didn't "
                           "accept authentication for user "
                           "%s.",
                           local_session.user);
                     break;
                 case 1:
-                    backend_protocol->protocol_auth_state = MYSQL_IDLE;
+                    mysql_protocol_set_state(backend_protocol, MYSQL_IDLE);
                     MXS_DEBUG("%lu [gw_read_backend_event] "
                           "gw_receive_backend_auth succeed. "
                           "dcb %p fd %d, user %s.",
@@ -938,6 +1110,12 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             dcb->delayq = NULL;
             spinlock_release(&dcb->authlock);
 
+            if (session->client_dcb && DCB_IS_POOL_WARMUP(session->client_dcb))
+            {
+                server_pool_warmup_done(dcb, false);
+                return 1;
+            }
+
             /* Only reload the users table if authentication failed and the
              * client session is not stopping. It is possible that authentication
              * fails because the client has closed the connection before all
@@ -996,6 +1174,28 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
                   dcb->fd,
                   local_session.user);
 
+            if (backend_protocol->protocol_auth_state == MYSQL_IDLE)
+            {
+                server_connection_authenticated(dcb);
+
+                /** The packets after the OK of the authentication are compressed */
+                if (dcb->server->compression != SERVER_COMPRESSION_NONE &&
+                    (backend_protocol->server_capabilities & GW_MYSQL_CAPABILITIES_COMPRESS))
+                {
+                    backend_protocol->compressed = true;
+                    backend_protocol->compress_seq = 0;
+                    dcb->flags |= DCBF_COMPRESSED;
+                }
+
+                /** A warm-up connection has no client, it goes to the pool */
+                if (session->client_dcb && DCB_IS_POOL_WARMUP(session->client_dcb))
+                {
+                    spinlock_release(&dcb->authlock);
+                    server_pool_warmup_done(dcb, true);
+                    return 0;
+                }
+            }
+
             /* check the delay queue and flush the data */
             if (dcb->delayq)
             {
@@ -1026,7 +1226,7 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
         CHK_SESSION(session);
 
         /* read available backend data */
-        return_code = dcb_read(dcb, &read_buffer, 0);
+        return_code = gw_backend_read(dcb, &read_buffer);
 
         if (return_code < 0)
         {
@@ -1076,6 +1276,36 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             goto return_rc;
         }
 
+        bool sescmd = protocol_get_srv_command((MySQLProtocol *)dcb->protocol, false) != MYSQL_COM_UNDEFINED;
+        return_code = 0;
+
+        /**
+         * Routers that only need to see the data pass by get the reply as
+         * it was read, without splitting it at packet boundaries.
+         */
+        if (gw_reply_streamable(dcb, sescmd))
+        {
+            GWBUF *stream = gw_take_stream((MySQLProtocol *)dcb->protocol, &read_buffer, sescmd);
+
+            if (stream)
+            {
+                return_code = gw_route_reply(dcb, stream);
+            }
+
+            if (read_buffer == NULL)
+            {
+                goto return_rc;
+            }
+            else if (!sescmd)
+            {
+                /** Only an incomplete packet header is left */
+                spinlock_acquire(&dcb->authlock);
+                dcb->dcb_readqueue = read_buffer;
+                spinlock_release(&dcb->authlock);
+                goto return_rc;
+            }
+        }
+
         {
             GWBUF *tmp = modutil_get_complete_packets(&read_buffer);
             /* Put any residue into the read queue */
@@ -1085,7 +1315,6 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             if (tmp == NULL)
             {
                 /** No complete packets */
-                return_code = 0;
                 goto return_rc;
             }
             else
@@ -1098,7 +1327,7 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
          * If protocol has session command set, concatenate whole
          * response into one buffer.
          */
-        if (protocol_get_srv_command((MySQLProtocol *) dcb->protocol, false) != MYSQL_COM_UNDEFINED)
+        if (sescmd)
         {
             read_buffer = process_response_data(dcb, read_buffer, gwbuf_length(read_buffer));
             /**
@@ -1107,7 +1336,6 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
              */
             if (!sescmd_response_complete(dcb))
             {
-                return_code = 0;
                 goto return_rc;
             }
 
@@ -1118,56 +1346,163 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
                            "not marked as complete. User: %s",
                            pthread_self(),
                            local_session.user);
-                return_code = 0;
                 goto return_rc;
             }
         }
-        /**
-         * Check that session is operable, and that client DCB is
-         * still listening the socket for replies.
-         */
-        if (dcb->session->state == SESSION_STATE_ROUTER_READY &&
-            dcb->session->client_dcb != NULL &&
-            dcb->session->client_dcb->state == DCB_STATE_POLLING &&
-            (session->router_session ||
-            session->service->router->getCapabilities() & (int)RCAP_TYPE_NO_RSESSION))
+
+        if (gw_route_reply(dcb, read_buffer))
         {
-            MySQLProtocol *client_protocol = (MySQLProtocol *)dcb->session->client_dcb->protocol;
-            if (client_protocol != NULL)
-            {
-                CHK_PROTOCOL(client_protocol);
+            return_code = 1;
+        }
 
-                if (client_protocol->protocol_auth_state == MYSQL_IDLE)
-                {
-                    gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
-
-                    session->service->router->clientReply(
-                        session->service->router_instance,
-                                        session->router_session,
-                                        read_buffer,
-                                        dcb);
-                    return_code = 1;
-                }
-            }
-            else if (dcb->session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
+return_rc:
+    return return_code;
+}
+
+/**
+ * Pass a reply to the router of the session, if the session and its client
+ * can still take it.
+ *
+ * @param dcb           The backend DCB
+ * @param read_buffer   The reply, freed if it can not be routed
+ * @return 1 if the reply was routed, 0 if not
+ */
+static int
+gw_route_reply(DCB *dcb, GWBUF *read_buffer)
+{
+    SESSION *session = dcb->session;
+    int return_code = 0;
+
+    /**
+     * Check that session is operable, and that client DCB is
+     * still listening the socket for replies.
+     */
+    if (dcb->session->state == SESSION_STATE_ROUTER_READY &&
+        dcb->session->client_dcb != NULL &&
+        dcb->session->client_dcb->state == DCB_STATE_POLLING &&
+        (session->router_session ||
+        session->service->router->getCapabilities() & (int)RCAP_TYPE_NO_RSESSION))
+    {
+        MySQLProtocol *client_protocol = (MySQLProtocol *)dcb->session->client_dcb->protocol;
+        if (client_protocol != NULL)
+        {
+            CHK_PROTOCOL(client_protocol);
+
+            if (client_protocol->protocol_auth_state == MYSQL_IDLE)
             {
                 gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+
                 session->service->router->clientReply(
                     session->service->router_instance,
-                    session->router_session,
-                    read_buffer, dcb);
+                                    session->router_session,
+                                    read_buffer,
+                                    dcb);
                 return_code = 1;
             }
         }
-        else /*< session is closing; replying to client isn't possible */
+        else if (dcb->session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
         {
-            gwbuf_free(read_buffer);
+            gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+            session->service->router->clientReply(
+                session->service->router_instance,
+                session->router_session,
+                read_buffer, dcb);
+            return_code = 1;
         }
+    }
+    else /*< session is closing; replying to client isn't possible */
+    {
+        gwbuf_free(read_buffer);
+    }
 
-return_rc:
     return return_code;
 }
 
+/**
+ * Check whether a reply can be forwarded as it was read. The router must
+ * allow it and the filters, which may look into the packets, must not be
+ * in use. Replies to session commands are always split into packets, but
+ * a packet that was already partly forwarded is finished first.
+ *
+ * @param dcb       The backend DCB
+ * @param sescmd    Whether a session command is waiting for its reply
+ * @return True if the reply can be forwarded as it was read
+ */
+static bool
+gw_reply_streamable(DCB *dcb, bool sescmd)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    SERVICE *service = dcb->session->service;
+
+    return proto->stream_left > 0 ||
+        (!sescmd && service->n_filters == 0 &&
+         (service->router->getCapabilities() & (int)RCAP_TYPE_RESULT_STREAM));
+}
+
+/**
+ * Take the part of a reply that can be forwarded as it was read. This is
+ * everything but a packet header that is not complete yet, or, if a
+ * session command is waiting for its reply, the rest of the packet that
+ * was partly forwarded. Only the packet headers are looked at, and the
+ * position of the next one is kept in the protocol between the reads.
+ *
+ * @param proto         The backend protocol
+ * @param read_buffer   The data that was read, the rest is left here
+ * @param sescmd        Whether a session command is waiting for its reply
+ * @return The data to forward, NULL if there is none
+ */
+static GWBUF *
+gw_take_stream(MySQLProtocol *proto, GWBUF **read_buffer, bool sescmd)
+{
+    size_t offset = proto->stream_left;
+    size_t base = 0;
+    bool incomplete = false;
+    size_t len;
+
+    for (GWBUF *buf = *read_buffer; buf; buf = buf->next)
+    {
+        size_t buflen = GWBUF_LENGTH(buf);
+
+        while (offset < base + buflen && !sescmd && !incomplete)
+        {
+            uint8_t header[3];
+
+            /** A header at the end of the data may continue in the next read */
+            if (gwbuf_copy_data(buf, offset - base, sizeof(header), header) != sizeof(header))
+            {
+                incomplete = true;
+            }
+            else
+            {
+                offset += MYSQL_HEADER_LEN + gw_mysql_get_byte3(header);
+            }
+        }
+        base += buflen;
+    }
+
+    if (offset >= base)
+    {
+        /** Everything can be forwarded */
+        proto->stream_left = offset - base;
+        len = base;
+    }
+    else
+    {
+        /** The next packet header is not complete or not to be streamed */
+        proto->stream_left = 0;
+        len = offset;
+    }
+
+    if (len == base)
+    {
+        GWBUF *rval = *read_buffer;
+        *read_buffer = NULL;
+        return rval;
+    }
+
+    return len > 0 ? gwbuf_split(read_buffer, len) : NULL;
+}
+
 /*
  * EPOLLOUT handler for the MySQL Backend protocol module.
  *
@@ -1231,7 +1566,7 @@ static int gw_write_backend_event(DCB *dcb)
 
     if (backend_protocol->protocol_auth_state == MYSQL_PENDING_CONNECT)
     {
-        backend_protocol->protocol_auth_state = MYSQL_CONNECTED;
+        mysql_protocol_set_state(backend_protocol, MYSQL_CONNECTED);
         rc = 1;
         goto return_rc;
     }
@@ -1318,7 +1653,7 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                 protocol_add_srv_command(backend_protocol, cmd);
             }
             /** Write to backend */
-            rc = dcb_write(dcb, queue);
+            rc = gw_backend_write(dcb, queue);
         }
         break;
 
@@ -1381,6 +1716,11 @@ static int gw_error_backend_event(DCB *dcb)
         dcb_close(dcb);
         return 1;
     }
+    if (session->client_dcb && DCB_IS_POOL_WARMUP(session->client_dcb))
+    {
+        server_pool_warmup_done(dcb, false);
+        return 1;
+    }
     rsession = session->router_session;
     router = session->service->router;
     router_instance = session->service->router_instance;
@@ -1509,6 +1849,12 @@ static int gw_backend_hangup(DCB *dcb)
 
     CHK_SESSION(session);
 
+    if (session->client_dcb && DCB_IS_POOL_WARMUP(session->client_dcb))
+    {
+        server_pool_warmup_done(dcb, false);
+        goto retblock;
+    }
+
     rsession = session->router_session;
     router = session->service->router;
     router_instance = session->service->router_instance;
@@ -1699,7 +2045,7 @@ static int backend_write_delayqueue(DCB *dcb)
             localq = gwbuf_consume(localq, GWBUF_LENGTH(localq));
             localq = gwbuf_append(localq, new_packet);
         }
-        rc = dcb_write(dcb, localq);
+        rc = gw_backend_write(dcb, localq);
     }
 
     if (rc == 0)
@@ -1990,7 +2336,8 @@ static GWBUF* process_response_data(DCB* dcb,
                  * packet content. Fails if read buffer doesn't include
                  * enough data to read the packet length.
                  */
-                init_response_status(readbuf, srvcmd, &npackets_left, &nbytes_left);
+                init_response_status(readbuf, srvcmd, MYSQL_DEPRECATE_EOF(p),
+                                     &npackets_left, &nbytes_left);
             }
 
             initial_packets = npackets_left;
@@ -2186,6 +2533,14 @@ gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload)
 
     // get capabilities part 2 (2 bytes)
     memcpy(&capab_ptr[2], &mysql_server_capabilities_two, 2);
+    conn->server_capabilities = mysql_server_capabilities_one |
+        ((uint32_t)mysql_server_capabilities_two << 16);
+
+    /** The client handshake offers CLIENT_DEPRECATE_EOF only if all servers have it */
+    if (conn->owner_dcb && conn->owner_dcb->server)
+    {
+        conn->owner_dcb->server->capabilities = conn->server_capabilities;
+    }
 
     // 2 bytes shift
     payload += 2;
@@ -2239,7 +2594,7 @@ gw_receive_backend_auth(MySQLProtocol *protocol)
     uint8_t *ptr = NULL;
     int rc = 0;
 
-    n = dcb_read(dcb, &head, 0);
+    n = gw_backend_read(dcb, &head);
 
     dcb->last_read = hkheartbeat;
 
@@ -2346,13 +2701,13 @@ gw_receive_backend_auth(MySQLProtocol *protocol)
  * We start by taking the default bitmask and removing any bits not set in
  * the bitmask contained in the connection structure. Then add SSL flag if
  * the connection requires SSL (set from the MaxScale configuration). The
- * compression flag may be set, although compression is NOT SUPPORTED. If a
- * database name has been specified in the function call, the relevant flag
- * is set.
+ * compression flag is set if the server is configured to use compression
+ * and supports it. If a database name has been specified in the function
+ * call, the relevant flag is set.
  *
  * @param conn  The MySQLProtocol structure for the connection
  * @param db_specified Whether the connection request specified a database
- * @param compress Whether compression is requested - NOT SUPPORTED
+ * @param compress Whether compression is requested
  * @return Bit mask (32 bits)
  * @note Capability bits are defined in mysql_client_server_protocol.h
  */
@@ -2364,6 +2719,11 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
     /** Copy client's flags to backend but with the known capabilities mask */
     final_capabilities = (conn->client_capabilities & (uint32_t)GW_MYSQL_CAPABILITIES_CLIENT);
 
+    /** The replies are passed to the client as they are, so the result sets
+     * must have the format the client negotiated */
+    final_capabilities |= conn->client_capabilities & GW_MYSQL_CAPABILITIES_DEPRECATE_EOF;
+    final_capabilities |= conn->client_capabilities & GW_MYSQL_CAPABILITIES_SESSION_TRACK;
+
     if (conn->owner_dcb->server->server_ssl)
     {
         final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_SSL;
@@ -2372,7 +2732,6 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
         /* final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT; */
     }
 
-    /* Compression is not currently supported */
     if (compress)
     {
         final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_COMPRESS;
@@ -2677,6 +3036,82 @@ gw_create_change_user_packet(MYSQL_session*  mses,
     return buffer;
 }
 
+/**
+ * Switch a connection from the persistent pool to the user of a new session.
+ * COM_CHANGE_USER authenticates the connection as the user and resets its
+ * state, which is cheaper than a new connection. The reply is read like the
+ * reply to the authentication of a new connection, so the writes of the
+ * session wait in the delay queue until it has arrived and a rejection goes
+ * to the error handler of the router.
+ *
+ * @param dcb       The backend DCB taken from the pool
+ * @param session   The session the DCB has been linked to
+ * @return 1 on success, 0 if the switch could not be started
+ */
+static int
+gw_reuse_backend(DCB *dcb, SESSION *session)
+{
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+    MYSQL_session mses;
+    GWBUF *buffer;
+    int rc = 0;
+
+    CHK_PROTOCOL(protocol);
+
+    if (!gw_get_shared_session_auth_info(dcb, &mses))
+    {
+        return 0;
+    }
+
+    /** The character set is sent again, the capabilities are fixed by the handshake */
+    if (session->client_dcb->protocol)
+    {
+        protocol->charset = ((MySQLProtocol *)session->client_dcb->protocol)->charset;
+    }
+    buffer = gw_create_change_user_packet(&mses, protocol);
+    /** Not a session command, the reply is not routed */
+    buffer->gwbuf_type = GWBUF_TYPE_MYSQL;
+
+    spinlock_acquire(&dcb->authlock);
+    if (protocol->protocol_auth_state == MYSQL_IDLE)
+    {
+        mysql_protocol_set_state(protocol, MYSQL_AUTH_RECV);
+        if ((rc = gw_backend_write(dcb, buffer)) == 0)
+        {
+            mysql_protocol_set_state(protocol, MYSQL_AUTH_FAILED);
+        }
+    }
+    else
+    {
+        gwbuf_free(buffer);
+    }
+    spinlock_release(&dcb->authlock);
+
+    return rc;
+}
+
+/**
+ * Check whether a connection from the persistent pool can be used by a session.
+ * The format of the result sets is fixed by the handshake so the connection
+ * must have negotiated CLIENT_DEPRECATE_EOF exactly when the client has. A
+ * connection that reports session state changes can only be used by a client
+ * that has negotiated CLIENT_SESSION_TRACK.
+ *
+ * @param dcb       The backend DCB taken from the pool
+ * @param session   The session the DCB has been linked to
+ * @return 1 if the connection can be used, 0 if not
+ */
+static int
+gw_backend_reusable(DCB *dcb, SESSION *session)
+{
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+    MySQLProtocol *client = (MySQLProtocol *)session->client_dcb->protocol;
+    uint32_t client_caps = client ? client->client_capabilities : 0;
+
+    return ((protocol->client_capabilities ^ client_caps) & GW_MYSQL_CAPABILITIES_DEPRECATE_EOF) == 0 &&
+           ((protocol->client_capabilities & ~client_caps) & GW_MYSQL_CAPABILITIES_SESSION_TRACK) == 0;
+}
+
 /**
  * Write a MySQL CHANGE_USER packet to backend server
  *
@@ -2706,3 +3141,152 @@ gw_send_change_user_to_backend(char          *dbname,
     }
     return rc;
 }
+
+/**
+ * Get the CPU time used by the calling thread
+ *
+ * @return The CPU time in microseconds
+ */
+static uint64_t
+gw_thread_cpu_usecs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Read from a backend. If the compressed protocol is in use, the data is
+ * decompressed and only complete compressed packets are returned; the rest
+ * is kept in the protocol until more data arrives.
+ *
+ * @param dcb   The backend DCB
+ * @param head  Where the data is appended
+ * @return The number of bytes in head, or -1 on error
+ */
+static int
+gw_backend_read(DCB *dcb, GWBUF **head)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    GWBUF *readq;
+    GWBUF *raw = NULL;
+    bool error = false;
+    int n;
+
+    if (!proto->compressed)
+    {
+        return dcb_read(dcb, head, 0);
+    }
+
+    /** The read queue holds decompressed data that dcb_read must not see */
+    spinlock_acquire(&dcb->authlock);
+    readq = dcb->dcb_readqueue;
+    dcb->dcb_readqueue = NULL;
+    spinlock_release(&dcb->authlock);
+
+    n = dcb_read(dcb, &raw, 0);
+
+    if (n > 0)
+    {
+        readq = gwbuf_append(readq, gw_decompress_packets(dcb, raw, &error));
+    }
+    else
+    {
+        gwbuf_free(raw);
+    }
+
+    *head = gwbuf_append(*head, readq);
+
+    if (n < 0 || error)
+    {
+        return -1;
+    }
+
+    return gwbuf_length(*head);
+}
+
+/**
+ * Write to a backend, compressing the data if the compressed protocol is
+ * in use.
+ *
+ * @param dcb   The backend DCB
+ * @param queue The MySQL packets to write
+ * @return The return value of dcb_write, 0 on failure
+ */
+static int
+gw_backend_write(DCB *dcb, GWBUF *queue)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (proto->compressed && queue)
+    {
+        if ((queue = gw_compress_packets(dcb, queue)) == NULL)
+        {
+            return 0;
+        }
+    }
+
+    return dcb_write(dcb, queue);
+}
+
+/**
+ * Compress MySQL packets for a backend and count them in the statistics of
+ * the server.
+ *
+ * @param dcb   The backend DCB
+ * @param queue The MySQL packets, freed by this function
+ * @return The compressed packets, or NULL on error
+ */
+static GWBUF *
+gw_compress_packets(DCB *dcb, GWBUF *queue)
+{
+    uint64_t start = gw_thread_cpu_usecs();
+    size_t total = gwbuf_length(queue);
+    GWBUF *rval = mysql_compress_packets((MySQLProtocol *)dcb->protocol, queue,
+                                         dcb->server->compression_level,
+                                         MYSQL_COMPRESS_MIN_LEN);
+
+    if (rval)
+    {
+        server_add_compression_stats(dcb->server, true, gwbuf_length(rval), total,
+                                     gw_thread_cpu_usecs() - start);
+    }
+    else
+    {
+        MXS_ERROR("Failed to compress %lu bytes for server %s.",
+                  total, dcb->server->unique_name);
+    }
+
+    return rval;
+}
+
+/**
+ * Decompress the data read from a backend and count it in the statistics of
+ * the server.
+ *
+ * @param dcb   The backend DCB
+ * @param raw   The data that was read, freed by this function
+ * @param error Set to true if a packet could not be decompressed
+ * @return The decompressed MySQL packets, NULL if no packet was complete
+ */
+static GWBUF *
+gw_decompress_packets(DCB *dcb, GWBUF *raw, bool *error)
+{
+    uint64_t start = gw_thread_cpu_usecs();
+    uint64_t nread = 0;
+    GWBUF *rval = mysql_decompress_packets((MySQLProtocol *)dcb->protocol, raw, &nread, error);
+
+    if (*error)
+    {
+        MXS_ERROR("Failed to decompress the data from server %s.", dcb->server->unique_name);
+    }
+
+    if (nread)
+    {
+        server_add_compression_stats(dcb->server, false, nread, gwbuf_length(rval),
+                                     gw_thread_cpu_usecs() - start);
+    }
+
+    return rval;
+}
@@ -56,7 +56,9 @@
 #include <modinfo.h>
 #include <sys/stat.h>
 #include <modutil.h>
+#include <qc_pool.h>
 #include <netinet/tcp.h>
+#include <mysql_wire.h>
 
 #include "gw_authenticator.h"
 
@@ -87,13 +89,17 @@ static char *gw_default_auth();
 static int gw_connection_limit(DCB *dcb, int limit);
 static int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char* mysql_message);
 static int MySQLSendHandshake(DCB* dcb);
-static int route_by_statement(SESSION *, GWBUF **);
+static int route_by_statement(SESSION *, GWBUF **, bool);
+static bool stream_input_allowed(SESSION *session, uint8_t capabilities);
+static GWBUF *take_stream_input(MySQLProtocol *proto, GWBUF **read_buffer);
 static void mysql_client_auth_error_handling(DCB *dcb, int auth_val);
 static int gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
 static int gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
 static int gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities);
 extern char* create_auth_fail_str(char *username, char *hostaddr, char *sha1, char *db,int);
-static bool ensure_complete_packet(DCB *dcb, GWBUF **read_buffer, int nbytes_read);
+static bool gw_read_classified_query(DCB *dcb);
+static bool classify_in_pool(DCB *dcb, GWBUF *query);
+static int gw_client_read(DCB *dcb, GWBUF **head, int maxbytes);
 
 /*
  * The "module object" for the mysqld client protocol module.
@@ -174,77 +180,61 @@ static char *gw_default_auth()
  */
 int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char* mysql_message)
 {
-    uint8_t *outbuf = NULL;
-    uint32_t mysql_payload_size = 0;
-    uint8_t mysql_packet_header[4];
-    uint8_t *mysql_payload = NULL;
-    uint8_t field_count = 0;
-    uint8_t affected_rows = 0;
-    uint8_t insert_id = 0;
-    uint8_t mysql_server_status[2];
-    uint8_t mysql_warning_counter[2];
-    GWBUF *buf;
-
-    affected_rows = in_affected_rows;
+    GWBUF *buf = mxs_wire_create_ok(packet_number, in_affected_rows, 0, mysql_message);
 
-    mysql_payload_size =
-        sizeof(field_count) +
-        sizeof(affected_rows) +
-        sizeof(insert_id) +
-        sizeof(mysql_server_status) +
-        sizeof(mysql_warning_counter);
-
-    if (mysql_message != NULL)
-    {
-        mysql_payload_size += strlen(mysql_message);
-    }
-
-    // allocate memory for packet header + payload
-    if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
+    if (buf == NULL)
     {
         return 0;
     }
-    outbuf = GWBUF_DATA(buf);
-
-    // write packet header with packet number
-    gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-    mysql_packet_header[3] = packet_number;
-
-    // write header
-    memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
 
-    mysql_payload = outbuf + sizeof(mysql_packet_header);
+    int len = GWBUF_LENGTH(buf);
 
-    mysql_server_status[0] = 2;
-    mysql_server_status[1] = 0;
-    mysql_warning_counter[0] = 0;
-    mysql_warning_counter[1] = 0;
-
-    // write data
-    memcpy(mysql_payload, &field_count, sizeof(field_count));
-    mysql_payload = mysql_payload + sizeof(field_count);
-
-    memcpy(mysql_payload, &affected_rows, sizeof(affected_rows));
-    mysql_payload = mysql_payload + sizeof(affected_rows);
-
-    memcpy(mysql_payload, &insert_id, sizeof(insert_id));
-    mysql_payload = mysql_payload + sizeof(insert_id);
+    // writing data in the Client buffer queue
+    dcb->func.write(dcb, buf);
 
-    memcpy(mysql_payload, mysql_server_status, sizeof(mysql_server_status));
-    mysql_payload = mysql_payload + sizeof(mysql_server_status);
+    return len;
+}
 
-    memcpy(mysql_payload, mysql_warning_counter, sizeof(mysql_warning_counter));
-    mysql_payload = mysql_payload + sizeof(mysql_warning_counter);
+/**
+ * Check whether every server of a service has advertised a capability. The
+ * replies of the servers are passed to the clients so a capability that
+ * changes the format of the replies can only be offered to the clients if
+ * all servers support it.
+ *
+ * @param service       The service of the client
+ * @param capability    The capability
+ * @return True if the capability can be advertised
+ */
+static bool servers_support(SERVICE *service, uint32_t capability)
+{
+    if (service->dbref == NULL)
+    {
+        return false;
+    }
 
-    if (mysql_message != NULL)
+    for (SERVER_REF *ref = service->dbref; ref; ref = ref->next)
     {
-        memcpy(mysql_payload, mysql_message, strlen(mysql_message));
+        if ((ref->server->capabilities & capability) == 0)
+        {
+            return false;
+        }
     }
 
-    // writing data in the Client buffer queue
-    dcb->func.write(dcb, buf);
+    return true;
+}
 
-    return sizeof(mysql_packet_header) + mysql_payload_size;
+/**
+ * Check whether the clients of a service can be offered CLIENT_DEPRECATE_EOF.
+ * The router reads the result sets so it must support it as well.
+ *
+ * @param service The service of the client
+ * @return True if CLIENT_DEPRECATE_EOF can be advertised
+ */
+static bool deprecate_eof_supported(SERVICE *service)
+{
+    return service->router &&
+           (service->router->getCapabilities() & RCAP_TYPE_DEPRECATE_EOF) &&
+           servers_support(service, GW_MYSQL_CAPABILITIES_DEPRECATE_EOF);
 }
 
 /**
@@ -360,8 +350,10 @@ int MySQLSendHandshake(DCB* dcb)
     mysql_server_capabilities_one[0] = GW_MYSQL_SERVER_CAPABILITIES_BYTE1;
     mysql_server_capabilities_one[1] = GW_MYSQL_SERVER_CAPABILITIES_BYTE2;
 
-
-    mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    if (!dcb->service->client_compression)
+    {
+        mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    }
 
     if (ssl_required_by_dcb(dcb))
     {
@@ -385,6 +377,21 @@ int MySQLSendHandshake(DCB* dcb)
     mysql_server_capabilities_two[0] = 15;
     mysql_server_capabilities_two[1] = 128;
 
+    if (deprecate_eof_supported(dcb->service))
+    {
+        mysql_server_capabilities_two[1] |= (int)GW_MYSQL_CAPABILITIES_DEPRECATE_EOF >> 24;
+    }
+
+    /** The OK packets report the session state changes only if asked */
+    if (servers_support(dcb->service, GW_MYSQL_CAPABILITIES_SESSION_TRACK))
+    {
+        mysql_server_capabilities_two[0] |= (int)GW_MYSQL_CAPABILITIES_SESSION_TRACK >> 16;
+    }
+
+    /** The capabilities the client may use are checked against these */
+    protocol->server_capabilities = gw_mysql_get_byte2(mysql_server_capabilities_one) |
+        ((uint32_t)gw_mysql_get_byte2(mysql_server_capabilities_two) << 16);
+
     memcpy(mysql_handshake_payload, mysql_server_capabilities_two, sizeof(mysql_server_capabilities_two));
     mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_two);
 
@@ -425,9 +432,77 @@ int MySQLSendHandshake(DCB* dcb)
  */
 int gw_MySQLWrite_client(DCB *dcb, GWBUF *queue)
 {
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (proto->compressed && queue)
+    {
+        size_t len = gwbuf_length(queue);
+
+        if ((queue = mysql_compress_packets(proto, queue, dcb->service->client_compression_level,
+                                            dcb->service->client_compression_min_len)) == NULL)
+        {
+            MXS_ERROR("Failed to compress %lu bytes for client %s@%s.",
+                      len, dcb->user, dcb->remote);
+            return 0;
+        }
+    }
+
     return dcb_write(dcb, queue);
 }
 
+/**
+ * Read from a client. If the compressed protocol is in use, the data is
+ * decompressed and only complete compressed packets are returned; the rest
+ * is kept in the protocol until more data arrives.
+ *
+ * @param dcb       The client DCB
+ * @param head      Where the data is appended
+ * @param maxbytes  Maximum bytes to read, 0 for no limit
+ * @return The return value of dcb_read, -1 on error
+ */
+static int
+gw_client_read(DCB *dcb, GWBUF **head, int maxbytes)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    GWBUF *readq;
+    GWBUF *raw = NULL;
+    uint64_t nread = 0;
+    bool error = false;
+    int n;
+
+    if (!proto->compressed)
+    {
+        return dcb_read(dcb, head, maxbytes);
+    }
+
+    /** The read queue holds decompressed data that dcb_read must not see */
+    spinlock_acquire(&dcb->authlock);
+    readq = dcb->dcb_readqueue;
+    dcb->dcb_readqueue = NULL;
+    spinlock_release(&dcb->authlock);
+
+    n = dcb_read(dcb, &raw, maxbytes);
+
+    if (n > 0)
+    {
+        readq = gwbuf_append(readq, mysql_decompress_packets(proto, raw, &nread, &error));
+    }
+    else
+    {
+        gwbuf_free(raw);
+    }
+
+    *head = gwbuf_append(*head, readq);
+
+    if (error)
+    {
+        MXS_ERROR("Failed to decompress the data from client %s@%s.", dcb->user, dcb->remote);
+        return -1;
+    }
+
+    return n;
+}
+
 /**
  * @brief Client read event triggered by EPOLLIN
  *
@@ -458,6 +533,11 @@ int gw_read_client_event(DCB* dcb)
 
 #endif
 
+    if (protocol->protocol_auth_state == MYSQL_IDLE && !gw_read_classified_query(dcb))
+    {
+        return 0;
+    }
+
     /**
      * The use of max_bytes seems like a hack, but no better option is available
      * at the time of writing. When a MySQL server receives a new connection
@@ -480,7 +560,7 @@ int gw_read_client_event(DCB* dcb)
     {
         max_bytes = 36;
     }
-    return_code = dcb_read(dcb, &read_buffer, max_bytes);
+    return_code = gw_client_read(dcb, &read_buffer, max_bytes);
     if (return_code < 0)
     {
         dcb_close(dcb);
@@ -560,7 +640,6 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     int auth_val;
 
     protocol = (MySQLProtocol *)dcb->protocol;
-    /* int compress = -1; */
 
     /**
      * The first step in the authentication process is to extract the
@@ -574,12 +653,11 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     if (MYSQL_AUTH_SUCCEEDED == (
         auth_val = dcb->authfunc.extract(dcb, read_buffer)))
     {
-        /*
-         * Maybe this comment will be useful some day:
-          compress =
-          GW_MYSQL_CAPABILITIES_COMPRESS & gw_mysql_get_byte4(
-          &protocol->client_capabilities);
-        */
+        /** The client can only use the capabilities that change the replies if offered */
+        protocol->client_capabilities &= ~(GW_MYSQL_CAPABILITIES_DEPRECATE_EOF |
+                                           GW_MYSQL_CAPABILITIES_SESSION_TRACK) |
+            protocol->server_capabilities;
+
         auth_val = dcb->authfunc.authenticate(dcb);
     }
 
@@ -595,7 +673,7 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     {
         SESSION *session;
 
-        protocol->protocol_auth_state = MYSQL_AUTH_RECV;
+        mysql_protocol_set_state(protocol, MYSQL_AUTH_RECV);
         /**
          * Create session, and a router session for it.
          * If successful, there will be backend connection(s)
@@ -613,12 +691,21 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
             ss_dassert(session->state != SESSION_STATE_ALLOC &&
                 session->state != SESSION_STATE_DUMMY);
 
-            protocol->protocol_auth_state = MYSQL_IDLE;
+            mysql_protocol_set_state(protocol, MYSQL_IDLE);
             /**
              * Send an AUTH_OK packet to the client,
              * packet sequence is # packet_number
              */
             mysql_send_ok(dcb, packet_number, 0, NULL);
+
+            /** The packets after the OK of the authentication are compressed */
+            if (protocol->client_capabilities & protocol->server_capabilities &
+                GW_MYSQL_CAPABILITIES_COMPRESS)
+            {
+                protocol->compressed = true;
+                protocol->compress_seq = 0;
+                dcb->flags |= DCBF_COMPRESSED;
+            }
         }
         else
         {
@@ -631,7 +718,7 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
      */
     if (MYSQL_AUTH_SUCCEEDED != auth_val && MYSQL_AUTH_SSL_INCOMPLETE != auth_val)
     {
-        protocol->protocol_auth_state = MYSQL_AUTH_FAILED;
+        mysql_protocol_set_state(protocol, MYSQL_AUTH_FAILED);
         mysql_client_auth_error_handling(dcb, auth_val);
         /**
          * Close DCB and which will release MYSQL_session
@@ -711,6 +798,7 @@ static bool process_client_commands(DCB* dcb, int bytes_available, GWBUF** buffe
         if (protocol_is_idle(dcb))
         {
             int pktlen;
+            uint8_t seq;
             uint8_t cmd = (uint8_t)MYSQL_COM_QUERY; // Treat empty packets as COM_QUERY
 
             /**
@@ -721,6 +809,7 @@ static bool process_client_commands(DCB* dcb, int bytes_available, GWBUF** buffe
             {
                 uint8_t *data = (uint8_t*)GWBUF_DATA(queue);
                 pktlen = gw_mysql_get_byte3(data);
+                seq = data[3];
                 if (pktlen)
                 {
                     cmd = *(data + MYSQL_HEADER_LEN);
@@ -742,6 +831,7 @@ static bool process_client_commands(DCB* dcb, int bytes_available, GWBUF** buffe
                 }
 
                 pktlen = gw_mysql_get_byte3(packet_header);
+                seq = packet_header[3];
 
                 /**
                  * Check if the packet is empty, and if not, if we have the command byte.
@@ -760,8 +850,13 @@ static bool process_client_commands(DCB* dcb, int bytes_available, GWBUF** buffe
                 }
             }
 
+            /** Packets that continue a command, e.g. LOAD DATA LOCAL INFILE
+             * data, start with a sequence number other than zero */
             MySQLProtocol *proto = (MySQLProtocol*)dcb->protocol;
-            proto->current_command = cmd;
+            if (seq == 0)
+            {
+                proto->current_command = cmd;
+            }
             dcb->protocol_packet_length = pktlen + MYSQL_HEADER_LEN;
             dcb->protocol_bytes_processed = 0;
         }
@@ -832,15 +927,54 @@ gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
      * we need to make sure that a complete SQL packet is read before continuing */
     if (capabilities & (int)RCAP_TYPE_STMT_INPUT)
     {
-        uint8_t* data;
-        int packet_size;
+        MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+        uint8_t header[MYSQL_HEADER_LEN];
+
+        /**
+         * The received part of an incomplete packet is kept in the protocol
+         * with its length instead of the read queue. A large packet read in
+         * small pieces is then not measured again on each read and the bytes
+         * are not counted twice by process_client_commands.
+         */
+        if (proto->stmt_readq)
+        {
+            read_buffer = gwbuf_append(proto->stmt_readq, read_buffer);
+            nbytes_read += proto->stmt_readq_len;
+            proto->stmt_readq = NULL;
+            proto->stmt_readq_len = 0;
+        }
 
-        if (nbytes_read < 3 || nbytes_read <
-            (MYSQL_GET_PACKET_LEN((uint8_t *) GWBUF_DATA(read_buffer)) + 4))
+        if (stream_input_allowed(session, capabilities))
         {
-            spinlock_acquire(&dcb->authlock);
-            dcb->dcb_readqueue = read_buffer;
-            spinlock_release(&dcb->authlock);
+            GWBUF *stream = take_stream_input(proto, &read_buffer);
+
+            if (stream)
+            {
+                nbytes_read -= gwbuf_length(stream);
+                gwbuf_set_type(stream, GWBUF_TYPE_MYSQL);
+                gwbuf_set_type(stream, GWBUF_TYPE_STREAM);
+
+                if (!SESSION_ROUTE_QUERY(session, stream))
+                {
+                    MXS_ERROR("Routing the data of a command sent by %s@%s failed. "
+                              "Closing the client connection.", dcb->user, dcb->remote);
+                    gwbuf_free(read_buffer);
+                    dcb_close(dcb);
+                    return 1;
+                }
+            }
+
+            if (read_buffer == NULL)
+            {
+                return 0;
+            }
+        }
+
+        if (gwbuf_copy_data(read_buffer, 0, MYSQL_HEADER_LEN, header) != MYSQL_HEADER_LEN ||
+            nbytes_read < (int)gw_mysql_get_byte3(header) + MYSQL_HEADER_LEN)
+        {
+            proto->stmt_readq = read_buffer;
+            proto->stmt_readq_len = nbytes_read;
             return 0;
         }
         gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
@@ -895,15 +1029,26 @@ gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities)
              * to router. The routing functions return 1 for
              * success or 0 for failure.
              */
-            return_code = route_by_statement(session, &read_buffer) ? 0 : 1;
+            return_code = route_by_statement(session, &read_buffer,
+                                             stream_input_allowed(session, capabilities)) ? 0 : 1;
 
             if (read_buffer != NULL)
             {
                 /* Must have been data left over */
-                /* Add incomplete mysql packet to read queue */
-                spinlock_acquire(&dcb->authlock);
-                dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, read_buffer);
-                spinlock_release(&dcb->authlock);
+                if (protocol_is_idle(dcb))
+                {
+                    /** The commands after a query taken by the classifier
+                     * pool are processed again from their beginning */
+                    spinlock_acquire(&dcb->authlock);
+                    dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, read_buffer);
+                    spinlock_release(&dcb->authlock);
+                }
+                else
+                {
+                    /** Keep the incomplete packet until the rest arrives */
+                    proto->stmt_readq = read_buffer;
+                    proto->stmt_readq_len = gwbuf_length(read_buffer);
+                }
             }
         }
         else if (NULL != session->router_session || (capabilities & (int)RCAP_TYPE_NO_RSESSION))
@@ -1172,7 +1317,7 @@ int gw_MySQLAccept(DCB *listener)
         MySQLSendHandshake(client_dcb);
 
         // client protocol state change
-        protocol->protocol_auth_state = MYSQL_AUTH_SENT;
+        mysql_protocol_set_state(protocol, MYSQL_AUTH_SENT);
 
         /**
          * Set new descriptor to event set. At the same time,
@@ -1263,6 +1408,16 @@ gw_client_close(DCB *dcb)
 #endif
     MXS_DEBUG("%lu [gw_client_close]", pthread_self());
     mysql_protocol_done(dcb);
+
+    if (!DCB_IS_CLONE(dcb))
+    {
+        MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+        spinlock_acquire(&dcb->authlock);
+        gwbuf_free(proto->classified_query);
+        proto->classified_query = NULL;
+        spinlock_release(&dcb->authlock);
+    }
     session = dcb->session;
     /**
      * session may be NULL if session_alloc failed.
@@ -1340,10 +1495,12 @@ retblock:
  *
  * @param session       Session pointer
  * @param p_readbuf     Pointer to the address of GWBUF including the query
+ * @param stream        Whether the packets that continue a command are marked
+ *                      with GWBUF_TYPE_STREAM
  *
  * @return 1 if succeed,
  */
-static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
+static int route_by_statement(SESSION* session, GWBUF** p_readbuf, bool stream)
 {
     int rc;
     GWBUF* packetbuf;
@@ -1384,6 +1541,19 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
              * sure it is set to each (MySQL) packet.
              */
             gwbuf_set_type(packetbuf, GWBUF_TYPE_SINGLE_STMT);
+
+            uint8_t *data = GWBUF_DATA(packetbuf);
+
+            if (stream && MYSQL_GET_PACKET_NO(data) != 0)
+            {
+                gwbuf_set_type(packetbuf, GWBUF_TYPE_STREAM);
+            }
+            else if (qc_pool_wants(packetbuf) && classify_in_pool(session->client_dcb, packetbuf))
+            {
+                /** The rest is routed once the query has been parsed */
+                rc = 1;
+                goto return_rc;
+            }
             /** Route query */
             rc = SESSION_ROUTE_QUERY(session, packetbuf);
         }
@@ -1400,48 +1570,165 @@ return_rc:
 }
 
 /**
- * if read queue existed appent read to it. if length of read buffer is less
- * than 3 or less than mysql packet then return.  else copy mysql packets to
- * separate buffers from read buffer and continue. else if read queue didn't
- * exist, length of read is less than 3 or less than mysql packet then
- * create read queue and append to it and return. if length read is less than
- * mysql packet length append to read queue append to it and return.
- * else (complete packet was read) continue.
+ * Check whether the packets that continue a command can be routed in parts.
+ * The router must allow it and the filters, which may look into the packets,
+ * must not be in use.
+ *
+ * @param session       The client session
+ * @param capabilities  The router capabilities flags
+ * @return True if the data can be routed as it is read
+ */
+static bool stream_input_allowed(SESSION *session, uint8_t capabilities)
+{
+    return (capabilities & (int)RCAP_TYPE_STREAM_INPUT) && session->service->n_filters == 0;
+}
+
+/**
+ * Take the data that continues the command the router received last. These
+ * are the packets whose sequence number is not zero, e.g. the data of LOAD
+ * DATA LOCAL INFILE and the packets that follow a packet of the maximum size.
+ * The router has already chosen where the command goes, so the data is routed
+ * as it was read and only the packet headers are looked at. Empty packets,
+ * which end LOAD DATA LOCAL INFILE, are left to be routed on their own.
  *
- * @return True if we have a complete packet, otherwise false
+ * @param proto         The client protocol
+ * @param read_buffer   The data that was read, the rest is left here
+ * @return The data to route, NULL if there is none
  */
-static bool ensure_complete_packet(DCB *dcb, GWBUF **read_buffer, int nbytes_read)
+static GWBUF *take_stream_input(MySQLProtocol *proto, GWBUF **read_buffer)
 {
-    if (dcb->dcb_readqueue)
+    size_t offset = proto->stream_left;
+    size_t total = gwbuf_length(*read_buffer);
+    uint8_t header[MYSQL_HEADER_LEN];
+
+    while (offset < total &&
+           gwbuf_copy_data(*read_buffer, offset, MYSQL_HEADER_LEN, header) == MYSQL_HEADER_LEN &&
+           MYSQL_GET_PACKET_NO(header) != 0 && MYSQL_GET_PACKET_LEN(header) > 0)
     {
-        dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, *read_buffer);
-        nbytes_read = gwbuf_length(dcb->dcb_readqueue);
-        int plen = MYSQL_GET_PACKET_LEN((uint8_t *) GWBUF_DATA(dcb->dcb_readqueue));
+        offset += MYSQL_HEADER_LEN + MYSQL_GET_PACKET_LEN(header);
+    }
 
-        if (nbytes_read < 3 || nbytes_read < plen + 4)
-        {
-            return false;
-        }
-        else
-        {
-            /**
-             * There is at least one complete mysql packet in
-             * read_buffer.
-             */
-            *read_buffer = dcb->dcb_readqueue;
-            dcb->dcb_readqueue = NULL;
-        }
+    if (offset >= total)
+    {
+        GWBUF *rval = *read_buffer;
+        proto->stream_left = offset - total;
+        *read_buffer = NULL;
+        return rval;
+    }
+
+    proto->stream_left = 0;
+    return offset > 0 ? gwbuf_split(read_buffer, offset) : NULL;
+}
+
+/**
+ * Called by a thread of the classifier pool when a query has been parsed.
+ * The query is stored in the protocol and the polling thread that owns the
+ * DCB routes it when it processes the read event faked here.
+ *
+ * @param dcb   The client DCB
+ * @param query The parsed query
+ */
+static void query_classified(DCB *dcb, GWBUF *query)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    bool polling;
+
+    spinlock_acquire(&dcb->authlock);
+    polling = dcb->state == DCB_STATE_POLLING;
+    if (polling)
+    {
+        proto->classified_query = query;
+    }
+    proto->classifying = false;
+    spinlock_release(&dcb->authlock);
+
+    if (polling)
+    {
+        poll_fake_read_event(dcb);
     }
     else
     {
-        uint8_t* data = (uint8_t *) GWBUF_DATA(*read_buffer);
+        gwbuf_free(query);
+    }
+}
+
+/**
+ * Hand a long query to the classifier pool instead of parsing it on the
+ * polling thread when it is routed.
+ *
+ * The commands that follow the query are left in the read queue. As they
+ * start at a packet boundary, the command tracking of the protocol is reset
+ * so that they are processed again from their beginning.
+ *
+ * @param dcb   The client DCB
+ * @param query A query for which qc_pool_wants() returned true
+ * @return True if the query was taken by the pool
+ */
+static bool classify_in_pool(DCB *dcb, GWBUF *query)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    /** Set before queuing, the pool may be done before this returns */
+    spinlock_acquire(&dcb->authlock);
+    proto->classifying = true;
+    spinlock_release(&dcb->authlock);
+
+    if (!qc_pool_classify(dcb, query, query_classified))
+    {
+        spinlock_acquire(&dcb->authlock);
+        proto->classifying = false;
+        spinlock_release(&dcb->authlock);
+        return false;
+    }
+
+    dcb->protocol_bytes_processed = dcb->protocol_packet_length;
+    return true;
+}
+
+/**
+ * Route the query that was parsed by the classifier pool, if there is one.
+ *
+ * While a query of the client is being parsed, nothing is read from the
+ * client so that the queries are routed in order. The read event that the
+ * pool fakes when it is done makes the session continue with the data that
+ * arrived in the meantime.
+ *
+ * @param dcb The client DCB
+ * @return False if the client must not be read from, because a query is still
+ * being parsed or the session was closed
+ */
+static bool gw_read_classified_query(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    GWBUF *query;
+    bool classifying;
+
+    spinlock_acquire(&dcb->authlock);
+    classifying = proto->classifying;
+    query = proto->classified_query;
+    proto->classified_query = NULL;
+    spinlock_release(&dcb->authlock);
+
+    if (query)
+    {
+        SESSION *session = dcb->session;
 
-        if (nbytes_read < 3 || nbytes_read < MYSQL_GET_PACKET_LEN(data) + 4)
+        if (session->state == SESSION_STATE_ROUTER_READY)
         {
-            dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, *read_buffer);
-            return false;
+            uint8_t capabilities = session->service->router->getCapabilities(
+                session->service->router_instance, session->router_session);
+
+            proto->current_command = MYSQL_COM_QUERY;
+            gw_read_finish_processing(dcb, query, capabilities);
+        }
+        else
+        {
+            gwbuf_free(query);
         }
+
+        /** Routing the query may have closed the session */
+        return dcb->state == DCB_STATE_POLLING;
     }
 
-    return true;
+    return !classifying;
 }
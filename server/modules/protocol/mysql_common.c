@@ -49,6 +49,9 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <netinet/tcp.h>
+#include <memlog.h>
+#include <mysql_wire.h>
+#include <zlib.h>
 
 static server_command_t* server_command_init(server_command_t* srvcmd, mysql_server_cmd_t cmd);
 
@@ -133,6 +136,11 @@ void mysql_protocol_done(DCB* dcb)
         free(scmd);
         scmd = scmd2;
     }
+    gwbuf_free(p->compress_readq);
+    p->compress_readq = NULL;
+    gwbuf_free(p->stmt_readq);
+    p->stmt_readq = NULL;
+    p->stmt_readq_len = 0;
     p->protocol_state = MYSQL_PROTOCOL_DONE;
 
 retblock:
@@ -162,6 +170,8 @@ const char* gw_mysql_protocol_state2string (int state)
         return "MySQL Received user, password, db and capabilities";
     case MYSQL_AUTH_FAILED:
         return "MySQL Authentication failed";
+    case MYSQL_HANDSHAKE_FAILED:
+        return "MySQL Backend handshake failed";
     case MYSQL_IDLE:
         return "MySQL authentication is succesfully done.";
     case MYSQL_AUTH_SSL_REQ:
@@ -177,6 +187,21 @@ const char* gw_mysql_protocol_state2string (int state)
     }
 }
 
+/**
+ * Change the authentication state of a protocol and note the change in the
+ * flight recorder
+ *
+ * @param protocol The protocol
+ * @param state The new state
+ */
+void mysql_protocol_set_state(MySQLProtocol *protocol, mysql_auth_state_t state)
+{
+    memlog_ring_log(MLR_PROTOCOL_STATE, protocol->owner_dcb,
+                    (intptr_t)gw_mysql_protocol_state2string(protocol->protocol_auth_state),
+                    (intptr_t)gw_mysql_protocol_state2string(state));
+    protocol->protocol_auth_state = state;
+}
+
 GWBUF* mysql_create_com_quit(GWBUF* bufparam,
                              int packet_number)
 {
@@ -246,71 +271,10 @@ GWBUF* mysql_create_custom_error(int         packet_number,
                                  int         affected_rows,
                                  const char* msg)
 {
-    uint8_t* outbuf = NULL;
-    uint32_t mysql_payload_size = 0;
-    uint8_t mysql_packet_header[4];
-    uint8_t* mysql_payload = NULL;
-    uint8_t field_count = 0;
-    uint8_t mysql_err[2];
-    uint8_t mysql_statemsg[6];
-    const char* mysql_error_msg = NULL;
-    const char* mysql_state = NULL;
-
-    GWBUF* errbuf = NULL;
-
-    mysql_error_msg = "An errorr occurred ...";
-    mysql_state = "HY000";
-
-    field_count = 0xff;
-    gw_mysql_set_byte2(mysql_err, /* mysql_errno */ 2003);
-    mysql_statemsg[0]='#';
-    memcpy(mysql_statemsg + 1, mysql_state, 5);
-
-    if (msg != NULL)
-    {
-        mysql_error_msg = msg;
-    }
-
-    mysql_payload_size =
-        sizeof(field_count) +
-        sizeof(mysql_err) +
-        sizeof(mysql_statemsg) +
-        strlen(mysql_error_msg);
-
-    /** allocate memory for packet header + payload */
-    errbuf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size);
+    GWBUF* errbuf = mxs_wire_create_err(packet_number, 2003, "HY000",
+                                        msg ? msg : "An errorr occurred ...");
     ss_dassert(errbuf != NULL);
 
-    if (errbuf == NULL)
-    {
-        return 0;
-    }
-    outbuf = GWBUF_DATA(errbuf);
-
-    /** write packet header and packet number */
-    gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-    mysql_packet_header[3] = packet_number;
-
-    /** write header */
-    memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-
-    mysql_payload = outbuf + sizeof(mysql_packet_header);
-
-    /** write field */
-    memcpy(mysql_payload, &field_count, sizeof(field_count));
-    mysql_payload = mysql_payload + sizeof(field_count);
-
-    /** write errno */
-    memcpy(mysql_payload, mysql_err, sizeof(mysql_err));
-    mysql_payload = mysql_payload + sizeof(mysql_err);
-
-    /** write sqlstate */
-    memcpy(mysql_payload, mysql_statemsg, sizeof(mysql_statemsg));
-    mysql_payload = mysql_payload + sizeof(mysql_statemsg);
-
-    /** write error message */
-    memcpy(mysql_payload, mysql_error_msg, strlen(mysql_error_msg));
-
     return errbuf;
 }
 
@@ -332,44 +296,7 @@ mysql_create_standard_error(int packet_number,
         int error_number,
         const char *error_message)
 {
-    uint8_t *outbuf = NULL;
-    uint32_t mysql_payload_size = 0;
-    uint8_t mysql_packet_header[4];
-    uint8_t mysql_error_number[2];
-    uint8_t *mysql_handshake_payload = NULL;
-    GWBUF *buf;
-
-    mysql_payload_size = 1 + sizeof(mysql_error_number) + strlen(error_message);
-
-    // allocate memory for packet header + payload
-    if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
-    {
-        return NULL;
-    }
-    outbuf = GWBUF_DATA(buf);
-
-    // write packet header with mysql_payload_size
-    gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-
-    // write packet number, now is 0
-    mysql_packet_header[3]= 0;
-    memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-
-    // current buffer pointer
-    mysql_handshake_payload = outbuf + sizeof(mysql_packet_header);
-
-    // write 0xff which is the error indicator
-    *mysql_handshake_payload = 0xff;
-    mysql_handshake_payload++;
-
-    // write error number
-    gw_mysql_set_byte2(mysql_handshake_payload, error_number);
-    mysql_handshake_payload += 2;
-
-    // write error message
-    memcpy(mysql_handshake_payload, error_message, strlen(error_message));
-
-    return buf;
+    return mxs_wire_create_err(packet_number, error_number, NULL, error_message);
 }
 
 /**
@@ -440,16 +367,7 @@ int mysql_send_auth_error(DCB        *dcb,
                           int        in_affected_rows,
                           const char *mysql_message)
 {
-    uint8_t *outbuf = NULL;
-    uint32_t mysql_payload_size = 0;
-    uint8_t mysql_packet_header[4];
-    uint8_t *mysql_payload = NULL;
-    uint8_t field_count = 0;
-    uint8_t mysql_err[2];
-    uint8_t mysql_statemsg[6];
-    const char *mysql_error_msg = NULL;
-    const char *mysql_state = NULL;
-
+    const char *mysql_error_msg = mysql_message ? mysql_message : "Access denied!";
     GWBUF *buf;
 
     if (dcb->state != DCB_STATE_POLLING)
@@ -461,57 +379,16 @@ int mysql_send_auth_error(DCB        *dcb,
                   STRDCBSTATE(dcb->state));
         return 0;
     }
-    mysql_error_msg = "Access denied!";
-    mysql_state = "28000";
-
-    field_count = 0xff;
-    gw_mysql_set_byte2(mysql_err, /*mysql_errno */ 1045);
-    mysql_statemsg[0]='#';
-    memcpy(mysql_statemsg + 1, mysql_state, 5);
 
-    if (mysql_message != NULL)
-    {
-        mysql_error_msg = mysql_message;
-    }
-
-    mysql_payload_size =
-        sizeof(field_count) + sizeof(mysql_err) + sizeof(mysql_statemsg) + strlen(mysql_error_msg);
-
-    // allocate memory for packet header + payload
-    if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
+    if ((buf = mxs_wire_create_err(packet_number, 1045, "28000", mysql_error_msg)) == NULL)
     {
         return 0;
     }
-    outbuf = GWBUF_DATA(buf);
-
-    // write packet header with packet number
-    gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-    mysql_packet_header[3] = packet_number;
-
-    // write header
-    memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-
-    mysql_payload = outbuf + sizeof(mysql_packet_header);
-
-    // write field
-    memcpy(mysql_payload, &field_count, sizeof(field_count));
-    mysql_payload = mysql_payload + sizeof(field_count);
-
-    // write errno
-    memcpy(mysql_payload, mysql_err, sizeof(mysql_err));
-    mysql_payload = mysql_payload + sizeof(mysql_err);
-
-    // write sqlstate
-    memcpy(mysql_payload, mysql_statemsg, sizeof(mysql_statemsg));
-    mysql_payload = mysql_payload + sizeof(mysql_statemsg);
-
-    // write err messg
-    memcpy(mysql_payload, mysql_error_msg, strlen(mysql_error_msg));
 
     // writing data in the Client buffer queue
     dcb->func.write(dcb, buf);
 
-    return sizeof(mysql_packet_header) + mysql_payload_size;
+    return mxs_wire_err_len("28000", strlen(mysql_error_msg));
 }
 
 
@@ -577,7 +454,7 @@ GWBUF* gw_MySQL_get_next_packet(GWBUF** p_readbuf)
 
         memcpy(target + nbytes_copied, src, bytestocopy);
         *p_readbuf = gwbuf_consume((*p_readbuf), bytestocopy);
-        totalbuflen = gwbuf_length((*p_readbuf));
+        totalbuflen -= bytestocopy;
         nbytes_copied += bytestocopy;
     }
     ss_dassert(buflen == 0 || nbytes_copied == packetlen);
@@ -817,6 +694,7 @@ mysql_server_cmd_t protocol_get_srv_command(MySQLProtocol* p,
  */
 void init_response_status(GWBUF*             buf,
                           mysql_server_cmd_t cmd,
+                          bool               deprecate_eof,
                           int*               npackets,
                           ssize_t*           nbytes_left)
 {
@@ -843,7 +721,12 @@ void init_response_status(GWBUF*             buf,
             nparam = gw_mysql_get_byte2(readbuf);
             gwbuf_copy_data(buf, 11, 2, readbuf);
             nattr = gw_mysql_get_byte2(readbuf);
-            *npackets = 1 + nparam + MIN(1, nparam) + nattr + MIN(nattr, 1);
+            /** The parameters and the columns end in an EOF unless it is deprecated */
+            *npackets = 1 + nparam + nattr;
+            if (!deprecate_eof)
+            {
+                *npackets += MIN(1, nparam) + MIN(nattr, 1);
+            }
             break;
 
         case MYSQL_COM_QUIT:
@@ -1007,3 +890,144 @@ char *create_auth_fail_str(char *username,
 retblock:
     return errstr;
 }
+
+/**
+ * Convert MySQL packets into packets of the compressed protocol. Payloads
+ * that are shorter than min_len, or that zlib cannot make smaller, are sent
+ * uncompressed.
+ *
+ * @param proto     The protocol of the connection
+ * @param queue     The MySQL packets, freed by this function
+ * @param level     The zlib compression level
+ * @param min_len   The shortest payload that is compressed
+ * @return The compressed packets, or NULL on error
+ */
+GWBUF *
+mysql_compress_packets(MySQLProtocol *proto, GWBUF *queue, int level, size_t min_len)
+{
+    size_t total = gwbuf_length(queue);
+    size_t offset = 0;
+    GWBUF *rval = NULL;
+
+    if ((queue = gwbuf_make_contiguous(queue)) == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *data = GWBUF_DATA(queue);
+
+    /** A new command starts a new sequence of compressed packets */
+    if (total > MYSQL_HEADER_LEN && MYSQL_GET_PACKET_NO(data) == 0)
+    {
+        proto->compress_seq = 0;
+    }
+
+    while (offset < total)
+    {
+        size_t len = MIN(total - offset, MYSQL_PACKET_LENGTH_MAX);
+        uLongf clen = compressBound(len);
+        GWBUF *packet = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN + MAX(clen, len));
+
+        if (packet == NULL)
+        {
+            gwbuf_free(rval);
+            rval = NULL;
+            break;
+        }
+
+        uint8_t *ptr = GWBUF_DATA(packet);
+        size_t ulen = len;
+
+        if (len < min_len ||
+            compress2(ptr + MYSQL_COMPRESSED_HEADER_LEN, &clen, data + offset, len, level) != Z_OK ||
+            clen >= len)
+        {
+            /** An uncompressed length of zero means the payload is not compressed */
+            memcpy(ptr + MYSQL_COMPRESSED_HEADER_LEN, data + offset, len);
+            clen = len;
+            ulen = 0;
+        }
+
+        gw_mysql_set_byte3(ptr, clen);
+        ptr[3] = proto->compress_seq++;
+        gw_mysql_set_byte3(ptr + 4, ulen);
+        GWBUF_RTRIM(packet, GWBUF_LENGTH(packet) - MYSQL_COMPRESSED_HEADER_LEN - clen);
+
+        rval = gwbuf_append(rval, packet);
+        offset += len;
+    }
+
+    gwbuf_free(queue);
+    return rval;
+}
+
+/**
+ * Extract the complete packets of the compressed protocol from the data
+ * read from a connection. An incomplete packet is kept in the protocol.
+ *
+ * @param proto The protocol of the connection
+ * @param raw   The data that was read, freed by this function
+ * @param nread Incremented by the number of compressed bytes consumed
+ * @param error Set to true if a packet could not be decompressed
+ * @return The decompressed MySQL packets, NULL if no packet was complete
+ */
+GWBUF *
+mysql_decompress_packets(MySQLProtocol *proto, GWBUF *raw, uint64_t *nread, bool *error)
+{
+    uint8_t header[MYSQL_COMPRESSED_HEADER_LEN];
+    GWBUF *rval = NULL;
+
+    proto->compress_readq = gwbuf_append(proto->compress_readq, raw);
+
+    while (gwbuf_copy_data(proto->compress_readq, 0, MYSQL_COMPRESSED_HEADER_LEN,
+                           header) == MYSQL_COMPRESSED_HEADER_LEN)
+    {
+        size_t clen = gw_mysql_get_byte3(header);
+        size_t ulen = gw_mysql_get_byte3(header + 4);
+
+        if (gwbuf_length(proto->compress_readq) < MYSQL_COMPRESSED_HEADER_LEN + clen)
+        {
+            break;
+        }
+
+        proto->compress_readq = gwbuf_consume(proto->compress_readq,
+                                              MYSQL_COMPRESSED_HEADER_LEN);
+        proto->compress_seq = header[3] + 1;
+
+        GWBUF *packet = gwbuf_alloc(ulen ? ulen : clen);
+
+        if (packet == NULL)
+        {
+            *error = true;
+            break;
+        }
+
+        if (ulen == 0)
+        {
+            gwbuf_copy_data(proto->compress_readq, 0, clen, GWBUF_DATA(packet));
+        }
+        else
+        {
+            uint8_t *cdata = malloc(clen);
+            uLongf destlen = ulen;
+
+            if (cdata == NULL ||
+                gwbuf_copy_data(proto->compress_readq, 0, clen, cdata) != clen ||
+                uncompress(GWBUF_DATA(packet), &destlen, cdata, clen) != Z_OK ||
+                destlen != ulen)
+            {
+                free(cdata);
+                gwbuf_free(packet);
+                *error = true;
+                break;
+            }
+            free(cdata);
+        }
+
+        proto->compress_readq = gwbuf_consume(proto->compress_readq, clen);
+        *nread += MYSQL_COMPRESSED_HEADER_LEN + clen;
+        rval = gwbuf_append(rval, packet);
+    }
+
+    return rval;
+}
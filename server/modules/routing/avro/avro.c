@@ -93,6 +93,7 @@ static bool ensure_dir_ok(const char* path, int mode);
 bool avro_save_conversion_state(AVRO_INSTANCE *router);
 static void stats_func(void *);
 void avro_index_file(AVRO_INSTANCE *router, const char* path);
+bool avro_index_prepare(AVRO_INSTANCE *router);
 void avro_update_index(AVRO_INSTANCE* router);
 
 /** The module object definition */
@@ -172,7 +173,18 @@ void* safe_key_free(void *data)
 bool create_tables(sqlite3* handle)
 {
     char* errmsg;
-    int rc = sqlite3_exec(handle, "CREATE TABLE IF NOT EXISTS "
+
+    /** Clients read the index while it is updated */
+    int rc = sqlite3_exec(handle, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",
+                          NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK)
+    {
+        MXS_WARNING("Failed to enable write-ahead logging for the GTID index: %s",
+                    sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+    }
+
+    rc = sqlite3_exec(handle, "CREATE TABLE IF NOT EXISTS "
                           GTID_TABLE_NAME"(domain int, server_id int, "
                           "sequence bigint, "
                           "avrofile varchar(255), "
@@ -187,6 +199,32 @@ bool create_tables(sqlite3* handle)
         return false;
     }
 
+    /** The file position of a GTID is found from the index alone */
+    rc = sqlite3_exec(handle, "CREATE INDEX IF NOT EXISTS "GTID_TABLE_NAME"_position ON "
+                      GTID_TABLE_NAME"(avrofile, domain, server_id, sequence, position);",
+                      NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to create index for GTID positions: %s",
+                  sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+        return false;
+    }
+
+    rc = sqlite3_exec(handle, "CREATE TABLE IF NOT EXISTS "
+                      TIMESTAMP_TABLE_NAME"(avrofile varchar(255), position bigint, "
+                      "timestamp bigint, primary key(avrofile, position));"
+                      "CREATE INDEX IF NOT EXISTS "TIMESTAMP_TABLE_NAME"_timestamp ON "
+                      TIMESTAMP_TABLE_NAME"(avrofile, timestamp, position);",
+                      NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to create block timestamp table '"TIMESTAMP_TABLE_NAME"': %s",
+                  sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+        return false;
+    }
+
     rc = sqlite3_exec(handle, "CREATE TABLE IF NOT EXISTS "
                       USED_TABLES_TABLE_NAME"(domain int, server_id int, "
                       "sequence bigint, binlog_timestamp bigint, "
@@ -211,6 +249,20 @@ bool create_tables(sqlite3* handle)
         return false;
     }
 
+    /** Older versions added a row for each indexing run, keep the latest one */
+    rc = sqlite3_exec(handle, "DELETE FROM "INDEX_TABLE_NAME" WHERE rowid NOT IN "
+                      "(SELECT max(rowid) FROM "INDEX_TABLE_NAME" GROUP BY filename);"
+                      "CREATE UNIQUE INDEX IF NOT EXISTS "INDEX_TABLE_NAME"_filename ON "
+                      INDEX_TABLE_NAME"(filename);",
+                      NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to create index for indexing progress table '"INDEX_TABLE_NAME"': %s",
+                  sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+        return false;
+    }
+
     rc = sqlite3_exec(handle, "ATTACH DATABASE ':memory:' AS "MEMORY_DATABASE_NAME,
                       NULL, NULL, &errmsg);
     if (rc != SQLITE_OK)
@@ -317,6 +369,7 @@ createInstance(SERVICE *service, char **options)
     memset(&inst->stats, 0, sizeof(AVRO_ROUTER_STATS));
     spinlock_init(&inst->lock);
     spinlock_init(&inst->fileslock);
+    spinlock_init(&inst->shared_lock);
     inst->service = service;
     inst->binlog_fd = -1;
     inst->binlogdir = NULL;
@@ -332,8 +385,18 @@ createInstance(SERVICE *service, char **options)
     inst->trx_count = 0;
     inst->row_target = AVRO_DEFAULT_BLOCK_ROW_COUNT;
     inst->trx_target = AVRO_DEFAULT_BLOCK_TRX_COUNT;
+    inst->n_workers = AVRO_DEFAULT_CONVERSION_THREADS;
+    inst->shared_blocks = AVRO_DEFAULT_SHARED_BLOCKS;
+    inst->flush_interval = AVRO_DEFAULT_FLUSH_INTERVAL;
+    inst->last_flush = time(NULL);
+    inst->block_size = AVRO_DEFAULT_BLOCK_SIZE;
+    inst->codec = NULL;
     int first_file = 1;
     bool err = false;
+    char *kafka_brokers = NULL;
+    char *kafka_topic = NULL;
+    char *kafka_compression = NULL;
+    int kafka_batch_ms = AVRO_DEFAULT_KAFKA_BATCH_MS;
 
     CONFIG_PARAMETER *param = config_get_param(service->svc_config_param, "source");
     if (param)
@@ -398,6 +461,52 @@ createInstance(SERVICE *service, char **options)
                 {
                     inst->trx_target = atoi(value);
                 }
+                else if (strcmp(options[i], "flush_interval") == 0)
+                {
+                    inst->flush_interval = MAX(0, atoi(value));
+                }
+                else if (strcmp(options[i], "block_size") == 0)
+                {
+                    inst->block_size = MAX(0, atol(value));
+                }
+                else if (strcmp(options[i], "codec") == 0)
+                {
+                    if (strcmp(value, "null") == 0 || strcmp(value, "deflate") == 0)
+                    {
+                        free(inst->codec);
+                        inst->codec = strdup(value);
+                    }
+                    else
+                    {
+                        MXS_ERROR("[avrorouter] Unsupported codec '%s', expected "
+                                  "'null' or 'deflate'.", value);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "conversion_threads") == 0)
+                {
+                    inst->n_workers = MAX(0, atoi(value));
+                }
+                else if (strcmp(options[i], "shared_blocks") == 0)
+                {
+                    inst->shared_blocks = MAX(0, atoi(value));
+                }
+                else if (strcmp(options[i], "kafka_brokers") == 0)
+                {
+                    kafka_brokers = value;
+                }
+                else if (strcmp(options[i], "kafka_topic") == 0)
+                {
+                    kafka_topic = value;
+                }
+                else if (strcmp(options[i], "kafka_compression") == 0)
+                {
+                    kafka_compression = value;
+                }
+                else if (strcmp(options[i], "kafka_batch_ms") == 0)
+                {
+                    kafka_batch_ms = MAX(0, atoi(value));
+                }
                 else if (strcmp(options[i], "start_index") == 0)
                 {
                     first_file = MAX(1, atoi(value));
@@ -416,6 +525,11 @@ createInstance(SERVICE *service, char **options)
         }
     }
 
+    if (inst->codec == NULL)
+    {
+        inst->codec = strdup(AVRO_DEFAULT_CODEC);
+    }
+
     if (inst->binlogdir == NULL)
     {
         MXS_ERROR("No 'binlogdir' option found in source service or in router_options.");
@@ -475,11 +589,9 @@ createInstance(SERVICE *service, char **options)
 
     int pcreerr;
     size_t erroff;
-    pcre2_code *create_re = pcre2_compile((PCRE2_SPTR) create_table_regex,
-                                          PCRE2_ZERO_TERMINATED, 0, &pcreerr, &erroff, NULL);
+    pcre2_code *create_re = mxs_pcre2_compile(create_table_regex, 0, &pcreerr, &erroff);
     ss_dassert(create_re); // This should almost never fail
-    pcre2_code *alter_re = pcre2_compile((PCRE2_SPTR) alter_table_regex,
-                                         PCRE2_ZERO_TERMINATED, 0, &pcreerr, &erroff, NULL);
+    pcre2_code *alter_re = mxs_pcre2_compile(alter_table_regex, 0, &pcreerr, &erroff);
     ss_dassert(alter_re); // This should almost never fail
 
     if (create_re && alter_re)
@@ -507,11 +619,32 @@ createInstance(SERVICE *service, char **options)
                   sqlite3_errmsg(inst->sqlite_handle));
         err = true;
     }
-    else if (!create_tables(inst->sqlite_handle))
+    else if (!create_tables(inst->sqlite_handle) || !avro_index_prepare(inst))
     {
         err = true;
     }
 
+    if (kafka_brokers && !err)
+    {
+        if ((inst->kafka = avro_kafka_alloc(kafka_brokers, kafka_topic,
+                                            kafka_compression ? kafka_compression :
+                                            AVRO_DEFAULT_KAFKA_COMPRESSION,
+                                            kafka_batch_ms)))
+        {
+            MXS_NOTICE("[%s] Publishing converted rows to Kafka brokers: %s",
+                       service->name, kafka_brokers);
+        }
+        else
+        {
+            err = true;
+        }
+    }
+    else if ((kafka_topic || kafka_compression) && !err)
+    {
+        MXS_WARNING("[%s] No 'kafka_brokers' option found, rows will not be "
+                    "published to Kafka.", service->name);
+    }
+
     if (err)
     {
         sqlite3_close_v2(inst->sqlite_handle);
@@ -521,6 +654,7 @@ createInstance(SERVICE *service, char **options)
         free(inst->avrodir);
         free(inst->binlogdir);
         free(inst->fileroot);
+        free(inst->codec);
         free(inst);
         return NULL;
     }
@@ -538,6 +672,12 @@ createInstance(SERVICE *service, char **options)
     avro_load_conversion_state(inst);
     avro_load_metadata_from_schemas(inst);
 
+    if (!avro_workers_start(inst))
+    {
+        MXS_WARNING("[%s] Converting the row events without conversion threads.",
+                    service->name);
+    }
+
     /*
      * Add tasks for statistic computation
      */
@@ -652,6 +792,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
 
     free(client->uuid);
     maxavro_file_close(client->file_handle);
+    avro_shared_release(router, client->shared_file);
     sqlite3_close_v2(client->sqlite_handle);
 
     /*
@@ -816,6 +957,22 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tCurrent GTID #events:                %lu\n",
                router_inst->gtid.event_num);
 
+    dcb_printf(dcb, "\tAvro data block codec:               %s\n",
+               router_inst->codec);
+    dcb_printf(dcb, "\tNumber of conversion threads:        %d\n",
+               router_inst->n_workers);
+    dcb_printf(dcb, "\tShared blocks per Avro file:         %d\n",
+               router_inst->shared_blocks);
+    dcb_printf(dcb, "\tBlocks sent from shared blocks:      %lu\n",
+               router_inst->stats.n_shared_hits);
+    dcb_printf(dcb, "\tBlocks converted by clients:         %lu\n",
+               router_inst->stats.n_shared_misses);
+
+    if (router_inst->kafka)
+    {
+        avro_kafka_diagnostics(router_inst->kafka, dcb);
+    }
+
     dcb_printf(dcb, "\tCurrent GTID affected tables: ");
     avro_get_used_tables(router_inst, dcb);
     dcb_printf(dcb, "\n");
@@ -866,6 +1023,14 @@ diagnostics(ROUTER *router, DCB *dcb)
                        session->gtid.domain, session->gtid.server_id,
                        session->gtid.seq);
 
+            if (session->framed)
+            {
+                dcb_printf(dcb, "\t\tBinary framing:              %s\n",
+                           session->compress ? "compressed" : "uncompressed");
+                dcb_printf(dcb, "\t\tFrames sent/acknowledged:    %lu/%lu\n",
+                           session->frames_sent, session->frames_acked);
+            }
+
             // TODO: Add real value for this
             //dcb_printf(dcb, "\t\tAvro Transaction ID:         %u\n", 0);
             // TODO: Add real value for this
@@ -1021,6 +1186,7 @@ void converter_func(void* data)
     /** We reached end of file, flush unwritten records to disk */
     if (router->task_delay == 1)
     {
+        avro_workers_wait(router);
         avro_flush_all_tables(router);
         avro_save_conversion_state(router);
     }
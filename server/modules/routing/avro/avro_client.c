@@ -41,6 +41,7 @@
 #include <version.h>
 #include <avrorouter.h>
 #include <maxavro.h>
+#include <zlib.h>
 
 extern int load_mysql_users(SERVICE *service);
 extern char *blr_extract_column(GWBUF *buf, int col);
@@ -51,6 +52,9 @@ static int avro_client_do_registration(AVRO_INSTANCE *, AVRO_CLIENT *, GWBUF *);
 int avro_client_callback(DCB *dcb, DCB_REASON reason, void *data);
 static void avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *queue);
 static bool avro_client_stream_data(AVRO_CLIENT *client);
+static bool avro_client_parse_options(AVRO_CLIENT *client, char *command);
+static void avro_client_ack(AVRO_CLIENT *client, const char *command);
+static int send_frame(AVRO_CLIENT *client, uint8_t type, GWBUF *payload, uint32_t rows);
 void avro_notify_client(AVRO_CLIENT *client);
 void poll_fake_write_event(DCB *dcb);
 GWBUF* read_avro_json_schema(const char *avrofile, const char* dir);
@@ -447,20 +451,43 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
     const char req_data[] = "REQUEST-DATA";
     const char req_last_gtid[] = "QUERY-LAST-TRANSACTION";
     const char req_gtid[] = "QUERY-TRANSACTION";
+    const char req_ack[] = "ACK";
+    const char req_timestamp[] = "TIMESTAMP";
     const size_t req_data_len = sizeof(req_data) - 1;
     uint8_t *data = GWBUF_DATA(queue);
     char *command_ptr = strstr((char *)data, req_data);
 
     if (command_ptr != NULL)
     {
-        char *file_ptr = command_ptr + req_data_len;
-        int data_len = GWBUF_LENGTH(queue) - req_data_len;
+        int command_len = GWBUF_LENGTH(queue) - (command_ptr - (char *)data);
+        char command[command_len + 1];
+        memcpy(command, command_ptr, command_len);
+        command[command_len] = '\0';
+
+        if (!avro_client_parse_options(client, command))
+        {
+            dcb_printf(client->dcb, "ERR REQUEST-DATA with invalid stream options");
+            return;
+        }
+
+        char *file_ptr = command + req_data_len;
+        int data_len = strlen(file_ptr);
 
         if (data_len > 1)
         {
             const char *gtid_ptr = get_avrofile_name(file_ptr, data_len, client->avro_binfile);
 
-            if (gtid_ptr)
+            while (gtid_ptr && isspace(*gtid_ptr))
+            {
+                gtid_ptr++;
+            }
+
+            if (gtid_ptr && strncasecmp(gtid_ptr, req_timestamp, sizeof(req_timestamp) - 1) == 0)
+            {
+                client->requested_timestamp = true;
+                client->timestamp = strtoul(gtid_ptr + sizeof(req_timestamp) - 1, NULL, 10);
+            }
+            else if (gtid_ptr)
             {
                 client->requested_gtid = true;
                 extract_gtid_request(&client->gtid, gtid_ptr, data_len - (gtid_ptr - file_ptr));
@@ -485,6 +512,16 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
             dcb_printf(client->dcb, "ERR REQUEST-DATA with no data");
         }
     }
+    /** Acknowledgement of received frames */
+    else if (client->framed && GWBUF_LENGTH(queue) > sizeof(req_ack) - 1 &&
+             memcmp(data, req_ack, sizeof(req_ack) - 1) == 0)
+    {
+        int len = GWBUF_LENGTH(queue);
+        char command[len + 1];
+        memcpy(command, data, len);
+        command[len] = '\0';
+        avro_client_ack(client, command);
+    }
     /* Return last GTID info */
     else if (strstr((char *)data, req_last_gtid))
     {
@@ -507,6 +544,234 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
     }
 }
 
+/**
+ * Parse the stream options at the end of a REQUEST-DATA command
+ *
+ * The options are removed from the command so that only the file name and
+ * the GTID are left in it.
+ *
+ * @param client  The client
+ * @param command The command, modified in place
+ * @return True if the options were valid
+ */
+static bool avro_client_parse_options(AVRO_CLIENT *client, char *command)
+{
+    const char *names[] = {" FRAMING=", " COMPRESSION=", " WINDOW=", NULL};
+    char *end = command + strlen(command);
+    char *options = end;
+
+    for (int i = 0; names[i]; i++)
+    {
+        char *opt = strstr(command, names[i]);
+
+        if (opt && opt < options)
+        {
+            options = opt;
+        }
+    }
+
+    if (options == end)
+    {
+        return true;
+    }
+
+    char *saveptr;
+    bool rval = true;
+
+    for (char *tok = strtok_r(options, " ", &saveptr); tok && rval;
+         tok = strtok_r(NULL, " ", &saveptr))
+    {
+        if (strcmp(tok, "FRAMING=BINARY") == 0)
+        {
+            client->framed = true;
+        }
+        else if (strcmp(tok, "FRAMING=TEXT") == 0)
+        {
+            client->framed = false;
+        }
+        else if (strcmp(tok, "COMPRESSION=DEFLATE") == 0)
+        {
+            client->compress = true;
+        }
+        else if (strcmp(tok, "COMPRESSION=NONE") == 0)
+        {
+            client->compress = false;
+        }
+        else if (strncmp(tok, "WINDOW=", 7) == 0 && isdigit(tok[7]))
+        {
+            client->window = strtoul(tok + 7, NULL, 10);
+        }
+        else
+        {
+            MXS_ERROR("Unknown stream option '%s' from %s@%s.", tok,
+                      client->dcb->user, client->dcb->remote);
+            rval = false;
+        }
+    }
+
+    if (rval && client->framed && client->format != AVRO_FORMAT_JSON)
+    {
+        MXS_ERROR("Binary framing was requested by %s@%s but it is only "
+                  "supported with the JSON format.", client->dcb->user, client->dcb->remote);
+        rval = false;
+    }
+
+    if (rval && client->compress && !client->framed)
+    {
+        MXS_ERROR("Compression was requested by %s@%s without binary framing.",
+                  client->dcb->user, client->dcb->remote);
+        rval = false;
+    }
+
+    /** Remove the options and the spaces before them */
+    *options = '\0';
+    while (options > command && isspace(*(options - 1)))
+    {
+        *--options = '\0';
+    }
+
+    return rval;
+}
+
+/**
+ * Check if the client has as many unacknowledged frames as it allows
+ *
+ * @param client The client
+ * @return True if no more frames can be sent before an acknowledgement
+ */
+static inline bool avro_client_window_full(AVRO_CLIENT *client)
+{
+    return client->framed && client->window > 0 &&
+           client->frames_sent - client->frames_acked >= client->window;
+}
+
+/**
+ * Handle an acknowledgement of received frames
+ *
+ * The acknowledgement is the total number of frames the client has
+ * processed. Several acknowledgements can arrive in one read in which case
+ * the last one is used. If streaming was stopped because the window was
+ * full, it is resumed.
+ *
+ * @param client  The client
+ * @param command The ACK command
+ */
+static void avro_client_ack(AVRO_CLIENT *client, const char *command)
+{
+    const char *ptr = command;
+    const char *next;
+
+    while ((next = strstr(ptr, "ACK")))
+    {
+        ptr = next + 3;
+    }
+
+    uint64_t acked = strtoull(ptr, NULL, 10);
+
+    spinlock_acquire(&client->catch_lock);
+
+    if (acked > client->frames_acked && acked <= client->frames_sent)
+    {
+        client->frames_acked = acked;
+    }
+
+    if ((client->cstate & AVRO_WAIT_ACK) && !avro_client_window_full(client))
+    {
+        client->cstate &= ~AVRO_WAIT_ACK;
+        avro_notify_client(client);
+    }
+
+    spinlock_release(&client->catch_lock);
+}
+
+/** Store a 4 byte little-endian integer in a frame header */
+static inline void frame_set_uint32(uint8_t *ptr, uint32_t value)
+{
+    ptr[0] = value & 0xff;
+    ptr[1] = (value >> 8) & 0xff;
+    ptr[2] = (value >> 16) & 0xff;
+    ptr[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * Send data to a client
+ *
+ * If the client requested binary framing, the data is sent as one frame
+ * and compressed if the client asked for it and the compressed payload is
+ * smaller. Otherwise the data is sent as it is.
+ *
+ * @param client  The client
+ * @param type    Frame type
+ * @param payload Data to send
+ * @param rows    Number of rows in the data
+ * @return Return value of the write
+ */
+static int send_frame(AVRO_CLIENT *client, uint8_t type, GWBUF *payload, uint32_t rows)
+{
+    DCB *dcb = client->dcb;
+
+    if (!client->framed)
+    {
+        return dcb->func.write(dcb, payload);
+    }
+
+    uint32_t raw_len = gwbuf_length(payload);
+    uint32_t len = raw_len;
+    uint8_t flags = 0;
+    GWBUF *frame = NULL;
+
+    if (client->compress && raw_len > 0 && (payload = gwbuf_make_contiguous(payload)))
+    {
+        uLongf bound = compressBound(raw_len);
+
+        if ((frame = gwbuf_alloc(CDC_FRAME_HEADER_LEN + bound)))
+        {
+            uLongf dest_len = bound;
+
+            if (compress2((Bytef*)GWBUF_DATA(frame) + CDC_FRAME_HEADER_LEN, &dest_len,
+                          GWBUF_DATA(payload), raw_len, Z_BEST_SPEED) == Z_OK &&
+                dest_len < raw_len)
+            {
+                gwbuf_rtrim(frame, bound - dest_len);
+                gwbuf_free(payload);
+                payload = NULL;
+                len = dest_len;
+                flags |= CDC_FRAME_DEFLATE;
+            }
+            else
+            {
+                /** Not worth compressing, send the payload as it is */
+                gwbuf_rtrim(frame, bound);
+            }
+        }
+    }
+    else if (payload)
+    {
+        frame = gwbuf_alloc(CDC_FRAME_HEADER_LEN);
+    }
+
+    if (frame == NULL)
+    {
+        gwbuf_free(payload);
+        return 0;
+    }
+
+    uint8_t *ptr = GWBUF_DATA(frame);
+    frame_set_uint32(ptr, len);
+    frame_set_uint32(ptr + 4, raw_len);
+    frame_set_uint32(ptr + 8, rows);
+    ptr[12] = type;
+    ptr[13] = flags;
+
+    if (payload)
+    {
+        frame = gwbuf_append(frame, payload);
+    }
+
+    client->frames_sent++;
+    return dcb->func.write(dcb, frame);
+}
+
 /**
  * @brief Form the full Avro file name
  *
@@ -552,7 +817,7 @@ const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest)
     return rval;
 }
 
-static int send_row(DCB *dcb, json_t* row)
+static int send_row(AVRO_CLIENT *client, json_t* row)
 {
     char *json = json_dumps(row, JSON_PRESERVE_ORDER);
     GWBUF *buf;
@@ -560,7 +825,7 @@ static int send_row(DCB *dcb, json_t* row)
 
     if (json && (buf = gwbuf_alloc_and_load(strlen(json), (void*)json)))
     {
-        rc = dcb->func.write(dcb, buf);
+        rc = send_frame(client, CDC_FRAME_ROWS, buf, 1);
     }
     else
     {
@@ -571,24 +836,35 @@ static int send_row(DCB *dcb, json_t* row)
     return rc;
 }
 
-static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
+/**
+ * @brief Find the index of a field in the schema
+ *
+ * @param schema Schema of the file
+ * @param name Name of the field
+ * @return Index of the field or -1 if the schema has no such field
+ */
+static int get_field_index(MAXAVRO_SCHEMA *schema, const char *name)
 {
-    json_t *obj = json_object_get(row, avro_sequence);
-    ss_dassert(json_is_integer(obj));
-    client->gtid.seq = json_integer_value(obj);
-
-    obj = json_object_get(row, avro_server_id);
-    ss_dassert(json_is_integer(obj));
-    client->gtid.server_id = json_integer_value(obj);
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        if (strcmp(schema->fields[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
 
-    obj = json_object_get(row, avro_domain);
-    ss_dassert(json_is_integer(obj));
-    client->gtid.domain = json_integer_value(obj);
+    return -1;
 }
 
 /**
  * @brief Stream Avro data in JSON format
  *
+ * The records of a data block are written as JSON text straight from the
+ * block and sent with one write. The converted blocks are shared with the
+ * other clients reading the same file and a block that another client has
+ * already converted is sent as it is. With binary framing each block is
+ * sent as one frame and streaming stops when the client's window is full.
+ *
  * @param file File to stream from
  * @param dcb DCB to stream to
  * @return True if more data is readable, false if all data was sent
@@ -596,88 +872,170 @@ static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
 static bool stream_json(AVRO_CLIENT *client)
 {
     int bytes = 0;
+    int rc = 1;
+    bool more = true;
     MAXAVRO_FILE *file = client->file_handle;
-    DCB *dcb = client->dcb;
+    MAXAVRO_TEXT text = {NULL, 0, 0};
+    uint64_t values[file->schema->num_fields + 1];
+    int sequence = get_field_index(file->schema, avro_sequence);
+    int server_id = get_field_index(file->schema, avro_server_id);
+    int domain = get_field_index(file->schema, avro_domain);
 
-    do
+    while (more && rc > 0 && bytes < AVRO_DATA_BURST_SIZE && !avro_client_window_full(client))
     {
-        json_t *row;
-        int rc = 1;
-        while (rc > 0 && (row = maxavro_record_read_json(file)))
+        AVRO_SHARED_BLOCK block = {file->block_start_pos};
+        bool whole_block = !file->metadata_read || file->records_read_from_block == 0;
+
+        if (whole_block && avro_shared_get(client->router, client->shared_file, block.pos, &block))
         {
-            rc = send_row(dcb, row);
-            set_current_gtid(client, row);
-            json_decref(row);
+            rc = send_frame(client, CDC_FRAME_ROWS, block.json, block.records);
+            client->gtid.seq = block.gtid.seq;
+            client->gtid.server_id = block.gtid.server_id;
+            client->gtid.domain = block.gtid.domain;
+            file->records_read += block.records;
+            bytes += block.next_pos - block.pos;
+            more = maxavro_record_set_pos(file, block.next_pos);
+            continue;
+        }
+
+        uint32_t found = 0;
+        text.len = 0;
+
+        while (maxavro_record_read_text(file, &text, values))
+        {
+            found++;
+        }
+
+        if (found)
+        {
+            if (sequence >= 0 && server_id >= 0 && domain >= 0)
+            {
+                client->gtid.seq = values[sequence];
+                client->gtid.server_id = values[server_id];
+                client->gtid.domain = values[domain];
+            }
+
+            if ((block.json = gwbuf_alloc_and_load(text.len, text.data)))
+            {
+                if (whole_block && file->records_read_from_block == file->records_in_block)
+                {
+                    block.next_pos = file->data_start_pos + file->block_size + SYNC_MARKER_SIZE;
+                    block.records = file->records_in_block;
+                    block.gtid = client->gtid;
+                    avro_shared_put(client->router, client->shared_file, &block);
+                }
+                rc = send_frame(client, CDC_FRAME_ROWS, block.json, found);
+            }
+            else
+            {
+                rc = 0;
+            }
         }
         bytes += file->block_size;
+        more = maxavro_next_block(file);
     }
-    while (maxavro_next_block(file) && bytes < AVRO_DATA_BURST_SIZE);
 
+    free(text.data);
     return bytes >= AVRO_DATA_BURST_SIZE;
 }
 
 /**
  * @brief Stream Avro data in native Avro format
  *
+ * The current data block is sent from memory and the complete blocks after
+ * it are copied from the file to the client with sendfile().
+ *
  * @param file File to stream from
  * @param dcb DCB to stream to
  * @return True if streaming was successful, false if an error occurred
  */
 static bool stream_binary(AVRO_CLIENT *client)
 {
-    GWBUF *buffer;
-    uint64_t bytes = 0;
-    int rc = 1;
     MAXAVRO_FILE *file = client->file_handle;
     DCB *dcb = client->dcb;
+    GWBUF *buffer = maxavro_record_read_binary(file);
 
-    while (rc > 0 && bytes < AVRO_DATA_BURST_SIZE)
+    if (buffer == NULL)
     {
-        bytes += file->block_size;
-        if ((buffer = maxavro_record_read_binary(file)))
-        {
-            rc = dcb->func.write(dcb, buffer);
-        }
-        else
-        {
-            rc = 0;
-        }
+        return false;
     }
 
-    return bytes >= AVRO_DATA_BURST_SIZE;
-}
+    long bytes = gwbuf_length(buffer);
+    long start = file->block_start_pos;
+    long len = 0;
 
-static int sqlite_cb(void* data, int rows, char** values, char** names)
-{
-    for (int i = 0; i < rows; i++)
+    if (bytes < AVRO_DATA_BURST_SIZE)
     {
-        if (values[i])
-        {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
-        }
+        len = maxavro_skip_blocks(file, AVRO_DATA_BURST_SIZE - bytes);
     }
-    return 0;
+
+    int rc = dcb_sendfile(dcb, buffer, fileno(file->file), start, len);
+
+    return rc > 0 && bytes + len >= AVRO_DATA_BURST_SIZE;
 }
 
-static const char select_template[] = "SELECT max(position) FROM gtid WHERE domain=%lu "
-                                      "AND server_id=%lu AND sequence <= %lu AND avrofile=\"%s\";";
+/**
+ * The position of the last indexed block that starts with the requested GTID
+ * or an earlier one. The positions in a file grow with the sequence numbers
+ * so the covering index on the GTID table is enough to find it.
+ */
+static const char select_sql[] = "SELECT position FROM "GTID_TABLE_NAME" WHERE avrofile = ? "
+                                 "AND domain = ? AND server_id = ? AND sequence <= ? "
+                                 "ORDER BY sequence DESC LIMIT 1;";
+
+/**
+ * The position of the last indexed block that starts before the requested
+ * timestamp. The rows with the requested timestamp can start in the middle
+ * of that block.
+ */
+static const char select_timestamp_sql[] = "SELECT position FROM "TIMESTAMP_TABLE_NAME
+                                           " WHERE avrofile = ? AND timestamp < ? "
+                                           "ORDER BY timestamp DESC, position DESC LIMIT 1;";
 
-static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
+/**
+ * Move to the indexed block where the seek to the requested GTID or
+ * timestamp starts. If nothing is indexed, the file position is not changed.
+ *
+ * @param client    The client
+ * @param file      The file to seek in
+ * @param timestamp Seek to the requested timestamp instead of the GTID
+ * @return True if the index was read and the position set
+ */
+static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file, bool timestamp)
 {
     char *name = strrchr(client->file_handle->filename, '/');
     ss_dassert(name);
     name++;
 
-    char sql[sizeof(select_template) + NAME_MAX + 80];
-    snprintf(sql, sizeof(sql), select_template, client->gtid.domain,
-             client->gtid.server_id, client->gtid.seq, name);
-
+    sqlite3_stmt *stmt;
     long offset = -1;
-    char *errmsg = NULL;
     bool rval = false;
+    int rc = sqlite3_prepare_v2(client->sqlite_handle,
+                                timestamp ? select_timestamp_sql : select_sql,
+                                -1, &stmt, NULL);
+
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+
+        if (timestamp)
+        {
+            sqlite3_bind_int64(stmt, 2, client->timestamp);
+        }
+        else
+        {
+            sqlite3_bind_int64(stmt, 2, client->gtid.domain);
+            sqlite3_bind_int64(stmt, 3, client->gtid.server_id);
+            sqlite3_bind_int64(stmt, 4, client->gtid.seq);
+        }
+
+        if ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            offset = sqlite3_column_int64(stmt, 0);
+        }
+    }
 
-    if (sqlite3_exec(client->sqlite_handle, sql, sqlite_cb, &offset, &errmsg) == SQLITE_OK)
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE)
     {
         rval = true;
         if (offset > 0 && !maxavro_record_set_pos(file, offset))
@@ -685,15 +1043,66 @@ static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
             rval = false;
         }
     }
+    else if (timestamp)
+    {
+        MXS_ERROR("Failed to query index position for timestamp %u: %s",
+                  client->timestamp, sqlite3_errmsg(client->sqlite_handle));
+    }
     else
     {
         MXS_ERROR("Failed to query index position for GTID %lu-%lu-%lu: %s",
-                  client->gtid.domain, client->gtid.server_id, client->gtid.seq, errmsg);
+                  client->gtid.domain, client->gtid.server_id, client->gtid.seq,
+                  sqlite3_errmsg(client->sqlite_handle));
     }
-    sqlite3_free(errmsg);
+    sqlite3_finalize(stmt);
     return rval;
 }
 
+/**
+ * Skip the rows before the requested timestamp
+ *
+ * The rows of the block where the timestamp is found are sent from the
+ * first row with the requested timestamp or a later one.
+ *
+ * @param client The client
+ * @param file   The file to seek in
+ * @return True if a row with the timestamp or a later one was found
+ */
+static bool seek_to_timestamp(AVRO_CLIENT *client, MAXAVRO_FILE* file)
+{
+    bool seeking = true;
+
+    do
+    {
+        json_t *row;
+        while ((row = maxavro_record_read_json(file)))
+        {
+            if (seeking)
+            {
+                json_t *obj = json_object_get(row, avro_timestamp);
+                ss_dassert(json_is_integer(obj));
+
+                if (json_integer_value(obj) >= client->timestamp)
+                {
+                    MXS_INFO("Found timestamp %u for %s@%s", client->timestamp,
+                             client->dcb->user, client->dcb->remote);
+                    seeking = false;
+                }
+            }
+
+            if (!seeking)
+            {
+                send_row(client, row);
+            }
+
+            json_decref(row);
+        }
+    }
+    while (seeking && maxavro_next_block(file));
+
+    return !seeking;
+}
+
 /**
  *
  * @param client
@@ -739,7 +1148,7 @@ static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
              * read the row into memory */
             if (!seeking)
             {
-                send_row(client->dcb, row);
+                send_row(client, row);
             }
 
             json_decref(row);
@@ -769,22 +1178,29 @@ static bool avro_client_stream_data(AVRO_CLIENT *client)
         snprintf(filename, PATH_MAX, "%s/%s", router->avrodir, client->avro_binfile);
 
         spinlock_acquire(&client->file_lock);
-        if (client->file_handle == NULL)
+        if (client->file_handle == NULL &&
+            (client->file_handle = maxavro_file_open(filename)))
         {
-            client->file_handle = maxavro_file_open(filename);
+            client->shared_file = avro_shared_acquire(router, client->avro_binfile);
         }
         spinlock_release(&client->file_lock);
 
         switch (client->format)
         {
             case AVRO_FORMAT_JSON:
-                /** Currently only JSON format supports seeking to a GTID */
+                /** Currently only JSON format supports seeking to a GTID or a timestamp */
                 if (client->requested_gtid &&
-                    seek_to_index_pos(client, client->file_handle) &&
+                    seek_to_index_pos(client, client->file_handle, false) &&
                     seek_to_gtid(client, client->file_handle))
                 {
                     client->requested_gtid = false;
                 }
+                else if (client->requested_timestamp &&
+                         seek_to_index_pos(client, client->file_handle, true) &&
+                         seek_to_timestamp(client, client->file_handle))
+                {
+                    client->requested_timestamp = false;
+                }
 
                 read_more = stream_json(client);
                 break;
@@ -895,6 +1311,8 @@ static void rotate_avro_file(AVRO_CLIENT *client, char *fullname)
 
     spinlock_acquire(&client->file_lock);
     maxavro_file_close(client->file_handle);
+    avro_shared_release(client->router, client->shared_file);
+    client->shared_file = NULL;
 
     if ((client->file_handle = maxavro_file_open(fullname)) == NULL)
     {
@@ -902,6 +1320,7 @@ static void rotate_avro_file(AVRO_CLIENT *client, char *fullname)
     }
     else
     {
+        client->shared_file = avro_shared_acquire(client->router, filename);
         MXS_INFO("Rotated '%s'@'%s' to file: %s", client->dcb->user,
                  client->dcb->remote, fullname);
     }
@@ -958,6 +1377,14 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
             return 0;
         }
 
+        if (avro_client_window_full(client))
+        {
+            /** The client will resume the stream when it acknowledges frames */
+            client->cstate |= AVRO_WAIT_ACK;
+            spinlock_release(&client->catch_lock);
+            return 0;
+        }
+
         client->cstate |= AVRO_CS_BUSY;
         spinlock_release(&client->catch_lock);
 
@@ -982,7 +1409,7 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
 
             if (schema)
             {
-                client->dcb->func.write(client->dcb, schema);
+                send_frame(client, CDC_FRAME_SCHEMA, schema, 0);
             }
         }
 
@@ -993,18 +1420,35 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
         print_next_filename(client->avro_binfile, client->router->avrodir,
                             filename, sizeof(filename));
 
+        bool window_full = avro_client_window_full(client);
         bool next_file;
         /** If the next file is available, send it to the client */
-        if ((next_file = (access(filename, R_OK) == 0)))
+        if ((next_file = (!window_full && access(filename, R_OK) == 0)))
         {
             rotate_avro_file(client, filename);
         }
 
         spinlock_acquire(&client->catch_lock);
         client->cstate &= ~AVRO_CS_BUSY;
-        client->cstate |= AVRO_WAIT_DATA;
 
-        if (next_file || read_more)
+        if (window_full)
+        {
+            /** Checked again as an acknowledgement may have arrived meanwhile */
+            if (avro_client_window_full(client))
+            {
+                client->cstate |= AVRO_WAIT_ACK;
+            }
+            else
+            {
+                avro_notify_client(client);
+            }
+        }
+        else
+        {
+            client->cstate |= AVRO_WAIT_DATA;
+        }
+
+        if (!window_full && (next_file || read_more))
         {
 #ifdef SS_DEBUG
             if (read_more)
@@ -96,11 +96,15 @@ void avro_close_binlog(int fd)
 /**
  * @brief Allocate an Avro table
  *
- * Create an Aro table and prepare it for writing.
+ * Create an Aro table and prepare it for writing. An existing file keeps the
+ * schema and codec it was created with.
  * @param filepath Path to the created file
  * @param json_schema The schema of the table in JSON format
+ * @param codec Codec of the data blocks
+ * @param block_size Maximum size of the data blocks, 0 for the default size
  */
-AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
+AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                             const char *codec, size_t block_size)
 {
     AVRO_TABLE *table = calloc(1, sizeof(AVRO_TABLE));
     if (table)
@@ -113,20 +117,12 @@ AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
             return NULL;
         }
 
-        int rc = 0;
+        enum maxavro_codec file_codec = strcmp(codec, "deflate") == 0 ?
+                                        MAXAVRO_CODEC_DEFLATE : MAXAVRO_CODEC_NULL;
 
-        if (access(filepath, F_OK) == 0)
+        if ((table->writer = maxavro_writer_open(filepath, json_schema, file_codec,
+                                                 block_size)) == NULL)
         {
-            rc = avro_file_writer_open(filepath, &table->avro_file);
-        }
-        else
-        {
-            rc = avro_file_writer_create(filepath, table->avro_schema, &table->avro_file);
-        }
-
-        if (rc)
-        {
-            MXS_ERROR("Avro error: %s", avro_strerror());
             avro_schema_decref(table->avro_schema);
             free(table);
             return NULL;
@@ -136,7 +132,7 @@ AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
         {
             MXS_ERROR("Avro error: %s", avro_strerror());
             avro_schema_decref(table->avro_schema);
-            avro_file_writer_close(table->avro_file);
+            maxavro_writer_close(table->writer);
             free(table);
             return NULL;
         }
@@ -150,7 +146,9 @@ AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
 /**
  * @brief Write a new ini file with current conversion status
  *
- * The file is stored in the cache directory as 'avro-conversion.ini'.
+ * The file is stored in the cache directory as 'avro-conversion.ini'. If the
+ * rows are published to Kafka, the state is saved only after the broker has
+ * acknowledged all the rows.
  * @param router Avro router instance
  * @return True if the file was written successfully to disk
  *
@@ -161,6 +159,13 @@ bool avro_save_conversion_state(AVRO_INSTANCE *router)
     char filename[PATH_MAX + 1];
     char err_msg[STRERROR_BUFLEN];
 
+    if (router->kafka && !avro_kafka_flush(router->kafka))
+    {
+        MXS_ERROR("[%s] Not all rows were published to Kafka, the conversion "
+                  "state was not saved.", router->service->name);
+        return false;
+    }
+
     snprintf(filename, sizeof(filename), "%s/"AVRO_PROGRESS_FILE".tmp", router->avrodir);
 
     /* open file for writing */
@@ -303,8 +308,7 @@ void* avro_table_free(AVRO_TABLE *table)
 {
     if (table)
     {
-        avro_file_writer_flush(table->avro_file);
-        avro_file_writer_close(table->avro_file);
+        maxavro_writer_close(table->writer);
         avro_value_iface_decref(table->avro_writer_iface);
         avro_schema_decref(table->avro_schema);
         free(table->json_schema);
@@ -313,6 +317,125 @@ void* avro_table_free(AVRO_TABLE *table)
     return NULL;
 }
 
+/**
+ * @brief Convert one generic Avro value for the writer
+ *
+ * @param value Value to convert
+ * @param dest Where the value is stored
+ * @param len Where the length of a string or bytes value is stored
+ * @return True if the type of the value is supported
+ */
+static bool table_value_from_avro(avro_value_t *value, MAXAVRO_RECORD_VALUE *dest, size_t *len)
+{
+    const char *str;
+    const void *bytes;
+    int32_t i32;
+    int64_t i64;
+    float f;
+    int i;
+
+    switch (avro_value_get_type(value))
+    {
+        case AVRO_INT32:
+            avro_value_get_int(value, &i32);
+            dest->integer = i32;
+            return true;
+
+        case AVRO_INT64:
+            avro_value_get_long(value, &i64);
+            dest->integer = i64;
+            return true;
+
+        case AVRO_FLOAT:
+            avro_value_get_float(value, &f);
+            dest->floating = f;
+            return true;
+
+        case AVRO_DOUBLE:
+            avro_value_get_double(value, &dest->floating);
+            return true;
+
+        case AVRO_BOOLEAN:
+            avro_value_get_boolean(value, &i);
+            dest->boolean = i;
+            return true;
+
+        case AVRO_ENUM:
+            avro_value_get_enum(value, &i);
+            dest->integer = i;
+            return true;
+
+        case AVRO_STRING:
+            /** The size of a string includes the terminating null byte */
+            avro_value_get_string(value, &str, len);
+            dest->string = (char*)str;
+            *len = *len ? *len - 1 : 0;
+            return true;
+
+        case AVRO_BYTES:
+            avro_value_get_bytes(value, &bytes, len);
+            dest->bytes = (char*)bytes;
+            return true;
+
+        case AVRO_NULL:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Append a record to the Avro file of a table
+ *
+ * The record is converted from the generic Avro value of the table and
+ * encoded with the writer of the table.
+ *
+ * @param table Table to append to
+ * @param record Record created with the writer interface of the table
+ * @return True if the record was appended
+ */
+bool avro_table_append(AVRO_TABLE *table, avro_value_t *record)
+{
+    size_t nfields = 0;
+    avro_value_get_size(record, &nfields);
+
+    if (nfields != table->writer->schema->num_fields)
+    {
+        MXS_ERROR("Record has %lu fields but the schema of '%s' has %lu.",
+                  nfields, table->filename, table->writer->schema->num_fields);
+        return false;
+    }
+
+    MAXAVRO_RECORD_VALUE values[nfields + 1];
+    size_t lengths[nfields + 1];
+    int branches[nfields + 1];
+
+    for (size_t i = 0; i < nfields; i++)
+    {
+        avro_value_t field;
+        lengths[i] = 0;
+        branches[i] = 0;
+        avro_value_get_by_index(record, i, &field, NULL);
+
+        if (avro_value_get_type(&field) == AVRO_UNION)
+        {
+            avro_value_t branch;
+            avro_value_get_discriminant(&field, &branches[i]);
+            avro_value_get_current_branch(&field, &branch);
+            field = branch;
+        }
+
+        if (!table_value_from_avro(&field, &values[i], &lengths[i]))
+        {
+            MXS_ERROR("Unsupported type for field %lu of a record in '%s'.", i, table->filename);
+            return false;
+        }
+    }
+
+    return maxavro_writer_append(table->writer, values, lengths, branches);
+}
+
 /**
  * @brief Rotate to next file if it exists
  *
@@ -660,7 +783,7 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
                  (hdr.event_type >= WRITE_ROWS_EVENTv2 && hdr.event_type <= DELETE_ROWS_EVENTv2))
         {
             router->row_count++;
-            handle_row_event(router, &hdr, ptr);
+            handle_row_event(router, &hdr, result);
         }
         /* Decode ROTATE EVENT */
         else if (hdr.event_type == ROTATE_EVENT)
@@ -727,8 +850,11 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             pending_transaction = 0;
 
             if (router->row_count >= router->row_target ||
-                router->trx_count >= router->trx_target)
+                router->trx_count >= router->trx_target ||
+                (router->flush_interval > 0 &&
+                 time(NULL) - router->last_flush >= router->flush_interval))
             {
+                avro_workers_wait(router);
                 update_used_tables(router);
                 avro_flush_all_tables(router);
                 avro_save_conversion_state(router);
@@ -846,6 +972,8 @@ void avro_load_metadata_from_schemas(AVRO_INSTANCE *router)
  */
 void avro_flush_all_tables(AVRO_INSTANCE *router)
 {
+    router->last_flush = time(NULL);
+
     HASHITERATOR *iter = hashtable_iterator(router->open_tables);
 
     if (iter)
@@ -857,7 +985,7 @@ void avro_flush_all_tables(AVRO_INSTANCE *router)
 
             if (table)
             {
-                avro_file_writer_flush(table->avro_file);
+                maxavro_writer_flush(table->writer);
             }
         }
         hashtable_iterator_free(iter);
@@ -876,16 +1004,7 @@ void avro_flush_all_tables(AVRO_INSTANCE *router)
  */
 bool is_create_table_statement(AVRO_INSTANCE *router, char* ptr, size_t len)
 {
-    int rc = 0;
-    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(router->create_table_re, NULL);
-
-    if (mdata)
-    {
-        rc = pcre2_match(router->create_table_re, (PCRE2_SPTR) ptr, len, 0, 0, mdata, NULL);
-        pcre2_match_data_free(mdata);
-    }
-
-    return rc > 0;
+    return mxs_pcre2_match(router->create_table_re, ptr, len) > 0;
 }
 
 
@@ -898,16 +1017,7 @@ bool is_create_table_statement(AVRO_INSTANCE *router, char* ptr, size_t len)
  */
 bool is_alter_table_statement(AVRO_INSTANCE *router, char* ptr, size_t len)
 {
-    int rc = 0;
-    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(router->alter_table_re, NULL);
-
-    if (mdata)
-    {
-        rc = pcre2_match(router->alter_table_re, (PCRE2_SPTR) ptr, len, 0, 0, mdata, NULL);
-        pcre2_match_data_free(mdata);
-    }
-
-    return rc > 0;
+    return mxs_pcre2_match(router->alter_table_re, ptr, len) > 0;
 }
 
 /** Database name offset */
@@ -997,6 +1107,9 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
     {
         TABLE_CREATE *created = table_create_alloc(sql, db);
 
+        /** The workers use the table definitions */
+        avro_workers_wait(router);
+
         if (created && !save_and_replace_table_create(router, created))
         {
             MXS_ERROR("Failed to save statement to disk: %.*s", len, sql);
@@ -1022,6 +1135,7 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
 
         if (created)
         {
+            avro_workers_wait(router);
             table_create_alter(created, sql, sql + len);
         }
         else
@@ -19,7 +19,8 @@
  * that avrorouter uses contain the common GTID field, we can use it to create
  * an index. This can then be used to speed up retrieval of Avro records by
  * seeking to the offset of the file and reading the record instead of iterating
- * through all the records and looking for a matching record.
+ * through all the records and looking for a matching record. The timestamp of
+ * the first record of each block is indexed the same way.
  *
  * The index is stored as an SQLite3 database.
  *
@@ -38,8 +39,95 @@
 
 void* safe_key_free(void *data);
 
-static const char insert_template[] = "INSERT INTO gtid(domain, server_id, "
-                                      "sequence, avrofile, position) values (%lu, %lu, %lu, \"%s\", %ld);";
+static const char insert_sql[] = "INSERT INTO "GTID_TABLE_NAME"(domain, server_id, "
+                                 "sequence, avrofile, position) VALUES (?, ?, ?, ?, ?);";
+
+static const char timestamp_sql[] = "INSERT OR IGNORE INTO "TIMESTAMP_TABLE_NAME"(avrofile, "
+                                    "position, timestamp) VALUES (?, ?, ?);";
+
+static const char position_sql[] = "SELECT position FROM "INDEX_TABLE_NAME
+                                   " WHERE filename = ?;";
+
+static const char progress_sql[] = "INSERT OR REPLACE INTO "INDEX_TABLE_NAME
+                                   "(position, filename) VALUES (?, ?);";
+
+static const char used_table_sql[] = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
+                                     "(domain, server_id, sequence, binlog_timestamp, table_name)"
+                                     " VALUES (?, ?, ?, ?, ?);";
+
+static const char flush_used_tables_sql[] = "INSERT INTO "USED_TABLES_TABLE_NAME
+                                            " SELECT * FROM "MEMORY_TABLE_NAME";";
+
+static const char clear_used_tables_sql[] = "DELETE FROM "MEMORY_TABLE_NAME";";
+
+/**
+ * @brief Prepare the statements that update the index
+ *
+ * The statements are prepared once and reused with new values bound to them.
+ *
+ * @param router Avro router instance
+ * @return True if all statements were prepared
+ */
+bool avro_index_prepare(AVRO_INSTANCE *router)
+{
+    struct
+    {
+        const char *sql;
+        sqlite3_stmt **stmt;
+    } statements[] =
+    {
+        {insert_sql, &router->index_insert_stmt},
+        {timestamp_sql, &router->index_timestamp_stmt},
+        {position_sql, &router->index_position_stmt},
+        {progress_sql, &router->index_progress_stmt},
+        {used_table_sql, &router->used_table_stmt},
+        {flush_used_tables_sql, &router->used_tables_flush_stmt},
+        {clear_used_tables_sql, &router->used_tables_clear_stmt}
+    };
+
+    for (int i = 0; i < sizeof(statements) / sizeof(statements[0]); i++)
+    {
+        if (sqlite3_prepare_v2(router->sqlite_handle, statements[i].sql, -1,
+                               statements[i].stmt, NULL) != SQLITE_OK)
+        {
+            MXS_ERROR("Failed to prepare statement '%s': %s", statements[i].sql,
+                      sqlite3_errmsg(router->sqlite_handle));
+
+            while (i >= 0)
+            {
+                sqlite3_finalize(*statements[i].stmt);
+                *statements[i--].stmt = NULL;
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Execute a prepared statement that returns no rows
+ *
+ * The statement is reset and its values are cleared afterwards.
+ *
+ * @param router Avro router instance
+ * @param stmt The statement
+ * @return True if the statement was executed successfully
+ */
+static bool avro_index_exec(AVRO_INSTANCE *router, sqlite3_stmt *stmt)
+{
+    bool rval = sqlite3_step(stmt) == SQLITE_DONE;
+
+    if (!rval)
+    {
+        MXS_ERROR("Failed to execute '%s': %s", sqlite3_sql(stmt),
+                  sqlite3_errmsg(router->sqlite_handle));
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rval;
+}
 
 static void set_gtid(gtid_pos_t *gtid, json_t *row)
 {
@@ -54,21 +142,23 @@ static void set_gtid(gtid_pos_t *gtid, json_t *row)
     obj = json_object_get(row, avro_domain);
     ss_dassert(json_is_integer(obj));
     gtid->domain = json_integer_value(obj);
-}
 
-int index_query_cb(void *data, int rows, char** values, char** names)
-{
-    for (int i = 0; i < rows; i++)
-    {
-        if (values[i])
-        {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
-        }
-    }
-    return 0;
+    obj = json_object_get(row, avro_timestamp);
+    ss_dassert(json_is_integer(obj));
+    gtid->timestamp = json_integer_value(obj);
 }
 
+/**
+ * @brief Index the GTIDs of an Avro file
+ *
+ * The GTID and the timestamp of the first record in each data block are
+ * stored with the offset of the block. The indexing continues from where it ended the last time and
+ * stops at the last complete data block. The GTIDs and the new position are
+ * stored in one transaction.
+ *
+ * @param router Avro router instance
+ * @param filename Path to the Avro file
+ */
 void avro_index_file(AVRO_INSTANCE *router, const char* filename)
 {
     MAXAVRO_FILE *file = maxavro_file_open(filename);
@@ -79,26 +169,27 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
 
         if (name)
         {
-            char sql[AVRO_SQL_BUFFER_SIZE];
             char *errmsg;
             long pos = -1;
             name++;
 
-            snprintf(sql, sizeof(sql), "SELECT position FROM "INDEX_TABLE_NAME
-                     " WHERE filename=\"%s\";", name);
-            if (sqlite3_exec(router->sqlite_handle, sql, index_query_cb, &pos, &errmsg) != SQLITE_OK)
+            sqlite3_bind_text(router->index_position_stmt, 1, name, -1, SQLITE_STATIC);
+
+            if (sqlite3_step(router->index_position_stmt) == SQLITE_ROW)
             {
-                MXS_ERROR("Failed to read last indexed position of file '%s': %s",
-                          name, errmsg);
+                pos = sqlite3_column_int64(router->index_position_stmt, 0);
             }
-            else if (pos > 0)
+
+            sqlite3_reset(router->index_position_stmt);
+            sqlite3_clear_bindings(router->index_position_stmt);
+
+            if (pos > 0)
             {
                 /** Continue from last position */
                 maxavro_record_set_pos(file, pos);
             }
-            sqlite3_free(errmsg);
-            errmsg = NULL;
 
+            long start_pos = file->block_start_pos;
             gtid_pos_t prev_gtid = {0, 0, 0, 0, 0};
 
             if (sqlite3_exec(router->sqlite_handle, "BEGIN", NULL, NULL, &errmsg) != SQLITE_OK)
@@ -115,23 +206,36 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
                 {
                     gtid_pos_t gtid;
                     set_gtid(&gtid, row);
+                    json_decref(row);
+
+                    sqlite3_stmt *ts_stmt = router->index_timestamp_stmt;
+                    sqlite3_bind_text(ts_stmt, 1, name, -1, SQLITE_STATIC);
+                    sqlite3_bind_int64(ts_stmt, 2, file->block_start_pos);
+                    sqlite3_bind_int64(ts_stmt, 3, gtid.timestamp);
+
+                    if (!avro_index_exec(router, ts_stmt))
+                    {
+                        MXS_ERROR("Failed to insert timestamp %u for %s into index "
+                                  "database.", gtid.timestamp, name);
+                    }
 
                     if (prev_gtid.domain != gtid.domain ||
                         prev_gtid.server_id != gtid.server_id ||
                         prev_gtid.seq != gtid.seq)
                     {
-                        snprintf(sql, sizeof(sql), insert_template, gtid.domain,
-                                 gtid.server_id, gtid.seq, name, file->block_start_pos);
-                        if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                                         &errmsg) != SQLITE_OK)
+                        sqlite3_stmt *stmt = router->index_insert_stmt;
+                        sqlite3_bind_int64(stmt, 1, gtid.domain);
+                        sqlite3_bind_int64(stmt, 2, gtid.server_id);
+                        sqlite3_bind_int64(stmt, 3, gtid.seq);
+                        sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
+                        sqlite3_bind_int64(stmt, 5, file->block_start_pos);
+
+                        if (!avro_index_exec(router, stmt))
                         {
                             MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s "
-                                      "into index database: %s", gtid.domain,
-                                      gtid.server_id, gtid.seq, name, errmsg);
-
+                                      "into index database.", gtid.domain,
+                                      gtid.server_id, gtid.seq, name);
                         }
-                        sqlite3_free(errmsg);
-                        errmsg = NULL;
                         prev_gtid = gtid;
                     }
                 }
@@ -142,21 +246,22 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
             }
             while (maxavro_next_block(file));
 
-            if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
+            if (file->block_start_pos != start_pos)
             {
-                MXS_ERROR("Failed to commit transaction: %s", errmsg);
+                sqlite3_bind_int64(router->index_progress_stmt, 1, file->block_start_pos);
+                sqlite3_bind_text(router->index_progress_stmt, 2, name, -1, SQLITE_STATIC);
+
+                if (!avro_index_exec(router, router->index_progress_stmt))
+                {
+                    MXS_ERROR("Failed to update indexing progress of '%s'.", name);
+                }
             }
-            sqlite3_free(errmsg);
 
-            snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO "INDEX_TABLE_NAME
-                     " values (%lu, \"%s\");", file->block_start_pos, name);
-            if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                             &errmsg) != SQLITE_OK)
+            if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
             {
-                MXS_ERROR("Failed to update indexing progress: %s", errmsg);
+                MXS_ERROR("Failed to commit transaction: %s", errmsg);
             }
             sqlite3_free(errmsg);
-            errmsg = NULL;
         }
         else
         {
@@ -192,11 +297,6 @@ void avro_update_index(AVRO_INSTANCE* router)
     globfree(&files);
 }
 
-/** The SQL for the in-memory used_tables table */
-static const char *insert_sql = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
-                                "(domain, server_id, sequence, binlog_timestamp, table_name)"
-                                " VALUES (%lu, %lu, %lu, %lu, \"%s\")";
-
 /**
  * @brief Add a used table to the current transaction
  *
@@ -208,17 +308,19 @@ static const char *insert_sql = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
  */
 void add_used_table(AVRO_INSTANCE* router, char* table)
 {
-    char sql[AVRO_SQL_BUFFER_SIZE], *errmsg;
-    snprintf(sql, sizeof(sql), insert_sql, router->gtid.domain, router->gtid.server_id,
-             router->gtid.seq, router->gtid.timestamp, table);
+    sqlite3_stmt *stmt = router->used_table_stmt;
+    sqlite3_bind_int64(stmt, 1, router->gtid.domain);
+    sqlite3_bind_int64(stmt, 2, router->gtid.server_id);
+    sqlite3_bind_int64(stmt, 3, router->gtid.seq);
+    sqlite3_bind_int64(stmt, 4, router->gtid.timestamp);
+    sqlite3_bind_text(stmt, 5, table, -1, SQLITE_STATIC);
 
-    if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    if (!avro_index_exec(router, stmt))
     {
-        MXS_ERROR("Failed to add used table %s for GTID %lu-%lu-%lu: %s",
+        MXS_ERROR("Failed to add used table %s for GTID %lu-%lu-%lu.",
                   table, router->gtid.domain, router->gtid.server_id,
-                  router->gtid.seq, errmsg);
+                  router->gtid.seq);
     }
-    sqlite3_free(errmsg);
 }
 
 /**
@@ -233,17 +335,21 @@ void update_used_tables(AVRO_INSTANCE* router)
 {
     char *errmsg;
 
-    if (sqlite3_exec(router->sqlite_handle, "INSERT INTO "USED_TABLES_TABLE_NAME
-                     " SELECT * FROM "MEMORY_TABLE_NAME, NULL, NULL, &errmsg) != SQLITE_OK)
+    if (sqlite3_exec(router->sqlite_handle, "BEGIN", NULL, NULL, &errmsg) != SQLITE_OK)
     {
-        MXS_ERROR("Failed to transfer used table data from memory to disk: %s", errmsg);
+        MXS_ERROR("Failed to start transaction: %s", errmsg);
     }
     sqlite3_free(errmsg);
 
-    if (sqlite3_exec(router->sqlite_handle, "DELETE FROM "MEMORY_TABLE_NAME,
-                     NULL, NULL, &errmsg) != SQLITE_OK)
+    if (!avro_index_exec(router, router->used_tables_flush_stmt) ||
+        !avro_index_exec(router, router->used_tables_clear_stmt))
+    {
+        MXS_ERROR("Failed to transfer used table data from memory to disk.");
+    }
+
+    if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
     {
-        MXS_ERROR("Failed to transfer used table data from memory to disk: %s", errmsg);
+        MXS_ERROR("Failed to commit transaction: %s", errmsg);
     }
     sqlite3_free(errmsg);
 }
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_kafka.c - Publishing of the converted rows to Kafka
+ *
+ * Each record written to an Avro file is also published as JSON to a Kafka
+ * topic. The producer batches and compresses the messages in the background.
+ * The message key is the value of the first column of the table, which is
+ * usually the primary key, so the changes of a row stay in one partition.
+ *
+ * The conversion state is saved only after the broker has acknowledged all
+ * messages published before it. If a message could not be delivered, the
+ * state is not saved and the rows are converted and published again after
+ * a restart.
+ */
+
+#include <ctype.h>
+#include <avrorouter.h>
+#include <atomic.h>
+#include <log_manager.h>
+
+#ifdef HAVE_RDKAFKA
+
+#include <librdkafka/rdkafka.h>
+
+/** How long to wait for the acknowledgements before saving the state */
+#define AVRO_KAFKA_FLUSH_TIMEOUT_MS 30000
+
+/** A topic that rows were published to */
+typedef struct avro_kafka_topic
+{
+    char *name;
+    rd_kafka_topic_t *topic;
+    struct avro_kafka_topic *next;
+} AVRO_KAFKA_TOPIC;
+
+struct avro_kafka
+{
+    rd_kafka_t *producer;
+    char *topic; /*< Configured topic, NULL for a topic per table */
+    SPINLOCK lock; /*< Protects the topics */
+    AVRO_KAFKA_TOPIC *topics;
+    int failed; /*< Messages that were not delivered */
+    int n_produced; /*< Messages given to the producer */
+    int n_delivered; /*< Messages acknowledged by the broker */
+    int n_failed; /*< Messages that could not be delivered */
+};
+
+/**
+ * Delivery report callback, called from rd_kafka_poll() and rd_kafka_flush()
+ */
+static void delivery_cb(rd_kafka_t *rk, const rd_kafka_message_t *msg, void *opaque)
+{
+    AVRO_KAFKA *kafka = (AVRO_KAFKA*)opaque;
+
+    if (msg->err)
+    {
+        MXS_ERROR("Failed to publish a row to Kafka topic '%s': %s",
+                  rd_kafka_topic_name(msg->rkt), rd_kafka_err2str(msg->err));
+        atomic_add(&kafka->failed, 1);
+        atomic_add(&kafka->n_failed, 1);
+    }
+    else
+    {
+        atomic_add(&kafka->n_delivered, 1);
+    }
+}
+
+/**
+ * Set a producer configuration value
+ */
+static bool set_conf(rd_kafka_conf_t *conf, const char *key, const char *value)
+{
+    char err[512];
+
+    if (rd_kafka_conf_set(conf, key, value, err, sizeof(err)) != RD_KAFKA_CONF_OK)
+    {
+        MXS_ERROR("Failed to set Kafka option '%s' to '%s': %s", key, value, err);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Create a Kafka producer
+ *
+ * @param brokers Brokers separated by whitespace
+ * @param topic The topic where all rows are published, NULL to publish the
+ * rows of each table to a topic named after the table
+ * @param compression Compression codec of the message batches
+ * @param batch_ms How long the messages are batched in milliseconds
+ * @return New producer or NULL on error
+ */
+AVRO_KAFKA* avro_kafka_alloc(const char *brokers, const char *topic,
+                             const char *compression, int batch_ms)
+{
+    AVRO_KAFKA *kafka = calloc(1, sizeof(AVRO_KAFKA));
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char broker_list[strlen(brokers) + 1];
+    char linger[32];
+    char err[512];
+
+    /** The router options are separated by commas */
+    strcpy(broker_list, brokers);
+    for (char *ptr = broker_list; *ptr; ptr++)
+    {
+        if (isspace(*ptr))
+        {
+            *ptr = ',';
+        }
+    }
+
+    snprintf(linger, sizeof(linger), "%d", batch_ms);
+
+    if (kafka == NULL || conf == NULL || (topic && (kafka->topic = strdup(topic)) == NULL))
+    {
+        MXS_ERROR("Failed to allocate memory for the Kafka producer.");
+    }
+    else if (set_conf(conf, "bootstrap.servers", broker_list) &&
+             set_conf(conf, "compression.codec", compression) &&
+             set_conf(conf, "queue.buffering.max.ms", linger))
+    {
+        spinlock_init(&kafka->lock);
+        rd_kafka_conf_set_opaque(conf, kafka);
+        rd_kafka_conf_set_dr_msg_cb(conf, delivery_cb);
+
+        if ((kafka->producer = rd_kafka_new(RD_KAFKA_PRODUCER, conf, err, sizeof(err))))
+        {
+            /** The producer owns the configuration */
+            return kafka;
+        }
+
+        MXS_ERROR("Failed to create Kafka producer: %s", err);
+    }
+
+    if (conf)
+    {
+        rd_kafka_conf_destroy(conf);
+    }
+
+    if (kafka)
+    {
+        free(kafka->topic);
+        free(kafka);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Wait for the published rows and free the producer
+ *
+ * @param kafka Producer to free
+ */
+void avro_kafka_free(AVRO_KAFKA *kafka)
+{
+    if (kafka)
+    {
+        rd_kafka_flush(kafka->producer, AVRO_KAFKA_FLUSH_TIMEOUT_MS);
+
+        while (kafka->topics)
+        {
+            AVRO_KAFKA_TOPIC *topic = kafka->topics;
+            kafka->topics = topic->next;
+            rd_kafka_topic_destroy(topic->topic);
+            free(topic->name);
+            free(topic);
+        }
+
+        rd_kafka_destroy(kafka->producer);
+        free(kafka->topic);
+        free(kafka);
+    }
+}
+
+/**
+ * @brief Get the topic handle for a table
+ *
+ * @param kafka Producer
+ * @param name Name of the topic
+ * @return The topic or NULL on error
+ */
+static rd_kafka_topic_t* get_topic(AVRO_KAFKA *kafka, const char *name)
+{
+    rd_kafka_topic_t *rval = NULL;
+
+    spinlock_acquire(&kafka->lock);
+
+    for (AVRO_KAFKA_TOPIC *topic = kafka->topics; topic; topic = topic->next)
+    {
+        if (strcmp(topic->name, name) == 0)
+        {
+            rval = topic->topic;
+            break;
+        }
+    }
+
+    if (rval == NULL)
+    {
+        AVRO_KAFKA_TOPIC *topic = malloc(sizeof(AVRO_KAFKA_TOPIC));
+
+        if (topic && (topic->name = strdup(name)) &&
+            (topic->topic = rd_kafka_topic_new(kafka->producer, name, NULL)))
+        {
+            topic->next = kafka->topics;
+            kafka->topics = topic;
+            rval = topic->topic;
+        }
+        else
+        {
+            MXS_ERROR("Failed to create Kafka topic '%s': %s", name,
+                      rd_kafka_err2str(rd_kafka_last_error()));
+            if (topic)
+            {
+                free(topic->name);
+                free(topic);
+            }
+        }
+    }
+
+    spinlock_release(&kafka->lock);
+
+    return rval;
+}
+
+/**
+ * @brief Extract the table identifier from the name of its Avro file
+ *
+ * @param filename Path to the Avro file, db.table.000001.avro
+ * @param dest Where the db.table identifier is stored
+ * @param size Size of @c dest
+ */
+static void table_ident_from_file(const char *filename, char *dest, size_t size)
+{
+    const char *start = strrchr(filename, '/');
+    start = start ? start + 1 : filename;
+    const char *end = start + strlen(start);
+
+    /** Skip the .avro suffix and the version number */
+    for (int i = 0; i < 2 && end > start; i++)
+    {
+        while (end > start && *end != '.')
+        {
+            end--;
+        }
+
+        if (i == 0 && end > start)
+        {
+            end--;
+        }
+    }
+
+    snprintf(dest, size, "%.*s", (int)(end - start), start);
+}
+
+/**
+ * @brief Publish a record
+ *
+ * The record is converted to JSON and given to the producer which sends it
+ * in the background. This is called by the conversion threads after the
+ * record has been numbered.
+ *
+ * @param kafka Producer
+ * @param table Avro file of the record
+ * @param record The record to publish
+ */
+void avro_kafka_produce(AVRO_KAFKA *kafka, AVRO_TABLE *table, avro_value_t *record)
+{
+    char ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
+    const char *name = kafka->topic;
+
+    if (name == NULL)
+    {
+        table_ident_from_file(table->filename, ident, sizeof(ident));
+        name = ident;
+    }
+
+    rd_kafka_topic_t *topic = get_topic(kafka, name);
+    char *json;
+
+    if (topic == NULL || avro_value_to_json(record, 1, &json))
+    {
+        atomic_add(&kafka->failed, 1);
+        return;
+    }
+
+    avro_value_t field;
+    char *key = NULL;
+
+    if (avro_value_get_by_index(record, AVRO_FIRST_COLUMN_FIELD, &field, NULL) == 0)
+    {
+        avro_value_to_json(&field, 1, &key);
+    }
+
+    /** The producer frees the JSON once it has been sent */
+    while (rd_kafka_produce(topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_FREE,
+                            json, strlen(json), key, key ? strlen(key) : 0, NULL) == -1)
+    {
+        if (rd_kafka_last_error() != RD_KAFKA_RESP_ERR__QUEUE_FULL)
+        {
+            MXS_ERROR("Failed to publish a row to Kafka topic '%s': %s", name,
+                      rd_kafka_err2str(rd_kafka_last_error()));
+            atomic_add(&kafka->failed, 1);
+            free(json);
+            free(key);
+            return;
+        }
+
+        /** The local queue is full, wait for the broker to catch up */
+        rd_kafka_poll(kafka->producer, 100);
+    }
+
+    free(key);
+    atomic_add(&kafka->n_produced, 1);
+    rd_kafka_poll(kafka->producer, 0);
+}
+
+/**
+ * @brief Wait until the broker has acknowledged the published rows
+ *
+ * @param kafka Producer
+ * @return True if all published rows were delivered
+ */
+bool avro_kafka_flush(AVRO_KAFKA *kafka)
+{
+    rd_kafka_resp_err_t err = rd_kafka_flush(kafka->producer, AVRO_KAFKA_FLUSH_TIMEOUT_MS);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+    {
+        MXS_ERROR("Kafka broker did not acknowledge the published rows: %s",
+                  rd_kafka_err2str(err));
+        return false;
+    }
+
+    /** The rows that failed are published again only after a restart */
+    return kafka->failed == 0;
+}
+
+/**
+ * @brief Print the producer statistics
+ *
+ * @param kafka Producer
+ * @param dcb DCB to print to
+ */
+void avro_kafka_diagnostics(AVRO_KAFKA *kafka, DCB *dcb)
+{
+    dcb_printf(dcb, "\tKafka topic:                         %s\n",
+               kafka->topic ? kafka->topic : "Table name");
+    dcb_printf(dcb, "\tRows published to Kafka:             %d\n", kafka->n_produced);
+    dcb_printf(dcb, "\tRows acknowledged by Kafka:          %d\n", kafka->n_delivered);
+    dcb_printf(dcb, "\tRows not delivered to Kafka:         %d\n", kafka->n_failed);
+}
+
+#else
+
+AVRO_KAFKA* avro_kafka_alloc(const char *brokers, const char *topic,
+                             const char *compression, int batch_ms)
+{
+    MXS_ERROR("MaxScale was built without librdkafka, rows cannot be published to Kafka.");
+    return NULL;
+}
+
+void avro_kafka_free(AVRO_KAFKA *kafka)
+{
+}
+
+void avro_kafka_produce(AVRO_KAFKA *kafka, AVRO_TABLE *table, avro_value_t *record)
+{
+}
+
+bool avro_kafka_flush(AVRO_KAFKA *kafka)
+{
+    return true;
+}
+
+void avro_kafka_diagnostics(AVRO_KAFKA *kafka, DCB *dcb)
+{
+}
+
+#endif
@@ -103,8 +103,11 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
                              router->avrodir, table_ident, map->version);
 
                     /** Close the file and open a new one */
+                    avro_workers_wait(router);
                     hashtable_delete(router->open_tables, table_ident);
-                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema);
+                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema,
+                                                               router->codec,
+                                                               router->block_size);
 
                     if (avro_table)
                     {
@@ -170,27 +173,27 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
  * This sets the domain, server ID, sequence and event position fields of
  * the GTID. It also sets the event timestamp and event type fields.
  *
- * @param router Avro router instance
+ * @param gtid GTID of the record
  * @param hdr Replication header
  * @param event_type Event type
  * @param record Record to prepare
  */
-static void prepare_record(AVRO_INSTANCE *router, REP_HEADER *hdr,
+static void prepare_record(gtid_pos_t *gtid, REP_HEADER *hdr,
                            int event_type, avro_value_t *record)
 {
     avro_value_t field;
     avro_value_get_by_name(record, avro_domain, &field, NULL);
-    avro_value_set_int(&field, router->gtid.domain);
+    avro_value_set_int(&field, gtid->domain);
 
     avro_value_get_by_name(record, avro_server_id, &field, NULL);
-    avro_value_set_int(&field, router->gtid.server_id);
+    avro_value_set_int(&field, gtid->server_id);
 
     avro_value_get_by_name(record, avro_sequence, &field, NULL);
-    avro_value_set_int(&field, router->gtid.seq);
+    avro_value_set_int(&field, gtid->seq);
 
-    router->gtid.event_num++;
+    gtid->event_num++;
     avro_value_get_by_name(record, avro_event_number, &field, NULL);
-    avro_value_set_int(&field, router->gtid.event_num);
+    avro_value_set_int(&field, gtid->event_num);
 
     avro_value_get_by_name(record, avro_timestamp, &field, NULL);
     avro_value_set_int(&field, hdr->timestamp);
@@ -205,14 +208,18 @@ static void prepare_record(AVRO_INSTANCE *router, REP_HEADER *hdr,
  * These events contain the changes in the data. This function assumes that full
  * row image is sent in every row event.
  *
+ * If there are conversion threads, the rows are converted by the thread
+ * that handles the table.
+ *
  * @param router Avro router instance
  * @param hdr Replication header
- * @param ptr Pointer to the start of the event
+ * @param event The event without the header
  * @return True on succcess, false on error
  */
-bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
+bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, GWBUF *event)
 {
     bool rval = false;
+    uint8_t *ptr = GWBUF_DATA(event);
     uint8_t *start = ptr;
     uint8_t table_id_size = router->event_type_hdr_lens[hdr->event_type] == 6 ? 4 : 6;
     uint64_t table_id = 0;
@@ -253,8 +260,7 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
      * the future partial row images could be used if the bitfield containing
      * the columns that are present in this event is used. */
     const int coldata_size = (ncolumns + 7) / 8;
-    uint8_t col_present[coldata_size];
-    memcpy(&col_present, ptr, coldata_size);
+    uint8_t *col_present = ptr;
     ptr += coldata_size;
 
     /** Update events have the before and after images of the row. This can be
@@ -280,7 +286,14 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
         AVRO_TABLE* table = hashtable_fetch(router->open_tables, table_ident);
         TABLE_CREATE* create = map->table_create;
 
-        if (table && create && ncolumns == map->columns)
+        if (table && create && ncolumns == map->columns && router->workers)
+        {
+            avro_worker_dispatch(router, hdr, event, table_ident, map, table,
+                                 ptr, col_present);
+            add_used_table(router, table_ident);
+            rval = true;
+        }
+        else if (table && create && ncolumns == map->columns)
         {
             avro_value_t record;
             avro_generic_value_new(table->avro_writer_iface, &record);
@@ -293,18 +306,28 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
             {
                 /** Add the current GTID and timestamp */
                 int event_type = get_event_type(hdr->event_type);
-                prepare_record(router, hdr, event_type, &record);
+                prepare_record(&router->gtid, hdr, event_type, &record);
                 ptr = process_row_event_data(map, create, &record, ptr, col_present);
-                avro_file_writer_append_value(table->avro_file, &record);
+                avro_table_append(table, &record);
+
+                if (router->kafka)
+                {
+                    avro_kafka_produce(router->kafka, table, &record);
+                }
 
                 /** Update rows events have the before and after images of the
                  * affected rows so we'll process them as another record with
                  * a different type */
                 if (event_type == UPDATE_EVENT)
                 {
-                    prepare_record(router, hdr, UPDATE_EVENT_AFTER, &record);
+                    prepare_record(&router->gtid, hdr, UPDATE_EVENT_AFTER, &record);
                     ptr = process_row_event_data(map, create, &record, ptr, col_present);
-                    avro_file_writer_append_value(table->avro_file, &record);
+                    avro_table_append(table, &record);
+
+                    if (router->kafka)
+                    {
+                        avro_kafka_produce(router->kafka, table, &record);
+                    }
                 }
 
                 rows++;
@@ -341,116 +364,225 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
 }
 
 /**
- * @brief Unpack numeric types
+ * @brief Convert the rows of a row event into Avro records
  *
- * Convert the stored value into an Avro value and pack it in the record.
+ * The records are numbered and written with avro_write_rows().
  *
- * @param field Avro value in a record
- * @param type Type of the field
- * @param metadata Field metadata
- * @param value Pointer to the start of the in-memory representation of the data
+ * @param job The row event
+ * @param rows Where the converted rows are stored
+ * @return Number of converted rows, the after images of updates counted separately
  */
-void set_numeric_field_value(avro_value_t *field, uint8_t type, uint8_t *metadata, uint8_t *value)
+int avro_decode_rows(AVRO_JOB *job, AVRO_ROW **rows)
 {
-    int64_t i = 0;
-
-    switch (type)
+    uint8_t *start = GWBUF_DATA(job->event);
+    uint8_t *ptr = job->rows;
+    int event_type = get_event_type(job->hdr.event_type);
+    int images = event_type == UPDATE_EVENT ? 2 : 1;
+    AVRO_ROW *converted = NULL;
+    int size = 0;
+    int n = 0;
+
+    while (ptr - start < job->hdr.event_size - BINLOG_EVENT_HDR_LEN)
     {
-        case TABLE_COL_TYPE_TINY:
-            i = *value;
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_SHORT:
-            memcpy(&i, value, 2);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_INT24:
-            memcpy(&i, value, 3);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_LONG:
-            memcpy(&i, value, 4);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_LONGLONG:
-            memcpy(&i, value, 8);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_FLOAT:
-            memcpy(&i, value, 4);
-            avro_value_set_float(field, (float)i);
-            break;
-
-        case TABLE_COL_TYPE_DOUBLE:
-            memcpy(&i, value, 8);
-            avro_value_set_float(field, (double)i);
-            break;
+        if (n + images > size)
+        {
+            int new_size = size ? size * 2 : 16;
+            AVRO_ROW *tmp = realloc(converted, new_size * sizeof(AVRO_ROW));
 
-        default:
-            break;
+            if (tmp == NULL)
+            {
+                MXS_ERROR("Failed to allocate memory for converting the rows of %s.%s.",
+                          job->map->database, job->map->table);
+                break;
+            }
+
+            converted = tmp;
+            size = new_size;
+        }
+
+        for (int i = 0; i < images; i++)
+        {
+            AVRO_ROW *row = &converted[n++];
+            avro_generic_value_new(job->table->avro_writer_iface, &row->record);
+            row->event_type = i == 0 ? event_type : UPDATE_EVENT_AFTER;
+            ptr = process_row_event_data(job->map, job->map->table_create, &row->record,
+                                         ptr, job->columns_present);
+        }
     }
+
+    *rows = converted;
+    return n;
 }
 
 /**
- * @brief Check if a bit is set
+ * @brief Number converted rows and write them to the Avro file
  *
- * @param ptr Pointer to start of bitfield
- * @param columns Number of columns (bits)
- * @param current_column Zero indexed column number
- * @return True if the bit is set
+ * The rows are also published to Kafka if a producer is configured.
+ *
+ * @param router Avro router instance
+ * @param gtid GTID of the rows, the event number is increased for each row
+ * @param hdr Replication header of the row event
+ * @param table Avro file of the table
+ * @param rows Rows from avro_decode_rows(), freed by this function
+ * @param n Number of rows
  */
-static bool bit_is_set(uint8_t *ptr, int columns, int current_column)
+void avro_write_rows(AVRO_INSTANCE *router, gtid_pos_t *gtid, REP_HEADER *hdr,
+                     AVRO_TABLE *table, AVRO_ROW *rows, int n)
 {
-    if (current_column >= 8)
+    for (int i = 0; i < n; i++)
     {
-        ptr += current_column / 8;
-        current_column = current_column % 8;
+        prepare_record(gtid, hdr, rows[i].event_type, &rows[i].record);
+        avro_table_append(table, &rows[i].record);
+
+        if (router->kafka)
+        {
+            avro_kafka_produce(router->kafka, table, &rows[i].record);
+        }
+        avro_value_decref(&rows[i].record);
     }
 
-    return ((*ptr) & (1 << current_column));
+    free(rows);
 }
 
 /**
- * @brief Get the length of the metadata for a particular field
+ * @brief Set the value of a column from the row image
  *
- * @param type Type of the field
- * @return Length of the metadata for this field
+ * @param col Decoding plan of the column
+ * @param field Avro value of the column
+ * @param ptr Pointer to the value in the row image
+ * @param extra_bits BIT values stored in the NULL bitmap that are still unused
+ * @return Pointer to the first byte after the value
  */
-int get_metadata_len(uint8_t type)
+static inline uint8_t* decode_column(COLUMN_PLAN *col, avro_value_t *field, uint8_t *ptr,
+                                     int *extra_bits)
 {
-    switch (type)
+    switch (col->kind)
     {
-        case TABLE_COL_TYPE_STRING:
-        case TABLE_COL_TYPE_VAR_STRING:
-        case TABLE_COL_TYPE_VARCHAR:
-        case TABLE_COL_TYPE_DECIMAL:
-        case TABLE_COL_TYPE_NEWDECIMAL:
-        case TABLE_COL_TYPE_ENUM:
-        case TABLE_COL_TYPE_SET:
-        case TABLE_COL_TYPE_BIT:
-            return 2;
-
-        case TABLE_COL_TYPE_BLOB:
-        case TABLE_COL_TYPE_FLOAT:
-        case TABLE_COL_TYPE_DOUBLE:
-        case TABLE_COL_TYPE_DATETIME2:
-        case TABLE_COL_TYPE_TIMESTAMP2:
-        case TABLE_COL_TYPE_TIME2:
-            return 1;
+        case COLUMN_KIND_INT:
+            {
+                int32_t i = 0;
+                memcpy(&i, ptr, col->size);
+                avro_value_set_int(field, i);
+            }
+            return ptr + col->size;
 
-        default:
-            return 0;
+        case COLUMN_KIND_LONG:
+            {
+                int64_t l;
+                memcpy(&l, ptr, sizeof(l));
+                avro_value_set_long(field, l);
+            }
+            return ptr + sizeof(int64_t);
+
+        case COLUMN_KIND_FLOAT:
+            {
+                float f;
+                memcpy(&f, ptr, sizeof(f));
+                avro_value_set_float(field, f);
+            }
+            return ptr + sizeof(float);
+
+        case COLUMN_KIND_DOUBLE:
+            {
+                double d;
+                memcpy(&d, ptr, sizeof(d));
+                avro_value_set_double(field, d);
+            }
+            return ptr + sizeof(double);
+
+        case COLUMN_KIND_STRING:
+            {
+                uint8_t bytes = *ptr;
+                char str[bytes + 1];
+                memcpy(str, ptr + 1, bytes);
+                str[bytes] = '\0';
+                avro_value_set_string(field, str);
+                return ptr + bytes + 1;
+            }
+
+        case COLUMN_KIND_ENUM:
+            {
+                /** Right now only ENUMs/SETs with less than 256 values
+                 * are printed correctly */
+                char strval[32];
+                snprintf(strval, sizeof(strval), "%hhu", *ptr);
+                if (col->size > 1 && !warn_large_enumset)
+                {
+                    warn_large_enumset = true;
+                    MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
+                }
+                avro_value_set_string(field, strval);
+            }
+            return ptr + col->size;
+
+        case COLUMN_KIND_VARSTRING:
+            {
+                size_t sz;
+                char *str = lestr_consume(&ptr, &sz);
+                char buf[sz + 1];
+                memcpy(buf, str, sz);
+                buf[sz] = '\0';
+                avro_value_set_string(field, buf);
+            }
+            return ptr;
+
+        case COLUMN_KIND_BLOB:
+            {
+                uint64_t len = 0;
+                memcpy(&len, ptr, col->size);
+                ptr += col->size;
+                avro_value_set_bytes(field, ptr, len);
+                return ptr + len;
+            }
+
+        case COLUMN_KIND_TEMPORAL:
+            {
+                char buf[80];
+                struct tm tm;
+                ptr += unpack_temporal_value(col->type, ptr, col->metadata, &tm);
+                format_temporal_value(buf, sizeof(buf), col->type, &tm);
+                avro_value_set_string(field, buf);
+            }
+            return ptr;
+
+        case COLUMN_KIND_BIT:
+            {
+                int width = col->metadata[0] + col->metadata[1] * 8;
+                int bits_in_nullmap = MIN(width, *extra_bits);
+                *extra_bits -= bits_in_nullmap;
+                width -= bits_in_nullmap;
+
+                // TODO: extract the bytes
+                if (!warn_bit)
+                {
+                    warn_bit = true;
+                    MXS_WARNING("BIT is not currently supported, values are stored as 0.");
+                }
+                avro_value_set_int(field, 0);
+                return ptr + width / 8;
+            }
+
+        case COLUMN_KIND_DECIMAL:
+            // TODO: Add support for DECIMAL
+            if (!warn_decimal)
+            {
+                warn_decimal = true;
+                MXS_WARNING("DECIMAL is not currently supported, values are stored as 0.");
+            }
+            avro_value_set_int(field, 0);
+            return ptr + col->size;
     }
+
+    ss_dassert(false);
+    return ptr;
 }
 
 /**
  * @brief Extract the values from a single row  in a row event
  *
+ * The columns are decoded with the plan created from the table map event. The
+ * NULL and present column bitmaps are read 64 columns at a time.
+ *
  * @param map Table map event associated with this row
  * @param create Table creation associated with this row
  * @param record Avro record used for storing this row
@@ -462,11 +594,8 @@ int get_metadata_len(uint8_t type)
 uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value_t *record,
                                 uint8_t *ptr, uint8_t *columns_present)
 {
-    int npresent = 0;
+    uint64_t ncolumns = map->columns;
     avro_value_t field;
-    long ncolumns = map->columns;
-    uint8_t *metadata = map->column_metadata;
-    size_t metadata_offset = 0;
 
     /** BIT type values use the extra bits in the row event header */
     int extra_bits = (((ncolumns + 7) / 8) * 8) - ncolumns;
@@ -475,127 +604,30 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
     uint8_t *null_bitmap = ptr;
     ptr += (ncolumns + 7) / 8;
 
-    for (long i = 0; i < map->columns && npresent < ncolumns; i++)
+    ss_dassert(create->columns == map->columns);
+
+    for (uint64_t first = 0; first < ncolumns; first += 64)
     {
-        ss_dassert(create->columns == map->columns);
-        avro_value_get_by_name(record, create->column_names[i], &field, NULL);
+        uint64_t present = column_bitmap_word(columns_present, ncolumns, first);
+        uint64_t nulls = column_bitmap_word(null_bitmap, ncolumns, first) & present;
+        uint64_t last = MIN(ncolumns - first, 64);
 
-        if (bit_is_set(columns_present, ncolumns, i))
+        for (uint64_t bit = 0; bit < last; bit++)
         {
-            npresent++;
-            if (bit_is_set(null_bitmap, ncolumns, i))
+            if (present & (1ULL << bit))
             {
-                avro_value_set_null(&field);
-            }
-            else if (column_is_fixed_string(map->column_types[i]))
-            {
-                /** ENUM and SET are stored as STRING types with the type stored
-                 * in the metadata. */
-                if (fixed_string_is_enum(metadata[metadata_offset]))
-                {
-                    uint8_t val[metadata[metadata_offset + 1]];
-                    uint64_t bytes = unpack_enum(ptr, &metadata[metadata_offset], val);
-                    char strval[32];
-
-                    /** Right now only ENUMs/SETs with less than 256 values
-                     * are printed correctly */
-                    snprintf(strval, sizeof(strval), "%hhu", val[0]);
-                    if (bytes > 1 && warn_large_enumset)
-                    {
-                        warn_large_enumset = true;
-                        MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
-                    }
-                    avro_value_set_string(&field, strval);
-                    ptr += bytes;
-                }
-                else
-                {
-                    uint8_t bytes = *ptr;
-                    char str[bytes + 1];
-                    memcpy(str, ptr + 1, bytes);
-                    str[bytes] = '\0';
-                    avro_value_set_string(&field, str);
-                    ptr += bytes + 1;
-                }
-            }
-            else if (column_is_bit(map->column_types[i]))
-            {
-                uint64_t value = 0;
-                int width = metadata[metadata_offset] + metadata[metadata_offset + 1] * 8;
-                int bits_in_nullmap = MIN(width, extra_bits);
-                extra_bits -= bits_in_nullmap;
-                width -= bits_in_nullmap;
-                size_t bytes = width / 8;
+                uint64_t i = first + bit;
+                avro_value_get_by_index(record, AVRO_FIRST_COLUMN_FIELD + i, &field, NULL);
 
-                // TODO: extract the bytes
-                if (!warn_bit)
+                if (nulls & (1ULL << bit))
                 {
-                    warn_bit = true;
-                    MXS_WARNING("BIT is not currently supported, values are stored as 0.");
+                    avro_value_set_null(&field);
                 }
-                avro_value_set_int(&field, value);
-                ptr += bytes;
-            }
-            else if (column_is_decimal(map->column_types[i]))
-            {
-                const int dec_dig = 9;
-                int precision = metadata[metadata_offset];
-                int decimals = metadata[metadata_offset + 1];
-                int dig_bytes[] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
-                int ipart = precision - decimals;
-                int ipart1 = ipart / dec_dig;
-                int fpart1 = decimals / dec_dig;
-                int ipart2 = ipart - ipart1 * dec_dig;
-                int fpart2 = decimals - fpart1 * dec_dig;
-                int ibytes = ipart1 * 4 + dig_bytes[ipart2];
-                int fbytes = fpart1 * 4 + dig_bytes[fpart2];
-                ptr += ibytes + fbytes;
-
-                // TODO: Add support for DECIMAL
-                if (!warn_decimal)
+                else
                 {
-                    warn_decimal = true;
-                    MXS_WARNING("DECIMAL is not currently supported, values are stored as 0.");
+                    ptr = decode_column(&map->column_plan[i], &field, ptr, &extra_bits);
                 }
-                avro_value_set_int(&field, 0);
-            }
-            else if (column_is_variable_string(map->column_types[i]))
-            {
-                size_t sz;
-                char *str = lestr_consume(&ptr, &sz);
-                char buf[sz + 1];
-                memcpy(buf, str, sz);
-                buf[sz] = '\0';
-                avro_value_set_string(&field, buf);
-            }
-            else if (column_is_blob(map->column_types[i]))
-            {
-                uint8_t bytes = metadata[metadata_offset];
-                uint64_t len = 0;
-                memcpy(&len, ptr, bytes);
-                ptr += bytes;
-                avro_value_set_bytes(&field, ptr, len);
-                ptr += len;
-            }
-            else if (column_is_temporal(map->column_types[i]))
-            {
-                char buf[80];
-                struct tm tm;
-                ptr += unpack_temporal_value(map->column_types[i], ptr, &metadata[metadata_offset], &tm);
-                format_temporal_value(buf, sizeof(buf), map->column_types[i], &tm);
-                avro_value_set_string(&field, buf);
-            }
-            /** All numeric types (INT, LONG, FLOAT etc.) */
-            else
-            {
-                uint8_t lval[16];
-                memset(lval, 0, sizeof(lval));
-                ptr += unpack_numeric_field(ptr, map->column_types[i],
-                                            &metadata[metadata_offset], lval);
-                set_numeric_field_value(&field, map->column_types[i], &metadata[metadata_offset], lval);
             }
-            ss_dassert(metadata_offset <= map->column_metadata_size);
-            metadata_offset += get_metadata_len(map->column_types[i]);
         }
     }
 
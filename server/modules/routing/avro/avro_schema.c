@@ -979,14 +979,18 @@ TABLE_MAP *table_map_alloc(uint8_t *ptr, uint8_t hdr_len, TABLE_CREATE* create)
         map->database = strdup(schema_name);
         map->table = strdup(table_name);
         map->table_create = create;
+        map->column_plan = NULL;
         if (map->column_types && map->database && map->table &&
             map->column_metadata && map->null_bitmap)
         {
             memcpy(map->column_types, column_types, column_count);
             memcpy(map->null_bitmap, nullmap, nullmap_size);
             memcpy(map->column_metadata, metadata, metadata_size);
+            map->column_plan = column_plan_alloc(map->column_types, column_count,
+                                                 map->column_metadata, metadata_size);
         }
-        else
+
+        if (map->column_plan == NULL)
         {
             free(map->null_bitmap);
             free(map->column_metadata);
@@ -1014,6 +1018,9 @@ void* table_map_free(TABLE_MAP *map)
 {
     if (map)
     {
+        free(map->column_plan);
+        free(map->column_metadata);
+        free(map->null_bitmap);
         free(map->column_types);
         free(map->database);
         free(map->table);
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_shared.c - Data blocks shared by the clients
+ *
+ * The clients that stream JSON convert each data block of the Avro file they
+ * read. When many clients follow the same tables, they would convert the same
+ * blocks. The most recently converted blocks of each file are kept in memory
+ * and the clients that reach a block that another client has already
+ * converted send the same buffer. A client that falls behind the kept blocks
+ * converts the blocks itself.
+ *
+ * The blocks of a file are kept as long as some client reads the file.
+ */
+
+#include <avrorouter.h>
+#include <log_manager.h>
+
+/**
+ * @brief Start sharing the blocks of a file
+ *
+ * @param router Avro router instance
+ * @param name Name of the file without the directory
+ * @return The shared file or NULL if blocks are not shared
+ */
+AVRO_SHARED_FILE* avro_shared_acquire(AVRO_INSTANCE *router, const char *name)
+{
+    if (router->shared_blocks <= 0)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&router->shared_lock);
+
+    AVRO_SHARED_FILE *file = router->shared_files;
+
+    while (file && strcmp(file->name, name) != 0)
+    {
+        file = file->next;
+    }
+
+    if (file == NULL && (file = calloc(1, sizeof(AVRO_SHARED_FILE))))
+    {
+        if ((file->blocks = calloc(router->shared_blocks, sizeof(AVRO_SHARED_BLOCK))))
+        {
+            strncpy(file->name, name, sizeof(file->name) - 1);
+            file->next = router->shared_files;
+            router->shared_files = file;
+        }
+        else
+        {
+            free(file);
+            file = NULL;
+        }
+    }
+
+    if (file)
+    {
+        file->refcount++;
+    }
+
+    spinlock_release(&router->shared_lock);
+
+    if (file == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the shared blocks of '%s'.",
+                  router->service->name, name);
+    }
+
+    return file;
+}
+
+/**
+ * @brief Stop sharing the blocks of a file
+ *
+ * The blocks are freed when the last client stops reading the file.
+ *
+ * @param router Avro router instance
+ * @param file The shared file, may be NULL
+ */
+void avro_shared_release(AVRO_INSTANCE *router, AVRO_SHARED_FILE *file)
+{
+    if (file == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&router->shared_lock);
+
+    if (--file->refcount == 0)
+    {
+        AVRO_SHARED_FILE **prev = &router->shared_files;
+
+        while (*prev != file)
+        {
+            prev = &(*prev)->next;
+        }
+
+        *prev = file->next;
+    }
+    else
+    {
+        file = NULL;
+    }
+
+    spinlock_release(&router->shared_lock);
+
+    if (file)
+    {
+        for (int i = 0; i < router->shared_blocks; i++)
+        {
+            gwbuf_free(file->blocks[i].json);
+        }
+
+        free(file->blocks);
+        free(file);
+    }
+}
+
+/**
+ * @brief Find a converted block
+ *
+ * @param router Avro router instance
+ * @param file The shared file, may be NULL
+ * @param pos Offset of the block in the file
+ * @param dest Where the block is copied. The JSON is a clone of the shared
+ * buffer and the caller must free it.
+ * @return True if the block was found
+ */
+bool avro_shared_get(AVRO_INSTANCE *router, AVRO_SHARED_FILE *file, long pos,
+                     AVRO_SHARED_BLOCK *dest)
+{
+    bool rval = false;
+
+    if (file)
+    {
+        spinlock_acquire(&router->shared_lock);
+
+        for (int i = 0; i < router->shared_blocks; i++)
+        {
+            AVRO_SHARED_BLOCK *block = &file->blocks[i];
+
+            if (block->json && block->pos == pos)
+            {
+                *dest = *block;
+                rval = (dest->json = gwbuf_clone(block->json)) != NULL;
+                router->stats.n_shared_hits++;
+                break;
+            }
+        }
+
+        spinlock_release(&router->shared_lock);
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Share a converted block
+ *
+ * The block replaces the oldest one of the file unless another client has
+ * already shared it. The block is counted as converted by a client.
+ *
+ * @param router Avro router instance
+ * @param file The shared file, may be NULL
+ * @param block The block, its JSON is cloned
+ */
+void avro_shared_put(AVRO_INSTANCE *router, AVRO_SHARED_FILE *file, AVRO_SHARED_BLOCK *block)
+{
+    if (file == NULL)
+    {
+        return;
+    }
+
+    GWBUF *json = gwbuf_clone(block->json);
+    GWBUF *old = NULL;
+
+    if (json == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&router->shared_lock);
+
+    router->stats.n_shared_misses++;
+    int i;
+
+    for (i = 0; i < router->shared_blocks; i++)
+    {
+        if (file->blocks[i].json && file->blocks[i].pos == block->pos)
+        {
+            break;
+        }
+    }
+
+    if (i == router->shared_blocks)
+    {
+        AVRO_SHARED_BLOCK *slot = &file->blocks[file->oldest];
+        old = slot->json;
+        *slot = *block;
+        slot->json = json;
+        json = NULL;
+        file->oldest = (file->oldest + 1) % router->shared_blocks;
+    }
+
+    spinlock_release(&router->shared_lock);
+
+    gwbuf_free(old);
+    gwbuf_free(json);
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_worker.c - Parallel conversion of row events
+ *
+ * The thread reading the binlog files hands the row events to a set of
+ * worker threads. Each table is converted by one worker so that the records
+ * of a table are written in the order of the binlog. The workers convert the
+ * rows of their events in parallel and then take turns in the order of the
+ * binlog to number the records with the GTID event numbers.
+ *
+ * The reading thread waits for the workers to finish the events given to
+ * them before the conversion state is saved and before the table
+ * definitions are changed.
+ */
+
+#include <avrorouter.h>
+#include <thread.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+static void avro_worker_thread(void *data);
+
+/**
+ * @brief Start the conversion worker threads
+ *
+ * @param router Avro router instance
+ * @return True if the workers were started or none were configured
+ */
+bool avro_workers_start(AVRO_INSTANCE *router)
+{
+    if (router->n_workers == 0)
+    {
+        return true;
+    }
+
+    if ((router->workers = calloc(router->n_workers, sizeof(AVRO_WORKER))) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the conversion threads.",
+                  router->service->name);
+        router->n_workers = 0;
+        return false;
+    }
+
+    pthread_mutex_init(&router->order_lock, NULL);
+    pthread_cond_init(&router->order_cond, NULL);
+
+    for (int i = 0; i < router->n_workers; i++)
+    {
+        AVRO_WORKER *worker = &router->workers[i];
+        THREAD thr;
+
+        worker->router = router;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+
+        if (thread_start(&thr, avro_worker_thread, worker) == NULL)
+        {
+            MXS_ERROR("[%s] Failed to start conversion thread, using %d threads.",
+                      router->service->name, i);
+            router->n_workers = i;
+            break;
+        }
+        thread_detach(thr);
+    }
+
+    if (router->n_workers == 0)
+    {
+        free(router->workers);
+        router->workers = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Give a row event to the worker that converts the table
+ *
+ * @param router Avro router instance
+ * @param hdr Replication header
+ * @param event The event without the header, a reference is taken
+ * @param ident The table identifier
+ * @param map Table map of the table
+ * @param table Avro file of the table
+ * @param rows The first row in the event
+ * @param columns_present The bitfield of the columns present in the rows
+ */
+void avro_worker_dispatch(AVRO_INSTANCE *router, REP_HEADER *hdr, GWBUF *event,
+                          char *ident, TABLE_MAP *map, AVRO_TABLE *table,
+                          uint8_t *rows, uint8_t *columns_present)
+{
+    AVRO_WORKER *worker = &router->workers[(unsigned int)simple_str_hash(ident) % router->n_workers];
+    AVRO_JOB *job = malloc(sizeof(AVRO_JOB));
+
+    if (job == NULL)
+    {
+        /** The records are numbered in the order of the jobs, convert it here */
+        MXS_ERROR("Failed to allocate memory for row event conversion, "
+                  "converting the event in the reading thread.");
+        avro_workers_wait(router);
+        AVRO_JOB local = {*hdr, event, rows, columns_present, map, table, router->gtid, 0, NULL};
+        AVRO_ROW *converted;
+        int n = avro_decode_rows(&local, &converted);
+        avro_write_rows(router, &router->gtid, hdr, table, converted, n);
+
+        pthread_mutex_lock(&router->order_lock);
+        router->order_gtid = router->gtid;
+        pthread_mutex_unlock(&router->order_lock);
+        return;
+    }
+
+    job->hdr = *hdr;
+    job->event = gwbuf_clone(event);
+    job->rows = rows;
+    job->columns_present = columns_present;
+    job->map = map;
+    job->table = table;
+    job->gtid = router->gtid;
+    job->seqno = router->job_seqno++;
+    job->next = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->tail)
+    {
+        worker->tail->next = job;
+    }
+    else
+    {
+        worker->head = job;
+    }
+    worker->tail = job;
+    worker->pending++;
+
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * @brief Wait until the workers have written all events given to them
+ *
+ * After this the reading thread can change the tables and save the
+ * conversion state. The event number of the current GTID is updated with
+ * the records written by the workers.
+ *
+ * @param router Avro router instance
+ */
+void avro_workers_wait(AVRO_INSTANCE *router)
+{
+    for (int i = 0; i < router->n_workers; i++)
+    {
+        AVRO_WORKER *worker = &router->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+
+        while (worker->pending > 0)
+        {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    if (router->workers)
+    {
+        pthread_mutex_lock(&router->order_lock);
+
+        if (router->order_gtid.domain == router->gtid.domain &&
+            router->order_gtid.server_id == router->gtid.server_id &&
+            router->order_gtid.seq == router->gtid.seq)
+        {
+            router->gtid.event_num = router->order_gtid.event_num;
+        }
+
+        pthread_mutex_unlock(&router->order_lock);
+    }
+}
+
+/**
+ * @brief Reserve the event numbers for the records of a row event
+ *
+ * The row events are numbered in the order in which they were read.
+ *
+ * @param router Avro router instance
+ * @param job The row event
+ * @param n Number of records in the event
+ * @return The GTID of the event with the event number before its first record
+ */
+static gtid_pos_t avro_worker_number(AVRO_INSTANCE *router, AVRO_JOB *job, int n)
+{
+    gtid_pos_t gtid;
+
+    pthread_mutex_lock(&router->order_lock);
+
+    while (router->order_next != job->seqno)
+    {
+        pthread_cond_wait(&router->order_cond, &router->order_lock);
+    }
+
+    if (router->order_gtid.domain != job->gtid.domain ||
+        router->order_gtid.server_id != job->gtid.server_id ||
+        router->order_gtid.seq != job->gtid.seq)
+    {
+        router->order_gtid = job->gtid;
+        router->order_gtid.event_num = 0;
+    }
+
+    gtid = router->order_gtid;
+    gtid.timestamp = job->gtid.timestamp;
+    router->order_gtid.event_num += n;
+    router->order_next++;
+
+    pthread_cond_broadcast(&router->order_cond);
+    pthread_mutex_unlock(&router->order_lock);
+
+    return gtid;
+}
+
+/**
+ * @brief Conversion worker thread
+ *
+ * @param data The worker
+ */
+static void avro_worker_thread(void *data)
+{
+    AVRO_WORKER *worker = (AVRO_WORKER*)data;
+    AVRO_INSTANCE *router = worker->router;
+
+    while (true)
+    {
+        AVRO_JOB *job;
+
+        pthread_mutex_lock(&worker->lock);
+
+        while (worker->head == NULL)
+        {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+
+        job = worker->head;
+        worker->head = job->next;
+
+        if (worker->head == NULL)
+        {
+            worker->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+
+        AVRO_ROW *rows;
+        int n = avro_decode_rows(job, &rows);
+        gtid_pos_t gtid = avro_worker_number(router, job, n);
+        avro_write_rows(router, &gtid, &job->hdr, job->table, rows, n);
+
+        gwbuf_free(job->event);
+        free(job);
+
+        pthread_mutex_lock(&worker->lock);
+
+        if (--worker->pending == 0)
+        {
+            pthread_cond_broadcast(&worker->cond);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
@@ -240,8 +240,12 @@ createInstance(SERVICE *service, char **options)
     inst->files = NULL;
     spinlock_init(&inst->fileslock);
     spinlock_init(&inst->binlog_lock);
+    spinlock_init(&inst->wbuf_lock);
 
     inst->binlog_fd = -1;
+    inst->index_fd = -1;
+    inst->gtid_index = NULL;
+    spinlock_init(&inst->gtid_index_lock);
     inst->master_chksum = true;
     inst->master_uuid = NULL;
 
@@ -255,6 +259,13 @@ createInstance(SERVICE *service, char **options)
     inst->short_burst = DEF_SHORT_BURST;
     inst->long_burst = DEF_LONG_BURST;
     inst->burst_size = DEF_BURST_SIZE;
+    inst->catchup_threads = DEF_CATCHUP_THREADS;
+    inst->event_cache = DEF_EVENT_CACHE;
+    inst->sendfile_size = DEF_SENDFILE_SIZE;
+    inst->wbuf_size = DEF_WRITE_BUFFER;
+    inst->binlog_sync = DEF_BINLOG_SYNC;
+    inst->index_interval = DEF_INDEX_INTERVAL;
+    inst->compress_binlogs = false;
     inst->retry_backoff = 1;
     inst->binlogdir = NULL;
     inst->heartbeat = BLR_HEARTBEAT_DEFAULT_INTERVAL;
@@ -451,6 +462,104 @@ createInstance(SERVICE *service, char **options)
                     inst->burst_size = size;
 
                 }
+                else if (strcmp(options[i], "catchup_threads") == 0)
+                {
+                    int n_threads = atoi(value);
+
+                    if (n_threads < 0)
+                    {
+                        MXS_WARNING("Invalid catchup_threads value %s. "
+                                    "Using the default value %d.",
+                                    value, DEF_CATCHUP_THREADS);
+                    }
+                    else
+                    {
+                        inst->catchup_threads = n_threads;
+                    }
+                }
+                else if (strcmp(options[i], "event_cache") == 0)
+                {
+                    int n_events = atoi(value);
+
+                    if (n_events < 0)
+                    {
+                        MXS_WARNING("Invalid event_cache value %s. "
+                                    "Using the default value %d.",
+                                    value, DEF_EVENT_CACHE);
+                    }
+                    else
+                    {
+                        inst->event_cache = n_events;
+                    }
+                }
+                else if (strcmp(options[i], "write_buffer") == 0)
+                {
+                    int size = atoi(value);
+
+                    if (size < 0)
+                    {
+                        MXS_WARNING("Invalid write_buffer value %s. "
+                                    "Using the default value %d.",
+                                    value, DEF_WRITE_BUFFER);
+                    }
+                    else
+                    {
+                        inst->wbuf_size = size;
+                    }
+                }
+                else if (strcmp(options[i], "binlog_sync") == 0)
+                {
+                    int interval = atoi(value);
+
+                    if (strcasecmp(value, "commit") == 0)
+                    {
+                        inst->binlog_sync = BLR_SYNC_COMMIT;
+                    }
+                    else if (!isdigit(*value))
+                    {
+                        MXS_WARNING("Invalid binlog_sync value %s. "
+                                    "Using the default value %d.",
+                                    value, DEF_BINLOG_SYNC);
+                    }
+                    else
+                    {
+                        inst->binlog_sync = interval;
+                    }
+                }
+                else if (strcmp(options[i], "sendfile_size") == 0)
+                {
+                    int size = atoi(value);
+
+                    if (size < 0)
+                    {
+                        MXS_WARNING("Invalid sendfile_size value %s. "
+                                    "Using the default value %d.",
+                                    value, DEF_SENDFILE_SIZE);
+                    }
+                    else
+                    {
+                        inst->sendfile_size = size;
+                    }
+                }
+                else if (strcmp(options[i], "index_interval") == 0)
+                {
+                    int interval = atoi(value);
+
+                    if (interval < 0)
+                    {
+                        MXS_WARNING("Invalid index_interval value %s. "
+                                    "Using the default value %d.",
+                                    value, DEF_INDEX_INTERVAL);
+                    }
+                    else
+                    {
+                        inst->index_interval = interval;
+                    }
+                }
+                else if (strcmp(options[i], "compress_binlogs") == 0)
+                {
+                    inst->compress_binlogs = config_truth_value(value);
+                }
                 else if (strcmp(options[i], "heartbeat") == 0)
                 {
                     int h_val = (int)strtol(value, NULL, 10);
@@ -686,6 +795,21 @@ createInstance(SERVICE *service, char **options)
      */
     blr_init_cache(inst);
 
+    /*
+     * Start the I/O threads that read ahead for the slaves in catch-up
+     */
+    blr_readahead_init(inst->catchup_threads);
+
+    /*
+     * Allocate the buffer that collects the events written to the binlog
+     */
+    if (inst->wbuf_size > 0 && (inst->wbuf = malloc(inst->wbuf_size)) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate a write buffer of %u bytes, "
+                  "writing each event separately.", service->name, inst->wbuf_size);
+        inst->wbuf_size = 0;
+    }
+
     /*
      * Add tasks for statistic computation
      */
@@ -744,6 +868,7 @@ free_instance(ROUTER_INSTANCE *instance)
     free(instance->set_master_hostname);
     free(instance->fileroot);
     free(instance->binlogdir);
+    blr_gtid_index_free(instance);
     free(instance);
 }
 
@@ -788,6 +913,7 @@ newSession(ROUTER *instance, SESSION *session)
     slave->pthread = 0;
     slave->overrun = 0;
     slave->uuid = NULL;
+    slave->gtid_state = NULL;
     slave->hostname = NULL;
     spinlock_init(&slave->catch_lock);
     slave->dcb = session->client_dcb;
@@ -801,6 +927,8 @@ newSession(ROUTER *instance, SESSION *session)
     slave->mariadb10_compat = false;
     slave->heartbeat = 0;
     slave->lastEventReceived = 0;
+    slave->readahead = NULL;
+    slave->handoff = NULL;
 
     /**
          * Add this session to the list of active sessions.
@@ -881,6 +1009,9 @@ static void freeSession(ROUTER* router_instance,
     {
         free(slave->passwd);
     }
+    free(slave->gtid_state);
+    blr_readahead_free(slave->readahead);
+    gwbuf_free(slave->handoff);
     free(slave);
 }
 
@@ -1154,6 +1285,24 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tAverage events per packet:                   %.1f\n",
                router_inst->stats.n_reads != 0 ?
                ((double)router_inst->stats.n_binlogs / router_inst->stats.n_reads) : 0);
+    if (router_inst->cache)
+    {
+        dcb_printf(dcb, "\tNumber of events read from the cache:        %lu\n",
+                   router_inst->stats.n_cachehits);
+        dcb_printf(dcb, "\tNumber of events read from the binlogs:      %lu\n",
+                   router_inst->stats.n_cachemisses);
+    }
+    dcb_printf(dcb, "\tNumber of writes to the binlogs:             %lu\n",
+               router_inst->stats.n_writes);
+    dcb_printf(dcb, "\tNumber of syncs of the binlogs:              %lu\n",
+               router_inst->stats.n_syncs);
+    dcb_printf(dcb, "\tNumber of records added to the indexes:      %lu\n",
+               router_inst->stats.n_index);
+    if (router_inst->compress_binlogs)
+    {
+        dcb_printf(dcb, "\tNumber of binlog files compressed:           %d\n",
+                   router_inst->stats.n_compressed);
+    }
 
     spinlock_acquire(&router_inst->lock);
     if (router_inst->stats.lastReply)
@@ -1362,6 +1511,10 @@ diagnostics(ROUTER *router, DCB *dcb)
                        session->stats.n_dcb);
             dcb_printf(dcb, "\t\tNo. of failed reads                      %u\n",
                        session->stats.n_failed_read);
+            dcb_printf(dcb, "\t\tNo. of events sent from file             %u\n",
+                       session->stats.n_sendfile);
+            dcb_printf(dcb, "\t\tNo. of events sent by slave thread       %u\n",
+                       session->stats.n_handoff);
 
 #ifdef DETAILED_DIAG
             dcb_printf(dcb, "\t\tNo. of nested distribute events          %u\n",
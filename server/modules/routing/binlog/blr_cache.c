@@ -42,6 +42,7 @@
 #include <blr.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <rcu.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
@@ -49,13 +50,284 @@
 
 
 /**
- * Initialise the cache for this instanceof the binlog router. As a side
- * effect also determine the binlog file to read and the position to read
- * from.
+ * Initialise the cache for this instance of the binlog router. The cache
+ * keeps the latest router->event_cache events, none if it is zero.
  *
  * @param   router      The router instance
  */
 void
 blr_init_cache(ROUTER_INSTANCE *router)
 {
+    BLCACHE *cache;
+
+    router->cache = NULL;
+
+    if (router->event_cache <= 0)
+    {
+        return;
+    }
+
+    if ((cache = (BLCACHE *)calloc(1, sizeof(BLCACHE))) == NULL ||
+        (cache->records = (BLCACHE_RECORD **)calloc(router->event_cache,
+                                                    sizeof(BLCACHE_RECORD *))) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate the binlog event cache, "
+                  "the slaves read all events from the binlog files.",
+                  router->service->name);
+        free(cache);
+        return;
+    }
+
+    cache->size = router->event_cache;
+    spinlock_init(&cache->lock);
+    router->cache = cache;
+}
+
+/**
+ * Compare the place of an event in the binlog files to that of a record. The
+ * binlog files are numbered with a fixed width, so their names sort in the
+ * order they are written.
+ *
+ * @return Negative, zero or positive if the event is before, at or after the record
+ */
+static int
+blr_cache_cmp(const char *binlogname, unsigned long pos, BLCACHE_RECORD *record)
+{
+    int cmp = strcmp(binlogname, record->binlogname);
+
+    if (cmp == 0)
+    {
+        cmp = pos < record->position ? -1 : (pos > record->position ? 1 : 0);
+    }
+
+    return cmp;
+}
+
+/**
+ * Free the replaced records that no reader can refer to any more. The caller
+ * must hold the cache lock.
+ *
+ * @param cache The cache
+ */
+static void
+blr_cache_reclaim(BLCACHE *cache)
+{
+    BLCACHE_RECORD **link = &cache->retired;
+    BLCACHE_RECORD *record;
+
+    /** The replacements must be visible before the readers are checked */
+    __sync_synchronize();
+    if (cache->readers)
+    {
+        return;
+    }
+
+    while ((record = *link) != NULL)
+    {
+        if (rcu_passed(record->epoch))
+        {
+            *link = record->retired;
+            gwbuf_free(record->pkt);
+            free(record);
+        }
+        else
+        {
+            link = &record->retired;
+        }
+    }
+}
+
+/**
+ * Add an event that has been written to the current binlog file to the
+ * cache. Only the thread of the master connection adds events, in the order
+ * they are in the files. An event that is not after the latest one means the
+ * files have been replaced and the cache starts over.
+ *
+ * @param router    The router instance
+ * @param hdr       The event header
+ * @param data      The whole event
+ * @return The buffer of the cached event, valid until the next event is
+ *         added, or NULL if the event is not cached
+ */
+GWBUF *
+blr_cache_add(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *data)
+{
+    BLCACHE *cache = router->cache;
+    BLCACHE_RECORD *record;
+
+    if (cache == NULL || hdr->event_size > BLR_CACHE_MAX_EVENT || hdr->event_size == 0)
+    {
+        return NULL;
+    }
+
+    if ((record = (BLCACHE_RECORD *)malloc(sizeof(BLCACHE_RECORD))) == NULL ||
+        (record->pkt = gwbuf_alloc(hdr->event_size)) == NULL)
+    {
+        free(record);
+        return NULL;
+    }
+
+    memcpy(GWBUF_DATA(record->pkt), data, hdr->event_size);
+    record->hdr = *hdr;
+    record->position = hdr->next_pos - hdr->event_size;
+    record->epoch = 0;
+    record->retired = NULL;
+
+    spinlock_acquire(&router->binlog_lock);
+    strcpy(record->binlogname, router->binlog_name);
+    spinlock_release(&router->binlog_lock);
+
+    if (cache->current > cache->first)
+    {
+        BLCACHE_RECORD *latest = cache->records[(cache->current - 1) % cache->size];
+
+        if (blr_cache_cmp(record->binlogname, record->position, latest) <= 0)
+        {
+            cache->first = cache->current;
+        }
+    }
+
+    record->seqno = cache->current;
+
+    BLCACHE_RECORD **slot = &cache->records[record->seqno % cache->size];
+    BLCACHE_RECORD *old = *slot;
+
+    /** The record must be visible before it is in the ring and in the ring before it is counted */
+    __sync_synchronize();
+    *slot = record;
+    __sync_synchronize();
+    cache->current++;
+
+    spinlock_acquire(&cache->lock);
+    if (old)
+    {
+        old->epoch = rcu_retire();
+        old->retired = cache->retired;
+        cache->retired = old;
+    }
+    blr_cache_reclaim(cache);
+    spinlock_release(&cache->lock);
+
+    return record->pkt;
+}
+
+/**
+ * Get the record with a sequence number from the ring
+ *
+ * @return The record or NULL if its slot holds another one
+ */
+static inline BLCACHE_RECORD *
+blr_cache_slot(BLCACHE *cache, uint64_t seqno)
+{
+    BLCACHE_RECORD *record = *(BLCACHE_RECORD * volatile *)&cache->records[seqno % cache->size];
+
+    return record && record->seqno == seqno ? record : NULL;
+}
+
+/**
+ * Find the record of an event among the sequence numbers [begin, end). The
+ * records are in the order of the events, so a binary search finds it. A
+ * record replaced during the search counts as being before the event.
+ *
+ * @return The record or NULL if the event is not in the cache
+ */
+static BLCACHE_RECORD *
+blr_cache_search(BLCACHE *cache, uint64_t begin, uint64_t end,
+                 const char *binlogname, unsigned long pos)
+{
+    while (begin < end)
+    {
+        uint64_t mid = begin + (end - begin) / 2;
+        BLCACHE_RECORD *record = blr_cache_slot(cache, mid);
+        int cmp = record ? blr_cache_cmp(binlogname, pos, record) : 1;
+
+        if (cmp == 0)
+        {
+            return record;
+        }
+        else if (cmp < 0)
+        {
+            end = mid;
+        }
+        else
+        {
+            begin = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Read an event for a slave from the cache. The next event of the slave is
+ * looked up where its previous one ended, and searched for if it is not there.
+ *
+ * @param router        The router instance
+ * @param slave         The slave
+ * @param binlogname    The binlog file of the event
+ * @param pos           The position of the event in the file
+ * @param hdr           The event header to fill in
+ * @return A buffer of the event shared with the cache, or NULL if the event
+ *         is not in the cache
+ */
+GWBUF *
+blr_cache_read(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, const char *binlogname,
+               unsigned long pos, REP_HEADER *hdr)
+{
+    BLCACHE *cache = router->cache;
+    GWBUF *rval = NULL;
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    bool online = rcu_is_online();
+
+    if (!online)
+    {
+        atomic_add(&cache->readers, 1);
+    }
+
+    uint64_t end = *(volatile uint64_t *)&cache->current;
+    /** A restart of the cache is seen before the records added after it */
+    __sync_synchronize();
+    uint64_t begin = *(volatile uint64_t *)&cache->first;
+    BLCACHE_RECORD *record = NULL;
+
+    if (end - begin > (uint64_t)cache->size)
+    {
+        begin = end - cache->size;
+    }
+
+    if (slave->cache_seqno >= begin && slave->cache_seqno < end &&
+        (record = blr_cache_slot(cache, slave->cache_seqno)) != NULL &&
+        blr_cache_cmp(binlogname, pos, record) != 0)
+    {
+        record = NULL;
+    }
+
+    if (record == NULL && begin < end)
+    {
+        record = blr_cache_search(cache, begin, end, binlogname, pos);
+    }
+
+    if (record && (rval = gwbuf_clone(record->pkt)) != NULL)
+    {
+        *hdr = record->hdr;
+        hdr->ok = SLAVE_POS_READ_OK;
+        slave->cache_seqno = record->seqno + 1;
+        router->stats.n_cachehits++;
+    }
+    else
+    {
+        router->stats.n_cachemisses++;
+    }
+
+    if (!online)
+    {
+        atomic_add(&cache->readers, -1);
+    }
+
+    return rval;
 }
@@ -46,6 +46,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -55,12 +56,21 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <gwdirs.h>
+#include <thread.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <hk_heartbeat.h>
+#include <mysql_client_server_protocol.h>
+#include <zlib.h>
 
 static int  blr_file_create(ROUTER_INSTANCE *router, char *file);
+static void blr_file_close_current(ROUTER_INSTANCE *router);
+static void blr_index_open(ROUTER_INSTANCE *router, const char *path, uint64_t filelen);
+static void blr_index_event(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *buf);
+static void blr_gtid_index_add(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *buf);
 static void blr_log_header(int priority, char *msg, uint8_t *ptr);
+static void blr_zfile_queue(ROUTER_INSTANCE *router, const char *file);
 void blr_cache_read_master_data(ROUTER_INSTANCE *router);
 int blr_file_get_next_binlogname(ROUTER_INSTANCE *router);
 int blr_file_new_binlog(ROUTER_INSTANCE *router, char *file);
@@ -187,10 +197,325 @@ blr_file_init(ROUTER_INSTANCE *router)
     return 1;
 }
 
+/**
+ * Rotate to a new binlog file. With compress_binlogs, the file that was
+ * written until now is compressed in the background.
+ *
+ * @param router    The router instance
+ * @param file      The name of the new binlog file
+ * @param pos       The position in the new file
+ * @return          Non-zero if the new file was created
+ */
 int
 blr_file_rotate(ROUTER_INSTANCE *router, char *file, uint64_t pos)
 {
-    return blr_file_create(router, file);
+    char prev[BINLOG_FNAMELEN + 1];
+
+    strcpy(prev, router->binlog_name);
+
+    int rval = blr_file_create(router, file);
+
+    if (rval && router->compress_binlogs && *prev && strcmp(prev, file) != 0)
+    {
+        blr_zfile_queue(router, prev);
+    }
+
+    return rval;
+}
+
+/** A binlog file waiting to be compressed */
+typedef struct
+{
+    ROUTER_INSTANCE *router;
+    char            path[PATH_MAX + 1];
+} BLR_ZJOB;
+
+/**
+ * Write all of a buffer to a file
+ *
+ * @param fd    The file
+ * @param buf   The data
+ * @param len   Length of the data
+ * @return True if all of the data was written
+ */
+static bool
+blr_write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *ptr = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, ptr, len);
+
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * Find where a block of a compressed binlog file ends in a buffer read from
+ * the binlog file. The block ends after the last complete event that fits
+ * into BLR_ZBLOCK_SIZE bytes, or after the first event if it alone is
+ * larger. If the size of an event is not valid, the rest of the buffer is
+ * taken as it is.
+ *
+ * @param data      The data read from the file
+ * @param len       Length of the data
+ * @param start     Where the first event starts
+ * @return          Offset of the end of the block, 0 if the first event is
+ *                  not completely in the buffer
+ */
+static size_t
+blr_zfile_block_end(uint8_t *data, size_t len, size_t start)
+{
+    size_t end = start;
+
+    while (end + BINLOG_EVENT_HDR_LEN <= len)
+    {
+        uint32_t size = extract_field(&data[end + 9], 32);
+
+        if (size < BINLOG_EVENT_HDR_LEN)
+        {
+            return len;
+        }
+        else if (end + size > len || (end > start && end + size > BLR_ZBLOCK_SIZE))
+        {
+            break;
+        }
+        end += size;
+    }
+
+    return end;
+}
+
+/**
+ * Compress a binlog file that is no longer written. The file is written
+ * into a temporary file that is renamed when it is complete, after which
+ * the uncompressed file is removed. The slaves that have the uncompressed
+ * file open keep reading it.
+ *
+ * @param router    The router instance
+ * @param path      Path of the binlog file
+ * @return          True if the file was compressed
+ */
+static bool
+blr_zfile_compress(ROUTER_INSTANCE *router, const char *path)
+{
+    char zpath[PATH_MAX + 1];
+    char tmppath[PATH_MAX + 1];
+    char err_msg[STRERROR_BUFLEN];
+    BLR_ZFILE_HEADER header;
+    BLR_ZBLOCK *blocks = NULL;
+    uint64_t n_blocks = 0;
+    uint64_t max_blocks = 0;
+    size_t cap = BLR_ZBLOCK_SIZE;
+    uLong zcap = compressBound(cap);
+    uint8_t *data = malloc(cap);
+    uint8_t *zdata = malloc(zcap);
+    uint64_t pos = 0;
+    uint64_t offset = sizeof(header);
+    size_t have = 0;
+    bool eof = false;
+    bool ok = false;
+    int fd = -1;
+    int zfd = -1;
+
+    snprintf(zpath, sizeof(zpath), "%s" BLR_ZFILE_SUFFIX, path);
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", zpath);
+
+    if (data && zdata && (fd = open(path, O_RDONLY)) != -1 &&
+        (zfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) != -1 &&
+        lseek(zfd, offset, SEEK_SET) == offset)
+    {
+        ok = true;
+    }
+
+    while (ok && !(eof && have == 0))
+    {
+        while (!eof && have < cap)
+        {
+            ssize_t n = read(fd, data + have, cap - have);
+
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            eof = n == 0;
+            have += n;
+        }
+
+        if (!ok)
+        {
+            break;
+        }
+
+        /** The blocks end at event boundaries, the binlog magic is part of
+         * the first block */
+        size_t start = pos == 0 ? MIN(have, BINLOG_MAGIC_SIZE) : 0;
+        size_t end = eof ? have : blr_zfile_block_end(data, have, start);
+
+        if (end == 0)
+        {
+            /** An event larger than the buffer */
+            uint8_t *tmp_data = realloc(data, cap * 2);
+            uint8_t *tmp_zdata = tmp_data ? realloc(zdata, compressBound(cap * 2)) : NULL;
+
+            data = tmp_data ? tmp_data : data;
+            zdata = tmp_zdata ? tmp_zdata : zdata;
+
+            if (tmp_data == NULL || tmp_zdata == NULL)
+            {
+                ok = false;
+                break;
+            }
+            cap *= 2;
+            zcap = compressBound(cap);
+            continue;
+        }
+
+        if (n_blocks == max_blocks)
+        {
+            uint64_t newmax = max_blocks ? max_blocks * 2 : 1024;
+            BLR_ZBLOCK *tmp = realloc(blocks, newmax * sizeof(BLR_ZBLOCK));
+
+            if (tmp == NULL)
+            {
+                ok = false;
+                break;
+            }
+            blocks = tmp;
+            max_blocks = newmax;
+        }
+
+        uLongf clen = zcap;
+
+        if (compress2(zdata, &clen, data, end, Z_DEFAULT_COMPRESSION) != Z_OK ||
+            !blr_write_all(zfd, zdata, clen))
+        {
+            ok = false;
+            break;
+        }
+
+        blocks[n_blocks].pos = pos;
+        blocks[n_blocks].offset = offset;
+        blocks[n_blocks].len = end;
+        blocks[n_blocks].clen = clen;
+        n_blocks++;
+
+        offset += clen;
+        pos += end;
+        have -= end;
+        memmove(data, data + end, have);
+    }
+
+    if (ok)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BLR_ZFILE_MAGIC, BLR_ZFILE_MAGIC_SIZE);
+        header.size = pos;
+        header.index_offset = offset;
+        header.n_blocks = n_blocks;
+
+        ok = blr_write_all(zfd, blocks, n_blocks * sizeof(BLR_ZBLOCK)) &&
+             pwrite(zfd, &header, sizeof(header), 0) == sizeof(header) &&
+             fsync(zfd) == 0 && rename(tmppath, zpath) == 0;
+    }
+
+    if (ok)
+    {
+        if (unlink(path) != 0)
+        {
+            MXS_ERROR("%s: Failed to delete binlog file %s after compressing it, %s.",
+                      router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+        MXS_NOTICE("%s: Compressed binlog file %s from %lu to %lu bytes.",
+                   router->service->name, path, pos, offset + n_blocks * sizeof(BLR_ZBLOCK));
+    }
+    else
+    {
+        MXS_ERROR("%s: Failed to compress binlog file %s, %s.",
+                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        unlink(tmppath);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (zfd != -1)
+    {
+        close(zfd);
+    }
+    free(data);
+    free(zdata);
+    free(blocks);
+
+    return ok;
+}
+
+/**
+ * The thread compressing a binlog file
+ *
+ * @param data  The BLR_ZJOB of the file
+ */
+static void
+blr_zfile_thread(void *data)
+{
+    BLR_ZJOB *job = (BLR_ZJOB *)data;
+
+    if (blr_zfile_compress(job->router, job->path))
+    {
+        atomic_add(&job->router->stats.n_compressed, 1);
+    }
+    free(job);
+}
+
+/**
+ * Compress a binlog file in a thread of its own. The files are rotated
+ * seldom enough for each of them to have a thread.
+ *
+ * @param router    The router instance
+ * @param file      The name of the binlog file
+ */
+static void
+blr_zfile_queue(ROUTER_INSTANCE *router, const char *file)
+{
+    BLR_ZJOB *job = (BLR_ZJOB *)malloc(sizeof(BLR_ZJOB));
+    THREAD thr;
+
+    if (job == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate memory for compressing binlog file %s.",
+                  router->service->name, file);
+        return;
+    }
+
+    job->router = router;
+    snprintf(job->path, sizeof(job->path), "%s/%s", router->binlogdir, file);
+
+    if (thread_start(&thr, blr_zfile_thread, job) == NULL)
+    {
+        MXS_ERROR("%s: Failed to start the thread compressing binlog file %s.",
+                  router->service->name, file);
+        free(job);
+        return;
+    }
+    thread_detach(thr);
 }
 
 
@@ -237,7 +562,7 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
     {
         if (blr_file_add_magic(fd))
         {
-            close(router->binlog_fd);
+            blr_file_close_current(router);
             spinlock_acquire(&router->binlog_lock);
             strncpy(router->binlog_name, file, BINLOG_FNAMELEN);
             router->binlog_fd = fd;
@@ -247,6 +572,7 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
             router->last_written = BINLOG_MAGIC_SIZE;
             spinlock_release(&router->binlog_lock);
 
+            blr_index_open(router, path, BINLOG_MAGIC_SIZE);
             created = 1;
         }
         else
@@ -294,10 +620,11 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
         return;
     }
     fsync(fd);
-    close(router->binlog_fd);
+    blr_file_close_current(router);
     spinlock_acquire(&router->binlog_lock);
     memmove(router->binlog_name, file, BINLOG_FNAMELEN);
     router->current_pos = lseek(fd, 0L, SEEK_END);
+    router->last_written = router->current_pos;
     if (router->current_pos < 4)
     {
         if (router->current_pos == 0)
@@ -327,6 +654,176 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
     }
     router->binlog_fd = fd;
     spinlock_release(&router->binlog_lock);
+
+    blr_index_open(router, path, router->current_pos);
+}
+
+/**
+ * Write the write buffer to the binlog file. Called with the write buffer
+ * locked. If the write fails, the part that was written is removed from the
+ * file. The master thread then discards the buffered events and moves the
+ * binlog position back to the first of them, which makes the next write fail
+ * so that the events are fetched again from the master. The other threads
+ * keep the events in the buffer for the master thread.
+ *
+ * @param router    The router instance
+ * @param master    True if called by the thread handling the master
+ * @return          True if the buffer was written
+ */
+static bool
+blr_file_write_out(ROUTER_INSTANCE *router, bool master)
+{
+    ssize_t n;
+
+    if (router->wbuf_len == 0)
+    {
+        return true;
+    }
+
+    if ((n = pwrite(router->binlog_fd, router->wbuf, router->wbuf_len,
+                    router->wbuf_pos)) != router->wbuf_len)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to write %u bytes of binlog records at %lu of %s, %s. "
+                  "Truncating to previous record.",
+                  router->service->name, router->wbuf_len, router->wbuf_pos,
+                  router->binlog_name,
+                  n < 0 ? strerror_r(errno, err_msg, sizeof(err_msg)) : "short write");
+        /* Remove any partial event that was written */
+        if (ftruncate(router->binlog_fd, router->wbuf_pos))
+        {
+            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
+                      router->service->name, router->wbuf_pos,
+                      router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+
+        if (master)
+        {
+            spinlock_acquire(&router->binlog_lock);
+            router->current_pos = router->wbuf_pos;
+            router->last_written = router->wbuf_pos;
+            if (router->binlog_position > router->wbuf_pos)
+            {
+                router->binlog_position = router->wbuf_pos;
+            }
+            if (router->current_safe_event > router->wbuf_pos)
+            {
+                router->current_safe_event = router->wbuf_pos;
+            }
+            spinlock_release(&router->binlog_lock);
+
+            router->wbuf_len = 0;
+            router->wbuf_failed = true;
+        }
+        return false;
+    }
+
+    router->wbuf_len = 0;
+    router->unsynced = true;
+    router->stats.n_writes++;
+    return true;
+}
+
+/**
+ * Append data to the binlog file being written. The data is collected in the
+ * write buffer, which is written when the data does not fit into it. Data
+ * that is larger than the buffer or that continues an event which was written
+ * past the buffer is written directly. Called by the thread handling the
+ * master.
+ *
+ * @param router    The router instance
+ * @param buf       The data
+ * @param size      The length of the data
+ * @param direct    Write the data past the buffer
+ * @return          The number of bytes written, 0 on failure
+ */
+int
+blr_file_write(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size, bool direct)
+{
+    struct iovec iov = {buf, size};
+    return blr_file_writev(router, &iov, 1, size, direct);
+}
+
+/**
+ * Append data from several buffers to the binlog file being written. This
+ * is blr_file_write for data that is not contiguous in memory, the direct
+ * write is done with one system call.
+ *
+ * @param router    The router instance
+ * @param iov       The data
+ * @param n_iov     Number of buffers
+ * @param size      The total length of the data
+ * @param direct    Write the data past the buffer
+ * @return          The number of bytes written, 0 on failure
+ */
+int
+blr_file_writev(ROUTER_INSTANCE *router, const struct iovec *iov, int n_iov,
+                uint32_t size, bool direct)
+{
+    int n = size;
+
+    spinlock_acquire(&router->wbuf_lock);
+
+    direct = direct || size > router->wbuf_size;
+
+    if (router->wbuf_failed)
+    {
+        /** The buffered events were lost, the master connection is restarted */
+        n = 0;
+    }
+    else if ((direct || router->wbuf_len + size > router->wbuf_size) &&
+             !blr_file_write_out(router, true))
+    {
+        n = 0;
+    }
+    else if (direct)
+    {
+        if ((n = pwritev(router->binlog_fd, iov, n_iov, router->last_written)) != size)
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
+                      "Truncating to previous record.",
+                      router->service->name, router->last_written,
+                      router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            /* Remove any partial event that was written */
+            if (ftruncate(router->binlog_fd, router->last_written))
+            {
+                MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
+                          router->service->name, router->last_written,
+                          router->binlog_name,
+                          strerror_r(errno, err_msg, sizeof(err_msg)));
+            }
+            n = 0;
+        }
+        else
+        {
+            router->unsynced = true;
+            router->stats.n_writes++;
+        }
+    }
+    else
+    {
+        if (router->wbuf_len == 0)
+        {
+            router->wbuf_pos = router->last_written;
+        }
+        for (int i = 0; i < n_iov; i++)
+        {
+            memcpy(router->wbuf + router->wbuf_len, iov[i].iov_base, iov[i].iov_len);
+            router->wbuf_len += iov[i].iov_len;
+        }
+    }
+
+    if (n == 0)
+    {
+        router->wbuf_failed = false;
+    }
+
+    spinlock_release(&router->wbuf_lock);
+
+    return n;
 }
 
 /**
@@ -340,44 +837,846 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
 int
 blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size, uint8_t *buf)
 {
-    int n;
+    int n;
+    /** The buffer must start at an event so that the event can be fetched again */
+    bool direct = router->wbuf_partial;
+
+    router->wbuf_partial = false;
+
+    if ((n = blr_file_write(router, buf, size, direct)) == 0)
+    {
+        return 0;
+    }
+
+    if (hdr->event_type == XID_EVENT || hdr->event_type == QUERY_EVENT)
+    {
+        router->unsynced_commit = true;
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    router->current_pos = hdr->next_pos;
+    router->last_written += size;
+    router->last_event_pos = hdr->next_pos - hdr->event_size;
+    spinlock_release(&router->binlog_lock);
+
+    if (router->index_fd != -1)
+    {
+        blr_index_event(router, hdr, buf);
+    }
+
+    /** GTID events are never sent in more than one packet */
+    if (hdr->event_type == MARIADB10_GTID_EVENT)
+    {
+        blr_gtid_index_add(router, hdr, buf);
+    }
+    return n;
+}
+
+/**
+ * Write the events buffered by the master thread to the binlog file so that
+ * the other threads can read them. If the write fails, the events stay in
+ * the buffer.
+ *
+ * @param router    The router instance
+ */
+void
+blr_file_write_buffer(ROUTER_INSTANCE *router)
+{
+    if (router->wbuf_len > 0)
+    {
+        spinlock_acquire(&router->wbuf_lock);
+        blr_file_write_out(router, false);
+        spinlock_release(&router->wbuf_lock);
+    }
+}
+
+/**
+ * Sync the binlog file being written to disk.
+ *
+ * @param router    The router instance
+ */
+void
+blr_file_sync(ROUTER_INSTANCE *router)
+{
+    fsync(router->binlog_fd);
+    router->stats.n_syncs++;
+    router->last_sync = hkheartbeat;
+    router->unsynced = false;
+    router->unsynced_commit = false;
+}
+
+/**
+ * Flush the content of the binlog file to disk. Called at the end of each
+ * batch of events from the master. The write buffer is written to the file
+ * and the file is synced unless the binlog_sync option says otherwise.
+ *
+ * @param   router  The binlog router
+ */
+void
+blr_file_flush(ROUTER_INSTANCE *router)
+{
+    bool sync;
+
+    spinlock_acquire(&router->wbuf_lock);
+    blr_file_write_out(router, true);
+    spinlock_release(&router->wbuf_lock);
+
+    if (router->binlog_sync == BLR_SYNC_COMMIT)
+    {
+        sync = router->unsynced_commit;
+    }
+    else
+    {
+        sync = router->unsynced && (hkheartbeat - router->last_sync) * 100 >= router->binlog_sync;
+    }
+
+    if (sync)
+    {
+        blr_file_sync(router);
+    }
+}
+
+/**
+ * Write and sync the binlog file being written before it is closed.
+ *
+ * @param router    The router instance
+ */
+static void
+blr_file_close_current(ROUTER_INSTANCE *router)
+{
+    if (router->binlog_fd != -1)
+    {
+        spinlock_acquire(&router->wbuf_lock);
+        blr_file_write_out(router, true);
+        spinlock_release(&router->wbuf_lock);
+
+        if (router->unsynced)
+        {
+            blr_file_sync(router);
+        }
+    }
+    close(router->binlog_fd);
+
+    if (router->index_fd != -1)
+    {
+        close(router->index_fd);
+        router->index_fd = -1;
+    }
+}
+
+/**
+ * Read a record of the index of a binlog file.
+ *
+ * @param fd    The index file
+ * @param n     Number of the record
+ * @param rec   The record that is read
+ * @return      True if the record was read
+ */
+static bool
+blr_index_read(int fd, uint64_t n, BLR_INDEX_RECORD *rec)
+{
+    off_t offset = BLR_INDEX_MAGIC_SIZE + n * sizeof(*rec);
+
+    return pread(fd, rec, sizeof(*rec), offset) == sizeof(*rec);
+}
+
+/**
+ * Open the index of the binlog file being written. The records of an
+ * existing index that point past the end of the binlog file, left by events
+ * that did not reach the file, are removed. An index that is not recognised
+ * is started again.
+ *
+ * @param router    The router instance
+ * @param path      Path of the binlog file
+ * @param filelen   Length of the binlog file
+ */
+static void
+blr_index_open(ROUTER_INSTANCE *router, const char *path, uint64_t filelen)
+{
+    char idxpath[PATH_MAX + 1];
+    char magic[BLR_INDEX_MAGIC_SIZE];
+    char err_msg[STRERROR_BUFLEN];
+    struct stat statb;
+    bool ok;
+    int fd;
+
+    router->index_events = 0;
+    router->index_pos = 0;
+    router->index_boundary = filelen <= BINLOG_MAGIC_SIZE;
+
+    if (router->index_interval == 0)
+    {
+        return;
+    }
+
+    snprintf(idxpath, sizeof(idxpath), "%s" BLR_INDEX_SUFFIX, path);
+
+    if ((fd = open(idxpath, O_RDWR | O_CREAT | O_APPEND, 0666)) == -1)
+    {
+        MXS_ERROR("%s: Failed to open binlog index %s, %s.",
+                  router->service->name, idxpath,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        return;
+    }
+
+    if (fstat(fd, &statb) == 0 && statb.st_size >= BLR_INDEX_MAGIC_SIZE &&
+        pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, BLR_INDEX_MAGIC, sizeof(magic)) == 0)
+    {
+        BLR_INDEX_RECORD rec;
+        uint64_t low = 0;
+        uint64_t high = (statb.st_size - BLR_INDEX_MAGIC_SIZE) / sizeof(rec);
+
+        /** The records are in the order of the positions */
+        while (low < high)
+        {
+            uint64_t mid = low + (high - low) / 2;
+
+            if (blr_index_read(fd, mid, &rec) && rec.pos < filelen)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+
+        if (low > 0 && blr_index_read(fd, low - 1, &rec))
+        {
+            router->index_pos = rec.pos;
+        }
+
+        ok = ftruncate(fd, BLR_INDEX_MAGIC_SIZE + low * sizeof(rec)) == 0;
+    }
+    else
+    {
+        ok = ftruncate(fd, 0) == 0 &&
+             write(fd, BLR_INDEX_MAGIC, BLR_INDEX_MAGIC_SIZE) == BLR_INDEX_MAGIC_SIZE;
+    }
+
+    if (!ok)
+    {
+        MXS_ERROR("%s: Failed to prepare binlog index %s, %s.",
+                  router->service->name, idxpath,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        close(fd);
+        return;
+    }
+
+    router->index_fd = fd;
+}
+
+/**
+ * Add an event written to the binlog file to the index. A record is added
+ * when the event starts a transaction and index_interval events have been
+ * written since the previous record. A record that is added after the
+ * binlog position has been moved back is skipped so that the records stay
+ * in order.
+ *
+ * @param router    The router instance
+ * @param hdr       The header of the event
+ * @param buf       The last part of the event that was written
+ */
+static void
+blr_index_event(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *buf)
+{
+    uint64_t pos = hdr->next_pos - hdr->event_size;
+
+    if (++router->index_events >= router->index_interval &&
+        router->index_boundary && pos > router->index_pos)
+    {
+        BLR_INDEX_RECORD rec;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.pos = pos;
+        rec.timestamp = hdr->timestamp;
+        rec.flags = (router->trx_safe ? BLR_INDEX_TRX : 0) |
+                    (router->master_chksum ? BLR_INDEX_CHECKSUM : 0);
+        rec.gtid_seq = router->gtid_seq;
+        rec.gtid_domain = router->gtid_domain;
+        rec.gtid_server = router->gtid_server;
+
+        if (write(router->index_fd, &rec, sizeof(rec)) == sizeof(rec))
+        {
+            router->index_events = 0;
+            router->index_pos = pos;
+            router->stats.n_index++;
+        }
+        else
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to write to the index of binlog file %s, %s. "
+                      "The rest of the file is not indexed.",
+                      router->service->name, router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            close(router->index_fd);
+            router->index_fd = -1;
+            return;
+        }
+    }
+
+    /** GTID events are never sent in more than one packet */
+    if (hdr->event_type == MARIADB10_GTID_EVENT)
+    {
+        router->gtid_seq = gw_mysql_get_byte8(buf + BINLOG_EVENT_HDR_LEN);
+        router->gtid_domain = gw_mysql_get_byte4(buf + BINLOG_EVENT_HDR_LEN + 8);
+        router->gtid_server = hdr->serverid;
+    }
+
+    router->index_boundary = hdr->event_type != MARIADB10_GTID_EVENT &&
+                             (!router->trx_safe || router->pending_transaction != 1);
+}
+
+/**
+ * Find the last transaction boundary in the index of the binlog file being
+ * written that matches an event in the file.
+ *
+ * @param router    The router instance
+ * @param filelen   Length of the binlog file
+ * @param rec       The record that is found
+ * @param hdr       The header of the event at the position of the record
+ * @return          True if a record was found
+ */
+static bool
+blr_index_last(ROUTER_INSTANCE *router, uint64_t filelen, BLR_INDEX_RECORD *rec, REP_HEADER *hdr)
+{
+    struct stat statb;
+    uint64_t n;
+
+    if (router->index_fd == -1 || fstat(router->index_fd, &statb) != 0 ||
+        statb.st_size < BLR_INDEX_MAGIC_SIZE)
+    {
+        return false;
+    }
+
+    n = (statb.st_size - BLR_INDEX_MAGIC_SIZE) / sizeof(*rec);
+
+    while (n > 0 && blr_index_read(router->index_fd, --n, rec))
+    {
+        uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+
+        if ((rec->flags & BLR_INDEX_TRX) &&
+            rec->pos + BINLOG_EVENT_HDR_LEN <= filelen &&
+            pread(router->binlog_fd, hdbuf, sizeof(hdbuf), rec->pos) == sizeof(hdbuf))
+        {
+            hdr->timestamp = EXTRACT32(hdbuf);
+            hdr->event_type = hdbuf[4];
+            hdr->serverid = EXTRACT32(&hdbuf[5]);
+            hdr->event_size = extract_field(&hdbuf[9], 32);
+            hdr->next_pos = EXTRACT32(&hdbuf[13]);
+            hdr->flags = EXTRACT16(&hdbuf[17]);
+
+            if (hdr->timestamp == rec->timestamp &&
+                hdr->next_pos == rec->pos + hdr->event_size)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Read a record of the GTID index of a domain.
+ *
+ * @param fd    The index file
+ * @param n     Number of the record
+ * @param rec   The record that is read
+ * @return      True if the record was read
+ */
+static bool
+blr_gtid_read(int fd, uint64_t n, BLR_GTID_RECORD *rec)
+{
+    off_t offset = BLR_GTID_INDEX_MAGIC_SIZE + n * sizeof(*rec);
+
+    return pread(fd, rec, sizeof(*rec), offset) == sizeof(*rec);
+}
+
+/**
+ * Find the first record of a GTID index with a sequence number greater
+ * than the one given.
+ *
+ * @param fd        The index file
+ * @param n_records Number of records in the index
+ * @param seq       The sequence number
+ * @return          Number of the record, n_records if there is none
+ */
+static uint64_t
+blr_gtid_search(int fd, uint64_t n_records, uint64_t seq)
+{
+    BLR_GTID_RECORD rec;
+    uint64_t low = 0;
+    uint64_t high = n_records;
+
+    while (low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+
+        if (blr_gtid_read(fd, mid, &rec) && rec.seq <= seq)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Get the number of a binlog file from its name.
+ *
+ * @param name  Name of the binlog file
+ * @return      The number after the last dot of the name
+ */
+static uint32_t
+blr_file_number(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+
+    return dot ? (uint32_t)atoi(dot + 1) : 0;
+}
+
+/**
+ * Get the GTID index of a domain, opening the index file if it is not yet
+ * open. A partial record at the end of an existing file, left by a write
+ * that did not complete, is removed. The caller must hold gtid_index_lock.
+ *
+ * @param router    The router instance
+ * @param domain    The replication domain
+ * @param create    Create the index file if it does not exist
+ * @return          The index or NULL if there is none
+ */
+static BLR_GTID_INDEX *
+blr_gtid_index_get(ROUTER_INSTANCE *router, uint32_t domain, bool create)
+{
+    BLR_GTID_INDEX *idx;
+    char path[PATH_MAX + 1];
+    char magic[BLR_GTID_INDEX_MAGIC_SIZE];
+    char err_msg[STRERROR_BUFLEN];
+    struct stat statb;
+    uint64_t n_records = 0;
+    bool ok;
+    int fd;
+
+    for (idx = router->gtid_index; idx; idx = idx->next)
+    {
+        if (idx->domain == domain)
+        {
+            return idx;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.%u" BLR_GTID_INDEX_SUFFIX,
+             router->binlogdir, router->fileroot, domain);
+
+    if ((fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0666)) == -1)
+    {
+        if (create || errno != ENOENT)
+        {
+            MXS_ERROR("%s: Failed to open GTID index %s, %s.",
+                      router->service->name, path,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+        return NULL;
+    }
+
+    if (fstat(fd, &statb) == 0 && statb.st_size >= BLR_GTID_INDEX_MAGIC_SIZE &&
+        pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, BLR_GTID_INDEX_MAGIC, sizeof(magic)) == 0)
+    {
+        n_records = (statb.st_size - BLR_GTID_INDEX_MAGIC_SIZE) / sizeof(BLR_GTID_RECORD);
+        ok = ftruncate(fd, BLR_GTID_INDEX_MAGIC_SIZE + n_records * sizeof(BLR_GTID_RECORD)) == 0;
+    }
+    else
+    {
+        ok = ftruncate(fd, 0) == 0 &&
+             write(fd, BLR_GTID_INDEX_MAGIC, BLR_GTID_INDEX_MAGIC_SIZE) == BLR_GTID_INDEX_MAGIC_SIZE;
+    }
+
+    if (!ok || (idx = calloc(1, sizeof(*idx))) == NULL)
+    {
+        MXS_ERROR("%s: Failed to prepare GTID index %s, %s.",
+                  router->service->name, path,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        close(fd);
+        return NULL;
+    }
+
+    idx->domain = domain;
+    idx->fd = fd;
+    idx->n_records = n_records;
+
+    if (n_records > 0 && !blr_gtid_read(fd, n_records - 1, &idx->last))
+    {
+        idx->n_records = 0;
+    }
+
+    idx->next = router->gtid_index;
+    router->gtid_index = idx;
+
+    return idx;
+}
+
+/**
+ * Add a MariaDB 10 GTID event written to the binlog file to the GTID index
+ * of its domain. If the GTID is not newer than the last one in the index,
+ * the master has sent the events again and the records from the GTID on
+ * are replaced.
+ *
+ * @param router    The router instance
+ * @param hdr       The header of the event
+ * @param buf       The event
+ */
+static void
+blr_gtid_index_add(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *buf)
+{
+    BLR_GTID_INDEX *idx;
+    BLR_GTID_RECORD rec;
+    uint32_t domain = gw_mysql_get_byte4(buf + BINLOG_EVENT_HDR_LEN + 8);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.seq = gw_mysql_get_byte8(buf + BINLOG_EVENT_HDR_LEN);
+    rec.server_id = hdr->serverid;
+    rec.file = blr_file_number(router->binlog_name);
+    rec.pos = hdr->next_pos - hdr->event_size;
+
+    spinlock_acquire(&router->gtid_index_lock);
+    idx = blr_gtid_index_get(router, domain, true);
+    spinlock_release(&router->gtid_index_lock);
+
+    if (idx == NULL)
+    {
+        return;
+    }
+
+    uint64_t n = idx->n_records;
+
+    if (n > 0 && rec.seq <= idx->last.seq)
+    {
+        n = rec.seq > 0 ? blr_gtid_search(idx->fd, n, rec.seq - 1) : 0;
+
+        if (ftruncate(idx->fd, BLR_GTID_INDEX_MAGIC_SIZE + n * sizeof(rec)) != 0)
+        {
+            return;
+        }
+
+        spinlock_acquire(&router->gtid_index_lock);
+        idx->n_records = n;
+        spinlock_release(&router->gtid_index_lock);
+    }
+
+    if (pwrite(idx->fd, &rec, sizeof(rec), BLR_GTID_INDEX_MAGIC_SIZE + n * sizeof(rec)) == sizeof(rec))
+    {
+        spinlock_acquire(&router->gtid_index_lock);
+        idx->last = rec;
+        idx->n_records = n + 1;
+        spinlock_release(&router->gtid_index_lock);
+    }
+    else
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to add GTID %u-%u-%lu to the GTID index, %s.",
+                  router->service->name, domain, rec.server_id,
+                  (unsigned long)rec.seq,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+    }
+}
+
+/**
+ * Find the binlog position a slave registering with a list of GTIDs must
+ * start from. The position is the earliest of the GTID events that follow
+ * the GTIDs in the binlog files. A slave that has all the events of its
+ * domains starts from the latest safe position.
+ *
+ * @param router    The router instance
+ * @param state     Comma separated list of domain-server-sequence GTIDs
+ * @param file      Name of the binlog file is copied here
+ * @param pos       The binlog position is stored here
+ * @param error     Buffer for the error message if no position is found
+ * @param errlen    Size of the error buffer
+ * @return          True if the position was found
+ */
+bool
+blr_gtid_find(ROUTER_INSTANCE *router, const char *state, char *file, uint32_t *pos,
+              char *error, size_t errlen)
+{
+    char *copy = strdup(state);
+    char *gtid, *brkb;
+    uint32_t start_file = 0;
+    uint64_t start_pos = 0;
+    bool found = false;
+    bool ok = copy != NULL;
+
+    for (gtid = ok ? strtok_r(copy, ", \t", &brkb) : NULL; ok && gtid;
+         gtid = strtok_r(NULL, ", \t", &brkb))
+    {
+        unsigned int domain, server_id;
+        unsigned long seq;
+        BLR_GTID_INDEX *idx;
+        BLR_GTID_RECORD rec;
+        uint64_t n_records = 0;
+        int fd = -1;
+
+        if (sscanf(gtid, "%u-%u-%lu", &domain, &server_id, &seq) != 3)
+        {
+            snprintf(error, errlen, "Invalid GTID '%s' in @slave_connect_state", gtid);
+            ok = false;
+            break;
+        }
+
+        spinlock_acquire(&router->gtid_index_lock);
+        if ((idx = blr_gtid_index_get(router, domain, false)))
+        {
+            fd = idx->fd;
+            n_records = idx->n_records;
+        }
+        spinlock_release(&router->gtid_index_lock);
+
+        uint64_t n = blr_gtid_search(fd, n_records, seq);
+        uint32_t rec_file;
+        uint64_t rec_pos;
+
+        if (n > 0 ? !blr_gtid_read(fd, n - 1, &rec) || rec.seq != seq || rec.server_id != server_id :
+            n_records == 0 || !blr_gtid_read(fd, 0, &rec) || rec.seq != seq + 1)
+        {
+            snprintf(error, errlen, "Could not find GTID %u-%u-%lu in the binlog files "
+                     "of the binlog router", domain, server_id, seq);
+            ok = false;
+            break;
+        }
+
+        if (n < n_records)
+        {
+            if (!blr_gtid_read(fd, n, &rec))
+            {
+                snprintf(error, errlen, "Failed to read the GTID index of domain %u", domain);
+                ok = false;
+                break;
+            }
+            rec_file = rec.file;
+            rec_pos = rec.pos;
+        }
+        else
+        {
+            spinlock_acquire(&router->binlog_lock);
+            rec_file = blr_file_number(router->binlog_name);
+            rec_pos = router->binlog_position;
+            spinlock_release(&router->binlog_lock);
+        }
+
+        if (!found || rec_file < start_file || (rec_file == start_file && rec_pos < start_pos))
+        {
+            start_file = rec_file;
+            start_pos = rec_pos;
+            found = true;
+        }
+    }
+
+    free(copy);
+
+    if (ok && !found)
+    {
+        snprintf(error, errlen, "The @slave_connect_state is empty, a binlog file "
+                 "and position are needed to register");
+        ok = false;
+    }
+
+    if (ok)
+    {
+        snprintf(file, BINLOG_FNAMELEN + 1, BINLOG_NAMEFMT, router->fileroot, start_file);
+        *pos = start_pos;
+    }
+
+    return ok;
+}
+
+/**
+ * Close the GTID indexes of a router instance.
+ *
+ * @param router    The router instance
+ */
+void
+blr_gtid_index_free(ROUTER_INSTANCE *router)
+{
+    BLR_GTID_INDEX *idx = router->gtid_index;
+
+    while (idx)
+    {
+        BLR_GTID_INDEX *next = idx->next;
+        close(idx->fd);
+        free(idx);
+        idx = next;
+    }
+
+    router->gtid_index = NULL;
+}
+
+/**
+ * Open the compressed version of a binlog file and read the index of its
+ * blocks.
+ *
+ * @param file      The file record, the descriptor is set if the file is opened
+ * @param path      Path of the uncompressed binlog file
+ * @return          True if the compressed file was opened
+ */
+static bool
+blr_zfile_open(BLFILE *file, const char *path)
+{
+    char zpath[PATH_MAX + 1];
+    BLR_ZFILE_HEADER header;
+    size_t size;
+    int fd;
+
+    snprintf(zpath, sizeof(zpath), "%s" BLR_ZFILE_SUFFIX, path);
+
+    if ((fd = open(zpath, O_RDONLY)) == -1)
+    {
+        return false;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, BLR_ZFILE_MAGIC, BLR_ZFILE_MAGIC_SIZE) != 0)
+    {
+        MXS_ERROR("Compressed binlog file %s is not valid.", zpath);
+        close(fd);
+        return false;
+    }
+
+    size = header.n_blocks * sizeof(BLR_ZBLOCK);
+
+    if ((file->zblocks = (BLR_ZBLOCK *)malloc(size ? size : 1)) == NULL ||
+        pread(fd, file->zblocks, size, header.index_offset) != size)
+    {
+        MXS_ERROR("Failed to read the index of compressed binlog file %s.", zpath);
+        free(file->zblocks);
+        file->zblocks = NULL;
+        close(fd);
+        return false;
+    }
+
+    file->fd = fd;
+    file->n_zblocks = header.n_blocks;
+    file->zsize = header.size;
+    file->zdata = NULL;
+    return true;
+}
+
+/**
+ * Decompress a block of a compressed binlog file
+ *
+ * @param file      The binlog file
+ * @param block     The block
+ * @return          The decompressed data or NULL on error
+ */
+static uint8_t *
+blr_zblock_inflate(BLFILE *file, BLR_ZBLOCK *block)
+{
+    uint8_t *data = (uint8_t *)malloc(block->len);
+    uint8_t *zdata = (uint8_t *)malloc(block->clen);
+    uLongf len = block->len;
+
+    if (data == NULL || zdata == NULL ||
+        pread(file->fd, zdata, block->clen, block->offset) != block->clen ||
+        uncompress(data, &len, zdata, block->clen) != Z_OK || len != block->len)
+    {
+        MXS_ERROR("Failed to decompress the block at position %lu of binlog file %s.",
+                  block->pos, file->binlogname);
+        free(data);
+        data = NULL;
+    }
+
+    free(zdata);
+    return data;
+}
+
+/**
+ * Read from a compressed binlog file. The last block decompressed is kept
+ * with the file, so the slaves reading the same part of the file mostly
+ * copy the events from it. A block is decompressed without holding the lock
+ * of the file.
+ *
+ * @param file      The binlog file
+ * @param buf       Where to copy the data
+ * @param len       Number of bytes to read
+ * @param pos       Binlog position to read from
+ * @return Number of bytes read, 0 at the end of the file or -1 on error
+ */
+static ssize_t
+blr_zfile_read(BLFILE *file, uint8_t *buf, size_t len, uint64_t pos)
+{
+    size_t done = 0;
 
-    if ((n = pwrite(router->binlog_fd, buf, size,
-                    router->last_written)) != size)
+    while (done < len && pos + done < file->zsize)
     {
-        char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
-                  router->binlog_name,
-                  strerror_r(errno, err_msg, sizeof(err_msg)));
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->last_written))
+        uint64_t cur = pos + done;
+        uint64_t low = 0;
+        uint64_t high = file->n_zblocks;
+
+        /** The last block that starts at or before the position */
+        while (high - low > 1)
         {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->last_written,
-                      router->binlog_name,
-                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            uint64_t mid = low + (high - low) / 2;
+
+            if (file->zblocks[mid].pos <= cur)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid;
+            }
         }
-        return 0;
+
+        BLR_ZBLOCK *block = &file->zblocks[low];
+        size_t offset = cur - block->pos;
+        size_t count = MIN(block->len - offset, len - done);
+        bool cached;
+
+        spinlock_acquire(&file->lock);
+        if ((cached = file->zdata && file->zblock == low))
+        {
+            memcpy(buf + done, file->zdata + offset, count);
+        }
+        spinlock_release(&file->lock);
+
+        if (!cached)
+        {
+            uint8_t *data = blr_zblock_inflate(file, block);
+
+            if (data == NULL)
+            {
+                errno = EIO;
+                return -1;
+            }
+
+            memcpy(buf + done, data + offset, count);
+
+            spinlock_acquire(&file->lock);
+            uint8_t *old = file->zdata;
+            file->zdata = data;
+            file->zblock = low;
+            spinlock_release(&file->lock);
+            free(old);
+        }
+
+        done += count;
     }
-    spinlock_acquire(&router->binlog_lock);
-    router->current_pos = hdr->next_pos;
-    router->last_written += size;
-    router->last_event_pos = hdr->next_pos - hdr->event_size;
-    spinlock_release(&router->binlog_lock);
-    return n;
+
+    return done;
 }
 
 /**
- * Flush the content of the binlog file to disk.
- *
- * @param   router  The binlog router
+ * Read from a binlog file, decompressing it if it is compressed
  */
-void
-blr_file_flush(ROUTER_INSTANCE *router)
+static inline ssize_t
+blr_file_pread(BLFILE *file, uint8_t *buf, size_t len, uint64_t pos)
 {
-    fsync(router->binlog_fd);
+    return file->zblocks ? blr_zfile_read(file, buf, len, pos) : pread(file->fd, buf, len, pos);
 }
 
 /**
@@ -421,7 +1720,8 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     strncat(path, "/", PATH_MAX - strlen(path));
     strncat(path, binlog, PATH_MAX - strlen(path));
 
-    if ((file->fd = open(path, O_RDONLY, 0666)) == -1)
+    if ((file->fd = open(path, O_RDONLY, 0666)) == -1 &&
+        (errno != ENOENT || !blr_zfile_open(file, path)))
     {
         MXS_ERROR("Failed to open binlog file %s", path);
         free(file);
@@ -436,6 +1736,345 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     return file;
 }
 
+/**
+ * The reads queued for the I/O threads. The threads wait on the condition
+ * for reads to arrive, which is why this is a mutex and not a spinlock.
+ */
+static BLR_READAHEAD *readahead_head = NULL;
+static BLR_READAHEAD *readahead_tail = NULL;
+static pthread_mutex_t readahead_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_qcond = PTHREAD_COND_INITIALIZER;
+static int n_readahead_threads = 0;
+
+static void blr_readahead_thread(void *data);
+
+/**
+ * Start the I/O threads that read ahead for the slaves in catch-up. The
+ * threads are shared by all binlog routers, so only the threads needed to
+ * have n_threads of them are started. They run until MaxScale exits.
+ *
+ * @param n_threads     The number of threads wanted
+ * @return False if a thread could not be started
+ */
+bool
+blr_readahead_init(int n_threads)
+{
+    bool rval = true;
+
+    pthread_mutex_lock(&readahead_qlock);
+    while (n_readahead_threads < n_threads)
+    {
+        THREAD thr;
+
+        if (thread_start(&thr, blr_readahead_thread, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start binlog read-ahead thread.");
+            rval = false;
+            break;
+        }
+        thread_detach(thr);
+        n_readahead_threads++;
+    }
+    pthread_mutex_unlock(&readahead_qlock);
+
+    return rval;
+}
+
+/**
+ * Allocate the binlog read-ahead of a slave
+ *
+ * @param router    The router of the slave
+ * @return The read-ahead or NULL if memory allocation failed
+ */
+BLR_READAHEAD *
+blr_readahead_alloc(ROUTER_INSTANCE *router)
+{
+    BLR_READAHEAD *ra = (BLR_READAHEAD *)calloc(1, sizeof(BLR_READAHEAD));
+    uint8_t *cur = (uint8_t *)malloc(BLR_READAHEAD_SIZE);
+    uint8_t *next = (uint8_t *)malloc(BLR_READAHEAD_SIZE);
+
+    if (ra == NULL || cur == NULL || next == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for binlog read-ahead.");
+        free(ra);
+        free(cur);
+        free(next);
+        return NULL;
+    }
+
+    ra->cur.data = cur;
+    ra->next.data = next;
+    spinlock_init(&ra->lock);
+    ra->state = BLR_RA_IDLE;
+    ra->refcnt = 1;
+    ra->router = router;
+
+    return ra;
+}
+
+/**
+ * Release a reference to a read-ahead, freeing it with the last one
+ *
+ * @param ra    The read-ahead
+ */
+static void
+blr_readahead_release(BLR_READAHEAD *ra)
+{
+    spinlock_acquire(&ra->lock);
+    int refcnt = --ra->refcnt;
+    spinlock_release(&ra->lock);
+
+    if (refcnt == 0)
+    {
+        free(ra->cur.data);
+        free(ra->next.data);
+        free(ra);
+    }
+}
+
+/**
+ * Free the read-ahead of a slave. A read of the I/O threads that is still
+ * queued keeps it in memory until the read is done.
+ *
+ * @param ra    The read-ahead or NULL
+ */
+void
+blr_readahead_free(BLR_READAHEAD *ra)
+{
+    if (ra)
+    {
+        blr_readahead_release(ra);
+    }
+}
+
+/**
+ * Read a chunk of a binlog file. Of the file being written only the part
+ * before the last committed transaction is read, as the router truncates
+ * the file if the rest is not completed.
+ *
+ * @param router    The router instance
+ * @param file      The binlog file
+ * @param chunk     The chunk to fill
+ * @param start     File offset to read from
+ */
+static void
+blr_chunk_fill(ROUTER_INSTANCE *router, BLFILE *file, BLR_CHUNK *chunk, unsigned long start)
+{
+    unsigned long size = BLR_READAHEAD_SIZE;
+
+    bool current = false;
+
+    spinlock_acquire(&router->binlog_lock);
+    if (strcmp(router->binlog_name, file->binlogname) == 0)
+    {
+        unsigned long safe = router->binlog_position > start ? router->binlog_position - start : 0;
+
+        if (safe < size)
+        {
+            size = safe;
+        }
+        current = true;
+    }
+    spinlock_release(&router->binlog_lock);
+
+    if (current && size > 0)
+    {
+        blr_file_write_buffer(router);
+    }
+
+    strcpy(chunk->binlogname, file->binlogname);
+    chunk->start = start;
+    chunk->len = 0;
+
+    if (size > 0)
+    {
+        ssize_t n = blr_file_pread(file, chunk->data, size, start);
+
+        if (n > 0)
+        {
+            chunk->len = n;
+        }
+    }
+}
+
+/**
+ * Check whether a chunk holds a range of a binlog file
+ */
+static inline bool
+blr_chunk_covers(BLR_CHUNK *chunk, BLFILE *file, unsigned long pos, unsigned int len)
+{
+    return chunk->len > 0 && pos >= chunk->start && pos + len <= chunk->start + chunk->len &&
+           strcmp(chunk->binlogname, file->binlogname) == 0;
+}
+
+/**
+ * Queue the read of the chunk that starts at the given offset, unless the
+ * next chunk is already queued or read.
+ *
+ * @param ra        The read-ahead
+ * @param file      The binlog file
+ * @param start     File offset of the chunk
+ */
+static void
+blr_readahead_queue(BLR_READAHEAD *ra, BLFILE *file, unsigned long start)
+{
+    if (ra->router->catchup_threads <= 0 || n_readahead_threads == 0)
+    {
+        return;
+    }
+
+    spinlock_acquire(&ra->lock);
+    if (ra->state != BLR_RA_IDLE)
+    {
+        spinlock_release(&ra->lock);
+        return;
+    }
+    ra->state = BLR_RA_QUEUED;
+    ra->refcnt++;
+    spinlock_release(&ra->lock);
+
+    strcpy(ra->next.binlogname, file->binlogname);
+    ra->next.start = start;
+    ra->next.len = 0;
+    ra->qnext = NULL;
+
+    pthread_mutex_lock(&readahead_qlock);
+    if (readahead_tail)
+    {
+        readahead_tail->qnext = ra;
+    }
+    else
+    {
+        readahead_head = ra;
+    }
+    readahead_tail = ra;
+    pthread_cond_signal(&readahead_qcond);
+    pthread_mutex_unlock(&readahead_qlock);
+}
+
+/**
+ * Read from a binlog file through the read-ahead of a slave. The data is
+ * copied from the current chunk. When the chunk does not hold it, the chunk
+ * read ahead is used if it does, otherwise the chunk is read from the file.
+ * Once half of a chunk has been used, the next one is queued for the I/O
+ * threads.
+ *
+ * @param ra        The read-ahead
+ * @param file      The binlog file
+ * @param buf       Where to copy the data
+ * @param len       Number of bytes to read
+ * @param pos       File offset to read from
+ * @return Number of bytes read, 0 at the end of the file or -1 on error
+ */
+static ssize_t
+blr_readahead_read(BLR_READAHEAD *ra, BLFILE *file, uint8_t *buf, unsigned int len, unsigned long pos)
+{
+    BLR_CHUNK *cur = &ra->cur;
+
+    if (len > BLR_READAHEAD_SIZE)
+    {
+        return blr_file_pread(file, buf, len, pos);
+    }
+
+    if (!blr_chunk_covers(cur, file, pos, len))
+    {
+        bool swapped = false;
+
+        spinlock_acquire(&ra->lock);
+        if (ra->state == BLR_RA_READY)
+        {
+            if (blr_chunk_covers(&ra->next, file, pos, len))
+            {
+                BLR_CHUNK tmp = ra->cur;
+                ra->cur = ra->next;
+                ra->next = tmp;
+                swapped = true;
+            }
+            ra->state = BLR_RA_IDLE;
+        }
+        spinlock_release(&ra->lock);
+
+        if (!swapped)
+        {
+            blr_chunk_fill(ra->router, file, cur, pos);
+        }
+
+        if (!blr_chunk_covers(cur, file, pos, len))
+        {
+            return blr_file_pread(file, buf, len, pos);
+        }
+    }
+
+    memcpy(buf, cur->data + (pos - cur->start), len);
+
+    /** A short chunk ends at the end of the readable data */
+    if (cur->len == BLR_READAHEAD_SIZE && pos + len - cur->start >= BLR_READAHEAD_SIZE / 2)
+    {
+        blr_readahead_queue(ra, file, cur->start + cur->len);
+    }
+
+    return len;
+}
+
+/**
+ * An I/O thread reading ahead for the slaves. The reads of slaves that
+ * have gone away are skipped. The thread never returns.
+ *
+ * @param data  Unused, here to satisfy the thread system
+ */
+static void
+blr_readahead_thread(void *data)
+{
+    pthread_mutex_lock(&readahead_qlock);
+    while (true)
+    {
+        if (readahead_head == NULL)
+        {
+            pthread_cond_wait(&readahead_qcond, &readahead_qlock);
+            continue;
+        }
+
+        BLR_READAHEAD *ra = readahead_head;
+        readahead_head = ra->qnext;
+        if (readahead_head == NULL)
+        {
+            readahead_tail = NULL;
+        }
+        pthread_mutex_unlock(&readahead_qlock);
+
+        spinlock_acquire(&ra->lock);
+        bool wanted = ra->refcnt > 1;
+        spinlock_release(&ra->lock);
+
+        if (wanted)
+        {
+            BLFILE *file = blr_open_binlog(ra->router, ra->next.binlogname);
+
+            if (file)
+            {
+                blr_chunk_fill(ra->router, file, &ra->next, ra->next.start);
+                blr_close_binlog(ra->router, file);
+            }
+        }
+
+        spinlock_acquire(&ra->lock);
+        ra->state = BLR_RA_READY;
+        spinlock_release(&ra->lock);
+        blr_readahead_release(ra);
+
+        pthread_mutex_lock(&readahead_qlock);
+    }
+}
+
+/**
+ * Read from a binlog file, through the read-ahead if there is one
+ */
+static inline ssize_t
+blr_pread(BLFILE *file, BLR_READAHEAD *ra, uint8_t *buf, unsigned int len, unsigned long pos)
+{
+    return ra ? blr_readahead_read(ra, file, buf, len, pos) : blr_file_pread(file, buf, len, pos);
+}
+
 /**
  * Read a replication event into a GWBUF structure.
  *
@@ -449,6 +2088,51 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
 GWBUF *
 blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HEADER *hdr, char *errmsg)
 {
+    return blr_read_binlog_ahead(router, file, pos, hdr, errmsg, NULL);
+}
+
+/**
+ * Check if the payload of an event read for a slave is left in the file to be
+ * sent with sendfile(). The slave needs the contents of a rotate event and the
+ * events in the current read-ahead chunk are already in memory.
+ *
+ * @param router    The router instance
+ * @param file      File record
+ * @param ra        The read-ahead of the slave, may be NULL
+ * @param hdr       Header of the event
+ * @param pos       Position of the event
+ * @return True if only the header of the event should be read
+ */
+static bool
+blr_event_in_file(ROUTER_INSTANCE *router, BLFILE *file, BLR_READAHEAD *ra,
+                  REP_HEADER *hdr, unsigned long pos)
+{
+    return router->sendfile_size > 0 && file->zblocks == NULL &&
+           hdr->event_size >= router->sendfile_size &&
+           hdr->event_size + 1 < MYSQL_PACKET_LENGTH_MAX && hdr->event_type != ROTATE_EVENT &&
+           !(ra && blr_chunk_covers(&ra->cur, file, pos, hdr->event_size));
+}
+
+/**
+ * Read a replication event for a slave into a GWBUF structure. The event is
+ * taken from the event cache if it is there, otherwise it is read through the
+ * read-ahead of the slave. Of an event of at least sendfile_size bytes only
+ * the event header is read, which the caller recognises from the length of
+ * the buffer, and the event is sent with blr_send_event_file().
+ *
+ * @param router    The router instance
+ * @param file      File record
+ * @param pos       Position of binlog record to read
+ * @param hdr       Binlog header to populate
+ * @param errmsg    Allocated BINLOG_ERROR_MSG_LEN bytes message error buffer
+ * @param slave     The slave, NULL to read the file directly
+ * @return          The binlog record wrapped in a GWBUF structure
+ */
+GWBUF *
+blr_read_binlog_ahead(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HEADER *hdr,
+                      char *errmsg, ROUTER_SLAVE *slave)
+{
+    BLR_READAHEAD *ra = slave ? slave->readahead : NULL;
     uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
     GWBUF *result;
     unsigned char *data;
@@ -469,7 +2153,11 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     }
 
     spinlock_acquire(&file->lock);
-    if (fstat(file->fd, &statb) == 0)
+    if (file->zblocks)
+    {
+        filelen = file->zsize;
+    }
+    else if (fstat(file->fd, &statb) == 0)
     {
         filelen = statb.st_size;
     }
@@ -542,8 +2230,20 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     spinlock_release(&file->lock);
     spinlock_release(&router->binlog_lock);
 
+    /* The position is safe to read, the event may still be in memory */
+    if (slave && (result = blr_cache_read(router, slave, file->binlogname, pos, hdr)) != NULL)
+    {
+        return result;
+    }
+
+    /* The event may not have been written to the file yet */
+    if (strcmp(router->binlog_name, file->binlogname) == 0)
+    {
+        blr_file_write_buffer(router);
+    }
+
     /* Read the header information from the file */
-    if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+    if ((n = blr_pread(file, ra, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
     {
         switch (n)
         {
@@ -627,7 +2327,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                   pos, file->binlogname, filelen, router->binlog_position,
                   router->binlog_name);
 
-        if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_file_pread(file, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -682,6 +2382,21 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                       "rereading");
         }
     }
+
+    if (slave && blr_event_in_file(router, file, ra, hdr, pos))
+    {
+        if ((result = gwbuf_alloc_and_load(BINLOG_EVENT_HDR_LEN, hdbuf)) == NULL)
+        {
+            snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
+                     "Failed to allocate memory for binlog event header, event at %lu in binlog file '%s'",
+                     pos, file->binlogname);
+            return NULL;
+        }
+
+        hdr->ok = SLAVE_POS_READ_OK;
+        return result;
+    }
+
     if ((result = gwbuf_alloc(hdr->event_size)) == NULL)
     {
         snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
@@ -694,8 +2409,8 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
 
     memcpy(data, hdbuf, BINLOG_EVENT_HDR_LEN);  // Copy the header in
 
-    if ((n = pread(file->fd, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
-                   pos + BINLOG_EVENT_HDR_LEN))
+    if ((n = blr_pread(file, ra, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
+                       pos + BINLOG_EVENT_HDR_LEN))
         != hdr->event_size - BINLOG_EVENT_HDR_LEN)  // Read the balance
     {
         if (n == -1)
@@ -778,6 +2493,8 @@ blr_close_binlog(ROUTER_INSTANCE *router, BLFILE *file)
     {
         close(file->fd);
         file->fd = -1;
+        free(file->zblocks);
+        free(file->zdata);
         free(file);
     }
 }
@@ -815,6 +2532,10 @@ blr_file_size(BLFILE *file)
 {
     struct stat statb;
 
+    if (file->zblocks)
+    {
+        return file->zsize;
+    }
     if (fstat(file->fd, &statb) == 0)
     {
         return statb.st_size;
@@ -925,7 +2646,12 @@ blr_file_next_exists(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     sprintf(bigbuf, "%s/%s", router->binlogdir, buf);
     if (access(bigbuf, R_OK) == -1)
     {
-        return 0;
+        strcat(bigbuf, BLR_ZFILE_SUFFIX);
+
+        if (access(bigbuf, R_OK) == -1)
+        {
+            return 0;
+        }
     }
     return 1;
 }
@@ -973,6 +2699,7 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
     BINLOG_EVENT_DESC last_event;
     BINLOG_EVENT_DESC fde_event;
     int fde_seen = 0;
+    BLR_INDEX_RECORD index_rec;
 
     memset(&first_event, '\0', sizeof(first_event));
     memset(&last_event, '\0', sizeof(last_event));
@@ -985,6 +2712,8 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
         return 1;
     }
 
+    blr_file_write_buffer(router);
+
     if (fstat(router->binlog_fd, &statb) == 0)
     {
         filelen = statb.st_size;
@@ -994,6 +2723,20 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
     router->binlog_position = 4;
     router->current_safe_event = 4;
 
+    if (router->index_interval > 0 && blr_index_last(router, filelen, &index_rec, &hdr))
+    {
+        /** The events before the last transaction boundary in the index were checked before */
+        pos = index_rec.pos;
+        last_known_commit = pos;
+        found_chksum = (index_rec.flags & BLR_INDEX_CHECKSUM) != 0;
+        first_event.event_time = hdr.timestamp;
+        first_event.event_type = hdr.event_type;
+        first_event.event_pos = pos;
+
+        MXS_NOTICE("%s: Checking binlog file %s from the indexed position %llu.",
+                   router->service->name, router->binlog_name, pos);
+    }
+
     while (1)
     {
 
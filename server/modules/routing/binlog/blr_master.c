@@ -63,6 +63,7 @@
 #include <spinlock.h>
 #include <housekeeper.h>
 #include <buffer.h>
+#include <maxscale_crc32.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -92,6 +93,7 @@ static void blr_log_packet(int priority, char *msg, uint8_t *ptr, int len);
 void blr_master_close(ROUTER_INSTANCE *);
 char *blr_extract_column(GWBUF *buf, int col);
 void poll_fake_write_event(DCB *dcb);
+int poll_current_thread();
 GWBUF *blr_read_events_from_pos(ROUTER_INSTANCE *router, unsigned long long pos, REP_HEADER *hdr,
                                 unsigned long long pos_end);
 static void blr_check_last_master_event(void *inst);
@@ -100,9 +102,12 @@ static void blr_log_identity(ROUTER_INSTANCE *router);
 static void blr_distribute_error_message(ROUTER_INSTANCE *router, char *message, char *state,
                                          unsigned int err_code);
 
-int blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *buf);
+static bool blr_write_event_fragment(ROUTER_INSTANCE *router, GWBUF *pkt, uint32_t offset,
+                                     uint32_t len);
 void extract_checksum(ROUTER_INSTANCE* router, uint8_t *cksumptr, uint8_t len);
 static void blr_terminate_master_replication(ROUTER_INSTANCE *router, uint8_t* ptr, int len);
+static bool blr_slave_handoff(ROUTER_SLAVE *slave, const char* binlog_name, uint32_t binlog_pos,
+                              REP_HEADER *hdr, GWBUF *event);
 
 static int keepalive = 1;
 
@@ -864,6 +869,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
     int preslen = -1;
     int prev_length = -1;
     int n_bufs = -1, pn_bufs = -1;
+    uint8_t head[MYSQL_HEADER_LEN + 1 + BINLOG_EVENT_HDR_LEN];
+    bool fragment;
 
     /*
      * Prepend any residual buffer to the buffer chain we have
@@ -910,8 +917,22 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
             len = EXTRACT24(pdata) + 4;
         }
         /* len is now the payload length for the packet we are working on */
+        fragment = false;
 
-        if (reslen < len && pkt_length >= len)
+        if (reslen < len && pkt_length >= len &&
+            len - MYSQL_HEADER_LEN == MYSQL_PACKET_LENGTH_MAX)
+        {
+            /*
+             * A full packet of a large event. Only the headers are
+             * copied, the packet is written into the binlog directly
+             * from the buffer chain.
+             */
+            gwbuf_copy_data(pkt, 0, sizeof(head), head);
+            ptr = head;
+            n_bufs = -1;
+            fragment = true;
+        }
+        else if (reslen < len && pkt_length >= len)
         {
             /*
              * The message is contained in more than the current
@@ -988,7 +1009,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
         /*
          * ptr now points at the current message in a contiguous buffer,
          * this buffer is either within the GWBUF or in a malloc'd
-         * copy if the message straddles GWBUF's.
+         * copy if the message straddles GWBUF's. For a fragment of a
+         * large event only the headers are in the contiguous buffer.
          */
 
         if (len < BINLOG_EVENT_HDR_LEN && router->master_event_state != BLR_EVENT_ONGOING)
@@ -1034,7 +1056,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                                    (no_residual ? "No residual data from previous call" :
                                     "Residual data from previous call") : ""));
 
-                        blr_log_packet(LOG_ERR, "Packet:", ptr, len);
+                        blr_log_packet(LOG_ERR, "Packet:", ptr, fragment ? sizeof(head) : len);
 
                         MXS_ERROR("This event (0x%x) was contained in %d GWBUFs, "
                                   "the previous events was contained in %d GWBUFs",
@@ -1057,13 +1079,13 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                     }
 
                     /** Prepare the checksum variables for this event */
-                    router->stored_checksum = crc32(0L, NULL, 0);
+                    router->stored_checksum = mxs_crc32(0L, NULL, 0);
                     router->checksum_size = hdr.event_size - MYSQL_CHECKSUM_LEN;
                     router->partial_checksum_bytes = 0;
                 }
                 else
                 {
-                    blr_terminate_master_replication(router, ptr, len);
+                    blr_terminate_master_replication(router, ptr, fragment ? sizeof(head) : len);
                 }
 
                 if (hdr.ok == 0)
@@ -1108,32 +1130,16 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                 {
                     /* current partial event is being written to disk file */
                     uint32_t offset = MYSQL_HEADER_LEN;
-                    uint32_t extra_bytes = MYSQL_HEADER_LEN;
 
                     /** Don't write the OK byte into the binlog */
                     if (router->master_event_state == BLR_EVENT_STARTED)
                     {
                         offset = MYSQL_HEADER_LEN + 1;
                         router->master_event_state = BLR_EVENT_ONGOING;
-                        extra_bytes = MYSQL_HEADER_LEN + 1;
-                    }
-
-                    if (router->master_chksum)
-                    {
-                        uint32_t size = (len - extra_bytes) < router->checksum_size ?
-                            len - extra_bytes : router->checksum_size;
-                        router->stored_checksum = crc32(router->stored_checksum,
-                                                        ptr + offset,
-                                                        size);
-                        router->checksum_size -= size;
-
-                        if (router->checksum_size == 0 && size < len - offset)
-                        {
-                            extract_checksum(router, ptr + offset + size, len - offset - size);
-                        }
                     }
 
-                    if (blr_write_data_into_binlog(router, len - offset, ptr + offset) == 0)
+                    /** This is a full packet, it is written from the buffer chain */
+                    if (!blr_write_event_fragment(router, pkt, offset, len - offset))
                     {
                         /** Failed to write to the binlog file, destroy the buffer
                          * chain and close the connection with the master */
@@ -1145,6 +1151,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                         blr_master_delayed_connect(router);
                         return;
                     }
+                    free(msg);
+                    msg = NULL;
                     pkt = gwbuf_consume(pkt, len);
                     pkt_length -= len;
                     continue;
@@ -1172,7 +1180,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
 
                 if (router->checksum_size > 0)
                 {
-                    router->stored_checksum = crc32(router->stored_checksum,
+                    router->stored_checksum = mxs_crc32(router->stored_checksum,
                                                     ptr + offset,
                                                     size);
                     router->checksum_size -= size;
@@ -1843,6 +1851,13 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
     int action;
     unsigned int cstate;
 
+    /**
+     * The event is kept in memory for the slaves that read it later. The
+     * up to date slaves share its buffer. A rotate event is not cached as it
+     * is distributed once the router has moved to the next file.
+     */
+    GWBUF *cached = hdr->event_type != ROTATE_EVENT ? blr_cache_add(router, hdr, ptr) : NULL;
+
     spinlock_acquire(&router->lock);
     slave = router->slaves;
     while (slave)
@@ -1991,8 +2006,16 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
                 {
                     blr_slave_rotate(router, slave, ptr);
                 }
+                else if (cached && slave->dcb->owner != poll_current_thread() &&
+                         blr_slave_handoff(slave, binlog_name, binlog_pos, hdr, cached))
+                {
+                    /** The thread that owns the slave sends the event */
+                    break;
+                }
 
-                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr))
+                if (cached ?
+                    blr_send_event_buffer(role, binlog_name, binlog_pos, slave, hdr, cached) :
+                    blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr))
                 {
                     spinlock_acquire(&slave->catch_lock);
                     if (hdr->event_type != ROTATE_EVENT)
@@ -2225,6 +2248,9 @@ GWBUF
     /* Get current binnlog position */
     end_pos = pos_end;
 
+    /* The events may still be in the write buffer */
+    blr_file_write_buffer(router);
+
     /* end of file reached, we're done */
     if (pos == end_pos)
     {
@@ -2584,33 +2610,77 @@ blr_distribute_error_message(ROUTER_INSTANCE *router, char *message, char *state
     spinlock_release(&router->lock);
 }
 
-int
-blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *buf)
+/**
+ * Write a full packet of a large event into the binlog
+ *
+ * The packet is written directly from the buffer chain it was read into and
+ * the checksum of the event is updated one buffer at a time. No contiguous
+ * copy of the packet is made.
+ *
+ * @param router The router instance
+ * @param pkt    The buffer chain starting with the packet
+ * @param offset Offset of the event data in the packet
+ * @param len    Length of the event data in the packet
+ * @return True if the data was written
+ */
+static bool
+blr_write_event_fragment(ROUTER_INSTANCE *router, GWBUF *pkt, uint32_t offset, uint32_t len)
 {
-    int n;
+    struct iovec iov[BLR_FRAGMENT_IOV];
+    int n_iov = 0;
+    uint32_t iov_len = 0;
+
+    while (pkt && offset >= GWBUF_LENGTH(pkt))
+    {
+        offset -= GWBUF_LENGTH(pkt);
+        pkt = pkt->next;
+    }
 
-    if ((n = pwrite(router->binlog_fd, buf, data_len,
-                    router->last_written)) != data_len)
+    while (pkt && len > 0)
     {
-        char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
-                  router->binlog_name,
-                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        uint8_t *data = (uint8_t*)GWBUF_DATA(pkt) + offset;
+        uint32_t n = MIN(GWBUF_LENGTH(pkt) - offset, len);
+
+        if (router->master_chksum)
+        {
+            uint32_t size = MIN(n, router->checksum_size);
+
+            if (size > 0)
+            {
+                router->stored_checksum = mxs_crc32(router->stored_checksum, data, size);
+                router->checksum_size -= size;
+            }
+
+            if (router->checksum_size == 0 && size < n)
+            {
+                extract_checksum(router, data + size, n - size);
+            }
+        }
+
+        iov[n_iov].iov_base = data;
+        iov[n_iov].iov_len = n;
+        n_iov++;
+        iov_len += n;
+        len -= n;
+        offset = 0;
+        pkt = pkt->next;
 
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->last_written))
+        /** The rest of the event is written past the write buffer as well */
+        if (n_iov == BLR_FRAGMENT_IOV || len == 0 || pkt == NULL)
         {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->last_written,
-                      router->binlog_name,
-                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            if (blr_file_writev(router, iov, n_iov, iov_len, true) == 0)
+            {
+                return false;
+            }
+            router->wbuf_partial = true;
+            router->last_written += iov_len;
+            n_iov = 0;
+            iov_len = 0;
         }
-        return 0;
     }
-    router->last_written += data_len;
-    return n;
+
+    ss_dassert(len == 0);
+    return len == 0;
 }
 
 /**
@@ -2761,6 +2831,186 @@ bool blr_send_event(blr_thread_role_t role,
     return rval;
 }
 
+/**
+ * Send a single replication event held in a buffer to a slave
+ *
+ * An event that fits into one packet is not copied. Only the packet header is
+ * allocated for the slave and the buffer of the event is shared with the
+ * other slaves it is sent to. Larger events are sent with blr_send_event().
+ *
+ * @param role  What is the role of the caller, slave or master.
+ * @param binlog_name The name of the binlogfile.
+ * @param binlog_pos The position in the binlogfile.
+ * @param slave Slave where the event is sent to
+ * @param hdr   Replication header
+ * @param event A contiguous buffer of the whole event, still owned by the caller
+ * @return True on success, false if memory allocation failed
+ */
+bool blr_send_event_buffer(blr_thread_role_t role,
+                           const char* binlog_name,
+                           uint32_t binlog_pos,
+                           ROUTER_SLAVE *slave,
+                           REP_HEADER *hdr,
+                           GWBUF *event)
+{
+    if (hdr->event_size + 1 >= MYSQL_PACKET_LENGTH_MAX ||
+        ((strcmp(slave->lsi_binlog_name, binlog_name) == 0) &&
+         (slave->lsi_binlog_pos == binlog_pos)))
+    {
+        /** This also reports an event that has already been sent */
+        return blr_send_event(role, binlog_name, binlog_pos, slave, hdr, GWBUF_DATA(event));
+    }
+
+    GWBUF *head = gwbuf_alloc(MYSQL_HEADER_LEN + 1);
+    GWBUF *body = gwbuf_clone(event);
+
+    if (head == NULL || body == NULL)
+    {
+        gwbuf_free(head);
+        gwbuf_free(body);
+        MXS_ERROR("Failed to send an event of %u bytes to slave at %s:%d.",
+                  hdr->event_size, slave->dcb->remote,
+                  ntohs(slave->dcb->ipv4.sin_port));
+        return false;
+    }
+
+    uint8_t *data = GWBUF_DATA(head);
+    encode_value(data, hdr->event_size + 1, 24);
+    data[3] = slave->seqno++;
+    data[4] = 0; // OK byte
+
+    slave->stats.n_bytes += MYSQL_HEADER_LEN + 1 + hdr->event_size;
+    slave->dcb->func.write(slave->dcb, gwbuf_append(head, body));
+    slave->stats.n_events++;
+
+    strcpy(slave->lsi_binlog_name, binlog_name);
+    slave->lsi_binlog_pos = binlog_pos;
+    slave->lsi_sender_role = role;
+    slave->lsi_sender_tid = thread_self();
+
+    return true;
+}
+
+/**
+ * Hand an event over to the thread that owns the slave
+ *
+ * The slave stays busy until its own thread has sent the event, so the
+ * master thread only has to clone the cached event for each slave. The
+ * event is sent from the DCB_REASON_DRAINED callback of the slave.
+ *
+ * @param slave Slave where the event is sent to
+ * @param binlog_name The name of the binlogfile.
+ * @param binlog_pos The position in the binlogfile.
+ * @param hdr   Replication header
+ * @param event The cached event, still owned by the caller
+ * @return True if the event was handed over, false if it must be sent now
+ */
+static bool blr_slave_handoff(ROUTER_SLAVE *slave,
+                              const char* binlog_name,
+                              uint32_t binlog_pos,
+                              REP_HEADER *hdr,
+                              GWBUF *event)
+{
+    GWBUF *clone = gwbuf_clone(event);
+
+    if (clone == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&slave->catch_lock);
+    ss_dassert(slave->handoff == NULL);
+    slave->handoff_hdr = *hdr;
+    strcpy(slave->handoff_binlog_name, binlog_name);
+    slave->handoff_binlog_pos = binlog_pos;
+    slave->handoff = clone;
+    spinlock_release(&slave->catch_lock);
+
+    poll_fake_write_event(slave->dcb);
+    return true;
+}
+
+/**
+ * Send a single replication event to a slave from the binlog file
+ *
+ * The event header has already been read and the rest of the event is copied
+ * from the file to the socket of the slave by the kernel. Only the events
+ * that fit into one packet can be sent this way.
+ *
+ * @param role  What is the role of the caller, slave or master.
+ * @param binlog_name The name of the binlogfile.
+ * @param binlog_pos The position in the binlogfile.
+ * @param slave Slave where the event is sent to
+ * @param hdr   Replication header
+ * @param file  The binlog file the event is in
+ * @param evhdr The event header as it was read from the disk, still owned by the caller
+ * @return True on success, false if the event could not be sent
+ */
+bool blr_send_event_file(blr_thread_role_t role,
+                         const char* binlog_name,
+                         uint32_t binlog_pos,
+                         ROUTER_SLAVE *slave,
+                         REP_HEADER *hdr,
+                         BLFILE *file,
+                         GWBUF *evhdr)
+{
+    ss_dassert(hdr->event_size + 1 < MYSQL_PACKET_LENGTH_MAX);
+
+    if ((strcmp(slave->lsi_binlog_name, binlog_name) == 0) &&
+        (slave->lsi_binlog_pos == binlog_pos))
+    {
+        MXS_ERROR("Slave %s:%i, server-id %d, binlog '%s', position %u: "
+                  "thread %lu in the role of %s could not send the event, "
+                  "the event has already been sent by thread %lu in the role of %s.",
+                  slave->dcb->remote,
+                  ntohs((slave->dcb->ipv4).sin_port),
+                  slave->serverid,
+                  binlog_name,
+                  binlog_pos,
+                  thread_self(),
+                  ROLETOSTR(role),
+                  slave->lsi_sender_tid,
+                  ROLETOSTR(slave->lsi_sender_role));
+        return false;
+    }
+
+    GWBUF *head = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + BINLOG_EVENT_HDR_LEN);
+
+    if (head == NULL)
+    {
+        MXS_ERROR("Failed to send an event of %u bytes to slave at %s:%d.",
+                  hdr->event_size, slave->dcb->remote,
+                  ntohs(slave->dcb->ipv4.sin_port));
+        return false;
+    }
+
+    uint8_t *data = GWBUF_DATA(head);
+    encode_value(data, hdr->event_size + 1, 24);
+    data[3] = slave->seqno++;
+    data[4] = 0; // OK byte
+    memcpy(data + MYSQL_HEADER_LEN + 1, GWBUF_DATA(evhdr), BINLOG_EVENT_HDR_LEN);
+
+    if (!dcb_sendfile(slave->dcb, head, file->fd, binlog_pos + BINLOG_EVENT_HDR_LEN,
+                      hdr->event_size - BINLOG_EVENT_HDR_LEN))
+    {
+        MXS_ERROR("Failed to send an event of %u bytes from binlog file '%s' "
+                  "to slave at %s:%d.", hdr->event_size, file->binlogname,
+                  slave->dcb->remote, ntohs(slave->dcb->ipv4.sin_port));
+        return false;
+    }
+
+    slave->stats.n_bytes += MYSQL_HEADER_LEN + 1 + hdr->event_size;
+    slave->stats.n_events++;
+    slave->stats.n_sendfile++;
+
+    strcpy(slave->lsi_binlog_name, binlog_name);
+    slave->lsi_binlog_pos = binlog_pos;
+    slave->lsi_sender_role = role;
+    slave->lsi_sender_tid = thread_self();
+
+    return true;
+}
+
 /**
  * Extract the checksum from the binlogs
  *
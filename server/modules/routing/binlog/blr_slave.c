@@ -66,6 +66,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
 #include <string.h>
 #include <maxscale.h>
 #include <service.h>
@@ -82,7 +83,8 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <version.h>
-#include <zlib.h>
+#include <maxscale_crc32.h>
+#include <mysql_wire.h>
 
 extern int load_mysql_users(SERVICE *service);
 extern void blr_master_close(ROUTER_INSTANCE* router);
@@ -156,6 +158,7 @@ static int blr_slave_send_columndef_with_status_schema(ROUTER_INSTANCE *router,
                                                        char *name, int type, int len, uint8_t seqno);
 static void blr_send_slave_heartbeat(void *inst);
 static int blr_slave_send_heartbeat(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
+static bool blr_slave_send_handoff(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 
 void poll_fake_write_event(DCB *dcb);
 
@@ -308,10 +311,13 @@ blr_slave_request(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
  *  SHOW WARNINGS
  *  SHOW [GLOBAL] STATUS LIKE 'Uptime'
  *
- * Seven set commands are supported:
+ * Ten set commands are supported:
  *  SET @master_binlog_checksum = @@global.binlog_checksum
  *  SET @master_heartbeat_period=...
  *  SET @slave_slave_uuid=...
+ *  SET @slave_connect_state=...
+ *  SET @slave_gtid_strict_mode=...
+ *  SET @slave_gtid_ignore_duplicates=...
  *  SET NAMES latin1
  *  SET NAMES utf8
  *  SET NAMES XXX
@@ -768,6 +774,39 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
             free(query_text);
             return blr_slave_replay(router, slave, router->saved_master.chksum1);
         }
+        else if (strcasecmp(word, "@slave_connect_state") == 0)
+        {
+            /** The GTID list has commas, take the value from the query */
+            char *value = memchr(qtext, '=', query_len);
+
+            free(slave->gtid_state);
+            slave->gtid_state = NULL;
+
+            if (value)
+            {
+                int len = query_len - (++value - qtext);
+
+                while (len > 0 && (isspace(*value) || *value == '\''))
+                {
+                    value++;
+                    len--;
+                }
+                while (len > 0 && (isspace(value[len - 1]) || value[len - 1] == '\''))
+                {
+                    len--;
+                }
+                slave->gtid_state = strndup(value, len);
+            }
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
+        else if ((strcasecmp(word, "@slave_gtid_strict_mode") == 0) ||
+                 (strcasecmp(word, "@slave_gtid_ignore_duplicates") == 0))
+        {
+            /* return OK */
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
         else if (strcasecmp(word, "@slave_uuid") == 0)
         {
             if ((word = strtok_r(NULL, sep, &brkb)) != NULL)
@@ -1942,6 +1981,33 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
     strncpy(slave->binlogfile, (char *)ptr, binlognamelen);
     slave->binlogfile[binlognamelen] = 0;
 
+    if (binlognamelen == 0 && slave->gtid_state)
+    {
+        char error[BINLOG_ERROR_MSG_LEN + 1];
+
+        /** A MariaDB 10 slave using GTIDs sends no binlog file */
+        if (!blr_gtid_find(router, slave->gtid_state, slave->binlogfile,
+                           &slave->binlog_pos, error, sizeof(error)))
+        {
+            MXS_ERROR("%s: Slave %s, server-id %d, failed to register with GTID "
+                      "state '%s': %s",
+                      router->service->name, slave->dcb->remote,
+                      slave->serverid, slave->gtid_state, error);
+            slave->state = BLRS_ERRORED;
+            blr_send_custom_error(slave->dcb, 1, 0, error, "HY000", 1236);
+            dcb_close(slave->dcb);
+            return 1;
+        }
+
+        binlognamelen = strlen(slave->binlogfile);
+
+        MXS_NOTICE("%s: Slave %s, server-id %d, registered with GTID state '%s' "
+                   "at binlog file '%s', position %lu",
+                   router->service->name, slave->dcb->remote, slave->serverid,
+                   slave->gtid_state, slave->binlogfile,
+                   (unsigned long)slave->binlog_pos);
+    }
+
     if (router->trx_safe)
     {
         /**
@@ -2027,8 +2093,8 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
          * include the length, sequence number and ok byte that makes up the first
          * 5 bytes of the message. We also do not include the 4 byte checksum itself.
          */
-        chksum = crc32(0L, NULL, 0);
-        chksum = crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
+        chksum = mxs_crc32(0L, NULL, 0);
+        chksum = mxs_crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
         encode_value(ptr, chksum, 32);
     }
 
@@ -2255,8 +2321,15 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
 #endif
     int events_before = slave->stats.n_events;
 
+    /** Without the read-ahead the events not in the cache are read one by one */
+    if (slave->readahead == NULL)
+    {
+        slave->readahead = blr_readahead_alloc(router);
+    }
+
     while (burst-- && burst_size > 0 &&
-           (record = blr_read_binlog(router, file, slave->binlog_pos, &hdr, read_errmsg)) != NULL)
+           (record = blr_read_binlog_ahead(router, file, slave->binlog_pos, &hdr,
+                                           read_errmsg, slave)) != NULL)
     {
         char binlog_name[BINLOG_FNAMELEN + 1];
         uint32_t binlog_pos;
@@ -2318,8 +2391,14 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             }
         }
 
-        if (blr_send_event(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
-                           slave, &hdr, (uint8_t*) record->start))
+        /** A large event was left in the file and only its header was read */
+        bool sent = GWBUF_LENGTH(record) < hdr.event_size ?
+                    blr_send_event_file(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
+                                        slave, &hdr, file, record) :
+                    blr_send_event_buffer(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
+                                          slave, &hdr, record);
+
+        if (sent)
         {
             if (hdr.event_type != ROTATE_EVENT)
             {
@@ -2617,6 +2696,11 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
     }
     if (reason == DCB_REASON_DRAINED)
     {
+        if (slave->state == BLRS_DUMPING && blr_slave_send_handoff(router, slave))
+        {
+            return 0;
+        }
+
         if (slave->state == BLRS_DUMPING)
         {
             spinlock_acquire(&slave->catch_lock);
@@ -2668,6 +2752,73 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
     return 0;
 }
 
+/**
+ * Send the event the master thread handed over to this slave
+ *
+ * The slave has been kept busy since the event was handed over. Once the
+ * event is sent the slave is either up to date again or, if more events
+ * were distributed in the meantime, it reads them from the binlog.
+ *
+ * @param router    The binlog router
+ * @param slave     The slave instance
+ * @return True if there was an event to send
+ */
+static bool
+blr_slave_send_handoff(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    spinlock_acquire(&slave->catch_lock);
+    GWBUF *event = slave->handoff;
+    slave->handoff = NULL;
+    spinlock_release(&slave->catch_lock);
+
+    if (event == NULL)
+    {
+        return false;
+    }
+
+    if (blr_send_event_buffer(BLR_THREAD_ROLE_SLAVE, slave->handoff_binlog_name,
+                              slave->handoff_binlog_pos, slave, &slave->handoff_hdr, event))
+    {
+        bool catchup = false;
+
+        slave->stats.n_handoff++;
+        spinlock_acquire(&slave->catch_lock);
+        slave->binlog_pos = slave->handoff_hdr.next_pos;
+        if (slave->overrun)
+        {
+            slave->stats.n_overrun++;
+            slave->overrun = 0;
+            slave->cstate &= ~(CS_UPTODATE | CS_EXPECTCB);
+            catchup = true;
+        }
+        else
+        {
+            slave->cstate &= ~CS_BUSY;
+        }
+        spinlock_release(&slave->catch_lock);
+
+        if (catchup)
+        {
+            blr_slave_catchup(router, slave, true);
+        }
+    }
+    else
+    {
+        MXS_WARNING("Slave %s:%i, server-id %d, binlog '%s, position %u: "
+                    "Slave-thread could not send event to slave, closing connection.",
+                    slave->dcb->remote,
+                    ntohs((slave->dcb->ipv4).sin_port),
+                    slave->serverid,
+                    slave->handoff_binlog_name,
+                    slave->handoff_binlog_pos);
+        slave->state = BLRS_ERRORED;
+        dcb_close(slave->dcb);
+    }
+
+    gwbuf_free(event);
+    return true;
+}
+
 /**
  * Rotate the slave to the new binlog file
  *
@@ -2763,8 +2914,8 @@ blr_slave_fake_rotate(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, BLFILE** fil
          * include the length, sequence number and ok byte that makes up the first
          * 5 bytes of the message. We also do not include the 4 byte checksum itself.
          */
-        chksum = crc32(0L, NULL, 0);
-        chksum = crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
+        chksum = mxs_crc32(0L, NULL, 0);
+        chksum = mxs_crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
         encode_value(ptr, chksum, 32);
     }
 
@@ -2831,8 +2982,8 @@ blr_slave_send_fde(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
      * and write it into the header
      */
     ptr = GWBUF_DATA(record) + hdr.event_size - 4;
-    chksum = crc32(0L, NULL, 0);
-    chksum = crc32(chksum, GWBUF_DATA(record), hdr.event_size - 4);
+    chksum = mxs_crc32(0L, NULL, 0);
+    chksum = mxs_crc32(chksum, GWBUF_DATA(record), hdr.event_size - 4);
     encode_value(ptr, chksum, 32);
 
     slave->dcb->func.write(slave->dcb, head);
@@ -2883,47 +3034,13 @@ blr_slave_send_columndef(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, char *nam
                          uint8_t seqno)
 {
     GWBUF *pkt;
-    uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(26 + strlen(name))) == NULL)
+    if ((pkt = gwbuf_alloc(mxs_wire_coldef_len(0, 0, strlen(name)))) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
-    encode_value(ptr, 22 + strlen(name), 24);   // Add length of data packet
-    ptr += 3;
-    *ptr++ = seqno;                 // Sequence number in response
-    *ptr++ = 3;                 // Catalog is always def
-    *ptr++ = 'd';
-    *ptr++ = 'e';
-    *ptr++ = 'f';
-    *ptr++ = 0;                 // Schema name length
-    *ptr++ = 0;                 // virtual table name length
-    *ptr++ = 0;                 // Table name length
-    *ptr++ = strlen(name);              // Column name length;
-    while (*name)
-    {
-        *ptr++ = *name++;    // Copy the column name
-    }
-    *ptr++ = 0;                 // Orginal column name
-    *ptr++ = 0x0c;                  // Length of next fields always 12
-    *ptr++ = 0x3f;                  // Character set
-    *ptr++ = 0;
-    encode_value(ptr, len, 32);         // Add length of column
-    ptr += 4;
-    *ptr++ = type;
-    *ptr++ = 0x81;                  // Two bytes of flags
-    if (type == 0xfd)
-    {
-        *ptr++ = 0x1f;
-    }
-    else
-    {
-        *ptr++ = 0x00;
-    }
-    *ptr++ = 0;
-    *ptr++ = 0;
-    *ptr++ = 0;
+    mxs_wire_put_coldef(GWBUF_DATA(pkt), seqno, "", "", name, 0x3f, len, type,
+                        type == 0xfd ? 0x1f81 : 0x0081, 0);
     return slave->dcb->func.write(slave->dcb, pkt);
 }
 
@@ -2939,22 +3056,9 @@ blr_slave_send_columndef(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, char *nam
 static int
 blr_slave_send_eof(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, int seqno)
 {
-    GWBUF *pkt;
-    uint8_t *ptr;
+    GWBUF *pkt = mxs_wire_create_eof(seqno);
 
-    if ((pkt = gwbuf_alloc(9)) == NULL)
-    {
-        return 0;
-    }
-    ptr = GWBUF_DATA(pkt);
-    encode_value(ptr, 5, 24);           // Add length of data packet
-    ptr += 3;
-    *ptr++ = seqno;                 // Sequence number in response
-    *ptr++ = 0xfe;                  // Length of result string
-    encode_value(ptr, 0, 16);           // No errors
-    ptr += 2;
-    encode_value(ptr, 2, 16);           // Autocommit enabled
-    return slave->dcb->func.write(slave->dcb, pkt);
+    return pkt ? slave->dcb->func.write(slave->dcb, pkt) : 0;
 }
 
 /**
@@ -3773,6 +3877,7 @@ int blr_handle_change_master(ROUTER_INSTANCE* router, char *command, char *error
             router->current_safe_event = 4;
 
             /* close current file binlog file, next start slave will create the new one */
+            blr_file_write_buffer(router);
             fsync(router->binlog_fd);
             close(router->binlog_fd);
             router->binlog_fd = -1;
@@ -5267,8 +5372,8 @@ blr_slave_send_heartbeat(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     /* Add the CRC32 */
     if (!slave->nocrc)
     {
-        chksum = crc32(0L, NULL, 0);
-        chksum = crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
+        chksum = mxs_crc32(0L, NULL, 0);
+        chksum = mxs_crc32(chksum, GWBUF_DATA(resp) + 5, hdr.event_size - 4);
         encode_value(ptr, chksum, 32);
     }
 
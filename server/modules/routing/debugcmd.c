@@ -69,6 +69,9 @@
 #include <monitor.h>
 #include <debugcli.h>
 #include <housekeeper.h>
+#include <query_classifier.h>
+#include <slowlog.h>
+#include <memlog.h>
 
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -102,16 +105,19 @@ struct subcommand {
 };
 
 static  void    telnetdShowUsers(DCB *);
+static  void    dprintLocks(DCB *);
 /**
  * The subcommands of the show command
  */
 struct subcommand showoptions[] = {
-#if defined(BUFFER_TRACE)
-    { "buffers",	0, dprintAllBuffers,
-	  "Show all buffers with backtrace",
-      "Show all buffers with backtrace",
+    { "allocprofile", 0, allocprof_print,
+      "Show the allocation sites with the most outstanding bytes",
+      "Show the allocation sites with the most outstanding bytes",
+      {0, 0, 0} },
+    { "bufferpool", 0, dprintBufferPool,
+      "Show the statistics of the buffer pools",
+      "Show the statistics of the buffer pools",
       {0, 0, 0} },
-#endif
     { "dcbs", 0, dprintAllDCBs,
       "Show all descriptor control blocks (network connections)",
       "Show all descriptor control blocks (network connections)",
@@ -142,6 +148,10 @@ struct subcommand showoptions[] = {
       "Show the report of MaxScale loaded modules, suitable for Notification Service",
       "Show the report of MaxScale loaded modules, suitable for Notification Service",
       {0, 0, 0} },
+    { "flightrecorder", 0, dShowMemlogRings,
+      "Show the recent state changes of the DCBs, sessions and protocols",
+      "Show the recent state changes of the DCBs, sessions and protocols",
+      {0, 0, 0} },
     { "filter", 1, dprintFilter,
       "Show details of a filter, called with a filter name",
       "Show details of a filter, called with the address of a filter",
@@ -150,6 +160,14 @@ struct subcommand showoptions[] = {
       "Show all filters",
       "Show all filters",
       {0, 0, 0} },
+    { "latency", 0, dListServiceLatency,
+      "Show the query latency percentiles of each stage of the traced queries",
+      "Show the query latency percentiles of each stage of the traced queries",
+      {0, 0, 0} },
+    { "locks", 0, dprintLocks,
+      "Show the contention statistics of the lock sites",
+      "Show the contention statistics of the lock sites",
+      {0, 0, 0} },
     { "modules", 0, dprintAllModules,
       "Show all currently loaded modules",
       "Show all currently loaded modules",
@@ -167,6 +185,10 @@ struct subcommand showoptions[] = {
       "Show persistent pool for a server, e.g. show persistent 0x485390. "
       "The address may also be replaced with the server name from the configuration file",
       {ARG_TYPE_SERVER, 0, 0} },
+    { "qc_cache", 0, dprintQcCacheStats,
+      "Show the statistics of the query classification cache",
+      "Show the statistics of the query classification cache",
+      {0, 0, 0} },
     { "server", 1, dprintServer,
       "Show details for a named server, e.g. show server dbnode1",
       "Show details for a server, e.g. show server 0x485390. The address may also be "
@@ -196,6 +218,10 @@ struct subcommand showoptions[] = {
       "Show all active sessions in MaxScale",
       "Show all active sessions in MaxScale",
       {0, 0, 0} },
+    { "slowqueries", 0, dShowSlowQueries,
+      "Show the most recent queries that were slower than the slow query threshold of their service",
+      "Show the most recent queries that were slower than the slow query threshold of their service",
+      {0, 0, 0} },
     { "tasks", 0, hkshow_tasks,
       "Show all active housekeeper tasks in MaxScale",
       "Show all active housekeeper tasks in MaxScale",
@@ -356,6 +382,9 @@ struct subcommand restartoptions[] = {
 static void set_server(DCB *dcb, SERVER *server, char *bit);
 static void set_pollsleep(DCB *dcb, int);
 static void set_nbpoll(DCB *dcb, int);
+static void set_threads(DCB *dcb, int);
+static void set_allocprofile(DCB *dcb, int);
+static void disable_allocprofile(DCB *dcb);
 /**
  * The subcommands of the set command
  */
@@ -372,6 +401,14 @@ struct subcommand setoptions[] = {
       "Set the number of non-blocking polls",
       "Set the number of non-blocking polls",
       {ARG_TYPE_NUMERIC, 0, 0} },
+    { "threads", 1, set_threads,
+      "Set the number of polling threads, at most max_threads. E.g. set threads 8",
+      "Set the number of polling threads, at most max_threads. E.g. set threads 8",
+      {ARG_TYPE_NUMERIC, 0, 0} },
+    { "allocprofile", 1, set_allocprofile,
+      "Sample one in N buffer, DCB and session allocations. E.g. set allocprofile 1000",
+      "Sample one in N buffer, DCB and session allocations. E.g. set allocprofile 1000",
+      {ARG_TYPE_NUMERIC, 0, 0} },
 
     { NULL, 0, NULL, NULL, NULL,
       {0, 0, 0} }
@@ -530,6 +567,14 @@ struct subcommand enableoptions[] = {
  *  * The subcommands of the disable command
  *   */
 struct subcommand disableoptions[] = {
+    {
+        "allocprofile",
+        0,
+        disable_allocprofile,
+        "Stop sampling the allocations, the samples taken are kept",
+        "Stop sampling the allocations, the samples taken are kept",
+        {0, 0, 0}
+    },
     {
         "heartbeat",
         1,
@@ -667,10 +712,19 @@ struct subcommand failoptions[] = {
 #endif /* FAKE_CODE */
 
 static void telnetdAddUser(DCB *, char *);
+static void add_fingerprint(DCB *, FILTER_DEF *, char *, char *);
 /**
  * The subcommands of the add command
  */
 struct subcommand addoptions[] = {
+    { "fingerprint", 3, add_fingerprint,
+      "Route the statements with a fingerprint to a server. The fingerprint is the hash "
+      "shown by show slowqueries or an example statement. "
+      "E.g. add fingerprint \"Reports\" 3f1a9c0e5b7d2468 analytics1",
+      "Route the statements with a fingerprint to a server. The fingerprint is the hash "
+      "shown by show slowqueries or an example statement. "
+      "E.g. add fingerprint 0x8a4e30 3f1a9c0e5b7d2468 analytics1",
+      {ARG_TYPE_FILTER, ARG_TYPE_STRING, ARG_TYPE_STRING} },
     { "user", 1, telnetdAddUser,
       "Add a new user for the debug interface. E.g. add user john",
       "Add a new user for the debug interface. E.g. add user john",
@@ -681,10 +735,21 @@ struct subcommand addoptions[] = {
 
 
 static void telnetdRemoveUser(DCB *, char *);
+static void remove_fingerprint(DCB *, FILTER_DEF *, char *);
 /**
  * The subcommands of the remove command
  */
 struct subcommand removeoptions[] = {
+    {
+        "fingerprint",
+        2,
+        remove_fingerprint,
+        "Stop routing the statements with a fingerprint to a server. "
+        "E.g. remove fingerprint \"Reports\" 3f1a9c0e5b7d2468",
+        "Stop routing the statements with a fingerprint to a server. "
+        "E.g. remove fingerprint 0x8a4e30 3f1a9c0e5b7d2468",
+        {ARG_TYPE_FILTER, ARG_TYPE_STRING, 0}
+    },
     {
         "user",
         1,
@@ -1218,6 +1283,7 @@ set_server(DCB *dcb, SERVER *server, char *bit)
     if ((bitvalue = server_map_status(bit)) != 0)
     {
         server_set_status(server, bitvalue);
+        server_publish_state(server);
     }
     else
     {
@@ -1241,6 +1307,7 @@ clear_server(DCB *dcb, SERVER *server, char *bit)
     if ((bitvalue = server_map_status(bit)) != 0)
     {
         server_clear_status(server, bitvalue);
+        server_publish_state(server);
     }
     else
     {
@@ -1329,6 +1396,39 @@ static void telnetdRemoveUser(
     }
 }
 
+/**
+ * Route the statements with a fingerprint to a server
+ *
+ * @param dcb           The DCB for messages
+ * @param filter        The fingerprint filter
+ * @param fingerprint   The fingerprint or an example statement
+ * @param server        The name of the server
+ */
+static void
+add_fingerprint(DCB *dcb, FILTER_DEF *filter, char *fingerprint, char *server)
+{
+    if (!filter_command(filter, dcb, "add", fingerprint, server))
+    {
+        dcb_printf(dcb, "Filter %s does not route by fingerprint.\n", filter->name);
+    }
+}
+
+/**
+ * Stop routing the statements with a fingerprint to a server
+ *
+ * @param dcb           The DCB for messages
+ * @param filter        The fingerprint filter
+ * @param fingerprint   The fingerprint or an example statement
+ */
+static void
+remove_fingerprint(DCB *dcb, FILTER_DEF *filter, char *fingerprint)
+{
+    if (!filter_command(filter, dcb, "remove", fingerprint, NULL))
+    {
+        dcb_printf(dcb, "Filter %s does not route by fingerprint.\n", filter->name);
+    }
+}
+
 
 
 /**
@@ -1343,6 +1443,75 @@ telnetdShowUsers(DCB *dcb)
     dcb_PrintAdminUsers(dcb);
 }
 
+/** The lock sites collected for printing */
+typedef struct
+{
+    SPINLOCK_SITE   **sites;
+    int             n_sites;
+    int             size;
+} LOCK_SITES;
+
+static void
+collect_lock_site(void *hdl, SPINLOCK_SITE *site)
+{
+    LOCK_SITES *sites = (LOCK_SITES *)hdl;
+
+    if (sites->n_sites == sites->size)
+    {
+        int size = sites->size ? sites->size * 2 : 64;
+        SPINLOCK_SITE **tmp = realloc(sites->sites, size * sizeof(SPINLOCK_SITE *));
+
+        if (tmp == NULL)
+        {
+            return;
+        }
+        sites->sites = tmp;
+        sites->size = size;
+    }
+    sites->sites[sites->n_sites++] = site;
+}
+
+static int
+compare_lock_sites(const void *a, const void *b)
+{
+    const SPINLOCK_SITE *s1 = *(const SPINLOCK_SITE **)a;
+    const SPINLOCK_SITE *s2 = *(const SPINLOCK_SITE **)b;
+
+    return s1->cycles < s2->cycles ? 1 : s1->cycles > s2->cycles ? -1 : 0;
+}
+
+/**
+ * Print the counters of the lock sites, the sites that waited the longest
+ * first.
+ *
+ * @param dcb   The DCB to print to
+ */
+static void
+dprintLocks(DCB *dcb)
+{
+    LOCK_SITES sites = {NULL, 0, 0};
+
+    spinlock_sites(collect_lock_site, &sites);
+    qsort(sites.sites, sites.n_sites, sizeof(SPINLOCK_SITE *), compare_lock_sites);
+
+    dcb_printf(dcb, "%-40s | %12s | %12s | %10s | %16s\n",
+               "Lock site", "Acquired", "Contended", "Slept", "Wait cycles");
+    dcb_printf(dcb, "-----------------------------------------+--------------+"
+               "--------------+------------+-----------------\n");
+    for (int i = 0; i < sites.n_sites; i++)
+    {
+        SPINLOCK_SITE *site = sites.sites[i];
+        const char *file = strrchr(site->file, '/');
+        char name[41];
+
+        snprintf(name, sizeof(name), "%s:%d", file ? file + 1 : site->file, site->line);
+        dcb_printf(dcb, "%-40s | %12lu | %12lu | %10lu | %16lu\n", name,
+                   (unsigned long)site->acquired, (unsigned long)site->contended,
+                   (unsigned long)site->parked, (unsigned long)site->cycles);
+    }
+    free(sites.sites);
+}
+
 /**
  * Command to shutdown a running monitor
  *
@@ -1770,6 +1939,49 @@ set_nbpoll(DCB *dcb, int nb)
     poll_set_nonblocking_polls(nb);
 }
 
+/**
+ * Set the number of polling threads
+ *
+ * @param       dcb             DCB for output
+ * @param       count           Number of threads
+ */
+static void
+set_threads(DCB *dcb, int count)
+{
+    if (poll_set_threadcount(count))
+    {
+        dcb_printf(dcb, "%d polling threads are running.\n", count);
+    }
+    else
+    {
+        dcb_printf(dcb, "Failed to change the number of polling threads, "
+                   "see the error log for details.\n");
+    }
+}
+
+/**
+ * Set the sampling rate of the allocation profiler
+ *
+ * @param       dcb             DCB for output
+ * @param       rate            One in this many allocations is sampled
+ */
+static void
+set_allocprofile(DCB *dcb, int rate)
+{
+    allocprof_set_rate(rate);
+}
+
+/**
+ * Stop the allocation profiler
+ *
+ * @param       dcb             DCB for output
+ */
+static void
+disable_allocprofile(DCB *dcb)
+{
+    allocprof_set_rate(0);
+}
+
 /**
  * Re-enable sendig MaxScale module list via http
  * Proper [feedback] section in MaxSclale.cnf
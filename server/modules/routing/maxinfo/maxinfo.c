@@ -51,6 +51,8 @@
 #include <secrets.h>
 #include <users.h>
 #include <dbusers.h>
+#include <metrics.h>
+#include <slowlog.h>
 
 
 MODULE_INFO 	info = {
@@ -430,7 +432,7 @@ int	len;
 	snprintf(result, 1000,
 		"Uptime: %u  Threads: %u  Sessions: %u ",
 			maxscale_uptime(),
-			config_threadcount(),
+			poll_thread_count(),
 			serviceSessionCountAll());
 	if ((ret = gwbuf_alloc(4 + strlen(result))) == NULL)
 		return 0;
@@ -688,6 +690,8 @@ static struct uri_table {
 	{ "/variables", maxinfo_variables },
 	{ "/status", maxinfo_status },
 	{ "/event/times", eventTimesGetList },
+	{ "/latency", serviceLatencyGetList },
+	{ "/slowqueries", slowlogGetList },
 	{ NULL, NULL }
 };
 
@@ -707,6 +711,17 @@ int		i;
 RESULTSET	*set;
 
 	uri = (char *)GWBUF_DATA(queue);
+	if (strcmp(uri, "/metrics") == 0)
+	{
+		GWBUF *metrics = metrics_generate();
+
+		if (metrics)
+		{
+			session->dcb->func.write(session->dcb, metrics);
+		}
+		gwbuf_free(queue);
+		return 1;
+	}
 	for (i = 0; supported_uri[i].uri; i++)
 	{
 		if (strcmp(uri, supported_uri[i].uri) == 0)
@@ -60,11 +60,14 @@ int	len;
 		desc = "No error";
 		break;
 	case PARSE_MALFORMED_SHOW:
-		desc = "Expected show <command> [like <pattern>]";
+		desc = "Expected show <command> [like <pattern>] [limit <count> [offset <count>]]";
 		break;
 	case PARSE_EXPECTED_LIKE:
 		desc = "Expected LIKE <pattern>";
 		break;
+	case PARSE_MALFORMED_LIMIT:
+		desc = "Expected LIMIT <count> [OFFSET <count>]";
+		break;
 	case PARSE_SYNTAX_ERROR:
 		desc = "Syntax error";
 		break;
@@ -44,11 +44,13 @@
 #include <log_manager.h>
 #include <resultset.h>
 #include <maxconfig.h>
+#include <slowlog.h>
 
 static void exec_show(DCB *dcb, MAXINFO_TREE *tree);
 static void exec_select(DCB *dcb, MAXINFO_TREE *tree);
-static void exec_show_variables(DCB *dcb, MAXINFO_TREE *filter);
-static void exec_show_status(DCB *dcb, MAXINFO_TREE *filter);
+static void exec_show_variables(DCB *dcb, MAXINFO_TREE *tree);
+static void exec_show_status(DCB *dcb, MAXINFO_TREE *tree);
+static void maxinfo_stream_result(RESULTSET *set, DCB *dcb, MAXINFO_TREE *tree);
 static int maxinfo_pattern_match(char *pattern, char *str);
 static void exec_flush(DCB *dcb, MAXINFO_TREE *tree);
 static void exec_set(DCB *dcb, MAXINFO_TREE *tree);
@@ -101,11 +103,32 @@ maxinfo_execute(DCB *dcb, MAXINFO_TREE *tree)
 	}
 }
 
+/**
+ * Stream a result set to the client applying the limit clause of a
+ * show command
+ *
+ * @param set	The result set to stream
+ * @param dcb	DCB to which to stream result set
+ * @param tree	The show parse tree, the left branch is a potential limit clause
+ */
+static void
+maxinfo_stream_result(RESULTSET *set, DCB *dcb, MAXINFO_TREE *tree)
+{
+MAXINFO_TREE	*limit = tree->left;
+
+	if (limit && limit->op == MAXOP_LIMIT)
+	{
+		resultset_set_limit(set, atol(limit->value),
+				limit->right ? atol(limit->right->value) : 0);
+	}
+	resultset_stream_mysql(set, dcb);
+}
+
 /**
  * Fetch the list of services and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_services(DCB *dcb, MAXINFO_TREE *tree)
@@ -115,7 +138,7 @@ RESULTSET	*set;
 	if ((set = serviceGetList()) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -123,7 +146,7 @@ RESULTSET	*set;
  * Fetch the list of listeners and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_listeners(DCB *dcb, MAXINFO_TREE *tree)
@@ -133,7 +156,7 @@ RESULTSET	*set;
 	if ((set = serviceGetListenerList()) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -141,7 +164,7 @@ RESULTSET	*set;
  * Fetch the list of sessions and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_sessions(DCB *dcb, MAXINFO_TREE *tree)
@@ -151,7 +174,7 @@ RESULTSET	*set;
 	if ((set = sessionGetList(SESSION_LIST_ALL)) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -159,7 +182,7 @@ RESULTSET	*set;
  * Fetch the list of client sessions and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_clients(DCB *dcb, MAXINFO_TREE *tree)
@@ -169,7 +192,7 @@ RESULTSET	*set;
 	if ((set = sessionGetList(SESSION_LIST_CONNECTION)) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -177,7 +200,7 @@ RESULTSET	*set;
  * Fetch the list of servers and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_servers(DCB *dcb, MAXINFO_TREE *tree)
@@ -187,7 +210,7 @@ RESULTSET	*set;
 	if ((set = serverGetList()) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -195,7 +218,7 @@ RESULTSET	*set;
  * Fetch the list of modules and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_modules(DCB *dcb, MAXINFO_TREE *tree)
@@ -205,7 +228,7 @@ RESULTSET	*set;
 	if ((set = moduleGetList()) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -213,7 +236,7 @@ RESULTSET	*set;
  * Fetch the list of monitors and stream as a result set
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_monitors(DCB *dcb, MAXINFO_TREE *tree)
@@ -223,7 +246,7 @@ RESULTSET	*set;
 	if ((set = monitorGetList()) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -231,7 +254,7 @@ RESULTSET	*set;
  * Fetch the event times data
  *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	The show parse tree
  */
 static void
 exec_show_eventTimes(DCB *dcb, MAXINFO_TREE *tree)
@@ -241,7 +264,43 @@ RESULTSET	*set;
 	if ((set = eventTimesGetList()) == NULL)
 		return;
 	
-	resultset_stream_mysql(set, dcb);
+	maxinfo_stream_result(set, dcb, tree);
+	resultset_free(set);
+}
+
+/**
+ * Fetch the query latency percentiles of the services
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	The show parse tree
+ */
+static void
+exec_show_latency(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = serviceLatencyGetList()) == NULL)
+		return;
+	
+	maxinfo_stream_result(set, dcb, tree);
+	resultset_free(set);
+}
+
+/**
+ * Fetch the most recent slow queries
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	The show parse tree
+ */
+static void
+exec_show_slowqueries(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = slowlogGetList()) == NULL)
+		return;
+	
+	maxinfo_stream_result(set, dcb, tree);
 	resultset_free(set);
 }
 
@@ -262,6 +321,8 @@ static struct {
 	{ "modules", exec_show_modules },
 	{ "monitors", exec_show_monitors },
 	{ "eventTimes", exec_show_eventTimes },
+	{ "latency", exec_show_latency },
+	{ "slowqueries", exec_show_slowqueries },
 	{ NULL, NULL }
 };
 
@@ -281,7 +342,7 @@ char	errmsg[120];
 	{
 		if (strcasecmp(show_commands[i].name, tree->value) == 0)
 		{
-			(*show_commands[i].func)(dcb, tree->right);
+			(*show_commands[i].func)(dcb, tree);
 			return;
 		}
 	}
@@ -360,6 +421,7 @@ void exec_set_server(DCB *dcb, MAXINFO_TREE *tree)
         if (status != 0)
         {
             server_set_status(server, status);
+            server_publish_state(server);
             maxinfo_send_ok(dcb);
         }
         else
@@ -440,6 +502,7 @@ void exec_clear_server(DCB *dcb, MAXINFO_TREE *tree)
         if (status != 0)
         {
             server_clear_status(server, status);
+            server_publish_state(server);
             maxinfo_send_ok(dcb);
         }
         else
@@ -785,7 +848,7 @@ static struct {
 	{ "version_comment", VT_STRING, (STATSFUNC)getVersionComment },
 	{ "basedir", VT_STRING, (STATSFUNC)getMaxScaleHome},
 	{ "MAXSCALE_VERSION", VT_STRING, (STATSFUNC)getVersion },
-	{ "MAXSCALE_THREADS", VT_INT, (STATSFUNC)config_threadcount },
+	{ "MAXSCALE_THREADS", VT_INT, (STATSFUNC)poll_thread_count },
 	{ "MAXSCALE_NBPOLLS", VT_INT, (STATSFUNC)config_nbpolls },
 	{ "MAXSCALE_POLLSLEEP", VT_INT, (STATSFUNC)config_pollsleep },
 	{ "MAXSCALE_UPTIME", VT_INT, (STATSFUNC)maxscale_uptime },
@@ -845,16 +908,16 @@ char		buf[80];
  * Execute a show variables command applying an optional filter
  *
  * @param dcb		The DCB connected to the client
- * @param filter	A potential like clause or NULL
+ * @param tree		The show parse tree, the right branch is a potential like clause
  */
 static void
-exec_show_variables(DCB *dcb, MAXINFO_TREE *filter)
+exec_show_variables(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*result;
 VARCONTEXT	context;
 
-	if (filter)
-		context.like = filter->value;
+	if (tree->right)
+		context.like = tree->right->value;
 	else
 		context.like = NULL;
 	context.index = 0;
@@ -866,7 +929,7 @@ VARCONTEXT	context;
 	}
 	resultset_add_column(result, "Variable_name", 40, COL_TYPE_VARCHAR);
 	resultset_add_column(result, "Value", 40, COL_TYPE_VARCHAR);
-	resultset_stream_mysql(result, dcb);
+	maxinfo_stream_result(result, dcb, tree);
 	resultset_free(result);
 }
 
@@ -1048,8 +1111,8 @@ static struct {
 	{ "Uptime", VT_INT, (STATSFUNC)maxscale_uptime },
 	{ "Uptime_since_flush_status", VT_INT, (STATSFUNC)maxscale_uptime },
 	{ "Threads_created", VT_INT, (STATSFUNC)config_threadcount },
-	{ "Threads_running", VT_INT, (STATSFUNC)config_threadcount },
-	{ "Threadpool_threads", VT_INT, (STATSFUNC)config_threadcount },
+	{ "Threads_running", VT_INT, (STATSFUNC)poll_thread_count },
+	{ "Threadpool_threads", VT_INT, (STATSFUNC)config_max_threadcount },
 	{ "Threads_connected", VT_INT, (STATSFUNC)serviceSessionCountAll },
 	{ "Connections", VT_INT, (STATSFUNC)maxinfo_all_dcbs },
 	{ "Client_connections", VT_INT, (STATSFUNC)maxinfo_client_dcbs },
@@ -1117,16 +1180,16 @@ char		buf[80];
  * Execute a show status command applying an optional filter
  *
  * @param dcb		The DCB connected to the client
- * @param filter	A potential like clause or NULL
+ * @param tree		The show parse tree, the right branch is a potential like clause
  */
 static void
-exec_show_status(DCB *dcb, MAXINFO_TREE *filter)
+exec_show_status(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*result;
 VARCONTEXT	context;
 
-	if (filter)
-		context.like = filter->value;
+	if (tree->right)
+		context.like = tree->right->value;
 	else
 		context.like = NULL;
 	context.index = 0;
@@ -1138,7 +1201,7 @@ VARCONTEXT	context;
 	}
 	resultset_add_column(result, "Variable_name", 40, COL_TYPE_VARCHAR);
 	resultset_add_column(result, "Value", 40, COL_TYPE_VARCHAR);
-	resultset_stream_mysql(result, dcb);
+	maxinfo_stream_result(result, dcb, tree);
 	resultset_free(result);
 }
 
@@ -25,6 +25,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
 #include <service.h>
 #include <session.h>
@@ -45,6 +46,7 @@ static void free_tree(MAXINFO_TREE *);
 static char *fetch_token(char *, int *, char **);
 static MAXINFO_TREE *parse_column_list(char **sql);
 static MAXINFO_TREE *parse_table_name(char **sql);
+static MAXINFO_TREE *parse_limit(char **sql, PARSE_ERROR *parse_error);
 MAXINFO_TREE* maxinfo_parse_literals(MAXINFO_TREE *tree, int min_args, char *ptr,
                                      PARSE_ERROR *parse_error);
 
@@ -79,21 +81,31 @@ MAXINFO_TREE	*col, *table;
 			tree = make_tree_node(MAXOP_SHOW, text, NULL, NULL);
 			if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
 				return tree;
-			else if (token == LT_LIKE)
+			if (token == LT_LIKE)
 			{
-				if ((ptr = fetch_token(ptr, &token, &text)) != NULL)
-				{
-					tree->right = make_tree_node(MAXOP_LIKE,
-							text, NULL, NULL);
-					return tree;
-				}
-				else
+				free(text);
+				if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
 				{
 					// Expected expression
 					*parse_error = PARSE_EXPECTED_LIKE;
 					free_tree(tree);
 					return NULL;
 				}
+				tree->right = make_tree_node(MAXOP_LIKE,
+						text, NULL, NULL);
+				if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
+					return tree;
+			}
+			if (token == LT_LIMIT)
+			{
+				free(text);
+				if ((tree->left = parse_limit(&ptr, parse_error)) == NULL)
+				{
+					free_tree(tree);
+					return NULL;
+				}
+				if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
+					return tree;
 			}
 			// Malformed show
 			free(text);
@@ -178,6 +190,69 @@ MAXINFO_TREE	*col, *table;
 	return NULL;
 }
 
+/**
+ * Check that a token is a non-negative number
+ *
+ * @param text	The token text
+ * @return	Non-zero if the token is a number
+ */
+static int
+is_count(char *text)
+{
+	if (text == NULL || *text == 0)
+		return 0;
+	while (*text)
+	{
+		if (!isdigit(*text))
+			return 0;
+		text++;
+	}
+	return 1;
+}
+
+/**
+ * Parse the arguments of a limit clause, LIMIT <count> [OFFSET <count>]
+ *
+ * @param ptr		Pointer to pointer to the text after LIMIT, updated
+ *			to point after the clause
+ * @param parse_error	Set if the clause is malformed
+ * @return	A limit node with the offset as the right branch or NULL
+ */
+static MAXINFO_TREE *
+parse_limit(char **ptr, PARSE_ERROR *parse_error)
+{
+int		token;
+char		*text, *next;
+MAXINFO_TREE	*tree;
+
+	*ptr = fetch_token(*ptr, &token, &text);
+	if (*ptr == NULL || token != LT_STRING || !is_count(text))
+	{
+		free(text);
+		*parse_error = PARSE_MALFORMED_LIMIT;
+		return NULL;
+	}
+	tree = make_tree_node(MAXOP_LIMIT, text, NULL, NULL);
+
+	// Look ahead for an offset
+	if ((next = fetch_token(*ptr, &token, &text)) == NULL)
+		return tree;
+	free(text);
+	if (token != LT_OFFSET)
+		return tree;
+
+	*ptr = fetch_token(next, &token, &text);
+	if (*ptr == NULL || token != LT_STRING || !is_count(text))
+	{
+		free(text);
+		free_tree(tree);
+		*parse_error = PARSE_MALFORMED_LIMIT;
+		return NULL;
+	}
+	tree->right = make_tree_node(MAXOP_LITERAL, text, NULL, NULL);
+	return tree;
+}
+
 /**
  * Parse a column list, may be a * or a valid list of string name
  * separated by a comma
@@ -306,6 +381,8 @@ static struct
     { "clear",      LT_CLEAR},
     { "shutdown",   LT_SHUTDOWN},
     { "restart",    LT_RESTART},
+    { "limit",      LT_LIMIT},
+    { "offset",     LT_OFFSET},
     { NULL, 0}
 };
 
@@ -377,6 +454,14 @@ int	i;
 		return NULL;
 	}
 
+	if (quote != '\0' && *s2 == quote)
+	{
+		// Step over the closing quote, a quoted string is never a keyword
+		*text = strndup(s1, s2 - s1);
+		*token = LT_STRING;
+		return s2 + 1;
+	}
+
 	*text = strndup(s1, s2 - s1);
 	for (i = 0; keywords[i].text; i++)
 	{
@@ -73,6 +73,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <inttypes.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -82,6 +83,7 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <modinfo.h>
+#include <random_jkiss.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
@@ -101,6 +103,9 @@ MODULE_INFO info =
 
 static char *version_str = "V1.1.0";
 
+/** The most servers sampled for a new session before all are examined */
+#define READCONN_SAMPLE_TRIES 4
+
 /* The router entry points */
 static ROUTER *createInstance(SERVICE *service, char **options);
 static void *newSession(ROUTER *instance, SESSION *session);
@@ -187,10 +192,190 @@ static inline void free_readconn_instance(ROUTER_INSTANCE *router)
             }
         }
         free(router->servers);
+        free(router->sample_alias);
+        free(router->sample_prob);
+        ts_stats_free(router->stats.n_queries);
         free(router);
     }
 }
 
+/**
+ * Build the alias table that is used to sample the servers by their weights
+ * in constant time. Each slot of the table is chosen with the same probability
+ * and it then gives either its own server or its alias.
+ *
+ * @param inst  The router instance with the weights of the servers set
+ * @return False if memory allocation failed
+ */
+static bool
+build_sampler(ROUTER_INSTANCE *inst)
+{
+    int n = inst->n_servers;
+    int *small = malloc(n * sizeof(int));
+    int *large = malloc(n * sizeof(int));
+    long long *scaled = malloc(n * sizeof(long long));
+    int n_small = 0, n_large = 0;
+    int i;
+
+    inst->sample_alias = malloc(n * sizeof(int));
+    inst->sample_prob = malloc(n * sizeof(int));
+    inst->total_weight = 0;
+
+    if (small == NULL || large == NULL || scaled == NULL ||
+        inst->sample_alias == NULL || inst->sample_prob == NULL)
+    {
+        free(small);
+        free(large);
+        free(scaled);
+        return false;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        inst->total_weight += inst->servers[i]->weight;
+    }
+
+    /** The weights scaled so that the average is total_weight */
+    for (i = 0; i < n; i++)
+    {
+        scaled[i] = (long long)inst->servers[i]->weight * n;
+        inst->sample_alias[i] = i;
+        inst->sample_prob[i] = inst->total_weight;
+
+        if (scaled[i] < inst->total_weight)
+        {
+            small[n_small++] = i;
+        }
+        else
+        {
+            large[n_large++] = i;
+        }
+    }
+
+    while (n_small > 0 && n_large > 0)
+    {
+        int s = small[--n_small];
+        int l = large[--n_large];
+
+        inst->sample_prob[s] = scaled[s];
+        inst->sample_alias[s] = l;
+        scaled[l] -= inst->total_weight - scaled[s];
+
+        if (scaled[l] < inst->total_weight)
+        {
+            small[n_small++] = l;
+        }
+        else
+        {
+            large[n_large++] = l;
+        }
+    }
+
+    free(small);
+    free(large);
+    free(scaled);
+    return true;
+}
+
+/**
+ * Check whether a server is a valid target for a new session. The root master
+ * is not when slaves are wanted.
+ *
+ * @param inst          The router instance
+ * @param backend       The server
+ * @param master_host   The root master or NULL if there is none
+ * @return True if a session can be created to the server
+ */
+static inline bool
+backend_is_eligible(ROUTER_INSTANCE *inst, BACKEND *backend, BACKEND *master_host)
+{
+    return !SERVER_IN_MAINT(backend->server) &&
+           backend->weight > 0 &&
+           SERVER_IS_RUNNING(backend->server) &&
+           (backend->server->status & inst->bitmask & inst->bitvalue) &&
+           !(backend == master_host && (inst->bitvalue & SERVER_SLAVE));
+}
+
+/**
+ * Compare the loads of two servers. A server is less loaded if it has fewer
+ * connections relative to its weight or the same number of them but has had
+ * fewer connections over time. The latter spreads the connections over the
+ * servers during periods of very low load. With the least_congested option,
+ * the load scores published by the monitor are compared first. The weight of
+ * a slave that is warming up is only a part of its full weight.
+ *
+ * @param inst  The router instance
+ * @param a     A server
+ * @param b     Another server
+ * @return True if a is less loaded than b
+ */
+static inline bool
+backend_is_less_loaded(ROUTER_INSTANCE *inst, BACKEND *a, BACKEND *b)
+{
+    if (inst->least_congested && a->server->load != b->server->load)
+    {
+        return a->server->load < b->server->load;
+    }
+
+    int load_a = ((a->current_connection_count + 1) * 1000) /
+                 server_warmup_weight(a->server, a->weight);
+    int load_b = ((b->current_connection_count + 1) * 1000) /
+                 server_warmup_weight(b->server, b->weight);
+
+    return load_a < load_b ||
+           (load_a == load_b && a->server->stats.n_connections < b->server->stats.n_connections);
+}
+
+/**
+ * Choose the less loaded of two servers sampled by their weights. A few more
+ * samples are taken if the sampled servers are not valid targets. A slave that
+ * is warming up is rejected in proportion to the part of its weight it does
+ * not have yet, so it is sampled by its current weight.
+ *
+ * @param inst          The router instance
+ * @param master_host   The root master or NULL if there is none
+ * @return The chosen server or NULL if no valid server was sampled
+ */
+static BACKEND *
+sample_candidate(ROUTER_INSTANCE *inst, BACKEND *master_host)
+{
+    BACKEND *candidate = NULL;
+    int found = 0;
+
+    if (inst->n_servers == 0 || inst->total_weight <= 0)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i < READCONN_SAMPLE_TRIES && found < 2; i++)
+    {
+        unsigned int slot = random_jkiss() % inst->n_servers;
+        int idx = random_jkiss() % inst->total_weight < inst->sample_prob[slot] ?
+                  slot : inst->sample_alias[slot];
+        BACKEND *backend = inst->servers[idx];
+
+        if (backend != candidate && backend_is_eligible(inst, backend, master_host))
+        {
+            int weight = server_warmup_weight(backend->server, backend->weight);
+
+            if (weight < backend->weight &&
+                random_jkiss() % backend->weight >= (unsigned int)weight)
+            {
+                continue;
+            }
+
+            found++;
+
+            if (candidate == NULL || backend_is_less_loaded(inst, backend, candidate))
+            {
+                candidate = backend;
+            }
+        }
+    }
+
+    return candidate;
+}
+
 /**
  * Create an instance of the router for a particular service
  * within the gateway.
@@ -218,6 +403,12 @@ createInstance(SERVICE *service, char **options)
     inst->service = service;
     spinlock_init(&inst->lock);
 
+    if ((inst->stats.n_queries = ts_stats_alloc()) == NULL)
+    {
+        free_readconn_instance(inst);
+        return NULL;
+    }
+
     /*
      * We need an array of the backend servers in the instance structure so
      * that we can maintain a count of the number of connections to each
@@ -248,6 +439,7 @@ createInstance(SERVICE *service, char **options)
         n++;
     }
     inst->servers[n] = NULL;
+    inst->n_servers = n;
 
     if ((weightby = serviceGetWeightingParameter(service)) != NULL)
     {
@@ -315,6 +507,12 @@ createInstance(SERVICE *service, char **options)
         }
     }
 
+    if (!build_sampler(inst))
+    {
+        free_readconn_instance(inst);
+        return NULL;
+    }
+
     /*
      * Process the options
      */
@@ -350,12 +548,20 @@ createInstance(SERVICE *service, char **options)
                 inst->bitmask |= (SERVER_NDB);
                 inst->bitvalue |= SERVER_NDB;
             }
+            else if (!strcasecmp(options[i], "splice"))
+            {
+                inst->splice = true;
+            }
+            else if (!strcasecmp(options[i], "least_congested"))
+            {
+                inst->least_congested = true;
+            }
             else
             {
                 MXS_WARNING("Unsupported router "
                             "option \'%s\' for readconnroute. "
                             "Expected router options are "
-                            "[slave|master|synced|ndb|running]",
+                            "[slave|master|synced|ndb|running|splice|least_congested]",
                             options[i]);
                 error = true;
             }
@@ -400,6 +606,7 @@ newSession(ROUTER *instance, SESSION *session)
     ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
     ROUTER_CLIENT_SES *client_rses;
     BACKEND *candidate = NULL;
+    bool sampled;
     int i;
     BACKEND *master_host = NULL;
 
@@ -410,7 +617,8 @@ newSession(ROUTER *instance, SESSION *session)
               inst);
 
 
-    client_rses = (ROUTER_CLIENT_SES *) calloc(1, sizeof(ROUTER_CLIENT_SES));
+    /** The router session lives in the memory of the session */
+    client_rses = (ROUTER_CLIENT_SES *) session_arena_alloc(session, sizeof(ROUTER_CLIENT_SES));
 
     if (client_rses == NULL)
     {
@@ -435,110 +643,56 @@ newSession(ROUTER *instance, SESSION *session)
      */
 
     /*
-     * Loop over all the servers and find any that have fewer connections
-     * than the candidate server.
-     *
-     * If a server has less connections than the current candidate we mark this
-     * as the new candidate to connect to.
-     *
-     * If a server has the same number of connections currently as the candidate
-     * and has had less connections over time than the candidate it will also
-     * become the new candidate. This has the effect of spreading the
-     * connections over different servers during periods of very low load.
+     * Unless the root master is wanted, choose the less loaded of two servers
+     * sampled by their weights. This takes the same time however many servers
+     * there are.
      */
-    for (i = 0; inst->servers[i]; i++)
+    if (!(inst->bitvalue & SERVER_MASTER))
     {
-        if (inst->servers[i])
-        {
-            MXS_DEBUG("%lu [newSession] Examine server in port %d with "
-                      "%d connections. Status is %s, "
-                      "inst->bitvalue is %d",
-                      pthread_self(),
-                      inst->servers[i]->server->port,
-                      inst->servers[i]->current_connection_count,
-                      STRSRVSTATUS(inst->servers[i]->server),
-                      inst->bitmask);
-        }
+        candidate = sample_candidate(inst, master_host);
+    }
+    sampled = candidate != NULL;
 
-        if (SERVER_IN_MAINT(inst->servers[i]->server))
-        {
-            continue;
-        }
+    /*
+     * If no server was sampled, loop over all the servers and find any
+     * that are less loaded than the candidate server.
+     */
+    for (i = 0; !sampled && inst->servers[i]; i++)
+    {
+        MXS_DEBUG("%lu [newSession] Examine server in port %d with "
+                  "%d connections. Status is %s, "
+                  "inst->bitvalue is %d",
+                  pthread_self(),
+                  inst->servers[i]->server->port,
+                  inst->servers[i]->current_connection_count,
+                  STRSRVSTATUS(inst->servers[i]->server),
+                  inst->bitmask);
 
-        if (inst->servers[i]->weight == 0)
+        /* Check server status bits against bitvalue from router_options */
+        if (!backend_is_eligible(inst, inst->servers[i], master_host))
         {
             continue;
         }
 
-        /* Check server status bits against bitvalue from router_options */
-        if (inst->servers[i] &&
-            SERVER_IS_RUNNING(inst->servers[i]->server) &&
-            (inst->servers[i]->server->status & inst->bitmask & inst->bitvalue))
+        if (inst->bitvalue & SERVER_MASTER)
         {
-            if (master_host)
+            /* If option is "master" return only the root Master as there
+             * could be intermediate masters (Relay Servers)
+             * and they must not be selected. If master_host is NULL,
+             * there is no master server and the candidate will be NULL.
+             */
+            if (master_host == NULL || inst->servers[i] == master_host)
             {
-                if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_SLAVE))
-                {
-                    /* skip root Master here, as it could also be slave of an external server
-                     * that is not in the configuration.
-                     * Intermediate masters (Relay Servers) are also slave and will be selected
-                     * as Slave(s)
-                     */
-
-                    continue;
-                }
-                if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_MASTER))
-                {
-                    /* If option is "master" return only the root Master as there
-                     * could be intermediate masters (Relay Servers)
-                     * and they must not be selected.
-                     */
-
-                    candidate = master_host;
-                    break;
-                }
-            }
-            else
-            {
-                /* master_host is NULL, no master server.
-                 * If requested router_option is 'master'
-                 * candidate wll be NULL.
-                 */
-                if (inst->bitvalue & SERVER_MASTER)
-                {
-                    candidate = NULL;
-                    break;
-                }
+                candidate = master_host;
+                break;
             }
+        }
 
-            /* If no candidate set, set first running server as
-            our initial candidate server */
-            if (candidate == NULL)
-            {
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight <
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight)
-            {
-                /* This running server has fewer
-                connections, set it as a new candidate */
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight ==
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight &&
-                     inst->servers[i]->server->stats.n_connections <
-                     candidate->server->stats.n_connections)
-            {
-                /* This running server has the same number
-                of connections currently as the candidate
-                but has had fewer connections over time
-                than candidate, set this server to candidate*/
-                candidate = inst->servers[i];
-            }
+        /* If no candidate set, set first running server as
+        our initial candidate server */
+        if (candidate == NULL || backend_is_less_loaded(inst, inst->servers[i], candidate))
+        {
+            candidate = inst->servers[i];
         }
     }
 
@@ -557,7 +711,6 @@ newSession(ROUTER *instance, SESSION *session)
             MXS_ERROR("Failed to create new routing session. "
                       "Couldn't find eligible candidate server. Freeing "
                       "allocated resources.");
-            free(client_rses);
             return NULL;
         }
     }
@@ -586,7 +739,6 @@ newSession(ROUTER *instance, SESSION *session)
     if (client_rses->backend_dcb == NULL)
     {
         atomic_add(&candidate->current_connection_count, -1);
-        free(client_rses);
         return NULL;
     }
     dcb_add_callback(
@@ -671,7 +823,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
               router_cli_ses->backend->server->port,
               prev_val - 1);
 
-    free(router_cli_ses);
+    slowlog_query_free(&router_cli_ses->slow_query);
 }
 
 /**
@@ -733,7 +885,7 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
     mysql_server_cmd_t mysql_command = proto->current_command;
     bool rses_is_closed;
 
-    inst->stats.n_queries++;
+    ts_stats_add(inst->stats.n_queries, 1);
 
     /** Dirty read for quick check if router is closed. */
     if (router_cli_ses->rses_closed)
@@ -783,6 +935,8 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
             {
                 trc = modutil_get_SQL(queue);
             }
+            slowlog_start(&router_cli_ses->slow_query,
+                          inst->service->slow_query_threshold, queue);
         default:
             rc = backend_dcb->func.write(backend_dcb, queue);
             break;
@@ -827,8 +981,13 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tNumber of router sessions:   	%d\n",
                router_inst->stats.n_sessions);
     dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
-    dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
-               router_inst->stats.n_queries);
+    if (router_inst->splice)
+    {
+        dcb_printf(dcb, "\tNumber of spliced sessions:	%d\n",
+                   router_inst->stats.n_spliced);
+    }
+    dcb_printf(dcb, "\tNumber of queries forwarded:   	%" PRId64 "\n",
+               ts_stats_sum(router_inst->stats.n_queries));
     if ((weightby = serviceGetWeightingParameter(router_inst->service))
         != NULL)
     {
@@ -862,8 +1021,36 @@ diagnostics(ROUTER *router, DCB *dcb)
 static void
 clientReply(ROUTER *instance, void *router_session, GWBUF *queue, DCB *backend_dcb)
 {
-    ss_dassert(backend_dcb->session->client_dcb != NULL);
-    SESSION_ROUTE_REPLY(backend_dcb->session, queue);
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *) router_session;
+    SESSION *session = backend_dcb->session;
+
+    ss_dassert(session->client_dcb != NULL);
+    slowlog_end(&rses->slow_query, inst->service->slow_query_threshold,
+                inst->service->name, backend_dcb->server->unique_name);
+    SESSION_ROUTE_REPLY(session, queue);
+
+    /**
+     * The first reply means that the backend has been authenticated and
+     * from now on the data only needs to be passed through. The filters
+     * must see the data, so sessions with filters are not spliced. Spliced
+     * queries bypass the router and could not be timed for the slow query
+     * log either.
+     */
+    if (inst->splice && !rses->splice_tried)
+    {
+        rses->splice_tried = true;
+
+        if (session->service->n_filters == 0 &&
+            session->service->slow_query_threshold == 0 &&
+            dcb_splice(backend_dcb, session->client_dcb))
+        {
+            if (dcb_splice(session->client_dcb, backend_dcb))
+            {
+                atomic_add(&inst->stats.n_spliced, 1);
+            }
+        }
+    }
 }
 
 /**
@@ -990,7 +1177,7 @@ static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses)
 
 static int getCapabilities()
 {
-    return RCAP_TYPE_PACKET_INPUT;
+    return RCAP_TYPE_PACKET_INPUT | RCAP_TYPE_RESULT_STREAM | RCAP_TYPE_DEPRECATE_EOF;
 }
 
 /********************************
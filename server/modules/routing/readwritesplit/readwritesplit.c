@@ -16,6 +16,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <ctype.h>
 
 #include <router.h>
 #include <readwritesplit.h>
@@ -30,6 +33,10 @@
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <mysqld_error.h>
+#include <random_jkiss.h>
+#include <time.h>
+#include <hk_heartbeat.h>
+#include <housekeeper.h>
 
 MODULE_INFO info =
 {
@@ -43,6 +50,12 @@ MODULE_INFO info =
 
 #define RWSPLIT_TRACE_MSG_LEN 1000
 
+/** The types of statements that only read data and can be sent to a slave */
+#define READ_ONLY_STMT_TYPES (QUERY_TYPE_LOCAL_READ | QUERY_TYPE_READ | \
+                              QUERY_TYPE_USERVAR_READ | QUERY_TYPE_SYSVAR_READ | \
+                              QUERY_TYPE_GSYSVAR_READ | QUERY_TYPE_SHOW_DATABASES | \
+                              QUERY_TYPE_SHOW_TABLES)
+
 /**
  * @file readwritesplit.c   The entry points for the read/write query splitting
  * router module.
@@ -96,6 +109,25 @@ static DCB *rses_get_client_dcb(ROUTER_CLIENT_SES *rses);
 static backend_ref_t *check_candidate_bref(backend_ref_t *candidate_bref,
                                            backend_ref_t *new_bref,
                                            select_criteria_t sc);
+static backend_ref_t *get_slave_by_response_time(ROUTER_CLIENT_SES *rses,
+                                                 int max_rlag);
+static uint64_t response_time_now(void);
+static void rebalance_slaves(ROUTER_CLIENT_SES *rses, int max_rlag);
+bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history);
+static bool lazy_connect_master(ROUTER_CLIENT_SES *rses);
+static bool lazy_connect_slave(ROUTER_CLIENT_SES *rses, int max_rlag);
+static void release_idle_backends(void *data);
+static void bref_update_response_time(backend_ref_t *bref);
+static SERVER *rses_get_root_server(ROUTER_CLIENT_SES *rses);
+static bool rlag_is_acceptable(SERVER *master, SERVER *serv, int max_rlag);
+static unsigned int bref_server_status(backend_ref_t *bref);
+static int bref_server_load(backend_ref_t *bref);
+backend_ref_t *causal_check_read(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                                 GWBUF *query, bool can_delay);
+static void causal_fetch_gtid(ROUTER_CLIENT_SES *rses, GWBUF *reply);
+GWBUF *causal_process_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                            backend_ref_t *bref, GWBUF *reply);
+bool causal_server_is_supported(SERVER *server);
 
 static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
                                          GWBUF *querybuf, qc_query_type_t type);
@@ -105,6 +137,7 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
 
 static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
                               GWBUF *querybuf);
+static bool route_stream_data(ROUTER_CLIENT_SES *rses, GWBUF *querybuf);
 
 static int getCapabilities();
 
@@ -113,10 +146,19 @@ static bool router_option_configured(ROUTER_INSTANCE *router,
                                      const char *optionstr, void *data);
 #endif
 
-#if defined(PREP_STMT_CACHING)
-static prep_stmt_t *prep_stmt_init(prep_stmt_type_t type, void *id);
-static void prep_stmt_done(prep_stmt_t *pstmt);
-#endif /*< PREP_STMT_CACHING */
+static bool is_read_only_prep_stmt(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype);
+prep_stmt_t *prep_stmt_init(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype);
+void prep_stmt_done(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt);
+void prep_stmt_store_reply(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                           backend_ref_t *bref, GWBUF *reply);
+void prep_stmt_publish(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                       backend_ref_t *bref, GWBUF *reply);
+prep_stmt_t *prep_stmt_get(ROUTER_CLIENT_SES *rses, GWBUF *buf);
+static bool prep_stmt_exec_is_read(prep_stmt_t *pstmt, GWBUF *buf);
+backend_ref_t *prep_stmt_get_target(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                                    backend_ref_t *bref, GWBUF *buf);
+static bool route_prep_stmt_close(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                                  GWBUF *buf);
 
 int bref_cmp_global_conn(const void *bref1, const void *bref2);
 
@@ -126,6 +168,10 @@ int bref_cmp_behind_master(const void *bref1, const void *bref2);
 
 int bref_cmp_current_load(const void *bref1, const void *bref2);
 
+int bref_cmp_response_time(const void *bref1, const void *bref2);
+
+int bref_cmp_congestion(const void *bref1, const void *bref2);
+
 /**
  * The order of functions _must_ match with the order the select criteria are
  * listed in select_criteria_t definition in readwritesplit.h
@@ -136,9 +182,17 @@ int (*criteria_cmpfun[LAST_CRITERIA])(const void *, const void *) =
     bref_cmp_global_conn,
     bref_cmp_router_conn,
     bref_cmp_behind_master,
-    bref_cmp_current_load
+    bref_cmp_current_load,
+    bref_cmp_response_time,
+    bref_cmp_congestion
 };
 
+/**
+ * The weight of a new response time sample in the moving average is
+ * 1 / (1 << RESPONSE_TIME_SHIFT).
+ */
+#define RESPONSE_TIME_SHIFT 3
+
 static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
                                            backend_ref_t *backend_ref,
                                            int router_nservers, int max_nslaves,
@@ -148,7 +202,7 @@ static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
                                            ROUTER_INSTANCE *router);
 
 static bool get_dcb(DCB **dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
-                    char *name, int max_rlag);
+                    HINT *named, int max_rlag);
 
 static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                                            char **options);
@@ -173,6 +227,13 @@ static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses);
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses);
 
 static void mysql_sescmd_done(mysql_sescmd_t *sescmd);
+static char *sescmd_get_key(GWBUF *buf, unsigned char packet_type);
+static bool is_read_only_trx(GWBUF *buf);
+static bool is_lock_query(GWBUF *buf);
+static void sescmd_compact_history(ROUTER_CLIENT_SES *rses);
+static bool is_call_query(GWBUF *buf);
+static bool route_redundant_sescmd(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                   unsigned char packet_type, bool *succp);
 
 static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
                                          GWBUF *sescmd_buf,
@@ -193,6 +254,13 @@ static bool execute_sescmd_history(backend_ref_t *bref);
 
 static bool execute_sescmd_in_backend(backend_ref_t *backend_ref);
 
+static bool rses_tracks_state(ROUTER_CLIENT_SES *rses);
+static bool rses_prepares_lazily(ROUTER_CLIENT_SES *rses);
+
+static void sescmd_catch_up(backend_ref_t *bref);
+
+static void sescmd_add_tracked(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *reply);
+
 static void sescmd_cursor_reset(sescmd_cursor_t *scur);
 
 static bool sescmd_cursor_history_empty(sescmd_cursor_t *scur);
@@ -202,8 +270,6 @@ static void sescmd_cursor_set_active(sescmd_cursor_t *sescmd_cursor,
 
 static bool sescmd_cursor_is_active(sescmd_cursor_t *sescmd_cursor);
 
-static GWBUF *sescmd_cursor_clone_querybuf(sescmd_cursor_t *scur);
-
 static mysql_sescmd_t *sescmd_cursor_get_command(sescmd_cursor_t *scur);
 
 static bool sescmd_cursor_next(sescmd_cursor_t *scur);
@@ -217,7 +283,7 @@ static void tracelog_routed_query(ROUTER_CLIENT_SES *rses, char *funcname,
 static bool route_session_write(ROUTER_CLIENT_SES *router_client_ses,
                                 GWBUF *querybuf, ROUTER_INSTANCE *inst,
                                 unsigned char packet_type,
-                                qc_query_type_t qtype);
+                                qc_query_type_t qtype, prep_stmt_t *pstmt);
 
 static void refreshInstance(ROUTER_INSTANCE *router, CONFIG_PARAMETER *param);
 
@@ -245,7 +311,8 @@ static ROUTER_INSTANCE *instances;
 static int hashkeyfun(void *key);
 static int hashcmpfun(void *, void *);
 static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
-                                 mysql_server_cmd_t packet_type);
+                                 mysql_server_cmd_t packet_type,
+                                 qc_query_type_t *qtype);
 static bool send_readonly_error(DCB *dcb);
 
 static int hashkeyfun(void *key)
@@ -473,6 +540,10 @@ static inline void free_rwsplit_instance(ROUTER_INSTANCE *router)
             }
         }
         free(router->servers);
+        ts_stats_free(router->stats.n_queries);
+        ts_stats_free(router->stats.n_master);
+        ts_stats_free(router->stats.n_slave);
+        ts_stats_free(router->stats.n_all);
         free(router);
     }
 }
@@ -501,6 +572,15 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     router->service = service;
     spinlock_init(&router->lock);
 
+    if ((router->stats.n_queries = ts_stats_alloc()) == NULL ||
+        (router->stats.n_master = ts_stats_alloc()) == NULL ||
+        (router->stats.n_slave = ts_stats_alloc()) == NULL ||
+        (router->stats.n_all = ts_stats_alloc()) == NULL)
+    {
+        free_rwsplit_instance(router);
+        return NULL;
+    }
+
     /** Calculate number of servers */
     sref = service->dbref;
     nservers = 0;
@@ -537,6 +617,7 @@ static ROUTER *createInstance(SERVICE *service, char **options)
         router->servers[nservers]->backend_conn_count = 0;
         router->servers[nservers]->be_valid = false;
         router->servers[nservers]->weight = 1000;
+        router->servers[nservers]->be_response_time = 0;
 #if defined(SS_DEBUG)
         router->servers[nservers]->be_chk_top = CHK_NUM_BACKEND;
         router->servers[nservers]->be_chk_tail = CHK_NUM_BACKEND;
@@ -629,10 +710,16 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     /** Enable strict multistatement handling by default */
     router->rwsplit_config.rw_strict_multi_stmt = true;
 
+    /** Read-only prepared statements are executed in slaves by default */
+    router->rwsplit_config.rw_route_prep_stmt = true;
+
     /** By default, the client connection is closed immediately when a master
      * failure is detected */
     router->rwsplit_config.rw_master_failure_mode = RW_FAIL_INSTANTLY;
 
+    /** A slave is waited for at most ten seconds by the causal reads */
+    router->rwsplit_config.rw_causal_reads_timeout = 10;
+
     /** Call this before refreshInstance */
     if (options && !rwsplit_process_router_options(router, options))
     {
@@ -640,6 +727,26 @@ static ROUTER *createInstance(SERVICE *service, char **options)
         return NULL;
     }
 
+    if (router->rwsplit_config.rw_causal_reads)
+    {
+        /** The versions of the servers that have not been connected to are checked later */
+        for (int i = 0; router->servers[i]; i++)
+        {
+            SERVER *server = router->servers[i]->backend_server;
+
+            if (server->server_string && !causal_server_is_supported(server))
+            {
+                MXS_ERROR("Service '%s' uses causal_reads but server '%s' is '%s'. The "
+                          "causal reads require MariaDB %d.%d.%d or later, the reads that "
+                          "follow writes are routed to the master instead of that server.",
+                          service->name, server->unique_name, server->server_string,
+                          CAUSAL_MIN_VERSION / 10000, CAUSAL_MIN_VERSION / 100 % 100,
+                          CAUSAL_MIN_VERSION % 100);
+                router->causal_unsupported = 1;
+            }
+        }
+    }
+
     /** These options cancel each other out */
     if (router->rwsplit_config.rw_disable_sescmd_hist &&
         router->rwsplit_config.rw_max_sescmd_history_size > 0)
@@ -688,6 +795,13 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     {
         refreshInstance(router, param);
     }
+    if (router->rwsplit_config.rw_idle_backend_timeout > 0)
+    {
+        char task_name[strlen(service->name) + sizeof("rwsplit idle ")];
+        sprintf(task_name, "rwsplit idle %s", service->name);
+        hktask_add(task_name, release_idle_backends, router, 1);
+    }
+
     /**
      * We have completed the creation of the router data, so now
      * insert this router into the linked list of routers
@@ -725,7 +839,8 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     int i;
     const int min_nservers = 1; /*< hard-coded for now */
 
-    client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+    /** The router session and the backend references live in the memory of the session */
+    client_rses = (ROUTER_CLIENT_SES *)session_arena_alloc(session, sizeof(ROUTER_CLIENT_SES));
 
     if (client_rses == NULL)
     {
@@ -739,6 +854,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
 
     client_rses->router = router;
     client_rses->client_dcb = session->client_dcb;
+    client_rses->rses_session = session;
     /**
      * If service config has been changed, reload config from service to
      * router instance first.
@@ -765,6 +881,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     client_rses->rses_transaction_active = false;
     client_rses->have_tmp_tables = false;
     client_rses->forced_node = NULL;
+    client_rses->rses_last_activity = hkheartbeat;
 
     router_nservers = router_get_servercount(router);
 
@@ -775,13 +892,11 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     /**
      * Create backend reference objects for this session.
      */
-    backend_ref = (backend_ref_t *)calloc(1, router_nservers * sizeof(backend_ref_t));
+    backend_ref = (backend_ref_t *)session_arena_alloc(session, router_nservers * sizeof(backend_ref_t));
 
     if (backend_ref == NULL)
     {
         /** log this */
-        free(client_rses);
-        free(backend_ref);
         client_rses = NULL;
         goto return_rses;
     }
@@ -802,6 +917,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
         /** store pointers to sescmd list to both cursors */
         backend_ref[i].bref_sescmd_cur.scmd_cur_rses = client_rses;
         backend_ref[i].bref_sescmd_cur.scmd_cur_active = false;
+        backend_ref[i].bref_sescmd_cur.scmd_cur_sent = -1;
         backend_ref[i].bref_sescmd_cur.scmd_cur_ptr_property =
             &client_rses->rses_properties[RSES_PROP_TYPE_SESCMD];
         backend_ref[i].bref_sescmd_cur.scmd_cur_cmd = NULL;
@@ -821,15 +937,29 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
 
     if (!succp)
     {
-        free(client_rses->rses_backend_ref);
-        free(client_rses);
         client_rses = NULL;
         goto return_rses;
     }
-    succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
-                                           max_nslaves, max_slave_rlag,
-                                           client_rses->rses_config.rw_slave_select_criteria,
-                                           session, router);
+    if (client_rses->rses_config.rw_lazy_connect)
+    {
+        /** The servers are connected when the first queries are routed to them */
+        BACKEND *master_host = get_root_master(backend_ref, router_nservers);
+
+        succp = client_rses->rses_config.rw_master_failure_mode != RW_FAIL_INSTANTLY ||
+                (master_host && !SERVER_IS_DOWN(master_host->backend_server));
+
+        if (!succp)
+        {
+            MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
+        }
+    }
+    else
+    {
+        succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
+                                               max_nslaves, max_slave_rlag,
+                                               client_rses->rses_config.rw_slave_select_criteria,
+                                               session, router);
+    }
 
     rses_end_locked_router_action(client_rses);
 
@@ -840,8 +970,6 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
      */
     if (!succp)
     {
-        free(client_rses->rses_backend_ref);
-        free(client_rses);
         client_rses = NULL;
         goto return_rses;
     }
@@ -1016,2293 +1144,4183 @@ static void freeSession(ROUTER *router_instance, void *router_client_session)
             p = q;
         }
     }
+
+    if (router_cli_ses->rses_prep_stmt)
+    {
+        hashtable_free(router_cli_ses->rses_prep_stmt);
+    }
+
+    if (router_cli_ses->rses_causal_query)
+    {
+        gwbuf_free(router_cli_ses->rses_causal_query);
+    }
     /*
-     * We are no longer in the linked list, free
-     * all the memory and other resources associated
-     * to the client session.
+     * We are no longer in the linked list, free the resources
+     * associated to the client session. The memory of the router
+     * session is taken back with the session.
      */
-    free(router_cli_ses->rses_backend_ref);
-    free(router_cli_ses);
+    slowlog_query_free(&router_cli_ses->rses_slow_query);
     return;
 }
 
 /**
- * Provide the router with a pointer to a suitable backend dcb.
- *
- * Detect failures in server statuses and reselect backends if necessary.
- * If name is specified, server name becomes primary selection criteria.
- * Similarly, if max replication lag is specified, skip backends which lag too
- * much.
+ * Choose a slave at random, the probability of each slave being inversely
+ * proportional to its average response time. A slave that has not replied
+ * yet is given the response time of the fastest slave so that it gets
+ * measured without being flooded. The probability of a slave that is warming
+ * up is reduced like its weight. @see server_warmup_weight
  *
- * @param p_dcb Address of the pointer to the resulting DCB
- * @param rses  Pointer to router client session
- * @param btype Backend type
- * @param name  Name of the backend which is primarily searched. May be NULL.
- *
- * @return True if proper DCB was found, false otherwise.
+ * @param rses      Router client session
+ * @param max_rlag  Maximum allowed replication lag or MAX_RLAG_UNDEFINED
+ * @return The chosen slave or NULL if no slave can be used
  */
-static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
-                    char *name, int max_rlag)
+static backend_ref_t *get_slave_by_response_time(ROUTER_CLIENT_SES *rses,
+                                                 int max_rlag)
 {
-    backend_ref_t *backend_ref;
-    backend_ref_t *master_bref;
-    int i;
-    bool succp = false;
+    backend_ref_t *backend_ref = rses->rses_backend_ref;
+    backend_ref_t *chosen = NULL;
+    int fastest = 0;
+    double total = 0.0;
+    double r;
 
-    CHK_CLIENT_RSES(rses);
-    ss_dassert(p_dcb != NULL && *(p_dcb) == NULL);
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        int rt = backend_ref[i].bref_backend->be_response_time;
 
-    if (p_dcb == NULL)
+        if (rt > 0 && (fastest == 0 || rt < fastest))
+        {
+            fastest = rt;
+        }
+    }
+
+    if (fastest == 0)
     {
-        goto return_succp;
+        fastest = 1;
     }
-    backend_ref = rses->rses_backend_ref;
 
-    /** get root master from available servers */
-    master_bref = get_root_master_bref(rses);
+    /** Pick the point where the cumulative weight is reached */
+    r = (double)random_jkiss() / (double)UINT_MAX;
 
-    if (name != NULL) /*< Choose backend by name from a hint */
+    for (int pass = 0; pass < 2; pass++)
     {
-        ss_dassert(btype != BE_MASTER); /*< Master dominates and no name should be passed with it */
+        double sum = 0.0;
 
-        for (i = 0; i < rses->rses_nbackends; i++)
+        for (int i = 0; i < rses->rses_nbackends; i++)
         {
             BACKEND *b = backend_ref[i].bref_backend;
             SERVER server;
-            server.status = backend_ref[i].bref_backend->backend_server->status;
-            /**
-             * To become chosen:
-             * backend must be in use, name must match,
-             * backend's role must be either slave, relay
-             * server, or master.
-             */
-            if (BREF_IS_IN_USE((&backend_ref[i])) &&
-                (strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
-                (SERVER_IS_SLAVE(&server) || SERVER_IS_RELAY_SERVER(&server) ||
-                 SERVER_IS_MASTER(&server)))
-            {
-                *p_dcb = backend_ref[i].bref_dcb;
-                succp = true;
-                ss_dassert(backend_ref[i].bref_dcb->state != DCB_STATE_ZOMBIE);
-                break;
-            }
-        }
-        if (succp)
-        {
-            goto return_succp;
-        }
-        else
-        {
-            btype = BE_SLAVE;
-        }
-    }
+            int rt;
 
-    if (btype == BE_SLAVE)
-    {
-        backend_ref_t *candidate_bref = NULL;
+            server.status = b->backend_server->status;
 
-        for (i = 0; i < rses->rses_nbackends; i++)
-        {
-            BACKEND *b = (&backend_ref[i])->bref_backend;
-            SERVER server;
-            SERVER candidate;
-            server.status = backend_ref[i].bref_backend->backend_server->status;
-            /**
-             * Unused backend or backend which is not master nor
-             * slave can't be used
-             */
-            if (!BREF_IS_IN_USE(&backend_ref[i]) ||
-                (!SERVER_IS_MASTER(&server) && !SERVER_IS_SLAVE(&server)))
+            if (!BREF_IS_IN_USE(&backend_ref[i]) || !SERVER_IS_SLAVE(&server) ||
+                !rlag_is_acceptable(rses_get_root_server(rses), b->backend_server, max_rlag))
             {
                 continue;
             }
-            /**
-             * If there are no candidates yet accept both master or
-             * slave.
-             */
-            else if (candidate_bref == NULL)
-            {
-                /**
-                 * Ensure that master has not changed dunring
-                 * session and abort if it has.
-                 */
-                if (SERVER_IS_MASTER(&server) && &backend_ref[i] == master_bref)
-                {
-                    /** found master */
-                    candidate_bref = &backend_ref[i];
-                    candidate.status = candidate_bref->bref_backend->backend_server->status;
-                    succp = true;
-                }
-                /**
-                 * Ensure that max replication lag is not set
-                 * or that candidate's lag doesn't exceed the
-                 * maximum allowed replication lag.
-                 */
-                else if (max_rlag == MAX_RLAG_UNDEFINED ||
-                         (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                          b->backend_server->rlag <= max_rlag))
-                {
-                    /** found slave */
-                    candidate_bref = &backend_ref[i];
-                    candidate.status = candidate_bref->bref_backend->backend_server->status;
-                    succp = true;
-                }
-            }
-            /**
-             * If candidate is master, any slave which doesn't break
-             * replication lag limits replaces it.
-             */
-            else if (SERVER_IS_MASTER(&candidate) && SERVER_IS_SLAVE(&server) &&
-                     (max_rlag == MAX_RLAG_UNDEFINED ||
-                      (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                       b->backend_server->rlag <= max_rlag)) &&
-                     !rses->rses_config.rw_master_reads)
-            {
-                /** found slave */
-                candidate_bref = &backend_ref[i];
-                candidate.status = candidate_bref->bref_backend->backend_server->status;
-                succp = true;
-            }
-            /**
-             * When candidate exists, compare it against the current
-             * backend and update assign it to new candidate if
-             * necessary.
-             */
-            else if (SERVER_IS_SLAVE(&server))
+
+            rt = b->be_response_time > 0 ? b->be_response_time : fastest;
+            sum += server_warmup_weight(b->backend_server, 1000) / (1000.0 * rt);
+
+            /** The first pass sums the weights, the second one chooses */
+            if (pass == 1 && sum >= r * total)
             {
-                if (max_rlag == MAX_RLAG_UNDEFINED ||
-                    (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                     b->backend_server->rlag <= max_rlag))
-                {
-                    candidate_bref =
-                        check_candidate_bref(candidate_bref, &backend_ref[i],
-                                             rses->rses_config.rw_slave_select_criteria);
-                    candidate.status =
-                        candidate_bref->bref_backend->backend_server->status;
-                }
-                else
-                {
-                    MXS_INFO("Server %s:%d is too much behind the "
-                             "master, %d s. and can't be chosen.",
-                             b->backend_server->name, b->backend_server->port,
-                             b->backend_server->rlag);
-                }
+                return &backend_ref[i];
             }
-        } /*<  for */
-        /** Assign selected DCB's pointer value */
-        if (candidate_bref != NULL)
-        {
-            *p_dcb = candidate_bref->bref_dcb;
+            chosen = &backend_ref[i];
         }
 
-        goto return_succp;
-    } /*< if (btype == BE_SLAVE) */
-    /**
-     * If target was originally master only then the execution jumps
-     * directly here.
-     */
-    if (btype == BE_MASTER)
-    {
-        if (master_bref)
+        if (chosen == NULL)
         {
-            /** It is possible for the server status to change at any point in time
-             * so copying it locally will make possible error messages
-             * easier to understand */
-            SERVER server;
-            server.status = master_bref->bref_backend->backend_server->status;
-            if (BREF_IS_IN_USE(master_bref) && SERVER_IS_MASTER(&server))
-            {
-                *p_dcb = master_bref->bref_dcb;
-                succp = true;
-                /** if bref is in use DCB should not be closed */
-                ss_dassert(master_bref->bref_dcb->state != DCB_STATE_ZOMBIE);
-            }
-            else
-            {
-                MXS_ERROR("Server at %s:%d should be master but "
-                          "is %s instead and can't be chosen to master.",
-                          master_bref->bref_backend->backend_server->name,
-                          master_bref->bref_backend->backend_server->port,
-                          STRSRVSTATUS(&server));
-                succp = false;
-            }
+            break;
         }
+        total = sum;
     }
 
-return_succp:
-    return succp;
+    /** Rounding may leave the last slave unchosen in the second pass */
+    return chosen;
 }
 
 /**
- * Find out which of the two backend servers has smaller value for select
- * criteria property.
+ * Connect the session to a slave that is better by the slave selection
+ * criteria than the ones it uses. This lets the sessions that stay open for
+ * a long time move to the slaves that were added or came back after the
+ * sessions were opened. If the session already uses as many slaves as it
+ * may, its worst idle slave is closed first. The session command history is
+ * executed in the new slave before it is used. Done at most once in every
+ * RWSPLIT_REBALANCE_INTERVAL and only with the cached values of the criteria.
  *
- * @param cand  previously selected candidate
- * @param new   challenger
- * @param sc    select criteria
+ * The caller must hold the lock of the router session.
  *
- * @return pointer to backend reference of that backend server which has smaller
- * value in selection criteria. If either reference pointer is NULL then the
- * other reference pointer value is returned.
+ * @param rses      Router client session
+ * @param max_rlag  Maximum allowed replication lag or MAX_RLAG_UNDEFINED
  */
-static backend_ref_t *check_candidate_bref(backend_ref_t *cand,
-                                           backend_ref_t *new,
-                                           select_criteria_t sc)
+static void rebalance_slaves(ROUTER_CLIENT_SES *rses, int max_rlag)
 {
-    int (*p)(const void *, const void *);
-    /** get compare function */
-    p = criteria_cmpfun[sc];
+    backend_ref_t *backend_ref = rses->rses_backend_ref;
+    select_criteria_t sc = rses->rses_config.rw_slave_select_criteria;
+    backend_ref_t *best = NULL;
+    backend_ref_t *worst = NULL;
+    int n_slaves = 0;
 
-    if (new == NULL)
+    if (!rses->rses_config.rw_rebalance_slaves ||
+        rses->rses_config.rw_disable_sescmd_hist ||
+        hkheartbeat - rses->rses_last_rebalance < RWSPLIT_REBALANCE_INTERVAL)
     {
-        return cand;
+        return;
     }
-    else if (cand == NULL || (p((void *)cand, (void *)new) > 0))
+    rses->rses_last_rebalance = hkheartbeat;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        return new;
+        backend_ref_t *bref = &backend_ref[i];
+        SERVER *serv = bref->bref_backend->backend_server;
+
+        if (bref == rses->rses_master_ref || SERVER_IS_MASTER(serv))
+        {
+            continue;
+        }
+        else if (BREF_IS_IN_USE(bref))
+        {
+            n_slaves++;
+
+            /** Only a slave that is not executing anything can be closed */
+            if (!BREF_IS_WAITING_RESULT(bref) && bref->bref_pending_cmd == NULL &&
+                !sescmd_cursor_is_active(&bref->bref_sescmd_cur) &&
+                bref->bref_causal_op == CAUSAL_OP_NONE &&
+                bref != rses->forced_node && bref != rses->rses_ro_trx_slave &&
+                (worst == NULL || criteria_cmpfun[sc](worst, bref) < 0))
+            {
+                worst = bref;
+            }
+        }
+        else if (!BREF_HAS_FAILED(bref) && SERVER_IS_RUNNING(serv) &&
+                 SERVER_IS_SLAVE(serv) &&
+                 rlag_is_acceptable(rses_get_root_server(rses), serv, max_rlag))
+        {
+            best = check_candidate_bref(best, bref, sc);
+        }
     }
-    else
+
+    if (best == NULL)
     {
-        return cand;
+        return;
+    }
+
+    if (n_slaves >= rses_get_max_slavecount(rses, rses->rses_nbackends))
+    {
+        if (worst == NULL || criteria_cmpfun[sc](worst, best) <= 0)
+        {
+            return;
+        }
+
+        MXS_INFO("Replacing slave %s with %s.",
+                 worst->bref_backend->backend_server->unique_name,
+                 best->bref_backend->backend_server->unique_name);
+
+        bref_clear_state(worst, BREF_IN_USE);
+        bref_set_state(worst, BREF_CLOSED);
+        dcb_close(worst->bref_dcb);
+        atomic_add(&worst->bref_backend->backend_conn_count, -1);
+    }
+
+    if (connect_server(best, rses->client_dcb->session, true))
+    {
+        MXS_INFO("Connected to slave %s while rebalancing the slaves.",
+                 best->bref_backend->backend_server->unique_name);
     }
 }
 
 /**
- * Examine the query type, transaction state and routing hints. Find out the
- * target for query routing.
+ * Connect the master of a session that was opened with lazy_connect. The
+ * session command history is executed in the master before it is used.
  *
- *  @param qtype      Type of query
- *  @param trx_active Is transacation active or not
- *  @param hint       Pointer to list of hints attached to the query buffer
+ * The caller must hold the lock of the router session.
  *
- *  @return bitfield including the routing target, or the target server name
- *          if the query would otherwise be routed to slave.
+ * @param rses Router client session
+ * @return True if the master is connected
  */
-static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
-                                       qc_query_type_t qtype, HINT *hint)
+static bool lazy_connect_master(ROUTER_CLIENT_SES *rses)
 {
-    bool trx_active = rses->rses_transaction_active;
-    bool load_active = rses->rses_load_active;
-    target_t use_sql_variables_in = rses->rses_config.rw_use_sql_variables_in;
-    route_target_t target = TARGET_UNDEFINED;
-
-    if (rses->rses_config.rw_strict_multi_stmt && rses->forced_node &&
-        rses->forced_node == rses->rses_master_ref)
+    if (rses->rses_master_ref)
     {
-        target = TARGET_MASTER;
+        return BREF_IS_IN_USE(rses->rses_master_ref);
     }
-    /**
-     * These queries are not affected by hints
-     */
-    else if (!load_active &&
-             (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
-              /** Configured to allow writing variables to all nodes */
-              (use_sql_variables_in == TYPE_ALL &&
-               QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE)) ||
-              /** enable or disable autocommit are always routed to all */
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT)))
+
+    BACKEND *master_host = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+
+    for (int i = 0; master_host && i < rses->rses_nbackends; i++)
     {
-        /**
-         * This is problematic query because it would be routed to all
-         * backends but since this is SELECT that is not possible:
-         * 1. response set is not handled correctly in clientReply and
-         * 2. multiple results can degrade performance.
-         *
-         * Prepared statements are an exception to this since they do not
-         * actually do anything but only prepare the statement to be used.
-         * They can be safely routed to all backends since the execution
-         * is done later.
-         *
-         * With prepared statement caching the task of routing
-         * the execution of the prepared statements to the right server would be
-         * an easy one. Currently this is not supported.
-         */
-        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
-            !(QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT)))
-        {
-            MXS_WARNING("The query can't be routed to all "
-                        "backend servers because it includes SELECT and "
-                        "SQL variable modifications which is not supported. "
-                        "Set use_sql_variables_in=master or split the "
-                        "query to two, where SQL variable modifications "
-                        "are done in the first and the SELECT in the "
-                        "second one.");
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
 
-            target = TARGET_MASTER;
+        if (bref->bref_backend == master_host && !BREF_HAS_FAILED(bref) &&
+            SERVER_IS_RUNNING(master_host->backend_server))
+        {
+            if (BREF_IS_IN_USE(bref) ||
+                connect_server(bref, rses->client_dcb->session, true))
+            {
+                MXS_INFO("Connected to master %s when it was first needed.",
+                         master_host->backend_server->unique_name);
+                rses->rses_master_ref = bref;
+                return true;
+            }
+            break;
         }
-        target |= TARGET_ALL;
     }
-    /**
-     * Hints may affect on routing of the following queries
-     */
-    else if (!trx_active && !load_active &&
-             !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
-             (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||        /*< any SELECT */
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) || /*< 'SHOW TABLES' */
-              QUERY_IS_TYPE(qtype,
-                            QUERY_TYPE_USERVAR_READ) ||       /*< read user var */
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) || /*< read sys var */
-              QUERY_IS_TYPE(qtype,
-                            QUERY_TYPE_EXEC_STMT) || /*< prepared stmt exec */
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
-              QUERY_IS_TYPE(qtype,
-                            QUERY_TYPE_GSYSVAR_READ))) /*< read global sys var */
+
+    return false;
+}
+
+/**
+ * Connect a slave to a session that was opened with lazy_connect and has no
+ * slaves yet. The best slave by the slave selection criteria is chosen and
+ * the session command history is executed in it before it is used. If no
+ * slave can be connected and the session has no servers at all, the master
+ * is connected.
+ *
+ * The caller must hold the lock of the router session.
+ *
+ * @param rses      Router client session
+ * @param max_rlag  Maximum allowed replication lag or MAX_RLAG_UNDEFINED
+ * @return True if the session has a server that can execute a read
+ */
+static bool lazy_connect_slave(ROUTER_CLIENT_SES *rses, int max_rlag)
+{
+    backend_ref_t *best = NULL;
+    bool in_use = false;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        /** First set expected targets before evaluating hints */
-        if (!QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) &&
-            (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
-             QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) || /*< 'SHOW TABLES' */
-             /** Configured to allow reading variables from slaves */
-             (use_sql_variables_in == TYPE_ALL &&
-              (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
-               QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
-               QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ)))))
-        {
-            target = TARGET_SLAVE;
-        }
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *serv = bref->bref_backend->backend_server;
 
-        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
-            QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
-            QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
-            QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
-            /** Configured not to allow reading variables from slaves */
-            (use_sql_variables_in == TYPE_MASTER &&
-             (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
-              QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ))))
-        {
-            target = TARGET_MASTER;
-        }
-        /** process routing hints */
-        while (hint != NULL)
+        if (BREF_IS_IN_USE(bref))
         {
-            if (hint->type == HINT_ROUTE_TO_MASTER)
-            {
-                target = TARGET_MASTER; /*< override */
-                MXS_DEBUG("%lu [get_route_target] Hint: route to master.",
-                          pthread_self());
-                break;
-            }
-            else if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
-            {
-                /**
-                 * Searching for a named server. If it can't be
-                 * found, the oroginal target is chosen.
-                 */
-                target |= TARGET_NAMED_SERVER;
-                MXS_DEBUG("%lu [get_route_target] Hint: route to "
-                          "named server : ",
-                          pthread_self());
-            }
-            else if (hint->type == HINT_ROUTE_TO_UPTODATE_SERVER)
-            {
-                /** not implemented */
-            }
-            else if (hint->type == HINT_ROUTE_TO_ALL)
-            {
-                /** not implemented */
-            }
-            else if (hint->type == HINT_PARAMETER)
-            {
-                if (strncasecmp((char *)hint->data, "max_slave_replication_lag",
-                                strlen("max_slave_replication_lag")) == 0)
-                {
-                    target |= TARGET_RLAG_MAX;
-                }
-                else
-                {
-                    MXS_ERROR("Unknown hint parameter "
-                              "'%s' when 'max_slave_replication_lag' "
-                              "was expected.",
-                              (char *)hint->data);
-                }
-            }
-            else if (hint->type == HINT_ROUTE_TO_SLAVE)
+            if (SERVER_IS_SLAVE(serv))
             {
-                target = TARGET_SLAVE;
-                MXS_DEBUG("%lu [get_route_target] Hint: route to "
-                          "slave.",
-                          pthread_self());
+                return true;
             }
-            hint = hint->next;
-        } /*< while (hint != NULL) */
-        /** If nothing matches then choose the master */
-        if ((target & (TARGET_ALL | TARGET_SLAVE | TARGET_MASTER)) == 0)
+            in_use = true;
+        }
+        else if (!BREF_HAS_FAILED(bref) && SERVER_IS_RUNNING(serv) &&
+                 SERVER_IS_SLAVE(serv) && bref != rses->rses_master_ref &&
+                 rlag_is_acceptable(rses_get_root_server(rses), serv, max_rlag))
         {
-            target = TARGET_MASTER;
+            best = check_candidate_bref(best, bref, rses->rses_config.rw_slave_select_criteria);
         }
     }
-    else
+
+    if (best && connect_server(best, rses->client_dcb->session, true))
     {
-        /** hints don't affect on routing */
-        ss_dassert(trx_active ||
-                   (QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
-                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) &&
-                     use_sql_variables_in == TYPE_MASTER) ||
-                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) &&
-                     use_sql_variables_in == TYPE_MASTER) ||
-                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ) &&
-                     use_sql_variables_in == TYPE_MASTER) ||
-                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE) &&
-                     use_sql_variables_in == TYPE_MASTER) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_CREATE_TMP_TABLE) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_TMP_TABLE) ||
-                    QUERY_IS_TYPE(qtype, QUERY_TYPE_UNKNOWN)));
-        target = TARGET_MASTER;
+        MXS_INFO("Connected to slave %s when the first read was routed.",
+                 best->bref_backend->backend_server->unique_name);
+        return true;
     }
-#if defined(SS_EXTRA_DEBUG)
-    MXS_INFO("Selected target \"%s\"", STRTARGET(target));
-#endif
-    return target;
+
+    return in_use || lazy_connect_master(rses);
 }
 
 /**
- * Check if the query is a DROP TABLE... query and
- * if it targets a temporary table, remove it from the hashtable.
- * @param router_cli_ses Router client session
- * @param querybuf GWBUF containing the query
- * @param type The type of the query resolved so far
+ * Check whether the servers of a session can be released. The session must
+ * have nothing in progress and all of its state must be in the session
+ * command history so that it can be restored in the next servers.
+ *
+ * The caller must hold the lock of the router session.
+ *
+ * @param rses Router client session
+ * @return True if the backend connections of the session can be closed
  */
-void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
-                          qc_query_type_t type)
+static bool rses_can_release(ROUTER_CLIENT_SES *rses)
 {
+    bool in_use = false;
 
-    int tsize = 0, klen = 0, i;
-    char **tbl = NULL;
-    char *hkey, *dbname;
-    MYSQL_session *data;
-    rses_property_t *rses_prop_tmp;
-
-    if (router_cli_ses == NULL || querybuf == NULL)
+    if (rses->rses_transaction_active || !rses->rses_autocommit_enabled ||
+        rses->have_tmp_tables || rses->rses_load_active || rses->rses_state_pinned ||
+        rses->rses_config.rw_disable_sescmd_hist || rses->forced_node ||
+        rses->rses_causal_query || rses->rses_ro_trx_slave)
     {
-        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
-                  router_cli_ses, querybuf);
-        return;
+        return false;
     }
 
-    if (router_cli_ses->client_dcb == NULL)
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
-        return;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref))
+        {
+            if (BREF_IS_WAITING_RESULT(bref) || bref->bref_pending_cmd ||
+                sescmd_cursor_is_active(&bref->bref_sescmd_cur) ||
+                bref->bref_causal_op != CAUSAL_OP_NONE)
+            {
+                return false;
+            }
+            in_use = true;
+        }
     }
 
-    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
-    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+    return in_use;
+}
 
-    if (data == NULL)
-    {
-        MXS_ERROR("[%s] Error: User data in master server DBC is NULL.",
-                  __FUNCTION__);
-        return;
-    }
+/**
+ * Close the backend connections of the sessions that have been idle for longer
+ * than idle_backend_timeout. The connections go back to the persistent pools
+ * of the servers if the pools are enabled. The sessions are switched to
+ * lazy_connect so that the servers are connected and the session command
+ * history is executed in them when the next query arrives.
+ *
+ * Called by the housekeeper once a second.
+ *
+ * @param data The router instance
+ */
+static void release_idle_backends(void *data)
+{
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *)data;
+    long timeout = inst->rwsplit_config.rw_idle_backend_timeout * 10;
 
-    dbname = (char *)data->db;
+    spinlock_acquire(&inst->lock);
 
-    if (qc_is_drop_table_query(querybuf))
+    for (ROUTER_CLIENT_SES *rses = inst->connections; rses; rses = rses->next)
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
-        if (tbl != NULL)
+        if (hkheartbeat - rses->rses_last_activity < timeout ||
+            !rses_begin_locked_router_action(rses))
+        {
+            continue;
+        }
+
+        if (hkheartbeat - rses->rses_last_activity >= timeout && rses_can_release(rses))
         {
-            for (i = 0; i < tsize; i++)
+            for (int i = 0; i < rses->rses_nbackends; i++)
             {
-                klen = strlen(dbname) + strlen(tbl[i]) + 2;
-                hkey = calloc(klen, sizeof(char));
-                strcpy(hkey, dbname);
-                strcat(hkey, ".");
-                strcat(hkey, tbl[i]);
+                backend_ref_t *bref = &rses->rses_backend_ref[i];
 
-                if (rses_prop_tmp && rses_prop_tmp->rses_prop_data.temp_tables)
+                if (BREF_IS_IN_USE(bref))
                 {
-                    if (hashtable_delete(rses_prop_tmp->rses_prop_data.temp_tables,
-                                         (void *)hkey))
-                    {
-                        MXS_INFO("Temporary table dropped: %s", hkey);
-                    }
+                    MXS_INFO("Releasing the connection to %s of an idle session.",
+                             bref->bref_backend->backend_server->unique_name);
+                    bref_clear_state(bref, BREF_IN_USE);
+                    bref_set_state(bref, BREF_CLOSED);
+                    dcb_close(bref->bref_dcb);
+                    atomic_add(&bref->bref_backend->backend_conn_count, -1);
                 }
-                free(tbl[i]);
-                free(hkey);
             }
 
-            free(tbl);
+            rses->rses_master_ref = NULL;
+            rses->rses_config.rw_lazy_connect = true;
         }
+
+        rses_end_locked_router_action(rses);
     }
+
+    spinlock_release(&inst->lock);
 }
 
 /**
- * Check if the query targets a temporary table.
- * @param router_cli_ses Router client session
- * @param querybuf GWBUF containing the query
- * @param type The type of the query resolved so far
- * @return The type of the query
+ * Check whether a backend can be sent a query right away. A backend that is
+ * executing session commands or an internal query gets the next query only
+ * after it has replied to them.
+ *
+ * @param bref  Backend reference
+ * @return True if the backend has no commands of its own in progress
  */
-static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
-                                         GWBUF *querybuf,
-                                         qc_query_type_t type)
+static bool causal_bref_is_idle(backend_ref_t *bref)
 {
+    return bref->bref_causal_op == CAUSAL_OP_NONE &&
+           bref->bref_pending_cmd == NULL &&
+           !sescmd_cursor_is_active(&bref->bref_sescmd_cur);
+}
 
-    bool target_tmp_table = false;
-    int tsize = 0, klen = 0, i;
-    char **tbl = NULL;
-    char *dbname;
-    char hkey[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
-    MYSQL_session *data;
-    qc_query_type_t qtype = type;
-    rses_property_t *rses_prop_tmp;
+/**
+ * Check whether a server has the GTID functions that the causal reads use.
+ * MariaDB 10 reports its version prefixed with 5.5.5- to old clients.
+ *
+ * @param server    The server
+ * @return True if the server is MariaDB 10.0.9 or later, false if it is
+ * something else or its version is not known yet
+ */
+bool causal_server_is_supported(SERVER *server)
+{
+    const char *version = server->server_string;
+    int major;
+    int minor;
+    int patch;
 
-    if (router_cli_ses == NULL || querybuf == NULL)
+    if (version == NULL || strstr(version, "MariaDB") == NULL)
     {
-        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
-                  router_cli_ses, querybuf);
-        return type;
+        return false;
     }
 
-    if (router_cli_ses->client_dcb == NULL)
+    if (strncmp(version, "5.5.5-", 6) == 0)
     {
-        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
-        return type;
+        version += 6;
     }
 
-    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
-    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+    return sscanf(version, "%d.%d.%d", &major, &minor, &patch) == 3 &&
+           major * 10000 + minor * 100 + patch >= CAUSAL_MIN_VERSION;
+}
 
-    if (data == NULL)
+/**
+ * Check that a backend can execute the internal queries of the causal reads.
+ * The first server that cannot is reported once for each router instance.
+ *
+ * @param rses  Router client session
+ * @param bref  Backend reference
+ * @return True if the backend supports the causal reads
+ */
+static bool causal_bref_is_supported(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    SERVER *server = bref->bref_backend->backend_server;
+
+    if (causal_server_is_supported(server))
     {
-        MXS_ERROR("[%s] Error: User data in client DBC is NULL.", __FUNCTION__);
-        return qtype;
+        return true;
     }
 
-    dbname = (char *)data->db;
-
-    if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_LOCAL_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ))
+    if (atomic_add(&rses->router->causal_unsupported, 1) == 0)
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
+        MXS_ERROR("Server '%s' is '%s', the causal reads require MariaDB %d.%d.%d or "
+                  "later. The reads that follow writes are routed to the master "
+                  "instead of that server.", server->unique_name,
+                  server->server_string ? server->server_string : "of unknown version",
+                  CAUSAL_MIN_VERSION / 10000, CAUSAL_MIN_VERSION / 100 % 100,
+                  CAUSAL_MIN_VERSION % 100);
+    }
 
-        if (tbl != NULL && tsize > 0)
-        {
-            /** Query targets at least one table */
-            for (i = 0; i < tsize && !target_tmp_table && tbl[i]; i++)
-            {
-                sprintf(hkey, "%s.%s", dbname, tbl[i]);
-                if (rses_prop_tmp && rses_prop_tmp->rses_prop_data.temp_tables)
-                {
-                    if (hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey))
-                    {
-                        /**Query target is a temporary table*/
-                        qtype = QUERY_TYPE_READ_TMP_TABLE;
-                        MXS_INFO("Query targets a temporary table: %s", hkey);
-                        break;
-                    }
-                }
-            }
-        }
+    return false;
+}
+
+/**
+ * Send an internal query of the causal reads to a backend. The query is
+ * written as a session command so that the backend protocol collects the
+ * whole reply into one buffer before it is given to clientReply.
+ *
+ * @param bref  Backend reference
+ * @param sql   The query
+ * @param op    What the query is for
+ * @return True if the query was written
+ */
+static bool causal_send(backend_ref_t *bref, char *sql, causal_op_t op)
+{
+    GWBUF *buf = modutil_create_query(sql);
+
+    if (buf == NULL)
+    {
+        return false;
     }
 
-    if (tbl != NULL)
+    gwbuf_set_type(buf, GWBUF_TYPE_MYSQL | GWBUF_TYPE_SINGLE_STMT | GWBUF_TYPE_SESCMD);
+
+    if (bref->bref_dcb->func.write(bref->bref_dcb, buf) != 1)
     {
-        for (i = 0; i < tsize; i++)
-        {
-            free(tbl[i]);
-        }
-        free(tbl);
+        MXS_ERROR("Failed to write \"%s\" to '%s'.", sql,
+                  bref->bref_backend->backend_server->unique_name);
+        return false;
     }
 
-    return qtype;
+    bref->bref_causal_op = op;
+    return true;
 }
 
 /**
- * If query is of type QUERY_TYPE_CREATE_TMP_TABLE then find out
- * the database and table name, create a hashvalue and
- * add it to the router client session's property. If property
- * doesn't exist then create it first.
- * @param router_cli_ses Router client session
- * @param querybuf GWBUF containing the query
- * @param type The type of the query resolved so far
+ * Route a query to a backend, or leave it pending if the backend is busy
+ * with commands of its own. The router session must be locked.
+ *
+ * @param inst  Router instance
+ * @param bref  Backend reference
+ * @param query The query, freed by the call
  */
-static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
-                                   GWBUF *querybuf, qc_query_type_t type)
+static void causal_route(ROUTER_INSTANCE *inst, backend_ref_t *bref, GWBUF *query)
 {
-    if (!QUERY_IS_TYPE(type, QUERY_TYPE_CREATE_TMP_TABLE))
+    if (!causal_bref_is_idle(bref))
     {
-        return;
+        ss_dassert(bref->bref_pending_cmd == NULL);
+        bref->bref_pending_cmd = query;
+    }
+    else if (bref->bref_dcb->func.write(bref->bref_dcb, query) == 1)
+    {
+        ts_stats_add(inst->stats.n_queries, 1);
+        bref_set_state(bref, BREF_QUERY_ACTIVE);
+        bref_set_state(bref, BREF_WAITING_RESULT);
+    }
+    else
+    {
+        MXS_ERROR("Routing query to '%s' failed.",
+                  bref->bref_backend->backend_server->unique_name);
     }
+}
 
-    int klen = 0;
-    char *hkey, *dbname;
-    MYSQL_session *data;
-    rses_property_t *rses_prop_tmp;
-    HASHTABLE *h;
+/**
+ * Make a slave wait for the last write of the session before it executes
+ * a read. The read is left pending and it is routed by clientReply when the
+ * slave has replied to the wait. The router session must be locked.
+ *
+ * @param rses  Router client session
+ * @param bref  The slave
+ * @param query The read, cloned if the wait is started
+ * @return True if the slave is waiting for the write
+ */
+static bool causal_wait(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *query)
+{
+    char sql[CAUSAL_GTID_MAXLEN + 64];
 
-    if (router_cli_ses == NULL || querybuf == NULL)
+    if (!BREF_IS_IN_USE(bref) || BREF_IS_CLOSED(bref) || !causal_bref_is_idle(bref) ||
+        !causal_bref_is_supported(rses, bref))
     {
-        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
-                  router_cli_ses, querybuf);
-        return;
+        return false;
     }
 
-    if (router_cli_ses->client_dcb == NULL)
+    snprintf(sql, sizeof(sql), "SELECT MASTER_GTID_WAIT('%s', %d)",
+             rses->rses_causal_gtid, rses->rses_config.rw_causal_reads_timeout);
+
+    if (!causal_send(bref, sql, CAUSAL_OP_WAIT))
     {
-        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
-        return;
+        return false;
     }
 
-    router_cli_ses->have_tmp_tables = true;
-    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
-    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+    bref->bref_pending_cmd = gwbuf_clone(query);
+    MXS_INFO("Waiting for '%s' to replicate GTID %s before the read.",
+             bref->bref_backend->backend_server->unique_name, rses->rses_causal_gtid);
+    return true;
+}
 
-    if (data == NULL)
+/**
+ * Check whether a read that was routed to a slave can see the earlier writes
+ * of the session there. If the slave may not have replicated them yet, the
+ * read is either delayed until it has, or routed to the master. The router
+ * session must be locked.
+ *
+ * @param rses      Router client session
+ * @param bref      The backend chosen for the read
+ * @param query     The read
+ * @param can_delay False if the read can only be routed to the master
+ * @return The backend the read is routed to, NULL if the read was delayed
+ */
+backend_ref_t *causal_check_read(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                                 GWBUF *query, bool can_delay)
+{
+    backend_ref_t *master = rses->rses_master_ref;
+
+    if (!rses->rses_config.rw_causal_reads || bref == master ||
+        rses->rses_causal_state == CAUSAL_SYNCED ||
+        (rses->rses_causal_state == CAUSAL_KNOWN &&
+         bref->bref_causal_gen == rses->rses_causal_gen))
     {
-        MXS_ERROR("[%s] Error: User data in master server DBC is NULL.",
-                  __FUNCTION__);
-        return;
+        return bref;
     }
 
-    dbname = (char *)data->db;
+    if (can_delay)
+    {
+        if (rses->rses_causal_state == CAUSAL_FETCHING && rses->rses_causal_query == NULL)
+        {
+            /** Routed by causal_process_reply when the GTID has been read */
+            rses->rses_causal_query = gwbuf_clone(query);
+            rses->rses_causal_target = bref;
+            return NULL;
+        }
 
-    bool is_temp = true;
-    char *tblname = NULL;
+        if (rses->rses_causal_state == CAUSAL_KNOWN && causal_wait(rses, bref, query))
+        {
+            return NULL;
+        }
+    }
 
-    tblname = qc_get_created_table_name(querybuf);
+    if (master && BREF_IS_IN_USE(master) && !BREF_IS_CLOSED(master))
+    {
+        MXS_INFO("Slave '%s' may not have the last write of the session, routing "
+                 "the read to the master.", bref->bref_backend->backend_server->unique_name);
+        return master;
+    }
 
-    if (tblname && strlen(tblname) > 0)
+    return bref;
+}
+
+/**
+ * Start reading the GTID of the last write of the session from the master,
+ * after the master has replied to the write. The GTID is only read if the
+ * reply was a single OK or error packet, so that no part of the reply to
+ * the write can be taken for the reply to the GTID query. The router session
+ * must be locked.
+ *
+ * @param rses  Router client session
+ * @param reply The reply of the master
+ */
+static void causal_fetch_gtid(ROUTER_CLIENT_SES *rses, GWBUF *reply)
+{
+    backend_ref_t *master = rses->rses_master_ref;
+    uint8_t *data = GWBUF_DATA(reply);
+
+    if (rses->rses_causal_failed || !causal_bref_is_idle(master) ||
+        GWBUF_LENGTH(reply) != gwbuf_length(reply) ||
+        GWBUF_LENGTH(reply) < MYSQL_HEADER_LEN + 1 ||
+        GWBUF_LENGTH(reply) != MYSQL_GET_PACKET_LEN(data) + MYSQL_HEADER_LEN ||
+        (data[MYSQL_HEADER_LEN] != 0x00 && data[MYSQL_HEADER_LEN] != 0xff))
     {
-        klen = strlen(dbname) + strlen(tblname) + 2;
-        hkey = calloc(klen, sizeof(char));
-        strcpy(hkey, dbname);
-        strcat(hkey, ".");
-        strcat(hkey, tblname);
+        return;
     }
-    else
+
+    if (!causal_bref_is_supported(rses, master))
     {
-        hkey = NULL;
+        /** The reads that follow writes are routed to the master */
+        rses->rses_causal_failed = true;
+        return;
     }
 
-    if (rses_prop_tmp == NULL)
+    if (causal_send(master, "SELECT @@last_gtid", CAUSAL_OP_FETCH))
     {
-        if ((rses_prop_tmp = (rses_property_t *)calloc(1, sizeof(rses_property_t))))
-        {
-#if defined(SS_DEBUG)
-            rses_prop_tmp->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-            rses_prop_tmp->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
-#endif
-            rses_prop_tmp->rses_prop_rsession = router_cli_ses;
-            rses_prop_tmp->rses_prop_refcount = 1;
-            rses_prop_tmp->rses_prop_next = NULL;
-            rses_prop_tmp->rses_prop_type = RSES_PROP_TYPE_TMPTABLES;
-            router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES] = rses_prop_tmp;
-        }
-        else
-        {
-            MXS_ERROR("Call to malloc() failed.");
-        }
+        rses->rses_causal_state = CAUSAL_FETCHING;
     }
-    if (rses_prop_tmp)
+}
+
+/**
+ * Take the first reply out of a buffer and read the value of the only column
+ * of its first row.
+ *
+ * @param reply         The replies, the first one is consumed
+ * @param deprecate_eof The result set has no EOF after the column definitions
+ * @param value         Buffer where the value is stored
+ * @param size          Size of the buffer
+ * @return True if the reply was a result set with a value that fit the buffer
+ */
+static bool causal_take_reply(GWBUF **reply, bool deprecate_eof, char *value, size_t size)
+{
+    GWBUF *buf = *reply;
+    size_t len = 0;
+    bool last = false;
+    bool rval = false;
+
+    while (buf && !last)
     {
-        if (rses_prop_tmp->rses_prop_data.temp_tables == NULL)
-        {
-            h = hashtable_alloc(7, hashkeyfun, hashcmpfun);
-            hashtable_memory_fns(h, hstrdup, NULL, hfree, NULL);
-            if (h != NULL)
-            {
-                rses_prop_tmp->rses_prop_data.temp_tables = h;
-            }
-            else
-            {
-                MXS_ERROR("Failed to allocate a new hashtable.");
-            }
-        }
+        last = GWBUF_IS_TYPE_RESPONSE_END(buf);
+        len += GWBUF_LENGTH(buf);
+        buf = buf->next;
+    }
 
-        if (hkey && rses_prop_tmp->rses_prop_data.temp_tables &&
-            hashtable_add(rses_prop_tmp->rses_prop_data.temp_tables, (void *)hkey,
-                          (void *)is_temp) == 0) /*< Conflict in hash table */
+    uint8_t *data = (uint8_t *)malloc(len);
+
+    if (data && gwbuf_copy_data(*reply, 0, len, data) == len)
+    {
+        uint8_t *ptr = data;
+        uint8_t *end = data + len;
+        int n = 0;
+        int skip = deprecate_eof ? 2 : 3;
+
+        /** The column count, the column definition and the EOF precede the row */
+        while (n < skip && ptr + MYSQL_HEADER_LEN < end &&
+               (n > 0 || (ptr[MYSQL_HEADER_LEN] != 0x00 && ptr[MYSQL_HEADER_LEN] != 0xff)))
         {
-            MXS_INFO("Temporary table conflict in hashtable: %s", hkey);
+            ptr += MYSQL_GET_PACKET_LEN(ptr) + MYSQL_HEADER_LEN;
+            n++;
         }
-#if defined(SS_DEBUG)
+
+        if (n == skip && ptr + MYSQL_HEADER_LEN < end)
         {
-            bool retkey = hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey);
-            if (retkey)
+            uint8_t *val = ptr + MYSQL_HEADER_LEN;
+            size_t vlen = *val;
+
+            /** A value shorter than 251 bytes has a one byte length, 0xfb is NULL */
+            if (vlen < 0xfb && vlen < size && val + 1 + vlen <= end &&
+                vlen + 1 <= MYSQL_GET_PACKET_LEN(ptr))
             {
-                MXS_INFO("Temporary table added: %s", hkey);
+                memcpy(value, val + 1, vlen);
+                value[vlen] = '\0';
+                rval = true;
             }
         }
-#endif
     }
 
-    free(hkey);
-    free(tblname);
+    free(data);
+    *reply = gwbuf_consume(*reply, len);
+    return rval;
 }
 
 /**
- * Get client DCB pointer of the router client session.
- * This routine must be protected by Router client session lock.
- *
- * @param rses  Router client session pointer
+ * Check that a GTID position read from the master can be put in a query
  *
- * @return Pointer to client DCB
+ * @param gtid  The position
+ * @return True if it only has digits, dashes and commas
  */
-static DCB *rses_get_client_dcb(ROUTER_CLIENT_SES *rses)
+static bool causal_gtid_is_valid(const char *gtid)
 {
-    DCB *dcb = NULL;
-    int i;
-
-    for (i = 0; i < rses->rses_nbackends; i++)
+    for (const char *p = gtid; *p; p++)
     {
-        if ((dcb = rses->rses_backend_ref[i].bref_dcb) != NULL &&
-            BREF_IS_IN_USE(&rses->rses_backend_ref[i]) && dcb->session != NULL &&
-            dcb->session->client_dcb != NULL)
+        if (!isdigit((unsigned char)*p) && *p != '-' && *p != ',')
         {
-            return dcb->session->client_dcb;
+            return false;
         }
     }
-    return NULL;
+    return true;
 }
 
 /**
- * @brief The main routing entry point
+ * Process the reply to an internal query of the causal reads. The router
+ * session must be locked.
  *
- * The routeQuery will make the routing decision based on the contents
- * of the instance, session and the query itself. The query always represents
- * a complete MariaDB/MySQL packet because we define the RCAP_TYPE_STMT_INPUT in
- * getCapabilities().
+ * When the GTID of the last write has been read from the master, the read
+ * that was delayed for it is routed. When a slave has replied to a wait, the
+ * read pending in it is left to be routed by clientReply, unless the slave
+ * did not catch up in time, in which case the read is routed to the master.
  *
- * @param instance       Router instance
- * @param router_session Router session associated with the client
- * @param querybuf       Buffer containing the query
- * @return 1 on success, 0 on error
+ * @param inst  Router instance
+ * @param rses  Router client session
+ * @param bref  The backend that replied
+ * @param reply The replies of the backend
+ * @return The rest of the replies, NULL if there were no others
  */
-static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
+GWBUF *causal_process_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                            backend_ref_t *bref, GWBUF *reply)
 {
-    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
-    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *) router_session;
-    int rval = 0;
+    char value[CAUSAL_GTID_MAXLEN];
+    bool ok = causal_take_reply(&reply, modutil_deprecate_eof(rses->client_dcb->session),
+                                value, sizeof(value));
+    causal_op_t op = bref->bref_causal_op;
+    backend_ref_t *master = rses->rses_master_ref;
 
-    CHK_CLIENT_RSES(rses);
+    bref->bref_causal_op = CAUSAL_OP_NONE;
 
-    if (rses->rses_closed)
+    if (op == CAUSAL_OP_FETCH)
     {
-        uint8_t* data = GWBUF_DATA(querybuf);
-
-        if (GWBUF_LENGTH(querybuf) >= 5 && !MYSQL_IS_COM_QUIT(data))
+        if (rses->rses_causal_state != CAUSAL_FETCHING)
         {
-            char *query_str = modutil_get_query(querybuf);
-            MXS_ERROR("Can't route %s:\"%s\" to backend server. Router is closed.",
-                      STRPACKETTYPE(data[4]), query_str ? query_str : "(empty)");
-            free(query_str);
+            /** The session wrote again, the GTID is read after that write */
         }
-    }
-    else
-    {
-        if (GWBUF_IS_TYPE_UNDEFINED(querybuf))
+        else if (ok && causal_gtid_is_valid(value))
         {
-            GWBUF *tmpbuf = querybuf;
-
-            querybuf = modutil_get_complete_packets(&tmpbuf);
-            if (tmpbuf)
+            if (*value == '\0')
             {
-                rses->client_dcb->dcb_readqueue = gwbuf_append(rses->client_dcb->dcb_readqueue, tmpbuf);
+                /** The session has not written anything to the binary log */
+                rses->rses_causal_state = CAUSAL_SYNCED;
+            }
+            else
+            {
+                strcpy(rses->rses_causal_gtid, value);
+                rses->rses_causal_gen++;
+                rses->rses_causal_state = CAUSAL_KNOWN;
             }
-            querybuf = gwbuf_make_contiguous(querybuf);
-
-            /** Mark buffer to as MySQL type */
-            gwbuf_set_type(querybuf, GWBUF_TYPE_MYSQL);
-            gwbuf_set_type(querybuf, GWBUF_TYPE_SINGLE_STMT);
+        }
+        else
+        {
+            MXS_ERROR("Could not read the GTID of the last write from '%s', reads "
+                      "that follow writes are routed to the master. The causal "
+                      "reads require MariaDB 10.0.9 or later.",
+                      bref->bref_backend->backend_server->unique_name);
+            rses->rses_causal_failed = true;
+            rses->rses_causal_state = CAUSAL_STALE;
         }
 
-        if (route_single_stmt(inst, rses, querybuf))
+        if (rses->rses_causal_query)
         {
-            rval = 1;
+            GWBUF *query = rses->rses_causal_query;
+            backend_ref_t *target = rses->rses_causal_target;
+
+            rses->rses_causal_query = NULL;
+            rses->rses_causal_target = NULL;
+
+            if (rses->rses_causal_state == CAUSAL_KNOWN && causal_wait(rses, target, query))
+            {
+                gwbuf_free(query);
+            }
+            else if (rses->rses_causal_state == CAUSAL_SYNCED &&
+                     BREF_IS_IN_USE(target) && !BREF_IS_CLOSED(target))
+            {
+                causal_route(inst, target, query);
+            }
+            else
+            {
+                causal_route(inst, master && BREF_IS_IN_USE(master) ? master : target, query);
+            }
         }
     }
-
-    if (querybuf != NULL)
+    else if (op == CAUSAL_OP_WAIT)
     {
-        gwbuf_free(querybuf);
+        if (ok && strcmp(value, "0") == 0)
+        {
+            bref->bref_causal_gen = rses->rses_causal_gen;
+        }
+        else if (bref->bref_pending_cmd && master && BREF_IS_IN_USE(master) &&
+                 !BREF_IS_CLOSED(master))
+        {
+            MXS_WARNING("Slave '%s' did not replicate GTID %s within %d seconds, "
+                        "routing the read to the master.",
+                        bref->bref_backend->backend_server->unique_name,
+                        rses->rses_causal_gtid, rses->rses_config.rw_causal_reads_timeout);
+            GWBUF *query = bref->bref_pending_cmd;
+            bref->bref_pending_cmd = NULL;
+            causal_route(inst, master, query);
+        }
     }
 
-    return rval;
+    return reply;
 }
 
 /**
- * Routing function. Find out query type, backend type, and target DCB(s).
- * Then route query to found target(s).
- * @param inst      router instance
- * @param rses      router session
- * @param querybuf  GWBUF including the query
+ * Get the status of the server of a backend reference from the snapshot that
+ * the monitor published last. All statuses that one routing decision reads
+ * then come from complete monitoring cycles.
  *
- * @return true if routing succeed or if it failed due to unsupported query.
- * false if backend failure was encountered.
+ * @param bref Backend reference
+ * @return Status flag bitmap of the server
  */
-static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
-                              GWBUF *querybuf)
+static unsigned int bref_server_status(backend_ref_t *bref)
 {
-    qc_query_type_t qtype = QUERY_TYPE_UNKNOWN;
-    mysql_server_cmd_t packet_type = MYSQL_COM_UNDEFINED;
-    uint8_t *packet;
-    size_t packet_len;
-    int ret = 0;
-    DCB *target_dcb = NULL;
-    route_target_t route_target;
-    bool succp = false;
-    int rlag_max = MAX_RLAG_UNDEFINED;
-    backend_type_t btype; /*< target backend type */
-
-    ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
-    ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
+    SERVER *server = bref->bref_backend->backend_server;
+    const SERVER_STATE *state = server_state_acquire(server);
+    unsigned int status = state ? state->status : server->status;
 
-    packet = GWBUF_DATA(querybuf);
-    packet_len = gw_mysql_get_byte3(packet);
-
-    if (packet_len == 0)
-    {
-        /** Empty packet signals end of LOAD DATA LOCAL INFILE, send it to master*/
-        route_target = TARGET_MASTER;
-        packet_type = MYSQL_COM_UNDEFINED;
-        rses->rses_load_active = false;
-        route_target = TARGET_MASTER;
-        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
-                 rses->rses_load_data_sent + gwbuf_length(querybuf));
-    }
-    else
-    {
-        packet_type = packet[4];
+    server_state_release(state);
+    return status;
+}
 
-        switch (packet_type)
-        {
-            case MYSQL_COM_QUIT:        /*< 1 QUIT will close all sessions */
-            case MYSQL_COM_INIT_DB:     /*< 2 DDL must go to the master */
-            case MYSQL_COM_REFRESH:     /*< 7 - I guess this is session but not sure */
-            case MYSQL_COM_DEBUG:       /*< 0d all servers dump debug info to stdout */
-            case MYSQL_COM_PING:        /*< 0e all servers are pinged */
-            case MYSQL_COM_CHANGE_USER: /*< 11 all servers change it accordingly */
-                qtype = QUERY_TYPE_SESSION_WRITE;
-                break;
+/**
+ * Read the load score of a backend from the latest state the monitor
+ * has published.
+ *
+ * @param bref  Backend reference
+ * @return The load score of the server, 0 if not measured
+ */
+static int bref_server_load(backend_ref_t *bref)
+{
+    SERVER *server = bref->bref_backend->backend_server;
+    const SERVER_STATE *state = server_state_acquire(server);
+    int load = state ? state->load : server->load;
 
-            case MYSQL_COM_CREATE_DB:           /**< 5 DDL must go to the master */
-            case MYSQL_COM_DROP_DB:             /**< 6 DDL must go to the master */
-            case MYSQL_COM_STMT_CLOSE:          /*< free prepared statement */
-            case MYSQL_COM_STMT_SEND_LONG_DATA: /*< send data to column */
-            case MYSQL_COM_STMT_RESET: /*< resets the data of a prepared statement */
-                qtype = QUERY_TYPE_WRITE;
-                break;
+    server_state_release(state);
+    return load;
+}
 
-            case MYSQL_COM_QUERY:
-                qtype = qc_get_type(querybuf);
-                break;
+/**
+ * Provide the router with a pointer to a suitable backend dcb.
+ *
+ * Detect failures in server statuses and reselect backends if necessary.
+ * If a named server hint is given, the server becomes primary selection
+ * criteria. The server of the hint was resolved when the hint was created,
+ * so the backends are compared by pointer and the name is only compared if
+ * the server was not known then. Similarly, if max replication lag is
+ * specified, skip backends which lag too much.
+ *
+ * @param p_dcb Address of the pointer to the resulting DCB
+ * @param rses  Pointer to router client session
+ * @param btype Backend type
+ * @param named Hint naming the backend which is primarily searched. May be NULL.
+ *
+ * @return True if proper DCB was found, false otherwise.
+ */
+static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
+                    HINT *named, int max_rlag)
+{
+    backend_ref_t *backend_ref;
+    backend_ref_t *master_bref;
+    int i;
+    bool succp = false;
 
-            case MYSQL_COM_STMT_PREPARE:
-                qtype = qc_get_type(querybuf);
-                qtype |= QUERY_TYPE_PREPARE_STMT;
-                break;
+    CHK_CLIENT_RSES(rses);
+    ss_dassert(p_dcb != NULL && *(p_dcb) == NULL);
 
-            case MYSQL_COM_STMT_EXECUTE:
-                /** Parsing is not needed for this type of packet */
-                qtype = QUERY_TYPE_EXEC_STMT;
-                break;
+    if (p_dcb == NULL)
+    {
+        goto return_succp;
+    }
+    backend_ref = rses->rses_backend_ref;
 
-            case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
-            case MYSQL_COM_STATISTICS:     /**< 9 ? */
-            case MYSQL_COM_PROCESS_INFO:   /**< 0a ? */
-            case MYSQL_COM_CONNECT:        /**< 0b ? */
-            case MYSQL_COM_PROCESS_KILL:   /**< 0c ? */
-            case MYSQL_COM_TIME:           /**< 0f should this be run in gateway ? */
-            case MYSQL_COM_DELAYED_INSERT: /**< 10 ? */
-            case MYSQL_COM_DAEMON:         /**< 1d ? */
-            default:
-                break;
-        } /**< switch by packet type */
+    /** get root master from available servers */
+    master_bref = get_root_master_bref(rses);
 
-        /** This might not be absolutely necessary as some parts of the code
-         * can only be executed by one thread at a time. */
-        if (!rses_begin_locked_router_action(rses))
-        {
-            succp = false;
-            goto retblock;
-        }
+    if (named != NULL) /*< Choose backend by name from a hint */
+    {
+        char *name = named->data;
 
-        /** Check for multi-statement queries. If no master server is available
-         * and a multi-statement is issued, an error is returned to the client
-         * when the query is routed.
-         *
-         * If we do not have a master node, assigning the forced node is not
-         * effective since we don't have a node to force queries to. In this
-         * situation, assigning QUERY_TYPE_WRITE for the query will trigger
-         * the error processing. */
-        if (check_for_multi_stmt(rses, querybuf, packet_type) &&
-            rses->rses_master_ref == NULL)
-        {
-            qtype |= QUERY_TYPE_WRITE;
-        }
+        ss_dassert(btype != BE_MASTER); /*< Master dominates and no name should be passed with it */
 
-        /**
-         * Check if the query has anything to do with temporary tables.
-         */
-        if (rses->have_tmp_tables &&
-            (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
+        for (i = 0; i < rses->rses_nbackends; i++)
         {
-            check_drop_tmp_table(rses, querybuf, qtype);
-            if (packet_type == MYSQL_COM_QUERY)
+            BACKEND *b = backend_ref[i].bref_backend;
+            SERVER server;
+            server.status = bref_server_status(&backend_ref[i]);
+            /**
+             * To become chosen:
+             * backend must be in use, name must match,
+             * backend's role must be either slave, relay
+             * server, or master.
+             */
+            if (BREF_IS_IN_USE((&backend_ref[i])) &&
+                (named->server ? named->server == b->backend_server :
+                 strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
+                (SERVER_IS_SLAVE(&server) || SERVER_IS_RELAY_SERVER(&server) ||
+                 SERVER_IS_MASTER(&server)))
             {
-                qtype = is_read_tmp_table(rses, querybuf, qtype);
+                *p_dcb = backend_ref[i].bref_dcb;
+                succp = true;
+                ss_dassert(backend_ref[i].bref_dcb->state != DCB_STATE_ZOMBIE);
+                break;
             }
         }
-        check_create_tmp_table(rses, querybuf, qtype);
-
-        /**
-         * Check if this is a LOAD DATA LOCAL INFILE query. If so, send all queries
-         * to the master until the last, empty packet arrives.
-         */
-        if (rses->rses_load_active)
+        if (succp)
         {
-            rses->rses_load_data_sent += gwbuf_length(querybuf);
+            goto return_succp;
         }
-        else if (packet_type == MYSQL_COM_QUERY)
+        else
         {
-            qc_query_op_t queryop = qc_get_operation(querybuf);
-            if (queryop == QUERY_OP_LOAD)
-            {
-                rses->rses_load_active = true;
-                rses->rses_load_data_sent = 0;
-            }
+            btype = BE_SLAVE;
         }
+    }
 
-        rses_end_locked_router_action(rses);
-        /**
-         * If autocommit is disabled or transaction is explicitly started
-         * transaction becomes active and master gets all statements until
-         * transaction is committed and autocommit is enabled again.
-         */
-        if (rses->rses_autocommit_enabled &&
-            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
-        {
-            rses->rses_autocommit_enabled = false;
+    if (btype == BE_SLAVE)
+    {
+        backend_ref_t *candidate_bref = NULL;
 
-            if (!rses->rses_transaction_active)
-            {
-                rses->rses_transaction_active = true;
-            }
-        }
-        else if (!rses->rses_transaction_active &&
-                 QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
-        {
-            rses->rses_transaction_active = true;
-        }
-        /**
-         * Explicit COMMIT and ROLLBACK, implicit COMMIT.
-         */
-        if (rses->rses_autocommit_enabled && rses->rses_transaction_active &&
-            (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
-             QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
-        {
-            rses->rses_transaction_active = false;
-        }
-        else if (!rses->rses_autocommit_enabled &&
-                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        rebalance_slaves(rses, max_rlag);
+
+        if (rses->rses_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME &&
+            !rses->rses_config.rw_master_reads &&
+            (candidate_bref = get_slave_by_response_time(rses, max_rlag)) != NULL)
         {
-            rses->rses_autocommit_enabled = true;
-            rses->rses_transaction_active = false;
+            *p_dcb = candidate_bref->bref_dcb;
+            succp = true;
+            goto return_succp;
         }
 
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        for (i = 0; i < rses->rses_nbackends; i++)
         {
-            if (!rses->rses_load_active)
+            BACKEND *b = (&backend_ref[i])->bref_backend;
+            SERVER server;
+            SERVER candidate;
+            server.status = bref_server_status(&backend_ref[i]);
+            /**
+             * Unused backend or backend which is not master nor
+             * slave can't be used
+             */
+            if (!BREF_IS_IN_USE(&backend_ref[i]) ||
+                (!SERVER_IS_MASTER(&server) && !SERVER_IS_SLAVE(&server)))
             {
-                uint8_t *packet = GWBUF_DATA(querybuf);
-                unsigned char ptype = packet[4];
-                size_t len = MIN(GWBUF_LENGTH(querybuf),
-                                 MYSQL_GET_PACKET_LEN((unsigned char *)querybuf->start) - 1);
-                char *data = (char *)&packet[5];
-                char *contentstr = strndup(data, MIN(len, RWSPLIT_TRACE_MSG_LEN));
-                char *qtypestr = qc_get_qtype_str(qtype);
-                MXS_INFO("> Autocommit: %s, trx is %s, cmd: %s, type: %s, stmt: %s%s %s",
-                         (rses->rses_autocommit_enabled ? "[enabled]" : "[disabled]"),
-                         (rses->rses_transaction_active ? "[open]" : "[not open]"),
-                         STRPACKETTYPE(ptype), (qtypestr == NULL ? "N/A" : qtypestr),
-                         contentstr, (querybuf->hint == NULL ? "" : ", Hint:"),
-                         (querybuf->hint == NULL ? "" : STRHINTTYPE(querybuf->hint->type)));
-                free(contentstr);
-                free(qtypestr);
-            }
-            else
-            {
-                MXS_INFO("> Processing LOAD DATA LOCAL INFILE: %lu bytes sent.",
-                         rses->rses_load_data_sent);
+                continue;
             }
-        }
-        /**
-         * Find out where to route the query. Result may not be clear; it is
-         * possible to have a hint for routing to a named server which can
-         * be either slave or master.
-         * If query would otherwise be routed to slave then the hint determines
-         * actual target server if it exists.
-         *
-         * route_target is a bitfield and may include :
-         * TARGET_ALL
-         * - route to all connected backend servers
-         * TARGET_SLAVE[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
-         * - route primarily according to hints, then to slave and if those
-         *   failed, eventually to master
-         * TARGET_MASTER[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
-         * - route primarily according to the hints and if they failed,
-         *   eventually to master
-         */
-        route_target = get_route_target(rses, qtype, querybuf->hint);
-
-        if (TARGET_IS_ALL(route_target))
-        {
-            /** Multiple, conflicting routing target. Return error */
-            if (TARGET_IS_MASTER(route_target) || TARGET_IS_SLAVE(route_target))
+            /**
+             * If there are no candidates yet accept both master or
+             * slave.
+             */
+            else if (candidate_bref == NULL)
             {
-                backend_ref_t *bref = rses->rses_backend_ref;
-
-                char *query_str = modutil_get_query(querybuf);
-                char *qtype_str = qc_get_qtype_str(qtype);
-
-                MXS_ERROR("Can't route %s:%s:\"%s\". SELECT with session data "
-                          "modification is not supported if configuration parameter "
-                          "use_sql_variables_in=all .", STRPACKETTYPE(packet_type),
-                          qtype_str, (query_str == NULL ? "(empty)" : query_str));
-
-                MXS_INFO("Unable to route the query without losing session data "
-                         "modification from other servers. <");
-
-                while (bref != NULL && !BREF_IS_IN_USE(bref))
-                {
-                    bref++;
-                }
-
-                if (bref != NULL && BREF_IS_IN_USE(bref))
+                /**
+                 * Ensure that master has not changed dunring
+                 * session and abort if it has.
+                 */
+                if (SERVER_IS_MASTER(&server) && &backend_ref[i] == master_bref)
                 {
-                    /** Create and add MySQL error to eventqueue */
-                    modutil_reply_parse_error(bref->bref_dcb,
-                                              strdup("Routing query to backend failed. "
-                                                     "See the error log for further "
-                                                     "details."), 0);
+                    /** found master */
+                    candidate_bref = &backend_ref[i];
+                    candidate.status = bref_server_status(candidate_bref);
                     succp = true;
                 }
-                else
+                /**
+                 * Ensure that max replication lag is not set
+                 * or that candidate's lag doesn't exceed the
+                 * maximum allowed replication lag.
+                 */
+                else if (rlag_is_acceptable(rses_get_root_server(rses), b->backend_server,
+                                            max_rlag))
                 {
-                    /**
-                     * If there were no available backend references
-                     * available return false - session will be closed
-                     */
-                    MXS_ERROR("Sending error message to client "
-                              "failed. Router doesn't have any "
-                              "available backends. Session will be "
-                              "closed.");
-                    succp = false;
+                    /** found slave */
+                    candidate_bref = &backend_ref[i];
+                    candidate.status = bref_server_status(candidate_bref);
+                    succp = true;
                 }
-                if (query_str)
+            }
+            /**
+             * If candidate is master, any slave which doesn't break
+             * replication lag limits replaces it.
+             */
+            else if (SERVER_IS_MASTER(&candidate) && SERVER_IS_SLAVE(&server) &&
+                     rlag_is_acceptable(rses_get_root_server(rses), b->backend_server, max_rlag) &&
+                     !rses->rses_config.rw_master_reads)
+            {
+                /** found slave */
+                candidate_bref = &backend_ref[i];
+                candidate.status = bref_server_status(candidate_bref);
+                succp = true;
+            }
+            /**
+             * When candidate exists, compare it against the current
+             * backend and update assign it to new candidate if
+             * necessary.
+             */
+            else if (SERVER_IS_SLAVE(&server))
+            {
+                if (rlag_is_acceptable(rses_get_root_server(rses), b->backend_server, max_rlag))
                 {
-                    free(query_str);
+                    candidate_bref =
+                        check_candidate_bref(candidate_bref, &backend_ref[i],
+                                             rses->rses_config.rw_slave_select_criteria);
+                    candidate.status = bref_server_status(candidate_bref);
                 }
-                if (qtype_str)
+                else
                 {
-                    free(qtype_str);
+                    MXS_INFO("Server %s:%d is too much behind the "
+                             "master, %d s. and can't be chosen.",
+                             b->backend_server->name, b->backend_server->port,
+                             b->backend_server->rlag);
                 }
-                goto retblock;
             }
-            /**
-             * It is not sure if the session command in question requires
-             * response. Statement is examined in route_session_write.
-             * Router locking is done inside the function.
-             */
-            succp = route_session_write(rses, gwbuf_clone(querybuf), inst,
-                                        packet_type, qtype);
+        } /*<  for */
+        /** Assign selected DCB's pointer value */
+        if (candidate_bref != NULL)
+        {
+            *p_dcb = candidate_bref->bref_dcb;
+        }
 
-            if (succp)
+        goto return_succp;
+    } /*< if (btype == BE_SLAVE) */
+    /**
+     * If target was originally master only then the execution jumps
+     * directly here.
+     */
+    if (btype == BE_MASTER)
+    {
+        if (master_bref)
+        {
+            /** It is possible for the server status to change at any point in time
+             * so copying it locally will make possible error messages
+             * easier to understand */
+            SERVER server;
+            server.status = bref_server_status(master_bref);
+            if (BREF_IS_IN_USE(master_bref) && SERVER_IS_MASTER(&server))
+            {
+                *p_dcb = master_bref->bref_dcb;
+                succp = true;
+                /** if bref is in use DCB should not be closed */
+                ss_dassert(master_bref->bref_dcb->state != DCB_STATE_ZOMBIE);
+            }
+            else
+            {
+                MXS_ERROR("Server at %s:%d should be master but "
+                          "is %s instead and can't be chosen to master.",
+                          master_bref->bref_backend->backend_server->name,
+                          master_bref->bref_backend->backend_server->port,
+                          STRSRVSTATUS(&server));
+                succp = false;
+            }
+        }
+    }
+
+return_succp:
+    return succp;
+}
+
+/**
+ * Find out which of the two backend servers has smaller value for select
+ * criteria property.
+ *
+ * @param cand  previously selected candidate
+ * @param new   challenger
+ * @param sc    select criteria
+ *
+ * @return pointer to backend reference of that backend server which has smaller
+ * value in selection criteria. If either reference pointer is NULL then the
+ * other reference pointer value is returned.
+ */
+static backend_ref_t *check_candidate_bref(backend_ref_t *cand,
+                                           backend_ref_t *new,
+                                           select_criteria_t sc)
+{
+    int (*p)(const void *, const void *);
+    /** get compare function */
+    p = criteria_cmpfun[sc];
+
+    if (new == NULL)
+    {
+        return cand;
+    }
+    else if (cand == NULL || (p((void *)cand, (void *)new) > 0))
+    {
+        return new;
+    }
+    else
+    {
+        return cand;
+    }
+}
+
+/**
+ * Examine the query type, transaction state and routing hints. Find out the
+ * target for query routing.
+ *
+ *  @param qtype      Type of query
+ *  @param trx_active Is transacation active or not
+ *  @param hint       Pointer to list of hints attached to the query buffer
+ *
+ *  @return bitfield including the routing target, or the target server name
+ *          if the query would otherwise be routed to slave.
+ */
+static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
+                                       qc_query_type_t qtype, HINT *hint)
+{
+    bool trx_active = rses->rses_transaction_active;
+    bool load_active = rses->rses_load_active;
+    target_t use_sql_variables_in = rses->rses_config.rw_use_sql_variables_in;
+    route_target_t target = TARGET_UNDEFINED;
+
+    if (rses->rses_config.rw_strict_multi_stmt && rses->forced_node &&
+        rses->forced_node == rses->rses_master_ref)
+    {
+        target = TARGET_MASTER;
+    }
+    /**
+     * These queries are not affected by hints
+     */
+    else if (!load_active &&
+             (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
+              /** Configured to allow writing variables to all nodes */
+              (use_sql_variables_in == TYPE_ALL &&
+               QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE)) ||
+              /** enable or disable autocommit are always routed to all */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT)))
+    {
+        /**
+         * This is problematic query because it would be routed to all
+         * backends but since this is SELECT that is not possible:
+         * 1. response set is not handled correctly in clientReply and
+         * 2. multiple results can degrade performance.
+         *
+         * Prepared statements are an exception to this since they do not
+         * actually do anything but only prepare the statement to be used.
+         * They can be safely routed to all backends since the execution
+         * is done later.
+         *
+         * Read-only statements prepared with COM_STMT_PREPARE are routed to
+         * all backends so that their executions can be routed to slaves.
+         */
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+            !(QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT)))
+        {
+            MXS_WARNING("The query can't be routed to all "
+                        "backend servers because it includes SELECT and "
+                        "SQL variable modifications which is not supported. "
+                        "Set use_sql_variables_in=master or split the "
+                        "query to two, where SQL variable modifications "
+                        "are done in the first and the SELECT in the "
+                        "second one.");
+
+            target = TARGET_MASTER;
+        }
+        target |= TARGET_ALL;
+    }
+    /**
+     * Hints may affect on routing of the following queries
+     */
+    else if (!trx_active && !load_active &&
+             !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
+             (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||        /*< any SELECT */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) || /*< 'SHOW TABLES' */
+              QUERY_IS_TYPE(qtype,
+                            QUERY_TYPE_USERVAR_READ) ||       /*< read user var */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) || /*< read sys var */
+              QUERY_IS_TYPE(qtype,
+                            QUERY_TYPE_EXEC_STMT) || /*< prepared stmt exec */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+              QUERY_IS_TYPE(qtype,
+                            QUERY_TYPE_GSYSVAR_READ))) /*< read global sys var */
+    {
+        /** First set expected targets before evaluating hints */
+        if (!QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) || /*< 'SHOW TABLES' */
+             /** Configured to allow reading variables from slaves */
+             (use_sql_variables_in == TYPE_ALL &&
+              (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
+               QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
+               QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ)))))
+        {
+            target = TARGET_SLAVE;
+        }
+
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+            /** Configured not to allow reading variables from slaves */
+            (use_sql_variables_in == TYPE_MASTER &&
+             (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ))))
+        {
+            target = TARGET_MASTER;
+        }
+        /** process routing hints */
+        while (hint != NULL)
+        {
+            if (hint->type == HINT_ROUTE_TO_MASTER)
+            {
+                target = TARGET_MASTER; /*< override */
+                MXS_DEBUG("%lu [get_route_target] Hint: route to master.",
+                          pthread_self());
+                break;
+            }
+            else if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
+            {
+                /**
+                 * Searching for a named server. If it can't be
+                 * found, the oroginal target is chosen.
+                 */
+                target |= TARGET_NAMED_SERVER;
+                MXS_DEBUG("%lu [get_route_target] Hint: route to "
+                          "named server : ",
+                          pthread_self());
+            }
+            else if (hint->type == HINT_ROUTE_TO_UPTODATE_SERVER)
+            {
+                /** not implemented */
+            }
+            else if (hint->type == HINT_ROUTE_TO_ALL)
+            {
+                /** not implemented */
+            }
+            else if (hint->type == HINT_PARAMETER)
+            {
+                if (strncasecmp((char *)hint->data, "max_slave_replication_lag",
+                                strlen("max_slave_replication_lag")) == 0)
+                {
+                    target |= TARGET_RLAG_MAX;
+                }
+                else
+                {
+                    MXS_ERROR("Unknown hint parameter "
+                              "'%s' when 'max_slave_replication_lag' "
+                              "was expected.",
+                              (char *)hint->data);
+                }
+            }
+            else if (hint->type == HINT_ROUTE_TO_SLAVE)
+            {
+                target = TARGET_SLAVE;
+                MXS_DEBUG("%lu [get_route_target] Hint: route to "
+                          "slave.",
+                          pthread_self());
+            }
+            hint = hint->next;
+        } /*< while (hint != NULL) */
+        /** If nothing matches then choose the master */
+        if ((target & (TARGET_ALL | TARGET_SLAVE | TARGET_MASTER)) == 0)
+        {
+            target = TARGET_MASTER;
+        }
+    }
+    else
+    {
+        /** hints don't affect on routing */
+        ss_dassert(trx_active ||
+                   (QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
+                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) &&
+                     use_sql_variables_in == TYPE_MASTER) ||
+                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) &&
+                     use_sql_variables_in == TYPE_MASTER) ||
+                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ) &&
+                     use_sql_variables_in == TYPE_MASTER) ||
+                    (QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE) &&
+                     use_sql_variables_in == TYPE_MASTER) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_CREATE_TMP_TABLE) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_TMP_TABLE) ||
+                    QUERY_IS_TYPE(qtype, QUERY_TYPE_UNKNOWN)));
+        target = TARGET_MASTER;
+    }
+#if defined(SS_EXTRA_DEBUG)
+    MXS_INFO("Selected target \"%s\"", STRTARGET(target));
+#endif
+    return target;
+}
+
+/**
+ * Get the number of temporary tables a session has created and not dropped
+ *
+ * @param router_cli_ses Router client session
+ * @return The number of tables in the registry of the session
+ */
+static int tmp_table_count(ROUTER_CLIENT_SES *router_cli_ses)
+{
+    rses_property_t *rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
+
+    if (rses_prop_tmp == NULL || rses_prop_tmp->rses_prop_data.temp_tables == NULL)
+    {
+        return 0;
+    }
+
+    return hashtable_size(rses_prop_tmp->rses_prop_data.temp_tables);
+}
+
+/**
+ * Get the table names of a query for the temporary table checks. The names
+ * are not copied if the query classifier lets them be read in place.
+ *
+ * @param querybuf GWBUF containing the query
+ * @param names    The array of the table names is stored here
+ * @param tsize    The number of the table names is stored here
+ * @return The copy of the names that must be given to free_tmp_table_names()
+ *         or NULL if the names were not copied
+ */
+static char **get_tmp_table_names(GWBUF *querybuf, const char *const **names, int *tsize)
+{
+    char **tbl = NULL;
+
+    if (!qc_peek_table_names(querybuf, false, names, tsize))
+    {
+        tbl = qc_get_table_names(querybuf, tsize, false);
+        *names = (const char *const *)tbl;
+        if (tbl == NULL)
+        {
+            *tsize = 0;
+        }
+    }
+
+    return tbl;
+}
+
+/**
+ * Free the table names returned by get_tmp_table_names()
+ *
+ * @param tbl   The copied names or NULL
+ * @param tsize The number of names
+ */
+static void free_tmp_table_names(char **tbl, int tsize)
+{
+    if (tbl)
+    {
+        for (int i = 0; i < tsize; i++)
+        {
+            free(tbl[i]);
+        }
+        free(tbl);
+    }
+}
+
+/**
+ * Check if the query is a DROP TABLE... query and
+ * if it targets a temporary table, remove it from the hashtable.
+ * @param router_cli_ses Router client session
+ * @param querybuf GWBUF containing the query
+ * @param type The type of the query resolved so far
+ */
+void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
+                          qc_query_type_t type)
+{
+
+    int tsize = 0, i;
+    const char *const *names;
+    char **tbl;
+    char *dbname;
+    char hkey[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
+    MYSQL_session *data;
+    rses_property_t *rses_prop_tmp;
+
+    if (router_cli_ses == NULL || querybuf == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
+                  router_cli_ses, querybuf);
+        return;
+    }
+
+    if (router_cli_ses->client_dcb == NULL)
+    {
+        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
+        return;
+    }
+
+    /** Nothing can be dropped from an empty registry */
+    if (tmp_table_count(router_cli_ses) == 0)
+    {
+        return;
+    }
+
+    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
+    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+
+    if (data == NULL)
+    {
+        MXS_ERROR("[%s] Error: User data in master server DBC is NULL.",
+                  __FUNCTION__);
+        return;
+    }
+
+    dbname = (char *)data->db;
+
+    if (qc_is_drop_table_query(querybuf))
+    {
+        tbl = get_tmp_table_names(querybuf, &names, &tsize);
+
+        for (i = 0; i < tsize && names[i]; i++)
+        {
+            snprintf(hkey, sizeof(hkey), "%s.%s", dbname, names[i]);
+
+            if (hashtable_delete(rses_prop_tmp->rses_prop_data.temp_tables, (void *)hkey))
+            {
+                MXS_INFO("Temporary table dropped: %s", hkey);
+            }
+        }
+
+        free_tmp_table_names(tbl, tsize);
+    }
+}
+
+/**
+ * Check if the query targets a temporary table.
+ * @param router_cli_ses Router client session
+ * @param querybuf GWBUF containing the query
+ * @param type The type of the query resolved so far
+ * @return The type of the query
+ */
+static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
+                                         GWBUF *querybuf,
+                                         qc_query_type_t type)
+{
+
+    int tsize = 0, i;
+    const char *const *names;
+    char **tbl;
+    char *dbname;
+    char hkey[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
+    MYSQL_session *data;
+    qc_query_type_t qtype = type;
+    rses_property_t *rses_prop_tmp;
+
+    if (router_cli_ses == NULL || querybuf == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
+                  router_cli_ses, querybuf);
+        return type;
+    }
+
+    if (router_cli_ses->client_dcb == NULL)
+    {
+        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
+        return type;
+    }
+
+    /** All temporary tables of the session have been dropped */
+    if (tmp_table_count(router_cli_ses) == 0)
+    {
+        return type;
+    }
+
+    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
+    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+
+    if (data == NULL)
+    {
+        MXS_ERROR("[%s] Error: User data in client DBC is NULL.", __FUNCTION__);
+        return qtype;
+    }
+
+    dbname = (char *)data->db;
+
+    if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_LOCAL_READ) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ))
+    {
+        tbl = get_tmp_table_names(querybuf, &names, &tsize);
+
+        /** Query targets at least one table */
+        for (i = 0; i < tsize && names[i]; i++)
+        {
+            snprintf(hkey, sizeof(hkey), "%s.%s", dbname, names[i]);
+
+            if (hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey))
+            {
+                /**Query target is a temporary table*/
+                qtype = QUERY_TYPE_READ_TMP_TABLE;
+                MXS_INFO("Query targets a temporary table: %s", hkey);
+                break;
+            }
+        }
+
+        free_tmp_table_names(tbl, tsize);
+    }
+
+    return qtype;
+}
+
+/**
+ * If query is of type QUERY_TYPE_CREATE_TMP_TABLE then find out
+ * the database and table name, create a hashvalue and
+ * add it to the router client session's property. If property
+ * doesn't exist then create it first.
+ * @param router_cli_ses Router client session
+ * @param querybuf GWBUF containing the query
+ * @param type The type of the query resolved so far
+ */
+static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
+                                   GWBUF *querybuf, qc_query_type_t type)
+{
+    if (!QUERY_IS_TYPE(type, QUERY_TYPE_CREATE_TMP_TABLE))
+    {
+        return;
+    }
+
+    int klen = 0;
+    char *hkey, *dbname;
+    MYSQL_session *data;
+    rses_property_t *rses_prop_tmp;
+    HASHTABLE *h;
+
+    if (router_cli_ses == NULL || querybuf == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
+                  router_cli_ses, querybuf);
+        return;
+    }
+
+    if (router_cli_ses->client_dcb == NULL)
+    {
+        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
+        return;
+    }
+
+    router_cli_ses->have_tmp_tables = true;
+    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
+    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+
+    if (data == NULL)
+    {
+        MXS_ERROR("[%s] Error: User data in master server DBC is NULL.",
+                  __FUNCTION__);
+        return;
+    }
+
+    dbname = (char *)data->db;
+
+    bool is_temp = true;
+    char *tblname = NULL;
+
+    tblname = qc_get_created_table_name(querybuf);
+
+    if (tblname && strlen(tblname) > 0)
+    {
+        klen = strlen(dbname) + strlen(tblname) + 2;
+        hkey = calloc(klen, sizeof(char));
+        strcpy(hkey, dbname);
+        strcat(hkey, ".");
+        strcat(hkey, tblname);
+    }
+    else
+    {
+        hkey = NULL;
+    }
+
+    if (rses_prop_tmp == NULL)
+    {
+        if ((rses_prop_tmp = (rses_property_t *)calloc(1, sizeof(rses_property_t))))
+        {
+#if defined(SS_DEBUG)
+            rses_prop_tmp->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
+            rses_prop_tmp->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
+#endif
+            rses_prop_tmp->rses_prop_rsession = router_cli_ses;
+            rses_prop_tmp->rses_prop_refcount = 1;
+            rses_prop_tmp->rses_prop_next = NULL;
+            rses_prop_tmp->rses_prop_type = RSES_PROP_TYPE_TMPTABLES;
+            router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES] = rses_prop_tmp;
+        }
+        else
+        {
+            MXS_ERROR("Call to malloc() failed.");
+        }
+    }
+    if (rses_prop_tmp)
+    {
+        if (rses_prop_tmp->rses_prop_data.temp_tables == NULL)
+        {
+            h = hashtable_alloc(7, hashkeyfun, hashcmpfun);
+            hashtable_memory_fns(h, hstrdup, NULL, hfree, NULL);
+            if (h != NULL)
+            {
+                hashtable_enable_resize(h);
+                rses_prop_tmp->rses_prop_data.temp_tables = h;
+            }
+            else
+            {
+                MXS_ERROR("Failed to allocate a new hashtable.");
+            }
+        }
+
+        if (hkey && rses_prop_tmp->rses_prop_data.temp_tables &&
+            hashtable_add(rses_prop_tmp->rses_prop_data.temp_tables, (void *)hkey,
+                          (void *)is_temp) == 0) /*< Conflict in hash table */
+        {
+            MXS_INFO("Temporary table conflict in hashtable: %s", hkey);
+        }
+#if defined(SS_DEBUG)
+        {
+            bool retkey = hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey);
+            if (retkey)
+            {
+                MXS_INFO("Temporary table added: %s", hkey);
+            }
+        }
+#endif
+    }
+
+    free(hkey);
+    free(tblname);
+}
+
+/**
+ * Get client DCB pointer of the router client session.
+ * This routine must be protected by Router client session lock.
+ *
+ * @param rses  Router client session pointer
+ *
+ * @return Pointer to client DCB
+ */
+static DCB *rses_get_client_dcb(ROUTER_CLIENT_SES *rses)
+{
+    DCB *dcb = NULL;
+    int i;
+
+    for (i = 0; i < rses->rses_nbackends; i++)
+    {
+        if ((dcb = rses->rses_backend_ref[i].bref_dcb) != NULL &&
+            BREF_IS_IN_USE(&rses->rses_backend_ref[i]) && dcb->session != NULL &&
+            dcb->session->client_dcb != NULL)
+        {
+            return dcb->session->client_dcb;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief The main routing entry point
+ *
+ * The routeQuery will make the routing decision based on the contents
+ * of the instance, session and the query itself. The query always represents
+ * a complete MariaDB/MySQL packet because we define the RCAP_TYPE_STMT_INPUT in
+ * getCapabilities().
+ *
+ * @param instance       Router instance
+ * @param router_session Router session associated with the client
+ * @param querybuf       Buffer containing the query
+ * @return 1 on success, 0 on error
+ */
+static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
+{
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *) router_session;
+    int rval = 0;
+
+    CHK_CLIENT_RSES(rses);
+    rses->rses_last_activity = hkheartbeat;
+
+    if (rses->rses_closed)
+    {
+        uint8_t* data = GWBUF_DATA(querybuf);
+
+        if (GWBUF_LENGTH(querybuf) >= 5 && !MYSQL_IS_COM_QUIT(data))
+        {
+            char *query_str = modutil_get_query(querybuf);
+            MXS_ERROR("Can't route %s:\"%s\" to backend server. Router is closed.",
+                      STRPACKETTYPE(data[4]), query_str ? query_str : "(empty)");
+            free(query_str);
+        }
+    }
+    else if (GWBUF_IS_TYPE_STREAM(querybuf))
+    {
+        if (route_stream_data(rses, querybuf))
+        {
+            rval = 1;
+        }
+    }
+    else
+    {
+        if (GWBUF_IS_TYPE_UNDEFINED(querybuf))
+        {
+            GWBUF *tmpbuf = querybuf;
+
+            querybuf = modutil_get_complete_packets(&tmpbuf);
+            if (tmpbuf)
+            {
+                rses->client_dcb->dcb_readqueue = gwbuf_append(rses->client_dcb->dcb_readqueue, tmpbuf);
+            }
+            querybuf = gwbuf_make_contiguous(querybuf);
+
+            /** Mark buffer to as MySQL type */
+            gwbuf_set_type(querybuf, GWBUF_TYPE_MYSQL);
+            gwbuf_set_type(querybuf, GWBUF_TYPE_SINGLE_STMT);
+        }
+
+        slowlog_start(&rses->rses_slow_query, inst->service->slow_query_threshold, querybuf);
+
+        if (route_single_stmt(inst, rses, querybuf))
+        {
+            rval = 1;
+        }
+    }
+
+    if (querybuf != NULL)
+    {
+        gwbuf_free(querybuf);
+    }
+
+    return rval;
+}
+
+/**
+ * Route data that continues the last command to the backend that the command
+ * was routed to. The data is routed as it was read from the client and may
+ * end in the middle of a packet. If the command is still waiting for the
+ * backend to execute session commands, the data is appended to it.
+ *
+ * @param rses      Router client session
+ * @param querybuf  Packets or a part of a packet that continue the command
+ * @return True if the data was routed
+ */
+static bool route_stream_data(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    backend_ref_t *bref;
+    bool succp = false;
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return false;
+    }
+
+    bref = rses->rses_stream_target;
+
+    if (rses->rses_load_active)
+    {
+        uint8_t *data = GWBUF_DATA(querybuf);
+        rses->rses_load_data_sent += gwbuf_length(querybuf);
+
+        /** An empty packet, which ends the data, is always routed on its own */
+        if (GWBUF_IS_TYPE_SINGLE_STMT(querybuf) && GWBUF_LENGTH(querybuf) == MYSQL_HEADER_LEN &&
+            MYSQL_GET_PACKET_LEN(data) == 0)
+        {
+            rses->rses_load_active = false;
+            MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
+                     rses->rses_load_data_sent);
+        }
+    }
+
+    if (bref == NULL || !BREF_IS_IN_USE(bref) || BREF_IS_CLOSED(bref))
+    {
+        MXS_ERROR("The server that the command was routed to is not available, "
+                  "the data that continues the command can't be routed.");
+    }
+    else if (bref->bref_pending_cmd)
+    {
+        bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd, gwbuf_clone(querybuf));
+        succp = true;
+    }
+    else if (bref->bref_dcb->func.write(bref->bref_dcb, gwbuf_clone(querybuf)) == 1)
+    {
+        succp = true;
+    }
+    else
+    {
+        MXS_ERROR("Routing the data that continues the command to '%s' failed.",
+                  bref->bref_backend->backend_server->unique_name);
+    }
+
+    rses_end_locked_router_action(rses);
+    return succp;
+}
+
+/**
+ * Routing function. Find out query type, backend type, and target DCB(s).
+ * Then route query to found target(s).
+ * @param inst      router instance
+ * @param rses      router session
+ * @param querybuf  GWBUF including the query
+ *
+ * @return true if routing succeed or if it failed due to unsupported query.
+ * false if backend failure was encountered.
+ */
+static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              GWBUF *querybuf)
+{
+    qc_query_type_t qtype = QUERY_TYPE_UNKNOWN;
+    mysql_server_cmd_t packet_type = MYSQL_COM_UNDEFINED;
+    uint8_t *packet;
+    size_t packet_len;
+    int ret = 0;
+    DCB *target_dcb = NULL;
+    route_target_t route_target;
+    bool succp = false;
+    int rlag_max = MAX_RLAG_UNDEFINED;
+    backend_type_t btype; /*< target backend type */
+    prep_stmt_t *pstmt = NULL;     /*< The prepared statement the packet refers to */
+    prep_stmt_t *new_pstmt = NULL; /*< The statement a COM_STMT_PREPARE prepares */
+    backend_ref_t *ro_trx_slave = NULL; /*< The slave of the read-only transaction */
+    bool ro_trx_begin = false; /*< The statement starts a read-only transaction */
+
+    ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
+    ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
+
+    packet = GWBUF_DATA(querybuf);
+    packet_len = gw_mysql_get_byte3(packet);
+
+    if (packet_len == 0)
+    {
+        /** Empty packet signals end of LOAD DATA LOCAL INFILE, send it to master*/
+        route_target = TARGET_MASTER;
+        packet_type = MYSQL_COM_UNDEFINED;
+        rses->rses_load_active = false;
+        route_target = TARGET_MASTER;
+        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
+                 rses->rses_load_data_sent + gwbuf_length(querybuf));
+    }
+    else
+    {
+        packet_type = packet[4];
+
+        switch (packet_type)
+        {
+            case MYSQL_COM_QUIT:        /*< 1 QUIT will close all sessions */
+            case MYSQL_COM_INIT_DB:     /*< 2 DDL must go to the master */
+            case MYSQL_COM_REFRESH:     /*< 7 - I guess this is session but not sure */
+            case MYSQL_COM_DEBUG:       /*< 0d all servers dump debug info to stdout */
+            case MYSQL_COM_PING:        /*< 0e all servers are pinged */
+            case MYSQL_COM_CHANGE_USER: /*< 11 all servers change it accordingly */
+                qtype = QUERY_TYPE_SESSION_WRITE;
+                break;
+
+            case MYSQL_COM_CREATE_DB:           /**< 5 DDL must go to the master */
+            case MYSQL_COM_DROP_DB:             /**< 6 DDL must go to the master */
+                qtype = QUERY_TYPE_WRITE;
+                break;
+
+            case MYSQL_COM_STMT_CLOSE:          /*< free prepared statement */
+            case MYSQL_COM_STMT_SEND_LONG_DATA: /*< send data to column */
+            case MYSQL_COM_STMT_RESET: /*< resets the data of a prepared statement */
+            case MYSQL_COM_STMT_FETCH: /*< fetches rows from the cursor in the master */
+                pstmt = prep_stmt_get(rses, querybuf);
+                qtype = QUERY_TYPE_WRITE;
+                break;
+
+            case MYSQL_COM_QUERY:
+                if (rses->have_tmp_tables && tmp_table_count(rses) > 0)
+                {
+                    /** The table names are needed for routing reads of temporary tables */
+                    qc_parse_collect(querybuf, QC_COLLECT_TABLES);
+                }
+                qtype = qc_get_type(querybuf);
+                break;
+
+            case MYSQL_COM_STMT_PREPARE:
+                qtype = qc_get_type(querybuf);
+
+                if (is_read_only_prep_stmt(rses, qtype) &&
+                    (new_pstmt = prep_stmt_init(rses, qtype)) != NULL)
+                {
+                    /** Prepared in all backends so that any of them can execute it */
+                    qtype |= QUERY_TYPE_SESSION_WRITE;
+                }
+                qtype |= QUERY_TYPE_PREPARE_STMT;
+                break;
+
+            case MYSQL_COM_STMT_EXECUTE:
+                /**
+                 * Parsing is not needed for this type of packet, the type of
+                 * a read-only statement is known from its preparation.
+                 */
+                qtype = QUERY_TYPE_EXEC_STMT;
+
+                if ((pstmt = prep_stmt_get(rses, querybuf)) != NULL &&
+                    prep_stmt_exec_is_read(pstmt, querybuf))
+                {
+                    qtype = pstmt->pstmt_qtype;
+                }
+                break;
+
+            case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
+            case MYSQL_COM_STATISTICS:     /**< 9 ? */
+            case MYSQL_COM_PROCESS_INFO:   /**< 0a ? */
+            case MYSQL_COM_CONNECT:        /**< 0b ? */
+            case MYSQL_COM_PROCESS_KILL:   /**< 0c ? */
+            case MYSQL_COM_TIME:           /**< 0f should this be run in gateway ? */
+            case MYSQL_COM_DELAYED_INSERT: /**< 10 ? */
+            case MYSQL_COM_DAEMON:         /**< 1d ? */
+            default:
+                break;
+        } /**< switch by packet type */
+
+        if (pstmt && packet_type == MYSQL_COM_STMT_CLOSE)
+        {
+            succp = route_prep_stmt_close(rses, pstmt, querybuf);
+            goto retblock;
+        }
+        else if (pstmt && packet_type == MYSQL_COM_STMT_SEND_LONG_DATA)
+        {
+            /** The data is only sent to the master */
+            pstmt->pstmt_master_only = true;
+        }
+
+        /** This might not be absolutely necessary as some parts of the code
+         * can only be executed by one thread at a time. */
+        if (!rses_begin_locked_router_action(rses))
+        {
+            succp = false;
+            goto retblock;
+        }
+
+        /** Set again when the command is routed to a single backend */
+        rses->rses_stream_target = NULL;
+
+        /** Check for multi-statement queries. If no master server is available
+         * and a multi-statement is issued, an error is returned to the client
+         * when the query is routed.
+         *
+         * If we do not have a master node, assigning the forced node is not
+         * effective since we don't have a node to force queries to. In this
+         * situation, assigning QUERY_TYPE_WRITE for the query will trigger
+         * the error processing. */
+        if (check_for_multi_stmt(rses, querybuf, packet_type, &qtype))
+        {
+            /** A session that connects lazily needs the master to force the queries to */
+            if (rses->rses_config.rw_lazy_connect && rses->rses_master_ref == NULL &&
+                lazy_connect_master(rses))
+            {
+                rses->forced_node = rses->rses_master_ref;
+            }
+
+            if (rses->rses_master_ref == NULL)
+            {
+                qtype |= QUERY_TYPE_WRITE;
+            }
+
+            /** The statements may change the session state */
+            rses->rses_state_known_pos = rses->pos_generator;
+        }
+
+        /**
+         * Check if the query has anything to do with temporary tables.
+         */
+        if (rses->have_tmp_tables &&
+            (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
+        {
+            check_drop_tmp_table(rses, querybuf, qtype);
+            if (packet_type == MYSQL_COM_QUERY)
+            {
+                qtype = is_read_tmp_table(rses, querybuf, qtype);
+            }
+        }
+        check_create_tmp_table(rses, querybuf, qtype);
+
+        /**
+         * Check if this is a LOAD DATA LOCAL INFILE query. If so, send all queries
+         * to the master until the last, empty packet arrives.
+         */
+        if (rses->rses_load_active)
+        {
+            rses->rses_load_data_sent += gwbuf_length(querybuf);
+        }
+        else if (packet_type == MYSQL_COM_QUERY)
+        {
+            qc_query_op_t queryop = qc_get_operation(querybuf);
+            if (queryop == QUERY_OP_LOAD)
+            {
+                rses->rses_load_active = true;
+                rses->rses_load_data_sent = 0;
+            }
+
+            /** A lock taken by the session lives only in its connection */
+            if (!rses->rses_state_pinned && is_lock_query(querybuf))
+            {
+                rses->rses_state_pinned = true;
+            }
+
+            /** A procedure can change the session state */
+            if (rses->rses_config.rw_skip_redundant_sescmd && is_call_query(querybuf))
+            {
+                rses->rses_state_known_pos = rses->pos_generator;
+            }
+        }
+        else if (packet_type == MYSQL_COM_STMT_PREPARE &&
+                 rses->rses_config.rw_skip_redundant_sescmd && is_call_query(querybuf))
+        {
+            /** The executions of the statement are not tracked */
+            rses->rses_state_untracked = true;
+        }
+
+        rses_end_locked_router_action(rses);
+
+        /** The statement that ends a read-only transaction still goes to its slave */
+        ro_trx_slave = rses->rses_ro_trx_slave;
+        ro_trx_begin = rses->rses_config.rw_read_only_trx &&
+                       !rses->rses_transaction_active && rses->rses_autocommit_enabled &&
+                       !rses->have_tmp_tables && rses->forced_node == NULL &&
+                       packet_type == MYSQL_COM_QUERY &&
+                       QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) &&
+                       is_read_only_trx(querybuf);
+        /**
+         * If autocommit is disabled or transaction is explicitly started
+         * transaction becomes active and master gets all statements until
+         * transaction is committed and autocommit is enabled again.
+         */
+        if (rses->rses_autocommit_enabled &&
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+        {
+            rses->rses_autocommit_enabled = false;
+
+            if (!rses->rses_transaction_active)
+            {
+                rses->rses_transaction_active = true;
+            }
+        }
+        else if (!rses->rses_transaction_active &&
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+        {
+            rses->rses_transaction_active = true;
+        }
+        /**
+         * Explicit COMMIT and ROLLBACK, implicit COMMIT.
+         */
+        if (rses->rses_autocommit_enabled && rses->rses_transaction_active &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
+        {
+            rses->rses_transaction_active = false;
+        }
+        else if (!rses->rses_autocommit_enabled &&
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        {
+            rses->rses_autocommit_enabled = true;
+            rses->rses_transaction_active = false;
+        }
+
+        if (!rses->rses_transaction_active)
+        {
+            rses->rses_ro_trx_slave = NULL;
+        }
+
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            if (!rses->rses_load_active)
+            {
+                uint8_t *packet = GWBUF_DATA(querybuf);
+                unsigned char ptype = packet[4];
+                size_t len = MIN(GWBUF_LENGTH(querybuf),
+                                 MYSQL_GET_PACKET_LEN((unsigned char *)querybuf->start) - 1);
+                char *data = (char *)&packet[5];
+                char *contentstr = strndup(data, MIN(len, RWSPLIT_TRACE_MSG_LEN));
+                char *qtypestr = qc_get_qtype_str(qtype);
+                MXS_INFO("> Autocommit: %s, trx is %s, cmd: %s, type: %s, stmt: %s%s %s",
+                         (rses->rses_autocommit_enabled ? "[enabled]" : "[disabled]"),
+                         (rses->rses_transaction_active ? "[open]" : "[not open]"),
+                         STRPACKETTYPE(ptype), (qtypestr == NULL ? "N/A" : qtypestr),
+                         contentstr, (querybuf->hint == NULL ? "" : ", Hint:"),
+                         (querybuf->hint == NULL ? "" : STRHINTTYPE(querybuf->hint->type)));
+                free(contentstr);
+                free(qtypestr);
+            }
+            else
+            {
+                MXS_INFO("> Processing LOAD DATA LOCAL INFILE: %lu bytes sent.",
+                         rses->rses_load_data_sent);
+            }
+        }
+        /**
+         * Find out where to route the query. Result may not be clear; it is
+         * possible to have a hint for routing to a named server which can
+         * be either slave or master.
+         * If query would otherwise be routed to slave then the hint determines
+         * actual target server if it exists.
+         *
+         * route_target is a bitfield and may include :
+         * TARGET_ALL
+         * - route to all connected backend servers
+         * TARGET_SLAVE[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
+         * - route primarily according to hints, then to slave and if those
+         *   failed, eventually to master
+         * TARGET_MASTER[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
+         * - route primarily according to the hints and if they failed,
+         *   eventually to master
+         */
+        route_target = get_route_target(rses, qtype, querybuf->hint);
+
+        if (ro_trx_begin)
+        {
+            /** The transaction is executed in the slave that starts it */
+            route_target = TARGET_SLAVE;
+        }
+
+        if (TARGET_IS_ALL(route_target))
+        {
+            /** Multiple, conflicting routing target. Return error */
+            if (TARGET_IS_MASTER(route_target) || TARGET_IS_SLAVE(route_target))
+            {
+                backend_ref_t *bref = rses->rses_backend_ref;
+
+                char *query_str = modutil_get_query(querybuf);
+                char *qtype_str = qc_get_qtype_str(qtype);
+
+                MXS_ERROR("Can't route %s:%s:\"%s\". SELECT with session data "
+                          "modification is not supported if configuration parameter "
+                          "use_sql_variables_in=all .", STRPACKETTYPE(packet_type),
+                          qtype_str, (query_str == NULL ? "(empty)" : query_str));
+
+                MXS_INFO("Unable to route the query without losing session data "
+                         "modification from other servers. <");
+
+                while (bref != NULL && !BREF_IS_IN_USE(bref))
+                {
+                    bref++;
+                }
+
+                if (bref != NULL && BREF_IS_IN_USE(bref))
+                {
+                    /** Create and add MySQL error to eventqueue */
+                    modutil_reply_parse_error(bref->bref_dcb,
+                                              strdup("Routing query to backend failed. "
+                                                     "See the error log for further "
+                                                     "details."), 0);
+                    succp = true;
+                }
+                else
+                {
+                    /**
+                     * If there were no available backend references
+                     * available return false - session will be closed
+                     */
+                    MXS_ERROR("Sending error message to client "
+                              "failed. Router doesn't have any "
+                              "available backends. Session will be "
+                              "closed.");
+                    succp = false;
+                }
+                if (query_str)
+                {
+                    free(query_str);
+                }
+                if (qtype_str)
+                {
+                    free(qtype_str);
+                }
+                goto retblock;
+            }
+            if (route_redundant_sescmd(rses, querybuf, packet_type, &succp))
+            {
+                goto retblock;
+            }
+
+            /**
+             * It is not sure if the session command in question requires
+             * response. Statement is examined in route_session_write.
+             * Router locking is done inside the function.
+             */
+            succp = route_session_write(rses, gwbuf_clone(querybuf), inst,
+                                        packet_type, qtype, new_pstmt);
+            new_pstmt = NULL;
+
+            if (succp)
+            {
+                ts_stats_add(inst->stats.n_all, 1);
+            }
+            goto retblock;
+        }
+    }
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(rses))
+    {
+        if (packet_type != MYSQL_COM_QUIT)
+        {
+            char *query_str = modutil_get_query(querybuf);
+
+            MXS_ERROR("Can't route %s:%s:\"%s\" to "
+                      "backend server. Router is closed.",
+                      STRPACKETTYPE(packet_type), STRQTYPE(qtype),
+                      (query_str == NULL ? "(empty)" : query_str));
+            free(query_str);
+        }
+        succp = false;
+        goto retblock;
+    }
+
+    if (rses->rses_config.rw_lazy_connect)
+    {
+        if (TARGET_IS_MASTER(route_target))
+        {
+            lazy_connect_master(rses);
+        }
+        else
+        {
+            lazy_connect_slave(rses, rses_get_max_replication_lag(rses));
+        }
+    }
+
+    DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
+
+    if (ro_trx_slave && !TARGET_IS_ALL(route_target) &&
+        BREF_IS_IN_USE(ro_trx_slave) && !BREF_IS_CLOSED(ro_trx_slave))
+    {
+        /** All statements of a read-only transaction go to the same slave */
+        target_dcb = ro_trx_slave->bref_dcb;
+        ts_stats_add(inst->stats.n_slave, 1);
+        succp = true;
+    }
+    /**
+     * There is a hint which either names the target backend or
+     * hint which sets maximum allowed replication lag for the
+     * backend.
+     */
+    else if (TARGET_IS_NAMED_SERVER(route_target) ||
+             TARGET_IS_RLAG_MAX(route_target))
+    {
+        HINT *hint;
+        HINT *named_hint = NULL;
+        char *named_server = NULL;
+
+        hint = querybuf->hint;
+
+        while (hint != NULL)
+        {
+            if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
+            {
+                /**
+                 * Set the name of searched
+                 * backend server.
+                 */
+                named_hint = hint;
+                named_server = hint->data;
+                MXS_INFO("Hint: route to server "
+                         "'%s'",
+                         named_server);
+            }
+            else if (hint->type == HINT_PARAMETER &&
+                     (strncasecmp((char *)hint->data, "max_slave_replication_lag",
+                                  strlen("max_slave_replication_lag")) == 0))
+            {
+                int val = (int)strtol((char *)hint->value, (char **)NULL, 10);
+
+                if (val != 0 || errno == 0)
+                {
+                    /** Set max. acceptable replication lag value for backend srv */
+                    rlag_max = val;
+                    MXS_INFO("Hint: max_slave_replication_lag=%d", rlag_max);
+                }
+            }
+            hint = hint->next;
+        } /*< while */
+
+        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        {
+            rlag_max = rses_get_max_replication_lag(rses);
+        }
+
+        /** target may be master or slave */
+        btype = route_target & TARGET_SLAVE ? BE_SLAVE : BE_MASTER;
+
+        /**
+         * Search backend server by name or replication lag.
+         * If it fails, then try to find valid slave or master.
+         */
+        succp = get_dcb(&target_dcb, rses, btype, named_hint, rlag_max);
+
+        if (!succp)
+        {
+            if (TARGET_IS_NAMED_SERVER(route_target))
+            {
+                MXS_INFO("Was supposed to route to named server "
+                         "%s but couldn't find the server in a "
+                         "suitable state.", named_server);
+            }
+            else if (TARGET_IS_RLAG_MAX(route_target))
+            {
+                MXS_INFO("Was supposed to route to server with "
+                         "replication lag at most %d but couldn't "
+                         "find such a slave.", rlag_max);
+            }
+        }
+    }
+    else if (TARGET_IS_SLAVE(route_target))
+    {
+        btype = BE_SLAVE;
+
+        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        {
+            rlag_max = rses_get_max_replication_lag(rses);
+        }
+        /**
+         * Search suitable backend server, get DCB in target_dcb
+         */
+        succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL, rlag_max);
+
+        if (succp)
+        {
+#if defined(SS_EXTRA_DEBUG)
+            MXS_INFO("Found DCB for slave.");
+#endif
+            ts_stats_add(inst->stats.n_slave, 1);
+        }
+        else
+        {
+            MXS_INFO("Was supposed to route to slave but finding suitable one failed.");
+        }
+    }
+    else if (TARGET_IS_MASTER(route_target))
+    {
+        DCB *curr_master_dcb = NULL;
+
+        succp = get_dcb(&curr_master_dcb, rses, BE_MASTER, NULL, MAX_RLAG_UNDEFINED);
+
+        if (succp && master_dcb == curr_master_dcb)
+        {
+            ts_stats_add(inst->stats.n_master, 1);
+            target_dcb = master_dcb;
+        }
+        else
+        {
+            if (succp && master_dcb != curr_master_dcb)
+            {
+                MXS_INFO("Was supposed to route to master but master has changed.");
+            }
+            else
+            {
+                MXS_INFO("Was supposed to route to master but couldn't find master"
+                         " in a suitable state.");
+            }
+
+            if (rses->rses_config.rw_master_failure_mode == RW_ERROR_ON_WRITE)
+            {
+                /** Old master is no longer available */
+                succp = send_readonly_error(rses->client_dcb);
+            }
+            else
+            {
+                MXS_WARNING("[%s] Write query received from %s@%s when no master is "
+                            "available, closing client connection.", inst->service->name,
+                            rses->client_dcb->user, rses->client_dcb->remote);
+                succp = false;
+            }
+
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+    }
+
+    if (succp) /*< Have DCB of the target backend */
+    {
+        backend_ref_t *bref;
+        sescmd_cursor_t *scur;
+
+        bref = get_bref_from_dcb(rses, target_dcb);
+
+        /** A delayed read refers to no statement id that could change */
+        if ((bref = causal_check_read(rses, bref, querybuf, pstmt == NULL)) == NULL)
+        {
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+        target_dcb = bref->bref_dcb;
+
+        if (pstmt)
+        {
+            /** Replaces the statement id with the one of the target */
+            bref = prep_stmt_get_target(rses, pstmt, bref, querybuf);
+            target_dcb = bref->bref_dcb;
+        }
+        scur = &bref->bref_sescmd_cur;
+
+        if (bref != rses->rses_master_ref)
+        {
+            sescmd_catch_up(bref);
+        }
+
+        /** The rest of a large packet or the data of LOAD DATA follows */
+        rses->rses_stream_target = bref;
+
+        if (ro_trx_begin && bref != rses->rses_master_ref)
+        {
+            MXS_INFO("Starting a read-only transaction in '%s'.",
+                     bref->bref_backend->backend_server->unique_name);
+            rses->rses_ro_trx_slave = bref;
+        }
+
+        if (rses->rses_config.rw_causal_reads && bref == rses->rses_master_ref &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) || !QUERY_IS_TYPE(qtype, QUERY_TYPE_READ)))
+        {
+            /** The GTID of the write is read when the master has replied */
+            rses->rses_causal_state = CAUSAL_STALE;
+        }
+
+        ss_dassert(target_dcb != NULL);
+
+        MXS_INFO("Route query to %s \t%s:%d <",
+                 (SERVER_IS_MASTER(bref->bref_backend->backend_server) ? "master"
+                  : "slave"), bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
+        /**
+         * Store current stmt if execution of previous session command
+         * haven't completed yet.
+         *
+         * !!! Note that according to MySQL protocol
+         * there can only be one such non-sescmd stmt at the time.
+         * It is possible that bref->bref_pending_cmd includes a pending
+         * command if rwsplit is parent or child for another router,
+         * which runs all the same commands.
+         *
+         * If the assertion below traps, pending queries are treated
+         * somehow wrong, or client is sending more queries before
+         * previous is received.
+         */
+        if (sescmd_cursor_is_active(scur) || bref->bref_causal_op != CAUSAL_OP_NONE)
+        {
+            ss_dassert(bref->bref_pending_cmd == NULL);
+            bref->bref_pending_cmd = gwbuf_clone(querybuf);
+
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+
+        if ((ret = target_dcb->func.write(target_dcb, gwbuf_clone(querybuf))) == 1)
+        {
+            backend_ref_t *bref;
+
+            ts_stats_add(inst->stats.n_queries, 1);
+            /**
+             * Add one query response waiter to backend reference
+             */
+            bref = get_bref_from_dcb(rses, target_dcb);
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+        }
+        else
+        {
+            MXS_ERROR("Routing query failed.");
+            succp = false;
+        }
+    }
+    rses_end_locked_router_action(rses);
+
+retblock :
+    if (new_pstmt)
+    {
+        prep_stmt_done(rses, new_pstmt);
+    }
+#if defined(SS_DEBUG2)
+    {
+        char *canonical_query_str;
+
+        canonical_query_str = skygw_get_canonical(querybuf);
+
+        if (canonical_query_str != NULL)
+        {
+            MXS_INFO("Canonical version: %s", canonical_query_str);
+            free(canonical_query_str);
+        }
+    }
+#endif
+    return succp;
+}
+
+/**
+ * @node Acquires lock to router client session if it is not closed.
+ *
+ * Parameters:
+ * @param rses - in, use
+ *
+ *
+ * @return true if router session was not closed. If return value is true
+ * it means that router is locked, and must be unlocked later. False, if
+ * router was closed before lock was acquired.
+ *
+ *
+ * @details (write detailed description here)
+ *
+ */
+static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
+{
+    bool succp = false;
+
+    if (rses == NULL)
+    {
+        return false;
+    }
+
+    CHK_CLIENT_RSES(rses);
+
+    if (rses->rses_closed)
+    {
+
+        goto return_succp;
+    }
+    spinlock_acquire(&rses->rses_lock);
+    if (rses->rses_closed)
+    {
+        spinlock_release(&rses->rses_lock);
+        goto return_succp;
+    }
+    succp = true;
+
+return_succp:
+    return succp;
+}
+
+/** to be inline'd */
+
+/**
+ * @node Releases router client session lock.
+ *
+ * Parameters:
+ * @param rses - <usage>
+ *          <description>
+ *
+ * @return void
+ *
+ *
+ * @details (write detailed description here)
+ *
+ */
+static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
+{
+    CHK_CLIENT_RSES(rses);
+    spinlock_release(&rses->rses_lock);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * Print query router statistics to the DCB passed in
+ *
+ * @param   instance    The router instance
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void diagnostic(ROUTER *instance, DCB *dcb)
+{
+    ROUTER_CLIENT_SES *router_cli_ses;
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
+    int i = 0;
+    BACKEND *backend;
+    char *weightby;
+
+    spinlock_acquire(&router->lock);
+    router_cli_ses = router->connections;
+    while (router_cli_ses)
+    {
+        i++;
+        router_cli_ses = router_cli_ses->next;
+    }
+    spinlock_release(&router->lock);
+
+    double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
+    int64_t n_queries = ts_stats_sum(router->stats.n_queries);
+    int64_t n_master = ts_stats_sum(router->stats.n_master);
+    int64_t n_slave = ts_stats_sum(router->stats.n_slave);
+    int64_t n_all = ts_stats_sum(router->stats.n_all);
+
+    if (n_queries > 0)
+    {
+        master_pct = ((double)n_master / (double)n_queries) * 100.0;
+        slave_pct = ((double)n_slave / (double)n_queries) * 100.0;
+        all_pct = ((double)n_all / (double)n_queries) * 100.0;
+    }
+
+    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
+               router->stats.n_sessions);
+    dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
+    dcb_printf(dcb, "\tNumber of queries forwarded:          	%" PRId64 "\n",
+               n_queries);
+    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%" PRId64 " (%.2f%%)\n",
+               n_master, master_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%" PRId64 " (%.2f%%)\n",
+               n_slave, slave_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%" PRId64 " (%.2f%%)\n",
+               n_all, all_pct);
+
+    if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
+    {
+        dcb_printf(dcb, "\tConnection distribution based on %s "
+                   "server parameter.\n",
+                   weightby);
+        dcb_printf(dcb, "\t\tServer               Target %%    Connections  "
+                   "Operations\n");
+        dcb_printf(dcb, "\t\t                               Global  Router\n");
+        for (i = 0; router->servers[i]; i++)
+        {
+            backend = router->servers[i];
+            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
+                       backend->backend_server->unique_name, (float)backend->weight / 10,
+                       backend->backend_server->stats.n_current, backend->backend_conn_count,
+                       backend->backend_server->stats.n_current_ops);
+        }
+    }
+
+    if (router->rwsplit_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME)
+    {
+        dcb_printf(dcb, "\tAverage response times:\n");
+        for (i = 0; router->servers[i]; i++)
+        {
+            backend = router->servers[i];
+            dcb_printf(dcb, "\t\t%-20s %d us\n",
+                       backend->backend_server->unique_name,
+                       backend->be_response_time);
+        }
+    }
+}
+
+/**
+ * Client Reply routine
+ *
+ * The routine will reply to client for session change with master server data
+ *
+ * @param   instance    The router instance
+ * @param   router_session  The router session
+ * @param   backend_dcb The backend DCB
+ * @param   queue       The GWBUF with reply data
+ */
+static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
+                        DCB *backend_dcb)
+{
+    DCB *client_dcb;
+    ROUTER_INSTANCE *router_inst;
+    ROUTER_CLIENT_SES *router_cli_ses;
+    sescmd_cursor_t *scur = NULL;
+    backend_ref_t *bref;
+
+    router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
+    router_inst = (ROUTER_INSTANCE *)instance;
+    CHK_CLIENT_RSES(router_cli_ses);
+
+    /**
+     * Lock router client session for secure read of router session members.
+     * Note that this could be done without lock by using version #
+     */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        print_error_packet(router_cli_ses, writebuf, backend_dcb);
+        goto lock_failed;
+    }
+    /** Holding lock ensures that router session remains open */
+    ss_dassert(backend_dcb->session != NULL);
+    client_dcb = backend_dcb->session->client_dcb;
+
+    /** Unlock */
+    rses_end_locked_router_action(router_cli_ses);
+    /**
+     * 1. Check if backend received reply to sescmd.
+     * 2. Check sescmd's state whether OK_PACKET has been
+     *    sent to client already and if not, lock property cursor,
+     *    reply to client, and move property cursor forward. Finally
+     *    release the lock.
+     * 3. If reply for this sescmd is sent, lock property cursor
+     *    and
+     */
+    if (client_dcb == NULL)
+    {
+        gwbuf_free(writebuf);
+        /** Log that client was closed before reply */
+        goto lock_failed;
+    }
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        /** Log to debug that router was closed */
+        goto lock_failed;
+    }
+    bref = get_bref_from_dcb(router_cli_ses, backend_dcb);
+
+#if !defined(FOR_BUG548_FIX_ONLY)
+    /** This makes the issue becoming visible in poll.c */
+    if (bref == NULL)
+    {
+        /** Unlock router session */
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+#endif
+
+    CHK_BACKEND_REF(bref);
+    scur = &bref->bref_sescmd_cur;
+
+    if (bref->bref_causal_op != CAUSAL_OP_NONE && GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+    {
+        /** The first reply is to an internal query of the causal reads */
+        writebuf = causal_process_reply(router_inst, router_cli_ses, bref, writebuf);
+    }
+
+    if (writebuf)
+    {
+        /** The query is timed until the first reply that goes to the client */
+        slowlog_end(&router_cli_ses->rses_slow_query, router_inst->service->slow_query_threshold,
+                    router_inst->service->name, backend_dcb->server->unique_name);
+    }
+
+    if (writebuf == NULL)
+    {
+        /** Nothing is sent to the client */
+    }
+    /**
+     * Active cursor means that reply is from session command
+     * execution.
+     */
+    else if (sescmd_cursor_is_active(scur))
+    {
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) &&
+            MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
+        {
+            uint8_t *buf = (uint8_t *)GWBUF_DATA((scur->scmd_cur_cmd->my_sescmd_buf));
+            uint8_t *replybuf = (uint8_t *)GWBUF_DATA(writebuf);
+            size_t len = MYSQL_GET_PACKET_LEN(buf);
+            size_t replylen = MYSQL_GET_PACKET_LEN(replybuf);
+            char *err = strndup(&((char *)replybuf)[8], 5);
+            char *replystr = strndup(&((char *)replybuf)[13], replylen - 4 - 5);
+
+            ss_dassert(len + 4 == GWBUF_LENGTH(scur->scmd_cur_cmd->my_sescmd_buf));
+
+            MXS_ERROR("Failed to execute session command in %s:%d. Error was: %s %s",
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port, err, replystr);
+            free(err);
+            free(replystr);
+        }
+
+        if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+        {
+            /**
+             * Discard all those responses that have already been sent to
+             * the client. Return with buffer including response that
+             * needs to be sent to client or NULL.
+             */
+            bool rconn = false;
+            writebuf = sescmd_cursor_process_replies(writebuf, bref, &rconn);
+
+            if (rconn && !router_inst->rwsplit_config.rw_disable_sescmd_hist)
             {
-                atomic_add(&inst->stats.n_all, 1);
+                select_connect_backend_servers(
+                    &router_cli_ses->rses_master_ref, router_cli_ses->rses_backend_ref,
+                    router_cli_ses->rses_nbackends,
+                    router_cli_ses->rses_config.rw_max_slave_conn_count,
+                    router_cli_ses->rses_config.rw_max_slave_replication_lag,
+                    router_cli_ses->rses_config.rw_slave_select_criteria,
+                    router_cli_ses->rses_master_ref->bref_dcb->session,
+                    router_cli_ses->router);
             }
-            goto retblock;
         }
+        /**
+         * If response will be sent to client, decrease waiter count.
+         * This applies to session commands only. Counter decrement
+         * for other type of queries is done outside this block.
+         */
+
+        /** Set response status as replied */
+        bref_update_response_time(bref);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
     }
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(rses))
+    /**
+     * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
+     * This applies for queries  other than session commands.
+     */
+    else if (BREF_IS_QUERY_ACTIVE(bref))
     {
-        if (packet_type != MYSQL_COM_QUIT)
-        {
-            char *query_str = modutil_get_query(querybuf);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        /** Set response status as replied */
+        bref_update_response_time(bref);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
 
-            MXS_ERROR("Can't route %s:%s:\"%s\" to "
-                      "backend server. Router is closed.",
-                      STRPACKETTYPE(packet_type), STRQTYPE(qtype),
-                      (query_str == NULL ? "(empty)" : query_str));
-            free(query_str);
+        if (bref == router_cli_ses->rses_master_ref && rses_tracks_state(router_cli_ses))
+        {
+            /** The statement was not a session command but it may have changed the state */
+            sescmd_add_tracked(router_cli_ses, bref, writebuf);
         }
-        succp = false;
-        goto retblock;
     }
 
-    DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
+    if (writebuf != NULL && bref == router_cli_ses->rses_master_ref &&
+        router_cli_ses->rses_causal_state == CAUSAL_STALE)
+    {
+        causal_fetch_gtid(router_cli_ses, writebuf);
+    }
 
-    /**
-     * There is a hint which either names the target backend or
-     * hint which sets maximum allowed replication lag for the
-     * backend.
-     */
-    if (TARGET_IS_NAMED_SERVER(route_target) ||
-        TARGET_IS_RLAG_MAX(route_target))
+    if (writebuf != NULL && client_dcb != NULL)
     {
-        HINT *hint;
-        char *named_server = NULL;
+        /** Write reply to client DCB */
+        SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+    }
+    /** Unlock router session */
+    rses_end_locked_router_action(router_cli_ses);
 
-        hint = querybuf->hint;
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        /** Log to debug that router was closed */
+        goto lock_failed;
+    }
+    /** There is one pending session command to be executed. */
+    if (sescmd_cursor_is_active(scur))
+    {
+        bool succp;
 
-        while (hint != NULL)
-        {
-            if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
-            {
-                /**
-                 * Set the name of searched
-                 * backend server.
-                 */
-                named_server = hint->data;
-                MXS_INFO("Hint: route to server "
-                         "'%s'",
-                         named_server);
-            }
-            else if (hint->type == HINT_PARAMETER &&
-                     (strncasecmp((char *)hint->data, "max_slave_replication_lag",
-                                  strlen("max_slave_replication_lag")) == 0))
-            {
-                int val = (int)strtol((char *)hint->value, (char **)NULL, 10);
+        MXS_INFO("Backend %s:%d processed reply and starts to execute "
+                 "active cursor.", bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
 
-                if (val != 0 || errno == 0)
-                {
-                    /** Set max. acceptable replication lag value for backend srv */
-                    rlag_max = val;
-                    MXS_INFO("Hint: max_slave_replication_lag=%d", rlag_max);
-                }
-            }
-            hint = hint->next;
-        } /*< while */
+        succp = execute_sescmd_in_backend(bref);
 
-        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        if (!succp)
         {
-            rlag_max = rses_get_max_replication_lag(rses);
+            MXS_INFO("Backend %s:%d failed to execute session command.",
+                     bref->bref_backend->backend_server->name,
+                     bref->bref_backend->backend_server->port);
         }
+    }
+    else if (bref->bref_pending_cmd != NULL) /*< non-sescmd is waiting to be routed */
+    {
+        int ret;
 
-        /** target may be master or slave */
-        btype = route_target & TARGET_SLAVE ? BE_SLAVE : BE_MASTER;
-
-        /**
-         * Search backend server by name or replication lag.
-         * If it fails, then try to find valid slave or master.
-         */
-        succp = get_dcb(&target_dcb, rses, btype, named_server, rlag_max);
+        CHK_GWBUF(bref->bref_pending_cmd);
 
-        if (!succp)
+        if ((ret = bref->bref_dcb->func.write(bref->bref_dcb,
+                       gwbuf_clone(bref->bref_pending_cmd))) == 1)
         {
-            if (TARGET_IS_NAMED_SERVER(route_target))
+            ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
+            ts_stats_add(inst->stats.n_queries, 1);
+            /**
+             * Add one query response waiter to backend reference
+             */
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+        }
+        else
+        {
+            char* sql = modutil_get_SQL(bref->bref_pending_cmd);
+
+            if (sql)
             {
-                MXS_INFO("Was supposed to route to named server "
-                         "%s but couldn't find the server in a "
-                         "suitable state.", named_server);
+                MXS_ERROR("Routing query \"%s\" failed.", sql);
+                free(sql);
             }
-            else if (TARGET_IS_RLAG_MAX(route_target))
+            else
             {
-                MXS_INFO("Was supposed to route to server with "
-                         "replication lag at most %d but couldn't "
-                         "find such a slave.", rlag_max);
+                MXS_ERROR("Failed to route query.");
             }
         }
+        gwbuf_free(bref->bref_pending_cmd);
+        bref->bref_pending_cmd = NULL;
     }
-    else if (TARGET_IS_SLAVE(route_target))
+    /** Unlock router session */
+    rses_end_locked_router_action(router_cli_ses);
+
+lock_failed:
+    return;
+}
+
+/** The routing weight of a backend, a part of it while the server warms up */
+static inline int backend_weight(BACKEND *b)
+{
+    return server_warmup_weight(b->backend_server, b->weight);
+}
+
+/** Compare nunmber of connections from this router in backend servers */
+int bref_cmp_router_conn(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
     {
-        btype = BE_SLAVE;
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
 
-        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
-        {
-            rlag_max = rses_get_max_replication_lag(rses);
-        }
-        /**
-         * Search suitable backend server, get DCB in target_dcb
-         */
-        succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL, rlag_max);
+    return ((1000 + 1000 * b1->backend_conn_count) / backend_weight(b1)) -
+           ((1000 + 1000 * b2->backend_conn_count) / backend_weight(b2));
+}
 
-        if (succp)
-        {
-#if defined(SS_EXTRA_DEBUG)
-            MXS_INFO("Found DCB for slave.");
-#endif
-            atomic_add(&inst->stats.n_slave, 1);
-        }
-        else
-        {
-            MXS_INFO("Was supposed to route to slave but finding suitable one failed.");
-        }
+/** Compare nunmber of global connections in backend servers */
+int bref_cmp_global_conn(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
     }
-    else if (TARGET_IS_MASTER(route_target))
+    else if (b1->weight == 0)
     {
-        DCB *curr_master_dcb = NULL;
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
 
-        succp = get_dcb(&curr_master_dcb, rses, BE_MASTER, NULL, MAX_RLAG_UNDEFINED);
+    return ((1000 + 1000 * b1->backend_server->stats.n_current) / backend_weight(b1)) -
+           ((1000 + 1000 * b2->backend_server->stats.n_current) / backend_weight(b2));
+}
+
+/** Compare relication lag between backend servers */
+int bref_cmp_behind_master(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1
+            : ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+}
+
+/** Compare average response times of backend servers, unmeasured ones first */
+int bref_cmp_response_time(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    return b1->be_response_time - b2->be_response_time;
+}
+
+/** Compare load scores of backend servers, then their current operations */
+int bref_cmp_congestion(const void *bref1, const void *bref2)
+{
+    int load1 = bref_server_load((backend_ref_t *)bref1);
+    int load2 = bref_server_load((backend_ref_t *)bref2);
+
+    if (load1 != load2)
+    {
+        return load1 - load2;
+    }
+
+    return bref_cmp_current_load(bref1, bref2);
+}
+
+/** Compare nunmber of current operations in backend servers */
+int bref_cmp_current_load(const void *bref1, const void *bref2)
+{
+    SERVER *s1 = ((backend_ref_t *)bref1)->bref_backend->backend_server;
+    SERVER *s2 = ((backend_ref_t *)bref2)->bref_backend->backend_server;
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
 
-        if (succp && master_dcb == curr_master_dcb)
-        {
-            atomic_add(&inst->stats.n_master, 1);
-            target_dcb = master_dcb;
-        }
-        else
-        {
-            if (succp && master_dcb != curr_master_dcb)
-            {
-                MXS_INFO("Was supposed to route to master but master has changed.");
-            }
-            else
-            {
-                MXS_INFO("Was supposed to route to master but couldn't find master"
-                         " in a suitable state.");
-            }
+    return ((1000 * s1->stats.n_current_ops) - backend_weight(b1)) -
+           ((1000 * s2->stats.n_current_ops) - backend_weight(b2));
+}
 
-            if (rses->rses_config.rw_master_failure_mode == RW_ERROR_ON_WRITE)
-            {
-                /** Old master is no longer available */
-                succp = send_readonly_error(rses->client_dcb);
-            }
-            else
-            {
-                MXS_WARNING("[%s] Write query received from %s@%s when no master is "
-                            "available, closing client connection.", inst->service->name,
-                            rses->client_dcb->user, rses->client_dcb->remote);
-                succp = false;
-            }
+/**
+ * @return The monotonic time in microseconds
+ */
+static uint64_t response_time_now(void)
+{
+    struct timespec ts;
 
-            rses_end_locked_router_action(rses);
-            goto retblock;
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    if (succp) /*< Have DCB of the target backend */
+/**
+ * Add the response time of the reply being handled to the moving average of
+ * the server. Called before the waiter count of the reply is decreased. When
+ * more replies are pending, the next one is timed from this one.
+ *
+ * @param bref Backend reference that received a reply
+ */
+static void bref_update_response_time(backend_ref_t *bref)
+{
+    if (BREF_IS_WAITING_RESULT(bref))
     {
-        backend_ref_t *bref;
-        sescmd_cursor_t *scur;
+        BACKEND *b = bref->bref_backend;
+        uint64_t now = response_time_now();
+        uint64_t elapsed = now - bref->bref_query_start;
+        int sample = elapsed > INT_MAX ? INT_MAX : elapsed > 0 ? (int)elapsed : 1;
+        int avg = b->be_response_time;
 
-        bref = get_bref_from_dcb(rses, target_dcb);
-        scur = &bref->bref_sescmd_cur;
+        /** The average is shared by all sessions and a lost update is harmless */
+        b->be_response_time = avg == 0 ? sample :
+                              avg + (sample - avg) / (1 << RESPONSE_TIME_SHIFT);
 
-        ss_dassert(target_dcb != NULL);
+        bref->bref_query_start = now;
+    }
+}
 
-        MXS_INFO("Route query to %s \t%s:%d <",
-                 (SERVER_IS_MASTER(bref->bref_backend->backend_server) ? "master"
-                  : "slave"), bref->bref_backend->backend_server->name,
-                 bref->bref_backend->backend_server->port);
-        /**
-         * Store current stmt if execution of previous session command
-         * haven't completed yet.
-         *
-         * !!! Note that according to MySQL protocol
-         * there can only be one such non-sescmd stmt at the time.
-         * It is possible that bref->bref_pending_cmd includes a pending
-         * command if rwsplit is parent or child for another router,
-         * which runs all the same commands.
-         *
-         * If the assertion below traps, pending queries are treated
-         * somehow wrong, or client is sending more queries before
-         * previous is received.
-         */
-        if (sescmd_cursor_is_active(scur))
-        {
-            ss_dassert(bref->bref_pending_cmd == NULL);
-            bref->bref_pending_cmd = gwbuf_clone(querybuf);
+static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
+{
+    if (bref == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+    if (state != BREF_WAITING_RESULT)
+    {
+        bref->bref_state &= ~state;
+    }
+    else
+    {
+        int prev1;
 
-            rses_end_locked_router_action(rses);
-            goto retblock;
-        }
+        /** Decrease waiter count */
+        prev1 = atomic_add(&bref->bref_num_result_wait, -1);
 
-        if ((ret = target_dcb->func.write(target_dcb, gwbuf_clone(querybuf))) == 1)
+        if (prev1 <= 0)
         {
-            backend_ref_t *bref;
-
-            atomic_add(&inst->stats.n_queries, 1);
-            /**
-             * Add one query response waiter to backend reference
-             */
-            bref = get_bref_from_dcb(rses, target_dcb);
-            bref_set_state(bref, BREF_QUERY_ACTIVE);
-            bref_set_state(bref, BREF_WAITING_RESULT);
+            atomic_add(&bref->bref_num_result_wait, 1);
         }
         else
         {
-            MXS_ERROR("Routing query failed.");
-            succp = false;
+            /** Decrease global operation count */
+            server_add_current_ops(bref->bref_backend->backend_server, -1);
         }
     }
-    rses_end_locked_router_action(rses);
+}
 
-retblock :
-#if defined(SS_DEBUG2)
+static void bref_set_state(backend_ref_t *bref, bref_state_t state)
+{
+    if (bref == NULL)
     {
-        char *canonical_query_str;
-
-        canonical_query_str = skygw_get_canonical(querybuf);
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+    if (state != BREF_WAITING_RESULT)
+    {
+        bref->bref_state |= state;
+    }
+    else
+    {
+        int prev1;
 
-        if (canonical_query_str != NULL)
+        /** Increase waiter count */
+        prev1 = atomic_add(&bref->bref_num_result_wait, 1);
+        if (prev1 == 0)
         {
-            MXS_INFO("Canonical version: %s", canonical_query_str);
-            free(canonical_query_str);
+            bref->bref_query_start = response_time_now();
+        }
+        ss_dassert(prev1 >= 0);
+        if (prev1 < 0)
+        {
+            MXS_ERROR("[%s] Error: negative number of connections waiting for "
+                      "results in backend %s:%u",
+                      __FUNCTION__, bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
         }
+        /** Increase global operation count */
+        server_add_current_ops(bref->bref_backend->backend_server, 1);
     }
-#endif
-    return succp;
 }
 
 /**
- * @node Acquires lock to router client session if it is not closed.
- *
- * Parameters:
- * @param rses - in, use
- *
- *
- * @return true if router session was not closed. If return value is true
- * it means that router is locked, and must be unlocked later. False, if
- * router was closed before lock was acquired.
- *
+ * @brief Connect a server
  *
- * @details (write detailed description here)
+ * Connects to a server, adds callbacks to the created DCB and updates
+ * router statistics. If @p execute_history is true, the session command
+ * history will be executed on this server.
  *
+ * @param b Router's backend structure for the server
+ * @param session Client's session object
+ * @param execute_history Execute session command history
+ * @return True if successful, false if an error occurred
  */
-static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
+bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history)
 {
-    bool succp = false;
-
-    if (rses == NULL)
-    {
-        return false;
-    }
+    SERVER *serv = bref->bref_backend->backend_server;
+    bool rval = false;
 
-    CHK_CLIENT_RSES(rses);
+    bref->bref_dcb = dcb_connect(serv, session, serv->protocol);
 
-    if (rses->rses_closed)
+    if (bref->bref_dcb != NULL)
     {
-
-        goto return_succp;
+        if (!execute_history || execute_sescmd_history(bref))
+        {
+            /** Add a callback for unresponsive server */
+            dcb_add_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
+                             &router_handle_state_switch, (void *) bref);
+            bref->bref_state = 0;
+            bref_set_state(bref, BREF_IN_USE);
+            atomic_add(&bref->bref_backend->backend_conn_count, 1);
+            rval = true;
+        }
+        else
+        {
+            MXS_ERROR("Failed to execute session command in %s (%s:%d). See earlier "
+                      "errors for more details.",
+                      bref->bref_backend->backend_server->unique_name,
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+            dcb_close(bref->bref_dcb);
+            bref->bref_dcb = NULL;
+        }
     }
-    spinlock_acquire(&rses->rses_lock);
-    if (rses->rses_closed)
+    else
     {
-        spinlock_release(&rses->rses_lock);
-        goto return_succp;
+        MXS_ERROR("Unable to establish connection with server %s:%d",
+                  serv->name, serv->port);
     }
-    succp = true;
 
-return_succp:
-    return succp;
+    return rval;
 }
 
-/** to be inline'd */
-
 /**
- * @node Releases router client session lock.
- *
- * Parameters:
- * @param rses - <usage>
- *          <description>
- *
- * @return void
- *
- *
- * @details (write detailed description here)
+ * @brief Log server connections
  *
+ * @param select_criteria Slave selection criteria
+ * @param backend_ref Backend reference array
+ * @param router_nservers Number of backends in @p backend_ref
  */
-static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
+void log_server_connections(select_criteria_t select_criteria,
+                            backend_ref_t *backend_ref, int router_nservers)
 {
-    CHK_CLIENT_RSES(rses);
-    spinlock_release(&rses->rses_lock);
-}
+    if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
+        select_criteria == LEAST_ROUTER_CONNECTIONS ||
+        select_criteria == LEAST_BEHIND_MASTER ||
+        select_criteria == LEAST_CURRENT_OPERATIONS ||
+        select_criteria == LEAST_RESPONSE_TIME ||
+        select_criteria == LEAST_CONGESTED)
+    {
+        MXS_INFO("Servers and %s connection counts:",
+                 select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
+                 : "router");
 
-/**
- * Diagnostics routine
- *
- * Print query router statistics to the DCB passed in
- *
- * @param   instance    The router instance
- * @param   dcb     The DCB for diagnostic output
- */
-static void diagnostic(ROUTER *instance, DCB *dcb)
-{
-    ROUTER_CLIENT_SES *router_cli_ses;
-    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
-    int i = 0;
-    BACKEND *backend;
-    char *weightby;
+        for (int i = 0; i < router_nservers; i++)
+        {
+            BACKEND *b = backend_ref[i].bref_backend;
+
+            switch (select_criteria)
+            {
+                case LEAST_GLOBAL_CONNECTIONS:
+                    MXS_INFO("MaxScale connections : %d in \t%s:%d %s",
+                             b->backend_server->stats.n_current, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
 
-    spinlock_acquire(&router->lock);
-    router_cli_ses = router->connections;
-    while (router_cli_ses)
-    {
-        i++;
-        router_cli_ses = router_cli_ses->next;
-    }
-    spinlock_release(&router->lock);
+                case LEAST_ROUTER_CONNECTIONS:
+                    MXS_INFO("RWSplit connections : %d in \t%s:%d %s",
+                             b->backend_conn_count, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
 
-    double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
+                case LEAST_CURRENT_OPERATIONS:
+                    MXS_INFO("current operations : %d in \t%s:%d %s",
+                             b->backend_server->stats.n_current_ops,
+                             b->backend_server->name, b->backend_server->port,
+                             STRSRVSTATUS(b->backend_server));
+                    break;
 
-    if (router->stats.n_queries > 0)
-    {
-        master_pct = ((double)router->stats.n_master / (double)router->stats.n_queries) * 100.0;
-        slave_pct = ((double)router->stats.n_slave / (double)router->stats.n_queries) * 100.0;
-        all_pct = ((double)router->stats.n_all / (double)router->stats.n_queries) * 100.0;
-    }
+                case LEAST_BEHIND_MASTER:
+                    MXS_INFO("replication lag : %d in \t%s:%d %s",
+                             b->backend_server->rlag, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
 
-    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
-               router->stats.n_sessions);
-    dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
-    dcb_printf(dcb, "\tNumber of queries forwarded:          	%d\n",
-               router->stats.n_queries);
-    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%d (%.2f%%)\n",
-               router->stats.n_master, master_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%d (%.2f%%)\n",
-               router->stats.n_slave, slave_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%d (%.2f%%)\n",
-               router->stats.n_all, all_pct);
+                case LEAST_RESPONSE_TIME:
+                    MXS_INFO("average response time : %d us in \t%s:%d %s",
+                             b->be_response_time, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
 
-    if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
-    {
-        dcb_printf(dcb, "\tConnection distribution based on %s "
-                   "server parameter.\n",
-                   weightby);
-        dcb_printf(dcb, "\t\tServer               Target %%    Connections  "
-                   "Operations\n");
-        dcb_printf(dcb, "\t\t                               Global  Router\n");
-        for (i = 0; router->servers[i]; i++)
-        {
-            backend = router->servers[i];
-            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
-                       backend->backend_server->unique_name, (float)backend->weight / 10,
-                       backend->backend_server->stats.n_current, backend->backend_conn_count,
-                       backend->backend_server->stats.n_current_ops);
+                case LEAST_CONGESTED:
+                    MXS_INFO("load score : %d in \t%s:%d %s",
+                             bref_server_load(&backend_ref[i]), b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                default:
+                    break;
+            }
         }
     }
 }
 
 /**
- * Client Reply routine
+ * @brief Search suitable backend servers from those of router instance
  *
- * The routine will reply to client for session change with master server data
+ * It is assumed that there is only one master among servers of a router instance.
+ * As a result, the first master found is chosen. There will possibly be more
+ * backend references than connected backends because only those in correct state
+ * are connected to.
  *
- * @param   instance    The router instance
- * @param   router_session  The router session
- * @param   backend_dcb The backend DCB
- * @param   queue       The GWBUF with reply data
+ * @param p_master_ref Pointer to location where master's backend reference is to  be stored
+ * @param backend_ref Pointer to backend server reference object array
+ * @param router_nservers Number of backend server pointers pointed to by @p backend_ref
+ * @param max_nslaves Upper limit for the number of slaves
+ * @param max_slave_rlag Maximum allowed replication lag for any slave
+ * @param select_criteria Slave selection criteria
+ * @param session Client session
+ * @param router Router instance
+ * @return true, if at least one master and one slave was found.
  */
-static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
-                        DCB *backend_dcb)
+static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
+                                           backend_ref_t *backend_ref,
+                                           int router_nservers, int max_nslaves,
+                                           int max_slave_rlag,
+                                           select_criteria_t select_criteria,
+                                           SESSION *session,
+                                           ROUTER_INSTANCE *router)
 {
-    DCB *client_dcb;
-    ROUTER_INSTANCE *router_inst;
-    ROUTER_CLIENT_SES *router_cli_ses;
-    sescmd_cursor_t *scur = NULL;
-    backend_ref_t *bref;
+    if (p_master_ref == NULL || backend_ref == NULL)
+    {
+        MXS_ERROR("Master reference (%p) or backend reference (%p) is NULL.",
+                  p_master_ref, backend_ref);
+        ss_dassert(false);
+        return false;
+    }
 
-    router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
-    router_inst = (ROUTER_INSTANCE *)instance;
-    CHK_CLIENT_RSES(router_cli_ses);
+    /* get the root Master */
+    BACKEND *master_host = get_root_master(backend_ref, router_nservers);
 
-    /**
-     * Lock router client session for secure read of router session members.
-     * Note that this could be done without lock by using version #
-     */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    if (router->rwsplit_config.rw_master_failure_mode == RW_FAIL_INSTANTLY &&
+        (master_host == NULL || SERVER_IS_DOWN(master_host->backend_server)))
     {
-        print_error_packet(router_cli_ses, writebuf, backend_dcb);
-        goto lock_failed;
+        MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
+        return false;
     }
-    /** Holding lock ensures that router session remains open */
-    ss_dassert(backend_dcb->session != NULL);
-    client_dcb = backend_dcb->session->client_dcb;
 
-    /** Unlock */
-    rses_end_locked_router_action(router_cli_ses);
     /**
-     * 1. Check if backend received reply to sescmd.
-     * 2. Check sescmd's state whether OK_PACKET has been
-     *    sent to client already and if not, lock property cursor,
-     *    reply to client, and move property cursor forward. Finally
-     *    release the lock.
-     * 3. If reply for this sescmd is sent, lock property cursor
-     *    and
+     * Existing session : master is already chosen and connected.
+     * The function was called because new slave must be selected to replace
+     * failed one.
      */
-    if (client_dcb == NULL)
-    {
-        gwbuf_free(writebuf);
-        /** Log that client was closed before reply */
-        goto lock_failed;
-    }
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(router_cli_ses))
-    {
-        /** Log to debug that router was closed */
-        goto lock_failed;
-    }
-    bref = get_bref_from_dcb(router_cli_ses, backend_dcb);
+    bool master_connected = *p_master_ref != NULL;
 
-#if !defined(FOR_BUG548_FIX_ONLY)
-    /** This makes the issue becoming visible in poll.c */
-    if (bref == NULL)
+    /** Check slave selection criteria and set compare function */
+    int (*p)(const void *, const void *) = criteria_cmpfun[select_criteria];
+    ss_dassert(p);
+
+    /** Sort the pointer list to servers according to slave selection criteria.
+     * The servers that match the criteria the best are at the beginning of
+     * the list. */
+    qsort(backend_ref, (size_t) router_nservers, sizeof(backend_ref_t), p);
+
+    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
     {
-        /** Unlock router session */
-        rses_end_locked_router_action(router_cli_ses);
-        goto lock_failed;
+        log_server_connections(select_criteria, backend_ref, router_nservers);
     }
-#endif
 
-    CHK_BACKEND_REF(bref);
-    scur = &bref->bref_sescmd_cur;
+    int slaves_found = 0;
+    int slaves_connected = 0;
+    const int min_nslaves = 0; /*< not configurable at the time */
+    bool succp = false;
+
     /**
-     * Active cursor means that reply is from session command
-     * execution.
+     * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves
+     * servers from the sorted list. First master found is selected.
      */
-    if (sescmd_cursor_is_active(scur))
+    for (int i = 0; i < router_nservers &&
+         (slaves_connected < max_nslaves || !master_connected); i++)
     {
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) &&
-            MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
+        SERVER *serv = backend_ref[i].bref_backend->backend_server;
+
+        if (!BREF_HAS_FAILED(&backend_ref[i]) && SERVER_IS_RUNNING(serv))
         {
-            uint8_t *buf = (uint8_t *)GWBUF_DATA((scur->scmd_cur_cmd->my_sescmd_buf));
-            uint8_t *replybuf = (uint8_t *)GWBUF_DATA(writebuf);
-            size_t len = MYSQL_GET_PACKET_LEN(buf);
-            size_t replylen = MYSQL_GET_PACKET_LEN(replybuf);
-            char *err = strndup(&((char *)replybuf)[8], 5);
-            char *replystr = strndup(&((char *)replybuf)[13], replylen - 4 - 5);
+            /* check also for relay servers and don't take the master_host */
+            if (slaves_found < max_nslaves &&
+                rlag_is_acceptable(master_host ? master_host->backend_server : NULL,
+                                   serv, max_slave_rlag) &&
+                (SERVER_IS_SLAVE(serv) || SERVER_IS_RELAY_SERVER(serv)) &&
+                (master_host == NULL || (serv != master_host->backend_server)))
+            {
+                slaves_found += 1;
 
-            ss_dassert(len + 4 == GWBUF_LENGTH(scur->scmd_cur_cmd->my_sescmd_buf));
+                if (BREF_IS_IN_USE((&backend_ref[i])) ||
+                    connect_server(&backend_ref[i], session, true))
+                {
+                    slaves_connected += 1;
+                }
+            }
+                /* take the master_host for master */
+            else if (master_host && (serv == master_host->backend_server))
+            {
+                /** p_master_ref must be assigned with this backend_ref pointer
+                 * because its original value may have been lost when backend
+                 * references were sorted with qsort. */
+                *p_master_ref = &backend_ref[i];
 
-            MXS_ERROR("Failed to execute session command in %s:%d. Error was: %s %s",
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port, err, replystr);
-            free(err);
-            free(replystr);
+                if (!master_connected)
+                {
+                    /** The history is empty unless the session is already open */
+                    if (connect_server(&backend_ref[i], session, true))
+                    {
+                        master_connected = true;
+                    }
+                }
+            }
+        }
+    } /*< for */
+
+    /**
+     * Successful cases
+     */
+    if (slaves_connected >= min_nslaves && slaves_connected <= max_nslaves)
+    {
+        succp = true;
+
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            if (slaves_connected < max_nslaves)
+            {
+                MXS_INFO("Couldn't connect to maximum number of "
+                         "slaves. Connected successfully to %d slaves "
+                         "of %d of them.", slaves_connected, slaves_found);
+            }
+
+            for (int i = 0; i < router_nservers; i++)
+            {
+                if (BREF_IS_IN_USE((&backend_ref[i])))
+                {
+                    MXS_INFO("Selected %s in \t%s:%d",
+                             STRSRVSTATUS(backend_ref[i].bref_backend->backend_server),
+                             backend_ref[i].bref_backend->backend_server->name,
+                             backend_ref[i].bref_backend->backend_server->port);
+                }
+            } /* for */
+        }
+    }
+        /** Failure cases */
+    else
+    {
+        if (slaves_connected < min_nslaves)
+        {
+            MXS_ERROR("Couldn't establish required amount of "
+                      "slave connections for router session.");
         }
 
-        if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+        /** Clean up connections */
+        for (int i = 0; i < router_nservers; i++)
         {
-            /**
-             * Discard all those responses that have already been sent to
-             * the client. Return with buffer including response that
-             * needs to be sent to client or NULL.
-             */
-            bool rconn = false;
-            writebuf = sescmd_cursor_process_replies(writebuf, bref, &rconn);
-
-            if (rconn && !router_inst->rwsplit_config.rw_disable_sescmd_hist)
+            if (BREF_IS_IN_USE((&backend_ref[i])))
             {
-                select_connect_backend_servers(
-                    &router_cli_ses->rses_master_ref, router_cli_ses->rses_backend_ref,
-                    router_cli_ses->rses_nbackends,
-                    router_cli_ses->rses_config.rw_max_slave_conn_count,
-                    router_cli_ses->rses_config.rw_max_slave_replication_lag,
-                    router_cli_ses->rses_config.rw_slave_select_criteria,
-                    router_cli_ses->rses_master_ref->bref_dcb->session,
-                    router_cli_ses->router);
+                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
+
+                /** disconnect opened connections */
+                bref_clear_state(&backend_ref[i], BREF_IN_USE);
+                /** Decrease backend's connection counter. */
+                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
+                dcb_close(backend_ref[i].bref_dcb);
             }
         }
-        /**
-         * If response will be sent to client, decrease waiter count.
-         * This applies to session commands only. Counter decrement
-         * for other type of queries is done outside this block.
-         */
-
-        /** Set response status as replied */
-        bref_clear_state(bref, BREF_WAITING_RESULT);
     }
-    /**
-     * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
-     * This applies for queries  other than session commands.
-     */
-    else if (BREF_IS_QUERY_ACTIVE(bref))
+
+    return succp;
+}
+
+/**
+ * Create a generic router session property strcture.
+ */
+static rses_property_t *rses_property_init(rses_property_type_t prop_type)
+{
+    rses_property_t *prop;
+
+    prop = (rses_property_t *)calloc(1, sizeof(rses_property_t));
+    if (prop == NULL)
     {
-        bref_clear_state(bref, BREF_QUERY_ACTIVE);
-        /** Set response status as replied */
-        bref_clear_state(bref, BREF_WAITING_RESULT);
+        MXS_ERROR("Error: Malloc returned NULL. (%s:%d)", __FILE__, __LINE__);
+        return NULL;
     }
+    prop->rses_prop_type = prop_type;
+#if defined(SS_DEBUG)
+    prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
+    prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
+#endif
 
-    if (writebuf != NULL && client_dcb != NULL)
+    CHK_RSES_PROP(prop);
+    return prop;
+}
+
+/**
+ * Property is freed at the end of router client session.
+ */
+static void rses_property_done(rses_property_t *prop)
+{
+    if (prop == NULL)
     {
-        /** Write reply to client DCB */
-        SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
     }
-    /** Unlock router session */
-    rses_end_locked_router_action(router_cli_ses);
+    CHK_RSES_PROP(prop);
 
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    if (prop->rses_prop_mem)
     {
-        /** Log to debug that router was closed */
-        goto lock_failed;
+        session_mem_add(prop->rses_prop_rsession->rses_session, -(int64_t)prop->rses_prop_mem);
     }
-    /** There is one pending session command to be executed. */
-    if (sescmd_cursor_is_active(scur))
-    {
-        bool succp;
-
-        MXS_INFO("Backend %s:%d processed reply and starts to execute "
-                 "active cursor.", bref->bref_backend->backend_server->name,
-                 bref->bref_backend->backend_server->port);
-
-        succp = execute_sescmd_in_backend(bref);
 
-        if (!succp)
-        {
-            MXS_INFO("Backend %s:%d failed to execute session command.",
-                     bref->bref_backend->backend_server->name,
-                     bref->bref_backend->backend_server->port);
-        }
-    }
-    else if (bref->bref_pending_cmd != NULL) /*< non-sescmd is waiting to be routed */
+    switch (prop->rses_prop_type)
     {
-        int ret;
+        case RSES_PROP_TYPE_SESCMD:
+            mysql_sescmd_done(&prop->rses_prop_data.sescmd);
+            break;
 
-        CHK_GWBUF(bref->bref_pending_cmd);
+        case RSES_PROP_TYPE_TMPTABLES:
+            hashtable_free(prop->rses_prop_data.temp_tables);
+            break;
 
-        if ((ret = bref->bref_dcb->func.write(bref->bref_dcb,
-                       gwbuf_clone(bref->bref_pending_cmd))) == 1)
-        {
-            ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
-            atomic_add(&inst->stats.n_queries, 1);
-            /**
-             * Add one query response waiter to backend reference
-             */
-            bref_set_state(bref, BREF_QUERY_ACTIVE);
-            bref_set_state(bref, BREF_WAITING_RESULT);
-        }
-        else
-        {
-            char* sql = modutil_get_SQL(bref->bref_pending_cmd);
+        default:
+            MXS_DEBUG("%lu [rses_property_done] Unknown property type %d "
+                      "in property %p", pthread_self(), prop->rses_prop_type, prop);
 
-            if (sql)
-            {
-                MXS_ERROR("Routing query \"%s\" failed.", sql);
-                free(sql);
-            }
-            else
-            {
-                MXS_ERROR("Failed to route query.");
-            }
-        }
-        gwbuf_free(bref->bref_pending_cmd);
-        bref->bref_pending_cmd = NULL;
+            ss_dassert(false);
+            break;
     }
-    /** Unlock router session */
-    rses_end_locked_router_action(router_cli_ses);
-
-lock_failed:
-    return;
+    free(prop);
 }
 
-/** Compare nunmber of connections from this router in backend servers */
-int bref_cmp_router_conn(const void *bref1, const void *bref2)
+/**
+ * Add property to the router_client_ses structure's rses_properties
+ * array. The slot is determined by the type of property.
+ * In each slot there is a list of properties of similar type.
+ *
+ * Router client session must be locked.
+ */
+static int rses_property_add(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
-
-    if (b1->weight == 0 && b2->weight == 0)
+    if (rses == NULL)
     {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
+        MXS_ERROR("Router client session is NULL. (%s:%d)", __FILE__, __LINE__);
+        return -1;
     }
-    else if (b1->weight == 0)
+    if (prop == NULL)
     {
-        return 1;
+        MXS_ERROR("Router client session property is NULL. (%s:%d)", __FILE__, __LINE__);
+        return -1;
     }
-    else if (b2->weight == 0)
+    rses_property_t *p;
+
+    CHK_CLIENT_RSES(rses);
+    CHK_RSES_PROP(prop);
+    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+
+    prop->rses_prop_rsession = rses;
+    p = rses->rses_properties[prop->rses_prop_type];
+
+    /** The session is charged for the history it keeps */
+    if (prop->rses_prop_type == RSES_PROP_TYPE_SESCMD)
     {
-        return -1;
+        mysql_sescmd_t *scmd = &prop->rses_prop_data.sescmd;
+        prop->rses_prop_mem = sizeof(*prop) + gwbuf_length(scmd->my_sescmd_buf) +
+            (scmd->my_sescmd_key ? strlen(scmd->my_sescmd_key) + 1 : 0);
+        session_mem_add(rses->rses_session, prop->rses_prop_mem);
     }
 
-    return ((1000 + 1000 * b1->backend_conn_count) / b1->weight) -
-           ((1000 + 1000 * b2->backend_conn_count) / b2->weight);
+    if (p == NULL)
+    {
+        rses->rses_properties[prop->rses_prop_type] = prop;
+    }
+    else
+    {
+        while (p->rses_prop_next != NULL)
+        {
+            p = p->rses_prop_next;
+        }
+        p->rses_prop_next = prop;
+    }
+    return 0;
 }
 
-/** Compare nunmber of global connections in backend servers */
-int bref_cmp_global_conn(const void *bref1, const void *bref2)
+/**
+ * Router session must be locked.
+ * Return session command pointer if succeed, NULL if failed.
+ */
+static mysql_sescmd_t *rses_property_get_sescmd(rses_property_t *prop)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    mysql_sescmd_t *sescmd;
 
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
+    if (prop == NULL)
     {
-        return 1;
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return NULL;
     }
-    else if (b2->weight == 0)
+
+    CHK_RSES_PROP(prop);
+    ss_dassert(prop->rses_prop_rsession == NULL ||
+               SPINLOCK_IS_LOCKED(&prop->rses_prop_rsession->rses_lock));
+
+    sescmd = &prop->rses_prop_data.sescmd;
+
+    if (sescmd != NULL)
     {
-        return -1;
+        CHK_MYSQL_SESCMD(sescmd);
     }
+    return sescmd;
+}
+
+/**
+ * Create session command property.
+ */
+static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
+                                         GWBUF *sescmd_buf,
+                                         unsigned char packet_type,
+                                         ROUTER_CLIENT_SES *rses)
+{
+    mysql_sescmd_t *sescmd;
+
+    CHK_RSES_PROP(rses_prop);
+    /** Can't call rses_property_get_sescmd with uninitialized sescmd */
+    sescmd = &rses_prop->rses_prop_data.sescmd;
+    sescmd->my_sescmd_prop = rses_prop; /*< reference to owning property */
+#if defined(SS_DEBUG)
+    sescmd->my_sescmd_chk_top = CHK_NUM_MY_SESCMD;
+    sescmd->my_sescmd_chk_tail = CHK_NUM_MY_SESCMD;
+#endif
+    /** Set session command buffer */
+    sescmd->my_sescmd_buf = sescmd_buf;
+    sescmd->my_sescmd_packet_type = packet_type;
+    sescmd->my_sescmd_key = sescmd_get_key(sescmd_buf, packet_type);
+    sescmd->position = atomic_add(&rses->pos_generator, 1);
 
-    return ((1000 + 1000 * b1->backend_server->stats.n_current) / b1->weight) -
-           ((1000 + 1000 * b2->backend_server->stats.n_current) / b2->weight);
+    return sescmd;
 }
 
-/** Compare relication lag between backend servers */
-int bref_cmp_behind_master(const void *bref1, const void *bref2)
+static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    if (sescmd == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+    CHK_RSES_PROP(sescmd->my_sescmd_prop);
+    gwbuf_free(sescmd->my_sescmd_buf);
+    free(sescmd->my_sescmd_key);
 
-    return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1
-            : ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+    if (sescmd->my_sescmd_pstmt)
+    {
+        prep_stmt_done(sescmd->my_sescmd_prop->rses_prop_rsession,
+                       sescmd->my_sescmd_pstmt);
+    }
+    memset(sescmd, 0, sizeof(mysql_sescmd_t));
 }
 
-/** Compare nunmber of current operations in backend servers */
-int bref_cmp_current_load(const void *bref1, const void *bref2)
+/** Skip whitespace */
+static const char *sescmd_skip_space(const char *ptr, const char *end)
 {
-    SERVER *s1 = ((backend_ref_t *)bref1)->bref_backend->backend_server;
-    SERVER *s2 = ((backend_ref_t *)bref2)->bref_backend->backend_server;
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
-
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
+    while (ptr < end && isspace(*ptr))
     {
-        return 1;
+        ptr++;
     }
-    else if (b2->weight == 0)
+    return ptr;
+}
+
+/** Skip the characters of a name */
+static const char *sescmd_skip_name(const char *ptr, const char *end)
+{
+    while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '$'))
     {
-        return -1;
+        ptr++;
     }
-
-    return ((1000 * s1->stats.n_current_ops) - b1->weight) -
-           ((1000 * s2->stats.n_current_ops) - b2->weight);
+    return ptr;
 }
 
-static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
+/**
+ * Skip a keyword and the whitespace after it.
+ *
+ * @param ptr  Pointer to the SQL, moved past the keyword if it matches
+ * @param end  End of the SQL
+ * @param word The keyword in upper case
+ * @return True if the keyword matched
+ */
+static bool sescmd_skip_word(const char **ptr, const char *end, const char *word)
 {
-    if (bref == NULL)
+    size_t len = strlen(word);
+
+    if ((size_t)(end - *ptr) >= len && strncasecmp(*ptr, word, len) == 0 &&
+        sescmd_skip_name(*ptr + len, end) == *ptr + len)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        *ptr = sescmd_skip_space(*ptr + len, end);
+        return true;
     }
-    if (state != BREF_WAITING_RESULT)
+    return false;
+}
+
+/**
+ * Skip a constant: a number, a keyword or a quoted string. Strings with
+ * escapes, variables or characters which depend on the character set are
+ * not accepted, so the constant means the same in any session state.
+ *
+ * @return Pointer past the constant and the whitespace after it, NULL if
+ * there is no acceptable constant
+ */
+static const char *sescmd_skip_constant(const char *ptr, const char *end)
+{
+    const char *start = ptr;
+
+    if (ptr < end && (*ptr == '\'' || *ptr == '"'))
     {
-        bref->bref_state &= ~state;
+        char quote = *ptr++;
+
+        while (ptr < end && *ptr != quote)
+        {
+            if (*ptr == '\\' || *ptr == '@' || !isprint(*ptr))
+            {
+                return NULL;
+            }
+            ptr++;
+        }
+
+        if (ptr == end)
+        {
+            return NULL;
+        }
+        ptr++;
     }
     else
     {
-        int prev1;
-        int prev2;
-
-        /** Decrease waiter count */
-        prev1 = atomic_add(&bref->bref_num_result_wait, -1);
-
-        if (prev1 <= 0)
+        while (ptr < end && (isalnum(*ptr) || *ptr == '_' || *ptr == '.' ||
+                             *ptr == '-' || *ptr == '+'))
         {
-            atomic_add(&bref->bref_num_result_wait, 1);
+            ptr++;
         }
-        else
+
+        if (ptr == start)
         {
-            /** Decrease global operation count */
-            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
-            ss_dassert(prev2 > 0);
-            if (prev2 <= 0)
-            {
-                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                          __FUNCTION__, bref->bref_backend->backend_server->name,
-                          bref->bref_backend->backend_server->port);
-            }
+            return NULL;
         }
     }
+
+    return sescmd_skip_space(ptr, end);
 }
 
-static void bref_set_state(backend_ref_t *bref, bref_state_t state)
+/**
+ * Check whether a statement starts a read-only transaction
+ *
+ * @param buf   A COM_QUERY packet
+ * @return True if the statement is START TRANSACTION with READ ONLY
+ */
+static bool is_read_only_trx(GWBUF *buf)
 {
-    if (bref == NULL)
+    char *sql;
+    int len;
+
+    if (!modutil_extract_SQL(buf, &sql, &len))
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        return false;
     }
-    if (state != BREF_WAITING_RESULT)
+
+    const char *end = sql + len;
+    const char *ptr = sescmd_skip_space(sql, end);
+
+    if (!sescmd_skip_word(&ptr, end, "START") || !sescmd_skip_word(&ptr, end, "TRANSACTION"))
     {
-        bref->bref_state |= state;
+        return false;
     }
-    else
+
+    /** The characteristics of the transaction are separated by commas */
+    while (ptr < end)
     {
-        int prev1;
-        int prev2;
+        if (sescmd_skip_word(&ptr, end, "READ") && sescmd_skip_word(&ptr, end, "ONLY"))
+        {
+            return true;
+        }
 
-        /** Increase waiter count */
-        prev1 = atomic_add(&bref->bref_num_result_wait, 1);
-        ss_dassert(prev1 >= 0);
-        if (prev1 < 0)
+        while (ptr < end && *ptr != ',')
         {
-            MXS_ERROR("[%s] Error: negative number of connections waiting for "
-                      "results in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
+            ptr++;
         }
-        /** Increase global operation count */
-        prev2 =
-            atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
-        ss_dassert(prev2 >= 0);
-        if (prev2 < 0)
+
+        if (ptr < end)
         {
-            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
+            ptr = sescmd_skip_space(ptr + 1, end);
         }
     }
+
+    return false;
 }
 
 /**
- * @brief Connect a server
+ * Check whether a statement may take a named lock
  *
- * Connects to a server, adds callbacks to the created DCB and updates
- * router statistics. If @p execute_history is true, the session command
- * history will be executed on this server.
- *
- * @param b Router's backend structure for the server
- * @param session Client's session object
- * @param execute_history Execute session command history
- * @return True if successful, false if an error occurred
+ * @param buf   A COM_QUERY packet
+ * @return True if the statement calls GET_LOCK()
  */
-bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history)
+static bool is_lock_query(GWBUF *buf)
 {
-    SERVER *serv = bref->bref_backend->backend_server;
-    bool rval = false;
-
-    bref->bref_dcb = dcb_connect(serv, session, serv->protocol);
+    const char word[] = "GET_LOCK";
+    const int wlen = sizeof(word) - 1;
+    char *sql;
+    int len;
 
-    if (bref->bref_dcb != NULL)
+    if (modutil_extract_SQL(buf, &sql, &len))
     {
-        if (!execute_history || execute_sescmd_history(bref))
-        {
-            /** Add a callback for unresponsive server */
-            dcb_add_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
-                             &router_handle_state_switch, (void *) bref);
-            bref->bref_state = 0;
-            bref_set_state(bref, BREF_IN_USE);
-            atomic_add(&bref->bref_backend->backend_conn_count, 1);
-            rval = true;
-        }
-        else
+        for (int i = 0; i + wlen <= len; i++)
         {
-            MXS_ERROR("Failed to execute session command in %s (%s:%d). See earlier "
-                      "errors for more details.",
-                      bref->bref_backend->backend_server->unique_name,
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-            dcb_close(bref->bref_dcb);
-            bref->bref_dcb = NULL;
+            if (strncasecmp(sql + i, word, wlen) == 0)
+            {
+                return true;
+            }
         }
     }
-    else
-    {
-        MXS_ERROR("Unable to establish connection with server %s:%d",
-                  serv->name, serv->port);
-    }
 
-    return rval;
+    return false;
 }
 
 /**
- * @brief Log server connections
+ * Find out which session state a session command sets. Only the commands that
+ * set one session variable or the default database to a constant have a key.
+ * Such a command replaces the effect of an earlier command with the same key.
  *
- * @param select_criteria Slave selection criteria
- * @param backend_ref Backend reference array
- * @param router_nservers Number of backends in @p backend_ref
+ * @param buf         The session command
+ * @param packet_type The command byte of the packet
+ * @return The key or NULL if the command does something else. The caller
+ * must free the key.
  */
-void log_server_connections(select_criteria_t select_criteria,
-                            backend_ref_t *backend_ref, int router_nservers)
+static char *sescmd_get_key(GWBUF *buf, unsigned char packet_type)
 {
-    if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
-        select_criteria == LEAST_ROUTER_CONNECTIONS ||
-        select_criteria == LEAST_BEHIND_MASTER ||
-        select_criteria == LEAST_CURRENT_OPERATIONS)
-    {
-        MXS_INFO("Servers and %s connection counts:",
-                 select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
-                 : "router");
+    const char *ptr;
+    const char *end;
+    const char *name = NULL;
+    int name_len = 0;
+    bool is_use = false;
+    int len;
 
-        for (int i = 0; i < router_nservers; i++)
-        {
-            BACKEND *b = backend_ref[i].bref_backend;
+    if (packet_type == MYSQL_COM_INIT_DB)
+    {
+        return strdup("USE");
+    }
+    else if (packet_type != MYSQL_COM_QUERY || !modutil_get_SQL_view(buf, &ptr, &len))
+    {
+        return NULL;
+    }
 
-            switch (select_criteria)
-            {
-                case LEAST_GLOBAL_CONNECTIONS:
-                    MXS_INFO("MaxScale connections : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                    break;
+    end = ptr + len;
+    ptr = sescmd_skip_space(ptr, end);
 
-                case LEAST_ROUTER_CONNECTIONS:
-                    MXS_INFO("RWSplit connections : %d in \t%s:%d %s",
-                             b->backend_conn_count, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                    break;
+    if (sescmd_skip_word(&ptr, end, "USE"))
+    {
+        const char *db = ptr;
 
-                case LEAST_CURRENT_OPERATIONS:
-                    MXS_INFO("current operations : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current_ops,
-                             b->backend_server->name, b->backend_server->port,
-                             STRSRVSTATUS(b->backend_server));
-                    break;
+        if (db < end && *db == '`')
+        {
+            while (++ptr < end && *ptr != '`')
+            {
+                ;
+            }
 
-                case LEAST_BEHIND_MASTER:
-                    MXS_INFO("replication lag : %d in \t%s:%d %s",
-                             b->backend_server->rlag, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                default:
-                    break;
+            if (ptr == end)
+            {
+                return NULL;
             }
+            ptr = sescmd_skip_space(ptr + 1, end);
+        }
+        else if ((ptr = sescmd_skip_name(db, end)) == db)
+        {
+            return NULL;
+        }
+        else
+        {
+            ptr = sescmd_skip_space(ptr, end);
         }
+        name = "USE";
+        name_len = 3;
+        is_use = true;
     }
-}
+    else if (sescmd_skip_word(&ptr, end, "SET"))
+    {
+        if (sescmd_skip_word(&ptr, end, "NAMES"))
+        {
+            if ((ptr = sescmd_skip_constant(ptr, end)) &&
+                sescmd_skip_word(&ptr, end, "COLLATE"))
+            {
+                ptr = sescmd_skip_constant(ptr, end);
+            }
+            name = "names";
+            name_len = 5;
+        }
+        else
+        {
+            if (!sescmd_skip_word(&ptr, end, "SESSION") &&
+                !sescmd_skip_word(&ptr, end, "LOCAL") &&
+                end - ptr > 2 && ptr[0] == '@' && ptr[1] == '@')
+            {
+                ptr += 2;
 
-/**
- * @brief Search suitable backend servers from those of router instance
- *
- * It is assumed that there is only one master among servers of a router instance.
- * As a result, the first master found is chosen. There will possibly be more
- * backend references than connected backends because only those in correct state
- * are connected to.
- *
- * @param p_master_ref Pointer to location where master's backend reference is to  be stored
- * @param backend_ref Pointer to backend server reference object array
- * @param router_nservers Number of backend server pointers pointed to by @p backend_ref
- * @param max_nslaves Upper limit for the number of slaves
- * @param max_slave_rlag Maximum allowed replication lag for any slave
- * @param select_criteria Slave selection criteria
- * @param session Client session
- * @param router Router instance
- * @return true, if at least one master and one slave was found.
- */
-static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
-                                           backend_ref_t *backend_ref,
-                                           int router_nservers, int max_nslaves,
-                                           int max_slave_rlag,
-                                           select_criteria_t select_criteria,
-                                           SESSION *session,
-                                           ROUTER_INSTANCE *router)
-{
-    if (p_master_ref == NULL || backend_ref == NULL)
+                if (end - ptr > 8 && strncasecmp(ptr, "session.", 8) == 0)
+                {
+                    ptr += 8;
+                }
+                else if (end - ptr > 6 && strncasecmp(ptr, "local.", 6) == 0)
+                {
+                    ptr += 6;
+                }
+            }
+
+            name = ptr;
+            ptr = sescmd_skip_name(ptr, end);
+            name_len = ptr - name;
+            ptr = sescmd_skip_space(ptr, end);
+
+            if (name_len == 0 || ptr == end)
+            {
+                return NULL;
+            }
+            else if (*ptr == '=')
+            {
+                ptr++;
+            }
+            else if (end - ptr > 1 && ptr[0] == ':' && ptr[1] == '=')
+            {
+                ptr += 2;
+            }
+            else
+            {
+                return NULL;
+            }
+
+            ptr = sescmd_skip_constant(sescmd_skip_space(ptr, end), end);
+        }
+    }
+
+    /** Anything after the constant makes the command too complex */
+    if (name == NULL || ptr == NULL)
     {
-        MXS_ERROR("Master reference (%p) or backend reference (%p) is NULL.",
-                  p_master_ref, backend_ref);
-        ss_dassert(false);
-        return false;
+        return NULL;
+    }
+    else if (ptr < end && *ptr == ';')
+    {
+        ptr = sescmd_skip_space(ptr + 1, end);
     }
 
-    /* get the root Master */
-    BACKEND *master_host = get_root_master(backend_ref, router_nservers);
+    if (ptr != end)
+    {
+        return NULL;
+    }
 
-    if (router->rwsplit_config.rw_master_failure_mode == RW_FAIL_INSTANTLY &&
-        (master_host == NULL || SERVER_IS_DOWN(master_host->backend_server)))
+    /** Variable names are case-insensitive, USE stays in upper case */
+    char *key = strndup(name, name_len);
+
+    for (int i = 0; key && !is_use && i < name_len; i++)
     {
-        MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
-        return false;
+        key[i] = tolower(key[i]);
     }
 
-    /**
-     * Existing session : master is already chosen and connected.
-     * The function was called because new slave must be selected to replace
-     * failed one.
-     */
-    bool master_connected = *p_master_ref != NULL;
+    return key;
+}
 
-    /** Check slave selection criteria and set compare function */
-    int (*p)(const void *, const void *) = criteria_cmpfun[select_criteria];
-    ss_dassert(p);
+/**
+ * Check whether a session command of the history can be removed from it. It
+ * can be if a later command sets the same state and only commands that set
+ * state to constants are executed between the two, so nothing reads the
+ * state the command set. The preparation of a statement that the client has
+ * closed can always be removed. All backends in use must have processed the
+ * reply to a later command, so that none of them waits for the command or has
+ * its cursor at it, or must not have been sent the command yet.
+ *
+ * @param rses The router session
+ * @param prop The session command property
+ * @return True if the command can be removed
+ */
+static bool sescmd_is_superseded(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
+{
+    mysql_sescmd_t *scmd = &prop->rses_prop_data.sescmd;
+    rses_property_t *next;
 
-    /** Sort the pointer list to servers according to slave selection criteria.
-     * The servers that match the criteria the best are at the beginning of
-     * the list. */
-    qsort(backend_ref, (size_t) router_nservers, sizeof(backend_ref_t), p);
+    if (scmd->my_sescmd_pstmt ? scmd->my_sescmd_pstmt->pstmt_state != PREP_STMT_DROPPED :
+        scmd->my_sescmd_key == NULL)
+    {
+        return false;
+    }
 
-    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        log_server_connections(select_criteria, backend_ref, router_nservers);
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        sescmd_cursor_t *scur = &bref->bref_sescmd_cur;
+
+        /** A backend that has not been sent the command yet does not need it */
+        if (BREF_IS_IN_USE(bref) && scur->position <= scmd->position &&
+            (scur->scmd_cur_active || scur->scmd_cur_sent >= scmd->position))
+        {
+            return false;
+        }
     }
 
-    int slaves_found = 0;
-    int slaves_connected = 0;
-    const int min_nslaves = 0; /*< not configurable at the time */
-    bool succp = false;
+    if (scmd->my_sescmd_pstmt)
+    {
+        return true;
+    }
 
-    /**
-     * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves
-     * servers from the sorted list. First master found is selected.
-     */
-    for (int i = 0; i < router_nservers &&
-         (slaves_connected < max_nslaves || !master_connected); i++)
+    for (next = prop->rses_prop_next; next; next = next->rses_prop_next)
     {
-        SERVER *serv = backend_ref[i].bref_backend->backend_server;
+        char *key = next->rses_prop_data.sescmd.my_sescmd_key;
 
-        if (!BREF_HAS_FAILED(&backend_ref[i]) && SERVER_IS_RUNNING(serv))
+        if (key == NULL)
         {
-            /* check also for relay servers and don't take the master_host */
-            if (slaves_found < max_nslaves &&
-                (max_slave_rlag == MAX_RLAG_UNDEFINED ||
-                 (serv->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                  serv->rlag <= max_slave_rlag)) &&
-                (SERVER_IS_SLAVE(serv) || SERVER_IS_RELAY_SERVER(serv)) &&
-                (master_host == NULL || (serv != master_host->backend_server)))
-            {
-                slaves_found += 1;
+            return false;
+        }
+        else if (strcmp(key, scmd->my_sescmd_key) == 0)
+        {
+            return true;
+        }
+    }
 
-                if (BREF_IS_IN_USE((&backend_ref[i])) ||
-                    connect_server(&backend_ref[i], session, true))
-                {
-                    slaves_connected += 1;
-                }
-            }
-                /* take the master_host for master */
-            else if (master_host && (serv == master_host->backend_server))
-            {
-                /** p_master_ref must be assigned with this backend_ref pointer
-                 * because its original value may have been lost when backend
-                 * references were sorted with qsort. */
-                *p_master_ref = &backend_ref[i];
+    return false;
+}
 
-                if (!master_connected)
-                {
-                    if (connect_server(&backend_ref[i], session, false))
-                    {
-                        master_connected = true;
-                    }
-                }
-            }
-        }
-    } /*< for */
+/**
+ * Remove the session commands whose effect a later command replaces from the
+ * history. This keeps the history, and the time it takes to execute it in a
+ * new backend, proportional to the amount of distinct session state when the
+ * same variables are set repeatedly, or statements are prepared and closed
+ * for each execution. The cursors of the backends that are not
+ * in use are reset, they are reset anyway before the history is executed.
+ *
+ * The caller must hold the lock of the router session.
+ *
+ * @param rses The router session
+ */
+static void sescmd_compact_history(ROUTER_CLIENT_SES *rses)
+{
+    rses_property_t **pp = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
 
-    /**
-     * Successful cases
-     */
-    if (slaves_connected >= min_nslaves && slaves_connected <= max_nslaves)
+    while (*pp)
     {
-        succp = true;
+        rses_property_t *prop = *pp;
 
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        if (sescmd_is_superseded(rses, prop))
         {
-            if (slaves_connected < max_nslaves)
+            for (int i = 0; i < rses->rses_nbackends; i++)
             {
-                MXS_INFO("Couldn't connect to maximum number of "
-                         "slaves. Connected successfully to %d slaves "
-                         "of %d of them.", slaves_connected, slaves_found);
-            }
+                sescmd_cursor_t *scur = &rses->rses_backend_ref[i].bref_sescmd_cur;
 
-            for (int i = 0; i < router_nservers; i++)
-            {
-                if (BREF_IS_IN_USE((&backend_ref[i])))
+                if (scur->scmd_cur_ptr_property == &prop->rses_prop_next ||
+                    scur->scmd_cur_cmd == &prop->rses_prop_data.sescmd)
                 {
-                    MXS_INFO("Selected %s in \t%s:%d",
-                             STRSRVSTATUS(backend_ref[i].bref_backend->backend_server),
-                             backend_ref[i].bref_backend->backend_server->name,
-                             backend_ref[i].bref_backend->backend_server->port);
+                    ss_dassert(!BREF_IS_IN_USE(&rses->rses_backend_ref[i]));
+                    scur->scmd_cur_ptr_property = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+                    scur->scmd_cur_cmd = NULL;
+                    scur->scmd_cur_active = false;
+                    scur->scmd_cur_sent = -1;
                 }
-            } /* for */
-        }
-    }
-        /** Failure cases */
-    else
-    {
-        if (slaves_connected < min_nslaves)
-        {
-            MXS_ERROR("Couldn't establish required amount of "
-                      "slave connections for router session.");
-        }
+            }
 
-        /** Clean up connections */
-        for (int i = 0; i < router_nservers; i++)
-        {
-            if (BREF_IS_IN_USE((&backend_ref[i])))
+            if (prop->rses_prop_data.sescmd.my_sescmd_pstmt)
             {
-                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
-
-                /** disconnect opened connections */
-                bref_clear_state(&backend_ref[i], BREF_IN_USE);
-                /** Decrease backend's connection counter. */
-                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
-                dcb_close(backend_ref[i].bref_dcb);
+                MXS_DEBUG("Removing the preparation of closed statement %u from "
+                          "the history.", prop->rses_prop_data.sescmd.my_sescmd_pstmt->pstmt_id);
+            }
+            else
+            {
+                MXS_DEBUG("Removing superseded session command that sets '%s' from "
+                          "the history.", prop->rses_prop_data.sescmd.my_sescmd_key);
             }
+            *pp = prop->rses_prop_next;
+            rses_property_done(prop);
+            atomic_add(&rses->rses_nsescmd, -1);
+        }
+        else
+        {
+            pp = &prop->rses_prop_next;
         }
     }
-
-    return succp;
 }
 
 /**
- * Create a generic router session property strcture.
+ * Check whether a statement calls a stored procedure
+ *
+ * @param buf   A COM_QUERY or COM_STMT_PREPARE packet
+ * @return True if the statement is a CALL
  */
-static rses_property_t *rses_property_init(rses_property_type_t prop_type)
+static bool is_call_query(GWBUF *buf)
 {
-    rses_property_t *prop;
+    const char *ptr;
+    int len;
 
-    prop = (rses_property_t *)calloc(1, sizeof(rses_property_t));
-    if (prop == NULL)
+    if (!modutil_get_SQL_view(buf, &ptr, &len))
     {
-        MXS_ERROR("Error: Malloc returned NULL. (%s:%d)", __FILE__, __LINE__);
-        return NULL;
+        return false;
     }
-    prop->rses_prop_type = prop_type;
-#if defined(SS_DEBUG)
-    prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-    prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
-#endif
 
-    CHK_RSES_PROP(prop);
-    return prop;
+    const char *end = ptr + len;
+    ptr = sescmd_skip_space(ptr, end);
+
+    return sescmd_skip_word(&ptr, end, "CALL");
+}
+
+/** Whether the variable is one of those that SET NAMES sets */
+static bool sescmd_key_is_charset(const char *key)
+{
+    return strcmp(key, "names") == 0 || strncmp(key, "character_set_", 14) == 0 ||
+        strncmp(key, "collation_", 10) == 0;
+}
+
+/** Whether the variable is one of the names of the transaction isolation level */
+static bool sescmd_key_is_isolation(const char *key)
+{
+    return strcmp(key, "tx_isolation") == 0 || strcmp(key, "transaction_isolation") == 0;
 }
 
 /**
- * Property is freed at the end of router client session.
+ * Check whether setting one piece of the session state can change another
  */
-static void rses_property_done(rses_property_t *prop)
+static bool sescmd_keys_conflict(const char *a, const char *b)
 {
-    if (prop == NULL)
+    return (sescmd_key_is_charset(a) && sescmd_key_is_charset(b)) ||
+        (sescmd_key_is_isolation(a) && sescmd_key_is_isolation(b));
+}
+
+/**
+ * Check whether a session command would set the session state to the value
+ * it already has. This is the case if the latest command in the history that
+ * sets the same state is identical to it and succeeded, and no statement that
+ * was routed after it can have changed the state.
+ *
+ * The caller must hold the lock of the router session.
+ *
+ * @param rses          Router client session
+ * @param querybuf      The session command
+ * @param packet_type   Type of the command
+ * @return True if the command does not need to be routed
+ */
+static bool sescmd_is_redundant(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                unsigned char packet_type)
+{
+    mysql_sescmd_t *match = NULL;
+    char *key;
+
+    if (rses->rses_state_untracked || rses->rses_config.rw_disable_sescmd_hist ||
+        (key = sescmd_get_key(querybuf, packet_type)) == NULL)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        return false;
     }
-    CHK_RSES_PROP(prop);
 
-    switch (prop->rses_prop_type)
+    for (rses_property_t *prop = rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+         prop; prop = prop->rses_prop_next)
     {
-        case RSES_PROP_TYPE_SESCMD:
-            mysql_sescmd_done(&prop->rses_prop_data.sescmd);
-            break;
+        mysql_sescmd_t *scmd = &prop->rses_prop_data.sescmd;
 
-        case RSES_PROP_TYPE_TMPTABLES:
-            hashtable_free(prop->rses_prop_data.temp_tables);
-            break;
+        if (scmd->position < rses->rses_state_known_pos)
+        {
+            continue;
+        }
+        else if (scmd->my_sescmd_key == NULL)
+        {
+            match = NULL;
+        }
+        else if (strcmp(scmd->my_sescmd_key, key) == 0)
+        {
+            match = scmd;
+        }
+        else if (match && sescmd_keys_conflict(scmd->my_sescmd_key, key))
+        {
+            match = NULL;
+        }
+    }
 
-        default:
-            MXS_DEBUG("%lu [rses_property_done] Unknown property type %d "
-                      "in property %p", pthread_self(), prop->rses_prop_type, prop);
+    free(key);
 
-            ss_dassert(false);
-            break;
+    if (match == NULL || !match->my_sescmd_is_replied || match->reply_cmd != 0x00)
+    {
+        return false;
     }
-    free(prop);
+
+    /** The sequence number is not compared */
+    GWBUF *prev = match->my_sescmd_buf;
+    size_t len = GWBUF_LENGTH(querybuf);
+
+    return prev->next == NULL && querybuf->next == NULL &&
+        GWBUF_LENGTH(prev) == len && len > MYSQL_HEADER_LEN &&
+        memcmp(GWBUF_DATA(prev), GWBUF_DATA(querybuf), 3) == 0 &&
+        memcmp((uint8_t*)GWBUF_DATA(prev) + MYSQL_HEADER_LEN,
+               (uint8_t*)GWBUF_DATA(querybuf) + MYSQL_HEADER_LEN,
+               len - MYSQL_HEADER_LEN) == 0;
 }
 
 /**
- * Add property to the router_client_ses structure's rses_properties
- * array. The slot is determined by the type of property.
- * In each slot there is a list of properties of similar type.
- *
- * Router client session must be locked.
+ * Check whether any backend still has to reply to the session. A reply
+ * that is sent locally must not overtake them.
  */
-static int rses_property_add(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
+static bool rses_has_pending_replies(ROUTER_CLIENT_SES *rses)
 {
-    if (rses == NULL)
-    {
-        MXS_ERROR("Router client session is NULL. (%s:%d)", __FILE__, __LINE__);
-        return -1;
-    }
-    if (prop == NULL)
+    if (rses->rses_causal_query)
     {
-        MXS_ERROR("Router client session property is NULL. (%s:%d)", __FILE__, __LINE__);
-        return -1;
+        return true;
     }
-    rses_property_t *p;
-
-    CHK_CLIENT_RSES(rses);
-    CHK_RSES_PROP(prop);
-    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
-
-    prop->rses_prop_rsession = rses;
-    p = rses->rses_properties[prop->rses_prop_type];
 
-    if (p == NULL)
-    {
-        rses->rses_properties[prop->rses_prop_type] = prop;
-    }
-    else
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        while (p->rses_prop_next != NULL)
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) &&
+            (BREF_IS_WAITING_RESULT(bref) || bref->bref_pending_cmd ||
+             sescmd_cursor_is_active(&bref->bref_sescmd_cur)))
         {
-            p = p->rses_prop_next;
+            return true;
         }
-        p->rses_prop_next = prop;
     }
-    return 0;
+
+    return false;
 }
 
 /**
- * Router session must be locked.
- * Return session command pointer if succeed, NULL if failed.
+ * Send an OK packet to the client as the reply to a session command
+ *
+ * @param rses  Router client session
+ * @return True if the packet was written
  */
-static mysql_sescmd_t *rses_property_get_sescmd(rses_property_t *prop)
+static bool send_sescmd_ok(ROUTER_CLIENT_SES *rses)
 {
-    mysql_sescmd_t *sescmd;
+    uint8_t status = 0;
 
-    if (prop == NULL)
+    if (rses->rses_autocommit_enabled)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return NULL;
+        status |= 0x02;
     }
 
-    CHK_RSES_PROP(prop);
-    ss_dassert(prop->rses_prop_rsession == NULL ||
-               SPINLOCK_IS_LOCKED(&prop->rses_prop_rsession->rses_lock));
+    if (rses->rses_transaction_active)
+    {
+        status |= 0x01;
+    }
 
-    sescmd = &prop->rses_prop_data.sescmd;
+    uint8_t ok[] = {7, 0, 0, 1, 0x00, 0, 0, status, 0, 0, 0};
+    GWBUF *buf = gwbuf_alloc_and_load(sizeof(ok), ok);
 
-    if (sescmd != NULL)
+    if (buf == NULL)
     {
-        CHK_MYSQL_SESCMD(sescmd);
+        MXS_ERROR("Memory allocation failed when creating an OK packet.");
+        return false;
     }
-    return sescmd;
+
+    return rses->client_dcb->func.write(rses->client_dcb, buf);
 }
 
 /**
- * Create session command property.
+ * Reply to a session command that would not change the session state
+ * without routing it to the backends
+ *
+ * @param rses          Router client session
+ * @param querybuf      The session command
+ * @param packet_type   Type of the command
+ * @param succp         Set to the result of the reply if the command was replied to
+ * @return True if the command was replied to and must not be routed
  */
-static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
-                                         GWBUF *sescmd_buf,
-                                         unsigned char packet_type,
-                                         ROUTER_CLIENT_SES *rses)
+static bool route_redundant_sescmd(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                   unsigned char packet_type, bool *succp)
 {
-    mysql_sescmd_t *sescmd;
-
-    CHK_RSES_PROP(rses_prop);
-    /** Can't call rses_property_get_sescmd with uninitialized sescmd */
-    sescmd = &rses_prop->rses_prop_data.sescmd;
-    sescmd->my_sescmd_prop = rses_prop; /*< reference to owning property */
-#if defined(SS_DEBUG)
-    sescmd->my_sescmd_chk_top = CHK_NUM_MY_SESCMD;
-    sescmd->my_sescmd_chk_tail = CHK_NUM_MY_SESCMD;
-#endif
-    /** Set session command buffer */
-    sescmd->my_sescmd_buf = sescmd_buf;
-    sescmd->my_sescmd_packet_type = packet_type;
-    sescmd->position = atomic_add(&rses->pos_generator, 1);
+    bool redundant = false;
 
-    return sescmd;
-}
+    if (rses->rses_config.rw_skip_redundant_sescmd &&
+        rses_begin_locked_router_action(rses))
+    {
+        redundant = !rses_has_pending_replies(rses) &&
+            sescmd_is_redundant(rses, querybuf, packet_type);
+        rses_end_locked_router_action(rses);
+    }
 
-static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
-{
-    if (sescmd == NULL)
+    if (redundant)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        MXS_INFO("Session command does not change the session state, "
+                 "replying to it without routing.");
+        *succp = send_sescmd_ok(rses);
     }
-    CHK_RSES_PROP(sescmd->my_sescmd_prop);
-    gwbuf_free(sescmd->my_sescmd_buf);
-    memset(sescmd, 0, sizeof(mysql_sescmd_t));
+
+    return redundant;
 }
 
 /**
@@ -3347,6 +5365,11 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
     {
         bref->reply_cmd = *((unsigned char *)replybuf->start + 4);
         scur->position = scmd->position;
+
+        if (scmd->my_sescmd_pstmt)
+        {
+            prep_stmt_store_reply(ses, scmd->my_sescmd_pstmt, bref, replybuf);
+        }
         /** Faster backend has already responded to client : discard */
         if (scmd->my_sescmd_is_replied)
         {
@@ -3401,6 +5424,12 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
             scmd->my_sescmd_is_replied = true;
             scmd->reply_cmd = *((unsigned char *)replybuf->start + 4);
 
+            if (scmd->my_sescmd_pstmt)
+            {
+                /** The client uses the id in this reply */
+                prep_stmt_publish(ses, scmd->my_sescmd_pstmt, bref, replybuf);
+            }
+
             MXS_INFO("Server '%s' responded to a session command, sending the response "
                      "to the client.", bref->bref_backend->backend_server->unique_name);
 
@@ -3508,26 +5537,6 @@ static void sescmd_cursor_set_active(sescmd_cursor_t *sescmd_cursor,
     sescmd_cursor->scmd_cur_active = value;
 }
 
-/**
- * Clone session command's command buffer.
- * Router session must be locked
- */
-static GWBUF *sescmd_cursor_clone_querybuf(sescmd_cursor_t *scur)
-{
-    GWBUF *buf;
-    if (scur == NULL)
-    {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return NULL;
-    }
-    ss_dassert(scur->scmd_cur_cmd != NULL);
-
-    buf = gwbuf_clone_all(scur->scmd_cur_cmd->my_sescmd_buf);
-
-    CHK_GWBUF(buf);
-    return buf;
-}
-
 static bool sescmd_cursor_history_empty(sescmd_cursor_t *scur)
 {
     bool succp;
@@ -3567,6 +5576,7 @@ static void sescmd_cursor_reset(sescmd_cursor_t *scur)
 
     CHK_RSES_PROP((*scur->scmd_cur_ptr_property));
     scur->scmd_cur_active = false;
+    scur->scmd_cur_sent = -1;
     scur->scmd_cur_cmd = &(*scur->scmd_cur_ptr_property)->rses_prop_data.sescmd;
 }
 
@@ -3593,6 +5603,55 @@ static bool execute_sescmd_history(backend_ref_t *bref)
     return succp;
 }
 
+/**
+ * Write a session command to a backend.
+ *
+ * @param dcb  The backend DCB
+ * @param scmd The session command
+ * @return 1 on success, 0 on error
+ */
+static int sescmd_write(DCB *dcb, mysql_sescmd_t *scmd)
+{
+    GWBUF *buf;
+    int rc;
+
+    /**
+     * Mark session command buffer, it triggers writing
+     * MySQL command to protocol
+     */
+    gwbuf_set_type(scmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
+    buf = gwbuf_clone_all(scmd->my_sescmd_buf);
+
+    switch (scmd->my_sescmd_packet_type)
+    {
+        case MYSQL_COM_CHANGE_USER:
+            rc = dcb->func.auth(dcb, NULL, dcb->session, buf);
+            break;
+
+        case MYSQL_COM_INIT_DB:
+        {
+            /**
+             * Record database name and store to session.
+             */
+            MYSQL_session *data = dcb->session->client_dcb->data;
+            unsigned int qlen = MYSQL_GET_PACKET_LEN((unsigned char *)scmd->my_sescmd_buf->start);
+
+            memset(data->db, 0, MYSQL_DATABASE_MAXLEN + 1);
+            if (qlen > 0 && qlen < MYSQL_DATABASE_MAXLEN + 1)
+            {
+                strncpy(data->db, (char *)scmd->my_sescmd_buf->start + 5, qlen - 1);
+            }
+        }
+        /** Fallthrough */
+        case MYSQL_COM_QUERY:
+        default:
+            rc = dcb->func.write(dcb, buf);
+            break;
+    }
+
+    return rc;
+}
+
 /**
  * If session command cursor is passive, sends the command to backend for
  * execution.
@@ -3607,9 +5666,8 @@ static bool execute_sescmd_in_backend(backend_ref_t *backend_ref)
 {
     DCB *dcb;
     bool succp;
-    int rc = 0;
     sescmd_cursor_t *scur;
-    GWBUF *buf;
+    rses_property_t *prop;
     if (backend_ref == NULL)
     {
         MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
@@ -3645,54 +5703,36 @@ static bool execute_sescmd_in_backend(backend_ref_t *backend_ref)
         sescmd_cursor_set_active(scur, true);
     }
 
-    switch (scur->scmd_cur_cmd->my_sescmd_packet_type)
+    /**
+     * Send all commands that have not been sent yet without waiting for
+     * the replies to the earlier ones. The backend protocol queues the
+     * commands and the replies are matched to them in order.
+     */
+    succp = true;
+
+    for (prop = *scur->scmd_cur_ptr_property; prop && succp; prop = prop->rses_prop_next)
     {
-        case MYSQL_COM_CHANGE_USER:
-            /** This makes it possible to handle replies correctly */
-            gwbuf_set_type(scur->scmd_cur_cmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
-            buf = sescmd_cursor_clone_querybuf(scur);
-            rc = dcb->func.auth(dcb, NULL, dcb->session, buf);
-            break;
+        mysql_sescmd_t *scmd = &prop->rses_prop_data.sescmd;
 
-        case MYSQL_COM_INIT_DB:
+        if (scmd->position <= scur->scmd_cur_sent)
         {
-            /**
-             * Record database name and store to session.
-             */
-            GWBUF *tmpbuf;
-            MYSQL_session *data;
-            unsigned int qlen;
-
-            data = dcb->session->client_dcb->data;
-            tmpbuf = scur->scmd_cur_cmd->my_sescmd_buf;
-            qlen = MYSQL_GET_PACKET_LEN((unsigned char *)tmpbuf->start);
-            memset(data->db, 0, MYSQL_DATABASE_MAXLEN + 1);
-            if (qlen > 0 && qlen < MYSQL_DATABASE_MAXLEN + 1)
-            {
-                strncpy(data->db, tmpbuf->start + 5, qlen - 1);
-            }
+            continue;
         }
-        /** Fallthrough */
-        case MYSQL_COM_QUERY:
-        default:
-            /**
-             * Mark session command buffer, it triggers writing
-             * MySQL command to protocol
-             */
-
-            gwbuf_set_type(scur->scmd_cur_cmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
-            buf = sescmd_cursor_clone_querybuf(scur);
-            rc = dcb->func.write(dcb, buf);
+        else if (scmd->my_sescmd_packet_type == MYSQL_COM_CHANGE_USER &&
+                 scmd != scur->scmd_cur_cmd)
+        {
+            /** A user change is sent once the earlier commands are replied */
             break;
-    }
+        }
 
-    if (rc == 1)
-    {
-        succp = true;
-    }
-    else
-    {
-        succp = false;
+        succp = sescmd_write(dcb, scmd) == 1;
+        scur->scmd_cur_sent = scmd->position;
+
+        if (scmd->my_sescmd_packet_type == MYSQL_COM_CHANGE_USER)
+        {
+            /** Nothing is sent after a user change before its reply */
+            break;
+        }
     }
 return_succp:
     return succp;
@@ -3767,8 +5807,254 @@ static bool sescmd_cursor_next(sescmd_cursor_t *scur)
     {
         ss_dassert(false); /*< Log error, sescmd shouldn't be NULL */
     }
-return_succp:
-    return succp;
+return_succp:
+    return succp;
+}
+
+/**
+ * Check whether the session commands of a session are executed in the slaves
+ * only when they are next used. This requires that the master reports the
+ * state changes, so that those made by other statements are seen as well.
+ * The history is needed to catch the slaves up, and a slave that waits for a
+ * causal read can't execute commands before the wait.
+ *
+ * @param rses Router client session
+ * @return True if the slaves are caught up lazily
+ */
+static bool rses_tracks_state(ROUTER_CLIENT_SES *rses)
+{
+    backend_ref_t *master = rses->rses_master_ref;
+
+    return rses->rses_config.rw_session_state_tracking &&
+           !rses->rses_config.rw_disable_sescmd_hist &&
+           !rses->rses_config.rw_causal_reads &&
+           master && BREF_IS_IN_USE(master) && !BREF_IS_CLOSED(master) &&
+           modutil_tracks_session_state(master->bref_dcb);
+}
+
+/**
+ * Check whether read-only statements are prepared in the slaves only when they
+ * are next used. The preparations stay in the history in the order they were
+ * made, so that a slave that catches up resolves the names in them the same
+ * way the master did.
+ *
+ * @param rses Router client session
+ * @return True if the slaves prepare the statements lazily
+ */
+static bool rses_prepares_lazily(ROUTER_CLIENT_SES *rses)
+{
+    backend_ref_t *master = rses->rses_master_ref;
+
+    return rses->rses_config.rw_lazy_prepare &&
+           !rses->rses_config.rw_disable_sescmd_hist &&
+           !rses->rses_config.rw_causal_reads &&
+           master && BREF_IS_IN_USE(master) && !BREF_IS_CLOSED(master);
+}
+
+/**
+ * Send the session commands a backend has not yet executed to it before it is
+ * used. The commands are pipelined and the statement routed to the backend is
+ * left pending until they have been replied to. The router session must be
+ * locked.
+ *
+ * @param bref Backend reference
+ */
+static void sescmd_catch_up(backend_ref_t *bref)
+{
+    sescmd_cursor_t *scur = &bref->bref_sescmd_cur;
+    rses_property_t *prop = *scur->scmd_cur_ptr_property;
+
+    if (BREF_IS_IN_USE(bref) && !BREF_IS_CLOSED(bref) && !sescmd_cursor_is_active(scur) &&
+        prop && prop->rses_prop_data.sescmd.position > scur->scmd_cur_sent)
+    {
+        MXS_INFO("Executing the session commands that '%s' has not yet executed.",
+                 bref->bref_backend->backend_server->unique_name);
+        bref_set_state(bref, BREF_WAITING_RESULT);
+
+        if (!execute_sescmd_in_backend(bref))
+        {
+            MXS_ERROR("Failed to execute session command in %s:%d",
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+        }
+    }
+}
+
+/**
+ * Add a session command that a backend has already executed to the history.
+ * The other backends execute it when they are next used.
+ *
+ * @param rses          Router client session
+ * @param bref          The backend that executed the command
+ * @param buf           The command, owned by the history afterwards
+ * @param packet_type   Type of the command
+ */
+static void sescmd_add_executed(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                                GWBUF *buf, unsigned char packet_type)
+{
+    sescmd_cursor_t *scur = &bref->bref_sescmd_cur;
+    bool at_end = !sescmd_cursor_is_active(scur) && *scur->scmd_cur_ptr_property == NULL;
+    rses_property_t *prop = rses_property_init(RSES_PROP_TYPE_SESCMD);
+
+    if (prop == NULL)
+    {
+        gwbuf_free(buf);
+        return;
+    }
+
+    mysql_sescmd_t *scmd = mysql_sescmd_init(prop, buf, packet_type, rses);
+    scmd->my_sescmd_is_replied = true;
+    scmd->reply_cmd = 0x00;
+    rses_property_add(rses, prop);
+    atomic_add(&rses->rses_nsescmd, 1);
+
+    if (at_end)
+    {
+        /** The cursor is moved past the command as if it had executed it */
+        scur->scmd_cur_ptr_property = &prop->rses_prop_next;
+        scur->scmd_cur_cmd = scmd;
+        scur->position = scmd->position;
+        scur->scmd_cur_sent = scmd->position;
+    }
+
+    sescmd_compact_history(rses);
+}
+
+/**
+ * Check whether a system variable name can be put in a SET statement as is
+ */
+static bool sescmd_name_is_valid(const char *name, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+        {
+            return false;
+        }
+    }
+    return len > 0;
+}
+
+/**
+ * Build a statement that sets a system variable to the value that the master
+ * reported for it. Numeric values are left unquoted.
+ *
+ * @param change The state change
+ * @return The statement or NULL on error
+ */
+static GWBUF *sescmd_create_set(const MODUTIL_STATE_CHANGE *change)
+{
+    char sql[sizeof("SET SESSION  = ''") + change->name_len + change->value_len * 2];
+    char *ptr = sql;
+    bool numeric = change->value_len > 0;
+
+    for (size_t i = 0; i < change->value_len; i++)
+    {
+        if (!isdigit((unsigned char)change->value[i]))
+        {
+            numeric = false;
+        }
+    }
+
+    ptr += sprintf(ptr, "SET SESSION %.*s = ", (int)change->name_len, change->name);
+
+    if (!numeric)
+    {
+        *ptr++ = '\'';
+    }
+
+    for (size_t i = 0; i < change->value_len; i++)
+    {
+        if (change->value[i] == '\'' || change->value[i] == '\\')
+        {
+            *ptr++ = '\\';
+        }
+        *ptr++ = change->value[i];
+    }
+
+    if (!numeric)
+    {
+        *ptr++ = '\'';
+    }
+    *ptr = '\0';
+
+    return modutil_create_query(sql);
+}
+
+/**
+ * Build a COM_INIT_DB that changes to the database the master reported
+ */
+static GWBUF *sescmd_create_init_db(const MODUTIL_STATE_CHANGE *change)
+{
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + change->value_len);
+
+    if (buf)
+    {
+        uint8_t *data = GWBUF_DATA(buf);
+        gw_mysql_set_byte3(data, change->value_len + 1);
+        data[3] = 0;
+        data[4] = MYSQL_COM_INIT_DB;
+        memcpy(data + MYSQL_HEADER_LEN + 1, change->value, change->value_len);
+        gwbuf_set_type(buf, GWBUF_TYPE_MYSQL | GWBUF_TYPE_SINGLE_STMT);
+    }
+
+    return buf;
+}
+
+/** The most state changes of one OK packet that are replicated */
+#define SESCMD_MAX_TRACKED 16
+
+/**
+ * Replicate the session state changes that the master reported for a
+ * statement that was not routed as a session command, such as a call of a
+ * procedure that changes the database or sets system variables. Only the
+ * changes themselves are added to the history, not the statement. Other
+ * state, such as user variables, is only reported as changed and can't be
+ * replicated. The router session must be locked.
+ *
+ * @param rses  Router client session
+ * @param bref  The master
+ * @param reply The first part of the reply of the master
+ */
+static void sescmd_add_tracked(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *reply)
+{
+    MODUTIL_STATE_CHANGE changes[SESCMD_MAX_TRACKED];
+    uint8_t *data = GWBUF_DATA(reply);
+    size_t len;
+    int n;
+
+    /** An OK packet that reports state changes is a single short packet */
+    if (GWBUF_LENGTH(reply) < MYSQL_HEADER_LEN + 1 || data[MYSQL_HEADER_LEN] != 0x00 ||
+        (len = MYSQL_GET_PACKET_LEN(data) + MYSQL_HEADER_LEN) > GWBUF_LENGTH(reply) ||
+        (n = modutil_get_state_changes(data, len, changes, SESCMD_MAX_TRACKED)) <= 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        GWBUF *buf = NULL;
+        unsigned char packet_type = MYSQL_COM_QUERY;
+
+        if (changes[i].type == MODUTIL_TRACK_SYSTEM_VARIABLES &&
+            sescmd_name_is_valid(changes[i].name, changes[i].name_len))
+        {
+            buf = sescmd_create_set(&changes[i]);
+        }
+        else if (changes[i].type == MODUTIL_TRACK_SCHEMA &&
+                 changes[i].value_len <= MYSQL_DATABASE_MAXLEN)
+        {
+            buf = sescmd_create_init_db(&changes[i]);
+            packet_type = MYSQL_COM_INIT_DB;
+        }
+
+        if (buf)
+        {
+            MXS_INFO("Master '%s' reported a session state change, replicating it "
+                     "to the slaves.", bref->bref_backend->backend_server->unique_name);
+            sescmd_add_executed(rses, bref, buf, packet_type);
+        }
+    }
 }
 
 static rses_property_t *mysql_sescmd_get_property(mysql_sescmd_t *scmd)
@@ -3832,11 +6118,16 @@ static void tracelog_routed_query(ROUTER_CLIENT_SES *rses, char *funcname,
 }
 
 /**
- * Return RCAP_TYPE_STMT_INPUT.
+ * Return RCAP_TYPE_STMT_INPUT and RCAP_TYPE_RESULT_STREAM. Only the replies
+ * to session commands are inspected packet by packet, and the backend
+ * protocol always splits those into complete packets. The result sets the
+ * router reads itself are parsed for both formats so RCAP_TYPE_DEPRECATE_EOF
+ * is returned as well.
  */
 static int getCapabilities()
 {
-    return RCAP_TYPE_STMT_INPUT;
+    return RCAP_TYPE_STMT_INPUT | RCAP_TYPE_RESULT_STREAM | RCAP_TYPE_DEPRECATE_EOF |
+           RCAP_TYPE_STREAM_INPUT;
 }
 
 /**
@@ -3854,6 +6145,8 @@ static int getCapabilities()
  * @param inst          Router instance
  * @param packet_type       Type of MySQL packet
  * @param qtype         Query type from query_classifier
+ * @param pstmt         The statement that a COM_STMT_PREPARE prepares or NULL,
+ *                      owned by the session command afterwards
  *
  * @return True if at least one backend is used and routing succeed to all
  * backends being used, otherwise false.
@@ -3862,7 +6155,7 @@ static int getCapabilities()
 static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
                                 GWBUF *querybuf, ROUTER_INSTANCE *inst,
                                 unsigned char packet_type,
-                                qc_query_type_t qtype)
+                                qc_query_type_t qtype, prep_stmt_t *pstmt)
 {
     bool succp;
     rses_property_t *prop;
@@ -3871,6 +6164,7 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
     int max_nslaves;
     int nbackends;
     int nsucc;
+    bool lazy;
 
     MXS_INFO("Session write, routing to all servers.");
     /** Maximum number of slaves in this router client session */
@@ -3996,7 +6290,7 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
     {
         MXS_ERROR("Router session property initialization failed");
         rses_end_locked_router_action(router_cli_ses);
-        return false;
+        goto return_succp;
     }
 
     mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
@@ -4006,11 +6300,57 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
     {
         MXS_ERROR("Session property addition failed.");
         rses_end_locked_router_action(router_cli_ses);
-        return false;
+        goto return_succp;
+    }
+
+    if (!router_cli_ses->rses_config.rw_disable_sescmd_hist)
+    {
+        sescmd_compact_history(router_cli_ses);
+    }
+
+    /**
+     * The slaves execute plain statements and database changes when they are
+     * next used. Read-only statements are prepared in them lazily only if
+     * configured, otherwise the replies to prepared statements are needed
+     * from all.
+     */
+    lazy = ((packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_INIT_DB) &&
+            rses_tracks_state(router_cli_ses)) ||
+           (packet_type == MYSQL_COM_STMT_PREPARE && pstmt &&
+            rses_prepares_lazily(router_cli_ses));
+
+    /** The replies to the session command store the ids of the statement */
+    prop->rses_prop_data.sescmd.my_sescmd_pstmt = pstmt;
+    pstmt = NULL;
+
+    /**
+     * A session that connects lazily may have no servers yet. The history,
+     * which now includes this command, is executed in the server that is
+     * connected.
+     */
+    if (router_cli_ses->rses_config.rw_lazy_connect)
+    {
+        for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+        {
+            if (BREF_IS_IN_USE((&backend_ref[i])))
+            {
+                break;
+            }
+        }
+
+        if (i == router_cli_ses->rses_nbackends)
+        {
+            lazy_connect_slave(router_cli_ses, rses_get_max_replication_lag(router_cli_ses));
+        }
     }
 
     for (i = 0; i < router_cli_ses->rses_nbackends; i++)
     {
+        if (lazy && &backend_ref[i] != router_cli_ses->rses_master_ref)
+        {
+            continue;
+        }
+
         if (BREF_IS_IN_USE((&backend_ref[i])))
         {
             sescmd_cursor_t *scur;
@@ -4035,29 +6375,26 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
             bref_set_state(get_bref_from_dcb(router_cli_ses, backend_ref[i].bref_dcb),
                            BREF_WAITING_RESULT);
             /**
-             * Start execution if cursor is not already executing.
-             * Otherwise, cursor will execute pending commands
-             * when it completes with previous commands.
+             * The command is sent even if the cursor is still executing
+             * earlier commands, the replies are processed in order.
              */
             if (sescmd_cursor_is_active(scur))
             {
-                nsucc += 1;
-                MXS_INFO("Backend %s:%d already executing sescmd.",
+                MXS_INFO("Backend %s:%d already executing sescmd, pipelining "
+                         "the command.",
                          backend_ref[i].bref_backend->backend_server->name,
                          backend_ref[i].bref_backend->backend_server->port);
             }
+
+            if (execute_sescmd_in_backend(&backend_ref[i]))
+            {
+                nsucc += 1;
+            }
             else
             {
-                if (execute_sescmd_in_backend(&backend_ref[i]))
-                {
-                    nsucc += 1;
-                }
-                else
-                {
-                    MXS_ERROR("Failed to execute session command in %s:%d",
-                              backend_ref[i].bref_backend->backend_server->name,
-                              backend_ref[i].bref_backend->backend_server->port);
-                }
+                MXS_ERROR("Failed to execute session command in %s:%d",
+                          backend_ref[i].bref_backend->backend_server->name,
+                          backend_ref[i].bref_backend->backend_server->port);
             }
         }
     }
@@ -4068,6 +6405,10 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
     rses_end_locked_router_action(router_cli_ses);
 
 return_succp:
+    if (pstmt)
+    {
+        prep_stmt_done(router_cli_ses, pstmt);
+    }
     /**
      * Routing must succeed to all backends that are used.
      * There must be at leas one and at most max_nslaves+1 backends.
@@ -4149,14 +6490,16 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                 c = GET_SELECT_CRITERIA(value);
                 ss_dassert(c == LEAST_GLOBAL_CONNECTIONS ||
                            c == LEAST_ROUTER_CONNECTIONS || c == LEAST_BEHIND_MASTER ||
-                           c == LEAST_CURRENT_OPERATIONS || c == UNDEFINED_CRITERIA);
+                           c == LEAST_CURRENT_OPERATIONS || c == LEAST_RESPONSE_TIME ||
+                           c == LEAST_CONGESTED || c == UNDEFINED_CRITERIA);
 
                 if (c == UNDEFINED_CRITERIA)
                 {
                     MXS_ERROR("Unknown slave selection criteria \"%s\". "
                                 "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
-                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER,"
-                                "and LEAST_CURRENT_OPERATIONS.",
+                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER, "
+                                "LEAST_CURRENT_OPERATIONS, LEAST_RESPONSE_TIME and "
+                                "LEAST_CONGESTED.",
                                 STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria));
                     success = false;
                 }
@@ -4181,6 +6524,68 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
             {
                 router->rwsplit_config.rw_strict_multi_stmt = config_truth_value(value);
             }
+            else if (strcmp(options[i], "prepared_stmt_routing") == 0)
+            {
+                router->rwsplit_config.rw_route_prep_stmt = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "rebalance_slaves") == 0)
+            {
+                router->rwsplit_config.rw_rebalance_slaves = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "lazy_connect") == 0)
+            {
+                router->rwsplit_config.rw_lazy_connect = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "read_only_trx_to_slave") == 0)
+            {
+                router->rwsplit_config.rw_read_only_trx = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "skip_redundant_sescmd") == 0)
+            {
+                router->rwsplit_config.rw_skip_redundant_sescmd = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "session_state_tracking") == 0)
+            {
+                router->rwsplit_config.rw_session_state_tracking = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "lazy_prepare") == 0)
+            {
+                router->rwsplit_config.rw_lazy_prepare = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "idle_backend_timeout") == 0)
+            {
+                int val = atoi(value);
+
+                if (val >= 0)
+                {
+                    router->rwsplit_config.rw_idle_backend_timeout = val;
+                }
+                else
+                {
+                    MXS_ERROR("Invalid value for 'idle_backend_timeout': %s. The value "
+                              "must be zero or a positive number of seconds.", value);
+                    success = false;
+                }
+            }
+            else if (strcmp(options[i], "causal_reads") == 0)
+            {
+                router->rwsplit_config.rw_causal_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "causal_reads_timeout") == 0)
+            {
+                int val = atoi(value);
+
+                if (val > 0)
+                {
+                    router->rwsplit_config.rw_causal_reads_timeout = val;
+                }
+                else
+                {
+                    MXS_ERROR("Invalid value for 'causal_reads_timeout': %s. "
+                              "The value must be a positive number of seconds.", value);
+                    success = false;
+                }
+            }
             else if (strcmp(options[i], "master_failure_mode") == 0)
             {
                 if (strcasecmp(value, "fail_instantly") == 0)
@@ -4594,7 +6999,6 @@ static bool have_enough_servers(ROUTER_CLIENT_SES **p_rses, const int min_nsrv,
                           (*p_rses)->rses_config.rw_max_slave_conn_percent, dbgpct);
             }
         }
-        free(*p_rses);
         *p_rses = NULL;
         succp = false;
     }
@@ -4748,56 +7152,366 @@ static sescmd_cursor_t *backend_ref_get_sescmd_cursor(backend_ref_t *bref)
     return scur;
 }
 
-#if defined(PREP_STMT_CACHING)
-#define MAX_STMT_LEN 1024
+/** Offset of the statement id in the COM_STMT_* packets and in COM_STMT_PREPARE_OK */
+#define PREP_STMT_ID_OFFSET (MYSQL_HEADER_LEN + 1)
+
+/**
+ * The first id the router gives to a read-only prepared statement. A server
+ * numbers the statements of a connection from one and the statements that
+ * are only prepared in the master keep the id the master gave, so the ids
+ * of the router are taken from the upper half of the range.
+ */
+#define PREP_STMT_FIRST_ID 0x80000000
+
+static int prep_stmt_hashfn(void *key)
+{
+    return *(uint32_t *)key;
+}
+
+static int prep_stmt_cmpfn(void *v1, void *v2)
+{
+    return *(uint32_t *)v1 != *(uint32_t *)v2;
+}
+
+/**
+ * Check whether a statement that is being prepared is executed in slaves.
+ * Such statements are prepared in all backends of the session.
+ *
+ * @param rses  Router client session
+ * @param qtype The type of the statement
+ * @return True if the statement only reads data and can be executed in slaves
+ */
+static bool is_read_only_prep_stmt(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype)
+{
+    /** Reads of temporary tables must go to the master */
+    return rses->rses_config.rw_route_prep_stmt && !rses->have_tmp_tables &&
+           QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+           (qtype & ~READ_ONLY_STMT_TYPES) == 0;
+}
 
-static prep_stmt_t *prep_stmt_init(prep_stmt_type_t type, void *id)
+/**
+ * Allocate a prepared statement. The backends store the ids of the statement
+ * when they reply to the COM_STMT_PREPARE.
+ *
+ * @param rses  Router client session
+ * @param qtype The type of the statement
+ * @return The new statement or NULL if memory allocation failed
+ */
+prep_stmt_t *prep_stmt_init(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype)
 {
     prep_stmt_t *pstmt;
 
+    if (rses->rses_prep_stmt == NULL &&
+        (rses->rses_prep_stmt = hashtable_alloc(16, prep_stmt_hashfn,
+                                                prep_stmt_cmpfn)) == NULL)
+    {
+        MXS_ERROR("Failed to allocate the prepared statement table of the session.");
+        return NULL;
+    }
+
     pstmt = (prep_stmt_t *)calloc(1, sizeof(prep_stmt_t));
 
-    if (pstmt != NULL)
+    if (pstmt == NULL ||
+        (pstmt->pstmt_backend_ids = (uint32_t *)calloc(rses->rses_nbackends,
+                                                       sizeof(uint32_t))) == NULL)
     {
+        MXS_ERROR("Failed to allocate a prepared statement.");
+        free(pstmt);
+        return NULL;
+    }
 #if defined(SS_DEBUG)
-        pstmt->pstmt_chk_top = CHK_NUM_PREP_STMT;
-        pstmt->pstmt_chk_tail = CHK_NUM_PREP_STMT;
+    pstmt->pstmt_chk_top = CHK_NUM_PREP_STMT;
+    pstmt->pstmt_chk_tail = CHK_NUM_PREP_STMT;
 #endif
-        pstmt->pstmt_state = PREP_STMT_ALLOC;
-        pstmt->pstmt_type = type;
+    pstmt->pstmt_state = PREP_STMT_ALLOC;
+    pstmt->pstmt_qtype = qtype;
+
+    CHK_PREP_STMT(pstmt);
+    return pstmt;
+}
+
+/**
+ * Free a prepared statement and remove it from the statements of the session.
+ *
+ * @param rses  Router client session
+ * @param pstmt The statement
+ */
+void prep_stmt_done(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt)
+{
+    CHK_PREP_STMT(pstmt);
+
+    if (pstmt->pstmt_state == PREP_STMT_RECV &&
+        hashtable_fetch(rses->rses_prep_stmt, &pstmt->pstmt_id) == pstmt)
+    {
+        hashtable_delete(rses->rses_prep_stmt, &pstmt->pstmt_id);
+    }
+    free(pstmt->pstmt_backend_ids);
+    free(pstmt);
+}
+
+/**
+ * Store the id that a backend gave to a prepared statement. This is also
+ * done when the preparation is repeated in a reconnected backend. If the
+ * client closed the statement before the backend prepared it, the statement
+ * is closed in the backend right away.
+ *
+ * @param rses  Router client session
+ * @param pstmt The statement
+ * @param bref  The backend that replied
+ * @param reply The reply to the COM_STMT_PREPARE
+ */
+void prep_stmt_store_reply(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                           backend_ref_t *bref, GWBUF *reply)
+{
+    uint8_t id[4];
+
+    if (bref->reply_cmd == 0x00 &&
+        gwbuf_copy_data(reply, PREP_STMT_ID_OFFSET, sizeof(id), id) == sizeof(id))
+    {
+        pstmt->pstmt_backend_ids[bref - rses->rses_backend_ref] = gw_mysql_get_byte4(id);
 
-        if (type == PREP_STMT_NAME)
+        if (pstmt->pstmt_state == PREP_STMT_DROPPED)
         {
-            pstmt->pstmt_id.name = strndup((char *)id, MAX_STMT_LEN);
+            uint8_t data[PREP_STMT_ID_OFFSET + sizeof(id)] = {5, 0, 0, 0, MYSQL_COM_STMT_CLOSE};
+            GWBUF *close;
+
+            memcpy(data + PREP_STMT_ID_OFFSET, id, sizeof(id));
+
+            if ((close = gwbuf_alloc_and_load(sizeof(data), data)) != NULL)
+            {
+                gwbuf_set_type(close, GWBUF_TYPE_MYSQL);
+                bref->bref_dcb->func.write(bref->bref_dcb, close);
+            }
         }
-        else
+    }
+}
+
+/**
+ * Give a prepared statement the id that the client knows it by and put the
+ * id in the reply that is sent to the client. The ids come from a counter of
+ * the session, the ids of the backends are stored with prep_stmt_store_reply()
+ * and the packets that refer to the statement are given the id of their
+ * target. Each slave numbers its statements on its own, which is why the id
+ * of the backend that replied first can not be used when there is no master.
+ *
+ * @param rses  Router client session
+ * @param pstmt The statement
+ * @param bref  The backend whose reply is sent to the client
+ * @param reply The reply to the COM_STMT_PREPARE
+ */
+void prep_stmt_publish(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                       backend_ref_t *bref, GWBUF *reply)
+{
+    /** Status, statement id and number of columns precede the parameter count */
+    uint8_t *data = (uint8_t *)GWBUF_DATA(reply) + PREP_STMT_ID_OFFSET;
+
+    if (pstmt->pstmt_state == PREP_STMT_ALLOC &&
+        pstmt->pstmt_backend_ids[bref - rses->rses_backend_ref] != 0 &&
+        GWBUF_LENGTH(reply) >= PREP_STMT_ID_OFFSET + 8)
+    {
+        if (rses->rses_prep_stmt_next_id < PREP_STMT_FIRST_ID)
+        {
+            rses->rses_prep_stmt_next_id = PREP_STMT_FIRST_ID;
+        }
+
+        pstmt->pstmt_id = rses->rses_prep_stmt_next_id++;
+        pstmt->pstmt_nparams = gw_mysql_get_byte2(data + 6);
+
+        if (hashtable_add(rses->rses_prep_stmt, &pstmt->pstmt_id, pstmt))
         {
-            pstmt->pstmt_id.seq = 0;
+            pstmt->pstmt_state = PREP_STMT_RECV;
+            gw_mysql_set_byte4(data, pstmt->pstmt_id);
         }
     }
-    CHK_PREP_STMT(pstmt);
-    return pstmt;
 }
 
-static void prep_stmt_done(prep_stmt_t *pstmt)
+/**
+ * Find the prepared statement that a COM_STMT_* packet refers to.
+ *
+ * @param rses Router client session
+ * @param buf  The packet
+ * @return The statement or NULL if the statement was not prepared in all backends
+ */
+prep_stmt_t *prep_stmt_get(ROUTER_CLIENT_SES *rses, GWBUF *buf)
 {
-    CHK_PREP_STMT(pstmt);
+    uint32_t id;
 
-    if (pstmt->pstmt_type == PREP_STMT_NAME)
+    if (rses->rses_prep_stmt == NULL ||
+        GWBUF_LENGTH(buf) < PREP_STMT_ID_OFFSET + sizeof(id))
     {
-        free(pstmt->pstmt_id.name);
+        return NULL;
     }
-    free(pstmt);
+
+    id = gw_mysql_get_byte4((uint8_t *)GWBUF_DATA(buf) + PREP_STMT_ID_OFFSET);
+    return (prep_stmt_t *)hashtable_fetch(rses->rses_prep_stmt, &id);
 }
 
-static bool prep_stmt_drop(prep_stmt_t *pstmt)
+/**
+ * Check whether an execution of a prepared statement can be routed to a slave.
+ * An execution that opens a cursor must go to the master as the rows are
+ * fetched from it. The same goes for executions that do not send the types of
+ * the parameters as the types are only known by the server that received them.
+ *
+ * @param pstmt The statement
+ * @param buf   The COM_STMT_EXECUTE packet
+ * @return True if the execution only reads data and can go to any backend
+ */
+static bool prep_stmt_exec_is_read(prep_stmt_t *pstmt, GWBUF *buf)
 {
-    CHK_PREP_STMT(pstmt);
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+    /** Statement id, flags and iteration count */
+    size_t offset = PREP_STMT_ID_OFFSET + 4 + 1 + 4;
+
+    if (pstmt->pstmt_master_only || offset > len ||
+        data[PREP_STMT_ID_OFFSET + 4] != 0)
+    {
+        return false;
+    }
+
+    if (pstmt->pstmt_nparams > 0)
+    {
+        /** The NULL bitmap is followed by the new-params-bound flag */
+        offset += (pstmt->pstmt_nparams + 7) / 8;
+        return offset < len && data[offset] == 1;
+    }
 
-    pstmt->pstmt_state = PREP_STMT_DROPPED;
     return true;
 }
-#endif /*< PREP_STMT_CACHING */
+
+/**
+ * Replace the statement id in a COM_STMT_* packet with the id of the statement
+ * in the target backend. If the statement has not been prepared in the target
+ * yet, the packet is routed to the master instead and the target starts
+ * executing the session commands it has not yet executed, which prepares the
+ * statement in it for the next execution. The router session must be locked.
+ *
+ * @param rses  Router client session
+ * @param pstmt The statement
+ * @param bref  The chosen target
+ * @param buf   The packet
+ * @return The backend the packet is routed to
+ */
+backend_ref_t *prep_stmt_get_target(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                                    backend_ref_t *bref, GWBUF *buf)
+{
+    backend_ref_t *master = rses->rses_master_ref;
+    uint32_t id = pstmt->pstmt_backend_ids[bref - rses->rses_backend_ref];
+
+    /** A backend that is executing session commands may still be preparing it */
+    if ((id == 0 || sescmd_cursor_is_active(&bref->bref_sescmd_cur)) &&
+        master && master != bref && BREF_IS_IN_USE(master))
+    {
+        sescmd_catch_up(bref);
+        MXS_INFO("Prepared statement %u is not yet prepared in '%s', routing it "
+                 "to the master.", pstmt->pstmt_id,
+                 bref->bref_backend->backend_server->unique_name);
+        bref = master;
+        id = pstmt->pstmt_backend_ids[master - rses->rses_backend_ref];
+    }
+
+    if (id != 0)
+    {
+        uint8_t *ptr = (uint8_t *)GWBUF_DATA(buf) + PREP_STMT_ID_OFFSET;
+        gw_mysql_set_byte4(ptr, id);
+    }
+
+    return bref;
+}
+
+/**
+ * Close a prepared statement in all backends. Each backend receives the
+ * statement id it knows the statement by. There is no reply to the packet.
+ *
+ * @param rses  Router client session
+ * @param pstmt The statement
+ * @param buf   The COM_STMT_CLOSE packet
+ * @return True if the packet was written to at least one backend
+ */
+static bool route_prep_stmt_close(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                                  GWBUF *buf)
+{
+    bool succp = false;
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        uint32_t id = pstmt->pstmt_backend_ids[i];
+        GWBUF *close;
+
+        if (BREF_IS_IN_USE(bref) && id != 0 &&
+            (close = gwbuf_alloc_and_load(GWBUF_LENGTH(buf), GWBUF_DATA(buf))) != NULL)
+        {
+            gwbuf_set_type(close, buf->gwbuf_type);
+            gw_mysql_set_byte4((uint8_t *)GWBUF_DATA(close) + PREP_STMT_ID_OFFSET, id);
+
+            if (bref->bref_dcb->func.write(bref->bref_dcb, close) == 1)
+            {
+                succp = true;
+            }
+        }
+    }
+
+    /** The memory is freed with the session command that prepared it */
+    hashtable_delete(rses->rses_prep_stmt, &pstmt->pstmt_id);
+    pstmt->pstmt_state = PREP_STMT_DROPPED;
+
+    if (!rses->rses_config.rw_disable_sescmd_hist)
+    {
+        sescmd_compact_history(rses);
+    }
+
+    rses_end_locked_router_action(rses);
+    return succp;
+}
+
+/**
+ * Find the root master server of a session
+ *
+ * @param rses  Router client session
+ * @return The server of the root master, NULL if there is none
+ */
+static SERVER *rses_get_root_server(ROUTER_CLIENT_SES *rses)
+{
+    BACKEND *master;
+
+    if (rses->rses_master_ref)
+    {
+        return rses->rses_master_ref->bref_backend->backend_server;
+    }
+
+    master = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+    return master ? master->backend_server : NULL;
+}
+
+/**
+ * Check that the replication lag of a slave is within a limit. The lag is
+ * estimated at the time of the check from the replication positions that the
+ * monitor publishes, so a slave is dropped as soon as it falls behind and not
+ * only when the monitor next measures the lag.
+ *
+ * @param master    The root master, NULL if there is none
+ * @param serv      The slave
+ * @param max_rlag  Maximum allowed replication lag or MAX_RLAG_UNDEFINED
+ * @return True if there is no limit or the lag is known and within it
+ */
+static bool rlag_is_acceptable(SERVER *master, SERVER *serv, int max_rlag)
+{
+    int rlag;
+
+    if (max_rlag == MAX_RLAG_UNDEFINED)
+    {
+        return true;
+    }
+
+    rlag = server_estimate_rlag(serv, master);
+    return rlag != MAX_RLAG_NOT_AVAILABLE && rlag <= max_rlag;
+}
 
 /********************************
  * This routine returns the root master server from MySQL replication tree
@@ -4894,6 +7608,33 @@ static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses)
     return candidate_bref;
 }
 
+/**
+ * Check whether all statements of a multi-statement query only read data. If
+ * so, the query cannot modify the session state and it can be routed like any
+ * other read.
+ *
+ * @param rses Router client session
+ * @param buf Buffer containing the full query
+ * @param qtype The combined type of the statements is stored here
+ * @return True if the query only reads data
+ */
+static bool is_read_only_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
+                                    qc_query_type_t *qtype)
+{
+    uint32_t type;
+
+    /** Reads of temporary tables are only detected from the first statement */
+    if (!rses->have_tmp_tables &&
+        qc_get_multi_stmt_type(buf, &type) > 0 &&
+        (type & ~READ_ONLY_STMT_TYPES) == 0)
+    {
+        *qtype = (qc_query_type_t)type;
+        return true;
+    }
+
+    return false;
+}
+
 /**
  * @brief Detect multi-statement queries
  *
@@ -4901,13 +7642,19 @@ static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses)
  * query which would leave any slave sessions in an inconsistent state. Due to
  * this, for the duration of this session, all queries will be sent to the
  * master
- * if the current query contains a multi-statement query.
+ * if the current query contains a multi-statement query. A multi-statement
+ * query whose statements only read data does not change this, instead its
+ * type is replaced with the combined type of its statements.
  * @param rses Router client session
  * @param buf Buffer containing the full query
- * @return True if the query contains multiple statements
+ * @param packet_type Type of the packet
+ * @param qtype Type of the query, updated for read-only multi-statement queries
+ * @return True if the query contains multiple statements and all future
+ * queries are sent to the master
  */
 static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
-                                 mysql_server_cmd_t packet_type)
+                                 mysql_server_cmd_t packet_type,
+                                 qc_query_type_t *qtype)
 {
     MySQLProtocol *proto = (MySQLProtocol *)rses->client_dcb->protocol;
     bool rval = false;
@@ -4933,9 +7680,17 @@ static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
                 if (ptr < data + buflen &&
                     !is_mysql_statement_end(ptr, buflen - (ptr - data)))
                 {
-                    rses->forced_node = rses->rses_master_ref;
-                    rval = true;
-                    MXS_INFO("Multi-statement query, routing all future queries to master.");
+                    if (is_read_only_multi_stmt(rses, buf, qtype))
+                    {
+                        MXS_INFO("Multi-statement query that only reads data, "
+                                 "routing it as a read.");
+                    }
+                    else
+                    {
+                        rses->forced_node = rses->rses_master_ref;
+                        rval = true;
+                        MXS_INFO("Multi-statement query, routing all future queries to master.");
+                    }
                 }
             }
         }
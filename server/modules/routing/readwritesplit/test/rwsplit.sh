@@ -239,6 +239,15 @@ else
         echo "$TINPUT PASSED">>$TLOG ;
 fi
 
+TINPUT=test_sescmd4.sql
+TRETVAL="utf8	1	test"
+a=`$RUNCMD < $TDIR/$TINPUT`
+if [ "$a" != "$TRETVAL" ]; then
+        echo "$TINPUT FAILED, return value $a when $TRETVAL was expected">>$TLOG;
+else
+        echo "$TINPUT PASSED">>$TLOG ;
+fi
+
 TINPUT=test_temporary_table.sql
 a=`$RUNCMD < $TDIR/$TINPUT`
 TRETVAL=1
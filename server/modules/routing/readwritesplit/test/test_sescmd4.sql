@@ -0,0 +1,9 @@
+set names latin1;
+set autocommit=0;
+use mysql;
+set names utf8;
+set autocommit=1;
+use test;
+set names utf8;
+set autocommit=1;
+select @@character_set_client, @@autocommit, database();
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testcausal.c - The waits and the fallbacks of the causal reads of
+ * readwritesplit
+ *
+ * The backends of the session are DCBs that only record what is written to
+ * them, the replies of the servers are built by the test.
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <server.h>
+#include <router.h>
+#include <modutil.h>
+#include <statistics.h>
+#include <readwritesplit.h>
+#include <mysql_client_server_protocol.h>
+
+#define MASTER 0
+#define SLAVE  1
+
+extern backend_ref_t *causal_check_read(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                                        GWBUF *query, bool can_delay);
+extern GWBUF *causal_process_reply(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                                   backend_ref_t *bref, GWBUF *reply);
+extern bool causal_server_is_supported(SERVER *server);
+
+static ROUTER_INSTANCE inst;
+static ROUTER_CLIENT_SES rses;
+static DCB client;
+static SERVER *servers[2];
+static BACKEND backends[2];
+static backend_ref_t brefs[2];
+static DCB dcbs[2];
+static char written[2][CAUSAL_GTID_MAXLEN + 64]; /*< The last statement of each backend */
+
+static int
+backend_write(DCB *dcb, GWBUF *queue)
+{
+    char *sql = modutil_get_SQL(queue);
+
+    snprintf(written[dcb == &dcbs[MASTER] ? MASTER : SLAVE], sizeof(written[0]), "%s", sql);
+    free(sql);
+    gwbuf_free(queue);
+    return 1;
+}
+
+static void
+init_session(const char *master_version, const char *slave_version)
+{
+    const char *versions[] = {master_version, slave_version};
+
+    memset(&inst, 0, sizeof(inst));
+    memset(&rses, 0, sizeof(rses));
+    memset(&client, 0, sizeof(client));
+    memset(written, 0, sizeof(written));
+    inst.stats.n_queries = ts_stats_alloc();
+
+    spinlock_init(&rses.rses_lock);
+    rses.router = &inst;
+    rses.client_dcb = &client;
+    rses.rses_master_ref = &brefs[MASTER];
+    rses.rses_config.rw_causal_reads = true;
+    rses.rses_config.rw_causal_reads_timeout = 10;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (servers[i] == NULL)
+        {
+            servers[i] = server_alloc("127.0.0.1", "MySQLBackend", 3306 + i);
+            ss_info_dassert(servers[i], "Server should be allocated");
+            server_set_unique_name(servers[i], i == MASTER ? "master" : "slave");
+        }
+        server_set_version_string(servers[i], versions[i]);
+
+        memset(&backends[i], 0, sizeof(BACKEND));
+        backends[i].backend_server = servers[i];
+
+        memset(&dcbs[i], 0, sizeof(DCB));
+        dcbs[i].func.write = backend_write;
+
+        memset(&brefs[i], 0, sizeof(backend_ref_t));
+        brefs[i].bref_backend = &backends[i];
+        brefs[i].bref_dcb = &dcbs[i];
+        brefs[i].bref_state = BREF_IN_USE;
+        brefs[i].bref_sescmd_cur.scmd_cur_rses = &rses;
+    }
+
+    /** The session has written and the GTID of the write has been read */
+    strcpy(rses.rses_causal_gtid, "0-1-5");
+    rses.rses_causal_gen = 1;
+    rses.rses_causal_state = CAUSAL_KNOWN;
+    spinlock_acquire(&rses.rses_lock);
+}
+
+static void
+free_session()
+{
+    spinlock_release(&rses.rses_lock);
+    gwbuf_free(brefs[SLAVE].bref_pending_cmd);
+    ts_stats_free(inst.stats.n_queries);
+}
+
+static GWBUF *
+make_packet(GWBUF *head, uint8_t seq, const char *payload, size_t len)
+{
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + len);
+    uint8_t *ptr = (uint8_t*) GWBUF_DATA(buf);
+
+    gw_mysql_set_byte3(ptr, len);
+    ptr[3] = seq;
+    memcpy(ptr + MYSQL_HEADER_LEN, payload, len);
+
+    return gwbuf_append(head, buf);
+}
+
+/** The complete reply to MASTER_GTID_WAIT */
+static GWBUF *
+make_wait_reply(const char *value)
+{
+    static const char coldef[] = "\x03" "def\x00\x00\x00\x01" "a\x00\x0c"
+                                 "\x3f\x00\x0b\x00\x00\x00\x03\x00\x00\x00\x00\x00";
+    char row[8];
+    GWBUF *reply;
+
+    row[0] = strlen(value);
+    memcpy(row + 1, value, row[0]);
+
+    reply = make_packet(NULL, 1, "\x01", 1);
+    reply = make_packet(reply, 2, coldef, sizeof(coldef) - 1);
+    reply = make_packet(reply, 3, "\xfe\x00\x00\x02\x00", 5);
+    reply = make_packet(reply, 4, row, row[0] + 1);
+    reply = make_packet(reply, 5, "\xfe\x00\x00\x02\x00", 5);
+    reply = gwbuf_make_contiguous(reply);
+    gwbuf_set_type(reply, GWBUF_TYPE_MYSQL | GWBUF_TYPE_RESPONSE_END);
+
+    return reply;
+}
+
+/**
+ * test1    Only MariaDB 10.0.9 and later are used for the causal reads
+ *
+ */
+static int
+test1()
+{
+    static const struct
+    {
+        const char *version;
+        bool supported;
+    } versions[] =
+    {
+        {"10.0.9-MariaDB", true},
+        {"10.1.14-MariaDB-log", true},
+        {"5.5.5-10.0.12-MariaDB", true},
+        {"10.0.8-MariaDB", false},
+        {"5.5.5-10.0.3-MariaDB", false},
+        {"5.7.16-log", false},
+        {"10.1.14", false}
+    };
+
+    ss_dfprintf(stderr, "testcausal : Check the versions of the servers");
+    init_session("10.1.14-MariaDB", "10.1.14-MariaDB");
+    free_session();
+
+    for (int i = 0; i < sizeof(versions) / sizeof(versions[0]); i++)
+    {
+        server_set_version_string(servers[SLAVE], versions[i].version);
+        ss_info_dassert(causal_server_is_supported(servers[SLAVE]) == versions[i].supported,
+                        "The version should be checked");
+    }
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    A read on a slave waits for the last write of the session and a
+ *          slave that has caught up is not waited for again
+ *
+ */
+static int
+test2()
+{
+    GWBUF *query = modutil_create_query("SELECT a FROM t1");
+
+    ss_dfprintf(stderr, "testcausal : Wait on the slave before the read");
+    init_session("10.1.14-MariaDB", "10.1.14-MariaDB");
+
+    ss_info_dassert(causal_check_read(&rses, &brefs[SLAVE], query, true) == NULL,
+                    "The read should be delayed");
+    ss_info_dassert(strcmp(written[SLAVE], "SELECT MASTER_GTID_WAIT('0-1-5', 10)") == 0,
+                    "The slave should wait for the GTID of the write");
+    ss_info_dassert(brefs[SLAVE].bref_pending_cmd && *written[MASTER] == '\0',
+                    "The read should be pending in the slave");
+
+    ss_info_dassert(causal_process_reply(&inst, &rses, &brefs[SLAVE], make_wait_reply("0")) == NULL,
+                    "The reply to the wait should be consumed");
+    ss_info_dassert(brefs[SLAVE].bref_pending_cmd && *written[MASTER] == '\0',
+                    "The read should be left to the slave");
+    ss_info_dassert(brefs[SLAVE].bref_causal_op == CAUSAL_OP_NONE &&
+                    brefs[SLAVE].bref_causal_gen == rses.rses_causal_gen,
+                    "The slave should have caught up");
+
+    gwbuf_free(brefs[SLAVE].bref_pending_cmd);
+    brefs[SLAVE].bref_pending_cmd = NULL;
+    *written[SLAVE] = '\0';
+    ss_info_dassert(causal_check_read(&rses, &brefs[SLAVE], query, true) == &brefs[SLAVE],
+                    "The next read should go to the slave");
+    ss_info_dassert(*written[SLAVE] == '\0', "The slave should not be waited for again");
+
+    gwbuf_free(query);
+    free_session();
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    A read on a slave that does not catch up in time is routed to the
+ *          master, as are the reads on a slave that cannot wait
+ *
+ */
+static int
+test3()
+{
+    GWBUF *query = modutil_create_query("SELECT a FROM t1");
+
+    ss_dfprintf(stderr, "testcausal : Route the read to the master after a timeout");
+    init_session("10.1.14-MariaDB", "10.1.14-MariaDB");
+
+    ss_info_dassert(causal_check_read(&rses, &brefs[SLAVE], query, true) == NULL,
+                    "The read should be delayed");
+    ss_info_dassert(causal_process_reply(&inst, &rses, &brefs[SLAVE], make_wait_reply("-1")) == NULL,
+                    "The reply to the wait should be consumed");
+    ss_info_dassert(strcmp(written[MASTER], "SELECT a FROM t1") == 0,
+                    "The read should be routed to the master");
+    ss_info_dassert(brefs[SLAVE].bref_pending_cmd == NULL,
+                    "The read should not be left to the slave");
+    ss_info_dassert(brefs[SLAVE].bref_causal_gen != rses.rses_causal_gen,
+                    "The slave should not have caught up");
+    ss_info_dassert(causal_check_read(&rses, &brefs[SLAVE], query, false) == &brefs[MASTER],
+                    "A read that cannot be delayed should go to the master");
+    free_session();
+    ss_dfprintf(stderr, "\t..done\nRoute the read to the master of an unsupported slave");
+
+    init_session("10.1.14-MariaDB", "5.7.16-log");
+    ss_info_dassert(causal_check_read(&rses, &brefs[SLAVE], query, true) == &brefs[MASTER],
+                    "The read should be routed to the master");
+    ss_info_dassert(*written[SLAVE] == '\0', "The slave should not be asked to wait");
+    ss_info_dassert(inst.causal_unsupported, "The slave should be reported");
+
+    gwbuf_free(query);
+    free_session();
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    ts_stats_init();
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    exit(result);
+}
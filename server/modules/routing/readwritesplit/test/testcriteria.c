@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testcriteria.c - The slave selection criteria of readwritesplit
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <server.h>
+#include <router.h>
+#include <readwritesplit.h>
+
+#define N_BACKENDS 3
+
+extern int (*criteria_cmpfun[LAST_CRITERIA])(const void *, const void *);
+
+static SERVER *servers[N_BACKENDS];
+static BACKEND backends[N_BACKENDS];
+static backend_ref_t brefs[N_BACKENDS];
+
+static void
+init_backends()
+{
+    for (int i = 0; i < N_BACKENDS; i++)
+    {
+        char name[20];
+        snprintf(name, sizeof(name), "server%d", i + 1);
+
+        if (servers[i] == NULL)
+        {
+            servers[i] = server_alloc("127.0.0.1", "MySQLBackend", 3306 + i);
+            ss_info_dassert(servers[i], "Server should be allocated");
+            server_set_unique_name(servers[i], name);
+        }
+        servers[i]->load = 0;
+        servers[i]->stats.n_current = 0;
+        servers[i]->stats.n_current_ops = 0;
+        server_publish_state(servers[i]);
+
+        memset(&backends[i], 0, sizeof(BACKEND));
+        backends[i].backend_server = servers[i];
+        backends[i].be_valid = true;
+        backends[i].weight = 1000;
+
+        memset(&brefs[i], 0, sizeof(backend_ref_t));
+        brefs[i].bref_backend = &backends[i];
+    }
+}
+
+/** The servers of the backend references after sorting them by a criterion */
+static void
+sort_by(select_criteria_t criteria, SERVER **order)
+{
+    backend_ref_t sorted[N_BACKENDS];
+
+    memcpy(sorted, brefs, sizeof(sorted));
+    qsort(sorted, N_BACKENDS, sizeof(backend_ref_t), criteria_cmpfun[criteria]);
+
+    for (int i = 0; i < N_BACKENDS; i++)
+    {
+        order[i] = sorted[i].bref_backend->backend_server;
+    }
+}
+
+/**
+ * test1    Every criterion can be selected by name and has a compare function
+ *
+ */
+static int
+test1()
+{
+    static const char *names[] =
+    {
+        "LEAST_GLOBAL_CONNECTIONS",
+        "LEAST_ROUTER_CONNECTIONS",
+        "LEAST_BEHIND_MASTER",
+        "LEAST_CURRENT_OPERATIONS",
+        "LEAST_RESPONSE_TIME",
+        "LEAST_CONGESTED",
+        NULL
+    };
+
+    ss_dfprintf(stderr, "testcriteria : Select the criteria by name");
+    for (int i = 0; names[i]; i++)
+    {
+        select_criteria_t c = GET_SELECT_CRITERIA(names[i]);
+
+        ss_info_dassert(c != UNDEFINED_CRITERIA && c < LAST_CRITERIA,
+                        "The criterion should be in the table");
+        ss_info_dassert(criteria_cmpfun[c] != NULL, "The criterion should have a compare function");
+        ss_info_dassert(strcmp(STRCRITERIA(c), names[i]) == 0,
+                        "The criterion should be printed with its name");
+    }
+    ss_info_dassert(GET_SELECT_CRITERIA("ADAPTIVE_ROUTING") == LEAST_RESPONSE_TIME,
+                    "ADAPTIVE_ROUTING should select LEAST_RESPONSE_TIME");
+    ss_info_dassert(GET_SELECT_CRITERIA("LEAST_SOMETHING") == UNDEFINED_CRITERIA,
+                    "An unknown name should not select a criterion");
+    ss_info_dassert(DEFAULT_CRITERIA == LEAST_CURRENT_OPERATIONS,
+                    "The default should be LEAST_CURRENT_OPERATIONS");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test2    LEAST_RESPONSE_TIME prefers the server that replies the fastest
+ *
+ */
+static int
+test2()
+{
+    SERVER *order[N_BACKENDS];
+
+    ss_dfprintf(stderr, "testcriteria : Sort by LEAST_RESPONSE_TIME");
+    init_backends();
+    backends[0].be_response_time = 3000;
+    backends[1].be_response_time = 1000;
+    backends[2].be_response_time = 2000;
+
+    sort_by(LEAST_RESPONSE_TIME, order);
+    ss_info_dassert(order[0] == servers[1] && order[1] == servers[2] && order[2] == servers[0],
+                    "The servers should be sorted by their response time");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+/**
+ * test3    LEAST_CONGESTED prefers the server with the lowest load score and
+ *          then the one with the fewest operations
+ *
+ */
+static int
+test3()
+{
+    SERVER *order[N_BACKENDS];
+
+    ss_dfprintf(stderr, "testcriteria : Sort by LEAST_CONGESTED");
+    init_backends();
+    servers[0]->load = 50;
+    servers[1]->load = 10;
+    servers[2]->load = 50;
+    servers[0]->stats.n_current_ops = 5;
+    servers[2]->stats.n_current_ops = 2;
+    for (int i = 0; i < N_BACKENDS; i++)
+    {
+        server_publish_state(servers[i]);
+    }
+
+    sort_by(LEAST_CONGESTED, order);
+    ss_info_dassert(order[0] == servers[1], "The least loaded server should be first");
+    ss_info_dassert(order[1] == servers[2] && order[2] == servers[0],
+                    "Servers with the same load should be sorted by their operations");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    exit(result);
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testprepare.c - The statement ids of the read-only prepared statements
+ * of readwritesplit
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <server.h>
+#include <router.h>
+#include <readwritesplit.h>
+#include <mysql_client_server_protocol.h>
+
+#define N_BACKENDS 2
+
+extern prep_stmt_t *prep_stmt_init(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype);
+extern void prep_stmt_done(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt);
+extern void prep_stmt_store_reply(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                                  backend_ref_t *bref, GWBUF *reply);
+extern void prep_stmt_publish(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                              backend_ref_t *bref, GWBUF *reply);
+extern prep_stmt_t *prep_stmt_get(ROUTER_CLIENT_SES *rses, GWBUF *buf);
+extern backend_ref_t *prep_stmt_get_target(ROUTER_CLIENT_SES *rses, prep_stmt_t *pstmt,
+                                           backend_ref_t *bref, GWBUF *buf);
+
+static ROUTER_CLIENT_SES rses;
+static BACKEND backends[N_BACKENDS];
+static backend_ref_t brefs[N_BACKENDS];
+
+/** A session of two slaves and no master */
+static void
+init_session()
+{
+    memset(&rses, 0, sizeof(rses));
+    spinlock_init(&rses.rses_lock);
+    rses.rses_backend_ref = brefs;
+    rses.rses_nbackends = N_BACKENDS;
+
+    for (int i = 0; i < N_BACKENDS; i++)
+    {
+        memset(&backends[i], 0, sizeof(BACKEND));
+        memset(&brefs[i], 0, sizeof(backend_ref_t));
+        brefs[i].bref_backend = &backends[i];
+        brefs[i].bref_state = BREF_IN_USE;
+        brefs[i].bref_sescmd_cur.scmd_cur_rses = &rses;
+    }
+    spinlock_acquire(&rses.rses_lock);
+}
+
+/** A COM_STMT_PREPARE_OK of a statement with one parameter */
+static GWBUF *
+make_prepare_ok(uint32_t id)
+{
+    uint8_t data[MYSQL_HEADER_LEN + 12] = {12, 0, 0, 1, 0x00};
+
+    gw_mysql_set_byte4(data + MYSQL_HEADER_LEN + 1, id);
+    gw_mysql_set_byte2(data + MYSQL_HEADER_LEN + 7, 1);
+
+    return gwbuf_alloc_and_load(sizeof(data), data);
+}
+
+/** A COM_STMT_EXECUTE of a statement with one parameter */
+static GWBUF *
+make_execute(uint32_t id)
+{
+    uint8_t data[MYSQL_HEADER_LEN + 12] = {12, 0, 0, 0, MYSQL_COM_STMT_EXECUTE};
+
+    gw_mysql_set_byte4(data + MYSQL_HEADER_LEN + 1, id);
+    data[MYSQL_HEADER_LEN + 6] = 1; /*< Iteration count */
+    data[MYSQL_HEADER_LEN + 11] = 1; /*< New parameters are bound */
+
+    return gwbuf_alloc_and_load(sizeof(data), data);
+}
+
+/**
+ * Prepare a statement in both slaves
+ *
+ * @param first The slave that replies first, its reply goes to the client
+ * @param ids   The ids the slaves give to the statement
+ * @return The id that the client receives
+ */
+static uint32_t
+prepare(prep_stmt_t *pstmt, int first, uint32_t *ids)
+{
+    GWBUF *client_reply = NULL;
+    uint32_t client_id;
+
+    for (int n = 0; n < N_BACKENDS; n++)
+    {
+        int i = (first + n) % N_BACKENDS;
+        GWBUF *reply = make_prepare_ok(ids[i]);
+
+        prep_stmt_store_reply(&rses, pstmt, &brefs[i], reply);
+
+        if (n == 0)
+        {
+            prep_stmt_publish(&rses, pstmt, &brefs[i], reply);
+            client_reply = reply;
+        }
+        else
+        {
+            gwbuf_free(reply);
+        }
+    }
+
+    client_id = gw_mysql_get_byte4((uint8_t *)GWBUF_DATA(client_reply) + MYSQL_HEADER_LEN + 1);
+    gwbuf_free(client_reply);
+
+    return client_id;
+}
+
+/**
+ * Execute a statement in a slave
+ *
+ * @return The id that the slave receives
+ */
+static uint32_t
+execute(uint32_t client_id, int target, prep_stmt_t *expected)
+{
+    GWBUF *buf = make_execute(client_id);
+    prep_stmt_t *pstmt = prep_stmt_get(&rses, buf);
+    uint32_t id;
+
+    ss_info_dassert(pstmt == expected, "The execution should refer to the statement");
+    ss_info_dassert(prep_stmt_get_target(&rses, pstmt, &brefs[target], buf) == &brefs[target],
+                    "The execution should be routed to the chosen slave");
+    id = gw_mysql_get_byte4((uint8_t *)GWBUF_DATA(buf) + MYSQL_HEADER_LEN + 1);
+    gwbuf_free(buf);
+
+    return id;
+}
+
+/**
+ * test1    Two statements prepared without a master get different ids even
+ *          when the slaves that reply first gave them the same id
+ *
+ */
+static int
+test1()
+{
+    /** The first slave has prepared four statements more than the second one */
+    uint32_t ids1[N_BACKENDS] = {5, 1};
+    uint32_t ids2[N_BACKENDS] = {6, 5};
+    prep_stmt_t *stmt1;
+    prep_stmt_t *stmt2;
+    uint32_t id1;
+    uint32_t id2;
+
+    ss_dfprintf(stderr, "testprepare : Prepare two statements without a master");
+    init_session();
+    stmt1 = prep_stmt_init(&rses, QUERY_TYPE_READ);
+    stmt2 = prep_stmt_init(&rses, QUERY_TYPE_READ);
+    ss_info_dassert(stmt1 && stmt2, "The statements should be allocated");
+
+    id1 = prepare(stmt1, 0, ids1);
+    id2 = prepare(stmt2, 1, ids2);
+    ss_info_dassert(stmt1->pstmt_state == PREP_STMT_RECV && stmt2->pstmt_state == PREP_STMT_RECV,
+                    "Both statements should be known by their id");
+    ss_info_dassert(id1 != id2, "The client should get a different id for each statement");
+    ss_info_dassert(id1 == stmt1->pstmt_id && id2 == stmt2->pstmt_id,
+                    "The client should get the ids of the router");
+
+    for (int i = 0; i < N_BACKENDS; i++)
+    {
+        ss_info_dassert(execute(id1, i, stmt1) == ids1[i],
+                        "The first statement should be executed with the id of the slave");
+        ss_info_dassert(execute(id2, i, stmt2) == ids2[i],
+                        "The second statement should be executed with the id of the slave");
+    }
+
+    spinlock_release(&rses.rses_lock);
+    prep_stmt_done(&rses, stmt1);
+    prep_stmt_done(&rses, stmt2);
+    hashtable_free(rses.rses_prep_stmt);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+
+    exit(result);
+}
@@ -30,6 +30,10 @@
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <maxscale/poll.h>
+#include <housekeeper.h>
+#include <dbusers.h>
+#include <mysql_utils.h>
+#include <mysql_wire.h>
 #include <pcre.h>
 
 #define DEFAULT_REFRESH_INTERVAL 30.0
@@ -37,8 +41,8 @@
 /** Size of the hashtable used to store ignored databases */
 #define SCHEMAROUTER_HASHSIZE 100
 
-/** Hashtable size for the per user shard maps */
-#define SCHEMAROUTER_USERHASH_SIZE 10
+/** Maximum length of the names of the housekeeper tasks */
+#define SCHEMAROUTER_TASK_NAME_LEN 80
 
 MODULE_INFO info =
 {
@@ -99,6 +103,9 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
                                     SESSION*         session,
                                     ROUTER_INSTANCE* router);
 
+static bool connect_backend(backend_ref_t* bref, SESSION* session);
+static bool connect_session_backends(ROUTER_CLIENT_SES* rses, const char* db);
+static bool connect_all_shards(ROUTER_CLIENT_SES* rses);
 static bool get_shard_dcb(DCB**              dcb,
                           ROUTER_CLIENT_SES* rses,
                           char*              name);
@@ -161,6 +168,9 @@ static void handle_error_reply_client(SESSION*           ses,
                                       ROUTER_CLIENT_SES* rses,
                                       DCB*               backend_dcb,
                                       GWBUF*             errmsg);
+static GWBUF* scatter_backend_failed(ROUTER_CLIENT_SES* rses,
+                                     backend_ref_t*     bref,
+                                     GWBUF*             errmsg);
 
 static SPINLOCK instlock;
 static ROUTER_INSTANCE* instances;
@@ -176,7 +186,7 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
                                    GWBUF** wbuf);
 bool handle_default_db(ROUTER_CLIENT_SES *router_cli_ses);
 void route_queued_query(ROUTER_CLIENT_SES *router_cli_ses);
-void synchronize_shard_map(ROUTER_CLIENT_SES *client);
+static void refresh_shard_map(void *data);
 
 static int hashkeyfun(void* key)
 {
@@ -223,9 +233,13 @@ shard_map_t* shard_map_alloc()
             HASHMEMORYFN kcopy = (HASHMEMORYFN)strdup;
             HASHMEMORYFN kfree = (HASHMEMORYFN)keyfreefun;
             hashtable_memory_fns(rval->hash, kcopy, kcopy, kfree, kfree);
+            hashtable_enable_resize(rval->hash);
             spinlock_init(&rval->lock);
             rval->last_updated = 0;
             rval->state = SHMAP_UNINIT;
+            rval->tables = NULL;
+            rval->refcount = 1;
+            rval->shared = false;
         }
         else
         {
@@ -237,63 +251,334 @@ shard_map_t* shard_map_alloc()
 }
 
 /**
- * Convert a length encoded string into a C string.
- * @param data Pointer to the first byte of the string
- * @return Pointer to the newly allocated string or NULL if the value is NULL or an error occurred
+ * Release a reference to a shard map. The map is freed when the last
+ * reference to it is released.
+ * @param map Shard map to release
  */
-char* get_lenenc_str(void* data)
+void shard_map_release(shard_map_t *map)
 {
-    unsigned char* ptr = (unsigned char*)data;
-    char* rval;
-    uintptr_t size;
-    long offset;
+    if (map && atomic_add(&map->refcount, -1) == 1)
+    {
+        hashtable_free(map->hash);
+        if (map->tables)
+        {
+            hashtable_free(map->tables);
+        }
+        free(map);
+    }
+}
 
-    if (data == NULL)
+/**
+ * Get a reference to the shared shard map of the router instance.
+ * @param router Router instance
+ * @return The shared shard map or NULL if the databases have not been mapped yet.
+ * The reference must be released with shard_map_release().
+ */
+static shard_map_t* shard_map_get_shared(ROUTER_INSTANCE *router)
+{
+    spinlock_acquire(&router->lock);
+    shard_map_t *map = router->shard_map;
+
+    if (map)
     {
-        return NULL;
+        atomic_add(&map->refcount, 1);
+    }
+    spinlock_release(&router->lock);
+
+    return map;
+}
+
+/**
+ * Check whether a database may be found on more than one server.
+ * @param router Router instance
+ * @param db Database name
+ * @return True if the database is ignored when checking for duplicate databases
+ */
+static bool is_ignored_database(ROUTER_INSTANCE *router, char *db)
+{
+    return hashtable_fetch(router->ignored_dbs, db) ||
+           (router->ignore_regex &&
+            mxs_pcre2_match(router->ignore_regex, db, PCRE2_ZERO_TERMINATED) >= 0);
+}
+
+/**
+ * Check whether the client of a session may see a database. The grants of the
+ * client are looked up from the users of the service in the same way as when
+ * the client is authenticated: first by the address of the client, then by its
+ * class C, B and A networks and finally by any host.
+ * @param rses Router client session
+ * @param db Database name
+ * @return True if the client has a grant on the database
+ */
+static bool client_sees_database(ROUTER_CLIENT_SES *rses, char *db)
+{
+    static const uint32_t netmasks[] = {0xFFFFFFFF, 0x00FFFFFF, 0x0000FFFF, 0x000000FF};
+    DCB *dcb = rses->rses_client_dcb;
+    MYSQL_USER_HOST key;
+
+    if (strcasecmp(db, "information_schema") == 0)
+    {
+        return true;
     }
 
-    if (*ptr < 251)
+    memset(&key, 0, sizeof(key));
+    key.user = dcb->user;
+    key.resource = db;
+    memcpy(&key.ipv4, &dcb->ipv4, sizeof(struct sockaddr_in));
+
+    if (dcb->remote && strlen(dcb->remote) < MYSQL_HOST_MAXLEN)
     {
-        size = (uintptr_t)*ptr;
-        offset = 1;
+        strcpy(key.hostname, dcb->remote);
     }
-    else
+
+    for (int i = 0; i < sizeof(netmasks) / sizeof(netmasks[0]); i++)
     {
-        switch (*(ptr))
+        key.ipv4.sin_addr.s_addr &= netmasks[i];
+        key.netmask = 32 - 8 * i;
+
+        if (mysql_users_fetch(dcb->service->users, &key))
         {
-        case 0xfb:
-            return NULL;
-        case 0xfc:
-            size = *(ptr + 1) + (*(ptr + 2) << 8);
-            offset = 2;
-            break;
-        case 0xfd:
-            size = *ptr + (*(ptr + 2) << 8) + (*(ptr + 3) << 16);
-            offset = 3;
-            break;
-        case 0xfe:
-            size = *ptr + ((*(ptr + 2) << 8)) + (*(ptr + 3) << 16) +
-                (*(ptr + 4) << 24) + ((uintptr_t)*(ptr + 5) << 32) + ((uintptr_t)*(ptr + 6) << 40) +
-                ((uintptr_t)*(ptr + 7) << 48) + ((uintptr_t)*(ptr + 8) << 56);
-            offset = 8;
-            break;
-        default:
+            return true;
+        }
 
-            return NULL;
+        if (i == 0 && key.ipv4.sin_addr.s_addr == 0x0100007F &&
+            !dcb->service->localhost_match_wildcard_host)
+        {
+            return false;
+        }
+    }
+
+    memset(&key.ipv4, 0, sizeof(struct sockaddr_in));
+    key.netmask = 0;
+
+    return mysql_users_fetch(dcb->service->users, &key) != NULL;
+}
+
+/**
+ * Add the tables of a server to a shard map. The tables are keyed by their
+ * qualified names so that a table can be looked up with the name the query
+ * classifier gives for it.
+ * @param router Router instance
+ * @param map Shard map with the table map
+ * @param con Connection to the server
+ * @param server The server the connection is to
+ * @return True if the tables were added and none of them was already in the map
+ */
+static bool shard_map_add_tables(ROUTER_INSTANCE *router, shard_map_t *map, MYSQL *con,
+                                 SERVER *server)
+{
+    const char *query = "SELECT TABLE_SCHEMA, TABLE_NAME FROM information_schema.TABLES";
+    char key[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
+    MYSQL_RES *result;
+    bool rval = true;
+
+    if (mysql_query(con, query) != 0 || (result = mysql_store_result(con)) == NULL)
+    {
+        MXS_ERROR("Failed to list the tables of server '%s' for service '%s': %s",
+                  server->unique_name, router->service->name, mysql_error(con));
+        return false;
+    }
+
+    MYSQL_ROW row;
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        if (row[0] && row[1] && !is_ignored_database(router, row[0]))
+        {
+            snprintf(key, sizeof(key), "%s.%s", row[0], row[1]);
+
+            if (!hashtable_add(map->tables, key, server->unique_name))
+            {
+                MXS_ERROR("Table '%s' found on servers '%s' and '%s'.", key,
+                          server->unique_name, (char*)hashtable_fetch(map->tables, key));
+                rval = false;
+            }
         }
     }
+    mysql_free_result(result);
+
+    return rval;
+}
 
-    rval = malloc(sizeof(char)*(size+1));
-    if(rval)
+/**
+ * Add the databases of a server to a shard map. The databases are listed with
+ * the credentials of the service.
+ * @param router Router instance
+ * @param map Shard map to add the databases to
+ * @param server Server whose databases are added
+ * @param user User name of the service
+ * @param passwd Decrypted password of the service
+ * @return True if the databases were added and none of them was already in the map
+ */
+static bool shard_map_add_server(ROUTER_INSTANCE *router, shard_map_t *map, SERVER *server,
+                                 char *user, char *passwd)
+{
+    GATEWAY_CONF* cnf = config_get_global_options();
+    MYSQL *con = mysql_init(NULL);
+    bool rval = false;
+
+    if (con == NULL)
+    {
+        MXS_ERROR("Failed to initialize a MySQL connection for mapping the databases.");
+        return false;
+    }
+
+    mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, (void *) &cnf->auth_conn_timeout);
+    mysql_options(con, MYSQL_OPT_READ_TIMEOUT, (void *) &cnf->auth_read_timeout);
+    mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, (void *) &cnf->auth_write_timeout);
+
+    MYSQL_RES *result;
+
+    if (mxs_mysql_real_connect(con, server, user, passwd) == NULL ||
+        mysql_query(con, "SHOW DATABASES") != 0 ||
+        (result = mysql_store_result(con)) == NULL)
     {
-        memcpy(rval, ptr + offset, size);
-        memset(rval + size, 0, 1);
+        MXS_ERROR("Failed to list the databases of server '%s' for service '%s': %s",
+                  server->unique_name, router->service->name, mysql_error(con));
+    }
+    else
+    {
+        MYSQL_ROW row;
+        rval = true;
+
+        while ((row = mysql_fetch_row(result)))
+        {
+            /** With table sharding, the tables of a database may be on many servers */
+            if (row[0] && !hashtable_add(map->hash, row[0], server->unique_name) &&
+                !is_ignored_database(router, row[0]) && map->tables == NULL)
+            {
+                MXS_ERROR("Database '%s' found on servers '%s' and '%s'. The sessions map the "
+                          "databases with the credentials of their clients.",
+                          row[0], server->unique_name,
+                          (char*)hashtable_fetch(map->hash, row[0]));
+                rval = false;
+            }
+        }
+        mysql_free_result(result);
 
+        if (rval && map->tables)
+        {
+            rval = shard_map_add_tables(router, map, con, server);
+        }
     }
+
+    mysql_close(con);
     return rval;
 }
 
+/**
+ * Build a new shared shard map from the databases of the running servers and
+ * publish it. The sessions that are using the previous map keep it until they
+ * are closed, and the new sessions take the new map into use. The map is not
+ * published if a server could not be mapped or a database was found on more
+ * than one server, in which case the new sessions map the databases themselves
+ * once the previous map has been abandoned.
+ *
+ * Called by the housekeeper every refresh_interval seconds.
+ * @param data Router instance
+ */
+static void refresh_shard_map(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE*)data;
+    char *user, *passwd;
+    bool busy;
+
+    spinlock_acquire(&router->lock);
+    busy = router->shard_map_refreshing;
+    router->shard_map_refreshing = true;
+    spinlock_release(&router->lock);
+
+    if (busy)
+    {
+        return;
+    }
+
+    shard_map_t *map = shard_map_alloc();
+
+    if (map && router->schemarouter_config.table_sharding &&
+        (map->tables = hashtable_alloc(SCHEMAROUTER_HASHSIZE, hashkeyfun, hashcmpfun)))
+    {
+        HASHMEMORYFN kcopy = (HASHMEMORYFN)strdup;
+        HASHMEMORYFN kfree = (HASHMEMORYFN)keyfreefun;
+        hashtable_memory_fns(map->tables, kcopy, kcopy, kfree, kfree);
+        hashtable_enable_resize(map->tables);
+    }
+
+    bool ok = map != NULL && (map->tables || !router->schemarouter_config.table_sharding) &&
+              serviceGetUser(router->service, &user, &passwd) && mysql_thread_init() == 0;
+
+    if (ok)
+    {
+        char *dpwd = decryptPassword(passwd);
+        int n_mapped = 0;
+
+        for (int i = 0; ok && router->servers[i]; i++)
+        {
+            SERVER *server = router->servers[i]->backend_server;
+
+            if (SERVER_IS_RUNNING(server))
+            {
+                ok = shard_map_add_server(router, map, server, user, dpwd);
+                n_mapped++;
+            }
+        }
+
+        free(dpwd);
+        mysql_thread_end();
+        ok = ok && n_mapped > 0;
+    }
+
+    if (ok)
+    {
+        map->state = SHMAP_READY;
+        map->last_updated = time(NULL);
+        map->shared = true;
+        MXS_INFO("schemarouter: Mapped %d databases and %d tables for service '%s'.",
+                 hashtable_size(map->hash), map->tables ? hashtable_size(map->tables) : 0,
+                 router->service->name);
+    }
+    else
+    {
+        shard_map_release(map);
+        map = NULL;
+    }
+
+    shard_map_t *old = NULL;
+
+    spinlock_acquire(&router->lock);
+    /** A map that has not been refreshed for two intervals is abandoned */
+    if (map || (router->shard_map &&
+                difftime(time(NULL), router->shard_map->last_updated) >
+                2 * router->schemarouter_config.refresh_min_interval))
+    {
+        old = router->shard_map;
+        router->shard_map = map;
+    }
+    router->shard_map_refreshing = false;
+    spinlock_release(&router->lock);
+
+    shard_map_release(old);
+}
+
+/**
+ * Convert a length encoded string into a C string.
+ * @param data Pointer to the first byte of the string
+ * @param len Number of bytes available at data
+ * @return Pointer to the newly allocated string or NULL if the value is NULL or an error occurred
+ */
+char* get_lenenc_str(const uint8_t* data, size_t len)
+{
+    const char* str;
+    size_t size;
+
+    if (data == NULL || !mxs_wire_get_lenenc_str(&data, data + len, &str, &size))
+    {
+        return NULL;
+    }
+
+    return strndup(str, size);
+}
+
 /**
  * Parses a response set to a SHOW DATABASES query and inserts them into the
  * router client session's database hashtable. The name of the database is used
@@ -361,7 +646,7 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
     {
         int payloadlen = gw_mysql_get_byte3(ptr);
         int packetlen = payloadlen + 4;
-        char* data = get_lenenc_str(ptr + 4);
+        char* data = get_lenenc_str(ptr + 4, payloadlen);
 
         if (data)
         {
@@ -371,11 +656,7 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
             }
             else
             {
-                if (!(hashtable_fetch(rses->router->ignored_dbs, data) ||
-                      (rses->router->ignore_regex &&
-                       pcre2_match(rses->router->ignore_regex, (PCRE2_SPTR)data,
-                                   PCRE2_ZERO_TERMINATED, 0, 0,
-                                   rses->router->ignore_match_data, NULL) >= 0)))
+                if (!is_ignored_database(rses->router, data))
                 {
                     duplicate_found = true;
                     MXS_ERROR("Database '%s' found on servers '%s' and '%s' for user %s@%s.",
@@ -470,6 +751,68 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
     return !rval;
 }
 
+/**
+ * Find the server of the tables of a query from the table map. The names of
+ * the tables of the query are read in place and only the unqualified names are
+ * qualified with the current database for the lookup.
+ * @param client Client router session
+ * @param buffer Query to inspect
+ * @return Name of the server or NULL if none of the tables is in the table map
+ */
+static char* get_table_shard_name(ROUTER_CLIENT_SES* client, GWBUF* buffer)
+{
+    HASHTABLE *tables = client->shardmap->tables;
+    const char *const *names;
+    char **copy = NULL;
+    char key[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
+    char *rval = NULL;
+    int sz = 0;
+
+    if (!qc_peek_table_names(buffer, true, &names, &sz))
+    {
+        copy = qc_get_table_names(buffer, &sz, true);
+        names = (const char *const *)copy;
+    }
+
+    for (int i = 0; i < sz && names && names[i]; i++)
+    {
+        char *name = (char*)names[i];
+
+        if (strchr(name, '.') == NULL)
+        {
+            snprintf(key, sizeof(key), "%s.%s", client->current_db, name);
+            name = key;
+        }
+
+        char *shard = (char*)hashtable_fetch(tables, name);
+
+        if (shard)
+        {
+            if (rval && strcmp(shard, rval) != 0)
+            {
+                MXS_ERROR("Schemarouter: Query targets tables on servers '%s' and '%s'. "
+                          "Cross server queries are not supported.", rval, shard);
+            }
+            else if (rval == NULL)
+            {
+                rval = shard;
+                MXS_INFO("schemarouter: Query targets table '%s' on server '%s'", name, rval);
+            }
+        }
+    }
+
+    if (copy)
+    {
+        for (int i = 0; i < sz; i++)
+        {
+            free(copy[i]);
+        }
+        free(copy);
+    }
+
+    return rval;
+}
+
 /**
  * Check the hashtable for the right backend for this query.
  * @param router Router instance
@@ -487,6 +830,15 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
     char* rval = NULL, *query, *tmp = NULL;
     bool has_dbs = false; /**If the query targets any database other than the current one*/
 
+    bool table_found = false;
+
+    if (client->shardmap->tables && (rval = get_table_shard_name(client, buffer)))
+    {
+        /** The databases of the sharded tables are on many servers */
+        has_dbs = true;
+        table_found = true;
+    }
+
     dbnms = qc_get_database_names(buffer, &sz);
 
     HASHTABLE* ht = client->shardmap->hash;
@@ -496,7 +848,7 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
         for (i = 0; i < sz; i++)
         {
             char* name;
-            if ((name = (char*)hashtable_fetch(ht, dbnms[i])))
+            if (!table_found && (name = (char*)hashtable_fetch(ht, dbnms[i])))
             {
                 if (strcmp(dbnms[i], "information_schema") == 0 && rval == NULL)
                 {
@@ -717,17 +1069,6 @@ static ROUTER* createInstance(SERVICE *service, char **options)
                          (HASHMEMORYFN)free,
                          NULL);
 
-    if ((router->shard_maps = hashtable_alloc(SCHEMAROUTER_USERHASH_SIZE, hashkeyfun, hashcmpfun)) == NULL)
-    {
-        MXS_ERROR("Memory allocation failed when allocating schemarouter database ignore list.");
-        hashtable_free(router->ignored_dbs);
-        free(router);
-        return NULL;
-    }
-
-    hashtable_memory_fns(router->shard_maps, (HASHMEMORYFN)strdup,
-                         NULL, (HASHMEMORYFN)keyfreefun, NULL);
-
     /** Add default system databases to ignore */
     hashtable_add(router->ignored_dbs, "mysql","");
     hashtable_add(router->ignored_dbs, "information_schema", "");
@@ -761,8 +1102,7 @@ static ROUTER* createInstance(SERVICE *service, char **options)
     {
         int errcode;
         PCRE2_SIZE erroffset;
-        pcre2_code* re = pcre2_compile((PCRE2_SPTR)param->value, PCRE2_ZERO_TERMINATED, 0,
-                                       &errcode, &erroffset, NULL);
+        pcre2_code* re = mxs_pcre2_compile(param->value, 0, &errcode, &erroffset);
 
         if (re == NULL)
         {
@@ -775,20 +1115,7 @@ static ROUTER* createInstance(SERVICE *service, char **options)
             return NULL;
         }
 
-        pcre2_match_data* match_data = pcre2_match_data_create_from_pattern(re, NULL);
-
-        if (match_data == NULL)
-        {
-            MXS_ERROR("PCRE2 match data creation failed. This"
-                      " is most likely caused by a lack of available memory.");
-            pcre2_code_free(re);
-            hashtable_free(router->ignored_dbs);
-            free(router);
-            return NULL;
-        }
-
         router->ignore_regex = re;
-        router->ignore_match_data = match_data;
     }
 
     if ((param = config_get_param(conf, "ignore_databases")))
@@ -837,6 +1164,14 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         {
             router->schemarouter_config.debug = config_truth_value(value);
         }
+        else if (strcmp(options[i], "table_sharding") == 0)
+        {
+            router->schemarouter_config.table_sharding = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "lazy_connect") == 0)
+        {
+            router->schemarouter_config.lazy_connect = config_truth_value(value);
+        }
         else
         {
             MXS_ERROR("Unknown router options for Schemarouter: %s", options[i]);
@@ -851,6 +1186,14 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         router->schemarouter_config.max_sescmd_hist = 0;
     }
 
+    /** A shard connected later needs the whole history */
+    if (router->schemarouter_config.disable_sescmd_hist && router->schemarouter_config.lazy_connect)
+    {
+        MXS_WARNING("Schemarouter: 'lazy_connect' requires the session command history, "
+                    "connecting to all shards at the start of the session.");
+        router->schemarouter_config.lazy_connect = false;
+    }
+
     if (failure)
     {
         free(router);
@@ -919,6 +1262,15 @@ static ROUTER* createInstance(SERVICE *service, char **options)
      */
     router->schemarouter_version = service->svc_config_version;
 
+    /** The databases are mapped soon after the start and then periodically */
+    char task_name[SCHEMAROUTER_TASK_NAME_LEN + 1];
+    int interval = router->schemarouter_config.refresh_min_interval;
+
+    snprintf(task_name, sizeof(task_name), "schemarouter shard map %s", service->name);
+    hktask_add(task_name, refresh_shard_map, router, interval > 0 ? interval : 1);
+    snprintf(task_name, sizeof(task_name), "schemarouter first shard map %s", service->name);
+    hktask_oneshot(task_name, refresh_shard_map, router, 1);
+
     /**
      * We have completed the creation of the router data, so now
      * insert this router into the linked list of routers
@@ -945,25 +1297,6 @@ retblock:
     return (ROUTER *)router;
 }
 
-/**
- * Check if the shard map is out of date and update its state if necessary.
- * @param router Router instance
- * @param map Shard map to update
- * @return Current state of the shard map
- */
-enum shard_map_state shard_map_update_state(shard_map_t *self, ROUTER_INSTANCE* router)
-{
-    spinlock_acquire(&self->lock);
-    double tdiff = difftime(time(NULL), self->last_updated);
-    if (tdiff > router->schemarouter_config.refresh_min_interval)
-    {
-        self->state = SHMAP_STALE;
-    }
-    enum shard_map_state state = self->state;
-    spinlock_release(&self->lock);
-    return state;
-}
-
 /**
  * Associate a new session with this instance of the router.
  *
@@ -1028,20 +1361,11 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     client_rses->rses_mysql_session = (MYSQL_session*)session->client_dcb->data;
     client_rses->rses_client_dcb = (DCB*)session->client_dcb;
 
-    spinlock_acquire(&router->lock);
-
-    shard_map_t *map = hashtable_fetch(router->shard_maps, session->client_dcb->user);
-    enum shard_map_state state;
-
-    if (map)
-    {
-        state = shard_map_update_state(map, router);
-    }
-
-    spinlock_release(&router->lock);
+    shard_map_t *map = shard_map_get_shared(router);
 
-    if (map == NULL || state != SHMAP_READY)
+    if (map == NULL)
     {
+        /** The databases have not been mapped yet, the session maps them itself */
         if ((map = shard_map_alloc()) == NULL)
         {
             MXS_ERROR("Failed to allocate enough memory to create"
@@ -1050,6 +1374,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
             return NULL;
         }
         client_rses->init = INIT_UNINT;
+        atomic_add(&router->stats.shmap_cache_miss, 1);
     }
     else
     {
@@ -1115,6 +1440,9 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
         backend_ref[i].bref_state = 0;
         backend_ref[i].n_mapping_eof = 0;
         backend_ref[i].map_queue = NULL;
+        backend_ref[i].sg_state = SG_NONE;
+        backend_ref[i].sg_readbuf = NULL;
+        backend_ref[i].sg_rows = NULL;
         backend_ref[i].bref_backend = router->servers[i];
         /** store pointers to sescmd list to both cursors */
         backend_ref[i].bref_sescmd_cur.scmd_cur_rses = client_rses;
@@ -1138,13 +1466,13 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
         client_rses = NULL;
         goto return_rses;
     }
+    client_rses->rses_nbackends = router_nservers;
+
     /**
-     * Connect to all backend servers
+     * Connect to all backend servers, or only to the shard of the default
+     * database if the shards are connected when they are needed.
      */
-    succp = connect_backend_servers(backend_ref,
-                                    router_nservers,
-                                    session,
-                                    router);
+    succp = connect_session_backends(client_rses, db);
 
     rses_end_locked_router_action(client_rses);
 
@@ -1337,7 +1665,11 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
         {
             ;
         }
+        gwbuf_free(bref->sg_readbuf);
+        gwbuf_free(bref->sg_rows);
     }
+    gwbuf_free(router_cli_ses->sg_reply);
+    gwbuf_free(router_cli_ses->sg_eof);
     spinlock_acquire(&router->lock);
 
     if (router->connections == router_cli_ses)
@@ -1381,11 +1713,8 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
      * all the memory and other resources associated
      * to the client session.
      */
-    if (router_cli_ses->shardmap)
-    {
-        hashtable_free(router_cli_ses->shardmap->hash);
-        free(router_cli_ses->shardmap);
-    }
+    shard_map_release(router_cli_ses->shardmap);
+    slowlog_query_free(&router_cli_ses->slow_query);
     free(router_cli_ses->rses_backend_ref);
     free(router_cli_ses);
     return;
@@ -1442,11 +1771,51 @@ static bool get_shard_dcb(DCB**              p_dcb,
         }
     }
 
+    /** The shard is connected when it is first needed */
+    for (i = 0; rses->rses_config.lazy_connect && i < rses->rses_nbackends; i++)
+    {
+        BACKEND* b = backend_ref[i].bref_backend;
+
+        if (!BREF_IS_IN_USE((&backend_ref[i])) &&
+            (strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
+            SERVER_IS_RUNNING(b->backend_server))
+        {
+            MXS_INFO("schemarouter: Connecting to '%s' for the first query routed to it.",
+                     b->backend_server->unique_name);
+
+            if (connect_backend(&backend_ref[i], rses->rses_client_dcb->session))
+            {
+                atomic_add(&rses->router->stats.n_lazy_connects, 1);
+                *p_dcb = backend_ref[i].bref_dcb;
+                succp = true;
+            }
+            break;
+        }
+    }
+
 return_succp:
     return succp;
 }
 
 
+/**
+ * Check whether the query has a hint that routes it to all the servers.
+ * @param hint The hints of the query
+ * @return True if a route to all hint was found
+ */
+static bool hint_routes_to_all(HINT* hint)
+{
+    for (; hint; hint = hint->next)
+    {
+        if (hint->type == HINT_ROUTE_TO_ALL)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Examine the query type, transaction state and routing hints. Find out the
  * target for query routing.
@@ -1459,8 +1828,8 @@ return_succp:
  *          if the query would otherwise be routed to slave.
  */
 static route_target_t get_shard_route_target(qc_query_type_t qtype,
-                                             bool            trx_active, /*< !!! turha ? */
-                                             HINT*           hint) /*< !!! turha ? */
+                                             bool            trx_active, /*< Is a transaction active */
+                                             HINT*           hint) /*< The hints of the query */
 {
     route_target_t target = TARGET_UNDEFINED;
 
@@ -1483,6 +1852,16 @@ static route_target_t get_shard_route_target(qc_query_type_t qtype,
     {
         target = TARGET_ANY;
     }
+    /**
+     * Read-only queries outside transactions can be executed on all
+     * the shards when the client asks for it
+     */
+    else if (!trx_active && hint_routes_to_all(hint) &&
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+             !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE))
+    {
+        target = TARGET_SCATTER;
+    }
 #if defined(SS_DEBUG)
     MXS_INFO("Selected target type \"%s\"", STRTARGET(target));
 #endif
@@ -1719,93 +2098,481 @@ void check_create_tmp_table(ROUTER* instance,
         free(hkey);
         free(tblname);
     }
-}
+}
+
+int cmpfn(const void* a, const void *b)
+{
+    return strcmp(*(char* const *)a, *(char* const *)b);
+}
+
+/** Internal structure used to stream the list of databases */
+struct string_array
+{
+    char** array;
+    int position;
+    int size;
+};
+
+/**
+ * Callback for the database list streaming.
+ * @param rset Result set which is being processed
+ * @param data Pointer to struct string_array containing the database names
+ * @return New resultset row or NULL if no more data is available. If memory allocation
+ * failed, NULL is returned.
+ */
+RESULT_ROW *result_set_cb(struct resultset * rset, void *data)
+{
+    RESULT_ROW *row = NULL;
+    struct string_array *strarray = (struct string_array*) data;
+
+    if (strarray->position < strarray->size && (row = resultset_make_row(rset)))
+    {
+        if (resultset_row_set(row, 0, strarray->array[strarray->position++]) == 0)
+        {
+            resultset_free_row(row);
+            row = NULL;
+        }
+    }
+
+    return row;
+}
+
+/**
+ * Generates a custom SHOW DATABASES result set from all the databases in the
+ * hashtable. Only backend servers that are up and in a proper state are listed
+ * in it.
+ * @param router Router instance
+ * @param client Router client session
+ * @return True if the sending of the database list was successful, otherwise false
+ */
+bool send_database_list(ROUTER_INSTANCE* router, ROUTER_CLIENT_SES* client)
+{
+    bool rval = false;
+    spinlock_acquire(&client->shardmap->lock);
+    if (client->shardmap->state != SHMAP_UNINIT)
+    {
+        struct string_array strarray;
+        const int size = hashtable_size(client->shardmap->hash);
+        strarray.array = malloc(size * sizeof(char*));
+        strarray.position = 0;
+        HASHITERATOR *iter = hashtable_iterator(client->shardmap->hash);
+        RESULTSET* resultset = resultset_create(result_set_cb, &strarray);
+
+        if (strarray.array && iter && resultset)
+        {
+            char *key;
+            int i = 0;
+            while ((key = hashtable_next(iter)))
+            {
+                char *value = hashtable_fetch(client->shardmap->hash, key);
+                SERVER * server = server_find_by_unique_name(value);
+                if (SERVER_IS_RUNNING(server) &&
+                    (!client->shardmap->shared || client_sees_database(client, key)))
+                {
+                    strarray.array[i++] = key;
+                }
+            }
+            strarray.size = i;
+            qsort(strarray.array, strarray.size, sizeof(char*), cmpfn);
+            if (resultset_add_column(resultset, "Database", MYSQL_DATABASE_MAXLEN,
+                                     COL_TYPE_VARCHAR))
+            {
+                resultset_stream_mysql(resultset, client->rses_client_dcb);
+                rval = true;
+            }
+        }
+        resultset_free(resultset);
+        hashtable_iterator_free(iter);
+        free(strarray.array);
+    }
+    spinlock_release(&client->shardmap->lock);
+    return rval;
+}
+
+/**
+ * Keep a reply of a backend to a scattered query that ends the reply without
+ * a result set. The first error is kept and an OK packet only if nothing else
+ * has been kept.
+ *
+ * @param rses   Router client session
+ * @param packet The ERR or OK packet, freed if it is not kept
+ */
+static void scatter_keep_reply(ROUTER_CLIENT_SES* rses, GWBUF* packet)
+{
+    if (packet == NULL)
+    {
+        return;
+    }
+
+    if (rses->sg_reply == NULL ||
+        (PTR_IS_ERR(((uint8_t*)GWBUF_DATA(packet))) &&
+         !PTR_IS_ERR(((uint8_t*)GWBUF_DATA(rses->sg_reply)))))
+    {
+        gwbuf_free(rses->sg_reply);
+        rses->sg_reply = packet;
+    }
+    else
+    {
+        gwbuf_free(packet);
+    }
+}
+
+/**
+ * Add a packet to the packets sent to the client. The sequence numbers of
+ * the backends are replaced by a sequence of the merged result.
+ *
+ * @param rses   Router client session
+ * @param out    The packets to send to the client
+ * @param packet A contiguous packet, or a chain of them
+ * @return The packets to send to the client
+ */
+static GWBUF* scatter_forward(ROUTER_CLIENT_SES* rses, GWBUF* out, GWBUF* packet)
+{
+    GWBUF* buf;
+
+    for (buf = packet; buf; buf = buf->next)
+    {
+        ((uint8_t*)GWBUF_DATA(buf))[3] = rses->sg_seqno++;
+    }
+
+    return gwbuf_append(out, packet);
+}
+
+/**
+ * Create the end of the merged reply once all the backends have replied.
+ * An error of any backend ends the result.
+ *
+ * @param rses Router client session
+ * @param out  The packets to send to the client
+ * @return The packets to send to the client
+ */
+static GWBUF* scatter_finish(ROUTER_CLIENT_SES* rses, GWBUF* out)
+{
+    GWBUF* end = NULL;
+    int i;
+
+    if (rses->sg_reply && (!rses->sg_header_sent ||
+                           PTR_IS_ERR(((uint8_t*)GWBUF_DATA(rses->sg_reply)))))
+    {
+        end = rses->sg_reply;
+        rses->sg_reply = NULL;
+    }
+    else if (rses->sg_header_sent && rses->sg_eof)
+    {
+        end = rses->sg_eof;
+        rses->sg_eof = NULL;
+    }
+    else
+    {
+        end = modutil_create_mysql_err_msg(1, 0, 1105, "HY000",
+                                           "No result from the shards");
+    }
+
+    if (end)
+    {
+        out = scatter_forward(rses, out, end);
+    }
+
+    for (i = 0; i < rses->rses_nbackends; i++)
+    {
+        gwbuf_free(rses->rses_backend_ref[i].sg_rows);
+        rses->rses_backend_ref[i].sg_rows = NULL;
+    }
+    gwbuf_free(rses->sg_reply);
+    gwbuf_free(rses->sg_eof);
+    rses->sg_reply = NULL;
+    rses->sg_eof = NULL;
+    rses->sg_leader = NULL;
+    rses->sg_header_sent = false;
+
+    return out;
+}
+
+/**
+ * Mark the reply of a backend to a scattered query read.
+ *
+ * @param rses Router client session
+ * @param bref The backend
+ * @param out  The packets to send to the client
+ * @return The packets to send to the client
+ */
+static GWBUF* scatter_backend_done(ROUTER_CLIENT_SES* rses, backend_ref_t* bref, GWBUF* out)
+{
+    bref->sg_state = SG_NONE;
+    bref->sg_discard = false;
+    gwbuf_free(bref->sg_readbuf);
+    bref->sg_readbuf = NULL;
+    bref_clear_state(bref, BREF_QUERY_ACTIVE);
+    bref_clear_state(bref, BREF_WAITING_RESULT);
+
+    if (--rses->sg_pending == 0)
+    {
+        out = scatter_finish(rses, out);
+    }
+
+    return out;
+}
+
+/**
+ * Process a part of the reply of a backend to a scattered query. Only the
+ * complete packets are processed and the rest is kept until more data arrives.
+ * The column definitions of the first backend to send them are sent to the
+ * client and the rows of all the backends are sent as they arrive. The rows
+ * that arrive before the column definitions are complete are held back. The
+ * EOF packets of the backends are replaced by one at the end of the result.
+ *
+ * This must be called with the router session lock.
+ *
+ * @param rses   Router client session
+ * @param bref   The backend that sent the data
+ * @param buffer The data, freed by this function
+ * @return The packets to send to the client or NULL if there is nothing to send
+ */
+static GWBUF* scatter_process_reply(ROUTER_CLIENT_SES* rses, backend_ref_t* bref, GWBUF* buffer)
+{
+    GWBUF* out = NULL;
+    GWBUF* packet;
+    int i;
+
+    bref->sg_readbuf = gwbuf_append(bref->sg_readbuf, buffer);
+
+    while (bref->sg_state != SG_DONE &&
+           (packet = modutil_get_next_MySQL_packet(&bref->sg_readbuf)))
+    {
+        uint8_t* data = (uint8_t*)GWBUF_DATA(packet);
+
+        switch (bref->sg_state)
+        {
+        case SG_COLCOUNT:
+            if (PTR_IS_ERR(data) || PTR_IS_OK(data))
+            {
+                scatter_keep_reply(rses, packet);
+                bref->sg_state = SG_DONE;
+            }
+            else if (rses->sg_leader == NULL)
+            {
+                rses->sg_leader = bref;
+                rses->sg_ncolumns = leint_value(data + MYSQL_HEADER_LEN);
+                out = scatter_forward(rses, out, packet);
+                bref->sg_state = SG_COLUMNS;
+            }
+            else
+            {
+                if (leint_value(data + MYSQL_HEADER_LEN) != rses->sg_ncolumns)
+                {
+                    MXS_ERROR("schemarouter: '%s' returned a different number of "
+                              "columns than '%s'.",
+                              bref->bref_backend->backend_server->unique_name,
+                              rses->sg_leader->bref_backend->backend_server->unique_name);
+                    scatter_keep_reply(rses, modutil_create_mysql_err_msg(1, 0, 1222, "21000",
+                                                                          "The shards returned a different "
+                                                                          "number of columns"));
+                    bref->sg_discard = true;
+                }
+                gwbuf_free(packet);
+                bref->sg_state = SG_COLUMNS;
+            }
+            break;
+
+        case SG_COLUMNS:
+            if (rses->sg_leader != bref)
+            {
+                /** Only the column definitions of one backend are sent */
+                if (PTR_IS_EOF(data))
+                {
+                    bref->sg_state = SG_ROWS;
+                }
+                gwbuf_free(packet);
+            }
+            else if (PTR_IS_EOF(data))
+            {
+                out = scatter_forward(rses, out, packet);
+                rses->sg_header_sent = true;
+                bref->sg_state = SG_ROWS;
+
+                for (i = 0; i < rses->rses_nbackends; i++)
+                {
+                    if (rses->rses_backend_ref[i].sg_rows)
+                    {
+                        out = scatter_forward(rses, out, rses->rses_backend_ref[i].sg_rows);
+                        rses->rses_backend_ref[i].sg_rows = NULL;
+                    }
+                }
+            }
+            else
+            {
+                out = scatter_forward(rses, out, packet);
+            }
+            break;
+
+        case SG_ROWS:
+            if (PTR_IS_EOF(data))
+            {
+                gwbuf_free(rses->sg_eof);
+                rses->sg_eof = packet;
+                bref->sg_state = SG_DONE;
+            }
+            else if (PTR_IS_ERR(data))
+            {
+                scatter_keep_reply(rses, packet);
+                bref->sg_state = SG_DONE;
+            }
+            else if (bref->sg_discard)
+            {
+                gwbuf_free(packet);
+            }
+            else if (rses->sg_header_sent)
+            {
+                out = scatter_forward(rses, out, packet);
+            }
+            else
+            {
+                bref->sg_rows = gwbuf_append(bref->sg_rows, packet);
+            }
+            break;
+
+        default:
+            gwbuf_free(packet);
+            break;
+        }
+    }
+
+    if (bref->sg_state == SG_DONE)
+    {
+        out = scatter_backend_done(rses, bref, out);
+    }
 
-int cmpfn(const void* a, const void *b)
-{
-    return strcmp(*(char* const *)a, *(char* const *)b);
+    return out;
 }
 
-/** Internal structure used to stream the list of databases */
-struct string_array
-{
-    char** array;
-    int position;
-    int size;
-};
-
 /**
- * Callback for the database list streaming.
- * @param rset Result set which is being processed
- * @param data Pointer to struct string_array containing the database names
- * @return New resultset row or NULL if no more data is available. If memory allocation
- * failed, NULL is returned.
+ * Handle the failure of a backend while it executes a scattered query. The
+ * error ends the merged result if the other backends have already replied.
+ *
+ * This must be called with the router session lock.
+ *
+ * @param rses   Router client session
+ * @param bref   The failed backend
+ * @param errmsg The error packet
+ * @return The packets to send to the client or NULL if there is nothing to send
  */
-RESULT_ROW *result_set_cb(struct resultset * rset, void *data)
+static GWBUF* scatter_backend_failed(ROUTER_CLIENT_SES* rses,
+                                     backend_ref_t*     bref,
+                                     GWBUF*             errmsg)
 {
-    RESULT_ROW *row = NULL;
-    struct string_array *strarray = (struct string_array*) data;
+    size_t len = gwbuf_length(errmsg);
+    GWBUF* err = gwbuf_alloc(len);
 
-    if (strarray->position < strarray->size && (row = resultset_make_row(rset)))
+    if (err)
     {
-        if (resultset_row_set(row, 0, strarray->array[strarray->position++]) == 0)
-        {
-            resultset_free_row(row);
-            row = NULL;
-        }
+        /** A copy because the sequence number is changed when it is sent */
+        gwbuf_copy_data(errmsg, 0, len, GWBUF_DATA(err));
     }
 
-    return row;
+    gwbuf_free(bref->sg_rows);
+    bref->sg_rows = NULL;
+    scatter_keep_reply(rses, err);
+
+    return scatter_backend_done(rses, bref, NULL);
 }
 
 /**
- * Generates a custom SHOW DATABASES result set from all the databases in the
- * hashtable. Only backend servers that are up and in a proper state are listed
- * in it.
- * @param router Router instance
- * @param client Router client session
- * @return True if the sending of the database list was successful, otherwise false
+ * Route a read-only query to all the shards of the session. The replies of
+ * the shards are merged into one result in clientReply. The query is not
+ * routed if a session command is being executed on some shard because its
+ * replies could not be told apart from the result.
+ *
+ * @param inst     Router instance
+ * @param rses     Router client session
+ * @param querybuf The query
+ * @return True if the query was routed, false if it was routed nowhere and
+ * must be routed to a single shard
  */
-bool send_database_list(ROUTER_INSTANCE* router, ROUTER_CLIENT_SES* client)
+static bool route_scatter_query(ROUTER_INSTANCE*   inst,
+                                ROUTER_CLIENT_SES* rses,
+                                GWBUF*             querybuf)
 {
+    bool failed = false;
     bool rval = false;
-    spinlock_acquire(&client->shardmap->lock);
-    if (client->shardmap->state != SHMAP_UNINIT)
+    int i;
+
+    if (!rses_begin_locked_router_action(rses))
     {
-        struct string_array strarray;
-        const int size = hashtable_size(client->shardmap->hash);
-        strarray.array = malloc(size * sizeof(char*));
-        strarray.position = 0;
-        HASHITERATOR *iter = hashtable_iterator(client->shardmap->hash);
-        RESULTSET* resultset = resultset_create(result_set_cb, &strarray);
+        return false;
+    }
 
-        if (strarray.array && iter && resultset)
+    /**
+     * A shard that replays the session command history when it is connected
+     * here is busy and the query is routed to one shard, as with any active
+     * session command.
+     */
+    if (rses->rses_config.lazy_connect)
+    {
+        connect_all_shards(rses);
+    }
+
+    for (i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && !BREF_IS_CLOSED(bref) &&
+            (sescmd_cursor_is_active(&bref->bref_sescmd_cur) || bref->sg_state != SG_NONE))
         {
-            char *key;
-            int i = 0;
-            while ((key = hashtable_next(iter)))
-            {
-                char *value = hashtable_fetch(client->shardmap->hash, key);
-                SERVER * server = server_find_by_unique_name(value);
-                if (SERVER_IS_RUNNING(server))
-                {
-                    strarray.array[i++] = key;
-                }
-            }
-            strarray.size = i;
-            qsort(strarray.array, strarray.size, sizeof(char*), cmpfn);
-            if (resultset_add_column(resultset, "Database", MYSQL_DATABASE_MAXLEN,
-                                     COL_TYPE_VARCHAR))
-            {
-                resultset_stream_mysql(resultset, client->rses_client_dcb);
-                rval = true;
-            }
+            MXS_INFO("schemarouter: Session command active on '%s', query is not "
+                     "routed to all shards.", bref->bref_backend->backend_server->unique_name);
+            rses_end_locked_router_action(rses);
+            return false;
         }
-        resultset_free(resultset);
-        hashtable_iterator_free(iter);
-        free(strarray.array);
     }
-    spinlock_release(&client->shardmap->lock);
+
+    rses->sg_pending = 0;
+    rses->sg_leader = NULL;
+    rses->sg_header_sent = false;
+    rses->sg_seqno = 1;
+
+    for (i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+        if (!BREF_IS_IN_USE(bref) || BREF_IS_CLOSED(bref) ||
+            !SERVER_IS_RUNNING(bref->bref_backend->backend_server))
+        {
+            continue;
+        }
+
+        if (bref->bref_dcb->func.write(bref->bref_dcb, gwbuf_clone(querybuf)) == 1)
+        {
+            bref->sg_state = SG_COLCOUNT;
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            atomic_add(&bref->bref_backend->stats.queries, 1);
+            rses->sg_pending++;
+        }
+        else
+        {
+            MXS_ERROR("Routing query to %s:%d failed.",
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+            failed = true;
+        }
+    }
+
+    if (rses->sg_pending > 0)
+    {
+        if (failed)
+        {
+            /** The result would be missing the rows of some shard */
+            scatter_keep_reply(rses, modutil_create_mysql_err_msg(1, 0, 1105, "HY000",
+                                                                  "Query could not be routed "
+                                                                  "to all shards"));
+        }
+        atomic_add(&inst->stats.n_queries, 1);
+        atomic_add(&inst->stats.n_scattered, 1);
+        rval = true;
+    }
+
+    rses_end_locked_router_action(rses);
+
     return rval;
 }
 
@@ -1924,6 +2691,11 @@ static int routeQuery(ROUTER* instance,
     packet = GWBUF_DATA(querybuf);
     packet_type = packet[4];
 
+    if (!rses_is_closed)
+    {
+        slowlog_start(&router_cli_ses->slow_query, inst->service->slow_query_threshold, querybuf);
+    }
+
     if (rses_is_closed)
     {
         /**
@@ -2043,22 +2815,35 @@ static int routeQuery(ROUTER* instance,
         if (!change_successful)
         {
             time_t now = time(NULL);
+            /**
+             * The replies to the history of a shard connected now would be
+             * mistaken for the database list, so a session that has not
+             * connected all shards can only refresh before its first
+             * session command.
+             */
             if (router_cli_ses->rses_config.refresh_databases &&
                 difftime(now, router_cli_ses->rses_config.last_refresh) >
-                router_cli_ses->rses_config.refresh_min_interval)
+                router_cli_ses->rses_config.refresh_min_interval &&
+                (!router_cli_ses->rses_config.lazy_connect ||
+                 router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD] == NULL))
             {
-                spinlock_acquire(&router_cli_ses->shardmap->lock);
-                router_cli_ses->shardmap->state = SHMAP_STALE;
-                spinlock_release(&router_cli_ses->shardmap->lock);
-
                 rses_begin_locked_router_action(router_cli_ses);
 
+                if (router_cli_ses->rses_config.lazy_connect)
+                {
+                    connect_all_shards(router_cli_ses);
+                }
+
                 router_cli_ses->rses_config.last_refresh = now;
                 router_cli_ses->queue = querybuf;
                 int rc_refresh = 1;
+                shard_map_t *map = shard_map_alloc();
 
-                if ((router_cli_ses->shardmap = shard_map_alloc()))
+                /** The session maps the databases with the credentials of its client */
+                if (map)
                 {
+                    shard_map_release(router_cli_ses->shardmap);
+                    router_cli_ses->shardmap = map;
                     gen_databaselist(inst, router_cli_ses);
                 }
                 else
@@ -2099,9 +2884,22 @@ static int routeQuery(ROUTER* instance,
     }
 
     route_target = get_shard_route_target(qtype,
-                                          router_cli_ses->rses_transaction_active,
+                                          router_cli_ses->rses_transaction_active ||
+                                          !router_cli_ses->rses_autocommit_enabled,
                                           querybuf->hint);
 
+    if (TARGET_IS_SCATTER(route_target))
+    {
+        if (packet_type == MYSQL_COM_QUERY &&
+            route_scatter_query(inst, router_cli_ses, querybuf))
+        {
+            ret = 1;
+            goto retblock;
+        }
+        /** Route the query to one shard as if it had no hint */
+        route_target = TARGET_UNDEFINED;
+    }
+
     if (packet_type == MYSQL_COM_INIT_DB || op == QUERY_OP_CHANGE_DB)
     {
         route_target = TARGET_UNDEFINED;
@@ -2235,7 +3033,22 @@ static int routeQuery(ROUTER* instance,
     {
         int z;
 
-        for (z = 0; inst->servers[z]; z++)
+        /** Prefer a shard that is already connected */
+        for (z = 0; router_cli_ses->rses_config.lazy_connect &&
+             z < router_cli_ses->rses_nbackends; z++)
+        {
+            backend_ref_t* bref = &router_cli_ses->rses_backend_ref[z];
+
+            if (BREF_IS_IN_USE(bref) && !BREF_IS_CLOSED(bref) &&
+                SERVER_IS_RUNNING(bref->bref_backend->backend_server))
+            {
+                route_target = TARGET_NAMED_SERVER;
+                targetserver = strdup(bref->bref_backend->backend_server->unique_name);
+                break;
+            }
+        }
+
+        for (z = 0; TARGET_IS_ANY(route_target) && inst->servers[z]; z++)
         {
             if (SERVER_IS_RUNNING(inst->servers[z]->backend_server))
             {
@@ -2457,6 +3270,21 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
     }
     dcb_printf(dcb, "Shard map cache hits: %d\n", router->stats.shmap_cache_hit);
     dcb_printf(dcb, "Shard map cache misses: %d\n", router->stats.shmap_cache_miss);
+    dcb_printf(dcb, "Queries routed to all shards: %d\n", router->stats.n_scattered);
+    dcb_printf(dcb, "Shards connected on demand: %d\n", router->stats.n_lazy_connects);
+
+    shard_map_t *map = shard_map_get_shared(router);
+
+    if (map)
+    {
+        dcb_printf(dcb, "Shared shard map: %d databases, refreshed %.0lf seconds ago\n",
+                   hashtable_size(map->hash), difftime(time(NULL), map->last_updated));
+        shard_map_release(map);
+    }
+    else
+    {
+        dcb_printf(dcb, "Shared shard map: not mapped\n");
+    }
     dcb_printf(dcb, "\n");
 }
 
@@ -2546,15 +3374,6 @@ static void clientReply(ROUTER* instance,
             router_cli_ses->shardmap->last_updated = time(NULL);
             spinlock_release(&router_cli_ses->shardmap->lock);
 
-            rses_end_locked_router_action(router_cli_ses);
-
-            synchronize_shard_map(router_cli_ses);
-
-            if (!rses_begin_locked_router_action(router_cli_ses))
-            {
-                return;
-            }
-
             /*
              * Check if the session is reconnecting with a database name
              * that is not in the hashtable. If the database is not found
@@ -2626,6 +3445,23 @@ static void clientReply(ROUTER* instance,
 
     CHK_BACKEND_REF(bref);
     scur = &bref->bref_sescmd_cur;
+
+    slowlog_end(&router_cli_ses->slow_query, router_cli_ses->router->service->slow_query_threshold,
+                router_cli_ses->router->service->name, backend_dcb->server->unique_name);
+
+    /** The reply is a part of the result of a query routed to all shards */
+    if (bref->sg_state != SG_NONE)
+    {
+        writebuf = scatter_process_reply(router_cli_ses, bref, writebuf);
+
+        if (writebuf)
+        {
+            SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+        }
+        rses_end_locked_router_action(router_cli_ses);
+        return;
+    }
+
     /**
      * Active cursor means that reply is from session command
      * execution.
@@ -2818,7 +3654,6 @@ static void bref_clear_state(backend_ref_t* bref, bref_state_t state)
     else
     {
         int prev1;
-        int prev2;
 
         /** Decrease waiter count */
         prev1 = atomic_add(&bref->bref_num_result_wait, -1);
@@ -2830,15 +3665,7 @@ static void bref_clear_state(backend_ref_t* bref, bref_state_t state)
         else
         {
             /** Decrease global operation count */
-            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
-            ss_dassert(prev2 > 0);
-            if (prev2 <= 0)
-            {
-                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                          __FUNCTION__,
-                          bref->bref_backend->backend_server->name,
-                          bref->bref_backend->backend_server->port);
-            }
+            server_add_current_ops(bref->bref_backend->backend_server, -1);
         }
     }
 }
@@ -2857,7 +3684,6 @@ static void bref_set_state(backend_ref_t* bref, bref_state_t state)
     else
     {
         int prev1;
-        int prev2;
 
         /** Increase waiter count */
         prev1 = atomic_add(&bref->bref_num_result_wait, 1);
@@ -2871,15 +3697,7 @@ static void bref_set_state(backend_ref_t* bref, bref_state_t state)
                       bref->bref_backend->backend_server->port);
         }
         /** Increase global operation count */
-        prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
-        ss_dassert(prev2 >= 0);
-        if (prev2 < 0)
-        {
-            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                      __FUNCTION__,
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-        }
+        server_add_current_ops(bref->bref_backend->backend_server, 1);
     }
 }
 
@@ -2976,54 +3794,15 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
                 slaves_connected += 1;
             }
             /** New server connection */
+            else if (connect_backend(&backend_ref[i], session))
+            {
+                servers_connected += 1;
+            }
             else
             {
-                backend_ref[i].bref_dcb = dcb_connect(b->backend_server,
-                                                      session,
-                                                      b->backend_server->protocol);
-
-                if (backend_ref[i].bref_dcb != NULL)
-                {
-                    servers_connected += 1;
-                    /**
-                     * Start executing session command
-                     * history.
-                     */
-                    execute_sescmd_history(&backend_ref[i]);
-                    /**
-                     * When server fails, this callback
-                     * is called.
-                     * !!! Todo, routine which removes
-                     * corresponding entries from the hash
-                     * table.
-                     */
-
-                    backend_ref[i].bref_state = 0;
-                    bref_set_state(&backend_ref[i], BREF_IN_USE);
-                    /**
-                     * Increase backend connection counter.
-                     * Server's stats are _increased_ in
-                     * dcb.c:dcb_alloc !
-                     * But decreased in the calling function
-                     * of dcb_close.
-                     */
-                    atomic_add(&b->backend_conn_count, 1);
-
-                    dcb_add_callback(backend_ref[i].bref_dcb,
-                                     DCB_REASON_NOT_RESPONDING,
-                                     &router_handle_state_switch,
-                                     (void *)&backend_ref[i]);
-                }
-                else
-                {
-                    succp = false;
-                    MXS_ERROR("Unable to establish "
-                              "connection with slave %s:%d",
-                              b->backend_server->name,
-                              b->backend_server->port);
-                    /* handle connect error */
-                    break;
-                }
+                succp = false;
+                /* handle connect error */
+                break;
             }
         }
     } /*< for */
@@ -3070,6 +3849,115 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
     return succp;
 }
 
+/**
+ * Connect one backend of a session and start replaying the session command
+ * history to it. Must be called with the router session locked.
+ *
+ * @param bref      The backend reference
+ * @param session   The client session
+ * @return True if the connection was created
+ */
+static bool connect_backend(backend_ref_t* bref, SESSION* session)
+{
+    BACKEND* b = bref->bref_backend;
+
+    bref->bref_dcb = dcb_connect(b->backend_server, session, b->backend_server->protocol);
+
+    if (bref->bref_dcb == NULL)
+    {
+        MXS_ERROR("Unable to establish connection with server %s:%d",
+                  b->backend_server->name, b->backend_server->port);
+        return false;
+    }
+
+    /**
+     * Start executing session command history.
+     */
+    execute_sescmd_history(bref);
+
+    bref->bref_state = 0;
+    bref_set_state(bref, BREF_IN_USE);
+    /**
+     * Increase backend connection counter.
+     * Server's stats are _increased_ in
+     * dcb.c:dcb_alloc !
+     * But decreased in the calling function
+     * of dcb_close.
+     */
+    atomic_add(&b->backend_conn_count, 1);
+
+    /** When server fails, this callback is called. */
+    dcb_add_callback(bref->bref_dcb,
+                     DCB_REASON_NOT_RESPONDING,
+                     &router_handle_state_switch,
+                     (void *)bref);
+    return true;
+}
+
+/**
+ * Connect the backends of a new session. With lazy_connect and a shared
+ * shard map only the shard of the default database, or the first running
+ * shard if there is none, is connected. The other shards are connected by
+ * get_shard_dcb() when a query is routed to them. Without a shared map the
+ * session maps the databases itself and needs all of the shards.
+ *
+ * Must be called with the router session locked.
+ *
+ * @param rses  The router session
+ * @param db    The default database of the client or an empty string
+ * @return True if the connections were created
+ */
+static bool connect_session_backends(ROUTER_CLIENT_SES* rses, const char* db)
+{
+    SESSION* session = rses->rses_client_dcb->session;
+
+    if (rses->rses_config.lazy_connect && rses->init == INIT_READY)
+    {
+        const char* target = NULL;
+
+        spinlock_acquire(&rses->shardmap->lock);
+        if (*db)
+        {
+            target = hashtable_fetch(rses->shardmap->hash, (char*)db);
+        }
+
+        for (int i = 0; i < rses->rses_nbackends; i++)
+        {
+            backend_ref_t* bref = &rses->rses_backend_ref[i];
+            SERVER* server = bref->bref_backend->backend_server;
+
+            if (SERVER_IS_RUNNING(server) &&
+                (target == NULL || strcmp(target, server->unique_name) == 0))
+            {
+                spinlock_release(&rses->shardmap->lock);
+                MXS_INFO("schemarouter: Connecting only to '%s' at the start of the session.",
+                         server->unique_name);
+                return connect_backend(bref, session);
+            }
+        }
+        spinlock_release(&rses->shardmap->lock);
+    }
+
+    return connect_backend_servers(rses->rses_backend_ref, rses->rses_nbackends,
+                                   session, rses->router);
+}
+
+/**
+ * Connect all the shards of a session that are not yet connected. The
+ * commands that the new connections must replay keep their session command
+ * cursors active until the history is done.
+ *
+ * Must be called with the router session locked.
+ *
+ * @param rses  The router session
+ * @return True if all running shards are connected
+ */
+static bool connect_all_shards(ROUTER_CLIENT_SES* rses)
+{
+    return connect_backend_servers(rses->rses_backend_ref, rses->rses_nbackends,
+                                   rses->rses_client_dcb->session, rses->router);
+}
+
 /**
  * Create a generic router session property strcture.
  */
@@ -4065,7 +4953,17 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
      * the backend server it is necessary to send an error to the client
      * because it is waiting for reply.
      */
-    if (BREF_IS_WAITING_RESULT(bref))
+    if (bref->sg_state != SG_NONE)
+    {
+        /** The other shards may still be sending their part of the result */
+        GWBUF* reply = scatter_backend_failed(rses, bref, errmsg);
+
+        if (reply)
+        {
+            SESSION_ROUTE_REPLY(ses, reply);
+        }
+    }
+    else if (BREF_IS_WAITING_RESULT(bref))
     {
         DCB* client_dcb;
         client_dcb = ses->client_dcb;
@@ -4290,8 +5188,13 @@ RESULT_ROW* shard_list_cb(struct resultset* rset, void* data)
     struct shard_list *sl = (struct shard_list*)data;
     RESULT_ROW* rval = NULL;
 
-    if ((key = hashtable_next(sl->iter)) &&
-        (value = hashtable_fetch(sl->rses->shardmap->hash, key)))
+    while ((key = hashtable_next(sl->iter)) && sl->rses->shardmap->shared &&
+           !client_sees_database(sl->rses, key))
+    {
+        ;
+    }
+
+    if (key && (value = hashtable_fetch(sl->rses->shardmap->hash, key)))
     {
         if ((rval = resultset_make_row(sl->rset)))
         {
@@ -4555,74 +5458,3 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
     return mapped ? 1 : 0;
 }
 
-/**
- * Replace a shard map with another one. This function copies the contents of
- * the source shard map to the target and frees the source memory.
- * @param target Target shard map to replace
- * @param source Source shard map to use
- */
-void replace_shard_map(shard_map_t **target, shard_map_t **source)
-{
-    shard_map_t *tgt = *target;
-    shard_map_t *src = *source;
-    tgt->last_updated = src->last_updated;
-    tgt->state = src->state;
-    hashtable_free(tgt->hash);
-    tgt->hash = src->hash;
-    free(src);
-    *source = NULL;
-}
-
-/**
- * Synchronize the router client session shard map with the global shard map for
- * this user.
- *
- * If the router doesn't have a shard map for this user then the current shard map
- * of the client session is added to the router. If the shard map in the router is
- * out of date, its contents are replaced with the contents of the current client
- * session. If the router has a usable shard map, the current shard map of the client
- * is discarded and the router's shard map is used.
- * @param client Router session
- */
-void synchronize_shard_map(ROUTER_CLIENT_SES *client)
-{
-    spinlock_acquire(&client->router->lock);
-
-    client->router->stats.shmap_cache_miss++;
-
-    shard_map_t *map = hashtable_fetch(client->router->shard_maps,
-                                       client->rses_client_dcb->user);
-    if (map)
-    {
-        spinlock_acquire(&map->lock);
-        if (map->state == SHMAP_STALE)
-        {
-            replace_shard_map(&map, &client->shardmap);
-        }
-        else if (map->state != SHMAP_READY)
-        {
-            MXS_WARNING("Shard map state is not ready but"
-                        "it is in use. Replacing it with a newer one.");
-            replace_shard_map(&map, &client->shardmap);
-        }
-        else
-        {
-            /**
-             * Another thread has already updated the shard map for this user
-             */
-            hashtable_free(client->shardmap->hash);
-            free(client->shardmap);
-        }
-        spinlock_release(&map->lock);
-        client->shardmap = map;
-    }
-    else
-    {
-        hashtable_add(client->router->shard_maps,
-                      client->rses_client_dcb->user,
-                      client->shardmap);
-        ss_dassert(hashtable_fetch(client->router->shard_maps,
-                                   client->rses_client_dcb->user) == client->shardmap);
-    }
-    spinlock_release(&client->router->lock);
-}
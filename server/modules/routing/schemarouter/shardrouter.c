@@ -31,6 +31,7 @@
 #include <modinfo.h>
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
+#include <maxscale/poll.h>
 
 
 MODULE_INFO info = {
@@ -112,6 +113,7 @@ static route_target_t get_shard_route_target(
                                              HINT* hint);
 
 static int getCapabilities();
+static int subsvc_start_next(DCB* dcb);
 
 void subsvc_clear_state(SUBSERVICE* svc,subsvc_state_t state);
 void subsvc_set_state(SUBSERVICE* svc,subsvc_state_t state);
@@ -762,6 +764,125 @@ int fakeQuery(DCB* dcb)
     return 1;
 }
 
+/**
+ * Start the session of one subservice. Must be called with the router
+ * session locked.
+ * @param rses The router session
+ * @param subsvc The subservice in the SUBSVC_ALLOC state
+ * @return True if the session was started
+ */
+static bool subsvc_start(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc)
+{
+    FILTER_DEF* dummy_filterdef;
+    UPSTREAM* dummy_upstream;
+
+    subsvc->dcb = dcb_clone(rses->rses_client_dcb);
+
+    if(subsvc->dcb == NULL){
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to clone client DCB in shardrouter.");
+        return false;
+    }
+
+    subsvc->session = session_alloc(subsvc->service,subsvc->dcb);
+
+    if(subsvc->session == NULL){
+        dcb_close(subsvc->dcb);
+        subsvc->dcb = NULL;
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to create subsession for service %s in shardrouter.",subsvc->service->name);
+        return false;
+    }
+
+    dummy_filterdef = filter_alloc("tee_dummy","tee_dummy");
+
+    if(dummy_filterdef == NULL)
+    {
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to allocate filter definition in shardrouter.");
+        return false;
+    }
+    dummy_filterdef->obj = &dummyObject;
+    dummy_filterdef->filter = (FILTER*)rses;
+    dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail);
+
+    if(dummy_upstream == NULL)
+    {
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to set filterUpstream in shardrouter.");
+        return false;
+    }
+
+    subsvc->session->tail = *dummy_upstream;
+
+    subsvc_set_state(subsvc,SUBSVC_OK);
+
+    free(dummy_upstream);
+    return true;
+}
+
+/**
+ * Start the subservice sessions that have not been started yet. This is
+ * done before the databases are mapped, as all subservices are needed for
+ * it. Must be called with the router session locked.
+ * @param rses The router session
+ */
+static void subsvc_start_all(ROUTER_CLIENT_SES* rses)
+{
+    int i;
+
+    for(i = 0; i < rses->n_subservice; i++)
+    {
+        if(rses->subservice[i]->state == SUBSVC_ALLOC)
+        {
+            subsvc_start(rses, rses->subservice[i]);
+        }
+    }
+}
+
+/**
+ * Start the session of the next subservice that has not been started. The
+ * sessions are started one at a time from fake read events on the start DCB
+ * so that the handshake of the client is not delayed by them and the other
+ * events of the thread are processed in between.
+ * @param dcb The start DCB of the router session
+ * @return Always 1
+ */
+static int subsvc_start_next(DCB* dcb)
+{
+    ROUTER_CLIENT_SES* rses;
+    int i;
+
+    if(dcb->session == NULL ||
+       (rses = (ROUTER_CLIENT_SES*)dcb->session->router_session) == NULL)
+    {
+        return 1;
+    }
+
+    if(rses_begin_locked_router_action(rses))
+    {
+        for(i = 0; i < rses->n_subservice; i++)
+        {
+            if(rses->subservice[i]->state == SUBSVC_ALLOC)
+            {
+                subsvc_start(rses, rses->subservice[i]);
+                break;
+            }
+        }
+
+        for(; i < rses->n_subservice; i++)
+        {
+            if(rses->subservice[i]->state == SUBSVC_ALLOC)
+            {
+                poll_fake_read_event(dcb);
+                break;
+            }
+        }
+        rses_end_locked_router_action(rses);
+    }
+    return 1;
+}
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -995,8 +1116,6 @@ newSession(
     SUBSERVICE* subsvc;
     ROUTER_CLIENT_SES* client_rses = NULL;
     ROUTER_INSTANCE* router = (ROUTER_INSTANCE *) router_inst;
-    FILTER_DEF* dummy_filterdef;
-    UPSTREAM* dummy_upstream;
 
     int i, j;
     client_rses = (ROUTER_CLIENT_SES *) calloc(1, sizeof(ROUTER_CLIENT_SES));
@@ -1040,6 +1159,10 @@ newSession(
 
     client_rses->n_subservice = router->n_services;
 
+    /**
+     * The subservice sessions are started after the handshake, see
+     * subsvc_start_next(). Only the structures are created here.
+     */
     for(i = 0; i < client_rses->n_subservice; i++)
     {
         if((subsvc = calloc(1, sizeof(SUBSERVICE))) == NULL)
@@ -1060,51 +1183,14 @@ newSession(
         subsvc->scur->scmd_cur_rses = client_rses;
         subsvc->scur->scmd_cur_ptr_property = client_rses->rses_properties;
         subsvc->service = router->services[i];
-        subsvc->dcb = dcb_clone(client_rses->rses_client_dcb);
-
-        if(subsvc->dcb == NULL){
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to clone client DCB in shardrouter.");
-            continue;
-        }
-
-        subsvc->session = session_alloc(subsvc->service,subsvc->dcb);
-
-        if(subsvc->session == NULL){
-            dcb_close(subsvc->dcb);
-            subsvc->dcb = NULL;
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to create subsession for service %s in shardrouter.",subsvc->service->name);
-            continue;
-        }
-
-        dummy_filterdef = filter_alloc("tee_dummy","tee_dummy");
-
-        if(dummy_filterdef == NULL)
-        {
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to allocate filter definition in shardrouter.");
-            continue;
-        }
-        dummy_filterdef->obj = &dummyObject;
-        dummy_filterdef->filter = (FILTER*)client_rses;
-        dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail);
-
-        if(dummy_upstream == NULL)
-        {
-           subsvc_set_state(subsvc,SUBSVC_FAILED);
-           MXS_ERROR("Failed to set filterUpstream in shardrouter.");
-            continue;
-        }
-
-        subsvc->session->tail = *dummy_upstream;
-
-
-        subsvc_set_state(subsvc,SUBSVC_OK);
-
-        free(dummy_upstream);
     }
 
+    client_rses->startdcb = dcb_alloc(DCB_ROLE_INTERNAL, NULL);
+    client_rses->startdcb->func.read = subsvc_start_next;
+    client_rses->startdcb->state = DCB_STATE_POLLING;
+    client_rses->startdcb->session = session;
+    poll_fake_read_event(client_rses->startdcb);
+
     router->stats.n_sessions += 1;
 
     /**
@@ -1203,8 +1289,10 @@ closeSession(
         }
         router_cli_ses->replydcb->session = NULL;
         router_cli_ses->routedcb->session = NULL;
+        router_cli_ses->startdcb->session = NULL;
         dcb_close(router_cli_ses->replydcb);
         dcb_close(router_cli_ses->routedcb);
+        dcb_close(router_cli_ses->startdcb);
 
         /** Unlock */
         rses_end_locked_router_action(router_cli_ses);
@@ -1515,6 +1603,7 @@ routeQuery(ROUTER* instance,
 	    if(router_cli_ses->init & INIT_UNINT)
 	    {
 		/* Generate database list */
+		subsvc_start_all(router_cli_ses);
 		gen_subsvc_dblist(inst,router_cli_ses);
 
 	    }
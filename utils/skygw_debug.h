@@ -265,7 +265,9 @@ typedef enum skygw_chk_t
                         ((c) == LEAST_GLOBAL_CONNECTIONS ? "LEAST_GLOBAL_CONNECTIONS" : \
                         ((c) == LEAST_ROUTER_CONNECTIONS ? "LEAST_ROUTER_CONNECTIONS" : \
                         ((c) == LEAST_BEHIND_MASTER ? "LEAST_BEHIND_MASTER"           : \
-                        ((c) == LEAST_CURRENT_OPERATIONS ? "LEAST_CURRENT_OPERATIONS" : "Unknown criteria")))))
+                        ((c) == LEAST_CURRENT_OPERATIONS ? "LEAST_CURRENT_OPERATIONS" : \
+                        ((c) == LEAST_RESPONSE_TIME ? "LEAST_RESPONSE_TIME"           : \
+                        ((c) == LEAST_CONGESTED ? "LEAST_CONGESTED"                   : "Unknown criteria")))))))
 
 #define STRSRVSTATUS(s) (SERVER_IS_MASTER(s)  ? "RUNNING MASTER" :     \
                         (SERVER_IS_SLAVE(s)   ? "RUNNING SLAVE" :       \
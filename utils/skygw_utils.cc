@@ -26,10 +26,16 @@
 #include "skygw_debug.h"
 #include <skygw_types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "skygw_utils.h"
 #include <atomic.h>
 #include <random_jkiss.h>
 #include <pcre2.h>
+#include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static bool file_write_header(skygw_file_t* file);
 static void simple_mutex_free_memory(simple_mutex_t* sm);
@@ -1026,6 +1032,67 @@ return_rc:
     return rc;
 }
 
+/**
+ * Write a batch of buffers to a file with as few system calls as possible.
+ * Anything buffered in the stream of the file is written first. The
+ * buffers described by iov may be modified.
+ *
+ * @param file   The file
+ * @param iov    The buffers to write
+ * @param iovcnt The number of buffers
+ * @param flush  Whether the file should be synced to disk
+ * @return 0 on success, the errno of the failed write otherwise
+ */
+int skygw_file_writev(skygw_file_t* file, struct iovec* iov, int iovcnt, bool flush)
+{
+    static int writecount;
+    int fd;
+
+    CHK_FILE(file);
+
+    fd = fileno(file->sf_file);
+    fflush(file->sf_file);
+
+    while (iovcnt > 0)
+    {
+        ssize_t nwritten = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+
+        if (nwritten == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            int rc = errno;
+            perror("Logfile write.\n");
+            return rc;
+        }
+
+        /** Skip the buffers that were written, a partial write resumes mid-buffer */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len)
+        {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+
+    writecount += 1;
+
+    if (flush || writecount == FSYNCLIMIT)
+    {
+        fsync(fd);
+        writecount = 0;
+    }
+
+    return 0;
+}
+
 skygw_file_t* skygw_file_alloc(char* fname)
 {
     skygw_file_t* file;
@@ -1217,226 +1284,420 @@ char* remove_mysql_comments(const char** src, const size_t* srcsize, char** dest
     return output;
 }
 
-static pcre2_code* replace_values_re = NULL;
-static const PCRE2_SPTR replace_values_pattern = (PCRE2_SPTR) "(?i)([-=,+*/([:space:]]|\\b|[@])"
-    "(?:[0-9.-]+|(?<=[@])[a-z_0-9]+)([-=,+*/)[:space:];]|$)";
+/**
+ * Check whether a character can be a part of an unquoted identifier
+ *
+ * @param c Character to check
+ * @return True if the character is a letter, a digit, '_', '$' or a multibyte character
+ */
+static inline bool is_identifier_char(unsigned char c)
+{
+    return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
 
 /**
- * Replace literal numbers and user variables with a question mark.
- * @param src Pointer to the string to modify.
- * @param srcsize Pointer to a size_t variable which holds the length of the string to
- * be modified.
- * @param dest The address of the pointer where the result will be stored. If the
- * value pointed by this parameter is NULL, new memory will be allocated as needed.
- * @param Pointer to a size_t variable where the size of the result string is stored.
- * @return Pointer to new modified string or NULL if memory allocation failed.
- * If NULL is returned and the value pointed by @c dest was not NULL, no new
- * memory will be allocated, the memory pointed by @dest will be freed and the
- * contents of @c dest and @c destsize will be invalid.
+ * Find the first occurrence of either of two characters
+ *
+ * The string is scanned sixteen bytes at a time with SSE2 where it is available.
+ *
+ * @param p   Start of the string
+ * @param end End of the string
+ * @param a   The first character
+ * @param b   The second character
+ * @return Pointer to the first occurrence or @c end if neither character was found
  */
-char* replace_values(const char** src, const size_t* srcsize, char** dest, size_t* destsize)
+static inline const char* find_either(const char* p, const char* end, char a, char b)
 {
-    static const PCRE2_SPTR replace = (PCRE2_SPTR) "$1?$2";
-    pcre2_match_data* mdata;
-    char* output = *dest;
-    size_t orig_len = *srcsize;
-    size_t len = output ? *destsize : orig_len;
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
 
-    if (orig_len > 0)
+    while (end - p >= 16)
     {
-        if ((output || (output = (char*) malloc(len * sizeof (char)))) &&
-            (mdata = pcre2_match_data_create_from_pattern(replace_values_re, NULL)))
-        {
-            while (pcre2_substitute(replace_values_re, (PCRE2_SPTR) * src, orig_len, 0,
-                                    PCRE2_SUBSTITUTE_GLOBAL, mdata, NULL,
-                                    replace, PCRE2_ZERO_TERMINATED,
-                                    (PCRE2_UCHAR8*) output, &len) == PCRE2_ERROR_NOMEMORY)
-            {
-                char* tmp = (char*) realloc(output, (len = (size_t) (len * BUFFER_GROWTH_RATE + 1)));
-                if (tmp == NULL)
-                {
-                    free(output);
-                    output = NULL;
-                    break;
-                }
-                output = tmp;
-            }
-            pcre2_match_data_free(mdata);
-        }
-        else
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                                  _mm_cmpeq_epi8(v, vb)));
+        if (mask)
         {
-            free(output);
-            output = NULL;
+            return p + __builtin_ctz(mask);
         }
+
+        p += 16;
     }
-    else if (output == NULL)
+#endif
+
+    while (p < end && *p != a && *p != b)
     {
-        output = strdup(*src);
+        p++;
     }
 
-    if (output)
+    return p;
+}
+
+/**
+ * Skip a quoted string or identifier
+ *
+ * @param p     The first character after the opening quote
+ * @param end   End of the query
+ * @param quote The quote character
+ * @param escapes Whether a backslash escapes the next character
+ * @return Pointer to the character after the closing quote or NULL if the
+ * string is not terminated
+ */
+static const char* skip_quoted(const char* p, const char* end, char quote, bool escapes)
+{
+    while ((p = find_either(p, end, quote, escapes ? '\\' : quote)) < end)
     {
-        *destsize = strlen(output);
-        *dest = output;
+        if (*p == '\\')
+        {
+            p += 2;
+        }
+        else if (p + 1 < end && p[1] == quote)
+        {
+            /** A doubled quote */
+            p += 2;
+        }
+        else
+        {
+            return p + 1;
+        }
     }
 
-    return output;
+    return NULL;
 }
 
 /**
- * Find the given needle - user-provided literal -  and replace it with
- * replacement string. Separate user-provided literals from matching table names
- * etc. by searching only substrings preceded by non-letter and non-number.
+ * Check whether the contents of a parenthesised list in the canonical form
+ * are only literals
  *
- * @param haystack      Plain text query string, not to be freed
- * @param needle        Substring to be searched, not to be freed
- * @param replacement   Replacement text, not to be freed
- *
- * @return newly allocated string where needle is replaced
+ * @param p     The first character after the opening parenthesis
+ * @param end   End of the list
+ * @param quote Set to the quote character if all the literals are strings
+ *              quoted with it, otherwise to '\0'
+ * @return True if the list has at least one literal and nothing else
  */
-char* replace_literal(char* haystack, const char* needle, const char* replacement)
+static bool is_literal_list(const char* p, const char* end, char* quote)
 {
-    const char* prefix = "[ ='\",\\(]"; /*< ' ','=','(',''',''"',',' are allowed before needle */
-    const char* suffix = "([^[:alnum:]]|$)"; /*< alpha-num chars aren't allowed after the needle */
-    char* search_re;
-    char* newstr;
-    regex_t re;
-    regmatch_t match;
-    int rc;
-    size_t rlen = strlen(replacement);
-    size_t nlen = strlen(needle);
-    size_t hlen = strlen(haystack);
+    bool found = false;
 
-    search_re = (char *) malloc(strlen(prefix) + nlen + strlen(suffix) + 1);
+    *quote = '\0';
 
-    if (search_re == NULL)
+    while (p < end)
     {
-        char errbuf[STRERROR_BUFLEN];
-        fprintf(stderr, "Regex memory allocation failed : %s\n",
-                strerror_r(errno, errbuf, sizeof (errbuf)));
-        newstr = haystack;
-        goto retblock;
-    }
+        char q = '\0';
 
-    sprintf(search_re, "%s%s%s", prefix, needle, suffix);
-    /** Allocate memory for new string +1 for terminating byte */
-    newstr = (char *) malloc(hlen - nlen + rlen + 1);
+        if (*p == ' ')
+        {
+            p++;
+            continue;
+        }
 
-    if (newstr == NULL)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        fprintf(stderr, "Regex memory allocation failed : %s\n",
-                strerror_r(errno, errbuf, sizeof (errbuf)));
-        free(search_re);
-        free(newstr);
-        newstr = haystack;
-        goto retblock;
-    }
+        if (found)
+        {
+            if (*p != ',')
+            {
+                return false;
+            }
 
-    rc = regcomp(&re, search_re, REG_EXTENDED | REG_ICASE);
-    ss_info_dassert(rc == 0, "Regex check");
+            for (p++; p < end && *p == ' '; p++)
+            {
+            }
+        }
 
-    if (rc != 0)
-    {
-        char error_message[MAX_ERROR_MSG];
-        regerror(rc, &re, error_message, MAX_ERROR_MSG);
-        fprintf(stderr, "Regex error compiling '%s': %s\n",
-                search_re, error_message);
-        free(search_re);
-        free(newstr);
-        newstr = haystack;
-        goto retblock;
-    }
-    rc = regexec(&re, haystack, 1, &match, 0);
+        if (p + 2 < end && (*p == '\'' || *p == '"') && p[1] == '?' && p[2] == *p)
+        {
+            q = *p;
+            p += 3;
+        }
+        else if (p < end && *p == '?')
+        {
+            p++;
+        }
+        else
+        {
+            return false;
+        }
 
-    if (rc != 0)
-    {
-        free(search_re);
-        free(newstr);
-        regfree(&re);
-        newstr = haystack;
-        goto retblock;
+        *quote = !found || *quote == q ? q : '\0';
+        found = true;
     }
-    memcpy(newstr, haystack, match.rm_so + 1);
-    memcpy(newstr + match.rm_so + 1, replacement, rlen);
-    /** +1 is terminating byte */
-    memcpy(newstr + match.rm_so + 1 + rlen, haystack + match.rm_so + 1 + nlen, hlen - (match.rm_so + 1) - nlen + 1);
 
-    regfree(&re);
-    free(haystack);
-    free(search_re);
-retblock:
-    return newstr;
+    return found;
 }
 
-static pcre2_code* replace_quoted_re = NULL;
-static const PCRE2_SPTR replace_quoted_pattern = (PCRE2_SPTR)
-    "(?>[^'\"]*)(?|(?:\"\\K(?:(?:(?<=\\\\)\")|[^\"])*(\"))|(?:'\\K(?:(?:(?<=\\\\)')|[^'])*(')))";
-
 /**
- * Replace contents of single or double quoted strings with question marks.
- * @param src Pointer to the string to modify.
- * @param srcsize Pointer to a size_t variable which holds the length of the string to
- * be modified.
- * @param dest The address of the pointer where the result will be stored. If the
- * value pointed by this parameter is NULL, new memory will be allocated as needed.
- * @param Pointer to a size_t variable where the size of the result string is stored.
- * @return Pointer to new modified string or NULL if memory allocation failed.
- * If NULL is returned and the value pointed by @c dest was not NULL, no new
- * memory will be allocated, the memory pointed by @dest will be freed and the
- * contents of @c dest and @c destsize will be invalid.
+ * Create the canonical form of an SQL statement
+ *
+ * The statement is scanned once and the canonical form is written to @c dest
+ * as it goes, without allocating memory:
+ *
+ * - The contents of string literals are replaced with a question mark,
+ *   the quotes are kept
+ * - Numeric literals, including hexadecimal ones and their sign, and the
+ *   names of user and system variables are replaced with a question mark,
+ *   the scope of a system variable along with its name
+ * - A list of literals after IN is collapsed to a single literal, which is
+ *   quoted if all the literals were strings with the same quotes
+ * - Comments are removed, except for the executable comments that can
+ *   change the meaning of the statement
+ * - Runs of whitespace are replaced with a single space and the leading
+ *   and trailing whitespace is removed
+ *
+ * Quoted identifiers are copied as they are.
+ *
+ * @param sql         The statement, need not be null terminated
+ * @param len         Length of the statement
+ * @param dest        Buffer of at least CANONICAL_SQL_SIZE(len) bytes for the
+ *                    null terminated canonical form
+ * @param fingerprint If not NULL, the 64-bit FNV-1a hash of the canonical form
+ *                    is stored here
+ * @return The length of the canonical form
  */
-char* replace_quoted(const char** src, const size_t* srcsize, char** dest, size_t* destsize)
+size_t canonicalize_sql(const char* sql, size_t len, char* dest, uint64_t* fingerprint)
 {
-    static const PCRE2_SPTR replace = (PCRE2_SPTR) "?$1";
-    pcre2_match_data* mdata;
-    char* output = *dest;
-    size_t orig_len = *srcsize;
-    size_t len = output ? *destsize : orig_len;
+    const char* p = sql;
+    const char* end = sql + len;
+    char* o = dest;
+    char* in_end = NULL;  /*< Where the output was after the last IN */
+    char* in_open = NULL; /*< The parenthesis that opens the list of the last IN */
+    bool space = false;
 
-    if (orig_len > 0)
+    while (p < end)
     {
-        if ((output || (output = (char*) malloc(len * sizeof (char)))) &&
-            (mdata = pcre2_match_data_create_from_pattern(replace_quoted_re, NULL)))
+        unsigned char c = *p;
+
+        if (isspace(c))
         {
-            while (pcre2_substitute(replace_quoted_re, (PCRE2_SPTR) * src, orig_len, 0,
-                                    PCRE2_SUBSTITUTE_GLOBAL, mdata, NULL,
-                                    replace, PCRE2_ZERO_TERMINATED,
-                                    (PCRE2_UCHAR8*) output, &len) == PCRE2_ERROR_NOMEMORY)
+            space = o > dest;
+            p++;
+            continue;
+        }
+
+        if (c == '#' || (c == '-' && p + 1 < end && p[1] == '-' &&
+                         (p + 2 == end || isspace((unsigned char)p[2]))))
+        {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            p = nl ? nl : end;
+            continue;
+        }
+
+        if (c == '/' && p + 1 < end && p[1] == '*')
+        {
+            const char* exec = p + 2;
+
+            if (exec < end && *exec == 'M')
             {
-                char* tmp = (char*) realloc(output, (len = (size_t) (len * BUFFER_GROWTH_RATE + 1)));
-                if (tmp == NULL)
+                exec++;
+            }
+
+            if (exec >= end || *exec != '!')
+            {
+                /** A plain comment */
+                const char* close = p + 2;
+
+                while ((close = (const char*)memchr(close, '*', end - close)) &&
+                       (close + 1 >= end || close[1] != '/'))
                 {
-                    free(output);
-                    output = NULL;
-                    break;
+                    close++;
                 }
-                output = tmp;
+
+                p = close ? close + 2 : end;
+                continue;
             }
-            pcre2_match_data_free(mdata);
+        }
+
+        if (space)
+        {
+            *o++ = ' ';
+            space = false;
+        }
+
+        if (c == '/' && p + 1 < end && p[1] == '*')
+        {
+            /** The opening of an executable comment, its contents are
+             * canonicalized like the rest of the statement */
+            while (*p != '!')
+            {
+                *o++ = *p++;
+            }
+
+            *o++ = *p++;
+        }
+        else if (c == '\'' || c == '"')
+        {
+            const char* next = skip_quoted(p + 1, end, c, true);
+            *o++ = c;
+            *o++ = '?';
+
+            if (next)
+            {
+                *o++ = c;
+            }
+
+            p = next ? next : end;
+        }
+        else if (c == '`')
+        {
+            const char* next = skip_quoted(p + 1, end, c, false);
+            next = next ? next : end;
+            memcpy(o, p, next - p);
+            o += next - p;
+            p = next;
+        }
+        else if (c == '@')
+        {
+            /** The names of user and system variables are replaced */
+            bool system = false;
+            *o++ = *p++;
+
+            if (p < end && *p == '@')
+            {
+                *o++ = *p++;
+                system = true;
+            }
+
+            if (p < end && is_identifier_char(*p))
+            {
+                *o++ = '?';
+
+                while (p < end && is_identifier_char(*p))
+                {
+                    p++;
+                }
+
+                /** The scope of a system variable, e.g. @@SESSION.autocommit,
+                 * is replaced along with the name */
+                if (system && p + 1 < end && *p == '.' && is_identifier_char(p[1]))
+                {
+                    for (p++; p < end && is_identifier_char(*p); p++)
+                    {
+                    }
+                }
+            }
+        }
+        else if (isdigit(c) ||
+                 (c == '.' && p + 1 < end && isdigit((unsigned char)p[1]) &&
+                  (o == dest || !is_identifier_char(o[-1]))))
+        {
+            const char* q = p;
+
+            if (c == '0' && q + 1 < end && (q[1] == 'x' || q[1] == 'X'))
+            {
+                for (q += 2; q < end && isxdigit((unsigned char)*q); q++)
+                {
+                }
+            }
+            else
+            {
+                while (q < end && (isdigit((unsigned char)*q) || *q == '.'))
+                {
+                    q++;
+                }
+
+                if (q + 1 < end && (*q == 'e' || *q == 'E') &&
+                    (isdigit((unsigned char)q[1]) ||
+                     ((q[1] == '+' || q[1] == '-') && q + 2 < end && isdigit((unsigned char)q[2]))))
+                {
+                    for (q += 2; q < end && isdigit((unsigned char)*q); q++)
+                    {
+                    }
+                }
+            }
+
+            if (q < end && is_identifier_char(*q))
+            {
+                /** An identifier that starts with a digit, e.g. 1abc */
+                while (p < end && is_identifier_char(*p))
+                {
+                    *o++ = *p++;
+                }
+            }
+            else
+            {
+                if (o > dest && (o[-1] == '-' || o[-1] == '+'))
+                {
+                    /** The sign belongs to the number if it follows an operator
+                     * or an opening parenthesis and not an operand */
+                    const char* prev = o - 2;
+
+                    if (prev >= dest && *prev == ' ')
+                    {
+                        prev--;
+                    }
+
+                    if (prev < dest || strchr("(,=<>+-*/%", *prev))
+                    {
+                        o--;
+                    }
+                }
+
+                *o++ = '?';
+                p = q;
+            }
+        }
+        else if (is_identifier_char(c))
+        {
+            char* start = o;
+
+            while (p < end && is_identifier_char(*p))
+            {
+                *o++ = *p++;
+            }
+
+            if (o - start == 2 && (start[0] | 0x20) == 'i' && (start[1] | 0x20) == 'n')
+            {
+                in_end = o;
+            }
+        }
+        else if (c == '(')
+        {
+            in_open = in_end && (o == in_end || (o == in_end + 1 && o[-1] == ' ')) ? o : NULL;
+            *o++ = *p++;
+        }
+        else if (c == ')')
+        {
+            char quote;
+
+            if (in_open && is_literal_list(in_open + 1, o, &quote))
+            {
+                o = in_open + 1;
+
+                if (quote)
+                {
+                    *o++ = quote;
+                    *o++ = '?';
+                    *o++ = quote;
+                }
+                else
+                {
+                    *o++ = '?';
+                }
+            }
+
+            in_open = NULL;
+            *o++ = *p++;
         }
         else
         {
-            free(output);
-            output = NULL;
+            *o++ = *p++;
         }
     }
-    else if (output == NULL)
-    {
-        output = strdup(*src);
-    }
 
-    if (output)
-    {
-        *destsize = strlen(output);
-        *dest = output;
-    }
-    else
+    *o = '\0';
+
+    if (fingerprint)
     {
-        *dest = NULL;
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (const char* h = dest; h < o; h++)
+        {
+            hash = (hash ^ (unsigned char)*h) * 1099511628211ULL;
+        }
+
+        *fingerprint = hash;
     }
 
-    return output;
+    return o - dest;
 }
 
 /**
@@ -1634,22 +1895,6 @@ bool utils_init()
         rval = false;
     }
 
-    ss_info_dassert(replace_quoted_re == NULL, "utils_init called multiple times");
-    replace_quoted_re = pcre2_compile(replace_quoted_pattern, PCRE2_ZERO_TERMINATED, 0, &errcode,
-                                      &erroffset, NULL);
-    if (replace_quoted_re == NULL)
-    {
-        rval = false;
-    }
-
-    ss_info_dassert(replace_values_re == NULL, "utils_init called multiple times");
-    replace_values_re = pcre2_compile(replace_values_pattern, PCRE2_ZERO_TERMINATED, 0, &errcode,
-                                      &erroffset, NULL);
-    if (replace_values_re == NULL)
-    {
-        rval = false;
-    }
-
     return rval;
 }
 
@@ -1660,8 +1905,4 @@ void utils_end()
 {
     pcre2_code_free(remove_comments_re);
     remove_comments_re = NULL;
-    pcre2_code_free(replace_quoted_re);
-    replace_quoted_re = NULL;
-    pcre2_code_free(replace_values_re);
-    replace_values_re = NULL;
 }
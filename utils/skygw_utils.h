@@ -28,6 +28,8 @@
 #endif
 #define FSYNCLIMIT 10
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include "skygw_types.h"
 #include "skygw_debug.h"
 
@@ -149,6 +151,10 @@ int skygw_file_write(skygw_file_t* file,
                      void*         data,
                      size_t        nbytes,
                      bool          flush);
+int skygw_file_writev(skygw_file_t* file,
+                      struct iovec* iov,
+                      int           iovcnt,
+                      bool          flush);
 /** Skygw file routines */
 
 EXTERN_C_BLOCK_BEGIN
@@ -184,12 +190,12 @@ size_t get_decimal_len(size_t s);
 
 char* remove_mysql_comments(const char** src, const size_t* srcsize, char** dest,
                             size_t* destsize);
-char* replace_values(const char** src, const size_t* srcsize, char** dest,
-                     size_t* destsize);
-char* replace_literal(char* haystack,
-                      const char* needle,
-                      const char* replacement);
-char* replace_quoted(const char** src, const size_t* srcsize, char** dest, size_t* destsize);
+
+/** The size of a buffer that can hold the canonical form of a statement of len bytes */
+#define CANONICAL_SQL_SIZE(len) ((len) + (len) / 2 + 2)
+
+size_t canonicalize_sql(const char* sql, size_t len, char* dest, uint64_t* fingerprint);
+
 bool is_valid_posix_path(char* path);
 bool strip_escape_chars(char*);
 char* trim(char *str);